@@ -211,6 +211,8 @@ AC_DEFUN([AC_ARG_BLUEZ], [
 	maemo6_enable=no
 	sap_driver=dummy
 	dbusoob_enable=no
+	loopstat_enable=no
+	memstat_enable=no
 
 	AC_ARG_ENABLE(optimization, AC_HELP_STRING([--disable-optimization], [disable code optimization]), [
 		optimization_enable=${enableval}
@@ -351,6 +353,14 @@ AC_DEFUN([AC_ARG_BLUEZ], [
 		hal_enable=${enableval}
 	])
 
+	AC_ARG_ENABLE(loopstat, AC_HELP_STRING([--enable-loopstat], [time main loop callbacks of the daemon]), [
+		loopstat_enable=${enableval}
+	])
+
+	AC_ARG_ENABLE(memstat, AC_HELP_STRING([--enable-memstat], [count memory held by daemon subsystems]), [
+		memstat_enable=${enableval}
+	])
+
 	if (test "${fortify_enable}" = "yes"); then
 		CFLAGS="$CFLAGS -D_FORTIFY_SOURCE=2"
 	fi
@@ -375,7 +385,7 @@ AC_DEFUN([AC_ARG_BLUEZ], [
 	AM_CONDITIONAL(SNDFILE, test "${sndfile_enable}" = "yes" && test "${sndfile_found}" = "yes")
 	AM_CONDITIONAL(USB, test "${usb_enable}" = "yes" && test "${usb_found}" = "yes")
 	AM_CONDITIONAL(SBC, test "${alsa_enable}" = "yes" || test "${gstreamer_enable}" = "yes" ||
-									test "${test_enable}" = "yes")
+					test "${test_enable}" = "yes" || test "${audio_enable}" = "yes")
 	AM_CONDITIONAL(ALSA, test "${alsa_enable}" = "yes" && test "${alsa_found}" = "yes")
 	AM_CONDITIONAL(GSTREAMER, test "${gstreamer_enable}" = "yes" && test "${gstreamer_found}" = "yes")
 	AM_CONDITIONAL(AUDIOPLUGIN, test "${audio_enable}" = "yes")
@@ -406,4 +416,6 @@ AC_DEFUN([AC_ARG_BLUEZ], [
 	AM_CONDITIONAL(CONFIGFILES, test "${configfiles_enable}" = "yes")
 	AM_CONDITIONAL(MAEMO6PLUGIN, test "${maemo6_enable}" = "yes")
 	AM_CONDITIONAL(DBUSOOBPLUGIN, test "${dbusoob_enable}" = "yes")
+	AM_CONDITIONAL(LOOPSTAT, test "${loopstat_enable}" = "yes")
+	AM_CONDITIONAL(MEMSTAT, test "${memstat_enable}" = "yes")
 ])
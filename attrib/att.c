@@ -92,6 +92,57 @@ void att_data_list_free(struct att_data_list *list)
 	g_free(list);
 }
 
+uint16_t att_data_iter_init(struct att_data_iter *iter, const uint8_t *pdu,
+								int len)
+{
+	uint16_t elen;
+
+	if (pdu == NULL || iter == NULL)
+		return 0;
+
+	if (len < 2)
+		return 0;
+
+	switch (pdu[0]) {
+	case ATT_OP_READ_BY_GROUP_RESP:
+	case ATT_OP_READ_BY_TYPE_RESP:
+		elen = pdu[1];
+		break;
+	case ATT_OP_FIND_INFO_RESP:
+		/* Handle plus 16-bit or 128-bit UUID */
+		if (pdu[1] == 0x01)
+			elen = 2 + 2;
+		else if (pdu[1] == 0x02)
+			elen = 2 + 16;
+		else
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	if (elen == 0)
+		return 0;
+
+	iter->ptr = &pdu[2];
+	iter->end = iter->ptr + (len - 2) / elen * elen;
+	iter->len = elen;
+
+	return elen;
+}
+
+const uint8_t *att_data_iter_next(struct att_data_iter *iter)
+{
+	const uint8_t *entry = iter->ptr;
+
+	if (entry >= iter->end)
+		return NULL;
+
+	iter->ptr += iter->len;
+
+	return entry;
+}
+
 struct att_data_list *att_data_list_alloc(uint16_t num, uint16_t len)
 {
 	struct att_data_list *list;
@@ -695,6 +746,60 @@ uint16_t dec_read_resp(const uint8_t *pdu, int len, uint8_t *value, int *vlen)
 	return len;
 }
 
+uint16_t enc_read_multi_req(const uint16_t *handles, int num, uint8_t *pdu,
+								int len)
+{
+	uint16_t plen = sizeof(pdu[0]) + num * sizeof(handles[0]);
+	int i;
+
+	if (pdu == NULL)
+		return 0;
+
+	if (handles == NULL)
+		return 0;
+
+	/* At least two handles, otherwise a Read Request is to be used */
+	if (num < 2 || len < plen)
+		return 0;
+
+	pdu[0] = ATT_OP_READ_MULTI_REQ;
+
+	for (i = 0; i < num; i++)
+		att_put_u16(handles[i], &pdu[1 + i * sizeof(handles[0])]);
+
+	return plen;
+}
+
+uint16_t dec_read_multi_req(const uint8_t *pdu, int len, uint16_t *handles,
+								int *num)
+{
+	const uint16_t min_len = sizeof(pdu[0]) + 2 * sizeof(handles[0]);
+	int i, count;
+
+	if (pdu == NULL)
+		return 0;
+
+	if (handles == NULL || num == NULL)
+		return 0;
+
+	if (len < min_len || (len - 1) % sizeof(handles[0]))
+		return 0;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_REQ)
+		return 0;
+
+	count = (len - 1) / sizeof(handles[0]);
+	if (count > *num)
+		return 0;
+
+	for (i = 0; i < count; i++)
+		handles[i] = att_get_u16(&pdu[1 + i * sizeof(handles[0])]);
+
+	*num = count;
+
+	return len;
+}
+
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 							uint8_t *pdu, int len)
 {
@@ -139,6 +139,14 @@ struct att_data_list {
 	uint8_t **data;
 };
 
+/* Walks the entries of a Read By Group Type, Read By Type or Find
+ * Information response in place, without copying them */
+struct att_data_iter {
+	const uint8_t *ptr;
+	const uint8_t *end;
+	uint16_t len;		/* of each entry */
+};
+
 struct att_range {
 	uint16_t start;
 	uint16_t end;
@@ -249,6 +257,10 @@ static inline bt_uuid_t att_get_uuid128(const void *ptr)
 struct att_data_list *att_data_list_alloc(uint16_t num, uint16_t len);
 void att_data_list_free(struct att_data_list *list);
 
+uint16_t att_data_iter_init(struct att_data_iter *iter, const uint8_t *pdu,
+								int len);
+const uint8_t *att_data_iter_next(struct att_data_iter *iter);
+
 const char *att_ecode2str(uint8_t status);
 uint16_t enc_read_by_grp_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 							uint8_t *pdu, int len);
@@ -289,6 +301,10 @@ uint16_t enc_read_resp(uint8_t *value, int vlen, uint8_t *pdu, int len);
 uint16_t enc_read_blob_resp(uint8_t *value, int vlen, uint16_t offset,
 							uint8_t *pdu, int len);
 uint16_t dec_read_resp(const uint8_t *pdu, int len, uint8_t *value, int *vlen);
+uint16_t enc_read_multi_req(const uint16_t *handles, int num, uint8_t *pdu,
+								int len);
+uint16_t dec_read_multi_req(const uint8_t *pdu, int len, uint16_t *handles,
+								int *num);
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 							uint8_t *pdu, int len);
 uint16_t enc_find_info_req(uint16_t start, uint16_t end, uint8_t *pdu, int len);
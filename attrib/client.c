@@ -50,6 +50,16 @@
 
 #define CHAR_INTERFACE "org.bluez.Characteristic"
 
+/* Delay before the cache of a device is written, to batch updates */
+#define GATT_CACHE_DELAY 2
+
+/* Cache entry: service start, value handle, end handle, properties,
+ * type, flags, presentation format, description length, description */
+#define CACHE_DESC		0x01
+#define CACHE_FORMAT		0x02
+#define CACHE_ENTRY_SIZE	(7 + MAX_LEN_UUID_STR + 1 + \
+					sizeof(struct format) + 1)
+
 struct gatt_service {
 	struct btd_device *dev;
 	DBusConnection *conn;
@@ -61,6 +71,7 @@ struct gatt_service {
 	DBusMessage *msg;
 	int psm;
 	gboolean listen;
+	guint cache_id;
 };
 
 struct format {
@@ -77,6 +88,8 @@ struct primary {
 	char *path;
 	GSList *chars;
 	GSList *watchers;
+	GTimer *timer;		/* running while discovery is in progress */
+	guint pending;		/* outstanding discovery queries */
 };
 
 struct characteristic {
@@ -96,6 +109,7 @@ struct characteristic {
 struct query_data {
 	struct primary *prim;
 	struct characteristic *chr;
+	GSList *chars;		/* read together with Read Multiple */
 	DBusMessage *msg;
 	uint16_t handle;
 };
@@ -142,14 +156,25 @@ static void primary_free(void *user_data)
 
 	g_slist_foreach(prim->chars, (GFunc) characteristic_free, NULL);
 	g_slist_free(prim->chars);
+
+	if (prim->timer)
+		g_timer_destroy(prim->timer);
+
 	g_free(prim->path);
 	g_free(prim);
 }
 
+static gboolean cache_write(gpointer user_data);
+
 static void gatt_service_free(void *user_data)
 {
 	struct gatt_service *gatt = user_data;
 
+	if (gatt->cache_id) {
+		g_source_remove(gatt->cache_id);
+		cache_write(gatt);
+	}
+
 	g_slist_foreach(gatt->primary, (GFunc) primary_free, NULL);
 	g_slist_free(gatt->primary);
 	g_attrib_unref(gatt->attrib);
@@ -265,6 +290,197 @@ static void update_watchers(gpointer data, gpointer user_data)
 	g_dbus_send_message(conn, msg);
 }
 
+static void cache_append(GByteArray *cache, struct characteristic *chr)
+{
+	uint8_t entry[CACHE_ENTRY_SIZE], *ptr = entry;
+	size_t dlen;
+
+	dlen = chr->desc ? MIN(strlen(chr->desc), 255) : 0;
+
+	memset(entry, 0, sizeof(entry));
+
+	att_put_u16(chr->prim->att->start, ptr);
+	att_put_u16(chr->handle, ptr + 2);
+	att_put_u16(chr->end, ptr + 4);
+	ptr[6] = chr->perm;
+	ptr += 7;
+
+	strncpy((char *) ptr, chr->type, MAX_LEN_UUID_STR);
+	ptr += MAX_LEN_UUID_STR;
+
+	*ptr++ = (chr->desc ? CACHE_DESC : 0) |
+					(chr->format ? CACHE_FORMAT : 0);
+
+	if (chr->format)
+		memcpy(ptr, chr->format, sizeof(*chr->format));
+	ptr += sizeof(struct format);
+
+	*ptr = dlen;
+
+	g_byte_array_append(cache, entry, sizeof(entry));
+	if (dlen)
+		g_byte_array_append(cache, (uint8_t *) chr->desc, dlen);
+}
+
+static gboolean cache_write(gpointer user_data)
+{
+	struct gatt_service *gatt = user_data;
+	GByteArray *cache;
+	GSList *lp, *lc;
+
+	gatt->cache_id = 0;
+
+	cache = g_byte_array_new();
+
+	for (lp = gatt->primary; lp; lp = lp->next) {
+		struct primary *prim = lp->data;
+
+		for (lc = prim->chars; lc; lc = lc->next)
+			cache_append(cache, lc->data);
+	}
+
+	if (write_device_gatt_cache(&gatt->sba, &gatt->dba, cache->data,
+							cache->len) < 0)
+		error("Unable to write the GATT cache");
+
+	g_byte_array_free(cache, TRUE);
+
+	return FALSE;
+}
+
+static void cache_schedule(struct gatt_service *gatt)
+{
+	if (gatt->cache_id)
+		return;
+
+	gatt->cache_id = g_timeout_add_seconds(GATT_CACHE_DELAY, cache_write,
+									gatt);
+}
+
+static struct primary *find_primary(struct gatt_service *gatt,
+							uint16_t start)
+{
+	GSList *l;
+
+	for (l = gatt->primary; l; l = l->next) {
+		struct primary *prim = l->data;
+
+		if (prim->att->start == start)
+			return prim;
+	}
+
+	return NULL;
+}
+
+static void register_characteristics(struct primary *prim);
+
+static gboolean cache_load(struct gatt_service *gatt)
+{
+	uint8_t *data;
+	size_t len, off;
+	GSList *l;
+
+	if (read_device_gatt_cache(&gatt->sba, &gatt->dba, &data, &len) < 0)
+		return FALSE;
+
+	for (off = 0; off + CACHE_ENTRY_SIZE <= len; ) {
+		const uint8_t *ptr = data + off;
+		struct characteristic *chr;
+		struct primary *prim;
+		uint8_t flags, dlen;
+
+		dlen = ptr[CACHE_ENTRY_SIZE - 1];
+		if (off + CACHE_ENTRY_SIZE + dlen > len)
+			break;
+
+		off += CACHE_ENTRY_SIZE + dlen;
+
+		prim = find_primary(gatt, att_get_u16(ptr));
+		if (prim == NULL)
+			continue;
+
+		chr = g_new0(struct characteristic, 1);
+		chr->prim = prim;
+		chr->handle = att_get_u16(ptr + 2);
+		chr->end = att_get_u16(ptr + 4);
+		chr->perm = ptr[6];
+		ptr += 7;
+
+		memcpy(chr->type, ptr, MAX_LEN_UUID_STR);
+		ptr += MAX_LEN_UUID_STR;
+
+		flags = *ptr++;
+
+		if (flags & CACHE_FORMAT)
+			chr->format = g_memdup(ptr, sizeof(struct format));
+		ptr += sizeof(struct format) + 1;
+
+		if (flags & CACHE_DESC)
+			chr->desc = g_strndup((const char *) ptr, dlen);
+
+		chr->path = g_strdup_printf("%s/characteristic%04x",
+						prim->path, chr->handle);
+
+		prim->chars = g_slist_append(prim->chars, chr);
+	}
+
+	g_free(data);
+
+	for (l = gatt->primary; l; l = l->next)
+		register_characteristics(l->data);
+
+	return TRUE;
+}
+
+static gboolean is_service_changed(struct characteristic *chr)
+{
+	bt_uuid_t uuid, sc;
+
+	if (bt_string_to_uuid(&uuid, chr->type) < 0)
+		return FALSE;
+
+	bt_uuid16_create(&sc, GATT_CHARAC_SERVICE_CHANGED);
+
+	return bt_uuid_cmp(&uuid, &sc) == 0;
+}
+
+/* Drops what is known of the services in the range, to be discovered
+ * again on the next DiscoverCharacteristics */
+static void service_changed(struct gatt_service *gatt, uint16_t start,
+								uint16_t end)
+{
+	char addr[18], key[23];
+	GSList *lp, *lc;
+
+	DBG("Service Changed 0x%04x-0x%04x", start, end);
+
+	ba2str(&gatt->dba, addr);
+
+	for (lp = gatt->primary; lp; lp = lp->next) {
+		struct primary *prim = lp->data;
+		struct att_primary *att = prim->att;
+
+		if (att->end < start || att->start > end)
+			continue;
+
+		for (lc = prim->chars; lc; lc = lc->next) {
+			struct characteristic *chr = lc->data;
+
+			g_dbus_unregister_interface(gatt->conn, chr->path,
+								CHAR_INTERFACE);
+		}
+
+		g_slist_foreach(prim->chars, (GFunc) characteristic_free, NULL);
+		g_slist_free(prim->chars);
+		prim->chars = NULL;
+
+		snprintf(key, sizeof(key), "%17s#%04X", addr, att->start);
+		delete_entry(&gatt->sba, "characteristic", key);
+	}
+
+	cache_schedule(gatt);
+}
+
 static void events_handler(const uint8_t *pdu, uint16_t len,
 							gpointer user_data)
 {
@@ -313,6 +529,10 @@ static void events_handler(const uint8_t *pdu, uint16_t len,
 		g_slist_foreach(prim->watchers, update_watchers, chr);
 		break;
 	}
+
+	if (pdu[0] == ATT_OP_HANDLE_IND && len >= 7 && is_service_changed(chr))
+		service_changed(gatt, att_get_u16(&pdu[3]),
+						att_get_u16(&pdu[5]));
 }
 
 static void attrib_destroy(gpointer user_data)
@@ -401,6 +621,9 @@ static int l2cap_connect(struct gatt_service *gatt, GError **gerr,
 	g_io_channel_unref(io);
 	gatt->listen = listen;
 
+	if (gatt->psm < 0)
+		gatt_exchange_max_mtu(gatt->attrib);
+
 	g_attrib_set_destroy_function(gatt->attrib, attrib_destroy, gatt);
 	g_attrib_set_disconnect_function(gatt->attrib, attrib_disconnect,
 									gatt);
@@ -690,6 +913,44 @@ static void store_attribute(struct gatt_service *gatt, uint16_t handle,
 	g_free(str);
 }
 
+static struct query_data *query_new(struct primary *prim,
+						struct characteristic *chr)
+{
+	struct query_data *query;
+
+	query = g_new0(struct query_data, 1);
+	query->prim = prim;
+	query->chr = chr;
+
+	prim->pending++;
+
+	return query;
+}
+
+/* Time to ready is measured from the DiscoverCharacteristics call to
+ * the completion of the last descriptor or value read it caused */
+static void discovery_start(struct primary *prim)
+{
+	if (prim->timer == NULL)
+		prim->timer = g_timer_new();
+}
+
+static void query_free(struct query_data *query)
+{
+	struct primary *prim = query->prim;
+
+	g_free(query);
+
+	if (--prim->pending > 0 || prim->timer == NULL)
+		return;
+
+	DBG("%s ready in %.0f ms", prim->path,
+				g_timer_elapsed(prim->timer, NULL) * 1000);
+
+	g_timer_destroy(prim->timer);
+	prim->timer = NULL;
+}
+
 static void update_char_desc(guint8 status, const guint8 *pdu, guint16 len,
 							gpointer user_data)
 {
@@ -708,6 +969,7 @@ static void update_char_desc(guint8 status, const guint8 *pdu, guint16 len,
 		store_attribute(gatt, current->handle,
 				GATT_CHARAC_USER_DESC_UUID,
 				(void *) chr->desc, len);
+		cache_schedule(gatt);
 	} else if (status == ATT_ECODE_INSUFF_ENC) {
 		GIOChannel *io = g_attrib_get_channel(gatt->attrib);
 
@@ -721,7 +983,7 @@ static void update_char_desc(guint8 status, const guint8 *pdu, guint16 len,
 	}
 
 	g_attrib_unref(gatt->attrib);
-	g_free(current);
+	query_free(current);
 }
 
 static void update_char_format(guint8 status, const guint8 *pdu, guint16 len,
@@ -744,10 +1006,11 @@ static void update_char_format(guint8 status, const guint8 *pdu, guint16 len,
 
 	store_attribute(gatt, current->handle, GATT_CHARAC_FMT_UUID,
 				(void *) chr->format, sizeof(*chr->format));
+	cache_schedule(gatt);
 
 done:
 	g_attrib_unref(gatt->attrib);
-	g_free(current);
+	query_free(current);
 }
 
 static void update_char_value(guint8 status, const guint8 *pdu,
@@ -772,7 +1035,7 @@ static void update_char_value(guint8 status, const guint8 *pdu,
 	}
 
 	g_attrib_unref(gatt->attrib);
-	g_free(current);
+	query_free(current);
 }
 
 static int uuid_desc16_cmp(bt_uuid_t *uuid, guint16 desc)
@@ -784,28 +1047,51 @@ static int uuid_desc16_cmp(bt_uuid_t *uuid, guint16 desc)
 	return bt_uuid_cmp(uuid, &u16);
 }
 
+static struct characteristic *find_char_by_desc(struct primary *prim,
+							uint16_t handle)
+{
+	GSList *l;
+
+	for (l = prim->chars; l; l = l->next) {
+		struct characteristic *chr = l->data;
+
+		if (handle > chr->handle && handle <= chr->end)
+			return chr;
+	}
+
+	return NULL;
+}
+
+static void discover_desc(struct primary *prim, uint16_t start);
+
+/* Descriptors of all characteristics of the service are found with as
+ * few Find Information requests as the MTU allows, rather than one
+ * request per characteristic */
 static void descriptor_cb(guint8 status, const guint8 *pdu, guint16 plen,
 							gpointer user_data)
 {
 	struct query_data *current = user_data;
-	struct gatt_service *gatt = current->prim->gatt;
-	struct att_data_list *list;
+	struct primary *prim = current->prim;
+	struct gatt_service *gatt = prim->gatt;
+	struct att_data_iter iter;
+	const uint8_t *info;
+	guint16 handle = 0;
 	guint8 format;
-	int i;
 
 	if (status != 0)
 		goto done;
 
 	DBG("Find Information Response received");
 
-	list = dec_find_info_resp(pdu, plen, &format);
-	if (list == NULL)
+	if (pdu[0] != ATT_OP_FIND_INFO_RESP ||
+				att_data_iter_init(&iter, pdu, plen) == 0)
 		goto done;
 
-	for (i = 0; i < list->num; i++) {
-		guint16 handle;
+	format = pdu[1];
+
+	while ((info = att_data_iter_next(&iter))) {
+		struct characteristic *chr;
 		bt_uuid_t uuid;
-		uint8_t *info = list->data[i];
 		struct query_data *qfmt;
 
 		handle = att_get_u16(info);
@@ -819,57 +1105,214 @@ static void descriptor_cb(guint8 status, const guint8 *pdu, guint16 plen,
 			 * 0x02 yet. */
 			continue;
 		}
-		qfmt = g_new0(struct query_data, 1);
-		qfmt->prim = current->prim;
-		qfmt->chr = current->chr;
-		qfmt->handle = handle;
+
+		chr = find_char_by_desc(prim, handle);
+		if (chr == NULL)
+			continue;
 
 		if (uuid_desc16_cmp(&uuid, GATT_CHARAC_USER_DESC_UUID) == 0) {
+			qfmt = query_new(prim, chr);
+			qfmt->handle = handle;
 			gatt->attrib = g_attrib_ref(gatt->attrib);
 			gatt_read_char(gatt->attrib, handle, 0, update_char_desc,
 									qfmt);
 		} else if (uuid_desc16_cmp(&uuid, GATT_CHARAC_FMT_UUID) == 0) {
+			qfmt = query_new(prim, chr);
+			qfmt->handle = handle;
 			gatt->attrib = g_attrib_ref(gatt->attrib);
 			gatt_read_char(gatt->attrib, handle, 0,
 						update_char_format, qfmt);
-		} else
-			g_free(qfmt);
+		}
 	}
 
-	att_data_list_free(list);
+	if (handle != 0 && handle < prim->att->end)
+		discover_desc(prim, handle + 1);
+
 done:
 	g_attrib_unref(gatt->attrib);
-	g_free(current);
+	query_free(current);
 }
 
-static void update_all_chars(gpointer data, gpointer user_data)
+static void discover_desc(struct primary *prim, uint16_t start)
 {
-	struct query_data *qdesc, *qvalue;
-	struct characteristic *chr = data;
-	struct primary *prim = user_data;
 	struct gatt_service *gatt = prim->gatt;
+	struct query_data *qdesc;
 
-	qdesc = g_new0(struct query_data, 1);
-	qdesc->prim = prim;
-	qdesc->chr = chr;
+	qdesc = query_new(prim, NULL);
 
 	gatt->attrib = g_attrib_ref(gatt->attrib);
-	gatt_find_info(gatt->attrib, chr->handle + 1, chr->end, descriptor_cb,
+	gatt_find_info(gatt->attrib, start, prim->att->end, descriptor_cb,
 									qdesc);
+}
+
+static void read_char_value(gpointer data, gpointer user_data)
+{
+	struct query_data *qvalue;
+	struct characteristic *chr = data;
+	struct primary *prim = user_data;
+	struct gatt_service *gatt = prim->gatt;
 
-	qvalue = g_new0(struct query_data, 1);
-	qvalue->prim = prim;
-	qvalue->chr = chr;
+	qvalue = query_new(prim, chr);
 
 	gatt->attrib = g_attrib_ref(gatt->attrib);
 	gatt_read_char(gatt->attrib, chr->handle, 0, update_char_value, qvalue);
 }
 
+/* Size of the values of fixed length Characteristic Presentation Format
+ * types, 0 for the variable length ones */
+static int format_size(const struct format *fmt)
+{
+	static const uint8_t sizes[] = {
+		0,			/* reserved */
+		1, 1, 1, 1,		/* boolean, 2bit, nibble, uint8 */
+		2, 2, 3, 4, 6, 8, 16,	/* uint12 - uint128 */
+		1, 2, 2, 3, 4, 6, 8, 16,	/* sint8 - sint128 */
+		4, 8, 2, 4, 4,		/* float32, float64, SFLOAT, FLOAT,
+					 * duint16 */
+	};
+
+	if (fmt == NULL || fmt->format >= G_N_ELEMENTS(sizes))
+		return 0;
+
+	return sizes[fmt->format];
+}
+
+static void update_multi_values(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct query_data *current = user_data;
+	struct primary *prim = current->prim;
+	struct gatt_service *gatt = prim->gatt;
+	const guint8 *ptr;
+	int total = 0;
+	GSList *l;
+
+	for (l = current->chars; l; l = l->next) {
+		struct characteristic *chr = l->data;
+
+		total += format_size(chr->format);
+	}
+
+	/* Not supported by the server, or the formats are stale: fall back
+	 * to reading the values one by one */
+	if (status != 0 || len - 1 != total) {
+		g_slist_foreach(current->chars, read_char_value, prim);
+		goto done;
+	}
+
+	ptr = pdu + 1;
+
+	for (l = current->chars; l; l = l->next) {
+		struct characteristic *chr = l->data;
+		int size = format_size(chr->format);
+
+		characteristic_set_value(chr, ptr, size);
+		ptr += size;
+	}
+
+done:
+	g_slist_free(current->chars);
+	g_attrib_unref(gatt->attrib);
+	query_free(current);
+}
+
+static void read_multi_values(struct primary *prim, GSList *chars)
+{
+	struct gatt_service *gatt = prim->gatt;
+	struct query_data *qvalue;
+	uint16_t handles[ATT_MAX_MTU / 2];
+	int num = 0;
+	GSList *l;
+
+	if (chars == NULL)
+		return;
+
+	if (chars->next == NULL) {
+		read_char_value(chars->data, prim);
+		g_slist_free(chars);
+		return;
+	}
+
+	for (l = chars; l; l = l->next) {
+		struct characteristic *chr = l->data;
+
+		handles[num++] = chr->handle;
+	}
+
+	qvalue = query_new(prim, NULL);
+	qvalue->chars = chars;
+
+	gatt->attrib = g_attrib_ref(gatt->attrib);
+	if (gatt_read_multiple(gatt->attrib, handles, num,
+					update_multi_values, qvalue) == 0)
+		update_multi_values(ATT_ECODE_IO, NULL, 0, qvalue);
+}
+
+/* Values of a known fixed size are refreshed with as few Read Multiple
+ * requests as the MTU allows, the others with one read each */
+static void read_char_values(struct primary *prim)
+{
+	GSList *l, *batch = NULL;
+	int buflen, used = 1;
+
+	g_attrib_get_buffer(prim->gatt->attrib, &buflen);
+
+	for (l = prim->chars; l; l = l->next) {
+		struct characteristic *chr = l->data;
+		int size = format_size(chr->format);
+
+		if (size == 0 || !(chr->perm & ATT_CHAR_PROPER_READ) ||
+							size > buflen - 1) {
+			read_char_value(chr, prim);
+			continue;
+		}
+
+		/* Both the request and the response must fit the MTU */
+		if (used + size > buflen ||
+				(int) (g_slist_length(batch) + 1) * 2 >
+								buflen - 1) {
+			read_multi_values(prim, batch);
+			batch = NULL;
+			used = 1;
+		}
+
+		batch = g_slist_append(batch, chr);
+		used += size;
+	}
+
+	read_multi_values(prim, batch);
+}
+
+static DBusMessage *characteristics_reply(DBusMessage *msg,
+							struct primary *prim)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array_iter;
+	GSList *l;
+
+	reply = dbus_message_new_method_return(msg);
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+				DBUS_TYPE_OBJECT_PATH_AS_STRING, &array_iter);
+
+	for (l = prim->chars; l; l = l->next) {
+		struct characteristic *chr = l->data;
+
+		dbus_message_iter_append_basic(&array_iter,
+					DBUS_TYPE_OBJECT_PATH, &chr->path);
+	}
+
+	dbus_message_iter_close_container(&iter, &array_iter);
+
+	return reply;
+}
+
 static void char_discovered_cb(GSList *characteristics, guint8 status,
 							gpointer user_data)
 {
 	DBusMessage *reply;
-	DBusMessageIter iter, array_iter;
 	struct query_data *current = user_data;
 	struct primary *prim = current->prim;
 	struct att_primary *att = prim->att;
@@ -917,29 +1360,23 @@ static void char_discovered_cb(GSList *characteristics, guint8 status,
 
 	store_characteristics(gatt, prim);
 	register_characteristics(prim);
+	cache_schedule(gatt);
 
-	reply = dbus_message_new_method_return(current->msg);
-
-	dbus_message_iter_init_append(reply, &iter);
+	reply = characteristics_reply(current->msg, prim);
 
-	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
-				DBUS_TYPE_OBJECT_PATH_AS_STRING, &array_iter);
+	if (prim->chars) {
+		struct characteristic *chr = prim->chars->data;
 
-	for (l = prim->chars; l; l = l->next) {
-		struct characteristic *chr = l->data;
+		if (chr->handle < att->end)
+			discover_desc(prim, chr->handle + 1);
 
-		dbus_message_iter_append_basic(&array_iter,
-					DBUS_TYPE_OBJECT_PATH, &chr->path);
+		read_char_values(prim);
 	}
 
-	dbus_message_iter_close_container(&iter, &array_iter);
-
-	g_slist_foreach(prim->chars, update_all_chars, prim);
-
 fail:
 	g_dbus_send_message(gatt->conn, reply);
 	g_attrib_unref(gatt->attrib);
-	g_free(current);
+	query_free(current);
 }
 
 static DBusMessage *discover_char(DBusConnection *conn, DBusMessage *msg,
@@ -951,14 +1388,26 @@ static DBusMessage *discover_char(DBusConnection *conn, DBusMessage *msg,
 	struct query_data *qchr;
 	GError *gerr = NULL;
 
+	/* Known from the cache, which Service Changed keeps current. Only
+	 * the values are read again, if the device is connected. */
+	if (prim->chars) {
+		if (gatt->attrib) {
+			discovery_start(prim);
+			read_char_values(prim);
+		}
+
+		return characteristics_reply(msg, prim);
+	}
+
 	if (l2cap_connect(prim->gatt, &gerr, FALSE) < 0) {
 		DBusMessage *reply = btd_error_failed(msg, gerr->message);
 		g_error_free(gerr);
 		return reply;
 	}
 
-	qchr = g_new0(struct query_data, 1);
-	qchr->prim = prim;
+	discovery_start(prim);
+
+	qchr = query_new(prim, NULL);
 	qchr->msg = dbus_message_ref(msg);
 
 	gatt_discover_char(gatt->attrib, att->start, att->end, NULL,
@@ -1041,9 +1490,12 @@ static GSList *register_primaries(struct gatt_service *gatt, GSList *primaries)
 
 		gatt->primary = g_slist_append(gatt->primary, prim);
 		paths = g_slist_append(paths, g_strdup(prim->path));
-		load_characteristics(prim, gatt);
 	}
 
+	/* The text storage only has the characteristics themselves */
+	if (!cache_load(gatt))
+		g_slist_foreach(gatt->primary, load_characteristics, gatt);
+
 	return paths;
 }
 
@@ -30,6 +30,7 @@
 #include <bluetooth/sdp_lib.h>
 
 #include "att.h"
+#include "btio.h"
 #include "gattrib.h"
 #include "gatt.h"
 
@@ -150,8 +151,9 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 							gpointer user_data)
 {
 	struct discover_primary *dp = user_data;
-	struct att_data_list *list;
-	unsigned int i, err;
+	struct att_data_iter iter;
+	const uint8_t *data;
+	unsigned int err;
 	uint16_t start, end;
 
 	if (status) {
@@ -159,24 +161,23 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		goto done;
 	}
 
-	list = dec_read_by_grp_resp(ipdu, iplen);
-	if (list == NULL) {
+	if (ipdu[0] != ATT_OP_READ_BY_GROUP_RESP ||
+				att_data_iter_init(&iter, ipdu, iplen) == 0) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	for (i = 0, end = 0; i < list->num; i++) {
-		const uint8_t *data = list->data[i];
+	for (end = 0; (data = att_data_iter_next(&iter)); ) {
 		struct att_primary *primary;
 		bt_uuid_t uuid;
 
 		start = att_get_u16(&data[0]);
 		end = att_get_u16(&data[2]);
 
-		if (list->len == 6) {
+		if (iter.len == 6) {
 			bt_uuid_t uuid16 = att_get_uuid16(&data[4]);
 			bt_uuid_to_uuid128(&uuid16, &uuid);
-		} else if (list->len == 20) {
+		} else if (iter.len == 20) {
 			uuid = att_get_uuid128(&data[4]);
 		} else {
 			/* Skipping invalid data */
@@ -194,7 +195,6 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		dp->primaries = g_slist_append(dp->primaries, primary);
 	}
 
-	att_data_list_free(list);
 	err = 0;
 
 	if (end != 0xffff) {
@@ -248,8 +248,9 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 							gpointer user_data)
 {
 	struct discover_char *dc = user_data;
-	struct att_data_list *list;
-	unsigned int i, err;
+	struct att_data_iter iter;
+	const uint8_t *value;
+	unsigned int err;
 	int buflen;
 	uint8_t *buf;
 	guint16 oplen;
@@ -261,34 +262,33 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		goto done;
 	}
 
-	list = dec_read_by_type_resp(ipdu, iplen);
-	if (list == NULL) {
+	if (ipdu[0] != ATT_OP_READ_BY_TYPE_RESP ||
+				att_data_iter_init(&iter, ipdu, iplen) == 0) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	for (i = 0; i < list->num; i++) {
-		uint8_t *value = list->data[i];
+	while ((value = att_data_iter_next(&iter))) {
 		struct att_char *chars;
 		bt_uuid_t uuid;
 
 		last = att_get_u16(value);
 
-		if (list->len == 7) {
+		if (iter.len == 7) {
 			bt_uuid_t uuid16 = att_get_uuid16(&value[5]);
 			bt_uuid_to_uuid128(&uuid16, &uuid);
 		} else
 			uuid = att_get_uuid128(&value[5]);
 
+		if (dc->uuid && bt_uuid_cmp(dc->uuid, &uuid))
+			break;
+
 		chars = g_try_new0(struct att_char, 1);
 		if (!chars) {
 			err = ATT_ECODE_INSUFF_RESOURCES;
 			goto done;
 		}
 
-		if (dc->uuid && bt_uuid_cmp(dc->uuid, &uuid))
-			break;
-
 		chars->handle = last;
 		chars->properties = value[2];
 		chars->value_handle = att_get_u16(&value[3]);
@@ -297,7 +297,6 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 									chars);
 	}
 
-	att_data_list_free(list);
 	err = 0;
 
 	if (last != 0) {
@@ -517,6 +516,120 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, uint16_t offset,
 	return id;
 }
 
+struct read_stream_data {
+	GAttrib *attrib;
+	gatt_chunk_cb_t func;
+	gpointer user_data;
+	guint16 handle;
+	guint16 offset;
+	guint id;
+	gint ref;
+};
+
+static void read_stream_destroy(gpointer user_data)
+{
+	struct read_stream_data *stream = user_data;
+
+	if (g_atomic_int_dec_and_test(&stream->ref) == TRUE)
+		g_free(stream);
+}
+
+static void read_stream_helper(guint8 status, const guint8 *rpdu,
+					guint16 rlen, gpointer user_data)
+{
+	struct read_stream_data *stream = user_data;
+	uint8_t *buf;
+	int buflen;
+	guint16 plen, offset;
+	guint id;
+
+	/* Running past the end of the value on a Read Blob ends the read */
+	if (status != 0) {
+		if (stream->offset > 0)
+			status = 0;
+		goto done;
+	}
+
+	offset = stream->offset;
+	stream->offset += rlen - 1;
+
+	buf = g_attrib_get_buffer(stream->attrib, &buflen);
+	if (rlen < buflen) {
+		stream->func(0, offset, &rpdu[1], rlen - 1, TRUE,
+							stream->user_data);
+		return;
+	}
+
+	stream->func(0, offset, &rpdu[1], rlen - 1, FALSE, stream->user_data);
+
+	plen = enc_read_blob_req(stream->handle, stream->offset, buf, buflen);
+	id = g_attrib_send(stream->attrib, stream->id, ATT_OP_READ_BLOB_REQ,
+				buf, plen, read_stream_helper, stream,
+				read_stream_destroy);
+	if (id != 0) {
+		g_atomic_int_inc(&stream->ref);
+		return;
+	}
+
+	status = ATT_ECODE_IO;
+
+done:
+	stream->func(status, stream->offset, NULL, 0, TRUE, stream->user_data);
+}
+
+/* Long read handing each part to the caller instead of accumulating the
+ * whole value */
+guint gatt_read_char_stream(GAttrib *attrib, uint16_t handle,
+				gatt_chunk_cb_t func, gpointer user_data)
+{
+	struct read_stream_data *stream;
+	uint8_t *buf;
+	int buflen;
+	guint16 plen;
+	guint id;
+
+	stream = g_try_new0(struct read_stream_data, 1);
+	if (stream == NULL)
+		return 0;
+
+	stream->attrib = attrib;
+	stream->func = func;
+	stream->user_data = user_data;
+	stream->handle = handle;
+
+	buf = g_attrib_get_buffer(attrib, &buflen);
+	plen = enc_read_req(handle, buf, buflen);
+	id = g_attrib_send(attrib, 0, ATT_OP_READ_REQ, buf, plen,
+				read_stream_helper, stream, read_stream_destroy);
+	if (id == 0) {
+		g_free(stream);
+		return 0;
+	}
+
+	g_atomic_int_inc(&stream->ref);
+	stream->id = id;
+
+	return id;
+}
+
+/* The values in the response are concatenated, so this is only useful
+ * for characteristics whose value lengths are known */
+guint gatt_read_multiple(GAttrib *attrib, const uint16_t *handles, int num,
+				GAttribResultFunc func, gpointer user_data)
+{
+	uint8_t *buf;
+	int buflen;
+	guint16 plen;
+
+	buf = g_attrib_get_buffer(attrib, &buflen);
+	plen = enc_read_multi_req(handles, num, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	return g_attrib_send(attrib, 0, ATT_OP_READ_MULTI_REQ, buf, plen,
+						func, user_data, NULL);
+}
+
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 			int vlen, GAttribResultFunc func, gpointer user_data)
 {
@@ -547,6 +660,39 @@ guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
 							user_data, NULL);
 }
 
+static void max_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	GAttrib *attrib = user_data;
+	uint16_t mtu;
+
+	if (status != 0)
+		return;
+
+	if (dec_mtu_resp(pdu, plen, &mtu) == 0)
+		return;
+
+	mtu = MIN(mtu, ATT_MAX_MTU);
+	if (mtu > ATT_DEFAULT_LE_MTU)
+		g_attrib_set_mtu(attrib, mtu);
+}
+
+/* Queued ahead of anything else, so that discovery uses the largest PDUs
+ * both sides allow: up to the incoming L2CAP MTU, when the socket has one */
+guint gatt_exchange_max_mtu(GAttrib *attrib)
+{
+	uint16_t imtu = 0;
+
+	bt_io_get(g_attrib_get_channel(attrib), BT_IO_L2CAP, NULL,
+				BT_IO_OPT_IMTU, &imtu,
+				BT_IO_OPT_INVALID);
+
+	if (imtu < ATT_DEFAULT_LE_MTU || imtu > ATT_MAX_MTU)
+		imtu = ATT_MAX_MTU;
+
+	return gatt_exchange_mtu(attrib, imtu, max_mtu_cb, attrib);
+}
+
 guint gatt_find_info(GAttrib *attrib, uint16_t start, uint16_t end,
 				GAttribResultFunc func, gpointer user_data)
 {
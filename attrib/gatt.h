@@ -25,6 +25,12 @@
 
 typedef void (*gatt_cb_t) (GSList *l, guint8 status, gpointer user_data);
 
+/* Called for each part of a long value as it arrives, last is TRUE on the
+ * final call, which may carry no data. */
+typedef void (*gatt_chunk_cb_t) (guint8 status, uint16_t offset,
+					const guint8 *value, guint16 vlen,
+					gboolean last, gpointer user_data);
+
 guint gatt_discover_primary(GAttrib *attrib, bt_uuid_t *uuid, gatt_cb_t func,
 							gpointer user_data);
 
@@ -35,6 +41,12 @@ guint gatt_discover_char(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, uint16_t offset,
 				GAttribResultFunc func, gpointer user_data);
 
+guint gatt_read_char_stream(GAttrib *attrib, uint16_t handle,
+				gatt_chunk_cb_t func, gpointer user_data);
+
+guint gatt_read_multiple(GAttrib *attrib, const uint16_t *handles, int num,
+				GAttribResultFunc func, gpointer user_data);
+
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 			int vlen, GAttribResultFunc func, gpointer user_data);
 
@@ -51,6 +63,8 @@ guint gatt_read_char_by_uuid(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
 							gpointer user_data);
 
+guint gatt_exchange_max_mtu(GAttrib *attrib);
+
 gboolean gatt_parse_record(const sdp_record_t *rec,
 					uuid_t *prim_uuid, uint16_t *psm,
 					uint16_t *start, uint16_t *end);
@@ -37,15 +37,21 @@
 
 #define GATT_TIMEOUT 30
 
+/* Spare command blocks kept per GAttrib */
+#define GATTRIB_POOL_SIZE 8
+
 struct _GAttrib {
 	GIOChannel *io;
 	gint refs;
-	uint8_t *buf;
+	struct command *staged;	/* encoded into by g_attrib_get_buffer users */
+	GTrashStack *pool;
+	guint pool_len;
 	int buflen;
 	guint read_watch;
 	guint write_watch;
 	guint timeout_watch;
 	GQueue *queue;
+	GQueue *no_resp;	/* commands, notifications and responses */
 	GSList *events;
 	guint next_cmd_id;
 	guint next_evt_id;
@@ -60,6 +66,7 @@ struct command {
 	guint8 opcode;
 	guint8 *pdu;
 	guint16 len;
+	guint16 size;		/* buffer following the command, 0 if none */
 	guint8 expected;
 	gboolean sent;
 	GAttribResultFunc func;
@@ -150,13 +157,63 @@ GAttrib *g_attrib_ref(GAttrib *attrib)
 	return attrib;
 }
 
-static void command_destroy(struct command *cmd)
+/* Commands carry an MTU sized PDU buffer right behind them, recycled
+ * through a small pool so a stream of PDUs does not hit the allocator */
+static struct command *command_alloc(struct _GAttrib *attrib)
+{
+	struct command *cmd;
+
+	cmd = g_trash_stack_pop(&attrib->pool);
+	if (cmd) {
+		attrib->pool_len--;
+		memset(cmd, 0, sizeof(*cmd));
+	} else
+		cmd = g_malloc0(sizeof(*cmd) + attrib->buflen);
+
+	cmd->pdu = (guint8 *) (cmd + 1);
+	cmd->size = attrib->buflen;
+
+	return cmd;
+}
+
+static void command_free(struct _GAttrib *attrib, struct command *cmd)
+{
+	if (cmd->size == 0) {
+		g_free(cmd->pdu);
+		g_free(cmd);
+		return;
+	}
+
+	/* Blocks sized for a previous MTU are not reused */
+	if (cmd->size != attrib->buflen ||
+				attrib->pool_len >= GATTRIB_POOL_SIZE) {
+		g_free(cmd);
+		return;
+	}
+
+	g_trash_stack_push(&attrib->pool, cmd);
+	attrib->pool_len++;
+}
+
+static void pool_flush(struct _GAttrib *attrib)
+{
+	struct command *cmd;
+
+	while ((cmd = g_trash_stack_pop(&attrib->pool)))
+		g_free(cmd);
+
+	attrib->pool_len = 0;
+
+	g_free(attrib->staged);
+	attrib->staged = NULL;
+}
+
+static void command_destroy(struct _GAttrib *attrib, struct command *cmd)
 {
 	if (cmd->notify)
 		cmd->notify(cmd->user_data);
 
-	g_free(cmd->pdu);
-	g_free(cmd);
+	command_free(attrib, cmd);
 }
 
 static void event_destroy(struct event *evt)
@@ -173,11 +230,17 @@ static void attrib_destroy(GAttrib *attrib)
 	struct command *c;
 
 	while ((c = g_queue_pop_head(attrib->queue)))
-		command_destroy(c);
+		command_destroy(attrib, c);
 
 	g_queue_free(attrib->queue);
 	attrib->queue = NULL;
 
+	while ((c = g_queue_pop_head(attrib->no_resp)))
+		command_destroy(attrib, c);
+
+	g_queue_free(attrib->no_resp);
+	attrib->no_resp = NULL;
+
 	for (l = attrib->events; l; l = l->next)
 		event_destroy(l->data);
 
@@ -195,7 +258,7 @@ static void attrib_destroy(GAttrib *attrib)
 		g_io_channel_unref(attrib->io);
 	}
 
-	g_free(attrib->buf);
+	pool_flush(attrib);
 
 	if (attrib->destroy)
 		attrib->destroy(attrib->destroy_user_data);
@@ -271,20 +334,36 @@ static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
 		return FALSE;
 	}
 
+	/* PDUs not waiting for a response go out back to back, even while
+	 * a request is outstanding, until the socket is full */
+	while ((cmd = g_queue_peek_head(attrib->no_resp))) {
+		iostat = g_io_channel_write_chars(io, (gchar *) cmd->pdu,
+						cmd->len, &len, &gerr);
+		if (iostat == G_IO_STATUS_AGAIN)
+			return TRUE;
+
+		if (iostat != G_IO_STATUS_NORMAL) {
+			g_clear_error(&gerr);
+			return FALSE;
+		}
+
+		g_queue_pop_head(attrib->no_resp);
+		command_destroy(attrib, cmd);
+	}
+
+	/* Only one request may be outstanding */
 	cmd = g_queue_peek_head(attrib->queue);
-	if (cmd == NULL)
+	if (cmd == NULL || cmd->sent)
 		return FALSE;
 
 	iostat = g_io_channel_write_chars(io, (gchar *) cmd->pdu, cmd->len,
 								&len, &gerr);
-	if (iostat != G_IO_STATUS_NORMAL)
-		return FALSE;
-
-	if (cmd->expected == 0) {
-		g_queue_pop_head(attrib->queue);
-		command_destroy(cmd);
-
+	if (iostat == G_IO_STATUS_AGAIN)
 		return TRUE;
+
+	if (iostat != G_IO_STATUS_NORMAL) {
+		g_clear_error(&gerr);
+		return FALSE;
 	}
 
 	cmd->sent = TRUE;
@@ -333,8 +412,6 @@ static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
 		return FALSE;
 	}
 
-	memset(buf, 0, sizeof(buf));
-
 	iostat = g_io_channel_read_chars(io, (gchar *) buf, sizeof(buf),
 								&len, NULL);
 	if (iostat != G_IO_STATUS_NORMAL) {
@@ -378,7 +455,7 @@ done:
 		if (cmd->func)
 			cmd->func(status, buf, len, cmd->user_data);
 
-		command_destroy(cmd);
+		command_destroy(attrib, cmd);
 	}
 
 	if (!qempty)
@@ -394,6 +471,7 @@ GAttrib *g_attrib_new(GIOChannel *io)
 
 	g_io_channel_set_encoding(io, NULL, NULL);
 	g_io_channel_set_buffered(io, FALSE);
+	g_io_channel_set_flags(io, G_IO_FLAG_NONBLOCK, NULL);
 
 	attrib = g_try_new0(struct _GAttrib, 1);
 	if (attrib == NULL)
@@ -401,6 +479,7 @@ GAttrib *g_attrib_new(GIOChannel *io)
 
 	attrib->io = g_io_channel_ref(io);
 	attrib->queue = g_queue_new();
+	attrib->no_resp = g_queue_new();
 
 	attrib->read_watch = g_io_add_watch(attrib->io,
 			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
@@ -414,7 +493,6 @@ GAttrib *g_attrib_new(GIOChannel *io)
 	} else
 		omtu = ATT_DEFAULT_LE_MTU;
 
-	attrib->buf = g_malloc0(omtu);
 	attrib->buflen = omtu;
 
 	return g_attrib_ref(attrib);
@@ -426,29 +504,43 @@ guint g_attrib_send(GAttrib *attrib, guint id, guint8 opcode,
 {
 	struct command *c;
 
-	c = g_try_new0(struct command, 1);
-	if (c == NULL)
-		return 0;
+	if (attrib->staged && pdu == attrib->staged->pdu) {
+		/* Encoded in place, the buffer is handed over as is */
+		c = attrib->staged;
+		attrib->staged = NULL;
+	} else if (len <= attrib->buflen) {
+		c = command_alloc(attrib);
+		memcpy(c->pdu, pdu, len);
+	} else {
+		c = g_try_new0(struct command, 1);
+		if (c == NULL)
+			return 0;
+
+		c->pdu = g_malloc(len);
+		memcpy(c->pdu, pdu, len);
+	}
 
 	c->opcode = opcode;
 	c->expected = opcode2expected(opcode);
-	c->pdu = g_malloc(len);
-	memcpy(c->pdu, pdu, len);
 	c->len = len;
 	c->func = func;
 	c->user_data = user_data;
 	c->notify = notify;
 
-	if (id) {
+	if (id)
 		c->id = id;
-		g_queue_push_head(attrib->queue, c);
-	} else {
+	else
 		c->id = ++attrib->next_cmd_id;
+
+	/* Nothing waits for these, so they do not queue behind requests */
+	if (c->expected == 0)
+		g_queue_push_tail(attrib->no_resp, c);
+	else if (id)
+		g_queue_push_head(attrib->queue, c);
+	else
 		g_queue_push_tail(attrib->queue, c);
-	}
 
-	if (g_queue_get_length(attrib->queue) == 1)
-		wake_up_sender(attrib);
+	wake_up_sender(attrib);
 
 	return c->id;
 }
@@ -469,6 +561,15 @@ gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 	if (attrib == NULL || attrib->queue == NULL)
 		return FALSE;
 
+	l = g_queue_find_custom(attrib->no_resp, GUINT_TO_POINTER(id),
+							command_cmp_by_id);
+	if (l) {
+		cmd = l->data;
+		g_queue_remove(attrib->no_resp, cmd);
+		command_destroy(attrib, cmd);
+		return TRUE;
+	}
+
 	l = g_queue_find_custom(attrib->queue, GUINT_TO_POINTER(id),
 							command_cmp_by_id);
 	if (l == NULL)
@@ -480,7 +581,7 @@ gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 		cmd->func = NULL;
 	else {
 		g_queue_remove(attrib->queue, cmd);
-		command_destroy(cmd);
+		command_destroy(attrib, cmd);
 	}
 
 	return TRUE;
@@ -503,7 +604,7 @@ gboolean g_attrib_cancel_all(GAttrib *attrib)
 		}
 
 		first = FALSE;
-		command_destroy(c);
+		command_destroy(attrib, c);
 	}
 
 	if (head) {
@@ -511,6 +612,9 @@ gboolean g_attrib_cancel_all(GAttrib *attrib)
 		g_queue_push_head(attrib->queue, head);
 	}
 
+	while ((c = g_queue_pop_head(attrib->no_resp)))
+		command_destroy(attrib, c);
+
 	return TRUE;
 }
 
@@ -525,9 +629,12 @@ uint8_t *g_attrib_get_buffer(GAttrib *attrib, int *len)
 	if (len == NULL)
 		return NULL;
 
+	if (attrib->staged == NULL)
+		attrib->staged = command_alloc(attrib);
+
 	*len = attrib->buflen;
 
-	return attrib->buf;
+	return attrib->staged->pdu;
 }
 
 gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
@@ -543,7 +650,7 @@ gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
 			BT_IO_OPT_INVALID))
 		return FALSE;
 
-	attrib->buf = g_realloc(attrib->buf, mtu);
+	pool_flush(attrib);
 
 	attrib->buflen = mtu;
 
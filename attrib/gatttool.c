@@ -61,6 +61,11 @@ static gboolean opt_char_desc = FALSE;
 static gboolean opt_char_write = FALSE;
 static gboolean opt_char_write_req = FALSE;
 static gboolean opt_interactive = FALSE;
+static gboolean opt_bench_write = FALSE;
+static gboolean opt_bench_write_req = FALSE;
+static gboolean opt_bench_notify = FALSE;
+static gboolean opt_bench_discovery = FALSE;
+static int opt_duration = 10;
 static GMainLoop *event_loop;
 static gboolean got_error = FALSE;
 static GSourceFunc operation;
@@ -460,6 +465,360 @@ static gboolean characteristics_desc(gpointer user_data)
 	return FALSE;
 }
 
+/* Benchmarks print one line of space separated key=value pairs per
+ * result, so that they can be collected by scripts */
+
+#define BENCH_WINDOW	8	/* Write Commands kept queued */
+#define BENCH_BUCKETS	32	/* log2 microsecond latency buckets */
+
+static struct {
+	GAttrib *attrib;
+	GTimer *timer;		/* whole run */
+	GTimer *op;		/* current request */
+	uint8_t *value;
+	size_t vlen;
+	uint32_t seq;
+	guint inflight;
+	gboolean done;
+	guint64 count;
+	guint64 bytes;
+	guint64 errors;
+	guint64 lost;
+	guint64 reordered;
+	double min;
+	double max;
+	double sum;
+	guint hist[BENCH_BUCKETS];
+	guint services;
+	guint chars;
+	guint descs;
+	double primary_ms;
+	double chars_ms;
+} bench;
+
+static gboolean bench_value(int buflen)
+{
+	if (opt_handle <= 0) {
+		g_printerr("A valid handle is required\n");
+		return FALSE;
+	}
+
+	if (opt_value != NULL && opt_value[0] != '\0') {
+		bench.vlen = gatt_attr_data_from_string(opt_value,
+							&bench.value);
+		if (bench.vlen == 0) {
+			g_printerr("Invalid value\n");
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	/* Largest value a Write fits in */
+	bench.vlen = buflen - 3;
+	bench.value = g_malloc0(bench.vlen);
+
+	return TRUE;
+}
+
+/* The first four octets of written values carry a sequence number, so
+ * that the peer can detect losses */
+static void bench_stamp(void)
+{
+	if (bench.vlen >= sizeof(uint32_t))
+		att_put_u32(bench.seq, bench.value);
+
+	bench.seq++;
+}
+
+static void bench_latency(double usec)
+{
+	guint i = 0;
+
+	if (bench.count == 0 || usec < bench.min)
+		bench.min = usec;
+
+	if (usec > bench.max)
+		bench.max = usec;
+
+	bench.sum += usec;
+	bench.count++;
+
+	while (i < BENCH_BUCKETS - 1 && (1u << i) < usec)
+		i++;
+
+	bench.hist[i]++;
+}
+
+static gboolean bench_stop(gpointer user_data)
+{
+	const char *name = user_data;
+	double elapsed = g_timer_elapsed(bench.timer, NULL);
+	int i;
+
+	if (bench.done)
+		return FALSE;
+
+	bench.done = TRUE;
+
+	g_print("bench=%s duration=%.6f count=%" G_GUINT64_FORMAT
+			" bytes=%" G_GUINT64_FORMAT " rate=%.1f"
+			" throughput=%.1f errors=%" G_GUINT64_FORMAT, name,
+			elapsed, bench.count, bench.bytes,
+			elapsed > 0 ? bench.count / elapsed : 0,
+			elapsed > 0 ? bench.bytes / elapsed : 0, bench.errors);
+
+	if (g_str_equal(name, "notify"))
+		g_print(" lost=%" G_GUINT64_FORMAT " reordered=%"
+				G_GUINT64_FORMAT, bench.lost, bench.reordered);
+
+	if (g_str_equal(name, "write-req") && bench.count > 0)
+		g_print(" min_us=%.0f avg_us=%.0f max_us=%.0f", bench.min,
+					bench.sum / bench.count, bench.max);
+
+	g_print("\n");
+
+	/* Latency histogram, one line per non-empty bucket */
+	for (i = 0; i < BENCH_BUCKETS; i++) {
+		if (bench.hist[i] == 0)
+			continue;
+
+		g_print("bench=%s latency_us_le=%u count=%u\n", name,
+							1u << i, bench.hist[i]);
+	}
+
+	g_main_loop_quit(event_loop);
+
+	return FALSE;
+}
+
+static void bench_start(const char *name)
+{
+	bench.timer = g_timer_new();
+	g_timeout_add_seconds(opt_duration, bench_stop, (gpointer) name);
+}
+
+static void bench_write_fill(void);
+
+static void bench_write_sent(gpointer user_data)
+{
+	bench.inflight--;
+
+	if (bench.done)
+		return;
+
+	bench.count++;
+	bench.bytes += bench.vlen;
+
+	bench_write_fill();
+}
+
+static void bench_write_fill(void)
+{
+	while (bench.inflight < BENCH_WINDOW) {
+		bench_stamp();
+
+		if (gatt_write_cmd(bench.attrib, opt_handle, bench.value,
+				bench.vlen, bench_write_sent, NULL) == 0) {
+			bench.errors++;
+			break;
+		}
+
+		bench.inflight++;
+	}
+}
+
+static gboolean bench_write(gpointer user_data)
+{
+	int buflen;
+
+	bench.attrib = user_data;
+	g_attrib_get_buffer(bench.attrib, &buflen);
+
+	if (!bench_value(buflen)) {
+		g_main_loop_quit(event_loop);
+		return FALSE;
+	}
+
+	bench_start("write-cmd");
+	bench_write_fill();
+
+	return FALSE;
+}
+
+static void bench_write_req_next(void);
+
+static void bench_write_req_cb(guint8 status, const guint8 *pdu,
+					guint16 plen, gpointer user_data)
+{
+	if (bench.done)
+		return;
+
+	if (status != 0 || !dec_write_resp(pdu, plen))
+		bench.errors++;
+	else {
+		bench_latency(g_timer_elapsed(bench.op, NULL) * 1000000);
+		bench.bytes += bench.vlen;
+	}
+
+	bench_write_req_next();
+}
+
+static void bench_write_req_next(void)
+{
+	bench_stamp();
+	g_timer_start(bench.op);
+
+	if (gatt_write_char(bench.attrib, opt_handle, bench.value,
+				bench.vlen, bench_write_req_cb, NULL) == 0) {
+		bench.errors++;
+		bench_stop("write-req");
+	}
+}
+
+static gboolean bench_write_req(gpointer user_data)
+{
+	int buflen;
+
+	bench.attrib = user_data;
+	g_attrib_get_buffer(bench.attrib, &buflen);
+
+	if (!bench_value(buflen)) {
+		g_main_loop_quit(event_loop);
+		return FALSE;
+	}
+
+	bench.op = g_timer_new();
+	bench_start("write-req");
+	bench_write_req_next();
+
+	return FALSE;
+}
+
+/* Notifications are expected to start with a sequence number, as
+ * written by the write benchmarks */
+static void bench_notify_cb(const uint8_t *pdu, uint16_t len,
+							gpointer user_data)
+{
+	uint32_t seq;
+
+	if (bench.done)
+		return;
+
+	bench.count++;
+	bench.bytes += len - 3;
+
+	if (len < 3 + sizeof(uint32_t))
+		return;
+
+	seq = att_get_u32(&pdu[3]);
+
+	if (bench.count > 1 && seq > bench.seq)
+		bench.lost += seq - bench.seq;
+	else if (bench.count > 1 && seq < bench.seq)
+		bench.reordered++;
+
+	bench.seq = seq + 1;
+}
+
+static gboolean bench_notify(gpointer user_data)
+{
+	bench.attrib = user_data;
+
+	g_attrib_register(bench.attrib, ATT_OP_HANDLE_NOTIFY, bench_notify_cb,
+								NULL, NULL);
+
+	/* Enabling notifications, usually a write to the Client
+	 * Characteristic Configuration descriptor */
+	if (opt_handle > 0 && opt_value != NULL) {
+		uint8_t *value;
+		size_t len;
+
+		len = gatt_attr_data_from_string(opt_value, &value);
+		if (len > 0) {
+			gatt_write_char(bench.attrib, opt_handle, value, len,
+								NULL, NULL);
+			g_free(value);
+		}
+	}
+
+	bench_start("notify");
+
+	return FALSE;
+}
+
+static void bench_desc_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct att_data_iter iter;
+	const uint8_t *info;
+	uint16_t handle = 0;
+	double elapsed;
+
+	if (status == 0 && att_data_iter_init(&iter, pdu, plen) > 0) {
+		while ((info = att_data_iter_next(&iter))) {
+			handle = att_get_u16(info);
+			bench.descs++;
+		}
+
+		if (handle != 0 && handle < 0xffff) {
+			gatt_find_info(bench.attrib, handle + 1, 0xffff,
+						bench_desc_cb, NULL);
+			return;
+		}
+	} else if (status != 0 && status != ATT_ECODE_ATTR_NOT_FOUND)
+		bench.errors++;
+
+	elapsed = g_timer_elapsed(bench.timer, NULL) * 1000;
+
+	g_print("bench=discovery services=%u characteristics=%u"
+			" attributes=%u primary_ms=%.3f characteristics_ms=%.3f"
+			" attributes_ms=%.3f total_ms=%.3f errors=%"
+			G_GUINT64_FORMAT "\n", bench.services, bench.chars,
+			bench.descs, bench.primary_ms,
+			bench.chars_ms - bench.primary_ms,
+			elapsed - bench.chars_ms, elapsed, bench.errors);
+
+	g_main_loop_quit(event_loop);
+}
+
+static void bench_char_cb(GSList *characteristics, guint8 status,
+							gpointer user_data)
+{
+	if (status != 0)
+		bench.errors++;
+
+	bench.chars = g_slist_length(characteristics);
+	bench.chars_ms = g_timer_elapsed(bench.timer, NULL) * 1000;
+
+	gatt_find_info(bench.attrib, 0x0001, 0xffff, bench_desc_cb, NULL);
+}
+
+static void bench_primary_cb(GSList *services, guint8 status,
+							gpointer user_data)
+{
+	if (status != 0)
+		bench.errors++;
+
+	bench.services = g_slist_length(services);
+	bench.primary_ms = g_timer_elapsed(bench.timer, NULL) * 1000;
+
+	gatt_discover_char(bench.attrib, 0x0001, 0xffff, NULL, bench_char_cb,
+									NULL);
+}
+
+/* Primary services, then all characteristic declarations, then every
+ * attribute with Find Information, each phase timed */
+static gboolean bench_discovery(gpointer user_data)
+{
+	bench.attrib = user_data;
+	bench.timer = g_timer_new();
+
+	gatt_discover_primary(bench.attrib, NULL, bench_primary_cb, NULL);
+
+	return FALSE;
+}
+
 static gboolean parse_uuid(const char *key, const char *value,
 				gpointer user_data, GError **error)
 {
@@ -518,6 +877,21 @@ static GOptionEntry gatt_options[] = {
 	{ NULL },
 };
 
+static GOptionEntry bench_options[] = {
+	{ "bench-write", 0, 0, G_OPTION_ARG_NONE, &opt_bench_write,
+		"Write Command throughput to --handle", NULL },
+	{ "bench-write-req", 0, 0, G_OPTION_ARG_NONE, &opt_bench_write_req,
+		"Write Request latency to --handle", NULL },
+	{ "bench-notify", 0, 0, G_OPTION_ARG_NONE, &opt_bench_notify,
+		"Notification rate and losses, --value is written to "
+		"--handle first if given", NULL },
+	{ "bench-discovery", 0, 0, G_OPTION_ARG_NONE, &opt_bench_discovery,
+		"Time of the discovery of all attributes", NULL },
+	{ "duration", 't', 0, G_OPTION_ARG_INT, &opt_duration,
+		"Benchmark duration in seconds", "10" },
+	{ NULL },
+};
+
 static GOptionEntry options[] = {
 	{ "adapter", 'i', 0, G_OPTION_ARG_STRING, &opt_src,
 		"Specify local adapter interface", "hciX" },
@@ -535,7 +909,7 @@ static GOptionEntry options[] = {
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
-	GOptionGroup *gatt_group, *params_group, *char_rw_group;
+	GOptionGroup *gatt_group, *params_group, *char_rw_group, *bench_group;
 	GError *gerr = NULL;
 	GIOChannel *chan;
 
@@ -567,6 +941,12 @@ int main(int argc, char *argv[])
 	g_option_context_add_group(context, char_rw_group);
 	g_option_group_add_entries(char_rw_group, char_rw_options);
 
+	/* Benchmarks, using the read/write arguments */
+	bench_group = g_option_group_new("bench", "Benchmark commands",
+					"Show all benchmark commands", NULL, NULL);
+	g_option_context_add_group(context, bench_group);
+	g_option_group_add_entries(bench_group, bench_options);
+
 	if (g_option_context_parse(context, &argc, &argv, &gerr) == FALSE) {
 		g_printerr("%s\n", gerr->message);
 		g_error_free(gerr);
@@ -589,6 +969,14 @@ int main(int argc, char *argv[])
 		operation = characteristics_write_req;
 	else if (opt_char_desc)
 		operation = characteristics_desc;
+	else if (opt_bench_write)
+		operation = bench_write;
+	else if (opt_bench_write_req)
+		operation = bench_write_req;
+	else if (opt_bench_notify)
+		operation = bench_notify;
+	else if (opt_bench_discovery)
+		operation = bench_discovery;
 	else {
 		gchar *help = g_option_context_get_help(context, TRUE, NULL);
 		g_print("%s\n", help);
@@ -6,6 +6,7 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	a2dp.c \
+	a2dp-relay.c \
 	avdtp.c \
 	control.c \
 	device.c \
@@ -15,12 +16,27 @@ LOCAL_SRC_FILES:= \
 	main.c \
 	manager.c \
 	media.c \
+	mixer.c \
 	module-bluetooth-sink.c \
+	sco-relay.c \
 	sink.c \
 	source.c \
 	telephony-dummy.c \
 	transport.c \
-	unix.c
+	unix.c \
+	../sbc/sbc_primitives.c \
+	../sbc/sbc_primitives_neon.c
+
+ifeq ($(TARGET_ARCH),x86)
+LOCAL_SRC_FILES+= \
+	../sbc/sbc_primitives_mmx.c \
+	../sbc/sbc_primitives_sse.c \
+	../sbc/sbc.c
+else
+LOCAL_SRC_FILES+= \
+	../sbc/sbc.c.arm \
+	../sbc/sbc_primitives_armv6.c
+endif
 
 LOCAL_CFLAGS:= \
 	-DVERSION=\"4.93\" \
@@ -31,6 +47,7 @@ LOCAL_CFLAGS:= \
 
 LOCAL_C_INCLUDES:= \
 	$(LOCAL_PATH)/../lib \
+	$(LOCAL_PATH)/../sbc \
 	$(LOCAL_PATH)/../gdbus \
 	$(LOCAL_PATH)/../src \
 	$(LOCAL_PATH)/../btio \
@@ -50,6 +67,14 @@ LOCAL_CFLAGS += -DA2DP_48000_SAMPLE_RATE
 endif
 endif
 
+ifeq ($(BLUETOOTH_LOOPSTAT),true)
+LOCAL_CFLAGS += -DLOOPSTAT -include $(LOCAL_PATH)/../src/loopstat.h
+endif
+
+ifeq ($(BLUETOOTH_MEMSTAT),true)
+LOCAL_CFLAGS += -DMEMSTAT
+endif
+
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/bluez-plugin
 LOCAL_UNSTRIPPED_PATH := $(TARGET_OUT_SHARED_LIBRARIES_UNSTRIPPED)/bluez-plugin
 LOCAL_MODULE := audio
@@ -66,12 +91,14 @@ LOCAL_SRC_FILES:= \
 	android_audio_hw.c \
 	liba2dp.c \
 	ipc.c \
+	thread-policy.c \
 	../sbc/sbc_primitives.c \
 	../sbc/sbc_primitives_neon.c
 
 ifeq ($(TARGET_ARCH),x86)
 LOCAL_SRC_FILES+= \
 	../sbc/sbc_primitives_mmx.c \
+	../sbc/sbc_primitives_sse.c \
 	../sbc/sbc.c
 else
 LOCAL_SRC_FILES+= \
@@ -0,0 +1,743 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "avdtp.h"
+#include "a2dp-codecs.h"
+#include "rtp.h"
+#include "sbc.h"
+#include "a2dp-relay.h"
+
+/* Jitter buffer size, in packets indexed by RTP sequence number */
+#define RELAY_SLOTS 64
+
+/* Depth played out from, it grows by a step on every underrun and shrinks
+ * again after RELAY_ADAPT_SEC seconds without one */
+#define RELAY_MIN_TARGET_MS 40
+#define RELAY_MAX_TARGET_MS 200
+#define RELAY_TARGET_STEP_MS 20
+#define RELAY_ADAPT_SEC 30
+
+#define RELAY_TICK_MS 10
+
+/* A missing packet is waited for until this many later ones arrived */
+#define RELAY_REORDER 3
+
+/* Longest timestamp gap filled in for lost packets, a larger jump is the
+ * source restarting its timeline rather than loss */
+#define RELAY_MAX_GAP_MS 100
+
+/* Resampling control, in ppm per msec of depth error. The integral term
+ * converges on the drift between the source clock and the local one. */
+#define RELAY_KP 20.0
+#define RELAY_KI 0.01
+#define RELAY_MAX_PPM 1000.0
+
+/* The depth is averaged over about this many ticks, packets arrive in
+ * bursts that the control shouldn't follow */
+#define RELAY_DEPTH_AVG 64
+
+#define RELAY_REPORT_SEC 10
+
+struct rtp_slot {
+	gboolean valid;
+	uint16_t seq;
+	uint32_t timestamp;
+	unsigned int samples;	/* PCM frames in the packet */
+	size_t len;
+	uint8_t *data;		/* SBC frames */
+};
+
+struct a2dp_relay {
+	struct avdtp *session;
+	struct avdtp_stream *stream;
+	unsigned int cb_id;
+	int media_fd;
+	int client_fd;
+	guint media_watch;
+	guint timer;
+	uint16_t imtu;
+
+	sbc_t sbc;
+	unsigned int rate;
+	unsigned int channels;
+	unsigned int frame_samples;	/* PCM frames per SBC frame */
+
+	/* Jitter buffer */
+	uint8_t *pkt;
+	struct rtp_slot slots[RELAY_SLOTS];
+	gboolean have_seq;
+	uint16_t next_seq;	/* Next packet to decode */
+	uint16_t high_seq;	/* Highest packet received */
+	uint32_t next_ts;	/* Timestamp expected for next_seq */
+
+	/* Decoded audio, planar, consumed by the resampler */
+	int16_t *pcm[2];
+	unsigned int pcm_len;
+	unsigned int pcm_size;
+	double phase;		/* Resampler position in pcm */
+
+	/* Interleaved output, partially sent when the client lags */
+	int16_t *out;
+	unsigned int out_frames;
+	size_t out_len;
+	size_t out_sent;
+
+	gboolean primed;
+	unsigned int target_ms;
+	double depth_avg;	/* msec */
+	double integral;	/* Drift estimate, ppm */
+	uint64_t start;		/* Playout clock reference, usec */
+	uint64_t played;	/* Frames played out since start */
+	uint64_t clean_since;
+	uint64_t last_report;
+
+	unsigned long underruns;
+	unsigned long lost;
+	unsigned long late;
+	unsigned long overruns;
+};
+
+static uint64_t get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void relay_stop(struct a2dp_relay *relay)
+{
+	if (relay->media_watch) {
+		g_source_remove(relay->media_watch);
+		relay->media_watch = 0;
+	}
+
+	if (relay->timer) {
+		g_source_remove(relay->timer);
+		relay->timer = 0;
+	}
+}
+
+/* Drops everything buffered, playout restarts once the target depth has
+ * been received again */
+static void relay_flush(struct a2dp_relay *relay)
+{
+	int i;
+
+	for (i = 0; i < RELAY_SLOTS; i++)
+		relay->slots[i].valid = FALSE;
+
+	relay->have_seq = FALSE;
+	relay->pcm_len = 0;
+	relay->phase = 0;
+	relay->primed = FALSE;
+}
+
+/* Audio buffered ahead of the playout position, in PCM frames */
+static unsigned int relay_queued(struct a2dp_relay *relay)
+{
+	struct rtp_slot *slot = &relay->slots[relay->high_seq % RELAY_SLOTS];
+	unsigned int queued = 0;
+	uint32_t span;
+
+	if (relay->pcm_len > relay->phase)
+		queued = relay->pcm_len - (unsigned int) relay->phase;
+
+	if (!relay->have_seq || !slot->valid || slot->seq != relay->high_seq)
+		return queued;
+
+	span = slot->timestamp + slot->samples - relay->next_ts;
+	if (span > relay->rate)
+		span = relay->rate;
+
+	return queued + span;
+}
+
+static void relay_store(struct a2dp_relay *relay, const uint8_t *buf,
+								size_t len)
+{
+	const struct rtp_header *hdr = (const void *) buf;
+	const struct rtp_payload *payload;
+	struct rtp_slot *slot;
+	size_t header;
+	uint16_t seq;
+	int16_t diff;
+
+	if (len < sizeof(*hdr))
+		return;
+
+	header = sizeof(*hdr) + hdr->cc * 4;
+	if (hdr->v != 2 || len < header + sizeof(*payload))
+		return;
+
+	payload = (const void *) (buf + header);
+	header += sizeof(*payload);
+
+	/* Frames don't get fragmented with any usable MTU */
+	if (payload->is_fragmented || payload->frame_count == 0)
+		return;
+
+	seq = ntohs(hdr->sequence_number);
+
+	if (relay->have_seq) {
+		diff = seq - relay->next_seq;
+		if (diff < 0) {
+			relay->late++;
+			return;
+		}
+
+		/* Too far ahead to fit, start over from this packet */
+		if (diff >= RELAY_SLOTS) {
+			relay->overruns++;
+			relay_flush(relay);
+		}
+	}
+
+	if (!relay->have_seq) {
+		relay->have_seq = TRUE;
+		relay->next_seq = seq;
+		relay->high_seq = seq;
+		relay->next_ts = ntohl(hdr->timestamp);
+	}
+
+	slot = &relay->slots[seq % RELAY_SLOTS];
+	slot->valid = TRUE;
+	slot->seq = seq;
+	slot->timestamp = ntohl(hdr->timestamp);
+	slot->samples = payload->frame_count * relay->frame_samples;
+	slot->len = len - header;
+	memcpy(slot->data, buf + header, slot->len);
+
+	if ((int16_t) (seq - relay->high_seq) > 0)
+		relay->high_seq = seq;
+}
+
+/* Stands in for missing audio, fading the last sample out over the first
+ * millisecond and following with silence */
+static void relay_fill(struct a2dp_relay *relay, unsigned int count)
+{
+	unsigned int ch, i, fade = relay->rate / 1000;
+
+	if (count > relay->pcm_size - relay->pcm_len)
+		count = relay->pcm_size - relay->pcm_len;
+
+	for (ch = 0; ch < relay->channels; ch++) {
+		int16_t *pcm = relay->pcm[ch] + relay->pcm_len;
+		int last = relay->pcm_len ? pcm[-1] : 0;
+
+		for (i = 0; i < count; i++)
+			pcm[i] = i < fade ? last * (int) (fade - i) /
+							(int) fade : 0;
+	}
+
+	relay->pcm_len += count;
+}
+
+static void relay_decode(struct a2dp_relay *relay, struct rtp_slot *slot)
+{
+	const uint8_t *ptr = slot->data;
+	size_t left = slot->len;
+	unsigned int decoded = 0;
+
+	while (left > 0 && relay->pcm_len + relay->frame_samples <=
+							relay->pcm_size) {
+		int16_t *out[2];
+		size_t samples;
+		ssize_t used;
+
+		out[0] = relay->pcm[0] + relay->pcm_len;
+		out[1] = relay->pcm[1] + relay->pcm_len;
+
+		used = sbc_decode_planar(&relay->sbc, ptr, left, out,
+				relay->pcm_size - relay->pcm_len, &samples);
+		if (used <= 0)
+			break;
+
+		relay->pcm_len += samples;
+		decoded += samples;
+		ptr += used;
+		left -= used;
+	}
+
+	/* Keep the timeline when frames were corrupt */
+	if (decoded < slot->samples)
+		relay_fill(relay, slot->samples - decoded);
+}
+
+/* Moves the next packet, or the gap left by a lost one, into the decoded
+ * audio. Returns FALSE when there is nothing to move yet. */
+static gboolean relay_next(struct a2dp_relay *relay)
+{
+	struct rtp_slot *slot;
+	uint32_t gap;
+	int16_t ahead;
+
+	if (!relay->have_seq)
+		return FALSE;
+
+	ahead = relay->high_seq - relay->next_seq;
+	if (ahead < 0)
+		return FALSE;
+
+	slot = &relay->slots[relay->next_seq % RELAY_SLOTS];
+
+	if (slot->valid && slot->seq == relay->next_seq) {
+		/* Audio of lost packets shows as a timestamp jump */
+		gap = slot->timestamp - relay->next_ts;
+		if (gap > 0 && gap < relay->rate * RELAY_MAX_GAP_MS / 1000)
+			relay_fill(relay, gap);
+
+		relay_decode(relay, slot);
+
+		relay->next_ts = slot->timestamp + slot->samples;
+		relay->next_seq++;
+		slot->valid = FALSE;
+
+		return TRUE;
+	}
+
+	/* Give a reordered packet a chance to arrive */
+	if (ahead < RELAY_REORDER)
+		return FALSE;
+
+	relay->lost++;
+	relay->next_seq++;
+
+	return TRUE;
+}
+
+/* Linear interpolation at a ratio a few hundred ppm off unity, which is
+ * all drift tracking needs. Returns the number of frames produced. */
+static unsigned int relay_resample(struct a2dp_relay *relay, int16_t *out,
+					unsigned int count, double ratio)
+{
+	unsigned int ch, i, idx;
+
+	for (i = 0; i < count; i++) {
+		double frac;
+
+		idx = (unsigned int) relay->phase;
+		if (idx + 1 >= relay->pcm_len)
+			break;
+
+		frac = relay->phase - idx;
+
+		for (ch = 0; ch < relay->channels; ch++) {
+			int16_t *pcm = relay->pcm[ch];
+
+			*out++ = pcm[idx] + (pcm[idx + 1] - pcm[idx]) * frac;
+		}
+
+		relay->phase += ratio;
+	}
+
+	idx = (unsigned int) relay->phase;
+	if (idx > relay->pcm_len)
+		idx = relay->pcm_len;
+
+	for (ch = 0; ch < relay->channels; ch++)
+		memmove(relay->pcm[ch], relay->pcm[ch] + idx,
+				(relay->pcm_len - idx) * sizeof(int16_t));
+
+	relay->pcm_len -= idx;
+	relay->phase -= idx;
+
+	return i;
+}
+
+/* Returns FALSE once the client is gone */
+static gboolean relay_send(struct a2dp_relay *relay)
+{
+	while (relay->out_sent < relay->out_len) {
+		ssize_t len;
+
+		len = send(relay->client_fd,
+				(uint8_t *) relay->out + relay->out_sent,
+				relay->out_len - relay->out_sent,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN;
+		}
+
+		relay->out_sent += len;
+	}
+
+	return TRUE;
+}
+
+static void relay_adapt(struct a2dp_relay *relay, uint64_t now)
+{
+	if (now - relay->clean_since < RELAY_ADAPT_SEC * 1000000ULL)
+		return;
+
+	relay->clean_since = now;
+
+	if (relay->target_ms > RELAY_MIN_TARGET_MS)
+		relay->target_ms -= RELAY_TARGET_STEP_MS;
+}
+
+static void relay_report(struct a2dp_relay *relay, uint64_t now)
+{
+	if (now - relay->last_report < RELAY_REPORT_SEC * 1000000ULL)
+		return;
+
+	relay->last_report = now;
+
+	DBG("A2DP relay: depth %.0f ms target %u ms drift %+.0f ppm, "
+			"%lu underruns %lu lost %lu late %lu overruns",
+			relay->depth_avg, relay->target_ms, relay->integral,
+			relay->underruns, relay->lost, relay->late,
+			relay->overruns);
+}
+
+static gboolean relay_tick(gpointer user_data)
+{
+	struct a2dp_relay *relay = user_data;
+	uint64_t now = get_usec();
+	unsigned int due, need, done = 0;
+	double depth, err, ppm, ratio;
+
+	due = (now - relay->start) * relay->rate / 1000000 - relay->played;
+	if (due == 0)
+		return TRUE;
+
+	/* Don't try to catch up with a timer that fell far behind */
+	if (due > relay->out_frames) {
+		relay->played += due - relay->out_frames;
+		due = relay->out_frames;
+	}
+
+	relay->played += due;
+
+	/* The client hasn't taken the last tick yet, this one is lost */
+	if (relay->out_sent < relay->out_len) {
+		if (!relay_send(relay))
+			goto stop;
+
+		if (relay->out_sent < relay->out_len) {
+			relay->overruns++;
+			return TRUE;
+		}
+	}
+
+	depth = (double) relay_queued(relay) * 1000 / relay->rate;
+
+	if (!relay->primed && depth >= relay->target_ms) {
+		relay->primed = TRUE;
+		relay->depth_avg = depth;
+	}
+
+	if (relay->primed) {
+		relay->depth_avg += (depth - relay->depth_avg) /
+							RELAY_DEPTH_AVG;
+
+		err = relay->depth_avg - relay->target_ms;
+		relay->integral = CLAMP(relay->integral + RELAY_KI * err,
+						-RELAY_MAX_PPM, RELAY_MAX_PPM);
+		ppm = CLAMP(relay->integral + RELAY_KP * err,
+						-RELAY_MAX_PPM, RELAY_MAX_PPM);
+		ratio = 1.0 + ppm / 1000000.0;
+
+		need = (unsigned int) (relay->phase + due * ratio) + 2;
+		while (relay->pcm_len < need && relay_next(relay))
+			;
+
+		done = relay_resample(relay, relay->out, due, ratio);
+
+		if (done < due) {
+			relay->underruns++;
+			relay->primed = FALSE;
+			relay->clean_since = now;
+			if (relay->target_ms < RELAY_MAX_TARGET_MS)
+				relay->target_ms += RELAY_TARGET_STEP_MS;
+		} else
+			relay_adapt(relay, now);
+	}
+
+	/* Silence while priming keeps the client's clock running */
+	memset(relay->out + done * relay->channels, 0,
+			(due - done) * relay->channels * sizeof(int16_t));
+
+	relay->out_len = due * relay->channels * sizeof(int16_t);
+	relay->out_sent = 0;
+
+	if (!relay_send(relay))
+		goto stop;
+
+	relay_report(relay, now);
+
+	return TRUE;
+
+stop:
+	DBG("A2DP relay: client gone");
+	relay->timer = 0;
+	relay_stop(relay);
+	return FALSE;
+}
+
+static gboolean media_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	struct a2dp_relay *relay = data;
+	ssize_t len;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		goto stop;
+
+	len = recv(relay->media_fd, relay->pkt, relay->imtu, MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return TRUE;
+		goto stop;
+	}
+
+	relay_store(relay, relay->pkt, len);
+
+	return TRUE;
+
+stop:
+	DBG("A2DP relay: media transport gone");
+	relay->media_watch = 0;
+	return FALSE;
+}
+
+static void stream_state_changed(struct avdtp_stream *stream,
+					avdtp_state_t old_state,
+					avdtp_state_t new_state,
+					struct avdtp_error *err,
+					void *user_data)
+{
+	struct a2dp_relay *relay = user_data;
+
+	/* A suspended source restarts with new sequence numbers */
+	if (new_state != AVDTP_STATE_STREAMING)
+		relay_flush(relay);
+
+	if (new_state != AVDTP_STATE_IDLE)
+		return;
+
+	relay->cb_id = 0;
+	relay->stream = NULL;
+	relay->media_fd = -1;
+
+	if (relay->media_watch) {
+		g_source_remove(relay->media_watch);
+		relay->media_watch = 0;
+	}
+}
+
+static gboolean relay_setup(struct a2dp_relay *relay, const a2dp_sbc_t *config)
+{
+	unsigned int blocks;
+
+	switch (config->frequency) {
+	case SBC_SAMPLING_FREQ_16000:
+		relay->rate = 16000;
+		break;
+	case SBC_SAMPLING_FREQ_32000:
+		relay->rate = 32000;
+		break;
+	case SBC_SAMPLING_FREQ_44100:
+		relay->rate = 44100;
+		break;
+	case SBC_SAMPLING_FREQ_48000:
+		relay->rate = 48000;
+		break;
+	default:
+		return FALSE;
+	}
+
+	switch (config->block_length) {
+	case SBC_BLOCK_LENGTH_4:
+		blocks = 4;
+		break;
+	case SBC_BLOCK_LENGTH_8:
+		blocks = 8;
+		break;
+	case SBC_BLOCK_LENGTH_12:
+		blocks = 12;
+		break;
+	case SBC_BLOCK_LENGTH_16:
+		blocks = 16;
+		break;
+	default:
+		return FALSE;
+	}
+
+	relay->frame_samples = blocks *
+			(config->subbands == SBC_SUBBANDS_4 ? 4 : 8);
+	relay->channels = config->channel_mode == SBC_CHANNEL_MODE_MONO ?
+									1 : 2;
+
+	return TRUE;
+}
+
+struct a2dp_relay *a2dp_relay_new(struct avdtp *session,
+					struct avdtp_stream *stream, int *fd)
+{
+	struct avdtp_service_capability *cap;
+	struct avdtp_media_codec_capability *codec_cap;
+	struct a2dp_relay *relay;
+	GIOChannel *io;
+	uint16_t imtu;
+	int media_fd, sv[2], i;
+
+	cap = avdtp_stream_get_codec(stream);
+	if (cap == NULL)
+		return NULL;
+
+	codec_cap = (void *) cap->data;
+	if (codec_cap->media_codec_type != A2DP_CODEC_SBC)
+		return NULL;
+
+	if (!avdtp_stream_get_transport(stream, &media_fd, &imtu, NULL, NULL))
+		return NULL;
+
+	relay = g_new0(struct a2dp_relay, 1);
+
+	if (!relay_setup(relay, (void *) codec_cap->data)) {
+		error("A2DP relay: unsupported SBC configuration");
+		g_free(relay);
+		return NULL;
+	}
+
+	if (sbc_init(&relay->sbc, 0) < 0) {
+		error("A2DP relay: can't set up the SBC decoder");
+		g_free(relay);
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		error("A2DP relay: socketpair: %s (%d)", strerror(errno),
+									errno);
+		sbc_finish(&relay->sbc);
+		g_free(relay);
+		return NULL;
+	}
+
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+	relay->session = avdtp_ref(session);
+	relay->stream = stream;
+	relay->media_fd = media_fd;
+	relay->client_fd = sv[0];
+	relay->imtu = imtu;
+
+	relay->pkt = g_malloc(imtu);
+	for (i = 0; i < RELAY_SLOTS; i++)
+		relay->slots[i].data = g_malloc(imtu);
+
+	relay->pcm_size = relay->rate / 2;
+	relay->pcm[0] = g_new(int16_t, relay->pcm_size);
+	relay->pcm[1] = g_new(int16_t, relay->pcm_size);
+
+	relay->out_frames = relay->rate * RELAY_TICK_MS * 4 / 1000;
+	relay->out = g_new(int16_t, relay->out_frames * relay->channels);
+
+	relay->target_ms = RELAY_MIN_TARGET_MS;
+	relay->start = get_usec();
+	relay->clean_since = relay->start;
+	relay->last_report = relay->start;
+
+	io = g_io_channel_unix_new(media_fd);
+	relay->media_watch = g_io_add_watch(io,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				media_cb, relay);
+	g_io_channel_unref(io);
+
+	relay->timer = g_timeout_add(RELAY_TICK_MS, relay_tick, relay);
+
+	relay->cb_id = avdtp_stream_add_cb(session, stream,
+					stream_state_changed, relay);
+
+	DBG("A2DP relay: %u Hz %u channels, MTU %u", relay->rate,
+						relay->channels, imtu);
+
+	*fd = sv[1];
+
+	return relay;
+}
+
+void a2dp_relay_get_stats(struct a2dp_relay *relay, unsigned int *depth_ms,
+				int *drift_ppm, unsigned long *underruns,
+				unsigned long *lost)
+{
+	if (depth_ms)
+		*depth_ms = relay->depth_avg;
+	if (drift_ppm)
+		*drift_ppm = relay->integral;
+	if (underruns)
+		*underruns = relay->underruns;
+	if (lost)
+		*lost = relay->lost;
+}
+
+void a2dp_relay_free(struct a2dp_relay *relay)
+{
+	int i;
+
+	DBG("A2DP relay: drift %+.0f ppm, %lu underruns %lu lost %lu late "
+			"%lu overruns", relay->integral, relay->underruns,
+			relay->lost, relay->late, relay->overruns);
+
+	relay_stop(relay);
+
+	if (relay->cb_id)
+		avdtp_stream_remove_cb(relay->session, relay->stream,
+								relay->cb_id);
+
+	avdtp_unref(relay->session);
+
+	close(relay->client_fd);
+
+	sbc_finish(&relay->sbc);
+
+	for (i = 0; i < RELAY_SLOTS; i++)
+		g_free(relay->slots[i].data);
+
+	g_free(relay->pkt);
+	g_free(relay->pcm[0]);
+	g_free(relay->pcm[1]);
+	g_free(relay->out);
+	g_free(relay);
+}
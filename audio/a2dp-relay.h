@@ -0,0 +1,41 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct a2dp_relay;
+
+/* Receives the SBC stream of a remote A2DP source and hands it to a local
+ * socket as interleaved native endian 16 bit PCM at the configured rate
+ * and channels. Packets go through a jitter buffer ordered by RTP sequence
+ * and timestamp, and are played out against CLOCK_MONOTONIC with a slight
+ * resampling that keeps the buffer at its target depth, absorbing the
+ * drift between the source clock and the local one. On success *fd is the
+ * client end, owned by the caller. */
+struct a2dp_relay *a2dp_relay_new(struct avdtp *session,
+					struct avdtp_stream *stream, int *fd);
+void a2dp_relay_free(struct a2dp_relay *relay);
+
+/* Current buffer depth and estimated source clock drift, positive when
+ * the source runs faster than the local clock */
+void a2dp_relay_get_stats(struct a2dp_relay *relay, unsigned int *depth_ms,
+				int *drift_ppm, unsigned long *underruns,
+				unsigned long *lost);
@@ -28,6 +28,7 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include <dbus/dbus.h>
 #include <glib.h>
@@ -53,6 +54,14 @@
 #define SUSPEND_TIMEOUT 5
 #define RECONFIGURE_TIMEOUT 500
 
+/* Streams are kept in STREAMING state after their users suspend them for as
+ * long as the gap before they were resumed stayed for IDLE_PERCENTILE % of
+ * the last IDLE_GAPS idle periods, provided that is no longer than
+ * MAX_IDLE_TIMEOUT milliseconds. Otherwise they are suspended right away. */
+#define IDLE_GAPS 16
+#define IDLE_PERCENTILE 90
+#define MAX_IDLE_TIMEOUT 5000
+
 #ifndef MIN
 # define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
@@ -74,6 +83,11 @@ struct a2dp_sep {
 	gboolean locked;
 	gboolean suspending;
 	gboolean starting;
+	guint idle_timeout;		/* Fixed suspend delay in ms, 0 adaptive */
+	uint64_t idle_since;		/* When the stream was last suspended */
+	bdaddr_t idle_dst;		/* Device the gaps were observed with */
+	guint idle_gaps[IDLE_GAPS];	/* Last gaps between bursts in ms */
+	int idle_count;
 };
 
 struct a2dp_setup_cb {
@@ -926,6 +940,67 @@ static void open_cfm(struct avdtp *session, struct avdtp_local_sep *sep,
 	finalize_config(setup);
 }
 
+static uint64_t get_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int cmp_gap(gconstpointer a, gconstpointer b)
+{
+	guint gap_a = *(const guint *) a, gap_b = *(const guint *) b;
+
+	return gap_a < gap_b ? -1 : gap_a > gap_b;
+}
+
+/* Records how long the stream stayed idle, called when it is resumed */
+static void sep_record_gap(struct a2dp_sep *sep, struct avdtp *session)
+{
+	bdaddr_t src, dst;
+	uint64_t gap;
+
+	if (!sep->idle_since)
+		return;
+
+	gap = get_msec() - sep->idle_since;
+	sep->idle_since = 0;
+
+	avdtp_get_peers(session, &src, &dst);
+	if (bacmp(&dst, &sep->idle_dst) != 0) {
+		bacpy(&sep->idle_dst, &dst);
+		sep->idle_count = 0;
+	}
+
+	sep->idle_gaps[sep->idle_count++ % IDLE_GAPS] = MIN(gap, G_MAXUINT);
+}
+
+/* Returns how long in ms to wait before suspending the stream */
+static guint sep_suspend_delay(struct a2dp_sep *sep)
+{
+	guint gaps[IDLE_GAPS];
+	int count;
+
+	if (sep->idle_timeout)
+		return sep->idle_timeout;
+
+	count = MIN(sep->idle_count, IDLE_GAPS);
+	if (count < IDLE_GAPS / 4)
+		return 0;
+
+	memcpy(gaps, sep->idle_gaps, count * sizeof(guint));
+	qsort(gaps, count, sizeof(guint), cmp_gap);
+
+	count = (count * IDLE_PERCENTILE + 99) / 100 - 1;
+	if (gaps[count] > MAX_IDLE_TIMEOUT)
+		return 0;
+
+	/* a little slack over the gap observed */
+	return MIN(gaps[count] + gaps[count] / 4 + 100, MAX_IDLE_TIMEOUT);
+}
+
 static gboolean suspend_timeout(struct a2dp_sep *sep)
 {
 	if (avdtp_suspend(sep->session, sep->stream) == 0)
@@ -939,6 +1014,23 @@ static gboolean suspend_timeout(struct a2dp_sep *sep)
 	return FALSE;
 }
 
+/* Suspends the stream once it stayed unused for delay ms, resuming it in
+ * the meantime cancels the timer like for remote initiated streams */
+static void sep_defer_suspend(struct a2dp_sep *sep, struct avdtp *session,
+								guint delay)
+{
+	DBG("SEP %p: suspending in %u ms", sep->lsep, delay);
+
+	if (sep->suspend_timer)
+		g_source_remove(sep->suspend_timer);
+	else
+		sep->session = avdtp_ref(session);
+
+	sep->suspend_timer = g_timeout_add(delay,
+						(GSourceFunc) suspend_timeout,
+						sep);
+}
+
 static gboolean start_ind(struct avdtp *session, struct avdtp_local_sep *sep,
 				struct avdtp_stream *stream, uint8_t *err,
 				void *user_data)
@@ -2179,6 +2271,8 @@ unsigned int a2dp_resume(struct avdtp *session, struct a2dp_sep *sep,
 	setup->sep = sep;
 	setup->stream = sep->stream;
 
+	sep_record_gap(sep, session);
+
 	switch (avdtp_sep_get_state(sep->lsep)) {
 	case AVDTP_STATE_IDLE:
 		goto failed;
@@ -2219,6 +2313,7 @@ unsigned int a2dp_suspend(struct avdtp *session, struct a2dp_sep *sep,
 {
 	struct a2dp_setup_cb *cb_data;
 	struct a2dp_setup *setup;
+	guint delay;
 
 	setup = a2dp_setup_get(session);
 	if (!setup)
@@ -2240,6 +2335,15 @@ unsigned int a2dp_suspend(struct avdtp *session, struct a2dp_sep *sep,
 		cb_data->source_id = g_idle_add(finalize_suspend, setup);
 		break;
 	case AVDTP_STATE_STREAMING:
+		sep->idle_since = get_msec();
+		delay = sep->suspending ? 0 : sep_suspend_delay(sep);
+		if (delay > 0) {
+			/* report it suspended, keep it streaming a while */
+			sep_defer_suspend(sep, session, delay);
+			cb_data->source_id = g_idle_add(finalize_suspend,
+								setup);
+			break;
+		}
 		if (avdtp_suspend(session, sep->stream) < 0) {
 			error("avdtp_suspend failed");
 			goto failed;
@@ -2304,6 +2408,7 @@ gboolean a2dp_sep_unlock(struct a2dp_sep *sep, struct avdtp *session)
 {
 	struct a2dp_server *server = sep->server;
 	avdtp_state_t state;
+	guint delay;
 	GSList *l;
 
 	state = avdtp_sep_get_state(sep->lsep);
@@ -2331,7 +2436,15 @@ gboolean a2dp_sep_unlock(struct a2dp_sep *sep, struct avdtp *session)
 		/* Set timer here */
 		break;
 	case AVDTP_STATE_STREAMING:
-		if (avdtp_suspend(session, sep->stream) == 0)
+		/* already scheduled by a2dp_suspend() */
+		if (sep->suspend_timer)
+			break;
+		if (!sep->idle_since)
+			sep->idle_since = get_msec();
+		delay = sep->suspending ? 0 : sep_suspend_delay(sep);
+		if (delay > 0)
+			sep_defer_suspend(sep, session, delay);
+		else if (avdtp_suspend(session, sep->stream) == 0)
 			sep->suspending = TRUE;
 		break;
 	default:
@@ -2341,6 +2454,16 @@ gboolean a2dp_sep_unlock(struct a2dp_sep *sep, struct avdtp *session)
 	return TRUE;
 }
 
+void a2dp_sep_set_suspend_timeout(struct a2dp_sep *sep, guint timeout)
+{
+	sep->idle_timeout = timeout;
+}
+
+guint a2dp_sep_get_suspend_timeout(struct a2dp_sep *sep)
+{
+	return sep->idle_timeout;
+}
+
 gboolean a2dp_sep_get_lock(struct a2dp_sep *sep)
 {
 	return sep->locked;
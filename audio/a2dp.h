@@ -160,5 +160,10 @@ gboolean a2dp_sep_lock(struct a2dp_sep *sep, struct avdtp *session);
 gboolean a2dp_sep_unlock(struct a2dp_sep *sep, struct avdtp *session);
 gboolean a2dp_sep_get_lock(struct a2dp_sep *sep);
 struct avdtp_stream *a2dp_sep_get_stream(struct a2dp_sep *sep);
+
+/* Delay in milliseconds between a stream being released or suspended by
+ * its users and its suspension, 0 picks it from the observed usage */
+void a2dp_sep_set_suspend_timeout(struct a2dp_sep *sep, guint timeout);
+guint a2dp_sep_get_suspend_timeout(struct a2dp_sep *sep);
 struct a2dp_sep *a2dp_get_sep(struct avdtp *session,
 				struct avdtp_stream *stream);
@@ -21,10 +21,14 @@
 //#define LOG_NDEBUG 0
 
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 
@@ -63,19 +67,24 @@
 #define BUF_WRITE_AVAILABILITY_TIMEOUT_MS 5000
 /* maximum number of attempts to wait for a write completion in out_standby_stream_locked() */
 #define MAX_WRITE_COMPLETION_ATTEMPTS 5
+/* sink buffering and rendering delay assumed when the sink sends no AVDTP delay report */
+#define DEFAULT_SINK_DELAY_US 200000
 
-/* NOTE: there are 2 mutexes used by the a2dp output stream.
+/* NOTE: there is 1 mutex used by the a2dp output stream.
  *  - lock: protects all calls to a2dp lib functions (a2dp_stop(), a2dp_cleanup()...).
  *    One exception is a2dp_write() which is also protected by the flag write_busy. This is because
  *    out_write() cannot block waiting for a2dp_write() to complete because this function
  *    can sleep to throttle the A2DP bit rate.
  *    This flag is always set/reset and tested with "lock" mutex held.
- *  - buf_lock: protects access to pcm buffer read and write indexes.
  *
- *  The locking order is always as follows:
- *      buf_lock -> lock
+ * The pcm buffer is a single producer (out_write()) / single consumer (write thread) ring
+ * and needs no lock: buf_wr_idx is only modified by the producer and buf_rd_idx only by the
+ * consumer. The indexes run over twice the buffer size so that a full buffer can be told
+ * from an empty one. The producer signals buf_data_fd when the buffer stops being empty and
+ * the consumer signals buf_space_fd when it stops being full, so that no wakeup is needed
+ * while both sides keep up.
  *
- * If you need to hold the adev_a2dp->lock AND the astream_out->lock or astream_out->buf_lock,
+ * If you need to hold the adev_a2dp->lock AND the astream_out->lock,
  * you MUST take adev_a2dp lock first!!
  */
 
@@ -118,17 +127,16 @@ struct astream_out {
 
     uint32_t *buf;              /* pcm buffer between audioflinger thread and write thread*/
     size_t buf_size;            /* size of pcm buffer in frames */
-    size_t buf_rd_idx;          /* read index in pcm buffer, in frames*/
-    size_t buf_wr_idx;          /* write index in pcm buffer, in frames */
-    size_t buf_frames_ready;    /* number of frames ready for writing to a2dp sink */
-    pthread_mutex_t buf_lock;   /* mutex protecting read and write indexes */
-                                /* see NOTE on mutex locking order above */
-    pthread_cond_t buf_cond;    /* condition signaling data write/read to/from pcm buffer */
+    volatile int32_t buf_rd_idx; /* read index in pcm buffer modulo 2 * buf_size, in frames */
+    volatile int32_t buf_wr_idx; /* write index in pcm buffer modulo 2 * buf_size, in frames */
+    int buf_data_fd;            /* eventfd signaled when the pcm buffer stops being empty */
+    int buf_space_fd;           /* eventfd signaled when the pcm buffer stops being full */
     pthread_t buf_thread;       /* thread reading data from buffer and writing to a2dp sink*/
-    bool buf_thread_exit;       /* flag requesting write thread exit */
+    volatile bool buf_thread_exit; /* flag requesting write thread exit */
     bool write_busy;            /* indicates that a write to a2dp sink is in progress and that
                                    standby must wait for this flag to be cleared by write thread */
     pthread_cond_t write_cond;  /* condition associated with write_busy flag */
+    uint64_t frames_written;    /* frames accepted by out_write() since leaving standby */
 };
 
 static uint64_t system_time(void)
@@ -186,11 +194,39 @@ static int out_dump(const struct audio_stream *stream, int fd)
     return 0;
 }
 
+static size_t _out_frames_queued(struct astream_out *out, int32_t rd_idx, int32_t wr_idx);
+
+/* end to end latency: frames in the pcm buffer, encoded data held by liba2dp and the delay
+ * reported by the sink. Must be called with out->lock held. */
+static uint32_t _out_get_latency_us_locked(struct astream_out *out)
+{
+    unsigned int local = 0, sink = 0;
+    uint64_t latency;
+
+    latency = (uint64_t)_out_frames_queued(out, out->buf_rd_idx, out->buf_wr_idx) *
+            1000000 / out->sample_rate;
+
+    if (!out->data || out->standby ||
+        a2dp_get_latency(out->data, &local, &sink) < 0) {
+        /* nothing measured yet, report the worst case of a full pcm buffer */
+        latency = (uint64_t)out->buffer_duration_us * BUF_NUM_PERIODS;
+        local = 0;
+        sink = 0;
+    }
+
+    return latency + local + (sink ? sink : DEFAULT_SINK_DELAY_US);
+}
+
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
-    const struct astream_out *out = (const struct astream_out *)stream;
+    struct astream_out *out = (struct astream_out *)stream;
+    uint32_t latency_us;
+
+    pthread_mutex_lock(&out->lock);
+    latency_us = _out_get_latency_us_locked(out);
+    pthread_mutex_unlock(&out->lock);
 
-    return ((out->buffer_duration_us * BUF_NUM_PERIODS) / 1000) + 200;
+    return latency_us / 1000;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -202,7 +238,28 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -ENOSYS;
+    struct astream_out *out = (struct astream_out *)stream;
+    uint64_t pending;
+
+    if (!dsp_frames)
+        return -EINVAL;
+
+    /* compressed streams have no frame count to report */
+    if (out->format != AUDIO_FORMAT_PCM_16_BIT)
+        return -ENOSYS;
+
+    pthread_mutex_lock(&out->lock);
+    if (out->standby) {
+        pthread_mutex_unlock(&out->lock);
+        return -ENODATA;
+    }
+
+    /* frames written that the sink has not played yet */
+    pending = (uint64_t)_out_get_latency_us_locked(out) * out->sample_rate / 1000000;
+    *dsp_frames = out->frames_written > pending ? out->frames_written - pending : 0;
+    pthread_mutex_unlock(&out->lock);
+
+    return 0;
 }
 
 static int _out_init_locked(struct astream_out *out, const char *addr)
@@ -212,8 +269,12 @@ static int _out_init_locked(struct astream_out *out, const char *addr)
     if (out->data)
         return 0;
 
-    /* XXX: shouldn't this use the sample_rate/channel_count from 'out'? */
-    ret = a2dp_init(A2DP_SAMPLE_RATE, 2, &out->data);
+    if (out->format == AUDIO_FORMAT_MP3)
+        /* compressed stream, frames are sent to the sink as they are */
+        ret = a2dp_init_format(out->sample_rate, 2, A2DP_FORMAT_MPEG12, &out->data);
+    else
+        /* XXX: shouldn't this use the sample_rate/channel_count from 'out'? */
+        ret = a2dp_init(A2DP_SAMPLE_RATE, 2, &out->data);
     if (ret < 0) {
         ALOGE("a2dp_init failed err: %d\n", ret);
         out->data = NULL;
@@ -258,6 +319,13 @@ static int out_standby_stream_locked(struct astream_out *out)
 
     ALOGV_IF(!out->bt_enabled, "Standby skip stop: enabled %d", out->bt_enabled);
     if (out->bt_enabled) {
+        struct a2dp_stats stats;
+
+        if (a2dp_get_stats(out->data, &stats) == 0)
+            ALOGV("a2dp pacing: %u packets, %u late, %u early, %u resyncs, "
+                  "max jitter %u us, bitpool %u (%u changes)", stats.packets,
+                  stats.late, stats.early, stats.resyncs, stats.max_jitter,
+                  stats.bitpool, stats.bitpool_changes);
         ret = a2dp_stop(out->data);
     }
     release_wake_lock(A2DP_WAKE_LOCK_NAME);
@@ -365,44 +433,119 @@ static char * out_get_parameters(const struct audio_stream *stream,
     return str;
 }
 
-size_t _out_frames_available_locked(struct astream_out *out)
+static size_t _out_frames_queued(struct astream_out *out, int32_t rd_idx, int32_t wr_idx)
 {
+    if (wr_idx >= rd_idx)
+        return wr_idx - rd_idx;
+    return wr_idx + 2 * out->buf_size - rd_idx;
+}
+
+static uint32_t *_out_buf_ptr(struct astream_out *out, int32_t idx)
+{
+    if ((size_t)idx >= out->buf_size)
+        idx -= out->buf_size;
+    return out->buf + idx;
+}
+
+static int32_t _out_idx_add(struct astream_out *out, int32_t idx, size_t frames)
+{
+    idx += frames;
+    if ((size_t)idx >= 2 * out->buf_size)
+        idx -= 2 * out->buf_size;
+    return idx;
+}
 
-    size_t frames = out->buf_size - out->buf_frames_ready;
-    if (frames > out->buf_size - out->buf_wr_idx) {
-        frames = out->buf_size - out->buf_wr_idx;
+/* contiguous room in the pcm buffer, only called by out_write() */
+static size_t _out_frames_available(struct astream_out *out)
+{
+    int32_t rd_idx = android_atomic_acquire_load(&out->buf_rd_idx);
+    int32_t wr_idx = out->buf_wr_idx;
+    size_t frames = out->buf_size - _out_frames_queued(out, rd_idx, wr_idx);
+    size_t pos = _out_buf_ptr(out, wr_idx) - out->buf;
+
+    if (frames > out->buf_size - pos) {
+        frames = out->buf_size - pos;
     }
     return frames;
 }
 
-size_t _out_frames_ready_locked(struct astream_out *out)
+/* contiguous frames in the pcm buffer, only called by the write thread */
+static size_t _out_frames_ready(struct astream_out *out)
 {
-    size_t frames = out->buf_frames_ready;
+    int32_t wr_idx = android_atomic_acquire_load(&out->buf_wr_idx);
+    int32_t rd_idx = out->buf_rd_idx;
+    size_t frames = _out_frames_queued(out, rd_idx, wr_idx);
+    size_t pos = _out_buf_ptr(out, rd_idx) - out->buf;
 
-    if (frames > out->buf_size - out->buf_rd_idx) {
-        frames = out->buf_size - out->buf_rd_idx;
+    if (frames > out->buf_size - pos) {
+        frames = out->buf_size - pos;
     }
     return frames;
 }
 
-void _out_inc_wr_idx_locked(struct astream_out *out, size_t frames)
+static void _out_signal_event(int fd)
 {
-    out->buf_wr_idx += frames;
-    out->buf_frames_ready += frames;
-    if (out->buf_wr_idx == out->buf_size) {
-        out->buf_wr_idx = 0;
-    }
-    pthread_cond_signal(&out->buf_cond);
+    uint64_t val = 1;
+
+    if (write(fd, &val, sizeof(val)) < 0)
+        ALOGE("%s: eventfd write failed (%d)", __func__, errno);
 }
 
-void _out_inc_rd_idx_locked(struct astream_out *out, size_t frames)
+/* returns 1 if the event was signaled, 0 on timeout or a negative error */
+static int _out_wait_event(int fd, int timeout_ms)
 {
-    out->buf_rd_idx += frames;
-    out->buf_frames_ready -= frames;
-    if (out->buf_rd_idx == out->buf_size) {
-        out->buf_rd_idx = 0;
-    }
-    pthread_cond_signal(&out->buf_cond);
+    struct pollfd pfd;
+    uint64_t val;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0)
+        return ret < 0 ? -errno : 0;
+
+    if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+        return -errno;
+
+    return 1;
+}
+
+static void _out_inc_wr_idx(struct astream_out *out, size_t frames)
+{
+    int32_t rd_idx = android_atomic_acquire_load(&out->buf_rd_idx);
+    int32_t wr_idx = out->buf_wr_idx;
+
+    android_atomic_release_store(_out_idx_add(out, wr_idx, frames), &out->buf_wr_idx);
+
+    /* the write thread only sleeps on an empty buffer */
+    if (rd_idx == wr_idx)
+        _out_signal_event(out->buf_data_fd);
+}
+
+static void _out_inc_rd_idx(struct astream_out *out, size_t frames)
+{
+    int32_t wr_idx = android_atomic_acquire_load(&out->buf_wr_idx);
+    int32_t rd_idx = out->buf_rd_idx;
+
+    android_atomic_release_store(_out_idx_add(out, rd_idx, frames), &out->buf_rd_idx);
+
+    /* out_write() only sleeps on a full buffer */
+    if (_out_frames_queued(out, rd_idx, wr_idx) == out->buf_size)
+        _out_signal_event(out->buf_space_fd);
+}
+
+/* drops all frames queued in the pcm buffer, only called by the write thread */
+static void _out_flush(struct astream_out *out)
+{
+    size_t frames;
+
+    while ((frames = _out_frames_ready(out)) > 0)
+        _out_inc_rd_idx(out, frames);
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -414,7 +557,6 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     uint32_t *buf = (uint32_t *)buffer;
     size_t frames_written = 0;
 
-    pthread_mutex_lock(&out->buf_lock);
     pthread_mutex_lock(&out->lock);
     if (!out->bt_enabled || out->suspended) {
         ALOGV("a2dp %s: bluetooth disabled bt_en %d, suspended %d",
@@ -427,9 +569,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         acquire_wake_lock(PARTIAL_WAKE_LOCK, A2DP_WAKE_LOCK_NAME);
         out->standby = false;
         out->last_write_time = system_time();
-        out->buf_rd_idx = 0;
-        out->buf_wr_idx = 0;
-        out->buf_frames_ready = 0;
+        out->frames_written = 0;
+        /* frames left over from before standby were dropped by the write thread */
     }
 
     ret = _out_init_locked(out, NULL);
@@ -437,41 +578,58 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         goto err_init;
     }
 
+    if (out->format == AUDIO_FORMAT_MP3) {
+        /* compressed frames bypass the pcm buffer: liba2dp queues encoded packets itself,
+         * so a2dp_write() only blocks while its packet queue is full */
+        out->write_busy = true;
+        pthread_mutex_unlock(&out->lock);
+
+        ret = a2dp_write(out->data, buffer, bytes);
+
+        pthread_mutex_lock(&out->lock);
+        out->write_busy = false;
+        pthread_cond_signal(&out->write_cond);
+        if (ret < 0) {
+            goto err_write;
+        }
+        pthread_mutex_unlock(&out->lock);
+        return bytes;
+    }
+
     pthread_mutex_unlock(&out->lock);
 
     while (frames_written < frames_total) {
-        size_t frames = _out_frames_available_locked(out);
+        size_t frames = _out_frames_available(out);
         if (frames == 0) {
-            int ret = pthread_cond_timeout_np(&out->buf_cond,
-                                              &out->buf_lock,
-                                              BUF_WRITE_AVAILABILITY_TIMEOUT_MS);
-            if (ret != 0) {
+            int ret = _out_wait_event(out->buf_space_fd,
+                                      BUF_WRITE_AVAILABILITY_TIMEOUT_MS);
+            if (ret <= 0) {
                 pthread_mutex_lock(&out->lock);
                 goto err_write;
             }
-            frames  = _out_frames_available_locked(out);
+            continue;
         }
         if (frames > frames_total - frames_written) {
             frames = frames_total - frames_written;
         }
-        memcpy(out->buf + out->buf_wr_idx, buf + frames_written, frames * sizeof(uint32_t));
+        memcpy(_out_buf_ptr(out, out->buf_wr_idx), buf + frames_written,
+               frames * sizeof(uint32_t));
         frames_written += frames;
-        _out_inc_wr_idx_locked(out, frames);
+        _out_inc_wr_idx(out, frames);
         pthread_mutex_lock(&out->lock);
         if (out->standby) {
             goto err_write;
         }
+        out->frames_written += frames;
         pthread_mutex_unlock(&out->lock);
     }
-    pthread_mutex_unlock(&out->buf_lock);
 
     return bytes;
 
-/* out->lock must be locked and out->buf_lock unlocked when jumping here */
+/* out->lock must be locked when jumping here */
 err_write:
 err_init:
 err_bt_disabled:
-    pthread_mutex_unlock(&out->buf_lock);
     ALOGV("!!!! write error");
     out_standby_stream_locked(out);
     pthread_mutex_unlock(&out->lock);
@@ -486,20 +644,17 @@ static void *_out_buf_thread_func(void *context)
 {
     struct astream_out *out = (struct astream_out *)context;
 
-    pthread_mutex_lock(&out->buf_lock);
+    a2dp_set_thread_policy("a2dp_out_buf");
 
     while(!out->buf_thread_exit) {
         size_t frames;
 
-        frames = _out_frames_ready_locked(out);
+        frames = _out_frames_ready(out);
         while (frames && !out->buf_thread_exit) {
             int retries = MAX_WRITE_RETRIES;
-            uint64_t now;
-            uint32_t elapsed_us;
 
             while (frames > 0 && !out->buf_thread_exit) {
                 int ret;
-                uint32_t buffer_duration_us;
                 /* PCM format is always 16bit stereo */
                 size_t bytes = frames * sizeof(uint32_t);
                 if (bytes > out->buffer_size) {
@@ -510,19 +665,16 @@ static void *_out_buf_thread_func(void *context)
                 if (out->standby) {
                     /* abort and clear all pending frames if standby requested */
                     pthread_mutex_unlock(&out->lock);
-                    frames = _out_frames_ready_locked(out);
-                    _out_inc_rd_idx_locked(out, frames);
+                    _out_flush(out);
                     goto wait;
                 }
                 /* indicate to out_standby_stream_locked() that a2dp_write() is active */
                 out->write_busy = true;
                 pthread_mutex_unlock(&out->lock);
-                pthread_mutex_unlock(&out->buf_lock);
 
-                ret = a2dp_write(out->data, out->buf + out->buf_rd_idx, bytes);
+                ret = a2dp_write(out->data, _out_buf_ptr(out, out->buf_rd_idx), bytes);
 
                 /* clear write_busy condition */
-                pthread_mutex_lock(&out->buf_lock);
                 pthread_mutex_lock(&out->lock);
                 out->write_busy = false;
                 pthread_cond_signal(&out->write_cond);
@@ -531,44 +683,30 @@ static void *_out_buf_thread_func(void *context)
                 if (ret < 0) {
                     ALOGE("%s: a2dp_write failed (%d)\n", __func__, ret);
                     /* skip pending frames in case of write error */
-                    _out_inc_rd_idx_locked(out, frames);
+                    _out_inc_rd_idx(out, frames);
                     break;
                 } else if (ret == 0) {
                     if (retries-- == 0) {
                         /* skip pending frames in case of multiple time out */
-                        _out_inc_rd_idx_locked(out, frames);
+                        _out_inc_rd_idx(out, frames);
                         break;
                     }
                     continue;
                 }
                 ret /= sizeof(uint32_t);
-                _out_inc_rd_idx_locked(out, ret);
+                _out_inc_rd_idx(out, ret);
                 frames -= ret;
 
-                /* XXX: PLEASE FIX ME!!!! */
-
-                /* if A2DP sink runs abnormally fast, sleep a little so that
-                 * audioflinger mixer thread does no spin and starve other threads. */
-                /* NOTE: It is likely that the A2DP headset is being disconnected */
-                now = system_time();
-                elapsed_us = (now - out->last_write_time) / 1000UL;
-                buffer_duration_us = ((ret * 1000) / out->sample_rate) * 1000;
-
-                if (elapsed_us < (buffer_duration_us / 4)) {
-                    ALOGV("A2DP sink runs too fast");
-                    usleep(buffer_duration_us - elapsed_us);
-                }
-                out->last_write_time = now;
-
+                /* a2dp_write() paces its packets against the A2DP clock */
+                out->last_write_time = system_time();
             }
-            frames = _out_frames_ready_locked(out);
+            frames = _out_frames_ready(out);
         }
 wait:
         if (!out->buf_thread_exit) {
-            pthread_cond_wait(&out->buf_cond, &out->buf_lock);
+            _out_wait_event(out->buf_data_fd, -1);
         }
     }
-    pthread_mutex_unlock(&out->buf_lock);
     return NULL;
 }
 
@@ -665,6 +803,14 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->buffer_size = 512 * 20;
     out->channels = AUDIO_CHANNEL_OUT_STEREO;
     out->format = AUDIO_FORMAT_PCM_16_BIT;
+#ifdef AUDIO_DEVICE_API_VERSION_1_0
+    /* direct outputs may pass MP3 through to sinks with an MPEG-1,2 endpoint */
+    if (config->format == AUDIO_FORMAT_MP3 && (flags & AUDIO_OUTPUT_FLAG_DIRECT)) {
+        out->format = AUDIO_FORMAT_MP3;
+        if (config->sample_rate)
+            out->sample_rate = config->sample_rate;
+    }
+#endif
 
     out->fd = -1;
     out->device = devices;
@@ -692,18 +838,27 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         goto err_validate_parms;
     }
 
-    int err = pthread_create(&out->buf_thread, (const pthread_attr_t *) NULL, _out_buf_thread_func, out);
-    if (err != 0) {
-        goto err_validate_parms;
-    }
-
     /* PCM format is always 16bit, stereo */
     out->buf_size = (out->buffer_size * BUF_NUM_PERIODS) / sizeof(int32_t);
     out->buf = (uint32_t *)malloc(out->buf_size * sizeof(int32_t));
     if (!out->buf) {
+        ret = -ENOMEM;
         goto err_validate_parms;
     }
 
+    out->buf_data_fd = eventfd(0, EFD_NONBLOCK);
+    out->buf_space_fd = eventfd(0, EFD_NONBLOCK);
+    if (out->buf_data_fd < 0 || out->buf_space_fd < 0) {
+        ret = -errno;
+        goto err_eventfd;
+    }
+
+    int err = pthread_create(&out->buf_thread, (const pthread_attr_t *) NULL, _out_buf_thread_func, out);
+    if (err != 0) {
+        ret = -err;
+        goto err_eventfd;
+    }
+
     /* XXX: check return code? */
     if (adev->bt_enabled)
         _out_init_locked(out, "00:00:00:00:00:00");
@@ -728,6 +883,12 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     return 0;
 
+err_eventfd:
+    if (out->buf_data_fd >= 0)
+        close(out->buf_data_fd);
+    if (out->buf_space_fd >= 0)
+        close(out->buf_space_fd);
+    free(out->buf);
 err_validate_parms:
     free(out);
 err_alloc:
@@ -756,14 +917,12 @@ static void adev_close_output_stream_locked(struct adev_a2dp *dev,
     out_close_stream_locked(out);
     pthread_mutex_unlock(&out->lock);
     if (out->buf_thread) {
-        pthread_mutex_lock(&out->buf_lock);
         out->buf_thread_exit = true;
-        pthread_cond_broadcast(&out->buf_cond);
-        pthread_mutex_unlock(&out->buf_lock);
+        _out_signal_event(out->buf_data_fd);
         pthread_join(out->buf_thread, (void **) NULL);
-        pthread_cond_destroy(&out->buf_cond);
-        pthread_mutex_destroy(&out->buf_lock);
     }
+    close(out->buf_data_fd);
+    close(out->buf_space_fd);
     if (out->buf) {
         free(out->buf);
     }
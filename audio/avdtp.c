@@ -47,6 +47,7 @@
 #include "../src/adapter.h"
 #include "../src/manager.h"
 #include "../src/device.h"
+#include "../src/storage.h"
 
 #include "device.h"
 #include "manager.h"
@@ -56,6 +57,7 @@
 #include "btio.h"
 #include "sink.h"
 #include "source.h"
+#include "memstat.h"
 
 #define AVDTP_PSM 25
 
@@ -90,6 +92,19 @@
 #define DISCONNECT_TIMEOUT 1
 #define STREAM_TIMEOUT 20
 
+/* Capability requests kept in flight at once in pipelined discovery, the
+ * remaining ones are queued. Leaves transaction labels for the regular
+ * requests. */
+#define MAX_PIPELINED_REQS 8
+
+/* Media packets go ahead of other ACL traffic, highest priority that
+ * does not need CAP_NET_ADMIN */
+#define AVDTP_MEDIA_PRIORITY 6
+
+/* Service capabilities looked at in a single PDU, more than the spec
+ * defines categories */
+#define MAX_CAPS 16
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
 struct avdtp_common_header {
@@ -312,6 +327,15 @@ struct pending_req {
 	guint timeout;
 };
 
+/* Capabilities of a signaling PDU, pointing into it rather than copying */
+struct caps_view {
+	uint8_t *data;
+	int count;
+	uint16_t offset[MAX_CAPS];
+	int codec;			/* Index of the media codec or -1 */
+	gboolean delay_reporting;
+};
+
 struct avdtp_remote_sep {
 	uint8_t seid;
 	uint8_t type;
@@ -328,6 +352,10 @@ struct avdtp_server {
 	GIOChannel *io;
 	GSList *seps;
 	GSList *sessions;
+
+	/* Lookup tables for the signaling path */
+	struct avdtp_local_sep *sep_table[MAX_SEID + 1];
+	GHashTable *session_table; /* Keyed by the bdaddr_t of the peer */
 };
 
 struct avdtp_local_sep {
@@ -403,9 +431,20 @@ struct avdtp {
 
 	GSList *streams; /* Elements of type struct avdtp_stream * */
 
+	/* Indexed by remote SEID */
+	struct avdtp_remote_sep *sep_table[MAX_SEID + 1];
+	struct avdtp_stream *stream_table[MAX_SEID + 1];
+
 	GSList *req_queue; /* Elements of type struct pending_req * */
 	GSList *prio_queue; /* Same as req_queue but is processed before it */
 
+	/* GET_(ALL_)CAPABILITIES requests sent in parallel to session->req,
+	 * elements of type struct pending_req * */
+	GSList *pipeline;
+
+	/* Remote SEPs were loaded from storage rather than discovered */
+	gboolean seps_cached;
+
 	struct avdtp_stream *pending_open;
 
 	uint16_t imtu;
@@ -434,6 +473,10 @@ static GSList *avdtp_callbacks = NULL;
 
 static gboolean auto_connect = TRUE;
 
+static gboolean pipelined_discovery = FALSE;
+
+static gboolean cache_capabilities = FALSE;
+
 static int send_request(struct avdtp *session, gboolean priority,
 			struct avdtp_stream *stream, uint8_t signal_id,
 			void *buffer, size_t size);
@@ -451,6 +494,13 @@ static void avdtp_sep_set_state(struct avdtp *session,
 				struct avdtp_local_sep *sep,
 				avdtp_state_t state);
 static void auth_cb(DBusError *derr, void *user_data);
+static GSList *caps_to_list(uint8_t *data, int size,
+				struct avdtp_service_capability **codec,
+				gboolean *delay_reporting);
+static gboolean avdtp_parse_pipelined(struct avdtp *session,
+					struct pending_req *req,
+					uint8_t message_type,
+					void *buf, int size);
 
 static struct avdtp_server *find_server(GSList *list, const bdaddr_t *src)
 {
@@ -464,6 +514,23 @@ static struct avdtp_server *find_server(GSList *list, const bdaddr_t *src)
 	return NULL;
 }
 
+static guint bdaddr_hash(gconstpointer key)
+{
+	const bdaddr_t *bdaddr = key;
+	guint h = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		h = (h << 5) - h + bdaddr->b[i];
+
+	return h;
+}
+
+static gboolean bdaddr_equal(gconstpointer a, gconstpointer b)
+{
+	return bacmp(a, b) == 0;
+}
+
 static const char *avdtp_statestr(avdtp_state_t state)
 {
 	switch (state) {
@@ -725,30 +792,52 @@ int avdtp_error_posix_errno(struct avdtp_error *err)
 static struct avdtp_stream *find_stream_by_rseid(struct avdtp *session,
 							uint8_t rseid)
 {
-	GSList *l;
+	if (rseid > MAX_SEID)
+		return NULL;
 
-	for (l = session->streams; l != NULL; l = g_slist_next(l)) {
-		struct avdtp_stream *stream = l->data;
+	return session->stream_table[rseid];
+}
 
-		if (stream->rseid == rseid)
-			return stream;
-	}
+static void session_add_stream(struct avdtp *session,
+					struct avdtp_stream *stream)
+{
+	session->streams = g_slist_append(session->streams, stream);
 
-	return NULL;
+	if (stream->rseid <= MAX_SEID)
+		session->stream_table[stream->rseid] = stream;
 }
 
-static struct avdtp_remote_sep *find_remote_sep(GSList *seps, uint8_t seid)
+static void session_remove_stream(struct avdtp *session,
+					struct avdtp_stream *stream)
 {
 	GSList *l;
 
-	for (l = seps; l != NULL; l = g_slist_next(l)) {
-		struct avdtp_remote_sep *sep = l->data;
+	session->streams = g_slist_remove(session->streams, stream);
 
-		if (sep->seid == seid)
-			return sep;
+	if (stream->rseid > MAX_SEID ||
+			session->stream_table[stream->rseid] != stream)
+		return;
+
+	session->stream_table[stream->rseid] = NULL;
+
+	/* Another stream may still be set up towards the same remote SEP */
+	for (l = session->streams; l != NULL; l = g_slist_next(l)) {
+		struct avdtp_stream *s = l->data;
+
+		if (s->rseid == stream->rseid) {
+			session->stream_table[s->rseid] = s;
+			break;
+		}
 	}
+}
 
-	return NULL;
+static struct avdtp_remote_sep *find_remote_sep(struct avdtp *session,
+								uint8_t seid)
+{
+	if (seid > MAX_SEID)
+		return NULL;
+
+	return session->sep_table[seid];
 }
 
 static void avdtp_set_state(struct avdtp *session,
@@ -774,6 +863,45 @@ static void avdtp_set_state(struct avdtp *session,
 	}
 }
 
+static inline size_t caps_size(GSList *caps)
+{
+	size_t size = 0;
+
+	for (; caps != NULL; caps = g_slist_next(caps)) {
+		struct avdtp_service_capability *cap = caps->data;
+
+		size += sizeof(GSList) + sizeof(*cap) + cap->length;
+	}
+
+	return size;
+}
+
+/* Every capability list kept by a stream or SEP goes through these */
+static GSList *caps_hold(GSList *caps)
+{
+	if (caps != NULL)
+		btd_memstat_add(MEMSTAT_AVDTP_CAPS, caps_size(caps));
+
+	return caps;
+}
+
+static void caps_free(GSList *caps)
+{
+	if (caps == NULL)
+		return;
+
+	btd_memstat_sub(MEMSTAT_AVDTP_CAPS, caps_size(caps));
+
+	g_slist_foreach(caps, (GFunc) g_free, NULL);
+	g_slist_free(caps);
+}
+
+static void remote_sep_free(struct avdtp_remote_sep *sep)
+{
+	caps_free(sep->caps);
+	g_free(sep);
+}
+
 static void stream_free(struct avdtp_stream *stream)
 {
 	struct avdtp_remote_sep *rsep;
@@ -781,7 +909,7 @@ static void stream_free(struct avdtp_stream *stream)
 	stream->lsep->info.inuse = 0;
 	stream->lsep->stream = NULL;
 
-	rsep = find_remote_sep(stream->session->seps, stream->rseid);
+	rsep = find_remote_sep(stream->session, stream->rseid);
 	if (rsep)
 		rsep->stream = NULL;
 
@@ -797,8 +925,7 @@ static void stream_free(struct avdtp_stream *stream)
 	g_slist_foreach(stream->callbacks, (GFunc) g_free, NULL);
 	g_slist_free(stream->callbacks);
 
-	g_slist_foreach(stream->caps, (GFunc) g_free, NULL);
-	g_slist_free(stream->caps);
+	caps_free(stream->caps);
 
 	g_free(stream);
 }
@@ -837,46 +964,12 @@ static gboolean transport_cb(GIOChannel *chan, GIOCondition cond,
 	return FALSE;
 }
 
-static int get_send_buffer_size(int sk)
-{
-	int size;
-	socklen_t optlen = sizeof(size);
-
-	if (getsockopt(sk, SOL_SOCKET, SO_SNDBUF, &size, &optlen) < 0) {
-		int err = -errno;
-		error("getsockopt(SO_SNDBUF) failed: %s (%d)", strerror(-err),
-									-err);
-		return err;
-	}
-
-	/*
-	 * Doubled value is returned by getsockopt since kernel uses that
-	 * space for its own purposes (see man 7 socket, bookkeeping overhead
-	 * for SO_SNDBUF).
-	 */
-	return size / 2;
-}
-
-static int set_send_buffer_size(int sk, int size)
-{
-	socklen_t optlen = sizeof(size);
-
-	if (setsockopt(sk, SOL_SOCKET, SO_SNDBUF, &size, optlen) < 0) {
-		int err = -errno;
-		error("setsockopt(SO_SNDBUF) failed: %s (%d)", strerror(-err),
-									-err);
-		return err;
-	}
-
-	return 0;
-}
-
 static void handle_transport_connect(struct avdtp *session, GIOChannel *io,
 					uint16_t imtu, uint16_t omtu)
 {
 	struct avdtp_stream *stream = session->pending_open;
 	struct avdtp_local_sep *sep = stream->lsep;
-	int sk, buf_size, min_buf_size;
+	int buf_size, min_buf_size;
 	GError *err = NULL;
 
 	session->pending_open = NULL;
@@ -912,20 +1005,37 @@ static void handle_transport_connect(struct avdtp *session, GIOChannel *io,
 	if (err != NULL) {
 		error("Enabling flushable packets failed: %s", err->message);
 		g_error_free(err);
+		err = NULL;
 	} else
 		DBG("Flushable packets enabled");
 
-	sk = g_io_channel_unix_get_fd(stream->io);
-	buf_size = get_send_buffer_size(sk);
-	if (buf_size < 0)
+	if (!bt_io_set(stream->io, BT_IO_L2CAP, &err,
+				BT_IO_OPT_PRIORITY, AVDTP_MEDIA_PRIORITY,
+				BT_IO_OPT_INVALID)) {
+		error("Setting media priority failed: %s", err->message);
+		g_error_free(err);
+		err = NULL;
+	}
+
+	if (!bt_io_get(stream->io, BT_IO_L2CAP, &err,
+					BT_IO_OPT_SNDBUF, &buf_size,
+					BT_IO_OPT_INVALID)) {
+		error("%s", err->message);
+		g_error_free(err);
 		goto proceed;
+	}
 
-	DBG("sk %d, omtu %d, send buffer size %d", sk, omtu, buf_size);
+	DBG("omtu %d, send buffer size %d", omtu, buf_size);
 	min_buf_size = omtu * 2;
 	if (buf_size < min_buf_size) {
 		DBG("send buffer size to be increassed to %d",
 				min_buf_size);
-		set_send_buffer_size(sk, min_buf_size);
+		if (!bt_io_set(stream->io, BT_IO_L2CAP, &err,
+					BT_IO_OPT_SNDBUF, min_buf_size,
+					BT_IO_OPT_INVALID)) {
+			error("%s", err->message);
+			g_error_free(err);
+		}
 	}
 
 proceed:
@@ -1084,7 +1194,7 @@ static void avdtp_sep_set_state(struct avdtp *session,
 			g_source_remove(stream->idle_timer);
 			stream->idle_timer = 0;
 		}
-		session->streams = g_slist_remove(session->streams, stream);
+		session_remove_stream(session, stream);
 		if (session->pending_open == stream)
 			handle_transport_connect(session, NULL, 0, 0);
 		if (session->req && session->req->stream == stream)
@@ -1105,6 +1215,176 @@ static void avdtp_sep_set_state(struct avdtp *session,
 		stream_free(stream);
 }
 
+static void pipeline_free(struct avdtp *session)
+{
+	g_slist_foreach(session->pipeline, (GFunc) pending_req_free, NULL);
+	g_slist_free(session->pipeline);
+	session->pipeline = NULL;
+}
+
+static struct pending_req *find_pipelined(struct avdtp *session,
+							uint8_t transaction,
+							uint8_t signal_id)
+{
+	GSList *l;
+
+	for (l = session->pipeline; l != NULL; l = g_slist_next(l)) {
+		struct pending_req *req = l->data;
+
+		if (req->transaction == transaction &&
+						req->signal_id == signal_id)
+			return req;
+	}
+
+	return NULL;
+}
+
+static const sdp_record_t *get_remote_record(struct avdtp *session)
+{
+	struct btd_adapter *adapter;
+	struct btd_device *device;
+	const sdp_record_t *rec;
+	char addr[18];
+
+	adapter = manager_find_adapter(&session->server->src);
+	if (!adapter)
+		return NULL;
+
+	ba2str(&session->dst, addr);
+	device = adapter_find_device(adapter, addr);
+	if (!device)
+		return NULL;
+
+	rec = btd_device_get_record(device, A2DP_SINK_UUID);
+	if (!rec)
+		rec = btd_device_get_record(device, A2DP_SOURCE_UUID);
+
+	return rec;
+}
+
+/* The cached SEPs are only used as long as the SDP record they were
+ * discovered with, identified by its handle and the AVDTP version it
+ * advertises, stays the same */
+static char *remote_seps_state(struct avdtp *session)
+{
+	const sdp_record_t *rec = get_remote_record(session);
+
+	return g_strdup_printf("%04X:%08X", session->version,
+						rec ? rec->handle : 0);
+}
+
+/* Stores the SDP record state followed by the remote SEPs as space
+ * separated seid:type:media_type:caps entries, caps being the capability
+ * elements as they came in hex */
+static void store_remote_seps(struct avdtp *session)
+{
+	GString *str;
+	GSList *l, *c;
+	char *state;
+
+	if (session->seps == NULL)
+		return;
+
+	state = remote_seps_state(session);
+	str = g_string_new(state);
+	g_free(state);
+
+	for (l = session->seps; l != NULL; l = g_slist_next(l)) {
+		struct avdtp_remote_sep *sep = l->data;
+
+		g_string_append_printf(str, " %u:%u:%u:", sep->seid, sep->type,
+							sep->media_type);
+
+		for (c = sep->caps; c != NULL; c = g_slist_next(c)) {
+			struct avdtp_service_capability *cap = c->data;
+			uint8_t *data = (uint8_t *) cap;
+			int i;
+
+			for (i = 0; i < cap->length + 2; i++)
+				g_string_append_printf(str, "%02X", data[i]);
+		}
+	}
+
+	write_remote_seps(&session->server->src, &session->dst, str->str);
+
+	g_string_free(str, TRUE);
+}
+
+static gboolean load_remote_sep(struct avdtp *session, const char *entry)
+{
+	struct avdtp_remote_sep *sep;
+	unsigned int seid, type, media_type;
+	uint8_t caps[512];
+	const char *hex;
+	int size, n;
+
+	if (sscanf(entry, "%u:%u:%u:%n", &seid, &type, &media_type, &n) < 3)
+		return FALSE;
+
+	if (seid == 0 || seid > MAX_SEID || session->sep_table[seid])
+		return FALSE;
+
+	for (hex = entry + n, size = 0; hex[0] && hex[1]; hex += 2) {
+		unsigned int byte;
+
+		if (size == sizeof(caps) || sscanf(hex, "%2X", &byte) != 1)
+			return FALSE;
+
+		caps[size++] = byte;
+	}
+
+	sep = g_new0(struct avdtp_remote_sep, 1);
+	sep->seid = seid;
+	sep->type = type;
+	sep->media_type = media_type;
+	sep->caps = caps_hold(caps_to_list(caps, size, &sep->codec,
+						&sep->delay_reporting));
+
+	session->seps = g_slist_append(session->seps, sep);
+	session->sep_table[seid] = sep;
+
+	return TRUE;
+}
+
+static gboolean load_remote_seps(struct avdtp *session)
+{
+	char **entries, *str, *state, dstaddr[18];
+	int i;
+
+	str = read_remote_seps(&session->server->src, &session->dst);
+	if (str == NULL)
+		return FALSE;
+
+	entries = g_strsplit(str, " ", 0);
+	free(str);
+
+	ba2str(&session->dst, dstaddr);
+
+	state = remote_seps_state(session);
+	if (entries[0] == NULL || g_strcmp0(entries[0], state) != 0) {
+		DBG("%s: SDP record changed, not using cached SEPs", dstaddr);
+		goto done;
+	}
+
+	for (i = 1; entries[i] != NULL; i++) {
+		if (!load_remote_sep(session, entries[i])) {
+			error("Invalid cached SEP for %s: %s", dstaddr,
+								entries[i]);
+			break;
+		}
+	}
+
+	session->seps_cached = session->seps != NULL;
+
+	DBG("%s: %u cached SEPs", dstaddr, g_slist_length(session->seps));
+
+done:
+	g_free(state);
+	g_strfreev(entries);
+
+	return session->seps != NULL;
+}
+
 static void finalize_discovery(struct avdtp *session, int err)
 {
 	struct avdtp_error avdtp_err;
@@ -1122,6 +1402,17 @@ static void finalize_discovery(struct avdtp *session, int err)
 	session->user_data = NULL;
 }
 
+/* Called once the capabilities of all remote SEPs have been fetched */
+static void discovery_complete(struct avdtp *session)
+{
+	session->seps_cached = FALSE;
+
+	if (cache_capabilities)
+		store_remote_seps(session);
+
+	finalize_discovery(session, 0);
+}
+
 static void release_stream(struct avdtp_stream *stream, struct avdtp *session)
 {
 	struct avdtp_local_sep *sep = stream->lsep;
@@ -1150,10 +1441,13 @@ static void connection_lost(struct avdtp *session, int err)
 
 	session->free_lock = 1;
 
+	pipeline_free(session);
+
 	finalize_discovery(session, err);
 
 	g_slist_foreach(session->streams, (GFunc) release_stream, session);
 	session->streams = NULL;
+	memset(session->stream_table, 0, sizeof(session->stream_table));
 
 	session->free_lock = 0;
 
@@ -1225,11 +1519,14 @@ void avdtp_unref(struct avdtp *session)
 		remove_disconnect_timer(session);
 
 	server->sessions = g_slist_remove(server->sessions, session);
+	g_hash_table_remove(server->session_table, &session->dst);
 
 	if (session->req)
 		pending_req_free(session->req);
 
-	g_slist_foreach(session->seps, (GFunc) g_free, NULL);
+	pipeline_free(session);
+
+	g_slist_foreach(session->seps, (GFunc) remote_sep_free, NULL);
 	g_slist_free(session->seps);
 
 	g_free(session->buf);
@@ -1249,16 +1546,10 @@ struct avdtp *avdtp_ref(struct avdtp *session)
 static struct avdtp_local_sep *find_local_sep_by_seid(struct avdtp_server *server,
 							uint8_t seid)
 {
-	GSList *l;
-
-	for (l = server->seps; l != NULL; l = g_slist_next(l)) {
-		struct avdtp_local_sep *sep = l->data;
-
-		if (sep->info.seid == seid)
-			return sep;
-	}
+	if (seid > MAX_SEID)
+		return NULL;
 
-	return NULL;
+	return server->sep_table[seid];
 }
 
 struct avdtp_remote_sep *avdtp_find_remote_sep(struct avdtp *session,
@@ -1297,46 +1588,108 @@ struct avdtp_remote_sep *avdtp_find_remote_sep(struct avdtp *session,
 	return NULL;
 }
 
-static GSList *caps_to_list(uint8_t *data, int size,
-				struct avdtp_service_capability **codec,
-				gboolean *delay_reporting)
+/* Records where each capability starts without copying anything, the
+ * view is only valid as long as data is */
+static void caps_parse(struct caps_view *view, uint8_t *data, int size)
 {
-	GSList *caps;
 	int processed;
 
-	if (delay_reporting)
-		*delay_reporting = FALSE;
+	view->data = data;
+	view->count = 0;
+	view->codec = -1;
+	view->delay_reporting = FALSE;
 
-	for (processed = 0, caps = NULL; processed + 2 <= size;) {
-		struct avdtp_service_capability *cap;
+	for (processed = 0; processed + 2 <= size;) {
 		uint8_t length, category;
 
-		category = data[0];
-		length = data[1];
+		category = data[processed];
+		length = data[processed + 1];
 
 		if (processed + 2 + length > size) {
 			error("Invalid capability data in getcap resp");
 			break;
 		}
 
-		cap = g_malloc(sizeof(struct avdtp_service_capability) +
-					length);
-		memcpy(cap, data, 2 + length);
-
-		processed += 2 + length;
-		data += 2 + length;
-
-		caps = g_slist_append(caps, cap);
+		if (view->count == MAX_CAPS) {
+			error("Too many capabilities, ignoring the rest");
+			break;
+		}
 
 		if (category == AVDTP_MEDIA_CODEC &&
 				length >=
 				sizeof(struct avdtp_media_codec_capability))
+			view->codec = view->count;
+		else if (category == AVDTP_DELAY_REPORTING)
+			view->delay_reporting = TRUE;
+
+		view->offset[view->count++] = processed;
+		processed += 2 + length;
+	}
+}
+
+static struct avdtp_service_capability *caps_view_get(struct caps_view *view,
+								int index)
+{
+	return (void *) (view->data + view->offset[index]);
+}
+
+/* Makes the long lived copy once the capabilities are kept */
+static GSList *caps_view_to_list(struct caps_view *view,
+				struct avdtp_service_capability **codec,
+				gboolean *delay_reporting)
+{
+	GSList *caps = NULL;
+	int i;
+
+	if (delay_reporting)
+		*delay_reporting = view->delay_reporting;
+
+	for (i = 0; i < view->count; i++) {
+		struct avdtp_service_capability *cap, *src;
+
+		src = caps_view_get(view, i);
+		cap = g_memdup(src, 2 + src->length);
+
+		caps = g_slist_prepend(caps, cap);
+
+		if (i == view->codec)
 			*codec = cap;
-		else if (category == AVDTP_DELAY_REPORTING && delay_reporting)
-			*delay_reporting = TRUE;
 	}
 
-	return caps;
+	return g_slist_reverse(caps);
+}
+
+/* Tells whether a stored list holds exactly the capabilities in view */
+static gboolean caps_view_equal(struct caps_view *view, GSList *caps)
+{
+	int i;
+
+	for (i = 0; i < view->count; i++, caps = caps->next) {
+		struct avdtp_service_capability *cap, *src;
+
+		if (caps == NULL)
+			return FALSE;
+
+		src = caps_view_get(view, i);
+		cap = caps->data;
+
+		if (cap->length != src->length ||
+				memcmp(cap, src, 2 + src->length) != 0)
+			return FALSE;
+	}
+
+	return caps == NULL;
+}
+
+static GSList *caps_to_list(uint8_t *data, int size,
+				struct avdtp_service_capability **codec,
+				gboolean *delay_reporting)
+{
+	struct caps_view view;
+
+	caps_parse(&view, data, size);
+
+	return caps_view_to_list(&view, codec, delay_reporting);
 }
 
 static gboolean avdtp_unknown_cmd(struct avdtp *session, uint8_t transaction,
@@ -1456,7 +1809,7 @@ static void setconf_cb(struct avdtp *session, struct avdtp_stream *stream,
 	sep = stream->lsep;
 	sep->stream = stream;
 	sep->info.inuse = 1;
-	session->streams = g_slist_append(session->streams, stream);
+	session_add_stream(session, stream);
 
 	avdtp_sep_set_state(session, sep, AVDTP_STATE_CONFIGURED);
 }
@@ -1469,8 +1822,9 @@ static gboolean avdtp_setconf_cmd(struct avdtp *session, uint8_t transaction,
 	struct avdtp_stream *stream;
 	uint8_t err, category = 0x00;
 	struct audio_device *dev;
+	struct caps_view view;
 	bdaddr_t src, dst;
-	GSList *l;
+	int i;
 
 	if (size < sizeof(struct setconf_req)) {
 		error("Too short getcap request");
@@ -1519,25 +1873,26 @@ static gboolean avdtp_setconf_cmd(struct avdtp *session, uint8_t transaction,
 		break;
 	}
 
-	stream = g_new0(struct avdtp_stream, 1);
-	stream->session = session;
-	stream->lsep = sep;
-	stream->rseid = req->int_seid;
-	stream->caps = caps_to_list(req->caps,
-					size - sizeof(struct setconf_req),
-					&stream->codec,
-					&stream->delay_reporting);
+	caps_parse(&view, req->caps, size - sizeof(struct setconf_req));
 
 	/* Verify that the Media Transport capability's length = 0. Reject otherwise */
-	for (l = stream->caps; l != NULL; l = g_slist_next(l)) {
-		struct avdtp_service_capability *cap = l->data;
+	for (i = 0; i < view.count; i++) {
+		struct avdtp_service_capability *cap = caps_view_get(&view, i);
 
 		if (cap->category == AVDTP_MEDIA_TRANSPORT && cap->length != 0) {
 			err = AVDTP_BAD_MEDIA_TRANSPORT_FORMAT;
-			goto failed_stream;
+			goto failed;
 		}
 	}
 
+	/* Nothing is allocated for configurations rejected up to here */
+	stream = g_new0(struct avdtp_stream, 1);
+	stream->session = session;
+	stream->lsep = sep;
+	stream->rseid = req->int_seid;
+	stream->caps = caps_hold(caps_view_to_list(&view, &stream->codec,
+						&stream->delay_reporting));
+
 	if (stream->delay_reporting && session->version < 0x0103)
 		session->version = 0x0103;
 
@@ -1559,7 +1914,7 @@ static gboolean avdtp_setconf_cmd(struct avdtp *session, uint8_t transaction,
 
 		sep->stream = stream;
 		sep->info.inuse = 1;
-		session->streams = g_slist_append(session->streams, stream);
+		session_add_stream(session, stream);
 
 		avdtp_sep_set_state(session, sep, AVDTP_STATE_CONFIGURED);
 	}
@@ -2107,6 +2462,7 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 {
 	struct avdtp *session = data;
 	struct avdtp_common_header *header;
+	struct pending_req *req;
 	ssize_t size;
 	int fd;
 
@@ -2159,6 +2515,19 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 		return TRUE;
 	}
 
+	req = find_pipelined(session, header->transaction,
+						session->in.signal_id);
+	if (req) {
+		if (!avdtp_parse_pipelined(session, req, header->message_type,
+						session->in.buf,
+						session->in.data_size))
+			goto failed;
+
+		process_queue(session);
+
+		return TRUE;
+	}
+
 	if (session->req == NULL) {
 		error("No pending request, ignoring message");
 		return TRUE;
@@ -2219,43 +2588,20 @@ failed:
 	return FALSE;
 }
 
-static struct avdtp *find_session(GSList *list, const bdaddr_t *dst)
+static struct avdtp *find_session(struct avdtp_server *server,
+						const bdaddr_t *dst)
 {
-	for (; list != NULL; list = g_slist_next(list)) {
-		struct avdtp *s = list->data;
-
-		if (bacmp(dst, &s->dst))
-			continue;
-
-		return s;
-	}
-
-	return NULL;
+	return g_hash_table_lookup(server->session_table, dst);
 }
 
 static uint16_t get_version(struct avdtp *session)
 {
-	struct btd_adapter *adapter;
-	struct btd_device *device;
 	const sdp_record_t *rec;
 	sdp_list_t *protos;
 	sdp_data_t *proto_desc;
-	char addr[18];
 	uint16_t ver = 0x0100;
 
-	adapter = manager_find_adapter(&session->server->src);
-	if (!adapter)
-		goto done;
-
-	ba2str(&session->dst, addr);
-	device = adapter_find_device(adapter, addr);
-	if (!device)
-		goto done;
-
-	rec = btd_device_get_record(device, A2DP_SINK_UUID);
-	if (!rec)
-		rec = btd_device_get_record(device, A2DP_SOURCE_UUID);
-
+	rec = get_remote_record(session);
 	if (!rec)
 		goto done;
 
@@ -2285,7 +2631,7 @@ static struct avdtp *avdtp_get_internal(const bdaddr_t *src, const bdaddr_t *dst
 	if (server == NULL)
 		return NULL;
 
-	session = find_session(server->sessions, dst);
+	session = find_session(server, dst);
 	if (session) {
 		if (session->pending_auth)
 			return NULL;
@@ -2306,6 +2652,7 @@ static struct avdtp *avdtp_get_internal(const bdaddr_t *src, const bdaddr_t *dst
 	session->version = get_version(session);
 
 	server->sessions = g_slist_append(server->sessions, session);
+	g_hash_table_insert(server->session_table, &session->dst, session);
 
 	return session;
 }
@@ -2653,10 +3000,45 @@ static gboolean request_timeout(gpointer user_data)
 	return FALSE;
 }
 
+static gboolean transaction_in_use(struct avdtp *session,
+							uint8_t transaction)
+{
+	GSList *l;
+
+	if (session->req && session->req->transaction == transaction)
+		return TRUE;
+
+	for (l = session->pipeline; l != NULL; l = g_slist_next(l)) {
+		struct pending_req *req = l->data;
+
+		if (req->transaction == transaction)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static uint8_t next_transaction(struct avdtp *session)
+{
+	static int transaction = 0;
+	uint8_t label;
+	int i;
+
+	/* Labels are 4 bit, skip the ones still awaiting a response */
+	for (i = 0; i < 16; i++) {
+		label = transaction++;
+		transaction %= 16;
+
+		if (!transaction_in_use(session, label))
+			break;
+	}
+
+	return label;
+}
+
 static int send_req(struct avdtp *session, gboolean priority,
 			struct pending_req *req)
 {
-	static int transaction = 0;
 	int err;
 
 	if (session->state == AVDTP_SESSION_STATE_DISCONNECTED) {
@@ -2674,8 +3056,7 @@ static int send_req(struct avdtp *session, gboolean priority,
 		return 0;
 	}
 
-	req->transaction = transaction++;
-	transaction %= 16;
+	req->transaction = next_transaction(session);
 
 	/* FIXME: Should we retry to send if the buffer
 	was not totally sent or in case of EINTR? */
@@ -2720,6 +3101,90 @@ static int send_request(struct avdtp *session, gboolean priority,
 	return send_req(session, priority, req);
 }
 
+static gboolean pipeline_timeout(gpointer user_data)
+{
+	struct avdtp *session = user_data;
+
+	error("GetCapabilities: %s (%d)", strerror(ETIMEDOUT), ETIMEDOUT);
+
+	connection_lost(session, ETIMEDOUT);
+
+	return FALSE;
+}
+
+/* Sends a capability request right away without waiting for session->req
+ * to complete, the response is matched by its transaction label. Returns
+ * -EBUSY if the request should rather be queued. */
+static int send_pipelined(struct avdtp *session, uint8_t signal_id,
+						struct seid_req *sreq)
+{
+	struct pending_req *req;
+
+	if (session->state != AVDTP_SESSION_STATE_CONNECTED ||
+			g_slist_length(session->pipeline) >= MAX_PIPELINED_REQS)
+		return -EBUSY;
+
+	req = g_new0(struct pending_req, 1);
+	req->signal_id = signal_id;
+	req->data = g_memdup(sreq, sizeof(*sreq));
+	req->data_size = sizeof(*sreq);
+	req->transaction = next_transaction(session);
+
+	if (!avdtp_send(session, req->transaction, AVDTP_MSG_TYPE_COMMAND,
+				req->signal_id, req->data, req->data_size)) {
+		pending_req_free(req);
+		return -EIO;
+	}
+
+	req->timeout = g_timeout_add_seconds(REQ_TIMEOUT, pipeline_timeout,
+								session);
+	session->pipeline = g_slist_append(session->pipeline, req);
+
+	return 0;
+}
+
+static gboolean is_getcap(struct pending_req *req)
+{
+	return req->signal_id == AVDTP_GET_CAPABILITIES ||
+			req->signal_id == AVDTP_GET_ALL_CAPABILITIES;
+}
+
+/* Drops the cached SEPs and fetches them again in the background, the
+ * entries are updated in place so references to them stay valid */
+static void rediscover(struct avdtp *session)
+{
+	DBG("Cached SEPs rejected, rediscovering");
+
+	session->seps_cached = FALSE;
+	delete_remote_seps(&session->server->src, &session->dst);
+
+	if (send_request(session, FALSE, NULL, AVDTP_DISCOVER, NULL, 0) < 0)
+		error("Unable to rediscover SEPs");
+}
+
+/* Whether capability requests other than current are still outstanding */
+static gboolean getcap_pending(struct avdtp *session,
+						struct pending_req *current)
+{
+	GSList *l;
+
+	for (l = session->pipeline; l != NULL; l = g_slist_next(l)) {
+		if (l->data != current)
+			return TRUE;
+	}
+
+	if (session->req && session->req != current && is_getcap(session->req))
+		return TRUE;
+
+	if (session->prio_queue)
+		return is_getcap(session->prio_queue->data);
+
+	if (session->req_queue)
+		return is_getcap(session->req_queue->data);
+
+	return FALSE;
+}
+
 static gboolean avdtp_discover_resp(struct avdtp *session,
 					struct discover_resp *resp, int size)
 {
@@ -2745,12 +3210,16 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 
 		stream = find_stream_by_rseid(session, resp->seps[i].seid);
 
-		sep = find_remote_sep(session->seps, resp->seps[i].seid);
+		sep = find_remote_sep(session, resp->seps[i].seid);
 		if (!sep) {
 			if (resp->seps[i].inuse && !stream)
 				continue;
+			if (resp->seps[i].seid == 0 ||
+					resp->seps[i].seid > MAX_SEID)
+				continue;
 			sep = g_new0(struct avdtp_remote_sep, 1);
 			session->seps = g_slist_append(session->seps, sep);
+			session->sep_table[resp->seps[i].seid] = sep;
 		}
 
 		sep->stream = stream;
@@ -2761,7 +3230,11 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 		memset(&req, 0, sizeof(req));
 		req.acp_seid = sep->seid;
 
-		ret = send_request(session, TRUE, NULL, getcap_cmd,
+		ret = -EBUSY;
+		if (pipelined_discovery)
+			ret = send_pipelined(session, getcap_cmd, &req);
+		if (ret == -EBUSY)
+			ret = send_request(session, TRUE, NULL, getcap_cmd,
 							&req, sizeof(req));
 		if (ret < 0) {
 			finalize_discovery(session, -ret);
@@ -2773,11 +3246,12 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 }
 
 static gboolean avdtp_get_capabilities_resp(struct avdtp *session,
+						uint8_t seid,
 						struct getcap_resp *resp,
 						unsigned int size)
 {
 	struct avdtp_remote_sep *sep;
-	uint8_t seid;
+	struct caps_view view;
 
 	/* Check for minimum required packet size includes:
 	 *   1. getcap resp header
@@ -2791,23 +3265,30 @@ static gboolean avdtp_get_capabilities_resp(struct avdtp *session,
 		return FALSE;
 	}
 
-	seid = ((struct seid_req *) session->req->data)->acp_seid;
-
-	sep = find_remote_sep(session->seps, seid);
+	sep = find_remote_sep(session, seid);
+	if (sep == NULL) {
+		error("Capabilities of unknown SEID %u", seid);
+		return TRUE;
+	}
 
 	DBG("seid %d type %d media %d", sep->seid,
 					sep->type, sep->media_type);
 
+	caps_parse(&view, resp->caps, size - sizeof(struct getcap_resp));
+
+	/* Rediscovery mostly finds what is already known, keep it */
+	if (sep->caps && caps_view_equal(&view, sep->caps))
+		return TRUE;
+
 	if (sep->caps) {
-		g_slist_foreach(sep->caps, (GFunc) g_free, NULL);
-		g_slist_free(sep->caps);
+		caps_free(sep->caps);
 		sep->caps = NULL;
 		sep->codec = NULL;
 		sep->delay_reporting = FALSE;
 	}
 
-	sep->caps = caps_to_list(resp->caps, size - sizeof(struct getcap_resp),
-					&sep->codec, &sep->delay_reporting);
+	sep->caps = caps_hold(caps_view_to_list(&view, &sep->codec,
+						&sep->delay_reporting));
 
 	return TRUE;
 }
@@ -2928,16 +3409,8 @@ static gboolean avdtp_parse_resp(struct avdtp *session,
 					uint8_t transaction, uint8_t signal_id,
 					void *buf, int size)
 {
-	struct pending_req *next;
 	const char *get_all = "";
 
-	if (session->prio_queue)
-		next = session->prio_queue->data;
-	else if (session->req_queue)
-		next = session->req_queue->data;
-	else
-		next = NULL;
-
 	switch (signal_id) {
 	case AVDTP_DISCOVER:
 		DBG("DISCOVER request succeeded");
@@ -2946,11 +3419,12 @@ static gboolean avdtp_parse_resp(struct avdtp *session,
 		get_all = "ALL_";
 	case AVDTP_GET_CAPABILITIES:
 		DBG("GET_%sCAPABILITIES request succeeded", get_all);
-		if (!avdtp_get_capabilities_resp(session, buf, size))
+		if (!avdtp_get_capabilities_resp(session,
+						req_get_seid(session->req),
+						buf, size))
 			return FALSE;
-		if (!(next && (next->signal_id == AVDTP_GET_CAPABILITIES ||
-				next->signal_id == AVDTP_GET_ALL_CAPABILITIES)))
-			finalize_discovery(session, 0);
+		if (!getcap_pending(session, session->req))
+			discovery_complete(session);
 		return TRUE;
 	}
 
@@ -3073,6 +3547,9 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 			return FALSE;
 		error("SET_CONFIGURATION request rejected: %s (%d)",
 				avdtp_strerror(&err), err.err.error_code);
+		/* The SEPs may have changed since they were cached */
+		if (session->seps_cached)
+			rediscover(session);
 		if (sep && sep->cfm && sep->cfm->set_configuration)
 			sep->cfm->set_configuration(session, sep, stream,
 							&err, sep->user_data);
@@ -3150,7 +3627,7 @@ gboolean avdtp_is_connected(const bdaddr_t *src, const bdaddr_t *dst)
 	if (!server)
 		return FALSE;
 
-	session = find_session(server->sessions, dst);
+	session = find_session(server, dst);
 	if (!session)
 		return FALSE;
 
@@ -3236,6 +3713,48 @@ gboolean avdtp_stream_get_transport(struct avdtp_stream *stream, int *sock,
 	return TRUE;
 }
 
+static gboolean avdtp_parse_pipelined(struct avdtp *session,
+					struct pending_req *req,
+					uint8_t message_type,
+					void *buf, int size)
+{
+	struct avdtp_error err;
+	gboolean ret = TRUE;
+
+	session->pipeline = g_slist_remove(session->pipeline, req);
+
+	switch (message_type) {
+	case AVDTP_MSG_TYPE_ACCEPT:
+		DBG("GET_%sCAPABILITIES request succeeded",
+			req->signal_id == AVDTP_GET_ALL_CAPABILITIES ?
+								"ALL_" : "");
+		ret = avdtp_get_capabilities_resp(session, req_get_seid(req),
+								buf, size);
+		break;
+	case AVDTP_MSG_TYPE_REJECT:
+		if (!seid_rej_to_err(buf, size, &err)) {
+			ret = FALSE;
+			break;
+		}
+		error("GET_CAPABILITIES request rejected: %s (%d)",
+				avdtp_strerror(&err), err.err.error_code);
+		break;
+	case AVDTP_MSG_TYPE_GEN_REJECT:
+		error("Received a General Reject message");
+		break;
+	default:
+		error("Unknown message type 0x%02X", message_type);
+		break;
+	}
+
+	pending_req_free(req);
+
+	if (ret && !getcap_pending(session, NULL))
+		discovery_complete(session);
+
+	return ret;
+}
+
 static int process_queue(struct avdtp *session)
 {
 	GSList **queue, *l;
@@ -3333,7 +3852,8 @@ int avdtp_discover(struct avdtp *session, avdtp_discover_cb_t cb,
 	if (session->discov_cb)
 		return -EBUSY;
 
-	if (session->seps) {
+	if (session->seps || (cache_capabilities &&
+						load_remote_seps(session))) {
 		session->discov_cb = cb;
 		session->user_data = user_data;
 		g_idle_add(process_discover, session);
@@ -3456,6 +3976,7 @@ int avdtp_set_configuration(struct avdtp *session,
 	}
 
 	g_slist_foreach(caps, copy_capabilities, &new_stream->caps);
+	caps_hold(new_stream->caps);
 
 	/* Calculate total size of request */
 	for (l = caps, caps_len = 0; l != NULL; l = g_slist_next(l)) {
@@ -3484,7 +4005,7 @@ int avdtp_set_configuration(struct avdtp *session,
 		lsep->info.inuse = 1;
 		lsep->stream = new_stream;
 		rsep->stream = new_stream;
-		session->streams = g_slist_append(session->streams, new_stream);
+		session_add_stream(session, new_stream);
 		if (stream)
 			*stream = new_stream;
 	}
@@ -3691,18 +4212,24 @@ struct avdtp_local_sep *avdtp_register_sep(const bdaddr_t *src, uint8_t type,
 {
 	struct avdtp_server *server;
 	struct avdtp_local_sep *sep;
+	uint8_t seid;
 
 	server = find_server(servers, src);
 	if (!server)
 		return NULL;
 
-	if (g_slist_length(server->seps) > MAX_SEID)
+	/* SEID 0 is forbidden, reuse the lowest one released */
+	for (seid = 1; seid <= MAX_SEID; seid++)
+		if (server->sep_table[seid] == NULL)
+			break;
+
+	if (seid > MAX_SEID)
 		return NULL;
 
 	sep = g_new0(struct avdtp_local_sep, 1);
 
 	sep->state = AVDTP_STATE_IDLE;
-	sep->info.seid = g_slist_length(server->seps) + 1;
+	sep->info.seid = seid;
 	sep->info.type = type;
 	sep->info.media_type = media_type;
 	sep->codec = codec_type;
@@ -3715,6 +4242,7 @@ struct avdtp_local_sep *avdtp_register_sep(const bdaddr_t *src, uint8_t type,
 	DBG("SEP %p registered: type:%d codec:%d seid:%d", sep,
 			sep->info.type, sep->codec, sep->info.seid);
 	server->seps = g_slist_append(server->seps, sep);
+	server->sep_table[seid] = sep;
 
 	return sep;
 }
@@ -3728,6 +4256,7 @@ int avdtp_unregister_sep(struct avdtp_local_sep *sep)
 
 	server = sep->server;
 	server->seps = g_slist_remove(server->seps, sep);
+	server->sep_table[sep->info.seid] = NULL;
 
 	if (sep->stream)
 		release_stream(sep->stream, sep->stream->session);
@@ -3846,6 +4375,12 @@ int avdtp_init(const bdaddr_t *src, GKeyFile *config, uint16_t *version)
 	if (g_key_file_get_boolean(config, "A2DP", "DelayReporting", NULL))
 		ver = 0x0103;
 
+	pipelined_discovery = g_key_file_get_boolean(config, "A2DP",
+						"PipelinedDiscovery", NULL);
+
+	cache_capabilities = g_key_file_get_boolean(config, "A2DP",
+						"CacheCapabilities", NULL);
+
 proceed:
 	server = g_new0(struct avdtp_server, 1);
 	if (!server)
@@ -3863,6 +4398,7 @@ proceed:
 	}
 
 	bacpy(&server->src, src);
+	server->session_table = g_hash_table_new(bdaddr_hash, bdaddr_equal);
 
 	servers = g_slist_append(servers, server);
 
@@ -3888,6 +4424,7 @@ void avdtp_exit(const bdaddr_t *src)
 
 	g_io_channel_shutdown(server->io, TRUE, NULL);
 	g_io_channel_unref(server->io);
+	g_hash_table_destroy(server->session_table);
 	g_free(server);
 }
 
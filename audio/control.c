@@ -34,10 +34,12 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 
 #include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
 
@@ -58,6 +60,7 @@
 #include "glib-helper.h"
 #include "btio.h"
 #include "dbus-common.h"
+#include "memstat.h"
 
 #define AVCTP_PSM 23
 #define AVCTP_BROWSING_PSM 0x001B
@@ -132,6 +135,7 @@
 #define EVENT_TRACK_CHANGED		0x2
 #define EVENT_AVAILABLE_PLAYERS_CHANGED	0xa
 #define EVENT_ADDRESSED_PLAYER_CHANGED	0xb
+#define EVENT_MAX			0xd
 
 /* AVRCP1.3 Error/Staus Codes */
 #define ERROR_INVALID_PDU	0x00
@@ -143,6 +147,9 @@
 #define ERROR_INVALID_DIRECTION	0X07
 #define ERROR_NO_DIRECTORY	0X08
 #define ERROR_UID_NOT_EXIST	0X09
+#define ERROR_INVALID_SCOPE	0X0A
+#define ERROR_RANGE_OUT_OF_BOUNDS	0X0B
+#define ERROR_INVALID_PLAYER_ID	0X11
 
 /* AVRCP1.3 MetaData Attributes ID */
 #define METADATA_TITLE		0X1
@@ -157,10 +164,31 @@
 #define METADATA_MAX_FIELDS	6
 #define METADATA_MAX_STRING_LEN	150
 #define METADATA_MAX_NUMBER_LEN	40
+#define METADATA_FIELD_MASK(i)	(1 << (metadata_fields[i].id - 1))
 #define DEFAULT_METADATA_STRING	"Unknown"
 #define DEFAULT_METADATA_NUMBER	"1234567890"
 #define AVRCP_MAX_PKT_SIZE	512
 
+/* Browsing channel */
+#define AVCTP_BROWSING_MTU	1024
+#define BROWSING_PAGE_ITEMS	32
+#define BROWSING_TIMEOUT	2
+#define BROWSED_PLAYER_ID	0x0001
+
+#define PDU_SET_BROWSED_PLAYER	0x70
+#define PDU_GET_FOLDER_ITEMS	0x71
+#define PDU_CHANGE_PATH		0x72
+#define PDU_GENERAL_REJECT	0xa0
+
+#define SCOPE_MEDIA_PLAYER_LIST		0x00
+#define SCOPE_VIRTUAL_FILESYSTEM	0x01
+#define SCOPE_SEARCH			0x02
+#define SCOPE_NOW_PLAYING		0x03
+
+#define ITEM_MEDIA_PLAYER	0x01
+#define ITEM_FOLDER		0x02
+#define ITEM_MEDIA_ELEMENT	0x03
+
 /* AVRCP1.3 Character set */
 #define CHARACTER_SET_UTF8	0X6A
 
@@ -176,7 +204,11 @@
 
 static DBusConnection *connection = NULL;
 static gchar *input_device_name = NULL;
+static gboolean shared_input = FALSE;
+static int shared_uinput = -1;
+static unsigned int shared_uinput_refs = 0;
 static GSList *servers = NULL;
+static gboolean browsing_enabled = FALSE;
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
@@ -238,6 +270,12 @@ struct avrcp_params {
 #error "Unknown byte order"
 #endif
 
+struct avctp_browsing_header {
+	struct avctp_header avctp;
+	uint8_t pdu_id;
+	uint16_t param_len;
+} __attribute__ ((packed));
+
 struct avrcp_caps {
 	struct avrcp_params params;
 	uint8_t capability_id;
@@ -290,34 +328,64 @@ struct avctp_state_callback {
 struct avctp_server {
 	bdaddr_t src;
 	GIOChannel *io;
+	GIOChannel *browsing_io;
 	uint32_t tg_record_id;
 #ifndef ANDROID
 	uint32_t ct_record_id;
 #endif
 };
 
+/* GetElementAttributes attributes serialized back to back as they go on
+ * the wire, in metadata_fields order. Responses and their continuation
+ * packets are sent as slices of it, a pending continuation keeps its own
+ * reference so the blob can be replaced by UpdateMetaData meanwhile. */
+struct meta_data_blob {
+	int refs;
+	uint16_t off[METADATA_MAX_FIELDS];
+	uint16_t len[METADATA_MAX_FIELDS];
+	size_t size;
+	uint8_t data[0];
+};
+
+struct avrcp_notification {
+	gboolean registered;
+	gboolean changed;
+	uint8_t transaction;
+	uint64_t value;
+};
+
 struct meta_data {
-	gchar *title;
-	gchar *artist;
-	gchar *album;
-	gchar *media_number;
-	gchar *total_media_count;
-	gchar *playing_time;
-	gchar *remaining_mdata;
-	int remaining_mdata_len;
-	uint8_t trans_id_event_track;
-	uint8_t trans_id_event_playback;
-	uint8_t trans_id_event_addressed_player;
-	uint8_t trans_id_event_available_player;
+	struct meta_data_blob *blob;
+	struct meta_data_blob *cont_blob;
+	uint8_t cont_mask;
+	size_t cont_offset;
+	size_t cont_len;
+	struct avrcp_notification notify[EVENT_MAX + 1];
+	guint notify_id;
 	uint8_t trans_id_get_play_status;
-	gboolean reg_track_changed;
-	gboolean reg_playback_status;
-	gboolean reg_addressed_player;
-	gboolean reg_available_player;
 	gboolean req_get_play_status;
 	uint8_t current_play_status;
 };
 
+/* A browsing response being filled in by the media player. Folder items
+ * are asked for a page at a time and packed as they come until the
+ * response is as large as the MTU, so a folder is never held in memory
+ * as a whole. */
+struct browsing_request {
+	uint8_t transaction;
+	uint8_t pdu_id;
+	uint8_t scope;
+	uint32_t next;		/* first item of the pending page */
+	uint32_t end;
+	uint32_t asked;		/* items in the pending page */
+	uint16_t count;		/* items already packed */
+	gboolean full;
+	guint timeout_id;
+	size_t len;
+	size_t size;
+	uint8_t buf[0];
+};
+
 struct control {
 	struct audio_device *dev;
 
@@ -337,6 +405,12 @@ struct control {
 
 	gboolean ignore_pause;
 	struct meta_data *mdata;
+
+	GIOChannel *browsing_io;
+	guint browsing_io_id;
+	uint16_t browsing_mtu;
+	uint16_t uid_counter;
+	struct browsing_request *browsing;
 };
 
 static struct {
@@ -354,6 +428,22 @@ static struct {
 	{ NULL }
 };
 
+static const struct {
+	uint8_t id;
+	size_t max_len;
+	const char *def;
+} metadata_fields[METADATA_MAX_FIELDS] = {
+	{ METADATA_TITLE, METADATA_MAX_STRING_LEN, DEFAULT_METADATA_STRING },
+	{ METADATA_ARTIST, METADATA_MAX_STRING_LEN, DEFAULT_METADATA_STRING },
+	{ METADATA_ALBUM, METADATA_MAX_STRING_LEN, DEFAULT_METADATA_STRING },
+	{ METADATA_MEDIA_NUMBER, METADATA_MAX_NUMBER_LEN,
+						DEFAULT_METADATA_NUMBER },
+	{ METADATA_TOTAL_MEDIA, METADATA_MAX_NUMBER_LEN,
+						DEFAULT_METADATA_NUMBER },
+	{ METADATA_PLAYING_TIME, METADATA_MAX_NUMBER_LEN,
+						DEFAULT_METADATA_NUMBER },
+};
+
 static GSList *avctp_callbacks = NULL;
 
 static void auth_cb(DBusError *derr, void *user_data);
@@ -362,8 +452,10 @@ static int send_meta_data(struct control *control, uint8_t trans_id,
 				uint8_t att_mask);
 static int send_meta_data_continue_response(struct control *control,
 				uint8_t trans_id);
-static int send_notification(struct control *control,
-		uint16_t event_id, uint16_t event_data);
+static void control_notify(struct control *control, uint16_t event_id,
+							uint64_t value);
+static void notify_reset(struct meta_data *mdata);
+static void browsing_disconnect(struct control *control);
 static int send_play_status(struct control *control, uint32_t song_len,
                         uint32_t song_position, uint8_t play_status);
 
@@ -431,7 +523,7 @@ static sdp_record_t *avrcp_ct_record(void)
 	return record;
 }
 
-static sdp_record_t *avrcp_tg_record(void)
+static sdp_record_t *avrcp_tg_record(gboolean browsing)
 {
 	sdp_list_t *svclass_id, *pfseq, *apseq, *root;
 	uuid_t root_uuid, l2cap, avctp, avrtg;
@@ -446,6 +538,11 @@ static sdp_record_t *avrcp_tg_record(void)
 #ifdef ANDROID
 	feat = 0x0001;
 #endif
+	if (browsing) {
+		avrcp_ver = 0x0104;
+		feat |= 0x0040;
+	}
+
 	record = sdp_record_alloc();
 	if (!record)
 		return NULL;
@@ -475,6 +572,30 @@ static sdp_record_t *avrcp_tg_record(void)
 	aproto = sdp_list_append(0, apseq);
 	sdp_set_access_protos(record, aproto);
 
+	/* Additional Protocol Descriptor List, for the browsing channel */
+	if (browsing) {
+		sdp_list_t *br_proto[2], *br_apseq, *br_aproto;
+		sdp_data_t *br_psm;
+
+		br_psm = sdp_data_alloc(SDP_UINT16, &browsing_psm);
+		br_proto[0] = sdp_list_append(0, &l2cap);
+		br_proto[0] = sdp_list_append(br_proto[0], br_psm);
+		br_apseq = sdp_list_append(0, br_proto[0]);
+
+		br_proto[1] = sdp_list_append(0, &avctp);
+		br_proto[1] = sdp_list_append(br_proto[1], version);
+		br_apseq = sdp_list_append(br_apseq, br_proto[1]);
+
+		br_aproto = sdp_list_append(0, br_apseq);
+		sdp_set_add_access_protos(record, br_aproto);
+
+		free(br_psm);
+		sdp_list_free(br_proto[0], 0);
+		sdp_list_free(br_proto[1], 0);
+		sdp_list_free(br_apseq, 0);
+		sdp_list_free(br_aproto, 0);
+	}
+
 	/* Bluetooth Profile Descriptor List */
 	sdp_uuid16_create(&profile[0].uuid, AV_REMOTE_PROFILE_ID);
 	profile[0].version = avrcp_ver;
@@ -499,33 +620,37 @@ static sdp_record_t *avrcp_tg_record(void)
 	return record;
 }
 
-static int send_event(int fd, uint16_t type, uint16_t code, int32_t value)
+static int add_key(struct uinput_event *ev, uint16_t key, int pressed)
 {
-	struct uinput_event event;
-
-	memset(&event, 0, sizeof(event));
-	event.type	= type;
-	event.code	= code;
-	event.value	= value;
-
-	return write(fd, &event, sizeof(event));
+	memset(ev, 0, 2 * sizeof(*ev));
+	ev[0].type	= EV_KEY;
+	ev[0].code	= key;
+	ev[0].value	= pressed;
+	ev[1].type	= EV_SYN;
+	ev[1].code	= SYN_REPORT;
+
+	return 2;
 }
 
-static void send_key(int fd, uint16_t key, int pressed)
+/* uinput takes any number of events per write, so a whole passthrough
+ * PDU goes out with a single syscall */
+static void send_keys(int fd, struct uinput_event *ev, int count)
 {
-	if (fd < 0)
+	if (fd < 0 || count == 0)
 		return;
 
-	send_event(fd, EV_KEY, key, pressed);
-	send_event(fd, EV_SYN, SYN_REPORT, 0);
+	if (write(fd, ev, count * sizeof(*ev)) < 0)
+		error("AVRCP: writing to uinput failed: %s (%d)",
+						strerror(errno), errno);
 }
 
 static void handle_panel_passthrough(struct control *control,
 					const unsigned char *operands,
 					int operand_count)
 {
+	struct uinput_event ev[4];
 	const char *status;
-	int pressed, i;
+	int pressed, i, count = 0;
 
 	if (operand_count == 0)
 		return;
@@ -555,15 +680,17 @@ static void handle_panel_passthrough(struct control *control,
 			}
 
 			DBG("AVRCP: treating key press as press + release");
-			send_key(control->uinput, key_map[i].uinput, 1);
-			send_key(control->uinput, key_map[i].uinput, 0);
+			count += add_key(&ev[count], key_map[i].uinput, 1);
+			count += add_key(&ev[count], key_map[i].uinput, 0);
 			break;
 		}
 
-		send_key(control->uinput, key_map[i].uinput, pressed);
+		count += add_key(&ev[count], key_map[i].uinput, pressed);
 		break;
 	}
 
+	send_keys(control->uinput, ev, count);
+
 	if (key_map[i].name == NULL)
 		DBG("AVRCP: unknown button 0x%02X %s",
 						operands[0] & 0x7F, status);
@@ -576,6 +703,10 @@ static void avctp_disconnected(struct audio_device *dev)
 	if (!control)
 		return;
 
+	notify_reset(control->mdata);
+
+	browsing_disconnect(control);
+
 	if (control->io) {
 		g_io_channel_shutdown(control->io, TRUE, NULL);
 		g_io_channel_unref(control->io);
@@ -597,8 +728,12 @@ static void avctp_disconnected(struct audio_device *dev)
 		ba2str(&dev->dst, address);
 		DBG("AVRCP: closing uinput for %s", address);
 
-		ioctl(control->uinput, UI_DEV_DESTROY);
-		close(control->uinput);
+		if (!shared_input || --shared_uinput_refs == 0) {
+			ioctl(control->uinput, UI_DEV_DESTROY);
+			close(control->uinput);
+			shared_uinput = -1;
+		}
+
 		control->uinput = -1;
 	}
 }
@@ -664,6 +799,109 @@ static void set_company_id(uint8_t cid[3], const uint32_t cid_in)
 	cid[2] = cid_in;
 }
 
+static struct meta_data_blob *metadata_blob_new(const char *values[])
+{
+	struct meta_data_blob *blob;
+	size_t len[METADATA_MAX_FIELDS], size = 0;
+	uint8_t *ptr;
+	int i;
+
+	for (i = 0; i < METADATA_MAX_FIELDS; i++) {
+		len[i] = strlen(values[i]);
+		if (len[i] >= metadata_fields[i].max_len)
+			len[i] = metadata_fields[i].max_len - 1;
+		size += sizeof(struct meta_data_field) + len[i];
+	}
+
+	blob = g_malloc(sizeof(*blob) + size);
+	btd_memstat_add(MEMSTAT_AVRCP_METADATA, sizeof(*blob) + size);
+
+	blob->refs = 1;
+	blob->size = size;
+
+	for (i = 0, ptr = blob->data; i < METADATA_MAX_FIELDS; i++) {
+		struct meta_data_field *field = (struct meta_data_field *) ptr;
+
+		field->att_id = htonl(metadata_fields[i].id);
+		field->char_set_id = htons(CHARACTER_SET_UTF8);
+		field->att_len = htons(len[i]);
+		memcpy(field->val, values[i], len[i]);
+
+		blob->off[i] = ptr - blob->data;
+		blob->len[i] = sizeof(struct meta_data_field) + len[i];
+		ptr += blob->len[i];
+	}
+
+	return blob;
+}
+
+static struct meta_data_blob *metadata_blob_ref(struct meta_data_blob *blob)
+{
+	blob->refs++;
+
+	return blob;
+}
+
+static void metadata_blob_unref(struct meta_data_blob *blob)
+{
+	if (blob == NULL || --blob->refs > 0)
+		return;
+
+	btd_memstat_sub(MEMSTAT_AVRCP_METADATA, sizeof(*blob) + blob->size);
+
+	g_free(blob);
+}
+
+static void metadata_cont_clear(struct meta_data *mdata)
+{
+	metadata_blob_unref(mdata->cont_blob);
+	mdata->cont_blob = NULL;
+	mdata->cont_offset = 0;
+	mdata->cont_len = 0;
+}
+
+/* Points iov at len bytes of the attributes selected by mask, starting
+ * offset bytes into them. Attributes next to each other in the blob share
+ * a single entry, returns the number of entries used. */
+static int metadata_blob_iov(struct meta_data_blob *blob, uint8_t mask,
+				size_t offset, size_t len, struct iovec *iov)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < METADATA_MAX_FIELDS && len > 0; i++) {
+		size_t flen = blob->len[i];
+		uint8_t *base;
+
+		if (!(mask & METADATA_FIELD_MASK(i)))
+			continue;
+
+		if (offset >= flen) {
+			offset -= flen;
+			continue;
+		}
+
+		base = blob->data + blob->off[i] + offset;
+		flen -= offset;
+		offset = 0;
+
+		if (flen > len)
+			flen = len;
+		len -= flen;
+
+		if (cnt > 0 && (uint8_t *) iov[cnt - 1].iov_base +
+					iov[cnt - 1].iov_len == base) {
+			iov[cnt - 1].iov_len += flen;
+			continue;
+		}
+
+		iov[cnt].iov_base = base;
+		iov[cnt].iov_len = flen;
+		cnt++;
+	}
+
+	return cnt;
+}
+
 static gboolean control_cb(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
@@ -806,7 +1044,7 @@ static gboolean control_cb(GIOChannel *chan, GIOCondition cond,
 			send_meta_data(control, avctp->transaction, att_mask);
 			return TRUE;
 		} else if (params->pdu_id == PDU_REQ_CONTINUE_RSP_ID) {
-			if (mdata->remaining_mdata_len == 0) {
+			if (mdata->cont_len == 0) {
 				error_code = ERROR_INVALID_PARAMETER;
 			} else {
 				send_meta_data_continue_response(control, avctp->transaction);
@@ -814,21 +1052,20 @@ static gboolean control_cb(GIOChannel *chan, GIOCondition cond,
 			}
 
 		} else if (params->pdu_id == PDU_ABORT_CONTINUE_RSP_ID) {
-			if (mdata->remaining_mdata_len == 0) {
+			if (mdata->cont_len == 0) {
 				error_code = ERROR_INVALID_PARAMETER;
 			} else {
-				mdata->remaining_mdata_len = 0;
-				g_free(mdata->remaining_mdata);
-				mdata->remaining_mdata = NULL;
+				metadata_cont_clear(mdata);
 				avctp->cr = AVCTP_RESPONSE;
 				avrcp->code = CTYPE_STABLE;
 			}
 		} else if (params->pdu_id == PDU_RGR_NOTIFICATION_ID &&
 				!(control->avrcp_quirks & QUIRK_NO_NOTIFICATIONS)) {
+			struct avrcp_notification *n = NULL;
+
 			avctp->cr = AVCTP_RESPONSE;
 			if (caps->capability_id == EVENT_TRACK_CHANGED) {
-				mdata->trans_id_event_track = avctp->transaction;
-				mdata->reg_track_changed = TRUE;
+				n = &mdata->notify[EVENT_TRACK_CHANGED];
 				avrcp->code = CTYPE_INTERIM;
 				int index;
 				if (mdata->current_play_status == STATUS_STOPPED) {
@@ -841,8 +1078,7 @@ static gboolean control_cb(GIOChannel *chan, GIOCondition cond,
 				params->param_len = htons(9);
 				packet_size = sizeof(struct avrcp_caps) + 8;
 			} else if (caps->capability_id == EVENT_PLAYBACK_STATUS_CHANGED) {
-				mdata->trans_id_event_playback = avctp->transaction;
-				mdata->reg_playback_status = TRUE;
+				n = &mdata->notify[EVENT_PLAYBACK_STATUS_CHANGED];
 				avrcp->code = CTYPE_INTERIM;
 				params->param_len = htons(2);
 				*operands = mdata->current_play_status;
@@ -850,6 +1086,14 @@ static gboolean control_cb(GIOChannel *chan, GIOCondition cond,
 			} else {
 				error_code = ERROR_INVALID_PARAMETER;
 			}
+
+			/* The interim response carries the current value, so
+			 * anything queued before is no longer a change */
+			if (n) {
+				n->registered = TRUE;
+				n->changed = FALSE;
+				n->transaction = avctp->transaction;
+			}
 		} else if (params->pdu_id == PDU_GET_PLAY_STATUS_ID &&
 				!(control->avrcp_quirks & QUIRK_NO_NOTIFICATIONS)) {
 			g_dbus_emit_signal(control->dev->conn, control->dev->path,
@@ -885,6 +1129,536 @@ failed:
 	return FALSE;
 }
 
+static inline void put_be16(uint16_t val, uint8_t *dst)
+{
+	bt_put_unaligned(htons(val), (uint16_t *) dst);
+}
+
+static inline void put_be32(uint32_t val, uint8_t *dst)
+{
+	bt_put_unaligned(htonl(val), (uint32_t *) dst);
+}
+
+static inline void put_be64(uint64_t val, uint8_t *dst)
+{
+	bt_put_unaligned(hton64(val), (uint64_t *) dst);
+}
+
+static void browsing_request_free(struct control *control)
+{
+	struct browsing_request *req = control->browsing;
+
+	if (req == NULL)
+		return;
+
+	if (req->timeout_id)
+		g_source_remove(req->timeout_id);
+
+	g_free(req);
+	control->browsing = NULL;
+}
+
+static int browsing_send(struct control *control, uint8_t transaction,
+				uint8_t pdu_id, uint8_t *buf, size_t len)
+{
+	struct avctp_browsing_header *hdr = (struct avctp_browsing_header *) buf;
+	int sk;
+
+	if (control->browsing_io == NULL)
+		return -ENOTCONN;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->avctp.transaction = transaction;
+	hdr->avctp.packet_type = AVCTP_PACKET_SINGLE;
+	hdr->avctp.cr = AVCTP_RESPONSE;
+	hdr->avctp.pid = htons(AV_REMOTE_SVCLASS_ID);
+	hdr->pdu_id = pdu_id;
+	hdr->param_len = htons(len - sizeof(*hdr));
+
+	sk = g_io_channel_unix_get_fd(control->browsing_io);
+
+	if (write(sk, buf, len) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int browsing_reject(struct control *control, uint8_t transaction,
+					uint8_t pdu_id, uint8_t status)
+{
+	uint8_t buf[sizeof(struct avctp_browsing_header) + 1];
+
+	buf[sizeof(struct avctp_browsing_header)] = status;
+
+	return browsing_send(control, transaction, pdu_id, buf, sizeof(buf));
+}
+
+static void browsing_request_finish(struct control *control, uint8_t status)
+{
+	struct browsing_request *req = control->browsing;
+	uint8_t *params = req->buf + sizeof(struct avctp_browsing_header);
+
+	if (status != STATUS_OP_COMPLETED)
+		browsing_reject(control, req->transaction, req->pdu_id,
+									status);
+	else {
+		/* Status, UID counter and number of items */
+		params[0] = status;
+		put_be16(control->uid_counter, &params[1]);
+		put_be16(req->count, &params[3]);
+
+		browsing_send(control, req->transaction, req->pdu_id,
+							req->buf, req->len);
+	}
+
+	browsing_request_free(control);
+}
+
+static gboolean browsing_timeout(gpointer user_data)
+{
+	struct control *control = user_data;
+	struct browsing_request *req = control->browsing;
+
+	DBG("Media player didn't answer browsing PDU 0x%02X", req->pdu_id);
+
+	req->timeout_id = 0;
+
+	/* Whatever was packed so far is still a valid answer */
+	if (req->pdu_id == PDU_GET_FOLDER_ITEMS && req->count > 0)
+		browsing_request_finish(control, STATUS_OP_COMPLETED);
+	else
+		browsing_request_finish(control, ERROR_INTERNAL);
+
+	return FALSE;
+}
+
+static struct browsing_request *browsing_request_new(struct control *control,
+					uint8_t transaction, uint8_t pdu_id)
+{
+	struct browsing_request *req;
+
+	/* A new command means the controller gave up on the previous one */
+	browsing_request_free(control);
+
+	req = g_malloc0(sizeof(*req) + control->browsing_mtu);
+	req->transaction = transaction;
+	req->pdu_id = pdu_id;
+	req->size = control->browsing_mtu;
+	req->len = sizeof(struct avctp_browsing_header);
+	req->timeout_id = g_timeout_add_seconds(BROWSING_TIMEOUT,
+						browsing_timeout, control);
+
+	control->browsing = req;
+
+	return req;
+}
+
+static void browsing_request_page(struct control *control)
+{
+	struct browsing_request *req = control->browsing;
+	dbus_uint32_t start = req->next;
+
+	req->asked = MIN(req->end - req->next + 1, BROWSING_PAGE_ITEMS);
+
+	g_dbus_emit_signal(control->dev->conn, control->dev->path,
+				AUDIO_CONTROL_INTERFACE, "GetFolderItems",
+				DBUS_TYPE_BYTE, &req->scope,
+				DBUS_TYPE_UINT32, &start,
+				DBUS_TYPE_UINT32, &req->asked,
+				DBUS_TYPE_INVALID);
+}
+
+/* Cuts name to at most len bytes without splitting a character */
+static size_t name_fit(const char *name, size_t len)
+{
+	size_t n = strlen(name);
+
+	if (n <= len)
+		return n;
+
+	while (len > 0 && ((uint8_t) name[len] & 0xc0) == 0x80)
+		len--;
+
+	return len;
+}
+
+static gboolean browsing_pack_item(struct browsing_request *req,
+					uint64_t uid, uint8_t type,
+					uint8_t subtype, const char *name)
+{
+	size_t room, name_len;
+	uint8_t *ptr;
+
+	/* Type, length, UID, subtype, charset, name length and either the
+	 * playable flag of a folder or the attribute count of an element */
+	room = req->size - req->len;
+	if (room < 17)
+		return FALSE;
+
+	name_len = name_fit(name, room - 17);
+
+	/* Only the first item may lose the end of its name */
+	if (name_len < strlen(name) && req->count > 0)
+		return FALSE;
+
+	ptr = req->buf + req->len;
+	ptr[0] = type;
+	put_be16(14 + name_len, &ptr[1]);
+	put_be64(uid, &ptr[3]);
+	ptr[11] = subtype;
+	ptr += 12;
+
+	if (type == ITEM_FOLDER)
+		*ptr++ = 0x01;	/* playable */
+
+	put_be16(CHARACTER_SET_UTF8, ptr);
+	put_be16(name_len, ptr + 2);
+	memcpy(ptr + 4, name, name_len);
+	ptr += 4 + name_len;
+
+	/* Media elements come without attributes, the displayable name is
+	 * what car kits show in lists */
+	if (type == ITEM_MEDIA_ELEMENT)
+		*ptr++ = 0;
+
+	req->len = ptr - req->buf;
+	req->count++;
+
+	return TRUE;
+}
+
+static void browsing_player_list(struct control *control, uint8_t transaction,
+							uint32_t start)
+{
+	/* Passthrough, advanced control and browsing */
+	static const uint8_t features[16] = {
+		0xf8, 0xbf, 0xff, 0xbf, 0x1f, 0xfb, 0x3f, 0x68,
+	};
+	static const char name[] = "Media Player";
+	struct browsing_request *req;
+	uint8_t *ptr;
+
+	if (start > 0) {
+		browsing_reject(control, transaction, PDU_GET_FOLDER_ITEMS,
+						ERROR_RANGE_OUT_OF_BOUNDS);
+		return;
+	}
+
+	if (control->browsing_mtu < sizeof(struct avctp_browsing_header) +
+						5 + 31 + sizeof(name) - 1) {
+		browsing_reject(control, transaction, PDU_GET_FOLDER_ITEMS,
+							ERROR_INTERNAL);
+		return;
+	}
+
+	req = browsing_request_new(control, transaction, PDU_GET_FOLDER_ITEMS);
+	req->len += 5;
+
+	ptr = req->buf + req->len;
+	ptr[0] = ITEM_MEDIA_PLAYER;
+	put_be16(28 + sizeof(name) - 1, &ptr[1]);
+	put_be16(BROWSED_PLAYER_ID, &ptr[3]);
+	ptr[5] = 0x01;			/* audio */
+	put_be32(0, &ptr[6]);
+	ptr[10] = control->mdata->current_play_status;
+	memcpy(&ptr[11], features, sizeof(features));
+	put_be16(CHARACTER_SET_UTF8, &ptr[27]);
+	put_be16(sizeof(name) - 1, &ptr[29]);
+	memcpy(&ptr[31], name, sizeof(name) - 1);
+
+	req->len += 31 + sizeof(name) - 1;
+	req->count = 1;
+
+	browsing_request_finish(control, STATUS_OP_COMPLETED);
+}
+
+static void browsing_get_folder_items(struct control *control,
+					uint8_t transaction, uint8_t *params,
+					uint16_t len)
+{
+	struct browsing_request *req;
+	uint8_t scope;
+	uint32_t start, end;
+
+	if (len < 10) {
+		browsing_reject(control, transaction, PDU_GET_FOLDER_ITEMS,
+						ERROR_INVALID_PARAMETER);
+		return;
+	}
+
+	scope = params[0];
+	start = ntohl(bt_get_unaligned((uint32_t *) &params[1]));
+	end = ntohl(bt_get_unaligned((uint32_t *) &params[5]));
+
+	DBG("GetFolderItems scope %u items %u-%u", scope, start, end);
+
+	if (start > end) {
+		browsing_reject(control, transaction, PDU_GET_FOLDER_ITEMS,
+						ERROR_RANGE_OUT_OF_BOUNDS);
+		return;
+	}
+
+	switch (scope) {
+	case SCOPE_MEDIA_PLAYER_LIST:
+		browsing_player_list(control, transaction, start);
+		return;
+	case SCOPE_VIRTUAL_FILESYSTEM:
+	case SCOPE_NOW_PLAYING:
+		break;
+	default:
+		browsing_reject(control, transaction, PDU_GET_FOLDER_ITEMS,
+							ERROR_INVALID_SCOPE);
+		return;
+	}
+
+	req = browsing_request_new(control, transaction, PDU_GET_FOLDER_ITEMS);
+	req->scope = scope;
+	req->next = start;
+	req->end = end;
+	/* Room for status, UID counter and number of items */
+	req->len += 5;
+
+	browsing_request_page(control);
+}
+
+static void browsing_change_path(struct control *control,
+					uint8_t transaction, uint8_t *params,
+					uint16_t len)
+{
+	uint8_t direction;
+	uint64_t uid;
+
+	if (len < 11) {
+		browsing_reject(control, transaction, PDU_CHANGE_PATH,
+						ERROR_INVALID_PARAMETER);
+		return;
+	}
+
+	direction = params[2];
+	uid = ntoh64(bt_get_unaligned((uint64_t *) &params[3]));
+
+	if (direction > 0x01) {
+		browsing_reject(control, transaction, PDU_CHANGE_PATH,
+						ERROR_INVALID_DIRECTION);
+		return;
+	}
+
+	browsing_request_new(control, transaction, PDU_CHANGE_PATH);
+
+	g_dbus_emit_signal(control->dev->conn, control->dev->path,
+				AUDIO_CONTROL_INTERFACE, "ChangePath",
+				DBUS_TYPE_BYTE, &direction,
+				DBUS_TYPE_UINT64, &uid,
+				DBUS_TYPE_INVALID);
+}
+
+static void browsing_set_player(struct control *control,
+					uint8_t transaction, uint8_t *params,
+					uint16_t len)
+{
+	uint16_t player_id;
+
+	if (len < 2) {
+		browsing_reject(control, transaction, PDU_SET_BROWSED_PLAYER,
+						ERROR_INVALID_PARAMETER);
+		return;
+	}
+
+	player_id = ntohs(bt_get_unaligned((uint16_t *) params));
+	if (player_id != BROWSED_PLAYER_ID) {
+		browsing_reject(control, transaction, PDU_SET_BROWSED_PLAYER,
+						ERROR_INVALID_PLAYER_ID);
+		return;
+	}
+
+	browsing_request_new(control, transaction, PDU_SET_BROWSED_PLAYER);
+
+	g_dbus_emit_signal(control->dev->conn, control->dev->path,
+				AUDIO_CONTROL_INTERFACE, "SetBrowsedPlayer",
+				DBUS_TYPE_UINT16, &player_id,
+				DBUS_TYPE_INVALID);
+}
+
+static void browsing_disconnect(struct control *control)
+{
+	browsing_request_free(control);
+
+	if (control->browsing_io_id) {
+		g_source_remove(control->browsing_io_id);
+		control->browsing_io_id = 0;
+	}
+
+	if (control->browsing_io) {
+		g_io_channel_shutdown(control->browsing_io, TRUE, NULL);
+		g_io_channel_unref(control->browsing_io);
+		control->browsing_io = NULL;
+	}
+}
+
+static gboolean browsing_cb(GIOChannel *chan, GIOCondition cond,
+							gpointer data)
+{
+	struct control *control = data;
+	uint8_t buf[AVCTP_BROWSING_MTU];
+	struct avctp_browsing_header *hdr = (struct avctp_browsing_header *) buf;
+	uint8_t *params = buf + sizeof(*hdr);
+	uint16_t len;
+	int ret, sock;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		goto failed;
+
+	sock = g_io_channel_unix_get_fd(chan);
+
+	ret = read(sock, buf, sizeof(buf));
+	if (ret <= 0)
+		goto failed;
+
+	if ((size_t) ret < sizeof(*hdr)) {
+		error("Too small AVCTP browsing packet");
+		goto failed;
+	}
+
+	len = ntohs(hdr->param_len);
+	if (len > ret - sizeof(*hdr))
+		len = ret - sizeof(*hdr);
+
+	DBG("AVCTP browsing transaction %u, C/R %u, PDU 0x%02X, %u bytes",
+			hdr->avctp.transaction, hdr->avctp.cr, hdr->pdu_id, len);
+
+	if (hdr->avctp.cr != AVCTP_COMMAND)
+		return TRUE;
+
+	if (hdr->avctp.pid != htons(AV_REMOTE_SVCLASS_ID)) {
+		hdr->avctp.ipid = 1;
+		hdr->avctp.cr = AVCTP_RESPONSE;
+		if (write(sock, buf, sizeof(hdr->avctp)) < 0)
+			goto failed;
+		return TRUE;
+	}
+
+	switch (hdr->pdu_id) {
+	case PDU_SET_BROWSED_PLAYER:
+		browsing_set_player(control, hdr->avctp.transaction,
+								params, len);
+		break;
+	case PDU_GET_FOLDER_ITEMS:
+		browsing_get_folder_items(control, hdr->avctp.transaction,
+								params, len);
+		break;
+	case PDU_CHANGE_PATH:
+		browsing_change_path(control, hdr->avctp.transaction,
+								params, len);
+		break;
+	default:
+		browsing_reject(control, hdr->avctp.transaction,
+					PDU_GENERAL_REJECT, ERROR_INVALID_PDU);
+		break;
+	}
+
+	return TRUE;
+
+failed:
+	DBG("AVCTP browsing channel of %p got disconnected", control);
+	control->browsing_io_id = 0;
+	browsing_disconnect(control);
+	return FALSE;
+}
+
+static void browsing_connect_cb(GIOChannel *chan, GError *err, gpointer data)
+{
+	struct control *control = data;
+	GError *gerr = NULL;
+	uint16_t omtu;
+
+	if (err) {
+		error("%s", err->message);
+		browsing_disconnect(control);
+		return;
+	}
+
+	bt_io_get(chan, BT_IO_L2CAP, &gerr,
+			BT_IO_OPT_OMTU, &omtu,
+			BT_IO_OPT_INVALID);
+	if (gerr) {
+		error("%s", gerr->message);
+		g_error_free(gerr);
+		browsing_disconnect(control);
+		return;
+	}
+
+	DBG("AVCTP browsing channel connected, MTU %u", omtu);
+
+	control->browsing_mtu = MIN(omtu, AVCTP_BROWSING_MTU);
+	control->browsing_io_id = g_io_add_watch(chan,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				browsing_cb, control);
+}
+
+static void browsing_confirm_cb(GIOChannel *chan, gpointer data)
+{
+	struct audio_device *dev;
+	struct control *control;
+	char address[18];
+	bdaddr_t src, dst;
+	GError *err = NULL;
+
+	bt_io_get(chan, BT_IO_L2CAP, &err,
+			BT_IO_OPT_SOURCE_BDADDR, &src,
+			BT_IO_OPT_DEST_BDADDR, &dst,
+			BT_IO_OPT_DEST, address,
+			BT_IO_OPT_INVALID);
+	if (err) {
+		error("%s", err->message);
+		g_error_free(err);
+		g_io_channel_shutdown(chan, TRUE, NULL);
+		return;
+	}
+
+	/* Browsing goes along an authorized control channel */
+	dev = manager_get_device(&src, &dst, FALSE);
+	if (!dev || !dev->control ||
+			dev->control->state != AVCTP_STATE_CONNECTED ||
+			dev->control->browsing_io) {
+		error("Refusing unexpected browsing connect from %s",
+								address);
+		g_io_channel_shutdown(chan, TRUE, NULL);
+		return;
+	}
+
+	control = dev->control;
+	control->browsing_io = g_io_channel_ref(chan);
+
+	if (!bt_io_accept(chan, browsing_connect_cb, control, NULL, &err)) {
+		error("bt_io_accept: %s", err->message);
+		g_error_free(err);
+		browsing_disconnect(control);
+	}
+}
+
+static GIOChannel *browsing_server_socket(const bdaddr_t *src,
+							gboolean master)
+{
+	GError *err = NULL;
+	GIOChannel *io;
+
+	io = bt_io_listen(BT_IO_L2CAP, NULL, browsing_confirm_cb, NULL,
+				NULL, &err,
+				BT_IO_OPT_SOURCE_BDADDR, src,
+				BT_IO_OPT_PSM, AVCTP_BROWSING_PSM,
+				BT_IO_OPT_SEC_LEVEL, BT_IO_SEC_MEDIUM,
+				BT_IO_OPT_MASTER, master,
+				BT_IO_OPT_MODE, L2CAP_MODE_ERTM,
+				BT_IO_OPT_IMTU, AVCTP_BROWSING_MTU,
+				BT_IO_OPT_INVALID);
+	if (!io) {
+		error("%s", err->message);
+		g_error_free(err);
+	}
+
+	return io;
+}
+
 static int uinput_create(char *name)
 {
 	struct uinput_dev dev;
@@ -957,12 +1731,23 @@ static void init_uinput(struct control *control)
 
 	ba2str(&dev->dst, address);
 
+	if (shared_input && shared_uinput >= 0) {
+		shared_uinput_refs++;
+		control->uinput = shared_uinput;
+		DBG("AVRCP: sharing uinput with %s", address);
+		return;
+	}
+
 	/* Use device name from config file if specified */
 	uinput_dev_name = input_device_name;
 	if (!uinput_dev_name)
-		uinput_dev_name = address;
+		uinput_dev_name = shared_input ? "AVRCP" : address;
 
 	control->uinput = uinput_create(uinput_dev_name);
+	if (shared_input && control->uinput >= 0) {
+		shared_uinput = control->uinput;
+		shared_uinput_refs = 1;
+	}
 	if (control->uinput < 0)
 		error("AVRCP: failed to init uinput for %s", address);
 	else
@@ -1168,7 +1953,25 @@ int avrcp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 			DBG("audio.conf: %s", err->message);
 			input_device_name = NULL;
 			g_error_free(err);
+			err = NULL;
 		}
+
+		tmp = g_key_file_get_boolean(config, "AVRCP",
+							"SharedInputDevice", &err);
+		if (err) {
+			DBG("audio.conf: %s", err->message);
+			g_error_free(err);
+			err = NULL;
+		} else
+			shared_input = tmp;
+
+		tmp = g_key_file_get_boolean(config, "AVRCP",
+							"Browsing", &err);
+		if (err) {
+			DBG("audio.conf: %s", err->message);
+			g_error_free(err);
+		} else
+			browsing_enabled = tmp;
 	}
 
 	server = g_new0(struct avctp_server, 1);
@@ -1178,18 +1981,20 @@ int avrcp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 	if (!connection)
 		connection = dbus_connection_ref(conn);
 
-	record = avrcp_tg_record();
+	/* Without the channel the record doesn't offer browsing either */
+	if (browsing_enabled)
+		server->browsing_io = browsing_server_socket(src, master);
+
+	record = avrcp_tg_record(server->browsing_io != NULL);
 	if (!record) {
 		error("Unable to allocate new service record");
-		g_free(server);
-		return -1;
+		goto failed;
 	}
 
 	if (add_record_to_server(src, record) < 0) {
 		error("Unable to register AVRCP target service record");
-		g_free(server);
 		sdp_record_free(record);
-		return -1;
+		goto failed;
 	}
 	server->tg_record_id = record->handle;
 
@@ -1197,15 +2002,15 @@ int avrcp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 	record = avrcp_ct_record();
 	if (!record) {
 		error("Unable to allocate new service record");
-		g_free(server);
-		return -1;
+		remove_record_from_server(server->tg_record_id);
+		goto failed;
 	}
 
 	if (add_record_to_server(src, record) < 0) {
 		error("Unable to register AVRCP controller service record");
 		sdp_record_free(record);
-		g_free(server);
-		return -1;
+		remove_record_from_server(server->tg_record_id);
+		goto failed;
 	}
 	server->ct_record_id = record->handle;
 #endif
@@ -1216,8 +2021,7 @@ int avrcp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 		remove_record_from_server(server->ct_record_id);
 #endif
 		remove_record_from_server(server->tg_record_id);
-		g_free(server);
-		return -1;
+		goto failed;
 	}
 
 	bacpy(&server->src, src);
@@ -1225,6 +2029,16 @@ int avrcp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 	servers = g_slist_append(servers, server);
 
 	return 0;
+
+failed:
+	if (server->browsing_io) {
+		g_io_channel_shutdown(server->browsing_io, TRUE, NULL);
+		g_io_channel_unref(server->browsing_io);
+	}
+
+	g_free(server);
+
+	return -1;
 }
 
 static struct avctp_server *find_server(GSList *list, const bdaddr_t *src)
@@ -1256,6 +2070,12 @@ void avrcp_unregister(const bdaddr_t *src)
 
 	g_io_channel_shutdown(server->io, TRUE, NULL);
 	g_io_channel_unref(server->io);
+
+	if (server->browsing_io) {
+		g_io_channel_shutdown(server->browsing_io, TRUE, NULL);
+		g_io_channel_unref(server->browsing_io);
+	}
+
 	g_free(server);
 
 	if (servers)
@@ -1397,7 +2217,7 @@ static DBusMessage *update_notification(DBusConnection *conn, DBusMessage *msg,
 			ERROR_INTERFACE ".NotConnected",
 				"Device not Connected");
 
-	send_notification(control, event_id, event_data);
+	control_notify(control, event_id, event_data);
 
 	return dbus_message_new_method_return(msg);
 }
@@ -1444,6 +2264,8 @@ static DBusMessage *update_metadata(DBusConnection *conn, DBusMessage *msg,
 	DBusMessage *reply;
 	const gchar *title, *artist, *album;
 	const gchar *media_number, *total_media_count, *playing_time;
+	const char *values[METADATA_MAX_FIELDS];
+	struct meta_data_blob *blob;
 	int err;
 
 	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &title,
@@ -1459,30 +2281,130 @@ static DBusMessage *update_metadata(DBusConnection *conn, DBusMessage *msg,
 
 	DBG("MetaData is %s %s %s %s %s %s", title, artist, album, media_number,
 			total_media_count, playing_time);
-	if (strlen(title) < METADATA_MAX_STRING_LEN)
-		strcpy(mdata->title, title);
-	else
-		strncpy(mdata->title, title, (METADATA_MAX_STRING_LEN-1));
-	if (strlen(artist) < METADATA_MAX_STRING_LEN)
-		strcpy(mdata->artist, artist);
-	else
-		strncpy(mdata->artist, artist, (METADATA_MAX_STRING_LEN-1));
-	if (strlen(album) < METADATA_MAX_STRING_LEN)
-		strcpy(mdata->album, album);
-	else
-		strncpy(mdata->album, album, (METADATA_MAX_STRING_LEN-1));
-	if (strlen(media_number) < METADATA_MAX_NUMBER_LEN)
-		strcpy(mdata->media_number, media_number);
-	else
-		strncpy(mdata->media_number, media_number, (METADATA_MAX_NUMBER_LEN-1));
-	if (strlen(total_media_count) < METADATA_MAX_NUMBER_LEN)
-		strcpy(mdata->total_media_count, total_media_count);
-	else
-		strncpy(mdata->total_media_count, total_media_count, (METADATA_MAX_NUMBER_LEN-1));
-	if (strlen(playing_time) < METADATA_MAX_NUMBER_LEN)
-		strcpy(mdata->playing_time, playing_time);
+
+	values[0] = title;
+	values[1] = artist;
+	values[2] = album;
+	values[3] = media_number;
+	values[4] = total_media_count;
+	values[5] = playing_time;
+
+	blob = metadata_blob_new(values);
+	metadata_blob_unref(mdata->blob);
+	mdata->blob = blob;
+
+	return dbus_message_new_method_return(msg);
+}
+
+static DBusMessage *update_folder_items(DBusConnection *conn,
+						DBusMessage *msg, void *data)
+{
+	struct audio_device *device = data;
+	struct control *control = device->control;
+	struct browsing_request *req = control->browsing;
+	DBusMessageIter iter, array;
+	dbus_uint16_t uid_counter;
+	uint32_t received = 0;
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return btd_error_invalid_args(msg);
+
+	if (req == NULL || req->pdu_id != PDU_GET_FOLDER_ITEMS)
+		return btd_error_not_available(msg);
+
+	dbus_message_iter_get_basic(&iter, &uid_counter);
+	dbus_message_iter_next(&iter);
+	dbus_message_iter_recurse(&iter, &array);
+
+	control->uid_counter = uid_counter;
+
+	/* Items go straight from the message into the response */
+	while (!req->full && dbus_message_iter_get_arg_type(&array) ==
+							DBUS_TYPE_STRUCT) {
+		DBusMessageIter item;
+		dbus_uint64_t uid;
+		uint8_t type, subtype;
+		const char *name;
+
+		dbus_message_iter_recurse(&array, &item);
+		dbus_message_iter_get_basic(&item, &uid);
+		dbus_message_iter_next(&item);
+		dbus_message_iter_get_basic(&item, &type);
+		dbus_message_iter_next(&item);
+		dbus_message_iter_get_basic(&item, &subtype);
+		dbus_message_iter_next(&item);
+		dbus_message_iter_get_basic(&item, &name);
+
+		if (type != ITEM_FOLDER && type != ITEM_MEDIA_ELEMENT)
+			type = ITEM_MEDIA_ELEMENT;
+
+		if (!browsing_pack_item(req, uid, type, subtype, name))
+			req->full = TRUE;
+		else
+			received++;
+
+		dbus_message_iter_next(&array);
+	}
+
+	req->next += received;
+
+	DBG("Packed %u items, %zu of %zu bytes", req->count, req->len,
+								req->size);
+
+	if (req->count == 0)
+		browsing_request_finish(control, ERROR_RANGE_OUT_OF_BOUNDS);
+	else if (req->full || received < req->asked || req->next > req->end ||
+							req->next == 0)
+		browsing_request_finish(control, STATUS_OP_COMPLETED);
 	else
-		strncpy(mdata->playing_time, playing_time, (METADATA_MAX_NUMBER_LEN-1));
+		browsing_request_page(control);
+
+	return dbus_message_new_method_return(msg);
+}
+
+static DBusMessage *update_path(DBusConnection *conn, DBusMessage *msg,
+								void *data)
+{
+	struct audio_device *device = data;
+	struct control *control = device->control;
+	struct browsing_request *req = control->browsing;
+	uint8_t buf[sizeof(struct avctp_browsing_header) + 10];
+	uint8_t *params = buf + sizeof(struct avctp_browsing_header);
+	uint8_t status;
+	uint32_t items;
+	size_t len;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_BYTE, &status,
+						DBUS_TYPE_UINT32, &items,
+						DBUS_TYPE_INVALID))
+		return btd_error_invalid_args(msg);
+
+	if (req == NULL || (req->pdu_id != PDU_CHANGE_PATH &&
+				req->pdu_id != PDU_SET_BROWSED_PLAYER))
+		return btd_error_not_available(msg);
+
+	if (status != STATUS_OP_COMPLETED) {
+		browsing_request_finish(control, status);
+		return dbus_message_new_method_return(msg);
+	}
+
+	params[0] = status;
+
+	if (req->pdu_id == PDU_CHANGE_PATH) {
+		put_be32(items, &params[1]);
+		len = 5;
+	} else {
+		/* The player starts over from its root folder */
+		put_be16(control->uid_counter, &params[1]);
+		put_be32(items, &params[3]);
+		put_be16(CHARACTER_SET_UTF8, &params[7]);
+		params[9] = 0;
+		len = 10;
+	}
+
+	browsing_send(control, req->transaction, req->pdu_id, buf,
+				sizeof(struct avctp_browsing_header) + len);
+	browsing_request_free(control);
 
 	return dbus_message_new_method_return(msg);
 }
@@ -1525,6 +2447,8 @@ static GDBusMethodTable control_methods[] = {
 	{ "UpdateMetaData",	"ssssss",	"",	update_metadata },
 	{ "UpdatePlayStatus",	"uuu",	"",	update_play_status },
 	{ "UpdateNotification",	"qt",	"",	update_notification },
+	{ "UpdateFolderItems",	"qa(tyys)",	"",	update_folder_items },
+	{ "UpdatePath",		"yu",	"",	update_path },
 	{ NULL, NULL, NULL, NULL }
 };
 
@@ -1533,40 +2457,16 @@ static GDBusSignalTable control_signals[] = {
 	{ "Disconnected",		"",	G_DBUS_SIGNAL_FLAG_DEPRECATED},
 	{ "PropertyChanged",		"sv"	},
 	{ "GetPlayStatus",		""	},
+	{ "SetBrowsedPlayer",		"q"	},
+	{ "GetFolderItems",		"yuu"	},
+	{ "ChangePath",			"yt"	},
 	{ NULL, NULL }
 };
 
 static void metadata_cleanup(struct meta_data *mdata) {
-	if (mdata->title) {
-		g_free(mdata->title);
-		mdata->title = NULL;
-	}
-	if (mdata->artist) {
-		g_free(mdata->artist);
-		mdata->artist = NULL;
-	}
-	if (mdata->album) {
-		g_free(mdata->album);
-		mdata->album = NULL;
-	}
-	if (mdata->media_number) {
-		g_free(mdata->media_number);
-		mdata->media_number = NULL;
-	}
-	if (mdata->total_media_count) {
-		g_free(mdata->total_media_count);
-		mdata->total_media_count = NULL;
-	}
-	if (mdata->playing_time) {
-		g_free(mdata->playing_time);
-		mdata->playing_time = NULL;
-	}
-	if (mdata->remaining_mdata) {
-		g_free(mdata->remaining_mdata);
-		mdata->remaining_mdata = NULL;
-		mdata->remaining_mdata_len = 0;
-	}
-
+	metadata_cont_clear(mdata);
+	metadata_blob_unref(mdata->blob);
+	mdata->blob = NULL;
 }
 
 static void path_unregister(void *data)
@@ -1628,6 +2528,8 @@ struct control *control_init(struct audio_device *dev, uint16_t uuid16)
 {
 	struct control *control;
 	struct meta_data *mdata;
+	const char *values[METADATA_MAX_FIELDS];
+	int i;
 
 	if (!g_dbus_register_interface(dev->conn, dev->path,
 					AUDIO_CONTROL_INTERFACE,
@@ -1652,39 +2554,18 @@ struct control *control_init(struct audio_device *dev, uint16_t uuid16)
 		DBG("No Memory available for meta data");
 		return NULL;
 	}
-	mdata->title = g_new0(gchar, METADATA_MAX_STRING_LEN);
-	mdata->artist = g_new0(gchar, METADATA_MAX_STRING_LEN);
-	mdata->album = g_new0(gchar, METADATA_MAX_STRING_LEN);
-	mdata->media_number = g_new0(gchar, METADATA_MAX_NUMBER_LEN);
-	mdata->total_media_count = g_new0(gchar, METADATA_MAX_NUMBER_LEN);
-	mdata->playing_time = g_new0(gchar, METADATA_MAX_NUMBER_LEN);
-
-	if (!(mdata->title) || !(mdata->artist) || !(mdata->album) ||
-			!(mdata->media_number) || !(mdata->total_media_count) ||
-			!(mdata->playing_time)) {
-		DBG("No Memory available for meta data");
-		metadata_cleanup(mdata);
-		g_free(mdata);
-		return NULL;
-	}
-
-	strcpy(mdata->title,DEFAULT_METADATA_STRING);
-	strcpy(mdata->artist,DEFAULT_METADATA_STRING);
-	strcpy(mdata->album,DEFAULT_METADATA_STRING);
-	strcpy(mdata->media_number,DEFAULT_METADATA_NUMBER);
-	strcpy(mdata->total_media_count,DEFAULT_METADATA_NUMBER);
-	strcpy(mdata->playing_time,DEFAULT_METADATA_NUMBER);
-	mdata->remaining_mdata = NULL;
-	mdata->remaining_mdata_len = 0;
-	mdata->trans_id_event_track = 0;
-	mdata->trans_id_event_playback = 0;
-	mdata->trans_id_event_addressed_player = 0;
-	mdata->trans_id_event_available_player = 0;
+	for (i = 0; i < METADATA_MAX_FIELDS; i++)
+		values[i] = metadata_fields[i].def;
+
+	mdata->blob = metadata_blob_new(values);
+	mdata->cont_blob = NULL;
+	mdata->cont_len = 0;
+	/* No track selected and players unknown until told otherwise */
+	for (i = 0; i <= EVENT_MAX; i++)
+		mdata->notify[i].value = G_MAXUINT64;
+	mdata->notify[EVENT_PLAYBACK_STATUS_CHANGED].value = STATUS_STOPPED;
+	mdata->notify_id = 0;
 	mdata->trans_id_get_play_status = 0;
-	mdata->reg_track_changed = FALSE;
-	mdata->reg_playback_status = FALSE;
-	mdata->reg_addressed_player = FALSE;
-	mdata->reg_available_player = FALSE;
 	mdata->req_get_play_status = FALSE;
 	mdata->current_play_status = STATUS_STOPPED;
 
@@ -1738,13 +2619,16 @@ static int send_meta_data_continue_response(struct control *control,
 						uint8_t trans_id)
 {
 	struct meta_data *mdata = control->mdata;
-	int header_len = sizeof(struct avrcp_params);
-	int meta_data_len = mdata->remaining_mdata_len;
-	unsigned char buf[meta_data_len + header_len];
+	struct meta_data_blob *blob = mdata->cont_blob;
+	unsigned char buf[sizeof(struct avrcp_params)];
 	struct avrcp_params *params = (struct avrcp_params *) buf;
 	struct avrcp_header *avrcp = &params->avrcp;
 	struct avctp_header *avctp = &avrcp->avctp;
-	int sk = g_io_channel_unix_get_fd(control->io);
+	struct iovec iov[METADATA_MAX_FIELDS + 1];
+	size_t possible_len = AVRCP_MAX_PKT_SIZE - sizeof(buf) +
+						sizeof(struct avctp_header);
+	size_t len;
+	int cnt, ret, sk = g_io_channel_unix_get_fd(control->io);
 
 	memset(buf, 0, sizeof(buf));
 
@@ -1760,47 +2644,45 @@ static int send_meta_data_continue_response(struct control *control,
 	set_company_id(params->company_id, IEEEID_BTSIG);
 	params->pdu_id = PDU_GET_ELEMENT_ATTRIBUTES;
 
-	memcpy(buf + header_len, mdata->remaining_mdata, mdata->remaining_mdata_len);
-
-	if (meta_data_len + header_len - sizeof(struct avctp_header) > AVRCP_MAX_PKT_SIZE) {
-		int possible_len = AVRCP_MAX_PKT_SIZE - header_len + sizeof(struct avctp_header);
-
-		memcpy(mdata->remaining_mdata, buf + header_len + possible_len,
-		       mdata->remaining_mdata_len - possible_len);
-		mdata->remaining_mdata_len -= possible_len;
-
+	if (mdata->cont_len > possible_len) {
 		params->packet_type = AVCTP_PACKET_CONTINUE;
-		meta_data_len = possible_len;
+		len = possible_len;
 	} else {
 		params->packet_type = AVCTP_PACKET_END;
-
-		g_free(mdata->remaining_mdata);
-		mdata->remaining_mdata = NULL;
-		mdata->remaining_mdata_len = 0;
+		len = mdata->cont_len;
 	}
 
-	params->param_len = htons(meta_data_len);
+	params->param_len = htons(len);
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(buf);
+	cnt = metadata_blob_iov(blob, mdata->cont_mask, mdata->cont_offset,
+							len, &iov[1]);
+
+	ret = writev(sk, iov, cnt + 1);
 
-	return write(sk, buf, meta_data_len + header_len);
+	mdata->cont_offset += len;
+	mdata->cont_len -= len;
+	if (mdata->cont_len == 0)
+		metadata_cont_clear(mdata);
+
+	return ret;
 }
 
 static int send_meta_data(struct control *control, uint8_t trans_id, uint8_t att_mask)
 {
 	struct meta_data *mdata = control->mdata;
-	int header_len = sizeof(struct avrcp_caps);
-	/* calculate for the worst case */
-	int meta_data_len = strlen(mdata->title) + strlen(mdata->artist) +
-		strlen(mdata->album) + strlen(mdata->media_number) +
-		strlen(mdata->total_media_count) + strlen(mdata->playing_time) +
-		(sizeof(struct meta_data_field) * METADATA_MAX_FIELDS);
-	unsigned char buf[meta_data_len + header_len];
+	struct meta_data_blob *blob = mdata->blob;
+	unsigned char buf[sizeof(struct avrcp_caps)];
 	struct avrcp_caps *caps = (struct avrcp_caps *) buf;
 	struct avrcp_params *params = &caps->params;
 	struct avrcp_header *avrcp = &params->avrcp;
 	struct avctp_header *avctp = &avrcp->avctp;
-	struct meta_data_field *mdata_field = (struct meta_data_field *) &buf[header_len];
-	int count = 0, len = 0, total_len = 0, sk = g_io_channel_unix_get_fd(control->io);
-	uint8_t *op;
+	struct iovec iov[METADATA_MAX_FIELDS + 1];
+	size_t possible_len = AVRCP_MAX_PKT_SIZE - sizeof(buf) +
+						sizeof(struct avctp_header);
+	size_t meta_data_len = 0;
+	int i, count = 0, cnt, sk = g_io_channel_unix_get_fd(control->io);
 
 	memset(buf, 0, sizeof(buf));
 
@@ -1818,116 +2700,45 @@ static int send_meta_data(struct control *control, uint8_t trans_id, uint8_t att
 	params->packet_type = AVCTP_PACKET_SINGLE;
 	DBG("Att mask is %d", att_mask);
 
-	meta_data_len = 0;
-	op = (uint8_t *) mdata_field;
-
-	if (att_mask & (1 << (METADATA_TITLE - 1))) {
-		mdata_field->att_id = htonl(METADATA_TITLE);
-		mdata_field->char_set_id = htons(CHARACTER_SET_UTF8);
-		len = strlen(mdata->title);
-		mdata_field->att_len = htons(len);
-		strncpy(mdata_field->val, mdata->title, len);
-		meta_data_len += len + sizeof(struct meta_data_field);
-		DBG("METADATA_TITLE %d %d", len, meta_data_len);
-		count++;
-	}
-
-	if (att_mask & (1 << (METADATA_ARTIST - 1))) {
-		if (len > 0) {
-			op += sizeof(struct meta_data_field) + len;
-		}
-		mdata_field = (struct meta_data_field *)op;
-		mdata_field->att_id = htonl(METADATA_ARTIST);
-		mdata_field->char_set_id = htons(CHARACTER_SET_UTF8);
-		len = strlen(mdata->artist);
-		mdata_field->att_len = htons(len);
-		strncpy(mdata_field->val, mdata->artist, len);
-		meta_data_len += len + sizeof(struct meta_data_field);
-		count++;
-	}
-
-	if (att_mask & (1 << (METADATA_ALBUM - 1))) {
-		if (len > 0) {
-			op += sizeof(struct meta_data_field) + len;
-		}
-		mdata_field = (struct meta_data_field *)op;
-		mdata_field->att_id = htonl(METADATA_ALBUM);
-		mdata_field->char_set_id = htons(CHARACTER_SET_UTF8);
-		len = strlen(mdata->album);
-		mdata_field->att_len = htons(len);
-		strncpy(mdata_field->val, mdata->album, len);
-		meta_data_len += len + sizeof(struct meta_data_field);
-		count++;
-	}
-
-	if (att_mask & (1 << (METADATA_MEDIA_NUMBER - 1))) {
-		if (len > 0) {
-			op += sizeof(struct meta_data_field) + len;
-		}
-		mdata_field = (struct meta_data_field *)op;
-		mdata_field->att_id = htonl(METADATA_MEDIA_NUMBER);
-		mdata_field->char_set_id = htons(CHARACTER_SET_UTF8);
-		len = strlen(mdata->media_number);
-		mdata_field->att_len = htons(len);
-		strncpy(mdata_field->val, mdata->media_number, len);
-		meta_data_len += len + sizeof(struct meta_data_field);
-		count++;
-	}
-
-	if (att_mask & (1 << (METADATA_TOTAL_MEDIA - 1))) {
-		if (len > 0) {
-			op += sizeof(struct meta_data_field) + len;
-		}
-		mdata_field = (struct meta_data_field *)op;
-		mdata_field->att_id = htonl(METADATA_TOTAL_MEDIA);
-		mdata_field->char_set_id = htons(CHARACTER_SET_UTF8);
-		len = strlen(mdata->total_media_count);
-		mdata_field->att_len = htons(len);
-		strncpy(mdata_field->val, mdata->total_media_count, len);
-		meta_data_len += len + sizeof(struct meta_data_field);
-		count++;
-	}
+	for (i = 0; i < METADATA_MAX_FIELDS; i++) {
+		if (!(att_mask & METADATA_FIELD_MASK(i)))
+			continue;
 
-	if (att_mask & (1 << (METADATA_PLAYING_TIME - 1))) {
-		if (len > 0) {
-			op += sizeof(struct meta_data_field) + len;
-		}
-		mdata_field = (struct meta_data_field *)op;
-		mdata_field->att_id = htonl(METADATA_PLAYING_TIME);
-		mdata_field->char_set_id = htons(CHARACTER_SET_UTF8);
-		len = strlen(mdata->playing_time);
-		mdata_field->att_len = htons(len);
-		strncpy(mdata_field->val, mdata->playing_time, len);
-		meta_data_len += len + sizeof(struct meta_data_field);
+		meta_data_len += blob->len[i];
 		count++;
 	}
 
 	caps->capability_id = count;
 
-	if ((meta_data_len + header_len - sizeof(struct avctp_header)) > AVRCP_MAX_PKT_SIZE) {
-		int possible_len = AVRCP_MAX_PKT_SIZE - header_len + sizeof(struct avctp_header);
-		DBG("meta len is %d header len is %d -> possible %d", meta_data_len, header_len, possible_len);
+	/* A new request drops whatever was left of the previous one */
+	metadata_cont_clear(mdata);
+
+	if (meta_data_len > possible_len) {
+		DBG("meta len is %zu -> possible %zu", meta_data_len,
+								possible_len);
 
 		params->packet_type = AVCTP_PACKET_START;
 
-		mdata->remaining_mdata = g_new0(gchar, meta_data_len - possible_len);
-		if (!(mdata->remaining_mdata)) {
-			return -ENOMEM;
-		}
-		mdata->remaining_mdata_len = meta_data_len - possible_len;
-		DBG("Remain meta data len is %d", mdata->remaining_mdata_len);
+		mdata->cont_blob = metadata_blob_ref(blob);
+		mdata->cont_mask = att_mask;
+		mdata->cont_offset = possible_len;
+		mdata->cont_len = meta_data_len - possible_len;
+		DBG("Remain meta data len is %zu", mdata->cont_len);
 
-		memcpy(mdata->remaining_mdata, buf + header_len + possible_len,
-		       mdata->remaining_mdata_len);
 		meta_data_len = possible_len;
 	}
-	params->param_len = htons(meta_data_len + header_len - sizeof(struct avrcp_params));
+	params->param_len = htons(meta_data_len + sizeof(buf) -
+						sizeof(struct avrcp_params));
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(buf);
+	cnt = metadata_blob_iov(blob, att_mask, 0, meta_data_len, &iov[1]);
 
-	return write(sk, buf, meta_data_len + header_len);
+	return writev(sk, iov, cnt + 1);
 }
 
 static int send_notification(struct control *control,
-		uint16_t event_id, uint16_t event_data)
+		uint16_t event_id, uint64_t event_data)
 {
 	struct meta_data *mdata = control->mdata;
 	struct avrcp_event event;
@@ -1935,10 +2746,11 @@ static int send_notification(struct control *control,
 	struct avrcp_params *params = &caps->params;
 	struct avrcp_header *avrcp = &params->avrcp;
 	struct avctp_header *avctp = &avrcp->avctp;
-	int len = 0, total_len = 0, sk = g_io_channel_unix_get_fd(control->io);
+	int total_len = 0, sk = g_io_channel_unix_get_fd(control->io);
 
 	memset(&event, 0, sizeof(event));
 
+	avctp->transaction = mdata->notify[event_id].transaction;
 	avctp->packet_type = AVCTP_PACKET_SINGLE;
 	avctp->cr = AVCTP_RESPONSE;
 	avctp->pid = htons(AV_REMOTE_SVCLASS_ID);
@@ -1954,45 +2766,104 @@ static int send_notification(struct control *control,
 
 	switch(event_id) {
 		case EVENT_TRACK_CHANGED:
-			if (mdata->reg_track_changed == FALSE)
-				return 0;
 			total_len = sizeof(event.caps) + sizeof(event.event.track_changed);
-			event.event.track_changed.track_high = 0;
+			event.event.track_changed.track_high = htonl(event_data >> 32);
 			event.event.track_changed.track_low = htonl(event_data);
-			avctp->transaction = mdata->trans_id_event_track;
-			mdata->reg_track_changed = FALSE;
 			break;
 		case EVENT_PLAYBACK_STATUS_CHANGED:
-			mdata->current_play_status = (uint8_t) event_data;
-			if (mdata->reg_playback_status == FALSE)
-				return 0;
 			total_len = sizeof(event.caps) + sizeof(event.event.playback_status_changed);
 			event.event.playback_status_changed.status = event_data;
-			avctp->transaction = mdata->trans_id_event_playback;
-			mdata->reg_playback_status = FALSE;
 			break;
 		case EVENT_ADDRESSED_PLAYER_CHANGED:
-			if (mdata->reg_addressed_player == FALSE)
-				return 0;
 			total_len = sizeof(event.caps) + sizeof(event.event.player_changed);
 			event.event.player_changed.player_id = htons(event_data);
 			event.event.player_changed.uid_counter = 0;
-			avctp->transaction = mdata->trans_id_event_addressed_player;
-			mdata->reg_addressed_player = FALSE;
 			break;
 		case EVENT_AVAILABLE_PLAYERS_CHANGED:
-			if (mdata->reg_available_player == FALSE)
-				return 0;
-			avctp->transaction = mdata->trans_id_event_available_player;
-			mdata->reg_available_player = FALSE;
 			total_len = sizeof(event.caps);
 			break;
+		default:
+			return 0;
 	}
 	params->param_len = htons(total_len + 1 - sizeof(event.caps));
 	DBG("Send Notification totallen %d", total_len);
 	return write(sk, (unsigned char *) &event, total_len);
 }
 
+static gboolean notify_flush(gpointer user_data)
+{
+	struct control *control = user_data;
+	struct meta_data *mdata = control->mdata;
+	uint16_t id;
+
+	mdata->notify_id = 0;
+
+	if (control->io == NULL)
+		return FALSE;
+
+	for (id = 1; id <= EVENT_MAX; id++) {
+		struct avrcp_notification *n = &mdata->notify[id];
+
+		if (!n->changed || !n->registered)
+			continue;
+
+		/* A CHANGED response completes the registration, the
+		 * controller has to register again for further changes */
+		n->changed = FALSE;
+		n->registered = FALSE;
+
+		send_notification(control, id, n->value);
+	}
+
+	return FALSE;
+}
+
+/* Records the new value of an event and queues a CHANGED response if it
+ * differs from the last one and the controller registered for it. All the
+ * changes of a main loop iteration go out together with their final
+ * values, repeated updates with the same value generate no traffic. */
+static void control_notify(struct control *control, uint16_t event_id,
+							uint64_t value)
+{
+	struct meta_data *mdata = control->mdata;
+	struct avrcp_notification *n;
+
+	if (event_id == 0 || event_id > EVENT_MAX)
+		return;
+
+	if (event_id == EVENT_PLAYBACK_STATUS_CHANGED)
+		mdata->current_play_status = (uint8_t) value;
+
+	n = &mdata->notify[event_id];
+	if (n->value == value)
+		return;
+
+	n->value = value;
+
+	if (!n->registered)
+		return;
+
+	n->changed = TRUE;
+
+	if (mdata->notify_id == 0)
+		mdata->notify_id = g_idle_add(notify_flush, control);
+}
+
+static void notify_reset(struct meta_data *mdata)
+{
+	uint16_t id;
+
+	if (mdata->notify_id) {
+		g_source_remove(mdata->notify_id);
+		mdata->notify_id = 0;
+	}
+
+	for (id = 0; id <= EVENT_MAX; id++) {
+		mdata->notify[id].registered = FALSE;
+		mdata->notify[id].changed = FALSE;
+	}
+}
+
 static int send_play_status(struct control *control, uint32_t song_len,
 			uint32_t song_position, uint8_t play_status)
 {
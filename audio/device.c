@@ -514,16 +514,14 @@ static void device_headset_cb(struct audio_device *dev,
 	}
 }
 
-static DBusMessage *dev_connect(DBusConnection *conn, DBusMessage *msg,
-								void *data)
+int audio_device_connect(struct audio_device *dev)
 {
-	struct audio_device *dev = data;
 	struct dev_priv *priv = dev->priv;
 
 	if (priv->state == AUDIO_STATE_CONNECTING)
-		return btd_error_in_progress(msg);
+		return -EINPROGRESS;
 	else if (priv->state == AUDIO_STATE_CONNECTED)
-		return btd_error_already_connected(msg);
+		return -EALREADY;
 
 	dev->auto_connect = TRUE;
 
@@ -534,8 +532,7 @@ static DBusMessage *dev_connect(DBusConnection *conn, DBusMessage *msg,
 		struct avdtp *session = avdtp_get(&dev->src, &dev->dst);
 
 		if (!session)
-			return btd_error_failed(msg,
-					"Failed to get AVDTP session");
+			return -ENOMEM;
 
 		sink_setup_stream(dev->sink, session);
 		avdtp_unref(session);
@@ -544,7 +541,29 @@ static DBusMessage *dev_connect(DBusConnection *conn, DBusMessage *msg,
 	/* The previous calls should cause a call to the state callback to
 	 * indicate AUDIO_STATE_CONNECTING */
 	if (priv->state != AUDIO_STATE_CONNECTING)
+		return -EIO;
+
+	return 0;
+}
+
+static DBusMessage *dev_connect(DBusConnection *conn, DBusMessage *msg,
+								void *data)
+{
+	struct audio_device *dev = data;
+	struct dev_priv *priv = dev->priv;
+
+	switch (audio_device_connect(dev)) {
+	case 0:
+		break;
+	case -EINPROGRESS:
+		return btd_error_in_progress(msg);
+	case -EALREADY:
+		return btd_error_already_connected(msg);
+	case -ENOMEM:
+		return btd_error_failed(msg, "Failed to get AVDTP session");
+	default:
 		return btd_error_failed(msg, "Connect Failed");
+	}
 
 	priv->conn_req = dbus_message_ref(msg);
 
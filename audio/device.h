@@ -79,6 +79,8 @@ struct audio_device *audio_device_register(DBusConnection *conn,
 
 void audio_device_unregister(struct audio_device *device);
 
+int audio_device_connect(struct audio_device *dev);
+
 gboolean audio_device_is_active(struct audio_device *dev,
 						const char *interface);
 
@@ -28,7 +28,10 @@
 #include <unistd.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <pthread.h>
 
 #include <netinet/in.h>
@@ -54,6 +57,15 @@ GST_DEBUG_CATEGORY_STATIC(avdtp_sink_debug);
 #define CRC_PROTECTED 1
 #define CRC_UNPROTECTED 0
 
+/* most buffers a media packet may be made of in a buffer list group */
+#define AVDTP_SINK_MAX_IOV 16
+
+/* media packets the socket may queue, keeps the kernel from hiding latency */
+#define AVDTP_SINK_SNDBUF_PACKETS 4
+
+/* how late a media packet may be sent before it is dropped instead */
+#define AVDTP_SINK_MAX_LATENESS (20 * GST_MSECOND)
+
 #define DEFAULT_AUTOCONNECT TRUE
 
 #define GST_AVDTP_SINK_MUTEX_LOCK(s) G_STMT_START {	\
@@ -71,6 +83,7 @@ GST_DEBUG_CATEGORY_STATIC(avdtp_sink_debug);
 struct bluetooth_data {
 	struct bt_get_capabilities_rsp *caps; /* Bluetooth device caps */
 	guint link_mtu;
+	guint dropped;			/* Packets dropped for being late */
 
 	DBusConnection *conn;
 	guint8 codec; /* Bluetooth transport configuration */
@@ -180,6 +193,9 @@ static gboolean gst_avdtp_sink_stop(GstBaseSink *basesink)
 	}
 
 	if (self->data) {
+		if (self->data->dropped > 0)
+			GST_INFO_OBJECT(self, "%u late packets dropped",
+						self->data->dropped);
 		if (self->transport)
 			gst_avdtp_sink_transport_release(self);
 		if (self->data->conn)
@@ -416,7 +432,7 @@ static gboolean gst_avdtp_sink_conf_recv_stream_fd(
 	GError *gerr = NULL;
 	GIOStatus status;
 	GIOFlags flags;
-	int fd;
+	int fd, sndbuf;
 
 	/* Proceed if stream was already acquired */
 	if (self->stream != NULL)
@@ -460,21 +476,13 @@ proceed:
 			break;
 	}
 
-	/* set stream socket to block */
-	GST_LOG_OBJECT(self, "setting stream socket to block");
-	flags = g_io_channel_get_flags(self->stream);
-	flags &= ~G_IO_FLAG_NONBLOCK;
-	status = g_io_channel_set_flags(self->stream, flags, &gerr);
-	if (status != G_IO_STATUS_NORMAL) {
-		if (gerr)
-			GST_WARNING_OBJECT(self, "Error while "
-				"setting server socket to block:"
-				"%s", gerr->message);
-		else
-			GST_WARNING_OBJECT(self, "Error while "
-				"setting server "
-				"socket to block");
-	}
+	/* The socket stays nonblocking: render waits for room only as long
+	 * as a packet can still make it on time, see gst_avdtp_sink_send */
+	sndbuf = data->link_mtu * AVDTP_SINK_SNDBUF_PACKETS;
+	if (sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+							sizeof(sndbuf)) < 0)
+		GST_WARNING_OBJECT(self, "Unable to set send buffer: %s",
+							strerror(errno));
 
 	memset(data->buffer, 0, sizeof(data->buffer));
 
@@ -1716,23 +1724,175 @@ static GstFlowReturn gst_avdtp_sink_preroll(GstBaseSink *basesink,
 	return GST_FLOW_OK;
 }
 
-static GstFlowReturn gst_avdtp_sink_render(GstBaseSink *basesink,
-					GstBuffer *buffer)
+static gint64 monotonic_time(void)
 {
-	GstAvdtpSink *self = GST_AVDTP_SINK(basesink);
-	ssize_t ret;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (gint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+/* Time left, against the pipeline clock, before a packet with the given
+ * running time is later than max-lateness allows */
+static gint64 gst_avdtp_sink_time_left(GstAvdtpSink *self,
+					GstClockTime running_time)
+{
+	GstBaseSink *basesink = GST_BASE_SINK(self);
+	GstClock *clock;
+	GstClockTime now;
+	gint64 lateness;
+
+	lateness = gst_base_sink_get_max_lateness(basesink);
+	if (lateness < 0)
+		lateness = AVDTP_SINK_MAX_LATENESS;
+
+	if (!GST_CLOCK_TIME_IS_VALID(running_time) ||
+				!gst_base_sink_get_sync(basesink))
+		return lateness;
+
+	clock = gst_element_get_clock(GST_ELEMENT(self));
+	if (clock == NULL)
+		return lateness;
+
+	now = gst_clock_get_time(clock) -
+				gst_element_get_base_time(GST_ELEMENT(self));
+	gst_object_unref(clock);
+
+	return (gint64) (running_time + gst_base_sink_get_latency(basesink)) +
+						lateness - (gint64) now;
+}
+
+/* Sends one media packet without blocking the streaming thread past the
+ * packet deadline; a packet that cannot leave in time is dropped so the
+ * link catches up instead of building latency */
+static GstFlowReturn gst_avdtp_sink_send(GstAvdtpSink *self,
+					const struct iovec *iov, int iovcnt,
+					GstClockTime running_time)
+{
+	gint64 deadline = -1;
 	int fd;
 
 	fd = g_io_channel_unix_get_fd(self->stream);
 
-	ret = write(fd, GST_BUFFER_DATA(buffer), GST_BUFFER_SIZE(buffer));
-	if (ret < 0) {
-		GST_ERROR_OBJECT(self, "Error while writting to socket: %s",
-							strerror(errno));
-		return GST_FLOW_ERROR;
+	while (writev(fd, iov, iovcnt) < 0) {
+		struct pollfd p;
+		gint64 left;
+		int ret;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN) {
+			GST_ERROR_OBJECT(self, "Error while writting to "
+						"socket: %s", strerror(errno));
+			return GST_FLOW_ERROR;
+		}
+
+		if (deadline < 0)
+			deadline = monotonic_time() +
+				gst_avdtp_sink_time_left(self, running_time);
+
+		left = deadline - monotonic_time();
+		if (left <= 0)
+			goto drop;
+
+		p.fd = fd;
+		p.events = POLLOUT;
+		p.revents = 0;
+
+		ret = poll(&p, 1, (left + GST_MSECOND - 1) / GST_MSECOND);
+		if (ret == 0)
+			goto drop;
+
+		if (ret < 0 && errno != EINTR) {
+			GST_ERROR_OBJECT(self, "Error while polling socket: "
+						"%s", strerror(errno));
+			return GST_FLOW_ERROR;
+		}
 	}
 
 	return GST_FLOW_OK;
+
+drop:
+	self->data->dropped++;
+	GST_LOG_OBJECT(self, "Dropping late packet, %u so far",
+						self->data->dropped);
+
+	return GST_FLOW_OK;
+}
+
+static GstClockTime gst_avdtp_sink_running_time(GstAvdtpSink *self,
+					GstBuffer *buffer)
+{
+	GstBaseSink *basesink = GST_BASE_SINK(self);
+
+	if (buffer == NULL || !GST_BUFFER_TIMESTAMP_IS_VALID(buffer))
+		return GST_CLOCK_TIME_NONE;
+
+	return gst_segment_to_running_time(&basesink->segment,
+						GST_FORMAT_TIME,
+						GST_BUFFER_TIMESTAMP(buffer));
+}
+
+static GstFlowReturn gst_avdtp_sink_render(GstBaseSink *basesink,
+					GstBuffer *buffer)
+{
+	GstAvdtpSink *self = GST_AVDTP_SINK(basesink);
+	struct iovec iov;
+
+	iov.iov_base = GST_BUFFER_DATA(buffer);
+	iov.iov_len = GST_BUFFER_SIZE(buffer);
+
+	return gst_avdtp_sink_send(self, &iov, 1,
+				gst_avdtp_sink_running_time(self, buffer));
+}
+
+/* Sends each group, an RTP header followed by the payload buffers, as one
+ * media packet with a single writev() */
+static GstFlowReturn gst_avdtp_sink_render_list(GstBaseSink *basesink,
+					GstBufferList *list)
+{
+	GstAvdtpSink *self = GST_AVDTP_SINK(basesink);
+	GstBufferListIterator *it;
+	GstFlowReturn flow = GST_FLOW_OK;
+
+	it = gst_buffer_list_iterate(list);
+
+	while (gst_buffer_list_iterator_next_group(it)) {
+		struct iovec iov[AVDTP_SINK_MAX_IOV];
+		GstBuffer *buffer, *first = NULL;
+		int iovcnt = 0;
+
+		while ((buffer = gst_buffer_list_iterator_next(it)) != NULL) {
+			if (iovcnt == AVDTP_SINK_MAX_IOV) {
+				GST_ERROR_OBJECT(self, "Too many buffers in "
+							"media packet");
+				flow = GST_FLOW_ERROR;
+				goto done;
+			}
+
+			if (first == NULL)
+				first = buffer;
+
+			iov[iovcnt].iov_base = GST_BUFFER_DATA(buffer);
+			iov[iovcnt].iov_len = GST_BUFFER_SIZE(buffer);
+			iovcnt++;
+		}
+
+		if (iovcnt == 0)
+			continue;
+
+		flow = gst_avdtp_sink_send(self, iov, iovcnt,
+				gst_avdtp_sink_running_time(self, first));
+		if (flow != GST_FLOW_OK)
+			goto done;
+	}
+
+done:
+	gst_buffer_list_iterator_free(it);
+
+	return flow;
 }
 
 static gboolean gst_avdtp_sink_unlock(GstBaseSink *basesink)
@@ -1782,6 +1942,8 @@ static void gst_avdtp_sink_class_init(GstAvdtpSinkClass *klass)
 	basesink_class->stop = GST_DEBUG_FUNCPTR(gst_avdtp_sink_stop);
 	basesink_class->render = GST_DEBUG_FUNCPTR(
 					gst_avdtp_sink_render);
+	basesink_class->render_list = GST_DEBUG_FUNCPTR(
+					gst_avdtp_sink_render_list);
 	basesink_class->preroll = GST_DEBUG_FUNCPTR(
 					gst_avdtp_sink_preroll);
 	basesink_class->unlock = GST_DEBUG_FUNCPTR(
@@ -1829,10 +1991,11 @@ static void gst_avdtp_sink_init(GstAvdtpSink *self,
 
 	self->sink_lock = g_mutex_new();
 
-	/* FIXME this is for not synchronizing with clock, should be tested
-	 * with devices to see the behaviour
-	gst_base_sink_set_sync(GST_BASE_SINK(self), FALSE);
-	*/
+	/* Render is paced by the pipeline clock, buffers later than this are
+	 * dropped by the base class and reported upstream as QoS */
+	gst_base_sink_set_max_lateness(GST_BASE_SINK(self),
+						AVDTP_SINK_MAX_LATENESS);
+	gst_base_sink_set_qos_enabled(GST_BASE_SINK(self), TRUE);
 }
 
 static int gst_avdtp_sink_audioservice_send(GstAvdtpSink *self,
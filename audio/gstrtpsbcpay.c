@@ -161,52 +161,87 @@ static gboolean gst_rtp_sbc_pay_set_caps(GstBaseRTPPayload *payload,
 	return gst_basertppayload_set_outcaps(payload, NULL);
 }
 
+/* Adds one packet of up to max_payload bytes of frames to the list. The RTP
+ * header is a small buffer of its own while the frames are taken from the
+ * adapter, which hands out sub-buffers of the upstream ones instead of
+ * copying whenever the frames do not straddle two input buffers. */
+static guint gst_rtp_sbc_pay_add_packet(GstRtpSBCPay *sbcpay,
+			GstBufferListIterator *it, guint max_payload)
+{
+	GstBuffer *outbuf, *framebuf;
+	struct rtp_payload *payload;
+	guint frame_count;
+	guint payload_length;
+
+	frame_count = max_payload / sbcpay->frame_length;
+	payload_length = frame_count * sbcpay->frame_length;
+	if (payload_length == 0) /* Nothing to send */
+		return 0;
+
+	outbuf = gst_rtp_buffer_new_allocate(RTP_SBC_PAYLOAD_HEADER_SIZE,
+									0, 0);
+
+	gst_rtp_buffer_set_payload_type(outbuf,
+			GST_BASE_RTP_PAYLOAD_PT(sbcpay));
+
+	payload = (struct rtp_payload *) gst_rtp_buffer_get_payload(outbuf);
+	memset(payload, 0, sizeof(struct rtp_payload));
+	payload->frame_count = frame_count;
+
+	GST_BUFFER_TIMESTAMP(outbuf) = sbcpay->timestamp;
+
+	framebuf = gst_adapter_take_buffer(sbcpay->adapter, payload_length);
+
+	gst_buffer_list_iterator_add_group(it);
+	gst_buffer_list_iterator_add(it, outbuf);
+	gst_buffer_list_iterator_add(it, framebuf);
+
+	GST_DEBUG_OBJECT(sbcpay, "Queueing %d bytes", payload_length);
+
+	return payload_length;
+}
+
 static GstFlowReturn gst_rtp_sbc_pay_flush_buffers(GstRtpSBCPay *sbcpay)
 {
 	guint available;
 	guint max_payload;
-	GstBuffer *outbuf;
-	guint8 *payload_data;
-	guint frame_count;
-	guint payload_length;
-	struct rtp_payload *payload;
+	GstBufferList *list;
+	GstBufferListIterator *it;
+	guint packets = 0;
 
 	if (sbcpay->frame_length == 0) {
 		GST_ERROR_OBJECT(sbcpay, "Frame length is 0");
 		return GST_FLOW_ERROR;
 	}
 
-	available = gst_adapter_available(sbcpay->adapter);
-
 	max_payload = gst_rtp_buffer_calc_payload_len(
 		GST_BASE_RTP_PAYLOAD_MTU(sbcpay) - RTP_SBC_PAYLOAD_HEADER_SIZE,
 		0, 0);
 
-	max_payload = MIN(max_payload, available);
-	frame_count = max_payload / sbcpay->frame_length;
-	payload_length = frame_count * sbcpay->frame_length;
-	if (payload_length == 0) /* Nothing to send */
-		return GST_FLOW_OK;
-
-	outbuf = gst_rtp_buffer_new_allocate(payload_length +
-			RTP_SBC_PAYLOAD_HEADER_SIZE, 0, 0);
+	list = gst_buffer_list_new();
+	it = gst_buffer_list_iterate(list);
 
-	gst_rtp_buffer_set_payload_type(outbuf,
-			GST_BASE_RTP_PAYLOAD_PT(sbcpay));
+	/* one packet as before, plus any further full ones the adapter
+	 * holds */
+	do {
+		available = gst_adapter_available(sbcpay->adapter);
+		if (gst_rtp_sbc_pay_add_packet(sbcpay, it,
+					MIN(max_payload, available)) == 0)
+			break;
+		packets++;
+	} while (gst_adapter_available(sbcpay->adapter) >= max_payload);
 
-	payload_data = gst_rtp_buffer_get_payload(outbuf);
-	payload = (struct rtp_payload *) payload_data;
-	memset(payload, 0, sizeof(struct rtp_payload));
-	payload->frame_count = frame_count;
+	gst_buffer_list_iterator_free(it);
 
-	gst_adapter_copy(sbcpay->adapter, payload_data +
-			RTP_SBC_PAYLOAD_HEADER_SIZE, 0, payload_length);
-	gst_adapter_flush(sbcpay->adapter, payload_length);
+	if (packets == 0) {
+		gst_buffer_list_unref(list);
+		return GST_FLOW_OK;
+	}
 
-	GST_BUFFER_TIMESTAMP(outbuf) = sbcpay->timestamp;
-	GST_DEBUG_OBJECT(sbcpay, "Pushing %d bytes", payload_length);
+	GST_DEBUG_OBJECT(sbcpay, "Pushing %u packets", packets);
 
-	return gst_basertppayload_push(GST_BASE_RTP_PAYLOAD(sbcpay), outbuf);
+	return gst_basertppayload_push_list(GST_BASE_RTP_PAYLOAD(sbcpay),
+									list);
 }
 
 static GstFlowReturn gst_rtp_sbc_pay_handle_buffer(GstBaseRTPPayload *payload,
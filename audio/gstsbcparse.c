@@ -66,30 +66,28 @@ static GstFlowReturn sbc_parse_chain(GstPad *pad, GstBuffer *buffer)
 	guint size, offset = 0;
 	guint8 *data;
 
-	/* FIXME use a gstadpter */
-	if (parse->buffer) {
-		GstBuffer *temp;
-		temp = buffer;
-		buffer = gst_buffer_span(parse->buffer, 0, buffer,
-			GST_BUFFER_SIZE(parse->buffer)
-			+ GST_BUFFER_SIZE(buffer));
-		gst_buffer_unref(parse->buffer);
-		gst_buffer_unref(temp);
-		parse->buffer = NULL;
-	}
-
 	data = GST_BUFFER_DATA(buffer);
 	size = GST_BUFFER_SIZE(buffer);
 
 	while (offset < size) {
 		GstBuffer *output;
-		int consumed;
+		const void *frame;
+		size_t frame_len;
+		ssize_t consumed;
 
-		consumed = sbc_parse(&parse->new_sbc, data + offset,
-					size - offset);
-		if (consumed <= 0)
+		consumed = sbc_parser_feed(&parse->parser, data + offset,
+					size - offset, &frame, &frame_len);
+		if (consumed < 0)
 			break;
 
+		offset += consumed;
+
+		if (!frame)
+			continue;
+
+		if (sbc_parse(&parse->new_sbc, frame, frame_len) <= 0)
+			continue;
+
 		if (parse->first_parsing || (memcmp(&parse->sbc,
 				&parse->new_sbc, sizeof(sbc_t)) != 0)) {
 
@@ -105,24 +103,18 @@ static GstFlowReturn sbc_parse_chain(GstPad *pad, GstBuffer *buffer)
 
 		res = gst_pad_alloc_buffer_and_set_caps(parse->srcpad,
 						GST_BUFFER_OFFSET_NONE,
-						consumed, parse->outcaps, &output);
+						frame_len, parse->outcaps, &output);
 
 		if (res != GST_FLOW_OK)
 			goto done;
 
-		memcpy(GST_BUFFER_DATA(output), data + offset, consumed);
+		memcpy(GST_BUFFER_DATA(output), frame, frame_len);
 
 		res = gst_pad_push(parse->srcpad, output);
 		if (res != GST_FLOW_OK)
 			goto done;
-
-		offset += consumed;
 	}
 
-	if (offset < size)
-		parse->buffer = gst_buffer_create_sub(buffer,
-							offset, size - offset);
-
 done:
 	gst_buffer_unref(buffer);
 	gst_object_unref(parse);
@@ -143,22 +135,24 @@ static GstStateChangeReturn sbc_parse_change_state(GstElement *element,
 		parse->rate = -1;
 		parse->first_parsing = TRUE;
 
-		sbc_init(&parse->sbc, 0);
+		sbc_init(&parse->new_sbc, 0);
+		sbc_parser_init(&parse->parser);
 		break;
 
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_DEBUG("Finish subband codec");
 
-		if (parse->buffer) {
-			gst_buffer_unref(parse->buffer);
-			parse->buffer = NULL;
-		}
+		GST_DEBUG("Parsed %lu frames, dropped %lu bytes",
+				parse->parser.frames, parse->parser.dropped);
+
 		if (parse->outcaps != NULL) {
 			gst_caps_unref(parse->outcaps);
 			parse->outcaps = NULL;
 		}
 
-		sbc_finish(&parse->sbc);
+		sbc_parser_finish(&parse->parser);
+		sbc_finish(&parse->new_sbc);
+		memset(&parse->sbc, 0, sizeof(sbc_t));
 		break;
 
 	default:
@@ -47,7 +47,7 @@ struct _GstSbcParse {
 	GstPad *sinkpad;
 	GstPad *srcpad;
 
-	GstBuffer *buffer;
+	sbc_parser_t parser;
 
 	sbc_t sbc;
 	sbc_t new_sbc;
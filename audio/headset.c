@@ -38,6 +38,7 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <assert.h>
+#include <time.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -58,6 +59,7 @@
 #include "dbus-common.h"
 #include "../src/adapter.h"
 #include "../src/device.h"
+#include "../src/storage.h"
 
 #define DC_TIMEOUT 3
 
@@ -65,9 +67,28 @@
 
 #define BUF_SIZE 1024
 
+/* Indicator values last sent to each headset, used to drop +CIEV reports
+ * which would not change anything on the remote side */
+#define MAX_INDICATORS 20
+
+/* HFP 1.6 codec IDs used by AT+BAC and +BCS */
+#define HFP_CODEC_CVSD 1
+#define HFP_CODEC_MSBC 2
+
+/* Seconds to wait for the AT+BCS confirming a codec */
+#define BCS_TIMEOUT 3
+
 #define HEADSET_GAIN_SPEAKER 'S'
 #define HEADSET_GAIN_MICROPHONE 'M'
 
+/* Answer to a query, recorded from the telephony driver indications while
+ * filling and valid until the driver reports a change */
+struct query_cache {
+	GString *lines;
+	gboolean filling;
+	gboolean valid;
+};
+
 static struct {
 	gboolean telephony_ready;	/* Telephony plugin initialized */
 	uint32_t features;		/* HFP AG features */
@@ -79,6 +100,8 @@ static struct {
 	int number_type;		/* Incoming number type */
 	guint ring_timer;		/* For incoming call indication */
 	const char *chld;		/* Response to AT+CHLD=? */
+	struct query_cache clcc;	/* Cached AT+CLCC response */
+	struct query_cache cops;	/* Cached AT+COPS? response */
 } ag = {
 	.telephony_ready = FALSE,
 	.features = 0,
@@ -92,6 +115,9 @@ static struct {
 
 static gboolean sco_hci = TRUE;
 static gboolean fast_connectable = FALSE;
+static gboolean wideband_speech = FALSE;
+static gboolean sco_prewarm = FALSE;
+static guint prewarm_check_id = 0;
 
 static GSList *active_devices = NULL;
 
@@ -141,6 +167,11 @@ struct headset_slc {
 	gboolean cwa_enabled;
 	gboolean pending_ring;
 	gboolean inband_ring;
+
+	/* SCO opened ahead of an incoming call and kept muted, dropped as
+	 * soon as it is up if the call went away meanwhile */
+	gboolean prewarm;
+	gboolean prewarm_drop;
 	gboolean nrec;
 	gboolean nrec_req;
 
@@ -148,6 +179,20 @@ struct headset_slc {
 	int mic_gain;
 
 	unsigned int hf_features;
+
+	/* Codec IDs from AT+BAC as a bitmask, the codec picked by the last
+	 * codec connection and the one proposed with +BCS if any */
+	unsigned int hf_codecs;
+	int codec;
+	int bcs_codec;
+	guint bcs_timer;
+
+	/* Responses are coalesced and written once per mainloop iteration */
+	char out[BUF_SIZE];
+	size_t out_len;
+	guint out_id;
+
+	int ciev[MAX_INDICATORS];
 };
 
 struct headset {
@@ -160,6 +205,7 @@ struct headset {
 	GIOChannel *tmp_rfcomm;
 	GIOChannel *sco;
 	guint sco_id;
+	struct timespec sco_start;
 
 	gboolean auto_dc;
 
@@ -179,10 +225,81 @@ struct headset {
 struct event {
 	const char *cmd;
 	int (*callback) (struct audio_device *device, const char *buf);
+	size_t len;
+	struct event *next;
+};
+
+/* Commands are hashed on their first two letters after "AT+" (or the
+ * single letter of basic commands like ATD) so the dispatcher only has to
+ * compare the few commands sharing a bucket */
+#define EVENT_HASH_SIZE 32
+
+/* Zero allocation view of comma separated AT command arguments */
+#define AT_MAX_ARGS 8
+
+struct at_args {
+	const char *arg[AT_MAX_ARGS];
+	size_t len[AT_MAX_ARGS];
+	unsigned int count;
 };
 
 static GSList *headset_callbacks = NULL;
 
+static struct event *event_hash[EVENT_HASH_SIZE];
+
+static unsigned int at_parse_args(const char *buf, struct at_args *args)
+{
+	const char *p = buf;
+
+	args->count = 0;
+
+	if (*p == '\0' || *p == '\r')
+		return 0;
+
+	while (args->count < AT_MAX_ARGS) {
+		const char *end = p;
+
+		while (*end != '\0' && *end != '\r' && *end != ',')
+			end++;
+
+		args->arg[args->count] = p;
+		args->len[args->count] = end - p;
+		args->count++;
+
+		if (*end != ',')
+			break;
+
+		p = end + 1;
+	}
+
+	return args->count;
+}
+
+/* Same semantics as atoi() on the argument, missing arguments read as 0 */
+static int at_arg_int(const struct at_args *args, unsigned int i)
+{
+	const char *p, *end;
+	gboolean neg = FALSE;
+	int val = 0;
+
+	if (i >= args->count)
+		return 0;
+
+	p = args->arg[i];
+	end = p + args->len[i];
+
+	while (p < end && *p == ' ')
+		p++;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		val = val * 10 + (*p - '0');
+
+	return neg ? -val : val;
+}
+
 static void error_connect_failed(DBusConnection *conn, DBusMessage *msg,
 								int err)
 {
@@ -226,6 +343,8 @@ static void print_ag_features(uint32_t features)
 		g_string_append(gstr, "\"Enhanced call control\" ");
 	if (features & AG_FEATURE_EXTENDED_ERROR_RESULT_CODES)
 		g_string_append(gstr, "\"Extended Error Result Codes\" ");
+	if (features & AG_FEATURE_CODEC_NEGOTIATION)
+		g_string_append(gstr, "\"Codec negotiation\" ");
 
 	str = g_string_free(gstr, FALSE);
 
@@ -260,6 +379,8 @@ static void print_hf_features(uint32_t features)
 		g_string_append(gstr, "\"Enhanced call status\" ");
 	if (features & HF_FEATURE_ENHANCED_CALL_CONTROL)
 		g_string_append(gstr, "\"Enhanced call control\" ");
+	if (features & HF_FEATURE_CODEC_NEGOTIATION)
+		g_string_append(gstr, "\"Codec negotiation\" ");
 
 	str = g_string_free(gstr, FALSE);
 
@@ -285,35 +406,96 @@ static const char *state2str(headset_state_t state)
 	return NULL;
 }
 
+static int headset_write(struct headset *hs, const char *rsp, size_t count)
+{
+	size_t total_written;
+	int fd;
+
+	total_written = 0;
+	fd = g_io_channel_unix_get_fd(hs->rfcomm);
+
+	while (total_written < count) {
+		ssize_t written;
+
+		written = write(fd, rsp + total_written,
+				count - total_written);
+		if (written < 0)
+			return -errno;
+
+		total_written += written;
+	}
+
+	return 0;
+}
+
+static int headset_flush(struct headset *hs)
+{
+	struct headset_slc *slc = hs->slc;
+	int err;
+
+	if (slc->out_id > 0) {
+		g_source_remove(slc->out_id);
+		slc->out_id = 0;
+	}
+
+	if (slc->out_len == 0)
+		return 0;
+
+	err = headset_write(hs, slc->out, slc->out_len);
+	slc->out_len = 0;
+
+	return err;
+}
+
+static gboolean headset_flush_cb(gpointer user_data)
+{
+	struct headset *hs = user_data;
+	int err;
+
+	hs->slc->out_id = 0;
+
+	err = headset_flush(hs);
+	if (err < 0)
+		error("Failed to send to headset: %s (%d)",
+							strerror(-err), -err);
+
+	return FALSE;
+}
+
 static int headset_send_valist(struct headset *hs, char *format, va_list ap)
 {
+	struct headset_slc *slc = hs->slc;
 	char rsp[BUF_SIZE];
-	ssize_t total_written, count;
-	int fd;
+	int count;
 
 	count = vsnprintf(rsp, sizeof(rsp), format, ap);
 
 	if (count < 0)
 		return -EINVAL;
 
+	if ((size_t) count >= sizeof(rsp))
+		count = sizeof(rsp) - 1;
+
 	if (!hs->rfcomm) {
 		error("headset_send: the headset is not connected");
 		return -EIO;
 	}
 
-	total_written = 0;
-	fd = g_io_channel_unix_get_fd(hs->rfcomm);
+	if (slc == NULL)
+		return headset_write(hs, rsp, count);
 
-	while (total_written < count) {
-		ssize_t written;
+	if (slc->out_len + count > sizeof(slc->out)) {
+		int err = headset_flush(hs);
+		if (err < 0)
+			return err;
+	}
 
-		written = write(fd, rsp + total_written,
-				count - total_written);
-		if (written < 0)
-			return -errno;
+	memcpy(slc->out + slc->out_len, rsp, count);
+	slc->out_len += count;
 
-		total_written += written;
-	}
+	if (slc->out_id == 0)
+		slc->out_id = g_idle_add_full(G_PRIORITY_DEFAULT,
+						headset_flush_cb, hs, NULL);
 
 	return 0;
 }
@@ -335,12 +517,14 @@ static int supported_features(struct audio_device *device, const char *buf)
 {
 	struct headset *hs = device->headset;
 	struct headset_slc *slc = hs->slc;
+	struct at_args args;
 	int err;
 
 	if (strlen(buf) < 9)
 		return -EINVAL;
 
-	slc->hf_features = strtoul(&buf[8], NULL, 10);
+	at_parse_args(&buf[8], &args);
+	slc->hf_features = at_arg_int(&args, 0);
 
 	print_hf_features(slc->hf_features);
 
@@ -409,9 +593,17 @@ static int report_indicators(struct audio_device *device, const char *buf)
 
 	if (buf[7] == '=')
 		str = indicator_ranges(ag.indicators);
-	else
+	else {
+		struct headset_slc *slc = hs->slc;
+		int i;
+
 		str = indicator_values(ag.indicators);
 
+		for (i = 0; ag.indicators[i].desc != NULL &&
+						i < MAX_INDICATORS; i++)
+			slc->ciev[i] = ag.indicators[i].val;
+	}
+
 	err = headset_send(hs, "%s", str);
 
 	g_free(str);
@@ -555,6 +747,32 @@ static gboolean ring_timer_cb(gpointer data)
 	return TRUE;
 }
 
+static unsigned int elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+				(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void sco_store_setup_time(struct audio_device *dev)
+{
+	unsigned int avg, last, ms;
+
+	ms = elapsed_ms(&dev->headset->sco_start);
+
+	if (read_sco_setup_time(&dev->src, &dev->dst, &avg, &last) < 0)
+		avg = ms;
+	else
+		avg = (avg * 3 + ms) / 4;
+
+	DBG("SCO setup to %s took %u ms, average %u ms", dev->path, ms, avg);
+
+	write_sco_setup_time(&dev->src, &dev->dst, avg, ms);
+}
+
 static void sco_connect_cb(GIOChannel *chan, GError *err, gpointer user_data)
 {
 	int sk;
@@ -600,8 +818,18 @@ static void sco_connect_cb(GIOChannel *chan, GError *err, gpointer user_data)
 
 	fcntl(sk, F_SETFL, 0);
 
+	sco_store_setup_time(dev);
+
 	headset_set_state(dev, HEADSET_STATE_PLAYING);
 
+	if (slc->prewarm_drop) {
+		DBG("Call is gone, closing prewarmed SCO of %s", dev->path);
+		slc->prewarm = FALSE;
+		slc->prewarm_drop = FALSE;
+		headset_set_state(dev, HEADSET_STATE_CONNECTED);
+		return;
+	}
+
 	if (slc->pending_ring) {
 		ring_timer_cb(NULL);
 		ag.ring_timer = g_timeout_add_seconds(RING_INTERVAL,
@@ -611,28 +839,106 @@ static void sco_connect_cb(GIOChannel *chan, GError *err, gpointer user_data)
 	}
 }
 
+static gboolean codec_negotiation(struct headset *hs)
+{
+	if (!hs->hfp_active || hs->slc == NULL)
+		return FALSE;
+
+	if (!(ag.features & AG_FEATURE_CODEC_NEGOTIATION))
+		return FALSE;
+
+	return hs->slc->hf_features & HF_FEATURE_CODEC_NEGOTIATION;
+}
+
+static gboolean sco_open(struct audio_device *dev, GError **err)
+{
+	struct headset *hs = dev->headset;
+	uint16_t voice = 0;
+
+	/* mSBC frames go over the air as they are */
+	if (hs->slc && hs->slc->codec == HFP_CODEC_MSBC)
+		voice = BT_VOICE_TRANSPARENT;
+
+	clock_gettime(CLOCK_MONOTONIC, &hs->sco_start);
+
+	hs->sco = bt_io_connect(BT_IO_SCO, sco_connect_cb, dev, NULL, err,
+				BT_IO_OPT_SOURCE_BDADDR, &dev->src,
+				BT_IO_OPT_DEST_BDADDR, &dev->dst,
+				BT_IO_OPT_VOICE, voice,
+				BT_IO_OPT_INVALID);
+
+	return hs->sco != NULL;
+}
+
+static gboolean bcs_timeout(gpointer user_data)
+{
+	struct audio_device *dev = user_data;
+	struct headset_slc *slc = dev->headset->slc;
+	GError *err = NULL;
+
+	error("No AT+BCS from %s, falling back to CVSD", dev->path);
+
+	slc->bcs_timer = 0;
+	slc->bcs_codec = 0;
+	slc->codec = HFP_CODEC_CVSD;
+
+	/* Same cleanup as for a failed SCO connection attempt */
+	if (!sco_open(dev, &err)) {
+		sco_connect_cb(NULL, err, dev);
+		g_error_free(err);
+	}
+
+	return FALSE;
+}
+
+/* Proposes a codec to the hands-free, the SCO link is only opened once it
+ * confirms it with AT+BCS */
+static int codec_connection_setup(struct audio_device *dev)
+{
+	struct headset *hs = dev->headset;
+	struct headset_slc *slc = hs->slc;
+	int err;
+
+	if (wideband_speech && slc->hf_codecs & (1U << HFP_CODEC_MSBC))
+		slc->bcs_codec = HFP_CODEC_MSBC;
+	else
+		slc->bcs_codec = HFP_CODEC_CVSD;
+
+	err = headset_send(hs, "\r\n+BCS: %d\r\n", slc->bcs_codec);
+	if (err < 0) {
+		slc->bcs_codec = 0;
+		return err;
+	}
+
+	if (slc->bcs_timer)
+		g_source_remove(slc->bcs_timer);
+
+	slc->bcs_timer = g_timeout_add_seconds(BCS_TIMEOUT, bcs_timeout, dev);
+
+	return 0;
+}
+
 static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
 			void *user_data, unsigned int *cb_id)
 {
 	struct headset *hs = dev->headset;
 	GError *err = NULL;
-	GIOChannel *io;
 
 	if (hs->state != HEADSET_STATE_CONNECTED)
 		return -EINVAL;
 
-	io = bt_io_connect(BT_IO_SCO, sco_connect_cb, dev, NULL, &err,
-				BT_IO_OPT_SOURCE_BDADDR, &dev->src,
-				BT_IO_OPT_DEST_BDADDR, &dev->dst,
-				BT_IO_OPT_INVALID);
-	if (!io) {
+	/* Codecs are negotiated again after the hands-free changed its
+	 * list with AT+BAC */
+	if (codec_negotiation(hs) && hs->slc->codec == 0) {
+		int ret = codec_connection_setup(dev);
+		if (ret < 0)
+			return ret;
+	} else if (!sco_open(dev, &err)) {
 		error("%s", err->message);
 		g_error_free(err);
 		return -EIO;
 	}
 
-	hs->sco = io;
-
 	headset_set_state(dev, HEADSET_STATE_PLAY_IN_PROGRESS);
 
 	pending_connect_init(hs, HEADSET_STATE_PLAYING);
@@ -730,22 +1036,16 @@ int telephony_event_reporting_rsp(void *telephony_device, cme_error_t err)
 
 static int event_reporting(struct audio_device *dev, const char *buf)
 {
-	char **tokens; /* <mode>, <keyp>, <disp>, <ind>, <bfr> */
+	struct at_args args; /* <mode>, <keyp>, <disp>, <ind>, <bfr> */
 
 	if (strlen(buf) < 13)
 		return -EINVAL;
 
-	tokens = g_strsplit(&buf[8], ",", 5);
-	if (g_strv_length(tokens) < 4) {
-		g_strfreev(tokens);
+	if (at_parse_args(&buf[8], &args) < 4)
 		return -EINVAL;
-	}
-
-	ag.er_mode = atoi(tokens[0]);
-	ag.er_ind = atoi(tokens[3]);
 
-	g_strfreev(tokens);
-	tokens = NULL;
+	ag.er_mode = at_arg_int(&args, 0);
+	ag.er_ind = at_arg_int(&args, 3);
 
 	DBG("Event reporting (CMER): mode=%d, ind=%d",
 			ag.er_mode, ag.er_ind);
@@ -899,7 +1199,11 @@ static int response_and_hold(struct audio_device *device, const char *buf)
 		return telephony_generic_rsp(device, CME_ERROR_NOT_SUPPORTED);
 
 	if (buf[7] == '=') {
-		telephony_response_and_hold_req(device, atoi(&buf[8]) < 0);
+		struct at_args args;
+
+		at_parse_args(&buf[8], &args);
+		telephony_response_and_hold_req(device,
+						at_arg_int(&args, 0) < 0);
 		return 0;
 	}
 
@@ -996,6 +1300,7 @@ static int headset_set_gain(struct audio_device *device, uint16_t gain, char typ
 static int signal_gain_setting(struct audio_device *device, const char *buf)
 {
 	struct headset *hs = device->headset;
+	struct at_args args;
 	dbus_uint16_t gain;
 	int err;
 
@@ -1004,7 +1309,8 @@ static int signal_gain_setting(struct audio_device *device, const char *buf)
 		return -EINVAL;
 	}
 
-	gain = (dbus_uint16_t) strtol(&buf[7], NULL, 10);
+	at_parse_args(&buf[7], &args);
+	gain = (dbus_uint16_t) at_arg_int(&args, 0);
 
 	err = headset_set_gain(device, gain, buf[5]);
 	if (err < 0 && err != -EALREADY)
@@ -1048,13 +1354,88 @@ static int subscriber_number(struct audio_device *device, const char *buf)
 	return 0;
 }
 
+static void query_cache_invalidate(struct query_cache *cache)
+{
+	cache->filling = FALSE;
+	cache->valid = FALSE;
+}
+
+/* Answers from the cache when possible, otherwise starts recording the
+ * indications that the driver is about to send */
+static gboolean query_cache_answer(struct query_cache *cache,
+						struct audio_device *device)
+{
+	if (cache->valid) {
+		size_t off, len;
+
+		/* headset_send formats at most BUF_SIZE - 1 bytes at once */
+		for (off = 0; off < cache->lines->len; off += len) {
+			len = MIN(cache->lines->len - off, BUF_SIZE - 1);
+			headset_send(device->headset, "%.*s", (int) len,
+						cache->lines->str + off);
+		}
+
+		telephony_generic_rsp(device, CME_ERROR_NONE);
+
+		return TRUE;
+	}
+
+	if (cache->lines == NULL)
+		cache->lines = g_string_sized_new(64);
+	else
+		g_string_truncate(cache->lines, 0);
+
+	cache->filling = TRUE;
+
+	return FALSE;
+}
+
+static void query_cache_append(struct query_cache *cache, const char *line)
+{
+	if (cache->filling)
+		g_string_append(cache->lines, line);
+}
+
+static void query_cache_done(struct query_cache *cache, cme_error_t err)
+{
+	if (!cache->filling)
+		return;
+
+	cache->filling = FALSE;
+	cache->valid = err == CME_ERROR_NONE;
+}
+
+static void query_cache_free(struct query_cache *cache)
+{
+	if (cache->lines)
+		g_string_free(cache->lines, TRUE);
+
+	cache->lines = NULL;
+	query_cache_invalidate(cache);
+}
+
+void telephony_calls_changed_ind(void)
+{
+	query_cache_invalidate(&ag.clcc);
+}
+
+void telephony_operator_changed_ind(void)
+{
+	query_cache_invalidate(&ag.cops);
+}
+
 int telephony_list_current_calls_rsp(void *telephony_device, cme_error_t err)
 {
+	query_cache_done(&ag.clcc, err);
+
 	return telephony_generic_rsp(telephony_device, err);
 }
 
 static int list_current_calls(struct audio_device *device, const char *buf)
 {
+	if (query_cache_answer(&ag.clcc, device))
+		return 0;
+
 	telephony_list_current_calls_req(device);
 
 	return 0;
@@ -1100,6 +1481,8 @@ static int call_waiting_notify(struct audio_device *device, const char *buf)
 
 int telephony_operator_selection_rsp(void *telephony_device, cme_error_t err)
 {
+	query_cache_done(&ag.cops, err);
+
 	return telephony_generic_rsp(telephony_device, err);
 }
 
@@ -1136,12 +1519,16 @@ int telephony_voice_dial_rsp(void *telephony_device, cme_error_t err)
 
 int telephony_operator_selection_ind(int mode, const char *oper)
 {
+	char *line;
+
 	if (!active_devices)
 		return -ENODEV;
 
-	send_foreach_headset(active_devices, hfp_cmp,
-				"\r\n+COPS: %d,0,\"%s\"\r\n",
-				mode, oper);
+	line = g_strdup_printf("\r\n+COPS: %d,0,\"%s\"\r\n", mode, oper);
+	query_cache_append(&ag.cops, line);
+	send_foreach_headset(active_devices, hfp_cmp, "%s", line);
+	g_free(line);
+
 	return 0;
 }
 
@@ -1154,7 +1541,8 @@ static int operator_selection(struct audio_device *device, const char *buf)
 
 	switch (buf[7]) {
 	case '?':
-		telephony_operator_selection_req(device);
+		if (!query_cache_answer(&ag.cops, device))
+			telephony_operator_selection_req(device);
 		break;
 	case '=':
 		return headset_send(hs, "\r\nOK\r\n");
@@ -1200,6 +1588,98 @@ static int voice_dial(struct audio_device *device, const char *buf)
 	return 0;
 }
 
+static int available_codecs(struct audio_device *device, const char *buf)
+{
+	struct headset *hs = device->headset;
+	struct headset_slc *slc = hs->slc;
+	struct at_args args;
+	unsigned int i;
+	int err;
+
+	if (strlen(buf) < 8)
+		return -EINVAL;
+
+	slc->hf_codecs = 0;
+
+	at_parse_args(&buf[7], &args);
+	for (i = 0; i < args.count; i++) {
+		int id = at_arg_int(&args, i);
+
+		if (id > 0 && id < 32)
+			slc->hf_codecs |= 1U << id;
+	}
+
+	DBG("Hands-free codecs: 0x%x", slc->hf_codecs);
+
+	/* The next audio connection has to pick a codec again */
+	slc->codec = 0;
+
+	err = headset_send(hs, "\r\nOK\r\n");
+	if (err < 0)
+		return err;
+
+	/* An AT+BAC while a codec is proposed rejects that codec */
+	if (slc->bcs_codec)
+		return codec_connection_setup(device);
+
+	return 0;
+}
+
+static int codec_selection(struct audio_device *device, const char *buf)
+{
+	struct headset *hs = device->headset;
+	struct headset_slc *slc = hs->slc;
+	struct at_args args;
+	GError *gerr = NULL;
+	int err, id;
+
+	if (strlen(buf) < 8)
+		return -EINVAL;
+
+	at_parse_args(&buf[7], &args);
+	id = at_arg_int(&args, 0);
+
+	if (slc->bcs_codec == 0 || id != slc->bcs_codec)
+		return telephony_generic_rsp(device, CME_ERROR_NOT_ALLOWED);
+
+	DBG("Codec %d selected", id);
+
+	g_source_remove(slc->bcs_timer);
+	slc->bcs_timer = 0;
+	slc->bcs_codec = 0;
+	slc->codec = id;
+
+	err = headset_send(hs, "\r\nOK\r\n");
+	if (err < 0)
+		return err;
+
+	if (!sco_open(device, &gerr)) {
+		sco_connect_cb(NULL, gerr, device);
+		g_error_free(gerr);
+	}
+
+	return 0;
+}
+
+static int codec_connection(struct audio_device *device, const char *buf)
+{
+	struct headset *hs = device->headset;
+	int err;
+
+	if (!codec_negotiation(hs))
+		return telephony_generic_rsp(device, CME_ERROR_NOT_SUPPORTED);
+
+	err = headset_send(hs, "\r\nOK\r\n");
+	if (err < 0)
+		return err;
+
+	/* Nothing to do if an audio connection is already there or coming */
+	if (hs->state != HEADSET_STATE_CONNECTED)
+		return 0;
+
+	return sco_connect(device, NULL, NULL, NULL);
+}
+
 static int apple_command(struct audio_device *device, const char *buf)
 {
 	DBG("Got Apple command: %s", buf);
@@ -1228,19 +1708,62 @@ static struct event event_callbacks[] = {
 	{ "AT+COPS", operator_selection },
 	{ "AT+NREC", nr_and_ec },
 	{ "AT+BVRA", voice_dial },
+	{ "AT+BAC", available_codecs },
+	{ "AT+BCS", codec_selection },
+	{ "AT+BCC", codec_connection },
 	{ "AT+XAPL", apple_command },
 	{ "AT+IPHONEACCEV", apple_command },
 	{ 0 }
 };
 
+static int event_hash_key(const char *buf)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+
+	if (p[0] != 'A' || p[1] != 'T' || p[2] == '\0')
+		return -1;
+
+	if (p[2] != '+')
+		return p[2] % EVENT_HASH_SIZE;
+
+	if (p[3] == '\0' || p[4] == '\0')
+		return -1;
+
+	return (p[3] * 31 + p[4]) % EVENT_HASH_SIZE;
+}
+
+static void event_hash_init(void)
+{
+	struct event *ev;
+
+	memset(event_hash, 0, sizeof(event_hash));
+
+	/* Insert backwards so each chain keeps the table order */
+	for (ev = event_callbacks; ev->cmd; ev++)
+		;
+
+	while (ev-- > event_callbacks) {
+		int key = event_hash_key(ev->cmd);
+
+		ev->len = strlen(ev->cmd);
+		ev->next = event_hash[key];
+		event_hash[key] = ev;
+	}
+}
+
 static int handle_event(struct audio_device *device, const char *buf)
 {
 	struct event *ev;
+	int key;
 
 	DBG("Received %s", buf);
 
-	for (ev = event_callbacks; ev->cmd; ev++) {
-		if (!strncmp(buf, ev->cmd, strlen(ev->cmd)))
+	key = event_hash_key(buf);
+	if (key < 0)
+		return -EINVAL;
+
+	for (ev = event_hash[key]; ev != NULL; ev = ev->next) {
+		if (!strncmp(buf, ev->cmd, ev->len))
 			return ev->callback(device, buf);
 	}
 
@@ -1251,6 +1774,12 @@ static void close_sco(struct audio_device *device)
 {
 	struct headset *hs = device->headset;
 
+	if (hs->slc && hs->slc->bcs_timer) {
+		g_source_remove(hs->slc->bcs_timer);
+		hs->slc->bcs_timer = 0;
+		hs->slc->bcs_codec = 0;
+	}
+
 	if (hs->sco) {
 		int sock = g_io_channel_unix_get_fd(hs->sco);
 		shutdown(sock, SHUT_RDWR);
@@ -1405,6 +1934,8 @@ void headset_connect_cb(GIOChannel *chan, GError *err, gpointer user_data)
 	hs->slc->sp_gain = 15;
 	hs->slc->mic_gain = 15;
 	hs->slc->nrec = TRUE;
+	/* Nothing reported yet, every indicator reads as -1 */
+	memset(hs->slc->ciev, 0xff, sizeof(hs->slc->ciev));
 
 	/* In HFP mode wait for Service Level Connection */
 	if (hs->hfp_active)
@@ -2137,6 +2668,10 @@ static int headset_close_rfcomm(struct audio_device *dev)
 	struct headset *hs = dev->headset;
 	GIOChannel *rfcomm = hs->tmp_rfcomm ? hs->tmp_rfcomm : hs->rfcomm;
 
+	/* Do not lose responses still waiting for the mainloop */
+	if (hs->slc && hs->rfcomm)
+		headset_flush(hs);
+
 	if (rfcomm) {
 		g_io_channel_shutdown(rfcomm, TRUE, NULL);
 		g_io_channel_unref(rfcomm);
@@ -2144,8 +2679,14 @@ static int headset_close_rfcomm(struct audio_device *dev)
 		hs->rfcomm = NULL;
 	}
 
-	g_free(hs->slc);
-	hs->slc = NULL;
+	if (hs->slc) {
+		if (hs->slc->out_id > 0)
+			g_source_remove(hs->slc->out_id);
+		if (hs->slc->bcs_timer > 0)
+			g_source_remove(hs->slc->bcs_timer);
+		g_free(hs->slc);
+		hs->slc = NULL;
+	}
 
 	return 0;
 }
@@ -2241,6 +2782,8 @@ uint32_t headset_config_init(GKeyFile *config)
 	GError *err = NULL;
 	char *str;
 
+	event_hash_init();
+
 	/* Use the default values if there is no config file */
 	if (config == NULL)
 		return ag.features;
@@ -2273,6 +2816,29 @@ uint32_t headset_config_init(GKeyFile *config)
 		g_free(str);
 	}
 
+	/* Open SCO when a call comes in, before it gets answered */
+	str = g_key_file_get_string(config, "Headset", "PrewarmSCO", &err);
+	if (err) {
+		DBG("audio.conf: %s", err->message);
+		g_clear_error(&err);
+	} else {
+		sco_prewarm = strcmp(str, "true") == 0;
+		g_free(str);
+	}
+
+	/* Wide band speech can't go through the PCM routing */
+	str = g_key_file_get_string(config, "Headset", "WidebandSpeech",
+					&err);
+	if (err) {
+		DBG("audio.conf: %s", err->message);
+		g_clear_error(&err);
+	} else {
+		wideband_speech = strcmp(str, "true") == 0 && sco_hci;
+		if (wideband_speech)
+			ag.features |= AG_FEATURE_CODEC_NEGOTIATION;
+		g_free(str);
+	}
+
 	return ag.features;
 }
 
@@ -2577,7 +3143,10 @@ void headset_set_state(struct audio_device *dev, headset_state_t state)
 					AUDIO_HEADSET_INTERFACE, "Playing",
 					DBUS_TYPE_BOOLEAN, &value);
 
-		if (slc->sp_gain >= 0)
+		/* A prewarmed link stays silent until the call is answered */
+		if (slc->prewarm)
+			headset_send(hs, "\r\n+VGS=0\r\n");
+		else if (slc->sp_gain >= 0)
 			headset_send(hs, "\r\n+VGS=%u\r\n", slc->sp_gain);
 		if (slc->mic_gain >= 0)
 			headset_send(hs, "\r\n+VGM=%u\r\n", slc->mic_gain);
@@ -2685,6 +3254,16 @@ int headset_get_sco_fd(struct audio_device *dev)
 	return g_io_channel_unix_get_fd(hs->sco);
 }
 
+gboolean headset_get_wideband(struct audio_device *dev)
+{
+	struct headset *hs = dev->headset;
+
+	if (!hs->slc)
+		return FALSE;
+
+	return hs->slc->codec == HFP_CODEC_MSBC;
+}
+
 gboolean headset_get_nrec(struct audio_device *dev)
 {
 	struct headset *hs = dev->headset;
@@ -2755,8 +3334,61 @@ void headset_shutdown(struct audio_device *dev)
 	headset_set_state(dev, HEADSET_STATE_DISCONNECTED);
 }
 
+/* Called once the call setup is over, by then the call indicator tells
+ * whether the call got answered */
+static gboolean prewarm_check(gpointer user_data)
+{
+	gboolean answered;
+	GSList *l;
+
+	prewarm_check_id = 0;
+
+	answered = telephony_get_indicator(ag.indicators, "call") ==
+								EV_CALL_ACTIVE;
+
+	for (l = active_devices; l != NULL; l = l->next) {
+		struct audio_device *dev = l->data;
+		struct headset *hs = dev->headset;
+		struct headset_slc *slc = hs->slc;
+
+		if (slc == NULL || !slc->prewarm)
+			continue;
+
+		if (answered) {
+			slc->prewarm = FALSE;
+			if (hs->state == HEADSET_STATE_PLAYING &&
+							slc->sp_gain >= 0)
+				headset_send(hs, "\r\n+VGS=%u\r\n",
+								slc->sp_gain);
+		} else if (hs->state == HEADSET_STATE_PLAYING) {
+			DBG("Call rejected, closing prewarmed SCO");
+			slc->prewarm = FALSE;
+			headset_set_state(dev, HEADSET_STATE_CONNECTED);
+		} else
+			slc->prewarm_drop = TRUE;
+	}
+
+	return FALSE;
+}
+
 int telephony_event_ind(int index)
 {
+	const struct indicator *ind;
+	GSList *l;
+
+	ind = &ag.indicators[index];
+
+	if (g_str_equal(ind->desc, "callsetup") &&
+				ind->val == EV_CALLSETUP_INACTIVE &&
+				prewarm_check_id == 0)
+		prewarm_check_id = g_idle_add(prewarm_check, NULL);
+
+	/* call, callsetup and callheld all affect the call list */
+	if (g_str_has_prefix(ind->desc, "call"))
+		query_cache_invalidate(&ag.clcc);
+	else if (g_str_equal(ind->desc, "service"))
+		query_cache_invalidate(&ag.cops);
+
 	if (!active_devices)
 		return -ENODEV;
 
@@ -2765,9 +3397,29 @@ int telephony_event_ind(int index)
 		return -EINVAL;
 	}
 
-	send_foreach_headset(active_devices, hfp_cmp,
-				"\r\n+CIEV: %d,%d\r\n", index + 1,
-				ag.indicators[index].val);
+	for (l = active_devices; l != NULL; l = l->next) {
+		struct audio_device *device = l->data;
+		struct headset *hs = device->headset;
+		struct headset_slc *slc = hs->slc;
+		int ret;
+
+		if (hfp_cmp(hs) != 0 || slc == NULL)
+			continue;
+
+		if (index < MAX_INDICATORS) {
+			if (ind->ignore_redundant &&
+					slc->ciev[index] == ind->val)
+				continue;
+
+			slc->ciev[index] = ind->val;
+		}
+
+		ret = headset_send(hs, "\r\n+CIEV: %d,%d\r\n", index + 1,
+								ind->val);
+		if (ret < 0)
+			error("Failed to send to headset: %s (%d)",
+							strerror(-ret), -ret);
+	}
 
 	return 0;
 }
@@ -2820,6 +3472,14 @@ int telephony_incoming_call_ind(const char *number, int type)
 	ag.number = g_strdup(number);
 	ag.number_type = type;
 
+	/* With in-band ringing SCO is opened for the ring tone anyway */
+	if (sco_prewarm && hs->hfp_active && !slc->inband_ring &&
+				hs->state == HEADSET_STATE_CONNECTED &&
+				sco_connect(dev, NULL, NULL, NULL) == 0) {
+		DBG("Prewarming SCO for %s", dev->path);
+		slc->prewarm = TRUE;
+	}
+
 	if (slc->inband_ring && hs->hfp_active &&
 					hs->state != HEADSET_STATE_PLAYING) {
 		slc->pending_ring = TRUE;
@@ -2865,6 +3525,8 @@ int telephony_ready_ind(uint32_t features,
 {
 	ag.telephony_ready = TRUE;
 	ag.features = features;
+	if (wideband_speech)
+		ag.features |= AG_FEATURE_CODEC_NEGOTIATION;
 	ag.indicators = indicators;
 	ag.rh = rh;
 	ag.chld = chld;
@@ -2879,6 +3541,8 @@ int telephony_ready_ind(uint32_t features,
 int telephony_deinit(void)
 {
 	g_free(ag.number);
+	query_cache_free(&ag.clcc);
+	query_cache_free(&ag.cops);
 
 	memset(&ag, 0, sizeof(ag));
 
@@ -2894,18 +3558,23 @@ int telephony_list_current_call_ind(int idx, int dir, int status, int mode,
 					int mprty, const char *number,
 					int type)
 {
+	char *line;
+
 	if (!active_devices)
 		return -ENODEV;
 
 	if (number && strlen(number) > 0)
-		send_foreach_headset(active_devices, hfp_cmp,
+		line = g_strdup_printf(
 				"\r\n+CLCC: %d,%d,%d,%d,%d,\"%s\",%d\r\n",
 				idx, dir, status, mode, mprty, number, type);
 	else
-		send_foreach_headset(active_devices, hfp_cmp,
-					"\r\n+CLCC: %d,%d,%d,%d,%d\r\n",
+		line = g_strdup_printf("\r\n+CLCC: %d,%d,%d,%d,%d\r\n",
 					idx, dir, status, mode, mprty);
 
+	query_cache_append(&ag.clcc, line);
+	send_foreach_headset(active_devices, hfp_cmp, "%s", line);
+	g_free(line);
+
 	return 0;
 }
 
@@ -93,6 +93,7 @@ int headset_get_channel(struct audio_device *dev);
 
 int headset_get_sco_fd(struct audio_device *dev);
 gboolean headset_get_nrec(struct audio_device *dev);
+gboolean headset_get_wideband(struct audio_device *dev);
 unsigned int headset_add_nrec_cb(struct audio_device *dev,
 					headset_nrec_cb cb, void *user_data);
 gboolean headset_remove_nrec_cb(struct audio_device *dev, unsigned int id);
@@ -45,6 +45,35 @@
 				<  streams data >
 				..........
 
+  With BT_START_STREAM_EARLY_FD set in the request, BT_NEW_STREAM_IND may be
+  sent right away, ahead of BT_START_STREAM_RSP, so that the client gets
+  ready to stream while the remote accepts the start. Data must not be
+  written to the stream before BT_START_STREAM_RSP.
+
+  With BT_START_STREAM_SHARED_PCM set, for SBC A2DP streams, the fd passed
+  along BT_NEW_STREAM_IND is a shared memory region laid out as a struct
+  bt_pcm_ring instead of the stream socket. The client writes PCM in it
+  and the audio daemon does the encoding and pacing, mixing the rings of
+  every client writing to the same stream. Starting several streams, to
+  different devices, with the same non-zero group hands out the same ring
+  for all of them: the audio is encoded once per distinct configuration
+  and sent to every device. The streams of a group must agree on rate,
+  channels, blocks and subbands.
+
+  With BT_START_STREAM_SCO_RELAY set, for SCO streams, the fd passed along
+  BT_NEW_STREAM_IND is a stream socket relayed by the audio daemon instead
+  of the SCO socket. Data can be read and written in chunks of any size:
+  the daemon sends it in packets of the SCO MTU, clocked by the incoming
+  packets, from a jitter buffer that conceals underruns.
+
+  With BT_START_STREAM_A2DP_RELAY set, for SBC streams from a remote A2DP
+  source, the fd passed along BT_NEW_STREAM_IND is a stream socket the
+  audio daemon writes decoded PCM to, interleaved native endian 16 bit
+  samples at the configured rate and channels. The daemon keeps a jitter
+  buffer, conceals lost packets and resamples slightly to follow the
+  drift between the source clock and CLOCK_MONOTONIC, which it plays out
+  against. Silence is written while the buffer fills.
+
 				on snd_pcm_drop/snd_pcm_drain
 
 				<--BT_STOP_STREAM_REQ
@@ -177,6 +206,9 @@ struct bt_get_capabilities_req {
 
 #define BT_PCM_FLAG_NREC			0x01
 #define BT_PCM_FLAG_PCM_ROUTING			0x02
+/* The SCO link is transparent and carries mSBC frames, each behind a two
+ * byte H2 synchronization header */
+#define BT_PCM_FLAG_MSBC			0x04
 
 #define BT_WRITE_LOCK				(1 << 1)
 #define BT_READ_LOCK				1
@@ -255,10 +287,32 @@ struct bt_set_configuration_rsp {
 #define BT_STREAM_ACCESS_READ		0
 #define BT_STREAM_ACCESS_WRITE		1
 #define BT_STREAM_ACCESS_READWRITE	2
+#define BT_START_STREAM_EARLY_FD	0x01
+#define BT_START_STREAM_SHARED_PCM	0x02
+#define BT_START_STREAM_SCO_RELAY	0x04
+#define BT_START_STREAM_A2DP_RELAY	0x08
+
 struct bt_start_stream_req {
 	bt_audio_msg_header_t	h;
+	uint8_t			flags;
+	uint32_t		group;		/* With SHARED_PCM, 0 for none */
 } __attribute__ ((packed));
 
+/* Interleaved native endian 16 bit samples at the configured rate and
+ * channels are written at data[write_idx % size] and write_idx advanced
+ * once they are complete, the daemon does the same with read_idx. Both
+ * only ever grow. Overruns are left to the client to avoid, the daemon
+ * plays silence and counts an underrun when a ring runs dry mid frame. */
+#define BT_PCM_RING_SIZE		(32 * 1024)
+
+struct bt_pcm_ring {
+	uint32_t		size;
+	uint32_t		write_idx;
+	uint32_t		read_idx;
+	uint32_t		underruns;
+	uint8_t			data[0];
+};
+
 struct bt_start_stream_rsp {
 	bt_audio_msg_header_t	h;
 } __attribute__ ((packed));
@@ -27,7 +27,11 @@
 #endif
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <signal.h>
 #include <limits.h>
@@ -46,6 +50,9 @@
 #include "sbc.h"
 #include "rtp.h"
 #include "liba2dp.h"
+#include "thread-policy.h"
+
+#include <cutils/properties.h>
 
 #define LOG_NDEBUG 0
 #define LOG_TAG "A2DP"
@@ -85,6 +92,26 @@
 /* Number of packets to buffer in the stream socket */
 #define PACKET_BUFFER_COUNT		10
 
+/* Number of encoded packets sent together with a single system call */
+#define PACKET_BATCH_COUNT		4
+
+/* Number of encoded packets queued between the encoder and the sender
+ * thread, a2dp_write() blocks once all of them are in use */
+#define PACKET_RING_COUNT		8
+
+/* Number of packets the pacing tries to keep queued in the stream socket,
+ * packets are sent ahead of schedule while fewer are pending */
+#define PACKET_QUEUE_TARGET		2
+
+/* Bitpool adaptation: step by which the bitpool is lowered on congestion and
+ * raised again after BITPOOL_RECOVERY_PACKETS packets without congestion */
+#define BITPOOL_STEP			4
+#define BITPOOL_RECOVERY_PACKETS	200
+
+#ifndef SIOCOUTQ
+#define SIOCOUTQ			TIOCOUTQ
+#endif
+
 /* timeout in milliseconds to prevent poll() from hanging indefinitely */
 #define POLL_TIMEOUT			1000
 
@@ -95,9 +122,16 @@
 /* timeout in milliseconds for a2dp_write */
 #define WRITE_TIMEOUT			1000
 
+/* longest MPEG-1/2 audio frame, layer II at 384 kbit/s and 32 kHz */
+#define MPEG_MAX_FRAME_LENGTH		1729
+
 /* timeout in seconds for command socket recv() */
 #define RECV_TIMEOUT			5
 
+/* interval in milliseconds at which indications from bluetoothd, such as
+ * sink delay reports, are read while streaming */
+#define INDICATION_INTERVAL		500
+
 
 typedef enum {
 	A2DP_STATE_NONE = 0,
@@ -118,6 +152,12 @@ typedef enum {
 	A2DP_CMD_QUIT,
 } a2dp_command_t;
 
+/* RFC 2250 MPEG audio specific header, follows the RTP header */
+struct rtp_mpeg_payload {
+	uint16_t mbz;
+	uint16_t frag_offset;
+} __attribute__ ((packed));
+
 struct bluetooth_data {
 	unsigned int link_mtu;			/* MTU for transport channel */
 	struct pollfd stream;			/* Audio stream filedescriptor */
@@ -131,13 +171,42 @@ struct bluetooth_data {
 	pthread_cond_t thread_wait;
 	pthread_cond_t client_wait;
 
+	int format;				/* A2DP_FORMAT_* of a2dp_write() data */
 	sbc_capabilities_t sbc_capabilities;
+	mpeg_capabilities_t mpeg_capabilities;
 	sbc_t sbc;				/* Codec data */
 	int	frame_duration;			/* length of an SBC frame in microseconds */
 	int codesize;				/* SBC codesize */
 	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
+	uint8_t buffer[PACKET_RING_COUNT][BUFFER_SIZE]; /* Codec transfer buffers */
 	int count;				/* Codec transfer buffer counter */
+	int header_len;				/* RTP and payload header length */
+
+	/* MPEG passthrough: frame split across a2dp_write() calls */
+	uint8_t mpeg_frame[MPEG_MAX_FRAME_LENGTH];
+	unsigned int mpeg_frame_len;
+	unsigned int mpeg_frame_length;		/* Length of the last frame */
+	unsigned int mpeg_dropped;		/* Bytes skipped to resynchronize */
+	uint16_t mpeg_frag_offset;		/* Offset of the fragment being filled */
+	int layer;				/* Negotiated MPEG layer */
+
+	/* ring of encoded packets, filled by a2dp_write() at packet_head
+	 * and sent by the sender thread from packet_tail */
+	pthread_t sender;
+	pthread_mutex_t packet_mutex;
+	pthread_cond_t packet_ready;		/* packets were queued */
+	pthread_cond_t packet_space;		/* packets were sent or dropped */
+	int packet_len[PACKET_RING_COUNT];	/* Length of the queued packets */
+	long packet_duration[PACKET_RING_COUNT]; /* Play time in microseconds */
+	int packet_head;			/* Packet being filled */
+	int packet_tail;			/* Oldest queued packet */
+	int packets;				/* Queued packets */
+	int sending;				/* Packets the sender is writing */
+	int flushing;
+	int sender_quit;
+	int start_pending;	/* fd received ahead of the START response */
+	int stream_error;			/* Set by the sender on EPIPE */
+	int target_bitpool;			/* Bitpool for the next packet */
 
 	int nsamples;				/* Cumulative number of codec samples */
 	uint16_t seq_num;			/* Cumulative packet sequence */
@@ -147,8 +216,22 @@ struct bluetooth_data {
 	int	rate;
 	int	channels;
 
-	/* used for pacing our writes to the output socket */
+	/* used for pacing our writes to the output socket, deadline of
+	 * the next packet in CLOCK_MONOTONIC microseconds */
 	uint64_t	next_write;
+	struct a2dp_stats stats;
+
+	/* consecutive packets sent without congestion */
+	int uncongested;
+
+	/* delay reported by the sink in 1/10 milliseconds, 0 if none */
+	uint16_t delay_report;
+
+	/* when the statistics were last reset and the total time spent
+	 * encoding since, in nanoseconds */
+	uint64_t stats_start;
+	unsigned long long encode_time;
+	unsigned long encoded_frames;
 };
 
 static uint64_t get_microseconds()
@@ -158,6 +241,18 @@ static uint64_t get_microseconds()
 	return (now.tv_sec * 1000000UL + now.tv_nsec / 1000UL);
 }
 
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000UL;
+	ts.tv_nsec = (deadline % 1000000UL) * 1000UL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+									EINTR)
+		;
+}
+
 #ifdef ENABLE_TIMING
 static void print_time(const char* message, uint64_t then, uint64_t now)
 {
@@ -166,10 +261,17 @@ static void print_time(const char* message, uint64_t then, uint64_t now)
 #endif
 
 static int audioservice_send(struct bluetooth_data *data, const bt_audio_msg_header_t *msg);
+static int audioservice_sendv(struct bluetooth_data *data,
+			const bt_audio_msg_header_t **msgs, int count);
 static int audioservice_expect(struct bluetooth_data *data, bt_audio_msg_header_t *outmsg,
 				int expected_type);
+static int audioservice_recv(struct bluetooth_data *data,
+				bt_audio_msg_header_t *inmsg);
+static int audioservice_read_indications(struct bluetooth_data *data,
+								int flags);
 static int bluetooth_a2dp_hw_params(struct bluetooth_data *data);
 static void set_state(struct bluetooth_data *data, a2dp_state_t state);
+static void avdtp_flush_packets(struct bluetooth_data *data);
 
 
 static void bluetooth_close(struct bluetooth_data *data)
@@ -181,10 +283,12 @@ static void bluetooth_close(struct bluetooth_data *data)
 	}
 
 	if (data->stream.fd >= 0) {
+		avdtp_flush_packets(data);
 		close(data->stream.fd);
 		data->stream.fd = -1;
 	}
 
+	data->delay_report = 0;
 	data->state = A2DP_STATE_NONE;
 }
 
@@ -220,31 +324,50 @@ static int bluetooth_start(struct bluetooth_data *data)
 	struct bt_start_stream_req *start_req = (void*) buf;
 	struct bt_start_stream_rsp *start_rsp = (void*) buf;
 	struct bt_new_stream_ind *streamfd_ind = (void*) buf;
-	int opt_name, err, bytes;
+	int opt_name, err, bytes, i;
+	int early = 0;
 
 	DBG("bluetooth_start");
 	data->state = A2DP_STATE_STARTING;
-	/* send start */
+	/* send start, asking for the stream fd while START is in flight */
 	memset(start_req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	start_req->h.type = BT_REQUEST;
 	start_req->h.name = BT_START_STREAM;
 	start_req->h.length = sizeof(*start_req);
+	start_req->flags = BT_START_STREAM_EARLY_FD;
 
 
 	err = audioservice_send(data, &start_req->h);
 	if (err < 0)
 		goto error;
 
-	start_rsp->h.length = sizeof(*start_rsp);
-	err = audioservice_expect(data, &start_rsp->h, BT_START_STREAM);
+	/* BT_NEW_STREAM comes first if the daemon hands out the fd early,
+	 * both messages have the same size */
+	err = audioservice_read_indications(data, 0);
 	if (err < 0)
 		goto error;
 
-	streamfd_ind->h.length = sizeof(*streamfd_ind);
-	err = audioservice_expect(data, &streamfd_ind->h, BT_NEW_STREAM);
+	start_rsp->h.length = sizeof(*start_rsp);
+	err = audioservice_recv(data, &start_rsp->h);
 	if (err < 0)
 		goto error;
 
+	if (start_rsp->h.name == BT_NEW_STREAM)
+		early = 1;
+	else if (start_rsp->h.name == BT_START_STREAM) {
+		streamfd_ind->h.length = sizeof(*streamfd_ind);
+		err = audioservice_expect(data, &streamfd_ind->h,
+							BT_NEW_STREAM);
+		if (err < 0)
+			goto error;
+	} else {
+		ERR("Bogus message %s received while %s was expected",
+				bt_audio_strname(start_rsp->h.name),
+				bt_audio_strname(BT_START_STREAM));
+		err = -EINVAL;
+		goto error;
+	}
+
 	data->stream.fd = bt_audio_service_get_data_fd(data->server.fd);
 	if (data->stream.fd < 0) {
 		ERR("bt_audio_service_get_data_fd failed, errno: %d", errno);
@@ -259,20 +382,68 @@ static int bluetooth_start(struct bluetooth_data *data)
 	setsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF, &bytes,
 			sizeof(bytes));
 
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	/* only the fields that change are filled in for every packet */
+	for (i = 0; i < PACKET_RING_COUNT; i++) {
+		struct rtp_header *header = (struct rtp_header *) data->buffer[i];
+
+		memset(header, 0, data->header_len);
+		header->v = 2;
+		header->pt = 1;
+		header->ssrc = htonl(1);
+	}
+
+	data->count = data->header_len;
 	data->frame_count = 0;
 	data->samples = 0;
 	data->nsamples = 0;
+	data->mpeg_frame_len = 0;
+	data->mpeg_frag_offset = 0;
 	data->seq_num = 0;
 	data->frame_count = 0;
+
+	/* the sender is idle, the ring was flushed when the stream stopped */
+	pthread_mutex_lock(&data->packet_mutex);
+	data->packet_head = 0;
+	data->packet_tail = 0;
+	data->packets = 0;
+	data->stream_error = 0;
 	data->next_write = 0;
+	memset(&data->stats, 0, sizeof(data->stats));
+	data->stats_start = get_microseconds();
+	data->encode_time = 0;
+	data->encoded_frames = 0;
+	data->uncongested = 0;
+	data->sbc.bitpool = data->sbc_capabilities.max_bitpool;
+	data->target_bitpool = data->sbc.bitpool;
+	data->stats.bitpool = data->sbc.bitpool;
+	data->start_pending = early;
+	pthread_mutex_unlock(&data->packet_mutex);
 
 	set_state(data, A2DP_STATE_STARTED);
+
+	if (!early)
+		return 0;
+
+	/* Let the writers encode and queue the first packets meanwhile, the
+	 * sender holds them back until the sink accepted START */
+	pthread_mutex_unlock(&data->mutex);
+	start_rsp->h.length = sizeof(*start_rsp);
+	err = audioservice_expect(data, &start_rsp->h, BT_START_STREAM);
+	pthread_mutex_lock(&data->mutex);
+
+	pthread_mutex_lock(&data->packet_mutex);
+	data->start_pending = 0;
+	pthread_cond_signal(&data->packet_ready);
+	pthread_mutex_unlock(&data->packet_mutex);
+
+	if (err < 0)
+		goto error;
+
 	return 0;
 
 error:
 	/* close bluetooth connection to force reinit and reconfiguration */
-	if (data->state == A2DP_STATE_STARTING) {
+	if (data->state == A2DP_STATE_STARTING || early) {
 		bluetooth_close(data);
 		/* notify client that thread is ready for next command */
 		pthread_cond_signal(&data->client_wait);
@@ -292,6 +463,7 @@ static int bluetooth_stop(struct bluetooth_data *data)
 	data->state = A2DP_STATE_STOPPING;
 	l2cap_set_flushable(data->stream.fd, 0);
 	if (data->stream.fd >= 0) {
+		avdtp_flush_packets(data);
 		close(data->stream.fd);
 		data->stream.fd = -1;
 	}
@@ -432,6 +604,71 @@ static int bluetooth_a2dp_init(struct bluetooth_data *data)
 	return 0;
 }
 
+/* Picks the MPEG configuration matching the frames a2dp_write() is given:
+ * layer III at the stream rate, with whatever bitrates the sink takes */
+static int bluetooth_mpeg_init(struct bluetooth_data *data)
+{
+	mpeg_capabilities_t *cap = &data->mpeg_capabilities;
+
+	switch (data->rate) {
+	case 48000:
+		cap->frequency &= BT_MPEG_SAMPLING_FREQ_48000;
+		break;
+	case 44100:
+		cap->frequency &= BT_MPEG_SAMPLING_FREQ_44100;
+		break;
+	case 32000:
+		cap->frequency &= BT_MPEG_SAMPLING_FREQ_32000;
+		break;
+	case 24000:
+		cap->frequency &= BT_MPEG_SAMPLING_FREQ_24000;
+		break;
+	case 22050:
+		cap->frequency &= BT_MPEG_SAMPLING_FREQ_22050;
+		break;
+	case 16000:
+		cap->frequency &= BT_MPEG_SAMPLING_FREQ_16000;
+		break;
+	default:
+		cap->frequency = 0;
+		break;
+	}
+
+	if (!cap->frequency) {
+		ERR("Rate %d not supported", data->rate);
+		return -1;
+	}
+
+	if (!(cap->layer & BT_MPEG_LAYER_3)) {
+		ERR("Sink does not support MPEG layer III");
+		return -1;
+	}
+	cap->layer = BT_MPEG_LAYER_3;
+	data->layer = 3;
+
+	if (data->channels == 2) {
+		if (cap->channel_mode & BT_A2DP_CHANNEL_MODE_JOINT_STEREO)
+			cap->channel_mode = BT_A2DP_CHANNEL_MODE_JOINT_STEREO;
+		else if (cap->channel_mode & BT_A2DP_CHANNEL_MODE_STEREO)
+			cap->channel_mode = BT_A2DP_CHANNEL_MODE_STEREO;
+		else if (cap->channel_mode & BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL)
+			cap->channel_mode = BT_A2DP_CHANNEL_MODE_DUAL_CHANNEL;
+		else
+			cap->channel_mode = 0;
+	} else
+		cap->channel_mode &= BT_A2DP_CHANNEL_MODE_MONO;
+
+	if (!cap->channel_mode) {
+		ERR("No supported channel modes");
+		return -1;
+	}
+
+	/* frames are sent as they come, without MPF-2 extensions */
+	cap->mpf = 0;
+
+	return 0;
+}
+
 static void bluetooth_a2dp_setup(struct bluetooth_data *data)
 {
 	sbc_capabilities_t active_capabilities = data->sbc_capabilities;
@@ -491,18 +728,70 @@ static void bluetooth_a2dp_setup(struct bluetooth_data *data)
 	}
 
 	data->sbc.bitpool = active_capabilities.max_bitpool;
+	data->header_len = sizeof(struct rtp_header) +
+					sizeof(struct rtp_payload);
 	data->codesize = sbc_get_codesize(&data->sbc);
 	data->frame_duration = sbc_get_frame_duration(&data->sbc);
 	DBG("frame_duration: %d us", data->frame_duration);
 }
 
+static int bluetooth_mpeg_hw_params(struct bluetooth_data *data)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_set_configuration_req *setconf_req = (void*) buf;
+	struct bt_set_configuration_rsp *setconf_rsp = (void*) buf;
+	int err;
+
+	err = bluetooth_mpeg_init(data);
+	if (err < 0)
+		return err;
+
+	memset(setconf_req, 0, BT_SUGGESTED_BUFFER_SIZE);
+	setconf_req->h.type = BT_REQUEST;
+	setconf_req->h.name = BT_SET_CONFIGURATION;
+	setconf_req->h.length = sizeof(*setconf_req);
+	memcpy(&setconf_req->codec, &data->mpeg_capabilities,
+						sizeof(data->mpeg_capabilities));
+
+	setconf_req->codec.transport = BT_CAPABILITIES_TRANSPORT_A2DP;
+	setconf_req->codec.length = sizeof(data->mpeg_capabilities);
+	setconf_req->h.length += setconf_req->codec.length - sizeof(setconf_req->codec);
+
+	DBG("bluetooth_mpeg_hw_params sending configuration: frequency %d "
+		"channel_mode %d layer %d bitrate 0x%04x",
+		data->mpeg_capabilities.frequency,
+		data->mpeg_capabilities.channel_mode,
+		data->mpeg_capabilities.layer,
+		data->mpeg_capabilities.bitrate);
+
+	err = audioservice_send(data, &setconf_req->h);
+	if (err < 0)
+		return err;
+
+	err = audioservice_expect(data, &setconf_rsp->h, BT_SET_CONFIGURATION);
+	if (err < 0)
+		return err;
+
+	data->link_mtu = setconf_rsp->link_mtu;
+	DBG("MTU: %d", data->link_mtu);
+
+	data->header_len = sizeof(struct rtp_header) +
+					sizeof(struct rtp_mpeg_payload);
+	data->codesize = 0;
+	data->frame_duration = 0;
+
+	return 0;
+}
+
 static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 {
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	char setconf_buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_open_req *open_req = (void *) buf;
 	struct bt_open_rsp *open_rsp = (void *) buf;
-	struct bt_set_configuration_req *setconf_req = (void*) buf;
+	struct bt_set_configuration_req *setconf_req = (void*) setconf_buf;
 	struct bt_set_configuration_rsp *setconf_rsp = (void*) buf;
+	const bt_audio_msg_header_t *reqs[2];
 	int err;
 
 	memset(open_req, 0, BT_SUGGESTED_BUFFER_SIZE);
@@ -510,23 +799,29 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	open_req->h.name = BT_OPEN;
 	open_req->h.length = sizeof(*open_req);
 	strncpy(open_req->destination, data->address, 18);
-	open_req->seid = data->sbc_capabilities.capability.seid;
+	if (data->format == A2DP_FORMAT_MPEG12)
+		open_req->seid = data->mpeg_capabilities.capability.seid;
+	else
+		open_req->seid = data->sbc_capabilities.capability.seid;
 	open_req->lock = BT_WRITE_LOCK;
 
-	err = audioservice_send(data, &open_req->h);
-	if (err < 0)
-		return err;
+	if (data->format == A2DP_FORMAT_MPEG12) {
+		err = audioservice_send(data, &open_req->h);
+		if (err < 0)
+			return err;
 
-	open_rsp->h.length = sizeof(*open_rsp);
-	err = audioservice_expect(data, &open_rsp->h, BT_OPEN);
-	if (err < 0)
-		return err;
+		open_rsp->h.length = sizeof(*open_rsp);
+		err = audioservice_expect(data, &open_rsp->h, BT_OPEN);
+		if (err < 0)
+			return err;
+
+		return bluetooth_mpeg_hw_params(data);
+	}
 
 	err = bluetooth_a2dp_init(data);
 	if (err < 0)
 		return err;
 
-
 	memset(setconf_req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	setconf_req->h.type = BT_REQUEST;
 	setconf_req->h.name = BT_SET_CONFIGURATION;
@@ -615,10 +910,23 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	DBG("\tmin_bitpool: %d\n", data->sbc_capabilities.min_bitpool);
 	DBG("\tmax_bitpool: %d\n", data->sbc_capabilities.max_bitpool);
 
-	err = audioservice_send(data, &setconf_req->h);
+	/* The configuration does not depend on the open response, send both
+	 * requests in one go to save a round trip */
+	reqs[0] = &open_req->h;
+	reqs[1] = &setconf_req->h;
+	err = audioservice_sendv(data, reqs, 2);
 	if (err < 0)
 		return err;
 
+	open_rsp->h.length = sizeof(*open_rsp);
+	err = audioservice_expect(data, &open_rsp->h, BT_OPEN);
+	if (err < 0) {
+		/* the daemon refuses the configuration as well, drop it */
+		audioservice_expect(data, &setconf_rsp->h,
+						BT_SET_CONFIGURATION);
+		return err;
+	}
+
 	err = audioservice_expect(data, &setconf_rsp->h, BT_SET_CONFIGURATION);
 	if (err < 0)
 		return err;
@@ -636,78 +944,280 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	return 0;
 }
 
-static int avdtp_write(struct bluetooth_data *data)
+/* Waits until the next packet is due, which is against a fixed schedule of
+ * one packet duration per packet unless the socket queue runs low */
+static void avdtp_pace(struct bluetooth_data *data, long duration)
 {
-	int ret = 0;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
+	uint64_t now = get_microseconds();
+	int queued = 0;
+	long ahead;
 
-	uint64_t now;
-	long duration = data->frame_duration * data->frame_count;
-#ifdef ENABLE_TIMING
-	uint64_t begin, end, begin2, end2;
-	begin = get_microseconds();
+	if (ioctl(data->stream.fd, SIOCOUTQ, &queued) < 0)
+		queued = -1;
+	data->stats.queued = queued;
+
+	if (!data->next_write) {
+		data->next_write = now + duration;
+		return;
+	}
+
+	ahead = data->next_write - now;
+
+	if (ahead <= -CATCH_UP_TIMEOUT * 1000) {
+		/* fallen too far behind, don't try to catch up */
+		VDBG("ahead < %d, reseting next_write timestamp",
+						-CATCH_UP_TIMEOUT * 1000);
+		data->stats.resyncs++;
+		data->next_write = now + duration;
+		return;
+	}
+
+	if (ahead < 0) {
+		unsigned int late = -ahead;
+
+		if (late > (unsigned long) duration)
+			data->stats.late++;
+		if (late > data->stats.max_jitter)
+			data->stats.max_jitter = late;
+		data->stats.total_jitter += late;
+	} else if (queued >= 0 &&
+			queued < (int) data->link_mtu * PACKET_QUEUE_TARGET) {
+		/* the link drains faster than our schedule, send now
+		 * rather than let the sink underrun */
+		data->stats.early++;
+	} else
+		sleep_until(data->next_write);
+
+	data->next_write += duration;
+}
+
+/* Lowers the bitpool while the link is congested and raises it back
+ * towards the negotiated maximum once it recovers. Called by the sender
+ * thread with packet_mutex held, the encoder picks the new value up with
+ * the next packet. */
+static void avdtp_adapt_bitpool(struct bluetooth_data *data, int congested,
+								int packets)
+{
+	sbc_capabilities_t *cap = &data->sbc_capabilities;
+	int bitpool = data->target_bitpool;
+
+	/* passthrough streams are sent as they come */
+	if (data->format != A2DP_FORMAT_PCM)
+		return;
+
+	if (congested) {
+		data->uncongested = 0;
+		bitpool = MAX(bitpool - BITPOOL_STEP, (int) cap->min_bitpool);
+	} else if ((data->uncongested += packets) >=
+						BITPOOL_RECOVERY_PACKETS) {
+		data->uncongested = 0;
+		bitpool = MIN(bitpool + BITPOOL_STEP, (int) cap->max_bitpool);
+	}
+
+	if (bitpool == data->target_bitpool)
+		return;
+
+	VDBG("bitpool %d -> %d", data->target_bitpool, bitpool);
+
+	data->target_bitpool = bitpool;
+	data->stats.bitpool = bitpool;
+	data->stats.bitpool_changes++;
+}
+
+/* Accounts one send of a batch of packets in the latency histogram */
+static void avdtp_count_send(struct bluetooth_data *data, uint64_t usecs)
+{
+	int bucket = 0;
+
+	while (bucket < A2DP_SEND_LATENCY_BUCKETS - 1 &&
+				usecs >= (1000ULL << bucket))
+		bucket++;
+
+	data->stats.send_latency[bucket]++;
+}
+
+/* Matches the kernel's struct mmsghdr, which older C libraries lack */
+struct avdtp_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+/* Sends count packets starting at ring slot first as separate L2CAP SDUs,
+ * returns the number sent */
+static int avdtp_send_packets(struct bluetooth_data *data, int first,
+								int count)
+{
+	struct avdtp_mmsghdr msgs[PACKET_BATCH_COUNT];
+	struct iovec iov[PACKET_BATCH_COUNT];
+	int i, ret;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = data->buffer[first + i];
+		iov[i].iov_len = data->packet_len[first + i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+#ifdef __NR_sendmmsg
+	ret = syscall(__NR_sendmmsg, data->stream.fd, msgs, count,
+								MSG_NOSIGNAL);
+	if (ret >= 0 || errno != ENOSYS)
+		return ret;
 #endif
 
-	header = (struct rtp_header *)data->buffer;
-	payload = (struct rtp_payload *)(data->buffer + sizeof(*header));
+	for (i = 0; i < count; i++) {
+		ret = sendmsg(data->stream.fd, &msgs[i].msg_hdr, MSG_NOSIGNAL);
+		if (ret < 0)
+			return i > 0 ? i : ret;
+	}
+
+	return count;
+}
+
+/* Completes the header of the packet being filled and hands it over to
+ * the sender thread, waiting for the next slot to become free */
+static int avdtp_queue_packet(struct bluetooth_data *data)
+{
+	uint8_t *buffer = data->buffer[data->packet_head];
+	struct rtp_header *header = (struct rtp_header *) buffer;
+	struct rtp_payload *payload;
+	struct timespec ts;
+	int err = 0;
 
-	memset(data->buffer, 0, sizeof(*header) + sizeof(*payload));
+	if (data->format == A2DP_FORMAT_MPEG12) {
+		struct rtp_mpeg_payload *mpeg = (void *) (buffer +
+							sizeof(*header));
+
+		mpeg->mbz = 0;
+		mpeg->frag_offset = htons(data->mpeg_frag_offset);
+	} else {
+		payload = (struct rtp_payload *) (buffer + sizeof(*header));
+		payload->frame_count = data->frame_count;
+	}
 
-	payload->frame_count = data->frame_count;
-	header->v = 2;
-	header->pt = 1;
 	header->sequence_number = htons(data->seq_num);
 	header->timestamp = htonl(data->nsamples);
-	header->ssrc = htonl(1);
+
+	pthread_mutex_lock(&data->packet_mutex);
+
+	data->packet_len[data->packet_head] = data->count;
+	data->packet_duration[data->packet_head] =
+			data->frame_duration * data->frame_count;
+	data->packet_head = (data->packet_head + 1) % PACKET_RING_COUNT;
+	data->packets++;
+	pthread_cond_signal(&data->packet_ready);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += WRITE_TIMEOUT / 1000;
+
+	while (data->packets == PACKET_RING_COUNT && err == 0)
+		err = pthread_cond_timedwait(&data->packet_space,
+						&data->packet_mutex, &ts);
+
+	/* the next packet is encoded with the bitpool the sender picked */
+	data->sbc.bitpool = data->target_bitpool;
+
+	pthread_mutex_unlock(&data->packet_mutex);
+
+	/* Reset buffer of data to send */
+	data->count = data->header_len;
+	data->frame_count = 0;
+	data->samples = 0;
+	data->seq_num++;
+
+	if (err) {
+		ERR("Timeout waiting for the sender thread");
+		return -err;
+	}
+
+	return 0;
+}
+
+/* Drops all queued packets and waits for the sender thread to finish the
+ * packets it is writing, so that the stream socket can be closed */
+static void avdtp_flush_packets(struct bluetooth_data *data)
+{
+	pthread_mutex_lock(&data->packet_mutex);
+
+	data->flushing = 1;
+	while (data->sending)
+		pthread_cond_wait(&data->packet_space, &data->packet_mutex);
+
+	data->packet_tail = data->packet_head;
+	data->packets = 0;
+	data->flushing = 0;
+	pthread_cond_broadcast(&data->packet_space);
+
+	pthread_mutex_unlock(&data->packet_mutex);
+}
+
+/* Sends a batch of queued packets, called by the sender thread without
+ * packet_mutex held. Returns whether the link looked congested. */
+static int avdtp_write(struct bluetooth_data *data, int first, int packets)
+{
+	int ret = 0;
+	long duration = 0;
+	int congested = 0;
+	int i;
+	uint64_t send_begin;
+#ifdef ENABLE_TIMING
+	uint64_t begin, end, begin2, end2;
+	begin = get_microseconds();
+#endif
+
+	for (i = 0; i < packets; i++)
+		duration += data->packet_duration[first + i];
 
 	data->stream.revents = 0;
 #ifdef ENABLE_TIMING
 	begin2 = get_microseconds();
 #endif
-	ret = poll(&data->stream, 1, POLL_TIMEOUT);
+	/* the socket not being writable right away means backpressure */
+	ret = poll(&data->stream, 1, 0);
+	if (ret == 0) {
+		congested = 1;
+		ret = poll(&data->stream, 1, POLL_TIMEOUT);
+		if (ret == 0)
+			data->stats.poll_timeouts++;
+	}
 #ifdef ENABLE_TIMING
 	end2 = get_microseconds();
 	print_time("poll", begin2, end2);
 #endif
 	if (ret == 1 && data->stream.revents == POLLOUT) {
-		long ahead = 0;
-		now = get_microseconds();
-
-		if (data->next_write) {
-			ahead = data->next_write - now;
 #ifdef ENABLE_TIMING
-			DBG("duration: %ld, ahead: %ld", duration, ahead);
+		DBG("duration: %ld, ahead: %ld", duration,
+			data->next_write ? (long) (data->next_write -
+					get_microseconds()) : 0);
 #endif
-			if (ahead > 0) {
-				/* too fast, need to throttle */
-				usleep(ahead);
-			}
-		} else {
-			data->next_write = now;
-		}
-		if (ahead <= -CATCH_UP_TIMEOUT * 1000) {
-			/* fallen too far behind, don't try to catch up */
-			VDBG("ahead < %d, reseting next_write timestamp", -CATCH_UP_TIMEOUT * 1000);
-			data->next_write = 0;
-		} else {
-			data->next_write += duration;
-		}
+		avdtp_pace(data, duration);
 
+		/* more than half of the socket buffer still pending */
+		if (data->stats.queued > (int) data->link_mtu *
+						PACKET_BUFFER_COUNT / 2)
+			congested = 1;
+
+		send_begin = get_microseconds();
+		ret = avdtp_send_packets(data, first, packets);
+		avdtp_count_send(data, get_microseconds() - send_begin);
 #ifdef ENABLE_TIMING
-		begin2 = get_microseconds();
-#endif
-		ret = send(data->stream.fd, data->buffer, data->count, MSG_NOSIGNAL);
-#ifdef ENABLE_TIMING
-		end2 = get_microseconds();
-		print_time("send", begin2, end2);
+		print_time("send", send_begin, get_microseconds());
 #endif
 		if (ret < 0) {
 			/* can happen during normal remote disconnect */
 			VDBG("send() failed: %d (errno %s)", ret, strerror(errno));
-		}
-		if (ret == -EPIPE) {
-			bluetooth_close(data);
+			/* the socket is closed by the encoding side */
+			if (errno == EPIPE)
+				data->stream_error = EPIPE;
+		} else {
+			data->stats.packets += ret;
+			for (i = 0; i < ret; i++)
+				data->stats.bytes += data->packet_len[first + i];
+			/* the socket filled up part way, count as congestion */
+			if (ret < packets)
+				congested = 1;
 		}
 	} else {
 		/* can happen during normal remote disconnect */
@@ -716,17 +1226,239 @@ static int avdtp_write(struct bluetooth_data *data)
 		data->next_write = 0;
 	}
 
-	/* Reset buffer of data to send */
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	data->frame_count = 0;
-	data->samples = 0;
-	data->seq_num++;
-
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
 	print_time("avdtp_write", begin, end);
 #endif
-	return 0; /* always return success */
+	return congested;
+}
+
+/* Sender stage: writes out the packets queued by a2dp_write(), so that
+ * encoding the next packets overlaps with waiting on the socket */
+static void *a2dp_sender_thread(void *d)
+{
+	struct bluetooth_data *data = d;
+
+	prctl(PR_SET_NAME, (int)"a2dp_sender", 0, 0, 0);
+	a2dp_set_thread_policy("a2dp_sender");
+
+	pthread_mutex_lock(&data->packet_mutex);
+
+	while (!data->sender_quit) {
+		int first, packets, congested;
+
+		if (data->packets == 0 || data->flushing ||
+						data->start_pending) {
+			pthread_cond_wait(&data->packet_ready,
+						&data->packet_mutex);
+			continue;
+		}
+
+		/* packets queued so far, contiguous in the ring */
+		first = data->packet_tail;
+		packets = MIN(data->packets, PACKET_BATCH_COUNT);
+		packets = MIN(packets, PACKET_RING_COUNT - first);
+
+		data->sending = packets;
+		pthread_mutex_unlock(&data->packet_mutex);
+
+		congested = avdtp_write(data, first, packets);
+
+		pthread_mutex_lock(&data->packet_mutex);
+		/* packets that could not be sent are dropped */
+		data->packet_tail = (first + packets) % PACKET_RING_COUNT;
+		data->packets -= packets;
+		data->sending = 0;
+		avdtp_adapt_bitpool(data, congested, packets);
+		pthread_cond_broadcast(&data->packet_space);
+	}
+
+	pthread_mutex_unlock(&data->packet_mutex);
+
+	return NULL;
+}
+
+/* Parses the MPEG-1/2 audio frame header at p, returns the layer (1-3) and
+ * the frame length, samples per frame and sampling rate, or 0 if p does not
+ * start a valid frame */
+static int mpeg_parse_header(const uint8_t *p, unsigned int *length,
+				unsigned int *samples, unsigned int *rate)
+{
+	static const uint16_t bitrates[2][3][15] = {
+		{	/* MPEG-1 layer I, II and III in kbit/s */
+			{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320,
+							352, 384, 416, 448 },
+			{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192,
+							224, 256, 320, 384 },
+			{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160,
+							192, 224, 256, 320 },
+		}, {	/* MPEG-2 */
+			{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160,
+							176, 192, 224, 256 },
+			{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96,
+							112, 128, 144, 160 },
+			{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96,
+							112, 128, 144, 160 },
+		},
+	};
+	static const unsigned int rates[2][3] = {
+		{ 44100, 48000, 32000 },
+		{ 22050, 24000, 16000 },
+	};
+	unsigned int lsf, layer, bitrate, padding;
+
+	/* frame sync, MPEG-2.5 and reserved versions are not supported */
+	if (p[0] != 0xff || (p[1] & 0xf0) != 0xf0)
+		return 0;
+
+	lsf = (p[1] & 0x08) ? 0 : 1;
+	layer = 4 - ((p[1] >> 1) & 0x03);
+	if (layer > 3)
+		return 0;
+
+	bitrate = bitrates[lsf][layer - 1][p[2] >> 4];
+	if ((p[2] >> 4) == 0x0f || bitrate == 0 || ((p[2] >> 2) & 0x03) == 3)
+		return 0;
+
+	*rate = rates[lsf][(p[2] >> 2) & 0x03];
+	padding = (p[2] >> 1) & 0x01;
+
+	switch (layer) {
+	case 1:
+		*samples = 384;
+		*length = (12000 * bitrate / *rate + padding) * 4;
+		break;
+	case 2:
+		*samples = 1152;
+		*length = 144000 * bitrate / *rate + padding;
+		break;
+	default:
+		*samples = lsf ? 576 : 1152;
+		*length = (lsf ? 72000 : 144000) * bitrate / *rate + padding;
+		break;
+	}
+
+	return layer;
+}
+
+/* Adds one complete MPEG frame to the packet being filled, fragmenting it
+ * over several packets when it does not fit into one */
+static int mpeg_add_frame(struct bluetooth_data *data, const uint8_t *frame,
+				unsigned int length, unsigned int samples)
+{
+	size_t limit = data->link_mtu < BUFFER_SIZE ?
+					data->link_mtu : BUFFER_SIZE;
+	unsigned int offset = 0;
+	int err;
+
+	data->mpeg_frame_length = length;
+	data->frame_duration = samples * 1000000ULL / data->rate;
+
+	/* complete frames are kept together, so send what we have */
+	if (data->count > data->header_len && data->count + length > limit) {
+		err = avdtp_queue_packet(data);
+		if (err < 0)
+			return err;
+	}
+
+	data->nsamples += samples;
+
+	while (offset < length) {
+		unsigned int chunk = MIN(length - offset,
+						limit - data->header_len);
+
+		memcpy(data->buffer[data->packet_head] + data->count,
+						frame + offset, chunk);
+		data->count += chunk;
+		data->mpeg_frag_offset = offset;
+		/* the play time is accounted to the first fragment */
+		if (offset == 0)
+			data->frame_count++;
+		offset += chunk;
+
+		if (offset < length) {
+			err = avdtp_queue_packet(data);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	/* the last fragment goes out on its own too */
+	if (data->mpeg_frag_offset > 0) {
+		err = avdtp_queue_packet(data);
+		data->mpeg_frag_offset = 0;
+		return err;
+	}
+
+	/* send if the next frame of the same size would not fit */
+	if (data->count + length > limit)
+		return avdtp_queue_packet(data);
+
+	return 0;
+}
+
+/* Packetizes MPEG audio frames as they are, carrying partial frames over to
+ * the next call */
+static int a2dp_write_mpeg(struct bluetooth_data *data, const uint8_t *src,
+								int count)
+{
+	unsigned int length, samples, rate;
+	int left = count;
+	int err;
+
+	while (left > 0) {
+		unsigned int need;
+
+		/* common case, a whole frame straight from the caller */
+		if (data->mpeg_frame_len == 0 && left >= 4 &&
+				mpeg_parse_header(src, &length, &samples,
+							&rate) == data->layer &&
+				rate == (unsigned int) data->rate &&
+				(unsigned int) left >= length) {
+			err = mpeg_add_frame(data, src, length, samples);
+			if (err < 0)
+				return err;
+			src += length;
+			left -= length;
+			continue;
+		}
+
+		/* collect the header, then the rest of the frame */
+		if (data->mpeg_frame_len < 4)
+			need = 4;
+		else if (mpeg_parse_header(data->mpeg_frame, &need, &samples,
+								&rate) == 0)
+			need = data->mpeg_frame_len;
+		need = MIN(need - data->mpeg_frame_len, (unsigned int) left);
+		memcpy(data->mpeg_frame + data->mpeg_frame_len, src, need);
+		data->mpeg_frame_len += need;
+		src += need;
+		left -= need;
+
+		if (data->mpeg_frame_len < 4)
+			break;
+
+		if (mpeg_parse_header(data->mpeg_frame, &length, &samples,
+						&rate) != data->layer ||
+				rate != (unsigned int) data->rate ||
+				length > MPEG_MAX_FRAME_LENGTH) {
+			/* not a frame we negotiated, resynchronize */
+			memmove(data->mpeg_frame, data->mpeg_frame + 1,
+						--data->mpeg_frame_len);
+			data->mpeg_dropped++;
+			continue;
+		}
+
+		if (data->mpeg_frame_len < length)
+			continue;
+
+		err = mpeg_add_frame(data, data->mpeg_frame, length, samples);
+		if (err < 0)
+			return err;
+		data->mpeg_frame_len = 0;
+	}
+
+	return count;
 }
 
 static int audioservice_send(struct bluetooth_data *data,
@@ -752,6 +1484,37 @@ static int audioservice_send(struct bluetooth_data *data,
 	return err;
 }
 
+/* Sends several requests at once, the replies come back in order */
+static int audioservice_sendv(struct bluetooth_data *data,
+			const bt_audio_msg_header_t **msgs, int count)
+{
+	struct iovec iov[count];
+	struct msghdr msgh;
+	int i, err;
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = (void *) msgs[i];
+		iov[i].iov_len = msgs[i]->length;
+	}
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = iov;
+	msgh.msg_iovlen = count;
+
+	if (sendmsg(data->server.fd, &msgh, MSG_NOSIGNAL) > 0)
+		return 0;
+
+	err = -errno;
+	ERR("Error sending data to audio service: %s(%d)",
+		strerror(errno), errno);
+	if (err == -EPIPE)
+		bluetooth_close(data);
+
+	return err;
+}
+
+/* Reads exactly one message, the stream socket may hold several, into
+ * inmsg which must be able to take BT_SUGGESTED_BUFFER_SIZE bytes */
 static int audioservice_recv(struct bluetooth_data *data,
 		bt_audio_msg_header_t *inmsg)
 {
@@ -759,9 +1522,26 @@ static int audioservice_recv(struct bluetooth_data *data,
 	const char *type, *name;
 	uint16_t length;
 
-	length = inmsg->length ? inmsg->length : BT_SUGGESTED_BUFFER_SIZE;
+	ret = recv(data->server.fd, inmsg, sizeof(*inmsg), MSG_WAITALL);
+	if (ret == sizeof(*inmsg)) {
+		length = inmsg->length;
+		if (length < sizeof(*inmsg) ||
+					length > BT_SUGGESTED_BUFFER_SIZE) {
+			ERR("Bogus length %u of IPC packet from bluetoothd",
+								length);
+			return -EINVAL;
+		}
+
+		length -= sizeof(*inmsg);
+		ret = recv(data->server.fd, inmsg + 1, length, MSG_WAITALL);
+		if (ret >= 0 && ret != length) {
+			ERR("Truncated IPC packet from bluetoothd");
+			return -EINVAL;
+		}
+		if (ret >= 0)
+			ret = inmsg->length;
+	}
 
-	ret = recv(data->server.fd, inmsg, length, 0);
 	if (ret < 0) {
 		err = -errno;
 		ERR("Error receiving IPC data from bluetoothd: %s (%d)",
@@ -773,21 +1553,17 @@ static int audioservice_recv(struct bluetooth_data *data,
 		err = -EINVAL;
 	} else if (inmsg->type == BT_ERROR) {
 		bt_audio_error_t *error = (bt_audio_error_t *)inmsg;
-		ret = recv(data->server.fd, &error->posix_errno,
-				sizeof(error->posix_errno), 0);
-		if (ret < 0) {
-			err = -errno;
-			ERR("Error receiving error code for BT_ERROR: %s (%d)",
-						strerror(errno), errno);
-			if (err == -EPIPE)
-				bluetooth_close(data);
-		} else {
-			ERR("%s failed : %s(%d)",
-					bt_audio_strname(error->h.name),
-					strerror(error->posix_errno),
-					error->posix_errno);
-			err = -error->posix_errno;
+
+		if ((size_t) ret < sizeof(*error)) {
+			ERR("Too short BT_ERROR from bluetoothd");
+			return -EINVAL;
 		}
+
+		ERR("%s failed : %s(%d)",
+				bt_audio_strname(error->h.name),
+				strerror(error->posix_errno),
+				error->posix_errno);
+		err = -error->posix_errno;
 	} else {
 		type = bt_audio_strtype(inmsg->type);
 		name = bt_audio_strname(inmsg->name);
@@ -805,11 +1581,70 @@ static int audioservice_recv(struct bluetooth_data *data,
 	return err;
 }
 
+static void audioservice_indication(struct bluetooth_data *data,
+		const bt_audio_msg_header_t *msg)
+{
+	const struct bt_delay_report_ind *ind = (const void *) msg;
+
+	switch (msg->name) {
+	case BT_DELAY_REPORT:
+		if (msg->length < sizeof(*ind))
+			break;
+		DBG("sink delay report: %u.%u ms", ind->delay / 10,
+							ind->delay % 10);
+		data->delay_report = ind->delay;
+		break;
+	default:
+		VDBG("ignoring indication %s", bt_audio_strname(msg->name));
+		break;
+	}
+}
+
+/* Consumes the indications at the head of the IPC socket, with flags set to
+ * MSG_DONTWAIT only those already received. Returns 0 once another message
+ * or nothing is next, or a negative error. */
+static int audioservice_read_indications(struct bluetooth_data *data,
+								int flags)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	bt_audio_msg_header_t *msg = (void *) buf;
+	uint16_t length;
+	int ret;
+
+	while (1) {
+		ret = recv(data->server.fd, msg, sizeof(*msg), MSG_PEEK | flags);
+		if (ret < 0)
+			return errno == EAGAIN ? 0 : -errno;
+
+		/* responses and short reads are left to audioservice_recv */
+		if ((size_t) ret < sizeof(*msg) || msg->type != BT_INDICATION)
+			return 0;
+
+		length = msg->length;
+		if (length < sizeof(*msg) || length > sizeof(buf))
+			return -EINVAL;
+
+		ret = recv(data->server.fd, buf, length, MSG_WAITALL);
+		if (ret < 0)
+			return -errno;
+		if (ret < length)
+			return -EINVAL;
+
+		audioservice_indication(data, msg);
+	}
+}
+
 static int audioservice_expect(struct bluetooth_data *data,
 		bt_audio_msg_header_t *rsp_hdr, int expected_name)
 {
-	int err = audioservice_recv(data, rsp_hdr);
+	int err;
+
+	/* indications may be sent at any time, also ahead of a response */
+	err = audioservice_read_indications(data, 0);
+	if (err < 0)
+		return err;
 
+	err = audioservice_recv(data, rsp_hdr);
 	if (err != 0)
 		return err;
 
@@ -854,12 +1689,21 @@ static int bluetooth_parse_capabilities(struct bluetooth_data *data,
 {
 	int bytes_left = rsp->h.length - sizeof(*rsp);
 	codec_capabilities_t *codec = (void *) rsp->data;
+	int type = BT_A2DP_SBC_SINK;
+	void *caps = &data->sbc_capabilities;
+	size_t caps_len = sizeof(data->sbc_capabilities);
 
 	if (codec->transport != BT_CAPABILITIES_TRANSPORT_A2DP)
 		return -EINVAL;
 
+	if (data->format == A2DP_FORMAT_MPEG12) {
+		type = BT_A2DP_MPEG12_SINK;
+		caps = &data->mpeg_capabilities;
+		caps_len = sizeof(data->mpeg_capabilities);
+	}
+
 	while (bytes_left > 0) {
-		if ((codec->type == BT_A2DP_SBC_SINK) &&
+		if ((codec->type == type) &&
 			!(codec->lock & BT_WRITE_LOCK))
 			break;
 
@@ -871,11 +1715,10 @@ static int bluetooth_parse_capabilities(struct bluetooth_data *data,
 		codec = (codec_capabilities_t *)((char *)codec + codec->length);
 	}
 
-	if (bytes_left <= 0 ||
-			codec->length != sizeof(data->sbc_capabilities))
+	if (bytes_left <= 0 || codec->length != caps_len)
 		return -EINVAL;
 
-	memcpy(&data->sbc_capabilities, codec, codec->length);
+	memcpy(caps, codec, codec->length);
 	return 0;
 }
 
@@ -1022,6 +1865,9 @@ again:
 
 static void a2dp_free(struct bluetooth_data *data)
 {
+	pthread_cond_destroy(&data->packet_space);
+	pthread_cond_destroy(&data->packet_ready);
+	pthread_mutex_destroy(&data->packet_mutex);
 	pthread_cond_destroy(&data->client_wait);
 	pthread_cond_destroy(&data->thread_wait);
 	pthread_cond_destroy(&data->thread_start);
@@ -1030,6 +1876,16 @@ static void a2dp_free(struct bluetooth_data *data)
 	return;
 }
 
+static void a2dp_stop_sender(struct bluetooth_data *data)
+{
+	pthread_mutex_lock(&data->packet_mutex);
+	data->sender_quit = 1;
+	pthread_cond_signal(&data->packet_ready);
+	pthread_mutex_unlock(&data->packet_mutex);
+
+	pthread_join(data->sender, NULL);
+}
+
 static void* a2dp_thread(void *d)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
@@ -1038,6 +1894,7 @@ static void* a2dp_thread(void *d)
 
 	DBG("a2dp_thread started");
 	prctl(PR_SET_NAME, (int)"a2dp_thread", 0, 0, 0);
+	a2dp_set_thread_policy("a2dp_thread");
 
 	pthread_mutex_lock(&data->mutex);
 
@@ -1047,7 +1904,30 @@ static void* a2dp_thread(void *d)
 	while (1)
 	{
 		while (1) {
-			pthread_cond_wait(&data->thread_wait, &data->mutex);
+			if (data->state == A2DP_STATE_STARTED) {
+				struct timespec ts;
+
+				/* nothing else reads the IPC socket while
+				 * streaming, so check it periodically */
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec += INDICATION_INTERVAL / 1000;
+				ts.tv_nsec += (INDICATION_INTERVAL % 1000) *
+								1000000L;
+				if (ts.tv_nsec >= 1000000000L) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+				}
+
+				if (pthread_cond_timedwait(&data->thread_wait,
+						&data->mutex, &ts) == ETIMEDOUT) {
+					if (data->server.fd >= 0)
+						audioservice_read_indications(
+							data, MSG_DONTWAIT);
+					continue;
+				}
+			} else
+				pthread_cond_wait(&data->thread_wait,
+							&data->mutex);
 
 			/* Initialization needed */
 			if (data->state == A2DP_STATE_NONE &&
@@ -1083,6 +1963,7 @@ static void* a2dp_thread(void *d)
 
 			case A2DP_CMD_QUIT:
 				bluetooth_close(data);
+				a2dp_stop_sender(data);
 				sbc_finish(&data->sbc);
 				a2dp_free(data);
 				goto done;
@@ -1106,12 +1987,22 @@ done:
 }
 
 int a2dp_init(int rate, int channels, a2dpData* dataPtr)
+{
+	return a2dp_init_format(rate, channels, A2DP_FORMAT_PCM, dataPtr);
+}
+
+int a2dp_init_format(int rate, int channels, int format, a2dpData* dataPtr)
 {
 	struct bluetooth_data* data;
 	pthread_attr_t attr;
 	int err;
 
-	DBG("a2dp_init rate: %d channels: %d", rate, channels);
+	DBG("a2dp_init rate: %d channels: %d format: %d", rate, channels,
+								format);
+
+	if (format != A2DP_FORMAT_PCM && format != A2DP_FORMAT_MPEG12)
+		return -EINVAL;
+
 	*dataPtr = NULL;
 	data = malloc(sizeof(struct bluetooth_data));
 	if (!data)
@@ -1126,6 +2017,7 @@ int a2dp_init(int rate, int channels, a2dpData* dataPtr)
 	strncpy(data->address, "00:00:00:00:00:00", 18);
 	data->rate = rate;
 	data->channels = channels;
+	data->format = format;
 
 	sbc_init(&data->sbc, 0);
 
@@ -1133,17 +2025,28 @@ int a2dp_init(int rate, int channels, a2dpData* dataPtr)
 	pthread_cond_init(&data->thread_start, NULL);
 	pthread_cond_init(&data->thread_wait, NULL);
 	pthread_cond_init(&data->client_wait, NULL);
+	pthread_mutex_init(&data->packet_mutex, NULL);
+	pthread_cond_init(&data->packet_ready, NULL);
+	pthread_cond_init(&data->packet_space, NULL);
+
+	pthread_attr_init(&attr);
+
+	err = pthread_create(&data->sender, &attr, a2dp_sender_thread, data);
+	if (err) {
+		err = -err;
+		goto error;
+	}
 
 	pthread_mutex_lock(&data->mutex);
 	data->started = 0;
 
-	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
 	err = pthread_create(&data->thread, &attr, a2dp_thread, data);
 	if (err) {
 		/* If the thread create fails we must not wait */
 		pthread_mutex_unlock(&data->mutex);
+		a2dp_stop_sender(data);
 		err = -err;
 		goto error;
 	}
@@ -1187,7 +2090,8 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 	int err, ret = 0;
 	long frames_left = count;
 	int encoded;
-	unsigned int written;
+	size_t frame_length;
+	uint64_t encode_begin;
 	const char *buff;
 	int did_configure = 0;
 #ifdef ENABLE_TIMING
@@ -1200,34 +2104,60 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 	if (err < 0)
 		return err;
 
+	if (data->format == A2DP_FORMAT_MPEG12) {
+		ret = a2dp_write_mpeg(data, src, count);
+		goto done;
+	}
+
 	codesize = data->codesize;
 
 	while (frames_left >= codesize) {
-		/* Enough data to encode (sbc wants 512 byte blocks) */
-		encoded = sbc_encode(&(data->sbc), src, codesize,
-					data->buffer + data->count,
-					sizeof(data->buffer) - data->count,
-					&written);
+		size_t limit, frames, written, max;
+
+		/* the bitpool may change between packets */
+		frame_length = sbc_get_frame_length(&data->sbc);
+
+		/* Encode as many frames as fit in the current packet: the
+		 * packet is sent as soon as another frame would not fit */
+		limit = data->link_mtu < BUFFER_SIZE ?
+					data->link_mtu : BUFFER_SIZE;
+		max = limit > (size_t) data->count + 1 ?
+			(limit - data->count - 1) / frame_length : 0;
+		if (max < 1)
+			max = 1;
+		if (max > frames_left / codesize)
+			max = frames_left / codesize;
+
+		encode_begin = get_microseconds();
+		encoded = sbc_encode_frames(&(data->sbc), src, max * codesize,
+					data->buffer[data->packet_head] + data->count,
+					BUFFER_SIZE - data->count,
+					&frames, &written);
+		data->encode_time += (get_microseconds() - encode_begin) * 1000;
 		if (encoded <= 0) {
 			ERR("Encoding error %d", encoded);
 			goto done;
 		}
-		VDBG("sbc_encode returned %d, codesize: %d, written: %d\n",
-			encoded, codesize, written);
+		VDBG("sbc_encode_frames returned %d, codesize: %d, "
+			"frames: %zu, written: %zu\n",
+			encoded, codesize, frames, written);
 
 		src += encoded;
 		data->count += written;
-		data->frame_count++;
+		data->frame_count += frames;
 		data->samples += encoded;
+		data->encoded_frames += frames;
+		data->stats.encode_ns = data->encode_time /
+						data->encoded_frames;
 		data->nsamples += encoded;
 
 		/* No space left for another frame then send */
-		if ((data->count + written >= data->link_mtu) ||
-				(data->count + written >= BUFFER_SIZE)) {
-			VDBG("sending packet %d, count %d, link_mtu %u",
+		if ((data->count + frame_length >= data->link_mtu) ||
+				(data->count + frame_length >= BUFFER_SIZE)) {
+			VDBG("queueing packet %d, count %d, link_mtu %u",
 					data->seq_num, data->count,
 					data->link_mtu);
-			err = avdtp_write(data);
+			err = avdtp_queue_packet(data);
 			if (err < 0)
 				return err;
 		}
@@ -1240,6 +2170,11 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 		ERR("%ld bytes left at end of a2dp_write\n", frames_left);
 
 done:
+	if (data->stream_error == EPIPE) {
+		/* the sink went away, force reinit on the next write */
+		bluetooth_close(data);
+	}
+
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
 	print_time("a2dp_write total", begin, end);
@@ -1258,6 +2193,89 @@ int a2dp_stop(a2dpData d)
 	return 0;
 }
 
+int a2dp_set_thread_policy(const char *name)
+{
+	char value[PROPERTY_VALUE_MAX];
+	struct thread_policy policy;
+	int err;
+
+	if (property_get(A2DP_THREAD_POLICY_PROPERTY, value, NULL) <= 0)
+		return 0;
+
+	if (thread_policy_parse(&policy, value) < 0) {
+		ERR("Invalid %s: %s", A2DP_THREAD_POLICY_PROPERTY, value);
+		return -EINVAL;
+	}
+
+	err = thread_policy_apply(&policy);
+	if (err < 0)
+		ERR("%s: thread policy %s not fully applied: %s (%d)", name,
+			thread_policy_name(&policy), strerror(-err), -err);
+	else
+		DBG("%s: thread policy %s", name, thread_policy_name(&policy));
+
+	return err;
+}
+
+int a2dp_get_stats(a2dpData d, struct a2dp_stats *stats)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+
+	if (!data || !stats)
+		return -EINVAL;
+
+	memcpy(stats, &data->stats, sizeof(*stats));
+
+	if (data->stats_start) {
+		uint64_t elapsed = get_microseconds() - data->stats_start;
+
+		if (elapsed > 0)
+			stats->byte_rate = data->stats.bytes * 1000000ULL /
+								elapsed;
+	}
+
+	return 0;
+}
+
+int a2dp_get_latency(a2dpData d, unsigned int *local, unsigned int *sink)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	unsigned long long delay;
+	size_t frame_length;
+	int i;
+
+	if (!data || !local || !sink)
+		return -EINVAL;
+
+	pthread_mutex_lock(&data->packet_mutex);
+
+	/* packets still queued, including the one being sent */
+	delay = 0;
+	for (i = 0; i < data->packets; i++)
+		delay += data->packet_duration[(data->packet_tail + i) %
+							PACKET_RING_COUNT];
+
+	/* frames encoded into the packet being filled */
+	delay += (unsigned long long) data->frame_duration *
+							data->frame_count;
+
+	/* the stream socket queue as of the last send, in frames */
+	if (data->format == A2DP_FORMAT_MPEG12)
+		frame_length = data->mpeg_frame_length;
+	else
+		frame_length = sbc_get_frame_length(&data->sbc);
+	if (data->stats.queued > 0 && frame_length > 0)
+		delay += (unsigned long long) data->stats.queued *
+					data->frame_duration / frame_length;
+
+	pthread_mutex_unlock(&data->packet_mutex);
+
+	*local = delay;
+	*sink = data->delay_report * 100;
+
+	return 0;
+}
+
 void a2dp_cleanup(a2dpData d)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
@@ -28,10 +28,53 @@ extern "C" {
 
 typedef void* a2dpData;
 
+#define A2DP_SEND_LATENCY_BUCKETS	8
+
+/* Pacing statistics since the stream was last started, times are in
+ * microseconds */
+struct a2dp_stats {
+	unsigned int packets;		/* packets sent */
+	unsigned int late;		/* packets sent over one packet late */
+	unsigned int early;		/* packets sent early to refill the socket */
+	unsigned int resyncs;		/* schedule resets after falling behind */
+	unsigned int max_jitter;	/* largest lateness of a packet */
+	unsigned long long total_jitter; /* sum of the lateness of all packets */
+	int queued;			/* bytes pending in the socket, -1 if unknown */
+	unsigned int bitpool;		/* current bitpool */
+	unsigned int bitpool_changes;	/* bitpool adaptations */
+	unsigned int poll_timeouts;	/* waits for the socket that timed out */
+	unsigned long long bytes;	/* bytes sent, headers included */
+	unsigned int byte_rate;		/* average bytes sent per second */
+	unsigned int encode_ns;		/* average encoding time per frame */
+	/* time spent in send(), bucket i counts calls taking less than
+	 * 2^i milliseconds and the last bucket all longer ones */
+	unsigned int send_latency[A2DP_SEND_LATENCY_BUCKETS];
+};
+
+/* Formats of the data passed to a2dp_write(): 16 bit native endian PCM,
+ * which is encoded to SBC, or MPEG-1/2 layer III frames, which are sent as
+ * they are to sinks supporting them */
+#define A2DP_FORMAT_PCM		0
+#define A2DP_FORMAT_MPEG12	1
+
 int a2dp_init(int rate, int channels, a2dpData* dataPtr);
+int a2dp_init_format(int rate, int channels, int format, a2dpData* dataPtr);
 void a2dp_set_sink(a2dpData data, const char* address);
 int a2dp_write(a2dpData data, const void* buffer, int count);
 int a2dp_stop(a2dpData data);
+int a2dp_get_stats(a2dpData data, struct a2dp_stats *stats);
+
+/* Applies the scheduling policy described by the A2DP_THREAD_POLICY_PROPERTY
+ * system property (see thread-policy.h for its syntax) to the calling
+ * thread. Used for the threads of this library and for the threads that
+ * call a2dp_write(); name is only used in log messages */
+#define A2DP_THREAD_POLICY_PROPERTY	"bluetooth.a2dp.thread_policy"
+int a2dp_set_thread_policy(const char *name);
+
+/* Returns in microseconds how long audio passed to a2dp_write() is held
+ * locally, in encoded packets and the stream socket, and the delay the sink
+ * reported for its own buffering and rendering, or 0 if it reports none */
+int a2dp_get_latency(a2dpData data, unsigned int *local, unsigned int *sink);
 void a2dp_cleanup(a2dpData data);
 
 #ifdef __cplusplus
@@ -190,5 +190,6 @@ static void audio_exit(void)
 	dbus_connection_unref(connection);
 }
 
-BLUETOOTH_PLUGIN_DEFINE(audio, VERSION,
-			BLUETOOTH_PLUGIN_PRIORITY_DEFAULT, audio_init, audio_exit)
+BLUETOOTH_PLUGIN_DEFINE_TRIGGER(audio, VERSION,
+			BLUETOOTH_PLUGIN_PRIORITY_DEFAULT,
+			BLUETOOTH_PLUGIN_TRIGGER_ADAPTER, audio_init, audio_exit)
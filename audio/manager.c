@@ -377,7 +377,10 @@ static sdp_record_t *hfp_ag_record(uint8_t ch, uint32_t feat)
 	sdp_set_service_classes(record, svclass_id);
 
 	sdp_uuid16_create(&profile.uuid, HANDSFREE_PROFILE_ID);
-	profile.version = 0x0105;
+	if (feat & AG_FEATURE_CODEC_NEGOTIATION)
+		profile.version = 0x0106;
+	else
+		profile.version = 0x0105;
 	pfseq = sdp_list_append(0, &profile);
 	sdp_set_profile_descs(record, pfseq);
 
@@ -392,6 +395,9 @@ static sdp_record_t *hfp_ag_record(uint8_t ch, uint32_t feat)
 	apseq = sdp_list_append(apseq, proto[1]);
 
 	sdpfeat = (uint16_t) feat & 0xF;
+	/* The SDP record has its own bit for wide band speech */
+	if (feat & AG_FEATURE_CODEC_NEGOTIATION)
+		sdpfeat |= 0x0020;
 	features = sdp_data_alloc(SDP_UINT16, &sdpfeat);
 	sdp_attr_add(record, SDP_ATTR_SUPPORTED_FEATURES, features);
 
@@ -805,6 +811,22 @@ static void audio_remove(struct btd_device *device)
 
 }
 
+static int audio_reconnect(struct btd_device *device)
+{
+	struct audio_device *dev;
+
+	dev = manager_find_device(device_get_path(device), NULL, NULL, NULL,
+									FALSE);
+	if (!dev)
+		return -ENODEV;
+
+	/* Only the roles this side initiates, the rest is up to the device */
+	if (!dev->headset && !dev->sink)
+		return -ENOTSUP;
+
+	return audio_device_connect(dev);
+}
+
 static struct audio_adapter *audio_adapter_ref(struct audio_adapter *adp)
 {
 	adp->ref++;
@@ -1106,6 +1128,7 @@ static struct btd_device_driver audio_driver = {
 			AVRCP_TARGET_UUID, AVRCP_REMOTE_UUID),
 	.probe	= audio_probe,
 	.remove	= audio_remove,
+	.reconnect = audio_reconnect,
 };
 
 static struct btd_adapter_driver headset_server_driver = {
@@ -52,6 +52,7 @@
 #define MEDIA_ENDPOINT_INTERFACE "org.bluez.MediaEndpoint"
 
 #define REQUEST_TIMEOUT (3 * 1000)		/* 3 seconds */
+#define CACHE_MAX_ENTRIES 8
 
 struct media_adapter {
 	bdaddr_t		src;		/* Adapter address */
@@ -63,10 +64,20 @@ struct media_adapter {
 struct endpoint_request {
 	DBusMessage		*msg;
 	DBusPendingCall		*call;
+	guint			idle;		/* Cached reply source */
+	uint8_t			*capabilities;	/* Remote capabilities */
+	size_t			length;		/* Remote capabilities size */
 	media_endpoint_cb_t	cb;
 	void			*user_data;
 };
 
+struct endpoint_cache {
+	uint8_t			*capabilities;	/* Remote capabilities */
+	size_t			length;		/* Remote capabilities size */
+	uint8_t			*configuration;	/* Selected configuration */
+	int			size;		/* Configuration size */
+};
+
 struct media_endpoint {
 	struct a2dp_sep		*sep;
 	char			*sender;	/* Endpoint DBus bus id */
@@ -75,6 +86,8 @@ struct media_endpoint {
 	uint8_t			codec;		/* Endpoint codec */
 	uint8_t			*capabilities;	/* Endpoint property capabilities */
 	size_t			size;		/* Endpoint capabilities size */
+	gboolean		cache_config;	/* Cache SelectConfiguration */
+	GSList			*cache;		/* Selected configurations */
 	guint			hs_watch;
 	guint			watch;
 	struct endpoint_request *request;
@@ -89,10 +102,70 @@ static void endpoint_request_free(struct endpoint_request *request)
 	if (request->call)
 		dbus_pending_call_unref(request->call);
 
-	dbus_message_unref(request->msg);
+	if (request->msg)
+		dbus_message_unref(request->msg);
+
+	g_free(request->capabilities);
 	g_free(request);
 }
 
+static void endpoint_cache_free(struct endpoint_cache *entry)
+{
+	g_free(entry->capabilities);
+	g_free(entry->configuration);
+	g_free(entry);
+}
+
+static struct endpoint_cache *endpoint_cache_find(
+					struct media_endpoint *endpoint,
+					const uint8_t *capabilities,
+					size_t length)
+{
+	GSList *l;
+
+	for (l = endpoint->cache; l; l = l->next) {
+		struct endpoint_cache *entry = l->data;
+
+		if (entry->length != length)
+			continue;
+
+		if (memcmp(entry->capabilities, capabilities, length) != 0)
+			continue;
+
+		return entry;
+	}
+
+	return NULL;
+}
+
+static void endpoint_cache_add(struct media_endpoint *endpoint,
+					const uint8_t *capabilities,
+					size_t length,
+					const uint8_t *configuration,
+					int size)
+{
+	struct endpoint_cache *entry;
+	GSList *last;
+
+	if (endpoint_cache_find(endpoint, capabilities, length) != NULL)
+		return;
+
+	/* Drop the oldest entry, new ones are prepended */
+	if (g_slist_length(endpoint->cache) >= CACHE_MAX_ENTRIES) {
+		last = g_slist_last(endpoint->cache);
+		endpoint_cache_free(last->data);
+		endpoint->cache = g_slist_delete_link(endpoint->cache, last);
+	}
+
+	entry = g_new0(struct endpoint_cache, 1);
+	entry->capabilities = g_memdup(capabilities, length);
+	entry->length = length;
+	entry->configuration = g_memdup(configuration, size);
+	entry->size = size;
+
+	endpoint->cache = g_slist_prepend(endpoint->cache, entry);
+}
+
 static void media_endpoint_cancel(struct media_endpoint *endpoint)
 {
 	struct endpoint_request *request = endpoint->request;
@@ -100,6 +173,9 @@ static void media_endpoint_cancel(struct media_endpoint *endpoint)
 	if (request->call)
 		dbus_pending_call_cancel(request->call);
 
+	if (request->idle)
+		g_source_remove(request->idle);
+
 	endpoint_request_free(request);
 	endpoint->request = NULL;
 }
@@ -129,6 +205,8 @@ static void media_endpoint_remove(struct media_endpoint *endpoint)
 		media_transport_destroy(endpoint->transport);
 
 	g_dbus_remove_watch(adapter->conn, endpoint->watch);
+	g_slist_foreach(endpoint->cache, (GFunc) endpoint_cache_free, NULL);
+	g_slist_free(endpoint->cache);
 	g_free(endpoint->capabilities);
 	g_free(endpoint->sender);
 	g_free(endpoint->path);
@@ -186,6 +264,7 @@ static struct media_endpoint *media_endpoint_create(struct media_adapter *adapte
 						const char *path,
 						const char *uuid,
 						gboolean delay_reporting,
+						gboolean cache_config,
 						uint8_t codec,
 						uint8_t *capabilities,
 						int size,
@@ -198,6 +277,7 @@ static struct media_endpoint *media_endpoint_create(struct media_adapter *adapte
 	endpoint->path = g_strdup(path);
 	endpoint->uuid = g_strdup(uuid);
 	endpoint->codec = codec;
+	endpoint->cache_config = cache_config;
 
 	if (size > 0) {
 		endpoint->capabilities = g_new(uint8_t, size);
@@ -285,7 +365,8 @@ const char *media_endpoint_get_sender(struct media_endpoint *endpoint)
 }
 
 static int parse_properties(DBusMessageIter *props, const char **uuid,
-				gboolean *delay_reporting, uint8_t *codec,
+				gboolean *delay_reporting,
+				gboolean *cache_config, uint8_t *codec,
 				uint8_t **capabilities, int *size)
 {
 	gboolean has_uuid = FALSE;
@@ -317,6 +398,10 @@ static int parse_properties(DBusMessageIter *props, const char **uuid,
 			if (var != DBUS_TYPE_BOOLEAN)
 				return -EINVAL;
 			dbus_message_iter_get_basic(&value, delay_reporting);
+		} else if (strcasecmp(key, "CacheConfiguration") == 0) {
+			if (var != DBUS_TYPE_BOOLEAN)
+				return -EINVAL;
+			dbus_message_iter_get_basic(&value, cache_config);
 		} else if (strcasecmp(key, "Capabilities") == 0) {
 			DBusMessageIter array;
 
@@ -341,6 +426,7 @@ static DBusMessage *register_endpoint(DBusConnection *conn, DBusMessage *msg,
 	DBusMessageIter args, props;
 	const char *sender, *path, *uuid;
 	gboolean delay_reporting = FALSE;
+	gboolean cache_config = FALSE;
 	uint8_t codec;
 	uint8_t *capabilities;
 	int size = 0;
@@ -360,12 +446,13 @@ static DBusMessage *register_endpoint(DBusConnection *conn, DBusMessage *msg,
 	if (dbus_message_iter_get_arg_type(&props) != DBUS_TYPE_DICT_ENTRY)
 		return btd_error_invalid_args(msg);
 
-	if (parse_properties(&props, &uuid, &delay_reporting, &codec,
-						&capabilities, &size) < 0)
+	if (parse_properties(&props, &uuid, &delay_reporting, &cache_config,
+					&codec, &capabilities, &size) < 0)
 		return btd_error_invalid_args(msg);
 
 	if (media_endpoint_create(adapter, sender, path, uuid, delay_reporting,
-				codec, capabilities, size, &err) == FALSE) {
+				cache_config, codec, capabilities, size,
+				&err) == FALSE) {
 		if (err == -EPROTONOSUPPORT)
 			return btd_error_not_supported(msg);
 		else
@@ -513,6 +600,11 @@ static void endpoint_reply(DBusPendingCall *call, void *user_data)
 
 		dbus_message_iter_get_fixed_array(&array, &configuration, &size);
 
+		if (request->capabilities != NULL && size > 0)
+			endpoint_cache_add(endpoint, request->capabilities,
+						request->length, configuration,
+						size);
+
 		ret = configuration;
 		goto done;
 	} else  if (!dbus_message_get_args(reply, &err, DBUS_TYPE_INVALID)) {
@@ -609,12 +701,35 @@ gboolean media_endpoint_set_configuration(struct media_endpoint *endpoint,
 	return media_endpoint_async_call(conn, msg, endpoint, cb, user_data);
 }
 
+static gboolean cached_reply(gpointer user_data)
+{
+	struct media_endpoint *endpoint = user_data;
+	struct endpoint_request *request = endpoint->request;
+	struct endpoint_cache *entry;
+
+	request->idle = 0;
+
+	entry = endpoint_cache_find(endpoint, request->capabilities,
+							request->length);
+
+	if (request->cb)
+		request->cb(endpoint, entry ? entry->configuration : NULL,
+					entry ? entry->size : -1,
+					request->user_data);
+
+	endpoint_request_free(request);
+	endpoint->request = NULL;
+
+	return FALSE;
+}
+
 gboolean media_endpoint_select_configuration(struct media_endpoint *endpoint,
 						uint8_t *capabilities,
 						size_t length,
 						media_endpoint_cb_t cb,
 						void *user_data)
 {
+	struct endpoint_request *request;
 	DBusConnection *conn;
 	DBusMessage *msg;
 
@@ -623,6 +738,23 @@ gboolean media_endpoint_select_configuration(struct media_endpoint *endpoint,
 
 	conn = endpoint->adapter->conn;
 
+	/* Reply from the cache asynchronously, as the endpoint would */
+	if (endpoint->cache_config &&
+			endpoint_cache_find(endpoint, capabilities, length)) {
+		DBG("Using cached configuration: name = %s path = %s",
+					endpoint->sender, endpoint->path);
+
+		request = g_new0(struct endpoint_request, 1);
+		request->capabilities = g_memdup(capabilities, length);
+		request->length = length;
+		request->cb = cb;
+		request->user_data = user_data;
+		request->idle = g_idle_add(cached_reply, endpoint);
+		endpoint->request = request;
+
+		return TRUE;
+	}
+
 	msg = dbus_message_new_method_call(endpoint->sender, endpoint->path,
 						MEDIA_ENDPOINT_INTERFACE,
 						"SelectConfiguration");
@@ -635,7 +767,17 @@ gboolean media_endpoint_select_configuration(struct media_endpoint *endpoint,
 					&capabilities, length,
 					DBUS_TYPE_INVALID);
 
-	return media_endpoint_async_call(conn, msg, endpoint, cb, user_data);
+	if (media_endpoint_async_call(conn, msg, endpoint, cb,
+						user_data) == FALSE)
+		return FALSE;
+
+	if (endpoint->cache_config) {
+		request = endpoint->request;
+		request->capabilities = g_memdup(capabilities, length);
+		request->length = length;
+	}
+
+	return TRUE;
 }
 
 void media_endpoint_clear_configuration(struct media_endpoint *endpoint)
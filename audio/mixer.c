@@ -0,0 +1,753 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "avdtp.h"
+#include "a2dp-codecs.h"
+#include "ipc.h"
+#include "rtp.h"
+#include "sbc.h"
+#include "mixer.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#define MAX_FRAMES_PER_PACKET 15
+
+/* Audio sent in one go when the timer fires late, the rest is dropped to
+ * keep the latency bounded */
+#define MAX_CATCHUP_MSEC 40
+
+/* A mixer sums its rings into one PCM stream and clocks it. Each distinct
+ * SBC configuration among the streams fed from it gets an encoder, which
+ * hands every frame to the outputs, one per stream, that build and send
+ * packets for the MTU of their link. */
+struct mixer {
+	uint32_t group;
+	unsigned int rate;
+	unsigned int channels;
+	size_t codesize;
+	unsigned int bytes_per_sec;
+	uint64_t start;			/* Clock reference in usec */
+	uint64_t frames;		/* Frames mixed since start */
+	int16_t *mix;
+	GSList *rings;
+	GSList *encoders;
+	guint timer;
+	guint interval;
+};
+
+struct pcm_ring {
+	int refcount;
+	int fd;
+	struct bt_pcm_ring *shm;
+	size_t len;
+};
+
+struct mixer_encoder {
+	struct mixer *mixer;
+	a2dp_sbc_t config;
+	sbc_t sbc;
+	size_t frame_length;
+	uint8_t *frame;
+	GSList *outputs;
+};
+
+struct mixer_ring {
+	struct mixer_encoder *encoder;
+	struct pcm_ring *ring;
+	struct avdtp *session;
+	struct avdtp_stream *stream;
+	unsigned int cb_id;
+	gboolean streaming;
+	int fd;
+	unsigned int frames_per_packet;
+	unsigned int packet_frames;	/* Frames in the packet being built */
+	size_t packet_len;
+	uint8_t *packet;
+	uint16_t seq_num;
+	uint32_t timestamp;
+	unsigned int dropped;
+};
+
+static GSList *mixers = NULL;
+
+static uint64_t get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int memfd_new(const char *name)
+{
+#ifdef __NR_memfd_create
+	int fd;
+
+	fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+#else
+	return -ENOSYS;
+#endif
+}
+
+static struct pcm_ring *pcm_ring_new(void)
+{
+	struct pcm_ring *ring;
+	size_t len;
+	void *shm;
+	int fd, err;
+
+	fd = memfd_new("bluez-pcm");
+	if (fd < 0) {
+		error("memfd_create: %s (%d)", strerror(-fd), -fd);
+		return NULL;
+	}
+
+	len = sizeof(struct bt_pcm_ring) + BT_PCM_RING_SIZE;
+	if (ftruncate(fd, len) < 0)
+		goto failed;
+
+	shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto failed;
+
+	ring = g_new0(struct pcm_ring, 1);
+	ring->refcount = 1;
+	ring->fd = fd;
+	ring->shm = shm;
+	ring->len = len;
+	ring->shm->size = BT_PCM_RING_SIZE;
+
+	return ring;
+
+failed:
+	err = errno;
+	error("Unable to set up PCM ring: %s (%d)", strerror(err), err);
+	close(fd);
+	return NULL;
+}
+
+static void pcm_ring_unref(struct pcm_ring *ring)
+{
+	if (--ring->refcount > 0)
+		return;
+
+	DBG("ring %p underruns %u", ring, ring->shm->underruns);
+
+	munmap(ring->shm, ring->len);
+	close(ring->fd);
+	g_free(ring);
+}
+
+/* Adds up to one codesize worth of samples from the ring into mix */
+static gboolean pcm_ring_mix(struct pcm_ring *ring, int16_t *mix,
+							size_t codesize)
+{
+	struct bt_pcm_ring *shm = ring->shm;
+	uint32_t read_idx, avail, i;
+
+	read_idx = shm->read_idx;
+	__sync_synchronize();
+	avail = shm->write_idx - read_idx;
+
+	if (avail == 0)
+		return FALSE;
+
+	if (avail > shm->size) {
+		/* Client overran the daemon, skip to the oldest data left */
+		read_idx = shm->write_idx - shm->size;
+		avail = shm->size;
+	}
+
+	if (avail < codesize)
+		shm->underruns++;
+	else
+		avail = codesize;
+
+	for (i = 0; i + 1 < avail; i += sizeof(int16_t)) {
+		int16_t *sample = (void *) &shm->data[(read_idx + i) %
+								shm->size];
+		int sum = mix[i / 2] + *sample;
+
+		mix[i / 2] = CLAMP(sum, G_MININT16, G_MAXINT16);
+	}
+
+	__sync_synchronize();
+	shm->read_idx = read_idx + avail;
+
+	return TRUE;
+}
+
+static void output_reset(struct mixer_ring *output)
+{
+	output->packet_frames = 0;
+	output->packet_len = sizeof(struct rtp_header) +
+						sizeof(struct rtp_payload);
+}
+
+static void output_flush(struct mixer_ring *output)
+{
+	struct mixer_encoder *encoder = output->encoder;
+	struct rtp_header *header = (void *) output->packet;
+	struct rtp_payload *payload = (void *) (header + 1);
+	unsigned int samples;
+
+	if (output->packet_frames == 0)
+		return;
+
+	memset(header, 0, sizeof(*header) + sizeof(*payload));
+	header->v = 2;
+	header->pt = 1;
+	header->sequence_number = htons(output->seq_num++);
+	header->timestamp = htonl(output->timestamp);
+	header->ssrc = htonl(1);
+	payload->frame_count = output->packet_frames;
+
+	samples = encoder->mixer->codesize / encoder->mixer->channels /
+							sizeof(int16_t);
+	output->timestamp += output->packet_frames * samples;
+
+	/* Each sink has its own socket queue, a slow one only loses its own
+	 * packets */
+	if (send(output->fd, output->packet, output->packet_len,
+						MSG_DONTWAIT) < 0) {
+		if (errno == EAGAIN)
+			output->dropped++;
+		else
+			error("send: %s (%d)", strerror(errno), errno);
+	}
+
+	output_reset(output);
+}
+
+static void output_queue(struct mixer_ring *output, const uint8_t *frame,
+								size_t len)
+{
+	memcpy(output->packet + output->packet_len, frame, len);
+	output->packet_len += len;
+
+	if (++output->packet_frames == output->frames_per_packet)
+		output_flush(output);
+}
+
+static gboolean encoder_streaming(struct mixer_encoder *encoder)
+{
+	GSList *l;
+
+	for (l = encoder->outputs; l; l = l->next) {
+		struct mixer_ring *output = l->data;
+
+		if (output->streaming)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void encoder_encode(struct mixer_encoder *encoder, int16_t *mix)
+{
+	struct mixer *mixer = encoder->mixer;
+	ssize_t written;
+	GSList *l;
+
+	if (!encoder_streaming(encoder))
+		return;
+
+	/* Encoded once, whatever the number of sinks using it */
+	if (sbc_encode(&encoder->sbc, mix, mixer->codesize, encoder->frame,
+				encoder->frame_length, &written) < 0)
+		return;
+
+	for (l = encoder->outputs; l; l = l->next) {
+		struct mixer_ring *output = l->data;
+
+		if (output->streaming)
+			output_queue(output, encoder->frame, written);
+	}
+}
+
+static void mixer_flush(struct mixer *mixer)
+{
+	GSList *l, *o;
+
+	for (l = mixer->encoders; l; l = l->next) {
+		struct mixer_encoder *encoder = l->data;
+
+		for (o = encoder->outputs; o; o = o->next)
+			output_flush(o->data);
+	}
+}
+
+static gboolean mixer_mix(struct mixer *mixer)
+{
+	gboolean data = FALSE;
+	GSList *l;
+
+	memset(mixer->mix, 0, mixer->codesize);
+
+	for (l = mixer->rings; l; l = l->next)
+		data |= pcm_ring_mix(l->data, mixer->mix, mixer->codesize);
+
+	return data;
+}
+
+static gboolean mixer_timeout(gpointer user_data)
+{
+	struct mixer *mixer = user_data;
+	uint64_t now, due, catchup;
+	GSList *l;
+
+	now = get_usec();
+	due = (now - mixer->start) * mixer->bytes_per_sec / 1000000 /
+							mixer->codesize;
+
+	catchup = (uint64_t) mixer->bytes_per_sec * MAX_CATCHUP_MSEC / 1000 /
+							mixer->codesize;
+	if (due > mixer->frames + catchup)
+		mixer->frames = due - catchup;
+
+	while (mixer->frames < due) {
+		if (!mixer_mix(mixer)) {
+			/* Nothing to play, restart the clock on new data */
+			mixer_flush(mixer);
+			mixer->start = now;
+			mixer->frames = 0;
+			break;
+		}
+
+		for (l = mixer->encoders; l; l = l->next)
+			encoder_encode(l->data, mixer->mix);
+
+		mixer->frames++;
+	}
+
+	return TRUE;
+}
+
+static void mixer_update_timer(struct mixer *mixer, unsigned int frames)
+{
+	guint interval;
+
+	/* Tick twice per packet so that lateness stays under half of one */
+	interval = frames * mixer->codesize * 1000 / mixer->bytes_per_sec / 2;
+	interval = MAX(interval, 1);
+
+	if (mixer->timer && interval >= mixer->interval)
+		return;
+
+	if (mixer->timer)
+		g_source_remove(mixer->timer);
+
+	mixer->interval = interval;
+	mixer->start = get_usec();
+	mixer->frames = 0;
+	mixer->timer = g_timeout_add(interval, mixer_timeout, mixer);
+}
+
+static gboolean sbc_setup(sbc_t *sbc, const a2dp_sbc_t *sbc_cap,
+				unsigned int *rate, unsigned int *channels)
+{
+	if (sbc_init(sbc, SBC_FLAG_ENCODER_ONLY) < 0)
+		return FALSE;
+
+	switch (sbc_cap->frequency) {
+	case SBC_SAMPLING_FREQ_16000:
+		sbc->frequency = SBC_FREQ_16000;
+		*rate = 16000;
+		break;
+	case SBC_SAMPLING_FREQ_32000:
+		sbc->frequency = SBC_FREQ_32000;
+		*rate = 32000;
+		break;
+	case SBC_SAMPLING_FREQ_44100:
+		sbc->frequency = SBC_FREQ_44100;
+		*rate = 44100;
+		break;
+	case SBC_SAMPLING_FREQ_48000:
+		sbc->frequency = SBC_FREQ_48000;
+		*rate = 48000;
+		break;
+	default:
+		goto failed;
+	}
+
+	switch (sbc_cap->channel_mode) {
+	case SBC_CHANNEL_MODE_MONO:
+		sbc->mode = SBC_MODE_MONO;
+		break;
+	case SBC_CHANNEL_MODE_DUAL_CHANNEL:
+		sbc->mode = SBC_MODE_DUAL_CHANNEL;
+		break;
+	case SBC_CHANNEL_MODE_STEREO:
+		sbc->mode = SBC_MODE_STEREO;
+		break;
+	case SBC_CHANNEL_MODE_JOINT_STEREO:
+		sbc->mode = SBC_MODE_JOINT_STEREO;
+		break;
+	default:
+		goto failed;
+	}
+
+	switch (sbc_cap->block_length) {
+	case SBC_BLOCK_LENGTH_4:
+		sbc->blocks = SBC_BLK_4;
+		break;
+	case SBC_BLOCK_LENGTH_8:
+		sbc->blocks = SBC_BLK_8;
+		break;
+	case SBC_BLOCK_LENGTH_12:
+		sbc->blocks = SBC_BLK_12;
+		break;
+	case SBC_BLOCK_LENGTH_16:
+		sbc->blocks = SBC_BLK_16;
+		break;
+	default:
+		goto failed;
+	}
+
+	sbc->subbands = sbc_cap->subbands == SBC_SUBBANDS_4 ?
+							SBC_SB_4 : SBC_SB_8;
+	sbc->allocation = sbc_cap->allocation_method ==
+				SBC_ALLOCATION_LOUDNESS ?
+				SBC_AM_LOUDNESS : SBC_AM_SNR;
+	sbc->bitpool = sbc_cap->max_bitpool;
+
+	*channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
+
+	return TRUE;
+
+failed:
+	sbc_finish(sbc);
+	return FALSE;
+}
+
+static struct mixer_encoder *encoder_new(const a2dp_sbc_t *config,
+				unsigned int *rate, unsigned int *channels)
+{
+	struct mixer_encoder *encoder;
+
+	encoder = g_new0(struct mixer_encoder, 1);
+
+	if (!sbc_setup(&encoder->sbc, config, rate, channels)) {
+		g_free(encoder);
+		return NULL;
+	}
+
+	encoder->config = *config;
+	encoder->frame_length = sbc_get_frame_length(&encoder->sbc);
+	encoder->frame = g_malloc(encoder->frame_length);
+
+	return encoder;
+}
+
+static void encoder_free(struct mixer_encoder *encoder)
+{
+	sbc_finish(&encoder->sbc);
+	g_free(encoder->frame);
+	g_free(encoder);
+}
+
+static void mixer_free(struct mixer *mixer)
+{
+	mixers = g_slist_remove(mixers, mixer);
+
+	if (mixer->timer)
+		g_source_remove(mixer->timer);
+
+	g_slist_foreach(mixer->rings, (GFunc) pcm_ring_unref, NULL);
+	g_slist_free(mixer->rings);
+	g_free(mixer->mix);
+	g_free(mixer);
+}
+
+/* Finds the encoder producing the configuration, or creates it if the
+ * PCM format of the mixer is suitable for it */
+static struct mixer_encoder *mixer_get_encoder(struct mixer *mixer,
+						const a2dp_sbc_t *config)
+{
+	struct mixer_encoder *encoder;
+	unsigned int rate, channels;
+	GSList *l;
+
+	for (l = mixer->encoders; l; l = l->next) {
+		encoder = l->data;
+
+		if (memcmp(&encoder->config, config, sizeof(*config)) == 0)
+			return encoder;
+	}
+
+	encoder = encoder_new(config, &rate, &channels);
+	if (encoder == NULL)
+		return NULL;
+
+	if (mixer->codesize == 0) {
+		mixer->rate = rate;
+		mixer->channels = channels;
+		mixer->codesize = sbc_get_codesize(&encoder->sbc);
+		mixer->bytes_per_sec = rate * channels * sizeof(int16_t);
+		mixer->mix = g_malloc(mixer->codesize);
+	} else if (rate != mixer->rate || channels != mixer->channels ||
+			sbc_get_codesize(&encoder->sbc) != mixer->codesize) {
+		/* Grouping keeps every encoder in step on the same PCM */
+		error("SBC configuration does not match the group");
+		encoder_free(encoder);
+		return NULL;
+	}
+
+	encoder->mixer = mixer;
+	mixer->encoders = g_slist_append(mixer->encoders, encoder);
+
+	return encoder;
+}
+
+static void output_state_changed(struct avdtp_stream *stream,
+					avdtp_state_t old_state,
+					avdtp_state_t new_state,
+					struct avdtp_error *err,
+					void *user_data)
+{
+	struct mixer_ring *output = user_data;
+
+	if (output->streaming)
+		output_flush(output);
+
+	output->streaming = new_state == AVDTP_STATE_STREAMING;
+
+	if (new_state != AVDTP_STATE_IDLE)
+		return;
+
+	/* The stream is gone, the ring stays until its owner frees it */
+	output->cb_id = 0;
+	output->stream = NULL;
+	output->fd = -1;
+}
+
+static struct mixer *find_mixer(struct avdtp_stream *stream, uint32_t group)
+{
+	GSList *l, *e, *o;
+
+	for (l = mixers; l; l = l->next) {
+		struct mixer *mixer = l->data;
+
+		if (group && mixer->group == group)
+			return mixer;
+
+		for (e = mixer->encoders; e; e = e->next) {
+			struct mixer_encoder *encoder = e->data;
+
+			for (o = encoder->outputs; o; o = o->next) {
+				struct mixer_ring *output = o->data;
+
+				if (output->stream == stream)
+					return mixer;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+struct mixer_ring *mixer_ring_new(struct avdtp *session,
+					struct avdtp_stream *stream,
+					uint32_t group, int *fd)
+{
+	struct avdtp_service_capability *cap;
+	struct avdtp_media_codec_capability *codec_cap;
+	struct mixer_encoder *encoder;
+	struct mixer_ring *output;
+	struct pcm_ring *ring = NULL;
+	struct mixer *mixer;
+	gboolean created = FALSE, new_ring = FALSE;
+	uint16_t omtu;
+	size_t header;
+	int stream_fd;
+
+	cap = avdtp_stream_get_codec(stream);
+	if (cap == NULL)
+		return NULL;
+
+	codec_cap = (void *) cap->data;
+	if (codec_cap->media_codec_type != A2DP_CODEC_SBC)
+		return NULL;
+
+	if (!avdtp_stream_get_transport(stream, &stream_fd, NULL, &omtu,
+									NULL))
+		return NULL;
+
+	mixer = find_mixer(stream, group);
+	if (mixer == NULL) {
+		mixer = g_new0(struct mixer, 1);
+		mixer->group = group;
+		mixers = g_slist_append(mixers, mixer);
+		created = TRUE;
+	}
+
+	encoder = mixer_get_encoder(mixer, (void *) codec_cap->data);
+	if (encoder == NULL)
+		goto failed;
+
+	header = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	if (omtu < header + encoder->frame_length) {
+		error("MTU %u too small for SBC frames of %zu bytes", omtu,
+							encoder->frame_length);
+		goto failed;
+	}
+
+	/* Joining a group shares its ring, otherwise the client gets a ring
+	 * of its own mixed with the others on the stream */
+	if (group && mixer->rings)
+		ring = mixer->rings->data;
+	else {
+		ring = pcm_ring_new();
+		if (ring == NULL)
+			goto failed;
+		new_ring = TRUE;
+		mixer->rings = g_slist_append(mixer->rings, ring);
+	}
+
+	*fd = dup(ring->fd);
+	if (*fd < 0) {
+		error("dup: %s (%d)", strerror(errno), errno);
+		goto failed;
+	}
+
+	/* One reference for the mixer, one per output using the ring */
+	ring->refcount++;
+
+	output = g_new0(struct mixer_ring, 1);
+	output->encoder = encoder;
+	output->ring = ring;
+	output->session = avdtp_ref(session);
+	output->stream = stream;
+	output->fd = stream_fd;
+	/* Rings are only handed out once the stream has been started */
+	output->streaming = TRUE;
+	output->frames_per_packet = MIN((omtu - header) /
+						encoder->frame_length,
+						MAX_FRAMES_PER_PACKET);
+	output->packet = g_malloc(header + output->frames_per_packet *
+						encoder->frame_length);
+	output_reset(output);
+	output->cb_id = avdtp_stream_add_cb(session, stream,
+					output_state_changed, output);
+
+	encoder->outputs = g_slist_append(encoder->outputs, output);
+
+	mixer_update_timer(mixer, output->frames_per_packet);
+
+	DBG("group %u encoders %u frame length %zu frames per packet %u",
+			group, g_slist_length(mixer->encoders),
+			encoder->frame_length, output->frames_per_packet);
+
+	return output;
+
+failed:
+	if (new_ring) {
+		mixer->rings = g_slist_remove(mixer->rings, ring);
+		pcm_ring_unref(ring);
+	}
+
+	if (encoder && encoder->outputs == NULL) {
+		mixer->encoders = g_slist_remove(mixer->encoders, encoder);
+		encoder_free(encoder);
+	}
+
+	if (created)
+		mixer_free(mixer);
+
+	return NULL;
+}
+
+void mixer_ring_free(struct mixer_ring *output)
+{
+	struct mixer_encoder *encoder = output->encoder;
+	struct mixer *mixer = encoder->mixer;
+	struct pcm_ring *ring = output->ring;
+	GSList *l, *o;
+
+	DBG("output %p dropped %u packets", output, output->dropped);
+
+	encoder->outputs = g_slist_remove(encoder->outputs, output);
+
+	if (output->cb_id)
+		avdtp_stream_remove_cb(output->session, output->stream,
+								output->cb_id);
+
+	avdtp_unref(output->session);
+	g_free(output->packet);
+	g_free(output);
+
+	if (encoder->outputs == NULL) {
+		mixer->encoders = g_slist_remove(mixer->encoders, encoder);
+		encoder_free(encoder);
+	}
+
+	if (mixer->encoders == NULL) {
+		mixer_free(mixer);
+		pcm_ring_unref(ring);
+		return;
+	}
+
+	/* Drop the ring from the mixer once no output references it */
+	for (l = mixer->encoders; l; l = l->next) {
+		struct mixer_encoder *e = l->data;
+
+		for (o = e->outputs; o; o = o->next) {
+			struct mixer_ring *other = o->data;
+
+			if (other->ring == ring) {
+				pcm_ring_unref(ring);
+				return;
+			}
+		}
+	}
+
+	mixer->rings = g_slist_remove(mixer->rings, ring);
+	pcm_ring_unref(ring);
+	pcm_ring_unref(ring);
+}
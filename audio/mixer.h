@@ -0,0 +1,34 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct mixer_ring;
+
+/* Feeds an SBC stream from a shared PCM ring, see struct bt_pcm_ring. With
+ * group 0 the ring is new and mixed with any other on the stream. Streams
+ * started with the same non-zero group share one ring, encoded once per
+ * distinct configuration. On success *fd is the memory to hand out to the
+ * client, owned by the caller. */
+struct mixer_ring *mixer_ring_new(struct avdtp *session,
+					struct avdtp_stream *stream,
+					uint32_t group, int *fd);
+void mixer_ring_free(struct mixer_ring *ring);
@@ -27,7 +27,9 @@
 #endif
 
 #include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
 #include <time.h>
 #include <sys/time.h>
@@ -43,13 +45,18 @@
 #include "ipc.h"
 #include "sbc.h"
 #include "rtp.h"
+#include "thread-policy.h"
 
 /* #define ENABLE_DEBUG */
 
-#define UINT_SECS_MAX (UINT_MAX / 1000000 - 1)
-
 #define MIN_PERIOD_TIME 1
 
+/* number of hw pointer updates per period, driven by a timerfd */
+#define HW_THREAD_TICKS 4
+
+/* packets the stream socket may hold in low latency mode */
+#define LOW_LATENCY_PACKETS 2
+
 #define BUFFER_SIZE 2048
 
 #ifdef ENABLE_DEBUG
@@ -78,6 +85,10 @@
 # define MAX(x, y) ((x) > (y) ? (x) : (y))
 #endif
 
+#ifndef SIOCOUTQ
+#define SIOCOUTQ TIOCOUTQ
+#endif
+
 #define MAX_BITPOOL 64
 #define MIN_BITPOOL 2
 
@@ -124,6 +135,9 @@ struct bluetooth_alsa_config {
 	uint8_t bitpool;		/* A2DP only */
 	int has_bitpool;
 	int autoconnect;
+	int low_latency;		/* small periods and socket queue */
+	struct thread_policy thread_policy;	/* for the hw thread */
+	int has_thread_policy;
 };
 
 struct bluetooth_data {
@@ -140,8 +154,16 @@ struct bluetooth_data {
 
 	pthread_t hw_thread;				/* Makes virtual hw pointer move */
 	int pipefd[2];					/* Inter thread communication */
+
+	/* Frames accepted by transfer and frames and bytes sent to the stream
+	 * socket since prepare, used to find the frames the socket still
+	 * holds */
+	volatile snd_pcm_uframes_t written_frames;
+	volatile snd_pcm_uframes_t sent_frames;
+	volatile unsigned long sent_bytes;
 	int stopped;
 	sig_atomic_t reset;				/* Request XRUN handling */
+	unsigned int missed_ticks;			/* hw thread ticks overslept */
 };
 
 static int audioservice_send(int sk, const bt_audio_msg_header_t *msg);
@@ -162,14 +184,69 @@ static int bluetooth_stop(snd_pcm_ioplug_t *io)
 	return 0;
 }
 
+static void hw_thread_cleanup(void *arg)
+{
+	int *timer = arg;
+
+	if (*timer >= 0)
+		close(*timer);
+}
+
+/* Frames handed to the stream socket that it has not sent yet */
+static snd_pcm_uframes_t stream_queued_frames(struct bluetooth_data *data)
+{
+	unsigned long bytes = data->sent_bytes;
+	int queued;
+
+	if (bytes == 0 || ioctl(data->stream.fd, SIOCOUTQ, &queued) < 0 ||
+								queued <= 0)
+		return 0;
+
+	return (unsigned long long) queued * data->sent_frames / bytes;
+}
+
+static int hw_thread_timer(unsigned int tick_time)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (fd < 0)
+		return -errno;
+
+	its.it_interval.tv_sec = tick_time / 1000000;
+	its.it_interval.tv_nsec = (tick_time % 1000000) * 1000;
+	its.it_value = its.it_interval;
+
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
 static void *playback_hw_thread(void *param)
 {
 	struct bluetooth_data *data = param;
-	unsigned int prev_periods;
+	snd_pcm_uframes_t prev_pos, base_frames;
+	unsigned int prev_periods, tick_time;
 	double period_time;
 	struct timespec start;
-	struct pollfd fds[2];
-	int poll_timeout;
+	struct pollfd fds[3];
+	int poll_timeout, timer;
+
+	if (data->alsa_config.has_thread_policy) {
+		struct thread_policy *policy = &data->alsa_config.thread_policy;
+		int err;
+
+		err = thread_policy_apply(policy);
+		if (err < 0)
+			SNDERR("Thread policy %s not fully applied: %s (%d)",
+				thread_policy_name(policy), strerror(-err),
+									-err);
+	}
 
 	data->server.events = POLLIN;
 	/* note: only errors for data->stream.events */
@@ -177,17 +254,34 @@ static void *playback_hw_thread(void *param)
 	fds[0] = data->server;
 	fds[1] = data->stream;
 
+	prev_pos = 0;
 	prev_periods = 0;
+	base_frames = data->written_frames;
 	period_time = 1000000.0 * data->io.period_size / data->io.rate;
+
+	/* wake up several times per period so that the hw pointer follows
+	 * the stream closely, poll() timeouts are only the fallback */
+	tick_time = MAX(period_time / HW_THREAD_TICKS, MIN_PERIOD_TIME * 1000);
+	timer = hw_thread_timer(tick_time);
+	if (timer < 0)
+		DBG("timerfd not available: %s", strerror(-timer));
+
+	fds[2].fd = timer;
+	fds[2].events = POLLIN;
+
 	if (period_time > (int) (MIN_PERIOD_TIME * 1000))
 		poll_timeout = (int) (period_time / 1000.0f);
 	else
 		poll_timeout = MIN_PERIOD_TIME;
 
+	pthread_cleanup_push(hw_thread_cleanup, &timer);
+
 	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	while (1) {
-		unsigned int dtime, periods;
+		snd_pcm_uframes_t pos, drained;
+		unsigned long long dtime;
+		unsigned int periods;
 		struct timespec cur, delta;
 		int ret;
 
@@ -198,23 +292,39 @@ static void *playback_hw_thread(void *param)
 			DBG("Handle XRUN in hw-thread.");
 			data->reset = 0;
 			clock_gettime(CLOCK_MONOTONIC, &start);
+			prev_pos = 0;
 			prev_periods = 0;
+			base_frames = data->written_frames;
 		}
 
 		clock_gettime(CLOCK_MONOTONIC, &cur);
 
 		priv_timespecsub(&cur, &start, &delta);
 
-		dtime = delta.tv_sec * 1000000 + delta.tv_nsec / 1000;
-		periods = 1.0 * dtime / period_time;
+		dtime = delta.tv_sec * 1000000ULL + delta.tv_nsec / 1000;
+		pos = dtime * data->io.rate / 1000000;
+
+		/* never run ahead of what the socket has actually sent */
+		if (data->transport == BT_CAPABILITIES_TRANSPORT_A2DP) {
+			drained = data->written_frames - base_frames -
+						stream_queued_frames(data);
+			if ((snd_pcm_sframes_t) drained < 0)
+				drained = 0;
+			if (pos > drained)
+				pos = drained;
+		}
 
+		if (pos > prev_pos) {
+			data->hw_ptr += pos - prev_pos;
+			data->hw_ptr %= data->io.buffer_size;
+			prev_pos = pos;
+		}
+
+		periods = pos / data->io.period_size;
 		if (periods > prev_periods) {
 			char c = 'w';
 			int frags = periods - prev_periods, n;
 
-			data->hw_ptr += frags *	data->io.period_size;
-			data->hw_ptr %= data->io.buffer_size;
-
 			for (n = 0; n < frags; n++) {
 				/* Notify user that hardware pointer
 				 * has moved * */
@@ -222,19 +332,12 @@ static void *playback_hw_thread(void *param)
 					pthread_testcancel();
 			}
 
-			/* Reset point of reference to avoid too big values
-			 * that wont fit an unsigned int */
-			if ((unsigned int) delta.tv_sec < UINT_SECS_MAX)
-				prev_periods = periods;
-			else {
-				prev_periods = 0;
-				clock_gettime(CLOCK_MONOTONIC, &start);
-			}
+			prev_periods = periods;
 		}
 
 iter_sleep:
-		/* sleep up to one period interval */
-		ret = poll(fds, 2, poll_timeout);
+		/* sleep up to one tick, or one period without a timer */
+		ret = poll(fds, 3, timer < 0 ? poll_timeout : -1);
 
 		if (ret < 0) {
 			if (errno != EINTR) {
@@ -243,16 +346,35 @@ iter_sleep:
 				break;
 			}
 		} else if (ret > 0) {
-			ret = (fds[0].revents) ? 0 : 1;
-			SNDERR("poll fd %d revents %d", ret, fds[ret].revents);
-			if (fds[ret].revents & (POLLERR | POLLHUP | POLLNVAL))
-				break;
+			if (fds[2].revents & POLLIN) {
+				uint64_t expirations;
+
+				if (read(timer, &expirations,
+						sizeof(expirations)) < 0)
+					DBG("timerfd read: %s",
+							strerror(errno));
+				else if (expirations > 1)
+					data->missed_ticks += expirations - 1;
+			}
+
+			for (ret = 0; ret < 2; ret++) {
+				if (!fds[ret].revents)
+					continue;
+				SNDERR("poll fd %d revents %d", ret,
+							fds[ret].revents);
+				if (fds[ret].revents &
+						(POLLERR | POLLHUP | POLLNVAL))
+					goto done;
+			}
 		}
 
 		/* Offer opportunity to be canceled by main thread */
 		pthread_testcancel();
 	}
 
+done:
+	pthread_cleanup_pop(1);
+
 	data->hw_thread = 0;
 	pthread_exit(NULL);
 }
@@ -307,6 +429,9 @@ static void bluetooth_exit(struct bluetooth_data *data)
 		pthread_join(data->hw_thread, 0);
 	}
 
+	if (data->missed_ticks > 0)
+		DBG("hw thread missed %u ticks", data->missed_ticks);
+
 	if (a2dp->sbc_initialized)
 		sbc_finish(&a2dp->sbc);
 
@@ -364,6 +489,10 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 		 * If it is, capture won't start */
 		data->hw_ptr = io->period_size;
 
+	data->written_frames = 0;
+	data->sent_frames = 0;
+	data->sent_bytes = 0;
+
 	/* send start */
 	memset(req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	req->h.type = BT_REQUEST;
@@ -401,6 +530,15 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 		if (setsockopt(data->stream.fd, SOL_SOCKET, opt_name, &t,
 							sizeof(t)) < 0)
 			return -errno;
+
+		/* keep only a couple of packets queued in the socket */
+		if (data->alsa_config.low_latency &&
+				io->stream == SND_PCM_STREAM_PLAYBACK) {
+			int bytes = data->link_mtu * LOW_LATENCY_PACKETS;
+
+			setsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF,
+							&bytes, sizeof(bytes));
+		}
 	} else {
 		opt_name = (io->stream == SND_PCM_STREAM_PLAYBACK) ?
 						SCO_TXBUFS : SCO_RXBUFS;
@@ -989,6 +1127,9 @@ static int avdtp_write(struct bluetooth_data *data)
 	if (ret < 0) {
 		DBG("send returned %d errno %s.", ret, strerror(errno));
 		ret = -errno;
+	} else {
+		data->sent_frames += a2dp->samples;
+		data->sent_bytes += ret;
 	}
 
 	/* Reset buffer of data to send */
@@ -1138,6 +1279,8 @@ out:
 done:
 	DBG("returning %ld", size - bytes_left / frame_size);
 
+	data->written_frames += size - bytes_left / frame_size;
+
 	return size - bytes_left / frame_size;
 }
 
@@ -1291,6 +1434,11 @@ static int bluetooth_a2dp_hw_constraint(snd_pcm_ioplug_t *io)
 		4096, /* e.g. 23.2msec/period (stereo 16bit at 44.1kHz) */
 		8192
 	};
+	unsigned int low_latency_period_list[] = {
+		512, /* e.g. 2.9msec/period (stereo 16bit at 44.1kHz) */
+		1024,
+		2048
+	};
 
 	/* access type */
 	err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS,
@@ -1325,19 +1473,36 @@ static int bluetooth_a2dp_hw_constraint(snd_pcm_ioplug_t *io)
 	if (err < 0)
 		return err;
 
-	/* supported buffer sizes
-	 * (can be used as 3*8192, 6*4096, 12*2048, ...) */
-	err = snd_pcm_ioplug_set_param_minmax(io,
+	if (cfg->low_latency) {
+		/* as little as 4*512, up to the regular buffer size */
+		err = snd_pcm_ioplug_set_param_minmax(io,
+						SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+						512*4, 8192*3);
+		if (err < 0)
+			return err;
+
+		err = snd_pcm_ioplug_set_param_list(io,
+					SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+					ARRAY_NELEMS(low_latency_period_list),
+					low_latency_period_list);
+		if (err < 0)
+			return err;
+	} else {
+		/* supported buffer sizes
+		 * (can be used as 3*8192, 6*4096, 12*2048, ...) */
+		err = snd_pcm_ioplug_set_param_minmax(io,
 						SND_PCM_IOPLUG_HW_BUFFER_BYTES,
 						8192*3, 8192*3);
-	if (err < 0)
-		return err;
-
-	/* supported block sizes: */
-	err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-				ARRAY_NELEMS(period_list), period_list);
-	if (err < 0)
-		return err;
+		if (err < 0)
+			return err;
+
+		/* supported block sizes: */
+		err = snd_pcm_ioplug_set_param_list(io,
+					SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+					ARRAY_NELEMS(period_list), period_list);
+		if (err < 0)
+			return err;
+	}
 
 	/* supported rates */
 	rate_count = 0;
@@ -1411,6 +1576,39 @@ static int bluetooth_parse_config(snd_config_t *conf,
 			continue;
 		}
 
+		if (strcmp(id, "latency") == 0) {
+			if (snd_config_get_string(n, &value) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+
+			if (strcmp(value, "low") == 0)
+				bt_config->low_latency = 1;
+			else if (strcmp(value, "normal") == 0)
+				bt_config->low_latency = 0;
+			else {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (strcmp(id, "thread_policy") == 0) {
+			if (snd_config_get_string(n, &value) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+
+			if (thread_policy_parse(&bt_config->thread_policy,
+								value) < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+
+			bt_config->has_thread_policy = 1;
+			continue;
+		}
+
 		if (strcmp(id, "device") == 0 || strcmp(id, "bdaddr") == 0) {
 			if (snd_config_get_string(n, &value) < 0) {
 				SNDERR("Invalid type for %s", id);
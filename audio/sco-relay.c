@@ -0,0 +1,311 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "btio.h"
+#include "sco-relay.h"
+
+/* Jitter buffer size, in packets */
+#define RELAY_MAX_PACKETS 16
+
+/* Packets buffered before sending, the target grows on every underrun and
+ * shrinks again after RELAY_ADAPT_PACKETS packets sent without one */
+#define RELAY_MIN_TARGET 1
+#define RELAY_MAX_TARGET 8
+#define RELAY_ADAPT_PACKETS 400
+
+/* Packets above the target tolerated before the oldest are dropped */
+#define RELAY_SLACK 4
+
+struct sco_relay {
+	int sco_fd;
+	int client_fd;
+	guint sco_watch;
+	guint client_watch;
+	uint16_t mtu;
+	gboolean transparent;	/* Coded data, samples can't be faded */
+
+	/* Client to SCO direction */
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	uint8_t *last;		/* Last packet sent, faded for concealment */
+	gboolean have_last;
+	gboolean primed;
+	unsigned int target;
+	unsigned int clean;	/* Packets sent since the last underrun */
+
+	uint8_t *pkt;		/* SCO to client direction */
+
+	unsigned long underruns;
+	unsigned long overruns;
+};
+
+static void relay_stop(struct sco_relay *relay)
+{
+	if (relay->sco_watch) {
+		g_source_remove(relay->sco_watch);
+		relay->sco_watch = 0;
+	}
+
+	if (relay->client_watch) {
+		g_source_remove(relay->client_watch);
+		relay->client_watch = 0;
+	}
+}
+
+static void relay_drop(struct sco_relay *relay, size_t count)
+{
+	if (count > relay->len)
+		count = relay->len;
+
+	relay->len -= count;
+	memmove(relay->buf, relay->buf + count, relay->len);
+}
+
+/* Repeats the last packet at half the level each time, which fades out to
+ * silence over a few packets. Coded data is replaced by silence since the
+ * remote conceals invalid frames itself. */
+static void relay_conceal(struct sco_relay *relay)
+{
+	int16_t *samples = (int16_t *) relay->last;
+	unsigned int i;
+
+	if (relay->transparent || !relay->have_last) {
+		memset(relay->last, 0, relay->mtu);
+		return;
+	}
+
+	for (i = 0; i < relay->mtu / sizeof(int16_t); i++)
+		samples[i] /= 2;
+}
+
+static void relay_send(struct sco_relay *relay)
+{
+	if (!relay->primed && relay->len >= relay->target * relay->mtu) {
+		relay->primed = TRUE;
+		relay->clean = 0;
+	}
+
+	if (relay->primed && relay->len >= relay->mtu) {
+		memcpy(relay->last, relay->buf, relay->mtu);
+		relay->have_last = TRUE;
+		relay_drop(relay, relay->mtu);
+
+		if (++relay->clean >= RELAY_ADAPT_PACKETS &&
+					relay->target > RELAY_MIN_TARGET) {
+			relay->target--;
+			relay->clean = 0;
+		}
+	} else {
+		/* Silence while priming isn't an underrun */
+		if (relay->primed) {
+			relay->underruns++;
+			relay->primed = FALSE;
+			if (relay->target < RELAY_MAX_TARGET)
+				relay->target++;
+		}
+
+		relay_conceal(relay);
+	}
+
+	if (send(relay->sco_fd, relay->last, relay->mtu, MSG_DONTWAIT) < 0 &&
+							errno != EAGAIN)
+		error("SCO relay: send: %s (%d)", strerror(errno), errno);
+}
+
+static gboolean sco_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	struct sco_relay *relay = data;
+	ssize_t len;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		goto stop;
+
+	len = recv(relay->sco_fd, relay->pkt, relay->mtu, MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return TRUE;
+		goto stop;
+	}
+
+	if (len > 0 && send(relay->client_fd, relay->pkt, len,
+					MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		if (errno != EAGAIN)
+			goto stop;
+
+		/* The client is not keeping up, drop what it can't take */
+		relay->overruns++;
+	}
+
+	/* The link is synchronous, incoming packets clock outgoing ones */
+	relay_send(relay);
+
+	return TRUE;
+
+stop:
+	DBG("SCO relay: SCO link gone");
+	relay->sco_watch = 0;
+	relay_stop(relay);
+	return FALSE;
+}
+
+static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	struct sco_relay *relay = data;
+	ssize_t len;
+
+	if (cond & G_IO_IN) {
+		/* Make room by dropping the oldest packet */
+		if (relay->len == relay->size) {
+			relay_drop(relay, relay->mtu);
+			relay->overruns++;
+		}
+
+		len = read(relay->client_fd, relay->buf + relay->len,
+						relay->size - relay->len);
+		if (len < 0 && errno != EAGAIN && errno != EINTR)
+			goto stop;
+		if (len == 0)
+			goto stop;
+
+		if (len > 0)
+			relay->len += len;
+
+		/* Keep the latency bounded when the client runs ahead */
+		if (relay->len > (relay->target + RELAY_SLACK) * relay->mtu) {
+			relay_drop(relay, relay->len -
+					relay->target * relay->mtu);
+			relay->overruns++;
+		}
+
+		return TRUE;
+	}
+
+stop:
+	DBG("SCO relay: client gone");
+	relay->client_watch = 0;
+	relay_stop(relay);
+	return FALSE;
+}
+
+struct sco_relay *sco_relay_new(int sco_fd, int *fd)
+{
+	struct sco_relay *relay;
+	GIOChannel *io;
+	GError *gerr = NULL;
+	uint16_t mtu = 0, voice = BT_VOICE_CVSD_16BIT;
+	int sv[2];
+
+	io = g_io_channel_unix_new(sco_fd);
+	if (!bt_io_get(io, BT_IO_SCO, &gerr, BT_IO_OPT_MTU, &mtu,
+					BT_IO_OPT_VOICE, &voice,
+					BT_IO_OPT_INVALID)) {
+		error("SCO relay: %s", gerr->message);
+		g_error_free(gerr);
+		g_io_channel_unref(io);
+		return NULL;
+	}
+
+	if (mtu == 0 || mtu % sizeof(int16_t)) {
+		error("SCO relay: unusable MTU %u", mtu);
+		g_io_channel_unref(io);
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		error("SCO relay: socketpair: %s (%d)", strerror(errno), errno);
+		g_io_channel_unref(io);
+		return NULL;
+	}
+
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+	relay = g_new0(struct sco_relay, 1);
+	relay->sco_fd = sco_fd;
+	relay->client_fd = sv[0];
+	relay->mtu = mtu;
+	relay->transparent = voice == BT_VOICE_TRANSPARENT;
+	relay->size = RELAY_MAX_PACKETS * mtu;
+	relay->buf = g_malloc(relay->size);
+	relay->last = g_malloc0(mtu);
+	relay->pkt = g_malloc(mtu);
+	relay->target = RELAY_MIN_TARGET + 1;
+
+	relay->sco_watch = g_io_add_watch(io,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				sco_cb, relay);
+	g_io_channel_unref(io);
+
+	io = g_io_channel_unix_new(relay->client_fd);
+	relay->client_watch = g_io_add_watch(io,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				client_cb, relay);
+	g_io_channel_unref(io);
+
+	DBG("SCO relay: MTU %u%s", mtu,
+				relay->transparent ? ", transparent" : "");
+
+	*fd = sv[1];
+
+	return relay;
+}
+
+void sco_relay_get_counters(struct sco_relay *relay, unsigned long *underruns,
+						unsigned long *overruns)
+{
+	if (underruns)
+		*underruns = relay->underruns;
+	if (overruns)
+		*overruns = relay->overruns;
+}
+
+void sco_relay_free(struct sco_relay *relay)
+{
+	DBG("SCO relay: %lu underruns, %lu overruns", relay->underruns,
+							relay->overruns);
+
+	relay_stop(relay);
+
+	close(relay->client_fd);
+
+	g_free(relay->buf);
+	g_free(relay->last);
+	g_free(relay->pkt);
+	g_free(relay);
+}
@@ -0,0 +1,35 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct sco_relay;
+
+/* Relays audio between a SCO socket and a local socket handed to the
+ * client in its place. Client data is cut into packets of exactly the SCO
+ * MTU and sent one per received packet, from a small adaptive jitter
+ * buffer that conceals underruns. On success *fd is the client end, owned
+ * by the caller. */
+struct sco_relay *sco_relay_new(int sco_fd, int *fd);
+void sco_relay_free(struct sco_relay *relay);
+
+void sco_relay_get_counters(struct sco_relay *relay, unsigned long *underruns,
+						unsigned long *overruns);
@@ -98,12 +98,14 @@ void telephony_last_dialed_number_req(void *telephony_device)
 
 	active_call_status = CALL_STATUS_ALERTING;
 	active_call_dir = CALL_DIR_OUTGOING;
+	telephony_calls_changed_ind();
 }
 
 void telephony_terminate_call_req(void *telephony_device)
 {
 	g_free(active_call_number);
 	active_call_number = NULL;
+	telephony_calls_changed_ind();
 
 	telephony_terminate_call_rsp(telephony_device, CME_ERROR_NONE);
 
@@ -124,6 +126,7 @@ void telephony_answer_call_req(void *telephony_device)
 					EV_CALLSETUP_INACTIVE);
 
 	active_call_status = CALL_STATUS_ACTIVE;
+	telephony_calls_changed_ind();
 }
 
 void telephony_dial_number_req(void *telephony_device, const char *number)
@@ -143,6 +146,7 @@ void telephony_dial_number_req(void *telephony_device, const char *number)
 
 	active_call_status = CALL_STATUS_ALERTING;
 	active_call_dir = CALL_DIR_OUTGOING;
+	telephony_calls_changed_ind();
 }
 
 void telephony_transmit_dtmf_req(void *telephony_device, char tone)
@@ -234,6 +238,7 @@ static DBusMessage *outgoing_call(DBusConnection *conn, DBusMessage *msg,
 
 	active_call_status = CALL_STATUS_ALERTING;
 	active_call_dir = CALL_DIR_OUTGOING;
+	telephony_calls_changed_ind();
 
 	return dbus_message_new_method_return(msg);
 }
@@ -257,6 +262,7 @@ static DBusMessage *incoming_call(DBusConnection *conn, DBusMessage *msg,
 
 	active_call_status = CALL_STATUS_INCOMING;
 	active_call_dir = CALL_DIR_INCOMING;
+	telephony_calls_changed_ind();
 
 	telephony_incoming_call_ind(number, NUMBER_TYPE_TELEPHONY);
 
@@ -270,6 +276,7 @@ static DBusMessage *cancel_call(DBusConnection *conn, DBusMessage *msg,
 
 	g_free(active_call_number);
 	active_call_number = NULL;
+	telephony_calls_changed_ind();
 
 	if (telephony_get_indicator(dummy_indicators, "callsetup") > 0) {
 		telephony_update_indicator(dummy_indicators, "callsetup",
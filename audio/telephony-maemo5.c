@@ -936,6 +936,7 @@ static void handle_incoming_call(DBusMessage *msg)
 
 	g_free(call->number);
 	call->number = g_strdup(number);
+	telephony_calls_changed_ind();
 
 	telephony_update_indicator(maemo_indicators, "callsetup",
 					EV_CALLSETUP_INCOMING);
@@ -972,6 +973,7 @@ static void handle_outgoing_call(DBusMessage *msg)
 
 	g_free(call->number);
 	call->number = g_strdup(number);
+	telephony_calls_changed_ind();
 
 	g_free(last_dialed_number);
 	last_dialed_number = g_strdup(number);
@@ -1039,6 +1041,7 @@ static void handle_call_status(DBusMessage *msg, const char *call_path)
 	}
 
 	call->status = (int) status;
+	telephony_calls_changed_ind();
 
 	switch (status) {
 	case CSD_CALL_STATUS_IDLE:
@@ -1175,6 +1178,7 @@ static void handle_conference(DBusMessage *msg, gboolean joined)
 	DBG("Call %s %s the conference", path, joined ? "joined" : "left");
 
 	call->conference = joined;
+	telephony_calls_changed_ind();
 }
 
 static void get_operator_name_reply(DBusPendingCall *pending_call,
@@ -1216,6 +1220,7 @@ static void get_operator_name_reply(DBusPendingCall *pending_call,
 
 	g_free(net.operator_name);
 	net.operator_name = g_strdup(name);
+	telephony_operator_changed_ind();
 
 	DBG("telephony-maemo: operator name updated: %s", name);
 
@@ -1287,6 +1292,7 @@ static void update_registration_status(uint8_t status, uint16_t lac,
 			net.country_code != country_code) {
 		g_free(net.operator_name);
 		net.operator_name = NULL;
+		telephony_operator_changed_ind();
 		resolve_operator_name(operator_code, country_code);
 		net.operator_code = operator_code;
 		net.country_code = country_code;
@@ -1548,6 +1554,7 @@ static void parse_call_list(DBusMessageIter *iter)
 			call = g_new0(struct csd_call, 1);
 			call->object_path = g_strdup(object_path);
 			call->status = (int) status;
+			telephony_calls_changed_ind();
 			calls = g_slist_append(calls, call);
 			DBG("telephony-maemo: new csd call instance at %s",
 								object_path);
@@ -1569,6 +1576,7 @@ static void parse_call_list(DBusMessageIter *iter)
 		call->conference = conf;
 		g_free(call->number);
 		call->number = g_strdup(number);
+		telephony_calls_changed_ind();
 
 	} while (dbus_message_iter_next(iter));
 }
@@ -968,6 +968,7 @@ static void handle_incoming_call(DBusMessage *msg)
 
 	g_free(call->number);
 	call->number = g_strdup(number);
+	telephony_calls_changed_ind();
 
 	if (find_call_with_status(CSD_CALL_STATUS_ACTIVE) ||
 			find_call_with_status(CSD_CALL_STATUS_HOLD))
@@ -1005,6 +1006,7 @@ static void handle_outgoing_call(DBusMessage *msg)
 
 	g_free(call->number);
 	call->number = g_strdup(number);
+	telephony_calls_changed_ind();
 
 	if (create_request_timer) {
 		g_source_remove(create_request_timer);
@@ -1048,6 +1050,7 @@ static void call_set_status(struct csd_call *call, dbus_uint32_t status)
 	}
 
 	call->status = (int) status;
+	telephony_calls_changed_ind();
 
 	switch (status) {
 	case CSD_CALL_STATUS_IDLE:
@@ -1221,6 +1224,7 @@ static void handle_conference(DBusMessage *msg, gboolean joined)
 	DBG("Call %s %s the conference", path, joined ? "joined" : "left");
 
 	call->conference = joined;
+	telephony_calls_changed_ind();
 }
 
 static uint8_t str2status(const char *state)
@@ -1552,6 +1556,7 @@ static void parse_call_list(DBusMessageIter *iter)
 		call->conference = conf;
 		g_free(call->number);
 		call->number = g_strdup(number);
+		telephony_calls_changed_ind();
 
 		/* Update indicators */
 		call_set_status(call, status);
@@ -1566,6 +1571,7 @@ static void update_operator_name(const char *name)
 
 	g_free(net.operator_name);
 	net.operator_name = g_strndup(name, 16);
+	telephony_operator_changed_ind();
 	DBG("telephony-maemo6: operator name updated: %s", name);
 }
 
@@ -1968,6 +1974,7 @@ void telephony_exit(void)
 
 	g_free(net.operator_name);
 	net.operator_name = NULL;
+	telephony_operator_changed_ind();
 
 	net.status = NETWORK_REG_STATUS_UNKOWN;
 	net.signal_bars = 0;
@@ -727,6 +727,8 @@ static gboolean handle_vc_property_changed(DBusConnection *conn,
 		vc->conference = multiparty;
 	}
 
+	telephony_calls_changed_ind();
+
 	return TRUE;
 }
 
@@ -834,6 +836,8 @@ static void call_added(const char *path, DBusMessageIter *properties)
 
 	vc = call_new(path, properties);
 	calls = g_slist_prepend(calls, vc);
+
+	telephony_calls_changed_ind();
 }
 
 static void get_calls_reply(DBusPendingCall *call, void *user_data)
@@ -915,6 +919,7 @@ static void handle_network_property(const char *property, DBusMessageIter *varia
 		DBG("Operator is %s", operator);
 		g_free(net.operator_name);
 		net.operator_name = g_strdup(operator);
+		telephony_operator_changed_ind();
 	} else if (g_str_equal(property, "SignalStrength")) {
 		dbus_message_iter_get_basic(variant, &signals_bar);
 		DBG("SignalStrength is %d", signals_bar);
@@ -1037,9 +1042,11 @@ static void modem_removed(const char *path)
 	g_slist_foreach(calls, (GFunc) call_free, NULL);
 	g_slist_free(calls);
 	calls = NULL;
+	telephony_calls_changed_ind();
 
 	g_free(net.operator_name);
 	net.operator_name = NULL;
+	telephony_operator_changed_ind();
 	net.status = NETWORK_REG_STATUS_NOSERV;
 	net.signals_bar = 0;
 
@@ -1278,6 +1285,8 @@ static void call_removed(const char *path)
 
 	calls = g_slist_remove(calls, vc);
 	call_free(vc);
+
+	telephony_calls_changed_ind();
 }
 
 static gboolean handle_vcmanager_call_removed(DBusConnection *conn,
@@ -43,6 +43,7 @@
 #define AG_FEATURE_ENHANCED_CALL_STATUS		0x0040
 #define AG_FEATURE_ENHANCED_CALL_CONTROL	0x0080
 #define AG_FEATURE_EXTENDED_ERROR_RESULT_CODES	0x0100
+#define AG_FEATURE_CODEC_NEGOTIATION		0x0200
 
 #define HF_FEATURE_EC_ANDOR_NR			0x0001
 #define HF_FEATURE_CALL_WAITING_AND_3WAY	0x0002
@@ -51,6 +52,7 @@
 #define HF_FEATURE_REMOTE_VOLUME_CONTROL	0x0010
 #define HF_FEATURE_ENHANCED_CALL_STATUS		0x0020
 #define HF_FEATURE_ENHANCED_CALL_CONTROL	0x0040
+#define HF_FEATURE_CODEC_NEGOTIATION		0x0080
 
 /* Indicator event values */
 #define EV_SERVICE_NONE			0
@@ -197,6 +199,13 @@ int telephony_subscriber_number_ind(const char *number, int type,
 int telephony_call_waiting_ind(const char *number, int type);
 int telephony_operator_selection_ind(int mode, const char *oper);
 
+/* State change notifications by AG. The answers to AT+CLCC and AT+COPS?
+ * are cached by headset.c and served from memory until the telephony
+ * driver reports that its call list or operator changed. These are
+ * implemented by headset.c */
+void telephony_calls_changed_ind(void);
+void telephony_operator_changed_ind(void);
+
 /* Helper function for quick indicator updates */
 static inline int telephony_update_indicator(struct indicator *indicators,
 						const char *desc,
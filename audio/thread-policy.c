@@ -0,0 +1,234 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "thread-policy.h"
+
+static int parse_int(const char *str, char **end, int *value)
+{
+	long val;
+
+	errno = 0;
+	val = strtol(str, end, 10);
+	if (errno != 0 || *end == str)
+		return -EINVAL;
+
+	*value = val;
+
+	return 0;
+}
+
+static int parse_cpus(const char *str, unsigned long *cpus)
+{
+	*cpus = 0;
+
+	while (*str != '\0') {
+		int first, last;
+		char *end;
+
+		if (parse_int(str, &end, &first) < 0)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-' && parse_int(end + 1, &end, &last) < 0)
+			return -EINVAL;
+
+		if (first < 0 || last < first ||
+				last >= (int) THREAD_POLICY_CPUS_MAX)
+			return -EINVAL;
+
+		for (; first <= last; first++)
+			*cpus |= 1UL << first;
+
+		if (*end == '+')
+			end++;
+		else if (*end != '\0')
+			return -EINVAL;
+
+		str = end;
+	}
+
+	return *cpus ? 0 : -EINVAL;
+}
+
+static int parse_item(struct thread_policy *policy, const char *item)
+{
+	char *end;
+	int value;
+
+	if (strcmp(item, "default") == 0) {
+		policy->policy = SCHED_OTHER;
+		policy->set_nice = 0;
+		return 0;
+	}
+
+	if (strcmp(item, "mlock") == 0) {
+		policy->lock_memory = 1;
+		return 0;
+	}
+
+	if (strncmp(item, "cpus=", 5) == 0)
+		return parse_cpus(item + 5, &policy->cpus);
+
+	if (strncmp(item, "fifo:", 5) == 0 || strncmp(item, "rr:", 3) == 0) {
+		int sched = item[0] == 'f' ? SCHED_FIFO : SCHED_RR;
+
+		if (parse_int(strchr(item, ':') + 1, &end, &value) < 0 ||
+								*end != '\0')
+			return -EINVAL;
+
+		if (value < sched_get_priority_min(sched) ||
+				value > sched_get_priority_max(sched))
+			return -EINVAL;
+
+		policy->policy = sched;
+		policy->priority = value;
+		policy->set_nice = 0;
+		return 0;
+	}
+
+	if (strncmp(item, "nice:", 5) == 0) {
+		if (parse_int(item + 5, &end, &value) < 0 || *end != '\0')
+			return -EINVAL;
+
+		if (value < -20 || value > 19)
+			return -EINVAL;
+
+		policy->policy = SCHED_OTHER;
+		policy->priority = value;
+		policy->set_nice = 1;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+int thread_policy_parse(struct thread_policy *policy, const char *str)
+{
+	char buf[128], *item, *next;
+
+	memset(policy, 0, sizeof(*policy));
+	policy->policy = SCHED_OTHER;
+
+	if (strlen(str) >= sizeof(buf))
+		return -EINVAL;
+
+	strcpy(buf, str);
+
+	for (item = buf; item != NULL; item = next) {
+		next = strchr(item, ',');
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (parse_item(policy, item) < 0)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int set_nice(int value)
+{
+	/* On Linux the priority of a single thread is set by its id */
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), value) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int set_cpus(unsigned long cpus)
+{
+	cpu_set_t set;
+	unsigned int cpu;
+
+	CPU_ZERO(&set);
+
+	for (cpu = 0; cpu < THREAD_POLICY_CPUS_MAX; cpu++)
+		if (cpus & (1UL << cpu))
+			CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int thread_policy_apply(const struct thread_policy *policy)
+{
+	int err = 0, ret;
+
+	if (policy->policy == SCHED_FIFO || policy->policy == SCHED_RR) {
+		struct sched_param param;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = policy->priority;
+
+		ret = -pthread_setschedparam(pthread_self(), policy->policy,
+									&param);
+		if (ret < 0) {
+			err = ret;
+			set_nice(THREAD_POLICY_FALLBACK_NICE);
+		}
+	} else if (policy->set_nice) {
+		ret = set_nice(policy->priority);
+		if (ret < 0)
+			err = ret;
+	}
+
+	if (policy->cpus) {
+		ret = set_cpus(policy->cpus);
+		if (ret < 0 && err == 0)
+			err = ret;
+	}
+
+	if (policy->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0 &&
+								err == 0)
+		err = -errno;
+
+	return err;
+}
+
+const char *thread_policy_name(const struct thread_policy *policy)
+{
+	switch (policy->policy) {
+	case SCHED_FIFO:
+		return "fifo";
+	case SCHED_RR:
+		return "rr";
+	default:
+		return policy->set_nice ? "nice" : "default";
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Scheduling setup for the threads that feed audio to the stream socket.
+ * Used by the ALSA plugin and liba2dp, so it stays free of GLib and of any
+ * particular logging facility. */
+
+#define THREAD_POLICY_CPUS_MAX	(sizeof(unsigned long) * 8)
+
+/* Nice value tried when a real-time policy is not permitted, matches
+ * the priority Android gives to audio threads */
+#define THREAD_POLICY_FALLBACK_NICE	-16
+
+struct thread_policy {
+	int policy;		/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;		/* real-time priority, or nice value */
+	int set_nice;		/* apply priority as nice value */
+	unsigned long cpus;	/* allowed CPUs bit mask, 0 for any */
+	int lock_memory;	/* lock the process pages in memory */
+};
+
+/* Parses a policy description such as "fifo:10,cpus=0-1,mlock". The
+ * first item is "fifo:<priority>", "rr:<priority>", "nice:<value>" or
+ * "default", followed by optional "cpus=<list>" where CPUs and ranges are
+ * joined by '+' (e.g. "cpus=0+2-3") and "mlock". Returns 0 or -EINVAL. */
+int thread_policy_parse(struct thread_policy *policy, const char *str);
+
+/* Applies the policy to the calling thread. Steps that fail are skipped,
+ * a real-time policy that is not permitted falls back to
+ * THREAD_POLICY_FALLBACK_NICE. Returns 0 if everything was applied as
+ * requested, otherwise the negative errno of the first failure. */
+int thread_policy_apply(const struct thread_policy *policy);
+
+/* Returns a short description of the policy for logging */
+const char *thread_policy_name(const struct thread_policy *policy);
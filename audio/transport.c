@@ -27,6 +27,9 @@
 #endif
 
 #include <errno.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 #include <glib.h>
 #include <gdbus.h>
@@ -49,6 +52,8 @@
 
 #define MEDIA_TRANSPORT_INTERFACE "org.bluez.MediaTransport"
 
+#define SEND_LATENCY_BUCKETS 8
+
 struct media_request {
 	DBusMessage		*msg;
 	guint			id;
@@ -62,6 +67,29 @@ struct media_owner {
 	guint			watch;
 };
 
+/* Transmit counters reported by the sender since the stream was started */
+struct media_stats {
+	uint32_t		packets;	/* Packets sent */
+	uint32_t		late;		/* Packets sent late */
+	uint32_t		poll_timeouts;	/* Socket waits timed out */
+	uint32_t		byte_rate;	/* Bytes sent per second */
+	uint32_t		encode_ns;	/* Encoding time per frame */
+	uint8_t			bitpool;	/* Current bitpool (sbc only) */
+	uint32_t		send_latency[SEND_LATENCY_BUCKETS];
+};
+
+static const struct {
+	const char	*name;
+	size_t		offset;
+} stats_counters[] = {
+	{ "PacketsSent",	offsetof(struct media_stats, packets)	},
+	{ "LatePackets",	offsetof(struct media_stats, late)	},
+	{ "PollTimeouts",	offsetof(struct media_stats, poll_timeouts) },
+	{ "ByteRate",		offsetof(struct media_stats, byte_rate)	},
+	{ "EncoderTime",	offsetof(struct media_stats, encode_ns)	},
+	{ }
+};
+
 struct media_transport {
 	DBusConnection		*conn;
 	char			*path;		/* Transport object path */
@@ -75,6 +103,7 @@ struct media_transport {
 	uint16_t		imtu;		/* Transport input mtu */
 	uint16_t		omtu;		/* Transport output mtu */
 	uint16_t		delay;		/* Transport delay (a2dp only) */
+	struct media_stats	stats;		/* Transmit counters (a2dp only) */
 	unsigned int		nrec_id;	/* Transport nrec watch (headset only) */
 	gboolean		read_lock;
 	gboolean		write_lock;
@@ -212,6 +241,9 @@ static void media_transport_remove(struct media_transport *transport,
 static gboolean media_transport_set_fd(struct media_transport *transport,
 					int fd, uint16_t imtu, uint16_t omtu)
 {
+	/* Counters start over whenever the stream is resumed */
+	memset(&transport->stats, 0, sizeof(transport->stats));
+
 	if (transport->fd == fd)
 		return TRUE;
 
@@ -630,10 +662,48 @@ static DBusMessage *release(DBusConnection *conn, DBusMessage *msg,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static int set_send_latency(struct media_transport *transport,
+						DBusMessageIter *value)
+{
+	struct media_stats *stats = &transport->stats;
+	uint32_t buckets[SEND_LATENCY_BUCKETS];
+	uint32_t *array = stats->send_latency;
+	DBusMessageIter iter;
+	int n = 0;
+
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_ARRAY)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(value, &iter);
+
+	while (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_UINT32) {
+		if (n == SEND_LATENCY_BUCKETS)
+			return -EINVAL;
+		dbus_message_iter_get_basic(&iter, &buckets[n++]);
+		dbus_message_iter_next(&iter);
+	}
+
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_INVALID)
+		return -EINVAL;
+
+	memset(stats->send_latency, 0, sizeof(stats->send_latency));
+	memcpy(stats->send_latency, buckets, n * sizeof(uint32_t));
+
+	emit_array_property_changed(transport->conn, transport->path,
+				MEDIA_TRANSPORT_INTERFACE, "SendLatency",
+				DBUS_TYPE_UINT32, &array,
+				SEND_LATENCY_BUCKETS);
+
+	return 0;
+}
+
 static int set_property_a2dp(struct media_transport *transport,
 						const char *property,
 						DBusMessageIter *value)
 {
+	struct media_stats *stats = &transport->stats;
+	int i;
+
 	if (g_strcmp0(property, "Delay") == 0) {
 		if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_UINT16)
 			return -EINVAL;
@@ -643,6 +713,55 @@ static int set_property_a2dp(struct media_transport *transport,
 		return 0;
 	}
 
+	if (g_strcmp0(property, "Bitpool") == 0) {
+		if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_BYTE)
+			return -EINVAL;
+		dbus_message_iter_get_basic(value, &stats->bitpool);
+
+		emit_property_changed(transport->conn, transport->path,
+					MEDIA_TRANSPORT_INTERFACE, property,
+					DBUS_TYPE_BYTE, &stats->bitpool);
+		return 0;
+	}
+
+	if (g_strcmp0(property, "SendLatency") == 0)
+		return set_send_latency(transport, value);
+
+	if (g_strcmp0(property, "SuspendTimeout") == 0) {
+		struct a2dp_sep *sep;
+		uint16_t timeout;
+
+		if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_UINT16)
+			return -EINVAL;
+		dbus_message_iter_get_basic(value, &timeout);
+
+		sep = media_endpoint_get_sep(transport->endpoint);
+		a2dp_sep_set_suspend_timeout(sep, timeout);
+
+		emit_property_changed(transport->conn, transport->path,
+					MEDIA_TRANSPORT_INTERFACE, property,
+					DBUS_TYPE_UINT16, &timeout);
+		return 0;
+	}
+
+	for (i = 0; stats_counters[i].name; i++) {
+		uint32_t *counter;
+
+		if (g_strcmp0(property, stats_counters[i].name) != 0)
+			continue;
+
+		if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_UINT32)
+			return -EINVAL;
+
+		counter = (void *) stats + stats_counters[i].offset;
+		dbus_message_iter_get_basic(value, counter);
+
+		emit_property_changed(transport->conn, transport->path,
+					MEDIA_TRANSPORT_INTERFACE, property,
+					DBUS_TYPE_UINT32, counter);
+		return 0;
+	}
+
 	return -EINVAL;
 }
 
@@ -722,7 +841,33 @@ static DBusMessage *set_property(DBusConnection *conn, DBusMessage *msg,
 static void get_properties_a2dp(struct media_transport *transport,
 						DBusMessageIter *dict)
 {
+	struct media_stats *stats = &transport->stats;
+	uint32_t *send_latency = stats->send_latency;
+	struct a2dp_sep *sep;
+	uint16_t timeout;
+	int i, queued;
+
 	dict_append_entry(dict, "Delay", DBUS_TYPE_UINT16, &transport->delay);
+
+	sep = media_endpoint_get_sep(transport->endpoint);
+	timeout = a2dp_sep_get_suspend_timeout(sep);
+	dict_append_entry(dict, "SuspendTimeout", DBUS_TYPE_UINT16, &timeout);
+
+	for (i = 0; stats_counters[i].name; i++)
+		dict_append_entry(dict, stats_counters[i].name,
+				DBUS_TYPE_UINT32,
+				(void *) stats + stats_counters[i].offset);
+
+	dict_append_entry(dict, "Bitpool", DBUS_TYPE_BYTE, &stats->bitpool);
+
+	dict_append_array(dict, "SendLatency", DBUS_TYPE_UINT32,
+					&send_latency, SEND_LATENCY_BUCKETS);
+
+	/* Sampled from the socket, the sender shares it with us */
+	if (transport->fd < 0 || ioctl(transport->fd, SIOCOUTQ, &queued) < 0)
+		queued = 0;
+
+	dict_append_entry(dict, "QueuedBytes", DBUS_TYPE_UINT32, &queued);
 }
 
 static void get_properties_headset(struct media_transport *transport,
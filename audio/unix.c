@@ -34,6 +34,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -47,6 +49,9 @@
 #include "avdtp.h"
 #include "media.h"
 #include "a2dp.h"
+#include "mixer.h"
+#include "sco-relay.h"
+#include "a2dp-relay.h"
 #include "headset.h"
 #include "sink.h"
 #include "gateway.h"
@@ -55,6 +60,13 @@
 
 #define check_nul(str) (str[sizeof(str) - 1] == '\0')
 
+/* Replies held back while handling the requests of a single read */
+#define MAX_QUEUED_REPLIES 8
+
+/* Upper bound of codec entries in a BT_GET_CAPABILITIES response */
+#define MAX_CACHED_CODECS (BT_SUGGESTED_BUFFER_SIZE / \
+					sizeof(codec_capabilities_t))
+
 typedef enum {
 	TYPE_NONE,
 	TYPE_HEADSET,
@@ -90,20 +102,99 @@ struct unix_client {
 	int data_fd; /* To be deleted once two phase configuration is fully implemented */
 	unsigned int req_id;
 	unsigned int cb_id;
+	gboolean early_fd; /* Stream fd sent ahead of BT_START_STREAM_RSP */
+	gboolean shared_pcm; /* PCM ring handed out instead of the stream fd */
+	struct mixer_ring *ring;
+	uint32_t group; /* Streams sharing the PCM ring */
+	gboolean sco_relay; /* Relayed socket handed out instead of SCO */
+	struct sco_relay *relay;
+	gboolean a2dp_relay; /* Decoded PCM handed out instead of the stream */
+	struct a2dp_relay *receiver;
+	uint8_t inbuf[BT_SUGGESTED_BUFFER_SIZE]; /* Partially received requests */
+	size_t inlen;
+	gboolean batching;
+	struct iovec out[MAX_QUEUED_REPLIES];
+	int out_count;
 	gboolean (*cancel) (struct audio_device *dev, unsigned int id);
 };
 
+/* BT_GET_CAPABILITIES response of a connected A2DP session, kept so
+ * that clients reopening the stream are answered without discovery */
+struct caps_cache {
+	struct audio_device *dev;
+	struct avdtp *session;
+	service_type_t type;
+	uint8_t seid;
+	unsigned int count;
+	struct avdtp_stream *streams[MAX_CACHED_CODECS];
+	struct bt_get_capabilities_rsp *rsp;
+};
+
 static GSList *clients = NULL;
 
+static GSList *caps_cache = NULL;
+static unsigned int avdtp_callback_id = 0;
+
 static int unix_sock = -1;
 
+static void client_free_ring(struct unix_client *client)
+{
+	if (client->ring == NULL)
+		return;
+
+	mixer_ring_free(client->ring);
+	client->ring = NULL;
+}
+
+static void client_free_receiver(struct unix_client *client)
+{
+	if (client->receiver == NULL)
+		return;
+
+	a2dp_relay_free(client->receiver);
+	client->receiver = NULL;
+}
+
+static void client_free_relay(struct unix_client *client)
+{
+	if (client->relay == NULL)
+		return;
+
+	sco_relay_free(client->relay);
+	client->relay = NULL;
+}
+
+/* Returns the fd to hand out for the SCO socket, the client end of a new
+ * relay if one was asked for */
+static int client_sco_fd(struct unix_client *client, int sco_fd)
+{
+	int fd;
+
+	if (!client->sco_relay || sco_fd < 0)
+		return sco_fd;
+
+	client_free_relay(client);
+
+	client->relay = sco_relay_new(sco_fd, &fd);
+	if (client->relay == NULL)
+		return -1;
+
+	return fd;
+}
+
 static void client_free(struct unix_client *client)
 {
+	int i;
+
 	DBG("client_free(%p)", client);
 
 	if (client->cancel && client->dev && client->req_id > 0)
 		client->cancel(client->dev, client->req_id);
 
+	client_free_ring(client);
+	client_free_receiver(client);
+	client_free_relay(client);
+
 	if (client->sock >= 0)
 		close(client->sock);
 
@@ -112,6 +203,9 @@ static void client_free(struct unix_client *client)
 		g_slist_free(client->caps);
 	}
 
+	for (i = 0; i < client->out_count; i++)
+		g_free(client->out[i].iov_base);
+
 	g_free(client->interface);
 	g_free(client);
 }
@@ -139,13 +233,37 @@ static int set_nonblocking(int fd)
  * AF_UNIX) and the sendmsg() system call with the cmsg_type field of a "struct
  * cmsghdr" set to SCM_RIGHTS and the data being an integer value equal to the
  * handle of the file descriptor to be passed. */
-static int unix_sendmsg_fd(int sock, int fd)
+static void unix_ipc_flush(struct unix_client *client)
+{
+	struct msghdr msgh;
+	int i;
+
+	if (client->out_count == 0)
+		return;
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = client->out;
+	msgh.msg_iovlen = client->out_count;
+
+	if (sendmsg(client->sock, &msgh, MSG_NOSIGNAL) < 0)
+		error("Error %s(%d)", strerror(errno), errno);
+
+	for (i = 0; i < client->out_count; i++)
+		g_free(client->out[i].iov_base);
+
+	client->out_count = 0;
+}
+
+static int unix_sendmsg_fd(struct unix_client *client, int fd)
 {
 	char cmsg_b[CMSG_SPACE(sizeof(int))], m = 'm';
 	struct cmsghdr *cmsg;
 	struct iovec iov = { &m, sizeof(m) };
 	struct msghdr msgh;
 
+	/* The fd goes after the messages announcing it */
+	unix_ipc_flush(client);
+
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_iov = &iov;
 	msgh.msg_iovlen = 1;
@@ -159,7 +277,7 @@ static int unix_sendmsg_fd(int sock, int fd)
 	/* Initialize the payload */
 	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
 
-	return sendmsg(sock, &msgh, MSG_NOSIGNAL);
+	return sendmsg(client->sock, &msgh, MSG_NOSIGNAL);
 }
 
 static void unix_ipc_sendmsg(struct unix_client *client,
@@ -170,6 +288,18 @@ static void unix_ipc_sendmsg(struct unix_client *client,
 
 	DBG("Audio API: %s -> %s", type, name);
 
+	if (client->batching) {
+		struct iovec *iov;
+
+		if (client->out_count == MAX_QUEUED_REPLIES)
+			unix_ipc_flush(client);
+
+		iov = &client->out[client->out_count++];
+		iov->iov_base = g_memdup(msg, msg->length);
+		iov->iov_len = msg->length;
+		return;
+	}
+
 	if (send(client->sock, msg, msg->length, 0) < 0)
 		error("Error %s(%d)", strerror(errno), errno);
 }
@@ -232,6 +362,8 @@ static void stream_state_changed(struct avdtp_stream *stream,
 
 	switch (new_state) {
 	case AVDTP_STATE_IDLE:
+		client_free_ring(client);
+		client_free_receiver(client);
 		if (a2dp->sep) {
 			a2dp_sep_unlock(a2dp->sep, a2dp->session);
 			a2dp->sep = NULL;
@@ -261,6 +393,10 @@ static uint8_t headset_generate_capability(struct audio_device *dev,
 	pcm = (void *) codec;
 	pcm->sampling_rate = 8000;
 	if (dev->headset) {
+		if (headset_get_wideband(dev)) {
+			pcm->sampling_rate = 16000;
+			pcm->flags |= BT_PCM_FLAG_MSBC;
+		}
 		if (headset_get_nrec(dev))
 			pcm->flags |= BT_PCM_FLAG_NREC;
 		if (!headset_get_sco_hci(dev))
@@ -371,6 +507,7 @@ static void headset_resume_complete(struct audio_device *dev, void *user_data)
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_start_stream_rsp *rsp = (void *) buf;
 	struct bt_new_stream_ind *ind = (void *) buf;
+	int fd, ret;
 
 	client->req_id = 0;
 
@@ -383,6 +520,10 @@ static void headset_resume_complete(struct audio_device *dev, void *user_data)
 		goto failed;
 	}
 
+	fd = client_sco_fd(client, client->data_fd);
+	if (fd < 0)
+		goto failed;
+
 	memset(buf, 0, sizeof(buf));
 	rsp->h.type = BT_RESPONSE;
 	rsp->h.name = BT_START_STREAM;
@@ -397,7 +538,13 @@ static void headset_resume_complete(struct audio_device *dev, void *user_data)
 
 	unix_ipc_sendmsg(client, &ind->h);
 
-	if (unix_sendmsg_fd(client->sock, client->data_fd) < 0) {
+	ret = unix_sendmsg_fd(client, fd);
+
+	/* The client got its own copy of the relay end */
+	if (client->relay)
+		close(fd);
+
+	if (ret < 0) {
 		error("unix_sendmsg_fd: %s(%d)", strerror(errno), errno);
 		goto failed;
 	}
@@ -406,6 +553,7 @@ static void headset_resume_complete(struct audio_device *dev, void *user_data)
 
 failed:
 	error("headset_resume_complete: resume failed");
+	client_free_relay(client);
 	unix_ipc_error(client, BT_START_STREAM, EIO);
 }
 
@@ -415,6 +563,7 @@ static void gateway_resume_complete(struct audio_device *dev, GError *err, void
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_start_stream_rsp *rsp = (void *) buf;
 	struct bt_new_stream_ind *ind = (void *) buf;
+	int fd, ret;
 
 	if (err) {
 		unix_ipc_error(client, BT_START_STREAM, err->code);
@@ -436,8 +585,16 @@ static void gateway_resume_complete(struct audio_device *dev, GError *err, void
 	unix_ipc_sendmsg(client, &ind->h);
 
 	client->data_fd = gateway_get_sco_fd(dev);
-	if (unix_sendmsg_fd(client->sock, client->data_fd) < 0) {
+	fd = client_sco_fd(client, client->data_fd);
+
+	ret = unix_sendmsg_fd(client, fd);
+
+	if (client->relay)
+		close(fd);
+
+	if (ret < 0) {
 		error("unix_sendmsg_fd: %s(%d)", strerror(errno), errno);
+		client_free_relay(client);
 		unix_ipc_error(client, BT_START_STREAM, EIO);
 	}
 
@@ -621,6 +778,146 @@ static int a2dp_append_codec(struct bt_get_capabilities_rsp *rsp,
 	return 0;
 }
 
+static uint8_t a2dp_codec_lock(struct avdtp *session, uint8_t seid,
+						struct avdtp_stream *stream)
+{
+	struct a2dp_sep *sep;
+	uint8_t lock = 0;
+	GSList *l;
+
+	for (l = clients; l; l = l->next) {
+		struct unix_client *c = l->data;
+		struct a2dp_data *ca2dp = &c->d.a2dp;
+
+		if (ca2dp->session == session && c->seid == seid) {
+			lock = c->lock;
+			break;
+		}
+	}
+
+	sep = a2dp_get_sep(session, stream);
+	if (sep && a2dp_sep_get_lock(sep))
+		lock = BT_WRITE_LOCK;
+
+	return lock;
+}
+
+static void caps_cache_free(struct caps_cache *cache)
+{
+	g_free(cache->rsp);
+	g_free(cache);
+}
+
+static struct caps_cache *caps_cache_find(struct audio_device *dev,
+						struct avdtp *session,
+						service_type_t type,
+						uint8_t seid)
+{
+	GSList *l;
+
+	for (l = caps_cache; l; l = l->next) {
+		struct caps_cache *cache = l->data;
+
+		if (cache->dev == dev && cache->session == session &&
+				cache->type == type && cache->seid == seid)
+			return cache;
+	}
+
+	return NULL;
+}
+
+static void caps_cache_store(struct unix_client *client,
+				struct avdtp *session,
+				struct bt_get_capabilities_rsp *rsp,
+				struct avdtp_stream **streams,
+				unsigned int count)
+{
+	struct audio_device *dev = client->dev;
+	struct caps_cache *cache;
+
+	if (!avdtp_is_connected(&dev->src, &dev->dst))
+		return;
+
+	cache = caps_cache_find(dev, session, client->type, client->seid);
+	if (cache) {
+		caps_cache = g_slist_remove(caps_cache, cache);
+		caps_cache_free(cache);
+	}
+
+	cache = g_new0(struct caps_cache, 1);
+	cache->dev = dev;
+	cache->session = session;
+	cache->type = client->type;
+	cache->seid = client->seid;
+	cache->count = count;
+	memcpy(cache->streams, streams, count * sizeof(*streams));
+	cache->rsp = g_memdup(rsp, rsp->h.length);
+
+	caps_cache = g_slist_prepend(caps_cache, cache);
+}
+
+static void caps_cache_invalidate(struct audio_device *dev)
+{
+	GSList *l = caps_cache;
+
+	while (l) {
+		struct caps_cache *cache = l->data;
+
+		l = l->next;
+
+		if (cache->dev != dev)
+			continue;
+
+		caps_cache = g_slist_remove(caps_cache, cache);
+		caps_cache_free(cache);
+	}
+}
+
+/* Answers from the cache if every remote SEP still has the stream it had
+ * when the response was built, any (re)configuration since then creates
+ * or drops a stream. Only the locks change without that and they are
+ * refreshed for the requesting client. */
+static gboolean a2dp_send_cached_caps(struct audio_device *dev,
+						struct unix_client *client)
+{
+	struct avdtp *session = client->d.a2dp.session;
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_get_capabilities_rsp *rsp = (void *) buf;
+	struct caps_cache *cache;
+	size_t offset;
+	unsigned int i;
+
+	cache = caps_cache_find(dev, session, client->type, client->seid);
+	if (!cache)
+		return FALSE;
+
+	memcpy(buf, cache->rsp, cache->rsp->h.length);
+
+	for (i = 0, offset = sizeof(*rsp); i < cache->count; i++) {
+		codec_capabilities_t *codec = (void *) buf + offset;
+		struct avdtp_remote_sep *rsep;
+
+		rsep = avdtp_get_remote_sep(session, codec->seid);
+		if (!rsep || avdtp_get_stream(rsep) != cache->streams[i]) {
+			DBG("Cached capabilities of %s are stale", dev->path);
+			caps_cache = g_slist_remove(caps_cache, cache);
+			caps_cache_free(cache);
+			return FALSE;
+		}
+
+		codec->lock = a2dp_codec_lock(session, codec->seid,
+							cache->streams[i]);
+		offset += codec->length;
+	}
+
+	DBG("Capabilities of %s served from cache", dev->path);
+
+	client->dev = dev;
+	unix_ipc_sendmsg(client, &rsp->h);
+
+	return TRUE;
+}
+
 static void a2dp_discovery_complete(struct avdtp *session, GSList *seps,
 					struct avdtp_error *err,
 					void *user_data)
@@ -629,6 +926,8 @@ static void a2dp_discovery_complete(struct avdtp *session, GSList *seps,
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_get_capabilities_rsp *rsp = (void *) buf;
 	struct a2dp_data *a2dp = &client->d.a2dp;
+	struct avdtp_stream *streams[MAX_CACHED_CODECS];
+	unsigned int count = 0;
 
 	if (!g_slist_find(clients, client)) {
 		DBG("Client disconnected during discovery");
@@ -650,11 +949,9 @@ static void a2dp_discovery_complete(struct avdtp *session, GSList *seps,
 
 	for (; seps; seps = g_slist_next(seps)) {
 		struct avdtp_remote_sep *rsep = seps->data;
-		struct a2dp_sep *sep;
 		struct avdtp_service_capability *cap;
 		struct avdtp_stream *stream;
-		uint8_t type, seid, configured = 0, lock = 0;
-		GSList *cl;
+		uint8_t type, seid, configured = 0, lock;
 
 		type = avdtp_get_type(rsep);
 
@@ -679,23 +976,15 @@ static void a2dp_discovery_complete(struct avdtp *session, GSList *seps,
 				cap = avdtp_stream_get_codec(stream);
 		}
 
-		for (cl = clients; cl; cl = cl->next) {
-			struct unix_client *c = cl->data;
-			struct a2dp_data *ca2dp = &c->d.a2dp;
+		lock = a2dp_codec_lock(session, seid, stream);
 
-			if (ca2dp->session == session && c->seid == seid) {
-				lock = c->lock;
-				break;
-			}
-		}
-
-		sep = a2dp_get_sep(session, stream);
-		if (sep && a2dp_sep_get_lock(sep))
-			lock = BT_WRITE_LOCK;
-
-		a2dp_append_codec(rsp, cap, seid, type, configured, lock);
+		if (a2dp_append_codec(rsp, cap, seid, type, configured,
+								lock) == 0)
+			streams[count++] = stream;
 	}
 
+	caps_cache_store(client, session, rsp, streams, count);
+
 	unix_ipc_sendmsg(client, &rsp->h);
 
 	return;
@@ -783,10 +1072,25 @@ static void a2dp_resume_complete(struct avdtp *session,
 	struct bt_start_stream_rsp *rsp = (void *) buf;
 	struct bt_new_stream_ind *ind = (void *) buf;
 	struct a2dp_data *a2dp = &client->d.a2dp;
+	int fd = client->data_fd, ret;
 
 	if (err)
 		goto failed;
 
+	if (client->shared_pcm) {
+		client_free_ring(client);
+		client->ring = mixer_ring_new(a2dp->session, a2dp->stream,
+							client->group, &fd);
+		if (client->ring == NULL)
+			goto failed;
+	} else if (client->a2dp_relay) {
+		client_free_receiver(client);
+		client->receiver = a2dp_relay_new(a2dp->session, a2dp->stream,
+									&fd);
+		if (client->receiver == NULL)
+			goto failed;
+	}
+
 	memset(buf, 0, sizeof(buf));
 	rsp->h.type = BT_RESPONSE;
 	rsp->h.name = BT_START_STREAM;
@@ -794,6 +1098,11 @@ static void a2dp_resume_complete(struct avdtp *session,
 
 	unix_ipc_sendmsg(client, &rsp->h);
 
+	if (client->early_fd) {
+		client->early_fd = FALSE;
+		return;
+	}
+
 	memset(buf, 0, sizeof(buf));
 	ind->h.type = BT_RESPONSE;
 	ind->h.name = BT_NEW_STREAM;
@@ -801,7 +1110,13 @@ static void a2dp_resume_complete(struct avdtp *session,
 
 	unix_ipc_sendmsg(client, &ind->h);
 
-	if (unix_sendmsg_fd(client->sock, client->data_fd) < 0) {
+	ret = unix_sendmsg_fd(client, fd);
+
+	/* The ring stays mapped, the client got its own copy of the fd */
+	if (client->ring || client->receiver)
+		close(fd);
+
+	if (ret < 0) {
 		error("unix_sendmsg_fd: %s(%d)", strerror(errno), errno);
 		goto failed;
 	}
@@ -811,6 +1126,10 @@ static void a2dp_resume_complete(struct avdtp *session,
 failed:
 	error("resume failed");
 
+	client->early_fd = FALSE;
+	client_free_ring(client);
+	client_free_receiver(client);
+
 	unix_ipc_error(client, BT_START_STREAM, EIO);
 
 	if (client->cb_id > 0) {
@@ -872,6 +1191,9 @@ static void start_discovery(struct audio_device *dev, struct unix_client *client
 			goto failed;
 		}
 
+		if (a2dp_send_cached_caps(dev, client))
+			return;
+
 		err = avdtp_discover(a2dp->session, a2dp_discovery_complete,
 					client);
 		if (err) {
@@ -1072,6 +1394,31 @@ failed:
 	unix_ipc_error(client, BT_SET_CONFIGURATION, EIO);
 }
 
+/* Hands the stream fd out while START is still in flight, the transport
+ * channel is connected since the stream was opened */
+static void a2dp_send_early_fd(struct unix_client *client)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_new_stream_ind *ind = (void *) buf;
+
+	if (client->data_fd < 0) {
+		client->early_fd = FALSE;
+		return;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	ind->h.type = BT_RESPONSE;
+	ind->h.name = BT_NEW_STREAM;
+	ind->h.length = sizeof(*ind);
+
+	unix_ipc_sendmsg(client, &ind->h);
+
+	if (unix_sendmsg_fd(client, client->data_fd) < 0) {
+		error("unix_sendmsg_fd: %s(%d)", strerror(errno), errno);
+		client->early_fd = FALSE;
+	}
+}
+
 static void start_resume(struct audio_device *dev, struct unix_client *client)
 {
 	struct a2dp_data *a2dp = NULL;
@@ -1102,6 +1449,9 @@ static void start_resume(struct audio_device *dev, struct unix_client *client)
 					client);
 		client->cancel = a2dp_cancel;
 
+		if (id != 0 && client->early_fd)
+			a2dp_send_early_fd(client);
+
 		break;
 
 	case TYPE_HEADSET:
@@ -1179,6 +1529,9 @@ static void start_suspend(struct audio_device *dev, struct unix_client *client)
 			goto failed;
 		}
 
+		client_free_ring(client);
+		client_free_receiver(client);
+
 		id = a2dp_suspend(a2dp->session, a2dp->sep,
 					a2dp_suspend_complete, client);
 		client->cancel = a2dp_cancel;
@@ -1192,12 +1545,15 @@ static void start_suspend(struct audio_device *dev, struct unix_client *client)
 			goto failed;
 		}
 
+		client_free_relay(client);
+
 		id = headset_suspend_stream(dev, headset_suspend_complete,
 						client);
 		client->cancel = headset_cancel_stream;
 		break;
 
 	case TYPE_GATEWAY:
+		client_free_relay(client);
 		gateway_suspend_stream(dev);
 		client->cancel = gateway_cancel_stream;
 		headset_suspend_complete(dev, client);
@@ -1593,6 +1949,38 @@ static void handle_streamstart_req(struct unix_client *client,
 	if (!client->dev)
 		goto failed;
 
+	/* Older clients send the bare header or no group */
+	if (req->h.length > offsetof(struct bt_start_stream_req, flags)) {
+		client->early_fd = req->flags & BT_START_STREAM_EARLY_FD;
+		client->shared_pcm = req->flags & BT_START_STREAM_SHARED_PCM;
+		client->sco_relay = req->flags & BT_START_STREAM_SCO_RELAY;
+		client->a2dp_relay = req->flags & BT_START_STREAM_A2DP_RELAY;
+	} else {
+		client->early_fd = FALSE;
+		client->shared_pcm = FALSE;
+		client->sco_relay = FALSE;
+		client->a2dp_relay = FALSE;
+	}
+
+	if (req->h.length >= sizeof(*req))
+		client->group = req->group;
+	else
+		client->group = 0;
+
+	/* The ring and the receiver only exist once the stream is started */
+	if (client->shared_pcm || client->a2dp_relay)
+		client->early_fd = FALSE;
+
+	if (client->type != TYPE_SINK && client->type != TYPE_SOURCE)
+		client->shared_pcm = FALSE;
+
+	if (client->type != TYPE_HEADSET && client->type != TYPE_GATEWAY)
+		client->sco_relay = FALSE;
+
+	/* Only streams coming from a remote source are received */
+	if (client->type != TYPE_SOURCE || client->shared_pcm)
+		client->a2dp_relay = FALSE;
+
 	start_resume(client->dev, client);
 
 	return;
@@ -1694,41 +2082,16 @@ failed:
 	unix_ipc_error(client, BT_DELAY_REPORT, -err);
 }
 
-static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
+static void handle_message(struct unix_client *client,
+					bt_audio_msg_header_t *msghdr)
 {
-	char buf[BT_SUGGESTED_BUFFER_SIZE];
-	bt_audio_msg_header_t *msghdr = (void *) buf;
-	struct unix_client *client = data;
-	int len;
 	const char *type, *name;
 
-	if (cond & G_IO_NVAL)
-		return FALSE;
-
-	if (cond & (G_IO_HUP | G_IO_ERR)) {
-		DBG("Unix client disconnected (fd=%d)", client->sock);
-
-		goto failed;
-	}
-
-	memset(buf, 0, sizeof(buf));
-
-	len = recv(client->sock, buf, sizeof(buf), 0);
-	if (len < 0) {
-		error("recv: %s (%d)", strerror(errno), errno);
-		goto failed;
-	}
-
 	type = bt_audio_strtype(msghdr->type);
 	name = bt_audio_strname(msghdr->name);
 
 	DBG("Audio API: %s <- %s", type, name);
 
-	if (msghdr->length != len) {
-		error("Invalid message: length mismatch");
-		goto failed;
-	}
-
 	switch (msghdr->name) {
 	case BT_GET_CAPABILITIES:
 		handle_getcapabilities_req(client,
@@ -1766,6 +2129,61 @@ static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
 		error("Audio API: received unexpected message name %d",
 				msghdr->name);
 	}
+}
+
+static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct unix_client *client = data;
+	bt_audio_msg_header_t *msghdr = (void *) client->inbuf;
+	uint16_t length;
+	int len;
+
+	if (cond & G_IO_NVAL)
+		return FALSE;
+
+	if (cond & (G_IO_HUP | G_IO_ERR)) {
+		DBG("Unix client disconnected (fd=%d)", client->sock);
+
+		goto failed;
+	}
+
+	len = recv(client->sock, client->inbuf + client->inlen,
+					sizeof(client->inbuf) - client->inlen, 0);
+	if (len <= 0) {
+		if (len < 0)
+			error("recv: %s (%d)", strerror(errno), errno);
+		goto failed;
+	}
+
+	client->inlen += len;
+
+	/* Clients may send several requests without waiting for the
+	 * replies, handle all of them and send back the replies at once */
+	client->batching = TRUE;
+
+	while (client->inlen >= sizeof(*msghdr)) {
+		length = msghdr->length;
+
+		if (length < sizeof(*msghdr) || length > sizeof(buf)) {
+			error("Invalid message: length mismatch");
+			goto failed;
+		}
+
+		if (client->inlen < length)
+			break;
+
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, client->inbuf, length);
+
+		client->inlen -= length;
+		memmove(client->inbuf, client->inbuf + length, client->inlen);
+
+		handle_message(client, (void *) buf);
+	}
+
+	client->batching = FALSE;
+	unix_ipc_flush(client);
 
 	return TRUE;
 
@@ -1836,6 +2254,8 @@ void unix_device_removed(struct audio_device *dev)
 			client_free(client);
 		}
 	}
+
+	caps_cache_invalidate(dev);
 }
 
 void unix_delay_report(struct audio_device *dev, uint8_t seid, uint16_t delay)
@@ -1861,6 +2281,16 @@ void unix_delay_report(struct audio_device *dev, uint8_t seid, uint16_t delay)
 	}
 }
 
+static void avdtp_state_callback(struct audio_device *dev,
+					struct avdtp *session,
+					avdtp_session_state_t old_state,
+					avdtp_session_state_t new_state,
+					void *user_data)
+{
+	if (new_state == AVDTP_SESSION_STATE_DISCONNECTED)
+		caps_cache_invalidate(dev);
+}
+
 int unix_init(void)
 {
 	GIOChannel *io;
@@ -1900,6 +2330,8 @@ int unix_init(void)
 							server_cb, NULL);
 	g_io_channel_unref(io);
 
+	avdtp_callback_id = avdtp_add_state_cb(avdtp_state_callback, NULL);
+
 	DBG("Unix socket created: %d", sk);
 
 	return 0;
@@ -1909,6 +2341,15 @@ void unix_exit(void)
 {
 	g_slist_foreach(clients, (GFunc) client_free, NULL);
 	g_slist_free(clients);
+
+	g_slist_foreach(caps_cache, (GFunc) caps_cache_free, NULL);
+	g_slist_free(caps_cache);
+	caps_cache = NULL;
+
+	if (avdtp_callback_id) {
+		avdtp_remove_state_cb(avdtp_callback_id);
+		avdtp_callback_id = 0;
+	}
 	if (unix_sock >= 0) {
 		close(unix_sock);
 		unix_sock = -1;
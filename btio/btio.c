@@ -61,6 +61,12 @@ struct set_opts {
 	uint8_t mode;
 	int flushable;
 	uint8_t force_active;
+	uint16_t voice;
+	int fcs;
+	uint16_t txwin;
+	int sndbuf;
+	int rcvbuf;
+	int priority;
 };
 
 struct connect {
@@ -73,15 +79,75 @@ struct accept {
 	BtIOConnect connect;
 	gpointer user_data;
 	GDestroyNotify destroy;
+	guint32 defer_ms;
 };
 
+/* Incoming connection handed to a confirm callback, waiting for the upper
+ * layers to call bt_io_accept or drop it. Entries of dropped ones expire
+ * with the kernel's own defer timeout. */
+struct deferred {
+	GIOChannel *io;
+	bdaddr_t dst;
+	GTimeVal start;
+};
+
+static GSList *deferred_list = NULL;
+
+static BtIOAdmit admit_func = NULL;
+static gpointer admit_data = NULL;
+static guint admit_max_pending = 0;
+
 struct server {
+	BtIOType type;
 	BtIOConnect connect;
 	BtIOConfirm confirm;
 	gpointer user_data;
 	GDestroyNotify destroy;
 };
 
+/* What bt_io_get reads back from a socket that cannot change while it is
+ * connected, kept for the duration of the callback reporting it */
+struct io_info {
+	GIOChannel *io;
+	gboolean have_peers;
+	union {
+		struct sockaddr_l2 l2;
+		struct sockaddr_rc rc;
+		struct sockaddr_sco sco;
+	} src, dst;
+	gboolean have_opts;
+	union {
+		struct l2cap_options l2;
+		struct sco_options sco;
+	} opts;
+	gboolean have_conninfo;
+	uint16_t handle;
+	uint8_t dev_class[3];
+	guint32 defer_ms;
+};
+
+static struct io_info *current_info = NULL;
+
+struct _BtIOGroup {
+	int ref;
+	bdaddr_t dst;
+	GSList *channels;
+	guint pending;
+	guint connected;
+	BtIOGroupComplete complete;
+	gpointer user_data;
+	GDestroyNotify destroy;
+};
+
+struct group_channel {
+	BtIOGroup *group;
+	GIOChannel *io;
+	BtIOConnect connect;
+	gpointer user_data;
+	GDestroyNotify destroy;
+	GTimer *timer;
+};
+
 static void server_remove(struct server *server)
 {
 	if (server->destroy)
@@ -117,10 +183,35 @@ static gboolean check_nval(GIOChannel *io)
 	return FALSE;
 }
 
+static struct io_info *info_push(struct io_info *info, GIOChannel *io)
+{
+	struct io_info *prev = current_info;
+
+	memset(info, 0, sizeof(*info));
+	info->io = io;
+	current_info = info;
+
+	return prev;
+}
+
+static void info_pop(struct io_info *prev)
+{
+	current_info = prev;
+}
+
+static struct io_info *info_lookup(GIOChannel *io)
+{
+	if (current_info != NULL && current_info->io == io)
+		return current_info;
+
+	return NULL;
+}
+
 static gboolean accept_cb(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
 	struct accept *accept = user_data;
+	struct io_info info, *prev;
 	GError *err = NULL;
 
 	/* If the user aborted this accept attempt */
@@ -131,7 +222,10 @@ static gboolean accept_cb(GIOChannel *io, GIOCondition cond,
 		g_set_error(&err, BT_IO_ERROR, BT_IO_ERROR_DISCONNECTED,
 				"HUP or ERR on socket");
 
+	prev = info_push(&info, io);
+	info.defer_ms = accept->defer_ms;
 	accept->connect(io, err, accept->user_data);
+	info_pop(prev);
 
 	g_clear_error(&err);
 
@@ -142,6 +236,7 @@ static gboolean connect_cb(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
 	struct connect *conn = user_data;
+	struct io_info info, *prev;
 	GError *gerr = NULL;
 
 	/* If the user aborted this connect attempt */
@@ -163,7 +258,9 @@ static gboolean connect_cb(GIOChannel *io, GIOCondition cond,
 		g_set_error(&gerr, BT_IO_ERROR, BT_IO_ERROR_CONNECT_FAILED,
 				"HUP or ERR on socket");
 
+	prev = info_push(&info, io);
 	conn->connect(io, gerr, conn->user_data);
+	info_pop(prev);
 
 	if (gerr)
 		g_error_free(gerr);
@@ -171,12 +268,121 @@ static gboolean connect_cb(GIOChannel *io, GIOCondition cond,
 	return FALSE;
 }
 
+static guint32 elapsed_ms(const GTimeVal *start, const GTimeVal *now)
+{
+	return (now->tv_sec - start->tv_sec) * 1000 +
+				(now->tv_usec - start->tv_usec) / 1000;
+}
+
+static guint deferred_expire(const bdaddr_t *dst)
+{
+	GTimeVal now;
+	GSList *l, *next;
+	guint pending = 0;
+
+	g_get_current_time(&now);
+
+	for (l = deferred_list; l; l = next) {
+		struct deferred *d = l->data;
+
+		next = l->next;
+
+		if (now.tv_sec - d->start.tv_sec > DEFAULT_DEFER_TIMEOUT) {
+			deferred_list = g_slist_delete_link(deferred_list, l);
+			g_free(d);
+			continue;
+		}
+
+		if (bacmp(&d->dst, dst) == 0)
+			pending++;
+	}
+
+	return pending;
+}
+
+static void deferred_add(GIOChannel *io, const bdaddr_t *dst)
+{
+	struct deferred *d;
+
+	d = g_new0(struct deferred, 1);
+	d->io = io;
+	bacpy(&d->dst, dst);
+	g_get_current_time(&d->start);
+
+	deferred_list = g_slist_prepend(deferred_list, d);
+}
+
+static guint32 deferred_remove(GIOChannel *io)
+{
+	GTimeVal now;
+	GSList *l;
+
+	for (l = deferred_list; l; l = l->next) {
+		struct deferred *d = l->data;
+		guint32 ms;
+
+		if (d->io != io)
+			continue;
+
+		g_get_current_time(&now);
+		ms = elapsed_ms(&d->start, &now);
+
+		deferred_list = g_slist_delete_link(deferred_list, l);
+		g_free(d);
+
+		return ms;
+	}
+
+	return 0;
+}
+
+static void peer_address(BtIOType type, const void *addr, bdaddr_t *dst)
+{
+	switch (type) {
+	case BT_IO_L2RAW:
+	case BT_IO_L2CAP:
+		bacpy(dst, &((const struct sockaddr_l2 *) addr)->l2_bdaddr);
+		break;
+	case BT_IO_RFCOMM:
+		bacpy(dst, &((const struct sockaddr_rc *) addr)->rc_bdaddr);
+		break;
+	case BT_IO_SCO:
+		bacpy(dst, &((const struct sockaddr_sco *) addr)->sco_bdaddr);
+		break;
+	}
+}
+
+/* Runs before any upper layer sees the connection, so that rejecting a
+ * peer costs no more than closing the socket */
+static gboolean admit(struct server *server, const bdaddr_t *dst)
+{
+	guint pending;
+
+	pending = server->confirm ? deferred_expire(dst) : 0;
+
+	if (admit_max_pending > 0 && pending >= admit_max_pending)
+		return FALSE;
+
+	if (admit_func && !admit_func(dst, pending, admit_data))
+		return FALSE;
+
+	return TRUE;
+}
+
 static gboolean server_cb(GIOChannel *io, GIOCondition cond,
 							gpointer user_data)
 {
 	struct server *server = user_data;
+	struct io_info info, *prev;
 	int srv_sock, cli_sock;
 	GIOChannel *cli_io;
+	union {
+		struct sockaddr_l2 l2;
+		struct sockaddr_rc rc;
+		struct sockaddr_sco sco;
+	} addr;
+	socklen_t len;
+	bdaddr_t dst;
 
 	/* If the user closed the server */
 	if ((cond & G_IO_NVAL) || check_nval(io))
@@ -184,26 +390,48 @@ static gboolean server_cb(GIOChannel *io, GIOCondition cond,
 
 	srv_sock = g_io_channel_unix_get_fd(io);
 
-	cli_sock = accept(srv_sock, NULL, NULL);
-	if (cli_sock < 0)
-		return TRUE;
+	/* Drain the whole backlog, the socket is non-blocking */
+	while (1) {
+		memset(&addr, 0, sizeof(addr));
+		len = sizeof(addr);
 
-	cli_io = g_io_channel_unix_new(cli_sock);
+		cli_sock = accept(srv_sock, (struct sockaddr *) &addr, &len);
+		if (cli_sock < 0)
+			break;
 
-	g_io_channel_set_close_on_unref(cli_io, TRUE);
-	g_io_channel_set_flags(cli_io, G_IO_FLAG_NONBLOCK, NULL);
+		peer_address(server->type, &addr, &dst);
 
-	if (server->confirm)
-		server->confirm(cli_io, server->user_data);
-	else
-		server->connect(cli_io, NULL, server->user_data);
+		if (!admit(server, &dst)) {
+			close(cli_sock);
+			continue;
+		}
+
+		cli_io = g_io_channel_unix_new(cli_sock);
+
+		g_io_channel_set_close_on_unref(cli_io, TRUE);
+		g_io_channel_set_flags(cli_io, G_IO_FLAG_NONBLOCK, NULL);
+
+		prev = info_push(&info, cli_io);
+
+		if (server->confirm) {
+			deferred_add(cli_io, &dst);
+			server->confirm(cli_io, server->user_data);
+		} else
+			server->connect(cli_io, NULL, server->user_data);
 
-	g_io_channel_unref(cli_io);
+		info_pop(prev);
+
+		g_io_channel_unref(cli_io);
+
+		/* The server may have been closed by the callback */
+		if (check_nval(io))
+			return FALSE;
+	}
 
 	return TRUE;
 }
 
-static void server_add(GIOChannel *io, BtIOConnect connect,
+static void server_add(GIOChannel *io, BtIOType type, BtIOConnect connect,
 				BtIOConfirm confirm, gpointer user_data,
 				GDestroyNotify destroy)
 {
@@ -211,6 +439,7 @@ static void server_add(GIOChannel *io, BtIOConnect connect,
 	GIOCondition cond;
 
 	server = g_new0(struct server, 1);
+	server->type = type;
 	server->connect = connect;
 	server->confirm = confirm;
 	server->user_data = user_data;
@@ -238,7 +467,7 @@ static void connect_add(GIOChannel *io, BtIOConnect connect,
 }
 
 static void accept_add(GIOChannel *io, BtIOConnect connect, gpointer user_data,
-							GDestroyNotify destroy)
+				GDestroyNotify destroy, guint32 defer_ms)
 {
 	struct accept *accept;
 	GIOCondition cond;
@@ -247,6 +476,7 @@ static void accept_add(GIOChannel *io, BtIOConnect connect, gpointer user_data,
 	accept->connect = connect;
 	accept->user_data = user_data;
 	accept->destroy = destroy;
+	accept->defer_ms = defer_ms;
 
 	cond = G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
 	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, accept_cb, accept,
@@ -539,11 +769,73 @@ static int l2cap_set_flushable(int sock, gboolean flushable)
 	return 0;
 }
 
+static gboolean sock_set(int sock, int sndbuf, int rcvbuf, int priority,
+								GError **err)
+{
+	if (sndbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+							sizeof(sndbuf)) < 0) {
+		ERROR_FAILED(err, "setsockopt(SO_SNDBUF)", errno);
+		return FALSE;
+	}
+
+	if (rcvbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+							sizeof(rcvbuf)) < 0) {
+		ERROR_FAILED(err, "setsockopt(SO_RCVBUF)", errno);
+		return FALSE;
+	}
+
+	if (priority >= 0 && setsockopt(sock, SOL_SOCKET, SO_PRIORITY,
+					&priority, sizeof(priority)) < 0) {
+		ERROR_FAILED(err, "setsockopt(SO_PRIORITY)", errno);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean sock_get(int sock, BtIOOption opt, int *value, GError **err)
+{
+	socklen_t len = sizeof(*value);
+
+	switch (opt) {
+	case BT_IO_OPT_SNDBUF:
+		if (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, value, &len) < 0) {
+			ERROR_FAILED(err, "getsockopt(SO_SNDBUF)", errno);
+			return FALSE;
+		}
+		break;
+	case BT_IO_OPT_RCVBUF:
+		if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, value, &len) < 0) {
+			ERROR_FAILED(err, "getsockopt(SO_RCVBUF)", errno);
+			return FALSE;
+		}
+		break;
+	case BT_IO_OPT_PRIORITY:
+		if (getsockopt(sock, SOL_SOCKET, SO_PRIORITY, value,
+								&len) < 0) {
+			ERROR_FAILED(err, "getsockopt(SO_PRIORITY)", errno);
+			return FALSE;
+		}
+		return TRUE;
+	default:
+		g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
+					"Unknown option %d", opt);
+		return FALSE;
+	}
+
+	/* The kernel doubles the requested buffer size for its bookkeeping
+	 * overhead (see man 7 socket), report what was asked for */
+	*value /= 2;
+
+	return TRUE;
+}
+
 static gboolean l2cap_set(int sock, int sec_level, uint16_t imtu,
-				uint16_t omtu, uint8_t mode, int master,
-				int flushable, uint8_t force_active, GError **err)
+				uint16_t omtu, uint8_t mode, int fcs,
+				uint16_t txwin, int master, int flushable,
+				uint8_t force_active, GError **err)
 {
-	if (imtu || omtu || mode) {
+	if (imtu || omtu || mode || fcs >= 0 || txwin) {
 		struct l2cap_options l2o;
 		socklen_t len;
 
@@ -561,6 +853,10 @@ static gboolean l2cap_set(int sock, int sec_level, uint16_t imtu,
 			l2o.omtu = omtu;
 		if (mode)
 			l2o.mode = mode;
+		if (fcs >= 0)
+			l2o.fcs = fcs;
+		if (txwin)
+			l2o.txwin_size = txwin;
 
 		if (setsockopt(sock, SOL_L2CAP, L2CAP_OPTIONS, &l2o,
 							sizeof(l2o)) < 0) {
@@ -672,11 +968,24 @@ static int sco_connect(int sock, const bdaddr_t *dst)
 	return 0;
 }
 
-static gboolean sco_set(int sock, uint16_t mtu, GError **err)
+static gboolean sco_set(int sock, uint16_t mtu, uint16_t voice,
+								GError **err)
 {
 	struct sco_options sco_opt;
+	struct bt_voice bt_voice;
 	socklen_t len;
 
+	/* The kernel default is CVSD, only ask for anything else */
+	if (voice) {
+		memset(&bt_voice, 0, sizeof(bt_voice));
+		bt_voice.setting = voice;
+		if (setsockopt(sock, SOL_BLUETOOTH, BT_VOICE, &bt_voice,
+						sizeof(bt_voice)) < 0) {
+			ERROR_FAILED(err, "setsockopt(BT_VOICE)", errno);
+			return FALSE;
+		}
+	}
+
 	if (!mtu)
 		return TRUE;
 
@@ -712,6 +1021,8 @@ static gboolean parse_set_opts(struct set_opts *opts, GError **err,
 	opts->mode = L2CAP_MODE_BASIC;
 	opts->flushable = -1;
 	opts->force_active = 1;
+	opts->fcs = -1;
+	opts->priority = -1;
 
 	while (opt != BT_IO_OPT_INVALID) {
 		switch (opt) {
@@ -773,6 +1084,24 @@ static gboolean parse_set_opts(struct set_opts *opts, GError **err,
 		case BT_IO_OPT_POWER_ACTIVE:
 			opts->force_active = va_arg(args, int);
 			break;
+		case BT_IO_OPT_VOICE:
+			opts->voice = va_arg(args, int);
+			break;
+		case BT_IO_OPT_FCS:
+			opts->fcs = va_arg(args, gboolean);
+			break;
+		case BT_IO_OPT_TXWIN:
+			opts->txwin = va_arg(args, int);
+			break;
+		case BT_IO_OPT_SNDBUF:
+			opts->sndbuf = va_arg(args, int);
+			break;
+		case BT_IO_OPT_RCVBUF:
+			opts->rcvbuf = va_arg(args, int);
+			break;
+		case BT_IO_OPT_PRIORITY:
+			opts->priority = va_arg(args, int);
+			break;
 		default:
 			g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
 					"Unknown option %d", opt);
@@ -785,11 +1114,18 @@ static gboolean parse_set_opts(struct set_opts *opts, GError **err,
 	return TRUE;
 }
 
-static gboolean get_peers(int sock, struct sockaddr *src, struct sockaddr *dst,
-				socklen_t len, GError **err)
+static gboolean get_peers(struct io_info *info, int sock, struct sockaddr *src,
+				struct sockaddr *dst, socklen_t len,
+				GError **err)
 {
 	socklen_t olen;
 
+	if (info && info->have_peers) {
+		memcpy(src, &info->src, len);
+		memcpy(dst, &info->dst, len);
+		return TRUE;
+	}
+
 	memset(src, 0, len);
 	olen = len;
 	if (getsockname(sock, src, &olen) < 0) {
@@ -804,9 +1140,60 @@ static gboolean get_peers(int sock, struct sockaddr *src, struct sockaddr *dst,
 		return FALSE;
 	}
 
+	if (info) {
+		memcpy(&info->src, src, len);
+		memcpy(&info->dst, dst, len);
+		info->have_peers = TRUE;
+	}
+
 	return TRUE;
 }
 
+static int get_opts(struct io_info *info, int sock, int level, int optname,
+						void *opts, socklen_t len)
+{
+	if (info && info->have_opts) {
+		memcpy(opts, &info->opts, len);
+		return 0;
+	}
+
+	memset(opts, 0, len);
+	if (getsockopt(sock, level, optname, opts, &len) < 0)
+		return -errno;
+
+	if (info) {
+		memcpy(&info->opts, opts, len);
+		info->have_opts = TRUE;
+	}
+
+	return 0;
+}
+
+static int get_conninfo(struct io_info *info, int sock,
+			int (*get_info)(int, uint16_t *, uint8_t *),
+			uint16_t *handle, uint8_t *dev_class)
+{
+	int err;
+
+	if (info && info->have_conninfo) {
+		*handle = info->handle;
+		memcpy(dev_class, info->dev_class, 3);
+		return 0;
+	}
+
+	err = get_info(sock, handle, dev_class);
+	if (err < 0)
+		return err;
+
+	if (info) {
+		info->handle = *handle;
+		memcpy(info->dev_class, dev_class, 3);
+		info->have_conninfo = TRUE;
+	}
+
+	return 0;
+}
+
 static int l2cap_get_info(int sock, uint16_t *handle, uint8_t *dev_class)
 {
 	struct l2cap_conninfo info;
@@ -843,8 +1230,8 @@ static int l2cap_get_flushable(int sock, gboolean *flushable)
 	return 0;
 }
 
-static gboolean l2cap_get(int sock, GError **err, BtIOOption opt1,
-								va_list args)
+static gboolean l2cap_get(struct io_info *info, int sock, GError **err,
+						BtIOOption opt1, va_list args)
 {
 	BtIOOption opt = opt1;
 	struct sockaddr_l2 src, dst;
@@ -855,14 +1242,13 @@ static gboolean l2cap_get(int sock, GError **err, BtIOOption opt1,
 	socklen_t len;
 	gboolean flushable = FALSE;
 
-	len = sizeof(l2o);
-	memset(&l2o, 0, len);
-	if (getsockopt(sock, SOL_L2CAP, L2CAP_OPTIONS, &l2o, &len) < 0) {
+	if (get_opts(info, sock, SOL_L2CAP, L2CAP_OPTIONS, &l2o,
+							sizeof(l2o)) < 0) {
 		ERROR_FAILED(err, "getsockopt(L2CAP_OPTIONS)", errno);
 		return FALSE;
 	}
 
-	if (!get_peers(sock, (struct sockaddr *) &src,
+	if (!get_peers(info, sock, (struct sockaddr *) &src,
 				(struct sockaddr *) &dst, sizeof(src), err))
 		return FALSE;
 
@@ -880,6 +1266,9 @@ static gboolean l2cap_get(int sock, GError **err, BtIOOption opt1,
 		case BT_IO_OPT_DEST_BDADDR:
 			bacpy(va_arg(args, bdaddr_t *), &dst.l2_bdaddr);
 			break;
+		case BT_IO_OPT_DEFER_ELAPSED:
+			*(va_arg(args, guint32 *)) = info ? info->defer_ms : 0;
+			break;
 		case BT_IO_OPT_DEFER_TIMEOUT:
 			len = sizeof(int);
 			if (getsockopt(sock, SOL_BLUETOOTH, BT_DEFER_SETUP,
@@ -920,14 +1309,16 @@ static gboolean l2cap_get(int sock, GError **err, BtIOOption opt1,
 				(flags & L2CAP_LM_MASTER) ? TRUE : FALSE;
 			break;
 		case BT_IO_OPT_HANDLE:
-			if (l2cap_get_info(sock, &handle, dev_class) < 0) {
+			if (get_conninfo(info, sock, l2cap_get_info,
+						&handle, dev_class) < 0) {
 				ERROR_FAILED(err, "L2CAP_CONNINFO", errno);
 				return FALSE;
 			}
 			*(va_arg(args, uint16_t *)) = handle;
 			break;
 		case BT_IO_OPT_CLASS:
-			if (l2cap_get_info(sock, &handle, dev_class) < 0) {
+			if (get_conninfo(info, sock, l2cap_get_info,
+						&handle, dev_class) < 0) {
 				ERROR_FAILED(err, "L2CAP_CONNINFO", errno);
 				return FALSE;
 			}
@@ -936,6 +1327,12 @@ static gboolean l2cap_get(int sock, GError **err, BtIOOption opt1,
 		case BT_IO_OPT_MODE:
 			*(va_arg(args, uint8_t *)) = l2o.mode;
 			break;
+		case BT_IO_OPT_FCS:
+			*(va_arg(args, gboolean *)) = l2o.fcs ? TRUE : FALSE;
+			break;
+		case BT_IO_OPT_TXWIN:
+			*(va_arg(args, uint16_t *)) = l2o.txwin_size;
+			break;
 		case BT_IO_OPT_FLUSHABLE:
 			if (l2cap_get_flushable(sock, &flushable) < 0) {
 				ERROR_FAILED(err, "get_flushable", errno);
@@ -948,6 +1345,12 @@ static gboolean l2cap_get(int sock, GError **err, BtIOOption opt1,
 						va_arg(args, uint8_t *), err))
 				return FALSE;
 			break;
+		case BT_IO_OPT_SNDBUF:
+		case BT_IO_OPT_RCVBUF:
+		case BT_IO_OPT_PRIORITY:
+			if (!sock_get(sock, opt, va_arg(args, int *), err))
+				return FALSE;
+			break;
 		default:
 			g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
 					"Unknown option %d", opt);
@@ -978,8 +1381,8 @@ static int rfcomm_get_info(int sock, uint16_t *handle, uint8_t *dev_class)
 	return 0;
 }
 
-static gboolean rfcomm_get(int sock, GError **err, BtIOOption opt1,
-								va_list args)
+static gboolean rfcomm_get(struct io_info *info, int sock, GError **err,
+						BtIOOption opt1, va_list args)
 {
 	BtIOOption opt = opt1;
 	struct sockaddr_rc src, dst;
@@ -988,7 +1391,7 @@ static gboolean rfcomm_get(int sock, GError **err, BtIOOption opt1,
 	uint8_t dev_class[3];
 	uint16_t handle;
 
-	if (!get_peers(sock, (struct sockaddr *) &src,
+	if (!get_peers(info, sock, (struct sockaddr *) &src,
 				(struct sockaddr *) &dst, sizeof(src), err))
 		return FALSE;
 
@@ -1006,6 +1409,9 @@ static gboolean rfcomm_get(int sock, GError **err, BtIOOption opt1,
 		case BT_IO_OPT_DEST_BDADDR:
 			bacpy(va_arg(args, bdaddr_t *), &dst.rc_bdaddr);
 			break;
+		case BT_IO_OPT_DEFER_ELAPSED:
+			*(va_arg(args, guint32 *)) = info ? info->defer_ms : 0;
+			break;
 		case BT_IO_OPT_DEFER_TIMEOUT:
 			len = sizeof(int);
 			if (getsockopt(sock, SOL_BLUETOOTH, BT_DEFER_SETUP,
@@ -1042,14 +1448,16 @@ static gboolean rfcomm_get(int sock, GError **err, BtIOOption opt1,
 				(flags & RFCOMM_LM_MASTER) ? TRUE : FALSE;
 			break;
 		case BT_IO_OPT_HANDLE:
-			if (rfcomm_get_info(sock, &handle, dev_class) < 0) {
+			if (get_conninfo(info, sock, rfcomm_get_info,
+						&handle, dev_class) < 0) {
 				ERROR_FAILED(err, "RFCOMM_CONNINFO", errno);
 				return FALSE;
 			}
 			*(va_arg(args, uint16_t *)) = handle;
 			break;
 		case BT_IO_OPT_CLASS:
-			if (rfcomm_get_info(sock, &handle, dev_class) < 0) {
+			if (get_conninfo(info, sock, rfcomm_get_info,
+						&handle, dev_class) < 0) {
 				ERROR_FAILED(err, "RFCOMM_CONNINFO", errno);
 				return FALSE;
 			}
@@ -1060,6 +1468,12 @@ static gboolean rfcomm_get(int sock, GError **err, BtIOOption opt1,
 						va_arg(args, uint8_t *), err))
 				return FALSE;
 			break;
+		case BT_IO_OPT_SNDBUF:
+		case BT_IO_OPT_RCVBUF:
+		case BT_IO_OPT_PRIORITY:
+			if (!sock_get(sock, opt, va_arg(args, int *), err))
+				return FALSE;
+			break;
 		default:
 			g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
 					"Unknown option %d", opt);
@@ -1090,23 +1504,24 @@ static int sco_get_info(int sock, uint16_t *handle, uint8_t *dev_class)
 	return 0;
 }
 
-static gboolean sco_get(int sock, GError **err, BtIOOption opt1, va_list args)
+static gboolean sco_get(struct io_info *info, int sock, GError **err,
+						BtIOOption opt1, va_list args)
 {
 	BtIOOption opt = opt1;
 	struct sockaddr_sco src, dst;
 	struct sco_options sco_opt;
+	struct bt_voice voice;
 	socklen_t len;
 	uint8_t dev_class[3];
 	uint16_t handle;
 
-	len = sizeof(sco_opt);
-	memset(&sco_opt, 0, len);
-	if (getsockopt(sock, SOL_SCO, SCO_OPTIONS, &sco_opt, &len) < 0) {
+	if (get_opts(info, sock, SOL_SCO, SCO_OPTIONS, &sco_opt,
+							sizeof(sco_opt)) < 0) {
 		ERROR_FAILED(err, "getsockopt(SCO_OPTIONS)", errno);
 		return FALSE;
 	}
 
-	if (!get_peers(sock, (struct sockaddr *) &src,
+	if (!get_peers(info, sock, (struct sockaddr *) &src,
 				(struct sockaddr *) &dst, sizeof(src), err))
 		return FALSE;
 
@@ -1130,19 +1545,35 @@ static gboolean sco_get(int sock, GError **err, BtIOOption opt1, va_list args)
 			*(va_arg(args, uint16_t *)) = sco_opt.mtu;
 			break;
 		case BT_IO_OPT_HANDLE:
-			if (sco_get_info(sock, &handle, dev_class) < 0) {
+			if (get_conninfo(info, sock, sco_get_info,
+						&handle, dev_class) < 0) {
 				ERROR_FAILED(err, "SCO_CONNINFO", errno);
 				return FALSE;
 			}
 			*(va_arg(args, uint16_t *)) = handle;
 			break;
 		case BT_IO_OPT_CLASS:
-			if (sco_get_info(sock, &handle, dev_class) < 0) {
+			if (get_conninfo(info, sock, sco_get_info,
+						&handle, dev_class) < 0) {
 				ERROR_FAILED(err, "SCO_CONNINFO", errno);
 				return FALSE;
 			}
 			memcpy(va_arg(args, uint8_t *), dev_class, 3);
 			break;
+		case BT_IO_OPT_VOICE:
+			len = sizeof(voice);
+			memset(&voice, 0, len);
+			if (getsockopt(sock, SOL_BLUETOOTH, BT_VOICE, &voice,
+								&len) < 0)
+				voice.setting = BT_VOICE_CVSD_16BIT;
+			*(va_arg(args, uint16_t *)) = voice.setting;
+			break;
+		case BT_IO_OPT_SNDBUF:
+		case BT_IO_OPT_RCVBUF:
+		case BT_IO_OPT_PRIORITY:
+			if (!sock_get(sock, opt, va_arg(args, int *), err))
+				return FALSE;
+			break;
 		default:
 			g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
 					"Unknown option %d", opt);
@@ -1158,18 +1589,20 @@ static gboolean sco_get(int sock, GError **err, BtIOOption opt1, va_list args)
 static gboolean get_valist(GIOChannel *io, BtIOType type, GError **err,
 						BtIOOption opt1, va_list args)
 {
+	struct io_info *info;
 	int sock;
 
 	sock = g_io_channel_unix_get_fd(io);
+	info = info_lookup(io);
 
 	switch (type) {
 	case BT_IO_L2RAW:
 	case BT_IO_L2CAP:
-		return l2cap_get(sock, err, opt1, args);
+		return l2cap_get(info, sock, err, opt1, args);
 	case BT_IO_RFCOMM:
-		return rfcomm_get(sock, err, opt1, args);
+		return rfcomm_get(info, sock, err, opt1, args);
 	case BT_IO_SCO:
-		return sco_get(sock, err, opt1, args);
+		return sco_get(info, sock, err, opt1, args);
 	}
 
 	g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
@@ -1202,17 +1635,26 @@ gboolean bt_io_accept(GIOChannel *io, BtIOConnect connect, gpointer user_data,
 		}
 	}
 
-	accept_add(io, connect, user_data, destroy);
+	accept_add(io, connect, user_data, destroy, deferred_remove(io));
 
 	return TRUE;
 }
 
+void bt_io_set_admission(BtIOAdmit admit, guint max_pending,
+							gpointer user_data)
+{
+	admit_func = admit;
+	admit_data = user_data;
+	admit_max_pending = max_pending;
+}
+
 gboolean bt_io_set(GIOChannel *io, BtIOType type, GError **err,
 							BtIOOption opt1, ...)
 {
 	va_list args;
 	gboolean ret;
 	struct set_opts opts;
+	struct io_info *info;
 	int sock;
 
 	va_start(args, opt1);
@@ -1224,17 +1666,25 @@ gboolean bt_io_set(GIOChannel *io, BtIOType type, GError **err,
 
 	sock = g_io_channel_unix_get_fd(io);
 
+	/* MTU and mode may change, security level is never kept */
+	info = info_lookup(io);
+	if (info != NULL)
+		info->have_opts = FALSE;
+
+	if (!sock_set(sock, opts.sndbuf, opts.rcvbuf, opts.priority, err))
+		return FALSE;
+
 	switch (type) {
 	case BT_IO_L2RAW:
 	case BT_IO_L2CAP:
 		return l2cap_set(sock, opts.sec_level, opts.imtu, opts.omtu,
-				opts.mode, opts.master, opts.flushable,
-				opts.force_active, err);
+				opts.mode, opts.fcs, opts.txwin, opts.master,
+				opts.flushable, opts.force_active, err);
 	case BT_IO_RFCOMM:
 		return rfcomm_set(sock, opts.sec_level, opts.master, opts.force_active,
 				err);
 	case BT_IO_SCO:
-		return sco_set(sock, opts.mtu, err);
+		return sco_set(sock, opts.mtu, opts.voice, err);
 	}
 
 	g_set_error(err, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
@@ -1271,8 +1721,8 @@ static GIOChannel *create_io(BtIOType type, gboolean server,
 		if (l2cap_bind(sock, &opts->src, server ? opts->psm : 0,
 							opts->cid, err) < 0)
 			goto failed;
-		if (!l2cap_set(sock, opts->sec_level, 0, 0, 0, -1, -1, opts->force_active,
-					err))
+		if (!l2cap_set(sock, opts->sec_level, 0, 0, 0, -1, 0, -1, -1,
+					opts->force_active, err))
 			goto failed;
 		break;
 	case BT_IO_L2CAP:
@@ -1285,7 +1735,8 @@ static GIOChannel *create_io(BtIOType type, gboolean server,
 							opts->cid, err) < 0)
 			goto failed;
 		if (!l2cap_set(sock, opts->sec_level, opts->imtu, opts->omtu,
-				opts->mode, opts->master, opts->flushable,
+				opts->mode, opts->fcs, opts->txwin,
+				opts->master, opts->flushable,
 				opts->force_active, err))
 			goto failed;
 		break;
@@ -1310,7 +1761,7 @@ static GIOChannel *create_io(BtIOType type, gboolean server,
 		}
 		if (sco_bind(sock, &opts->src, err) < 0)
 			goto failed;
-		if (!sco_set(sock, opts->mtu, err))
+		if (!sco_set(sock, opts->mtu, opts->voice, err))
 			goto failed;
 		break;
 	default:
@@ -1319,6 +1770,9 @@ static GIOChannel *create_io(BtIOType type, gboolean server,
 		return NULL;
 	}
 
+	if (!sock_set(sock, opts->sndbuf, opts->rcvbuf, opts->priority, err))
+		goto failed;
+
 	io = g_io_channel_unix_new(sock);
 
 	g_io_channel_set_close_on_unref(io, TRUE);
@@ -1332,24 +1786,13 @@ failed:
 	return NULL;
 }
 
-GIOChannel *bt_io_connect(BtIOType type, BtIOConnect connect,
-				gpointer user_data, GDestroyNotify destroy,
-				GError **gerr, BtIOOption opt1, ...)
+static GIOChannel *connect_io(BtIOType type, struct set_opts *opts,
+								GError **gerr)
 {
 	GIOChannel *io;
-	va_list args;
-	struct set_opts opts;
 	int err, sock;
-	gboolean ret;
-
-	va_start(args, opt1);
-	ret = parse_set_opts(&opts, gerr, opt1, args);
-	va_end(args);
-
-	if (ret == FALSE)
-		return NULL;
 
-	io = create_io(type, FALSE, &opts, gerr);
+	io = create_io(type, FALSE, opts, gerr);
 	if (io == NULL)
 		return NULL;
 
@@ -1357,20 +1800,21 @@ GIOChannel *bt_io_connect(BtIOType type, BtIOConnect connect,
 
 	switch (type) {
 	case BT_IO_L2RAW:
-		err = l2cap_connect(sock, &opts.dst, 0, opts.cid);
+		err = l2cap_connect(sock, &opts->dst, 0, opts->cid);
 		break;
 	case BT_IO_L2CAP:
-		err = l2cap_connect(sock, &opts.dst, opts.psm, opts.cid);
+		err = l2cap_connect(sock, &opts->dst, opts->psm, opts->cid);
 		break;
 	case BT_IO_RFCOMM:
-		err = rfcomm_connect(sock, &opts.dst, opts.channel);
+		err = rfcomm_connect(sock, &opts->dst, opts->channel);
 		break;
 	case BT_IO_SCO:
-		err = sco_connect(sock, &opts.dst);
+		err = sco_connect(sock, &opts->dst);
 		break;
 	default:
 		g_set_error(gerr, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
 						"Unknown BtIO type %d", type);
+		g_io_channel_unref(io);
 		return NULL;
 	}
 
@@ -1381,11 +1825,173 @@ GIOChannel *bt_io_connect(BtIOType type, BtIOConnect connect,
 		return NULL;
 	}
 
+	return io;
+}
+
+GIOChannel *bt_io_connect(BtIOType type, BtIOConnect connect,
+				gpointer user_data, GDestroyNotify destroy,
+				GError **gerr, BtIOOption opt1, ...)
+{
+	GIOChannel *io;
+	va_list args;
+	struct set_opts opts;
+	gboolean ret;
+
+	va_start(args, opt1);
+	ret = parse_set_opts(&opts, gerr, opt1, args);
+	va_end(args);
+
+	if (ret == FALSE)
+		return NULL;
+
+	io = connect_io(type, &opts, gerr);
+	if (io == NULL)
+		return NULL;
+
 	connect_add(io, connect, user_data, destroy);
 
 	return io;
 }
 
+BtIOGroup *bt_io_group_new(BtIOGroupComplete complete, gpointer user_data,
+							GDestroyNotify destroy)
+{
+	BtIOGroup *group;
+
+	group = g_new0(BtIOGroup, 1);
+	group->ref = 1;
+	group->complete = complete;
+	group->user_data = user_data;
+	group->destroy = destroy;
+
+	return group;
+}
+
+BtIOGroup *bt_io_group_ref(BtIOGroup *group)
+{
+	group->ref++;
+
+	return group;
+}
+
+void bt_io_group_unref(BtIOGroup *group)
+{
+	GSList *l;
+
+	if (--group->ref > 0)
+		return;
+
+	for (l = group->channels; l; l = l->next) {
+		struct group_channel *chan = l->data;
+
+		g_timer_destroy(chan->timer);
+		g_free(chan);
+	}
+
+	g_slist_free(group->channels);
+
+	if (group->destroy)
+		group->destroy(group->user_data);
+
+	g_free(group);
+}
+
+static void group_connect_cb(GIOChannel *io, GError *err, gpointer user_data)
+{
+	struct group_channel *chan = user_data;
+
+	g_timer_stop(chan->timer);
+
+	if (err == NULL)
+		chan->group->connected++;
+
+	chan->connect(io, err, chan->user_data);
+}
+
+/* Runs once per channel, whether it connected, failed or was aborted by
+ * shutting down its socket, so the group always gets to complete */
+static void group_channel_remove(gpointer user_data)
+{
+	struct group_channel *chan = user_data;
+	BtIOGroup *group = chan->group;
+
+	g_timer_stop(chan->timer);
+
+	if (chan->destroy)
+		chan->destroy(chan->user_data);
+
+	if (--group->pending == 0 && group->complete)
+		group->complete(group, group->connected,
+				g_slist_length(group->channels) -
+				group->connected, group->user_data);
+
+	bt_io_group_unref(group);
+}
+
+GIOChannel *bt_io_group_connect(BtIOGroup *group, BtIOType type,
+				BtIOConnect connect, gpointer user_data,
+				GDestroyNotify destroy, GError **gerr,
+				BtIOOption opt1, ...)
+{
+	struct group_channel *chan;
+	GIOChannel *io;
+	va_list args;
+	struct set_opts opts;
+	gboolean ret;
+
+	va_start(args, opt1);
+	ret = parse_set_opts(&opts, gerr, opt1, args);
+	va_end(args);
+
+	if (ret == FALSE)
+		return NULL;
+
+	if (group->channels == NULL)
+		bacpy(&group->dst, &opts.dst);
+	else if (bacmp(&group->dst, &opts.dst) != 0) {
+		g_set_error(gerr, BT_IO_ERROR, BT_IO_ERROR_INVALID_ARGS,
+				"All channels of a group go to the same peer");
+		return NULL;
+	}
+
+	chan = g_new0(struct group_channel, 1);
+	chan->timer = g_timer_new();
+
+	io = connect_io(type, &opts, gerr);
+	if (io == NULL) {
+		g_timer_destroy(chan->timer);
+		g_free(chan);
+		return NULL;
+	}
+
+	chan->group = bt_io_group_ref(group);
+	chan->io = io;
+	chan->connect = connect;
+	chan->user_data = user_data;
+	chan->destroy = destroy;
+
+	group->channels = g_slist_append(group->channels, chan);
+	group->pending++;
+
+	connect_add(io, group_connect_cb, chan, group_channel_remove);
+
+	return io;
+}
+
+gdouble bt_io_group_elapsed(BtIOGroup *group, GIOChannel *io)
+{
+	GSList *l;
+
+	for (l = group->channels; l; l = l->next) {
+		struct group_channel *chan = l->data;
+
+		if (chan->io == io)
+			return g_timer_elapsed(chan->timer, NULL);
+	}
+
+	return -1;
+}
+
 GIOChannel *bt_io_listen(BtIOType type, BtIOConnect connect,
 				BtIOConfirm confirm, gpointer user_data,
 				GDestroyNotify destroy, GError **err,
@@ -1426,7 +2032,7 @@ GIOChannel *bt_io_listen(BtIOType type, BtIOConnect connect,
 		return NULL;
 	}
 
-	server_add(io, connect, confirm, user_data, destroy);
+	server_add(io, type, connect, confirm, user_data, destroy);
 
 	return io;
 }
@@ -26,6 +26,8 @@
 
 #include <glib.h>
 
+#include <bluetooth/bluetooth.h>
+
 typedef enum {
 	BT_IO_ERROR_DISCONNECTED,
 	BT_IO_ERROR_CONNECT_FAILED,
@@ -66,6 +68,13 @@ typedef enum {
 	BT_IO_OPT_MODE,
 	BT_IO_OPT_FLUSHABLE,
 	BT_IO_OPT_POWER_ACTIVE,
+	BT_IO_OPT_VOICE,
+	BT_IO_OPT_FCS,
+	BT_IO_OPT_TXWIN,
+	BT_IO_OPT_SNDBUF,
+	BT_IO_OPT_RCVBUF,
+	BT_IO_OPT_PRIORITY,
+	BT_IO_OPT_DEFER_ELAPSED,
 } BtIOOption;
 
 typedef enum {
@@ -79,9 +88,15 @@ typedef void (*BtIOConfirm)(GIOChannel *io, gpointer user_data);
 
 typedef void (*BtIOConnect)(GIOChannel *io, GError *err, gpointer user_data);
 
+typedef gboolean (*BtIOAdmit)(const bdaddr_t *dst, guint pending,
+							gpointer user_data);
+
 gboolean bt_io_accept(GIOChannel *io, BtIOConnect connect, gpointer user_data,
 					GDestroyNotify destroy, GError **err);
 
+void bt_io_set_admission(BtIOAdmit admit, guint max_pending,
+							gpointer user_data);
+
 gboolean bt_io_set(GIOChannel *io, BtIOType type, GError **err,
 						BtIOOption opt1, ...);
 
@@ -92,6 +107,23 @@ GIOChannel *bt_io_connect(BtIOType type, BtIOConnect connect,
 				gpointer user_data, GDestroyNotify destroy,
 				GError **err, BtIOOption opt1, ...);
 
+typedef struct _BtIOGroup BtIOGroup;
+
+typedef void (*BtIOGroupComplete)(BtIOGroup *group, guint connected,
+					guint failed, gpointer user_data);
+
+BtIOGroup *bt_io_group_new(BtIOGroupComplete complete, gpointer user_data,
+							GDestroyNotify destroy);
+BtIOGroup *bt_io_group_ref(BtIOGroup *group);
+void bt_io_group_unref(BtIOGroup *group);
+
+GIOChannel *bt_io_group_connect(BtIOGroup *group, BtIOType type,
+				BtIOConnect connect, gpointer user_data,
+				GDestroyNotify destroy, GError **err,
+				BtIOOption opt1, ...);
+
+gdouble bt_io_group_elapsed(BtIOGroup *group, GIOChannel *io);
+
 GIOChannel *bt_io_listen(BtIOType type, BtIOConnect connect,
 				BtIOConfirm confirm, gpointer user_data,
 				GDestroyNotify destroy, GError **err,
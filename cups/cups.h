@@ -34,5 +34,15 @@ enum {					/**** Backend exit codes ****/
 int sdp_search_spp(sdp_session_t *sdp, uint8_t *channel);
 int sdp_search_hcrp(sdp_session_t *sdp, unsigned short *ctrl_psm, unsigned short *data_psm);
 
+struct cups_progress {
+	struct timeval start;
+	struct timeval last;
+	unsigned long bytes;
+};
+
+void progress_start(struct cups_progress *p);
+void progress_update(struct cups_progress *p, int len);
+void progress_finish(struct cups_progress *p);
+
 int spp_print(bdaddr_t *src, bdaddr_t *dst, uint8_t channel, int fd, int copies, const char *cups_class);
 int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned short data_psm, int fd, int copies, const char *cups_class);
@@ -28,8 +28,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/poll.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
@@ -50,6 +53,10 @@
 #define HCRP_STATUS_CREDIT_SYNC_ERROR	0x0002
 #define HCRP_STATUS_GENERIC_FAILURE	0xffff
 
+/* Ask for more credit while this many MTU sized packets can still be
+ * sent, so the printer's answer arrives before the data runs dry */
+#define HCRP_CREDIT_LOW_WATER		4
+
 struct hcrp_pdu_hdr {
 	uint16_t pid;
 	uint16_t tid;
@@ -112,21 +119,28 @@ static int hcrp_credit_grant(int sk, uint16_t tid, uint32_t credit)
 	return 0;
 }
 
-static int hcrp_credit_request(int sk, uint16_t tid, uint32_t *credit)
+static int hcrp_credit_request_send(int sk, uint16_t tid)
 {
 	struct hcrp_pdu_hdr hdr;
-	struct hcrp_credit_request_rp rp;
-	unsigned char buf[128];
 	int len;
 
 	hdr.pid = htons(HCRP_PDU_CREDIT_REQUEST);
 	hdr.tid = htons(tid);
 	hdr.plen = htons(0);
-	memcpy(buf, &hdr, HCRP_PDU_HDR_SIZE);
-	len = write(sk, buf, HCRP_PDU_HDR_SIZE);
+	len = write(sk, &hdr, HCRP_PDU_HDR_SIZE);
 	if (len < 0)
 		return len;
 
+	return 0;
+}
+
+static int hcrp_credit_request_reply(int sk, uint32_t *credit)
+{
+	struct hcrp_pdu_hdr hdr;
+	struct hcrp_credit_request_rp rp;
+	unsigned char buf[128];
+	int len;
+
 	len = read(sk, buf, sizeof(buf));
 	if (len < 0)
 		return len;
@@ -190,9 +204,11 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 {
 	struct sockaddr_l2 addr;
 	struct l2cap_options opts;
+	struct cups_progress progress;
+	struct pollfd p;
 	socklen_t size;
-	unsigned char buf[2048];
-	int i, ctrl_sk, data_sk, count, len, timeout = 0;
+	unsigned char *buf;
+	int i, ctrl_sk, data_sk, count, len, timeout = 0, pending = 0;
 	unsigned int mtu;
 	uint8_t status;
 	uint16_t tid = 0;
@@ -288,6 +304,14 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 
 	mtu = opts.omtu;
 
+	buf = malloc(mtu);
+	if (!buf) {
+		perror("ERROR: Can't allocate buffer");
+		close(data_sk);
+		close(ctrl_sk);
+		return CUPS_BACKEND_FAILED;
+	}
+
 	/* Ignore SIGTERM signals if printing from stdin */
 	if (fd == 0) {
 #ifdef HAVE_SIGSET
@@ -305,6 +329,7 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 	tid = hcrp_get_next_tid(tid);
 	if (hcrp_credit_grant(ctrl_sk, tid, 0) < 0) {
 		fprintf(stderr, "ERROR: Can't grant initial credits\n");
+		free(buf);
 		close(data_sk);
 		close(ctrl_sk);
 		if (cups_class)
@@ -313,6 +338,8 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 			return CUPS_BACKEND_RETRY;
 	}
 
+	progress_start(&progress);
+
 	for (i = 0; i < copies; i++) {
 
 		if (fd != 0) {
@@ -321,11 +348,25 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 		}
 
 		while (1) {
-			if (credit < mtu) {
+			/* Keep one credit request in flight while there is
+			 * still credit left to send with */
+			if (!pending && credit < HCRP_CREDIT_LOW_WATER * mtu) {
 				tid = hcrp_get_next_tid(tid);
-				if (!hcrp_credit_request(ctrl_sk, tid, &tmp)) {
-					credit += tmp;
-					timeout = 0;
+				if (!hcrp_credit_request_send(ctrl_sk, tid))
+					pending = 1;
+			}
+
+			if (pending) {
+				p.fd = ctrl_sk;
+				p.events = POLLIN;
+				p.revents = 0;
+
+				if (poll(&p, 1, credit ? 0 : 1000) > 0) {
+					pending = 0;
+					if (!hcrp_credit_request_reply(ctrl_sk, &tmp)) {
+						credit += tmp;
+						timeout = 0;
+					}
 				}
 			}
 
@@ -337,17 +378,29 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 					break;
 				}
 
-				sleep(1);
+				/* The printer granted nothing, back off */
+				if (!pending)
+					sleep(1);
 				continue;
 			}
 
-			count = read(fd, buf, (credit > mtu) ? mtu : credit);
+			/* Fill whole packets, a pipe may hand out less */
+			size = (credit > mtu) ? mtu : credit;
+			count = 0;
+			while (count < (int) size) {
+				len = read(fd, buf + count, size - count);
+				if (len <= 0)
+					break;
+				count += len;
+			}
+
 			if (count <= 0)
 				break;
 
 			len = write(data_sk, buf, count);
 			if (len < 0) {
 				perror("ERROR: Error writing to device");
+				free(buf);
 				close(data_sk);
 				close(ctrl_sk);
 				return CUPS_BACKEND_FAILED;
@@ -357,10 +410,16 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 				fprintf(stderr, "ERROR: Can't send complete data\n");
 
 			credit -= len;
+
+			progress_update(&progress, len);
 		}
 
 	}
 
+	progress_finish(&progress);
+
+	free(buf);
+
 	close(data_sk);
 	close(ctrl_sk);
 
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <glib.h>
 
@@ -56,6 +57,56 @@ static gboolean doing_disco = FALSE;
 
 #define ATTRID_1284ID 0x0300
 
+static long elapsed_msec(const struct timeval *from, const struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+				(to->tv_usec - from->tv_usec) / 1000;
+}
+
+static double progress_rate(struct cups_progress *p, const struct timeval *now)
+{
+	long msec = elapsed_msec(&p->start, now);
+
+	return msec > 0 ? (double) p->bytes / msec * 1000 / 1024 : 0;
+}
+
+void progress_start(struct cups_progress *p)
+{
+	gettimeofday(&p->start, NULL);
+	p->last = p->start;
+	p->bytes = 0;
+}
+
+/* Tells CUPS how far the job got, at most once per second */
+void progress_update(struct cups_progress *p, int len)
+{
+	struct timeval now;
+
+	p->bytes += len;
+
+	gettimeofday(&now, NULL);
+	if (elapsed_msec(&p->last, &now) < 1000)
+		return;
+
+	p->last = now;
+
+	fprintf(stderr, "INFO: Sent %lu KB (%.1f KB/s)\n",
+				p->bytes / 1024, progress_rate(p, &now));
+}
+
+void progress_finish(struct cups_progress *p)
+{
+	struct timeval now;
+	long msec;
+
+	gettimeofday(&now, NULL);
+	msec = elapsed_msec(&p->start, &now);
+
+	fprintf(stderr, "DEBUG: Sent %lu bytes in %ld.%03lds (%.1f KB/s)\n",
+				p->bytes, msec / 1000, msec % 1000,
+						progress_rate(p, &now));
+}
+
 struct context_data {
 	gboolean found;
 	char *id;
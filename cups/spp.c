@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
@@ -38,11 +39,34 @@
 
 #include "cups.h"
 
+/* RFCOMM segments the stream into frames itself, so hand it large
+ * chunks and let the socket buffer keep the link busy */
+#define SPP_CHUNK_SIZE	16384
+
+static int write_all(int sk, const unsigned char *buf, int len)
+{
+	while (len > 0) {
+		int n = write(sk, buf, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
 int spp_print(bdaddr_t *src, bdaddr_t *dst, uint8_t channel, int fd, int copies, const char *cups_class)
 {
 	struct sockaddr_rc addr;
-	unsigned char buf[2048];
-	int i, sk, err, len;
+	struct cups_progress progress;
+	unsigned char buf[SPP_CHUNK_SIZE];
+	int i, sk, len;
 
 	if ((sk = socket(PF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM)) < 0) {
 		perror("ERROR: Can't create socket");
@@ -94,6 +118,8 @@ int spp_print(bdaddr_t *src, bdaddr_t *dst, uint8_t channel, int fd, int copies,
 #endif /* HAVE_SIGSET */
 	}
 
+	progress_start(&progress);
+
 	for (i = 0; i < copies; i++) {
 
 		if (fd != 0) {
@@ -102,16 +128,19 @@ int spp_print(bdaddr_t *src, bdaddr_t *dst, uint8_t channel, int fd, int copies,
 		}
 
 		while ((len = read(fd, buf, sizeof(buf))) > 0) {
-			err = write(sk, buf, len);
-			if (err < 0) {
+			if (write_all(sk, buf, len) < 0) {
 				perror("ERROR: Error writing to device");
 				close(sk);
 				return CUPS_BACKEND_FAILED;
 			}
+
+			progress_update(&progress, len);
 		}
 
 	}
 
+	progress_finish(&progress);
+
 	close(sk);
 
 	return CUPS_BACKEND_OK;
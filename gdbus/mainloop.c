@@ -36,6 +36,11 @@
 
 #define DISPATCH_TIMEOUT  0
 
+/* Upper bound on the work done by a single dispatch iteration, so that
+ * other sources on the same main loop get to run under D-Bus load */
+#define DISPATCH_BUDGET_MSGS	32
+#define DISPATCH_BUDGET_USEC	5000
+
 #define info(fmt...)
 #define error(fmt...)
 #define debug(fmt...)
@@ -70,25 +75,65 @@ static gboolean disconnected_signal(DBusConnection *conn,
 	return TRUE;
 }
 
+static dbus_int32_t dispatch_slot = -1;
+
+static glong elapsed_usec(const GTimeVal *start)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+
+	return (now.tv_sec - start->tv_sec) * G_USEC_PER_SEC +
+						now.tv_usec - start->tv_usec;
+}
+
 static gboolean message_dispatch(void *data)
 {
 	DBusConnection *conn = data;
+	DBusDispatchStatus status;
+	GTimeVal start;
+	int count = 0;
 
 	dbus_connection_ref(conn);
 
-	/* Dispatch messages */
-	while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS);
+	g_get_current_time(&start);
+
+	/* Dispatch messages until the queue is empty or the budget is
+	 * spent, in which case the rest is left for the next iteration */
+	do {
+		status = dbus_connection_dispatch(conn);
+	} while (status == DBUS_DISPATCH_DATA_REMAINS &&
+				++count < DISPATCH_BUDGET_MSGS &&
+				elapsed_usec(&start) < DISPATCH_BUDGET_USEC);
+
+	if (status != DBUS_DISPATCH_DATA_REMAINS)
+		dbus_connection_set_data(conn, dispatch_slot, NULL, NULL);
 
 	dbus_connection_unref(conn);
 
-	return FALSE;
+	return status == DBUS_DISPATCH_DATA_REMAINS;
 }
 
 static inline void queue_dispatch(DBusConnection *conn,
 						DBusDispatchStatus status)
 {
-	if (status == DBUS_DISPATCH_DATA_REMAINS)
-		g_timeout_add(DISPATCH_TIMEOUT, message_dispatch, conn);
+	guint id;
+
+	if (status != DBUS_DISPATCH_DATA_REMAINS)
+		return;
+
+	if (dispatch_slot < 0 &&
+			dbus_connection_allocate_data_slot(&dispatch_slot) == FALSE)
+		return;
+
+	/* Only one dispatch source per connection */
+	if (dbus_connection_get_data(conn, dispatch_slot) != NULL)
+		return;
+
+	id = g_timeout_add(DISPATCH_TIMEOUT, message_dispatch, conn);
+
+	dbus_connection_set_data(conn, dispatch_slot, GUINT_TO_POINTER(id),
+									NULL);
 }
 
 static gboolean watch_func(GIOChannel *chan, GIOCondition cond, gpointer data)
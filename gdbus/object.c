@@ -40,6 +40,7 @@
 struct generic_data {
 	unsigned int refcount;
 	GSList *interfaces;
+	GHashTable *interface_index;	/* name -> interface_data */
 	char *introspect;
 };
 
@@ -48,6 +49,10 @@ struct interface_data {
 	const GDBusMethodTable *methods;
 	const GDBusSignalTable *signals;
 	const GDBusPropertyTable *properties;
+	GHashTable *method_index;	/* name -> first table entry */
+	GHashTable *signal_index;	/* name -> table entry */
+	char *xml;			/* introspection, built on demand */
+	DBusMessage *properties;	/* GetProperties reply, on demand */
 	void *user_data;
 	GDBusDestroyFunction destroy;
 };
@@ -164,15 +169,24 @@ static void generate_introspection_xml(DBusConnection *conn,
 
 	g_string_append_printf(gstr, "<node>\n");
 
+	/* The tables of an interface never change, so its part of the
+	 * document is only generated once */
 	for (list = data->interfaces; list; list = list->next) {
 		struct interface_data *iface = list->data;
 
-		g_string_append_printf(gstr, "\t<interface name=\"%s\">\n",
-								iface->name);
+		if (iface->xml == NULL) {
+			GString *ixml = g_string_new(NULL);
 
-		generate_interface_xml(gstr, iface);
+			g_string_append_printf(ixml,
+					"\t<interface name=\"%s\">\n",
+					iface->name);
+			generate_interface_xml(ixml, iface);
+			g_string_append_printf(ixml, "\t</interface>\n");
 
-		g_string_append_printf(gstr, "\t</interface>\n");
+			iface->xml = g_string_free(ixml, FALSE);
+		}
+
+		g_string_append(gstr, iface->xml);
 	}
 
 	if (!dbus_connection_list_registered(conn, path, &children))
@@ -395,22 +409,40 @@ static void generic_unregister(DBusConnection *connection, void *user_data)
 {
 	struct generic_data *data = user_data;
 
+	g_hash_table_destroy(data->interface_index);
 	g_free(data->introspect);
 	g_free(data);
 }
 
-static struct interface_data *find_interface(GSList *interfaces,
+static struct interface_data *find_interface(struct generic_data *data,
 						const char *name)
 {
-	GSList *list;
-
 	if (name == NULL)
 		return NULL;
 
-	for (list = interfaces; list; list = list->next) {
-		struct interface_data *iface = list->data;
-		if (!strcmp(name, iface->name))
-			return iface;
+	return g_hash_table_lookup(data->interface_index, name);
+}
+
+static const GDBusMethodTable *find_method(struct interface_data *iface,
+							DBusMessage *message)
+{
+	const GDBusMethodTable *method;
+	const char *member;
+
+	member = dbus_message_get_member(message);
+	if (member == NULL)
+		return NULL;
+
+	method = g_hash_table_lookup(iface->method_index, member);
+
+	/* Methods sharing a name but not a signature follow the first */
+	for (; method && method->name && method->function; method++) {
+		if (strcmp(method->name, member) != 0)
+			continue;
+
+		if (dbus_message_has_signature(message,
+						method->signature) == TRUE)
+			return method;
 	}
 
 	return NULL;
@@ -424,31 +456,24 @@ static DBusHandlerResult generic_message(DBusConnection *connection,
 	const GDBusMethodTable *method;
 	const char *interface;
 
+	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
 	interface = dbus_message_get_interface(message);
 
-	iface = find_interface(data->interfaces, interface);
+	iface = find_interface(data, interface);
 	if (iface == NULL)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-	for (method = iface->methods; method &&
-			method->name && method->function; method++) {
-		if (dbus_message_is_method_call(message, iface->name,
-							method->name) == FALSE)
-			continue;
-
-		if (dbus_message_has_signature(message,
-						method->signature) == FALSE)
-			continue;
-
-		if (check_privilege(connection, message, method,
-						iface->user_data) == TRUE)
-			return DBUS_HANDLER_RESULT_HANDLED;
+	method = find_method(iface, message);
+	if (method == NULL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-		return process_message(connection, message, method,
-							iface->user_data);
-	}
+	if (check_privilege(connection, message, method,
+					iface->user_data) == TRUE)
+		return DBUS_HANDLER_RESULT_HANDLED;
 
-	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	return process_message(connection, message, method, iface->user_data);
 }
 
 static DBusObjectPathVTable generic_table = {
@@ -456,6 +481,178 @@ static DBusObjectPathVTable generic_table = {
 	.message_function	= generic_message,
 };
 
+/* Any signal from an interface may come with a property change, be it
+ * PropertyChanged or one of the object added/removed notifications */
+static void invalidate_properties(DBusConnection *conn, DBusMessage *signal)
+{
+	struct generic_data *data = NULL;
+	struct interface_data *iface;
+	const char *path;
+
+	path = dbus_message_get_path(signal);
+	if (path == NULL)
+		return;
+
+	if (dbus_connection_get_object_path_data(conn, path,
+					(void *) &data) == FALSE || data == NULL)
+		return;
+
+	iface = find_interface(data, dbus_message_get_interface(signal));
+	if (iface == NULL || iface->properties == NULL)
+		return;
+
+	dbus_message_unref(iface->properties);
+	iface->properties = NULL;
+}
+
+static DBusMessage *get_properties(DBusConnection *conn, const char *path,
+						struct interface_data *iface)
+{
+	const GDBusMethodTable *method;
+	DBusMessage *msg, *reply;
+
+	if (iface->properties != NULL)
+		return iface->properties;
+
+	msg = dbus_message_new_method_call(NULL, path, iface->name,
+							"GetProperties");
+	if (msg == NULL)
+		return NULL;
+
+	/* Only synchronous, unprivileged handlers can be called inline */
+	method = find_method(iface, msg);
+	if (method == NULL || method->privilege != 0 ||
+				method->flags & G_DBUS_METHOD_FLAG_ASYNC)
+		goto done;
+
+	reply = method->function(conn, msg, iface->user_data);
+	if (reply == NULL)
+		goto done;
+
+	if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+			dbus_message_has_signature(reply, "a{sv}") == FALSE) {
+		dbus_message_unref(reply);
+		goto done;
+	}
+
+	iface->properties = reply;
+
+done:
+	dbus_message_unref(msg);
+
+	return iface->properties;
+}
+
+static void copy_iter(DBusMessageIter *to, DBusMessageIter *from)
+{
+	int type;
+
+	while ((type = dbus_message_iter_get_arg_type(from)) !=
+							DBUS_TYPE_INVALID) {
+		DBusMessageIter sub_from, sub_to;
+		char *sig = NULL;
+
+		if (dbus_type_is_basic(type)) {
+			union {
+				dbus_uint64_t u64;
+				double dbl;
+				const char *str;
+			} value;
+
+			dbus_message_iter_get_basic(from, &value);
+			dbus_message_iter_append_basic(to, type, &value);
+			dbus_message_iter_next(from);
+			continue;
+		}
+
+		dbus_message_iter_recurse(from, &sub_from);
+
+		if (type == DBUS_TYPE_ARRAY)
+			sig = dbus_message_iter_get_signature(from);
+		else if (type == DBUS_TYPE_VARIANT)
+			sig = dbus_message_iter_get_signature(&sub_from);
+
+		/* Arrays take the element signature, past the 'a' */
+		dbus_message_iter_open_container(to, type,
+				type == DBUS_TYPE_ARRAY ? sig + 1 : sig,
+				&sub_to);
+		copy_iter(&sub_to, &sub_from);
+		dbus_message_iter_close_container(to, &sub_to);
+
+		dbus_free(sig);
+
+		dbus_message_iter_next(from);
+	}
+}
+
+static void append_object(DBusConnection *conn, const char *path,
+				struct generic_data *data, DBusMessageIter *array)
+{
+	DBusMessageIter entry, ifaces;
+	GSList *l;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_DICT_ENTRY,
+								NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH, &path);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &ifaces);
+
+	for (l = data->interfaces; l != NULL; l = l->next) {
+		struct interface_data *iface = l->data;
+		DBusMessageIter iface_entry, reply_iter;
+		DBusMessage *reply;
+
+		reply = get_properties(conn, path, iface);
+		if (reply == NULL)
+			continue;
+
+		dbus_message_iter_open_container(&ifaces, DBUS_TYPE_DICT_ENTRY,
+							NULL, &iface_entry);
+		dbus_message_iter_append_basic(&iface_entry, DBUS_TYPE_STRING,
+								&iface->name);
+		dbus_message_iter_init(reply, &reply_iter);
+		copy_iter(&iface_entry, &reply_iter);
+		dbus_message_iter_close_container(&ifaces, &iface_entry);
+	}
+
+	dbus_message_iter_close_container(&entry, &ifaces);
+	dbus_message_iter_close_container(array, &entry);
+}
+
+static void append_objects(DBusConnection *conn, const char *path,
+							DBusMessageIter *array)
+{
+	struct generic_data *data = NULL;
+	char **children;
+	int i;
+
+	if (dbus_connection_get_object_path_data(conn, path,
+						(void *) &data) && data != NULL)
+		append_object(conn, path, data, array);
+
+	if (dbus_connection_list_registered(conn, path, &children) == FALSE)
+		return;
+
+	for (i = 0; children[i]; i++) {
+		char *child;
+
+		child = g_strdup_printf("%s/%s",
+				g_str_equal(path, "/") ? "" : path, children[i]);
+		append_objects(conn, child, array);
+		g_free(child);
+	}
+
+	dbus_free_string_array(children);
+}
+
+/* Only the closest registered ancestor lists a new or removed child:
+ * the ones above it already list the path leading to it */
 static void invalidate_parent_data(DBusConnection *conn, const char *child_path)
 {
 	struct generic_data *data = NULL;
@@ -479,10 +676,10 @@ static void invalidate_parent_data(DBusConnection *conn, const char *child_path)
 		goto done;
 	}
 
-	invalidate_parent_data(conn, parent_path);
-
-	if (data == NULL)
+	if (data == NULL) {
+		invalidate_parent_data(conn, parent_path);
 		goto done;
+	}
 
 	g_free(data->introspect);
 	data->introspect = NULL;
@@ -504,6 +701,8 @@ static void add_interface(struct generic_data *data, const char *name,
 				GDBusDestroyFunction destroy)
 {
 	struct interface_data *iface;
+	const GDBusMethodTable *method;
+	const GDBusSignalTable *signal;
 
 	iface = g_new0(struct interface_data, 1);
 	iface->name = g_strdup(name);
@@ -513,7 +712,28 @@ static void add_interface(struct generic_data *data, const char *name,
 	iface->user_data = user_data;
 	iface->destroy = destroy;
 
+	/* Keys point into the tables, which outlive the registration */
+	iface->method_index = g_hash_table_new(g_str_hash, g_str_equal);
+	for (method = methods; method && method->name && method->function;
+								method++) {
+		if (g_hash_table_lookup(iface->method_index,
+							method->name) == NULL)
+			g_hash_table_insert(iface->method_index,
+					(gpointer) method->name,
+					(gpointer) method);
+	}
+
+	iface->signal_index = g_hash_table_new(g_str_hash, g_str_equal);
+	for (signal = signals; signal && signal->name; signal++) {
+		if (g_hash_table_lookup(iface->signal_index,
+							signal->name) == NULL)
+			g_hash_table_insert(iface->signal_index,
+					(gpointer) signal->name,
+					(gpointer) signal);
+	}
+
 	data->interfaces = g_slist_append(data->interfaces, iface);
+	g_hash_table_insert(data->interface_index, iface->name, iface);
 }
 
 static struct generic_data *object_path_ref(DBusConnection *connection,
@@ -531,11 +751,13 @@ static struct generic_data *object_path_ref(DBusConnection *connection,
 
 	data = g_new0(struct generic_data, 1);
 	data->refcount = 1;
+	data->interface_index = g_hash_table_new(g_str_hash, g_str_equal);
 
 	data->introspect = g_strdup(DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE "<node></node>");
 
 	if (!dbus_connection_register_object_path(connection, path,
 						&generic_table, data)) {
+		g_hash_table_destroy(data->interface_index);
 		g_free(data->introspect);
 		g_free(data);
 		return NULL;
@@ -553,15 +775,21 @@ static gboolean remove_interface(struct generic_data *data, const char *name)
 {
 	struct interface_data *iface;
 
-	iface = find_interface(data->interfaces, name);
+	iface = find_interface(data, name);
 	if (iface == NULL)
 		return FALSE;
 
 	data->interfaces = g_slist_remove(data->interfaces, iface);
+	g_hash_table_remove(data->interface_index, iface->name);
 
 	if (iface->destroy)
 		iface->destroy(iface->user_data);
 
+	g_hash_table_destroy(iface->method_index);
+	g_hash_table_destroy(iface->signal_index);
+	g_free(iface->xml);
+	if (iface->properties != NULL)
+		dbus_message_unref(iface->properties);
 	g_free(iface->name);
 	g_free(iface);
 
@@ -607,19 +835,16 @@ static gboolean check_signal(DBusConnection *conn, const char *path,
 		return FALSE;
 	}
 
-	iface = find_interface(data->interfaces, interface);
+	iface = find_interface(data, interface);
 	if (iface == NULL) {
 		error("dbus_connection_emit_signal: %s does not implement %s",
 				path, interface);
 		return FALSE;
 	}
 
-	for (signal = iface->signals; signal && signal->name; signal++) {
-		if (!strcmp(signal->name, name)) {
-			*args = signal->signature;
-			break;
-		}
-	}
+	signal = g_hash_table_lookup(iface->signal_index, name);
+	if (signal != NULL)
+		*args = signal->signature;
 
 	if (*args == NULL) {
 		error("No signal named %s on interface %s", name, interface);
@@ -661,6 +886,8 @@ static dbus_bool_t emit_signal_valist(DBusConnection *conn,
 		goto fail;
 	}
 
+	invalidate_properties(conn, signal);
+
 	ret = dbus_connection_send(conn, signal, NULL);
 
 fail:
@@ -683,7 +910,7 @@ gboolean g_dbus_register_interface(DBusConnection *connection,
 	if (data == NULL)
 		return FALSE;
 
-	if (find_interface(data->interfaces, name)) {
+	if (find_interface(data, name)) {
 		object_path_unref(connection, path);
 		return FALSE;
 	}
@@ -723,6 +950,34 @@ gboolean g_dbus_unregister_interface(DBusConnection *connection,
 	return TRUE;
 }
 
+gboolean g_dbus_append_objects(DBusConnection *connection, const char *path,
+							DBusMessageIter *iter)
+{
+	DBusMessageIter array;
+
+	if (path == NULL)
+		return FALSE;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_OBJECT_PATH_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	append_objects(connection, path, &array);
+
+	dbus_message_iter_close_container(iter, &array);
+
+	return TRUE;
+}
+
 gboolean g_dbus_register_security(const GDBusSecurityTable *security)
 {
 	if (security_table != NULL)
@@ -802,6 +1057,8 @@ gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message)
 
 	if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
 		dbus_message_set_no_reply(message, TRUE);
+	else if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL)
+		invalidate_properties(connection, message);
 
 	result = dbus_connection_send(connection, message, NULL);
 
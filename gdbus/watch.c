@@ -43,6 +43,14 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 static guint listener_id = 0;
 static GSList *listeners = NULL;
 
+/* Watches matching on arg0 (per name disconnect and service watches) are
+ * indexed by it, so that messages are matched against the few sharing
+ * their arg0 plus the ones not filtering on it */
+static GSList *any_argument = NULL;
+static GHashTable *argument_index = NULL;	/* arg0 -> filter_data list */
+static GHashTable *name_index = NULL;		/* sender -> filter_data list */
+static GHashTable *callback_index = NULL;	/* watch id -> filter_data */
+
 struct service_data {
 	DBusConnection *conn;
 	DBusPendingCall *call;
@@ -78,7 +86,8 @@ struct filter_data {
 	gboolean registered;
 };
 
-static struct filter_data *filter_data_find(DBusConnection *connection,
+static gboolean filter_data_match(struct filter_data *data,
+							DBusConnection *connection,
 							const char *name,
 							const char *owner,
 							const char *path,
@@ -86,45 +95,141 @@ static struct filter_data *filter_data_find(DBusConnection *connection,
 							const char *member,
 							const char *argument)
 {
-	GSList *current;
+	if (connection != data->connection)
+		return FALSE;
 
-	for (current = listeners;
-			current != NULL; current = current->next) {
-		struct filter_data *data = current->data;
+	if (name && data->name &&
+			g_str_equal(name, data->name) == FALSE)
+		return FALSE;
 
-		if (connection != data->connection)
-			continue;
+	if (owner && data->owner &&
+			g_str_equal(owner, data->owner) == FALSE)
+		return FALSE;
 
-		if (name && data->name &&
-				g_str_equal(name, data->name) == FALSE)
-			continue;
+	if (path && data->path &&
+			g_str_equal(path, data->path) == FALSE)
+		return FALSE;
 
-		if (owner && data->owner &&
-				g_str_equal(owner, data->owner) == FALSE)
-			continue;
+	if (interface && data->interface &&
+			g_str_equal(interface, data->interface) == FALSE)
+		return FALSE;
 
-		if (path && data->path &&
-				g_str_equal(path, data->path) == FALSE)
-			continue;
+	if (member && data->member &&
+			g_str_equal(member, data->member) == FALSE)
+		return FALSE;
 
-		if (interface && data->interface &&
-				g_str_equal(interface, data->interface) == FALSE)
-			continue;
+	if (argument && data->argument &&
+			g_str_equal(argument, data->argument) == FALSE)
+		return FALSE;
 
-		if (member && data->member &&
-				g_str_equal(member, data->member) == FALSE)
-			continue;
+	return TRUE;
+}
 
-		if (argument && data->argument &&
-				g_str_equal(argument, data->argument) == FALSE)
-			continue;
+static struct filter_data *filter_list_find(GSList *list,
+							DBusConnection *connection,
+							const char *name,
+							const char *owner,
+							const char *path,
+							const char *interface,
+							const char *member,
+							const char *argument)
+{
+	for (; list != NULL; list = list->next) {
+		struct filter_data *data = list->data;
 
-		return data;
+		if (filter_data_match(data, connection, name, owner, path,
+					interface, member, argument))
+			return data;
 	}
 
 	return NULL;
 }
 
+static struct filter_data *filter_data_find(DBusConnection *connection,
+							const char *name,
+							const char *owner,
+							const char *path,
+							const char *interface,
+							const char *member,
+							const char *argument)
+{
+	struct filter_data *data;
+
+	/* Without an argument any watch may match */
+	if (argument == NULL)
+		return filter_list_find(listeners, connection, name, owner,
+					path, interface, member, argument);
+
+	if (argument_index != NULL) {
+		data = filter_list_find(g_hash_table_lookup(argument_index,
+							argument),
+					connection, name, owner, path,
+					interface, member, argument);
+		if (data)
+			return data;
+	}
+
+	return filter_list_find(any_argument, connection, name, owner, path,
+					interface, member, argument);
+}
+
+static void index_add(GHashTable **index, const char *key,
+						struct filter_data *data)
+{
+	GSList *list;
+
+	if (*index == NULL)
+		*index = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+
+	list = g_hash_table_lookup(*index, key);
+	list = g_slist_append(list, data);
+	g_hash_table_insert(*index, g_strdup(key), list);
+}
+
+static void index_remove(GHashTable *index, const char *key,
+						struct filter_data *data)
+{
+	GSList *list;
+
+	if (index == NULL)
+		return;
+
+	list = g_hash_table_lookup(index, key);
+	list = g_slist_remove(list, data);
+
+	if (list == NULL)
+		g_hash_table_remove(index, key);
+	else
+		g_hash_table_insert(index, g_strdup(key), list);
+}
+
+static void listener_add(struct filter_data *data)
+{
+	listeners = g_slist_append(listeners, data);
+
+	if (data->argument)
+		index_add(&argument_index, data->argument, data);
+	else
+		any_argument = g_slist_append(any_argument, data);
+
+	if (data->name)
+		index_add(&name_index, data->name, data);
+}
+
+static void listener_remove(struct filter_data *data)
+{
+	listeners = g_slist_remove(listeners, data);
+
+	if (data->argument)
+		index_remove(argument_index, data->argument, data);
+	else
+		any_argument = g_slist_remove(any_argument, data);
+
+	if (data->name)
+		index_remove(name_index, data->name, data);
+}
+
 static void format_rule(struct filter_data *data, char *rule, size_t size)
 {
 	const char *sender;
@@ -241,7 +346,7 @@ proceed:
 		return NULL;
 	}
 
-	listeners = g_slist_append(listeners, data);
+	listener_add(data);
 
 	return data;
 }
@@ -266,12 +371,20 @@ static struct filter_callback *filter_data_find_callback(
 	return NULL;
 }
 
+static void callback_index_remove(struct filter_callback *cb)
+{
+	if (callback_index != NULL)
+		g_hash_table_remove(callback_index, GUINT_TO_POINTER(cb->id));
+}
+
 static void filter_data_free(struct filter_data *data)
 {
 	GSList *l;
 
-	for (l = data->callbacks; l != NULL; l = l->next)
+	for (l = data->callbacks; l != NULL; l = l->next) {
+		callback_index_remove(l->data);
 		g_free(l->data);
+	}
 
 	g_slist_free(data->callbacks);
 	g_dbus_remove_watch(data->connection, data->name_watch);
@@ -295,9 +408,13 @@ static void filter_data_call_and_free(struct filter_data *data)
 			cb->disc_func(data->connection, cb->user_data);
 		if (cb->destroy_func)
 			cb->destroy_func(cb->user_data);
+		callback_index_remove(cb);
 		g_free(cb);
 	}
 
+	g_slist_free(data->callbacks);
+	data->callbacks = NULL;
+
 	filter_data_free(data);
 }
 
@@ -320,6 +437,12 @@ static struct filter_callback *filter_data_add_callback(
 	cb->user_data = user_data;
 	cb->id = ++listener_id;
 
+	if (callback_index == NULL)
+		callback_index = g_hash_table_new(g_direct_hash,
+							g_direct_equal);
+
+	g_hash_table_insert(callback_index, GUINT_TO_POINTER(cb->id), data);
+
 	if (data->lock)
 		data->processed = g_slist_append(data->processed, cb);
 	else
@@ -364,6 +487,7 @@ static gboolean filter_data_remove_callback(struct filter_data *data,
 	if (cb->destroy_func)
 		cb->destroy_func(cb->user_data);
 
+	callback_index_remove(cb);
 	g_free(cb);
 
 	/* Don't remove the filter if other callbacks exist or data is lock
@@ -375,7 +499,7 @@ static gboolean filter_data_remove_callback(struct filter_data *data,
 		return FALSE;
 
 	connection = dbus_connection_ref(data->connection);
-	listeners = g_slist_remove(listeners, data);
+	listener_remove(data);
 	filter_data_free(data);
 
 	/* Remove filter if there are no listeners left for the connection */
@@ -417,16 +541,21 @@ static DBusHandlerResult signal_filter(DBusConnection *connection,
 	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
+static GSList *name_listeners(const char *name)
+{
+	if (name == NULL || name_index == NULL)
+		return NULL;
+
+	return g_hash_table_lookup(name_index, name);
+}
+
 static void update_name_cache(const char *name, const char *owner)
 {
 	GSList *l;
 
-	for (l = listeners; l != NULL; l = l->next) {
+	for (l = name_listeners(name); l != NULL; l = l->next) {
 		struct filter_data *data = l->data;
 
-		if (g_strcmp0(data->name, name) != 0)
-			continue;
-
 		g_free(data->owner);
 		data->owner = g_strdup(owner);
 	}
@@ -434,18 +563,12 @@ static void update_name_cache(const char *name, const char *owner)
 
 static const char *check_name_cache(const char *name)
 {
-	GSList *l;
+	GSList *l = name_listeners(name);
 
-	for (l = listeners; l != NULL; l = l->next) {
-		struct filter_data *data = l->data;
-
-		if (g_strcmp0(data->name, name) != 0)
-			continue;
-
-		return data->owner;
-	}
+	if (l == NULL)
+		return NULL;
 
-	return NULL;
+	return ((struct filter_data *) l->data)->owner;
 }
 
 static DBusHandlerResult service_filter(DBusConnection *connection,
@@ -513,9 +636,14 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 	member = dbus_message_get_member(message);
 	dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &arg, DBUS_TYPE_INVALID);
 
-	/* Sender is always bus name */
-	data = filter_data_find(connection, NULL, sender, path, iface, member,
-					arg);
+	/* Sender is always bus name. Watches on arg0 can only match signals
+	 * whose first argument is a string. */
+	if (arg != NULL)
+		data = filter_data_find(connection, NULL, sender, path, iface,
+							member, arg);
+	else
+		data = filter_list_find(any_argument, connection, NULL, sender,
+						path, iface, member, NULL);
 	if (data == NULL) {
 		error("Got %s.%s signal which has no listeners", iface, member);
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
@@ -536,7 +664,7 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 
 	remove_match(data);
 
-	listeners = g_slist_remove(listeners, data);
+	listener_remove(data);
 	filter_data_free(data);
 
 	/* Remove filter if there no listener left for the connection */
@@ -716,22 +844,21 @@ gboolean g_dbus_remove_watch(DBusConnection *connection, guint id)
 {
 	struct filter_data *data;
 	struct filter_callback *cb;
-	GSList *ldata;
 
-	if (id == 0)
+	if (id == 0 || callback_index == NULL)
 		return FALSE;
 
-	for (ldata = listeners; ldata; ldata = ldata->next) {
-		data = ldata->data;
+	data = g_hash_table_lookup(callback_index, GUINT_TO_POINTER(id));
+	if (data == NULL)
+		return FALSE;
 
-		cb = filter_data_find_callback(data, id);
-		if (cb) {
-			filter_data_remove_callback(data, cb);
-			return TRUE;
-		}
-	}
+	cb = filter_data_find_callback(data, id);
+	if (cb == NULL)
+		return FALSE;
 
-	return FALSE;
+	filter_data_remove_callback(data, cb);
+
+	return TRUE;
 }
 
 void g_dbus_remove_all_watches(DBusConnection *connection)
@@ -740,7 +867,7 @@ void g_dbus_remove_all_watches(DBusConnection *connection)
 
 	while ((data = filter_data_find(connection, NULL, NULL, NULL, NULL,
 					NULL, NULL))) {
-		listeners = g_slist_remove(listeners, data);
+		listener_remove(data);
 		filter_data_call_and_free(data);
 	}
 
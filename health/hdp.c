@@ -41,6 +41,7 @@
 #include <sdpd.h>
 #include "../src/dbus-common.h"
 #include <unistd.h>
+#include <sys/ioctl.h>
 
 #ifndef DBUS_TYPE_UNIX_FD
 	#define DBUS_TYPE_UNIX_FD -1
@@ -79,6 +80,7 @@ struct hdp_tmp_dc_data {
 	struct hdp_channel		*hdp_chann;
 	guint				ref;
 	mcap_mdl_operation_cb		cb;
+	GTimer				*timer;	/* Acquire handover */
 };
 
 struct hdp_echo_data {
@@ -163,6 +165,9 @@ static void free_hdp_conn_dc(struct hdp_tmp_dc_data *data)
 	dbus_connection_unref(data->conn);
 	hdp_channel_unref(data->hdp_chann);
 
+	if (data->timer)
+		g_timer_destroy(data->timer);
+
 	g_free(data);
 }
 
@@ -438,6 +443,7 @@ static DBusMessage *channel_get_properties(DBusConnection *conn,
 	DBusMessage *reply;
 	const char *path;
 	char *type;
+	int fd, queued;
 
 	reply = dbus_message_new_method_return(msg);
 	if (!reply)
@@ -465,6 +471,22 @@ static DBusMessage *channel_get_properties(DBusConnection *conn,
 
 	g_free(type);
 
+	if (chan->acquire_usec)
+		dict_append_entry(&dict, "AcquireLatency", DBUS_TYPE_UINT32,
+							&chan->acquire_usec);
+
+	/* The application owns the data path, the socket queues are what
+	 * tells whether it or the link is not keeping up */
+	fd = chan->mdl ? mcap_mdl_get_fd(chan->mdl) : -1;
+	if (fd >= 0) {
+		if (ioctl(fd, TIOCOUTQ, &queued) == 0)
+			dict_append_entry(&dict, "TxQueue", DBUS_TYPE_UINT32,
+								&queued);
+		if (ioctl(fd, TIOCINQ, &queued) == 0)
+			dict_append_entry(&dict, "RxQueue", DBUS_TYPE_UINT32,
+								&queued);
+	}
+
 	dbus_message_iter_close_container(&iter, &dict);
 
 	return reply;
@@ -497,6 +519,19 @@ static void abort_mdl_cb(GError *err, gpointer data)
 	}
 }
 
+static void acquire_done(struct hdp_tmp_dc_data *dc_data)
+{
+	struct hdp_channel *chan = dc_data->hdp_chann;
+
+	if (!dc_data->timer)
+		return;
+
+	chan->acquire_usec = MAX(g_timer_elapsed(dc_data->timer, NULL) *
+								1000000, 1);
+
+	DBG("%s handed over in %u us", chan->path, chan->acquire_usec);
+}
+
 static void hdp_mdl_reconn_cb(struct mcap_mdl *mdl, GError *err, gpointer data)
 {
 	struct hdp_tmp_dc_data *dc_data = data;
@@ -532,6 +567,8 @@ static void hdp_mdl_reconn_cb(struct mcap_mdl *mdl, GError *err, gpointer data)
 		return;
 	}
 
+	acquire_done(dc_data);
+
 	reply = g_dbus_create_reply(dc_data->msg, DBUS_TYPE_UNIX_FD,
 							&fd, DBUS_TYPE_INVALID);
 	g_dbus_send_message(dc_data->conn, reply);
@@ -623,9 +660,11 @@ static DBusMessage *channel_acquire_continue(struct hdp_tmp_dc_data *data,
 	}
 
 	fd = mcap_mdl_get_fd(data->hdp_chann->mdl);
-	if (fd >= 0)
+	if (fd >= 0) {
+		acquire_done(data);
 		return g_dbus_create_reply(data->msg, DBUS_TYPE_UNIX_FD, &fd,
 							DBUS_TYPE_INVALID);
+	}
 
 	hdp_tmp_dc_data_ref(data);
 	if (mcap_reconnect_mdl(data->hdp_chann->mdl, device_reconnect_mdl_cb,
@@ -663,6 +702,7 @@ static DBusMessage *channel_acquire(DBusConnection *conn,
 	dc_data->conn = dbus_connection_ref(conn);
 	dc_data->msg = dbus_message_ref(msg);
 	dc_data->hdp_chann = hdp_channel_ref(chan);
+	dc_data->timer = g_timer_new();
 
 	if (chan->dev->mcl_conn) {
 		reply = channel_acquire_continue(hdp_tmp_dc_data_ref(dc_data),
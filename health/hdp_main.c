@@ -58,5 +58,6 @@ static void hdp_exit(void)
 	connection = NULL;
 }
 
-BLUETOOTH_PLUGIN_DEFINE(health, VERSION,
-			BLUETOOTH_PLUGIN_PRIORITY_DEFAULT, hdp_init, hdp_exit)
+BLUETOOTH_PLUGIN_DEFINE_TRIGGER(health, VERSION,
+			BLUETOOTH_PLUGIN_PRIORITY_DEFAULT,
+			BLUETOOTH_PLUGIN_TRIGGER_ADAPTER, hdp_init, hdp_exit)
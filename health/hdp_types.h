@@ -123,6 +123,7 @@ struct hdp_channel {
 	uint16_t		imtu;		/* Channel incoming MTU */
 	uint16_t		omtu;		/* Channel outgoing MTU */
 	struct hdp_echo_data	*edata;		/* private data used by echo channels */
+	uint32_t		acquire_usec;	/* Last Acquire call to fd reply */
 	gint			ref;		/* Reference counter */
 };
 
@@ -64,6 +64,9 @@ struct mcap_csp {
 	guint		set_timer;	/* CSP-Slave: delayed set timer */
 	void		*set_data;	/* CSP-Slave: delayed set data */
 	void		*csp_priv_data;	/* CSP-Master: In-flight request data */
+	uint32_t	last_btclock;	/* CSP-Slave: last clock read */
+	struct timespec	last_time;	/* CSP-Slave: host time of last_btclock */
+	int		last_latency;	/* CSP-Slave: its read latency in us */
 };
 
 struct mcap_sync_cap_cbdata {
@@ -478,14 +481,16 @@ static int send_sync_set_rsp(struct mcap_mcl *mcl, uint8_t rspcode,
 	return sent;
 }
 
+/* Accuracy, in us, is the transaction time of the clock read that was used */
 static gboolean get_all_clocks(struct mcap_mcl *mcl, uint32_t *btclock,
 				struct timespec *base_time,
-				uint64_t *timestamp)
+				uint64_t *timestamp, int *accuracy)
 {
-	int latency;
+	int latency, best = -1;
 	int retry = 5;
 	uint16_t btres;
-	struct timespec t0;
+	uint32_t clk;
+	struct timespec t0, t1;
 
 	if (!caps(mcl))
 		return FALSE;
@@ -496,18 +501,78 @@ static gboolean get_all_clocks(struct mcap_mcl *mcl, uint32_t *btclock,
 
 		clock_gettime(CLK, &t0);
 
-		if (!read_btclock(mcl, btclock, &btres))
+		if (!read_btclock(mcl, &clk, &btres))
 			continue;
 
-		clock_gettime(CLK, base_time);
+		clock_gettime(CLK, &t1);
 
 		/* Tries to detect preemption between clock_gettime
 		 * and read_btclock by measuring transaction time
 		 */
-		latency = time_us(base_time) - time_us(&t0);
+		latency = time_us(&t1) - time_us(&t0);
+
+		/* Keep the tightest reading in case none is under the
+		 * preemption threshold */
+		if (best < 0 || latency < best) {
+			best = latency;
+			*btclock = clk;
+			*base_time = t1;
+		}
 	}
 
+	if (best < 0)
+		return FALSE;
+
+	mcl->csp->last_btclock = *btclock;
+	mcl->csp->last_time = *base_time;
+	mcl->csp->last_latency = MAX(best, 1);
+
 	*timestamp = mcap_get_timestamp(mcl, base_time);
+	*accuracy = mcl->csp->last_latency;
+
+	DBG("CSP: clock read with %dus accuracy", best);
+
+	return TRUE;
+}
+
+/* Derives the clocks from the last reading instead of asking the
+ * controller again, as long as the host and controller clocks cannot have
+ * drifted apart by more than the read latency that caps() measured */
+static gboolean extrapolate_clocks(struct mcap_mcl *mcl, uint32_t *btclock,
+				struct timespec *base_time,
+				uint64_t *timestamp, int *accuracy)
+{
+	struct mcap_csp *csp = mcl->csp;
+	struct timespec now;
+	int64_t elapsed, ticks, drift, usec;
+
+	if (!csp->last_latency)
+		return FALSE;
+
+	clock_gettime(CLK, &now);
+	elapsed = time_us(&now) - time_us(&csp->last_time);
+
+	/* Each clock may be off by ts_acc ppm */
+	drift = elapsed * 2 * caps(mcl)->ts_acc / 1000000;
+	if (csp->last_latency + drift > caps(mcl)->latency)
+		return FALSE;
+
+	/* Whole BT clock ticks (312.5us) since the reading */
+	ticks = elapsed * 2 / 625;
+	usec = ticks * 625 / 2;
+
+	*btclock = (csp->last_btclock + ticks) % MCAP_BTCLOCK_FIELD;
+
+	*base_time = csp->last_time;
+	base_time->tv_sec += usec / 1000000;
+	base_time->tv_nsec += (usec % 1000000) * 1000;
+	if (base_time->tv_nsec >= 1000000000) {
+		base_time->tv_sec++;
+		base_time->tv_nsec -= 1000000000;
+	}
+
+	*timestamp = mcap_get_timestamp(mcl, base_time);
+	*accuracy = csp->last_latency + drift;
 
 	return TRUE;
 }
@@ -519,7 +584,7 @@ static gboolean sync_send_indication(gpointer user_data)
 	uint32_t btclock;
 	uint64_t tmstamp;
 	struct timespec base_time;
-	int sent;
+	int sent, accuracy;
 
 	if (!user_data)
 		return FALSE;
@@ -529,7 +594,10 @@ static gboolean sync_send_indication(gpointer user_data)
 	if (!caps(mcl))
 		return FALSE;
 
-	if (!get_all_clocks(mcl, &btclock, &base_time, &tmstamp))
+	if (!extrapolate_clocks(mcl, &btclock, &base_time, &tmstamp,
+								&accuracy) &&
+			!get_all_clocks(mcl, &btclock, &base_time, &tmstamp,
+								&accuracy))
 		return FALSE;
 
 	cmd = g_new0(mcap_md_sync_info_ind, 1);
@@ -537,7 +605,7 @@ static gboolean sync_send_indication(gpointer user_data)
 	cmd->op = MCAP_MD_SYNC_INFO_IND;
 	cmd->btclock = htonl(btclock);
 	cmd->timestst = hton64(tmstamp);
-	cmd->timestsa = htons(caps(mcl)->latency);
+	cmd->timestsa = htons(accuracy);
 
 	sent = send_sync_cmd(mcl, cmd, sizeof(*cmd));
 	g_free(cmd);
@@ -559,7 +627,7 @@ static gboolean proc_sync_set_req_phase2(gpointer user_data)
 	struct timespec base_time;
 	uint16_t tmstampacc;
 	gboolean reset;
-	int delay;
+	int delay, accuracy;
 
 	if (!user_data)
 		return FALSE;
@@ -581,7 +649,8 @@ static gboolean proc_sync_set_req_phase2(gpointer user_data)
 		return FALSE;
 	}
 
-	if (!get_all_clocks(mcl, &btclock, &base_time, &tmstamp)) {
+	if (!get_all_clocks(mcl, &btclock, &base_time, &tmstamp,
+								&accuracy)) {
 		send_sync_set_rsp(mcl, MCAP_UNSPECIFIED_ERROR, 0, 0, 0);
 		return FALSE;
 	}
@@ -609,7 +678,7 @@ static gboolean proc_sync_set_req_phase2(gpointer user_data)
 		tmstamp = new_tmstamp;
 	}
 
-	tmstampacc = caps(mcl)->latency + caps(mcl)->ts_acc;
+	tmstampacc = accuracy + caps(mcl)->ts_acc;
 
 	if (mcl->csp->ind_timer) {
 		g_source_remove(mcl->csp->ind_timer);
@@ -88,6 +88,7 @@ struct input_device {
 	char			*name;
 	struct btd_device	*device;
 	GSList			*connections;
+	struct hidp_connadd_req	*req;	/* Template built on first connect */
 };
 
 static GSList *devices = NULL;
@@ -147,6 +148,11 @@ static void input_device_free(struct input_device *idev)
 	if (idev->dc_id)
 		device_remove_disconnect_watch(idev->device, idev->dc_id);
 
+	if (idev->req) {
+		free(idev->req->rd_data);
+		g_free(idev->req);
+	}
+
 	dbus_connection_unref(idev->conn);
 	btd_device_unref(idev->device);
 	g_free(idev->name);
@@ -243,26 +249,28 @@ static int decode_key(const char *str)
 	return key;
 }
 
-static int send_event(int fd, uint16_t type, uint16_t code, int32_t value)
+static void send_key(int fd, uint16_t key)
 {
-	struct uinput_event event;
+	struct uinput_event ev[4];
 
-	memset(&event, 0, sizeof(event));
-	event.type	= type;
-	event.code	= code;
-	event.value	= value;
+	memset(ev, 0, sizeof(ev));
 
-	return write(fd, &event, sizeof(event));
-}
-
-static void send_key(int fd, uint16_t key)
-{
 	/* Key press */
-	send_event(fd, EV_KEY, key, 1);
-	send_event(fd, EV_SYN, SYN_REPORT, 0);
+	ev[0].type = EV_KEY;
+	ev[0].code = key;
+	ev[0].value = 1;
+	ev[1].type = EV_SYN;
+	ev[1].code = SYN_REPORT;
 	/* Key release */
-	send_event(fd, EV_KEY, key, 0);
-	send_event(fd, EV_SYN, SYN_REPORT, 0);
+	ev[2].type = EV_KEY;
+	ev[2].code = key;
+	ev[2].value = 0;
+	ev[3].type = EV_SYN;
+	ev[3].code = SYN_REPORT;
+
+	/* One write for the whole key stroke */
+	if (write(fd, ev, sizeof(ev)) < 0)
+		error("uinput write failed: %s (%d)", strerror(errno), errno);
 }
 
 static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
@@ -569,31 +577,23 @@ cleanup:
 	g_free(req);
 }
 
-static int hidp_add_connection(const struct input_device *idev,
-				const struct input_conn *iconn)
+/* Parses the stored SDP record and device id, which do not change for the
+ * lifetime of the input device, so reconnects can skip the storage reads */
+static struct hidp_connadd_req *create_connadd_req(
+					const struct input_device *idev)
 {
 	struct hidp_connadd_req *req;
-	struct fake_hid *fake_hid;
-	struct fake_input *fake;
 	sdp_record_t *rec;
 	char src_addr[18], dst_addr[18];
-	int err;
-
-	req = g_new0(struct hidp_connadd_req, 1);
-	req->ctrl_sock = g_io_channel_unix_get_fd(iconn->ctrl_io);
-	req->intr_sock = g_io_channel_unix_get_fd(iconn->intr_io);
-	req->flags     = 0;
-	req->idle_to   = iconn->timeout;
 
 	ba2str(&idev->src, src_addr);
 	ba2str(&idev->dst, dst_addr);
 
 	rec = fetch_record(src_addr, dst_addr, idev->handle);
-	if (!rec) {
-		error("Rejected connection from unknown device %s", dst_addr);
-		err = -EPERM;
-		goto cleanup;
-	}
+	if (!rec)
+		return NULL;
+
+	req = g_new0(struct hidp_connadd_req, 1);
 
 	extract_hid_record(rec, req);
 	sdp_record_free(rec);
@@ -601,6 +601,45 @@ static int hidp_add_connection(const struct input_device *idev,
 	read_device_id(src_addr, dst_addr, NULL,
 				&req->vendor, &req->product, &req->version);
 
+	return req;
+}
+
+static int hidp_add_connection(struct input_device *idev,
+				const struct input_conn *iconn)
+{
+	struct hidp_connadd_req *req;
+	struct fake_hid *fake_hid;
+	struct fake_input *fake;
+	int err;
+
+	if (!idev->req) {
+		idev->req = create_connadd_req(idev);
+		if (!idev->req) {
+			char dst_addr[18];
+
+			ba2str(&idev->dst, dst_addr);
+			error("Rejected connection from unknown device %s",
+								dst_addr);
+			return -EPERM;
+		}
+	}
+
+	req = g_memdup(idev->req, sizeof(*req));
+	req->ctrl_sock = g_io_channel_unix_get_fd(iconn->ctrl_io);
+	req->intr_sock = g_io_channel_unix_get_fd(iconn->intr_io);
+	req->idle_to   = iconn->timeout;
+
+	/* The kernel copies the descriptor, but encryption may complete
+	 * after the template is gone so every request owns its copy */
+	if (idev->req->rd_data) {
+		req->rd_data = malloc(idev->req->rd_size);
+		if (!req->rd_data) {
+			g_free(req);
+			return -ENOMEM;
+		}
+		memcpy(req->rd_data, idev->req->rd_data, idev->req->rd_size);
+	}
+
 	fake_hid = get_fake_hid(req->vendor, req->product);
 	if (fake_hid) {
 		err = 0;
@@ -146,17 +146,19 @@ static unsigned int ps3remote_keymap[] = {
 	[0xff] = KEY_MAX,
 };
 
-static int ps3remote_decode(char *buff, int size, unsigned int *value)
+/* Decodes one report into key events, every button whose state changed
+ * gets its own event so simultaneous presses are not lost */
+static int ps3remote_decode(char *buff, int size, struct uinput_event *ev)
 {
 	static unsigned int lastkey = 0;
 	static unsigned int lastmask = 0;
-	unsigned int i, mask;
-	int retval;
+	unsigned int i, mask, code;
+	int n = 0;
 	guint8 key;
 
 	if (size < 12) {
 		error("Got a shorter packet! (size %i)\n", size);
-		return KEY_RESERVED;
+		return -EINVAL;
 	}
 
 	mask = (buff[2] << 16) + (buff[3] << 8) + buff[4];
@@ -168,36 +170,37 @@ static int ps3remote_decode(char *buff, int size, unsigned int *value)
 			continue;
 		if (ps3remote_bits[i] == 0)
 			goto error;
-		retval = ps3remote_keymap[ps3remote_bits[i]];
-		if (mask & (1 << i))
-			/* key pressed */
-			*value = 1;
-		else
-			/* key released */
-			*value = 0;
-
-		goto out;
-	}
 
-	*value = buff[11];
-	if (buff[11] == 1) {
-		retval = ps3remote_keymap[key];
-	} else
-		retval = lastkey;
+		ev[n].type = EV_KEY;
+		ev[n].code = ps3remote_keymap[ps3remote_bits[i]];
+		/* key pressed or released */
+		ev[n].value = (mask & (1 << i)) ? 1 : 0;
+		n++;
+	}
 
-	if (retval == KEY_RESERVED)
-		goto error;
-	if (retval == KEY_MAX)
-		return retval;
+	if (n > 0) {
+		lastmask = mask;
+		return n;
+	}
 
-	lastkey = retval;
+	if (buff[11] == 1)
+		code = ps3remote_keymap[key];
+	else
+		code = lastkey;
 
-out:
-	fflush(stdout);
+	if (code == KEY_RESERVED)
+		goto error;
+	if (code == KEY_MAX)
+		return 0;
 
+	lastkey = code;
 	lastmask = mask;
 
-	return retval;
+	ev[0].type = EV_KEY;
+	ev[0].code = code;
+	ev[0].value = buff[11];
+
+	return 1;
 
 error:
 	error("ps3remote: unrecognized sequence [%#x][%#x][%#x][%#x] [%#x],"
@@ -205,18 +208,18 @@ error:
 			buff[2], buff[3], buff[4], buff[5], buff[11],
 				lastmask >> 16, lastmask >> 8 & 0xff,
 						lastmask & 0xff, lastkey);
-	return -1;
+	return 0;
 }
 
 static gboolean ps3remote_event(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
 	struct fake_input *fake = data;
-	struct uinput_event event;
-	unsigned int key, value = 0;
+	struct uinput_event ev[25];	/* One per button plus SYN_REPORT */
+	struct timeval now;
 	ssize_t size;
 	char buff[50];
-	int fd;
+	int fd, i, n;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
@@ -235,28 +238,26 @@ static gboolean ps3remote_event(GIOChannel *chan, GIOCondition cond,
 		goto failed;
 	}
 
-	key = ps3remote_decode(buff, size, &value);
-	if (key == KEY_RESERVED) {
+	memset(ev, 0, sizeof(ev));
+
+	n = ps3remote_decode(buff, size, ev);
+	if (n < 0) {
 		error("Got invalid key from decode");
 		goto failed;
-	} else if (key == KEY_MAX)
+	} else if (n == 0)
 		return TRUE;
 
-	memset(&event, 0, sizeof(event));
-	gettimeofday(&event.time, NULL);
-	event.type = EV_KEY;
-	event.code = key;
-	event.value = value;
-	if (write(fake->uinput, &event, sizeof(event)) != sizeof(event)) {
-		error("Error writing to uinput device");
-		goto failed;
-	}
+	ev[n].type = EV_SYN;
+	ev[n].code = SYN_REPORT;
+	n++;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < n; i++)
+		ev[i].time = now;
 
-	memset(&event, 0, sizeof(event));
-	gettimeofday(&event.time, NULL);
-	event.type = EV_SYN;
-	event.code = SYN_REPORT;
-	if (write(fake->uinput, &event, sizeof(event)) != sizeof(event)) {
+	/* The whole report goes to uinput in a single write */
+	if (write(fake->uinput, ev, n * sizeof(ev[0])) !=
+					(ssize_t) (n * sizeof(ev[0]))) {
 		error("Error writing to uinput device");
 		goto failed;
 	}
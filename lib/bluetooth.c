@@ -29,7 +29,6 @@
 
 #include <stdio.h>
 #include <errno.h>
-#include <ctype.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +37,58 @@
 #include "bluetooth.h"
 #include "hci.h"
 
+/* Value of each hex digit, HEX_BAD for every other character */
+#define HEX_BAD 0xff
+#define XX HEX_BAD
+static const uint8_t hex_value[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+#undef XX
+
+static const char hex_digit[] = "0123456789ABCDEF";
+
+/* Parses "XX:XX:XX:XX:XX:XX" into b in string order, returns non-zero
+ * if str is not such an address. The 17 characters are checked without
+ * a branch per character. */
+static int parse_bdaddr(const char *str, uint8_t b[6])
+{
+	const unsigned char *s = (const unsigned char *) str;
+	unsigned int bad = 0;
+	int i;
+
+	if (!str || strlen(str) != 17)
+		return -1;
+
+	for (i = 0; i < 6; i++, s += 3) {
+		uint8_t hi = hex_value[s[0]], lo = hex_value[s[1]];
+
+		bad |= hi | lo;
+		b[i] = (hi << 4) | (lo & 0x0f);
+	}
+
+	/* Separators */
+	s = (const unsigned char *) str;
+	for (i = 2; i < 17; i += 3)
+		bad |= (s[i] != ':') << 7;
+
+	return bad & 0xf0;
+}
+
 void baswap(bdaddr_t *dst, const bdaddr_t *src)
 {
 	register unsigned char *d = (unsigned char *) dst;
@@ -76,23 +127,30 @@ bdaddr_t *strtoba(const char *str)
 
 int ba2str(const bdaddr_t *ba, char *str)
 {
-	return sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X",
-		ba->b[5], ba->b[4], ba->b[3], ba->b[2], ba->b[1], ba->b[0]);
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		uint8_t b = ba->b[5 - i];
+
+		str[i * 3] = hex_digit[b >> 4];
+		str[i * 3 + 1] = hex_digit[b & 0x0f];
+		str[i * 3 + 2] = ':';
+	}
+
+	str[17] = '\0';
+
+	return 17;
 }
 
 int str2ba(const char *str, bdaddr_t *ba)
 {
 	bdaddr_t b;
-	int i;
 
-	if (bachk(str) < 0) {
+	if (parse_bdaddr(str, b.b)) {
 		memset(ba, 0, sizeof(*ba));
 		return -1;
 	}
 
-	for (i = 0; i < 6; i++, str += 3)
-		b.b[i] = strtol(str, NULL, 16);
-
 	baswap(ba, &b);
 
 	return 0;
@@ -105,27 +163,9 @@ int ba2oui(const bdaddr_t *ba, char *str)
 
 int bachk(const char *str)
 {
-	if (!str)
-		return -1;
-
-	if (strlen(str) != 17)
-		return -1;
-
-	while (*str) {
-		if (!isxdigit(*str++))
-			return -1;
-
-		if (!isxdigit(*str++))
-			return -1;
-
-		if (*str == 0)
-			break;
+	uint8_t b[6];
 
-		if (*str++ != ':')
-			return -1;
-	}
-
-	return 0;
+	return parse_bdaddr(str, b) ? -1 : 0;
 }
 
 int baprintf(const char *format, ...)
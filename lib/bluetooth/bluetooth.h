@@ -81,6 +81,14 @@ struct bt_power {
 	uint8_t force_active;
 };
 
+#define BT_VOICE	11
+struct bt_voice {
+	uint16_t setting;
+};
+
+#define BT_VOICE_TRANSPARENT	0x0003
+#define BT_VOICE_CVSD_16BIT	0x0060
+
 /* Connection and socket states */
 enum {
 	BT_CONNECTED = 1, /* Equal to TCP_ESTABLISHED to make net code happy */
@@ -145,6 +153,15 @@ static inline void bacpy(bdaddr_t *dst, const bdaddr_t *src)
 	memcpy(dst, src, sizeof(bdaddr_t));
 }
 
+/* The address in the low 48 bits of an integer, most significant byte
+ * first as when printed, for use as a hash or sort key */
+static inline uint64_t bt_bdaddr_key(const bdaddr_t *ba)
+{
+	return (uint64_t) ba->b[5] << 40 | (uint64_t) ba->b[4] << 32 |
+		(uint64_t) ba->b[3] << 24 | (uint64_t) ba->b[2] << 16 |
+		(uint64_t) ba->b[1] << 8 | (uint64_t) ba->b[0];
+}
+
 void baswap(bdaddr_t *dst, const bdaddr_t *src);
 bdaddr_t *strtoba(const char *str);
 char *batostr(const bdaddr_t *ba);
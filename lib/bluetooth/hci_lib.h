@@ -53,6 +53,17 @@ int hci_close_dev(int dd);
 int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param);
 int hci_send_req(int dd, struct hci_request *req, int timeout);
 
+struct hci_req_queue;
+typedef void (*hci_req_cb_t) (struct hci_request *req, int err,
+							void *user_data);
+
+struct hci_req_queue *hci_req_queue_new(int dd);
+void hci_req_queue_free(struct hci_req_queue *q);
+int hci_req_submit(struct hci_req_queue *q, struct hci_request *req, hci_req_cb_t cb, void *user_data);
+int hci_req_pending(struct hci_req_queue *q);
+int hci_req_process(struct hci_req_queue *q);
+int hci_req_wait(struct hci_req_queue *q, int timeout);
+
 int hci_create_connection(int dd, const bdaddr_t *bdaddr, uint16_t ptype, uint16_t clkoffset, uint8_t rswitch, uint16_t *handle, int to);
 int hci_disconnect(int dd, uint16_t handle, uint8_t reason, int to);
 
@@ -138,6 +149,12 @@ int hci_le_clear_white_list(int dd, int to);
 int hci_for_each_dev(int flag, int(*func)(int dd, int dev_id, long arg), long arg);
 int hci_get_route(bdaddr_t *bdaddr);
 
+/* Keeps a per process table of the HCI devices, updated from the device
+ * events of the stack, which hci_get_route, hci_devid and hci_devba use
+ * instead of asking the kernel on every call. Not thread safe. */
+int hci_dev_cache_enable(void);
+void hci_dev_cache_disable(void);
+
 char *hci_bustostr(int bus);
 char *hci_typetostr(int type);
 char *hci_dtypetostr(int type);
@@ -81,6 +81,8 @@ static inline void sdp_list_foreach(sdp_list_t *list, sdp_list_func_t f, void *u
 #define SDP_RETRY_IF_BUSY	0x01
 #define SDP_WAIT_ON_CLOSE	0x02
 #define SDP_NON_BLOCKING	0x04
+#define SDP_ARENA_RECORDS	0x08
+#define SDP_LAZY_RECORDS	0x10
 
 /*
  * a session with an SDP server
@@ -116,6 +118,13 @@ typedef enum {
  */
 typedef void sdp_callback_t(uint8_t type, uint16_t status, uint8_t *rsp, size_t size, void *udata);
 
+/*
+ * Called for every complete record of a ServiceSearchAttribute response
+ * as the continuation fragments come in, see sdp_set_record_notify. The
+ * record belongs to the callee.
+ */
+typedef void sdp_record_cb_t(sdp_record_t *rec, void *udata);
+
 /*
  * create an L2CAP connection to a Bluetooth device
  *
@@ -140,6 +149,14 @@ int sdp_get_error(sdp_session_t *session);
 int sdp_process(sdp_session_t *session);
 int sdp_set_notify(sdp_session_t *session, sdp_callback_t *func, void *udata);
 
+/*
+ * With a record callback set, records are extracted while the response is
+ * still being received and only the incomplete one stays buffered. The
+ * sdp_callback_t then only gets what was left over, normally nothing.
+ */
+int sdp_set_record_notify(sdp_session_t *session, sdp_record_cb_t *func,
+								void *udata);
+
 int sdp_service_search_async(sdp_session_t *session, const sdp_list_t *search, uint16_t max_rec_num);
 int sdp_service_attr_async(sdp_session_t *session, uint32_t handle, sdp_attrreq_type_t reqtype, const sdp_list_t *attrid_list);
 int sdp_service_search_attr_async(sdp_session_t *session, const sdp_list_t *search, sdp_attrreq_type_t reqtype, const sdp_list_t *attrid_list);
@@ -475,6 +492,12 @@ int sdp_uuid16_cmp(const void *p1, const void *p2);
 int sdp_uuid128_cmp(const void *p1, const void *p2);
 int sdp_uuid_cmp(const void *p1, const void *p2);
 uuid_t *sdp_uuid_to_uuid128(const uuid_t *uuid);
+
+/*
+ * Converts a 16 or 32-bit uuid to its 128-bit form in place, for users
+ * that compare it many times with sdp_uuid128_cmp
+ */
+void sdp_uuid_extend(uuid_t *uuid);
 void sdp_uuid16_to_uuid128(uuid_t *uuid128, const uuid_t *uuid16);
 void sdp_uuid32_to_uuid128(uuid_t *uuid128, const uuid_t *uuid32);
 int sdp_uuid128_to_uuid(uuid_t *uuid);
@@ -600,6 +623,31 @@ int sdp_set_supp_feat(sdp_record_t *rec, const sdp_list_t *sf);
 int sdp_get_supp_feat(const sdp_record_t *rec, sdp_list_t **seqp);
 
 sdp_record_t *sdp_extract_pdu(const uint8_t *pdata, int bufsize, int *scanned);
+
+/*
+ * Same as sdp_extract_pdu, but with SDP_ARENA_RECORDS set on the session
+ * the record and all its data elements live in a single allocation which
+ * sdp_record_free releases at once. Such records can't be modified.
+ *
+ * With SDP_LAZY_RECORDS only the offsets of the attributes are noted and
+ * each one is decoded by its first sdp_data_get. sdp_gen_record_pdu hands
+ * out the raw bytes as long as the record is not modified.
+ */
+sdp_record_t *sdp_session_extract_pdu(sdp_session_t *session,
+				const uint8_t *pdata, int bufsize, int *scanned);
+
+/*
+ * Same as sdp_extract_pdu, but decoding the attributes on demand as with
+ * SDP_LAZY_RECORDS, for records that are loaded in bulk
+ */
+sdp_record_t *sdp_extract_pdu_lazy(const uint8_t *pdata, int bufsize,
+							int *scanned);
+
+/*
+ * Decodes all attributes of a lazy record into attrlist, for users that
+ * walk attrlist directly. Does nothing for other records.
+ */
+void sdp_record_decode(sdp_record_t *rec);
 sdp_record_t *sdp_copy_record(sdp_record_t *rec);
 
 void sdp_data_print(sdp_data_t *data);
@@ -615,6 +663,24 @@ void sdp_append_to_buf(sdp_buf_t *dst, uint8_t *data, uint32_t len);
 int sdp_gen_pdu(sdp_buf_t *pdu, sdp_data_t *data);
 int sdp_gen_record_pdu(const sdp_record_t *rec, sdp_buf_t *pdu);
 
+/*
+ * Returns the serialized record without copying it. The bytes belong to
+ * the record and stay valid until it is modified or freed. Only records
+ * allocated by the library keep them, others get -ENOTSUP.
+ */
+int sdp_get_record_pdu(const sdp_record_t *rec, const uint8_t **pdu,
+							uint32_t *len);
+
+/*
+ * A few byte strings kept with a record under a caller chosen key, like
+ * the attributes serialized for a request. They are dropped together
+ * with the serialized record whenever an attribute changes.
+ */
+int sdp_record_cache_get(const sdp_record_t *rec, const void *key,
+			uint32_t key_len, const uint8_t **data, uint32_t *len);
+int sdp_record_cache_set(const sdp_record_t *rec, const void *key,
+			uint32_t key_len, const uint8_t *data, uint32_t len);
+
 int sdp_extract_seqtype(const uint8_t *buf, int bufsize, uint8_t *dtdp, int *size);
 
 sdp_data_t *sdp_extract_attr(const uint8_t *pdata, int bufsize, int *extractedLength, sdp_record_t *rec);
@@ -809,6 +809,186 @@ char *lmp_featurestostr(uint8_t *features, char *pref, int width)
 }
 
 /* HCI functions that do not require open device */
+/* Optional table of the HCI devices, kept up to date from the device
+ * events of the stack so that route lookups don't need any ioctl. It is
+ * per process and not thread safe. */
+static struct {
+	int sk;			/* monitor socket, -1 when disabled */
+	int dirty;		/* devices changed since the table was read */
+	int count;
+	struct hci_dev_info info[HCI_MAX_DEV];
+} dev_cache = { .sk = -1 };
+
+static int dev_cache_load(void)
+{
+	struct hci_dev_list_req *dl;
+	struct hci_dev_req *dr;
+	int i, err = 0;
+
+	dl = malloc(HCI_MAX_DEV * sizeof(*dr) + sizeof(*dl));
+	if (!dl)
+		return -ENOMEM;
+
+	memset(dl, 0, HCI_MAX_DEV * sizeof(*dr) + sizeof(*dl));
+
+	dl->dev_num = HCI_MAX_DEV;
+	dr = dl->dev_req;
+
+	if (ioctl(dev_cache.sk, HCIGETDEVLIST, (void *) dl) < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	dev_cache.count = 0;
+
+	for (i = 0; i < dl->dev_num; i++, dr++) {
+		struct hci_dev_info *di = &dev_cache.info[dev_cache.count];
+
+		memset(di, 0, sizeof(*di));
+		di->dev_id = dr->dev_id;
+
+		/* Gone since the list was read */
+		if (ioctl(dev_cache.sk, HCIGETDEVINFO, (void *) di) < 0)
+			continue;
+
+		dev_cache.count++;
+	}
+
+	dev_cache.dirty = 0;
+
+done:
+	free(dl);
+
+	return err;
+}
+
+/* Reads the pending device events without blocking and reloads the
+ * table if any device was registered, unregistered, brought up or down */
+static int dev_cache_update(void)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	ssize_t len;
+
+	while ((len = recv(dev_cache.sk, buf, sizeof(buf),
+						MSG_DONTWAIT)) > 0) {
+		hci_event_hdr *eh = (void *) (buf + 1);
+		evt_stack_internal *si;
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_STACK_INTERNAL_SIZE ||
+				eh->evt != EVT_STACK_INTERNAL)
+			continue;
+
+		si = (void *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+		if (si->type == EVT_SI_DEVICE)
+			dev_cache.dirty = 1;
+	}
+
+	if (len < 0 && errno != EAGAIN && errno != EINTR)
+		dev_cache.dirty = 1;
+
+	if (dev_cache.dirty)
+		return dev_cache_load();
+
+	return 0;
+}
+
+int hci_dev_cache_enable(void)
+{
+	struct sockaddr_hci addr;
+	struct hci_filter flt;
+	int err;
+
+	if (dev_cache.sk >= 0)
+		return 0;
+
+	dev_cache.sk = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (dev_cache.sk < 0)
+		return -1;
+
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_set_event(EVT_STACK_INTERNAL, &flt);
+	if (setsockopt(dev_cache.sk, SOL_HCI, HCI_FILTER, &flt,
+							sizeof(flt)) < 0)
+		goto failed;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = HCI_DEV_NONE;
+	if (bind(dev_cache.sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto failed;
+
+	err = dev_cache_load();
+	if (err < 0) {
+		errno = -err;
+		goto failed;
+	}
+
+	return 0;
+
+failed:
+	err = errno;
+	close(dev_cache.sk);
+	dev_cache.sk = -1;
+	errno = err;
+
+	return -1;
+}
+
+void hci_dev_cache_disable(void)
+{
+	if (dev_cache.sk < 0)
+		return;
+
+	close(dev_cache.sk);
+	dev_cache.sk = -1;
+	dev_cache.count = 0;
+}
+
+/* Returns the cached information of dev_id, or NULL if there is no such
+ * device or the cache is disabled or could not be updated */
+static struct hci_dev_info *dev_cache_lookup(int dev_id)
+{
+	int i;
+
+	if (dev_cache.sk < 0 || dev_cache_update() < 0)
+		return NULL;
+
+	for (i = 0; i < dev_cache.count; i++)
+		if (dev_cache.info[i].dev_id == dev_id)
+			return &dev_cache.info[i];
+
+	return NULL;
+}
+
+/* Same as hci_for_each_dev() with func comparing addresses, served from
+ * the table; returns -2 if the table can't be used */
+static int dev_cache_find(int flag, const bdaddr_t *bdaddr, int same)
+{
+	int i;
+
+	if (dev_cache.sk < 0 || dev_cache_update() < 0)
+		return -2;
+
+	for (i = 0; i < dev_cache.count; i++) {
+		struct hci_dev_info *di = &dev_cache.info[i];
+
+		if (!hci_test_bit(flag, &di->flags))
+			continue;
+
+		if (same) {
+			if (!bacmp(bdaddr, &di->bdaddr))
+				return di->dev_id;
+		} else if (!hci_test_bit(HCI_RAW, &di->flags) &&
+						bacmp(bdaddr, &di->bdaddr))
+			return di->dev_id;
+	}
+
+	errno = ENODEV;
+
+	return -1;
+}
+
 int hci_for_each_dev(int flag, int (*func)(int dd, int dev_id, long arg),
 			long arg)
 {
@@ -883,6 +1063,12 @@ static int __same_bdaddr(int dd, int dev_id, long arg)
 
 int hci_get_route(bdaddr_t *bdaddr)
 {
+	int id;
+
+	id = dev_cache_find(HCI_UP, bdaddr ? bdaddr : BDADDR_ANY, 0);
+	if (id != -2)
+		return id;
+
 	return hci_for_each_dev(HCI_UP, __other_bdaddr,
 				(long) (bdaddr ? bdaddr : BDADDR_ANY));
 }
@@ -899,7 +1085,10 @@ int hci_devid(const char *str)
 	} else {
 		errno = ENODEV;
 		str2ba(str, &ba);
-		id = hci_for_each_dev(HCI_UP, __same_bdaddr, (long) &ba);
+		id = dev_cache_find(HCI_UP, &ba, 1);
+		if (id == -2)
+			id = hci_for_each_dev(HCI_UP, __same_bdaddr,
+								(long) &ba);
 	}
 
 	return id;
@@ -927,12 +1116,17 @@ int hci_devinfo(int dev_id, struct hci_dev_info *di)
 
 int hci_devba(int dev_id, bdaddr_t *bdaddr)
 {
-	struct hci_dev_info di;
+	struct hci_dev_info di, *cached;
 
-	memset(&di, 0, sizeof(di));
+	cached = dev_cache_lookup(dev_id);
+	if (cached)
+		memcpy(&di, cached, sizeof(di));
+	else {
+		memset(&di, 0, sizeof(di));
 
-	if (hci_devinfo(dev_id, &di))
-		return -1;
+		if (hci_devinfo(dev_id, &di))
+			return -1;
+	}
 
 	if (!hci_test_bit(HCI_UP, &di.flags)) {
 		errno = ENETDOWN;
@@ -1226,6 +1420,296 @@ done:
 	return 0;
 }
 
+/* Asynchronous requests
+ *
+ * Unlike hci_send_req() the socket filter is set up once for the queue
+ * and kept until it is freed, so any number of requests can be out at
+ * the same time. Command Status and Command Complete events are matched
+ * by opcode, other events by event code, to the oldest request waiting
+ * for them. */
+
+struct hci_req_entry {
+	struct hci_request *req;
+	uint16_t opcode;
+	hci_req_cb_t cb;
+	void *user_data;
+	struct hci_req_entry *next;
+};
+
+struct hci_req_queue {
+	int dd;
+	struct hci_filter of;
+	struct hci_filter nf;
+	struct hci_req_entry *head;
+	struct hci_req_entry *tail;
+	int pending;
+};
+
+struct hci_req_queue *hci_req_queue_new(int dd)
+{
+	struct hci_req_queue *q;
+	socklen_t olen;
+
+	q = malloc(sizeof(*q));
+	if (!q)
+		return NULL;
+
+	memset(q, 0, sizeof(*q));
+	q->dd = dd;
+
+	olen = sizeof(q->of);
+	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &q->of, &olen) < 0)
+		goto failed;
+
+	hci_filter_clear(&q->nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &q->nf);
+	hci_filter_set_event(EVT_CMD_STATUS, &q->nf);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &q->nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &q->nf);
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &q->nf, sizeof(q->nf)) < 0)
+		goto failed;
+
+	return q;
+
+failed:
+	free(q);
+	return NULL;
+}
+
+static void req_complete(struct hci_req_queue *q, struct hci_req_entry *e,
+								int err)
+{
+	struct hci_req_entry **p;
+
+	for (p = &q->head; *p; p = &(*p)->next) {
+		if (*p != e)
+			continue;
+
+		*p = e->next;
+		if (q->tail == e) {
+			struct hci_req_entry *t = q->head;
+
+			while (t && t->next)
+				t = t->next;
+			q->tail = t;
+		}
+		break;
+	}
+
+	q->pending--;
+
+	if (e->cb)
+		e->cb(e->req, err, e->user_data);
+
+	free(e);
+}
+
+void hci_req_queue_free(struct hci_req_queue *q)
+{
+	if (!q)
+		return;
+
+	while (q->head)
+		req_complete(q, q->head, ECANCELED);
+
+	setsockopt(q->dd, SOL_HCI, HCI_FILTER, &q->of, sizeof(q->of));
+	free(q);
+}
+
+int hci_req_submit(struct hci_req_queue *q, struct hci_request *r,
+					hci_req_cb_t cb, void *user_data)
+{
+	struct hci_req_entry *e;
+
+	if (!hci_filter_test_event(r->event, &q->nf)) {
+		hci_filter_set_event(r->event, &q->nf);
+		if (setsockopt(q->dd, SOL_HCI, HCI_FILTER, &q->nf,
+							sizeof(q->nf)) < 0)
+			return -1;
+	}
+
+	e = malloc(sizeof(*e));
+	if (!e) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	e->req = r;
+	e->opcode = htobs(cmd_opcode_pack(r->ogf, r->ocf));
+	e->cb = cb;
+	e->user_data = user_data;
+	e->next = NULL;
+
+	if (hci_send_cmd(q->dd, r->ogf, r->ocf, r->clen, r->cparam) < 0) {
+		free(e);
+		return -1;
+	}
+
+	if (q->tail)
+		q->tail->next = e;
+	else
+		q->head = e;
+	q->tail = e;
+	q->pending++;
+
+	return 0;
+}
+
+int hci_req_pending(struct hci_req_queue *q)
+{
+	return q->pending;
+}
+
+static int req_dispatch(struct hci_req_queue *q, unsigned char *buf, int len)
+{
+	hci_event_hdr *hdr = (void *) (buf + 1);
+	unsigned char *ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+	struct hci_req_entry *e;
+	struct hci_request *r;
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+		return 0;
+
+	len -= (1 + HCI_EVENT_HDR_SIZE);
+
+	for (e = q->head; e; e = e->next) {
+		evt_cmd_complete *cc;
+		evt_cmd_status *cs;
+		evt_remote_name_req_complete *rn;
+		evt_le_meta_event *me;
+		remote_name_req_cp *cp;
+
+		r = e->req;
+
+		switch (hdr->evt) {
+		case EVT_CMD_STATUS:
+			cs = (void *) ptr;
+
+			if (cs->opcode != e->opcode)
+				continue;
+
+			if (r->event != EVT_CMD_STATUS) {
+				if (cs->status) {
+					req_complete(q, e, EIO);
+					return 1;
+				}
+				return 0;
+			}
+
+			r->rlen = MIN(len, r->rlen);
+			memcpy(r->rparam, ptr, r->rlen);
+			req_complete(q, e, 0);
+			return 1;
+
+		case EVT_CMD_COMPLETE:
+			cc = (void *) ptr;
+
+			if (cc->opcode != e->opcode)
+				continue;
+
+			r->rlen = MIN(len - EVT_CMD_COMPLETE_SIZE, r->rlen);
+			memcpy(r->rparam, ptr + EVT_CMD_COMPLETE_SIZE, r->rlen);
+			req_complete(q, e, 0);
+			return 1;
+
+		case EVT_REMOTE_NAME_REQ_COMPLETE:
+			if (r->event != hdr->evt)
+				continue;
+
+			rn = (void *) ptr;
+			cp = r->cparam;
+
+			if (bacmp(&rn->bdaddr, &cp->bdaddr))
+				continue;
+
+			r->rlen = MIN(len, r->rlen);
+			memcpy(r->rparam, ptr, r->rlen);
+			req_complete(q, e, 0);
+			return 1;
+
+		case EVT_LE_META_EVENT:
+			me = (void *) ptr;
+
+			if (r->ogf != OGF_LE_CTL || me->subevent != r->event)
+				continue;
+
+			r->rlen = MIN(len - 1, r->rlen);
+			memcpy(r->rparam, me->data, r->rlen);
+			req_complete(q, e, 0);
+			return 1;
+
+		default:
+			if (r->event != hdr->evt)
+				continue;
+
+			r->rlen = MIN(len, r->rlen);
+			memcpy(r->rparam, ptr, r->rlen);
+			req_complete(q, e, 0);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int req_read(struct hci_req_queue *q, int to)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct pollfd p;
+	int n, len;
+
+	p.fd = q->dd; p.events = POLLIN;
+	while ((n = poll(&p, 1, to)) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			continue;
+		return -1;
+	}
+
+	if (!n)
+		return 0;
+
+	while ((len = read(q->dd, buf, sizeof(buf))) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			continue;
+		return -1;
+	}
+
+	req_dispatch(q, buf, len);
+
+	return 1;
+}
+
+/* Handles whatever events are already waiting on the socket, without
+ * blocking, so it can be called when the descriptor polls readable */
+int hci_req_process(struct hci_req_queue *q)
+{
+	int err;
+
+	while ((err = req_read(q, 0)) > 0)
+		;
+
+	return err;
+}
+
+/* Waits until every submitted request has completed, or until no event
+ * arrived for to milliseconds */
+int hci_req_wait(struct hci_req_queue *q, int to)
+{
+	while (q->pending) {
+		int err = req_read(q, to);
+
+		if (err < 0)
+			return -1;
+
+		if (!err) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 int hci_create_connection(int dd, const bdaddr_t *bdaddr, uint16_t ptype,
 				uint16_t clkoffset, uint8_t rswitch,
 				uint16_t *handle, int to)
@@ -356,8 +356,21 @@ sdp_data_t *sdp_data_alloc_with_length(uint8_t dtd, const void *value,
 							uint32_t length)
 {
 	sdp_data_t *seq;
-	sdp_data_t *d = malloc(sizeof(sdp_data_t));
+	sdp_data_t *d;
+	size_t extra = 0;
+
+	/* Strings are stored right after the node, see sdp_data_free() */
+	switch (dtd) {
+	case SDP_URL_STR8:
+	case SDP_URL_STR16:
+	case SDP_TEXT_STR8:
+	case SDP_TEXT_STR16:
+		if (value && length <= USHRT_MAX)
+			extra = length + 1;
+		break;
+	}
 
+	d = malloc(sizeof(sdp_data_t) + extra);
 	if (!d)
 		return NULL;
 
@@ -432,13 +445,9 @@ sdp_data_t *sdp_data_alloc_with_length(uint8_t dtd, const void *value,
 
 		d->unitSize += length;
 		if (length <= USHRT_MAX) {
-			d->val.str = malloc(length);
-			if (!d->val.str) {
-				free(d);
-				return NULL;
-			}
-
+			d->val.str = (char *) (d + 1);
 			memcpy(d->val.str, value, length);
+			d->val.str[length] = '\0';
 		} else {
 			SDPERR("Strings of size > USHRT_MAX not supported\n");
 			free(d);
@@ -582,15 +591,346 @@ static void extract_svclass_uuid(sdp_data_t *data, uuid_t *uuid)
 	*uuid = d->val.uuid;
 }
 
+/*
+ * State the library keeps for the records it allocated itself. It lives
+ * in a table next to the records rather than in sdp_record_t, so that
+ * the size and layout applications were built with stay the same.
+ * Records set up by applications have none and are handled through
+ * attrlist alone, as they always were. Like the records themselves the
+ * table is not protected against concurrent use.
+ */
+struct sdp_record_priv {
+	const sdp_record_t *rec;
+	struct sdp_record_priv *next;
+
+	/* Memory backing the whole record when it was extracted with
+	 * SDP_ARENA_RECORDS, such records are read-only */
+	struct sdp_arena *arena;
+
+	/* Raw attributes of records extracted with SDP_LAZY_RECORDS, which
+	 * attrlist only holds once they got looked up or decoded */
+	struct sdp_lazy *lazy;
+
+	/* Serialized form of the record, generated by the first
+	 * sdp_get_record_pdu and dropped whenever an attribute changes */
+	uint8_t *pdu_cache;
+	uint32_t pdu_cache_len;
+
+	/* Serialized attribute subsets, see sdp_record_cache_get() */
+	struct attr_cache *attr_cache;
+
+	/* Nodes of attrlist in attribute order for binary search, kept up
+	 * to date by the attribute accessors */
+	sdp_list_t **attr_index;
+	unsigned int attr_count;
+	unsigned int attr_size;
+};
+
+#define PRIV_TABLE_MIN	64
+
+static struct sdp_record_priv **priv_table = NULL;
+static unsigned int priv_table_size = 0;
+static unsigned int priv_count = 0;
+
+/* Attribute accessors tend to hit the same record many times in a row */
+static struct sdp_record_priv *priv_last = NULL;
+
+static unsigned int priv_hash(const sdp_record_t *rec, unsigned int size)
+{
+	unsigned long p = (unsigned long) rec;
+
+	return ((p >> 4) ^ (p >> 12)) & (size - 1);
+}
+
+static void priv_table_grow(void)
+{
+	struct sdp_record_priv **table;
+	unsigned int i, size;
+
+	size = priv_table_size ? priv_table_size * 4 : PRIV_TABLE_MIN;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return;
+
+	for (i = 0; i < priv_table_size; i++) {
+		struct sdp_record_priv *priv = priv_table[i];
+
+		while (priv) {
+			struct sdp_record_priv *next = priv->next;
+			unsigned int h = priv_hash(priv->rec, size);
+
+			priv->next = table[h];
+			table[h] = priv;
+			priv = next;
+		}
+	}
+
+	free(priv_table);
+	priv_table = table;
+	priv_table_size = size;
+}
+
+static struct sdp_record_priv *record_priv_lookup(const sdp_record_t *rec)
+{
+	struct sdp_record_priv *priv = NULL;
+
+	if (priv_table)
+		priv = priv_table[priv_hash(rec, priv_table_size)];
+
+	for (; priv; priv = priv->next)
+		if (priv->rec == rec)
+			break;
+
+	if (priv)
+		priv_last = priv;
+
+	return priv;
+}
+
+static inline struct sdp_record_priv *record_priv(const sdp_record_t *rec)
+{
+	if (priv_last && priv_last->rec == rec)
+		return priv_last;
+
+	return record_priv_lookup(rec);
+}
+
+static struct sdp_record_priv *record_priv_new(const sdp_record_t *rec)
+{
+	struct sdp_record_priv *priv;
+	unsigned int h;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return NULL;
+
+	priv->rec = rec;
+
+	if (priv_count >= priv_table_size * 2)
+		priv_table_grow();
+
+	if (!priv_table) {
+		free(priv);
+		return NULL;
+	}
+
+	h = priv_hash(rec, priv_table_size);
+	priv->next = priv_table[h];
+	priv_table[h] = priv;
+	priv_count++;
+
+	return priv;
+}
+
+/* Unlinks the state of rec, which the caller then releases */
+static struct sdp_record_priv *record_priv_take(const sdp_record_t *rec)
+{
+	struct sdp_record_priv *priv = NULL, **prev;
+
+	if (!priv_table)
+		return NULL;
+
+	for (prev = &priv_table[priv_hash(rec, priv_table_size)];
+					(priv = *prev); prev = &priv->next) {
+		if (priv->rec == rec) {
+			*prev = priv->next;
+			priv_count--;
+			break;
+		}
+	}
+
+	if (priv == priv_last)
+		priv_last = NULL;
+
+	return priv;
+}
+
+static void *arena_alloc(struct sdp_record_priv *priv, size_t size);
+static void lazy_drop(sdp_record_t *rec, struct sdp_record_priv *priv);
+static void pdu_cache_drop(struct sdp_record_priv *priv);
+
+/*
+ * The index goes stale when attrlist is replaced directly, as some users
+ * do to drop all attributes at once. That shows as a head mismatch and
+ * the index is rebuilt from the list.
+ */
+static int attr_index_valid(const sdp_record_t *rec,
+					const struct sdp_record_priv *priv)
+{
+	if (priv->attr_count == 0)
+		return rec->attrlist == NULL;
+
+	return priv->attr_index[0] == rec->attrlist;
+}
+
+static int attr_index_rebuild(sdp_record_t *rec, struct sdp_record_priv *priv)
+{
+	sdp_list_t *l;
+	unsigned int i, count = 0;
+
+	/* The index of arena records is set up during extraction */
+	if (priv->arena)
+		return -1;
+
+	for (l = rec->attrlist; l; l = l->next)
+		count++;
+
+	if (count > priv->attr_size) {
+		sdp_list_t **index;
+
+		index = realloc(priv->attr_index, count * sizeof(sdp_list_t *));
+		if (!index)
+			return -1;
+
+		priv->attr_index = index;
+		priv->attr_size = count;
+	}
+
+	for (i = 0, l = rec->attrlist; l; l = l->next)
+		priv->attr_index[i++] = l;
+
+	priv->attr_count = count;
+
+	return 0;
+}
+
+#define ATTR_INDEX_SCAN	8
+
+/*
+ * Returns 1 and the position of attr, 0 and the position to insert it at
+ * or -1 if no index could be set up, which records allocated outside the
+ * library never have.
+ */
+static int attr_index_lookup(sdp_record_t *rec, struct sdp_record_priv *priv,
+					uint16_t attr, unsigned int *pos)
+{
+	unsigned int low = 0, high;
+
+	if (!priv)
+		return -1;
+
+	if (!attr_index_valid(rec, priv) && attr_index_rebuild(rec, priv) < 0)
+		return -1;
+
+	high = priv->attr_count;
+
+	/* Halve down to a few attributes, most records have no more than
+	 * that and a scan beats mispredicted branches there */
+	while (high - low > ATTR_INDEX_SCAN) {
+		unsigned int mid = low + (high - low) / 2;
+		sdp_data_t *d = priv->attr_index[mid]->data;
+
+		if (d->attrId == attr) {
+			*pos = mid;
+			return 1;
+		}
+
+		if (d->attrId < attr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	for (; low < high; low++) {
+		sdp_data_t *d = priv->attr_index[low]->data;
+
+		if (d->attrId >= attr)
+			break;
+	}
+
+	*pos = low;
+
+	return low < high &&
+		((sdp_data_t *) priv->attr_index[low]->data)->attrId == attr;
+}
+
+static int attr_index_insert(sdp_record_t *rec, struct sdp_record_priv *priv,
+					unsigned int pos, sdp_data_t *d)
+{
+	sdp_list_t *n;
+
+	if (priv->attr_count == priv->attr_size) {
+		unsigned int size = priv->attr_size ? priv->attr_size * 2 : 8;
+		sdp_list_t **index;
+
+		/* Arena records get an index big enough up front */
+		if (priv->arena)
+			return -1;
+
+		index = realloc(priv->attr_index, size * sizeof(sdp_list_t *));
+		if (!index)
+			return -1;
+
+		priv->attr_index = index;
+		priv->attr_size = size;
+	}
+
+	if (priv->arena)
+		n = arena_alloc(priv, sizeof(sdp_list_t));
+	else
+		n = malloc(sizeof(sdp_list_t));
+	if (!n)
+		return -1;
+
+	n->data = d;
+	n->next = pos < priv->attr_count ? priv->attr_index[pos] : NULL;
+
+	if (pos > 0)
+		priv->attr_index[pos - 1]->next = n;
+	else
+		rec->attrlist = n;
+
+	memmove(priv->attr_index + pos + 1, priv->attr_index + pos,
+			(priv->attr_count - pos) * sizeof(sdp_list_t *));
+	priv->attr_index[pos] = n;
+	priv->attr_count++;
+
+	return 0;
+}
+
+static void attr_index_remove(sdp_record_t *rec, struct sdp_record_priv *priv,
+							unsigned int pos)
+{
+	sdp_list_t *n = priv->attr_index[pos];
+
+	if (pos > 0)
+		priv->attr_index[pos - 1]->next = n->next;
+	else
+		rec->attrlist = n->next;
+
+	free(n);
+
+	priv->attr_count--;
+	memmove(priv->attr_index + pos, priv->attr_index + pos + 1,
+			(priv->attr_count - pos) * sizeof(sdp_list_t *));
+}
+
 int sdp_attr_add(sdp_record_t *rec, uint16_t attr, sdp_data_t *d)
 {
-	sdp_data_t *p = sdp_data_get(rec, attr);
+	struct sdp_record_priv *priv = record_priv(rec);
+	unsigned int pos;
+	int found;
 
-	if (p)
+	if (priv && priv->arena) {
+		SDPERR("Can't modify an arena record");
 		return -1;
+	}
+
+	lazy_drop(rec, priv);
+	pdu_cache_drop(priv);
 
 	d->attrId = attr;
-	rec->attrlist = sdp_list_insert_sorted(rec->attrlist, d, sdp_attrid_comp_func);
+
+	found = attr_index_lookup(rec, priv, attr, &pos);
+	if (found < 0) {
+		if (sdp_data_get(rec, attr))
+			return -1;
+
+		rec->attrlist = sdp_list_insert_sorted(rec->attrlist, d,
+							sdp_attrid_comp_func);
+	} else if (found > 0 || attr_index_insert(rec, priv, pos, d) < 0)
+		return -1;
 
 	if (attr == SDP_ATTR_SVCLASS_ID_LIST)
 		extract_svclass_uuid(d, &rec->svclass);
@@ -600,10 +940,27 @@ int sdp_attr_add(sdp_record_t *rec, uint16_t attr, sdp_data_t *d)
 
 void sdp_attr_remove(sdp_record_t *rec, uint16_t attr)
 {
-	sdp_data_t *d = sdp_data_get(rec, attr);
+	struct sdp_record_priv *priv = record_priv(rec);
+	unsigned int pos;
+	int found;
 
-	if (d)
-		rec->attrlist = sdp_list_remove(rec->attrlist, d);
+	if (priv && priv->arena) {
+		SDPERR("Can't modify an arena record");
+		return;
+	}
+
+	lazy_drop(rec, priv);
+	pdu_cache_drop(priv);
+
+	found = attr_index_lookup(rec, priv, attr, &pos);
+	if (found > 0)
+		attr_index_remove(rec, priv, pos);
+	else if (found < 0) {
+		sdp_data_t *d = sdp_data_get(rec, attr);
+
+		if (d)
+			rec->attrlist = sdp_list_remove(rec->attrlist, d);
+	}
 
 	if (attr == SDP_ATTR_SVCLASS_ID_LIST)
 		memset(&rec->svclass, 0, sizeof(rec->svclass));
@@ -912,43 +1269,227 @@ int sdp_gen_pdu(sdp_buf_t *buf, sdp_data_t *d)
 	return pdu_size;
 }
 
-static void sdp_attr_pdu(void *value, void *udata)
+static int pdu_reserve(sdp_buf_t *buf, uint32_t len)
+{
+	uint32_t size;
+	uint8_t *data;
+
+	if (buf->data_size + len <= buf->buf_size)
+		return 0;
+
+	size = buf->buf_size ? buf->buf_size : 256;
+	while (size < buf->data_size + len)
+		size *= 2;
+
+	data = realloc(buf->data, size);
+	if (!data)
+		return -ENOMEM;
+
+	buf->data = data;
+	buf->buf_size = size;
+
+	return 0;
+}
+
+/*
+ * Sequences get their length filled in once the members are written, so
+ * unlike sdp_append_to_pdu nothing needs to be sized up front.
+ */
+static int pdu_put_data(sdp_buf_t *buf, sdp_data_t *d)
+{
+	uint32_t start = buf->data_size;
+	sdp_data_t *child;
+	int hdr;
+
+	switch (d->dtd) {
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		if (pdu_reserve(buf, sizeof(uint8_t) + sizeof(uint32_t)) < 0)
+			return -ENOMEM;
+
+		hdr = sdp_set_data_type(buf, d->dtd);
+
+		for (child = d->val.dataseq; child; child = child->next)
+			if (pdu_put_data(buf, child) < 0)
+				return -ENOMEM;
+
+		sdp_set_seq_len(buf->data + start, buf->data_size - start - hdr);
+		return 0;
+	case SDP_TEXT_STR8:
+	case SDP_TEXT_STR16:
+	case SDP_TEXT_STR32:
+	case SDP_URL_STR8:
+	case SDP_URL_STR16:
+	case SDP_URL_STR32:
+		if (pdu_reserve(buf, sizeof(uint8_t) + sizeof(uint32_t) +
+							d->unitSize) < 0)
+			return -ENOMEM;
+		break;
+	default:
+		if (pdu_reserve(buf, sizeof(uint8_t) + sizeof(uint128_t)) < 0)
+			return -ENOMEM;
+		break;
+	}
+
+	sdp_gen_pdu(buf, d);
+
+	return 0;
+}
+
+static int gen_record_pdu(const sdp_record_t *rec, sdp_buf_t *buf)
 {
-	sdp_append_to_pdu((sdp_buf_t *)udata, (sdp_data_t *)value);
+	sdp_list_t *l;
+	uint32_t len;
+
+	memset(buf, 0, sizeof(sdp_buf_t));
+
+	if (!rec->attrlist)
+		return 0;
+
+	/* Start with a SEQ16 header, it is shrunk at the end if SEQ8 fits */
+	if (pdu_reserve(buf, 3) < 0)
+		return -ENOMEM;
+
+	buf->data[0] = SDP_SEQ16;
+	buf->data_size = 3;
+
+	for (l = rec->attrlist; l; l = l->next) {
+		sdp_data_t *d = l->data;
+		uint8_t *p;
+
+		if (pdu_reserve(buf, sizeof(uint8_t) + sizeof(uint16_t)) < 0)
+			return -ENOMEM;
+
+		p = buf->data + buf->data_size;
+		*p++ = SDP_UINT16;
+		bt_put_unaligned(htons(d->attrId), (uint16_t *) p);
+		buf->data_size += sizeof(uint8_t) + sizeof(uint16_t);
+
+		if (pdu_put_data(buf, d) < 0)
+			return -ENOMEM;
+	}
+
+	len = buf->data_size - 3;
+
+	if (len + 2 <= UCHAR_MAX) {
+		memmove(buf->data + 2, buf->data + 3, len);
+		buf->data[0] = SDP_SEQ8;
+		buf->data[1] = len;
+		buf->data_size = len + 2;
+	} else
+		bt_put_unaligned(htons(len), (uint16_t *) (buf->data + 1));
+
+	return 0;
 }
 
-static void sdp_attr_size(void *value, void *udata)
+#define ATTR_CACHE_MAX 4
+
+struct attr_cache {
+	struct attr_cache *next;
+	uint32_t key_len;
+	uint32_t len;
+	uint8_t buf[0];		/* key followed by the data */
+};
+
+static void pdu_cache_drop(struct sdp_record_priv *priv)
 {
-	sdp_gen_buffer((sdp_buf_t *)udata, (sdp_data_t *)value);
+	struct attr_cache *c;
+
+	if (!priv)
+		return;
+
+	c = priv->attr_cache;
+
+	while (c) {
+		struct attr_cache *next = c->next;
+		free(c);
+		c = next;
+	}
+
+	priv->attr_cache = NULL;
+
+	free(priv->pdu_cache);
+	priv->pdu_cache = NULL;
+	priv->pdu_cache_len = 0;
 }
 
 int sdp_gen_record_pdu(const sdp_record_t *rec, sdp_buf_t *buf)
 {
+	const uint8_t *pdu;
+	uint32_t len;
+	int err;
+
 	memset(buf, 0, sizeof(sdp_buf_t));
-	sdp_list_foreach(rec->attrlist, sdp_attr_size, buf);
 
-	buf->data = malloc(buf->buf_size);
+	err = sdp_get_record_pdu(rec, &pdu, &len);
+	if (err == -ENOTSUP) {
+		err = gen_record_pdu(rec, buf);
+		if (err < 0) {
+			free(buf->data);
+			memset(buf, 0, sizeof(sdp_buf_t));
+		}
+		return err;
+	}
+
+	if (err < 0)
+		return err;
+
+	if (len == 0)
+		return 0;
+
+	buf->data = malloc(len);
 	if (!buf->data)
 		return -ENOMEM;
-	buf->data_size = 0;
-	memset(buf->data, 0, buf->buf_size);
 
-	sdp_list_foreach(rec->attrlist, sdp_attr_pdu, buf);
+	memcpy(buf->data, pdu, len);
+	buf->data_size = len;
+	buf->buf_size = len;
 
 	return 0;
 }
 
 void sdp_attr_replace(sdp_record_t *rec, uint16_t attr, sdp_data_t *d)
 {
-	sdp_data_t *p = sdp_data_get(rec, attr);
+	struct sdp_record_priv *priv = record_priv(rec);
+	unsigned int pos;
+	int found;
 
-	if (p) {
-		rec->attrlist = sdp_list_remove(rec->attrlist, p);
-		sdp_data_free(p);
+	if (priv && priv->arena) {
+		SDPERR("Can't modify an arena record");
+		sdp_data_free(d);
+		return;
 	}
 
+	lazy_drop(rec, priv);
+	pdu_cache_drop(priv);
+
 	d->attrId = attr;
-	rec->attrlist = sdp_list_insert_sorted(rec->attrlist, d, sdp_attrid_comp_func);
+
+	found = attr_index_lookup(rec, priv, attr, &pos);
+	if (found > 0) {
+		sdp_list_t *n = priv->attr_index[pos];
+
+		sdp_data_free(n->data);
+		n->data = d;
+	} else if (found < 0 && !priv) {
+		sdp_data_t *p = sdp_data_get(rec, attr);
+
+		if (p) {
+			rec->attrlist = sdp_list_remove(rec->attrlist, p);
+			sdp_data_free(p);
+		}
+
+		rec->attrlist = sdp_list_insert_sorted(rec->attrlist, d,
+							sdp_attrid_comp_func);
+	} else if (found < 0 || attr_index_insert(rec, priv, pos, d) < 0) {
+		SDPERR("Not enough memory to add attribute 0x%04x", attr);
+		sdp_data_free(d);
+		return;
+	}
 
 	if (attr == SDP_ATTR_SVCLASS_ID_LIST)
 		extract_svclass_uuid(d, &rec->svclass);
@@ -989,7 +1530,8 @@ void sdp_data_free(sdp_data_t *d)
 	case SDP_TEXT_STR8:
 	case SDP_TEXT_STR16:
 	case SDP_TEXT_STR32:
-		free(d->val.str);
+		if (d->val.str != (char *) (d + 1))
+			free(d->val.str);
 		break;
 	}
 	free(d);
@@ -1038,21 +1580,202 @@ int sdp_uuid_extract(const uint8_t *p, int bufsize, uuid_t *uuid, int *scanned)
 	return 0;
 }
 
-static sdp_data_t *extract_int(const void *p, int bufsize, int *len)
+/*
+ * Records extracted with SDP_ARENA_RECORDS carve the record itself, its
+ * lists, data elements and strings out of a bump allocated chunk sized
+ * after the length of the record in the PDU. Bigger chunks get chained in
+ * front when the estimate falls short, freeing walks that chain only.
+ */
+struct sdp_arena {
+	struct sdp_arena *next;
+	size_t size;
+	size_t used;
+	uint8_t data[0] __attribute__ ((aligned(8)));
+};
+
+#define ARENA_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+/* Memory needed per byte of the record in the PDU, good for common
+ * records, the arena grows past that when needed */
+#define ARENA_BYTES_PER_PDU_BYTE	16
+
+static struct sdp_arena *arena_new(size_t size, struct sdp_arena *next)
 {
-	sdp_data_t *d;
+	struct sdp_arena *a = malloc(sizeof(struct sdp_arena) + size);
 
-	if (bufsize < (int) sizeof(uint8_t)) {
-		SDPERR("Unexpected end of packet");
+	if (!a)
 		return NULL;
-	}
 
-	d = malloc(sizeof(sdp_data_t));
-	if (!d)
-		return NULL;
+	a->next = next;
+	a->size = size;
+	a->used = 0;
 
-	SDPDBG("Extracting integer\n");
-	memset(d, 0, sizeof(sdp_data_t));
+	return a;
+}
+
+static void *arena_alloc(struct sdp_record_priv *priv, size_t size)
+{
+	struct sdp_arena *a = priv->arena;
+	void *p;
+
+	size = ARENA_ALIGN(size);
+
+	if (a->used + size > a->size) {
+		a = arena_new(a->size * 2 > size ? a->size * 2 : size, a);
+		if (!a)
+			return NULL;
+		priv->arena = a;
+	}
+
+	p = a->data + a->used;
+	a->used += size;
+
+	return p;
+}
+
+static void arena_free(struct sdp_arena *a)
+{
+	while (a) {
+		struct sdp_arena *next = a->next;
+		free(a);
+		a = next;
+	}
+}
+
+static sdp_record_t *arena_record_new(size_t size)
+{
+	struct sdp_record_priv *priv;
+	struct sdp_arena *a;
+	sdp_record_t *rec;
+
+	a = arena_new(ARENA_ALIGN(sizeof(sdp_record_t)) + size, NULL);
+	if (!a)
+		return NULL;
+
+	rec = (sdp_record_t *) a->data;
+	a->used = ARENA_ALIGN(sizeof(sdp_record_t));
+
+	memset(rec, 0, sizeof(sdp_record_t));
+	rec->handle = 0xffffffff;
+
+	priv = record_priv_new(rec);
+	if (!priv) {
+		free(a);
+		return NULL;
+	}
+
+	priv->arena = a;
+
+	return rec;
+}
+
+static sdp_list_t *arena_list_insert_sorted(struct sdp_record_priv *priv,
+				sdp_list_t *list, void *d, sdp_comp_func_t f)
+{
+	sdp_list_t *q, *p, *n;
+
+	n = arena_alloc(priv, sizeof(sdp_list_t));
+	if (!n)
+		return list;
+	n->data = d;
+	for (q = 0, p = list; p; q = p, p = p->next)
+		if (f(p->data, d) >= 0)
+			break;
+	if (q)
+		q->next = n;
+	else
+		list = n;
+	n->next = p;
+	return list;
+}
+
+/* Attributes come in ascending order, so appending after *tail is the
+ * common case. A repeated attribute replaces the earlier value. */
+static void arena_attr_add(sdp_record_t *rec, struct sdp_record_priv *priv,
+					sdp_list_t **tail, sdp_data_t *d)
+{
+	sdp_list_t *q, *p, *n;
+
+	if (*tail && ((sdp_data_t *) (*tail)->data)->attrId >= d->attrId) {
+		for (q = NULL, p = rec->attrlist; p; q = p, p = p->next) {
+			sdp_data_t *curr = p->data;
+
+			if (curr->attrId == d->attrId) {
+				p->data = d;
+				return;
+			}
+
+			if (curr->attrId > d->attrId)
+				break;
+		}
+
+		n = arena_alloc(priv, sizeof(sdp_list_t));
+		if (!n)
+			return;
+
+		n->data = d;
+		n->next = p;
+		if (q)
+			q->next = n;
+		else
+			rec->attrlist = n;
+		return;
+	}
+
+	n = arena_alloc(priv, sizeof(sdp_list_t));
+	if (!n)
+		return;
+
+	n->data = d;
+	n->next = NULL;
+	if (*tail)
+		(*tail)->next = n;
+	else
+		rec->attrlist = n;
+	*tail = n;
+}
+
+/* extra bytes are allocated right after the node, for its string */
+static sdp_data_t *data_new(sdp_record_t *rec, size_t extra)
+{
+	struct sdp_record_priv *priv = rec ? record_priv(rec) : NULL;
+	sdp_data_t *d;
+
+	if (priv && priv->arena)
+		d = arena_alloc(priv, sizeof(sdp_data_t) + extra);
+	else
+		d = malloc(sizeof(sdp_data_t) + extra);
+
+	if (d)
+		memset(d, 0, sizeof(sdp_data_t));
+
+	return d;
+}
+
+static void data_release(sdp_record_t *rec, void *p)
+{
+	struct sdp_record_priv *priv = rec ? record_priv(rec) : NULL;
+
+	/* Arena memory goes away with the record */
+	if (!priv || !priv->arena)
+		free(p);
+}
+
+static sdp_data_t *extract_int(const void *p, int bufsize, int *len,
+							sdp_record_t *rec)
+{
+	sdp_data_t *d;
+
+	if (bufsize < (int) sizeof(uint8_t)) {
+		SDPERR("Unexpected end of packet");
+		return NULL;
+	}
+
+	d = data_new(rec, 0);
+	if (!d)
+		return NULL;
+
+	SDPDBG("Extracting integer\n");
 	d->dtd = *(uint8_t *) p;
 	p += sizeof(uint8_t);
 	*len += sizeof(uint8_t);
@@ -1066,7 +1789,7 @@ static sdp_data_t *extract_int(const void *p, int bufsize, int *len)
 	case SDP_UINT8:
 		if (bufsize < (int) sizeof(uint8_t)) {
 			SDPERR("Unexpected end of packet");
-			free(d);
+			data_release(rec, d);
 			return NULL;
 		}
 		*len += sizeof(uint8_t);
@@ -1076,7 +1799,7 @@ static sdp_data_t *extract_int(const void *p, int bufsize, int *len)
 	case SDP_UINT16:
 		if (bufsize < (int) sizeof(uint16_t)) {
 			SDPERR("Unexpected end of packet");
-			free(d);
+			data_release(rec, d);
 			return NULL;
 		}
 		*len += sizeof(uint16_t);
@@ -1086,7 +1809,7 @@ static sdp_data_t *extract_int(const void *p, int bufsize, int *len)
 	case SDP_UINT32:
 		if (bufsize < (int) sizeof(uint32_t)) {
 			SDPERR("Unexpected end of packet");
-			free(d);
+			data_release(rec, d);
 			return NULL;
 		}
 		*len += sizeof(uint32_t);
@@ -1096,7 +1819,7 @@ static sdp_data_t *extract_int(const void *p, int bufsize, int *len)
 	case SDP_UINT64:
 		if (bufsize < (int) sizeof(uint64_t)) {
 			SDPERR("Unexpected end of packet");
-			free(d);
+			data_release(rec, d);
 			return NULL;
 		}
 		*len += sizeof(uint64_t);
@@ -1106,14 +1829,14 @@ static sdp_data_t *extract_int(const void *p, int bufsize, int *len)
 	case SDP_UINT128:
 		if (bufsize < (int) sizeof(uint128_t)) {
 			SDPERR("Unexpected end of packet");
-			free(d);
+			data_release(rec, d);
 			return NULL;
 		}
 		*len += sizeof(uint128_t);
 		ntoh128((uint128_t *) p, &d->val.uint128);
 		break;
 	default:
-		free(d);
+		data_release(rec, d);
 		d = NULL;
 	}
 	return d;
@@ -1122,30 +1845,36 @@ static sdp_data_t *extract_int(const void *p, int bufsize, int *len)
 static sdp_data_t *extract_uuid(const uint8_t *p, int bufsize, int *len,
 							sdp_record_t *rec)
 {
-	sdp_data_t *d = malloc(sizeof(sdp_data_t));
+	sdp_data_t *d = data_new(rec, 0);
 
 	if (!d)
 		return NULL;
 
 	SDPDBG("Extracting UUID");
-	memset(d, 0, sizeof(sdp_data_t));
 	if (sdp_uuid_extract(p, bufsize, &d->val.uuid, len) < 0) {
-		free(d);
+		data_release(rec, d);
 		return NULL;
 	}
 	d->dtd = *p;
-	if (rec)
-		sdp_pattern_add_uuid(rec, &d->val.uuid);
+	/* Lazy records collect their pattern when they get indexed */
+	if (rec) {
+		struct sdp_record_priv *priv = record_priv(rec);
+
+		if (!priv || !priv->lazy)
+			sdp_pattern_add_uuid(rec, &d->val.uuid);
+	}
 	return d;
 }
 
 /*
  * Extract strings from the PDU (could be service description and similar info)
  */
-static sdp_data_t *extract_str(const void *p, int bufsize, int *len)
+static sdp_data_t *extract_str(const void *p, int bufsize, int *len,
+							sdp_record_t *rec)
 {
 	char *s;
 	int n;
+	uint8_t dtd;
 	sdp_data_t *d;
 
 	if (bufsize < (int) sizeof(uint8_t)) {
@@ -1153,22 +1882,16 @@ static sdp_data_t *extract_str(const void *p, int bufsize, int *len)
 		return NULL;
 	}
 
-	d = malloc(sizeof(sdp_data_t));
-	if (!d)
-		return NULL;
-
-	memset(d, 0, sizeof(sdp_data_t));
-	d->dtd = *(uint8_t *) p;
+	dtd = *(uint8_t *) p;
 	p += sizeof(uint8_t);
 	*len += sizeof(uint8_t);
 	bufsize -= sizeof(uint8_t);
 
-	switch (d->dtd) {
+	switch (dtd) {
 	case SDP_TEXT_STR8:
 	case SDP_URL_STR8:
 		if (bufsize < (int) sizeof(uint8_t)) {
 			SDPERR("Unexpected end of packet");
-			free(d);
 			return NULL;
 		}
 		n = *(uint8_t *) p;
@@ -1180,32 +1903,31 @@ static sdp_data_t *extract_str(const void *p, int bufsize, int *len)
 	case SDP_URL_STR16:
 		if (bufsize < (int) sizeof(uint16_t)) {
 			SDPERR("Unexpected end of packet");
-			free(d);
 			return NULL;
 		}
 		n = ntohs(bt_get_unaligned((uint16_t *) p));
 		p += sizeof(uint16_t);
-		*len += sizeof(uint16_t) + n;
+		*len += sizeof(uint16_t);
 		bufsize -= sizeof(uint16_t);
 		break;
 	default:
 		SDPERR("Sizeof text string > UINT16_MAX\n");
-		free(d);
 		return NULL;
 	}
 
 	if (bufsize < n) {
 		SDPERR("String too long to fit in packet");
-		free(d);
 		return NULL;
 	}
 
-	s = malloc(n + 1);
-	if (!s) {
+	d = data_new(rec, n + 1);
+	if (!d) {
 		SDPERR("Not enough memory for incoming string");
-		free(d);
 		return NULL;
 	}
+
+	d->dtd = dtd;
+	s = (char *) (d + 1);
 	memset(s, 0, n + 1);
 	memcpy(s, p, n);
 
@@ -1277,13 +1999,12 @@ static sdp_data_t *extract_seq(const void *p, int bufsize, int *len,
 {
 	int seqlen, n = 0;
 	sdp_data_t *curr, *prev;
-	sdp_data_t *d = malloc(sizeof(sdp_data_t));
+	sdp_data_t *d = data_new(rec, 0);
 
 	if (!d)
 		return NULL;
 
 	SDPDBG("Extracting SEQ");
-	memset(d, 0, sizeof(sdp_data_t));
 	*len = sdp_extract_seqtype(p, bufsize, &d->dtd, &seqlen);
 	SDPDBG("Sequence Type : 0x%x length : 0x%x\n", d->dtd, seqlen);
 
@@ -1292,7 +2013,7 @@ static sdp_data_t *extract_seq(const void *p, int bufsize, int *len,
 
 	if (*len > bufsize) {
 		SDPERR("Packet not big enough to hold sequence.");
-		free(d);
+		data_release(rec, d);
 		return NULL;
 	}
 
@@ -1349,7 +2070,7 @@ sdp_data_t *sdp_extract_attr(const uint8_t *p, int bufsize, int *size,
 	case SDP_INT32:
 	case SDP_INT64:
 	case SDP_INT128:
-		elem = extract_int(p, bufsize, &n);
+		elem = extract_int(p, bufsize, &n, rec);
 		break;
 	case SDP_UUID16:
 	case SDP_UUID32:
@@ -1362,7 +2083,7 @@ sdp_data_t *sdp_extract_attr(const uint8_t *p, int bufsize, int *size,
 	case SDP_URL_STR8:
 	case SDP_URL_STR16:
 	case SDP_URL_STR32:
-		elem = extract_str(p, bufsize, &n);
+		elem = extract_str(p, bufsize, &n, rec);
 		break;
 	case SDP_SEQ8:
 	case SDP_SEQ16:
@@ -1376,96 +2097,647 @@ sdp_data_t *sdp_extract_attr(const uint8_t *p, int bufsize, int *size,
 		SDPERR("Unknown data descriptor : 0x%x terminating\n", dtd);
 		return NULL;
 	}
-	*size += n;
-	return elem;
+	*size += n;
+	return elem;
+}
+
+#ifdef SDP_DEBUG
+static void attr_print_func(void *value, void *userData)
+{
+	sdp_data_t *d = (sdp_data_t *)value;
+
+	SDPDBG("=====================================\n");
+	SDPDBG("ATTRIBUTE IDENTIFIER : 0x%x\n",  d->attrId);
+	SDPDBG("ATTRIBUTE VALUE PTR : 0x%x\n", (uint32_t)value);
+	if (d)
+		sdp_data_print(d);
+	else
+		SDPDBG("NULL value\n");
+	SDPDBG("=====================================\n");
+}
+
+void sdp_print_service_attr(sdp_list_t *svcAttrList)
+{
+	SDPDBG("Printing service attr list %p\n", svcAttrList);
+	sdp_list_foreach(svcAttrList, attr_print_func, NULL);
+	SDPDBG("Printed service attr list %p\n", svcAttrList);
+}
+#endif
+
+static sdp_record_t *extract_pdu(const uint8_t *buf, int bufsize,
+						int *scanned, int arena)
+{
+	int extracted = 0, seqlen = 0;
+	uint8_t dtd;
+	uint16_t attr;
+	sdp_record_t *rec;
+	struct sdp_record_priv *priv;
+	sdp_list_t *tail = NULL;
+	const uint8_t *p = buf;
+
+	*scanned = sdp_extract_seqtype(buf, bufsize, &dtd, &seqlen);
+	p += *scanned;
+	bufsize -= *scanned;
+
+	if (arena)
+		rec = arena_record_new((size_t) (seqlen < bufsize ?
+				seqlen : bufsize) * ARENA_BYTES_PER_PDU_BYTE);
+	else
+		rec = sdp_record_alloc();
+
+	if (!rec)
+		return NULL;
+
+	priv = record_priv(rec);
+
+	while (extracted < seqlen && bufsize > 0) {
+		int n = sizeof(uint8_t), attrlen = 0;
+		sdp_data_t *data = NULL;
+
+		SDPDBG("Extract PDU, sequenceLength: %d localExtractedLength: %d",
+							seqlen, extracted);
+
+		if (bufsize < n + (int) sizeof(uint16_t)) {
+			SDPERR("Unexpected end of packet");
+			break;
+		}
+
+		dtd = *(uint8_t *) p;
+		attr = ntohs(bt_get_unaligned((uint16_t *) (p + n)));
+		n += sizeof(uint16_t);
+
+		SDPDBG("DTD of attrId : %d Attr id : 0x%x \n", dtd, attr);
+
+		data = sdp_extract_attr(p + n, bufsize - n, &attrlen, rec);
+
+		SDPDBG("Attr id : 0x%x attrValueLength : %d\n", attr, attrlen);
+
+		n += attrlen;
+		if (data == NULL) {
+			SDPDBG("Terminating extraction of attributes");
+			break;
+		}
+
+		if (attr == SDP_ATTR_RECORD_HANDLE)
+			rec->handle = data->val.uint32;
+
+		if (attr == SDP_ATTR_SVCLASS_ID_LIST)
+			extract_svclass_uuid(data, &rec->svclass);
+
+		extracted += n;
+		p += n;
+		bufsize -= n;
+
+		if (priv && priv->arena) {
+			data->attrId = attr;
+			arena_attr_add(rec, priv, &tail, data);
+		} else
+			sdp_attr_replace(rec, attr, data);
+
+		SDPDBG("Extract PDU, seqLength: %d localExtractedLength: %d",
+							seqlen, extracted);
+	}
+
+	if (priv && priv->arena && rec->attrlist) {
+		unsigned int i, count = 0;
+		sdp_list_t *l;
+
+		for (l = rec->attrlist; l; l = l->next)
+			count++;
+
+		priv->attr_index = arena_alloc(priv,
+					count * sizeof(sdp_list_t *));
+		if (priv->attr_index) {
+			for (i = 0, l = rec->attrlist; l; l = l->next)
+				priv->attr_index[i++] = l;
+			priv->attr_count = count;
+			priv->attr_size = count;
+		}
+	}
+
+#ifdef SDP_DEBUG
+	SDPDBG("Successful extracting of Svc Rec attributes\n");
+	sdp_print_service_attr(rec->attrlist);
+#endif
+	*scanned += seqlen;
+	return rec;
+}
+
+sdp_record_t *sdp_extract_pdu(const uint8_t *buf, int bufsize, int *scanned)
+{
+	return extract_pdu(buf, bufsize, scanned, 0);
+}
+
+/*
+ * Lazy records keep a copy of the record as found in the PDU next to a
+ * sorted table of where each attribute value starts. Values are decoded
+ * into attrlist one at a time, the raw copy is dropped when the record
+ * gets modified.
+ */
+struct sdp_lazy_attr {
+	uint16_t id;
+	uint8_t decoded;
+	uint32_t offset;
+	uint32_t len;
+};
+
+struct sdp_lazy {
+	uint8_t *pdu;
+	uint32_t pdu_len;
+	int complete;
+	unsigned int count;
+	struct sdp_lazy_attr attrs[0];
+};
+
+/* Returns the size of the data element at p, sequences included */
+static int element_size(const uint8_t *p, int bufsize)
+{
+	uint8_t dtd;
+	int size, n;
+
+	if (bufsize < (int) sizeof(uint8_t))
+		return -1;
+
+	switch (*p) {
+	case SDP_DATA_NIL:
+		n = 1;
+		break;
+	case SDP_BOOL:
+	case SDP_INT8:
+	case SDP_UINT8:
+		n = 2;
+		break;
+	case SDP_INT16:
+	case SDP_UINT16:
+	case SDP_UUID16:
+		n = 3;
+		break;
+	case SDP_INT32:
+	case SDP_UINT32:
+	case SDP_UUID32:
+		n = 5;
+		break;
+	case SDP_INT64:
+	case SDP_UINT64:
+		n = 9;
+		break;
+	case SDP_INT128:
+	case SDP_UINT128:
+	case SDP_UUID128:
+		n = 17;
+		break;
+	case SDP_TEXT_STR8:
+	case SDP_URL_STR8:
+		if (bufsize < 2)
+			return -1;
+		n = 2 + p[1];
+		break;
+	case SDP_TEXT_STR16:
+	case SDP_URL_STR16:
+		if (bufsize < 3)
+			return -1;
+		n = 3 + ntohs(bt_get_unaligned((uint16_t *) (p + 1)));
+		break;
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		n = sdp_extract_seqtype(p, bufsize, &dtd, &size);
+		if (n == 0 || size < 0 || size > bufsize - n)
+			return -1;
+		n += size;
+		break;
+	default:
+		return -1;
+	}
+
+	return n > bufsize ? -1 : n;
+}
+
+/* Size of an attribute id and value pair */
+static int attr_pair_size(const uint8_t *p, int bufsize)
+{
+	int n = sizeof(uint8_t) + sizeof(uint16_t), len;
+
+	if (bufsize < n)
+		return -1;
+
+	len = element_size(p + n, bufsize - n);
+	if (len < 0)
+		return -1;
+
+	return n + len;
+}
+
+/* Adds the UUIDs of all data elements to the pattern, without decoding */
+static void lazy_scan_uuids(sdp_record_t *rec, const uint8_t *p, int len)
+{
+	int pos = 0;
+
+	while (pos < len) {
+		uint8_t dtd = p[pos];
+		int n, size;
+
+		if ((dtd >= SDP_SEQ8 && dtd <= SDP_SEQ32) ||
+				(dtd >= SDP_ALT8 && dtd <= SDP_ALT32)) {
+			/* Step into the sequence */
+			n = sdp_extract_seqtype(p + pos, len - pos, &dtd, &size);
+			if (n == 0)
+				return;
+			pos += n;
+			continue;
+		}
+
+		if (SDP_IS_UUID(dtd)) {
+			uuid_t uuid;
+			int scanned = 0;
+
+			if (sdp_uuid_extract(p + pos, len - pos, &uuid,
+							&scanned) == 0)
+				sdp_pattern_add_uuid(rec, &uuid);
+		}
+
+		n = element_size(p + pos, len - pos);
+		if (n <= 0)
+			return;
+		pos += n;
+	}
+}
+
+static int lazy_attr_cmp(const void *a, const void *b)
+{
+	const struct sdp_lazy_attr *a1 = a, *a2 = b;
+
+	return a1->id - a2->id;
+}
+
+static sdp_data_t *lazy_decode_attr(sdp_record_t *rec,
+					struct sdp_record_priv *priv,
+					struct sdp_lazy_attr *a)
+{
+	struct sdp_lazy *lazy = priv->lazy;
+	unsigned int pos;
+	sdp_data_t *d;
+	int n = 0;
+
+	if (a->decoded)
+		return NULL;
+
+	a->decoded = 1;
+
+	d = sdp_extract_attr(lazy->pdu + a->offset, a->len, &n, rec);
+	if (!d)
+		return NULL;
+
+	d->attrId = a->id;
+
+	if (attr_index_lookup(rec, priv, a->id, &pos) != 0 ||
+				attr_index_insert(rec, priv, pos, d) < 0) {
+		if (!priv->arena)
+			sdp_data_free(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+static sdp_data_t *lazy_decode(sdp_record_t *rec,
+				struct sdp_record_priv *priv, uint16_t attr)
+{
+	struct sdp_lazy *lazy = priv->lazy;
+	struct sdp_lazy_attr key, *a;
+
+	key.id = attr;
+	a = bsearch(&key, lazy->attrs, lazy->count,
+				sizeof(struct sdp_lazy_attr), lazy_attr_cmp);
+	if (!a)
+		return NULL;
+
+	return lazy_decode_attr(rec, priv, a);
+}
+
+static void lazy_decode_all(sdp_record_t *rec, struct sdp_record_priv *priv)
+{
+	struct sdp_lazy *lazy = priv->lazy;
+	unsigned int i;
+
+	if (!lazy)
+		return;
+
+	for (i = 0; i < lazy->count; i++)
+		lazy_decode_attr(rec, priv, &lazy->attrs[i]);
+}
+
+void sdp_record_decode(sdp_record_t *rec)
+{
+	struct sdp_record_priv *priv = record_priv(rec);
+
+	if (priv)
+		lazy_decode_all(rec, priv);
+}
+
+/* Turns a lazy record into a regular one before it gets modified */
+static void lazy_drop(sdp_record_t *rec, struct sdp_record_priv *priv)
+{
+	if (!priv || !priv->lazy || priv->arena)
+		return;
+
+	lazy_decode_all(rec, priv);
+
+	free(priv->lazy);
+	priv->lazy = NULL;
+}
+
+int sdp_get_record_pdu(const sdp_record_t *rec, const uint8_t **pdu,
+							uint32_t *len)
+{
+	sdp_record_t *r = (sdp_record_t *) rec;
+	struct sdp_record_priv *priv = record_priv(rec);
+	struct sdp_lazy *lazy;
+	sdp_buf_t buf;
+
+	/* Nowhere to keep the bytes of records the library did not
+	 * allocate, sdp_gen_record_pdu works for those */
+	if (!priv)
+		return -ENOTSUP;
+
+	lazy = priv->lazy;
+	if (lazy) {
+		if (lazy->complete) {
+			*pdu = lazy->pdu;
+			*len = lazy->pdu_len;
+			return 0;
+		}
+
+		/* A truncated record is generated from what could be decoded */
+		lazy_decode_all(r, priv);
+	}
+
+	/* attrlist was replaced behind the accessors' back */
+	if (!attr_index_valid(rec, priv))
+		pdu_cache_drop(priv);
+
+	if (!priv->pdu_cache) {
+		if (gen_record_pdu(rec, &buf) < 0) {
+			free(buf.data);
+			return -ENOMEM;
+		}
+
+		priv->pdu_cache = buf.data;
+		priv->pdu_cache_len = buf.data_size;
+	}
+
+	*pdu = priv->pdu_cache;
+	*len = priv->pdu_cache_len;
+
+	return 0;
 }
 
-#ifdef SDP_DEBUG
-static void attr_print_func(void *value, void *userData)
+int sdp_record_cache_get(const sdp_record_t *rec, const void *key,
+			uint32_t key_len, const uint8_t **data, uint32_t *len)
 {
-	sdp_data_t *d = (sdp_data_t *)value;
+	struct sdp_record_priv *priv = record_priv(rec);
+	struct attr_cache *c, **prev;
 
-	SDPDBG("=====================================\n");
-	SDPDBG("ATTRIBUTE IDENTIFIER : 0x%x\n",  d->attrId);
-	SDPDBG("ATTRIBUTE VALUE PTR : 0x%x\n", (uint32_t)value);
-	if (d)
-		sdp_data_print(d);
-	else
-		SDPDBG("NULL value\n");
-	SDPDBG("=====================================\n");
+	if (!priv)
+		return -ENOENT;
+
+	if (!attr_index_valid(rec, priv)) {
+		pdu_cache_drop(priv);
+		return -ENOENT;
+	}
+
+	for (prev = &priv->attr_cache; (c = *prev); prev = &c->next) {
+		if (c->key_len != key_len || memcmp(c->buf, key, key_len))
+			continue;
+
+		/* Move to the front, the last entry is the one replaced */
+		*prev = c->next;
+		c->next = priv->attr_cache;
+		priv->attr_cache = c;
+
+		*data = c->buf + c->key_len;
+		*len = c->len;
+		return 0;
+	}
+
+	return -ENOENT;
 }
 
-void sdp_print_service_attr(sdp_list_t *svcAttrList)
+int sdp_record_cache_set(const sdp_record_t *rec, const void *key,
+			uint32_t key_len, const uint8_t *data, uint32_t len)
 {
-	SDPDBG("Printing service attr list %p\n", svcAttrList);
-	sdp_list_foreach(svcAttrList, attr_print_func, NULL);
-	SDPDBG("Printed service attr list %p\n", svcAttrList);
+	struct sdp_record_priv *priv = record_priv(rec);
+	struct attr_cache *c, **prev;
+	int count = 0;
+
+	if (!priv)
+		return -ENOTSUP;
+
+	c = malloc(sizeof(*c) + key_len + len);
+	if (!c)
+		return -ENOMEM;
+
+	c->key_len = key_len;
+	c->len = len;
+	memcpy(c->buf, key, key_len);
+	memcpy(c->buf + key_len, data, len);
+
+	c->next = priv->attr_cache;
+	priv->attr_cache = c;
+
+	for (prev = &c->next; *prev; prev = &(*prev)->next) {
+		if (++count < ATTR_CACHE_MAX)
+			continue;
+
+		free(*prev);
+		*prev = NULL;
+		break;
+	}
+
+	return 0;
 }
-#endif
 
-sdp_record_t *sdp_extract_pdu(const uint8_t *buf, int bufsize, int *scanned)
+static void *record_alloc(struct sdp_record_priv *priv, size_t size)
 {
-	int extracted = 0, seqlen = 0;
-	uint8_t dtd;
-	uint16_t attr;
-	sdp_record_t *rec = sdp_record_alloc();
-	const uint8_t *p = buf;
+	if (priv->arena)
+		return arena_alloc(priv, size);
 
-	*scanned = sdp_extract_seqtype(buf, bufsize, &dtd, &seqlen);
-	p += *scanned;
-	bufsize -= *scanned;
-	rec->attrlist = NULL;
+	return malloc(size);
+}
 
-	while (extracted < seqlen && bufsize > 0) {
-		int n = sizeof(uint8_t), attrlen = 0;
-		sdp_data_t *data = NULL;
+static sdp_record_t *extract_pdu_lazy(const uint8_t *buf, int bufsize,
+						int *scanned, int arena)
+{
+	struct sdp_record_priv *priv;
+	struct sdp_lazy *lazy;
+	sdp_record_t *rec;
+	sdp_data_t *d;
+	const uint8_t *p;
+	unsigned int i, count = 0;
+	int seqlen = 0, hdr, len, pos, n, sorted = 1;
+	uint8_t dtd;
+	size_t size;
 
-		SDPDBG("Extract PDU, sequenceLength: %d localExtractedLength: %d",
-							seqlen, extracted);
+	hdr = sdp_extract_seqtype(buf, bufsize, &dtd, &seqlen);
+	*scanned = hdr;
 
-		if (bufsize < n + (int) sizeof(uint16_t)) {
-			SDPERR("Unexpected end of packet");
+	p = buf + hdr;
+	len = seqlen < bufsize - hdr ? seqlen : bufsize - hdr;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = attr_pair_size(p + pos, len - pos);
+		if (n < 0)
 			break;
-		}
+		count++;
+	}
 
-		dtd = *(uint8_t *) p;
-		attr = ntohs(bt_get_unaligned((uint16_t *) (p + n)));
-		n += sizeof(uint16_t);
+	len = pos;
 
-		SDPDBG("DTD of attrId : %d Attr id : 0x%x \n", dtd, attr);
+	size = sizeof(struct sdp_lazy) + count * sizeof(struct sdp_lazy_attr) +
+								hdr + len;
 
-		data = sdp_extract_attr(p + n, bufsize - n, &attrlen, rec);
+	if (arena)
+		rec = arena_record_new(size + count * sizeof(sdp_list_t *) +
+				count * (sizeof(sdp_list_t) + 32) + 256);
+	else
+		rec = sdp_record_alloc();
 
-		SDPDBG("Attr id : 0x%x attrValueLength : %d\n", attr, attrlen);
+	if (!rec)
+		return NULL;
 
-		n += attrlen;
-		if (data == NULL) {
-			SDPDBG("Terminating extraction of attributes");
-			break;
-		}
+	priv = record_priv(rec);
+	if (!priv) {
+		sdp_record_free(rec);
+		return NULL;
+	}
 
-		if (attr == SDP_ATTR_RECORD_HANDLE)
-			rec->handle = data->val.uint32;
+	lazy = record_alloc(priv, size);
+	if (count > 0)
+		priv->attr_index = record_alloc(priv,
+					count * sizeof(sdp_list_t *));
 
-		if (attr == SDP_ATTR_SVCLASS_ID_LIST)
-			extract_svclass_uuid(data, &rec->svclass);
+	if (!lazy || (count > 0 && !priv->attr_index)) {
+		if (!arena)
+			free(lazy);
+		sdp_record_free(rec);
+		return NULL;
+	}
 
-		extracted += n;
-		p += n;
-		bufsize -= n;
-		sdp_attr_replace(rec, attr, data);
+	priv->attr_size = count;
 
-		SDPDBG("Extract PDU, seqLength: %d localExtractedLength: %d",
-							seqlen, extracted);
+	lazy->count = count;
+	lazy->pdu = (uint8_t *) &lazy->attrs[count];
+	lazy->pdu_len = hdr + len;
+	lazy->complete = hdr > 0 && len == seqlen;
+	memcpy(lazy->pdu, buf, hdr + len);
+
+	for (i = 0, pos = 0; i < count; i++, pos += n) {
+		struct sdp_lazy_attr *a = &lazy->attrs[i];
+
+		n = attr_pair_size(p + pos, len - pos);
+
+		a->id = ntohs(bt_get_unaligned((uint16_t *) (p + pos + 1)));
+		a->decoded = 0;
+		a->offset = hdr + pos + sizeof(uint8_t) + sizeof(uint16_t);
+		a->len = n - sizeof(uint8_t) - sizeof(uint16_t);
+
+		if (i > 0 && a->id < lazy->attrs[i - 1].id)
+			sorted = 0;
 	}
-#ifdef SDP_DEBUG
-	SDPDBG("Successful extracting of Svc Rec attributes\n");
-	sdp_print_service_attr(rec->attrlist);
-#endif
+
+	if (!sorted)
+		qsort(lazy->attrs, count, sizeof(struct sdp_lazy_attr),
+							lazy_attr_cmp);
+
+	priv->lazy = lazy;
+
+	lazy_scan_uuids(rec, p, len);
+
+	d = lazy_decode(rec, priv, SDP_ATTR_RECORD_HANDLE);
+	if (d)
+		rec->handle = d->val.uint32;
+
+	d = lazy_decode(rec, priv, SDP_ATTR_SVCLASS_ID_LIST);
+	if (d)
+		extract_svclass_uuid(d, &rec->svclass);
+
 	*scanned += seqlen;
 	return rec;
 }
 
+static sdp_record_t *lazy_copy_record(sdp_record_t *rec,
+					struct sdp_record_priv *priv)
+{
+	struct sdp_lazy *lazy = priv->lazy, *cpy_lazy;
+	struct sdp_record_priv *cpy_priv;
+	sdp_record_t *cpy;
+	sdp_list_t *l;
+	unsigned int i;
+	size_t size;
+
+	cpy = sdp_record_alloc();
+	if (!cpy)
+		return NULL;
+
+	cpy_priv = record_priv(cpy);
+	if (!cpy_priv) {
+		sdp_record_free(cpy);
+		return NULL;
+	}
+
+	size = sizeof(struct sdp_lazy) +
+			lazy->count * sizeof(struct sdp_lazy_attr) +
+			lazy->pdu_len;
+
+	cpy_lazy = malloc(size);
+	if (lazy->count > 0)
+		cpy_priv->attr_index = malloc(lazy->count *
+							sizeof(sdp_list_t *));
+
+	if (!cpy_lazy || (lazy->count > 0 && !cpy_priv->attr_index)) {
+		free(cpy_lazy);
+		sdp_record_free(cpy);
+		return NULL;
+	}
+
+	memcpy(cpy_lazy, lazy, size - lazy->pdu_len);
+	cpy_lazy->pdu = (uint8_t *) &cpy_lazy->attrs[lazy->count];
+	memcpy(cpy_lazy->pdu, lazy->pdu, lazy->pdu_len);
+
+	for (i = 0; i < cpy_lazy->count; i++)
+		cpy_lazy->attrs[i].decoded = 0;
+
+	cpy_priv->attr_size = lazy->count;
+	cpy_priv->lazy = cpy_lazy;
+	cpy->handle = rec->handle;
+	cpy->svclass = rec->svclass;
+
+	for (l = rec->pattern; l; l = l->next)
+		sdp_pattern_add_uuid(cpy, l->data);
+
+	return cpy;
+}
+
+sdp_record_t *sdp_extract_pdu_lazy(const uint8_t *buf, int bufsize,
+							int *scanned)
+{
+	return extract_pdu_lazy(buf, bufsize, scanned, 0);
+}
+
+sdp_record_t *sdp_session_extract_pdu(sdp_session_t *session,
+				const uint8_t *buf, int bufsize, int *scanned)
+{
+	if (session->flags & SDP_LAZY_RECORDS)
+		return extract_pdu_lazy(buf, bufsize, scanned,
+				session->flags & SDP_ARENA_RECORDS);
+
+	return extract_pdu(buf, bufsize, scanned,
+				session->flags & SDP_ARENA_RECORDS);
+}
+
 static void sdp_copy_pattern(void *value, void *udata)
 {
 	uuid_t *uuid = value;
@@ -1585,8 +2857,12 @@ static void sdp_copy_attrlist(void *value, void *udata)
 
 sdp_record_t *sdp_copy_record(sdp_record_t *rec)
 {
+	struct sdp_record_priv *priv = record_priv(rec);
 	sdp_record_t *cpy;
 
+	if (priv && priv->lazy)
+		return lazy_copy_record(rec, priv);
+
 	cpy = sdp_record_alloc();
 
 	cpy->handle = rec->handle;
@@ -1675,6 +2951,19 @@ void sdp_data_print(sdp_data_t *d)
 
 sdp_data_t *sdp_data_get(const sdp_record_t *rec, uint16_t attrId)
 {
+	struct sdp_record_priv *priv = record_priv(rec);
+	unsigned int pos;
+
+	/* The index is a cache of attrlist, so bypass the const */
+	switch (attr_index_lookup((sdp_record_t *) rec, priv, attrId, &pos)) {
+	case 1:
+		return priv->attr_index[pos]->data;
+	case 0:
+		if (priv->lazy)
+			return lazy_decode((sdp_record_t *) rec, priv, attrId);
+		return NULL;
+	}
+
 	if (rec->attrlist) {
 		sdp_data_t sdpTemplate;
 		sdp_list_t *p;
@@ -2591,18 +3880,40 @@ uuid_t *sdp_uuid128_create(uuid_t *u, const void *val)
  * UUID comparison function
  * returns 0 if uuidValue1 == uuidValue2 else -1
  */
+static void uuid_to_uuid128(uuid_t *uuid128, const uuid_t *uuid);
+
+/*
+ * UUIDs of the same size are compared as they are, in network order to
+ * sort the same way as their 128-bit forms do
+ */
 int sdp_uuid_cmp(const void *p1, const void *p2)
 {
-	uuid_t *u1 = sdp_uuid_to_uuid128(p1);
-	uuid_t *u2 = sdp_uuid_to_uuid128(p2);
-	int ret;
+	const uuid_t *u1 = p1;
+	const uuid_t *u2 = p2;
+	uuid_t a, b;
 
-	ret = sdp_uuid128_cmp(u1, u2);
+	if (u1->type == u2->type) {
+		uint16_t s1, s2;
+		uint32_t l1, l2;
 
-	bt_free(u1);
-	bt_free(u2);
+		switch (u1->type) {
+		case SDP_UUID16:
+			s1 = htons(u1->value.uuid16);
+			s2 = htons(u2->value.uuid16);
+			return memcmp(&s1, &s2, sizeof(uint16_t));
+		case SDP_UUID32:
+			l1 = htonl(u1->value.uuid32);
+			l2 = htonl(u2->value.uuid32);
+			return memcmp(&l1, &l2, sizeof(uint32_t));
+		case SDP_UUID128:
+			return sdp_uuid128_cmp(u1, u2);
+		}
+	}
 
-	return ret;
+	uuid_to_uuid128(&a, u1);
+	uuid_to_uuid128(&b, u2);
+
+	return sdp_uuid128_cmp(&a, &b);
 }
 
 /*
@@ -2676,13 +3987,8 @@ void sdp_uuid32_to_uuid128(uuid_t *uuid128, const uuid_t *uuid32)
 	memcpy(&uuid128->value.uuid128.data[0], &data0, 4);
 }
 
-uuid_t *sdp_uuid_to_uuid128(const uuid_t *uuid)
+static void uuid_to_uuid128(uuid_t *uuid128, const uuid_t *uuid)
 {
-	uuid_t *uuid128 = bt_malloc(sizeof(uuid_t));
-
-	if (!uuid128)
-		return NULL;
-
 	memset(uuid128, 0, sizeof(uuid_t));
 	switch (uuid->type) {
 	case SDP_UUID128:
@@ -2695,9 +4001,31 @@ uuid_t *sdp_uuid_to_uuid128(const uuid_t *uuid)
 		sdp_uuid16_to_uuid128(uuid128, uuid);
 		break;
 	}
+}
+
+uuid_t *sdp_uuid_to_uuid128(const uuid_t *uuid)
+{
+	uuid_t *uuid128 = bt_malloc(sizeof(uuid_t));
+
+	if (!uuid128)
+		return NULL;
+
+	uuid_to_uuid128(uuid128, uuid);
+
 	return uuid128;
 }
 
+void sdp_uuid_extend(uuid_t *uuid)
+{
+	uuid_t uuid128;
+
+	if (uuid->type == SDP_UUID128)
+		return;
+
+	uuid_to_uuid128(&uuid128, uuid);
+	*uuid = uuid128;
+}
+
 /*
  * converts a 128-bit uuid to a 16/32-bit one if possible
  * returns true if uuid contains a 16/32-bit UUID at exit
@@ -3120,6 +4448,12 @@ sdp_record_t *sdp_record_alloc(void)
 
 	memset(rec, 0, sizeof(sdp_record_t));
 	rec->handle = 0xffffffff;
+
+	if (!record_priv_new(rec)) {
+		free(rec);
+		return NULL;
+	}
+
 	return rec;
 }
 
@@ -3128,14 +4462,69 @@ sdp_record_t *sdp_record_alloc(void)
  */
 void sdp_record_free(sdp_record_t *rec)
 {
+	struct sdp_record_priv *priv = record_priv_take(rec);
+
+	pdu_cache_drop(priv);
+
+	if (priv && priv->arena) {
+		arena_free(priv->arena);
+		free(priv);
+		return;
+	}
+
 	sdp_list_free(rec->attrlist, (sdp_free_func_t) sdp_data_free);
 	sdp_list_free(rec->pattern, free);
+
+	if (priv) {
+		free(priv->attr_index);
+		free(priv->lazy);
+		free(priv);
+	}
+
 	free(rec);
 }
 
+static void arena_pattern_add_uuid(sdp_record_t *rec,
+				struct sdp_record_priv *priv, uuid_t *uuid)
+{
+	uuid_t tmp, *uuid128;
+
+	memset(&tmp, 0, sizeof(tmp));
+	switch (uuid->type) {
+	case SDP_UUID128:
+		tmp = *uuid;
+		break;
+	case SDP_UUID32:
+		sdp_uuid32_to_uuid128(&tmp, uuid);
+		break;
+	case SDP_UUID16:
+		sdp_uuid16_to_uuid128(&tmp, uuid);
+		break;
+	}
+
+	if (sdp_list_find(rec->pattern, &tmp, sdp_uuid128_cmp))
+		return;
+
+	uuid128 = arena_alloc(priv, sizeof(uuid_t));
+	if (!uuid128)
+		return;
+
+	*uuid128 = tmp;
+	rec->pattern = arena_list_insert_sorted(priv, rec->pattern, uuid128,
+							sdp_uuid128_cmp);
+}
+
 void sdp_pattern_add_uuid(sdp_record_t *rec, uuid_t *uuid)
 {
-	uuid_t *uuid128 = sdp_uuid_to_uuid128(uuid);
+	struct sdp_record_priv *priv = record_priv(rec);
+	uuid_t *uuid128;
+
+	if (priv && priv->arena) {
+		arena_pattern_add_uuid(rec, priv, uuid);
+		return;
+	}
+
+	uuid128 = sdp_uuid_to_uuid128(uuid);
 
 	SDPDBG("Elements in target pattern : %d\n", sdp_list_len(rec->pattern));
 	SDPDBG("Trying to add : 0x%lx\n", (unsigned long) uuid128);
@@ -3592,15 +4981,15 @@ sdp_record_t *sdp_service_attr_req(sdp_session_t *session, uint32_t handle,
 		 * and the last one (which has cstate_len == 0)
 		 */
 		if (cstate_len > 0 || rsp_concat_buf.data_size != 0) {
-			uint8_t *targetPtr = NULL;
-
 			cstate = cstate_len > 0 ? (sdp_cstate_t *) (pdata + rsp_count) : 0;
 
 			/* build concatenated response buffer */
-			rsp_concat_buf.data = realloc(rsp_concat_buf.data, rsp_concat_buf.data_size + rsp_count);
-			rsp_concat_buf.buf_size = rsp_concat_buf.data_size + rsp_count;
-			targetPtr = rsp_concat_buf.data + rsp_concat_buf.data_size;
-			memcpy(targetPtr, pdata, rsp_count);
+			if (pdu_reserve(&rsp_concat_buf, rsp_count) < 0) {
+				errno = ENOMEM;
+				goto end;
+			}
+			memcpy(rsp_concat_buf.data + rsp_concat_buf.data_size,
+							pdata, rsp_count);
 			rsp_concat_buf.data_size += rsp_count;
 		}
 	} while (cstate);
@@ -3611,7 +5000,8 @@ sdp_record_t *sdp_service_attr_req(sdp_session_t *session, uint32_t handle,
 			pdata = rsp_concat_buf.data;
 			pdata_len = rsp_concat_buf.data_size;
 		}
-		rec = sdp_extract_pdu(pdata, pdata_len, &scanned);
+		rec = sdp_session_extract_pdu(session, pdata, pdata_len,
+								&scanned);
 	}
 
 end:
@@ -3631,6 +5021,9 @@ struct sdp_transaction {
 	sdp_buf_t rsp_concat_buf;
 	uint32_t reqsize;	/* without cstate */
 	int err;		/* ZERO if success or the errno if failed */
+	sdp_record_cb_t *rec_cb;	/* called for each complete record */
+	void *rec_udata;
+	uint32_t rsp_streamed;	/* bytes already handed to rec_cb */
 };
 
 /*
@@ -3701,6 +5094,66 @@ int sdp_set_notify(sdp_session_t *session, sdp_callback_t *func, void *udata)
 	return 0;
 }
 
+int sdp_set_record_notify(sdp_session_t *session, sdp_record_cb_t *func,
+								void *udata)
+{
+	struct sdp_transaction *t;
+
+	if (!session || !session->priv)
+		return -1;
+
+	t = session->priv;
+	t->rec_cb = func;
+	t->rec_udata = udata;
+
+	return 0;
+}
+
+/*
+ * Hands the complete records of a partial ServiceSearchAttribute response
+ * to rec_cb and drops them from the buffer, so only the record still
+ * being received is kept.
+ */
+static void stream_records(sdp_session_t *session, struct sdp_transaction *t)
+{
+	sdp_buf_t *buf = &t->rsp_concat_buf;
+	uint8_t *p = buf->data;
+	int left = buf->data_size;
+
+	if (t->rsp_streamed == 0) {
+		uint8_t dtd;
+		int seqlen, n;
+
+		n = sdp_extract_seqtype(p, left, &dtd, &seqlen);
+		if (n == 0)
+			return;
+
+		p += n;
+		left -= n;
+	}
+
+	while (left > 0) {
+		sdp_record_t *rec;
+		int len, scanned = 0;
+
+		len = element_size(p, left);
+		if (len < 0)
+			break;
+
+		rec = sdp_session_extract_pdu(session, p, len, &scanned);
+		if (rec)
+			t->rec_cb(rec, t->rec_udata);
+
+		p += len;
+		left -= len;
+	}
+
+	t->rsp_streamed += p - buf->data;
+
+	memmove(buf->data, p, left);
+	buf->data_size = left;
+}
+
 /*
  * This function starts an asynchronous service search request.
  * The incomming and outgoing data are stored in the transaction structure
@@ -3743,6 +5196,7 @@ int sdp_service_search_async(sdp_session_t *session, const sdp_list_t *search, u
 	/* clean possible allocated buffer */
 	free(t->rsp_concat_buf.data);
 	memset(&t->rsp_concat_buf, 0, sizeof(sdp_buf_t));
+	t->rsp_streamed = 0;
 
 	if (!t->reqbuf) {
 		t->reqbuf = malloc(SDP_REQ_BUFFER_SIZE);
@@ -3844,6 +5298,7 @@ int sdp_service_attr_async(sdp_session_t *session, uint32_t handle, sdp_attrreq_
 	/* clean possible allocated buffer */
 	free(t->rsp_concat_buf.data);
 	memset(&t->rsp_concat_buf, 0, sizeof(sdp_buf_t));
+	t->rsp_streamed = 0;
 
 	if (!t->reqbuf) {
 		t->reqbuf = malloc(SDP_REQ_BUFFER_SIZE);
@@ -3956,6 +5411,7 @@ int sdp_service_search_attr_async(sdp_session_t *session, const sdp_list_t *sear
 	/* clean possible allocated buffer */
 	free(t->rsp_concat_buf.data);
 	memset(&t->rsp_concat_buf, 0, sizeof(sdp_buf_t));
+	t->rsp_streamed = 0;
 
 	if (!t->reqbuf) {
 		t->reqbuf = malloc(SDP_REQ_BUFFER_SIZE);
@@ -4068,7 +5524,7 @@ int sdp_process(sdp_session_t *session)
 	struct sdp_transaction *t;
 	sdp_pdu_hdr_t *reqhdr, *rsphdr;
 	sdp_cstate_t *pcstate;
-	uint8_t *pdata, *rspbuf, *targetPtr;
+	uint8_t *pdata, *rspbuf;
 	int rsp_count, err = -1;
 	size_t size = 0;
 	int n, plen;
@@ -4199,12 +5655,18 @@ int sdp_process(sdp_session_t *session)
 	 * This is a split response, need to concatenate intermediate
 	 * responses and the last one which will have cstate length == 0
 	 */
-	t->rsp_concat_buf.data = realloc(t->rsp_concat_buf.data, t->rsp_concat_buf.data_size + rsp_count);
-	targetPtr = t->rsp_concat_buf.data + t->rsp_concat_buf.data_size;
-	t->rsp_concat_buf.buf_size = t->rsp_concat_buf.data_size + rsp_count;
-	memcpy(targetPtr, pdata, rsp_count);
+	if (pdu_reserve(&t->rsp_concat_buf, rsp_count) < 0) {
+		t->err = ENOMEM;
+		status = 0xffff;
+		goto end;
+	}
+	memcpy(t->rsp_concat_buf.data + t->rsp_concat_buf.data_size,
+							pdata, rsp_count);
 	t->rsp_concat_buf.data_size += rsp_count;
 
+	if (t->rec_cb && pdu_id == SDP_SVC_SEARCH_ATTR_RSP)
+		stream_records(session, t);
+
 	if (pcstate->length > 0) {
 		int reqsize, cstate_len;
 
@@ -4410,15 +5872,16 @@ int sdp_service_search_attr_req(sdp_session_t *session, const sdp_list_t *search
 		 * responses and the last one which will have cstate_len == 0
 		 */
 		if (cstate_len > 0 || rsp_concat_buf.data_size != 0) {
-			uint8_t *targetPtr = NULL;
-
 			cstate = cstate_len > 0 ? (sdp_cstate_t *) (pdata + rsp_count) : 0;
 
 			/* build concatenated response buffer */
-			rsp_concat_buf.data = realloc(rsp_concat_buf.data, rsp_concat_buf.data_size + rsp_count);
-			targetPtr = rsp_concat_buf.data + rsp_concat_buf.data_size;
-			rsp_concat_buf.buf_size = rsp_concat_buf.data_size + rsp_count;
-			memcpy(targetPtr, pdata, rsp_count);
+			if (pdu_reserve(&rsp_concat_buf, rsp_count) < 0) {
+				errno = ENOMEM;
+				status = -1;
+				goto end;
+			}
+			memcpy(rsp_concat_buf.data + rsp_concat_buf.data_size,
+							pdata, rsp_count);
 			rsp_concat_buf.data_size += rsp_count;
 		}
 	} while (cstate);
@@ -4446,7 +5909,8 @@ int sdp_service_search_attr_req(sdp_session_t *session, const sdp_list_t *search
 			pdata_len -= scanned;
 			do {
 				int recsize = 0;
-				sdp_record_t *rec = sdp_extract_pdu(pdata, pdata_len, &recsize);
+				sdp_record_t *rec = sdp_session_extract_pdu(session,
+						pdata, pdata_len, &recsize);
 				if (rec == NULL) {
 					SDPERR("SVC REC is null\n");
 					status = -1;
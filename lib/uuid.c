@@ -123,6 +123,22 @@ int bt_uuid_cmp(const bt_uuid_t *uuid1, const bt_uuid_t *uuid2)
 {
 	bt_uuid_t u1, u2;
 
+	/* Same sized UUIDs differ only in the bytes taken from the value */
+	if (uuid1->type == uuid2->type) {
+		switch (uuid1->type) {
+		case BT_UUID16:
+			return memcmp(&uuid1->value.u16, &uuid2->value.u16,
+						sizeof(uuid1->value.u16));
+		case BT_UUID32:
+			return memcmp(&uuid1->value.u32, &uuid2->value.u32,
+						sizeof(uuid1->value.u32));
+		case BT_UUID128:
+			return bt_uuid128_cmp(uuid1, uuid2);
+		default:
+			break;
+		}
+	}
+
 	bt_uuid_to_uuid128(uuid1, &u1);
 	bt_uuid_to_uuid128(uuid2, &u2);
 
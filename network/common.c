@@ -35,17 +35,24 @@
 #include <sys/wait.h>
 #include <net/if.h>
 #include <linux/sockios.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include <bluetooth/bnep.h>
 
 #include <glib.h>
+#include <gdbus.h>
 
 #include "log.h"
+#include "dbus-common.h"
 #include "common.h"
 
 static int ctl;
+static int if_ctl = -1;		/* Interface ioctls */
+static int rtnl = -1;		/* Route netlink, -1 when unavailable */
+static uint32_t rtnl_seq = 0;
 
 static struct {
 	const char	*name;		/* Friendly name */
@@ -103,6 +110,27 @@ const char *bnep_name(uint16_t id)
 	return NULL;
 }
 
+static int rtnl_open(void)
+{
+	struct sockaddr_nl addr;
+	int sk;
+
+	sk = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sk < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(sk);
+		return -err;
+	}
+
+	return sk;
+}
+
 int bnep_init(void)
 {
 	ctl = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_BNEP);
@@ -114,11 +142,27 @@ int bnep_init(void)
 		return -err;
 	}
 
+	/* Kept open, every connection sets up its interface through them */
+	if_ctl = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	rtnl = rtnl_open();
+	if (rtnl < 0)
+		DBG("No route netlink socket: %s (%d)", strerror(-rtnl),
+									-rtnl);
+
 	return 0;
 }
 
 int bnep_cleanup(void)
 {
+	if (rtnl >= 0)
+		close(rtnl);
+	rtnl = -1;
+
+	if (if_ctl >= 0)
+		close(if_ctl);
+	if_ctl = -1;
+
 	close(ctl);
 	return 0;
 }
@@ -190,9 +234,7 @@ int bnep_connadd(int sk, uint16_t role, char *dev)
 int bnep_if_up(const char *devname)
 {
 	struct ifreq ifr;
-	int sk, err;
-
-	sk = socket(AF_INET, SOCK_DGRAM, 0);
+	int err;
 
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, devname, IF_NAMESIZE - 1);
@@ -200,9 +242,7 @@ int bnep_if_up(const char *devname)
 	ifr.ifr_flags |= IFF_UP;
 	ifr.ifr_flags |= IFF_MULTICAST;
 
-	err = ioctl(sk, SIOCSIFFLAGS, (caddr_t) &ifr);
-
-	close(sk);
+	err = ioctl(if_ctl, SIOCSIFFLAGS, (caddr_t) &ifr);
 
 	if (err < 0) {
 		error("Could not bring up %s", devname);
@@ -215,9 +255,7 @@ int bnep_if_up(const char *devname)
 int bnep_if_down(const char *devname)
 {
 	struct ifreq ifr;
-	int sk, err;
-
-	sk = socket(AF_INET, SOCK_DGRAM, 0);
+	int err;
 
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, devname, IF_NAMESIZE - 1);
@@ -225,9 +263,7 @@ int bnep_if_down(const char *devname)
 	ifr.ifr_flags &= ~IFF_UP;
 
 	/* Bring down the interface */
-	err = ioctl(sk, SIOCSIFFLAGS, (caddr_t) &ifr);
-
-	close(sk);
+	err = ioctl(if_ctl, SIOCSIFFLAGS, (caddr_t) &ifr);
 
 	if (err < 0) {
 		error("Could not bring down %s", devname);
@@ -241,27 +277,180 @@ int bnep_add_to_bridge(const char *devname, const char *bridge)
 {
 	int ifindex = if_nametoindex(devname);
 	struct ifreq ifr;
-	int sk, err;
+	int err;
 
 	if (!devname || !bridge)
 		return -EINVAL;
 
-	sk = socket(AF_INET, SOCK_STREAM, 0);
-	if (sk < 0)
-		return -1;
-
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, bridge, IFNAMSIZ - 1);
 	ifr.ifr_ifindex = ifindex;
 
-	err = ioctl(sk, SIOCBRADDIF, &ifr);
+	err = ioctl(if_ctl, SIOCBRADDIF, &ifr);
+	if (err < 0)
+		return err;
+
+	info("bridge %s: interface %s added", bridge, devname);
+
+	return 0;
+}
+
+/* Brings the interface up and enslaves it to the bridge in a single
+ * RTM_NEWLINK request */
+static int rtnl_if_up_bridge(int ifindex, int master)
+{
+	struct {
+		struct nlmsghdr hdr;
+		struct ifinfomsg ifi;
+		struct rtattr master_rta;
+		uint32_t master;
+	} req;
+	struct {
+		struct nlmsghdr hdr;
+		struct nlmsgerr err;
+	} rsp;
+	ssize_t len;
+
+	memset(&req, 0, sizeof(req));
+	req.hdr.nlmsg_len = sizeof(req);
+	req.hdr.nlmsg_type = RTM_NEWLINK;
+	req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.hdr.nlmsg_seq = ++rtnl_seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
+	req.ifi.ifi_flags = IFF_UP | IFF_MULTICAST;
+	req.ifi.ifi_change = IFF_UP | IFF_MULTICAST;
+	req.master_rta.rta_type = IFLA_MASTER;
+	req.master_rta.rta_len = RTA_LENGTH(sizeof(req.master));
+	req.master = master;
+
+	if (send(rtnl, &req, sizeof(req), 0) < 0)
+		return -errno;
+
+	do {
+		len = recv(rtnl, &rsp, sizeof(rsp), 0);
+		if (len < 0)
+			return -errno;
+	} while (len < (ssize_t) sizeof(rsp) ||
+				rsp.hdr.nlmsg_type != NLMSG_ERROR ||
+				rsp.hdr.nlmsg_seq != rtnl_seq);
+
+	return rsp.err.error;
+}
+
+int bnep_if_up_bridge(const char *devname, const char *bridge)
+{
+	int ifindex, master, err;
 
-	close(sk);
+	if (!devname || !bridge)
+		return -EINVAL;
 
+	ifindex = if_nametoindex(devname);
+	master = if_nametoindex(bridge);
+	if (ifindex == 0 || master == 0)
+		return -ENODEV;
+
+	if (rtnl >= 0) {
+		err = rtnl_if_up_bridge(ifindex, master);
+		if (err == 0) {
+			info("bridge %s: interface %s added", bridge,
+								devname);
+			return 0;
+		}
+
+		/* Kernels without IFLA_MASTER support take the ioctls */
+		DBG("RTM_NEWLINK on %s: %s (%d)", devname, strerror(-err),
+									-err);
+	}
+
+	if (bnep_add_to_bridge(devname, bridge) < 0)
+		return -errno;
+
+	bnep_if_up(devname);
+
+	return 0;
+}
+
+static int read_counter(const char *devname, const char *name,
+							uint64_t *value)
+{
+	char path[PATH_MAX];
+	unsigned long long val;
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+								devname, name);
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	n = fscanf(f, "%llu", &val);
+	fclose(f);
+
+	if (n != 1)
+		return -EIO;
+
+	*value = val;
+
+	return 0;
+}
+
+int bnep_stats_read(const char *devname, struct bnep_stats *stats)
+{
+	int err;
+
+	err = read_counter(devname, "rx_bytes", &stats->rx_bytes);
 	if (err < 0)
 		return err;
 
-	info("bridge %s: interface %s added", bridge, devname);
+	read_counter(devname, "tx_bytes", &stats->tx_bytes);
+	read_counter(devname, "rx_dropped", &stats->rx_dropped);
+	read_counter(devname, "tx_dropped", &stats->tx_dropped);
 
 	return 0;
 }
+
+void bnep_stats_sample(const char *devname, struct bnep_stats *stats,
+						unsigned int interval)
+{
+	if (bnep_stats_read(devname, stats) < 0)
+		return;
+
+	/* The first sample only sets the baseline */
+	if (interval > 0 && (stats->last_rx || stats->last_tx)) {
+		stats->rx_rate = (stats->rx_bytes - stats->last_rx) / interval;
+		stats->tx_rate = (stats->tx_bytes - stats->last_tx) / interval;
+	}
+
+	stats->last_rx = stats->rx_bytes;
+	stats->last_tx = stats->tx_bytes;
+}
+
+void bnep_stats_append(DBusMessageIter *dict, struct bnep_stats *stats)
+{
+	dbus_uint64_t counter;
+	dbus_int16_t rssi;
+
+	counter = stats->rx_bytes;
+	dict_append_entry(dict, "RxBytes", DBUS_TYPE_UINT64, &counter);
+
+	counter = stats->tx_bytes;
+	dict_append_entry(dict, "TxBytes", DBUS_TYPE_UINT64, &counter);
+
+	counter = stats->rx_dropped;
+	dict_append_entry(dict, "RxDropped", DBUS_TYPE_UINT64, &counter);
+
+	counter = stats->tx_dropped;
+	dict_append_entry(dict, "TxDropped", DBUS_TYPE_UINT64, &counter);
+
+	dict_append_entry(dict, "RxRate", DBUS_TYPE_UINT32, &stats->rx_rate);
+	dict_append_entry(dict, "TxRate", DBUS_TYPE_UINT32, &stats->tx_rate);
+
+	if (stats->rssi == 127)
+		return;
+
+	rssi = stats->rssi;
+	dict_append_entry(dict, "RSSI", DBUS_TYPE_INT16, &rssi);
+}
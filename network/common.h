@@ -40,3 +40,22 @@ int bnep_connadd(int sk, uint16_t role, char *dev);
 int bnep_if_up(const char *devname);
 int bnep_if_down(const char *devname);
 int bnep_add_to_bridge(const char *devname, const char *bridge);
+int bnep_if_up_bridge(const char *devname, const char *bridge);
+
+/* Interface counters, rates are bytes per second over the last sample */
+struct bnep_stats {
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
+	uint32_t rx_rate;
+	uint32_t tx_rate;
+	int8_t rssi;			/* 127 when not known */
+	uint64_t last_rx;		/* Counters at the previous sample */
+	uint64_t last_tx;
+};
+
+int bnep_stats_read(const char *devname, struct bnep_stats *stats);
+void bnep_stats_sample(const char *devname, struct bnep_stats *stats,
+						unsigned int interval);
+void bnep_stats_append(DBusMessageIter *dict, struct bnep_stats *stats);
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <netinet/in.h>
 
 #include <bluetooth/bluetooth.h>
@@ -50,6 +51,10 @@
 
 #define NETWORK_PEER_INTERFACE "org.bluez.Network"
 
+#define SETUP_TIMEOUT		10	/* Seconds to wait for the setup response */
+#define CONNECT_RETRIES		2	/* Extra L2CAP attempts, 1s then 2s apart */
+#define REJECT_TIMEOUT		30	/* Seconds a refused role is not retried */
+
 typedef enum {
 	CONNECTED,
 	CONNECTING,
@@ -72,6 +77,12 @@ struct network_conn {
 	GIOChannel	*io;
 	guint		watch;		/* Disconnect watch */
 	guint		dc_id;
+	guint		timeout;	/* Setup timeout or retry backoff */
+	int		attempt;	/* L2CAP connect attempts so far */
+	uint16_t	reject;		/* Last setup response from the peer */
+	time_t		reject_time;
+	struct bnep_stats stats;
+	guint		stats_timer;
 	struct network_peer *peer;
 };
 
@@ -82,6 +93,7 @@ struct __service_16 {
 
 static DBusConnection *connection = NULL;
 static GSList *peers = NULL;
+static unsigned int stats_interval = 0;
 
 static struct network_peer *find_peer(GSList *list, const char *path)
 {
@@ -107,6 +119,60 @@ static struct network_conn *find_connection(GSList *list, uint16_t id)
 	return NULL;
 }
 
+static void update_rssi(struct network_conn *nc)
+{
+	struct btd_adapter *adapter = device_get_adapter(nc->peer->device);
+	struct btd_conn_stats cs;
+
+	if (btd_adapter_get_conn_stats(adapter, &nc->peer->dst, &cs) == 0)
+		nc->stats.rssi = cs.rssi;
+}
+
+static gboolean stats_cb(gpointer data)
+{
+	struct network_conn *nc = data;
+	dbus_int16_t rssi;
+
+	bnep_stats_sample(nc->dev, &nc->stats, stats_interval);
+	update_rssi(nc);
+
+	queue_property_changed(connection, nc->peer->path,
+				NETWORK_PEER_INTERFACE, "RxRate",
+				DBUS_TYPE_UINT32, &nc->stats.rx_rate);
+	queue_property_changed(connection, nc->peer->path,
+				NETWORK_PEER_INTERFACE, "TxRate",
+				DBUS_TYPE_UINT32, &nc->stats.tx_rate);
+
+	if (nc->stats.rssi != 127) {
+		rssi = nc->stats.rssi;
+		queue_property_changed(connection, nc->peer->path,
+					NETWORK_PEER_INTERFACE, "RSSI",
+					DBUS_TYPE_INT16, &rssi);
+	}
+
+	return TRUE;
+}
+
+static void start_sampling(struct network_conn *nc)
+{
+	memset(&nc->stats, 0, sizeof(nc->stats));
+	nc->stats.rssi = 127;
+
+	bnep_stats_sample(nc->dev, &nc->stats, 0);
+
+	if (stats_interval > 0)
+		nc->stats_timer = g_timeout_add_seconds(stats_interval,
+								stats_cb, nc);
+}
+
+static void stop_sampling(struct network_conn *nc)
+{
+	if (nc->stats_timer) {
+		g_source_remove(nc->stats_timer);
+		nc->stats_timer = 0;
+	}
+}
+
 static gboolean bnep_watchdog_cb(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
@@ -134,6 +200,7 @@ static gboolean bnep_watchdog_cb(GIOChannel *chan, GIOCondition cond,
 
 	info("%s disconnected", nc->dev);
 
+	stop_sampling(nc);
 	bnep_if_down(nc->dev);
 	nc->state = DISCONNECTED;
 	memset(nc->dev, 0, sizeof(nc->dev));
@@ -151,14 +218,21 @@ static void cancel_connection(struct network_conn *nc, const char *err_msg)
 		nc->watch = 0;
 	}
 
+	if (nc->timeout) {
+		g_source_remove(nc->timeout);
+		nc->timeout = 0;
+	}
+
 	if (nc->msg && err_msg) {
 		reply = btd_error_failed(nc->msg, err_msg);
 		g_dbus_send_message(connection, reply);
 	}
 
-	g_io_channel_shutdown(nc->io, TRUE, NULL);
-	g_io_channel_unref(nc->io);
-	nc->io = NULL;
+	if (nc->io) {
+		g_io_channel_shutdown(nc->io, TRUE, NULL);
+		g_io_channel_unref(nc->io);
+		nc->io = NULL;
+	}
 
 	nc->state = DISCONNECTED;
 }
@@ -168,9 +242,10 @@ static void connection_destroy(DBusConnection *conn, void *user_data)
 	struct network_conn *nc = user_data;
 
 	if (nc->state == CONNECTED) {
+		stop_sampling(nc);
 		bnep_if_down(nc->dev);
 		bnep_kill_connection(&nc->peer->dst);
-	} else if (nc->io)
+	} else if (nc->state == CONNECTING)
 		cancel_connection(nc, NULL);
 }
 
@@ -189,7 +264,6 @@ static gboolean bnep_setup_cb(GIOChannel *chan, GIOCondition cond,
 {
 	struct network_conn *nc = data;
 	struct bnep_control_rsp *rsp;
-	struct timeval timeo;
 	char pkt[BNEP_MTU];
 	ssize_t r;
 	int sk;
@@ -238,13 +312,16 @@ static gboolean bnep_setup_cb(GIOChannel *chan, GIOCondition cond,
 
 	if (r != BNEP_SUCCESS) {
 		error("bnep failed");
+		/* Remember the refusal so that Connect fails fast for a
+		 * while instead of paging the peer again */
+		nc->reject = r;
+		nc->reject_time = time(NULL);
 		goto failed;
 	}
 
-	memset(&timeo, 0, sizeof(timeo));
-	timeo.tv_sec = 0;
-
-	setsockopt(sk, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
+	g_source_remove(nc->timeout);
+	nc->timeout = 0;
+	nc->reject = BNEP_SUCCESS;
 
 	if (bnep_connadd(sk, BNEP_SVC_PANU, nc->dev)) {
 		error("%s could not be added", nc->dev);
@@ -271,6 +348,7 @@ static gboolean bnep_setup_cb(GIOChannel *chan, GIOCondition cond,
 				DBUS_TYPE_STRING, &uuid);
 
 	nc->state = CONNECTED;
+	start_sampling(nc);
 	nc->dc_id = device_add_disconnect_watch(nc->peer->device, disconnect_cb,
 						nc, NULL);
 
@@ -289,11 +367,22 @@ failed:
 	return FALSE;
 }
 
+static gboolean setup_timeout_cb(gpointer data)
+{
+	struct network_conn *nc = data;
+
+	nc->timeout = 0;
+
+	error("bnep setup to %s timed out", nc->peer->path);
+	cancel_connection(nc, "bnep setup timed out");
+
+	return FALSE;
+}
+
 static int bnep_connect(struct network_conn *nc)
 {
 	struct bnep_setup_conn_req *req;
 	struct __service_16 *s;
-	struct timeval timeo;
 	unsigned char pkt[BNEP_MTU];
 	int fd;
 
@@ -306,11 +395,7 @@ static int bnep_connect(struct network_conn *nc)
 	s->dst = htons(nc->id);
 	s->src = htons(BNEP_SVC_PANU);
 
-	memset(&timeo, 0, sizeof(timeo));
-	timeo.tv_sec = 30;
-
 	fd = g_io_channel_unix_get_fd(nc->io);
-	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
 
 	if (send(fd, pkt, sizeof(*req) + sizeof(*s), 0) < 0)
 		return -errno;
@@ -318,9 +403,48 @@ static int bnep_connect(struct network_conn *nc)
 	g_io_add_watch(nc->io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
 			(GIOFunc) bnep_setup_cb, nc);
 
+	nc->timeout = g_timeout_add_seconds(SETUP_TIMEOUT, setup_timeout_cb,
+									nc);
+
 	return 0;
 }
 
+static void connect_cb(GIOChannel *chan, GError *err, gpointer data);
+
+static gboolean connect_attempt(struct network_conn *nc, GError **err)
+{
+	struct network_peer *peer = nc->peer;
+
+	nc->attempt++;
+
+	nc->io = bt_io_connect(BT_IO_L2CAP, connect_cb, nc,
+				NULL, err,
+				BT_IO_OPT_SOURCE_BDADDR, &peer->src,
+				BT_IO_OPT_DEST_BDADDR, &peer->dst,
+				BT_IO_OPT_PSM, BNEP_PSM,
+				BT_IO_OPT_OMTU, BNEP_MTU,
+				BT_IO_OPT_IMTU, BNEP_MTU,
+				BT_IO_OPT_INVALID);
+
+	return nc->io != NULL;
+}
+
+static gboolean retry_connect(gpointer data)
+{
+	struct network_conn *nc = data;
+	GError *err = NULL;
+
+	nc->timeout = 0;
+
+	if (!connect_attempt(nc, &err)) {
+		error("%s", err->message);
+		cancel_connection(nc, err->message);
+		g_error_free(err);
+	}
+
+	return FALSE;
+}
+
 static void connect_cb(GIOChannel *chan, GError *err, gpointer data)
 {
 	struct network_conn *nc = data;
@@ -329,6 +453,18 @@ static void connect_cb(GIOChannel *chan, GError *err, gpointer data)
 
 	if (err) {
 		error("%s", err->message);
+
+		/* Page timeouts and collisions are common when several
+		 * peers are brought up at once, so back off and retry */
+		if (nc->attempt <= CONNECT_RETRIES) {
+			g_io_channel_unref(nc->io);
+			nc->io = NULL;
+			nc->timeout = g_timeout_add_seconds(
+						1 << (nc->attempt - 1),
+						retry_connect, nc);
+			return;
+		}
+
 		err_msg = err->message;
 		goto failed;
 	}
@@ -368,15 +504,16 @@ static DBusMessage *connection_connect(DBusConnection *conn,
 	if (nc->state != DISCONNECTED)
 		return btd_error_already_connected(msg);
 
-	nc->io = bt_io_connect(BT_IO_L2CAP, connect_cb, nc,
-				NULL, &err,
-				BT_IO_OPT_SOURCE_BDADDR, &peer->src,
-				BT_IO_OPT_DEST_BDADDR, &peer->dst,
-				BT_IO_OPT_PSM, BNEP_PSM,
-				BT_IO_OPT_OMTU, BNEP_MTU,
-				BT_IO_OPT_IMTU, BNEP_MTU,
-				BT_IO_OPT_INVALID);
-	if (!nc->io) {
+	if (nc->reject != BNEP_SUCCESS &&
+			time(NULL) - nc->reject_time < REJECT_TIMEOUT) {
+		DBG("%s refused %s recently (0x%04x)", peer->path, svc,
+								nc->reject);
+		return btd_error_failed(msg, "bnep setup rejected");
+	}
+
+	nc->attempt = 0;
+
+	if (!connect_attempt(nc, &err)) {
 		DBusMessage *reply;
 		error("%s", err->message);
 		reply = btd_error_failed(msg, err->message);
@@ -472,6 +609,13 @@ static DBusMessage *connection_get_properties(DBusConnection *conn,
 	property = nc ? bnep_uuid(nc->id) : "";
 	dict_append_entry(&dict, "UUID", DBUS_TYPE_STRING, &property);
 
+	/* Counters are read fresh, rates come from the last sample */
+	if (nc) {
+		bnep_stats_read(nc->dev, &nc->stats);
+		update_rssi(nc);
+		bnep_stats_append(&dict, &nc->stats);
+	}
+
 	dbus_message_iter_close_container(&iter, &dict);
 
 	return reply;
@@ -604,9 +748,10 @@ int connection_register(struct btd_device *device, const char *path,
 	return 0;
 }
 
-int connection_init(DBusConnection *conn)
+int connection_init(DBusConnection *conn, unsigned int interval)
 {
 	connection = dbus_connection_ref(conn);
+	stats_interval = interval;
 
 	return 0;
 }
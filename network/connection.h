@@ -21,7 +21,7 @@
  *
  */
 
-int connection_init(DBusConnection *conn);
+int connection_init(DBusConnection *conn, unsigned int interval);
 void connection_exit(void);
 int connection_register(struct btd_device *device, const char *path,
 			bdaddr_t *src, bdaddr_t *dst, uint16_t id);
@@ -55,5 +55,6 @@ static void network_exit(void)
 	dbus_connection_unref(connection);
 }
 
-BLUETOOTH_PLUGIN_DEFINE(network, VERSION,
-			BLUETOOTH_PLUGIN_PRIORITY_DEFAULT, network_init, network_exit)
+BLUETOOTH_PLUGIN_DEFINE_TRIGGER(network, VERSION,
+			BLUETOOTH_PLUGIN_PRIORITY_DEFAULT,
+			BLUETOOTH_PLUGIN_TRIGGER_ADAPTER, network_init, network_exit)
@@ -44,6 +44,7 @@
 static DBusConnection *connection = NULL;
 
 static gboolean conf_security = TRUE;
+static int conf_stats_interval = 0;
 
 static void read_config(const char *file)
 {
@@ -64,11 +65,22 @@ static void read_config(const char *file)
 		g_clear_error(&err);
 	}
 
+	conf_stats_interval = g_key_file_get_integer(keyfile, "General",
+						"StatisticsInterval", &err);
+	if (err) {
+		DBG("%s: %s", file, err->message);
+		g_clear_error(&err);
+	}
+
+	if (conf_stats_interval < 0)
+		conf_stats_interval = 0;
+
 done:
 	g_key_file_free(keyfile);
 
-	DBG("Config options: Security=%s",
-				conf_security ? "true" : "false");
+	DBG("Config options: Security=%s StatisticsInterval=%d",
+				conf_security ? "true" : "false",
+				conf_stats_interval);
 }
 
 static int network_probe(struct btd_device *device, GSList *uuids, uint16_t id)
@@ -185,13 +197,13 @@ int network_manager_init(DBusConnection *conn)
 	 * field that defines which service the source is connecting to.
 	 */
 
-	if (server_init(conn, conf_security) < 0)
+	if (server_init(conn, conf_security, conf_stats_interval) < 0)
 		return -1;
 
 	/* Register network server if it doesn't exist */
 	btd_register_adapter_driver(&network_server_driver);
 
-	if (connection_init(conn) < 0)
+	if (connection_init(conn, conf_stats_interval) < 0)
 		return -1;
 
 	btd_register_device_driver(&network_panu_driver);
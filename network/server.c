@@ -60,6 +60,10 @@ struct network_session {
 	GIOChannel	*io;		/* Pending connect channel */
 	guint		watch;		/* BNEP socket watch */
         guint           io_watch;
+	GTimer		*timer;		/* Started on incoming connection */
+	gdouble		auth_time;	/* Seconds spent in authorization */
+	char		dev[16];	/* Interface name once connected */
+	struct bnep_stats stats;
 };
 
 struct network_adapter {
@@ -80,11 +84,13 @@ struct network_server {
 	GSList		*sessions;	/* Active connections */
 	struct network_adapter *na;	/* Adapter reference */
 	guint		watch_id;	/* Client service watch */
+	guint		stats_timer;	/* Samples every session */
 };
 
 static DBusConnection *connection = NULL;
 static GSList *adapters = NULL;
 static gboolean security = TRUE;
+static unsigned int stats_interval = 0;
 
 static struct network_adapter *find_adapter(GSList *list,
 					struct btd_adapter *adapter)
@@ -305,9 +311,46 @@ static void session_free(void *data)
 	if (session->io)
 		g_io_channel_unref(session->io);
 
+	if (session->timer)
+		g_timer_destroy(session->timer);
+
 	g_free(session);
 }
 
+static void session_update_rssi(struct network_server *ns,
+					struct network_session *session)
+{
+	struct btd_conn_stats cs;
+
+	if (btd_adapter_get_conn_stats(ns->na->adapter, &session->dst,
+								&cs) == 0)
+		session->stats.rssi = cs.rssi;
+}
+
+static gboolean stats_cb(gpointer data)
+{
+	struct network_server *ns = data;
+	GSList *l;
+
+	for (l = ns->sessions; l; l = l->next) {
+		struct network_session *session = l->data;
+
+		bnep_stats_sample(session->dev, &session->stats,
+							stats_interval);
+		session_update_rssi(ns, session);
+	}
+
+	return TRUE;
+}
+
+static void stop_sampling(struct network_server *ns)
+{
+	if (ns->stats_timer) {
+		g_source_remove(ns->stats_timer);
+		ns->stats_timer = 0;
+	}
+}
+
 static void bnep_watchdog_cb(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
@@ -328,7 +371,12 @@ static void bnep_watchdog_cb(GIOChannel *chan, GIOCondition cond,
 	g_io_channel_shutdown(chan, TRUE, NULL);
 	g_io_channel_unref(session->io);
 	session->io = NULL;
+
+	ns->sessions = g_slist_remove(ns->sessions, session);
 	session_free(session);
+
+	if (!ns->sessions)
+		stop_sampling(ns);
 }
 
 
@@ -353,17 +401,30 @@ static int server_connadd(struct network_server *ns,
 	info("Added new connection: %s", devname);
 
 #ifndef ANDROID_NO_BRIDGE
-	if (bnep_add_to_bridge(devname, ns->bridge) < 0) {
+	err = bnep_if_up_bridge(devname, ns->bridge);
+	if (err < 0) {
 		error("Can't add %s to the bridge %s: %s(%d)",
-				devname, ns->bridge, strerror(errno), errno);
+				devname, ns->bridge, strerror(-err), -err);
 		return -EPERM;
 	}
+#else
+	bnep_if_up(devname);
 #endif
 
-	bnep_if_up(devname);
+	DBG("%s set up in %.1f ms (%.1f ms authorizing)", devname,
+			g_timer_elapsed(session->timer, NULL) * 1000,
+			session->auth_time * 1000);
+
+	strcpy(session->dev, devname);
+	session->stats.rssi = 127;
+	bnep_stats_sample(devname, &session->stats, 0);
 
 	ns->sessions = g_slist_append(ns->sessions, session);
 
+	if (stats_interval > 0 && !ns->stats_timer)
+		ns->stats_timer = g_timeout_add_seconds(stats_interval,
+								stats_cb, ns);
+
 	ba2str(&session->dst, address);
 	gboolean result = g_dbus_emit_signal(connection, adapter_get_path(ns->na->adapter),
 				ns->iface, "DeviceConnected",
@@ -546,6 +607,8 @@ static void auth_cb(DBusError *derr, void *user_data)
 		goto reject;
 	}
 
+	na->setup->auth_time = g_timer_elapsed(na->setup->timer, NULL);
+
 	if (!bt_io_accept(na->setup->io, connect_event, na, NULL,
 							&err)) {
 		error("bt_io_accept: %s", err->message);
@@ -600,6 +663,7 @@ static void confirm_event(GIOChannel *chan, gpointer user_data)
 	na->setup = g_new0(struct network_session, 1);
 	bacpy(&na->setup->dst, &dst);
 	na->setup->io = g_io_channel_ref(chan);
+	na->setup->timer = g_timer_new();
 
 	perr = btd_request_authorization(&src, &dst, BNEP_SVC_UUID,
 					auth_cb, na);
@@ -616,9 +680,10 @@ drop:
 	g_io_channel_shutdown(chan, TRUE, NULL);
 }
 
-int server_init(DBusConnection *conn, gboolean secure)
+int server_init(DBusConnection *conn, gboolean secure, unsigned int interval)
 {
 	security = secure;
+	stats_interval = interval;
 	connection = dbus_connection_ref(conn);
 
 	return 0;
@@ -758,6 +823,60 @@ static DBusMessage *disconnect_device(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *get_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct network_server *ns = data;
+	DBusMessage *reply;
+	DBusMessageIter iter, sessions;
+	GSList *l;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &sessions);
+
+	for (l = ns->sessions; l; l = l->next) {
+		struct network_session *session = l->data;
+		DBusMessageIter entry, dict;
+		char address[18];
+		const char *paddr = address, *pdev = session->dev;
+
+		ba2str(&session->dst, address);
+
+		bnep_stats_read(session->dev, &session->stats);
+		session_update_rssi(ns, session);
+
+		dbus_message_iter_open_container(&sessions,
+					DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+									&pdev);
+		dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+		dict_append_entry(&dict, "Address", DBUS_TYPE_STRING, &paddr);
+		bnep_stats_append(&dict, &session->stats);
+
+		dbus_message_iter_close_container(&entry, &dict);
+		dbus_message_iter_close_container(&sessions, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &sessions);
+
+	return reply;
+}
 
 static void adapter_free(struct network_adapter *na)
 {
@@ -776,6 +895,8 @@ static void server_free(struct network_server *ns)
 	if (!ns)
 		return;
 
+	stop_sampling(ns);
+
 	/* FIXME: Missing release/free all bnepX interfaces */
 	if (ns->record_id)
 		remove_record_from_server(ns->record_id);
@@ -814,6 +935,7 @@ static GDBusMethodTable server_methods[] = {
 	{ "Register",	"ss",	"",	register_server		},
 	{ "Unregister",	"s",	"",	unregister_server	},
 	{ "DisconnectDevice", "ss",	"",	disconnect_device	},
+	{ "GetStatistics", "",	"a{sa{sv}}",	get_statistics		},
 	{ }
 };
 
@@ -21,7 +21,8 @@
  *
  */
 
-int server_init(DBusConnection *conn, gboolean secure);
+int server_init(DBusConnection *conn, gboolean secure,
+						unsigned int interval);
 void server_exit(void);
 int server_register(struct btd_adapter *adapter);
 int server_unregister(struct btd_adapter *adapter);
@@ -24,6 +24,10 @@ LOCAL_C_INCLUDES:= \
         $(call include-path-for, glib) \
         $(call include-path-for, dbus) \
 
+ifeq ($(BLUETOOTH_LOOPSTAT),true)
+LOCAL_CFLAGS += -DLOOPSTAT -include $(LOCAL_PATH)/../src/loopstat.h
+endif
+
 LOCAL_SHARED_LIBRARIES := \
 	libbluetoothd \
 	libbluetooth \
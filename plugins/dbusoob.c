@@ -46,27 +46,35 @@
 
 #define OOB_INTERFACE	"org.bluez.OutOfBand"
 
-struct oob_request {
+/* Local OOB data is read from the controller ahead of demand whenever the
+ * adapter powers up, so the first ReadLocalData is answered without a
+ * controller round trip. Only the most recent pair read is valid, so no
+ * new read is issued while handed out data may still be in use */
+struct oob_adapter {
 	struct btd_adapter *adapter;
 	DBusMessage *msg;
+	gboolean reading;
+	gboolean cached;
+	uint8_t hash[16];
+	uint8_t randomizer[16];
 };
 
-static GSList *oob_requests = NULL;
+static GSList *oob_adapters = NULL;
 static DBusConnection *connection = NULL;
 
-static gint oob_request_cmp(gconstpointer a, gconstpointer b)
+static gint oob_adapter_cmp(gconstpointer a, gconstpointer b)
 {
-	const struct oob_request *data = a;
+	const struct oob_adapter *data = a;
 	const struct btd_adapter *adapter = b;
 
 	return data->adapter != adapter;
 }
 
-static struct oob_request *find_oob_request(struct btd_adapter *adapter)
+static struct oob_adapter *find_oob_adapter(struct btd_adapter *adapter)
 {
 	GSList *match;
 
-	match = g_slist_find_custom(oob_requests, adapter, oob_request_cmp);
+	match = g_slist_find_custom(oob_adapters, adapter, oob_adapter_cmp);
 
 	if (match)
 		return match->data;
@@ -74,28 +82,63 @@ static struct oob_request *find_oob_request(struct btd_adapter *adapter)
 	return NULL;
 }
 
+static DBusMessage *local_data_reply(DBusMessage *msg, uint8_t *hash,
+							uint8_t *randomizer)
+{
+	return g_dbus_create_reply(msg,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &hash, 16,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &randomizer, 16,
+			DBUS_TYPE_INVALID);
+}
+
+static int read_local_data_start(struct oob_adapter *oob)
+{
+	int err;
+
+	if (oob->reading)
+		return 0;
+
+	err = btd_adapter_read_local_oob_data(oob->adapter);
+	if (err < 0)
+		return err;
+
+	oob->reading = TRUE;
+
+	return 0;
+}
+
 static void read_local_data_complete(struct btd_adapter *adapter, uint8_t *hash,
 				uint8_t *randomizer)
 {
 	struct DBusMessage *reply;
-	struct oob_request *oob_request;
+	struct oob_adapter *oob;
+
+	oob = find_oob_adapter(adapter);
+	if (!oob)
+		return;
+
+	oob->reading = FALSE;
+
+	if (!oob->msg) {
+		/* Prefetched ahead of demand, keep it for the next request */
+		if (hash && randomizer) {
+			memcpy(oob->hash, hash, sizeof(oob->hash));
+			memcpy(oob->randomizer, randomizer,
+						sizeof(oob->randomizer));
+			oob->cached = TRUE;
+		}
 
-	oob_request = find_oob_request(adapter);
-	if (!oob_request)
 		return;
+	}
 
 	if (hash && randomizer)
-		reply = g_dbus_create_reply(oob_request->msg,
-			DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &hash, 16,
-			DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &randomizer, 16,
-			DBUS_TYPE_INVALID);
+		reply = local_data_reply(oob->msg, hash, randomizer);
 	else
-		reply = btd_error_failed(oob_request->msg,
+		reply = btd_error_failed(oob->msg,
 					"Failed to read local OOB data.");
 
-	oob_requests = g_slist_remove(oob_requests, oob_request);
-	dbus_message_unref(oob_request->msg);
-	g_free(oob_request);
+	dbus_message_unref(oob->msg);
+	oob->msg = NULL;
 
 	if (!reply) {
 		error("Couldn't allocate D-Bus message");
@@ -110,22 +153,48 @@ static DBusMessage *read_local_data(DBusConnection *conn, DBusMessage *msg,
 								void *data)
 {
 	struct btd_adapter *adapter = data;
-	struct oob_request *oob_request;
+	struct oob_adapter *oob;
+
+	oob = find_oob_adapter(adapter);
+	if (!oob)
+		return btd_error_failed(msg, "Request failed.");
 
-	if (find_oob_request(adapter))
+	if (oob->msg)
 		return btd_error_in_progress(msg);
 
-	if (btd_adapter_read_local_oob_data(adapter))
+	if (oob->cached) {
+		oob->cached = FALSE;
+		return local_data_reply(msg, oob->hash, oob->randomizer);
+	}
+
+	if (read_local_data_start(oob) < 0)
 		return btd_error_failed(msg, "Request failed.");
 
-	oob_request = g_new(struct oob_request, 1);
-	oob_request->adapter = adapter;
-	oob_requests = g_slist_append(oob_requests, oob_request);
-	oob_request->msg = dbus_message_ref(msg);
+	oob->msg = dbus_message_ref(msg);
 
 	return NULL;
 }
 
+static void adapter_powered(struct btd_adapter *adapter, gboolean powered)
+{
+	struct oob_adapter *oob;
+
+	oob = find_oob_adapter(adapter);
+	if (!oob)
+		return;
+
+	/* The controller forgets its local OOB data when powered down */
+	oob->cached = FALSE;
+
+	if (!powered) {
+		oob->reading = FALSE;
+		return;
+	}
+
+	if (!oob->msg)
+		read_local_data_start(oob);
+}
+
 static DBusMessage *add_remote_data(DBusConnection *conn, DBusMessage *msg,
 								void *data)
 {
@@ -153,6 +222,84 @@ static DBusMessage *add_remote_data(DBusConnection *conn, DBusMessage *msg,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+/* Walks an array of (address, hash, randomizer) entries, adding each one
+ * when add is TRUE and only validating them otherwise */
+static int parse_remote_data_list(DBusMessageIter *iter,
+				struct btd_adapter *adapter, gboolean add)
+{
+	DBusMessageIter array;
+
+	dbus_message_iter_recurse(iter, &array);
+
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+		DBusMessageIter entry, value;
+		uint8_t *hash, *randomizer;
+		int hlen, rlen;
+		const char *addr;
+		bdaddr_t bdaddr;
+
+		dbus_message_iter_recurse(&array, &entry);
+
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+			return -EINVAL;
+		dbus_message_iter_get_basic(&entry, &addr);
+		dbus_message_iter_next(&entry);
+
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_ARRAY)
+			return -EINVAL;
+		dbus_message_iter_recurse(&entry, &value);
+		dbus_message_iter_get_fixed_array(&value, &hash, &hlen);
+		dbus_message_iter_next(&entry);
+
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_ARRAY)
+			return -EINVAL;
+		dbus_message_iter_recurse(&entry, &value);
+		dbus_message_iter_get_fixed_array(&value, &randomizer, &rlen);
+
+		if (hlen != 16 || rlen != 16 || bachk(addr))
+			return -EINVAL;
+
+		if (add) {
+			int err;
+
+			str2ba(addr, &bdaddr);
+
+			err = btd_adapter_add_remote_oob_data(adapter, &bdaddr,
+							hash, randomizer);
+			if (err)
+				return err;
+		}
+
+		dbus_message_iter_next(&array);
+	}
+
+	return 0;
+}
+
+static DBusMessage *add_remote_data_list(DBusConnection *conn,
+						DBusMessage *msg, void *data)
+{
+	struct btd_adapter *adapter = data;
+	DBusMessageIter iter;
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return btd_error_invalid_args(msg);
+
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY ||
+			dbus_message_iter_get_element_type(&iter) !=
+							DBUS_TYPE_STRUCT)
+		return btd_error_invalid_args(msg);
+
+	/* Reject the whole list before touching the store */
+	if (parse_remote_data_list(&iter, adapter, FALSE) < 0)
+		return btd_error_invalid_args(msg);
+
+	if (parse_remote_data_list(&iter, adapter, TRUE) < 0)
+		return btd_error_failed(msg, "Request failed");
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
 static DBusMessage *remove_remote_data(DBusConnection *conn, DBusMessage *msg,
 								void *data)
 {
@@ -177,6 +324,7 @@ static DBusMessage *remove_remote_data(DBusConnection *conn, DBusMessage *msg,
 
 static GDBusMethodTable oob_methods[] = {
 	{"AddRemoteData",	"sayay",	"",	add_remote_data},
+	{"AddRemoteDataList",	"a(sayay)",	"",	add_remote_data_list},
 	{"RemoveRemoteData",	"s",		"",	remove_remote_data},
 	{"ReadLocalData",	"",		"ayay",	read_local_data,
 						G_DBUS_METHOD_FLAG_ASYNC},
@@ -186,6 +334,7 @@ static GDBusMethodTable oob_methods[] = {
 static int oob_probe(struct btd_adapter *adapter)
 {
 	const char *path = adapter_get_path(adapter);
+	struct oob_adapter *oob;
 
 	if (!g_dbus_register_interface(connection, path, OOB_INTERFACE,
 				oob_methods, NULL, NULL, adapter, NULL)) {
@@ -193,13 +342,29 @@ static int oob_probe(struct btd_adapter *adapter)
 			return -EIO;
 		}
 
+	oob = g_new0(struct oob_adapter, 1);
+	oob->adapter = adapter;
+	oob_adapters = g_slist_append(oob_adapters, oob);
+
+	btd_adapter_register_powered_callback(adapter, adapter_powered);
+
 	return 0;
 }
 
 static void oob_remove(struct btd_adapter *adapter)
 {
+	struct oob_adapter *oob;
+
 	read_local_data_complete(adapter, NULL, NULL);
 
+	oob = find_oob_adapter(adapter);
+	if (oob) {
+		oob_adapters = g_slist_remove(oob_adapters, oob);
+		g_free(oob);
+	}
+
+	btd_adapter_unregister_powered_callback(adapter, adapter_powered);
+
 	g_dbus_unregister_interface(connection, adapter_get_path(adapter),
 							OOB_INTERFACE);
 }
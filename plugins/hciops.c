@@ -28,9 +28,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -52,16 +55,27 @@
 #include "manager.h"
 #include "oob.h"
 #include "eir.h"
+#include "glib-helper.h"
 
 #define DISCOV_HALTED 0
 #define DISCOV_INQ 1
 #define DISCOV_SCAN 2
 
-#define TIMEOUT_BR_LE_SCAN 5120 /* TGAP(100)/2 */
 #define TIMEOUT_LE_SCAN 10240 /* TGAP(gen_disc_scan_min) */
 
 #define LENGTH_BR_INQ 0x08
-#define LENGTH_BR_LE_INQ 0x04
+
+/* The smallest advertising report takes 10 of the 254 bytes an LE meta
+ * event has room for */
+#define LE_ADV_MAX_REPORTS 25
+
+/* Events handled per wakeup of the event socket at most */
+#define HCI_EVENT_BATCH 64
+
+/* Remote OOB data older than this is dropped, expired entries are swept
+ * at most once per OOB_DATA_SWEEP seconds when new data is added */
+#define OOB_DATA_LIFETIME	1800
+#define OOB_DATA_SWEEP		60
 
 static int hciops_start_scanning(int index, int timeout);
 
@@ -85,6 +99,20 @@ enum {
 	PENDING_NAME,
 };
 
+/* Nothing else is needed before the adapter can be set up, so whichever
+ * of these we haven't seen an answer to are issued together and run up
+ * to the controller's command credits */
+static const struct {
+	int bit;
+	uint16_t ocf;
+	uint16_t ogf;
+} pending_reads[] = {
+	{ PENDING_BDADDR,	OCF_READ_BD_ADDR,	OGF_INFO_PARAM	},
+	{ PENDING_VERSION,	OCF_READ_LOCAL_VERSION,	OGF_INFO_PARAM	},
+	{ PENDING_FEATURES,	OCF_READ_LOCAL_FEATURES, OGF_INFO_PARAM	},
+	{ PENDING_NAME,		OCF_READ_LOCAL_NAME,	OGF_HOST_CTL	},
+};
+
 struct bt_conn {
 	struct dev_info *dev;
 	bdaddr_t bdaddr;
@@ -97,12 +125,14 @@ struct bt_conn {
 	gboolean bonding_initiator;
 	gboolean secmode3;
 	GIOChannel *io; /* For raw L2CAP socket (bonding) */
+	struct btd_conn_stats stats;
 };
 
 struct oob_data {
 	bdaddr_t bdaddr;
 	uint8_t hash[16];
 	uint8_t randomizer[16];
+	time_t expires;
 };
 
 static int max_dev = -1;
@@ -119,6 +149,7 @@ static struct dev_info {
 	int8_t tx_power;
 
 	int discov_state;
+	struct discovery_params discov_params;
 
 	uint32_t current_cod;
 	uint32_t wanted_cod;
@@ -139,20 +170,45 @@ static struct dev_info {
 	gboolean up;
 	uint32_t pending;
 
+	/* Set when the adapter is powered, cleared once it is set up */
+	struct timeval up_time;
+
 	GIOChannel *io;
 	guint watch_id;
 
 	gboolean debug_keys;
-	GSList *keys;
+	GHashTable *keys;
 	uint8_t pin_length;
 
-	GSList *oob_data;
+	GHashTable *oob_data;
+	time_t oob_sweep;
 
 	GSList *uuids;
 
-	GSList *connections;
+	/* Connections by address own the bt_conn, the handle table only
+	 * has those whose handle is already known */
+	GHashTable *conn_addrs;
+	GHashTable *conn_handles;
 
 	guint stop_scan_id;
+
+	/* EIR built from the inputs above is kept until one of them
+	 * changes, dev->eir is what was last written to the controller */
+	uint8_t eir_cache[HCI_MAX_EIR_LENGTH];
+	gboolean eir_dirty;
+	guint eir_id;
+
+	/* Commands waiting for the controller to accept more */
+	GSList *cmd_queue;
+	uint8_t cmd_credits;
+	guint cmd_timeout_id;
+
+	/* Counted from when the event socket is started */
+	time_t stats_since;
+	uint32_t stats_events[256];
+	uint32_t stats_le_reports;
+	uint32_t stats_commands;
+	GHashTable *cmd_stats;
 } *devs = NULL;
 
 static inline int get_state(int index)
@@ -245,6 +301,8 @@ static struct dev_info *init_dev_info(int index, int sk, gboolean registered,
 	dev->id = index;
 	dev->sk = sk;
 	dev->cache_enable = TRUE;
+	dev->eir_dirty = TRUE;
+	dev->cmd_credits = 1;
 	dev->registered = registered;
 	dev->already_up = already_up;
 	dev->io_capability = 0x03; /* No Input No Output */
@@ -253,6 +311,277 @@ static struct dev_info *init_dev_info(int index, int sk, gboolean registered,
 	return dev;
 }
 
+/*
+ * Commands are sent as long as the controller has credits for them, as
+ * told by Num_HCI_Command_Packets of the Command Status and Command
+ * Complete events. The others wait, pairing replies ahead of everything
+ * else and background updates behind, and a queued write of a setting
+ * is replaced by a newer one.
+ */
+#define CMD_PRIO_HIGH		0
+#define CMD_PRIO_NORMAL		1
+#define CMD_PRIO_LOW		2
+
+/* Progress without a reply to the last command after that many seconds */
+#define CMD_TIMEOUT		2
+
+struct queued_cmd {
+	uint16_t opcode;
+	uint8_t prio;
+	uint8_t plen;
+	uint8_t param[255];
+};
+
+static uint8_t cmd_priority(uint16_t opcode)
+{
+	switch (opcode) {
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_PIN_CODE_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_PIN_CODE_NEG_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_LINK_KEY_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_IO_CAPABILITY_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_IO_CAPABILITY_NEG_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_USER_CONFIRM_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_USER_CONFIRM_NEG_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_USER_PASSKEY_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_USER_PASSKEY_NEG_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_REMOTE_OOB_DATA_REPLY):
+	case cmd_opcode_pack(OGF_LINK_CTL, OCF_REMOTE_OOB_DATA_NEG_REPLY):
+		return CMD_PRIO_HIGH;
+	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_EXT_INQUIRY_RESPONSE):
+	case cmd_opcode_pack(OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME):
+		return CMD_PRIO_LOW;
+	default:
+		return CMD_PRIO_NORMAL;
+	}
+}
+
+/* Settings where only the last value written matters */
+static gboolean cmd_replaceable(uint16_t opcode)
+{
+	switch (opcode) {
+	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_CLASS_OF_DEV):
+	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_EXT_INQUIRY_RESPONSE):
+	case cmd_opcode_pack(OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME):
+	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE):
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* Queues cmd behind everything of the same or a higher priority, so
+ * that commands of one priority go out in the order they were sent */
+static GSList *cmd_queue_insert(GSList *queue, struct queued_cmd *cmd)
+{
+	GSList *l;
+
+	for (l = queue; l; l = l->next) {
+		struct queued_cmd *queued = l->data;
+
+		if (queued->prio > cmd->prio)
+			break;
+	}
+
+	return g_slist_insert_before(queue, l, cmd);
+}
+
+struct cmd_latency {
+	guint64 sent;		/* usec, 0 when no reply is expected */
+	struct btd_hci_cmd_stats stats;
+};
+
+static const unsigned int cmd_latency_bounds[] = BTD_HCI_LATENCY_BOUNDS;
+
+static guint64 monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void cmd_sent(struct dev_info *dev, uint16_t opcode)
+{
+	struct cmd_latency *lat;
+
+	dev->stats_commands++;
+
+	if (dev->cmd_stats == NULL)
+		dev->cmd_stats = g_hash_table_new_full(g_direct_hash,
+						g_direct_equal, NULL, g_free);
+
+	lat = g_hash_table_lookup(dev->cmd_stats, GUINT_TO_POINTER(opcode));
+	if (lat == NULL) {
+		lat = g_new0(struct cmd_latency, 1);
+		lat->stats.opcode = opcode;
+		g_hash_table_insert(dev->cmd_stats, GUINT_TO_POINTER(opcode),
+									lat);
+	}
+
+	lat->sent = monotonic_usec();
+}
+
+static void cmd_replied(struct dev_info *dev, uint16_t opcode)
+{
+	struct cmd_latency *lat;
+	unsigned int i;
+	uint32_t usec;
+
+	if (dev->cmd_stats == NULL)
+		return;
+
+	lat = g_hash_table_lookup(dev->cmd_stats, GUINT_TO_POINTER(opcode));
+	if (lat == NULL || lat->sent == 0)
+		return;
+
+	usec = monotonic_usec() - lat->sent;
+	lat->sent = 0;
+
+	lat->stats.count++;
+	lat->stats.total += usec;
+	lat->stats.max = MAX(lat->stats.max, usec);
+
+	for (i = 0; i < G_N_ELEMENTS(cmd_latency_bounds); i++)
+		if (usec < cmd_latency_bounds[i])
+			break;
+
+	lat->stats.buckets[i]++;
+}
+
+static gboolean cmd_timeout(gpointer user_data);
+
+static int process_cmd_queue(struct dev_info *dev)
+{
+	while (dev->cmd_queue && dev->cmd_credits > 0) {
+		struct queued_cmd *cmd = dev->cmd_queue->data;
+		int err = 0;
+
+		if (hci_send_cmd(dev->sk, cmd_opcode_ogf(cmd->opcode),
+					cmd_opcode_ocf(cmd->opcode),
+					cmd->plen, cmd->param) < 0)
+			err = -errno;
+
+		if (err == 0)
+			cmd_sent(dev, cmd->opcode);
+
+		dev->cmd_queue = g_slist_remove(dev->cmd_queue, cmd);
+		g_free(cmd);
+
+		if (err < 0) {
+			error("hci%d: unable to send queued command: %s (%d)",
+						dev->id, strerror(-err), -err);
+			continue;
+		}
+
+		dev->cmd_credits--;
+	}
+
+	if (dev->cmd_credits == 0 && dev->cmd_timeout_id == 0)
+		dev->cmd_timeout_id = g_timeout_add_seconds(CMD_TIMEOUT,
+							cmd_timeout, dev);
+
+	return 0;
+}
+
+static gboolean cmd_timeout(gpointer user_data)
+{
+	struct dev_info *dev = user_data;
+
+	dev->cmd_timeout_id = 0;
+
+	error("hci%d: command timeout, %u queued", dev->id,
+					g_slist_length(dev->cmd_queue));
+
+	dev->cmd_credits = 1;
+	process_cmd_queue(dev);
+
+	return FALSE;
+}
+
+static void cmd_credits_update(struct dev_info *dev, uint8_t ncmd)
+{
+	if (dev->cmd_timeout_id > 0) {
+		g_source_remove(dev->cmd_timeout_id);
+		dev->cmd_timeout_id = 0;
+	}
+
+	dev->cmd_credits = ncmd;
+
+	process_cmd_queue(dev);
+}
+
+static void cmd_queue_clear(struct dev_info *dev)
+{
+	if (dev->cmd_timeout_id > 0) {
+		g_source_remove(dev->cmd_timeout_id);
+		dev->cmd_timeout_id = 0;
+	}
+
+	g_slist_foreach(dev->cmd_queue, (GFunc) g_free, NULL);
+	g_slist_free(dev->cmd_queue);
+	dev->cmd_queue = NULL;
+}
+
+/* Same as hci_send_cmd(), -1 and errno on failure */
+static int send_cmd(struct dev_info *dev, uint16_t ogf, uint16_t ocf,
+						uint8_t plen, void *param)
+{
+	uint16_t opcode = cmd_opcode_pack(ogf, ocf);
+	struct queued_cmd *cmd;
+	GSList *l;
+
+	if (dev->sk < 0) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (dev->cmd_queue == NULL && dev->cmd_credits > 0) {
+		if (hci_send_cmd(dev->sk, ogf, ocf, plen, param) < 0)
+			return -1;
+
+		cmd_sent(dev, opcode);
+
+		if (--dev->cmd_credits == 0 && dev->cmd_timeout_id == 0)
+			dev->cmd_timeout_id = g_timeout_add_seconds(
+						CMD_TIMEOUT, cmd_timeout, dev);
+
+		return 0;
+	}
+
+	if (cmd_replaceable(opcode)) {
+		for (l = dev->cmd_queue; l; l = l->next) {
+			cmd = l->data;
+
+			if (cmd->opcode != opcode)
+				continue;
+
+			/* The new value goes out after whatever was sent
+			 * before it, not in the slot of the stale one */
+			dev->cmd_queue = g_slist_delete_link(dev->cmd_queue, l);
+
+			memcpy(cmd->param, param, plen);
+			cmd->plen = plen;
+
+			dev->cmd_queue = cmd_queue_insert(dev->cmd_queue, cmd);
+
+			return 0;
+		}
+	}
+
+	cmd = g_new0(struct queued_cmd, 1);
+	cmd->opcode = opcode;
+	cmd->prio = cmd_priority(opcode);
+	cmd->plen = plen;
+	if (plen > 0)
+		memcpy(cmd->param, param, plen);
+
+	dev->cmd_queue = cmd_queue_insert(dev->cmd_queue, cmd);
+
+	return 0;
+}
+
 /* Async HCI command handling with callback support */
 
 struct hci_cmd_data {
@@ -366,7 +695,7 @@ static int write_inq_mode(int index, uint8_t mode)
 	memset(&cp, 0, sizeof(cp));
 	cp.mode = mode;
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE,
 					WRITE_INQUIRY_MODE_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -417,7 +746,7 @@ static int init_ssp_mode(int index)
 	memset(&cp, 0, sizeof(cp));
 	cp.mode = 0x01;
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL,
+	if (send_cmd(dev, OGF_HOST_CTL,
 				OCF_WRITE_SIMPLE_PAIRING_MODE,
 				WRITE_SIMPLE_PAIRING_MODE_CP_SIZE, &cp) < 0)
 		return -errno;
@@ -437,7 +766,7 @@ static int hciops_set_discoverable(int index, gboolean discoverable)
 
 	DBG("hci%d discoverable %d", index, discoverable);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE,
 								1, &mode) < 0)
 		return -errno;
 
@@ -466,7 +795,7 @@ static int hciops_power_off(int index)
 
 	DBG("hci%d set scan mode off", index);
 	mode = SCAN_DISABLED;
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE,
 				1, &mode) < 0)
 		return -errno;
 
@@ -529,7 +858,7 @@ static void set_event_mask(int index)
 	if (dev->features[4] & LMP_LE)
 		events[7] |= 0x20;	/* LE Meta-Event */
 
-	hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_SET_EVENT_MASK,
+	send_cmd(dev, OGF_HOST_CTL, OCF_SET_EVENT_MASK,
 						sizeof(events), events);
 }
 
@@ -549,7 +878,7 @@ static void start_adapter(int index)
 		write_inq_mode(index, inqmode);
 
 	if (dev->features[7] & LMP_INQ_TX_PWR)
-		hci_send_cmd(dev->sk, OGF_HOST_CTL,
+		send_cmd(dev, OGF_HOST_CTL,
 				OCF_READ_INQ_RESPONSE_TX_POWER_LEVEL, 0, NULL);
 
 	/* Set default link policy */
@@ -565,7 +894,7 @@ static void start_adapter(int index)
 		link_policy &= ~HCI_LP_PARK;
 
 	link_policy = htobs(link_policy);
-	hci_send_cmd(dev->sk, OGF_LINK_POLICY, OCF_WRITE_DEFAULT_LINK_POLICY,
+	send_cmd(dev, OGF_LINK_POLICY, OCF_WRITE_DEFAULT_LINK_POLICY,
 					sizeof(link_policy), &link_policy);
 
 	dev->current_cod = 0;
@@ -578,7 +907,7 @@ static int hciops_stop_inquiry(int index)
 
 	DBG("hci%d", index);
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, 0) < 0)
+	if (send_cmd(dev, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, 0) < 0)
 		return -errno;
 
 	return 0;
@@ -715,6 +1044,7 @@ static int hciops_set_did(int index, uint16_t vendor, uint16_t product,
 	dev->did_vendor = vendor;
 	dev->did_product = product;
 	dev->did_version = version;
+	dev->eir_dirty = TRUE;
 
 	return 0;
 }
@@ -723,44 +1053,39 @@ static int hciops_set_did(int index, uint16_t vendor, uint16_t product,
 
 /* Start of HCI event callbacks */
 
-static gint conn_handle_cmp(gconstpointer a, gconstpointer b)
-{
-	const struct bt_conn *conn = a;
-	uint16_t handle = *((const uint16_t *) b);
-
-	return (int) conn->handle - (int) handle;
-}
+#define CONN_HANDLE_KEY(handle) GUINT_TO_POINTER((handle) & 0x0fff)
 
 static struct bt_conn *find_conn_by_handle(struct dev_info *dev,
 							uint16_t handle)
 {
-	GSList *match;
+	struct bt_conn *conn;
+
+	if (dev->conn_handles == NULL)
+		return NULL;
 
-	match = g_slist_find_custom(dev->connections, &handle,
-							conn_handle_cmp);
-	if (match)
-		return match->data;
+	conn = g_hash_table_lookup(dev->conn_handles, CONN_HANDLE_KEY(handle));
+	if (conn)
+		conn->stats.events++;
 
-	return NULL;
+	return conn;
 }
 
-static gint conn_bdaddr_cmp(gconstpointer a, gconstpointer b)
+static struct bt_conn *find_connection(struct dev_info *dev, bdaddr_t *bdaddr)
 {
-	const struct bt_conn *conn = a;
-	const bdaddr_t *bdaddr = b;
+	if (dev->conn_addrs == NULL)
+		return NULL;
 
-	return bacmp(&conn->bdaddr, bdaddr);
+	return g_hash_table_lookup(dev->conn_addrs, bdaddr);
 }
 
-static struct bt_conn *find_connection(struct dev_info *dev, bdaddr_t *bdaddr)
+static void conn_free(struct bt_conn *conn)
 {
-	GSList *match;
-
-	match = g_slist_find_custom(dev->connections, bdaddr, conn_bdaddr_cmp);
-	if (match)
-		return match->data;
+	if (conn->io != NULL) {
+		g_io_channel_shutdown(conn->io, TRUE, NULL);
+		g_io_channel_unref(conn->io);
+	}
 
-	return NULL;
+	g_free(conn);
 }
 
 static struct bt_conn *get_connection(struct dev_info *dev, bdaddr_t *bdaddr)
@@ -777,13 +1102,48 @@ static struct bt_conn *get_connection(struct dev_info *dev, bdaddr_t *bdaddr)
 	conn->loc_cap = dev->io_capability;
 	conn->loc_auth = 0xff;
 	conn->rem_auth = 0xff;
+	conn->stats.rssi = 127; /* Not available */
 	bacpy(&conn->bdaddr, bdaddr);
 
-	dev->connections = g_slist_append(dev->connections, conn);
+	if (dev->conn_addrs == NULL) {
+		dev->conn_addrs = g_hash_table_new_full(bt_bdaddr_hash,
+					bt_bdaddr_equal, NULL,
+					(GDestroyNotify) conn_free);
+		dev->conn_handles = g_hash_table_new(g_direct_hash,
+							g_direct_equal);
+	}
+
+	g_hash_table_insert(dev->conn_addrs, &conn->bdaddr, conn);
 
 	return conn;
 }
 
+static void conn_set_handle(struct dev_info *dev, struct bt_conn *conn,
+							uint16_t handle)
+{
+	if (g_hash_table_lookup(dev->conn_handles,
+				CONN_HANDLE_KEY(conn->handle)) == conn)
+		g_hash_table_remove(dev->conn_handles,
+					CONN_HANDLE_KEY(conn->handle));
+
+	conn->handle = handle;
+	conn->stats.handle = handle;
+	conn->stats.connected = time(NULL);
+
+	g_hash_table_replace(dev->conn_handles, CONN_HANDLE_KEY(handle), conn);
+}
+
+/* The caller still owns conn and has to free it */
+static void conn_remove(struct dev_info *dev, struct bt_conn *conn)
+{
+	if (g_hash_table_lookup(dev->conn_handles,
+				CONN_HANDLE_KEY(conn->handle)) == conn)
+		g_hash_table_remove(dev->conn_handles,
+					CONN_HANDLE_KEY(conn->handle));
+
+	g_hash_table_steal(dev->conn_addrs, &conn->bdaddr);
+}
+
 static int get_handle(int index, bdaddr_t *bdaddr, uint16_t *handle)
 {
 	struct dev_info *dev = &devs[index];
@@ -816,7 +1176,7 @@ static int disconnect_addr(int index, bdaddr_t *dba, uint8_t reason)
 	cp.handle = htobs(handle);
 	cp.reason = reason;
 
-	if (hci_send_cmd(devs[index].sk, OGF_LINK_CTL, OCF_DISCONNECT,
+	if (send_cmd(&devs[index], OGF_LINK_CTL, OCF_DISCONNECT,
 						DISCONNECT_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -869,13 +1229,13 @@ static void link_key_request(int index, bdaddr_t *dba)
 	struct dev_info *dev = &devs[index];
 	struct link_key_info *key_info;
 	struct bt_conn *conn;
-	GSList *match;
 	char da[18];
 
 	ba2str(dba, da);
 	DBG("hci%d dba %s", index, da);
 
 	conn = get_connection(dev, dba);
+	conn->stats.events++;
 	if (conn->handle == 0)
 		conn->secmode3 = TRUE;
 
@@ -883,17 +1243,13 @@ static void link_key_request(int index, bdaddr_t *dba)
 
 	DBG("kernel auth requirements = 0x%02x", conn->loc_auth);
 
-	match = g_slist_find_custom(dev->keys, dba, (GCompareFunc) bacmp);
-	if (match)
-		key_info = match->data;
-	else
-		key_info = NULL;
+	key_info = dev->keys ? g_hash_table_lookup(dev->keys, dba) : NULL;
 
 	DBG("Matching key %s", key_info ? "found" : "not found");
 
 	if (key_info == NULL || (!dev->debug_keys && key_info->type == 0x03)) {
 		/* Link key not found */
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
+		send_cmd(dev, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
 								6, dba);
 		return;
 	}
@@ -906,7 +1262,7 @@ static void link_key_request(int index, bdaddr_t *dba)
 	 * required */
 	if (key_info->type == 0x04 && conn->loc_auth != 0xff &&
 						(conn->loc_auth & 0x01))
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
+		send_cmd(dev, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
 								6, dba);
 	else {
 		link_key_reply_cp lr;
@@ -914,7 +1270,7 @@ static void link_key_request(int index, bdaddr_t *dba)
 		memcpy(lr.link_key, key_info->key, 16);
 		bacpy(&lr.bdaddr, dba);
 
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_LINK_KEY_REPLY,
+		send_cmd(dev, OGF_LINK_CTL, OCF_LINK_KEY_REPLY,
 						LINK_KEY_REPLY_CP_SIZE, &lr);
 	}
 }
@@ -927,7 +1283,6 @@ static void link_key_notify(int index, void *ptr)
 	struct link_key_info *key_info;
 	uint8_t old_key_type, key_type;
 	struct bt_conn *conn;
-	GSList *match;
 	char da[18];
 	uint8_t status = 0;
 
@@ -935,19 +1290,19 @@ static void link_key_notify(int index, void *ptr)
 	DBG("hci%d dba %s type %d", index, da, evt->key_type);
 
 	conn = get_connection(dev, &evt->bdaddr);
+	conn->stats.events++;
 
-	match = g_slist_find_custom(dev->keys, dba, (GCompareFunc) bacmp);
-	if (match)
-		key_info = match->data;
-	else
-		key_info = NULL;
+	if (dev->keys == NULL)
+		dev->keys = g_hash_table_new_full(bt_bdaddr_hash,
+						bt_bdaddr_equal, NULL, g_free);
 
+	key_info = g_hash_table_lookup(dev->keys, dba);
 	if (key_info == NULL) {
 		key_info = g_new0(struct link_key_info, 1);
 		bacpy(&key_info->bdaddr, &evt->bdaddr);
 		old_key_type = 0xff;
 	} else {
-		dev->keys = g_slist_remove(dev->keys, key_info);
+		g_hash_table_steal(dev->keys, dba);
 		old_key_type = key_info->type;
 	}
 
@@ -1020,7 +1375,7 @@ done:
 		return;
 	}
 
-	dev->keys = g_slist_prepend(dev->keys, key_info);
+	g_hash_table_insert(dev->keys, &key_info->bdaddr, key_info);
 
 	/* If we're connected and not dedicated bonding initiators we're
 	 * done with the bonding process */
@@ -1070,11 +1425,11 @@ static int hciops_confirm_reply(int index, bdaddr_t *bdaddr, gboolean success)
 	bacpy(&cp.bdaddr, bdaddr);
 
 	if (success)
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = send_cmd(dev, OGF_LINK_CTL,
 					OCF_USER_CONFIRM_REPLY,
 					USER_CONFIRM_REPLY_CP_SIZE, &cp);
 	else
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = send_cmd(dev, OGF_LINK_CTL,
 					OCF_USER_CONFIRM_NEG_REPLY,
 					USER_CONFIRM_REPLY_CP_SIZE, &cp);
 
@@ -1098,6 +1453,8 @@ static void user_confirm_request(int index, void *ptr)
 	if (conn == NULL)
 		return;
 
+	conn->stats.events++;
+
 	loc_mitm = (conn->loc_auth & 0x01) ? TRUE : FALSE;
 	rem_mitm = (conn->rem_auth & 0x01) ? TRUE : FALSE;
 
@@ -1142,7 +1499,7 @@ static void user_confirm_request(int index, void *ptr)
 		return;
 
 fail:
-	hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_USER_CONFIRM_NEG_REPLY,
+	send_cmd(dev, OGF_LINK_CTL, OCF_USER_CONFIRM_NEG_REPLY,
 								6, ptr);
 }
 
@@ -1154,7 +1511,7 @@ static void user_passkey_request(int index, void *ptr)
 	DBG("hci%d", index);
 
 	if (btd_event_user_passkey(&dev->bdaddr, &req->bdaddr) < 0)
-		hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		send_cmd(dev, OGF_LINK_CTL,
 				OCF_USER_PASSKEY_NEG_REPLY, 6, ptr);
 }
 
@@ -1169,40 +1526,73 @@ static void user_passkey_notify(int index, void *ptr)
 						btohl(req->passkey));
 }
 
-static gint oob_bdaddr_cmp(gconstpointer a, gconstpointer b)
+static struct oob_data *find_oob_data(struct dev_info *dev, bdaddr_t *bdaddr)
+{
+	struct oob_data *data;
+
+	if (dev->oob_data == NULL)
+		return NULL;
+
+	data = g_hash_table_lookup(dev->oob_data, bdaddr);
+	if (data == NULL)
+		return NULL;
+
+	if (data->expires <= time(NULL)) {
+		g_hash_table_remove(dev->oob_data, bdaddr);
+		return NULL;
+	}
+
+	return data;
+}
+
+static gboolean oob_data_expired(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct oob_data *data = value;
+	time_t *now = user_data;
+
+	return data->expires <= *now;
+}
+
+static void sweep_oob_data(struct dev_info *dev)
 {
-	const struct oob_data *data = a;
-	const bdaddr_t *bdaddr = b;
+	time_t now = time(NULL);
+	guint removed;
+
+	if (now < dev->oob_sweep)
+		return;
+
+	dev->oob_sweep = now + OOB_DATA_SWEEP;
 
-	return bacmp(&data->bdaddr, bdaddr);
+	removed = g_hash_table_foreach_remove(dev->oob_data, oob_data_expired,
+									&now);
+	if (removed > 0)
+		DBG("hci%d dropped %u expired OOB entries", dev->id, removed);
 }
 
 static void remote_oob_data_request(int index, bdaddr_t *bdaddr)
 {
 	struct dev_info *dev = &devs[index];
-	GSList *match;
+	struct oob_data *data;
 
 	DBG("hci%d", index);
 
-	match = g_slist_find_custom(dev->oob_data, bdaddr, oob_bdaddr_cmp);
+	data = find_oob_data(dev, bdaddr);
 
-	if (match) {
-		struct oob_data *data;
+	if (data) {
 		remote_oob_data_reply_cp cp;
 
-		data = match->data;
-
 		bacpy(&cp.bdaddr, &data->bdaddr);
 		memcpy(cp.hash, data->hash, sizeof(cp.hash));
 		memcpy(cp.randomizer, data->randomizer, sizeof(cp.randomizer));
 
-		dev->oob_data = g_slist_delete_link(dev->oob_data, match);
+		g_hash_table_remove(dev->oob_data, bdaddr);
 
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_REMOTE_OOB_DATA_REPLY,
+		send_cmd(dev, OGF_LINK_CTL, OCF_REMOTE_OOB_DATA_REPLY,
 				REMOTE_OOB_DATA_REPLY_CP_SIZE, &cp);
 
 	} else {
-		hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		send_cmd(dev, OGF_LINK_CTL,
 				OCF_REMOTE_OOB_DATA_NEG_REPLY, 6, bdaddr);
 	}
 }
@@ -1297,13 +1687,12 @@ static void io_capa_request(int index, void *ptr)
 		memset(&cp, 0, sizeof(cp));
 		bacpy(&cp.bdaddr, dba);
 		cp.reason = HCI_PAIRING_NOT_ALLOWED;
-		hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		send_cmd(dev, OGF_LINK_CTL,
 					OCF_IO_CAPABILITY_NEG_REPLY,
 					IO_CAPABILITY_NEG_REPLY_CP_SIZE, &cp);
 	} else {
 		io_capability_reply_cp cp;
 		struct bt_conn *conn;
-		GSList *match;
 
 		memset(&cp, 0, sizeof(cp));
 		bacpy(&cp.bdaddr, dba);
@@ -1311,15 +1700,14 @@ static void io_capa_request(int index, void *ptr)
 		cp.authentication = auth;
 
 		conn = find_connection(dev, dba);
-		match = g_slist_find_custom(dev->oob_data, dba, oob_bdaddr_cmp);
 
 		if ((conn->bonding_initiator || conn->rem_oob_data == 0x01) &&
-				match)
+				find_oob_data(dev, dba))
 			cp.oob_data = 0x01;
 		else
 			cp.oob_data = 0x00;
 
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_IO_CAPABILITY_REPLY,
+		send_cmd(dev, OGF_LINK_CTL, OCF_IO_CAPABILITY_REPLY,
 					IO_CAPABILITY_REPLY_CP_SIZE, &cp);
 	}
 }
@@ -1336,6 +1724,7 @@ static void io_capa_response(int index, void *ptr)
 
 	conn = find_connection(dev, &evt->bdaddr);
 	if (conn) {
+		conn->stats.events++;
 		conn->rem_cap = evt->capability;
 		conn->rem_auth = evt->authentication;
 		conn->rem_oob_data = evt->oob_data;
@@ -1355,6 +1744,7 @@ static void pin_code_request(int index, bdaddr_t *dba)
 	DBG("hci%d PIN request for %s", index, addr);
 
 	conn = get_connection(dev, dba);
+	conn->stats.events++;
 	if (conn->handle == 0)
 		conn->secmode3 = TRUE;
 
@@ -1374,7 +1764,7 @@ static void pin_code_request(int index, bdaddr_t *dba)
 	return;
 
 reject:
-	hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_PIN_CODE_NEG_REPLY, 6, dba);
+	send_cmd(dev, OGF_LINK_CTL, OCF_PIN_CODE_NEG_REPLY, 6, dba);
 }
 
 static inline void remote_features_notify(int index, void *ptr)
@@ -1400,12 +1790,41 @@ static void write_le_host_complete(int index, uint8_t status)
 	if (status)
 		return;
 
-	if (hci_send_cmd(dev->sk, OGF_INFO_PARAM,
+	if (send_cmd(dev, OGF_INFO_PARAM,
 				OCF_READ_LOCAL_EXT_FEATURES, 1, &page_num) < 0)
 		error("Unable to read extended local features: %s (%d)",
 						strerror(errno), errno);
 }
 
+static void pending_done(int index, int bit)
+{
+	struct dev_info *dev = &devs[index];
+
+	if (!hci_test_bit(bit, &dev->pending))
+		return;
+
+	hci_clear_bit(bit, &dev->pending);
+
+	if (!dev->pending && dev->up)
+		init_adapter(index);
+}
+
+static void send_pending_reads(int index)
+{
+	struct dev_info *dev = &devs[index];
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(pending_reads); i++) {
+		if (!hci_test_bit(pending_reads[i].bit, &dev->pending))
+			continue;
+
+		if (send_cmd(dev, pending_reads[i].ogf, pending_reads[i].ocf,
+							0, NULL) < 0)
+			error("hci%d: unable to send init command 0x%4.4x",
+					index, pending_reads[i].ocf);
+	}
+}
+
 static void read_local_version_complete(int index,
 				const read_local_version_rp *rp)
 {
@@ -1420,15 +1839,9 @@ static void read_local_version_complete(int index,
 	dev->ver.lmp_ver = rp->lmp_ver;
 	dev->ver.lmp_subver = btohs(bt_get_unaligned(&rp->lmp_subver));
 
-	if (!dev->pending)
-		return;
-
-	hci_clear_bit(PENDING_VERSION, &dev->pending);
-
 	DBG("Got version for hci%d", index);
 
-	if (!dev->pending && dev->up)
-		init_adapter(index);
+	pending_done(index, PENDING_VERSION);
 }
 
 static void read_local_features_complete(int index,
@@ -1441,48 +1854,71 @@ static void read_local_features_complete(int index,
 
 	memcpy(dev->features, rp->features, 8);
 
-	if (!dev->pending)
-		return;
-
-	hci_clear_bit(PENDING_FEATURES, &dev->pending);
-
 	DBG("Got features for hci%d", index);
 
-	if (!dev->pending && dev->up)
-		init_adapter(index);
+	pending_done(index, PENDING_FEATURES);
 }
 
-static void update_ext_inquiry_response(int index)
+static gboolean write_ext_inquiry_response(gpointer user_data)
 {
-	struct dev_info *dev = &devs[index];
+	struct dev_info *dev = user_data;
 	write_ext_inquiry_response_cp cp;
 
-	DBG("hci%d", index);
+	dev->eir_id = 0;
 
 	if (!(dev->features[6] & LMP_EXT_INQ))
-		return;
+		return FALSE;
 
 	if (dev->ssp_mode == 0)
-		return;
+		return FALSE;
 
 	if (dev->cache_enable)
-		return;
+		return FALSE;
 
-	memset(&cp, 0, sizeof(cp));
+	if (dev->eir_dirty) {
+		memset(dev->eir_cache, 0, sizeof(dev->eir_cache));
+		eir_create(dev->name, dev->tx_power, dev->did_vendor,
+				dev->did_product, dev->did_version,
+				dev->uuids, dev->eir_cache);
+		dev->eir_dirty = FALSE;
+	}
 
-	eir_create(dev->name, dev->tx_power, dev->did_vendor, dev->did_product,
-					dev->did_version, dev->uuids, cp.data);
+	if (memcmp(dev->eir_cache, dev->eir, sizeof(dev->eir)) == 0)
+		return FALSE;
 
-	if (memcmp(cp.data, dev->eir, sizeof(cp.data)) == 0)
-		return;
+	DBG("hci%d", dev->id);
 
-	memcpy(dev->eir, cp.data, sizeof(cp.data));
+	memcpy(dev->eir, dev->eir_cache, sizeof(dev->eir));
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL,
+	memset(&cp, 0, sizeof(cp));
+	memcpy(cp.data, dev->eir, sizeof(cp.data));
+
+	if (send_cmd(dev, OGF_HOST_CTL,
 				OCF_WRITE_EXT_INQUIRY_RESPONSE,
 				WRITE_EXT_INQUIRY_RESPONSE_CP_SIZE, &cp) < 0)
 		error("Unable to write EIR data: %s (%d)",
 						strerror(errno), errno);
+
+	return FALSE;
+}
+
+/* Written once the main loop is idle, so that a burst of service or name
+ * changes ends up as a single write */
+static void update_ext_inquiry_response(int index)
+{
+	struct dev_info *dev = &devs[index];
+
+	if (dev->eir_id > 0)
+		return;
+
+	dev->eir_id = g_idle_add(write_ext_inquiry_response, dev);
+}
+
+static void eir_changed(int index)
+{
+	devs[index].eir_dirty = TRUE;
+
+	update_ext_inquiry_response(index);
 }
 
 static void update_name(int index, const char *name)
@@ -1493,7 +1929,7 @@ static void update_name(int index, const char *name)
 	if (adapter)
 		adapter_update_local_name(adapter, name);
 
-	update_ext_inquiry_response(index);
+	eir_changed(index);
 }
 
 static void read_local_name_complete(int index, read_local_name_rp *rp)
@@ -1512,27 +1948,9 @@ static void read_local_name_complete(int index, read_local_name_rp *rp)
 		return;
 	}
 
-	hci_clear_bit(PENDING_NAME, &dev->pending);
-
 	DBG("Got name for hci%d", index);
 
-	/* Even though it shouldn't happen (assuming the kernel behaves
-	 * properly) it seems like we might miss the very first
-	 * initialization commands that the kernel sends. So check for
-	 * it here (since read_local_name is one of the last init
-	 * commands) and resend the first ones if we haven't seen
-	 * their results yet */
-
-	if (hci_test_bit(PENDING_FEATURES, &dev->pending))
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
-					OCF_READ_LOCAL_FEATURES, 0, NULL);
-
-	if (hci_test_bit(PENDING_VERSION, &dev->pending))
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
-					OCF_READ_LOCAL_VERSION, 0, NULL);
-
-	if (!dev->pending && dev->up)
-		init_adapter(index);
+	pending_done(index, PENDING_NAME);
 }
 
 static void read_tx_power_complete(int index, void *ptr)
@@ -1547,7 +1965,7 @@ static void read_tx_power_complete(int index, void *ptr)
 		return;
 
 	dev->tx_power = rp->level;
-	update_ext_inquiry_response(index);
+	eir_changed(index);
 }
 
 static void read_simple_pairing_mode_complete(int index, void *ptr)
@@ -1561,7 +1979,7 @@ static void read_simple_pairing_mode_complete(int index, void *ptr)
 		return;
 
 	dev->ssp_mode = rp->mode;
-	update_ext_inquiry_response(index);
+	eir_changed(index);
 }
 
 static void read_local_ext_features_complete(int index,
@@ -1592,15 +2010,9 @@ static void read_bd_addr_complete(int index, read_bd_addr_rp *rp)
 
 	bacpy(&dev->bdaddr, &rp->bdaddr);
 
-	if (!dev->pending)
-		return;
-
-	hci_clear_bit(PENDING_BDADDR, &dev->pending);
-
 	DBG("Got bdaddr for hci%d", index);
 
-	if (!dev->pending && dev->up)
-		init_adapter(index);
+	pending_done(index, PENDING_BDADDR);
 }
 
 static inline void cs_inquiry_evt(int index, uint8_t status)
@@ -1618,6 +2030,9 @@ static inline void cmd_status(int index, void *ptr)
 	evt_cmd_status *evt = ptr;
 	uint16_t opcode = btohs(evt->opcode);
 
+	cmd_replied(&devs[index], opcode);
+	cmd_credits_update(&devs[index], evt->ncmd);
+
 	if (opcode == cmd_opcode_pack(OGF_LINK_CTL, OCF_INQUIRY))
 		cs_inquiry_evt(index, evt->status);
 }
@@ -1636,6 +2051,18 @@ static void read_scan_complete(int index, uint8_t status, void *ptr)
 	}
 
 	adapter_mode_changed(adapter, rp->enable);
+
+	/* The scan mode is the last thing init_adapter sets up */
+	if (timerisset(&devs[index].up_time)) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		timersub(&now, &devs[index].up_time, &now);
+		timerclear(&devs[index].up_time);
+
+		info("hci%d ready in %ld ms", index,
+				now.tv_sec * 1000 + now.tv_usec / 1000);
+	}
 }
 
 static int write_class(int index, uint32_t class)
@@ -1647,7 +2074,7 @@ static int write_class(int index, uint32_t class)
 
 	memcpy(cp.dev_class, &class, 3);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_CLASS_OF_DEV,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_WRITE_CLASS_OF_DEV,
 					WRITE_CLASS_OF_DEV_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -1686,7 +2113,7 @@ static int hciops_set_limited_discoverable(int index, gboolean limited)
 	cp.num_current_iac = num;
 	memcpy(&cp.lap, lap, num * 3);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_CURRENT_IAC_LAP,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_WRITE_CURRENT_IAC_LAP,
 						(num * 3 + 1), &cp) < 0)
 		return -errno;
 
@@ -1759,8 +2186,10 @@ static inline void inquiry_complete_evt(int index, uint8_t status)
 	adapter_type = get_adapter_type(index);
 
 	if (adapter_type == BR_EDR_LE &&
+			devs[index].discov_params.transport & DISCOVERY_LE &&
 					adapter_has_discov_sessions(adapter)) {
-		int err = hciops_start_scanning(index, TIMEOUT_BR_LE_SCAN);
+		int err = hciops_start_scanning(index,
+				devs[index].discov_params.scan_timeout);
 		if (err < 0)
 			set_state(index, DISCOV_HALTED);
 	} else {
@@ -1801,6 +2230,9 @@ static inline void cmd_complete(int index, void *ptr)
 	uint16_t opcode = btohs(evt->opcode);
 	uint8_t status = *((uint8_t *) ptr + EVT_CMD_COMPLETE_SIZE);
 
+	cmd_replied(dev, opcode);
+	cmd_credits_update(dev, evt->ncmd);
+
 	switch (opcode) {
 	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION):
 		ptr += sizeof(evt_cmd_complete);
@@ -1829,11 +2261,11 @@ static inline void cmd_complete(int index, void *ptr)
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME):
 		if (!status)
-			hci_send_cmd(dev->sk, OGF_HOST_CTL,
+			send_cmd(dev, OGF_HOST_CTL,
 						OCF_READ_LOCAL_NAME, 0, 0);
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE):
-		hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_READ_SCAN_ENABLE,
+		send_cmd(dev, OGF_HOST_CTL, OCF_READ_SCAN_ENABLE,
 								0, NULL);
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_READ_SCAN_ENABLE):
@@ -1845,7 +2277,7 @@ static inline void cmd_complete(int index, void *ptr)
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_SIMPLE_PAIRING_MODE):
 		if (!status)
-			hci_send_cmd(dev->sk, OGF_HOST_CTL,
+			send_cmd(dev, OGF_HOST_CTL,
 					OCF_READ_SIMPLE_PAIRING_MODE, 0, NULL);
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_READ_SIMPLE_PAIRING_MODE):
@@ -1904,9 +2336,35 @@ static inline void remote_version_information(int index, void *ptr)
 				btohs(evt->lmp_subver));
 }
 
+/* Peers we have a link to show up in inquiry and advertising reports
+ * too, which is the only RSSI we get for them without asking */
+static void found_add(struct dev_info *dev, struct btd_found_info *found,
+				int *count, bdaddr_t *bdaddr, uint32_t class,
+				int8_t rssi, uint8_t *data)
+{
+	struct bt_conn *conn;
+
+	conn = find_connection(dev, bdaddr);
+	if (conn)
+		conn->stats.rssi = rssi;
+
+	/* The controller can't filter on signal strength, so do it here
+	 * rather than in the adapter */
+	if (dev->discov_state != DISCOV_HALTED && dev->discov_params.has_rssi &&
+					rssi < dev->discov_params.rssi)
+		return;
+
+	found[*count].bdaddr = bdaddr;
+	found[*count].class = class;
+	found[*count].rssi = rssi;
+	found[*count].data = data;
+	(*count)++;
+}
+
 static inline void inquiry_result(int index, int plen, void *ptr)
 {
 	struct dev_info *dev = &devs[index];
+	struct btd_found_info found[255];
 	uint8_t num = *(uint8_t *) ptr++;
 	int i;
 
@@ -1920,17 +2378,22 @@ static inline void inquiry_result(int index, int plen, void *ptr)
 						(info->dev_class[1] << 8) |
 						(info->dev_class[2] << 16);
 
-		btd_event_device_found(&dev->bdaddr, &info->bdaddr, class,
-								0, NULL);
+		found[i].bdaddr = &info->bdaddr;
+		found[i].class = class;
+		found[i].rssi = 0;
+		found[i].data = NULL;
 		ptr += INQUIRY_INFO_SIZE;
 	}
+
+	btd_event_devices_found(&dev->bdaddr, found, num);
 }
 
 static inline void inquiry_result_with_rssi(int index, int plen, void *ptr)
 {
 	struct dev_info *dev = &devs[index];
+	struct btd_found_info found[255];
 	uint8_t num = *(uint8_t *) ptr++;
-	int i;
+	int i, count = 0;
 
 	if (!num)
 		return;
@@ -1942,8 +2405,8 @@ static inline void inquiry_result_with_rssi(int index, int plen, void *ptr)
 						| (info->dev_class[1] << 8)
 						| (info->dev_class[2] << 16);
 
-			btd_event_device_found(&dev->bdaddr, &info->bdaddr,
-						class, info->rssi, NULL);
+			found_add(dev, found, &count, &info->bdaddr, class,
+							info->rssi, NULL);
 			ptr += INQUIRY_INFO_WITH_RSSI_AND_PSCAN_MODE_SIZE;
 		}
 	} else {
@@ -1953,18 +2416,21 @@ static inline void inquiry_result_with_rssi(int index, int plen, void *ptr)
 						| (info->dev_class[1] << 8)
 						| (info->dev_class[2] << 16);
 
-			btd_event_device_found(&dev->bdaddr, &info->bdaddr,
-						class, info->rssi, NULL);
+			found_add(dev, found, &count, &info->bdaddr, class,
+							info->rssi, NULL);
 			ptr += INQUIRY_INFO_WITH_RSSI_SIZE;
 		}
 	}
+
+	btd_event_devices_found(&dev->bdaddr, found, count);
 }
 
 static inline void extended_inquiry_result(int index, int plen, void *ptr)
 {
 	struct dev_info *dev = &devs[index];
+	struct btd_found_info found[255];
 	uint8_t num = *(uint8_t *) ptr++;
-	int i;
+	int i, count = 0;
 
 	for (i = 0; i < num; i++) {
 		extended_inquiry_info *info = ptr;
@@ -1972,10 +2438,12 @@ static inline void extended_inquiry_result(int index, int plen, void *ptr)
 					| (info->dev_class[1] << 8)
 					| (info->dev_class[2] << 16);
 
-		btd_event_device_found(&dev->bdaddr, &info->bdaddr, class,
+		found_add(dev, found, &count, &info->bdaddr, class,
 						info->rssi, info->data);
 		ptr += EXTENDED_INQUIRY_INFO_SIZE;
 	}
+
+	btd_event_devices_found(&dev->bdaddr, found, count);
 }
 
 static inline void remote_features_information(int index, void *ptr)
@@ -2012,7 +2480,7 @@ static gboolean __get_remote_version(gpointer user_data)
 	memset(&cp, 0, sizeof(cp));
 	cp.handle = htobs(req->handle);
 
-	hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_READ_REMOTE_VERSION,
+	send_cmd(dev, OGF_LINK_CTL, OCF_READ_REMOTE_VERSION,
 					READ_REMOTE_VERSION_CP_SIZE, &cp);
 
 	return FALSE;
@@ -2030,16 +2498,6 @@ static void get_remote_version(int index, uint16_t handle)
 								req, g_free);
 }
 
-static void conn_free(struct bt_conn *conn)
-{
-	if (conn->io != NULL) {
-		g_io_channel_shutdown(conn->io, TRUE, NULL);
-		g_io_channel_unref(conn->io);
-	}
-
-	g_free(conn);
-}
-
 static inline void conn_failed(int index, bdaddr_t *bdaddr, uint8_t status)
 {
 	struct dev_info *dev = &devs[index];
@@ -2052,7 +2510,7 @@ static inline void conn_failed(int index, bdaddr_t *bdaddr, uint8_t status)
 
 	bonding_complete(dev, conn, status);
 
-	dev->connections = g_slist_remove(dev->connections, conn);
+	conn_remove(dev, conn);
 	conn_free(conn);
 
 	btd_event_conn_failed(&dev->bdaddr, bdaddr, status);
@@ -2077,7 +2535,7 @@ static inline void conn_complete(int index, void *ptr)
 	}
 
 	conn = get_connection(dev, &evt->bdaddr);
-	conn->handle = btohs(evt->handle);
+	conn_set_handle(dev, conn, btohs(evt->handle));
 
 	btd_event_conn_complete(&dev->bdaddr, &evt->bdaddr);
 
@@ -2113,7 +2571,7 @@ static inline void le_conn_complete(int index, void *ptr)
 	}
 
 	conn = get_connection(dev, &evt->peer_bdaddr);
-	conn->handle = btohs(evt->handle);
+	conn_set_handle(dev, conn, btohs(evt->handle));
 
 	btd_event_conn_complete(&dev->bdaddr, &evt->peer_bdaddr);
 
@@ -2146,7 +2604,7 @@ static inline void disconn_complete(int index, void *ptr)
 	if (conn == NULL)
 		return;
 
-	dev->connections = g_slist_remove(dev->connections, conn);
+	conn_remove(dev, conn);
 
 	btd_event_disconn_complete(&dev->bdaddr, &conn->bdaddr);
 
@@ -2192,33 +2650,36 @@ static inline void conn_request(int index, void *ptr)
 static inline void le_advertising_report(int index, evt_le_meta_event *meta)
 {
 	struct dev_info *dev = &devs[index];
+	struct btd_found_info found[LE_ADV_MAX_REPORTS];
+	/* Advertising data is shorter than the EIR the storage expects */
+	uint8_t eir[LE_ADV_MAX_REPORTS][HCI_MAX_EIR_LENGTH];
 	le_advertising_info *info;
-	uint8_t num_reports, rssi, eir[HCI_MAX_EIR_LENGTH];
+	uint8_t num_reports;
+	int8_t rssi;
+	int i, count = 0;
 	const uint8_t RSSI_SIZE = 1;
 
-	num_reports = meta->data[0];
-
-	info = (le_advertising_info *) &meta->data[1];
-	rssi = *(info->data + info->length);
+	dev->stats_le_reports += meta->data[0];
 
-	memset(eir, 0, sizeof(eir));
-	memcpy(eir, info->data, info->length);
+	num_reports = MIN(meta->data[0], LE_ADV_MAX_REPORTS);
 
-	btd_event_device_found(&dev->bdaddr, &info->bdaddr, 0, rssi, eir);
+	info = (le_advertising_info *) &meta->data[1];
 
-	num_reports--;
+	for (i = 0; i < num_reports; i++) {
+		if (i > 0)
+			info = (le_advertising_info *) (info->data +
+						info->length + RSSI_SIZE);
 
-	while (num_reports--) {
-		info = (le_advertising_info *) (info->data + info->length +
-								RSSI_SIZE);
 		rssi = *(info->data + info->length);
 
-		memset(eir, 0, sizeof(eir));
-		memcpy(eir, info->data, info->length);
+		memset(eir[count], 0, sizeof(eir[count]));
+		memcpy(eir[count], info->data, info->length);
 
-		btd_event_device_found(&dev->bdaddr, &info->bdaddr, 0, rssi,
-									eir);
+		found_add(dev, found, &count, &info->bdaddr, 0, rssi,
+								eir[count]);
 	}
+
+	btd_event_devices_found(&dev->bdaddr, found, count);
 }
 
 static inline void le_metaevent(int index, void *ptr)
@@ -2253,67 +2714,47 @@ static void stop_hci_dev(int index)
 	if (dev->stop_scan_id > 0)
 		g_source_remove(dev->stop_scan_id);
 
+	if (dev->eir_id > 0) {
+		g_source_remove(dev->eir_id);
+		dev->eir_id = 0;
+	}
+
+	cmd_queue_clear(dev);
+
 	if (dev->io != NULL)
 		g_io_channel_unref(dev->io);
 
 	hci_close_dev(dev->sk);
 
-	g_slist_foreach(dev->keys, (GFunc) g_free, NULL);
-	g_slist_free(dev->keys);
+	if (dev->keys != NULL) {
+		g_hash_table_destroy(dev->keys);
+		dev->keys = NULL;
+	}
+
+	if (dev->cmd_stats != NULL)
+		g_hash_table_destroy(dev->cmd_stats);
+
+	if (dev->oob_data != NULL) {
+		g_hash_table_destroy(dev->oob_data);
+		dev->oob_data = NULL;
+	}
 
 	g_slist_foreach(dev->uuids, (GFunc) g_free, NULL);
 	g_slist_free(dev->uuids);
 
-	g_slist_foreach(dev->connections, (GFunc) conn_free, NULL);
-	g_slist_free(dev->connections);
+	if (dev->conn_addrs != NULL) {
+		g_hash_table_destroy(dev->conn_handles);
+		g_hash_table_destroy(dev->conn_addrs);
+	}
 
 	init_dev_info(index, -1, dev->registered, dev->already_up);
 }
 
-static gboolean io_security_event(GIOChannel *chan, GIOCondition cond,
-								gpointer data)
+static void process_event(int index, uint8_t evt, uint8_t plen, void *ptr)
 {
-	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr = buf;
-	int type, index = GPOINTER_TO_INT(data);
-	struct dev_info *dev = &devs[index];
-	struct hci_dev_info di;
-	ssize_t len;
-	hci_event_hdr *eh;
-	evt_cmd_status *evt;
-	int fd;
+	evt_cmd_status *status;
 
-	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR)) {
-		stop_hci_dev(index);
-		return FALSE;
-	}
-
-	fd = g_io_channel_unix_get_fd(chan);
-
-	len = read(fd, buf, sizeof(buf));
-	if (len < 0) {
-		if (errno == EAGAIN)
-			return TRUE;
-		stop_hci_dev(index);
-		return FALSE;
-	}
-
-	type = *ptr++;
-
-	if (type != HCI_EVENT_PKT)
-		return TRUE;
-
-	eh = (hci_event_hdr *) ptr;
-	ptr += HCI_EVENT_HDR_SIZE;
-
-	memset(&di, 0, sizeof(di));
-	if (hci_devinfo(index, &di) == 0) {
-		bacpy(&dev->bdaddr, &di.bdaddr);
-
-		if (ignore_device(&di))
-			return TRUE;
-	}
-
-	switch (eh->evt) {
+	switch (evt) {
 	case EVT_CMD_STATUS:
 		cmd_status(index, ptr);
 		break;
@@ -2339,20 +2780,20 @@ static gboolean io_security_event(GIOChannel *chan, GIOCondition cond,
 		break;
 
 	case EVT_INQUIRY_COMPLETE:
-		evt = (evt_cmd_status *) ptr;
-		inquiry_complete_evt(index, evt->status);
+		status = (evt_cmd_status *) ptr;
+		inquiry_complete_evt(index, status->status);
 		break;
 
 	case EVT_INQUIRY_RESULT:
-		inquiry_result(index, eh->plen, ptr);
+		inquiry_result(index, plen, ptr);
 		break;
 
 	case EVT_INQUIRY_RESULT_WITH_RSSI:
-		inquiry_result_with_rssi(index, eh->plen, ptr);
+		inquiry_result_with_rssi(index, plen, ptr);
 		break;
 
 	case EVT_EXTENDED_INQUIRY_RESULT:
-		extended_inquiry_result(index, eh->plen, ptr);
+		extended_inquiry_result(index, plen, ptr);
 		break;
 
 	case EVT_CONN_COMPLETE:
@@ -2418,6 +2859,66 @@ static gboolean io_security_event(GIOChannel *chan, GIOCondition cond,
 		break;
 	}
 
+}
+
+static gboolean io_security_event(GIOChannel *chan, GIOCondition cond,
+								gpointer data)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	int index = GPOINTER_TO_INT(data);
+	struct dev_info *dev = &devs[index];
+	struct hci_dev_info di;
+	hci_event_hdr *eh;
+	ssize_t len;
+	int fd, count;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR)) {
+		stop_hci_dev(index);
+		return FALSE;
+	}
+
+	fd = g_io_channel_unix_get_fd(chan);
+
+	memset(&di, 0, sizeof(di));
+	if (hci_devinfo(index, &di) == 0) {
+		bacpy(&dev->bdaddr, &di.bdaddr);
+
+		if (ignore_device(&di)) {
+			/* Still drain the socket */
+			while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+			return TRUE;
+		}
+	}
+
+	/* Handle whatever is queued in one go, bounded so that a busy
+	 * controller can't keep the main loop from running other sources */
+	for (count = 0; count < HCI_EVENT_BATCH; count++) {
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			stop_hci_dev(index);
+			return FALSE;
+		}
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+			continue;
+
+		eh = (hci_event_hdr *) (buf + 1);
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE + eh->plen)
+			continue;
+
+		dev->stats_events[eh->evt]++;
+
+		process_event(index, eh->evt, eh->plen,
+					buf + 1 + HCI_EVENT_HDR_SIZE);
+
+		/* The device went away while handling the event */
+		if (dev->sk < 0 || dev->io != chan)
+			return FALSE;
+	}
+
 	return TRUE;
 }
 
@@ -2469,6 +2970,8 @@ static void start_hci_dev(int index)
 		return;
 	}
 
+	dev->stats_since = time(NULL);
+
 	chan = g_io_channel_unix_new(dev->sk);
 	cond = G_IO_IN | G_IO_NVAL | G_IO_HUP | G_IO_ERR;
 	dev->watch_id = g_io_add_watch_full(chan, G_PRIORITY_LOW, cond,
@@ -2521,21 +3024,31 @@ static void device_devup_setup(int index)
 	if (ignore_device(&di))
 		return;
 
+	if (!timerisset(&dev->up_time))
+		gettimeofday(&dev->up_time, NULL);
+
+	/* The kernel keeps these two around, no need to wait for them */
 	bacpy(&dev->bdaddr, &di.bdaddr);
 	memcpy(dev->features, di.features, 8);
+	hci_clear_bit(PENDING_BDADDR, &dev->pending);
+	hci_clear_bit(PENDING_FEATURES, &dev->pending);
+
+	/* Whatever of the kernel's own init we missed is asked for
+	 * again, ahead of the commands below */
+	send_pending_reads(index);
 
 	/* Set page timeout */
 	if ((main_opts.flags & (1 << HCID_SET_PAGETO))) {
 		write_page_timeout_cp cp;
 
 		cp.timeout = htobs(main_opts.pageto);
-		hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_PAGE_TIMEOUT,
+		send_cmd(dev, OGF_HOST_CTL, OCF_WRITE_PAGE_TIMEOUT,
 					WRITE_PAGE_TIMEOUT_CP_SIZE, &cp);
 	}
 
 	bacpy(&cp.bdaddr, BDADDR_ANY);
 	cp.read_all = 1;
-	hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_READ_STORED_LINK_KEY,
+	send_cmd(dev, OGF_HOST_CTL, OCF_READ_STORED_LINK_KEY,
 					READ_STORED_LINK_KEY_CP_SIZE, &cp);
 
 	if (!dev->pending)
@@ -2581,6 +3094,8 @@ static struct dev_info *init_device(int index, gboolean already_up)
 	if (already_up)
 		return dev;
 
+	gettimeofday(&dev->up_time, NULL);
+
 	/* Do initialization in the separate process */
 	pid = fork();
 	switch (pid) {
@@ -2647,7 +3162,7 @@ static void init_conn_list(int index)
 			continue;
 
 		conn = get_connection(dev, &ci->bdaddr);
-		conn->handle = ci->handle;
+		conn_set_handle(dev, conn, ci->handle);
 	}
 
 failed:
@@ -2678,8 +3193,15 @@ static void device_event(int event, int index)
 	case HCI_DEV_DOWN:
 		info("HCI dev %d down", index);
 		devs[index].up = FALSE;
+		timerclear(&devs[index].up_time);
 		devs[index].pending_cod = 0;
 		devs[index].cache_enable = TRUE;
+
+		/* Nothing queued for the controller applies once it is back
+		 * up, which starts again with a single command credit */
+		cmd_queue_clear(&devs[index]);
+		devs[index].cmd_credits = 1;
+
 		if (!devs[index].pending) {
 			struct btd_adapter *adapter;
 
@@ -2737,8 +3259,7 @@ static gboolean init_known_adapters(gpointer user_data)
 
 		dev->pending = 0;
 		hci_set_bit(PENDING_VERSION, &dev->pending);
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
-					OCF_READ_LOCAL_VERSION, 0, NULL);
+		hci_set_bit(PENDING_NAME, &dev->pending);
 		device_event(HCI_DEV_UP, dr->dev_id);
 	}
 
@@ -2902,6 +3423,8 @@ static int hciops_set_powered(int index, gboolean powered)
 	if (powered == FALSE)
 		return hciops_power_off(index);
 
+	gettimeofday(&dev->up_time, NULL);
+
 	if (ioctl(dev->sk, HCIDEVUP, index) == 0)
 		return 0;
 
@@ -2909,6 +3432,7 @@ static int hciops_set_powered(int index, gboolean powered)
 		return 0;
 
 	err = -errno;
+	timerclear(&dev->up_time);
 	error("Can't init device hci%d: %s (%d)",
 					index, strerror(-err), -err);
 
@@ -2954,7 +3478,7 @@ static int hciops_start_inquiry(int index, uint8_t length)
 	inq_cp.length = length;
 	inq_cp.num_rsp = 0x00;
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL,
+	if (send_cmd(dev, OGF_LINK_CTL,
 			OCF_INQUIRY, INQUIRY_CP_SIZE, &inq_cp) < 0)
 		return -errno;
 
@@ -2970,9 +3494,9 @@ static int le_set_scan_enable(int index, uint8_t enable)
 
 	memset(&cp, 0, sizeof(cp));
 	cp.enable = enable;
-	cp.filter_dup = 0;
+	cp.filter_dup = enable ? dev->discov_params.filter_duplicates : 0;
 
-	if (hci_send_cmd(dev->sk, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+	if (send_cmd(dev, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
 				LE_SET_SCAN_ENABLE_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -3003,14 +3527,13 @@ static int hciops_start_scanning(int index, int timeout)
 
 	memset(&cp, 0, sizeof(cp));
 	cp.type = 0x01;			/* Active scanning */
-	/* The recommended value for scan interval and window is 11.25 msec.
-	 * It is calculated by: time = n * 0.625 msec */
-	cp.interval = htobs(0x0012);
-	cp.window = htobs(0x0012);
+	/* Interval and window are in units of 0.625 msec */
+	cp.interval = htobs(dev->discov_params.scan_interval);
+	cp.window = htobs(dev->discov_params.scan_window);
 	cp.own_bdaddr_type = 0;		/* Public address */
 	cp.filter = 0;			/* Accept all adv packets */
 
-	if (hci_send_cmd(dev->sk, OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS,
+	if (send_cmd(dev, OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS,
 				LE_SET_SCAN_PARAMETERS_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -3051,7 +3574,7 @@ static int hciops_resolve_name(int index, bdaddr_t *bdaddr)
 	bacpy(&cp.bdaddr, bdaddr);
 	cp.pscan_rep_mode = 0x02;
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ,
+	if (send_cmd(dev, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ,
 					REMOTE_NAME_REQ_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -3068,12 +3591,12 @@ static int hciops_set_name(int index, const char *name)
 	memset(&cp, 0, sizeof(cp));
 	strncpy((char *) cp.name, name, sizeof(cp.name));
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME,
 				CHANGE_LOCAL_NAME_CP_SIZE, &cp) < 0)
 		return -errno;
 
 	memcpy(dev->name, cp.name, 248);
-	update_ext_inquiry_response(index);
+	eir_changed(index);
 
 	return 0;
 }
@@ -3090,27 +3613,50 @@ static int hciops_cancel_resolve_name(int index, bdaddr_t *bdaddr)
 	memset(&cp, 0, sizeof(cp));
 	bacpy(&cp.bdaddr, bdaddr);
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL,
+	if (send_cmd(dev, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL,
 				REMOTE_NAME_REQ_CANCEL_CP_SIZE, &cp) < 0)
 		return -errno;
 
 	return 0;
 }
 
-static int hciops_start_discovery(int index)
+static int hciops_start_discovery(int index,
+				const struct discovery_params *params)
 {
+	struct dev_info *dev = &devs[index];
 	int adapter_type = get_adapter_type(index);
+	uint8_t transport = params->transport;
 
 	switch (adapter_type) {
 	case BR_EDR_LE:
-		return hciops_start_inquiry(index, LENGTH_BR_LE_INQ);
+		break;
 	case BR_EDR:
-		return hciops_start_inquiry(index, LENGTH_BR_INQ);
+		transport &= DISCOVERY_BREDR;
+		break;
 	case LE_ONLY:
-		return hciops_start_scanning(index, TIMEOUT_LE_SCAN);
+		transport &= DISCOVERY_LE;
+		break;
 	default:
 		return -EINVAL;
 	}
+
+	/* Nothing the filter asks for is supported, the results get
+	 * filtered out anyway so just use what there is */
+	if (transport == 0)
+		transport = adapter_type == LE_ONLY ? DISCOVERY_LE :
+							DISCOVERY_BREDR;
+
+	dev->discov_params = *params;
+	dev->discov_params.transport = transport;
+
+	switch (transport) {
+	case DISCOVERY_BREDR | DISCOVERY_LE:
+		return hciops_start_inquiry(index, params->inquiry_length);
+	case DISCOVERY_BREDR:
+		return hciops_start_inquiry(index, LENGTH_BR_INQ);
+	default:
+		return hciops_start_scanning(index, TIMEOUT_LE_SCAN);
+	}
 }
 
 static int hciops_stop_discovery(int index)
@@ -3147,10 +3693,10 @@ static int hciops_fast_connectable(int index, gboolean enable)
 
 	cp.window = 0x0012;	/* default 11.25 msec page scan window */
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_PAGE_ACTIVITY,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_WRITE_PAGE_ACTIVITY,
 					WRITE_PAGE_ACTIVITY_CP_SIZE, &cp) < 0)
 		return -errno;
-	else if (hci_send_cmd(dev->sk, OGF_HOST_CTL,
+	else if (send_cmd(dev, OGF_HOST_CTL,
 				OCF_WRITE_PAGE_SCAN_TYPE, 1, &type) < 0)
 		return -errno;
 
@@ -3222,14 +3768,19 @@ static int hciops_unblock_device(int index, bdaddr_t *bdaddr)
 static int hciops_get_conn_list(int index, GSList **conns)
 {
 	struct dev_info *dev = &devs[index];
-	GSList *l;
+	GHashTableIter iter;
+	gpointer value;
 
 	DBG("hci%d", index);
 
 	*conns = NULL;
 
-	for (l = dev->connections; l != NULL; l = g_slist_next(l)) {
-		struct bt_conn *conn = l->data;
+	if (dev->conn_addrs == NULL)
+		return 0;
+
+	g_hash_table_iter_init(&iter, dev->conn_addrs);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct bt_conn *conn = value;
 
 		*conns = g_slist_append(*conns,
 				g_memdup(&conn->bdaddr, sizeof(bdaddr_t)));
@@ -3260,23 +3811,19 @@ static int hciops_remove_bonding(int index, bdaddr_t *bdaddr)
 {
 	struct dev_info *dev = &devs[index];
 	delete_stored_link_key_cp cp;
-	GSList *match;
 	char addr[18];
 
 	ba2str(bdaddr, addr);
 	DBG("hci%d dba %s", index, addr);
 
-	match = g_slist_find_custom(dev->keys, bdaddr, (GCompareFunc) bacmp);
-	if (match) {
-		g_free(match->data);
-		dev->keys = g_slist_delete_link(dev->keys, match);
-	}
+	if (dev->keys != NULL)
+		g_hash_table_remove(dev->keys, bdaddr);
 
 	memset(&cp, 0, sizeof(cp));
 	bacpy(&cp.bdaddr, bdaddr);
 
 	/* Delete the link key from the Bluetooth chip */
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_DELETE_STORED_LINK_KEY,
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_DELETE_STORED_LINK_KEY,
 				DELETE_STORED_LINK_KEY_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -3302,11 +3849,11 @@ static int hciops_pincode_reply(int index, bdaddr_t *bdaddr, const char *pin,
 		bacpy(&pr.bdaddr, bdaddr);
 		memcpy(pr.pin_code, pin, pin_len);
 		pr.pin_len = pin_len;
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = send_cmd(dev, OGF_LINK_CTL,
 						OCF_PIN_CODE_REPLY,
 						PIN_CODE_REPLY_CP_SIZE, &pr);
 	} else
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = send_cmd(dev, OGF_LINK_CTL,
 					OCF_PIN_CODE_NEG_REPLY, 6, bdaddr);
 
 	if (err < 0)
@@ -3331,11 +3878,11 @@ static int hciops_passkey_reply(int index, bdaddr_t *bdaddr, uint32_t passkey)
 		bacpy(&cp.bdaddr, bdaddr);
 		cp.passkey = passkey;
 
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = send_cmd(dev, OGF_LINK_CTL,
 					OCF_USER_PASSKEY_REPLY,
 					USER_PASSKEY_REPLY_CP_SIZE, &cp);
 	} else
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = send_cmd(dev, OGF_LINK_CTL,
 					OCF_USER_PASSKEY_NEG_REPLY, 6, bdaddr);
 
 	if (err < 0)
@@ -3357,7 +3904,7 @@ static int hciops_enable_le(int index)
 	cp.le = 0x01;
 	cp.simul = (dev->features[6] & LMP_LE_BREDR) ? 0x01 : 0x00;
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL,
+	if (send_cmd(dev, OGF_HOST_CTL,
 				OCF_WRITE_LE_HOST_SUPPORTED,
 				WRITE_LE_HOST_SUPPORTED_CP_SIZE, &cp) < 0)
 		return -errno;
@@ -3428,6 +3975,7 @@ static int hciops_add_uuid(int index, uuid_t *uuid, uint8_t svc_hint)
 	info->svc_hint = svc_hint;
 
 	dev->uuids = g_slist_append(dev->uuids, info);
+	dev->eir_dirty = TRUE;
 
 	return update_service_classes(index);
 }
@@ -3441,6 +3989,7 @@ static int hciops_remove_uuid(int index, uuid_t *uuid)
 	if (match) {
 		g_free(match->data);
 		dev->uuids = g_slist_delete_link(dev->uuids, match);
+		dev->eir_dirty = TRUE;
 	}
 
 	DBG("hci%d", index);
@@ -3472,6 +4021,20 @@ static int hciops_disable_cod_cache(int index)
 	return write_class(index, dev->wanted_cod);
 }
 
+static int hciops_enable_cod_cache(int index)
+{
+	struct dev_info *dev = &devs[index];
+
+	DBG("hci%d cache_enable %d", index, dev->cache_enable);
+
+	if (dev->cache_enable)
+		return -EALREADY;
+
+	dev->cache_enable = TRUE;
+
+	return 0;
+}
+
 static int hciops_restore_powered(int index)
 {
 	struct dev_info *dev = &devs[index];
@@ -3485,6 +4048,7 @@ static int hciops_restore_powered(int index)
 static int hciops_load_keys(int index, GSList *keys, gboolean debug_keys)
 {
 	struct dev_info *dev = &devs[index];
+	GSList *l;
 
 	DBG("hci%d keys %d debug_keys %d", index, g_slist_length(keys),
 								debug_keys);
@@ -3492,7 +4056,19 @@ static int hciops_load_keys(int index, GSList *keys, gboolean debug_keys)
 	if (dev->keys != NULL)
 		return -EEXIST;
 
-	dev->keys = keys;
+	/* Keyed by address so link key requests are answered without
+	 * walking all the bonded devices */
+	dev->keys = g_hash_table_new_full(bt_bdaddr_hash, bt_bdaddr_equal,
+								NULL, g_free);
+
+	for (l = keys; l; l = l->next) {
+		struct link_key_info *info = l->data;
+
+		g_hash_table_replace(dev->keys, &info->bdaddr, info);
+	}
+
+	g_slist_free(keys);
+
 	dev->debug_keys = debug_keys;
 
 	return 0;
@@ -3523,7 +4099,7 @@ static int request_authentication(int index, bdaddr_t *bdaddr)
 	memset(&cp, 0, sizeof(cp));
 	cp.handle = htobs(handle);
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_AUTH_REQUESTED,
+	if (send_cmd(dev, OGF_LINK_CTL, OCF_AUTH_REQUESTED,
 					AUTH_REQUESTED_CP_SIZE, &cp) < 0)
 		return -errno;
 
@@ -3617,7 +4193,7 @@ static int hciops_read_local_oob_data(int index)
 
 	DBG("hci%d", index);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_READ_LOCAL_OOB_DATA, 0, 0)
+	if (send_cmd(dev, OGF_HOST_CTL, OCF_READ_LOCAL_OOB_DATA, 0, 0)
 									< 0)
 		return -errno;
 
@@ -3629,24 +4205,27 @@ static int hciops_add_remote_oob_data(int index, bdaddr_t *bdaddr,
 {
 	char addr[18];
 	struct dev_info *dev = &devs[index];
-	GSList *match;
 	struct oob_data *data;
 
 	ba2str(bdaddr, addr);
 	DBG("hci%d bdaddr %s", index, addr);
 
-	match = g_slist_find_custom(dev->oob_data, &bdaddr, oob_bdaddr_cmp);
+	if (dev->oob_data == NULL)
+		dev->oob_data = g_hash_table_new_full(bt_bdaddr_hash,
+						bt_bdaddr_equal, NULL, g_free);
+	else
+		sweep_oob_data(dev);
 
-	if (match) {
-		data = match->data;
-	} else {
+	data = g_hash_table_lookup(dev->oob_data, bdaddr);
+	if (data == NULL) {
 		data = g_new(struct oob_data, 1);
 		bacpy(&data->bdaddr, bdaddr);
-		dev->oob_data = g_slist_prepend(dev->oob_data, data);
+		g_hash_table_insert(dev->oob_data, &data->bdaddr, data);
 	}
 
 	memcpy(data->hash, hash, sizeof(data->hash));
 	memcpy(data->randomizer, randomizer, sizeof(data->randomizer));
+	data->expires = time(NULL) + OOB_DATA_LIFETIME;
 
 	return 0;
 }
@@ -3655,18 +4234,14 @@ static int hciops_remove_remote_oob_data(int index, bdaddr_t *bdaddr)
 {
 	char addr[18];
 	struct dev_info *dev = &devs[index];
-	GSList *match;
 
 	ba2str(bdaddr, addr);
 	DBG("hci%d bdaddr %s", index, addr);
 
-	match = g_slist_find_custom(dev->oob_data, &bdaddr, oob_bdaddr_cmp);
-
-	if (!match)
+	if (find_oob_data(dev, bdaddr) == NULL)
 		return -ENOENT;
 
-	g_free(match->data);
-	dev->oob_data = g_slist_delete_link(dev->oob_data, match);
+	g_hash_table_remove(dev->oob_data, bdaddr);
 
 	return 0;
 }
@@ -3701,6 +4276,62 @@ static int hciops_retry_authentication(int index, bdaddr_t *bdaddr)
 	return request_authentication(index, bdaddr);
 }
 
+static int hciops_get_conn_stats(int index, bdaddr_t *bdaddr,
+					struct btd_conn_stats *stats)
+{
+	struct dev_info *dev = &devs[index];
+	struct bt_conn *conn;
+
+	conn = find_connection(dev, bdaddr);
+	if (conn == NULL)
+		return -ENOTCONN;
+
+	*stats = conn->stats;
+
+	return 0;
+}
+
+static void copy_cmd_stats(gpointer key, gpointer value, gpointer user_data)
+{
+	struct cmd_latency *lat = value;
+	GSList **cmds = user_data;
+
+	if (lat->stats.count == 0)
+		return;
+
+	*cmds = g_slist_prepend(*cmds, g_memdup(&lat->stats,
+						sizeof(lat->stats)));
+}
+
+static int hciops_get_hci_stats(int index, struct btd_hci_stats *stats)
+{
+	struct dev_info *dev = &devs[index];
+	struct hci_dev_info di;
+
+	DBG("hci%d", index);
+
+	if (dev->sk < 0)
+		return -ENODEV;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->seconds = time(NULL) - dev->stats_since;
+	memcpy(stats->events, dev->stats_events, sizeof(stats->events));
+	stats->le_reports = dev->stats_le_reports;
+	stats->commands = dev->stats_commands;
+
+	if (hci_devinfo(index, &di) == 0) {
+		stats->acl_pkts = di.acl_pkts;
+		stats->kernel = di.stat;
+	}
+
+	if (dev->cmd_stats != NULL)
+		g_hash_table_foreach(dev->cmd_stats, copy_cmd_stats,
+							&stats->cmds);
+
+	return 0;
+}
+
 static struct btd_adapter_ops hci_ops = {
 	.setup = hciops_setup,
 	.cleanup = hciops_cleanup,
@@ -3732,6 +4363,7 @@ static struct btd_adapter_ops hci_ops = {
 	.add_uuid = hciops_add_uuid,
 	.remove_uuid = hciops_remove_uuid,
 	.disable_cod_cache = hciops_disable_cod_cache,
+	.enable_cod_cache = hciops_enable_cod_cache,
 	.restore_powered = hciops_restore_powered,
 	.load_keys = hciops_load_keys,
 	.set_io_capability = hciops_set_io_capability,
@@ -3742,6 +4374,8 @@ static struct btd_adapter_ops hci_ops = {
 	.remove_remote_oob_data = hciops_remove_remote_oob_data,
 	.set_link_timeout = hciops_set_link_timeout,
 	.retry_authentication = hciops_retry_authentication,
+	.get_conn_stats = hciops_get_conn_stats,
+	.get_hci_stats = hciops_get_hci_stats,
 };
 
 static int hciops_init(void)
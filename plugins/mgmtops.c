@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
@@ -51,6 +52,9 @@
 
 #define MGMT_BUF_SIZE 1024
 
+/* Events handled per socket wakeup before going back to the main loop */
+#define MGMT_MAX_EVENTS 32
+
 static int max_index = -1;
 static struct controller_info {
 	gboolean valid;
@@ -68,8 +72,19 @@ static struct controller_info {
 	gboolean pairable;
 	uint8_t sec_mode;
 	GSList *connections;
+	/* UUIDs the kernel has been given, so that adding or removing
+	 * one it already agrees on doesn't cost a command */
+	GSList *uuids;
+	/* RSSI threshold of the running discovery, if any */
+	gboolean has_rssi;
+	int8_t rssi;
 } *controllers = NULL;
 
+struct controller_uuid {
+	uint8_t uuid[16];
+	uint8_t svc_hint;
+};
+
 static int mgmt_sock = -1;
 static guint mgmt_watch = 0;
 
@@ -156,6 +171,9 @@ static void remove_controller(uint16_t index)
 
 	btd_manager_unregister_adapter(index);
 
+	g_slist_foreach(controllers[index].uuids, (GFunc) g_free, NULL);
+	g_slist_free(controllers[index].uuids);
+
 	memset(&controllers[index], 0, sizeof(struct controller_info));
 
 	DBG("Removed controller %u", index);
@@ -674,53 +692,80 @@ static void uuid_to_uuid128(uuid_t *uuid128, const uuid_t *uuid)
 		memcpy(uuid128, uuid, sizeof(*uuid));
 }
 
+static struct controller_uuid *find_uuid(struct controller_info *info,
+							const uint8_t *uuid)
+{
+	GSList *l;
+
+	for (l = info->uuids; l != NULL; l = g_slist_next(l)) {
+		struct controller_uuid *u = l->data;
+
+		if (memcmp(u->uuid, uuid, 16) == 0)
+			return u;
+	}
+
+	return NULL;
+}
+
+static void uuid_to_mgmt(uint8_t *dst, const uuid_t *uuid)
+{
+	uuid_t uuid128;
+	uint128_t uint128;
+
+	uuid_to_uuid128(&uuid128, uuid);
+
+	ntoh128((uint128_t *) uuid128.value.uuid128.data, &uint128);
+	htob128(&uint128, (uint128_t *) dst);
+}
+
 static int mgmt_add_uuid(int index, uuid_t *uuid, uint8_t svc_hint)
 {
 	char buf[MGMT_HDR_SIZE + sizeof(struct mgmt_cp_add_uuid)];
 	struct mgmt_hdr *hdr = (void *) buf;
 	struct mgmt_cp_add_uuid *cp = (void *) &buf[sizeof(*hdr)];
-	uuid_t uuid128;
-	uint128_t uint128;
+	struct controller_info *info = &controllers[index];
+	struct controller_uuid *u;
 
 	DBG("index %d", index);
 
-	uuid_to_uuid128(&uuid128, uuid);
-
 	memset(buf, 0, sizeof(buf));
 	hdr->opcode = htobs(MGMT_OP_ADD_UUID);
 	hdr->len = htobs(sizeof(*cp));
 	hdr->index = htobs(index);
 
-	ntoh128((uint128_t *) uuid128.value.uuid128.data, &uint128);
-	htob128(&uint128, (uint128_t *) cp->uuid);
-
+	uuid_to_mgmt(cp->uuid, uuid);
 	cp->svc_hint = svc_hint;
 
+	u = find_uuid(info, cp->uuid);
+	if (u != NULL && u->svc_hint == svc_hint)
+		return 0;
+
 	if (write(mgmt_sock, buf, sizeof(buf)) < 0)
 		return -errno;
 
+	if (u == NULL) {
+		u = g_new0(struct controller_uuid, 1);
+		memcpy(u->uuid, cp->uuid, 16);
+		info->uuids = g_slist_append(info->uuids, u);
+	}
+
+	u->svc_hint = svc_hint;
+
 	return 0;
 }
 
-static int mgmt_remove_uuid(int index, uuid_t *uuid)
+static int remove_uuid(int index, const uint8_t *uuid)
 {
 	char buf[MGMT_HDR_SIZE + sizeof(struct mgmt_cp_remove_uuid)];
 	struct mgmt_hdr *hdr = (void *) buf;
 	struct mgmt_cp_remove_uuid *cp = (void *) &buf[sizeof(*hdr)];
-	uuid_t uuid128;
-	uint128_t uint128;
-
-	DBG("index %d", index);
-
-	uuid_to_uuid128(&uuid128, uuid);
 
 	memset(buf, 0, sizeof(buf));
 	hdr->opcode = htobs(MGMT_OP_REMOVE_UUID);
 	hdr->len = htobs(sizeof(*cp));
 	hdr->index = htobs(index);
 
-	ntoh128((uint128_t *) uuid128.value.uuid128.data, &uint128);
-	htob128(&uint128, (uint128_t *) cp->uuid);
+	memcpy(cp->uuid, uuid, 16);
 
 	if (write(mgmt_sock, buf, sizeof(buf)) < 0)
 		return -errno;
@@ -728,14 +773,45 @@ static int mgmt_remove_uuid(int index, uuid_t *uuid)
 	return 0;
 }
 
+static int mgmt_remove_uuid(int index, uuid_t *uuid)
+{
+	struct controller_info *info = &controllers[index];
+	struct controller_uuid *u;
+	uint8_t uuid128[16];
+	int err;
+
+	DBG("index %d", index);
+
+	uuid_to_mgmt(uuid128, uuid);
+
+	u = find_uuid(info, uuid128);
+	if (u == NULL)
+		return 0;
+
+	err = remove_uuid(index, uuid128);
+	if (err < 0)
+		return err;
+
+	info->uuids = g_slist_remove(info->uuids, u);
+	g_free(u);
+
+	return 0;
+}
+
+/* Whatever a previous run left in the kernel is unknown, so the list
+ * starts from a single remove of the all zero UUID, which clears it */
 static int clear_uuids(int index)
 {
-	uuid_t uuid_any;
+	struct controller_info *info = &controllers[index];
+	uint8_t uuid_any[16];
 
-	memset(&uuid_any, 0, sizeof(uuid_any));
-	uuid_any.type = SDP_UUID128;
+	g_slist_foreach(info->uuids, (GFunc) g_free, NULL);
+	g_slist_free(info->uuids);
+	info->uuids = NULL;
 
-	return mgmt_remove_uuid(index, &uuid_any);
+	memset(uuid_any, 0, sizeof(uuid_any));
+
+	return remove_uuid(index, uuid_any);
 }
 
 static void read_index_list_complete(int sk, void *buf, size_t len)
@@ -1319,6 +1395,11 @@ static void mgmt_device_found(int sk, uint16_t index, void *buf, size_t len)
 	DBG("hci%u addr %s, class %u rssi %d %s", index, addr, cls,
 						ev->rssi, eir ? "eir" : "");
 
+	/* The kernel has no RSSI filter, so drop here what the adapter
+	 * would throw away anyway */
+	if (info->has_rssi && ev->rssi < info->rssi)
+		return;
+
 	btd_event_device_found(&info->bdaddr, &ev->bdaddr, cls, ev->rssi, eir);
 }
 
@@ -1379,38 +1460,16 @@ static void mgmt_discovering(int sk, uint16_t index, void *buf, size_t len)
 	adapter_set_state(adapter, state);
 }
 
-static gboolean mgmt_event(GIOChannel *io, GIOCondition cond, gpointer user_data)
+static void mgmt_process(int sk, char *buf, ssize_t ret)
 {
-	char buf[MGMT_BUF_SIZE];
 	struct mgmt_hdr *hdr = (void *) buf;
-	int sk;
-	ssize_t ret;
 	uint16_t len, opcode, index;
 
-	DBG("cond %d", cond);
-
-	if (cond & G_IO_NVAL)
-		return FALSE;
-
-	sk = g_io_channel_unix_get_fd(io);
-
-	if (cond & (G_IO_ERR | G_IO_HUP)) {
-		error("Error on management socket");
-		return FALSE;
-	}
-
-	ret = read(sk, buf, sizeof(buf));
-	if (ret < 0) {
-		error("Unable to read from management socket: %s (%d)",
-						strerror(errno), errno);
-		return TRUE;
-	}
-
 	DBG("Received %zd bytes from management socket", ret);
 
 	if (ret < MGMT_HDR_SIZE) {
 		error("Too small Management packet");
-		return TRUE;
+		return;
 	}
 
 	opcode = btohs(bt_get_unaligned(&hdr->opcode));
@@ -1419,7 +1478,7 @@ static gboolean mgmt_event(GIOChannel *io, GIOCondition cond, gpointer user_data
 
 	if (ret != MGMT_HDR_SIZE + len) {
 		error("Packet length mismatch. ret %zd len %u", ret, len);
-		return TRUE;
+		return;
 	}
 
 	switch (opcode) {
@@ -1487,6 +1546,44 @@ static gboolean mgmt_event(GIOChannel *io, GIOCondition cond, gpointer user_data
 		error("Unknown Management opcode %u (index %u)", opcode, index);
 		break;
 	}
+}
+
+static gboolean mgmt_event(GIOChannel *io, GIOCondition cond, gpointer user_data)
+{
+	char buf[MGMT_BUF_SIZE];
+	int sk, count;
+	ssize_t ret;
+
+	DBG("cond %d", cond);
+
+	if (cond & G_IO_NVAL)
+		return FALSE;
+
+	sk = g_io_channel_unix_get_fd(io);
+
+	if (cond & (G_IO_ERR | G_IO_HUP)) {
+		error("Error on management socket");
+		return FALSE;
+	}
+
+	/* The socket is non-blocking, so read whatever is already queued
+	 * instead of waiting for one wakeup per event */
+	for (count = 0; count < MGMT_MAX_EVENTS; count++) {
+		ret = read(sk, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			if (errno == EINTR)
+				continue;
+
+			error("Unable to read from management socket: %s (%d)",
+							strerror(errno), errno);
+			break;
+		}
+
+		mgmt_process(sk, buf, ret);
+	}
 
 	return TRUE;
 }
@@ -1513,6 +1610,11 @@ static int mgmt_setup(void)
 		goto fail;
 	}
 
+	if (fcntl(dd, F_SETFL, fcntl(dd, F_GETFL) | O_NONBLOCK) < 0) {
+		err = -errno;
+		goto fail;
+	}
+
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.opcode = htobs(MGMT_OP_READ_VERSION);
 	hdr.index = htobs(MGMT_INDEX_NONE);
@@ -1539,6 +1641,13 @@ fail:
 
 static void mgmt_cleanup(void)
 {
+	int i;
+
+	for (i = 0; i <= max_index; i++) {
+		g_slist_foreach(controllers[i].uuids, (GFunc) g_free, NULL);
+		g_slist_free(controllers[i].uuids);
+	}
+
 	g_free(controllers);
 	controllers = NULL;
 	max_index = -1;
@@ -1582,12 +1691,18 @@ static int mgmt_set_limited_discoverable(int index, gboolean limited)
 	return -ENOSYS;
 }
 
-static int mgmt_start_discovery(int index)
+/* The kernel runs the discovery cycle itself, the filters are only
+ * applied to the results */
+static int mgmt_start_discovery(int index,
+				const struct discovery_params *params)
 {
 	struct mgmt_hdr hdr;
 
 	DBG("index %d", index);
 
+	controllers[index].has_rssi = params->has_rssi;
+	controllers[index].rssi = params->rssi;
+
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.opcode = htobs(MGMT_OP_START_DISCOVERY);
 	hdr.index = htobs(index);
@@ -1604,6 +1719,8 @@ static int mgmt_stop_discovery(int index)
 
 	DBG("index %d", index);
 
+	controllers[index].has_rssi = FALSE;
+
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.opcode = htobs(MGMT_OP_STOP_DISCOVERY);
 	hdr.index = htobs(index);
@@ -1823,6 +1940,12 @@ static int mgmt_disable_cod_cache(int index)
 	return mgmt_set_mode(index, MGMT_OP_SET_SERVICE_CACHE, 0);
 }
 
+static int mgmt_enable_cod_cache(int index)
+{
+	DBG("index %d", index);
+	return mgmt_set_mode(index, MGMT_OP_SET_SERVICE_CACHE, 1);
+}
+
 static int mgmt_restore_powered(int index)
 {
 	DBG("index %d", index);
@@ -1849,8 +1972,6 @@ static int mgmt_load_keys(int index, GSList *keys, gboolean debug_keys)
 	if (buf == NULL)
 		return -ENOMEM;
 
-	memset(buf, 0, sizeof(buf));
-
 	hdr = (void *) buf;
 	hdr->opcode = htobs(MGMT_OP_LOAD_KEYS);
 	hdr->len = htobs(cp_size);
@@ -2032,6 +2153,7 @@ static struct btd_adapter_ops mgmt_ops = {
 	.add_uuid = mgmt_add_uuid,
 	.remove_uuid = mgmt_remove_uuid,
 	.disable_cod_cache = mgmt_disable_cod_cache,
+	.enable_cod_cache = mgmt_enable_cod_cache,
 	.restore_powered = mgmt_restore_powered,
 	.load_keys = mgmt_load_keys,
 	.set_io_capability = mgmt_set_io_capability,
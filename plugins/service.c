@@ -54,13 +54,6 @@ struct record_data {
 	struct service_adapter *serv_adapter;
 };
 
-struct context_data {
-	sdp_record_t *record;
-	sdp_data_t attr_data;
-	struct sdp_xml_data *stack_head;
-	uint16_t attr_id;
-};
-
 struct pending_auth {
 	DBusConnection *conn;
 	DBusMessage *msg;
@@ -77,198 +70,77 @@ struct service_adapter {
 
 static struct service_adapter *serv_adapter_any = NULL;
 
-static int compute_seq_size(sdp_data_t *data)
-{
-	int unit_size = data->unitSize;
-	sdp_data_t *seq = data->val.dataseq;
-
-	for (; seq; seq = seq->next)
-		unit_size += seq->unitSize;
-
-	return unit_size;
-}
-
 static void element_start(GMarkupParseContext *context,
 		const gchar *element_name, const gchar **attribute_names,
 		const gchar **attribute_values, gpointer user_data, GError **err)
 {
-	struct context_data *ctx_data = user_data;
-
-	if (!strcmp(element_name, "record"))
-		return;
-
-	if (!strcmp(element_name, "attribute")) {
-		int i;
-		for (i = 0; attribute_names[i]; i++) {
-			if (!strcmp(attribute_names[i], "id")) {
-				ctx_data->attr_id = strtol(attribute_values[i], 0, 0);
-				break;
-			}
-		}
-		DBG("New attribute 0x%04x", ctx_data->attr_id);
-		return;
-	}
-
-	if (ctx_data->stack_head) {
-		struct sdp_xml_data *newelem = sdp_xml_data_alloc();
-		newelem->next = ctx_data->stack_head;
-		ctx_data->stack_head = newelem;
-	} else {
-		ctx_data->stack_head = sdp_xml_data_alloc();
-		ctx_data->stack_head->next = NULL;
-	}
-
-	if (!strcmp(element_name, "sequence"))
-		ctx_data->stack_head->data = sdp_data_alloc(SDP_SEQ8, NULL);
-	else if (!strcmp(element_name, "alternate"))
-		ctx_data->stack_head->data = sdp_data_alloc(SDP_ALT8, NULL);
-	else {
-		int i;
-		/* Parse value, name, encoding */
-		for (i = 0; attribute_names[i]; i++) {
-			if (!strcmp(attribute_names[i], "value")) {
-				int curlen = strlen(ctx_data->stack_head->text);
-				int attrlen = strlen(attribute_values[i]);
-
-				/* Ensure we're big enough */
-				while ((curlen + 1 + attrlen) > ctx_data->stack_head->size) {
-					sdp_xml_data_expand(ctx_data->stack_head);
-				}
-
-				memcpy(ctx_data->stack_head->text + curlen,
-						attribute_values[i], attrlen);
-				ctx_data->stack_head->text[curlen + attrlen] = '\0';
-			}
-
-			if (!strcmp(attribute_names[i], "encoding")) {
-				if (!strcmp(attribute_values[i], "hex"))
-					ctx_data->stack_head->type = 1;
-			}
-
-			if (!strcmp(attribute_names[i], "name")) {
-				ctx_data->stack_head->name = strdup(attribute_values[i]);
-			}
-		}
-
-		ctx_data->stack_head->data = sdp_xml_parse_datatype(element_name,
-				ctx_data->stack_head, ctx_data->record);
-
-		if (ctx_data->stack_head->data == NULL)
-			error("Can't parse element %s", element_name);
-	}
+	struct sdp_xml_pdu *pdu = user_data;
+	int ret;
+
+	ret = sdp_xml_pdu_start(pdu, element_name, attribute_names,
+							attribute_values);
+	if (ret < 0)
+		g_set_error(err, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+				"Can't convert element %s: %s (%d)",
+				element_name, strerror(-ret), -ret);
 }
 
 static void element_end(GMarkupParseContext *context,
 		const gchar *element_name, gpointer user_data, GError **err)
 {
-	struct context_data *ctx_data = user_data;
-	struct sdp_xml_data *elem;
-
-	if (!strcmp(element_name, "record"))
-		return;
-
-	if (!strcmp(element_name, "attribute")) {
-		if (ctx_data->stack_head && ctx_data->stack_head->data) {
-			int ret = sdp_attr_add(ctx_data->record, ctx_data->attr_id,
-							ctx_data->stack_head->data);
-			if (ret == -1)
-				DBG("Could not add attribute 0x%04x",
-							ctx_data->attr_id);
-
-			ctx_data->stack_head->data = NULL;
-			sdp_xml_data_free(ctx_data->stack_head);
-			ctx_data->stack_head = NULL;
-		} else {
-			DBG("No data for attribute 0x%04x", ctx_data->attr_id);
-		}
-		return;
-	}
-
-	if (!strcmp(element_name, "sequence")) {
-		ctx_data->stack_head->data->unitSize = compute_seq_size(ctx_data->stack_head->data);
-
-		if (ctx_data->stack_head->data->unitSize > USHRT_MAX) {
-			ctx_data->stack_head->data->unitSize += sizeof(uint32_t);
-			ctx_data->stack_head->data->dtd = SDP_SEQ32;
-		} else if (ctx_data->stack_head->data->unitSize > UCHAR_MAX) {
-			ctx_data->stack_head->data->unitSize += sizeof(uint16_t);
-			ctx_data->stack_head->data->dtd = SDP_SEQ16;
-		} else {
-			ctx_data->stack_head->data->unitSize += sizeof(uint8_t);
-		}
-	} else if (!strcmp(element_name, "alternate")) {
-		ctx_data->stack_head->data->unitSize = compute_seq_size(ctx_data->stack_head->data);
-
-		if (ctx_data->stack_head->data->unitSize > USHRT_MAX) {
-			ctx_data->stack_head->data->unitSize += sizeof(uint32_t);
-			ctx_data->stack_head->data->dtd = SDP_ALT32;
-		} else if (ctx_data->stack_head->data->unitSize > UCHAR_MAX) {
-			ctx_data->stack_head->data->unitSize += sizeof(uint16_t);
-			ctx_data->stack_head->data->dtd = SDP_ALT16;
-		} else {
-			ctx_data->stack_head->data->unitSize += sizeof(uint8_t);
-		}
-	}
-
-	if (ctx_data->stack_head->next && ctx_data->stack_head->data &&
-					ctx_data->stack_head->next->data) {
-		switch (ctx_data->stack_head->next->data->dtd) {
-		case SDP_SEQ8:
-		case SDP_SEQ16:
-		case SDP_SEQ32:
-		case SDP_ALT8:
-		case SDP_ALT16:
-		case SDP_ALT32:
-			ctx_data->stack_head->next->data->val.dataseq =
-				sdp_seq_append(ctx_data->stack_head->next->data->val.dataseq,
-								ctx_data->stack_head->data);
-			ctx_data->stack_head->data = NULL;
-			break;
-		}
-
-		elem = ctx_data->stack_head;
-		ctx_data->stack_head = ctx_data->stack_head->next;
-
-		sdp_xml_data_free(elem);
-	}
+	struct sdp_xml_pdu *pdu = user_data;
+	int ret;
+
+	ret = sdp_xml_pdu_end(pdu, element_name);
+	if (ret < 0)
+		g_set_error(err, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+				"Can't convert element %s: %s (%d)",
+				element_name, strerror(-ret), -ret);
 }
 
 static GMarkupParser parser = {
 	element_start, element_end, NULL, NULL, NULL
 };
 
+/*
+ * The XML is converted to the record PDU in a single pass, which is then
+ * extracted like any received record.
+ */
 static sdp_record_t *sdp_xml_parse_record(const char *data, int size)
 {
 	GMarkupParseContext *ctx;
-	struct context_data *ctx_data;
+	struct sdp_xml_pdu pdu;
 	sdp_record_t *record;
+	int len, scanned;
 
-	ctx_data = malloc(sizeof(*ctx_data));
-	if (!ctx_data)
-		return NULL;
-
-	record = sdp_record_alloc();
-	if (!record) {
-		free(ctx_data);
+	if (sdp_xml_pdu_init(&pdu) < 0)
 		return NULL;
-	}
-
-	memset(ctx_data, 0, sizeof(*ctx_data));
-	ctx_data->record = record;
 
-	ctx = g_markup_parse_context_new(&parser, 0, ctx_data, NULL);
+	ctx = g_markup_parse_context_new(&parser, 0, &pdu, NULL);
 
-	if (g_markup_parse_context_parse(ctx, data, size, NULL) == FALSE) {
+	if (g_markup_parse_context_parse(ctx, data, size, NULL) == FALSE ||
+			g_markup_parse_context_end_parse(ctx, NULL) == FALSE) {
 		error("XML parsing error");
 		g_markup_parse_context_free(ctx);
-		sdp_record_free(record);
-		free(ctx_data);
+		sdp_xml_pdu_free(&pdu);
 		return NULL;
 	}
 
 	g_markup_parse_context_free(ctx);
 
-	free(ctx_data);
+	len = sdp_xml_pdu_finish(&pdu);
+	if (len < 0) {
+		sdp_xml_pdu_free(&pdu);
+		return NULL;
+	}
+
+	record = sdp_extract_pdu(pdu.buf.data, len, &scanned);
+
+	sdp_xml_pdu_free(&pdu);
+
+	/* A handle in the XML is dropped, it gets assigned on registration */
+	if (record)
+		record->handle = 0xffffffff;
 
 	return record;
 }
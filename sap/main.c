@@ -51,5 +51,6 @@ static void sap_exit(void)
 	dbus_connection_unref(connection);
 }
 
-BLUETOOTH_PLUGIN_DEFINE(sap, VERSION,
-		BLUETOOTH_PLUGIN_PRIORITY_DEFAULT, sap_init, sap_exit)
+BLUETOOTH_PLUGIN_DEFINE_TRIGGER(sap, VERSION,
+			BLUETOOTH_PLUGIN_PRIORITY_DEFAULT,
+			BLUETOOTH_PLUGIN_TRIGGER_ADAPTER, sap_init, sap_exit)
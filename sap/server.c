@@ -30,6 +30,8 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
 #include <glib.h>
 #include <netinet/in.h>
 #include <bluetooth/bluetooth.h>
@@ -58,6 +60,21 @@
 #define SAP_TIMER_GRACEFUL_DISCONNECT 30
 #define SAP_TIMER_NO_ACTIVITY 30
 
+#define SAP_APDU_STATS_INTERVAL 100
+
+/* Header of a successful TRANSFER_APDU_RESP up to the APDU bytes: result
+ * code parameter (padded to 4 bytes) followed by the response APDU
+ * parameter header, see sap_transfer_apdu_rsp */
+#define APDU_RSP_LEN_OFFSET	14
+#define APDU_RSP_HEADER_SIZE	16
+
+static const uint8_t apdu_rsp_header[APDU_RSP_HEADER_SIZE] = {
+	SAP_TRANSFER_APDU_RESP, 0x02, 0x00, 0x00,
+	SAP_PARAM_ID_RESULT_CODE, 0x00, 0x00, SAP_PARAM_ID_RESULT_CODE_LEN,
+	SAP_RESULT_OK, 0x00, 0x00, 0x00,
+	SAP_PARAM_ID_RESPONSE_APDU, 0x00, 0x00, 0x00
+};
+
 enum {
 	SAP_STATE_DISCONNECTED,
 	SAP_STATE_CONNECT_IN_PROGRESS,
@@ -67,11 +84,22 @@ enum {
 	SAP_STATE_CLIENT_DISCONNECT
 };
 
+struct sap_apdu_stats {
+	struct timespec start;		/* Pending request arrival */
+	unsigned int count;
+	unsigned long long total_us;
+	unsigned long long max_us;
+};
+
 struct sap_connection {
 	GIOChannel *io;
 	uint32_t state;
 	uint8_t processing_req;
 	guint timer_id;
+	uint16_t maxmsgsize;		/* Negotiated MaxMsgSize */
+	struct sap_apdu_stats apdu;
+	uint8_t rx_buf[SAP_BUF_SIZE];
+	uint8_t tx_buf[SAP_BUF_SIZE];
 };
 
 struct sap_server {
@@ -328,6 +356,7 @@ static void connect_req(struct sap_connection *conn,
 	conn->state = SAP_STATE_CONNECT_IN_PROGRESS;
 
 	if (maxmsgsize <= SAP_BUF_SIZE) {
+		conn->maxmsgsize = maxmsgsize;
 		conn->processing_req = SAP_CONNECT_REQ;
 		sap_connect_req(conn, maxmsgsize);
 	} else {
@@ -429,6 +458,7 @@ static void transfer_apdu_req(struct sap_connection *conn,
 		goto error_rsp;
 
 	conn->processing_req = SAP_TRANSFER_APDU_REQ;
+	clock_gettime(CLOCK_MONOTONIC, &conn->apdu.start);
 	sap_transfer_apdu_req(conn, param);
 
 	return;
@@ -670,6 +700,9 @@ int sap_connect_rsp(void *sap_device, uint8_t status, uint16_t maxmsgsize)
 	if (status == SAP_STATUS_OK) {
 		gboolean connected = TRUE;
 
+		if (maxmsgsize)
+			conn->maxmsgsize = maxmsgsize;
+
 		emit_property_changed(connection, server->path,
 						SAP_SERVER_INTERFACE,
 			"Connected", DBUS_TYPE_BOOLEAN, &connected);
@@ -729,14 +762,36 @@ int sap_disconnect_rsp(void *sap_device)
 	return 0;
 }
 
+static void apdu_stats_update(struct sap_connection *conn)
+{
+	struct sap_apdu_stats *stats = &conn->apdu;
+	struct timespec now;
+	unsigned long long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	us = (now.tv_sec - stats->start.tv_sec) * 1000000 +
+			(now.tv_nsec - stats->start.tv_nsec) / 1000;
+
+	stats->count++;
+	stats->total_us += us;
+	if (us > stats->max_us)
+		stats->max_us = us;
+
+	if (stats->count % SAP_APDU_STATS_INTERVAL == 0)
+		DBG("%u APDUs avg %llu us max %llu us",
+				stats->count, stats->total_us / stats->count,
+				stats->max_us);
+}
+
 int sap_transfer_apdu_rsp(void *sap_device, uint8_t result, uint8_t *apdu,
 					uint16_t length)
 {
 	struct sap_connection *conn = sap_device;
-	char buf[SAP_BUF_SIZE];
-	struct sap_message *msg = (struct sap_message *) buf;
-	struct sap_parameter *param = (struct sap_parameter *) msg->param;
+	uint8_t *buf;
+	struct sap_message *msg;
 	size_t size = sizeof(struct sap_message);
+	size_t max;
 
 	if (!conn)
 		return -EINVAL;
@@ -749,26 +804,32 @@ int sap_transfer_apdu_rsp(void *sap_device, uint8_t result, uint8_t *apdu,
 	if (result == SAP_RESULT_OK && (!apdu || (apdu && length == 0x00)))
 		return -EINVAL;
 
-	memset(buf, 0, sizeof(buf));
-	msg->id = SAP_TRANSFER_APDU_RESP;
-	msg->nparam = 0x01;
-	size += add_result_parameter(result, param);
+	apdu_stats_update(conn);
 
-	/* Add APDU response. */
-	if (result == SAP_RESULT_OK) {
-		msg->nparam++;
-		param = (struct sap_parameter *) &buf[size];
-		param->id = SAP_PARAM_ID_RESPONSE_APDU;
-		param->len = htons(length);
+	buf = conn->tx_buf;
 
-		size += PARAMETER_SIZE(length);
+	if (result != SAP_RESULT_OK) {
+		memset(buf, 0, size);
+		msg = (struct sap_message *) buf;
+		msg->id = SAP_TRANSFER_APDU_RESP;
+		msg->nparam = 0x01;
+		size += add_result_parameter(result, msg->param);
+		goto done;
+	}
 
-		if (size > SAP_BUF_SIZE)
-			return -EOVERFLOW;
+	/* Both parameters go out on every APDU, so start from the prebuilt
+	 * header and only fill in the length and the padding */
+	size = APDU_RSP_HEADER_SIZE + length + PADDING4(length);
+	max = conn->maxmsgsize ? conn->maxmsgsize : SAP_BUF_SIZE;
+	if (size > max)
+		return -EOVERFLOW;
 
-		memcpy(param->val, apdu, length);
-	}
+	memcpy(buf, apdu_rsp_header, APDU_RSP_HEADER_SIZE);
+	bt_put_unaligned(htons(length), (uint16_t *) &buf[APDU_RSP_LEN_OFFSET]);
+	memcpy(&buf[APDU_RSP_HEADER_SIZE], apdu, length);
+	memset(&buf[APDU_RSP_HEADER_SIZE + length], 0, PADDING4(length));
 
+done:
 	conn->processing_req = SAP_NO_REQ;
 
 	return send_message(sap_device, buf, size);
@@ -1023,6 +1084,27 @@ static int handle_cmd(void *data, void *buf, size_t size)
 					sizeof(struct sap_parameter) + 4))
 		goto error_rsp;
 
+	/* APDUs are the bulk of the traffic during a call, validate them in
+	 * place instead of going through the generic check */
+	if (msg->id == SAP_TRANSFER_APDU_REQ) {
+		struct sap_parameter *param = msg->param;
+
+		if (msg->nparam != 0x01)
+			goto error_rsp;
+
+		if (param->id != SAP_PARAM_ID_COMMAND_APDU &&
+				param->id != SAP_PARAM_ID_COMMAND_APDU7816)
+			goto error_rsp;
+
+		if (param->len == 0x00 || sizeof(struct sap_message) +
+				sizeof(struct sap_parameter) +
+				ntohs(param->len) > size)
+			goto error_rsp;
+
+		transfer_apdu_req(conn, param);
+		return 0;
+	}
+
 	if (check_msg(msg) < 0)
 		goto error_rsp;
 
@@ -1077,6 +1159,12 @@ static void sap_conn_remove(struct sap_connection *conn)
 		g_io_channel_unref(conn->io);
 	}
 
+	if (conn->apdu.count > 0)
+		info("SAP: %u APDUs, avg %llu us max %llu us",
+				conn->apdu.count,
+				conn->apdu.total_us / conn->apdu.count,
+				conn->apdu.max_us);
+
 	conn->io = NULL;
 	g_free(conn);
 	server->conn = NULL;
@@ -1084,7 +1172,7 @@ static void sap_conn_remove(struct sap_connection *conn)
 
 static gboolean sap_io_cb(GIOChannel *io, GIOCondition cond, gpointer data)
 {
-	char buf[SAP_BUF_SIZE];
+	struct sap_connection *conn = data;
 	size_t bytes_read = 0;
 	GError *gerr = NULL;
 	GIOStatus gstatus;
@@ -1106,8 +1194,8 @@ static gboolean sap_io_cb(GIOChannel *io, GIOCondition cond, gpointer data)
 		return FALSE;
 	}
 
-	gstatus = g_io_channel_read_chars(io, buf, sizeof(buf) - 1,
-				&bytes_read, &gerr);
+	gstatus = g_io_channel_read_chars(io, (gchar *) conn->rx_buf,
+				sizeof(conn->rx_buf) - 1, &bytes_read, &gerr);
 	if (gstatus != G_IO_STATUS_NORMAL) {
 		if (gerr)
 			g_error_free(gerr);
@@ -1115,7 +1203,7 @@ static gboolean sap_io_cb(GIOChannel *io, GIOCondition cond, gpointer data)
 		return TRUE;
 	}
 
-	if (handle_cmd(data, buf, bytes_read) < 0)
+	if (handle_cmd(conn, conn->rx_buf, bytes_read) < 0)
 		error("Invalid SAP message.");
 
 	return TRUE;
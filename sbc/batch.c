@@ -0,0 +1,297 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) utilities
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+
+int batch_input_map(struct batch_input *in, const char *filename)
+{
+	struct stat st;
+	void *data;
+	int fd, err;
+
+	memset(in, 0, sizeof(*in));
+	in->filename = filename;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	err = errno;
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return -err;
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	in->data = data;
+	in->size = st.st_size;
+
+	return 0;
+}
+
+void batch_input_unmap(struct batch_input *in)
+{
+	if (in->data)
+		munmap((void *) in->data, in->size);
+
+	in->data = NULL;
+	in->size = 0;
+}
+
+struct batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct batch_segment *segs;
+	unsigned int count;
+	unsigned int next;
+	batch_func_t process;
+};
+
+static void batch_process(struct batch_segment *seg, batch_func_t process)
+{
+	if (seg->output == NULL && seg->output_len > 0) {
+		seg->output = malloc(seg->output_len);
+		if (seg->output == NULL) {
+			seg->err = -ENOMEM;
+			return;
+		}
+
+		seg->allocated = 1;
+	}
+
+	process(seg);
+}
+
+static void *batch_worker(void *user_data)
+{
+	struct batch *batch = user_data;
+
+	pthread_mutex_lock(&batch->lock);
+
+	while (batch->next < batch->count) {
+		struct batch_segment *seg = &batch->segs[batch->next++];
+
+		pthread_mutex_unlock(&batch->lock);
+
+		batch_process(seg, batch->process);
+
+		pthread_mutex_lock(&batch->lock);
+		seg->done = 1;
+		pthread_cond_broadcast(&batch->cond);
+	}
+
+	pthread_mutex_unlock(&batch->lock);
+
+	return NULL;
+}
+
+static void batch_complete(struct batch_segment *seg, batch_func_t complete)
+{
+	if (complete)
+		complete(seg);
+
+	if (seg->allocated) {
+		free(seg->output);
+		seg->output = NULL;
+		seg->allocated = 0;
+	}
+}
+
+int batch_run(struct batch_segment *segs, unsigned int count,
+			unsigned int jobs, batch_func_t process,
+			batch_func_t complete)
+{
+	struct batch batch;
+	pthread_t *threads;
+	unsigned int i, started;
+	int err;
+
+	if (jobs > count)
+		jobs = count;
+
+	if (jobs <= 1) {
+		for (i = 0; i < count; i++) {
+			batch_process(&segs[i], process);
+			batch_complete(&segs[i], complete);
+		}
+
+		return 0;
+	}
+
+	threads = calloc(jobs, sizeof(pthread_t));
+	if (threads == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	batch.segs = segs;
+	batch.count = count;
+	batch.next = 0;
+	batch.process = process;
+
+	for (i = 0; i < count; i++)
+		segs[i].done = 0;
+
+	for (started = 0; started < jobs; started++) {
+		err = pthread_create(&threads[started], NULL, batch_worker,
+									&batch);
+		if (err != 0)
+			break;
+	}
+
+	/* Without any worker the calling thread does all of the work */
+	if (started == 0)
+		batch_worker(&batch);
+
+	for (i = 0; i < count; i++) {
+		pthread_mutex_lock(&batch.lock);
+		while (!segs[i].done)
+			pthread_cond_wait(&batch.cond, &batch.lock);
+		pthread_mutex_unlock(&batch.lock);
+
+		batch_complete(&segs[i], complete);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+	free(threads);
+
+	return 0;
+}
+
+uint8_t *batch_output_map(struct batch_output *out, int fd, size_t len)
+{
+	struct stat st;
+	off_t offset, start;
+	long page;
+	void *map;
+	int flags;
+
+	memset(out, 0, sizeof(*out));
+	out->fd = fd;
+
+	if (len == 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || (flags & O_ACCMODE) != O_RDWR || flags & O_APPEND)
+		return NULL;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0)
+		return NULL;
+
+	if (ftruncate(fd, offset + len) < 0)
+		return NULL;
+
+	page = sysconf(_SC_PAGESIZE);
+	start = offset - offset % page;
+
+	map = mmap(NULL, offset - start + len, PROT_READ | PROT_WRITE,
+						MAP_SHARED, fd, start);
+	if (map == MAP_FAILED) {
+		if (ftruncate(fd, st.st_size) < 0)
+			perror("Can't restore output size");
+		return NULL;
+	}
+
+	out->offset = offset;
+	out->len = len;
+	out->map = map;
+	out->map_len = offset - start + len;
+
+	return out->map + (offset - start);
+}
+
+void batch_output_unmap(struct batch_output *out)
+{
+	if (out->map == NULL)
+		return;
+
+	munmap(out->map, out->map_len);
+	out->map = NULL;
+
+	if (lseek(out->fd, out->offset + out->len, SEEK_SET) < 0)
+		perror("Can't seek output");
+}
+
+uint64_t batch_get_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void batch_report(const char *what, size_t frames, size_t bytes,
+				double seconds, uint64_t nsec)
+{
+	double elapsed = nsec / 1000000000.0;
+
+	if (elapsed <= 0)
+		return;
+
+	fprintf(stderr, "%s %lu frames, %.1f s of audio in %.3f s "
+			"(%.1fx realtime, %.1f MB/s, %.0f frames/s)\n",
+			what, (unsigned long) frames, seconds, elapsed,
+			seconds / elapsed, bytes / elapsed / 1000000,
+			frames / elapsed);
+}
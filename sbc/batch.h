@@ -0,0 +1,80 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) utilities
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Frames in the smallest segment handed to a worker */
+#define BATCH_MIN_FRAMES	256
+
+struct batch_input {
+	const char *filename;
+	const uint8_t *data;
+	size_t size;
+};
+
+int batch_input_map(struct batch_input *in, const char *filename);
+void batch_input_unmap(struct batch_input *in);
+
+/* A run of frames of one input that can be coded on its own. The codec
+ * state is rebuilt by coding the warmup frames before the first one and
+ * throwing their output away, which gives the same result as coding the
+ * whole input in one go. */
+struct batch_segment {
+	void *user_data;
+	size_t first;
+	size_t count;
+	size_t warmup;
+
+	/* Either points into a mapped output file, or is allocated by
+	 * batch_run() with output_len bytes when left NULL */
+	uint8_t *output;
+	size_t output_len;
+	size_t written;
+	int err;
+
+	int allocated;
+	int done;
+};
+
+typedef void (*batch_func_t) (struct batch_segment *seg);
+
+/* Calls process for each segment from up to jobs threads, and complete
+ * from the calling thread, in segment order, as soon as each is done */
+int batch_run(struct batch_segment *segs, unsigned int count,
+			unsigned int jobs, batch_func_t process,
+			batch_func_t complete);
+
+struct batch_output {
+	int fd;
+	off_t offset;
+	size_t len;
+	uint8_t *map;
+	size_t map_len;
+};
+
+/* Maps len bytes at the current offset of fd, which must be a regular
+ * file, and returns NULL when the output has to be written instead */
+uint8_t *batch_output_map(struct batch_output *out, int fd, size_t len);
+void batch_output_unmap(struct batch_output *out);
+
+void batch_report(const char *what, size_t frames, size_t bytes,
+				double seconds, uint64_t nsec);
+uint64_t batch_get_nsec(void);
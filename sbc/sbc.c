@@ -40,6 +40,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <limits.h>
 
@@ -50,6 +51,12 @@
 #include "sbc_primitives.h"
 
 #define SBC_SYNCWORD	0x9C
+#define MSBC_SYNCWORD	0xAD
+#define MSBC_BLOCKS	15
+#define MSBC_BITPOOL	26
+
+#define SBC_BITS_CACHE_BITS	6
+#define SBC_BITS_CACHE_SIZE	(1 << SBC_BITS_CACHE_BITS)
 
 /* This structure contains an unpacked SBC frame.
    Yes, there is probably quite some unused space herein */
@@ -72,7 +79,10 @@ struct sbc_frame {
 	uint8_t subbands;
 	uint8_t bitpool;
 	uint16_t codesize;
-	uint8_t length;
+	uint16_t length;
+
+	/* mSBC header, the fields above are implied */
+	uint8_t msbc;
 
 	/* bit number x set means joint stereo has been used in subband x */
 	uint8_t joint;
@@ -90,61 +100,322 @@ struct sbc_frame {
 	int16_t SBC_ALIGNED pcm_sample[2][16*8];
 };
 
-struct sbc_decoder_state {
-	int subbands;
-	int32_t V[2][170];
-	int offset[2][16];
+struct sbc_bits_cache_entry {
+	uint64_t sf;
+	uint32_t key;
+	int8_t bits[2][8];
+};
+
+struct sbc_bits_cache {
+	struct sbc_bits_cache_entry entries[SBC_BITS_CACHE_SIZE];
+	unsigned long hits;
+	unsigned long misses;
 };
 
 /*
- * Calculates the CRC-8 of the first len bits in data
+ * CRC-8 lookup tables for slice-by-8 calculation, crc_table[0] is the
+ * plain byte table and crc_table[n] is crc_table[0] followed by n zero
+ * bytes
  */
-static const uint8_t crc_table[256] = {
-	0x00, 0x1D, 0x3A, 0x27, 0x74, 0x69, 0x4E, 0x53,
-	0xE8, 0xF5, 0xD2, 0xCF, 0x9C, 0x81, 0xA6, 0xBB,
-	0xCD, 0xD0, 0xF7, 0xEA, 0xB9, 0xA4, 0x83, 0x9E,
-	0x25, 0x38, 0x1F, 0x02, 0x51, 0x4C, 0x6B, 0x76,
-	0x87, 0x9A, 0xBD, 0xA0, 0xF3, 0xEE, 0xC9, 0xD4,
-	0x6F, 0x72, 0x55, 0x48, 0x1B, 0x06, 0x21, 0x3C,
-	0x4A, 0x57, 0x70, 0x6D, 0x3E, 0x23, 0x04, 0x19,
-	0xA2, 0xBF, 0x98, 0x85, 0xD6, 0xCB, 0xEC, 0xF1,
-	0x13, 0x0E, 0x29, 0x34, 0x67, 0x7A, 0x5D, 0x40,
-	0xFB, 0xE6, 0xC1, 0xDC, 0x8F, 0x92, 0xB5, 0xA8,
-	0xDE, 0xC3, 0xE4, 0xF9, 0xAA, 0xB7, 0x90, 0x8D,
-	0x36, 0x2B, 0x0C, 0x11, 0x42, 0x5F, 0x78, 0x65,
-	0x94, 0x89, 0xAE, 0xB3, 0xE0, 0xFD, 0xDA, 0xC7,
-	0x7C, 0x61, 0x46, 0x5B, 0x08, 0x15, 0x32, 0x2F,
-	0x59, 0x44, 0x63, 0x7E, 0x2D, 0x30, 0x17, 0x0A,
-	0xB1, 0xAC, 0x8B, 0x96, 0xC5, 0xD8, 0xFF, 0xE2,
-	0x26, 0x3B, 0x1C, 0x01, 0x52, 0x4F, 0x68, 0x75,
-	0xCE, 0xD3, 0xF4, 0xE9, 0xBA, 0xA7, 0x80, 0x9D,
-	0xEB, 0xF6, 0xD1, 0xCC, 0x9F, 0x82, 0xA5, 0xB8,
-	0x03, 0x1E, 0x39, 0x24, 0x77, 0x6A, 0x4D, 0x50,
-	0xA1, 0xBC, 0x9B, 0x86, 0xD5, 0xC8, 0xEF, 0xF2,
-	0x49, 0x54, 0x73, 0x6E, 0x3D, 0x20, 0x07, 0x1A,
-	0x6C, 0x71, 0x56, 0x4B, 0x18, 0x05, 0x22, 0x3F,
-	0x84, 0x99, 0xBE, 0xA3, 0xF0, 0xED, 0xCA, 0xD7,
-	0x35, 0x28, 0x0F, 0x12, 0x41, 0x5C, 0x7B, 0x66,
-	0xDD, 0xC0, 0xE7, 0xFA, 0xA9, 0xB4, 0x93, 0x8E,
-	0xF8, 0xE5, 0xC2, 0xDF, 0x8C, 0x91, 0xB6, 0xAB,
-	0x10, 0x0D, 0x2A, 0x37, 0x64, 0x79, 0x5E, 0x43,
-	0xB2, 0xAF, 0x88, 0x95, 0xC6, 0xDB, 0xFC, 0xE1,
-	0x5A, 0x47, 0x60, 0x7D, 0x2E, 0x33, 0x14, 0x09,
-	0x7F, 0x62, 0x45, 0x58, 0x0B, 0x16, 0x31, 0x2C,
-	0x97, 0x8A, 0xAD, 0xB0, 0xE3, 0xFE, 0xD9, 0xC4
+static const uint8_t crc_table[8][256] = {
+	{
+		0x00, 0x1D, 0x3A, 0x27, 0x74, 0x69, 0x4E, 0x53,
+		0xE8, 0xF5, 0xD2, 0xCF, 0x9C, 0x81, 0xA6, 0xBB,
+		0xCD, 0xD0, 0xF7, 0xEA, 0xB9, 0xA4, 0x83, 0x9E,
+		0x25, 0x38, 0x1F, 0x02, 0x51, 0x4C, 0x6B, 0x76,
+		0x87, 0x9A, 0xBD, 0xA0, 0xF3, 0xEE, 0xC9, 0xD4,
+		0x6F, 0x72, 0x55, 0x48, 0x1B, 0x06, 0x21, 0x3C,
+		0x4A, 0x57, 0x70, 0x6D, 0x3E, 0x23, 0x04, 0x19,
+		0xA2, 0xBF, 0x98, 0x85, 0xD6, 0xCB, 0xEC, 0xF1,
+		0x13, 0x0E, 0x29, 0x34, 0x67, 0x7A, 0x5D, 0x40,
+		0xFB, 0xE6, 0xC1, 0xDC, 0x8F, 0x92, 0xB5, 0xA8,
+		0xDE, 0xC3, 0xE4, 0xF9, 0xAA, 0xB7, 0x90, 0x8D,
+		0x36, 0x2B, 0x0C, 0x11, 0x42, 0x5F, 0x78, 0x65,
+		0x94, 0x89, 0xAE, 0xB3, 0xE0, 0xFD, 0xDA, 0xC7,
+		0x7C, 0x61, 0x46, 0x5B, 0x08, 0x15, 0x32, 0x2F,
+		0x59, 0x44, 0x63, 0x7E, 0x2D, 0x30, 0x17, 0x0A,
+		0xB1, 0xAC, 0x8B, 0x96, 0xC5, 0xD8, 0xFF, 0xE2,
+		0x26, 0x3B, 0x1C, 0x01, 0x52, 0x4F, 0x68, 0x75,
+		0xCE, 0xD3, 0xF4, 0xE9, 0xBA, 0xA7, 0x80, 0x9D,
+		0xEB, 0xF6, 0xD1, 0xCC, 0x9F, 0x82, 0xA5, 0xB8,
+		0x03, 0x1E, 0x39, 0x24, 0x77, 0x6A, 0x4D, 0x50,
+		0xA1, 0xBC, 0x9B, 0x86, 0xD5, 0xC8, 0xEF, 0xF2,
+		0x49, 0x54, 0x73, 0x6E, 0x3D, 0x20, 0x07, 0x1A,
+		0x6C, 0x71, 0x56, 0x4B, 0x18, 0x05, 0x22, 0x3F,
+		0x84, 0x99, 0xBE, 0xA3, 0xF0, 0xED, 0xCA, 0xD7,
+		0x35, 0x28, 0x0F, 0x12, 0x41, 0x5C, 0x7B, 0x66,
+		0xDD, 0xC0, 0xE7, 0xFA, 0xA9, 0xB4, 0x93, 0x8E,
+		0xF8, 0xE5, 0xC2, 0xDF, 0x8C, 0x91, 0xB6, 0xAB,
+		0x10, 0x0D, 0x2A, 0x37, 0x64, 0x79, 0x5E, 0x43,
+		0xB2, 0xAF, 0x88, 0x95, 0xC6, 0xDB, 0xFC, 0xE1,
+		0x5A, 0x47, 0x60, 0x7D, 0x2E, 0x33, 0x14, 0x09,
+		0x7F, 0x62, 0x45, 0x58, 0x0B, 0x16, 0x31, 0x2C,
+		0x97, 0x8A, 0xAD, 0xB0, 0xE3, 0xFE, 0xD9, 0xC4
+	},
+	{
+		0x00, 0x4C, 0x98, 0xD4, 0x2D, 0x61, 0xB5, 0xF9,
+		0x5A, 0x16, 0xC2, 0x8E, 0x77, 0x3B, 0xEF, 0xA3,
+		0xB4, 0xF8, 0x2C, 0x60, 0x99, 0xD5, 0x01, 0x4D,
+		0xEE, 0xA2, 0x76, 0x3A, 0xC3, 0x8F, 0x5B, 0x17,
+		0x75, 0x39, 0xED, 0xA1, 0x58, 0x14, 0xC0, 0x8C,
+		0x2F, 0x63, 0xB7, 0xFB, 0x02, 0x4E, 0x9A, 0xD6,
+		0xC1, 0x8D, 0x59, 0x15, 0xEC, 0xA0, 0x74, 0x38,
+		0x9B, 0xD7, 0x03, 0x4F, 0xB6, 0xFA, 0x2E, 0x62,
+		0xEA, 0xA6, 0x72, 0x3E, 0xC7, 0x8B, 0x5F, 0x13,
+		0xB0, 0xFC, 0x28, 0x64, 0x9D, 0xD1, 0x05, 0x49,
+		0x5E, 0x12, 0xC6, 0x8A, 0x73, 0x3F, 0xEB, 0xA7,
+		0x04, 0x48, 0x9C, 0xD0, 0x29, 0x65, 0xB1, 0xFD,
+		0x9F, 0xD3, 0x07, 0x4B, 0xB2, 0xFE, 0x2A, 0x66,
+		0xC5, 0x89, 0x5D, 0x11, 0xE8, 0xA4, 0x70, 0x3C,
+		0x2B, 0x67, 0xB3, 0xFF, 0x06, 0x4A, 0x9E, 0xD2,
+		0x71, 0x3D, 0xE9, 0xA5, 0x5C, 0x10, 0xC4, 0x88,
+		0xC9, 0x85, 0x51, 0x1D, 0xE4, 0xA8, 0x7C, 0x30,
+		0x93, 0xDF, 0x0B, 0x47, 0xBE, 0xF2, 0x26, 0x6A,
+		0x7D, 0x31, 0xE5, 0xA9, 0x50, 0x1C, 0xC8, 0x84,
+		0x27, 0x6B, 0xBF, 0xF3, 0x0A, 0x46, 0x92, 0xDE,
+		0xBC, 0xF0, 0x24, 0x68, 0x91, 0xDD, 0x09, 0x45,
+		0xE6, 0xAA, 0x7E, 0x32, 0xCB, 0x87, 0x53, 0x1F,
+		0x08, 0x44, 0x90, 0xDC, 0x25, 0x69, 0xBD, 0xF1,
+		0x52, 0x1E, 0xCA, 0x86, 0x7F, 0x33, 0xE7, 0xAB,
+		0x23, 0x6F, 0xBB, 0xF7, 0x0E, 0x42, 0x96, 0xDA,
+		0x79, 0x35, 0xE1, 0xAD, 0x54, 0x18, 0xCC, 0x80,
+		0x97, 0xDB, 0x0F, 0x43, 0xBA, 0xF6, 0x22, 0x6E,
+		0xCD, 0x81, 0x55, 0x19, 0xE0, 0xAC, 0x78, 0x34,
+		0x56, 0x1A, 0xCE, 0x82, 0x7B, 0x37, 0xE3, 0xAF,
+		0x0C, 0x40, 0x94, 0xD8, 0x21, 0x6D, 0xB9, 0xF5,
+		0xE2, 0xAE, 0x7A, 0x36, 0xCF, 0x83, 0x57, 0x1B,
+		0xB8, 0xF4, 0x20, 0x6C, 0x95, 0xD9, 0x0D, 0x41
+	},
+	{
+		0x00, 0x8F, 0x03, 0x8C, 0x06, 0x89, 0x05, 0x8A,
+		0x0C, 0x83, 0x0F, 0x80, 0x0A, 0x85, 0x09, 0x86,
+		0x18, 0x97, 0x1B, 0x94, 0x1E, 0x91, 0x1D, 0x92,
+		0x14, 0x9B, 0x17, 0x98, 0x12, 0x9D, 0x11, 0x9E,
+		0x30, 0xBF, 0x33, 0xBC, 0x36, 0xB9, 0x35, 0xBA,
+		0x3C, 0xB3, 0x3F, 0xB0, 0x3A, 0xB5, 0x39, 0xB6,
+		0x28, 0xA7, 0x2B, 0xA4, 0x2E, 0xA1, 0x2D, 0xA2,
+		0x24, 0xAB, 0x27, 0xA8, 0x22, 0xAD, 0x21, 0xAE,
+		0x60, 0xEF, 0x63, 0xEC, 0x66, 0xE9, 0x65, 0xEA,
+		0x6C, 0xE3, 0x6F, 0xE0, 0x6A, 0xE5, 0x69, 0xE6,
+		0x78, 0xF7, 0x7B, 0xF4, 0x7E, 0xF1, 0x7D, 0xF2,
+		0x74, 0xFB, 0x77, 0xF8, 0x72, 0xFD, 0x71, 0xFE,
+		0x50, 0xDF, 0x53, 0xDC, 0x56, 0xD9, 0x55, 0xDA,
+		0x5C, 0xD3, 0x5F, 0xD0, 0x5A, 0xD5, 0x59, 0xD6,
+		0x48, 0xC7, 0x4B, 0xC4, 0x4E, 0xC1, 0x4D, 0xC2,
+		0x44, 0xCB, 0x47, 0xC8, 0x42, 0xCD, 0x41, 0xCE,
+		0xC0, 0x4F, 0xC3, 0x4C, 0xC6, 0x49, 0xC5, 0x4A,
+		0xCC, 0x43, 0xCF, 0x40, 0xCA, 0x45, 0xC9, 0x46,
+		0xD8, 0x57, 0xDB, 0x54, 0xDE, 0x51, 0xDD, 0x52,
+		0xD4, 0x5B, 0xD7, 0x58, 0xD2, 0x5D, 0xD1, 0x5E,
+		0xF0, 0x7F, 0xF3, 0x7C, 0xF6, 0x79, 0xF5, 0x7A,
+		0xFC, 0x73, 0xFF, 0x70, 0xFA, 0x75, 0xF9, 0x76,
+		0xE8, 0x67, 0xEB, 0x64, 0xEE, 0x61, 0xED, 0x62,
+		0xE4, 0x6B, 0xE7, 0x68, 0xE2, 0x6D, 0xE1, 0x6E,
+		0xA0, 0x2F, 0xA3, 0x2C, 0xA6, 0x29, 0xA5, 0x2A,
+		0xAC, 0x23, 0xAF, 0x20, 0xAA, 0x25, 0xA9, 0x26,
+		0xB8, 0x37, 0xBB, 0x34, 0xBE, 0x31, 0xBD, 0x32,
+		0xB4, 0x3B, 0xB7, 0x38, 0xB2, 0x3D, 0xB1, 0x3E,
+		0x90, 0x1F, 0x93, 0x1C, 0x96, 0x19, 0x95, 0x1A,
+		0x9C, 0x13, 0x9F, 0x10, 0x9A, 0x15, 0x99, 0x16,
+		0x88, 0x07, 0x8B, 0x04, 0x8E, 0x01, 0x8D, 0x02,
+		0x84, 0x0B, 0x87, 0x08, 0x82, 0x0D, 0x81, 0x0E
+	},
+	{
+		0x00, 0x9D, 0x27, 0xBA, 0x4E, 0xD3, 0x69, 0xF4,
+		0x9C, 0x01, 0xBB, 0x26, 0xD2, 0x4F, 0xF5, 0x68,
+		0x25, 0xB8, 0x02, 0x9F, 0x6B, 0xF6, 0x4C, 0xD1,
+		0xB9, 0x24, 0x9E, 0x03, 0xF7, 0x6A, 0xD0, 0x4D,
+		0x4A, 0xD7, 0x6D, 0xF0, 0x04, 0x99, 0x23, 0xBE,
+		0xD6, 0x4B, 0xF1, 0x6C, 0x98, 0x05, 0xBF, 0x22,
+		0x6F, 0xF2, 0x48, 0xD5, 0x21, 0xBC, 0x06, 0x9B,
+		0xF3, 0x6E, 0xD4, 0x49, 0xBD, 0x20, 0x9A, 0x07,
+		0x94, 0x09, 0xB3, 0x2E, 0xDA, 0x47, 0xFD, 0x60,
+		0x08, 0x95, 0x2F, 0xB2, 0x46, 0xDB, 0x61, 0xFC,
+		0xB1, 0x2C, 0x96, 0x0B, 0xFF, 0x62, 0xD8, 0x45,
+		0x2D, 0xB0, 0x0A, 0x97, 0x63, 0xFE, 0x44, 0xD9,
+		0xDE, 0x43, 0xF9, 0x64, 0x90, 0x0D, 0xB7, 0x2A,
+		0x42, 0xDF, 0x65, 0xF8, 0x0C, 0x91, 0x2B, 0xB6,
+		0xFB, 0x66, 0xDC, 0x41, 0xB5, 0x28, 0x92, 0x0F,
+		0x67, 0xFA, 0x40, 0xDD, 0x29, 0xB4, 0x0E, 0x93,
+		0x35, 0xA8, 0x12, 0x8F, 0x7B, 0xE6, 0x5C, 0xC1,
+		0xA9, 0x34, 0x8E, 0x13, 0xE7, 0x7A, 0xC0, 0x5D,
+		0x10, 0x8D, 0x37, 0xAA, 0x5E, 0xC3, 0x79, 0xE4,
+		0x8C, 0x11, 0xAB, 0x36, 0xC2, 0x5F, 0xE5, 0x78,
+		0x7F, 0xE2, 0x58, 0xC5, 0x31, 0xAC, 0x16, 0x8B,
+		0xE3, 0x7E, 0xC4, 0x59, 0xAD, 0x30, 0x8A, 0x17,
+		0x5A, 0xC7, 0x7D, 0xE0, 0x14, 0x89, 0x33, 0xAE,
+		0xC6, 0x5B, 0xE1, 0x7C, 0x88, 0x15, 0xAF, 0x32,
+		0xA1, 0x3C, 0x86, 0x1B, 0xEF, 0x72, 0xC8, 0x55,
+		0x3D, 0xA0, 0x1A, 0x87, 0x73, 0xEE, 0x54, 0xC9,
+		0x84, 0x19, 0xA3, 0x3E, 0xCA, 0x57, 0xED, 0x70,
+		0x18, 0x85, 0x3F, 0xA2, 0x56, 0xCB, 0x71, 0xEC,
+		0xEB, 0x76, 0xCC, 0x51, 0xA5, 0x38, 0x82, 0x1F,
+		0x77, 0xEA, 0x50, 0xCD, 0x39, 0xA4, 0x1E, 0x83,
+		0xCE, 0x53, 0xE9, 0x74, 0x80, 0x1D, 0xA7, 0x3A,
+		0x52, 0xCF, 0x75, 0xE8, 0x1C, 0x81, 0x3B, 0xA6
+	},
+	{
+		0x00, 0x6A, 0xD4, 0xBE, 0xB5, 0xDF, 0x61, 0x0B,
+		0x77, 0x1D, 0xA3, 0xC9, 0xC2, 0xA8, 0x16, 0x7C,
+		0xEE, 0x84, 0x3A, 0x50, 0x5B, 0x31, 0x8F, 0xE5,
+		0x99, 0xF3, 0x4D, 0x27, 0x2C, 0x46, 0xF8, 0x92,
+		0xC1, 0xAB, 0x15, 0x7F, 0x74, 0x1E, 0xA0, 0xCA,
+		0xB6, 0xDC, 0x62, 0x08, 0x03, 0x69, 0xD7, 0xBD,
+		0x2F, 0x45, 0xFB, 0x91, 0x9A, 0xF0, 0x4E, 0x24,
+		0x58, 0x32, 0x8C, 0xE6, 0xED, 0x87, 0x39, 0x53,
+		0x9F, 0xF5, 0x4B, 0x21, 0x2A, 0x40, 0xFE, 0x94,
+		0xE8, 0x82, 0x3C, 0x56, 0x5D, 0x37, 0x89, 0xE3,
+		0x71, 0x1B, 0xA5, 0xCF, 0xC4, 0xAE, 0x10, 0x7A,
+		0x06, 0x6C, 0xD2, 0xB8, 0xB3, 0xD9, 0x67, 0x0D,
+		0x5E, 0x34, 0x8A, 0xE0, 0xEB, 0x81, 0x3F, 0x55,
+		0x29, 0x43, 0xFD, 0x97, 0x9C, 0xF6, 0x48, 0x22,
+		0xB0, 0xDA, 0x64, 0x0E, 0x05, 0x6F, 0xD1, 0xBB,
+		0xC7, 0xAD, 0x13, 0x79, 0x72, 0x18, 0xA6, 0xCC,
+		0x23, 0x49, 0xF7, 0x9D, 0x96, 0xFC, 0x42, 0x28,
+		0x54, 0x3E, 0x80, 0xEA, 0xE1, 0x8B, 0x35, 0x5F,
+		0xCD, 0xA7, 0x19, 0x73, 0x78, 0x12, 0xAC, 0xC6,
+		0xBA, 0xD0, 0x6E, 0x04, 0x0F, 0x65, 0xDB, 0xB1,
+		0xE2, 0x88, 0x36, 0x5C, 0x57, 0x3D, 0x83, 0xE9,
+		0x95, 0xFF, 0x41, 0x2B, 0x20, 0x4A, 0xF4, 0x9E,
+		0x0C, 0x66, 0xD8, 0xB2, 0xB9, 0xD3, 0x6D, 0x07,
+		0x7B, 0x11, 0xAF, 0xC5, 0xCE, 0xA4, 0x1A, 0x70,
+		0xBC, 0xD6, 0x68, 0x02, 0x09, 0x63, 0xDD, 0xB7,
+		0xCB, 0xA1, 0x1F, 0x75, 0x7E, 0x14, 0xAA, 0xC0,
+		0x52, 0x38, 0x86, 0xEC, 0xE7, 0x8D, 0x33, 0x59,
+		0x25, 0x4F, 0xF1, 0x9B, 0x90, 0xFA, 0x44, 0x2E,
+		0x7D, 0x17, 0xA9, 0xC3, 0xC8, 0xA2, 0x1C, 0x76,
+		0x0A, 0x60, 0xDE, 0xB4, 0xBF, 0xD5, 0x6B, 0x01,
+		0x93, 0xF9, 0x47, 0x2D, 0x26, 0x4C, 0xF2, 0x98,
+		0xE4, 0x8E, 0x30, 0x5A, 0x51, 0x3B, 0x85, 0xEF
+	},
+	{
+		0x00, 0x46, 0x8C, 0xCA, 0x05, 0x43, 0x89, 0xCF,
+		0x0A, 0x4C, 0x86, 0xC0, 0x0F, 0x49, 0x83, 0xC5,
+		0x14, 0x52, 0x98, 0xDE, 0x11, 0x57, 0x9D, 0xDB,
+		0x1E, 0x58, 0x92, 0xD4, 0x1B, 0x5D, 0x97, 0xD1,
+		0x28, 0x6E, 0xA4, 0xE2, 0x2D, 0x6B, 0xA1, 0xE7,
+		0x22, 0x64, 0xAE, 0xE8, 0x27, 0x61, 0xAB, 0xED,
+		0x3C, 0x7A, 0xB0, 0xF6, 0x39, 0x7F, 0xB5, 0xF3,
+		0x36, 0x70, 0xBA, 0xFC, 0x33, 0x75, 0xBF, 0xF9,
+		0x50, 0x16, 0xDC, 0x9A, 0x55, 0x13, 0xD9, 0x9F,
+		0x5A, 0x1C, 0xD6, 0x90, 0x5F, 0x19, 0xD3, 0x95,
+		0x44, 0x02, 0xC8, 0x8E, 0x41, 0x07, 0xCD, 0x8B,
+		0x4E, 0x08, 0xC2, 0x84, 0x4B, 0x0D, 0xC7, 0x81,
+		0x78, 0x3E, 0xF4, 0xB2, 0x7D, 0x3B, 0xF1, 0xB7,
+		0x72, 0x34, 0xFE, 0xB8, 0x77, 0x31, 0xFB, 0xBD,
+		0x6C, 0x2A, 0xE0, 0xA6, 0x69, 0x2F, 0xE5, 0xA3,
+		0x66, 0x20, 0xEA, 0xAC, 0x63, 0x25, 0xEF, 0xA9,
+		0xA0, 0xE6, 0x2C, 0x6A, 0xA5, 0xE3, 0x29, 0x6F,
+		0xAA, 0xEC, 0x26, 0x60, 0xAF, 0xE9, 0x23, 0x65,
+		0xB4, 0xF2, 0x38, 0x7E, 0xB1, 0xF7, 0x3D, 0x7B,
+		0xBE, 0xF8, 0x32, 0x74, 0xBB, 0xFD, 0x37, 0x71,
+		0x88, 0xCE, 0x04, 0x42, 0x8D, 0xCB, 0x01, 0x47,
+		0x82, 0xC4, 0x0E, 0x48, 0x87, 0xC1, 0x0B, 0x4D,
+		0x9C, 0xDA, 0x10, 0x56, 0x99, 0xDF, 0x15, 0x53,
+		0x96, 0xD0, 0x1A, 0x5C, 0x93, 0xD5, 0x1F, 0x59,
+		0xF0, 0xB6, 0x7C, 0x3A, 0xF5, 0xB3, 0x79, 0x3F,
+		0xFA, 0xBC, 0x76, 0x30, 0xFF, 0xB9, 0x73, 0x35,
+		0xE4, 0xA2, 0x68, 0x2E, 0xE1, 0xA7, 0x6D, 0x2B,
+		0xEE, 0xA8, 0x62, 0x24, 0xEB, 0xAD, 0x67, 0x21,
+		0xD8, 0x9E, 0x54, 0x12, 0xDD, 0x9B, 0x51, 0x17,
+		0xD2, 0x94, 0x5E, 0x18, 0xD7, 0x91, 0x5B, 0x1D,
+		0xCC, 0x8A, 0x40, 0x06, 0xC9, 0x8F, 0x45, 0x03,
+		0xC6, 0x80, 0x4A, 0x0C, 0xC3, 0x85, 0x4F, 0x09
+	},
+	{
+		0x00, 0x5D, 0xBA, 0xE7, 0x69, 0x34, 0xD3, 0x8E,
+		0xD2, 0x8F, 0x68, 0x35, 0xBB, 0xE6, 0x01, 0x5C,
+		0xB9, 0xE4, 0x03, 0x5E, 0xD0, 0x8D, 0x6A, 0x37,
+		0x6B, 0x36, 0xD1, 0x8C, 0x02, 0x5F, 0xB8, 0xE5,
+		0x6F, 0x32, 0xD5, 0x88, 0x06, 0x5B, 0xBC, 0xE1,
+		0xBD, 0xE0, 0x07, 0x5A, 0xD4, 0x89, 0x6E, 0x33,
+		0xD6, 0x8B, 0x6C, 0x31, 0xBF, 0xE2, 0x05, 0x58,
+		0x04, 0x59, 0xBE, 0xE3, 0x6D, 0x30, 0xD7, 0x8A,
+		0xDE, 0x83, 0x64, 0x39, 0xB7, 0xEA, 0x0D, 0x50,
+		0x0C, 0x51, 0xB6, 0xEB, 0x65, 0x38, 0xDF, 0x82,
+		0x67, 0x3A, 0xDD, 0x80, 0x0E, 0x53, 0xB4, 0xE9,
+		0xB5, 0xE8, 0x0F, 0x52, 0xDC, 0x81, 0x66, 0x3B,
+		0xB1, 0xEC, 0x0B, 0x56, 0xD8, 0x85, 0x62, 0x3F,
+		0x63, 0x3E, 0xD9, 0x84, 0x0A, 0x57, 0xB0, 0xED,
+		0x08, 0x55, 0xB2, 0xEF, 0x61, 0x3C, 0xDB, 0x86,
+		0xDA, 0x87, 0x60, 0x3D, 0xB3, 0xEE, 0x09, 0x54,
+		0xA1, 0xFC, 0x1B, 0x46, 0xC8, 0x95, 0x72, 0x2F,
+		0x73, 0x2E, 0xC9, 0x94, 0x1A, 0x47, 0xA0, 0xFD,
+		0x18, 0x45, 0xA2, 0xFF, 0x71, 0x2C, 0xCB, 0x96,
+		0xCA, 0x97, 0x70, 0x2D, 0xA3, 0xFE, 0x19, 0x44,
+		0xCE, 0x93, 0x74, 0x29, 0xA7, 0xFA, 0x1D, 0x40,
+		0x1C, 0x41, 0xA6, 0xFB, 0x75, 0x28, 0xCF, 0x92,
+		0x77, 0x2A, 0xCD, 0x90, 0x1E, 0x43, 0xA4, 0xF9,
+		0xA5, 0xF8, 0x1F, 0x42, 0xCC, 0x91, 0x76, 0x2B,
+		0x7F, 0x22, 0xC5, 0x98, 0x16, 0x4B, 0xAC, 0xF1,
+		0xAD, 0xF0, 0x17, 0x4A, 0xC4, 0x99, 0x7E, 0x23,
+		0xC6, 0x9B, 0x7C, 0x21, 0xAF, 0xF2, 0x15, 0x48,
+		0x14, 0x49, 0xAE, 0xF3, 0x7D, 0x20, 0xC7, 0x9A,
+		0x10, 0x4D, 0xAA, 0xF7, 0x79, 0x24, 0xC3, 0x9E,
+		0xC2, 0x9F, 0x78, 0x25, 0xAB, 0xF6, 0x11, 0x4C,
+		0xA9, 0xF4, 0x13, 0x4E, 0xC0, 0x9D, 0x7A, 0x27,
+		0x7B, 0x26, 0xC1, 0x9C, 0x12, 0x4F, 0xA8, 0xF5
+	},
+	{
+		0x00, 0x5F, 0xBE, 0xE1, 0x61, 0x3E, 0xDF, 0x80,
+		0xC2, 0x9D, 0x7C, 0x23, 0xA3, 0xFC, 0x1D, 0x42,
+		0x99, 0xC6, 0x27, 0x78, 0xF8, 0xA7, 0x46, 0x19,
+		0x5B, 0x04, 0xE5, 0xBA, 0x3A, 0x65, 0x84, 0xDB,
+		0x2F, 0x70, 0x91, 0xCE, 0x4E, 0x11, 0xF0, 0xAF,
+		0xED, 0xB2, 0x53, 0x0C, 0x8C, 0xD3, 0x32, 0x6D,
+		0xB6, 0xE9, 0x08, 0x57, 0xD7, 0x88, 0x69, 0x36,
+		0x74, 0x2B, 0xCA, 0x95, 0x15, 0x4A, 0xAB, 0xF4,
+		0x5E, 0x01, 0xE0, 0xBF, 0x3F, 0x60, 0x81, 0xDE,
+		0x9C, 0xC3, 0x22, 0x7D, 0xFD, 0xA2, 0x43, 0x1C,
+		0xC7, 0x98, 0x79, 0x26, 0xA6, 0xF9, 0x18, 0x47,
+		0x05, 0x5A, 0xBB, 0xE4, 0x64, 0x3B, 0xDA, 0x85,
+		0x71, 0x2E, 0xCF, 0x90, 0x10, 0x4F, 0xAE, 0xF1,
+		0xB3, 0xEC, 0x0D, 0x52, 0xD2, 0x8D, 0x6C, 0x33,
+		0xE8, 0xB7, 0x56, 0x09, 0x89, 0xD6, 0x37, 0x68,
+		0x2A, 0x75, 0x94, 0xCB, 0x4B, 0x14, 0xF5, 0xAA,
+		0xBC, 0xE3, 0x02, 0x5D, 0xDD, 0x82, 0x63, 0x3C,
+		0x7E, 0x21, 0xC0, 0x9F, 0x1F, 0x40, 0xA1, 0xFE,
+		0x25, 0x7A, 0x9B, 0xC4, 0x44, 0x1B, 0xFA, 0xA5,
+		0xE7, 0xB8, 0x59, 0x06, 0x86, 0xD9, 0x38, 0x67,
+		0x93, 0xCC, 0x2D, 0x72, 0xF2, 0xAD, 0x4C, 0x13,
+		0x51, 0x0E, 0xEF, 0xB0, 0x30, 0x6F, 0x8E, 0xD1,
+		0x0A, 0x55, 0xB4, 0xEB, 0x6B, 0x34, 0xD5, 0x8A,
+		0xC8, 0x97, 0x76, 0x29, 0xA9, 0xF6, 0x17, 0x48,
+		0xE2, 0xBD, 0x5C, 0x03, 0x83, 0xDC, 0x3D, 0x62,
+		0x20, 0x7F, 0x9E, 0xC1, 0x41, 0x1E, 0xFF, 0xA0,
+		0x7B, 0x24, 0xC5, 0x9A, 0x1A, 0x45, 0xA4, 0xFB,
+		0xB9, 0xE6, 0x07, 0x58, 0xD8, 0x87, 0x66, 0x39,
+		0xCD, 0x92, 0x73, 0x2C, 0xAC, 0xF3, 0x12, 0x4D,
+		0x0F, 0x50, 0xB1, 0xEE, 0x6E, 0x31, 0xD0, 0x8F,
+		0x54, 0x0B, 0xEA, 0xB5, 0x35, 0x6A, 0x8B, 0xD4,
+		0x96, 0xC9, 0x28, 0x77, 0xF7, 0xA8, 0x49, 0x16
+	}
 };
 
-static uint8_t sbc_crc8(const uint8_t *data, size_t len)
+static inline uint8_t sbc_crc8_bytes(uint8_t crc, const uint8_t *data,
+								size_t len)
 {
-	uint8_t crc = 0x0f;
-	size_t i;
-	uint8_t octet;
+	while (len >= 8) {
+		crc = crc_table[7][crc ^ data[0]] ^ crc_table[6][data[1]] ^
+			crc_table[5][data[2]] ^ crc_table[4][data[3]] ^
+			crc_table[3][data[4]] ^ crc_table[2][data[5]] ^
+			crc_table[1][data[6]] ^ crc_table[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = crc_table[0][crc ^ *data++];
+
+	return crc;
+}
 
-	for (i = 0; i < len / 8; i++)
-		crc = crc_table[crc ^ data[i]];
+/* Feeds the len (less than 8) most significant bits of octet */
+static inline uint8_t sbc_crc8_bits(uint8_t crc, uint8_t octet, size_t len)
+{
+	size_t i;
 
-	octet = data[i];
-	for (i = 0; i < len % 8; i++) {
+	for (i = 0; i < len; i++) {
 		char bit = ((octet ^ crc) & 0x80) >> 7;
 
 		crc = ((crc & 0x7f) << 1) ^ (bit ? 0x1d : 0);
@@ -354,12 +625,66 @@ static SBC_ALWAYS_INLINE void sbc_calculate_bits_internal(
 
 }
 
-static void sbc_calculate_bits(const struct sbc_frame *frame, int (*bits)[8])
+/*
+ * Optional cache of the bits allocation results. Steady streams tend to
+ * repeat the same scale factors, so the allocation is looked up by the
+ * scale factors and the frame parameters it depends on.
+ */
+static inline uint32_t sbc_bits_cache_key(
+		const struct sbc_frame *frame, uint64_t *sf)
 {
+	uint64_t v = 0;
+	int ch, sb;
+
+	for (ch = 0; ch < frame->channels; ch++)
+		for (sb = 0; sb < frame->subbands; sb++)
+			v = (v << 4) | (frame->scale_factor[ch][sb] & 0x0F);
+
+	*sf = v;
+
+	/* bit 31 marks valid cache entries */
+	return 0x80000000 | (frame->bitpool << 8) | (frame->frequency << 4) |
+		(frame->mode << 2) | (frame->allocation << 1) |
+		(frame->subbands == 8);
+}
+
+static void sbc_calculate_bits(const struct sbc_frame *frame, int (*bits)[8],
+					struct sbc_bits_cache *cache)
+{
+	struct sbc_bits_cache_entry *entry = NULL;
+	uint64_t sf = 0;
+	uint32_t key = 0;
+	int ch, sb;
+
+	if (cache) {
+		key = sbc_bits_cache_key(frame, &sf);
+		entry = &cache->entries[((sf ^ key) * 0x9E3779B97F4A7C15ULL) >>
+						(64 - SBC_BITS_CACHE_BITS)];
+
+		if (entry->key == key && entry->sf == sf) {
+			for (ch = 0; ch < frame->channels; ch++)
+				for (sb = 0; sb < frame->subbands; sb++)
+					bits[ch][sb] = entry->bits[ch][sb];
+			cache->hits++;
+			return;
+		}
+
+		cache->misses++;
+	}
+
 	if (frame->subbands == 4)
 		sbc_calculate_bits_internal(frame, bits, 4);
 	else
 		sbc_calculate_bits_internal(frame, bits, 8);
+
+	if (!entry)
+		return;
+
+	entry->key = key;
+	entry->sf = sf;
+	for (ch = 0; ch < frame->channels; ch++)
+		for (sb = 0; sb < frame->subbands; sb++)
+			entry->bits[ch][sb] = bits[ch][sb];
 }
 
 /*
@@ -374,13 +699,10 @@ static void sbc_calculate_bits(const struct sbc_frame *frame, int (*bits)[8])
  *  -4   Bitpool value out of bounds
  */
 static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
-								size_t len)
+				size_t len, struct sbc_bits_cache *cache)
 {
 	unsigned int consumed;
-	/* Will copy the parts of the header that are relevant to crc
-	 * calculation here */
-	uint8_t crc_header[11] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	int crc_pos = 0;
+	uint8_t crc;
 	int32_t temp;
 
 	int audio_sample;
@@ -392,9 +714,30 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 	if (len < 4)
 		return -1;
 
+	if (data[0] == MSBC_SYNCWORD) {
+		/* Both header bytes are reserved */
+		if (data[1] != 0 || data[2] != 0)
+			return -2;
+
+		frame->msbc = 1;
+		frame->frequency = SBC_FREQ_16000;
+		frame->block_mode = SBC_BLK_16;
+		frame->blocks = MSBC_BLOCKS;
+		frame->mode = MONO;
+		frame->channels = 1;
+		frame->allocation = LOUDNESS;
+		frame->subband_mode = SBC_SB_8;
+		frame->subbands = 8;
+		frame->bitpool = MSBC_BITPOOL;
+
+		goto header_done;
+	}
+
 	if (data[0] != SBC_SYNCWORD)
 		return -2;
 
+	frame->msbc = 0;
+
 	frame->frequency = (data[1] >> 6) & 0x03;
 
 	frame->block_mode = (data[1] >> 4) & 0x03;
@@ -440,14 +783,11 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 			frame->bitpool > 32 * frame->subbands)
 		return -4;
 
+header_done:
 	/* data[3] is crc, we're checking it later */
 
 	consumed = 32;
 
-	crc_header[0] = data[1];
-	crc_header[1] = data[2];
-	crc_pos = 16;
-
 	if (frame->mode == JOINT_STEREO) {
 		if (len * 8 < consumed + frame->subbands)
 			return -1;
@@ -455,13 +795,8 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 		frame->joint = 0x00;
 		for (sb = 0; sb < frame->subbands - 1; sb++)
 			frame->joint |= ((data[4] >> (7 - sb)) & 0x01) << sb;
-		if (frame->subbands == 4)
-			crc_header[crc_pos / 8] = data[4] & 0xf0;
-		else
-			crc_header[crc_pos / 8] = data[4];
 
 		consumed += frame->subbands;
-		crc_pos += frame->subbands;
 	}
 
 	if (len * 8 < consumed + (4 * frame->subbands * frame->channels))
@@ -472,18 +807,22 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 			/* FIXME assert(consumed % 4 == 0); */
 			frame->scale_factor[ch][sb] =
 				(data[consumed >> 3] >> (4 - (consumed & 0x7))) & 0x0F;
-			crc_header[crc_pos >> 3] |=
-				frame->scale_factor[ch][sb] << (4 - (crc_pos & 0x7));
 
 			consumed += 4;
-			crc_pos += 4;
 		}
 	}
 
-	if (data[3] != sbc_crc8(crc_header, crc_pos))
+	/* The CRC covers data[1], data[2] and the bits following data[3] up
+	 * to the end of the scale factors */
+	crc = sbc_crc8_bytes(0x0f, data + 1, 2);
+	crc = sbc_crc8_bytes(crc, data + 4, (consumed - 32) / 8);
+	if (consumed % 8)
+		crc = sbc_crc8_bits(crc, data[consumed / 8], consumed % 8);
+
+	if (data[3] != crc)
 		return -3;
 
-	sbc_calculate_bits(frame, bits);
+	sbc_calculate_bits(frame, bits, cache);
 
 	for (ch = 0; ch < frame->channels; ch++) {
 		for (sb = 0; sb < frame->subbands; sb++)
@@ -538,116 +877,15 @@ static int sbc_unpack_frame(const uint8_t *data, struct sbc_frame *frame,
 static void sbc_decoder_init(struct sbc_decoder_state *state,
 					const struct sbc_frame *frame)
 {
-	int i, ch;
-
 	memset(state->V, 0, sizeof(state->V));
+	state->position[0] = state->position[1] = 0;
 	state->subbands = frame->subbands;
 
-	for (ch = 0; ch < 2; ch++)
-		for (i = 0; i < frame->subbands * 2; i++)
-			state->offset[ch][i] = (10 * i + 10);
-}
-
-static SBC_ALWAYS_INLINE int16_t sbc_clip16(int32_t s)
-{
-	if (s > 0x7FFF)
-		return 0x7FFF;
-	else if (s < -0x8000)
-		return -0x8000;
-	else
-		return s;
-}
-
-static inline void sbc_synthesize_four(struct sbc_decoder_state *state,
-				struct sbc_frame *frame, int ch, int blk)
-{
-	int i, k, idx;
-	int32_t *v = state->V[ch];
-	int *offset = state->offset[ch];
-
-	for (i = 0; i < 8; i++) {
-		/* Shifting */
-		offset[i]--;
-		if (offset[i] < 0) {
-			offset[i] = 79;
-			memcpy(v + 80, v, 9 * sizeof(*v));
-		}
-
-		/* Distribute the new matrix value to the shifted position */
-		v[offset[i]] = SCALE4_STAGED1(
-			MULA(synmatrix4[i][0], frame->sb_sample[blk][ch][0],
-			MULA(synmatrix4[i][1], frame->sb_sample[blk][ch][1],
-			MULA(synmatrix4[i][2], frame->sb_sample[blk][ch][2],
-			MUL (synmatrix4[i][3], frame->sb_sample[blk][ch][3])))));
-	}
-
-	/* Compute the samples */
-	for (idx = 0, i = 0; i < 4; i++, idx += 5) {
-		k = (i + 4) & 0xf;
-
-		/* Store in output, Q0 */
-		frame->pcm_sample[ch][blk * 4 + i] = sbc_clip16(SCALE4_STAGED1(
-			MULA(v[offset[i] + 0], sbc_proto_4_40m0[idx + 0],
-			MULA(v[offset[k] + 1], sbc_proto_4_40m1[idx + 0],
-			MULA(v[offset[i] + 2], sbc_proto_4_40m0[idx + 1],
-			MULA(v[offset[k] + 3], sbc_proto_4_40m1[idx + 1],
-			MULA(v[offset[i] + 4], sbc_proto_4_40m0[idx + 2],
-			MULA(v[offset[k] + 5], sbc_proto_4_40m1[idx + 2],
-			MULA(v[offset[i] + 6], sbc_proto_4_40m0[idx + 3],
-			MULA(v[offset[k] + 7], sbc_proto_4_40m1[idx + 3],
-			MULA(v[offset[i] + 8], sbc_proto_4_40m0[idx + 4],
-			MUL( v[offset[k] + 9], sbc_proto_4_40m1[idx + 4]))))))))))));
-	}
-}
-
-static inline void sbc_synthesize_eight(struct sbc_decoder_state *state,
-				struct sbc_frame *frame, int ch, int blk)
-{
-	int i, j, k, idx;
-	int *offset = state->offset[ch];
-
-	for (i = 0; i < 16; i++) {
-		/* Shifting */
-		offset[i]--;
-		if (offset[i] < 0) {
-			offset[i] = 159;
-			for (j = 0; j < 9; j++)
-				state->V[ch][j + 160] = state->V[ch][j];
-		}
-
-		/* Distribute the new matrix value to the shifted position */
-		state->V[ch][offset[i]] = SCALE8_STAGED1(
-			MULA(synmatrix8[i][0], frame->sb_sample[blk][ch][0],
-			MULA(synmatrix8[i][1], frame->sb_sample[blk][ch][1],
-			MULA(synmatrix8[i][2], frame->sb_sample[blk][ch][2],
-			MULA(synmatrix8[i][3], frame->sb_sample[blk][ch][3],
-			MULA(synmatrix8[i][4], frame->sb_sample[blk][ch][4],
-			MULA(synmatrix8[i][5], frame->sb_sample[blk][ch][5],
-			MULA(synmatrix8[i][6], frame->sb_sample[blk][ch][6],
-			MUL( synmatrix8[i][7], frame->sb_sample[blk][ch][7])))))))));
-	}
-
-	/* Compute the samples */
-	for (idx = 0, i = 0; i < 8; i++, idx += 5) {
-		k = (i + 8) & 0xf;
-
-		/* Store in output, Q0 */
-		frame->pcm_sample[ch][blk * 8 + i] = sbc_clip16(SCALE8_STAGED1(
-			MULA(state->V[ch][offset[i] + 0], sbc_proto_8_80m0[idx + 0],
-			MULA(state->V[ch][offset[k] + 1], sbc_proto_8_80m1[idx + 0],
-			MULA(state->V[ch][offset[i] + 2], sbc_proto_8_80m0[idx + 1],
-			MULA(state->V[ch][offset[k] + 3], sbc_proto_8_80m1[idx + 1],
-			MULA(state->V[ch][offset[i] + 4], sbc_proto_8_80m0[idx + 2],
-			MULA(state->V[ch][offset[k] + 5], sbc_proto_8_80m1[idx + 2],
-			MULA(state->V[ch][offset[i] + 6], sbc_proto_8_80m0[idx + 3],
-			MULA(state->V[ch][offset[k] + 7], sbc_proto_8_80m1[idx + 3],
-			MULA(state->V[ch][offset[i] + 8], sbc_proto_8_80m0[idx + 4],
-			MUL( state->V[ch][offset[k] + 9], sbc_proto_8_80m1[idx + 4]))))))))))));
-	}
+	sbc_init_decoder_primitives(state);
 }
 
 static int sbc_synthesize_audio(struct sbc_decoder_state *state,
-						struct sbc_frame *frame)
+				struct sbc_frame *frame, int16_t *pcm[2])
 {
 	int ch, blk;
 
@@ -655,14 +893,18 @@ static int sbc_synthesize_audio(struct sbc_decoder_state *state,
 	case 4:
 		for (ch = 0; ch < frame->channels; ch++) {
 			for (blk = 0; blk < frame->blocks; blk++)
-				sbc_synthesize_four(state, frame, ch, blk);
+				state->sbc_synthesize_4s(state, ch,
+					frame->sb_sample[blk][ch],
+					&pcm[ch][blk * 4]);
 		}
 		return frame->blocks * 4;
 
 	case 8:
 		for (ch = 0; ch < frame->channels; ch++) {
 			for (blk = 0; blk < frame->blocks; blk++)
-				sbc_synthesize_eight(state, frame, ch, blk);
+				state->sbc_synthesize_8s(state, ch,
+					frame->sb_sample[blk][ch],
+					&pcm[ch][blk * 8]);
 		}
 		return frame->blocks * 8;
 
@@ -715,17 +957,24 @@ static int sbc_analyze_audio(struct sbc_encoder_state *state,
 
 /* Supplementary bitstream writing macros for 'sbc_pack_frame' */
 
+/*
+ * The bitstream writer accumulates bits in a 64-bit cache and writes them
+ * out 32 bits at a time, n must not be larger than 32 and v must not have
+ * any bits set above the n lower ones
+ */
 #define PUT_BITS(data_ptr, bits_cache, bits_count, v, n)		\
 	do {								\
 		bits_cache = (v) | (bits_cache << (n));			\
 		bits_count += (n);					\
-		if (bits_count >= 16) {					\
-			bits_count -= 8;				\
-			*data_ptr++ = (uint8_t)				\
-				(bits_cache >> bits_count);		\
-			bits_count -= 8;				\
-			*data_ptr++ = (uint8_t)				\
-				(bits_cache >> bits_count);		\
+		if (bits_count >= 32) {					\
+			uint32_t word;					\
+			bits_count -= 32;				\
+			word = (uint32_t) (bits_cache >> bits_count);	\
+			data_ptr[0] = (uint8_t) (word >> 24);		\
+			data_ptr[1] = (uint8_t) (word >> 16);		\
+			data_ptr[2] = (uint8_t) (word >> 8);		\
+			data_ptr[3] = (uint8_t) word;			\
+			data_ptr += 4;					\
 		}							\
 	} while (0)
 
@@ -759,23 +1008,35 @@ static int sbc_analyze_audio(struct sbc_encoder_state *state,
 static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 					struct sbc_frame *frame, size_t len,
 					int frame_subbands, int frame_channels,
-					int joint)
+					int joint, struct sbc_bits_cache *cache)
 {
 	/* Bitstream writer starts from the fourth byte */
 	uint8_t *data_ptr = data + 4;
-	uint32_t bits_cache = 0;
+	uint64_t bits_cache = 0;
 	uint32_t bits_count = 0;
 
-	/* Will copy the header parts for CRC-8 calculation here */
-	uint8_t crc_header[11] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	int crc_pos = 0;
-
-	uint32_t audio_sample;
+	uint32_t crc_bits;
+	uint8_t crc;
 
 	int ch, sb, blk;	/* channel, subband, block and bit counters */
 	int bits[2][8];		/* bits distribution */
 	uint32_t levels[2][8];	/* levels are derived from that */
 	uint32_t sb_sample_delta[2][8];
+	uint32_t audio_sample[8];
+
+	/* Nothing is written unless the largest frame these parameters
+	 * can produce fits */
+	if (len < frame->length)
+		return -1;
+
+	if (frame->msbc) {
+		/* mSBC parameters are implied, the header bytes are reserved */
+		data[0] = MSBC_SYNCWORD;
+		data[1] = 0;
+		data[2] = 0;
+
+		goto header_done;
+	}
 
 	data[0] = SBC_SYNCWORD;
 
@@ -809,36 +1070,36 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 			frame->bitpool > frame_subbands << 5)
 		return -5;
 
+header_done:
 	/* Can't fill in crc yet */
 
-	crc_header[0] = data[1];
-	crc_header[1] = data[2];
-	crc_pos = 16;
-
-	if (frame->mode == JOINT_STEREO) {
+	if (frame->mode == JOINT_STEREO)
 		PUT_BITS(data_ptr, bits_cache, bits_count,
 			joint, frame_subbands);
-		crc_header[crc_pos >> 3] = joint;
-		crc_pos += frame_subbands;
-	}
 
 	for (ch = 0; ch < frame_channels; ch++) {
-		for (sb = 0; sb < frame_subbands; sb++) {
+		for (sb = 0; sb < frame_subbands; sb++)
 			PUT_BITS(data_ptr, bits_cache, bits_count,
 				frame->scale_factor[ch][sb] & 0x0F, 4);
-			crc_header[crc_pos >> 3] <<= 4;
-			crc_header[crc_pos >> 3] |= frame->scale_factor[ch][sb] & 0x0F;
-			crc_pos += 4;
-		}
 	}
 
-	/* align the last crc byte */
-	if (crc_pos % 8)
-		crc_header[crc_pos >> 3] <<= 8 - (crc_pos % 8);
+	/* The CRC covers data[1], data[2] and everything written so far,
+	 * including the bits still pending in the bits cache */
+	crc = sbc_crc8_bytes(0x0f, data + 1, 2);
+	crc = sbc_crc8_bytes(crc, data + 4, data_ptr - (data + 4));
 
-	data[3] = sbc_crc8(crc_header, crc_pos);
+	crc_bits = bits_count;
+	while (crc_bits >= 8) {
+		crc_bits -= 8;
+		crc = crc_table[0][crc ^ (uint8_t) (bits_cache >> crc_bits)];
+	}
+	if (crc_bits > 0)
+		crc = sbc_crc8_bits(crc,
+			(uint8_t) (bits_cache << (8 - crc_bits)), crc_bits);
 
-	sbc_calculate_bits(frame, bits);
+	data[3] = crc;
+
+	sbc_calculate_bits(frame, bits, cache);
 
 	for (ch = 0; ch < frame_channels; ch++) {
 		for (sb = 0; sb < frame_subbands; sb++) {
@@ -851,20 +1112,18 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 		}
 	}
 
+	/* Subbands without bits have zero levels, so they quantize to zero
+	 * and get packed as zero bits without any branching */
 	for (blk = 0; blk < frame->blocks; blk++) {
 		for (ch = 0; ch < frame_channels; ch++) {
-			for (sb = 0; sb < frame_subbands; sb++) {
-
-				if (bits[ch][sb] == 0)
-					continue;
-
-				audio_sample = ((uint64_t) levels[ch][sb] *
+			for (sb = 0; sb < frame_subbands; sb++)
+				audio_sample[sb] = ((uint64_t) levels[ch][sb] *
 					(sb_sample_delta[ch][sb] +
 					frame->sb_sample_f[blk][ch][sb])) >> 32;
 
+			for (sb = 0; sb < frame_subbands; sb++)
 				PUT_BITS(data_ptr, bits_cache, bits_count,
-					audio_sample, bits[ch][sb]);
-			}
+					audio_sample[sb], bits[ch][sb]);
 		}
 	}
 
@@ -874,22 +1133,22 @@ static SBC_ALWAYS_INLINE ssize_t sbc_pack_frame_internal(uint8_t *data,
 }
 
 static ssize_t sbc_pack_frame(uint8_t *data, struct sbc_frame *frame, size_t len,
-								int joint)
+				int joint, struct sbc_bits_cache *cache)
 {
 	if (frame->subbands == 4) {
 		if (frame->channels == 1)
 			return sbc_pack_frame_internal(
-				data, frame, len, 4, 1, joint);
+				data, frame, len, 4, 1, joint, cache);
 		else
 			return sbc_pack_frame_internal(
-				data, frame, len, 4, 2, joint);
+				data, frame, len, 4, 2, joint, cache);
 	} else {
 		if (frame->channels == 1)
 			return sbc_pack_frame_internal(
-				data, frame, len, 8, 1, joint);
+				data, frame, len, 8, 1, joint, cache);
 		else
 			return sbc_pack_frame_internal(
-				data, frame, len, 8, 2, joint);
+				data, frame, len, 8, 2, joint, cache);
 	}
 }
 
@@ -899,23 +1158,84 @@ static void sbc_encoder_init(struct sbc_encoder_state *state,
 	memset(&state->X, 0, sizeof(state->X));
 	state->position = (SBC_X_BUFFER_SIZE - frame->subbands * 9) & ~7;
 
-	sbc_init_primitives(state);
+	/* Only the generic code can analyze the odd block of mSBC frames */
+	if (frame->msbc)
+		sbc_init_primitives_generic(state);
+	else
+		sbc_init_primitives(state);
 }
 
+/*
+ * Encoder only instances (SBC_FLAG_ENCODER_ONLY) get just the part of this
+ * structure up to bits_cache, or up to dec_state when SBC_FLAG_BITS_CACHE
+ * is set as well, so keep the decoder only state at the end.
+ */
 struct sbc_priv {
 	int init;
+	int pooled;
+	size_t size;
 	struct SBC_ALIGNED sbc_frame frame;
-	struct SBC_ALIGNED sbc_decoder_state dec_state;
 	struct SBC_ALIGNED sbc_encoder_state enc_state;
+	int (*enc_process_input)(int position,
+			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
+			int nsamples, int nchannels);
+	/* The input reordering works on pairs of blocks, so with the odd
+	 * number of blocks in mSBC frames every other frame keeps its last
+	 * block back for the next one */
+	uint8_t msbc_carry[16];
+	int msbc_carried;
+	struct sbc_bits_cache bits_cache;
+	struct SBC_ALIGNED sbc_decoder_state dec_state;
 };
 
+#define SBC_HAS_BITS_CACHE(priv) \
+	((priv)->size > offsetof(struct sbc_priv, bits_cache))
+
+#define SBC_HAS_DECODER(priv) \
+	((priv)->size == sizeof(struct sbc_priv))
+
+#define SBC_BITS_CACHE(sbc, priv) \
+	((sbc)->flags & SBC_FLAG_BITS_CACHE && SBC_HAS_BITS_CACHE(priv) ? \
+						&(priv)->bits_cache : NULL)
+
+static size_t sbc_priv_size(unsigned long flags)
+{
+	if (!(flags & SBC_FLAG_ENCODER_ONLY))
+		return sizeof(struct sbc_priv);
+
+	if (flags & SBC_FLAG_BITS_CACHE)
+		return offsetof(struct sbc_priv, dec_state);
+
+	return offsetof(struct sbc_priv, bits_cache);
+}
+
+/* Clears the private state, keeping track of how it was allocated */
+static void sbc_priv_reset(struct sbc_priv *priv)
+{
+	size_t size = priv->size;
+	int pooled = priv->pooled;
+
+	memset(priv, 0, size);
+
+	priv->size = size;
+	priv->pooled = pooled;
+}
+
 static void sbc_set_defaults(sbc_t *sbc, unsigned long flags)
 {
+	sbc->flags = flags;
 	sbc->frequency = SBC_FREQ_44100;
 	sbc->mode = SBC_MODE_STEREO;
 	sbc->subbands = SBC_SB_8;
 	sbc->blocks = SBC_BLK_16;
 	sbc->bitpool = 32;
+
+	if (flags & SBC_FLAG_MSBC) {
+		sbc->frequency = SBC_FREQ_16000;
+		sbc->mode = SBC_MODE_MONO;
+		sbc->allocation = SBC_AM_LOUDNESS;
+		sbc->bitpool = MSBC_BITPOOL;
+	}
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 	sbc->endian = SBC_LE;
 #elif __BYTE_ORDER == __BIG_ENDIAN
@@ -927,43 +1247,89 @@ static void sbc_set_defaults(sbc_t *sbc, unsigned long flags)
 
 int sbc_init(sbc_t *sbc, unsigned long flags)
 {
+	struct sbc_priv *priv;
+	size_t size;
+
 	if (!sbc)
 		return -EIO;
 
 	memset(sbc, 0, sizeof(sbc_t));
 
-	sbc->priv_alloc_base = malloc(sizeof(struct sbc_priv) + SBC_ALIGN_MASK);
+	size = sbc_priv_size(flags);
+
+	sbc->priv_alloc_base = malloc(size + SBC_ALIGN_MASK);
 	if (!sbc->priv_alloc_base)
 		return -ENOMEM;
 
 	sbc->priv = (void *) (((uintptr_t) sbc->priv_alloc_base +
 			SBC_ALIGN_MASK) & ~((uintptr_t) SBC_ALIGN_MASK));
 
-	memset(sbc->priv, 0, sizeof(struct sbc_priv));
+	priv = sbc->priv;
+	priv->size = size;
+	priv->pooled = 0;
+	sbc_priv_reset(priv);
 
 	sbc_set_defaults(sbc, flags);
 
 	return 0;
 }
 
+int sbc_init_msbc(sbc_t *sbc, unsigned long flags)
+{
+	return sbc_init(sbc, flags | SBC_FLAG_MSBC);
+}
+
+int sbc_init_pool(sbc_t *sbc, unsigned int count, unsigned long flags)
+{
+	uint8_t *base;
+	size_t size;
+	unsigned int i;
+
+	if (!sbc || count == 0)
+		return -EIO;
+
+	memset(sbc, 0, sizeof(sbc_t) * count);
+
+	size = (sbc_priv_size(flags) + SBC_ALIGN_MASK) &
+						~((size_t) SBC_ALIGN_MASK);
+
+	sbc[0].priv_alloc_base = malloc(size * count + SBC_ALIGN_MASK);
+	if (!sbc[0].priv_alloc_base)
+		return -ENOMEM;
+
+	base = (void *) (((uintptr_t) sbc[0].priv_alloc_base +
+			SBC_ALIGN_MASK) & ~((uintptr_t) SBC_ALIGN_MASK));
+
+	for (i = 0; i < count; i++) {
+		struct sbc_priv *priv = (void *) (base + i * size);
+
+		priv->size = sbc_priv_size(flags);
+		priv->pooled = 1;
+		sbc_priv_reset(priv);
+
+		sbc[i].priv = priv;
+		sbc_set_defaults(&sbc[i], flags);
+	}
+
+	return 0;
+}
+
 ssize_t sbc_parse(sbc_t *sbc, const void *input, size_t input_len)
 {
 	return sbc_decode(sbc, input, input_len, NULL, 0, NULL);
 }
 
-ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
-			void *output, size_t output_len, size_t *written)
+static int sbc_decoder_unpack(sbc_t *sbc, struct sbc_priv *priv,
+				const void *input, size_t input_len)
 {
-	struct sbc_priv *priv;
-	char *ptr;
-	int i, ch, framelen, samples;
+	int framelen;
 
-	if (!sbc || !input)
+	/* encoder only instance */
+	if (!SBC_HAS_DECODER(priv))
 		return -EIO;
 
-	priv = sbc->priv;
-
-	framelen = sbc_unpack_frame(input, &priv->frame, input_len);
+	framelen = sbc_unpack_frame(input, &priv->frame, input_len,
+						SBC_BITS_CACHE(sbc, priv));
 
 	if (!priv->init) {
 		sbc_decoder_init(&priv->dec_state, &priv->frame);
@@ -976,6 +1342,9 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 		sbc->allocation = priv->frame.allocation;
 		sbc->bitpool = priv->frame.bitpool;
 
+		if (priv->frame.msbc)
+			sbc->flags |= SBC_FLAG_MSBC;
+
 		priv->frame.codesize = sbc_get_codesize(sbc);
 		priv->frame.length = framelen;
 	} else if (priv->frame.bitpool != sbc->bitpool) {
@@ -983,6 +1352,254 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 		sbc->bitpool = priv->frame.bitpool;
 	}
 
+	return framelen;
+}
+
+/* Largest possible frame: 8 subbands, 16 blocks, joint stereo, bitpool 256 */
+#define SBC_PARSER_MAX_FRAME	525
+
+/* Header, joint stereo flags and scale factors covered by the CRC */
+#define SBC_PARSER_MAX_HEADER	13
+
+struct sbc_parser_priv {
+	/* frame split across input chunks */
+	uint8_t buf[SBC_PARSER_MAX_FRAME];
+	size_t len;
+
+	/* bytes at the start of buf returned by the previous call */
+	size_t skip;
+};
+
+/*
+ * Checks the header and the CRC of the frame starting at data.
+ * Returns the frame length, 0 if more data is needed to tell or
+ * a negative value if data doesn't start with a valid frame.
+ */
+static int sbc_parser_check(const uint8_t *data, size_t len)
+{
+	int blocks, channels, subbands, bitpool, mode, crc_len, header_len;
+	int framelen;
+	uint8_t crc;
+
+	if (len < 1)
+		return 0;
+
+	if (data[0] != SBC_SYNCWORD)
+		return -2;
+
+	if (len < 3)
+		return 0;
+
+	blocks = 4 + ((data[1] >> 4) & 0x03) * 4;
+	mode = (data[1] >> 2) & 0x03;
+	channels = mode == SBC_MODE_MONO ? 1 : 2;
+	subbands = data[1] & 0x01 ? 8 : 4;
+	bitpool = data[2];
+
+	if ((mode == SBC_MODE_MONO || mode == SBC_MODE_DUAL_CHANNEL) &&
+			bitpool > 16 * subbands)
+		return -4;
+
+	if ((mode == SBC_MODE_STEREO || mode == SBC_MODE_JOINT_STEREO) &&
+			bitpool > 32 * subbands)
+		return -4;
+
+	/* bits following the crc field that the crc is computed over */
+	crc_len = 4 * subbands * channels;
+	if (mode == SBC_MODE_JOINT_STEREO)
+		crc_len += subbands;
+
+	header_len = 4 + (crc_len + 7) / 8;
+	if (len < (size_t) header_len)
+		return 0;
+
+	crc = sbc_crc8_bytes(0x0f, data + 1, 2);
+	crc = sbc_crc8_bytes(crc, data + 4, crc_len / 8);
+	if (crc_len % 8)
+		crc = sbc_crc8_bits(crc, data[4 + crc_len / 8], crc_len % 8);
+
+	if (data[3] != crc)
+		return -3;
+
+	framelen = 4 + (4 * subbands * channels) / 8;
+	if (mode == SBC_MODE_MONO || mode == SBC_MODE_DUAL_CHANNEL)
+		framelen += (blocks * channels * bitpool + 7) / 8;
+	else
+		framelen += ((mode == SBC_MODE_JOINT_STEREO ? subbands : 0) +
+					blocks * bitpool + 7) / 8;
+
+	return framelen;
+}
+
+int sbc_parser_init(sbc_parser_t *parser)
+{
+	if (!parser)
+		return -EIO;
+
+	memset(parser, 0, sizeof(sbc_parser_t));
+
+	parser->priv = malloc(sizeof(struct sbc_parser_priv));
+	if (!parser->priv)
+		return -ENOMEM;
+
+	memset(parser->priv, 0, sizeof(struct sbc_parser_priv));
+
+	return 0;
+}
+
+void sbc_parser_reset(sbc_parser_t *parser)
+{
+	struct sbc_parser_priv *priv;
+
+	if (!parser || !parser->priv)
+		return;
+
+	priv = parser->priv;
+
+	parser->dropped += priv->len - priv->skip;
+
+	priv->len = 0;
+	priv->skip = 0;
+}
+
+void sbc_parser_finish(sbc_parser_t *parser)
+{
+	if (!parser)
+		return;
+
+	free(parser->priv);
+
+	memset(parser, 0, sizeof(sbc_parser_t));
+}
+
+/* Drops the first byte of the buffered data and resyncs on the next
+ * syncword within it */
+static void sbc_parser_drop(sbc_parser_t *parser, struct sbc_parser_priv *priv)
+{
+	uint8_t *sync;
+	size_t skip;
+
+	sync = memchr(priv->buf + 1, SBC_SYNCWORD, priv->len - 1);
+	skip = sync ? (size_t) (sync - priv->buf) : priv->len;
+
+	memmove(priv->buf, priv->buf + skip, priv->len - skip);
+	priv->len -= skip;
+	parser->dropped += skip;
+}
+
+ssize_t sbc_parser_feed(sbc_parser_t *parser, const void *input,
+			size_t input_len, const void **frame, size_t *frame_len)
+{
+	struct sbc_parser_priv *priv;
+	const uint8_t *data = input;
+	const uint8_t *sync;
+	size_t offset = 0, want, n;
+	int framelen;
+
+	if (!parser || !parser->priv || !frame || (!input && input_len))
+		return -EIO;
+
+	priv = parser->priv;
+
+	*frame = NULL;
+	if (frame_len)
+		*frame_len = 0;
+
+	if (priv->skip > 0) {
+		memmove(priv->buf, priv->buf + priv->skip,
+						priv->len - priv->skip);
+		priv->len -= priv->skip;
+		priv->skip = 0;
+	}
+
+	/* Complete a frame split across chunks, copying only what is
+	 * needed to validate it */
+	while (priv->len > 0) {
+		framelen = sbc_parser_check(priv->buf, priv->len);
+		if (framelen < 0) {
+			sbc_parser_drop(parser, priv);
+			continue;
+		}
+
+		if (framelen > 0 && (size_t) framelen <= priv->len) {
+			priv->skip = framelen;
+			parser->frames++;
+
+			*frame = priv->buf;
+			if (frame_len)
+				*frame_len = framelen;
+
+			return offset;
+		}
+
+		if (framelen > 0)
+			want = framelen;
+		else
+			want = SBC_PARSER_MAX_HEADER;
+
+		n = want - priv->len;
+		if (n > input_len - offset)
+			n = input_len - offset;
+
+		if (n == 0)
+			return offset;
+
+		memcpy(priv->buf + priv->len, data + offset, n);
+		priv->len += n;
+		offset += n;
+	}
+
+	while (offset < input_len) {
+		sync = memchr(data + offset, SBC_SYNCWORD, input_len - offset);
+		if (!sync) {
+			parser->dropped += input_len - offset;
+			return input_len;
+		}
+
+		parser->dropped += sync - (data + offset);
+		offset = sync - data;
+
+		framelen = sbc_parser_check(sync, input_len - offset);
+		if (framelen < 0) {
+			parser->dropped++;
+			offset++;
+			continue;
+		}
+
+		if (framelen == 0 || (size_t) framelen > input_len - offset) {
+			/* keep the partial frame for the next chunk */
+			memcpy(priv->buf, sync, input_len - offset);
+			priv->len = input_len - offset;
+			return input_len;
+		}
+
+		parser->frames++;
+
+		*frame = sync;
+		if (frame_len)
+			*frame_len = framelen;
+
+		return offset + framelen;
+	}
+
+	return offset;
+}
+
+ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, size_t *written)
+{
+	struct sbc_priv *priv;
+	int16_t *pcm[2];
+	char *ptr;
+	int i, ch, framelen, samples;
+
+	if (!sbc || !input)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	framelen = sbc_decoder_unpack(sbc, priv, input, input_len);
+
 	if (!output)
 		return framelen;
 
@@ -992,7 +1609,10 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 	if (framelen <= 0)
 		return framelen;
 
-	samples = sbc_synthesize_audio(&priv->dec_state, &priv->frame);
+	pcm[0] = priv->frame.pcm_sample[0];
+	pcm[1] = priv->frame.pcm_sample[1];
+
+	samples = sbc_synthesize_audio(&priv->dec_state, &priv->frame, pcm);
 
 	ptr = output;
 
@@ -1020,23 +1640,123 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 	return framelen;
 }
 
-ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
-			void *output, size_t output_len, ssize_t *written)
+ssize_t sbc_decode_planar(sbc_t *sbc, const void *input, size_t input_len,
+			int16_t *output[2], size_t output_samples,
+			size_t *samples)
 {
 	struct sbc_priv *priv;
-	int samples;
-	ssize_t framelen;
-	int (*sbc_enc_process_input)(int position,
-			const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
-			int nsamples, int nchannels);
+	int16_t *pcm[2];
+	int framelen, ch, nsamples;
 
-	if (!sbc || !input)
+	if (!sbc || !input || !output)
 		return -EIO;
 
 	priv = sbc->priv;
 
-	if (written)
-		*written = 0;
+	if (samples)
+		*samples = 0;
+
+	framelen = sbc_decoder_unpack(sbc, priv, input, input_len);
+	if (framelen <= 0)
+		return framelen;
+
+	nsamples = priv->frame.blocks * priv->frame.subbands;
+	if (output_samples < (size_t) nsamples)
+		return -ENOSPC;
+
+	for (ch = 0; ch < priv->frame.channels; ch++) {
+		if (!output[ch])
+			return -EIO;
+		pcm[ch] = output[ch];
+	}
+
+	nsamples = sbc_synthesize_audio(&priv->dec_state, &priv->frame, pcm);
+	if (nsamples < 0)
+		return nsamples;
+
+	if (samples)
+		*samples = nsamples;
+
+	return framelen;
+}
+
+static uint8_t sbc_get_blocks(sbc_t *sbc)
+{
+	if (sbc->flags & SBC_FLAG_MSBC)
+		return MSBC_BLOCKS;
+
+	return 4 + (sbc->blocks * 4);
+}
+
+/*
+ * mSBC frames are always mono with 8 subbands and 15 blocks. The input
+ * reordering and the analysis filter constants work on pairs of blocks,
+ * so the input is fed as 8 pairs and 7 pairs plus a carried block in
+ * turns, and the blocks are then analyzed one at a time.
+ */
+static int sbc_analyze_msbc(struct sbc_priv *priv, const uint8_t *input)
+{
+	struct sbc_encoder_state *state = &priv->enc_state;
+	int nsamples, oldest, blk;
+
+	nsamples = MSBC_BLOCKS * 8 + (priv->msbc_carried ? 8 : -8);
+
+	/* Keep the history needed for the oldest block, which is one block
+	 * more than the input reordering itself preserves */
+	if (state->position < nsamples) {
+		memmove(&state->X[0][SBC_X_BUFFER_SIZE - 80],
+				&state->X[0][state->position],
+				80 * sizeof(int16_t));
+		state->position = SBC_X_BUFFER_SIZE - 80;
+	}
+
+	if (priv->msbc_carried) {
+		uint8_t pair[32];
+
+		memcpy(pair, priv->msbc_carry, 16);
+		memcpy(pair + 16, input, 16);
+
+		state->position = priv->enc_process_input(state->position,
+						pair, state->X, 16, 1);
+		state->position = priv->enc_process_input(state->position,
+						input + 16, state->X, 112, 1);
+
+		priv->msbc_carried = 0;
+
+		/* The newest block stays for the next frame */
+		oldest = MSBC_BLOCKS;
+	} else {
+		state->position = priv->enc_process_input(state->position,
+						input, state->X, 112, 1);
+
+		memcpy(priv->msbc_carry, input + 224, 16);
+		priv->msbc_carried = 1;
+
+		oldest = MSBC_BLOCKS - 1;
+	}
+
+	/* Blocks are addressed by their age, the newest one being 0 */
+	for (blk = 0; blk < MSBC_BLOCKS; blk++) {
+		int age = oldest - blk;
+		int16_t *x = &state->X[0][state->position + age * 8];
+
+		state->sbc_analyze_1b_8s(x, priv->frame.sb_sample_f[blk][0],
+								age & 1);
+	}
+
+	return MSBC_BLOCKS * 8;
+}
+
+static void sbc_encoder_prepare(sbc_t *sbc, struct sbc_priv *priv)
+{
+	/* None of the mSBC parameters is carried in the frame header */
+	if (sbc->flags & SBC_FLAG_MSBC) {
+		sbc->frequency = SBC_FREQ_16000;
+		sbc->mode = SBC_MODE_MONO;
+		sbc->subbands = SBC_SB_8;
+		sbc->allocation = SBC_AM_LOUDNESS;
+		sbc->bitpool = MSBC_BITPOOL;
+	}
 
 	if (!priv->init) {
 		priv->frame.frequency = sbc->frequency;
@@ -1046,10 +1766,16 @@ ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 		priv->frame.subband_mode = sbc->subbands;
 		priv->frame.subbands = sbc->subbands ? 8 : 4;
 		priv->frame.block_mode = sbc->blocks;
-		priv->frame.blocks = 4 + (sbc->blocks * 4);
+		priv->frame.blocks = sbc_get_blocks(sbc);
 		priv->frame.bitpool = sbc->bitpool;
 		priv->frame.codesize = sbc_get_codesize(sbc);
 		priv->frame.length = sbc_get_frame_length(sbc);
+		priv->frame.msbc = sbc->flags & SBC_FLAG_MSBC ? 1 : 0;
+
+		/* Start with one block of silence held back, the encoder
+		 * output lags the input by that block */
+		memset(priv->msbc_carry, 0, sizeof(priv->msbc_carry));
+		priv->msbc_carried = 1;
 
 		sbc_encoder_init(&priv->enc_state, &priv->frame);
 		priv->init = 1;
@@ -1058,67 +1784,186 @@ ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 		priv->frame.bitpool = sbc->bitpool;
 	}
 
-	/* input must be large enough to encode a complete frame */
-	if (input_len < priv->frame.codesize)
-		return 0;
-
-	/* output must be large enough to receive the encoded frame */
-	if (!output || output_len < priv->frame.length)
-		return -ENOSPC;
-
-	/* Select the needed input data processing function and call it */
+	/* Select the needed input data processing function */
 	if (priv->frame.subbands == 8) {
 		if (sbc->endian == SBC_BE)
-			sbc_enc_process_input =
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_8s_be;
 		else
-			sbc_enc_process_input =
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_8s_le;
 	} else {
 		if (sbc->endian == SBC_BE)
-			sbc_enc_process_input =
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_4s_be;
 		else
-			sbc_enc_process_input =
+			priv->enc_process_input =
 				priv->enc_state.sbc_enc_process_input_4s_le;
 	}
+}
 
-	priv->enc_state.position = sbc_enc_process_input(
-		priv->enc_state.position, (const uint8_t *) input,
-		priv->enc_state.X, priv->frame.subbands * priv->frame.blocks,
-		priv->frame.channels);
+/*
+ * Encodes one frame, the caller is responsible for checking that input
+ * and output buffers are large enough. Returns the number of samples
+ * consumed and stores the length of the packed frame in framelen.
+ */
+static int sbc_encode_frame(sbc_t *sbc, struct sbc_priv *priv,
+				const uint8_t *input, uint8_t *output,
+				size_t output_len, ssize_t *framelen)
+{
+	int samples;
+
+	if (priv->frame.msbc)
+		samples = sbc_analyze_msbc(priv, input);
+	else {
+		priv->enc_state.position = priv->enc_process_input(
+			priv->enc_state.position, input,
+			priv->enc_state.X,
+			priv->frame.subbands * priv->frame.blocks,
+			priv->frame.channels);
 
-	samples = sbc_analyze_audio(&priv->enc_state, &priv->frame);
+		samples = sbc_analyze_audio(&priv->enc_state, &priv->frame);
+	}
 
 	if (priv->frame.mode == JOINT_STEREO) {
 		int j = priv->enc_state.sbc_calc_scalefactors_j(
 			priv->frame.sb_sample_f, priv->frame.scale_factor,
 			priv->frame.blocks, priv->frame.subbands);
-		framelen = sbc_pack_frame(output, &priv->frame, output_len, j);
+		*framelen = sbc_pack_frame(output, &priv->frame, output_len, j,
+						SBC_BITS_CACHE(sbc, priv));
 	} else {
 		priv->enc_state.sbc_calc_scalefactors(
 			priv->frame.sb_sample_f, priv->frame.scale_factor,
 			priv->frame.blocks, priv->frame.channels,
 			priv->frame.subbands);
-		framelen = sbc_pack_frame(output, &priv->frame, output_len, 0);
+		*framelen = sbc_pack_frame(output, &priv->frame, output_len, 0,
+						SBC_BITS_CACHE(sbc, priv));
 	}
 
+	return samples;
+}
+
+ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, ssize_t *written)
+{
+	struct sbc_priv *priv;
+	int samples;
+	ssize_t framelen;
+
+	if (!sbc || !input)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (written)
+		*written = 0;
+
+	sbc_encoder_prepare(sbc, priv);
+
+	/* input must be large enough to encode a complete frame */
+	if (input_len < priv->frame.codesize)
+		return 0;
+
+	/* output must be large enough to receive the encoded frame */
+	if (!output || output_len < priv->frame.length)
+		return -ENOSPC;
+
+	samples = sbc_encode_frame(sbc, priv, input, output, output_len,
+								&framelen);
+
 	if (written)
 		*written = framelen;
 
 	return samples * priv->frame.channels * 2;
 }
 
+ssize_t sbc_encode_frames(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, size_t *frames,
+			size_t *written)
+{
+	struct sbc_priv *priv;
+	const uint8_t *in = input;
+	uint8_t *out = output;
+	size_t count, n;
+	ssize_t framelen;
+
+	if (!sbc || !input)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (frames)
+		*frames = 0;
+
+	if (written)
+		*written = 0;
+
+	sbc_encoder_prepare(sbc, priv);
+
+	/* input must be large enough to encode a complete frame */
+	if (input_len < priv->frame.codesize)
+		return 0;
+
+	/* output must be large enough to receive the encoded frame */
+	if (!output || output_len < priv->frame.length)
+		return -ENOSPC;
+
+	count = input_len / priv->frame.codesize;
+	if (count > output_len / priv->frame.length)
+		count = output_len / priv->frame.length;
+
+	for (n = 0; n < count; n++) {
+		/* the input is analyzed before the frame gets packed, never
+		 * start one that does not fit in what is left */
+		if (output_len < priv->frame.length)
+			break;
+
+		sbc_encode_frame(sbc, priv, in, out, output_len, &framelen);
+		if (framelen < 0) {
+			if (n == 0)
+				return framelen;
+			break;
+		}
+
+		in += priv->frame.codesize;
+		out += framelen;
+		output_len -= framelen;
+	}
+
+	if (frames)
+		*frames = n;
+
+	if (written)
+		*written = out - (uint8_t *) output;
+
+	return in - (const uint8_t *) input;
+}
+
 void sbc_finish(sbc_t *sbc)
 {
+	struct sbc_priv *priv;
+
 	if (!sbc)
 		return;
 
-	free(sbc->priv_alloc_base);
+	/* pooled state is released by sbc_finish_pool() */
+	priv = sbc->priv;
+	if (!priv || !priv->pooled)
+		free(sbc->priv_alloc_base);
 
 	memset(sbc, 0, sizeof(sbc_t));
 }
 
+void sbc_finish_pool(sbc_t *sbc, unsigned int count)
+{
+	if (!sbc || count == 0)
+		return;
+
+	free(sbc[0].priv_alloc_base);
+
+	memset(sbc, 0, sizeof(sbc_t) * count);
+}
+
 size_t sbc_get_frame_length(sbc_t *sbc)
 {
 	int ret;
@@ -1130,14 +1975,14 @@ size_t sbc_get_frame_length(sbc_t *sbc)
 		return priv->frame.length;
 
 	subbands = sbc->subbands ? 8 : 4;
-	blocks = 4 + (sbc->blocks * 4);
+	blocks = sbc_get_blocks(sbc);
 	channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
 	joint = sbc->mode == SBC_MODE_JOINT_STEREO ? 1 : 0;
 	bitpool = sbc->bitpool;
 
 	ret = 4 + (4 * subbands * channels) / 8;
 	/* This term is not always evenly divide so we round it up */
-	if (channels == 1)
+	if (channels == 1 || sbc->mode == SBC_MODE_DUAL_CHANNEL)
 		ret += ((blocks * channels * bitpool) + 7) / 8;
 	else
 		ret += (((joint ? subbands : 0) + blocks * bitpool) + 7) / 8;
@@ -1154,7 +1999,7 @@ unsigned sbc_get_frame_duration(sbc_t *sbc)
 	priv = sbc->priv;
 	if (!priv->init) {
 		subbands = sbc->subbands ? 8 : 4;
-		blocks = 4 + (sbc->blocks * 4);
+		blocks = sbc_get_blocks(sbc);
 	} else {
 		subbands = priv->frame.subbands;
 		blocks = priv->frame.blocks;
@@ -1191,7 +2036,7 @@ size_t sbc_get_codesize(sbc_t *sbc)
 	priv = sbc->priv;
 	if (!priv->init) {
 		subbands = sbc->subbands ? 8 : 4;
-		blocks = 4 + (sbc->blocks * 4);
+		blocks = sbc_get_blocks(sbc);
 		channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
 	} else {
 		subbands = priv->frame.subbands;
@@ -1216,6 +2061,32 @@ const char *sbc_get_implementation_info(sbc_t *sbc)
 	return priv->enc_state.implementation_info;
 }
 
+int sbc_get_bits_cache_stats(sbc_t *sbc, unsigned long *hits,
+						unsigned long *misses)
+{
+	struct sbc_priv *priv;
+
+	if (!sbc || !sbc->priv)
+		return -EIO;
+
+	priv = sbc->priv;
+
+	if (!SBC_HAS_BITS_CACHE(priv)) {
+		if (hits)
+			*hits = 0;
+		if (misses)
+			*misses = 0;
+		return 0;
+	}
+
+	if (hits)
+		*hits = priv->bits_cache.hits;
+	if (misses)
+		*misses = priv->bits_cache.misses;
+
+	return 0;
+}
+
 int sbc_reinit(sbc_t *sbc, unsigned long flags)
 {
 	struct sbc_priv *priv;
@@ -1225,8 +2096,32 @@ int sbc_reinit(sbc_t *sbc, unsigned long flags)
 
 	priv = sbc->priv;
 
-	if (priv->init == 1)
-		memset(sbc->priv, 0, sizeof(struct sbc_priv));
+	/* Only grow the allocation when the new flags need more state */
+	if (sbc_priv_size(flags) > priv->size) {
+		void *base;
+		size_t size;
+
+		if (priv->pooled)
+			return -EINVAL;
+
+		size = sbc_priv_size(flags);
+
+		base = malloc(size + SBC_ALIGN_MASK);
+		if (!base)
+			return -ENOMEM;
+
+		free(sbc->priv_alloc_base);
+
+		sbc->priv_alloc_base = base;
+		sbc->priv = (void *) (((uintptr_t) base + SBC_ALIGN_MASK) &
+					~((uintptr_t) SBC_ALIGN_MASK));
+
+		priv = sbc->priv;
+		priv->size = size;
+		priv->pooled = 0;
+		sbc_priv_reset(priv);
+	} else if (priv->init == 1)
+		sbc_priv_reset(priv);
 
 	sbc_set_defaults(sbc, flags);
 
@@ -64,6 +64,11 @@ extern "C" {
 #define SBC_LE			0x00
 #define SBC_BE			0x01
 
+/* flags */
+#define SBC_FLAG_BITS_CACHE	0x01	/* cache bit allocation results */
+#define SBC_FLAG_ENCODER_ONLY	0x02	/* no decoder state is allocated */
+#define SBC_FLAG_MSBC		0x04	/* mSBC frames, see sbc_init_msbc() */
+
 struct sbc_struct {
 	unsigned long flags;
 
@@ -81,19 +86,66 @@ struct sbc_struct {
 
 typedef struct sbc_struct sbc_t;
 
+struct sbc_parser_struct {
+	/* valid frames found and bytes skipped while resynchronizing */
+	unsigned long frames;
+	unsigned long dropped;
+
+	void *priv;
+};
+
+typedef struct sbc_parser_struct sbc_parser_t;
+
 int sbc_init(sbc_t *sbc, unsigned long flags);
 int sbc_reinit(sbc_t *sbc, unsigned long flags);
 
+/* Initializes an instance for the mSBC frames used by HFP wideband speech:
+ * 16 kHz mono, 8 subbands, 15 blocks, loudness allocation and bitpool 26
+ * with a 0xAD syncword header. The parameters are fixed, the H2 header of
+ * the SCO packets is left to the caller. */
+int sbc_init_msbc(sbc_t *sbc, unsigned long flags);
+
+/* Initializes count instances sharing a single allocation, meant to be
+ * used with SBC_FLAG_ENCODER_ONLY for many concurrent encoders. These must
+ * be released together with sbc_finish_pool() */
+int sbc_init_pool(sbc_t *sbc, unsigned int count, unsigned long flags);
+void sbc_finish_pool(sbc_t *sbc, unsigned int count);
+
 ssize_t sbc_parse(sbc_t *sbc, const void *input, size_t input_len);
 
 /* Decodes ONE input block into ONE output block */
 ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 			void *output, size_t output_len, size_t *written);
 
+/* Decodes ONE input block straight into native endian per channel buffers,
+ * each of which must hold at least one frame worth of samples */
+ssize_t sbc_decode_planar(sbc_t *sbc, const void *input, size_t input_len,
+			int16_t *output[2], size_t output_samples,
+			size_t *samples);
+
 /* Encodes ONE input block into ONE output block */
 ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 			void *output, size_t output_len, ssize_t *written);
 
+/* Encodes as many complete input blocks as fit into the output buffer,
+ * returns the number of input bytes consumed */
+ssize_t sbc_encode_frames(sbc_t *sbc, const void *input, size_t input_len,
+			void *output, size_t output_len, size_t *frames,
+			size_t *written);
+
+int sbc_parser_init(sbc_parser_t *parser);
+void sbc_parser_reset(sbc_parser_t *parser);
+void sbc_parser_finish(sbc_parser_t *parser);
+
+/* Scans input for the next frame with a valid header and CRC, returns the
+ * number of input bytes consumed. When a frame is found *frame points at
+ * it, either inside input or inside the parser for frames split across
+ * chunks, and stays valid until the next call. Otherwise *frame is NULL
+ * and all of input has been consumed. */
+ssize_t sbc_parser_feed(sbc_parser_t *parser, const void *input,
+			size_t input_len, const void **frame,
+			size_t *frame_len);
+
 /* Returns the output block size in bytes */
 size_t sbc_get_frame_length(sbc_t *sbc);
 
@@ -104,6 +156,11 @@ unsigned sbc_get_frame_duration(sbc_t *sbc);
 size_t sbc_get_codesize(sbc_t *sbc);
 
 const char *sbc_get_implementation_info(sbc_t *sbc);
+
+/* Returns the bit allocation cache counters, see SBC_FLAG_BITS_CACHE */
+int sbc_get_bits_cache_stats(sbc_t *sbc, unsigned long *hits,
+						unsigned long *misses);
+
 void sbc_finish(sbc_t *sbc);
 
 #ifdef __cplusplus
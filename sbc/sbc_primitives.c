@@ -33,6 +33,7 @@
 
 #include "sbc_primitives.h"
 #include "sbc_primitives_mmx.h"
+#include "sbc_primitives_sse.h"
 #include "sbc_primitives_iwmmxt.h"
 #include "sbc_primitives_neon.h"
 #include "sbc_primitives_armv6.h"
@@ -209,6 +210,12 @@ static inline void sbc_analyze_4b_8s_simd(int16_t *x,
 	sbc_analyze_eight_simd(x + 0, out, analysis_consts_fixed8_simd_even);
 }
 
+static void sbc_analyze_1b_8s_simd(int16_t *x, int32_t *out, int odd)
+{
+	sbc_analyze_eight_simd(x, out, odd ? analysis_consts_fixed8_simd_odd :
+					analysis_consts_fixed8_simd_even);
+}
+
 static inline int16_t unaligned16_be(const uint8_t *ptr)
 {
 	return (int16_t) ((ptr[0] << 8) | ptr[1]);
@@ -516,14 +523,94 @@ static int sbc_calc_scalefactors_j(
 	return joint;
 }
 
+static SBC_ALWAYS_INLINE int16_t sbc_clip16(int32_t s)
+{
+	if (s > 0x7FFF)
+		return 0x7FFF;
+	else if (s < -0x8000)
+		return -0x8000;
+	else
+		return s;
+}
+
+/*
+ * A reference C code of the synthesis filter. The history of the
+ * matrixing outputs is kept as a sequence of whole vectors (instead of
+ * per-row circular buffers), which allows to load the data for several
+ * output samples at once in platform specific SIMD optimizations.
+ */
+
+static void sbc_synthesize_4s(struct sbc_decoder_state *state, int ch,
+				const int32_t *sb_sample, int16_t *pcm)
+{
+	int i, j, pos;
+	int32_t t;
+	int32_t (*v)[16] = state->V[ch];
+
+	/* Shifting */
+	pos = state->position[ch] = state->position[ch] > 0 ?
+					state->position[ch] - 1 : 9;
+
+	/* Matrixing, the new vector is stored twice */
+	for (i = 0; i < 8; i++) {
+		t = MUL(synmatrix4[i][0], sb_sample[0]);
+		for (j = 1; j < 4; j++)
+			t = MULA(synmatrix4[i][j], sb_sample[j], t);
+		v[pos][i] = v[pos + 10][i] = SCALE4_STAGED1(t);
+	}
+
+	/* Compute the samples, Q0 */
+	for (i = 0; i < 4; i++) {
+		t = 0;
+		for (j = 0; j < 10; j += 2) {
+			t = MULA(v[pos + j][i], sbc_proto_4_40_simd[j][i], t);
+			t = MULA(v[pos + j + 1][i + 4],
+					sbc_proto_4_40_simd[j + 1][i], t);
+		}
+		pcm[i] = sbc_clip16(SCALE4_STAGED1(t));
+	}
+}
+
+static void sbc_synthesize_8s(struct sbc_decoder_state *state, int ch,
+				const int32_t *sb_sample, int16_t *pcm)
+{
+	int i, j, pos;
+	int32_t t;
+	int32_t (*v)[16] = state->V[ch];
+
+	/* Shifting */
+	pos = state->position[ch] = state->position[ch] > 0 ?
+					state->position[ch] - 1 : 9;
+
+	/* Matrixing, the new vector is stored twice */
+	for (i = 0; i < 16; i++) {
+		t = MUL(synmatrix8[i][0], sb_sample[0]);
+		for (j = 1; j < 8; j++)
+			t = MULA(synmatrix8[i][j], sb_sample[j], t);
+		v[pos][i] = v[pos + 10][i] = SCALE8_STAGED1(t);
+	}
+
+	/* Compute the samples, Q0 */
+	for (i = 0; i < 8; i++) {
+		t = 0;
+		for (j = 0; j < 10; j += 2) {
+			t = MULA(v[pos + j][i], sbc_proto_8_80_simd[j][i], t);
+			t = MULA(v[pos + j + 1][i + 8],
+					sbc_proto_8_80_simd[j + 1][i], t);
+		}
+		pcm[i] = sbc_clip16(SCALE8_STAGED1(t));
+	}
+}
+
 /*
  * Detect CPU features and setup function pointers
  */
-void sbc_init_primitives(struct sbc_encoder_state *state)
+void sbc_init_primitives_generic(struct sbc_encoder_state *state)
 {
 	/* Default implementation for analyze functions */
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_simd;
 	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_simd;
+	state->sbc_analyze_1b_8s = sbc_analyze_1b_8s_simd;
 
 	/* Default implementation for input reordering / deinterleaving */
 	state->sbc_enc_process_input_4s_le = sbc_enc_process_input_4s_le;
@@ -535,11 +622,19 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	state->sbc_calc_scalefactors = sbc_calc_scalefactors;
 	state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j;
 	state->implementation_info = "Generic C";
+}
+
+void sbc_init_primitives(struct sbc_encoder_state *state)
+{
+	sbc_init_primitives_generic(state);
 
 	/* X86/AMD64 optimizations */
 #ifdef SBC_BUILD_WITH_MMX_SUPPORT
 	sbc_init_primitives_mmx(state);
 #endif
+#ifdef SBC_BUILD_WITH_SSE_SUPPORT
+	sbc_init_primitives_sse(state);
+#endif
 
 	/* ARM optimizations */
 #ifdef SBC_BUILD_WITH_ARMV6_SUPPORT
@@ -552,3 +647,26 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	sbc_init_primitives_neon(state);
 #endif
 }
+
+void sbc_init_decoder_primitives_generic(struct sbc_decoder_state *state)
+{
+	/* Default implementation for synthesis functions */
+	state->sbc_synthesize_4s = sbc_synthesize_4s;
+	state->sbc_synthesize_8s = sbc_synthesize_8s;
+	state->implementation_info = "Generic C";
+}
+
+void sbc_init_decoder_primitives(struct sbc_decoder_state *state)
+{
+	sbc_init_decoder_primitives_generic(state);
+
+	/* X86/AMD64 optimizations */
+#ifdef SBC_BUILD_WITH_SSE_SUPPORT
+	sbc_init_decoder_primitives_sse(state);
+#endif
+
+	/* ARM optimizations */
+#ifdef SBC_BUILD_WITH_NEON_SUPPORT
+	sbc_init_decoder_primitives_neon(state);
+#endif
+}
@@ -45,6 +45,10 @@ struct sbc_encoder_state {
 	/* Polyphase analysis filter for 8 subbands configuration,
 	 * it handles 4 blocks at once */
 	void (*sbc_analyze_4b_8s)(int16_t *x, int32_t *out, int out_stride);
+	/* Single block variant for 8 subbands, needed by the 15 blocks of
+	 * mSBC frames. Only the generic C code provides it, so instances
+	 * using it stick to the generic X layout too */
+	void (*sbc_analyze_1b_8s)(int16_t *x, int32_t *out, int odd);
 	/* Process input data (deinterleave, endian conversion, reordering),
 	 * depending on the number of subbands and input data byte order */
 	int (*sbc_enc_process_input_4s_le)(int position,
@@ -70,11 +74,39 @@ struct sbc_encoder_state {
 	const char *implementation_info;
 };
 
+struct sbc_decoder_state {
+	int subbands;
+	/* Index of the newest vector in the synthesis filter history */
+	int position[2];
+	/* Synthesis filter history, the last 10 vectors produced by the
+	 * matrixing step are stored twice, so that a complete window is
+	 * always available starting at "position" without wraparound */
+	int32_t SBC_ALIGNED V[2][20][16];
+	/* Polyphase synthesis filter for 4 subbands configuration,
+	 * it handles one block of one channel */
+	void (*sbc_synthesize_4s)(struct sbc_decoder_state *state, int ch,
+			const int32_t *sb_sample, int16_t *pcm);
+	/* Polyphase synthesis filter for 8 subbands configuration,
+	 * it handles one block of one channel */
+	void (*sbc_synthesize_8s)(struct sbc_decoder_state *state, int ch,
+			const int32_t *sb_sample, int16_t *pcm);
+	const char *implementation_info;
+};
+
 /*
  * Initialize pointers to the functions which are the basic "building bricks"
  * of SBC codec. Best implementation is selected based on target CPU
  * capabilities.
  */
 void sbc_init_primitives(struct sbc_encoder_state *encoder_state);
+void sbc_init_decoder_primitives(struct sbc_decoder_state *decoder_state);
+
+/*
+ * Initialize pointers to the reference C implementation only, this is
+ * useful for testing and benchmarking of the platform specific code.
+ */
+void sbc_init_primitives_generic(struct sbc_encoder_state *encoder_state);
+void sbc_init_decoder_primitives_generic(
+				struct sbc_decoder_state *decoder_state);
 
 #endif
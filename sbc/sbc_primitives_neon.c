@@ -877,6 +877,157 @@ static int sbc_enc_process_input_8s_le_neon(int position, const uint8_t *pcm,
 		position, pcm, X, nsamples, nchannels, 0);
 }
 
+/*
+ * Synthesis filter, the history vectors and the constant tables are
+ * organized so that every multiplication handles 4 output values at once
+ */
+
+static void sbc_synthesize_4s_neon(struct sbc_decoder_state *state, int ch,
+				const int32_t *sb_sample, int16_t *pcm)
+{
+	int32_t (*v)[16] = state->V[ch];
+	const int32_t *consts;
+	int32_t *out;
+	int pos, i;
+
+	pos = state->position[ch] = state->position[ch] > 0 ?
+					state->position[ch] - 1 : 9;
+
+	/* Matrixing */
+	consts = &synmatrix4_simd[0][0];
+	i = 4;
+	asm volatile (
+		"vmov.i32   q8, #0\n"
+		"vmov.i32   q9, #0\n"
+	"1:\n"
+		"vld1.32    {d0[], d1[]}, [%0]!\n"
+		"vld1.32    {d8, d9, d10, d11}, [%1, :128]!\n"
+		"vmla.i32   q8, q4, q0\n"
+		"vmla.i32   q9, q5, q0\n"
+		"subs       %2, %2, #1\n"
+		"bgt        1b\n"
+
+		"vshr.s32   q8, q8, %5\n"
+		"vshr.s32   q9, q9, %5\n"
+
+		"vst1.32    {d16, d17, d18, d19}, [%3, :128]\n"
+		"vst1.32    {d16, d17, d18, d19}, [%4, :128]\n"
+		: "+r" (sb_sample), "+r" (consts), "+r" (i)
+		: "r" (&v[pos][0]), "r" (&v[pos + 10][0]),
+			"i" (SCALE4_STAGED1_BITS)
+		: "cc", "memory",
+			"d0", "d1", "d8", "d9", "d10", "d11",
+			"d16", "d17", "d18", "d19");
+
+	/* Windowing */
+	consts = &sbc_proto_4_40_simd[0][0];
+	out = &v[pos][0];
+	i = 5;
+	asm volatile (
+		"vmov.i32   q8, #0\n"
+	"1:\n"
+		/* even history vectors, first half */
+		"vld1.32    {d0, d1}, [%0, :128]\n"
+		"add        %0, %0, #80\n"
+		"vld1.32    {d2, d3}, [%1, :128]!\n"
+		"vmla.i32   q8, q0, q1\n"
+		/* odd history vectors, second half */
+		"vld1.32    {d0, d1}, [%0, :128]\n"
+		"add        %0, %0, #48\n"
+		"vld1.32    {d2, d3}, [%1, :128]!\n"
+		"vmla.i32   q8, q0, q1\n"
+		"subs       %2, %2, #1\n"
+		"bgt        1b\n"
+
+		"vqshrn.s32 d16, q8, %4\n"
+		"vst1.16    {d16}, [%3]\n"
+		: "+r" (out), "+r" (consts), "+r" (i)
+		: "r" (pcm), "i" (SCALE4_STAGED1_BITS)
+		: "cc", "memory",
+			"d0", "d1", "d2", "d3", "d16", "d17");
+}
+
+static void sbc_synthesize_8s_neon(struct sbc_decoder_state *state, int ch,
+				const int32_t *sb_sample, int16_t *pcm)
+{
+	int32_t (*v)[16] = state->V[ch];
+	const int32_t *consts;
+	int32_t *out;
+	int pos, i;
+
+	pos = state->position[ch] = state->position[ch] > 0 ?
+					state->position[ch] - 1 : 9;
+
+	/* Matrixing */
+	consts = &synmatrix8_simd[0][0];
+	i = 8;
+	asm volatile (
+		"vmov.i32   q8,  #0\n"
+		"vmov.i32   q9,  #0\n"
+		"vmov.i32   q10, #0\n"
+		"vmov.i32   q11, #0\n"
+	"1:\n"
+		"vld1.32    {d0[], d1[]}, [%0]!\n"
+		"vld1.32    {d8, d9, d10, d11}, [%1, :128]!\n"
+		"vld1.32    {d12, d13, d14, d15}, [%1, :128]!\n"
+		"vmla.i32   q8,  q4, q0\n"
+		"vmla.i32   q9,  q5, q0\n"
+		"vmla.i32   q10, q6, q0\n"
+		"vmla.i32   q11, q7, q0\n"
+		"subs       %2, %2, #1\n"
+		"bgt        1b\n"
+
+		"vshr.s32   q8,  q8,  %5\n"
+		"vshr.s32   q9,  q9,  %5\n"
+		"vshr.s32   q10, q10, %5\n"
+		"vshr.s32   q11, q11, %5\n"
+
+		"vst1.32    {d16, d17, d18, d19}, [%3, :128]!\n"
+		"vst1.32    {d20, d21, d22, d23}, [%3, :128]\n"
+		"vst1.32    {d16, d17, d18, d19}, [%4, :128]!\n"
+		"vst1.32    {d20, d21, d22, d23}, [%4, :128]\n"
+		: "+r" (sb_sample), "+r" (consts), "+r" (i)
+		: "r" (&v[pos][0]), "r" (&v[pos + 10][0]),
+			"i" (SCALE8_STAGED1_BITS)
+		: "cc", "memory",
+			"d0", "d1", "d8", "d9", "d10", "d11",
+			"d12", "d13", "d14", "d15",
+			"d16", "d17", "d18", "d19",
+			"d20", "d21", "d22", "d23");
+
+	/* Windowing */
+	consts = &sbc_proto_8_80_simd[0][0];
+	out = &v[pos][0];
+	i = 5;
+	asm volatile (
+		"vmov.i32   q8, #0\n"
+		"vmov.i32   q9, #0\n"
+	"1:\n"
+		/* even history vectors, first half */
+		"vld1.32    {d0, d1, d2, d3}, [%0, :128]\n"
+		"add        %0, %0, #96\n"
+		"vld1.32    {d4, d5, d6, d7}, [%1, :128]!\n"
+		"vmla.i32   q8, q0, q2\n"
+		"vmla.i32   q9, q1, q3\n"
+		/* odd history vectors, second half */
+		"vld1.32    {d0, d1, d2, d3}, [%0, :128]\n"
+		"add        %0, %0, #32\n"
+		"vld1.32    {d4, d5, d6, d7}, [%1, :128]!\n"
+		"vmla.i32   q8, q0, q2\n"
+		"vmla.i32   q9, q1, q3\n"
+		"subs       %2, %2, #1\n"
+		"bgt        1b\n"
+
+		"vqshrn.s32 d16, q8, %4\n"
+		"vqshrn.s32 d17, q9, %4\n"
+		"vst1.16    {d16, d17}, [%3]\n"
+		: "+r" (out), "+r" (consts), "+r" (i)
+		: "r" (pcm), "i" (SCALE8_STAGED1_BITS)
+		: "cc", "memory",
+			"d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7",
+			"d16", "d17", "d18", "d19");
+}
+
 void sbc_init_primitives_neon(struct sbc_encoder_state *state)
 {
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_neon;
@@ -890,4 +1041,11 @@ void sbc_init_primitives_neon(struct sbc_encoder_state *state)
 	state->implementation_info = "NEON";
 }
 
+void sbc_init_decoder_primitives_neon(struct sbc_decoder_state *state)
+{
+	state->sbc_synthesize_4s = sbc_synthesize_4s_neon;
+	state->sbc_synthesize_8s = sbc_synthesize_8s_neon;
+	state->implementation_info = "NEON";
+}
+
 #endif
@@ -35,6 +35,7 @@
 #define SBC_BUILD_WITH_NEON_SUPPORT
 
 void sbc_init_primitives_neon(struct sbc_encoder_state *encoder_state);
+void sbc_init_decoder_primitives_neon(struct sbc_decoder_state *decoder_state);
 
 #endif
 
@@ -0,0 +1,548 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2004-2005  Henryk Ploetz <henryk@ploetzli.ch>
+ *  Copyright (C) 2005-2006  Brad Midgley <bmidgley@xmission.com>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+
+#include "sbc_primitives_sse.h"
+
+/*
+ * SSE2 optimizations
+ */
+
+#ifdef SBC_BUILD_WITH_SSE_SUPPORT
+
+static inline void sbc_analyze_four_sse(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+		1 << (SBC_PROTO_FIXED4_SCALE - 1),
+	};
+	asm volatile (
+		"movdqu      (%0), %%xmm0\n"
+		"movdqu    16(%0), %%xmm1\n"
+		"pmaddwd     (%1), %%xmm0\n"
+		"pmaddwd   16(%1), %%xmm1\n"
+		"paddd       (%2), %%xmm0\n"
+		"paddd      %%xmm1, %%xmm0\n"
+		"\n"
+		"movdqu    32(%0), %%xmm1\n"
+		"movdqu    48(%0), %%xmm2\n"
+		"pmaddwd   32(%1), %%xmm1\n"
+		"pmaddwd   48(%1), %%xmm2\n"
+		"paddd      %%xmm1, %%xmm0\n"
+		"paddd      %%xmm2, %%xmm0\n"
+		"\n"
+		"movdqu    64(%0), %%xmm1\n"
+		"pmaddwd   64(%1), %%xmm1\n"
+		"paddd      %%xmm1, %%xmm0\n"
+		"\n"
+		"psrad         %4, %%xmm0\n"
+		"packssdw   %%xmm0, %%xmm0\n"
+		"\n"
+		"pshufd $0x00, %%xmm0, %%xmm1\n"
+		"pshufd $0x55, %%xmm0, %%xmm2\n"
+		"pmaddwd   80(%1), %%xmm1\n"
+		"pmaddwd   96(%1), %%xmm2\n"
+		"paddd      %%xmm2, %%xmm1\n"
+		"\n"
+		"movdqu     %%xmm1, (%3)\n"
+		:
+		: "r" (in), "r" (consts), "r" (&round_c), "r" (out),
+			"i" (SBC_PROTO_FIXED4_SCALE)
+		: "cc", "memory", "xmm0", "xmm1", "xmm2");
+}
+
+static inline void sbc_analyze_eight_sse(const int16_t *in, int32_t *out,
+							const FIXED_T *consts)
+{
+	static const SBC_ALIGNED int32_t round_c[4] = {
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+		1 << (SBC_PROTO_FIXED8_SCALE - 1),
+	};
+	asm volatile (
+		"movdqu      (%0), %%xmm0\n"
+		"movdqu    16(%0), %%xmm1\n"
+		"pmaddwd     (%1), %%xmm0\n"
+		"pmaddwd   16(%1), %%xmm1\n"
+		"paddd       (%2), %%xmm0\n"
+		"paddd       (%2), %%xmm1\n"
+		"\n"
+		"movdqu    32(%0), %%xmm2\n"
+		"movdqu    48(%0), %%xmm3\n"
+		"pmaddwd   32(%1), %%xmm2\n"
+		"pmaddwd   48(%1), %%xmm3\n"
+		"paddd      %%xmm2, %%xmm0\n"
+		"paddd      %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu    64(%0), %%xmm2\n"
+		"movdqu    80(%0), %%xmm3\n"
+		"pmaddwd   64(%1), %%xmm2\n"
+		"pmaddwd   80(%1), %%xmm3\n"
+		"paddd      %%xmm2, %%xmm0\n"
+		"paddd      %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu    96(%0), %%xmm2\n"
+		"movdqu   112(%0), %%xmm3\n"
+		"pmaddwd   96(%1), %%xmm2\n"
+		"pmaddwd  112(%1), %%xmm3\n"
+		"paddd      %%xmm2, %%xmm0\n"
+		"paddd      %%xmm3, %%xmm1\n"
+		"\n"
+		"movdqu   128(%0), %%xmm2\n"
+		"movdqu   144(%0), %%xmm3\n"
+		"pmaddwd  128(%1), %%xmm2\n"
+		"pmaddwd  144(%1), %%xmm3\n"
+		"paddd      %%xmm2, %%xmm0\n"
+		"paddd      %%xmm3, %%xmm1\n"
+		"\n"
+		"psrad         %4, %%xmm0\n"
+		"psrad         %4, %%xmm1\n"
+		"packssdw   %%xmm1, %%xmm0\n"
+		"\n"
+		"pshufd $0x00, %%xmm0, %%xmm4\n"
+		"movdqa     %%xmm4, %%xmm5\n"
+		"pmaddwd  160(%1), %%xmm4\n"
+		"pmaddwd  176(%1), %%xmm5\n"
+		"\n"
+		"pshufd $0x55, %%xmm0, %%xmm2\n"
+		"movdqa     %%xmm2, %%xmm3\n"
+		"pmaddwd  192(%1), %%xmm2\n"
+		"pmaddwd  208(%1), %%xmm3\n"
+		"paddd      %%xmm2, %%xmm4\n"
+		"paddd      %%xmm3, %%xmm5\n"
+		"\n"
+		"pshufd $0xaa, %%xmm0, %%xmm2\n"
+		"movdqa     %%xmm2, %%xmm3\n"
+		"pmaddwd  224(%1), %%xmm2\n"
+		"pmaddwd  240(%1), %%xmm3\n"
+		"paddd      %%xmm2, %%xmm4\n"
+		"paddd      %%xmm3, %%xmm5\n"
+		"\n"
+		"pshufd $0xff, %%xmm0, %%xmm2\n"
+		"movdqa     %%xmm2, %%xmm3\n"
+		"pmaddwd  256(%1), %%xmm2\n"
+		"pmaddwd  272(%1), %%xmm3\n"
+		"paddd      %%xmm2, %%xmm4\n"
+		"paddd      %%xmm3, %%xmm5\n"
+		"\n"
+		"movdqu     %%xmm4, (%3)\n"
+		"movdqu     %%xmm5, 16(%3)\n"
+		:
+		: "r" (in), "r" (consts), "r" (&round_c), "r" (out),
+			"i" (SBC_PROTO_FIXED8_SCALE)
+		: "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3",
+			"xmm4", "xmm5");
+}
+
+static inline void sbc_analyze_4b_4s_sse(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_four_sse(x + 12, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse(x + 8, out, analysis_consts_fixed4_simd_even);
+	out += out_stride;
+	sbc_analyze_four_sse(x + 4, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse(x + 0, out, analysis_consts_fixed4_simd_even);
+}
+
+static inline void sbc_analyze_4b_8s_sse(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_sse(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_sse(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse(x + 0, out, analysis_consts_fixed8_simd_even);
+}
+
+/*
+ * Accumulates "abs(x) - 1" of every lane of %%xmmX into %%xmmACC with
+ * bitwise OR (zero samples are skipped), using %%xmmT and %%xmmZ as
+ * temporaries. This is the same trick as used by the MMX code, which
+ * avoids branches and preserves the exact result of the C reference.
+ */
+#define SSE_ACCUMULATE_ABS(x, acc, t, z)				\
+		"movdqa         " x ", " t "\n"				\
+		"pxor           " z ", " z "\n"				\
+		"pcmpgtd        " z ", " t "\n"				\
+		"paddd          " x ", " t "\n"				\
+		"pcmpgtd        " t ", " z "\n"				\
+		"pxor           " z ", " t "\n"				\
+		"por            " t ", " acc "\n"
+
+static void sbc_calc_scalefactors_sse(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int channels, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[4] = {
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+	};
+	int ch, sb;
+	intptr_t blk;
+	for (ch = 0; ch < channels; ch++) {
+		for (sb = 0; sb < subbands; sb += 4) {
+			blk = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]));
+			asm volatile (
+				"movdqa       (%4), %%xmm0\n"
+			"1:\n"
+				"movdqu   (%1, %0), %%xmm1\n"
+				SSE_ACCUMULATE_ABS("%%xmm1", "%%xmm0",
+							"%%xmm2", "%%xmm3")
+
+				"sub            %2, %0\n"
+				"jns            1b\n"
+
+				"movd        %%xmm0, %k0\n"
+				"bsrl           %k0, %k0\n"
+				"subl            %5, %k0\n"
+				"movl           %k0, (%3)\n"
+
+				"psrldq         $4, %%xmm0\n"
+				"movd        %%xmm0, %k0\n"
+				"bsrl           %k0, %k0\n"
+				"subl            %5, %k0\n"
+				"movl           %k0, 4(%3)\n"
+
+				"psrldq         $4, %%xmm0\n"
+				"movd        %%xmm0, %k0\n"
+				"bsrl           %k0, %k0\n"
+				"subl            %5, %k0\n"
+				"movl           %k0, 8(%3)\n"
+
+				"psrldq         $4, %%xmm0\n"
+				"movd        %%xmm0, %k0\n"
+				"bsrl           %k0, %k0\n"
+				"subl            %5, %k0\n"
+				"movl           %k0, 12(%3)\n"
+			: "+r" (blk)
+			: "r" (&sb_sample_f[0][ch][sb]),
+				"i" ((char *) &sb_sample_f[1][0][0] -
+					(char *) &sb_sample_f[0][0][0]),
+				"r" (&scale_factor[ch][sb]),
+				"r" (&consts),
+				"i" (SCALE_OUT_BITS)
+			: "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+		}
+	}
+}
+
+static int sbc_calc_scalefactors_j_sse(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int subbands)
+{
+	static const SBC_ALIGNED int32_t consts[4] = {
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+		1 << SCALE_OUT_BITS,
+	};
+	/* OR-accumulated magnitudes for left, right, mid and side */
+	uint32_t SBC_ALIGNED acc[4][8];
+	int blk, sb, joint = 0;
+	intptr_t pos;
+
+	for (sb = 0; sb < subbands; sb += 4) {
+		pos = (blocks - 1) * (((char *) &sb_sample_f[1][0][0] -
+			(char *) &sb_sample_f[0][0][0]));
+		asm volatile (
+			"movdqa       (%3), %%xmm0\n"
+			"movdqa     %%xmm0, %%xmm1\n"
+			"movdqa     %%xmm0, %%xmm2\n"
+			"movdqa     %%xmm0, %%xmm3\n"
+		"1:\n"
+			"movdqu   (%1, %0), %%xmm4\n"
+			"movdqu 32(%1, %0), %%xmm5\n"
+			SSE_ACCUMULATE_ABS("%%xmm4", "%%xmm0",
+						"%%xmm6", "%%xmm7")
+			SSE_ACCUMULATE_ABS("%%xmm5", "%%xmm1",
+						"%%xmm6", "%%xmm7")
+
+			"psrad          $1, %%xmm4\n"
+			"psrad          $1, %%xmm5\n"
+			"movdqa     %%xmm4, %%xmm6\n"
+			"paddd      %%xmm5, %%xmm4\n"
+			"psubd      %%xmm5, %%xmm6\n"
+			SSE_ACCUMULATE_ABS("%%xmm4", "%%xmm2",
+						"%%xmm5", "%%xmm7")
+			SSE_ACCUMULATE_ABS("%%xmm6", "%%xmm3",
+						"%%xmm5", "%%xmm7")
+
+			"sub            %2, %0\n"
+			"jns            1b\n"
+
+			"movdqu     %%xmm0, (%4)\n"
+			"movdqu     %%xmm1, 32(%4)\n"
+			"movdqu     %%xmm2, 64(%4)\n"
+			"movdqu     %%xmm3, 96(%4)\n"
+		: "+r" (pos)
+		: "r" (&sb_sample_f[0][0][sb]),
+			"i" ((char *) &sb_sample_f[1][0][0] -
+				(char *) &sb_sample_f[0][0][0]),
+			"r" (&consts),
+			"r" (&acc[0][sb])
+		: "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3",
+			"xmm4", "xmm5", "xmm6", "xmm7");
+	}
+
+	for (sb = 0; sb < subbands; sb++) {
+		uint32_t x, y;
+
+		scale_factor[0][sb] = (31 - SCALE_OUT_BITS) -
+			__builtin_clz(acc[0][sb]);
+		scale_factor[1][sb] = (31 - SCALE_OUT_BITS) -
+			__builtin_clz(acc[1][sb]);
+
+		/* last subband does not use joint stereo */
+		if (sb == subbands - 1)
+			break;
+
+		x = (31 - SCALE_OUT_BITS) - __builtin_clz(acc[2][sb]);
+		y = (31 - SCALE_OUT_BITS) - __builtin_clz(acc[3][sb]);
+
+		/* decide whether to use joint stereo for this subband */
+		if ((scale_factor[0][sb] + scale_factor[1][sb]) > x + y) {
+			joint |= 1 << (subbands - 1 - sb);
+			scale_factor[0][sb] = x;
+			scale_factor[1][sb] = y;
+			for (blk = 0; blk < blocks; blk++) {
+				int32_t tmp0 = sb_sample_f[blk][0][sb];
+				int32_t tmp1 = sb_sample_f[blk][1][sb];
+				sb_sample_f[blk][0][sb] = ASR(tmp0, 1) +
+								ASR(tmp1, 1);
+				sb_sample_f[blk][1][sb] = ASR(tmp0, 1) -
+								ASR(tmp1, 1);
+			}
+		}
+	}
+
+	/* bitmask with the information about subbands using joint stereo */
+	return joint;
+}
+
+/*
+ * Synthesis filter. SSE2 has no instruction for 32-bit multiplication
+ * keeping the low half of the result, so the even and the odd lanes are
+ * multiplied separately with "pmuludq" and accumulated as 64-bit values.
+ * Only the lower 32 bits of each sum are used, which matches the
+ * wraparound behaviour of the C reference code.
+ */
+
+static inline void sbc_synthesize_matrix_sse(const int32_t *sb_sample,
+				const int32_t *consts, intptr_t consts_stride,
+				intptr_t subbands, int32_t *out0, int32_t *out1)
+{
+	asm volatile (
+		"pxor       %%xmm0, %%xmm0\n"
+		"pxor       %%xmm1, %%xmm1\n"
+	"1:\n"
+		"movd         (%0), %%xmm2\n"
+		"pshufd $0x00, %%xmm2, %%xmm2\n"
+		"movdqa       (%1), %%xmm3\n"
+		"movdqa     %%xmm3, %%xmm4\n"
+		"psrlq         $32, %%xmm4\n"
+		"pmuludq    %%xmm2, %%xmm3\n"
+		"pmuludq    %%xmm2, %%xmm4\n"
+		"paddq      %%xmm3, %%xmm0\n"
+		"paddq      %%xmm4, %%xmm1\n"
+		"add            $4, %0\n"
+		"add            %3, %1\n"
+		"sub            $1, %2\n"
+		"jnz            1b\n"
+		"\n"
+		"pshufd $0x08, %%xmm0, %%xmm0\n"
+		"pshufd $0x08, %%xmm1, %%xmm1\n"
+		"punpckldq  %%xmm1, %%xmm0\n"
+		"psrad          %6, %%xmm0\n"
+		"movdqu     %%xmm0, (%4)\n"
+		"movdqu     %%xmm0, (%5)\n"
+		: "+r" (sb_sample), "+r" (consts), "+r" (subbands)
+		: "r" (consts_stride), "r" (out0), "r" (out1),
+			"i" (SCALE8_STAGED1_BITS)
+		: "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4");
+}
+
+/*
+ * One tap of the synthesis window for 4 output samples, "v" points to
+ * the history vector, the constants are at (%1) and get advanced by %4
+ */
+#define SSE_SYNTHESIZE_TAP(v)						\
+		"movdqu    " v ", %%xmm2\n"				\
+		"movdqa       (%1), %%xmm4\n"				\
+		"movdqa     %%xmm2, %%xmm3\n"				\
+		"movdqa     %%xmm4, %%xmm5\n"				\
+		"psrlq         $32, %%xmm3\n"				\
+		"psrlq         $32, %%xmm5\n"				\
+		"pmuludq    %%xmm4, %%xmm2\n"				\
+		"pmuludq    %%xmm5, %%xmm3\n"				\
+		"paddq      %%xmm2, %%xmm0\n"				\
+		"paddq      %%xmm3, %%xmm1\n"				\
+		"add           $64, %0\n"				\
+		"add            %4, %1\n"
+
+static inline void sbc_synthesize_window_sse(const int32_t *v,
+				const int32_t *consts, intptr_t subbands,
+				int16_t *pcm)
+{
+	/* odd history vectors are used at offset "subbands", which is also
+	 * the stride of the constants table */
+	intptr_t stride = subbands * sizeof(int32_t);
+	intptr_t taps = 10;
+
+	asm volatile (
+		"pxor       %%xmm0, %%xmm0\n"
+		"pxor       %%xmm1, %%xmm1\n"
+	"1:\n"
+		SSE_SYNTHESIZE_TAP("(%0)")
+		SSE_SYNTHESIZE_TAP("(%0, %4)")
+		"sub            $2, %2\n"
+		"jnz            1b\n"
+		"\n"
+		"pshufd $0x08, %%xmm0, %%xmm0\n"
+		"pshufd $0x08, %%xmm1, %%xmm1\n"
+		"punpckldq  %%xmm1, %%xmm0\n"
+		"psrad          %5, %%xmm0\n"
+		"packssdw   %%xmm0, %%xmm0\n"
+		"movq       %%xmm0, (%3)\n"
+		: "+r" (v), "+r" (consts), "+r" (taps)
+		: "r" (pcm), "r" (stride), "i" (SCALE8_STAGED1_BITS)
+		: "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+			"xmm5");
+}
+
+static void sbc_synthesize_4s_sse(struct sbc_decoder_state *state, int ch,
+				const int32_t *sb_sample, int16_t *pcm)
+{
+	int32_t (*v)[16] = state->V[ch];
+	int pos;
+
+	pos = state->position[ch] = state->position[ch] > 0 ?
+					state->position[ch] - 1 : 9;
+
+	sbc_synthesize_matrix_sse(sb_sample, &synmatrix4_simd[0][0],
+			sizeof(synmatrix4_simd[0]), 4, &v[pos][0],
+			&v[pos + 10][0]);
+	sbc_synthesize_matrix_sse(sb_sample, &synmatrix4_simd[0][4],
+			sizeof(synmatrix4_simd[0]), 4, &v[pos][4],
+			&v[pos + 10][4]);
+
+	sbc_synthesize_window_sse(&v[pos][0], &sbc_proto_4_40_simd[0][0],
+									4, pcm);
+}
+
+static void sbc_synthesize_8s_sse(struct sbc_decoder_state *state, int ch,
+				const int32_t *sb_sample, int16_t *pcm)
+{
+	int32_t (*v)[16] = state->V[ch];
+	int pos, i;
+
+	pos = state->position[ch] = state->position[ch] > 0 ?
+					state->position[ch] - 1 : 9;
+
+	for (i = 0; i < 16; i += 4)
+		sbc_synthesize_matrix_sse(sb_sample, &synmatrix8_simd[0][i],
+				sizeof(synmatrix8_simd[0]), 8, &v[pos][i],
+				&v[pos + 10][i]);
+
+	sbc_synthesize_window_sse(&v[pos][0], &sbc_proto_8_80_simd[0][0],
+								8, pcm);
+	sbc_synthesize_window_sse(&v[pos][4], &sbc_proto_8_80_simd[0][4],
+								8, pcm + 4);
+}
+
+static int check_sse_support(void)
+{
+#ifdef __amd64__
+	return 1; /* We assume that all 64-bit processors have SSE2 support */
+#else
+	int cpuid_feature_information;
+	asm volatile (
+		/* According to Intel manual, CPUID instruction is supported
+		 * if the value of ID bit (bit 21) in EFLAGS can be modified */
+		"pushf\n"
+		"movl     (%%esp),   %0\n"
+		"xorl     $0x200000, (%%esp)\n" /* try to modify ID bit */
+		"popf\n"
+		"pushf\n"
+		"xorl     (%%esp),   %0\n"      /* check if ID bit changed */
+		"jz       1f\n"
+		"push     %%eax\n"
+		"push     %%ebx\n"
+		"push     %%ecx\n"
+		"mov      $1,        %%eax\n"
+		"cpuid\n"
+		"pop      %%ecx\n"
+		"pop      %%ebx\n"
+		"pop      %%eax\n"
+		"1:\n"
+		"popf\n"
+		: "=d" (cpuid_feature_information)
+		:
+		: "cc");
+    return cpuid_feature_information & (1 << 26);
+#endif
+}
+
+void sbc_init_primitives_sse(struct sbc_encoder_state *state)
+{
+	if (check_sse_support()) {
+		state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_sse;
+		state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_sse;
+		state->sbc_calc_scalefactors = sbc_calc_scalefactors_sse;
+		state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j_sse;
+		state->implementation_info = "SSE2";
+	}
+}
+
+void sbc_init_decoder_primitives_sse(struct sbc_decoder_state *state)
+{
+	if (check_sse_support()) {
+		state->sbc_synthesize_4s = sbc_synthesize_4s_sse;
+		state->sbc_synthesize_8s = sbc_synthesize_8s_sse;
+		state->implementation_info = "SSE2";
+	}
+}
+
+#endif
@@ -0,0 +1,694 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) benchmark
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+#include "sbc_primitives.h"
+#include "sbc_primitives_mmx.h"
+#include "sbc_primitives_sse.h"
+#include "sbc_primitives_iwmmxt.h"
+#include "sbc_primitives_neon.h"
+#include "sbc_primitives_armv6.h"
+
+#define DEFAULT_ITERATIONS 20000
+
+struct backend {
+	const char *name;
+	void (*init)(struct sbc_encoder_state *state);
+	void (*init_decoder)(struct sbc_decoder_state *state);
+};
+
+static const struct backend backends[] = {
+	{ "Generic C", NULL, NULL },
+#ifdef SBC_BUILD_WITH_MMX_SUPPORT
+	{ "MMX", sbc_init_primitives_mmx, NULL },
+#endif
+#ifdef SBC_BUILD_WITH_SSE_SUPPORT
+	{ "SSE2", sbc_init_primitives_sse, sbc_init_decoder_primitives_sse },
+#endif
+#ifdef SBC_BUILD_WITH_ARMV6_SUPPORT
+	{ "ARMv6", sbc_init_primitives_armv6, NULL },
+#endif
+#ifdef SBC_BUILD_WITH_IWMMXT_SUPPORT
+	{ "IWMMXT", sbc_init_primitives_iwmmxt, NULL },
+#endif
+#ifdef SBC_BUILD_WITH_NEON_SUPPORT
+	{ "NEON", sbc_init_primitives_neon, sbc_init_decoder_primitives_neon },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+/* Data shared by all the benchmarks of one configuration */
+struct bench_data {
+	int subbands;
+	int blocks;
+	int channels;
+	uint8_t pcm[16 * 8 * 2 * 2];
+	int32_t SBC_ALIGNED sb_sample_f[16][2][8];
+	int32_t SBC_ALIGNED sb_sample[16][2][8];
+};
+
+/* Results of a single primitive call, compared against the C code */
+struct bench_result {
+	int32_t SBC_ALIGNED sb_sample_f[16][2][8];
+	uint32_t SBC_ALIGNED scale_factor[2][8];
+	int16_t SBC_ALIGNED X[2][SBC_X_BUFFER_SIZE];
+	int16_t SBC_ALIGNED pcm[2][16 * 8];
+	int joint;
+};
+
+static int iterations = DEFAULT_ITERATIONS;
+
+static uint64_t get_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t get_cycles(void)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__amd64__))
+	uint32_t lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+
+	return ((uint64_t) hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+static void generate_input(struct bench_data *data)
+{
+	unsigned int seed = 0x5bc;
+	int i, n;
+
+	n = data->subbands * data->blocks * data->channels;
+
+	for (i = 0; i < n; i++) {
+		double v = 12000.0 * sin(i * 0.113) + 6000.0 * sin(i * 1.37);
+		int16_t s;
+
+		seed = seed * 1103515245 + 12345;
+		s = (int16_t) (v + (int) ((seed >> 16) & 0x1fff) - 0x1000);
+
+		data->pcm[i * 2] = s & 0xff;
+		data->pcm[i * 2 + 1] = (s >> 8) & 0xff;
+	}
+}
+
+static int process_input(struct sbc_encoder_state *state,
+				struct bench_data *data, int16_t X[2][SBC_X_BUFFER_SIZE])
+{
+	int position = (SBC_X_BUFFER_SIZE - data->subbands * 9) & ~7;
+
+	memset(X, 0, sizeof(int16_t) * 2 * SBC_X_BUFFER_SIZE);
+
+	if (data->subbands == 8)
+		return state->sbc_enc_process_input_8s_le(position, data->pcm,
+				X, data->subbands * data->blocks,
+				data->channels);
+	else
+		return state->sbc_enc_process_input_4s_le(position, data->pcm,
+				X, data->subbands * data->blocks,
+				data->channels);
+}
+
+static void analyze(struct sbc_encoder_state *state, struct bench_data *data,
+			int32_t sb_sample_f[16][2][8])
+{
+	int ch, blk;
+	int16_t *x;
+
+	for (ch = 0; ch < data->channels; ch++) {
+		if (data->subbands == 8) {
+			x = &state->X[ch][state->position - 32 +
+							data->blocks * 8];
+			for (blk = 0; blk < data->blocks; blk += 4) {
+				state->sbc_analyze_4b_8s(x,
+					sb_sample_f[blk][ch],
+					sb_sample_f[blk + 1][ch] -
+					sb_sample_f[blk][ch]);
+				x -= 32;
+			}
+		} else {
+			x = &state->X[ch][state->position - 16 +
+							data->blocks * 4];
+			for (blk = 0; blk < data->blocks; blk += 4) {
+				state->sbc_analyze_4b_4s(x,
+					sb_sample_f[blk][ch],
+					sb_sample_f[blk + 1][ch] -
+					sb_sample_f[blk][ch]);
+				x -= 16;
+			}
+		}
+	}
+}
+
+static void synthesize(struct sbc_decoder_state *state,
+			struct bench_data *data, int16_t pcm[2][16 * 8])
+{
+	int ch, blk;
+
+	for (ch = 0; ch < data->channels; ch++) {
+		for (blk = 0; blk < data->blocks; blk++) {
+			if (data->subbands == 8)
+				state->sbc_synthesize_8s(state, ch,
+					data->sb_sample[blk][ch],
+					&pcm[ch][blk * 8]);
+			else
+				state->sbc_synthesize_4s(state, ch,
+					data->sb_sample[blk][ch],
+					&pcm[ch][blk * 4]);
+		}
+	}
+}
+
+enum {
+	BENCH_PROCESS_INPUT,
+	BENCH_ANALYZE,
+	BENCH_SCALEFACTORS,
+	BENCH_SCALEFACTORS_J,
+	BENCH_SYNTHESIZE,
+};
+
+static const char *bench_names[] = {
+	"process_input",
+	"analyze",
+	"calc_scalefactors",
+	"calc_scalefactors_j",
+	"synthesize",
+};
+
+static void run_once(int bench, struct sbc_encoder_state *enc,
+			struct sbc_decoder_state *dec,
+			struct bench_data *data, struct bench_result *res)
+{
+	switch (bench) {
+	case BENCH_PROCESS_INPUT:
+		process_input(enc, data, res->X);
+		break;
+	case BENCH_ANALYZE:
+		analyze(enc, data, res->sb_sample_f);
+		break;
+	case BENCH_SCALEFACTORS:
+		enc->sbc_calc_scalefactors(data->sb_sample_f,
+				res->scale_factor, data->blocks,
+				data->channels, data->subbands);
+		break;
+	case BENCH_SCALEFACTORS_J:
+		/* samples get modified in place, so start from a copy */
+		memcpy(res->sb_sample_f, data->sb_sample_f,
+					sizeof(res->sb_sample_f));
+		res->joint = enc->sbc_calc_scalefactors_j(res->sb_sample_f,
+				res->scale_factor, data->blocks,
+				data->subbands);
+		break;
+	case BENCH_SYNTHESIZE:
+		synthesize(dec, data, res->pcm);
+		break;
+	}
+}
+
+static double snr_int32(const int32_t *ref, const int32_t *val, int n)
+{
+	double signal = 0, noise = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double d = (double) ref[i] - val[i];
+		signal += (double) ref[i] * ref[i];
+		noise += d * d;
+	}
+
+	if (noise == 0)
+		return INFINITY;
+
+	return 10 * log10(signal / noise);
+}
+
+static double snr_int16(const int16_t *ref, const int16_t *val, int n)
+{
+	double signal = 0, noise = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double d = (double) ref[i] - val[i];
+		signal += (double) ref[i] * ref[i];
+		noise += d * d;
+	}
+
+	if (noise == 0)
+		return INFINITY;
+
+	return 10 * log10(signal / noise);
+}
+
+/* Returns the SNR of the primitive output against the reference in dB */
+static double compare(int bench, struct bench_data *data,
+			struct bench_result *ref, struct bench_result *res)
+{
+	switch (bench) {
+	case BENCH_PROCESS_INPUT:
+		return snr_int16(&ref->X[0][0], &res->X[0][0],
+					2 * SBC_X_BUFFER_SIZE);
+	case BENCH_ANALYZE:
+		return snr_int32(&ref->sb_sample_f[0][0][0],
+				&res->sb_sample_f[0][0][0],
+				data->blocks * 2 * 8);
+	case BENCH_SCALEFACTORS:
+		return memcmp(ref->scale_factor, res->scale_factor,
+				sizeof(ref->scale_factor)) ? -INFINITY :
+				INFINITY;
+	case BENCH_SCALEFACTORS_J:
+		if (ref->joint != res->joint || memcmp(ref->scale_factor,
+				res->scale_factor, sizeof(ref->scale_factor)))
+			return -INFINITY;
+		return snr_int32(&ref->sb_sample_f[0][0][0],
+				&res->sb_sample_f[0][0][0],
+				data->blocks * 2 * 8);
+	case BENCH_SYNTHESIZE:
+		return snr_int16(&ref->pcm[0][0], &res->pcm[0][0],
+				data->blocks * data->subbands);
+	}
+
+	return 0;
+}
+
+static void print_result(const char *backend, const char *name,
+				struct bench_data *data, uint64_t nsec,
+				uint64_t cycles, double snr)
+{
+	int samples = data->subbands * data->blocks * data->channels;
+
+	printf("%-10s %-20s %2d %2d %2d %10.1f", backend, name,
+			data->subbands, data->blocks, data->channels,
+			(double) nsec / iterations);
+
+	if (cycles)
+		printf(" %10.2f", (double) cycles / iterations / samples);
+	else
+		printf(" %10s", "-");
+
+	if (isnan(snr))
+		printf(" %10s\n", "-");
+	else if (isinf(snr) && snr > 0)
+		printf(" %10s\n", "exact");
+	else if (isinf(snr))
+		printf(" %10s\n", "MISMATCH");
+	else
+		printf(" %10.1f\n", snr);
+}
+
+static void bench_primitive(int bench, const struct backend *backend,
+				struct bench_data *data)
+{
+	struct sbc_encoder_state SBC_ALIGNED enc_ref, enc;
+	struct sbc_decoder_state SBC_ALIGNED dec_ref, dec;
+	struct bench_result SBC_ALIGNED ref, res;
+	uint64_t nsec, cycles;
+	const char *info;
+	int i;
+
+	if (bench == BENCH_SCALEFACTORS_J && data->channels != 2)
+		return;
+
+	memset(&ref, 0, sizeof(ref));
+	memset(&res, 0, sizeof(res));
+	memset(&dec_ref, 0, sizeof(dec_ref));
+
+	sbc_init_primitives_generic(&enc_ref);
+	sbc_init_decoder_primitives_generic(&dec_ref);
+
+	enc = enc_ref;
+	dec = dec_ref;
+
+	if (bench == BENCH_SYNTHESIZE) {
+		if (backend->init_decoder)
+			backend->init_decoder(&dec);
+		info = dec.implementation_info;
+	} else {
+		if (backend->init)
+			backend->init(&enc);
+		info = enc.implementation_info;
+	}
+
+	/* backend is not available on this CPU or has no such primitive */
+	if (backend->init && strcmp(info, backend->name))
+		return;
+	if (bench == BENCH_SYNTHESIZE && !backend->init_decoder &&
+							backend->init)
+		return;
+
+	/* the analysis works on the data prepared by the C code */
+	enc_ref.position = process_input(&enc_ref, data, enc_ref.X);
+	enc.position = enc_ref.position;
+	memcpy(enc.X, enc_ref.X, sizeof(enc.X));
+
+	run_once(bench, &enc_ref, &dec_ref, data, &ref);
+	run_once(bench, &enc, &dec, data, &res);
+
+	nsec = get_nsec();
+	cycles = get_cycles();
+
+	for (i = 0; i < iterations; i++)
+		run_once(bench, &enc, &dec, data, &res);
+
+	cycles = get_cycles() - cycles;
+	nsec = get_nsec() - nsec;
+
+	/* synthesis has state, so compare from a fresh start */
+	if (bench == BENCH_SYNTHESIZE) {
+		memset(&dec_ref.V, 0, sizeof(dec_ref.V));
+		memset(&dec.V, 0, sizeof(dec.V));
+		dec_ref.position[0] = dec_ref.position[1] = 0;
+		dec.position[0] = dec.position[1] = 0;
+		run_once(bench, &enc_ref, &dec_ref, data, &ref);
+		run_once(bench, &enc, &dec, data, &res);
+	}
+
+	print_result(backend->name, bench_names[bench], data, nsec, cycles,
+					compare(bench, data, &ref, &res));
+}
+
+static void bench_codec(struct bench_data *data, int subbands, int blocks,
+					int channels, unsigned long flags)
+{
+	uint8_t frame[512], pcm[sizeof(data->pcm)];
+	const char *name;
+	uint64_t nsec, cycles;
+	ssize_t encoded;
+	size_t written;
+	sbc_t sbc;
+	int i;
+
+	sbc_init(&sbc, flags);
+	sbc.subbands = subbands == 8 ? SBC_SB_8 : SBC_SB_4;
+	sbc.blocks = blocks / 4 - 1;
+	sbc.mode = channels == 2 ? SBC_MODE_JOINT_STEREO : SBC_MODE_MONO;
+	sbc.endian = SBC_LE;
+
+	nsec = get_nsec();
+	cycles = get_cycles();
+
+	for (i = 0; i < iterations; i++)
+		sbc_encode(&sbc, data->pcm, sizeof(data->pcm), frame,
+						sizeof(frame), &encoded);
+
+	cycles = get_cycles() - cycles;
+	nsec = get_nsec() - nsec;
+
+	name = flags & SBC_FLAG_BITS_CACHE ? "sbc_encode (cache)" :
+								"sbc_encode";
+	print_result(sbc_get_implementation_info(&sbc), name, data,
+						nsec, cycles, NAN);
+
+	sbc_finish(&sbc);
+
+	sbc_init(&sbc, flags);
+
+	nsec = get_nsec();
+	cycles = get_cycles();
+
+	for (i = 0; i < iterations; i++)
+		sbc_decode(&sbc, frame, encoded, pcm, sizeof(pcm), &written);
+
+	cycles = get_cycles() - cycles;
+	nsec = get_nsec() - nsec;
+
+	name = flags & SBC_FLAG_BITS_CACHE ? "sbc_decode (cache)" :
+								"sbc_decode";
+	print_result("", name, data, nsec, cycles, NAN);
+
+	sbc_finish(&sbc);
+}
+
+static void bench(int subbands, int blocks, int channels)
+{
+	struct sbc_encoder_state SBC_ALIGNED enc;
+	struct bench_data SBC_ALIGNED data;
+	int i, b, blk, ch, sb;
+
+	memset(&data, 0, sizeof(data));
+	data.subbands = subbands;
+	data.blocks = blocks;
+	data.channels = channels;
+
+	generate_input(&data);
+
+	/* subband samples for the scale factors and synthesis benchmarks */
+	sbc_init_primitives_generic(&enc);
+	enc.position = process_input(&enc, &data, enc.X);
+	analyze(&enc, &data, data.sb_sample_f);
+
+	for (blk = 0; blk < blocks; blk++)
+		for (ch = 0; ch < channels; ch++)
+			for (sb = 0; sb < subbands; sb++)
+				data.sb_sample[blk][ch][sb] =
+					data.sb_sample_f[blk][ch][sb] >>
+							SCALE_OUT_BITS;
+
+	for (b = BENCH_PROCESS_INPUT; b <= BENCH_SYNTHESIZE; b++)
+		for (i = 0; backends[i].name; i++)
+			bench_primitive(b, &backends[i], &data);
+
+	bench_codec(&data, subbands, blocks, channels, 0);
+	bench_codec(&data, subbands, blocks, channels, SBC_FLAG_BITS_CACHE);
+}
+
+#define GUARD_SIZE 16
+
+/*
+ * Encodes one frame of every mode and bitpool into a buffer that holds
+ * exactly sbc_get_frame_length() bytes and checks that the frame fits,
+ * that nothing past it was touched and that the decoder agrees on its
+ * length. Returns the number of failed configurations.
+ */
+static int check_frame_length(struct bench_data *data, int subbands,
+						int blocks, int mode)
+{
+	uint8_t pcm[sizeof(data->pcm)];
+	uint8_t *frame;
+	size_t length, frames, written;
+	ssize_t decoded;
+	int bitpool, max_bitpool, i, failed = 0;
+	sbc_t sbc;
+
+	max_bitpool = subbands << (mode == SBC_MODE_STEREO ||
+				mode == SBC_MODE_JOINT_STEREO ? 5 : 4);
+	if (max_bitpool > 255)
+		max_bitpool = 255;
+
+	for (bitpool = 2; bitpool <= max_bitpool; bitpool++) {
+		sbc_init(&sbc, 0);
+		sbc.subbands = subbands == 8 ? SBC_SB_8 : SBC_SB_4;
+		sbc.blocks = blocks / 4 - 1;
+		sbc.mode = mode;
+		sbc.bitpool = bitpool;
+		sbc.endian = SBC_LE;
+
+		length = sbc_get_frame_length(&sbc);
+		frame = malloc(length + GUARD_SIZE);
+		if (!frame) {
+			sbc_finish(&sbc);
+			return failed + 1;
+		}
+
+		memset(frame, 0xa5, length + GUARD_SIZE);
+
+		if (sbc_encode_frames(&sbc, data->pcm, sizeof(data->pcm),
+				frame, length, &frames, &written) < 0 ||
+				frames != 1 || written == 0 ||
+				written > length)
+			goto fail;
+
+		for (i = 0; i < GUARD_SIZE; i++)
+			if (frame[length + i] != 0xa5)
+				goto fail;
+
+		sbc_finish(&sbc);
+		sbc_init(&sbc, 0);
+
+		decoded = sbc_decode(&sbc, frame, length, pcm, sizeof(pcm),
+								NULL);
+		if (decoded < 0 || (size_t) decoded != written)
+			goto fail;
+
+		sbc_finish(&sbc);
+		free(frame);
+		continue;
+
+fail:
+		fprintf(stderr, "Frame length mismatch: sb %d bl %d mode %d "
+				"bitpool %d length %zu written %zu\n",
+				subbands, blocks, mode, bitpool, length,
+				written);
+		sbc_finish(&sbc);
+		free(frame);
+		failed++;
+	}
+
+	return failed;
+}
+
+static int check_frame_lengths(void)
+{
+	struct bench_data data;
+	int sb, blk, mode, failed = 0;
+
+	memset(&data, 0, sizeof(data));
+	data.subbands = 8;
+	data.blocks = 16;
+	data.channels = 2;
+
+	generate_input(&data);
+
+	for (sb = 4; sb <= 8; sb += 4)
+		for (blk = 4; blk <= 16; blk += 4)
+			for (mode = SBC_MODE_MONO;
+					mode <= SBC_MODE_JOINT_STEREO; mode++)
+				failed += check_frame_length(&data, sb, blk,
+									mode);
+
+	return failed;
+}
+
+static void usage(void)
+{
+	printf("SBC benchmark utility ver %s\n", VERSION);
+	printf("Copyright (c) 2004-2010  Marcel Holtmann\n\n");
+
+	printf("Usage:\n"
+		"\tsbcbench [options]\n"
+		"\n");
+
+	printf("Options:\n"
+		"\t-h, --help           Display help\n"
+		"\t-n, --iterations     Number of iterations (default %d)\n"
+		"\t-s, --subbands       Only test 4 or 8 subbands\n"
+		"\t-B, --blocks         Only test 4, 8, 12 or 16 blocks\n"
+		"\t-c, --channels       Only test 1 or 2 channels\n"
+		"\n", DEFAULT_ITERATIONS);
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "iterations",	1, 0, 'n' },
+	{ "subbands",	1, 0, 's' },
+	{ "blocks",	1, 0, 'B' },
+	{ "channels",	1, 0, 'c' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	int opt, subbands = 0, blocks = 0, channels = 0;
+	int sb, blk, ch;
+
+	while ((opt = getopt_long(argc, argv, "+hn:s:B:c:",
+						main_options, NULL)) != -1) {
+		switch(opt) {
+		case 'h':
+			usage();
+			exit(0);
+
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) {
+				fprintf(stderr, "Invalid iterations\n");
+				exit(1);
+			}
+			break;
+
+		case 's':
+			subbands = atoi(optarg);
+			if (subbands != 8 && subbands != 4) {
+				fprintf(stderr, "Invalid subbands\n");
+				exit(1);
+			}
+			break;
+
+		case 'B':
+			blocks = atoi(optarg);
+			if (blocks != 16 && blocks != 12 &&
+						blocks != 8 && blocks != 4) {
+				fprintf(stderr, "Invalid blocks\n");
+				exit(1);
+			}
+			break;
+
+		case 'c':
+			channels = atoi(optarg);
+			if (channels != 1 && channels != 2) {
+				fprintf(stderr, "Invalid channels\n");
+				exit(1);
+			}
+			break;
+
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (check_frame_lengths() > 0)
+		exit(1);
+
+	printf("%-10s %-20s %2s %2s %2s %10s %10s %10s\n", "backend",
+			"function", "sb", "bl", "ch", "ns/frame",
+			"cyc/sample", "SNR (dB)");
+
+	for (sb = 4; sb <= 8; sb += 4) {
+		if (subbands && sb != subbands)
+			continue;
+		for (blk = 4; blk <= 16; blk += 4) {
+			if (blocks && blk != blocks)
+				continue;
+			for (ch = 1; ch <= 2; ch++) {
+				if (channels && ch != channels)
+					continue;
+				bench(sb, blk, ch);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -31,6 +31,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <getopt.h>
 #include <sys/stat.h>
@@ -39,56 +40,141 @@
 
 #include "sbc.h"
 #include "formats.h"
+#include "batch.h"
 
-#define BUF_SIZE 8192
+#define SBC_SYNCWORD 0x9c
+
+/* Enough frames to refill the 10 block synthesis window */
+#define WARMUP_FRAMES(blocks) ((10 + (blocks) - 1) / (blocks))
 
 static int verbose = 0;
+static unsigned int jobs = 1;
 
-static void decode(char *filename, char *output, int tofile)
+static size_t total_frames = 0, total_bytes = 0;
+static double total_seconds = 0;
+
+struct decode_part {
+	const char *filename;
+	const uint8_t *start;	/* of the first warmup frame */
+	const uint8_t *end;
+	size_t offset;		/* of the output in the mapped file */
+	int fd;
+};
+
+/* Length of the frame at data and of the audio it decodes to, from its
+ * header alone */
+static ssize_t frame_length(const uint8_t *data, size_t len, size_t *pcm)
+{
+	int subbands, blocks, channels, mode, bitpool;
+	ssize_t framelen;
+
+	if (len < 4 || data[0] != SBC_SYNCWORD)
+		return -1;
+
+	blocks = 4 + ((data[1] >> 4) & 0x03) * 4;
+	mode = (data[1] >> 2) & 0x03;
+	subbands = data[1] & 0x01 ? 8 : 4;
+	channels = mode == SBC_MODE_MONO ? 1 : 2;
+	bitpool = data[2];
+
+	framelen = 4 + (4 * subbands * channels) / 8;
+	if (mode == SBC_MODE_MONO || mode == SBC_MODE_DUAL_CHANNEL)
+		framelen += (blocks * channels * bitpool + 7) / 8;
+	else
+		framelen += ((mode == SBC_MODE_JOINT_STEREO ? subbands : 0) +
+						blocks * bitpool + 7) / 8;
+
+	if ((size_t) framelen > len)
+		return -1;
+
+	if (pcm)
+		*pcm = blocks * subbands * channels * 2;
+
+	return framelen;
+}
+
+static void decode_segment(struct batch_segment *seg)
 {
-	unsigned char buf[BUF_SIZE], *stream;
-	struct stat st;
+	struct decode_part *part = seg->user_data;
+	const uint8_t *ptr = part->start;
+	uint8_t scratch[512];
+	size_t n, len;
+	ssize_t framelen;
 	sbc_t sbc;
-	int fd, ad, pos, streamlen, framelen, count;
-	size_t len;
-	int format = AFMT_S16_BE, frequency, channels;
-	ssize_t written;
 
-	if (stat(filename, &st) < 0) {
-		fprintf(stderr, "Can't get size of file %s: %s\n",
-						filename, strerror(errno));
-		return;
-	}
+	sbc_init(&sbc, 0L);
+	sbc.endian = SBC_BE;
 
-	stream = malloc(st.st_size);
+	for (n = 0; n < seg->warmup + seg->count; n++) {
+		uint8_t *out = scratch;
+		size_t out_len = sizeof(scratch);
 
-	if (!stream) {
-		fprintf(stderr, "Can't allocate memory for %s: %s\n",
-						filename, strerror(errno));
-		return;
-	}
+		if (n >= seg->warmup) {
+			out = seg->output + seg->written;
+			out_len = seg->output_len - seg->written;
+		}
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "Can't open file %s: %s\n",
-						filename, strerror(errno));
-		goto free;
-	}
+		framelen = sbc_decode(&sbc, ptr, part->end - ptr, out,
+							out_len, &len);
+		if (framelen <= 0) {
+			seg->err = framelen < 0 ? framelen : -EIO;
+			break;
+		}
 
-	if (read(fd, stream, st.st_size) != st.st_size) {
-		fprintf(stderr, "Can't read content of %s: %s\n",
-						filename, strerror(errno));
-		close(fd);
-		goto free;
+		ptr += framelen;
+
+		if (n >= seg->warmup)
+			seg->written += len;
 	}
 
-	close(fd);
+	sbc_finish(&sbc);
+}
+
+static void write_segment(struct batch_segment *seg)
+{
+	struct decode_part *part = seg->user_data;
+	ssize_t written;
+
+	if (seg->err < 0)
+		fprintf(stderr, "Can't decode all of %s: %s\n",
+					part->filename, strerror(-seg->err));
+
+	total_bytes += seg->written;
+
+	/* Mapped output is already in place */
+	if (seg->allocated == 0 || seg->written == 0)
+		return;
+
+	written = write(part->fd, seg->output, seg->written);
+	if (written < (ssize_t) seg->written)
+		fprintf(stderr, "Can't write decoded audio: %s\n",
+						strerror(errno));
+}
+
+static void decode(char *filename, char *output, int tofile)
+{
+	struct batch_input in;
+	struct batch_output out;
+	struct batch_segment *segs = NULL;
+	struct decode_part *parts = NULL;
+	const uint8_t *ptr, *end;
+	sbc_t sbc;
+	int ad, err;
+	int format = AFMT_S16_BE, frequency, channels;
+	size_t nframes, pcm, pcm_len, seglen, n, warmup, offset;
+	unsigned int nsegs, i;
+	uint8_t *map = NULL;
+	ssize_t framelen;
 
-	pos = 0;
-	streamlen = st.st_size;
+	err = batch_input_map(&in, filename);
+	if (err < 0) {
+		fprintf(stderr, "Can't open file %s: %s\n",
+						filename, strerror(-err));
+		return;
+	}
 
 	if (tofile)
-		ad = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		ad = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	else
 		ad = open(output, O_WRONLY, 0);
 
@@ -101,7 +187,7 @@ static void decode(char *filename, char *output, int tofile)
 	sbc_init(&sbc, 0L);
 	sbc.endian = SBC_BE;
 
-	framelen = sbc_decode(&sbc, stream, streamlen, buf, sizeof(buf), &len);
+	sbc_parse(&sbc, in.data, in.size);
 	channels = sbc.mode == SBC_MODE_MONO ? 1 : 2;
 	switch (sbc.frequency) {
 	case SBC_FREQ_16000:
@@ -133,8 +219,11 @@ static void decode(char *filename, char *output, int tofile)
 						"STEREO" : "JOINTSTEREO");
 	}
 
+	warmup = WARMUP_FRAMES(4 + sbc.blocks * 4);
+
 	if (tofile) {
 		struct au_header au_hdr;
+		ssize_t written;
 
 		au_hdr.magic       = AU_MAGIC;
 		au_hdr.hdr_size    = BE_INT(24);
@@ -168,53 +257,94 @@ static void decode(char *filename, char *output, int tofile)
 		}
 	}
 
-	count = len;
+	/* Walk the frame headers once to size the output and the segments,
+	 * decoding stops at the first frame that doesn't fit */
+	end = in.data + in.size;
+	nframes = 0;
+	pcm_len = 0;
 
-	while (framelen > 0) {
-		/* we have completed an sbc_decode at this point sbc.len is the
-		 * length of the frame we just decoded count is the number of
-		 * decoded bytes yet to be written */
+	for (ptr = in.data; ptr < end; ptr += framelen, nframes++) {
+		framelen = frame_length(ptr, end - ptr, &pcm);
+		if (framelen < 0)
+			break;
 
-		if (count + len >= BUF_SIZE) {
-			/* buffer is too full to stuff decoded audio in so it
-			 * must be written to the device */
-			written = write(ad, buf, count);
-			if (written > 0)
-				count -= written;
-		}
+		pcm_len += pcm;
+	}
 
-		/* sanity check */
-		if (count + len >= BUF_SIZE) {
-			fprintf(stderr,
-				"buffer size of %d is too small for decoded"
-				" data (%lu)\n", BUF_SIZE, (unsigned long) (len + count));
-			exit(1);
+	if (nframes == 0)
+		goto close;
+
+	end = ptr;
+
+	if (tofile)
+		map = batch_output_map(&out, ad, pcm_len);
+
+	seglen = (nframes + jobs - 1) / jobs;
+	if (seglen < BATCH_MIN_FRAMES)
+		seglen = BATCH_MIN_FRAMES;
+
+	nsegs = (nframes + seglen - 1) / seglen;
+
+	segs = calloc(nsegs, sizeof(*segs));
+	parts = calloc(nsegs, sizeof(*parts));
+	if (segs == NULL || parts == NULL) {
+		fprintf(stderr, "Can't allocate segments\n");
+		goto unmap;
+	}
+
+	/* Second walk to find where each segment and its warmup start */
+	for (ptr = in.data, n = 0, i = 0, offset = 0; n < nframes;
+						ptr += framelen, n++) {
+		if (i < nsegs && (n + warmup == i * seglen || n == 0)) {
+			segs[i].user_data = &parts[i];
+			segs[i].first = i * seglen;
+			segs[i].count = nframes - segs[i].first;
+			if (segs[i].count > seglen)
+				segs[i].count = seglen;
+			segs[i].warmup = segs[i].first - n;
+
+			parts[i].filename = filename;
+			parts[i].start = ptr;
+			parts[i].end = end;
+			parts[i].fd = ad;
+			i++;
 		}
 
-		/* push the pointer in the file forward to the next bit to be
-		 * decoded tell the decoder to decode up to the remaining
-		 * length of the file (!) */
-		pos += framelen;
-		framelen = sbc_decode(&sbc, stream + pos, streamlen - pos,
-					buf + count, sizeof(buf) - count, &len);
+		if (n % seglen == 0)
+			parts[n / seglen].offset = offset;
 
-		/* increase the count */
-		count += len;
+		framelen = frame_length(ptr, end - ptr, &pcm);
+		offset += pcm;
 	}
 
-	if (count > 0) {
-		written = write(ad, buf, count);
-		if (written > 0)
-			count -= written;
+	for (i = 0; i < nsegs; i++) {
+		size_t next = i + 1 < nsegs ? parts[i + 1].offset : pcm_len;
+
+		segs[i].output_len = next - parts[i].offset;
+		if (map)
+			segs[i].output = map + parts[i].offset;
 	}
 
+	batch_run(segs, nsegs, jobs, decode_segment, write_segment);
+
+	total_frames += nframes;
+	total_seconds += frequency ? (double) pcm_len / (channels * 2) /
+							frequency : 0;
+
+unmap:
+	if (map)
+		batch_output_unmap(&out);
+
+	free(parts);
+	free(segs);
+
 close:
 	sbc_finish(&sbc);
 
 	close(ad);
 
 free:
-	free(stream);
+	batch_input_unmap(&in);
 }
 
 static void usage(void)
@@ -231,6 +361,7 @@ static void usage(void)
 		"\t-v, --verbose        Verbose mode\n"
 		"\t-d, --device <dsp>   Sound device\n"
 		"\t-f, --file <file>    Decode to a file\n"
+		"\t-j, --jobs <n>       Decode with n threads\n"
 		"\n");
 }
 
@@ -239,6 +370,7 @@ static struct option main_options[] = {
 	{ "device",	1, 0, 'd' },
 	{ "verbose",	0, 0, 'v' },
 	{ "file",	1, 0, 'f' },
+	{ "jobs",	1, 0, 'j' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -246,8 +378,9 @@ int main(int argc, char *argv[])
 {
 	char *output = NULL;
 	int i, opt, tofile = 0;
+	uint64_t nsec;
 
-	while ((opt = getopt_long(argc, argv, "+hvd:f:",
+	while ((opt = getopt_long(argc, argv, "+hvd:f:j:",
 						main_options, NULL)) != -1) {
 		switch(opt) {
 		case 'h':
@@ -270,6 +403,14 @@ int main(int argc, char *argv[])
 			tofile = 1;
 			break;
 
+		case 'j':
+			if (atoi(optarg) < 1) {
+				fprintf(stderr, "Invalid jobs\n");
+				exit(1);
+			}
+			jobs = atoi(optarg);
+			break;
+
 		default:
 			exit(1);
 		}
@@ -284,9 +425,15 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	nsec = batch_get_nsec();
+
 	for (i = 0; i < argc; i++)
 		decode(argv[i], output ? output : "/dev/dsp", tofile);
 
+	if (verbose)
+		batch_report("decoded", total_frames, total_bytes,
+				total_seconds, batch_get_nsec() - nsec);
+
 	free(output);
 
 	return 0;
@@ -38,117 +38,155 @@
 
 #include "sbc.h"
 #include "formats.h"
+#include "batch.h"
 
 static int verbose = 0;
+static unsigned int jobs = 1;
+
+static int subbands = 8, bitpool = 32, joint = 0, dualchannel = 0;
+static int snr = 0, blocks = 16;
+
+static size_t total_frames = 0, total_bytes = 0;
+static double total_seconds = 0;
+
+static int out_fd;
 
 #define BUF_SIZE 32768
 static unsigned char input[BUF_SIZE], output[BUF_SIZE + BUF_SIZE / 4];
 
-static void encode(char *filename, int subbands, int bitpool, int joint,
-					int dualchannel, int snr, int blocks)
-{
-	struct au_header au_hdr;
-	sbc_t sbc;
-	int fd, size, srate, codesize, nframes;
-	ssize_t encoded;
-	ssize_t len;
+/* Enough frames to refill the 9 blocks of analysis history */
+#define WARMUP_FRAMES(blocks) ((9 + (blocks) - 1) / (blocks))
 
-	if (sizeof(au_hdr) != 24) {
-		/* Sanity check just in case */
-		fprintf(stderr, "FIXME: sizeof(au_hdr) != 24\n");
-		return;
-	}
-
-	if (strcmp(filename, "-")) {
-		fd = open(filename, O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "Can't open file %s: %s\n",
-						filename, strerror(errno));
-			return;
-		}
-	} else
-		fd = fileno(stdin);
+struct encode_file {
+	struct batch_input in;
+	struct au_header au_hdr;
+	const uint8_t *pcm;
+	size_t nframes;
+	size_t codesize;
+	size_t framelen;
+	size_t offset;		/* of the output in the mapped file */
+	int stream;
+};
 
-	len = read(fd, &au_hdr, sizeof(au_hdr));
-	if (len < (ssize_t) sizeof(au_hdr)) {
-		if (fd > fileno(stderr))
-			fprintf(stderr, "Can't read header from file %s: %s\n",
-						filename, strerror(errno));
-		else
-			perror("Can't read audio header");
-		goto done;
-	}
+static int setup_encoder(sbc_t *sbc, const struct au_header *au_hdr,
+					const char *filename, int quiet)
+{
+	int srate;
 
-	if (au_hdr.magic != AU_MAGIC ||
-			BE_INT(au_hdr.hdr_size) > 128 ||
-			BE_INT(au_hdr.hdr_size) < sizeof(au_hdr) ||
-			BE_INT(au_hdr.encoding) != AU_FMT_LIN16) {
+	if (au_hdr->magic != AU_MAGIC ||
+			BE_INT(au_hdr->hdr_size) > 128 ||
+			BE_INT(au_hdr->hdr_size) < sizeof(*au_hdr) ||
+			BE_INT(au_hdr->encoding) != AU_FMT_LIN16) {
 		fprintf(stderr, "Not in Sun/NeXT audio S16_BE format\n");
-		goto done;
+		return -1;
 	}
 
-	sbc_init(&sbc, 0L);
-
-	switch (BE_INT(au_hdr.sample_rate)) {
+	switch (BE_INT(au_hdr->sample_rate)) {
 	case 16000:
-		sbc.frequency = SBC_FREQ_16000;
+		sbc->frequency = SBC_FREQ_16000;
 		break;
 	case 32000:
-		sbc.frequency = SBC_FREQ_32000;
+		sbc->frequency = SBC_FREQ_32000;
 		break;
 	case 44100:
-		sbc.frequency = SBC_FREQ_44100;
+		sbc->frequency = SBC_FREQ_44100;
 		break;
 	case 48000:
-		sbc.frequency = SBC_FREQ_48000;
+		sbc->frequency = SBC_FREQ_48000;
 		break;
 	}
 
-	srate = BE_INT(au_hdr.sample_rate);
+	srate = BE_INT(au_hdr->sample_rate);
 
-	sbc.subbands = subbands == 4 ? SBC_SB_4 : SBC_SB_8;
+	sbc->subbands = subbands == 4 ? SBC_SB_4 : SBC_SB_8;
 
-	if (BE_INT(au_hdr.channels) == 1) {
-		sbc.mode = SBC_MODE_MONO;
+	if (BE_INT(au_hdr->channels) == 1) {
+		sbc->mode = SBC_MODE_MONO;
 		if (joint || dualchannel) {
 			fprintf(stderr, "Audio is mono but joint or "
 				"dualchannel mode has been specified\n");
-			goto done;
+			return -1;
 		}
 	} else if (joint && !dualchannel)
-		sbc.mode = SBC_MODE_JOINT_STEREO;
+		sbc->mode = SBC_MODE_JOINT_STEREO;
 	else if (!joint && dualchannel)
-		sbc.mode = SBC_MODE_DUAL_CHANNEL;
+		sbc->mode = SBC_MODE_DUAL_CHANNEL;
 	else if (!joint && !dualchannel)
-		sbc.mode = SBC_MODE_STEREO;
+		sbc->mode = SBC_MODE_STEREO;
 	else {
 		fprintf(stderr, "Both joint and dualchannel mode have been "
 								"specified\n");
-		goto done;
+		return -1;
 	}
 
-	sbc.endian = SBC_BE;
-	/* Skip extra bytes of the header if any */
-	if (read(fd, input, BE_INT(au_hdr.hdr_size) - len) < 0)
-		goto done;
-
-	sbc.bitpool = bitpool;
-	sbc.allocation = snr ? SBC_AM_SNR : SBC_AM_LOUDNESS;
-	sbc.blocks = blocks == 4 ? SBC_BLK_4 :
+	sbc->endian = SBC_BE;
+	sbc->bitpool = bitpool;
+	sbc->allocation = snr ? SBC_AM_SNR : SBC_AM_LOUDNESS;
+	sbc->blocks = blocks == 4 ? SBC_BLK_4 :
 			blocks == 8 ? SBC_BLK_8 :
 				blocks == 12 ? SBC_BLK_12 : SBC_BLK_16;
 
-	if (verbose) {
+	if (verbose && !quiet) {
 		fprintf(stderr, "encoding %s with rate %d, %d blocks, "
 			"%d subbands, %d bits, allocation method %s, "
 							"and mode %s\n",
 			filename, srate, blocks, subbands, bitpool,
-			sbc.allocation == SBC_AM_SNR ? "SNR" : "LOUDNESS",
-			sbc.mode == SBC_MODE_MONO ? "MONO" :
-					sbc.mode == SBC_MODE_STEREO ?
+			sbc->allocation == SBC_AM_SNR ? "SNR" : "LOUDNESS",
+			sbc->mode == SBC_MODE_MONO ? "MONO" :
+					sbc->mode == SBC_MODE_STEREO ?
 						"STEREO" : "JOINTSTEREO");
 	}
 
+	return 0;
+}
+
+static void account(const struct au_header *au_hdr, size_t frames,
+							size_t bytes)
+{
+	total_frames += frames;
+	total_bytes += bytes;
+	total_seconds += (double) bytes / (BE_INT(au_hdr->channels) * 2) /
+					BE_INT(au_hdr->sample_rate);
+}
+
+/* Inputs that can't be mapped, like stdin, are encoded as they are read */
+static void encode_stream(char *filename)
+{
+	struct au_header au_hdr;
+	sbc_t sbc;
+	int fd, size, codesize, nframes;
+	size_t encoded, frames;
+	ssize_t len;
+
+	if (strcmp(filename, "-")) {
+		fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Can't open file %s: %s\n",
+						filename, strerror(errno));
+			return;
+		}
+	} else
+		fd = fileno(stdin);
+
+	len = read(fd, &au_hdr, sizeof(au_hdr));
+	if (len < (ssize_t) sizeof(au_hdr)) {
+		if (fd > fileno(stderr))
+			fprintf(stderr, "Can't read header from file %s: %s\n",
+						filename, strerror(errno));
+		else
+			perror("Can't read audio header");
+		goto done;
+	}
+
+	sbc_init(&sbc, 0L);
+
+	if (setup_encoder(&sbc, &au_hdr, filename, 0) < 0)
+		goto finish;
+
+	/* Skip extra bytes of the header if any */
+	if (read(fd, input, BE_INT(au_hdr.hdr_size) - len) < 0)
+		goto finish;
+
 	codesize = sbc_get_codesize(&sbc);
 	nframes = sizeof(input) / codesize;
 	while (1) {
@@ -164,24 +202,22 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 			/* Not enough data for encoding even a single frame */
 			break;
 		}
-		/* encode all the data from the input buffer in a loop */
+		/* encode all the data from the input buffer at once */
 		inp = input;
 		outp = output;
-		while (size >= codesize) {
-			len = sbc_encode(&sbc, inp, codesize,
-				outp, sizeof(output) - (outp - output),
-				&encoded);
-			if (len != codesize || encoded <= 0) {
-				fprintf(stderr,
-					"sbc_encode fail, len=%zd, encoded=%lu\n",
-					len, (unsigned long) encoded);
-				break;
-			}
+		len = sbc_encode_frames(&sbc, inp, size, outp, sizeof(output),
+							&frames, &encoded);
+		if (len <= 0 || encoded == 0) {
+			fprintf(stderr,
+				"sbc_encode_frames fail, len=%zd, encoded=%lu\n",
+				len, (unsigned long) encoded);
+		} else {
 			size -= len;
 			inp += len;
 			outp += encoded;
+			account(&au_hdr, frames, len);
 		}
-		len = write(fileno(stdout), output, outp - output);
+		len = write(out_fd, output, outp - output);
 		if (len != outp - output) {
 			perror("Can't write SBC output");
 			break;
@@ -196,6 +232,7 @@ static void encode(char *filename, int subbands, int bitpool, int joint,
 		}
 	}
 
+finish:
 	sbc_finish(&sbc);
 
 done:
@@ -203,6 +240,213 @@ done:
 		close(fd);
 }
 
+static int open_file(struct encode_file *file, char *filename)
+{
+	size_t hdr_size;
+	sbc_t sbc;
+	int err;
+
+	if (strcmp(filename, "-") == 0)
+		err = -EINVAL;
+	else
+		err = batch_input_map(&file->in, filename);
+
+	if (err < 0) {
+		file->stream = 1;
+		return err;
+	}
+
+	if (file->in.size < sizeof(file->au_hdr)) {
+		fprintf(stderr, "Can't read header from file %s: %s\n",
+						filename, strerror(EIO));
+		batch_input_unmap(&file->in);
+		return -EIO;
+	}
+
+	memcpy(&file->au_hdr, file->in.data, sizeof(file->au_hdr));
+
+	sbc_init(&sbc, 0L);
+
+	if (setup_encoder(&sbc, &file->au_hdr, filename, 0) < 0) {
+		sbc_finish(&sbc);
+		batch_input_unmap(&file->in);
+		return -EIO;
+	}
+
+	hdr_size = BE_INT(file->au_hdr.hdr_size);
+	if (hdr_size > file->in.size)
+		hdr_size = file->in.size;
+
+	file->pcm = file->in.data + hdr_size;
+	file->codesize = sbc_get_codesize(&sbc);
+	file->framelen = sbc_get_frame_length(&sbc);
+	file->nframes = (file->in.size - hdr_size) / file->codesize;
+
+	/* Segment buffers are sized from this, so take it from a frame
+	 * the encoder really produced rather than from the parameters */
+	if (file->nframes > 0) {
+		uint8_t frame[1024];
+		size_t written = 0;
+
+		sbc_encode_frames(&sbc, file->pcm, file->codesize, frame,
+					sizeof(frame), NULL, &written);
+		if (written > 0)
+			file->framelen = written;
+	}
+
+	sbc_finish(&sbc);
+
+	return 0;
+}
+
+static void encode_segment(struct batch_segment *seg)
+{
+	struct encode_file *file = seg->user_data;
+	const uint8_t *pcm;
+	uint8_t scratch[1024];
+	size_t n, frames, written;
+	ssize_t len;
+	sbc_t sbc;
+
+	sbc_init(&sbc, 0L);
+	setup_encoder(&sbc, &file->au_hdr, file->in.filename, 1);
+
+	pcm = file->pcm + (seg->first - seg->warmup) * file->codesize;
+
+	for (n = 0; n < seg->warmup; n++) {
+		sbc_encode_frames(&sbc, pcm, file->codesize, scratch,
+					sizeof(scratch), NULL, NULL);
+		pcm += file->codesize;
+	}
+
+	len = sbc_encode_frames(&sbc, pcm, seg->count * file->codesize,
+					seg->output, seg->output_len,
+					&frames, &written);
+	if (len < 0 || frames != seg->count)
+		seg->err = len < 0 ? len : -EIO;
+
+	seg->written = written;
+
+	sbc_finish(&sbc);
+}
+
+static void write_segment(struct batch_segment *seg)
+{
+	struct encode_file *file = seg->user_data;
+	ssize_t len;
+
+	if (seg->err < 0)
+		fprintf(stderr, "Can't encode %s: %s\n", file->in.filename,
+							strerror(-seg->err));
+
+	account(&file->au_hdr, seg->written / file->framelen,
+				seg->written / file->framelen *
+							file->codesize);
+
+	/* Mapped output is already in place */
+	if (seg->allocated == 0 || seg->written == 0)
+		return;
+
+	len = write(out_fd, seg->output, seg->written);
+	if (len != (ssize_t) seg->written)
+		perror("Can't write SBC output");
+}
+
+static void encode_files(char **filenames, int count)
+{
+	struct encode_file *files;
+	struct batch_segment *segs;
+	struct batch_output out;
+	unsigned int nsegs = 0;
+	size_t seglen, frames = 0, outlen = 0, first;
+	uint8_t *map = NULL;
+	int i, streamed = 0;
+
+	if (sizeof(struct au_header) != 24) {
+		/* Sanity check just in case */
+		fprintf(stderr, "FIXME: sizeof(au_hdr) != 24\n");
+		return;
+	}
+
+	files = calloc(count, sizeof(*files));
+	if (files == NULL) {
+		perror("Can't allocate files");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (open_file(&files[i], filenames[i]) < 0) {
+			streamed += files[i].stream;
+			continue;
+		}
+
+		frames += files[i].nframes;
+		files[i].offset = outlen;
+		outlen += files[i].nframes * files[i].framelen;
+	}
+
+	/* Inputs that can't be mapped keep the output from being mapped */
+	if (streamed == 0)
+		map = batch_output_map(&out, out_fd, outlen);
+
+	seglen = (frames + jobs - 1) / jobs;
+	if (seglen < BATCH_MIN_FRAMES)
+		seglen = BATCH_MIN_FRAMES;
+
+	segs = calloc(frames / seglen + count, sizeof(*segs));
+	if (segs == NULL) {
+		perror("Can't allocate segments");
+		goto done;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct encode_file *file = &files[i];
+		unsigned int warmup = WARMUP_FRAMES(blocks);
+
+		if (file->stream) {
+			/* Flush what comes before, since order matters */
+			batch_run(segs, nsegs, jobs, encode_segment,
+								write_segment);
+			nsegs = 0;
+
+			encode_stream(filenames[i]);
+			continue;
+		}
+
+		if (file->pcm == NULL)
+			continue;
+
+		for (first = 0; first < file->nframes; first += seglen) {
+			struct batch_segment *seg = &segs[nsegs++];
+
+			memset(seg, 0, sizeof(*seg));
+			seg->user_data = file;
+			seg->first = first;
+			seg->count = file->nframes - first;
+			if (seg->count > seglen)
+				seg->count = seglen;
+			seg->warmup = first < warmup ? first : warmup;
+			seg->output_len = seg->count * file->framelen;
+			if (map)
+				seg->output = map + file->offset +
+						first * file->framelen;
+		}
+	}
+
+	batch_run(segs, nsegs, jobs, encode_segment, write_segment);
+
+	free(segs);
+
+done:
+	if (map)
+		batch_output_unmap(&out);
+
+	for (i = 0; i < count; i++)
+		batch_input_unmap(&files[i].in);
+
+	free(files);
+}
+
 static void usage(void)
 {
 	printf("SBC encoder utility ver %s\n", VERSION);
@@ -221,6 +465,8 @@ static void usage(void)
 		"\t-d, --dualchannel    Dual channel\n"
 		"\t-S, --snr            Use SNR mode (default is loudness)\n"
 		"\t-B, --blocks         Number of blocks (4, 8, 12 or 16)\n"
+		"\t-o, --output <file>  Write to a file instead of stdout\n"
+		"\t-J, --jobs <n>       Encode with n threads\n"
 		"\n");
 }
 
@@ -233,15 +479,18 @@ static struct option main_options[] = {
 	{ "dualchannel",0, 0, 'd' },
 	{ "snr",	0, 0, 'S' },
 	{ "blocks",	1, 0, 'B' },
+	{ "output",	1, 0, 'o' },
+	{ "jobs",	1, 0, 'J' },
 	{ 0, 0, 0, 0 }
 };
 
 int main(int argc, char *argv[])
 {
-	int i, opt, subbands = 8, bitpool = 32, joint = 0, dualchannel = 0;
-	int snr = 0, blocks = 16;
+	char *output = NULL;
+	uint64_t nsec;
+	int opt;
 
-	while ((opt = getopt_long(argc, argv, "+hvs:b:jdSB:",
+	while ((opt = getopt_long(argc, argv, "+hvs:b:jdSB:o:J:",
 						main_options, NULL)) != -1) {
 		switch(opt) {
 		case 'h':
@@ -285,6 +534,18 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'J':
+			if (atoi(optarg) < 1) {
+				fprintf(stderr, "Invalid jobs\n");
+				exit(1);
+			}
+			jobs = atoi(optarg);
+			break;
+
 		default:
 			usage();
 			exit(1);
@@ -300,9 +561,26 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	for (i = 0; i < argc; i++)
-		encode(argv[i], subbands, bitpool, joint, dualchannel,
-								snr, blocks);
+	if (output) {
+		out_fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0) {
+			fprintf(stderr, "Can't open output %s: %s\n",
+						output, strerror(errno));
+			exit(1);
+		}
+	} else
+		out_fd = fileno(stdout);
+
+	nsec = batch_get_nsec();
+
+	encode_files(argv, argc);
+
+	if (verbose)
+		batch_report("encoded", total_frames, total_bytes,
+				total_seconds, batch_get_nsec() - nsec);
+
+	if (output)
+		close(out_fd);
 
 	return 0;
 }
@@ -35,6 +35,8 @@
 #include <string.h>
 #include <libgen.h>
 
+#include "batch.h"
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 struct sbc_frame_hdr {
 	uint8_t syncword:8;		/* Sync word */
@@ -150,12 +152,29 @@ static char *mode2str(uint8_t mode)
 	}
 }
 
-static ssize_t __read(int fd, void *buf, size_t count)
+/* Files are mapped, only stdin is actually read */
+struct input {
+	int fd;
+	struct batch_input map;
+	size_t pos;
+};
+
+static ssize_t __read(struct input *in, void *buf, size_t count)
 {
 	ssize_t len, pos = 0;
 
+	if (in->map.data) {
+		if (count > in->map.size - in->pos)
+			count = in->map.size - in->pos;
+
+		memcpy(buf, in->map.data + in->pos, count);
+		in->pos += count;
+
+		return count;
+	}
+
 	while (count > 0) {
-		len = read(fd, buf + pos, count);
+		len = read(in->fd, buf + pos, count);
 		if (len <= 0)
 			return len;
 
@@ -166,33 +185,65 @@ static ssize_t __read(int fd, void *buf, size_t count)
 	return pos;
 }
 
+static ssize_t __skip(struct input *in, size_t count)
+{
+	unsigned char buf[64];
+	ssize_t len, size, pos = 0;
+
+	if (in->map.data) {
+		if (count > in->map.size - in->pos)
+			count = in->map.size - in->pos;
+
+		in->pos += count;
+
+		return count;
+	}
+
+	while (count > 0) {
+		size = count > sizeof(buf) ? sizeof(buf) : count;
+
+		len = __read(in, buf, size);
+		if (len <= 0)
+			return pos;
+
+		count -= len;
+		pos   += len;
+	}
+
+	return pos;
+}
+
 #define SIZE 32
 
 static int analyze_file(char *filename)
 {
 	struct sbc_frame_hdr hdr;
-	unsigned char buf[64];
+	struct input in;
 	double rate;
 	int bitpool[SIZE], frame_len[SIZE];
 	int subbands, blocks, freq, method;
-	int n, p1, p2, fd, size, num;
+	int n, p1, p2, num, err;
 	ssize_t len;
 	unsigned int count;
 
+	memset(&in, 0, sizeof(in));
+
 	if (strcmp(filename, "-")) {
 		printf("Filename\t\t%s\n", basename(filename));
 
-		fd = open(filename, O_RDONLY);
-		if (fd < 0) {
-			perror("Can't open file");
+		err = batch_input_map(&in.map, filename);
+		if (err < 0) {
+			fprintf(stderr, "Can't open file: %s\n",
+							strerror(-err));
 			return -1;
 		}
 	} else
-		fd = fileno(stdin);
+		in.fd = fileno(stdin);
 
-	len = __read(fd, &hdr, sizeof(hdr));
+	len = __read(&in, &hdr, sizeof(hdr));
 	if (len != sizeof(hdr) || hdr.syncword != 0x9c) {
 		fprintf(stderr, "Not a SBC audio file\n");
+		batch_input_unmap(&in.map);
 		return -1;
 	}
 
@@ -211,23 +262,18 @@ static int analyze_file(char *filename)
 		frame_len[n] = 0;
 	}
 
-	if (lseek(fd, 0, SEEK_SET) < 0) {
+	if (in.map.data == NULL) {
 		num = 1;
 		rate = calc_bit_rate(&hdr);
-		while (count) {
-			size = count > sizeof(buf) ? sizeof(buf) : count;
-			len = __read(fd, buf, size);
-			if (len < 0)
-				break;
-			count -= len;
-		}
+		__skip(&in, count);
 	} else {
+		in.pos = 0;
 		num = 0;
 		rate = 0;
 	}
 
 	while (1) {
-		len = __read(fd, &hdr, sizeof(hdr));
+		len = __read(&in, &hdr, sizeof(hdr));
 		if (len < 0) {
 			fprintf(stderr, "Unable to read frame header"
 					" (error %d)\n", errno);
@@ -260,18 +306,9 @@ static int analyze_file(char *filename)
 		if (p2 >= 0)
 			frame_len[p2] = len;
 
-		while (count) {
-			size = count > sizeof(buf) ? sizeof(buf) : count;
-
-			len = __read(fd, buf, size);
-			if (len != size) {
-				fprintf(stderr, "Unable to read frame data "
+		if (__skip(&in, count) != (ssize_t) count)
+			fprintf(stderr, "Unable to read frame data "
 						"(error %d)\n", errno);
-				break;
-			}
-
-			count -= len;
-		}
 
 		rate += calc_bit_rate(&hdr);
 		num++;
@@ -296,8 +333,7 @@ static int analyze_file(char *filename)
 	if (num > 0)
 		printf("Bit rate\t\t%.3f kbps\n", rate / num);
 
-	if (fd > fileno(stderr))
-		close(fd);
+	batch_input_unmap(&in.map);
 
 	printf("\n");
 
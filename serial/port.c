@@ -35,6 +35,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 
 #include <bluetooth/bluetooth.h>
@@ -79,6 +80,11 @@ struct serial_port {
 	char		*dev;		/* RFCOMM device name */
 	int		fd;		/* Opened file descriptor */
 	GIOChannel	*io;		/* BtIO channel */
+	gboolean	revalidated;	/* Channel looked up for this connect */
+	GIOChannel	*notify;	/* inotify watch for the device node */
+	guint		notify_id;
+	guint		open_timer;
+	int		open_tries;
 	guint		listener_id;
 	struct serial_device *device;
 };
@@ -137,12 +143,32 @@ static struct serial_port *find_port(GSList *ports, const char *pattern)
 	return NULL;
 }
 
+static void open_watch_remove(struct serial_port *port)
+{
+	if (port->open_timer > 0) {
+		g_source_remove(port->open_timer);
+		port->open_timer = 0;
+	}
+
+	if (port->notify_id > 0) {
+		g_source_remove(port->notify_id);
+		port->notify_id = 0;
+	}
+
+	if (port->notify) {
+		g_io_channel_unref(port->notify);
+		port->notify = NULL;
+	}
+}
+
 static int port_release(struct serial_port *port)
 {
 	struct rfcomm_dev_req req;
 	int rfcomm_ctl;
 	int err = 0;
 
+	open_watch_remove(port);
+
 	if (port->id < 0) {
 		if (port->io) {
 			g_io_channel_shutdown(port->io, TRUE, NULL);
@@ -241,6 +267,8 @@ static void open_notify(int fd, int err, struct serial_port *port)
 	struct serial_device *device = port->device;
 	DBusMessage *reply;
 
+	open_watch_remove(port);
+
 	if (err < 0) {
 		/* Max tries exceeded */
 		port_release(port);
@@ -260,41 +288,132 @@ static gboolean open_continue(gpointer user_data)
 {
 	struct serial_port *port = user_data;
 	int fd;
-	static int ntries = MAX_OPEN_TRIES;
-
-	if (!port->listener_id)
-		return FALSE; /* Owner exited */
 
 	fd = open(port->dev, O_RDONLY | O_NOCTTY);
 	if (fd < 0) {
 		int err = -errno;
 		error("Could not open %s: %s (%d)",
 				port->dev, strerror(-err), -err);
-		if (!--ntries) {
-			/* Reporting error */
-			open_notify(fd, err, port);
-			ntries = MAX_OPEN_TRIES;
-			return FALSE;
-		}
-		return TRUE;
+		if (--port->open_tries > 0)
+			return TRUE;
+
+		/* Reporting error */
+		port->open_timer = 0;
+		open_notify(fd, err, port);
+		return FALSE;
 	}
 
 	/* Connection succeeded */
+	port->open_timer = 0;
 	open_notify(fd, 0, port);
 	return FALSE;
 }
 
-static int port_open(struct serial_port *port)
+static gboolean node_event(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
 {
+	struct serial_port *port = user_data;
+	char buf[1024]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const char *name = strrchr(port->dev, '/') + 1;
+	gboolean found = FALSE;
+	ssize_t len, off;
 	int fd;
 
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		/* Leave it to the timer */
+		port->notify_id = 0;
+		return FALSE;
+	}
+
+	len = read(g_io_channel_unix_get_fd(chan), buf, sizeof(buf));
+	if (len <= 0)
+		return TRUE;
+
+	for (off = 0; off < len; ) {
+		struct inotify_event *ev = (void *) (buf + off);
+
+		if (ev->mask & IN_Q_OVERFLOW)
+			found = TRUE;
+		else if (ev->len > 0 && strcmp(ev->name, name) == 0)
+			found = TRUE;
+
+		off += sizeof(*ev) + ev->len;
+	}
+
+	if (!found)
+		return TRUE;
+
+	/* Node created but maybe not set up yet, wait for its attributes */
 	fd = open(port->dev, O_RDONLY | O_NOCTTY);
-	if (fd < 0) {
-		g_timeout_add(OPEN_WAIT, open_continue, port);
+	if (fd < 0)
+		return TRUE;
+
+	port->notify_id = 0;
+	open_notify(fd, 0, port);
+	return FALSE;
+}
+
+static int port_open(struct serial_port *port)
+{
+	int fd, nfd;
+
+	/* Watch /dev before trying, so a node created in between the
+	 * first attempt and the watch is not missed */
+	nfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (nfd >= 0 && inotify_add_watch(nfd, "/dev",
+						IN_CREATE | IN_ATTRIB) < 0) {
+		close(nfd);
+		nfd = -1;
+	}
+
+	fd = open(port->dev, O_RDONLY | O_NOCTTY);
+	if (fd >= 0) {
+		if (nfd >= 0)
+			close(nfd);
+		return fd;
+	}
+
+	if (nfd < 0) {
+		/* No inotify, fall back to polling */
+		port->open_tries = MAX_OPEN_TRIES;
+		port->open_timer = g_timeout_add(OPEN_WAIT, open_continue,
+									port);
 		return -EINPROGRESS;
 	}
 
-	return fd;
+	port->notify = g_io_channel_unix_new(nfd);
+	g_io_channel_set_close_on_unref(port->notify, TRUE);
+	port->notify_id = g_io_add_watch(port->notify,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				node_event, port);
+
+	/* Last attempt once udev had as long as polling would allow */
+	port->open_tries = 1;
+	port->open_timer = g_timeout_add(MAX_OPEN_TRIES * OPEN_WAIT,
+						open_continue, port);
+
+	return -EINPROGRESS;
+}
+
+static void get_record_cb(sdp_list_t *recs, int err, gpointer user_data);
+
+static int resolve_channel(struct serial_port *port)
+{
+	struct serial_device *device = port->device;
+	uuid_t uuid;
+	int err;
+
+	err = bt_string2uuid(&uuid, port->uuid);
+	if (err < 0)
+		return err;
+
+	sdp_uuid128_to_uuid(&uuid);
+
+	port->revalidated = TRUE;
+
+	return bt_search_service(&device->src, &device->dst, &uuid,
+				get_record_cb, port, NULL);
 }
 
 static void rfcomm_connect_cb(GIOChannel *chan, GError *conn_err,
@@ -312,6 +431,20 @@ static void rfcomm_connect_cb(GIOChannel *chan, GError *conn_err,
 
 	if (conn_err) {
 		error("%s", conn_err->message);
+
+		/* The remote may have moved the service to another
+		 * channel, look it up again before giving up */
+		if (port->uuid && !port->revalidated) {
+			g_io_channel_unref(port->io);
+			port->io = NULL;
+
+			DBG("Revalidating channel %u of %s", port->channel,
+								port->uuid);
+
+			if (resolve_channel(port) == 0)
+				return;
+		}
+
 		reply = btd_error_failed(port->msg, conn_err->message);
 		goto fail;
 	}
@@ -421,22 +554,15 @@ failed:
 static int connect_port(struct serial_port *port)
 {
 	struct serial_device *device = port->device;
-	uuid_t uuid;
-	int err;
-
-	if (!port->uuid)
-		goto connect;
 
-	err = bt_string2uuid(&uuid, port->uuid);
-	if (err < 0)
-		return err;
+	port->revalidated = FALSE;
 
-	sdp_uuid128_to_uuid(&uuid);
-
-	return bt_search_service(&device->src, &device->dst, &uuid,
-				get_record_cb, port, NULL);
+	/* Reuse the channel of the last lookup, or the one from the
+	 * record the port was registered with, and only go to SDP when
+	 * there is none or connecting to it fails */
+	if (port->uuid && (port->channel < 1 || port->channel > 30))
+		return resolve_channel(port);
 
-connect:
 	port->io = bt_io_connect(BT_IO_RFCOMM, rfcomm_connect_cb, port,
 				NULL, NULL,
 				BT_IO_OPT_SOURCE_BDADDR, &device->src,
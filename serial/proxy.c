@@ -34,12 +34,15 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -64,6 +67,9 @@
 #define SERIAL_PROXY_INTERFACE	"org.bluez.SerialProxy"
 #define SERIAL_MANAGER_INTERFACE "org.bluez.SerialProxyManager"
 #define BUF_SIZE		1024
+#define BUF_SIZE_MAX		65536
+#define BUF_HIGH_WATER		(BUF_SIZE_MAX * 3 / 4)
+#define BUF_LOW_WATER		(BUF_SIZE_MAX / 4)
 
 typedef enum {
 	TTY_PROXY,
@@ -78,6 +84,30 @@ struct serial_adapter {
 	GSList			*proxies;	/* Proxies list */
 };
 
+struct serial_proxy;
+
+struct forward_stats {
+	uint64_t	bytes;		/* Written to dst */
+	uint32_t	stalls;		/* Times reading src was paused */
+	uint32_t	max_queue;	/* Most bytes ever waiting */
+};
+
+/* One direction of the data flow between the RFCOMM and local channels,
+ * buffered in a ring that grows up to BUF_SIZE_MAX */
+struct forward {
+	struct serial_proxy *prx;
+	GIOChannel	*src;
+	GIOChannel	*dst;
+	guint		read_watch;
+	guint		write_watch;
+	gboolean	paused;		/* Above the high watermark */
+	uint8_t		*buf;
+	size_t		size;
+	size_t		head;		/* Oldest byte waiting for dst */
+	size_t		len;		/* Bytes waiting for dst */
+	struct forward_stats *stats;
+};
+
 struct serial_proxy {
 	bdaddr_t	src;		/* Local address */
 	bdaddr_t	dst;		/* Remote address */
@@ -95,14 +125,61 @@ struct serial_proxy {
 	GIOChannel	*io;		/* Server listen */
 	GIOChannel	*rfcomm;	/* Remote RFCOMM channel*/
 	GIOChannel	*local;		/* Local channel: TTY or Unix socket */
+	struct forward	*to_local;	/* RFCOMM to local */
+	struct forward	*to_remote;	/* Local to RFCOMM */
+	struct forward_stats rx_stats;	/* RFCOMM to local */
+	struct forward_stats tx_stats;	/* Local to RFCOMM */
+	GPid		data_plane;	/* Forwarding helper process */
+	guint		data_plane_watch;
 	struct serial_adapter *adapter;	/* Adapter pointer */
 };
 
 static GSList *adapters = NULL;
 static int sk_counter = 0;
+static gboolean separate_data_plane = FALSE;
+
+static void forward_free(struct forward *fwd)
+{
+	if (fwd == NULL)
+		return;
+
+	if (fwd->read_watch)
+		g_source_remove(fwd->read_watch);
+
+	if (fwd->write_watch)
+		g_source_remove(fwd->write_watch);
+
+	g_free(fwd->buf);
+	g_free(fwd);
+}
+
+static void reap_data_plane(GPid pid, gint status, gpointer data)
+{
+	g_spawn_close_pid(pid);
+}
+
+static void stop_forwarding(struct serial_proxy *prx)
+{
+	if (prx->data_plane) {
+		g_source_remove(prx->data_plane_watch);
+		prx->data_plane_watch = 0;
+
+		kill(prx->data_plane, SIGTERM);
+		g_child_watch_add(prx->data_plane, reap_data_plane, NULL);
+		prx->data_plane = 0;
+	}
+
+	forward_free(prx->to_local);
+	prx->to_local = NULL;
+
+	forward_free(prx->to_remote);
+	prx->to_remote = NULL;
+}
 
 static void disable_proxy(struct serial_proxy *prx)
 {
+	stop_forwarding(prx);
+
 	if (prx->rfcomm) {
 		g_io_channel_shutdown(prx->rfcomm, TRUE, NULL);
 		g_io_channel_unref(prx->rfcomm);
@@ -200,73 +277,386 @@ static sdp_record_t *proxy_record_new(const char *uuid128, uint8_t channel)
 	return record;
 }
 
-static int channel_write(GIOChannel *chan, char *buf, size_t size)
+static void close_channels(struct serial_proxy *prx)
+{
+	stop_forwarding(prx);
+
+	g_io_channel_shutdown(prx->local, TRUE, NULL);
+	g_io_channel_unref(prx->local);
+	prx->local = NULL;
+
+	g_io_channel_shutdown(prx->rfcomm, TRUE, NULL);
+	g_io_channel_unref(prx->rfcomm);
+	prx->rfcomm = NULL;
+}
+
+/* Writes what dst takes without blocking, the rest stays buffered */
+static int forward_flush(struct forward *fwd)
 {
-	size_t wbytes;
 	ssize_t written;
+	size_t chunk;
 	int fd;
 
-	fd = g_io_channel_unix_get_fd(chan);
+	fd = g_io_channel_unix_get_fd(fwd->dst);
+
+	while (fwd->len > 0) {
+		chunk = MIN(fwd->len, fwd->size - fwd->head);
 
-	wbytes = 0;
-	while (wbytes < size) {
-		written = write(fd, buf + wbytes, size - wbytes);
-		if (written < 0)
+		written = write(fd, fwd->buf + fwd->head, chunk);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
 			return -errno;
+		}
 
-		wbytes += written;
+		fwd->head = (fwd->head + written) % fwd->size;
+		fwd->len -= written;
+		fwd->stats->bytes += written;
 	}
 
+	if (fwd->len == 0)
+		fwd->head = 0;
+
 	return 0;
 }
 
-static gboolean forward_data(GIOChannel *chan, GIOCondition cond, gpointer data)
+/* Contiguous free room after the queued bytes, the ring doubles when a
+ * read filled all of it and the limit isn't reached */
+static size_t forward_room(struct forward *fwd, uint8_t **ptr)
 {
-	char buf[BUF_SIZE];
-	struct serial_proxy *prx = data;
-	GIOChannel *dest;
-	ssize_t rbytes;
-	int fd, err;
+	size_t tail;
+
+	if (fwd->len == fwd->size && fwd->size < BUF_SIZE_MAX) {
+		uint8_t *buf = g_malloc(fwd->size * 2);
+		size_t first = fwd->size - fwd->head;
+
+		memcpy(buf, fwd->buf + fwd->head, first);
+		memcpy(buf + first, fwd->buf, fwd->head);
+
+		g_free(fwd->buf);
+		fwd->buf = buf;
+		fwd->head = 0;
+		fwd->size *= 2;
+	}
+
+	tail = (fwd->head + fwd->len) % fwd->size;
+	*ptr = fwd->buf + tail;
+
+	if (fwd->len == fwd->size)
+		return 0;
+
+	if (tail >= fwd->head)
+		return fwd->size - tail;
+
+	return fwd->head - tail;
+}
+
+static gboolean forward_read(GIOChannel *chan, GIOCondition cond,
+							gpointer data);
+static gboolean forward_write(GIOChannel *chan, GIOCondition cond,
+							gpointer data);
+
+static void forward_update(struct forward *fwd)
+{
+	/* Stop reading between the watermarks while dst can't keep up,
+	 * the peer gets flow controlled by RFCOMM credits or by the
+	 * local socket buffer */
+	if (!fwd->paused && fwd->len >= BUF_HIGH_WATER) {
+		fwd->paused = TRUE;
+		fwd->stats->stalls++;
+	} else if (fwd->paused && fwd->len <= BUF_LOW_WATER)
+		fwd->paused = FALSE;
+
+	if (fwd->len > fwd->stats->max_queue)
+		fwd->stats->max_queue = fwd->len;
+
+	if (!fwd->paused && fwd->read_watch == 0)
+		fwd->read_watch = g_io_add_watch(fwd->src,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				forward_read, fwd);
+	else if (fwd->paused && fwd->read_watch > 0) {
+		g_source_remove(fwd->read_watch);
+		fwd->read_watch = 0;
+	}
+
+	if (fwd->len > 0 && fwd->write_watch == 0)
+		fwd->write_watch = g_io_add_watch(fwd->dst,
+				G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				forward_write, fwd);
+	else if (fwd->len == 0 && fwd->write_watch > 0) {
+		g_source_remove(fwd->write_watch);
+		fwd->write_watch = 0;
+	}
+}
+
+static gboolean forward_write(GIOChannel *chan, GIOCondition cond,
+							gpointer data)
+{
+	struct forward *fwd = data;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
 
-	dest = (chan == prx->rfcomm) ? prx->local : prx->rfcomm;
+	if (cond & (G_IO_HUP | G_IO_ERR) || forward_flush(fwd) < 0) {
+		fwd->write_watch = 0;
+		close_channels(fwd->prx);
+		return FALSE;
+	}
+
+	if (fwd->len > 0) {
+		forward_update(fwd);
+		return TRUE;
+	}
+
+	fwd->write_watch = 0;
+	forward_update(fwd);
+
+	return FALSE;
+}
+
+static gboolean forward_read(GIOChannel *chan, GIOCondition cond,
+							gpointer data)
+{
+	struct forward *fwd = data;
+	uint8_t *ptr;
+	size_t room;
+	ssize_t rbytes;
+	int fd;
+
+	if (cond & G_IO_NVAL)
+		return FALSE;
 
 	fd = g_io_channel_unix_get_fd(chan);
 
 	if (cond & (G_IO_HUP | G_IO_ERR)) {
 		/* Try forward remaining data */
-		do {
-			rbytes = read(fd, buf, sizeof(buf));
+		while ((room = forward_room(fwd, &ptr)) > 0) {
+			rbytes = read(fd, ptr, room);
 			if (rbytes <= 0)
 				break;
 
-			err = channel_write(dest, buf, rbytes);
-		} while (err == 0);
+			fwd->len += rbytes;
 
-		g_io_channel_shutdown(prx->local, TRUE, NULL);
-		g_io_channel_unref(prx->local);
-		prx->local = NULL;
+			if (forward_flush(fwd) < 0)
+				break;
+		}
 
-		g_io_channel_shutdown(prx->rfcomm, TRUE, NULL);
-		g_io_channel_unref(prx->rfcomm);
-		prx->rfcomm = NULL;
+		fwd->read_watch = 0;
+		close_channels(fwd->prx);
 
 		return FALSE;
 	}
 
-	rbytes = read(fd, buf, sizeof(buf));
-	if (rbytes < 0)
+	room = forward_room(fwd, &ptr);
+
+	rbytes = read(fd, ptr, room);
+	if (rbytes < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
+
+	if (rbytes <= 0) {
+		fwd->read_watch = 0;
+		close_channels(fwd->prx);
 		return FALSE;
+	}
 
-	err = channel_write(dest, buf, rbytes);
-	if (err != 0)
+	fwd->len += rbytes;
+
+	if (forward_flush(fwd) < 0) {
+		fwd->read_watch = 0;
+		close_channels(fwd->prx);
+		return FALSE;
+	}
+
+	forward_update(fwd);
+
+	/* Paused above the high watermark, resumed by forward_write */
+	if (fwd->read_watch == 0)
 		return FALSE;
 
 	return TRUE;
 }
 
+struct data_dir {
+	int		src;
+	int		dst;
+	size_t		off;
+	size_t		len;
+	uint8_t		buf[BUF_SIZE_MAX];
+};
+
+static gboolean data_dir_read(struct data_dir *dir)
+{
+	ssize_t rbytes;
+
+	rbytes = read(dir->src, dir->buf, sizeof(dir->buf));
+	if (rbytes < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (rbytes == 0)
+		return FALSE;
+
+	dir->off = 0;
+	dir->len = rbytes;
+
+	return TRUE;
+}
+
+static gboolean data_dir_write(struct data_dir *dir)
+{
+	ssize_t written;
+
+	written = write(dir->dst, dir->buf + dir->off, dir->len);
+	if (written < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	dir->off += written;
+	dir->len -= written;
+
+	return TRUE;
+}
+
+/* Try forward remaining data, blocking is fine in the helper process */
+static void data_dir_drain(struct data_dir *dir)
+{
+	fcntl(dir->dst, F_SETFL, fcntl(dir->dst, F_GETFL) & ~O_NONBLOCK);
+
+	do {
+		while (dir->len > 0)
+			if (!data_dir_write(dir))
+				return;
+	} while (data_dir_read(dir) && dir->len > 0);
+}
+
+/* Forwarding loop of the helper process: reading a side only once what
+ * came from it was written out gives the same backpressure as the ring
+ * buffers of the in-process path */
+static void data_plane_run(int rfcomm, int local)
+{
+	static struct data_dir rx, tx;
+	struct pollfd fds[2];
+
+	rx.src = tx.dst = rfcomm;
+	rx.dst = tx.src = local;
+
+	while (1) {
+		fds[0].fd = rfcomm;
+		fds[0].events = (rx.len == 0 ? POLLIN : 0) |
+						(tx.len > 0 ? POLLOUT : 0);
+		fds[1].fd = local;
+		fds[1].events = (tx.len == 0 ? POLLIN : 0) |
+						(rx.len > 0 ? POLLOUT : 0);
+		fds[0].revents = fds[1].revents = 0;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+			data_dir_drain(&rx);
+			return;
+		}
+
+		if (fds[1].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+			data_dir_drain(&tx);
+			return;
+		}
+
+		if ((fds[0].revents & POLLIN) && rx.len == 0 &&
+							!data_dir_read(&rx))
+			return;
+
+		if ((fds[1].revents & POLLIN) && tx.len == 0 &&
+							!data_dir_read(&tx))
+			return;
+
+		if ((fds[1].revents & POLLOUT) && rx.len > 0 &&
+							!data_dir_write(&rx))
+			return;
+
+		if ((fds[0].revents & POLLOUT) && tx.len > 0 &&
+							!data_dir_write(&tx))
+			return;
+	}
+}
+
+static void data_plane_exited(GPid pid, gint status, gpointer data)
+{
+	struct serial_proxy *prx = data;
+
+	DBG("Serial Proxy: data plane %d exited", pid);
+
+	g_spawn_close_pid(pid);
+
+	prx->data_plane = 0;
+	prx->data_plane_watch = 0;
+
+	close_channels(prx);
+}
+
+/* Hands both fds over to a child process, bluetoothd keeps its copies
+ * only to tell the connection apart and to close it */
+static int start_data_plane(struct serial_proxy *prx)
+{
+	int rfcomm, local, fd;
+	long max_fd;
+	pid_t pid;
+
+	rfcomm = g_io_channel_unix_get_fd(prx->rfcomm);
+	local = g_io_channel_unix_get_fd(prx->local);
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (pid == 0) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		signal(SIGPIPE, SIG_IGN);
+
+		/* Listening and HCI sockets must not outlive the parent's
+		 * copies */
+		max_fd = sysconf(_SC_OPEN_MAX);
+		for (fd = 3; fd < max_fd; fd++)
+			if (fd != rfcomm && fd != local)
+				close(fd);
+
+		data_plane_run(rfcomm, local);
+
+		_exit(0);
+	}
+
+	DBG("Serial Proxy: data plane %d started", pid);
+
+	prx->data_plane = pid;
+	prx->data_plane_watch = g_child_watch_add(pid, data_plane_exited,
+									prx);
+
+	return 0;
+}
+
+static struct forward *forward_new(struct serial_proxy *prx, GIOChannel *src,
+							GIOChannel *dst)
+{
+	struct forward *fwd;
+
+	fwd = g_new0(struct forward, 1);
+	fwd->prx = prx;
+	fwd->stats = (src == prx->rfcomm) ? &prx->rx_stats : &prx->tx_stats;
+	fwd->src = src;
+	fwd->dst = dst;
+	fwd->size = BUF_SIZE;
+	fwd->buf = g_malloc(fwd->size);
+
+	forward_update(fwd);
+
+	return fwd;
+}
+
 static inline int unix_socket_connect(const char *address)
 {
 	struct sockaddr_un addr;
@@ -397,15 +787,18 @@ static void connect_event_cb(GIOChannel *chan, GError *conn_err, gpointer data)
 	if (sk < 0)
 		goto drop;
 
+	/* Writes must never block the main loop */
+	fcntl(sk, F_SETFL, fcntl(sk, F_GETFL) | O_NONBLOCK);
+
 	prx->local = g_io_channel_unix_new(sk);
 
-	g_io_add_watch(prx->rfcomm,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			forward_data, prx);
+	g_io_channel_set_flags(prx->rfcomm, G_IO_FLAG_NONBLOCK, NULL);
+
+	if (separate_data_plane && start_data_plane(prx) == 0)
+		return;
 
-	g_io_add_watch(prx->local,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			forward_data, prx);
+	prx->to_local = forward_new(prx, prx->rfcomm, prx->local);
+	prx->to_remote = forward_new(prx, prx->local, prx->rfcomm);
 
 	return;
 
@@ -605,6 +998,19 @@ static DBusMessage *proxy_get_info(DBusConnection *conn,
 		dict_append_entry(&dict, "address", DBUS_TYPE_STRING, &pstr);
 	}
 
+	dict_append_entry(&dict, "rx_bytes", DBUS_TYPE_UINT64,
+						&prx->rx_stats.bytes);
+	dict_append_entry(&dict, "rx_stalls", DBUS_TYPE_UINT32,
+						&prx->rx_stats.stalls);
+	dict_append_entry(&dict, "rx_max_queue", DBUS_TYPE_UINT32,
+						&prx->rx_stats.max_queue);
+	dict_append_entry(&dict, "tx_bytes", DBUS_TYPE_UINT64,
+						&prx->tx_stats.bytes);
+	dict_append_entry(&dict, "tx_stalls", DBUS_TYPE_UINT32,
+						&prx->tx_stats.stalls);
+	dict_append_entry(&dict, "tx_max_queue", DBUS_TYPE_UINT32,
+						&prx->tx_stats.max_queue);
+
 	dbus_message_iter_close_container(&iter, &dict);
 
 	return reply;
@@ -1172,6 +1578,9 @@ static void serial_proxy_init(struct serial_adapter *adapter)
 		return;
 	}
 
+	separate_data_plane = g_key_file_get_boolean(config, "General",
+					"SeparateDataPlane", NULL);
+
 	group_list = g_key_file_get_groups(config, NULL);
 
 	for (i = 0; group_list[i] != NULL; i++) {
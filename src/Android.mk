@@ -17,7 +17,9 @@ LOCAL_SRC_FILES:= \
 	event.c \
 	glib-helper.c \
 	log.c \
+	loopstat.c \
 	main.c \
+	memstat.c \
 	manager.c \
 	oob.c \
 	oui.c \
@@ -52,6 +54,14 @@ LOCAL_CFLAGS += \
 	-DBOARD_HAVE_BLUETOOTH_BCM
 endif
 
+ifeq ($(BLUETOOTH_LOOPSTAT),true)
+LOCAL_CFLAGS += -DLOOPSTAT -include $(LOCAL_PATH)/loopstat.h
+endif
+
+ifeq ($(BLUETOOTH_MEMSTAT),true)
+LOCAL_CFLAGS += -DMEMSTAT
+endif
+
 LOCAL_C_INCLUDES:= \
 	$(LOCAL_PATH)/../attrib \
 	$(LOCAL_PATH)/../btio \
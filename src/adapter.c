@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
 #ifdef ANDROID_EXPAND_NAME
@@ -63,6 +64,7 @@
 #include "attrib-server.h"
 #include "att.h"
 #include "eir.h"
+#include "memstat.h"
 
 /* Flags Descriptions */
 #define EIR_LIM_DISC                0x01 /* LE Limited Discoverable Mode */
@@ -73,12 +75,37 @@
 #define EIR_SIM_HOST                0x10 /* Simultaneous LE and BR/EDR to Same
 					    Device Capable (Host) */
 
+/* One bucket per RSSI magnitude, 0 to 128 */
+#define FOUND_RSSI_BUCKETS		129
+
+/* Properties of a DeviceFound signal */
+#define FOUND_RSSI			0x01
+#define FOUND_NAME			0x02
+#define FOUND_UUIDS			0x04
+#define FOUND_ALL			0xff
+
+/* A discovery cycle lasts eight inquiry length units of 1.28 s, split
+ * between BR/EDR inquiry and LE scanning after what each of them found */
+#define DISCOV_CYCLE_UNITS		8
+#define DISCOV_LE_SHARE_MIN		25	/* percent of the cycle */
+#define DISCOV_LE_SHARE_MAX		75
+
+/* 11.25 ms, window and interval alike so that scanning never pauses */
+#define DISCOV_SCAN_INTERVAL		0x0012
+#define DISCOV_SCAN_WINDOW		0x0012
+
 #define IO_CAPABILITY_DISPLAYONLY	0x00
 #define IO_CAPABILITY_DISPLAYYESNO	0x01
 #define IO_CAPABILITY_KEYBOARDONLY	0x02
 #define IO_CAPABILITY_NOINPUTNOOUTPUT	0x03
 #define IO_CAPABILITY_INVALID		0xFF
 
+/* Stored devices created and probed per main loop iteration */
+#define LOAD_DEVICES_BATCH		8
+
+#define RECONNECT_DELAY			1	/* seconds after power on */
+#define RECONNECT_TIMEOUT		20	/* seconds to page a device */
+
 #define check_address(address) bachk(address)
 
 static DBusConnection *connection = NULL;
@@ -88,6 +115,15 @@ static GSList *ops_candidates = NULL;
 
 const struct btd_adapter_ops *adapter_ops = NULL;
 
+/* What a discovery session is interested in, a device matches if it has
+ * any of the UUIDs and is at least as strong as the RSSI threshold */
+struct discovery_filter {
+	uint8_t			transport;
+	gboolean		has_rssi;
+	int16_t			rssi;
+	struct eir_uuids	uuids;
+};
+
 struct session_req {
 	struct btd_adapter	*adapter;
 	DBusConnection		*conn;		/* Connection reference */
@@ -97,15 +133,24 @@ struct session_req {
 	uint8_t			mode;		/* Requested mode */
 	int			refcount;	/* Session refcount */
 	gboolean		got_reply;	/* Agent reply received */
+	struct discovery_filter	*filter;	/* Discovery filter */
 };
 
 struct service_auth {
 	service_auth_cb cb;
 	void *user_data;
+	char *uuid;
 	struct btd_device *device;
 	struct btd_adapter *adapter;
+	struct agent *agent;		/* Set while sent to the agent */
 };
 
+static void service_auth_free(struct service_auth *auth)
+{
+	g_free(auth->uuid);
+	g_free(auth);
+}
+
 struct btd_adapter {
 	uint16_t dev_id;
 	int up;
@@ -126,12 +171,29 @@ struct btd_adapter {
 	struct session_req *pending_mode;
 	int state;			/* standard inq, periodic inq, name
 					 * resolving, suspended discovery */
-	GSList *found_devices;
-	GSList *oor_devices;		/* out of range device list */
+	GHashTable *found_devices;	/* bdaddr -> struct remote_dev_info */
+	GList *found_rssi[FOUND_RSSI_BUCKETS];	/* found devices by |rssi| */
+	unsigned int found_generation;	/* discovery cycles completed */
+	gboolean oor_tracking;		/* devices not seen are out of range */
+	guint found_emit_id;		/* rate limited DeviceFound signals */
+	struct discovery_filter *discov_filter;	/* of all the sessions */
+	unsigned int le_share;		/* LE part of a cycle, percent */
+	unsigned int cycle_bredr;	/* BR/EDR devices seen this cycle */
+	unsigned int cycle_le;		/* LE devices seen this cycle */
 	struct agent *agent;		/* For the new API */
-	guint auth_idle_id;		/* Ongoing authorization */
+	guint auth_idle_id;		/* Authorization queue processing */
+	GSList *trusted_auths;		/* Authorizations without agent */
+	GSList *auths;			/* Authorizations for the agent */
+	struct service_auth *auth;	/* Authorization sent to the agent */
+	guint reconnect_id;		/* Reconnection start timer */
+	GSList *reconnect_queue;	/* Devices waiting to be paged */
+	GSList *reconnecting;		/* Devices being paged */
 	GSList *connections;		/* Connected devices */
 	GSList *devices;		/* Devices structure pointers */
+	struct device_loader *loader;	/* Stored devices not created yet */
+	guint load_id;			/* Stored devices loading */
+	GHashTable *device_addrs;	/* Devices by address */
+	GHashTable *device_paths;	/* Devices by object path */
 	GSList *mode_sessions;		/* Request Mode sessions */
 	GSList *disc_sessions;		/* Discovery sessions */
 	guint scheduler_id;		/* Scheduler handle */
@@ -151,8 +213,15 @@ struct btd_adapter {
 	gboolean name_stored;
 
 	GSList *loaded_drivers;
+
+	gboolean cod_cache_off;		/* class/EIR written as they change */
+	gboolean services_batched;	/* cod cache enabled for a batch */
+	gboolean uuids_changed;		/* UUIDs signal deferred by a batch */
 };
 
+/* Nesting of btd_adapter_services_begin() calls */
+static int services_batch = 0;
+
 static void adapter_set_pairable_timeout(struct btd_adapter *adapter,
 					guint interval);
 static DBusMessage *set_discoverable(DBusConnection *conn, DBusMessage *msg,
@@ -180,14 +249,60 @@ static int found_device_cmp(const struct remote_dev_info *d1,
 
 static void dev_info_free(struct remote_dev_info *dev)
 {
+	btd_memstat_sub(MEMSTAT_FOUND_DEVICES, sizeof(*dev));
+
 	g_free(dev->name);
 	g_free(dev->alias);
-	g_slist_foreach(dev->services, (GFunc) g_free, NULL);
-	g_slist_free(dev->services);
+	g_free(dev->services);
 	g_strfreev(dev->uuids);
 	g_free(dev);
 }
 
+static inline int rssi_bucket(int8_t rssi)
+{
+	return rssi < 0 ? -rssi : rssi;
+}
+
+/* The found devices are kept in one bucket per RSSI magnitude so that an
+ * RSSI change just moves the device between two buckets */
+static void found_device_link(struct btd_adapter *adapter,
+					struct remote_dev_info *dev)
+{
+	int bucket = rssi_bucket(dev->rssi);
+
+	adapter->found_rssi[bucket] = g_list_prepend(
+					adapter->found_rssi[bucket], dev);
+	dev->rssi_link = adapter->found_rssi[bucket];
+}
+
+static void found_device_unlink(struct btd_adapter *adapter,
+					struct remote_dev_info *dev)
+{
+	int bucket = rssi_bucket(dev->rssi);
+
+	if (dev->rssi_link == NULL)
+		return;
+
+	adapter->found_rssi[bucket] = g_list_delete_link(
+				adapter->found_rssi[bucket], dev->rssi_link);
+	dev->rssi_link = NULL;
+}
+
+static void clear_found_devices(struct btd_adapter *adapter)
+{
+	int i;
+
+	for (i = 0; i < FOUND_RSSI_BUCKETS; i++) {
+		g_list_free(adapter->found_rssi[i]);
+		adapter->found_rssi[i] = NULL;
+	}
+
+	g_hash_table_destroy(adapter->found_devices);
+	adapter->found_devices = g_hash_table_new_full(bt_bdaddr_hash,
+						bt_bdaddr_equal, NULL,
+						(GDestroyNotify) dev_info_free);
+}
+
 /*
  * Device name expansion
  *   %d - device id
@@ -276,53 +391,86 @@ int btd_adapter_set_class(struct btd_adapter *adapter, uint8_t major,
 static int pending_remote_name_cancel(struct btd_adapter *adapter)
 {
 	struct remote_dev_info *dev, match;
-	int err;
+	gboolean found = FALSE;
+	int err = 0;
 
-	/* find the pending remote name request */
+	/* find the pending remote name requests */
 	memset(&match, 0, sizeof(struct remote_dev_info));
 	bacpy(&match.bdaddr, BDADDR_ANY);
 	match.name_status = NAME_REQUESTED;
 
-	dev = adapter_search_found_devices(adapter, &match);
-	if (!dev) /* no pending request */
-		return -ENODATA;
+	while ((dev = adapter_search_found_devices(adapter, &match))) {
+		/* The completion that follows has nothing to start anymore */
+		dev->name_status = NAME_NOT_REQUIRED;
 
-	err = adapter_ops->cancel_resolve_name(adapter->dev_id, &dev->bdaddr);
-	if (err < 0)
-		error("Remote name cancel failed: %s(%d)",
+		err = adapter_ops->cancel_resolve_name(adapter->dev_id,
+								&dev->bdaddr);
+		if (err < 0)
+			error("Remote name cancel failed: %s(%d)",
 						strerror(errno), errno);
 
+		found = TRUE;
+	}
+
+	if (!found) /* no pending request */
+		return -ENODATA;
+
 	adapter_set_state(adapter, STATE_IDLE);
 
 	return err;
 }
 
+static unsigned int count_found_devices(struct btd_adapter *adapter,
+						name_status_t status)
+{
+	unsigned int count = 0;
+	GList *l;
+	int i;
+
+	for (i = 0; i < FOUND_RSSI_BUCKETS; i++) {
+		for (l = adapter->found_rssi[i]; l; l = l->next) {
+			struct remote_dev_info *dev = l->data;
+
+			if (dev->name_status == status)
+				count++;
+		}
+	}
+
+	return count;
+}
+
 int adapter_resolve_names(struct btd_adapter *adapter)
 {
 	struct remote_dev_info *dev, match;
-	int err;
+	unsigned int pending;
+	int err = -ENODATA;
 
-	/* Do not attempt to resolve more names if on suspended state */
-	if (adapter->state == STATE_SUSPENDED)
+	/* Do not attempt to resolve more names if on suspended state, nor
+	 * let late completions start requests outside of name resolving */
+	if (adapter->state != STATE_RESOLVNAME)
 		return 0;
 
+	pending = count_found_devices(adapter, NAME_REQUESTED);
+
 	memset(&match, 0, sizeof(struct remote_dev_info));
 	bacpy(&match.bdaddr, BDADDR_ANY);
 	match.name_status = NAME_REQUIRED;
 
-	dev = adapter_search_found_devices(adapter, &match);
-	if (!dev)
-		return -ENODATA;
+	/* Keep up to the configured number of requests running, the
+	 * search returns the strongest signal first */
+	while (pending < main_opts.name_resolv_parallel) {
+		dev = adapter_search_found_devices(adapter, &match);
+		if (!dev)
+			break;
 
-	/* send at least one request or return failed if the list is empty */
-	do {
 		/* flag to indicate the current remote name requested */
 		dev->name_status = NAME_REQUESTED;
 
 		err = adapter_ops->resolve_name(adapter->dev_id, &dev->bdaddr);
-
-		if (!err)
-			break;
+		if (!err) {
+			pending++;
+			continue;
+		}
 
 		error("Unable to send HCI remote name req: %s (%d)",
 						strerror(errno), errno);
@@ -330,10 +478,11 @@ int adapter_resolve_names(struct btd_adapter *adapter)
 		/* if failed, request the next element */
 		/* remove the element from the list */
 		adapter_remove_found_device(adapter, &dev->bdaddr);
+	}
 
-		/* get the next element */
-		dev = adapter_search_found_devices(adapter, &match);
-	} while (dev);
+	/* return failed only without any request left running */
+	if (pending > 0)
+		return 0;
 
 	return err;
 }
@@ -611,7 +760,7 @@ void btd_adapter_pairable_changed(struct btd_adapter *adapter,
 
 	write_device_pairable(&adapter->bdaddr, pairable);
 
-	emit_property_changed(connection, adapter->path,
+	queue_property_changed(connection, adapter->path,
 				ADAPTER_INTERFACE, "Pairable",
 				DBUS_TYPE_BOOLEAN, &pairable);
 
@@ -698,35 +847,27 @@ static uint8_t get_needed_mode(struct btd_adapter *adapter, uint8_t mode)
 	return mode;
 }
 
-static GSList *remove_bredr(GSList *all)
+static gboolean remove_bredr(gpointer key, gpointer value, gpointer user_data)
 {
-	GSList *l, *le;
-
-	for (l = all, le = NULL; l; l = l->next) {
-		struct remote_dev_info *dev = l->data;
-		if (dev->le == FALSE) {
-			dev_info_free(dev);
-			continue;
-		}
+	struct remote_dev_info *dev = value;
+	struct btd_adapter *adapter = user_data;
 
-		le = g_slist_append(le, dev);
-	}
+	if (dev->le)
+		return FALSE;
 
-	g_slist_free(all);
+	found_device_unlink(adapter, dev);
 
-	return le;
+	return TRUE;
 }
 
 static void stop_discovery(struct btd_adapter *adapter)
 {
 	pending_remote_name_cancel(adapter);
 
-	adapter->found_devices = remove_bredr(adapter->found_devices);
+	g_hash_table_foreach_remove(adapter->found_devices, remove_bredr,
+								adapter);
 
-	if (adapter->oor_devices) {
-		g_slist_free(adapter->oor_devices);
-		adapter->oor_devices = NULL;
-	}
+	adapter->oor_tracking = FALSE;
 
 	/* Reset if suspended, otherwise remove timer (software scheduler)
 	   or request inquiry to stop */
@@ -744,6 +885,76 @@ static void stop_discovery(struct btd_adapter *adapter)
 	adapter_ops->stop_discovery(adapter->dev_id);
 }
 
+/* Sessions without a filter see everything, so the merged filter only
+ * exists while all the discovery sessions have one */
+static void update_discovery_filter(struct btd_adapter *adapter)
+{
+	struct discovery_filter *merged;
+	gboolean any_rssi = FALSE, any_uuid = FALSE;
+	GSList *l;
+
+	g_free(adapter->discov_filter);
+	adapter->discov_filter = NULL;
+
+	if (adapter->disc_sessions == NULL)
+		return;
+
+	for (l = adapter->disc_sessions; l; l = l->next) {
+		struct session_req *req = l->data;
+
+		if (req->filter == NULL)
+			return;
+	}
+
+	merged = g_new0(struct discovery_filter, 1);
+	merged->rssi = G_MAXINT16;
+
+	for (l = adapter->disc_sessions; l; l = l->next) {
+		struct discovery_filter *filter = ((struct session_req *)
+							l->data)->filter;
+
+		merged->transport |= filter->transport;
+
+		if (!filter->has_rssi)
+			any_rssi = TRUE;
+		else if (filter->rssi < merged->rssi)
+			merged->rssi = filter->rssi;
+
+		if (eir_uuids_count(&filter->uuids) == 0)
+			any_uuid = TRUE;
+		else
+			eir_uuids_merge(&merged->uuids, &filter->uuids);
+	}
+
+	merged->has_rssi = !any_rssi;
+
+	if (any_uuid)
+		memset(&merged->uuids, 0, sizeof(merged->uuids));
+
+	adapter->discov_filter = merged;
+}
+
+static gboolean found_device_wanted(struct btd_adapter *adapter,
+					struct remote_dev_info *dev)
+{
+	struct discovery_filter *filter = adapter->discov_filter;
+
+	if (filter == NULL)
+		return TRUE;
+
+	if (!(filter->transport & (dev->le ? DISCOVERY_LE : DISCOVERY_BREDR)))
+		return FALSE;
+
+	if (filter->has_rssi && dev->rssi < filter->rssi)
+		return FALSE;
+
+	if (eir_uuids_count(&filter->uuids) == 0)
+		return TRUE;
+
+	return dev->services && eir_uuids_match(dev->services,
+							&filter->uuids);
+}
+
 static void session_remove(struct session_req *req)
 {
 	struct btd_adapter *adapter = req->adapter;
@@ -773,6 +984,8 @@ static void session_remove(struct session_req *req)
 		adapter->disc_sessions = g_slist_remove(adapter->disc_sessions,
 							req);
 
+		update_discovery_filter(adapter);
+
 		if (adapter->disc_sessions)
 			return;
 
@@ -797,6 +1010,7 @@ static void session_free(struct session_req *req)
 
 	if (req->conn)
 		dbus_connection_unref(req->conn);
+	g_free(req->filter);
 	g_free(req->owner);
 	g_free(req);
 }
@@ -882,7 +1096,7 @@ static DBusMessage *set_discoverable_timeout(DBusConnection *conn,
 
 	path = dbus_message_get_path(msg);
 
-	emit_property_changed(conn, path,
+	queue_property_changed(conn, path,
 				ADAPTER_INTERFACE, "DiscoverableTimeout",
 				DBUS_TYPE_UINT32, &timeout);
 
@@ -909,7 +1123,7 @@ static DBusMessage *set_pairable_timeout(DBusConnection *conn,
 
 	path = dbus_message_get_path(msg);
 
-	emit_property_changed(conn, path,
+	queue_property_changed(conn, path,
 				ADAPTER_INTERFACE, "PairableTimeout",
 				DBUS_TYPE_UINT32, &timeout);
 
@@ -934,7 +1148,7 @@ void btd_adapter_class_changed(struct btd_adapter *adapter, uint32_t new_class)
 		attrib_gap_set(GATT_CHARAC_APPEARANCE, class, 2);
 	}
 
-	emit_property_changed(connection, adapter->path,
+	queue_property_changed(connection, adapter->path,
 				ADAPTER_INTERFACE, "Class",
 				DBUS_TYPE_UINT32, &new_class);
 }
@@ -956,7 +1170,7 @@ void adapter_update_local_name(struct btd_adapter *adapter, const char *name)
 		write_local_name(&adapter->bdaddr, adapter->name);
 
 		if (connection)
-			emit_property_changed(connection, adapter->path,
+			queue_property_changed(connection, adapter->path,
 						ADAPTER_INTERFACE, "Name",
 						DBUS_TYPE_STRING, &name_ptr);
 	}
@@ -980,7 +1194,7 @@ static DBusMessage *set_name(DBusConnection *conn, DBusMessage *msg,
 
 	strncpy(adapter->name, name, MAX_NAME_LENGTH);
 	write_local_name(&adapter->bdaddr, name);
-	emit_property_changed(connection, adapter->path,
+	queue_property_changed(connection, adapter->path,
 					ADAPTER_INTERFACE, "Name",
 					DBUS_TYPE_STRING, &name_ptr);
 
@@ -996,23 +1210,75 @@ done:
 	return dbus_message_new_method_return(msg);
 }
 
+/* Object paths used to be compared with strcasecmp, keep matching them
+ * regardless of case */
+static guint path_hash(gconstpointer key)
+{
+	const char *p;
+	guint h = 5381;
+
+	for (p = key; *p != '\0'; p++)
+		h = (h << 5) + h + g_ascii_tolower(*p);
+
+	return h;
+}
+
+static gboolean path_equal(gconstpointer a, gconstpointer b)
+{
+	return g_ascii_strcasecmp(a, b) == 0;
+}
+
+static void adapter_link_device(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	bdaddr_t *bdaddr = g_new(bdaddr_t, 1);
+
+	device_get_address(device, bdaddr);
+	g_hash_table_replace(adapter->device_addrs, bdaddr, device);
+	g_hash_table_replace(adapter->device_paths,
+				(gpointer) device_get_path(device), device);
+}
+
+static void adapter_unlink_device(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	bdaddr_t bdaddr;
+
+	device_get_address(device, &bdaddr);
+
+	if (g_hash_table_lookup(adapter->device_addrs, &bdaddr) == device)
+		g_hash_table_remove(adapter->device_addrs, &bdaddr);
+
+	if (g_hash_table_lookup(adapter->device_paths,
+					device_get_path(device)) == device)
+		g_hash_table_remove(adapter->device_paths,
+						device_get_path(device));
+}
+
+static void adapter_load_pending(struct btd_adapter *adapter);
+
+static struct btd_device *adapter_find_device_by_path(
+						struct btd_adapter *adapter,
+						const char *path)
+{
+	adapter_load_pending(adapter);
+
+	return g_hash_table_lookup(adapter->device_paths, path);
+}
+
 struct btd_device *adapter_find_device(struct btd_adapter *adapter,
 							const char *dest)
 {
-	struct btd_device *device;
-	GSList *l;
+	bdaddr_t bdaddr;
 
-	if (!adapter)
+	if (!adapter || !dest || bachk(dest) < 0)
 		return NULL;
 
-	l = g_slist_find_custom(adapter->devices, dest,
-					(GCompareFunc) device_address_cmp);
-	if (!l)
-		return NULL;
+	adapter_load_pending(adapter);
 
-	device = l->data;
+	str2ba(dest, &bdaddr);
 
-	return device;
+	return g_hash_table_lookup(adapter->device_addrs, &bdaddr);
 }
 
 static void adapter_update_devices(struct btd_adapter *adapter)
@@ -1028,7 +1294,7 @@ static void adapter_update_devices(struct btd_adapter *adapter)
 		devices[i] = (char *) device_get_path(dev);
 	}
 
-	emit_array_property_changed(connection, adapter->path,
+	queue_array_property_changed(connection, adapter->path,
 					ADAPTER_INTERFACE, "Devices",
 					DBUS_TYPE_OBJECT_PATH, &devices, i);
 	g_free(devices);
@@ -1054,7 +1320,7 @@ static void adapter_emit_uuids_updated(struct btd_adapter *adapter)
 			uuids[i++] = uuid;
 	}
 
-	emit_array_property_changed(connection, adapter->path,
+	queue_array_property_changed(connection, adapter->path,
 			ADAPTER_INTERFACE, "UUIDs", DBUS_TYPE_STRING, &uuids, i);
 
 	g_strfreev(uuids);
@@ -1113,6 +1379,65 @@ static int uuid_cmp(const void *a, const void *b)
 	return sdp_uuid_cmp(&rec->svclass, uuid);
 }
 
+static void adapter_services_changed(struct btd_adapter *adapter)
+{
+	if (services_batch > 0) {
+		adapter->uuids_changed = TRUE;
+		return;
+	}
+
+	adapter_emit_uuids_updated(adapter);
+}
+
+static void batch_begin(struct btd_adapter *adapter, gpointer user_data)
+{
+	if (!adapter->cod_cache_off)
+		return;
+
+	if (adapter_ops->enable_cod_cache(adapter->dev_id) < 0)
+		return;
+
+	adapter->cod_cache_off = FALSE;
+	adapter->services_batched = TRUE;
+}
+
+static void batch_commit(struct btd_adapter *adapter, gpointer user_data)
+{
+	if (adapter->services_batched) {
+		adapter->services_batched = FALSE;
+
+		/* A powered down adapter flushes its cache on start */
+		if (adapter->up) {
+			adapter_ops->disable_cod_cache(adapter->dev_id);
+			adapter->cod_cache_off = TRUE;
+		}
+	}
+
+	if (adapter->uuids_changed) {
+		adapter->uuids_changed = FALSE;
+		adapter_emit_uuids_updated(adapter);
+	}
+}
+
+/*
+ * Service records added or removed until the matching commit only update
+ * the class of device, EIR data and UUIDs property once, at commit time.
+ * Calls can be nested.
+ */
+void btd_adapter_services_begin(void)
+{
+	if (services_batch++ == 0)
+		manager_foreach_adapter(batch_begin, NULL);
+}
+
+void btd_adapter_services_commit(void)
+{
+	if (services_batch == 0 || --services_batch > 0)
+		return;
+
+	manager_foreach_adapter(batch_commit, NULL);
+}
+
 void adapter_service_insert(struct btd_adapter *adapter, void *r)
 {
 	sdp_record_t *rec = r;
@@ -1131,7 +1456,7 @@ void adapter_service_insert(struct btd_adapter *adapter, void *r)
 		adapter_ops->add_uuid(adapter->dev_id, &rec->svclass, svc_hint);
 	}
 
-	adapter_emit_uuids_updated(adapter);
+	adapter_services_changed(adapter);
 }
 
 void adapter_service_remove(struct btd_adapter *adapter, void *r)
@@ -1143,7 +1468,7 @@ void adapter_service_remove(struct btd_adapter *adapter, void *r)
 	if (sdp_list_find(adapter->services, &rec->svclass, uuid_cmp) == NULL)
 		adapter_ops->remove_uuid(adapter->dev_id, &rec->svclass);
 
-	adapter_emit_uuids_updated(adapter);
+	adapter_services_changed(adapter);
 }
 
 static struct btd_device *adapter_create_device(DBusConnection *conn,
@@ -1163,6 +1488,7 @@ static struct btd_device *adapter_create_device(DBusConnection *conn,
 	device_set_temporary(device, TRUE);
 
 	adapter->devices = g_slist_append(adapter->devices, device);
+	adapter_link_device(adapter, device);
 
 	path = device_get_path(device);
 	g_dbus_emit_signal(conn, adapter->path,
@@ -1175,105 +1501,370 @@ static struct btd_device *adapter_create_device(DBusConnection *conn,
 	return device;
 }
 
-void adapter_remove_device(DBusConnection *conn, struct btd_adapter *adapter,
-						struct btd_device *device,
-						gboolean remove_storage)
-{
-	const gchar *dev_path = device_get_path(device);
-	struct agent *agent;
-
-	adapter->devices = g_slist_remove(adapter->devices, device);
-	adapter->connections = g_slist_remove(adapter->connections, device);
-
-	adapter_update_devices(adapter);
+static gboolean adapter_cancel_auths(struct btd_adapter *adapter,
+						struct btd_device *device);
 
-	g_dbus_emit_signal(conn, adapter->path,
-			ADAPTER_INTERFACE, "DeviceRemoved",
-			DBUS_TYPE_OBJECT_PATH, &dev_path,
-			DBUS_TYPE_INVALID);
+struct reconnect_req {
+	struct btd_adapter *adapter;
+	struct btd_device *device;
+	guint timeout;
+};
 
-	agent = device_get_agent(device);
+struct reconnect_candidate {
+	struct btd_device *device;
+	char lastused[24];
+};
 
-	if (agent && device_is_authorizing(device))
-		agent_cancel(agent);
+static void reconnect_req_free(struct reconnect_req *req)
+{
+	if (req->timeout)
+		g_source_remove(req->timeout);
 
-	device_remove(device, remove_storage);
+	btd_device_unref(req->device);
+	g_free(req);
 }
 
-struct btd_device *adapter_get_device(DBusConnection *conn,
-						struct btd_adapter *adapter,
-						const gchar *address)
+static void reconnect_next(struct btd_adapter *adapter);
+
+static gboolean reconnect_timeout(gpointer user_data)
 {
-	struct btd_device *device;
+	struct reconnect_req *req = user_data;
+	struct btd_adapter *adapter = req->adapter;
 
-	DBG("%s", address);
+	DBG("%s did not connect in time", device_get_path(req->device));
 
-	if (!adapter)
-		return NULL;
+	req->timeout = 0;
+	adapter->reconnecting = g_slist_remove(adapter->reconnecting, req);
+	reconnect_req_free(req);
 
-	device = adapter_find_device(adapter, address);
-	if (device)
-		return device;
+	reconnect_next(adapter);
 
-	return adapter_create_device(conn, adapter, address,
-						DEVICE_TYPE_BREDR);
+	return FALSE;
 }
 
-static int start_discovery(struct btd_adapter *adapter)
+static void reconnect_next(struct btd_adapter *adapter)
 {
-	/* Do not start if suspended */
-	if (adapter->state == STATE_SUSPENDED)
-		return 0;
+	while (adapter->reconnect_queue != NULL &&
+			g_slist_length(adapter->reconnecting) <
+					main_opts.reconnect_parallel) {
+		struct btd_device *device = adapter->reconnect_queue->data;
+		struct reconnect_req *req;
 
-	/* Postpone discovery if still resolving names */
-	if (adapter->state == STATE_RESOLVNAME)
-		return -EINPROGRESS;
+		adapter->reconnect_queue = g_slist_remove(
+					adapter->reconnect_queue, device);
 
-	pending_remote_name_cancel(adapter);
+		/* Connected by the device itself meanwhile */
+		if (device_is_connected(device) ||
+					device_reconnect(device) < 0) {
+			btd_device_unref(device);
+			continue;
+		}
+
+		req = g_new0(struct reconnect_req, 1);
+		req->adapter = adapter;
+		req->device = device;
+		req->timeout = g_timeout_add_seconds(RECONNECT_TIMEOUT,
+							reconnect_timeout, req);
 
-	return adapter_ops->start_discovery(adapter->dev_id);
+		adapter->reconnecting = g_slist_append(adapter->reconnecting,
+									req);
+	}
 }
 
-static gboolean discovery_cb(gpointer user_data)
+static gint lastused_cmp(gconstpointer a, gconstpointer b)
 {
-	struct btd_adapter *adapter = user_data;
-	int err;
+	const struct reconnect_candidate *ca = a, *cb = b;
 
-	err = start_discovery(adapter);
-	if (err == -EINPROGRESS)
-		return TRUE;
-	else if (err < 0)
-		error("start_discovery: %s (%d)", strerror(-err), -err);
-
-	return FALSE;
+	/* Most recently used first, never used ones last */
+	return strcmp(cb->lastused, ca->lastused);
 }
 
-static DBusMessage *adapter_start_discovery(DBusConnection *conn,
-						DBusMessage *msg, void *data)
+static gboolean reconnect_start(gpointer user_data)
 {
-	struct session_req *req;
-	struct btd_adapter *adapter = data;
-	const char *sender = dbus_message_get_sender(msg);
-	int err;
+	struct btd_adapter *adapter = user_data;
+	GSList *l, *candidates = NULL;
 
-	if (!adapter->up)
-		return btd_error_not_ready(msg);
+	adapter->reconnect_id = 0;
 
-	req = find_session(adapter->disc_sessions, sender);
-	if (req) {
-		session_ref(req);
-		return dbus_message_new_method_return(msg);
-	}
+	adapter_load_pending(adapter);
 
-	if (adapter->disc_sessions)
-		goto done;
+	for (l = adapter->devices; l != NULL; l = l->next) {
+		struct btd_device *device = l->data;
+		struct reconnect_candidate *c;
+		bdaddr_t bdaddr;
 
-	g_slist_foreach(adapter->found_devices, (GFunc) dev_info_free, NULL);
-	g_slist_free(adapter->found_devices);
-	adapter->found_devices = NULL;
+		if (!device_is_paired(device) || !device_is_trusted(device) ||
+						device_is_connected(device))
+			continue;
+
+		c = g_new0(struct reconnect_candidate, 1);
+		c->device = device;
+
+		device_get_address(device, &bdaddr);
+		read_lastused_info(&adapter->bdaddr, &bdaddr, c->lastused,
+							sizeof(c->lastused));
+
+		candidates = g_slist_insert_sorted(candidates, c,
+								lastused_cmp);
+	}
+
+	for (l = candidates; l != NULL; l = l->next) {
+		struct reconnect_candidate *c = l->data;
+
+		adapter->reconnect_queue = g_slist_append(
+					adapter->reconnect_queue,
+					btd_device_ref(c->device));
+		g_free(c);
+	}
+
+	g_slist_free(candidates);
+
+	DBG("%u devices to reconnect",
+				g_slist_length(adapter->reconnect_queue));
+
+	reconnect_next(adapter);
+
+	return FALSE;
+}
+
+static void reconnect_stop(struct btd_adapter *adapter)
+{
+	if (adapter->reconnect_id) {
+		g_source_remove(adapter->reconnect_id);
+		adapter->reconnect_id = 0;
+	}
+
+	g_slist_foreach(adapter->reconnect_queue, (GFunc) btd_device_unref,
+									NULL);
+	g_slist_free(adapter->reconnect_queue);
+	adapter->reconnect_queue = NULL;
+
+	g_slist_foreach(adapter->reconnecting, (GFunc) reconnect_req_free,
+									NULL);
+	g_slist_free(adapter->reconnecting);
+	adapter->reconnecting = NULL;
+}
+
+static struct reconnect_req *find_reconnect(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	GSList *l;
+
+	for (l = adapter->reconnecting; l != NULL; l = l->next) {
+		struct reconnect_req *req = l->data;
+
+		if (req->device == device)
+			return req;
+	}
+
+	return NULL;
+}
+
+/* Called once the link to the device is up, by reconnection or not */
+static void reconnect_connected(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	struct reconnect_req *req;
+
+	req = find_reconnect(adapter, device);
+	if (req == NULL)
+		return;
+
+	adapter->reconnecting = g_slist_remove(adapter->reconnecting, req);
+
+	/* Remaining profiles go over the link the first one paged */
+	device_reconnect_profiles(device);
+	reconnect_req_free(req);
+
+	reconnect_next(adapter);
+}
+
+static void reconnect_cancel(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	struct reconnect_req *req;
+
+	if (g_slist_find(adapter->reconnect_queue, device)) {
+		adapter->reconnect_queue = g_slist_remove(
+					adapter->reconnect_queue, device);
+		btd_device_unref(device);
+	}
+
+	req = find_reconnect(adapter, device);
+	if (req == NULL)
+		return;
+
+	adapter->reconnecting = g_slist_remove(adapter->reconnecting, req);
+	reconnect_req_free(req);
+
+	reconnect_next(adapter);
+}
+
+void adapter_remove_device(DBusConnection *conn, struct btd_adapter *adapter,
+						struct btd_device *device,
+						gboolean remove_storage)
+{
+	const gchar *dev_path = device_get_path(device);
+	struct agent *agent;
+
+	flush_property_changed(dev_path);
+
+	adapter->devices = g_slist_remove(adapter->devices, device);
+	adapter_unlink_device(adapter, device);
+	adapter->connections = g_slist_remove(adapter->connections, device);
+
+	adapter_update_devices(adapter);
+
+	g_dbus_emit_signal(conn, adapter->path,
+			ADAPTER_INTERFACE, "DeviceRemoved",
+			DBUS_TYPE_OBJECT_PATH, &dev_path,
+			DBUS_TYPE_INVALID);
+
+	adapter_cancel_auths(adapter, device);
+	reconnect_cancel(adapter, device);
+
+	device_remove(device, remove_storage);
+}
+
+struct btd_device *adapter_get_device(DBusConnection *conn,
+						struct btd_adapter *adapter,
+						const gchar *address)
+{
+	struct btd_device *device;
+
+	DBG("%s", address);
+
+	if (!adapter)
+		return NULL;
+
+	device = adapter_find_device(adapter, address);
+	if (device)
+		return device;
+
+	return adapter_create_device(conn, adapter, address,
+						DEVICE_TYPE_BREDR);
+}
+
+/*
+ * The part of the cycle given to LE follows the rate at which each
+ * transport turned up devices in the previous cycles, bounded so that
+ * neither of them starves.
+ */
+static void update_le_share(struct btd_adapter *adapter)
+{
+	unsigned int le, bredr, target;
+
+	if (adapter->cycle_le + adapter->cycle_bredr == 0)
+		return;
+
+	/* Devices per unit of time spent on each transport */
+	le = adapter->cycle_le * (100 - adapter->le_share);
+	bredr = adapter->cycle_bredr * adapter->le_share;
+
+	target = 100 * le / (le + bredr);
+
+	adapter->le_share = (adapter->le_share * 3 + target) / 4;
+	adapter->le_share = MAX(adapter->le_share, DISCOV_LE_SHARE_MIN);
+	adapter->le_share = MIN(adapter->le_share, DISCOV_LE_SHARE_MAX);
+
+	adapter->cycle_le = 0;
+	adapter->cycle_bredr = 0;
+}
+
+static void get_discovery_params(struct btd_adapter *adapter,
+					struct discovery_params *params)
+{
+	struct discovery_filter *filter = adapter->discov_filter;
+	unsigned int units;
+
+	update_le_share(adapter);
+
+	units = (DISCOV_CYCLE_UNITS * (100 - adapter->le_share) + 50) / 100;
+	units = MAX(units, 1);
+	units = MIN(units, DISCOV_CYCLE_UNITS - 1);
+
+	memset(params, 0, sizeof(*params));
+	params->transport = filter ? filter->transport :
+					DISCOVERY_BREDR | DISCOVERY_LE;
+	params->inquiry_length = units;
+	params->scan_timeout = (DISCOV_CYCLE_UNITS - units) * 1280;
+	params->scan_interval = DISCOV_SCAN_INTERVAL;
+	params->scan_window = DISCOV_SCAN_WINDOW;
+
+	/* Without an RSSI threshold one report per device and cycle is
+	 * all a filtered discovery needs */
+	params->filter_duplicates = filter && !filter->has_rssi;
+
+	/* Reports that can't pass the threshold are dropped as they come
+	 * in, before they are looked up or stored */
+	if (filter && filter->has_rssi) {
+		params->has_rssi = TRUE;
+		params->rssi = CLAMP(filter->rssi, G_MININT8, G_MAXINT8);
+	}
+}
+
+static int start_discovery(struct btd_adapter *adapter)
+{
+	struct discovery_params params;
+
+	/* Do not start if suspended */
+	if (adapter->state == STATE_SUSPENDED)
+		return 0;
+
+	/* Postpone discovery if still resolving names */
+	if (adapter->state == STATE_RESOLVNAME)
+		return -EINPROGRESS;
+
+	pending_remote_name_cancel(adapter);
+
+	get_discovery_params(adapter, &params);
+
+	DBG("transport 0x%02x inquiry %u scan %u ms", params.transport,
+				params.inquiry_length, params.scan_timeout);
 
-	g_slist_free(adapter->oor_devices);
-	adapter->oor_devices = NULL;
+	return adapter_ops->start_discovery(adapter->dev_id, &params);
+}
+
+static gboolean discovery_cb(gpointer user_data)
+{
+	struct btd_adapter *adapter = user_data;
+	int err;
+
+	err = start_discovery(adapter);
+	if (err == -EINPROGRESS)
+		return TRUE;
+	else if (err < 0)
+		error("start_discovery: %s (%d)", strerror(-err), -err);
+
+	return FALSE;
+}
+
+static DBusMessage *adapter_start_discovery(DBusConnection *conn,
+						DBusMessage *msg, void *data)
+{
+	struct session_req *req;
+	struct btd_adapter *adapter = data;
+	const char *sender = dbus_message_get_sender(msg);
+	int err;
+
+	if (!adapter->up)
+		return btd_error_not_ready(msg);
+
+	req = find_session(adapter->disc_sessions, sender);
+	if (req) {
+		session_ref(req);
+		return dbus_message_new_method_return(msg);
+	}
+
+	if (adapter->disc_sessions)
+		goto done;
+
+	clear_found_devices(adapter);
+
+	adapter->oor_tracking = FALSE;
+	adapter->le_share = 50;
+	adapter->cycle_le = 0;
+	adapter->cycle_bredr = 0;
 
 	err = start_discovery(adapter);
 	if (err < 0 && err != -EINPROGRESS)
@@ -1288,6 +1879,138 @@ done:
 	return dbus_message_new_method_return(msg);
 }
 
+static int parse_filter_uuids(DBusMessageIter *value,
+					struct discovery_filter *filter)
+{
+	DBusMessageIter array;
+
+	if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_ARRAY)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(value, &array);
+
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING) {
+		const char *str;
+		uuid_t uuid;
+
+		dbus_message_iter_get_basic(&array, &str);
+
+		if (bt_string2uuid(&uuid, str) < 0)
+			return -EINVAL;
+
+		eir_uuids_add(&filter->uuids, &uuid);
+
+		dbus_message_iter_next(&array);
+	}
+
+	return 0;
+}
+
+static int parse_discovery_filter(DBusMessageIter *iter,
+					struct discovery_filter *filter)
+{
+	DBusMessageIter dict;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+		return -EINVAL;
+
+	filter->transport = DISCOVERY_BREDR | DISCOVERY_LE;
+
+	dbus_message_iter_recurse(iter, &dict);
+
+	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, value;
+		const char *key, *str;
+		dbus_int16_t rssi;
+
+		dbus_message_iter_recurse(&dict, &entry);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+			return -EINVAL;
+
+		dbus_message_iter_get_basic(&entry, &key);
+		dbus_message_iter_next(&entry);
+
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+			return -EINVAL;
+
+		dbus_message_iter_recurse(&entry, &value);
+
+		if (g_str_equal(key, "UUIDs")) {
+			if (parse_filter_uuids(&value, filter) < 0)
+				return -EINVAL;
+		} else if (g_str_equal(key, "RSSI")) {
+			if (dbus_message_iter_get_arg_type(&value) !=
+							DBUS_TYPE_INT16)
+				return -EINVAL;
+
+			dbus_message_iter_get_basic(&value, &rssi);
+			filter->rssi = rssi;
+			filter->has_rssi = TRUE;
+		} else if (g_str_equal(key, "Transport")) {
+			if (dbus_message_iter_get_arg_type(&value) !=
+							DBUS_TYPE_STRING)
+				return -EINVAL;
+
+			dbus_message_iter_get_basic(&value, &str);
+
+			if (g_str_equal(str, "bredr"))
+				filter->transport = DISCOVERY_BREDR;
+			else if (g_str_equal(str, "le"))
+				filter->transport = DISCOVERY_LE;
+			else if (g_str_equal(str, "auto"))
+				filter->transport = DISCOVERY_BREDR |
+								DISCOVERY_LE;
+			else
+				return -EINVAL;
+		} else
+			return -EINVAL;
+
+		dbus_message_iter_next(&dict);
+	}
+
+	return 0;
+}
+
+static DBusMessage *adapter_set_discovery_filter(DBusConnection *conn,
+						DBusMessage *msg, void *data)
+{
+	struct btd_adapter *adapter = data;
+	struct discovery_filter *filter;
+	struct session_req *req;
+	const char *sender = dbus_message_get_sender(msg);
+	DBusMessageIter iter;
+
+	if (!adapter->up)
+		return btd_error_not_ready(msg);
+
+	req = find_session(adapter->disc_sessions, sender);
+	if (!req)
+		return btd_error_failed(msg, "Invalid discovery session");
+
+	filter = g_new0(struct discovery_filter, 1);
+
+	dbus_message_iter_init(msg, &iter);
+	if (parse_discovery_filter(&iter, filter) < 0) {
+		g_free(filter);
+		return btd_error_invalid_args(msg);
+	}
+
+	/* An empty dictionary removes the filter */
+	if (filter->transport == (DISCOVERY_BREDR | DISCOVERY_LE) &&
+					!filter->has_rssi &&
+					eir_uuids_count(&filter->uuids) == 0) {
+		g_free(filter);
+		filter = NULL;
+	}
+
+	g_free(req->filter);
+	req->filter = filter;
+
+	update_discovery_filter(adapter);
+
+	return dbus_message_new_method_return(msg);
+}
+
 static DBusMessage *adapter_stop_discovery(DBusConnection *conn,
 						DBusMessage *msg, void *data)
 {
@@ -1322,6 +2045,8 @@ static DBusMessage *get_properties(DBusConnection *conn,
 	GSList *l;
 	sdp_list_t *list;
 
+	adapter_load_pending(adapter);
+
 	ba2str(&adapter->bdaddr, srcaddr);
 
 	if (check_address(srcaddr) < 0)
@@ -1566,6 +2291,8 @@ static DBusMessage *list_devices(DBusConnection *conn,
 	if (!dbus_message_has_signature(msg, DBUS_TYPE_INVALID_AS_STRING))
 		return btd_error_invalid_args(msg);
 
+	adapter_load_pending(adapter);
+
 	reply = dbus_message_new_method_return(msg);
 	if (!reply)
 		return NULL;
@@ -1767,32 +2494,21 @@ static DBusMessage *create_paired_device(DBusConnection *conn,
 	return NULL;
 }
 
-static gint device_path_cmp(struct btd_device *device, const gchar *path)
-{
-	const gchar *dev_path = device_get_path(device);
-
-	return strcasecmp(dev_path, path);
-}
-
 static DBusMessage *remove_device(DBusConnection *conn, DBusMessage *msg,
 								void *data)
 {
 	struct btd_adapter *adapter = data;
 	struct btd_device *device;
 	const char *path;
-	GSList *l;
 
 	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path,
 						DBUS_TYPE_INVALID) == FALSE)
 		return btd_error_invalid_args(msg);
 
-	l = g_slist_find_custom(adapter->devices,
-			path, (GCompareFunc) device_path_cmp);
-	if (!l)
+	device = adapter_find_device_by_path(adapter, path);
+	if (!device)
 		return btd_error_does_not_exist(msg);
 
-	device = l->data;
-
 	if (device_is_temporary(device) || device_is_busy(device))
 		return g_dbus_create_error(msg,
 				ERROR_INTERFACE ".DoesNotExist",
@@ -1816,20 +2532,16 @@ static DBusMessage *find_device(DBusConnection *conn, DBusMessage *msg,
 	struct btd_device *device;
 	DBusMessage *reply;
 	const gchar *address;
-	GSList *l;
 	const gchar *dev_path;
 
 	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &address,
 						DBUS_TYPE_INVALID))
 		return btd_error_invalid_args(msg);
 
-	l = g_slist_find_custom(adapter->devices,
-			address, (GCompareFunc) device_address_cmp);
-	if (!l)
+	device = adapter_find_device(adapter, address);
+	if (!device)
 		return btd_error_does_not_exist(msg);
 
-	device = l->data;
-
 	reply = dbus_message_new_method_return(msg);
 	if (!reply)
 		return NULL;
@@ -2426,7 +3138,6 @@ static DBusMessage *set_link_timeout(DBusConnection *conn,
 	struct btd_adapter *adapter = data;
         struct btd_device *device;
 	const char *path;
-	GSList *l;
 	uint32_t num_slots;
         int dd, err;
 	bdaddr_t bdaddr;
@@ -2437,13 +3148,12 @@ static DBusMessage *set_link_timeout(DBusConnection *conn,
 			DBUS_TYPE_INVALID))
 		return btd_error_invalid_args(msg);
 
-        l = g_slist_find_custom(adapter->devices,
-                        path, (GCompareFunc) device_path_cmp);
-        if (!l)
-                return g_dbus_create_error(msg,
-                                ERROR_INTERFACE ".DoesNotExist",
-                                "Device does not exist");
-	device_get_address(l->data, &bdaddr);
+	device = adapter_find_device_by_path(adapter, path);
+	if (!device)
+		return g_dbus_create_error(msg,
+				ERROR_INTERFACE ".DoesNotExist",
+				"Device does not exist");
+	device_get_address(device, &bdaddr);
 
 	err = adapter_ops->set_link_timeout(adapter->dev_id, &bdaddr,
 			num_slots);
@@ -2453,39 +3163,187 @@ static DBusMessage *set_link_timeout(DBusConnection *conn,
 	return dbus_message_new_method_return(msg);
 }
 
-static GDBusMethodTable adapter_methods[] = {
-	{ "GetProperties",	"",	"a{sv}",get_properties		},
-	{ "SetProperty",	"sv",	"",	set_property,
-						G_DBUS_METHOD_FLAG_ASYNC},
-	{ "RequestSession",	"",	"",	request_session,
-						G_DBUS_METHOD_FLAG_ASYNC},
-	{ "ReleaseSession",	"",	"",	release_session		},
-	{ "StartDiscovery",	"",	"",	adapter_start_discovery },
-	{ "StopDiscovery",	"",	"",	adapter_stop_discovery,
-						G_DBUS_METHOD_FLAG_ASYNC},
-	{ "ListDevices",	"",	"ao",	list_devices,
-						G_DBUS_METHOD_FLAG_DEPRECATED},
-	{ "CreateDevice",	"s",	"o",	create_device,
-						G_DBUS_METHOD_FLAG_ASYNC},
-	{ "CreatePairedDevice",	"sos",	"o",	create_paired_device,
-						G_DBUS_METHOD_FLAG_ASYNC},
-	{ "CancelDeviceCreation","s",	"",	cancel_device_creation,
-						G_DBUS_METHOD_FLAG_ASYNC},
-	{ "RemoveDevice",	"o",	"",	remove_device,
-						G_DBUS_METHOD_FLAG_ASYNC},
-	{ "FindDevice",		"s",	"o",	find_device		},
-	{ "RegisterAgent",	"os",	"",	register_agent		},
+static void dict_append_event_counts(DBusMessageIter *dict,
+						const uint32_t *events)
+{
+	DBusMessageIter entry, value, array;
+	const char *key = "Events";
+	int i;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+							"a{yu}", &value);
+	dbus_message_iter_open_container(&value, DBUS_TYPE_ARRAY,
+					DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_BYTE_AS_STRING
+					DBUS_TYPE_UINT32_AS_STRING
+					DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+					&array);
+
+	for (i = 0; i < 256; i++) {
+		DBusMessageIter item;
+		uint8_t code = i;
+
+		if (events[i] == 0)
+			continue;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+							NULL, &item);
+		dbus_message_iter_append_basic(&item, DBUS_TYPE_BYTE, &code);
+		dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT32,
+								&events[i]);
+		dbus_message_iter_close_container(&array, &item);
+	}
+
+	dbus_message_iter_close_container(&value, &array);
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+/* Each opcode maps to its count, average and maximum latency in usec
+ * followed by the counts of the latency buckets */
+static void dict_append_cmd_latency(DBusMessageIter *dict, GSList *cmds)
+{
+	DBusMessageIter entry, value, array;
+	const char *key = "CommandLatency";
+	GSList *l;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+							"a{qau}", &value);
+	dbus_message_iter_open_container(&value, DBUS_TYPE_ARRAY,
+					DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_UINT16_AS_STRING
+					DBUS_TYPE_ARRAY_AS_STRING
+					DBUS_TYPE_UINT32_AS_STRING
+					DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+					&array);
+
+	for (l = cmds; l != NULL; l = g_slist_next(l)) {
+		struct btd_hci_cmd_stats *cmd = l->data;
+		uint32_t values[3 + BTD_HCI_LATENCY_BUCKETS];
+		const uint32_t *ptr = values;
+		DBusMessageIter item, list;
+
+		values[0] = cmd->count;
+		values[1] = cmd->total / cmd->count;
+		values[2] = cmd->max;
+		memcpy(&values[3], cmd->buckets, sizeof(cmd->buckets));
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+							NULL, &item);
+		dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT16,
+							&cmd->opcode);
+		dbus_message_iter_open_container(&item, DBUS_TYPE_ARRAY,
+					DBUS_TYPE_UINT32_AS_STRING, &list);
+		dbus_message_iter_append_fixed_array(&list, DBUS_TYPE_UINT32,
+						&ptr, G_N_ELEMENTS(values));
+		dbus_message_iter_close_container(&item, &list);
+		dbus_message_iter_close_container(&array, &item);
+	}
+
+	dbus_message_iter_close_container(&value, &array);
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static DBusMessage *get_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct btd_adapter *adapter = data;
+	struct btd_hci_stats stats;
+	DBusMessage *reply;
+	DBusMessageIter iter, dict;
+	int err;
+
+	if (adapter_ops->get_hci_stats == NULL)
+		return btd_error_not_supported(msg);
+
+	if (!adapter->up)
+		return btd_error_not_ready(msg);
+
+	err = adapter_ops->get_hci_stats(adapter->dev_id, &stats);
+	if (err < 0)
+		return btd_error_failed(msg, strerror(-err));
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		goto done;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	dict_append_entry(&dict, "Seconds", DBUS_TYPE_UINT32, &stats.seconds);
+	dict_append_entry(&dict, "Commands", DBUS_TYPE_UINT32,
+							&stats.commands);
+	dict_append_entry(&dict, "LEReports", DBUS_TYPE_UINT32,
+							&stats.le_reports);
+	dict_append_entry(&dict, "ACLBuffers", DBUS_TYPE_UINT16,
+							&stats.acl_pkts);
+	dict_append_entry(&dict, "ACLSent", DBUS_TYPE_UINT32,
+							&stats.kernel.acl_tx);
+	dict_append_entry(&dict, "ACLReceived", DBUS_TYPE_UINT32,
+							&stats.kernel.acl_rx);
+	dict_append_entry(&dict, "SendErrors", DBUS_TYPE_UINT32,
+							&stats.kernel.err_tx);
+	dict_append_entry(&dict, "ReceiveErrors", DBUS_TYPE_UINT32,
+							&stats.kernel.err_rx);
+	dict_append_event_counts(&dict, stats.events);
+	dict_append_cmd_latency(&dict, stats.cmds);
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+done:
+	g_slist_foreach(stats.cmds, (GFunc) g_free, NULL);
+	g_slist_free(stats.cmds);
+
+	return reply;
+}
+
+static GDBusMethodTable adapter_methods[] = {
+	{ "GetProperties",	"",	"a{sv}",get_properties		},
+	{ "SetProperty",	"sv",	"",	set_property,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "RequestSession",	"",	"",	request_session,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "ReleaseSession",	"",	"",	release_session		},
+	{ "StartDiscovery",	"",	"",	adapter_start_discovery },
+	{ "SetDiscoveryFilter",	"a{sv}", "",	adapter_set_discovery_filter },
+	{ "StopDiscovery",	"",	"",	adapter_stop_discovery,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "ListDevices",	"",	"ao",	list_devices,
+						G_DBUS_METHOD_FLAG_DEPRECATED},
+	{ "CreateDevice",	"s",	"o",	create_device,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "CreatePairedDevice",	"sos",	"o",	create_paired_device,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "CancelDeviceCreation","s",	"",	cancel_device_creation,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "RemoveDevice",	"o",	"",	remove_device,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "FindDevice",		"s",	"o",	find_device		},
+	{ "RegisterAgent",	"os",	"",	register_agent		},
 	{ "UnregisterAgent",	"o",	"",	unregister_agent	},
 	{ "AddRfcommServiceRecord",	"sttq",	"u",	add_rfcomm_service_record },
 	{ "RemoveServiceRecord",	"u",	"",	remove_service_record },
 	{ "SetLinkTimeout",	"ou",	"",	set_link_timeout	},
 	{ "AddReservedServiceRecords",   "au",    "au",    add_reserved_service_records  },
 	{ "RemoveReservedServiceRecords", "au",    "",	remove_reserved_service_records  },
+	{ "GetStatistics",	"",	"a{sv}",get_statistics		},
 	{ }
 };
 
 static GDBusSignalTable adapter_signals[] = {
 	{ "PropertyChanged",		"sv"		},
+	{ "PropertiesChanged",		"a{sv}"		},
 	{ "DeviceCreated",		"o"		},
 	{ "DeviceRemoved",		"o"		},
 	{ "DeviceFound",		"sa{sv}"	},
@@ -2493,53 +3351,103 @@ static GDBusSignalTable adapter_signals[] = {
 	{ }
 };
 
-static void create_stored_device_from_profiles(char *key, char *value,
-						void *user_data)
-{
-	struct btd_adapter *adapter = user_data;
-	GSList *list, *uuids = bt_string2list(value);
+/* What the storage of an adapter has about one device */
+struct stored_device {
+	bdaddr_t bdaddr;
+	char address[18];
+	device_type_t type;
+	char *profiles;
+	char *primary;
+	gboolean has_type;
+	uint8_t stored_type;
 	struct btd_device *device;
+};
 
-	if (g_slist_find_custom(adapter->devices,
-				key, (GCompareFunc) device_address_cmp))
-		return;
+struct device_loader {
+	struct btd_adapter *adapter;
+	GHashTable *devices;	/* bdaddr -> struct stored_device */
+	GSList *order;		/* first seen last */
+	GSList *next;		/* next device to create */
+	GSList *keys;
+	gboolean busy;		/* creating or probing devices */
+	GTimer *timer;
+};
 
-	device = device_create(connection, adapter, key, DEVICE_TYPE_BREDR);
-	if (!device)
-		return;
+static void stored_device_free(gpointer data)
+{
+	struct stored_device *dev = data;
 
-	device_set_temporary(device, FALSE);
-	adapter->devices = g_slist_append(adapter->devices, device);
+	g_free(dev->profiles);
+	g_free(dev->primary);
+	g_free(dev);
+}
 
-	device_probe_drivers(device, uuids);
-	list = device_services_from_record(device, uuids);
-	if (list)
-		device_register_services(connection, device, list, ATT_PSM);
+/* The first file a device shows up in decides its type and services */
+static struct stored_device *stored_device_get(struct device_loader *loader,
+					const char *key, size_t keylen,
+					device_type_t type, gboolean *created)
+{
+	struct stored_device *dev;
+	char address[18];
+	bdaddr_t bdaddr;
 
-	g_slist_foreach(uuids, (GFunc) g_free, NULL);
-	g_slist_free(uuids);
+	if (keylen >= sizeof(address))
+		keylen = sizeof(address) - 1;
+
+	memcpy(address, key, keylen);
+	address[keylen] = '\0';
+
+	str2ba(address, &bdaddr);
+
+	dev = g_hash_table_lookup(loader->devices, &bdaddr);
+	if (dev) {
+		*created = FALSE;
+		return dev;
+	}
+
+	dev = g_new0(struct stored_device, 1);
+	bacpy(&dev->bdaddr, &bdaddr);
+	g_strlcpy(dev->address, address, sizeof(dev->address));
+	dev->type = type;
+
+	g_hash_table_insert(loader->devices, &dev->bdaddr, dev);
+	loader->order = g_slist_prepend(loader->order, dev);
+
+	*created = TRUE;
+
+	return dev;
 }
 
-struct adapter_keys {
-	struct btd_adapter *adapter;
-	GSList *keys;
-};
+static void load_stored_profiles(const char *key, size_t keylen,
+					const char *value, size_t valuelen,
+					void *user_data)
+{
+	struct stored_device *dev;
+	gboolean created;
+
+	dev = stored_device_get(user_data, key, keylen, DEVICE_TYPE_BREDR,
+								&created);
+	if (created)
+		dev->profiles = g_strndup(value, valuelen);
+}
 
-static struct link_key_info *get_key_info(const char *addr, const char *value)
+/* Parses "<key> <type> <pin length>" as found in the linkkeys file */
+static struct link_key_info *get_key_info(const bdaddr_t *bdaddr,
+					const char *value, size_t len)
 {
 	struct link_key_info *info;
 	char tmp[3];
 	long int l;
 	int i;
 
-	if (strlen(value) < 36) {
-		error("Unexpectedly short (%zu) link key line", strlen(value));
+	if (len < 36) {
+		error("Unexpectedly short (%zu) link key line", len);
 		return NULL;
 	}
 
 	info = g_new0(struct link_key_info, 1);
 
-	str2ba(addr, &info->bdaddr);
+	bacpy(&info->bdaddr, bdaddr);
 
 	memset(tmp, 0, sizeof(tmp));
 
@@ -2551,7 +3459,9 @@ static struct link_key_info *get_key_info(const char *addr, const char *value)
 	memcpy(tmp, value + 33, 2);
 	info->type = (uint8_t) strtol(tmp, NULL, 10);
 
-	memcpy(tmp, value + 35, 2);
+	/* The value is not terminated, the pin length may be one digit */
+	memset(tmp, 0, sizeof(tmp));
+	memcpy(tmp, value + 35, MIN(len - 35, 2));
 	l = strtol(tmp, NULL, 10);
 	if (l < 0)
 		l = 0;
@@ -2560,69 +3470,49 @@ static struct link_key_info *get_key_info(const char *addr, const char *value)
 	return info;
 }
 
-static void create_stored_device_from_linkkeys(char *key, char *value,
-							void *user_data)
+static void load_stored_linkkeys(const char *key, size_t keylen,
+					const char *value, size_t valuelen,
+					void *user_data)
 {
-	struct adapter_keys *keys = user_data;
-	struct btd_adapter *adapter = keys->adapter;
-	struct btd_device *device;
+	struct device_loader *loader = user_data;
+	struct stored_device *dev;
 	struct link_key_info *info;
+	gboolean created;
 
-	info = get_key_info(key, value);
-	if (info)
-		keys->keys = g_slist_append(keys->keys, info);
-
-	if (g_slist_find_custom(adapter->devices, key,
-					(GCompareFunc) device_address_cmp))
-		return;
+	dev = stored_device_get(loader, key, keylen, DEVICE_TYPE_BREDR,
+								&created);
 
-	device = device_create(connection, adapter, key, DEVICE_TYPE_BREDR);
-	if (device) {
-		device_set_temporary(device, FALSE);
-		adapter->devices = g_slist_append(adapter->devices, device);
-	}
+	info = get_key_info(&dev->bdaddr, value, valuelen);
+	if (info)
+		loader->keys = g_slist_prepend(loader->keys, info);
 }
 
-static void create_stored_device_from_blocked(char *key, char *value,
-							void *user_data)
+static void load_stored_blocked(const char *key, size_t keylen,
+					const char *value, size_t valuelen,
+					void *user_data)
 {
-	struct btd_adapter *adapter = user_data;
-	struct btd_device *device;
-
-	if (g_slist_find_custom(adapter->devices,
-				key, (GCompareFunc) device_address_cmp))
-		return;
+	gboolean created;
 
-	device = device_create(connection, adapter, key, DEVICE_TYPE_BREDR);
-	if (device) {
-		device_set_temporary(device, FALSE);
-		adapter->devices = g_slist_append(adapter->devices, device);
-	}
+	stored_device_get(user_data, key, keylen, DEVICE_TYPE_BREDR,
+								&created);
 }
 
-static void create_stored_device_from_types(char *key, char *value,
-							void *user_data)
+static void load_stored_types(const char *key, size_t keylen,
+					const char *value, size_t valuelen,
+					void *user_data)
 {
-	GSList *l;
-	struct btd_adapter *adapter = user_data;
-	struct btd_device *device;
+	struct stored_device *dev;
+	char tmp[5];
 	uint8_t type;
+	gboolean created;
 
-	type = strtol(value, NULL, 16);
-
-	l = g_slist_find_custom(adapter->devices,
-				key, (GCompareFunc) device_address_cmp);
-	if (l) {
-		device = l->data;
-		device_set_type(device, type);
-		return;
-	}
+	memset(tmp, 0, sizeof(tmp));
+	memcpy(tmp, value, MIN(valuelen, sizeof(tmp) - 1));
+	type = strtol(tmp, NULL, 16);
 
-	device = device_create(connection, adapter, key, type);
-	if (device) {
-		device_set_temporary(device, FALSE);
-		adapter->devices = g_slist_append(adapter->devices, device);
-	}
+	dev = stored_device_get(user_data, key, keylen, type, &created);
+	dev->has_type = TRUE;
+	dev->stored_type = type;
 }
 
 static GSList *string_to_primary_list(char *str)
@@ -2660,25 +3550,39 @@ static GSList *string_to_primary_list(char *str)
 	return l;
 }
 
-static void create_stored_device_from_primary(char *key, char *value,
-							void *user_data)
+static void load_stored_primary(const char *key, size_t keylen,
+					const char *value, size_t valuelen,
+					void *user_data)
 {
-	struct btd_adapter *adapter = user_data;
-	struct btd_device *device;
+	struct stored_device *dev;
+	gboolean created;
+
+	dev = stored_device_get(user_data, key, keylen, DEVICE_TYPE_LE,
+								&created);
+	if (created)
+		dev->primary = g_strndup(value, valuelen);
+}
+
+static void probe_stored_device(struct stored_device *dev)
+{
+	struct btd_device *device = dev->device;
 	GSList *services, *uuids, *l;
 
-	if (g_slist_find_custom(adapter->devices,
-			key, (GCompareFunc) device_address_cmp))
-		return;
+	if (dev->profiles) {
+		uuids = bt_string2list(dev->profiles);
 
-	device = device_create(connection, adapter, key, DEVICE_TYPE_LE);
-	if (!device)
-		return;
+		device_probe_drivers(device, uuids);
+		services = device_services_from_record(device, uuids);
+		if (services)
+			device_register_services(connection, device, services,
+								ATT_PSM);
 
-	device_set_temporary(device, FALSE);
-	adapter->devices = g_slist_append(adapter->devices, device);
+		g_slist_foreach(uuids, (GFunc) g_free, NULL);
+		g_slist_free(uuids);
+		return;
+	}
 
-	services = string_to_primary_list(value);
+	services = string_to_primary_list(dev->primary);
 	if (services == NULL)
 		return;
 
@@ -2693,40 +3597,189 @@ static void create_stored_device_from_primary(char *key, char *value,
 	g_slist_free(uuids);
 }
 
+/*
+ * All the files are parsed before any device gets created, so that each
+ * device is created once with its final type and looked up by address
+ * through a hash instead of walking the device list for every line.
+ * Devices are created and probed at most max at a time, returns TRUE
+ * while some are left.
+ */
+static gboolean create_stored_devices(struct device_loader *loader,
+								guint max)
+{
+	struct btd_adapter *adapter = loader->adapter;
+	GSList *l, *first, *tail;
+	guint count;
+
+	first = loader->next;
+	tail = g_slist_last(adapter->devices);
+
+	loader->busy = TRUE;
+
+	for (l = first, count = 0; l && count < max; l = l->next, count++) {
+		struct stored_device *dev = l->data;
+		struct btd_device *device;
+
+		device = g_hash_table_lookup(adapter->device_addrs,
+								&dev->bdaddr);
+		if (device) {
+			if (dev->has_type)
+				device_set_type(device, dev->stored_type);
+			continue;
+		}
+
+		device = device_create(connection, adapter, dev->address,
+				dev->has_type ? dev->stored_type : dev->type);
+		if (!device)
+			continue;
+
+		device_set_temporary(device, FALSE);
+
+		/* Appending at the tail keeps this linear */
+		if (tail) {
+			g_slist_append(tail, device);
+			tail = tail->next;
+		} else
+			adapter->devices = tail = g_slist_append(NULL, device);
+
+		adapter_link_device(adapter, device);
+
+		dev->device = device;
+	}
+
+	loader->next = l;
+
+	for (l = first; l != loader->next; l = l->next) {
+		struct stored_device *dev = l->data;
+
+		if (dev->device && (dev->profiles || dev->primary))
+			probe_stored_device(dev);
+	}
+
+	loader->busy = FALSE;
+
+	return loader->next != NULL;
+}
+
+static void device_loader_free(struct device_loader *loader)
+{
+	g_slist_free(loader->order);
+	g_hash_table_destroy(loader->devices);
+	g_timer_destroy(loader->timer);
+	g_free(loader);
+}
+
+static void load_connections(struct btd_adapter *adapter);
+
+static void load_devices_complete(struct btd_adapter *adapter)
+{
+	struct device_loader *loader = adapter->loader;
+
+	adapter->loader = NULL;
+
+	info("%s: %u stored devices loaded in %.0f ms", adapter->path,
+				g_hash_table_size(loader->devices),
+				g_timer_elapsed(loader->timer, NULL) * 1000);
+
+	device_loader_free(loader);
+
+	/* retrieve the active connections: address the scenario where
+	 * the are active connections before the daemon've started */
+	load_connections(adapter);
+}
+
+static gboolean load_devices_idle(gpointer user_data)
+{
+	struct btd_adapter *adapter = user_data;
+
+	if (create_stored_devices(adapter->loader, LOAD_DEVICES_BATCH))
+		return TRUE;
+
+	adapter->load_id = 0;
+
+	load_devices_complete(adapter);
+
+	return FALSE;
+}
+
+/* Finishes loading right away for callers that need the whole device
+ * list, unless called back from the loading itself */
+static void adapter_load_pending(struct btd_adapter *adapter)
+{
+	if (adapter->loader == NULL || adapter->loader->busy)
+		return;
+
+	g_source_remove(adapter->load_id);
+	adapter->load_id = 0;
+
+	create_stored_devices(adapter->loader, G_MAXUINT);
+
+	load_devices_complete(adapter);
+}
+
+static void adapter_load_cancel(struct btd_adapter *adapter)
+{
+	if (adapter->loader == NULL)
+		return;
+
+	g_source_remove(adapter->load_id);
+	adapter->load_id = 0;
+
+	device_loader_free(adapter->loader);
+	adapter->loader = NULL;
+}
+
+/* The stored files are parsed and the link keys loaded right away, while
+ * the devices themselves are created and probed from the main loop a few
+ * at a time so that the daemon answers on D-Bus meanwhile */
 static void load_devices(struct btd_adapter *adapter)
 {
 	char filename[PATH_MAX + 1];
 	char srcaddr[18];
-	struct adapter_keys keys = { adapter, NULL };
+	struct device_loader *loader;
 	int err;
 
+	loader = g_new0(struct device_loader, 1);
+	loader->adapter = adapter;
+	loader->devices = g_hash_table_new_full(bt_bdaddr_hash,
+						bt_bdaddr_equal, NULL,
+						stored_device_free);
+	loader->timer = g_timer_new();
+
 	ba2str(&adapter->bdaddr, srcaddr);
 
 	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "profiles");
-	textfile_foreach(filename, create_stored_device_from_profiles,
-								adapter);
+	textfile_foreach_raw(filename, load_stored_profiles, loader);
 
 	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "primary");
-	textfile_foreach(filename, create_stored_device_from_primary,
-								adapter);
+	textfile_foreach_raw(filename, load_stored_primary, loader);
 
 	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "linkkeys");
-	textfile_foreach(filename, create_stored_device_from_linkkeys, &keys);
+	textfile_foreach_raw(filename, load_stored_linkkeys, loader);
+
+	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "blocked");
+	textfile_foreach_raw(filename, load_stored_blocked, loader);
+
+	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "types");
+	textfile_foreach_raw(filename, load_stored_types, loader);
+
+	loader->keys = g_slist_reverse(loader->keys);
 
-	err = adapter_ops->load_keys(adapter->dev_id, keys.keys,
+	err = adapter_ops->load_keys(adapter->dev_id, loader->keys,
 							main_opts.debug_keys);
 	if (err < 0) {
 		error("Unable to load keys to adapter_ops: %s (%d)",
 							strerror(-err), -err);
-		g_slist_foreach(keys.keys, (GFunc) g_free, NULL);
-		g_slist_free(keys.keys);
+		g_slist_foreach(loader->keys, (GFunc) g_free, NULL);
+		g_slist_free(loader->keys);
 	}
 
-	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "blocked");
-	textfile_foreach(filename, create_stored_device_from_blocked, adapter);
+	loader->keys = NULL;
+	loader->order = g_slist_reverse(loader->order);
+	loader->next = loader->order;
 
-	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "types");
-	textfile_foreach(filename, create_stored_device_from_types, adapter);
+	adapter->loader = loader;
+	adapter->load_id = g_idle_add(load_devices_idle, adapter);
 }
 
 int btd_adapter_block_address(struct btd_adapter *adapter, bdaddr_t *bdaddr)
@@ -2774,8 +3827,12 @@ static void load_drivers(struct btd_adapter *adapter)
 {
 	GSList *l;
 
+	btd_adapter_services_begin();
+
 	for (l = adapter_drivers; l; l = l->next)
 		probe_driver(adapter, l->data);
+
+	btd_adapter_services_commit();
 }
 
 static void load_connections(struct btd_adapter *adapter)
@@ -2839,13 +3896,18 @@ static void call_adapter_powered_callbacks(struct btd_adapter *adapter,
        }
 }
 
-static void emit_device_disappeared(gpointer data, gpointer user_data)
+static gboolean emit_device_disappeared(gpointer key, gpointer value,
+							gpointer user_data)
 {
-	struct remote_dev_info *dev = data;
+	struct remote_dev_info *dev = value;
 	struct btd_adapter *adapter = user_data;
 	char address[18];
 	const char *paddr = address;
 
+	/* Seen again during the last discovery cycle */
+	if (dev->generation == adapter->found_generation)
+		return FALSE;
+
 	ba2str(&dev->bdaddr, address);
 
 	g_dbus_emit_signal(connection, adapter->path,
@@ -2853,15 +3915,20 @@ static void emit_device_disappeared(gpointer data, gpointer user_data)
 			DBUS_TYPE_STRING, &paddr,
 			DBUS_TYPE_INVALID);
 
-	adapter->found_devices = g_slist_remove(adapter->found_devices, dev);
+	found_device_unlink(adapter, dev);
+
+	return TRUE;
 }
 
 static void update_oor_devices(struct btd_adapter *adapter)
 {
-	g_slist_foreach(adapter->oor_devices, emit_device_disappeared, adapter);
-	g_slist_foreach(adapter->oor_devices, (GFunc) dev_info_free, NULL);
-	g_slist_free(adapter->oor_devices);
-	adapter->oor_devices =  g_slist_copy(adapter->found_devices);
+	if (adapter->oor_tracking)
+		g_hash_table_foreach_remove(adapter->found_devices,
+					emit_device_disappeared, adapter);
+
+	/* Whatever isn't seen in the next cycle is out of range */
+	adapter->found_generation++;
+	adapter->oor_tracking = TRUE;
 }
 
 void btd_adapter_get_mode(struct btd_adapter *adapter, uint8_t *mode,
@@ -2909,6 +3976,9 @@ void btd_adapter_start(struct btd_adapter *adapter)
 	adapter->state = STATE_IDLE;
 	adapter->mode = MODE_CONNECTABLE;
 
+	/* Found devices get their stored names and aliases from memory */
+	storage_load_devices(&adapter->bdaddr);
+
 	if (main_opts.le)
 		adapter_ops->enable_le(adapter->dev_id);
 
@@ -2922,13 +3992,24 @@ void btd_adapter_start(struct btd_adapter *adapter)
 	btd_adapter_set_class(adapter, cls[1], cls[0]);
 
 	powered = TRUE;
-	emit_property_changed(connection, adapter->path,
+	queue_property_changed(connection, adapter->path,
 					ADAPTER_INTERFACE, "Powered",
 					DBUS_TYPE_BOOLEAN, &powered);
 
 	call_adapter_powered_callbacks(adapter, TRUE);
 
-	adapter_ops->disable_cod_cache(adapter->dev_id);
+	if (adapter->services_batched || services_batch == 0) {
+		adapter_ops->disable_cod_cache(adapter->dev_id);
+		adapter->cod_cache_off = TRUE;
+		adapter->services_batched = FALSE;
+	} else
+		/* Flushed once the running batch is committed */
+		adapter->services_batched = TRUE;
+
+	if (main_opts.reconnect_parallel > 0 && adapter->reconnect_id == 0)
+		adapter->reconnect_id = g_timeout_add_seconds(RECONNECT_DELAY,
+							reconnect_start,
+							adapter);
 
 	info("Adapter %s has been enabled", adapter->path);
 }
@@ -2961,7 +4042,10 @@ static void remove_driver(gpointer data, gpointer user_data)
 
 static void unload_drivers(struct btd_adapter *adapter)
 {
+	btd_adapter_services_begin();
 	g_slist_foreach(adapter->loaded_drivers, remove_driver, adapter);
+	btd_adapter_services_commit();
+
 	g_slist_free(adapter->loaded_drivers);
 	adapter->loaded_drivers = NULL;
 }
@@ -3033,6 +4117,8 @@ int btd_adapter_stop(struct btd_adapter *adapter)
 	/* check pending requests */
 	reply_pending_requests(adapter);
 
+	reconnect_stop(adapter);
+
 	stop_discovery(adapter);
 
 	if (adapter->disc_sessions) {
@@ -3049,26 +4135,27 @@ int btd_adapter_stop(struct btd_adapter *adapter)
 
 	if (adapter->scan_mode == (SCAN_PAGE | SCAN_INQUIRY)) {
 		discoverable = FALSE;
-		emit_property_changed(connection, adapter->path,
+		queue_property_changed(connection, adapter->path,
 					ADAPTER_INTERFACE, "Discoverable",
 					DBUS_TYPE_BOOLEAN, &discoverable);
 	}
 
 	if ((adapter->scan_mode & SCAN_PAGE) && adapter->pairable == TRUE) {
 		pairable = FALSE;
-		emit_property_changed(connection, adapter->path,
+		queue_property_changed(connection, adapter->path,
 					ADAPTER_INTERFACE, "Pairable",
 					DBUS_TYPE_BOOLEAN, &pairable);
 	}
 
 	powered = FALSE;
-	emit_property_changed(connection, adapter->path, ADAPTER_INTERFACE,
+	queue_property_changed(connection, adapter->path, ADAPTER_INTERFACE,
 				"Powered", DBUS_TYPE_BOOLEAN, &powered);
 
 	/* Duplicately publish the UUIDs to make sure the upper layers know */
 	adapter_emit_uuids_updated(adapter);
 
 	adapter->up = 0;
+	adapter->cod_cache_off = FALSE;
 	adapter->scan_mode = SCAN_DISABLED;
 	adapter->mode = MODE_OFF;
 	adapter->state = STATE_IDLE;
@@ -3087,6 +4174,7 @@ int btd_adapter_stop(struct btd_adapter *adapter)
 static void adapter_free(gpointer user_data)
 {
 	struct btd_adapter *adapter = user_data;
+	int i;
 
 	agent_free(adapter->agent);
 	adapter->agent = NULL;
@@ -3096,12 +4184,35 @@ static void adapter_free(gpointer user_data)
 	if (adapter->auth_idle_id)
 		g_source_remove(adapter->auth_idle_id);
 
+	adapter_load_cancel(adapter);
+
+	reconnect_stop(adapter);
+
+	g_slist_foreach(adapter->trusted_auths, (GFunc) service_auth_free,
+									NULL);
+	g_slist_free(adapter->trusted_auths);
+	g_slist_foreach(adapter->auths, (GFunc) service_auth_free, NULL);
+	g_slist_free(adapter->auths);
+
 	sdp_list_free(adapter->services, NULL);
 
-	g_slist_foreach(adapter->found_devices, (GFunc) dev_info_free, NULL);
-	g_slist_free(adapter->found_devices);
+	if (adapter->found_emit_id)
+		g_source_remove(adapter->found_emit_id);
+
+	if (adapter->found_devices) {
+		for (i = 0; i < FOUND_RSSI_BUCKETS; i++)
+			g_list_free(adapter->found_rssi[i]);
+
+		g_hash_table_destroy(adapter->found_devices);
+	}
+
+	g_free(adapter->discov_filter);
 
-	g_slist_free(adapter->oor_devices);
+	if (adapter->device_addrs)
+		g_hash_table_destroy(adapter->device_addrs);
+
+	if (adapter->device_paths)
+		g_hash_table_destroy(adapter->device_paths);
 
 	g_free(adapter->path);
 	g_free(adapter);
@@ -3174,10 +4285,7 @@ gboolean adapter_init(struct btd_adapter *adapter)
 	if (read_device_pairable(&adapter->bdaddr, &adapter->pairable) < 0)
 		adapter->pairable = TRUE;
 
-	/* retrieve the active connections: address the scenario where
-	 * the are active connections before the daemon've started */
-	load_connections(adapter);
-
+	/* Existing connections are added once the stored devices are */
 	adapter->initialized = TRUE;
 
 	return TRUE;
@@ -3200,6 +4308,16 @@ struct btd_adapter *adapter_create(DBusConnection *conn, int id)
 
 	adapter->dev_id = id;
 
+	adapter->found_devices = g_hash_table_new_full(bt_bdaddr_hash,
+						bt_bdaddr_equal, NULL,
+						(GDestroyNotify) dev_info_free);
+
+	adapter->device_addrs = g_hash_table_new_full(bt_bdaddr_hash,
+						bt_bdaddr_equal, g_free, NULL);
+	adapter->device_paths = g_hash_table_new(path_hash, path_equal);
+
+	adapter->le_share = 50;
+
 	snprintf(path, sizeof(path), "%s/hci%d", base_path, id);
 	adapter->path = g_strdup(path);
 
@@ -3220,9 +4338,16 @@ void adapter_remove(struct btd_adapter *adapter)
 
 	DBG("Removing adapter %s", adapter->path);
 
+	adapter_load_cancel(adapter);
+
+	flush_property_changed(adapter->path);
+
 	for (l = adapter->devices; l; l = l->next)
 		device_remove(l->data, FALSE);
 	g_slist_free(adapter->devices);
+	adapter->devices = NULL;
+	g_hash_table_remove_all(adapter->device_addrs);
+	g_hash_table_remove_all(adapter->device_paths);
 
 	unload_drivers(adapter);
 
@@ -3255,10 +4380,7 @@ static inline void suspend_discovery(struct btd_adapter *adapter)
 	if (adapter->state != STATE_SUSPENDED)
 		return;
 
-	if (adapter->oor_devices) {
-		g_slist_free(adapter->oor_devices);
-		adapter->oor_devices = NULL;
-	}
+	adapter->oor_tracking = FALSE;
 
 	if (adapter->scheduler_id) {
 		g_source_remove(adapter->scheduler_id);
@@ -3296,8 +4418,11 @@ void adapter_set_state(struct btd_adapter *adapter, int state)
 	case STATE_IDLE:
 		update_oor_devices(adapter);
 
+		/* Write out what was learned about the devices found */
+		storage_flush();
+
 		discov_active = FALSE;
-		emit_property_changed(connection, path,
+		queue_property_changed(connection, path,
 					ADAPTER_INTERFACE, "Discovering",
 					DBUS_TYPE_BOOLEAN, &discov_active);
 
@@ -3309,7 +4434,7 @@ void adapter_set_state(struct btd_adapter *adapter, int state)
 		break;
 	case STATE_DISCOV:
 		discov_active = TRUE;
-		emit_property_changed(connection, path,
+		queue_property_changed(connection, path,
 					ADAPTER_INTERFACE, "Discovering",
 					DBUS_TYPE_BOOLEAN, &discov_active);
 		break;
@@ -3330,24 +4455,28 @@ int adapter_get_state(struct btd_adapter *adapter)
 struct remote_dev_info *adapter_search_found_devices(struct btd_adapter *adapter,
 						struct remote_dev_info *match)
 {
-	GSList *l;
-
-	l = g_slist_find_custom(adapter->found_devices, match,
-					(GCompareFunc) found_device_cmp);
-	if (l)
-		return l->data;
+	struct remote_dev_info *dev;
+	GList *l;
+	int i;
 
-	return NULL;
-}
+	if (bacmp(&match->bdaddr, BDADDR_ANY)) {
+		dev = g_hash_table_lookup(adapter->found_devices,
+							&match->bdaddr);
+		if (dev && found_device_cmp(dev, match) == 0)
+			return dev;
 
-static int dev_rssi_cmp(struct remote_dev_info *d1, struct remote_dev_info *d2)
-{
-	int rssi1, rssi2;
+		return NULL;
+	}
 
-	rssi1 = d1->rssi < 0 ? -d1->rssi : d1->rssi;
-	rssi2 = d2->rssi < 0 ? -d2->rssi : d2->rssi;
+	/* Strongest signal first */
+	for (i = 0; i < FOUND_RSSI_BUCKETS; i++) {
+		for (l = adapter->found_rssi[i]; l; l = l->next) {
+			if (found_device_cmp(l->data, match) == 0)
+				return l->data;
+		}
+	}
 
-	return rssi1 - rssi2;
+	return NULL;
 }
 
 static void append_dict_valist(DBusMessageIter *iter,
@@ -3374,7 +4503,7 @@ static void append_dict_valist(DBusMessageIter *iter,
 			if (n_elements > 0)
 				dict_append_array(&dict, key, DBUS_TYPE_STRING,
 						val, n_elements);
-		} else
+		} else if (val != NULL)
 			dict_append_entry(&dict, key, type, val);
 		key = va_arg(var_args, char *);
 	}
@@ -3406,71 +4535,91 @@ static void emit_device_found(const char *path, const char *address,
 	g_dbus_send_message(connection, signal);
 }
 
-static char **strlist2array(GSList *list)
+static guint64 monotonic_msec(void)
 {
-	unsigned int i, n;
-	char **array;
-
-	if (list == NULL)
-		return NULL;
-
-	n = g_slist_length(list);
-	array = g_new0(char *, n + 1);
+	struct timespec ts;
 
-	for (i = 0; list; list = list->next, i++)
-		array[i] = g_strdup((const gchar *) list->data);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	return array;
+	return (guint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void adapter_emit_device_found(struct btd_adapter *adapter,
-						struct remote_dev_info *dev)
+/* With DeviceFoundChangesOnly a device gets all its properties in the
+ * first signal, the following ones only carry the fields that changed.
+ * Skipped values are passed as NULL and left out of the dictionary. */
+static void emit_found_fields(struct btd_adapter *adapter,
+				struct remote_dev_info *dev, unsigned int fields)
 {
 	struct btd_device *device;
-	char peer_addr[18], local_addr[18];
-	const char *icon, *paddr = peer_addr;
+	char peer_addr[18];
+	const char *icon, *name, *paddr = peer_addr;
 	dbus_bool_t paired = FALSE;
 	dbus_int16_t rssi = dev->rssi;
+	gboolean all, broadcaster;
 	char *alias;
 	size_t uuid_count;
 
+	/* Devices outside of the discovery filter are not reported until
+	 * they match it, once reported they keep getting updates */
+	if (!dev->emitted && !found_device_wanted(adapter, dev)) {
+		dev->emit_pending = 0;
+		return;
+	}
+
+	all = fields == FOUND_ALL || !dev->emitted ||
+					!main_opts.found_changes_only;
+
+	dev->emitted = TRUE;
+	dev->emitted_rssi = dev->rssi;
+	dev->emitted_time = monotonic_msec();
+	dev->emit_pending = 0;
+
 	ba2str(&dev->bdaddr, peer_addr);
-	ba2str(&adapter->bdaddr, local_addr);
 
-	device = adapter_find_device(adapter, paddr);
-	if (device)
-		paired = device_is_paired(device);
+	if (all) {
+		device = adapter_find_device(adapter, paddr);
+		if (device)
+			paired = device_is_paired(device);
+	}
 
-	/* The uuids string array is updated only if necessary */
-	uuid_count = g_slist_length(dev->services);
+	/* The uuids string array is updated only if necessary, the set of
+	 * UUIDs never shrinks so a different count means new ones */
+	uuid_count = dev->services ? eir_uuids_count(dev->services) : 0;
 	if (dev->services && dev->uuid_count != uuid_count) {
 		g_strfreev(dev->uuids);
-		dev->uuids = strlist2array(dev->services);
+		dev->uuids = eir_uuids_to_strv(dev->services);
 		dev->uuid_count = uuid_count;
 	}
 
-	if (dev->le) {
-		gboolean broadcaster;
+	if (!all && !(fields & FOUND_UUIDS))
+		uuid_count = 0;
+
+	name = all || (fields & FOUND_NAME) ? dev->name : NULL;
 
+	if (dev->le) {
 		if (dev->flags & (EIR_LIM_DISC | EIR_GEN_DISC))
 			broadcaster = FALSE;
 		else
 			broadcaster = TRUE;
 
 		emit_device_found(adapter->path, paddr,
-				"Address", DBUS_TYPE_STRING, &paddr,
-				"RSSI", DBUS_TYPE_INT16, &rssi,
-				"Name", DBUS_TYPE_STRING, &dev->name,
-				"Paired", DBUS_TYPE_BOOLEAN, &paired,
-				"Broadcaster", DBUS_TYPE_BOOLEAN, &broadcaster,
-				"UUIDs", DBUS_TYPE_ARRAY, &dev->uuids, uuid_count,
-				NULL);
+			"Address", DBUS_TYPE_STRING, &paddr,
+			"RSSI", DBUS_TYPE_INT16,
+				all || (fields & FOUND_RSSI) ? &rssi : NULL,
+			"Name", DBUS_TYPE_STRING, &name,
+			"Paired", DBUS_TYPE_BOOLEAN, all ? &paired : NULL,
+			"Broadcaster", DBUS_TYPE_BOOLEAN,
+				all ? &broadcaster : NULL,
+			"UUIDs", DBUS_TYPE_ARRAY, &dev->uuids, uuid_count,
+			NULL);
 		return;
 	}
 
-	icon = class_to_icon(dev->class);
+	icon = all ? class_to_icon(dev->class) : NULL;
 
-	if (!dev->alias) {
+	if (!all && !(fields & FOUND_NAME))
+		alias = NULL;
+	else if (!dev->alias) {
 #ifdef ANDROID
 		/* Android doesn't fallback to name or address if there is no alias.
 		   It's safe to set alias to NULL because dict_append_entry() will
@@ -3488,19 +4637,141 @@ void adapter_emit_device_found(struct btd_adapter *adapter,
 
 	emit_device_found(adapter->path, paddr,
 			"Address", DBUS_TYPE_STRING, &paddr,
-			"Class", DBUS_TYPE_UINT32, &dev->class,
+			"Class", DBUS_TYPE_UINT32, all ? &dev->class : NULL,
 			"Icon", DBUS_TYPE_STRING, &icon,
-			"RSSI", DBUS_TYPE_INT16, &rssi,
-			"Name", DBUS_TYPE_STRING, &dev->name,
+			"RSSI", DBUS_TYPE_INT16,
+				all || (fields & FOUND_RSSI) ? &rssi : NULL,
+			"Name", DBUS_TYPE_STRING, &name,
 			"Alias", DBUS_TYPE_STRING, &alias,
-			"LegacyPairing", DBUS_TYPE_BOOLEAN, &dev->legacy,
-			"Paired", DBUS_TYPE_BOOLEAN, &paired,
+			"LegacyPairing", DBUS_TYPE_BOOLEAN,
+				all ? &dev->legacy : NULL,
+			"Paired", DBUS_TYPE_BOOLEAN, all ? &paired : NULL,
 			"UUIDs", DBUS_TYPE_ARRAY, &dev->uuids, uuid_count,
 			NULL);
 
 	g_free(alias);
 }
 
+void adapter_emit_device_found(struct btd_adapter *adapter,
+						struct remote_dev_info *dev)
+{
+	emit_found_fields(adapter, dev, FOUND_ALL);
+}
+
+struct found_flush {
+	struct btd_adapter *adapter;
+	guint64 now;
+	unsigned int waiting;
+};
+
+static void flush_pending(gpointer key, gpointer value, gpointer user_data)
+{
+	struct remote_dev_info *dev = value;
+	struct found_flush *flush = user_data;
+
+	if (dev->emit_pending == 0)
+		return;
+
+	if (flush->now - dev->emitted_time < main_opts.found_interval) {
+		flush->waiting++;
+		return;
+	}
+
+	emit_found_fields(flush->adapter, dev, dev->emit_pending);
+}
+
+static gboolean flush_found_devices(gpointer user_data)
+{
+	struct found_flush flush;
+
+	flush.adapter = user_data;
+	flush.now = monotonic_msec();
+	flush.waiting = 0;
+
+	g_hash_table_foreach(flush.adapter->found_devices, flush_pending,
+								&flush);
+	if (flush.waiting > 0)
+		return TRUE;
+
+	flush.adapter->found_emit_id = 0;
+
+	return FALSE;
+}
+
+/* Signals for devices seen again are held back until the interval since
+ * the previous one passed, whatever changed meanwhile goes out together */
+static void found_device_changed(struct btd_adapter *adapter,
+				struct remote_dev_info *dev, unsigned int fields)
+{
+	dev->emit_pending |= fields;
+
+	if (main_opts.found_interval == 0 || !dev->emitted ||
+			monotonic_msec() - dev->emitted_time >=
+						main_opts.found_interval) {
+		emit_found_fields(adapter, dev, dev->emit_pending);
+		return;
+	}
+
+	if (adapter->found_emit_id == 0)
+		adapter->found_emit_id = g_timeout_add(
+					main_opts.found_interval,
+					flush_found_devices, adapter);
+}
+
+static gboolean rssi_moved(struct remote_dev_info *dev, int8_t rssi)
+{
+	int delta = rssi - dev->emitted_rssi;
+
+	if (main_opts.found_hysteresis == 0)
+		return delta != 0;
+
+	return (delta < 0 ? -delta : delta) >= main_opts.found_hysteresis;
+}
+
+static void count_cycle_device(struct btd_adapter *adapter,
+					struct remote_dev_info *dev)
+{
+	if (dev->le)
+		adapter->cycle_le++;
+	else
+		adapter->cycle_bredr++;
+}
+
+/* Names stored before they got a timestamp count as fresh */
+static gboolean name_is_stale(const struct cached_device *stored)
+{
+	if (main_opts.name_resolv_max_age == 0)
+		return FALSE;
+
+	if (stored == NULL || stored->name_time == 0)
+		return FALSE;
+
+	return time(NULL) - stored->name_time >
+				(time_t) main_opts.name_resolv_max_age;
+}
+
+/* FNV-1a of the EIR fields and the class, to tell repeated advertising
+ * reports and inquiry results apart from ones with news in them */
+static uint32_t found_device_hash(const uint8_t *data, uint32_t class)
+{
+	uint32_t hash = 0x811c9dc5;
+	int i, len = 0;
+
+	while (data && len < HCI_MAX_EIR_LENGTH && data[len] != 0)
+		len += data[len] + 1;
+
+	if (len > HCI_MAX_EIR_LENGTH)
+		len = HCI_MAX_EIR_LENGTH;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 0x01000193;
+
+	for (i = 0; i < 4; i++)
+		hash = (hash ^ ((class >> (i * 8)) & 0xff)) * 0x01000193;
+
+	return hash;
+}
+
 static struct remote_dev_info *found_device_new(const bdaddr_t *bdaddr,
 					gboolean le, const char *name,
 					const char *alias, uint32_t class,
@@ -3510,6 +4781,8 @@ static struct remote_dev_info *found_device_new(const bdaddr_t *bdaddr,
 	struct remote_dev_info *dev;
 
 	dev = g_new0(struct remote_dev_info, 1);
+	btd_memstat_add(MEMSTAT_FOUND_DEVICES, sizeof(*dev));
+
 	bacpy(&dev->bdaddr, bdaddr);
 	dev->le = le;
 	dev->name = g_strdup(name);
@@ -3523,112 +4796,100 @@ static struct remote_dev_info *found_device_new(const bdaddr_t *bdaddr,
 	return dev;
 }
 
-static void remove_same_uuid(gpointer data, gpointer user_data)
-{
-	struct remote_dev_info *dev = user_data;
-	GSList *l;
-
-	for (l = dev->services; l; l = l->next) {
-		char *current_uuid = l->data;
-		char *new_uuid = data;
-
-		if (strcmp(current_uuid, new_uuid) == 0) {
-			g_free(current_uuid);
-			dev->services = g_slist_delete_link(dev->services, l);
-			break;
-		}
-	}
-}
-
-static void dev_prepend_uuid(gpointer data, gpointer user_data)
+static gboolean pairing_is_legacy(const uint8_t *eir,
+					const struct cached_device *stored)
 {
-	struct remote_dev_info *dev = user_data;
-	char *new_uuid = data;
-
-	dev->services = g_slist_prepend(dev->services, g_strdup(new_uuid));
-}
-
-static gboolean pairing_is_legacy(bdaddr_t *local, bdaddr_t *peer,
-					const uint8_t *eir, const char *name)
-{
-	unsigned char features[8];
-
 	if (eir)
 		return FALSE;
 
-	if (name == NULL)
+	if (stored == NULL || stored->name == NULL)
 		return TRUE;
 
-	if (read_remote_features(local, peer, NULL, features) < 0)
+	if (!stored->features_known)
 		return TRUE;
 
-	if (features[0] & 0x01)
+	if (stored->features[0] & 0x01)
 		return FALSE;
 	else
 		return TRUE;
 }
 
-static char *read_stored_data(bdaddr_t *local, bdaddr_t *peer, const char *file)
-{
-	char local_addr[18], peer_addr[18], filename[PATH_MAX + 1];
-
-	ba2str(local, local_addr);
-	ba2str(peer, peer_addr);
-
-	create_name(filename, PATH_MAX, STORAGEDIR, local_addr, file);
-
-	return textfile_get(filename, peer_addr);
-}
-
 void adapter_update_found_devices(struct btd_adapter *adapter, bdaddr_t *bdaddr,
 						uint32_t class, int8_t rssi,
 						uint8_t *data)
 {
-	struct remote_dev_info *dev, match;
+	struct remote_dev_info *dev;
+	const struct cached_device *stored;
 	struct eir_data eir_data;
-	char *alias, *name;
+	const char *alias, *name;
 	gboolean legacy, le;
 	name_status_t name_status;
+	unsigned int fields = 0;
+	uint32_t hash;
 	int err;
 
-	memset(&eir_data, 0, sizeof(eir_data));
+	hash = found_device_hash(data, class);
+
+	/* Device already seen in the discovery session ? */
+	dev = g_hash_table_lookup(adapter->found_devices, bdaddr);
+	if (dev) {
+		if (dev->generation != adapter->found_generation)
+			count_cycle_device(adapter, dev);
+
+		dev->generation = adapter->found_generation;
+
+		/* Nothing new but maybe the signal strength */
+		if (dev->content_hash == hash) {
+			if (dev->rssi == rssi)
+				return;
+
+			found_device_unlink(adapter, dev);
+			dev->rssi = rssi;
+			found_device_link(adapter, dev);
+
+			if (rssi_moved(dev, rssi))
+				found_device_changed(adapter, dev, FOUND_RSSI);
+
+			return;
+		}
+	}
+
 	err = eir_parse(&eir_data, data);
 	if (err < 0) {
 		error("Error parsing EIR data: %s (%d)", strerror(-err), -err);
 		return;
 	}
 
-	if (eir_data.name != NULL && eir_data.name_complete)
+	if (eir_data.name[0] != '\0' && eir_data.name_complete)
 		write_device_name(&adapter->bdaddr, bdaddr, eir_data.name);
 
-	/* Device already seen in the discovery session ? */
-	memset(&match, 0, sizeof(struct remote_dev_info));
-	bacpy(&match.bdaddr, bdaddr);
-	match.name_status = NAME_ANY;
-
-	dev = adapter_search_found_devices(adapter, &match);
 	if (dev) {
-		adapter->oor_devices = g_slist_remove(adapter->oor_devices,
-							dev);
-		if (dev->rssi != rssi)
-			goto done;
+		if (eir_data.name[0] != '\0' && eir_data.name_complete &&
+				g_strcmp0(dev->name, eir_data.name) != 0) {
+			g_free(dev->name);
+			dev->name = g_strdup(eir_data.name);
+			fields |= FOUND_NAME;
+		}
 
-		eir_data_free(&eir_data);
+		if (rssi_moved(dev, rssi))
+			fields |= FOUND_RSSI;
 
-		return;
+		goto done;
 	}
 
 	/* New device in the discovery session */
 
-	name = read_stored_data(&adapter->bdaddr, bdaddr, "names");
+	stored = read_cached_device(&adapter->bdaddr, bdaddr);
+	name = stored ? stored->name : NULL;
+	alias = stored ? stored->alias : NULL;
 
 	if (eir_data.flags < 0) {
 		le = FALSE;
 
-		legacy = pairing_is_legacy(&adapter->bdaddr, bdaddr, data,
-									name);
+		legacy = pairing_is_legacy(data, stored);
 
-		if (!name && main_opts.name_resolv &&
+		if ((!name || name_is_stale(stored)) &&
+				main_opts.name_resolv &&
 				adapter_has_discov_sessions(adapter))
 			name_status = NAME_REQUIRED;
 		else
@@ -3639,27 +4900,35 @@ void adapter_update_found_devices(struct btd_adapter *adapter, bdaddr_t *bdaddr,
 		name_status = NAME_NOT_REQUIRED;
 	}
 
-	alias = read_stored_data(&adapter->bdaddr, bdaddr, "aliases");
-
 	dev = found_device_new(bdaddr, le, name, alias, class, legacy,
 						name_status, eir_data.flags);
-	free(name);
-	free(alias);
 
-	adapter->found_devices = g_slist_prepend(adapter->found_devices, dev);
+	dev->generation = adapter->found_generation;
+	g_hash_table_insert(adapter->found_devices, &dev->bdaddr, dev);
+
+	count_cycle_device(adapter, dev);
+
+	fields = FOUND_ALL;
 
 done:
-	dev->rssi = rssi;
+	dev->content_hash = hash;
 
-	adapter->found_devices = g_slist_sort(adapter->found_devices,
-						(GCompareFunc) dev_rssi_cmp);
+	found_device_unlink(adapter, dev);
+	dev->rssi = rssi;
+	found_device_link(adapter, dev);
 
-	g_slist_foreach(eir_data.services, remove_same_uuid, dev);
-	g_slist_foreach(eir_data.services, dev_prepend_uuid, dev);
+	if (eir_uuids_count(&eir_data.services) > 0) {
+		if (dev->services == NULL)
+			dev->services = g_new0(struct eir_uuids, 1);
 
-	adapter_emit_device_found(adapter, dev);
+		if (eir_uuids_merge(dev->services, &eir_data.services) > 0)
+			fields |= FOUND_UUIDS;
+	}
 
-	eir_data_free(&eir_data);
+	if (fields == FOUND_ALL)
+		adapter_emit_device_found(adapter, dev);
+	else if (fields != 0)
+		found_device_changed(adapter, dev, fields);
 }
 
 int adapter_remove_found_device(struct btd_adapter *adapter, bdaddr_t *bdaddr)
@@ -3724,14 +4993,14 @@ void adapter_mode_changed(struct btd_adapter *adapter, uint8_t scan_mode)
 
 	/* If page scanning gets toggled emit the Pairable property */
 	if ((adapter->scan_mode & SCAN_PAGE) != (scan_mode & SCAN_PAGE))
-		emit_property_changed(connection, adapter->path,
+		queue_property_changed(connection, adapter->path,
 					ADAPTER_INTERFACE, "Pairable",
 					DBUS_TYPE_BOOLEAN, &pairable);
 
 	if (!discoverable)
 		adapter_set_limited_discoverable(adapter, FALSE);
 
-	emit_property_changed(connection, path,
+	queue_property_changed(connection, path,
 				ADAPTER_INTERFACE, "Discoverable",
 				DBUS_TYPE_BOOLEAN, &discoverable);
 
@@ -3759,6 +5028,8 @@ void adapter_add_connection(struct btd_adapter *adapter,
 	device_add_connection(device, connection);
 
 	adapter->connections = g_slist_append(adapter->connections, device);
+
+	reconnect_connected(adapter, device);
 }
 
 void adapter_remove_connection(struct btd_adapter *adapter,
@@ -3819,7 +5090,9 @@ int btd_register_adapter_driver(struct btd_adapter_driver *driver)
 	if (driver->probe == NULL)
 		return 0;
 
+	btd_adapter_services_begin();
 	manager_foreach_adapter(probe_driver, driver);
+	btd_adapter_services_commit();
 
 	return 0;
 }
@@ -3833,40 +5106,193 @@ void btd_unregister_adapter_driver(struct btd_adapter_driver *driver)
 {
 	adapter_drivers = g_slist_remove(adapter_drivers, driver);
 
+	btd_adapter_services_begin();
 	manager_foreach_adapter(unload_driver, driver);
+	btd_adapter_services_commit();
+}
+
+static gboolean auth_idle_cb(gpointer user_data);
+
+static void auth_schedule(struct btd_adapter *adapter)
+{
+	if (adapter->auth_idle_id == 0)
+		adapter->auth_idle_id = g_idle_add(auth_idle_cb, adapter);
+}
+
+/* Answers every queued authorization matching the device and service of
+ * auth, so concurrent profile connections share one agent prompt */
+static void auth_complete(struct btd_adapter *adapter,
+				struct service_auth *auth, DBusError *derr)
+{
+	struct btd_device *device = auth->device;
+	char *uuid = g_strdup(auth->uuid);
+	GSList *l, *next, *done = NULL;
+
+	for (l = adapter->auths; l != NULL; l = next) {
+		struct service_auth *a = l->data;
+
+		next = l->next;
+
+		if (a->device != device || g_strcmp0(a->uuid, uuid) != 0)
+			continue;
+
+		adapter->auths = g_slist_delete_link(adapter->auths, l);
+		done = g_slist_append(done, a);
+	}
+
+	g_free(uuid);
+
+	for (l = done; l != NULL; l = l->next) {
+		struct service_auth *a = l->data;
+
+		a->cb(derr, a->user_data);
+		service_auth_free(a);
+	}
+
+	g_slist_free(done);
 }
 
 static void agent_auth_cb(struct agent *agent, DBusError *derr,
 							void *user_data)
 {
 	struct service_auth *auth = user_data;
+	struct btd_adapter *adapter = auth->adapter;
 
 	device_set_authorizing(auth->device, FALSE);
 
-	auth->cb(derr, auth->user_data);
+	adapter->auth = NULL;
+	auth->agent = NULL;
+
+	auth_complete(adapter, auth, derr);
+
+	/* The agent only takes a new request once this callback returns */
+	if (adapter->auths != NULL)
+		auth_schedule(adapter);
+}
+
+static int auth_send(struct btd_adapter *adapter, struct service_auth *auth)
+{
+	struct agent *agent;
+	int err;
+
+	agent = device_get_agent(auth->device);
+	if (!agent)
+		return -EPERM;
+
+	err = agent_authorize(agent, device_get_path(auth->device), auth->uuid,
+						agent_auth_cb, auth, NULL);
+	if (err < 0)
+		return err;
+
+	device_set_authorizing(auth->device, TRUE);
+	auth->agent = agent;
+	adapter->auth = auth;
+
+	return 0;
+}
+
+static void auth_next(struct btd_adapter *adapter)
+{
+	while (adapter->auth == NULL && adapter->auths != NULL) {
+		struct service_auth *auth = adapter->auths->data;
+		DBusError derr;
+		int err;
+
+		/* Trust may have been granted while waiting in the queue */
+		if (device_is_trusted(auth->device)) {
+			auth_complete(adapter, auth, NULL);
+			continue;
+		}
+
+		err = auth_send(adapter, auth);
+		if (err == 0)
+			return;
+
+		dbus_error_init(&derr);
+		dbus_set_error_const(&derr, ERROR_INTERFACE ".Failed",
+							strerror(-err));
+		auth_complete(adapter, auth, &derr);
+		dbus_error_free(&derr);
+	}
 }
 
 static gboolean auth_idle_cb(gpointer user_data)
 {
-	struct service_auth *auth = user_data;
-	struct btd_adapter *adapter = auth->adapter;
+	struct btd_adapter *adapter = user_data;
 
 	adapter->auth_idle_id = 0;
 
-	auth->cb(NULL, auth->user_data);
+	while (adapter->trusted_auths != NULL) {
+		struct service_auth *auth = adapter->trusted_auths->data;
+
+		adapter->trusted_auths = g_slist_remove(adapter->trusted_auths,
+									auth);
+		auth->cb(NULL, auth->user_data);
+		service_auth_free(auth);
+	}
+
+	auth_next(adapter);
 
 	return FALSE;
 }
 
+static gboolean adapter_cancel_auths(struct btd_adapter *adapter,
+						struct btd_device *device)
+{
+	struct service_auth *current = adapter->auth;
+	gboolean found = FALSE;
+	GSList *l, *next;
+
+	for (l = adapter->trusted_auths; l != NULL; l = next) {
+		struct service_auth *auth = l->data;
+
+		next = l->next;
+
+		if (auth->device != device)
+			continue;
+
+		adapter->trusted_auths = g_slist_delete_link(
+						adapter->trusted_auths, l);
+		service_auth_free(auth);
+		found = TRUE;
+	}
+
+	for (l = adapter->auths; l != NULL; l = next) {
+		struct service_auth *auth = l->data;
+
+		next = l->next;
+
+		if (auth->device != device || auth == current)
+			continue;
+
+		adapter->auths = g_slist_delete_link(adapter->auths, l);
+		service_auth_free(auth);
+		found = TRUE;
+	}
+
+	if (current && current->device == device) {
+		adapter->auth = NULL;
+		adapter->auths = g_slist_remove(adapter->auths, current);
+
+		agent_cancel(current->agent);
+		device_set_authorizing(device, FALSE);
+		service_auth_free(current);
+		found = TRUE;
+
+		if (adapter->auths != NULL)
+			auth_schedule(adapter);
+	}
+
+	return found;
+}
+
 static int adapter_authorize(struct btd_adapter *adapter, const bdaddr_t *dst,
 					const char *uuid, service_auth_cb cb,
 					void *user_data)
 {
 	struct service_auth *auth;
 	struct btd_device *device;
-	struct agent *agent;
 	char address[18];
-	const gchar *dev_path;
 	int err;
 
 	ba2str(dst, address);
@@ -3878,40 +5304,44 @@ static int adapter_authorize(struct btd_adapter *adapter, const bdaddr_t *dst,
 	if (!g_slist_find(adapter->connections, device))
 		return -ENOTCONN;
 
-	if (adapter->auth_idle_id)
-		return -EBUSY;
-
 	auth = g_try_new0(struct service_auth, 1);
 	if (!auth)
 		return -ENOMEM;
 
 	auth->cb = cb;
 	auth->user_data = user_data;
+	auth->uuid = g_strdup(uuid);
 	auth->device = device;
 	auth->adapter = adapter;
 
 	if (device_is_trusted(device) == TRUE) {
-		adapter->auth_idle_id = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-							auth_idle_cb, auth,
-							g_free);
+		adapter->trusted_auths = g_slist_append(adapter->trusted_auths,
+									auth);
+		auth_schedule(adapter);
 		return 0;
 	}
 
-	agent = device_get_agent(device);
-	if (!agent) {
-		g_free(auth);
+	if (!device_get_agent(device)) {
+		service_auth_free(auth);
 		return -EPERM;
 	}
 
-	dev_path = device_get_path(device);
+	/* Wait behind the request in progress, or share its answer when it
+	 * is for the same device and service */
+	if (adapter->auth != NULL || adapter->auths != NULL) {
+		adapter->auths = g_slist_append(adapter->auths, auth);
+		return 0;
+	}
 
-	err = agent_authorize(agent, dev_path, uuid, agent_auth_cb, auth, g_free);
-	if (err < 0)
-		g_free(auth);
-	else
-		device_set_authorizing(device, TRUE);
+	err = auth_send(adapter, auth);
+	if (err < 0) {
+		service_auth_free(auth);
+		return err;
+	}
 
-	return err;
+	adapter->auths = g_slist_append(adapter->auths, auth);
+
+	return 0;
 }
 
 int btd_request_authorization(const bdaddr_t *src, const bdaddr_t *dst,
@@ -3946,9 +5376,7 @@ int btd_cancel_authorization(const bdaddr_t *src, const bdaddr_t *dst)
 {
 	struct btd_adapter *adapter = manager_find_adapter(src);
 	struct btd_device *device;
-	struct agent *agent;
 	char address[18];
-	int err;
 
 	if (!adapter)
 		return -EPERM;
@@ -3958,27 +5386,10 @@ int btd_cancel_authorization(const bdaddr_t *src, const bdaddr_t *dst)
 	if (!device)
 		return -EPERM;
 
-	if (adapter->auth_idle_id) {
-		g_source_remove(adapter->auth_idle_id);
-		adapter->auth_idle_id = 0;
-		return 0;
-	}
-
-	/*
-	 * FIXME: Cancel fails if authorization is requested to adapter's
-	 * agent and in the meanwhile CreatePairedDevice is called.
-	 */
-
-	agent = device_get_agent(device);
-	if (!agent)
-		return -EPERM;
-
-	err = agent_cancel(agent);
-
-	if (err == 0)
-		device_set_authorizing(device, FALSE);
+	if (!adapter_cancel_auths(adapter, device))
+		return -EINVAL;
 
-	return err;
+	return 0;
 }
 
 static gchar *adapter_any_path = NULL;
@@ -4193,6 +5604,15 @@ int btd_adapter_retry_authentication(struct btd_adapter *adapter, bdaddr_t *bdad
 	return adapter_ops->retry_authentication(adapter->dev_id, bdaddr);
 }
 
+int btd_adapter_get_conn_stats(struct btd_adapter *adapter, bdaddr_t *bdaddr,
+					struct btd_conn_stats *stats)
+{
+	if (adapter_ops->get_conn_stats == NULL)
+		return -ENOSYS;
+
+	return adapter_ops->get_conn_stats(adapter->dev_id, bdaddr, stats);
+}
+
 int adapter_create_bonding(struct btd_adapter *adapter, bdaddr_t *bdaddr,
 								uint8_t io_cap)
 {
@@ -63,6 +63,26 @@ struct link_key_info {
 	uint8_t pin_len;
 };
 
+struct eir_uuids;
+
+/* Transports of a discovery cycle */
+#define DISCOVERY_BREDR		0x01
+#define DISCOVERY_LE		0x02
+
+/* How one discovery cycle is run. The inquiry length and scan timeout
+ * split the cycle when both transports are used, a single transport gets
+ * the whole cycle. */
+struct discovery_params {
+	uint8_t transport;		/* DISCOVERY_BREDR and/or DISCOVERY_LE */
+	uint8_t inquiry_length;		/* in 1.28 s units */
+	uint16_t scan_timeout;		/* LE scan after the inquiry, in ms */
+	uint16_t scan_interval;		/* in 0.625 ms units */
+	uint16_t scan_window;		/* in 0.625 ms units */
+	gboolean filter_duplicates;	/* one LE report per device */
+	gboolean has_rssi;		/* drop reports weaker than rssi */
+	int8_t rssi;
+};
+
 struct remote_dev_info {
 	bdaddr_t bdaddr;
 	int8_t rssi;
@@ -74,9 +94,16 @@ struct remote_dev_info {
 	gboolean le;
 	char **uuids;
 	size_t uuid_count;
-	GSList *services;
+	struct eir_uuids *services;
 	uint8_t bdaddr_type;
 	uint8_t flags;
+	unsigned int generation;	/* discovery cycle it was last seen */
+	GList *rssi_link;
+	uint32_t content_hash;		/* of the last EIR data and class */
+	gboolean emitted;
+	int8_t emitted_rssi;
+	guint64 emitted_time;		/* msec, monotonic */
+	unsigned int emit_pending;	/* fields waiting for a signal */
 };
 
 void btd_adapter_start(struct btd_adapter *adapter);
@@ -160,11 +187,47 @@ gboolean adapter_is_pairable(struct btd_adapter *adapter);
 gboolean adapter_powering_down(struct btd_adapter *adapter);
 
 int btd_adapter_restore_powered(struct btd_adapter *adapter);
+
+void btd_adapter_services_begin(void);
+void btd_adapter_services_commit(void);
 int btd_adapter_switch_online(struct btd_adapter *adapter);
 int btd_adapter_switch_offline(struct btd_adapter *adapter);
 
 typedef void (*bt_hci_result_t) (uint8_t status, gpointer user_data);
 
+/* Upper bounds in usec of the command latency buckets, the last bucket
+ * takes everything slower */
+#define BTD_HCI_LATENCY_BOUNDS	{ 1000, 2000, 5000, 10000, 20000, 50000, \
+					100000 }
+#define BTD_HCI_LATENCY_BUCKETS	8
+
+/* Time from sending a command to its Command Status or Complete */
+struct btd_hci_cmd_stats {
+	uint16_t opcode;
+	uint32_t count;
+	guint64 total;			/* usec */
+	uint32_t max;			/* usec */
+	uint32_t buckets[BTD_HCI_LATENCY_BUCKETS];
+};
+
+struct btd_hci_stats {
+	uint32_t seconds;		/* since counting started */
+	uint32_t events[256];		/* by event code */
+	uint32_t le_reports;
+	uint32_t commands;
+	uint16_t acl_pkts;		/* controller ACL buffers */
+	struct hci_dev_stats kernel;
+	GSList *cmds;			/* btd_hci_cmd_stats, to be freed */
+};
+
+/* Per link counters, rssi is 127 until one has been reported */
+struct btd_conn_stats {
+	uint16_t handle;
+	unsigned int events;
+	int8_t rssi;
+	time_t connected;
+};
+
 struct btd_adapter_ops {
 	int (*setup) (void);
 	void (*cleanup) (void);
@@ -172,7 +235,8 @@ struct btd_adapter_ops {
 	int (*set_discoverable) (int index, gboolean discoverable);
 	int (*set_pairable) (int index, gboolean pairable);
 	int (*set_limited_discoverable) (int index, gboolean limited);
-	int (*start_discovery) (int index);
+	int (*start_discovery) (int index,
+				const struct discovery_params *params);
 	int (*stop_discovery) (int index);
 
 	int (*resolve_name) (int index, bdaddr_t *bdaddr);
@@ -201,6 +265,7 @@ struct btd_adapter_ops {
 	int (*add_uuid) (int index, uuid_t *uuid, uint8_t svc_hint);
 	int (*remove_uuid) (int index, uuid_t *uuid);
 	int (*disable_cod_cache) (int index);
+	int (*enable_cod_cache) (int index);
 	int (*restore_powered) (int index);
 	int (*load_keys) (int index, GSList *keys, gboolean debug_keys);
 	int (*set_io_capability) (int index, uint8_t io_capability);
@@ -212,6 +277,9 @@ struct btd_adapter_ops {
 	int (*remove_remote_oob_data) (int index, bdaddr_t *bdaddr);
 	int (*set_link_timeout) (int index, bdaddr_t *bdaddr, uint32_t num_slots);
 	int (*retry_authentication) (int index, bdaddr_t *bdaddr);
+	int (*get_conn_stats) (int index, bdaddr_t *bdaddr,
+					struct btd_conn_stats *stats);
+	int (*get_hci_stats) (int index, struct btd_hci_stats *stats);
 };
 
 int btd_register_adapter_ops(struct btd_adapter_ops *ops, gboolean priority);
@@ -256,6 +324,9 @@ int btd_adapter_encrypt_link(struct btd_adapter *adapter, bdaddr_t *bdaddr,
 int btd_adapter_retry_authentication(struct btd_adapter *adapter,
 				bdaddr_t *bdaddr);
 
+int btd_adapter_get_conn_stats(struct btd_adapter *adapter, bdaddr_t *bdaddr,
+					struct btd_conn_stats *stats);
+
 int btd_adapter_set_did(struct btd_adapter *adapter, uint16_t vendor,
 					uint16_t product, uint16_t version);
 
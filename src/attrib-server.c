@@ -44,29 +44,34 @@
 #include "hcid.h"
 #include "att.h"
 #include "gattrib.h"
+#include "memstat.h"
 
 #include "attrib-server.h"
 
-static GSList *database = NULL;
+/* Attributes sorted by handle. Service and characteristic declarations
+ * are indexed on their own as well so range requests for them only visit
+ * the matching attributes. */
+static GPtrArray *database = NULL;
+static GPtrArray *services = NULL;
+static GPtrArray *characteristics = NULL;
 
 struct gatt_channel {
 	bdaddr_t src;
 	bdaddr_t dst;
 	GSList *configs;
-	GSList *notify;
-	GSList *indicate;
+	GSList *notify;		/* handles */
+	GSList *indicate;	/* handles */
 	GAttrib *attrib;
 	guint mtu;
+	guint max_mtu;		/* what the bearer allows, offered on exchange */
 	gboolean le;
 	guint id;
 	gboolean encrypted;
 };
 
-struct group_elem {
-	uint16_t handle;
-	uint16_t end;
-	uint8_t *data;
-	uint16_t len;
+struct subscribers {
+	GSList *notify;		/* channels */
+	GSList *indicate;	/* channels */
 };
 
 static GIOChannel *l2cap_io = NULL;
@@ -75,6 +80,13 @@ static GSList *clients = NULL;
 static uint32_t gatt_sdp_handle = 0;
 static uint32_t gap_sdp_handle = 0;
 
+/* Channels subscribed to each characteristic value handle */
+static GHashTable *subscribers = NULL;
+
+/* Handles updated since the last notification round */
+static GSList *pending_notify = NULL;
+static guint pending_notify_id = 0;
+
 /* GAP attribute handles */
 static uint16_t name_handle = 0x0000;
 static uint16_t appearance_handle = 0x0000;
@@ -87,6 +99,10 @@ static bt_uuid_t snd_uuid = {
 			.type = BT_UUID16,
 			.value.u16 = GATT_SND_SVC_UUID
 };
+static bt_uuid_t chr_uuid = {
+			.type = BT_UUID16,
+			.value.u16 = GATT_CHARAC_UUID
+};
 
 static sdp_record_t *server_record_new(uuid_t *uuid, uint16_t start, uint16_t end)
 {
@@ -159,6 +175,156 @@ static int attribute_cmp(gconstpointer a1, gconstpointer a2)
 	return attrib1->handle - attrib2->handle;
 }
 
+static struct attribute *index_get(GPtrArray *attrs, guint i)
+{
+	if (attrs == NULL || i >= attrs->len)
+		return NULL;
+
+	return g_ptr_array_index(attrs, i);
+}
+
+/* Position of the first attribute whose handle is not below handle */
+static guint index_lower_bound(GPtrArray *attrs, guint handle)
+{
+	guint low = 0, high;
+
+	if (attrs == NULL)
+		return 0;
+
+	high = attrs->len;
+
+	while (low < high) {
+		guint mid = (low + high) / 2;
+		struct attribute *a = g_ptr_array_index(attrs, mid);
+
+		if (a->handle < handle)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static void index_insert(GPtrArray *attrs, struct attribute *a)
+{
+	guint i = index_lower_bound(attrs, a->handle);
+
+	g_ptr_array_add(attrs, NULL);
+	memmove(&attrs->pdata[i + 1], &attrs->pdata[i],
+				(attrs->len - i - 1) * sizeof(gpointer));
+	attrs->pdata[i] = a;
+}
+
+static void index_remove(GPtrArray *attrs, uint16_t handle)
+{
+	guint i = index_lower_bound(attrs, handle);
+	struct attribute *a = index_get(attrs, i);
+
+	if (a && a->handle == handle)
+		g_ptr_array_remove_index(attrs, i);
+}
+
+static GPtrArray *type_index(bt_uuid_t *uuid)
+{
+	if (bt_uuid_cmp(uuid, &prim_uuid) == 0 ||
+				bt_uuid_cmp(uuid, &snd_uuid) == 0)
+		return services;
+
+	if (bt_uuid_cmp(uuid, &chr_uuid) == 0)
+		return characteristics;
+
+	return NULL;
+}
+
+static struct attribute *db_lookup(uint16_t handle)
+{
+	struct attribute *a;
+
+	a = index_get(database, index_lower_bound(database, handle));
+	if (a == NULL || a->handle != handle)
+		return NULL;
+
+	return a;
+}
+
+/* Handle of the last attribute of the service at position i of the
+ * services index, not looking at handles from limit on */
+static uint16_t service_end(guint i, guint limit)
+{
+	struct attribute *next, *last;
+	guint pos;
+
+	next = index_get(services, i + 1);
+	if (next && next->handle < limit)
+		limit = next->handle;
+
+	pos = index_lower_bound(database, limit);
+	last = index_get(database, pos - 1);
+
+	return last->handle;
+}
+
+static GSList *list_toggle(GSList *list, gpointer data, gboolean add)
+{
+	if (!add)
+		return g_slist_remove(list, data);
+
+	if (g_slist_find(list, data))
+		return list;
+
+	return g_slist_append(list, data);
+}
+
+static void subscribers_free(gpointer data)
+{
+	struct subscribers *subs = data;
+
+	g_slist_free(subs->notify);
+	g_slist_free(subs->indicate);
+	g_free(subs);
+}
+
+static void subscribers_update(uint16_t handle, struct gatt_channel *channel,
+					gboolean notify, gboolean indicate)
+{
+	gpointer key = GUINT_TO_POINTER(handle);
+	struct subscribers *subs;
+
+	subs = g_hash_table_lookup(subscribers, key);
+	if (subs == NULL) {
+		if (!notify && !indicate)
+			return;
+
+		subs = g_new0(struct subscribers, 1);
+		g_hash_table_insert(subscribers, key, subs);
+	}
+
+	subs->notify = list_toggle(subs->notify, channel, notify);
+	subs->indicate = list_toggle(subs->indicate, channel, indicate);
+
+	if (subs->notify == NULL && subs->indicate == NULL)
+		g_hash_table_remove(subscribers, key);
+}
+
+static void channel_unsubscribe(struct gatt_channel *channel)
+{
+	GSList *l;
+
+	for (l = channel->notify; l; l = l->next)
+		subscribers_update(GPOINTER_TO_UINT(l->data), channel,
+								FALSE, FALSE);
+
+	for (l = channel->indicate; l; l = l->next)
+		subscribers_update(GPOINTER_TO_UINT(l->data), channel,
+								FALSE, FALSE);
+
+	g_slist_free(channel->notify);
+	g_slist_free(channel->indicate);
+	channel->notify = NULL;
+	channel->indicate = NULL;
+}
+
 static uint8_t att_check_reqs(struct gatt_channel *channel, uint8_t opcode,
 								int reqs)
 {
@@ -197,31 +363,24 @@ static uint8_t client_set_notifications(struct attribute *attr,
 							gpointer user_data)
 {
 	struct gatt_channel *channel = user_data;
-	struct attribute *last_chr_val = NULL;
-	uint16_t cfg_val;
+	struct attribute *chr, *last_chr_val = NULL;
+	uint16_t cfg_val, handle;
 	uint8_t props;
-	bt_uuid_t uuid;
-	GSList *l;
+	guint i;
 
 	cfg_val = att_get_u16(attr->data);
 
-	bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
-	for (l = database, props = 0; l != NULL; l = l->next) {
-		struct attribute *a = l->data;
-		static uint16_t handle = 0;
-
-		if (a->handle >= attr->handle)
-			break;
+	/* The descriptor belongs to the closest characteristic before it */
+	i = index_lower_bound(characteristics, attr->handle);
+	if (i == 0)
+		return 0;
 
-		if (bt_uuid_cmp(&a->uuid, &uuid) == 0) {
-			props = att_get_u8(&a->data[0]);
-			handle = att_get_u16(&a->data[1]);
-			continue;
-		}
+	chr = index_get(characteristics, i - 1);
+	props = att_get_u8(&chr->data[0]);
+	handle = att_get_u16(&chr->data[1]);
 
-		if (handle && a->handle == handle)
-			last_chr_val = a;
-	}
+	if (handle < attr->handle)
+		last_chr_val = db_lookup(handle);
 
 	if (last_chr_val == NULL)
 		return 0;
@@ -232,17 +391,16 @@ static uint8_t client_set_notifications(struct attribute *attr,
 	if ((cfg_val & 0x0002) && !(props & ATT_CHAR_PROPER_INDICATE))
 		return ATT_ECODE_WRITE_NOT_PERM;
 
-	if (cfg_val & 0x0001)
-		channel->notify = g_slist_append(channel->notify, last_chr_val);
-	else
-		channel->notify = g_slist_remove(channel->notify, last_chr_val);
+	/* Handles rather than attributes, updates may move the latter */
+	channel->notify = list_toggle(channel->notify,
+					GUINT_TO_POINTER(handle),
+					cfg_val & 0x0001);
+	channel->indicate = list_toggle(channel->indicate,
+					GUINT_TO_POINTER(handle),
+					cfg_val & 0x0002);
 
-	if (cfg_val & 0x0002)
-		channel->indicate = g_slist_append(channel->indicate,
-								last_chr_val);
-	else
-		channel->indicate = g_slist_remove(channel->indicate,
-								last_chr_val);
+	subscribers_update(handle, channel, cfg_val & 0x0001,
+							cfg_val & 0x0002);
 
 	return 0;
 }
@@ -285,17 +443,21 @@ static struct attribute *client_cfg_attribute(struct gatt_channel *channel,
 	return l->data;
 }
 
+/* Entries of entry_len bytes fitting a response of len bytes after its
+ * opcode and length (or format) octets. Walks stop once it is full. */
+static int response_capacity(int len, int entry_len)
+{
+	return MAX((len - 2) / entry_len, 1);
+}
+
 static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 						uint16_t end, bt_uuid_t *uuid,
 						uint8_t *pdu, int len)
 {
-	struct att_data_list *adl;
 	struct attribute *a;
-	struct group_elem *cur, *old = NULL;
-	GSList *l, *groups;
-	uint16_t length, last_handle, last_size = 0;
-	uint8_t status;
-	int i;
+	uint16_t last_size = 0, elen = 0;
+	uint8_t status, *ptr = &pdu[2];
+	int i, num = 0, max = 0;
 
 	if (start > end || start == 0x0000)
 		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
@@ -311,33 +473,21 @@ static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, 0x0000,
 					ATT_ECODE_UNSUPP_GRP_TYPE, pdu, len);
 
-	last_handle = end;
-	for (l = database, groups = NULL, cur = NULL; l; l = l->next) {
+	/* Entries are written straight into the response */
+	for (i = index_lower_bound(services, start);
+					(a = index_get(services, i)); i++) {
 		struct attribute *client_attr;
 
-		a = l->data;
-
-		if (a->handle < start)
-			continue;
-
 		if (a->handle >= end)
 			break;
 
-		/* The old group ends when a new one starts */
-		if (old && (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)) {
-			old->end = last_handle;
-			old = NULL;
-		}
-
-		if (bt_uuid_cmp(&a->uuid, uuid) != 0) {
-			/* Still inside a service, update its last handle */
-			if (old)
-				last_handle = a->handle;
+		if (bt_uuid_cmp(&a->uuid, uuid) != 0)
 			continue;
-		}
 
-		if (last_size && (last_size != a->len))
+		if (last_size == 0) {
+			elen = a->len + 4;
+			max = response_capacity(len, elen);
+		} else if (last_size != a->len || num == max)
 			break;
 
 		status = att_check_reqs(channel, ATT_OP_READ_BY_GROUP_REQ,
@@ -350,83 +500,54 @@ static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
 		if (status == 0x00 && a->read_cb)
 			status = a->read_cb(a, a->cb_user_data);
 
-		if (status) {
-			g_slist_foreach(groups, (GFunc) g_free, NULL);
-			g_slist_free(groups);
+		if (status)
 			return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ,
 						a->handle, status, pdu, len);
-		}
-
-		cur = g_new0(struct group_elem, 1);
-		cur->handle = a->handle;
-		cur->data = a->data;
-		cur->len = a->len;
 
-		/* Attribute Grouping Type found */
-		groups = g_slist_append(groups, cur);
+		/* Attribute Grouping Type found, the group ends where the
+		 * next one starts */
+		att_put_u16(a->handle, ptr);
+		att_put_u16(service_end(i, end), &ptr[2]);
+		memcpy(&ptr[4], a->data, a->len);
+		ptr += elen;
+		num++;
 
 		last_size = a->len;
-		old = cur;
-		last_handle = cur->handle;
 	}
 
-	if (groups == NULL)
+	if (num == 0)
 		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
 					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
 
-	if (l == NULL)
-		cur->end = a->handle;
-	else
-		cur->end = last_handle;
-
-	length = g_slist_length(groups);
-
-	adl = att_data_list_alloc(length, last_size + 4);
-
-	for (i = 0, l = groups; l; l = l->next, i++) {
-		uint8_t *value;
-
-		cur = l->data;
-
-		value = (void *) adl->data[i];
-
-		att_put_u16(cur->handle, value);
-		att_put_u16(cur->end, &value[2]);
-		/* Attribute Value */
-		memcpy(&value[4], cur->data, cur->len);
-	}
-
-	length = enc_read_by_grp_resp(adl, pdu, len);
-
-	att_data_list_free(adl);
-	g_slist_foreach(groups, (GFunc) g_free, NULL);
-	g_slist_free(groups);
+	pdu[0] = ATT_OP_READ_BY_GROUP_RESP;
+	pdu[1] = elen;
 
-	return length;
+	return ptr - pdu;
 }
 
 static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
 						uint16_t end, bt_uuid_t *uuid,
 						uint8_t *pdu, int len)
 {
-	struct att_data_list *adl;
-	GSList *l, *types;
+	GPtrArray *attrs;
 	struct attribute *a;
-	uint16_t num, length;
-	uint8_t status;
-	int i;
+	uint16_t length = 0, elen = 0;
+	uint8_t status, *ptr = &pdu[2];
+	int i, num = 0, max = 0;
 
 	if (start > end || start == 0x0000)
 		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	for (l = database, length = 0, types = NULL; l; l = l->next) {
-		struct attribute *client_attr;
+	/* Declarations are read from their index, any other type needs
+	 * the whole range to be walked */
+	attrs = type_index(uuid);
+	if (attrs == NULL)
+		attrs = database;
 
-		a = l->data;
-
-		if (a->handle < start)
-			continue;
+	for (i = index_lower_bound(attrs, start);
+					(a = index_get(attrs, i)); i++) {
+		struct attribute *client_attr;
 
 		if (a->handle > end)
 			break;
@@ -444,123 +565,88 @@ static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
 		if (status == 0x00 && a->read_cb)
 			status = a->read_cb(a, a->cb_user_data);
 
-		if (status) {
-			g_slist_free(types);
+		if (status)
 			return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ,
 						a->handle, status, pdu, len);
-		}
 
-		/* All elements must have the same length */
-		if (length == 0)
+		/* All elements must have the same length, values longer
+		 * than the PDU are truncated */
+		if (num == 0) {
 			length = a->len;
-		else if (a->len != length)
+			elen = MIN(length + 2, len - 2);
+			max = response_capacity(len, elen);
+		} else if (a->len != length)
 			break;
 
-		types = g_slist_append(types, a);
+		/* Handle plus attribute value */
+		att_put_u16(a->handle, ptr);
+		memcpy(&ptr[2], a->data, elen - 2);
+		ptr += elen;
+
+		if (++num == max)
+			break;
 	}
 
-	if (types == NULL)
+	if (num == 0)
 		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
 					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
 
-	num = g_slist_length(types);
-
-	/* Handle length plus attribute value length */
-	length += 2;
-
-	adl = att_data_list_alloc(num, length);
-
-	for (i = 0, l = types; l; i++, l = l->next) {
-		uint8_t *value;
-
-		a = l->data;
-
-		value = (void *) adl->data[i];
-
-		att_put_u16(a->handle, value);
-
-		/* Attribute Value */
-		memcpy(&value[2], a->data, a->len);
-	}
-
-	length = enc_read_by_type_resp(adl, pdu, len);
-
-	att_data_list_free(adl);
-	g_slist_free(types);
+	pdu[0] = ATT_OP_READ_BY_TYPE_RESP;
+	pdu[1] = elen;
 
-	return length;
+	return ptr - pdu;
 }
 
 static int find_info(uint16_t start, uint16_t end, uint8_t *pdu, int len)
 {
 	struct attribute *a;
-	struct att_data_list *adl;
-	GSList *l, *info;
-	uint8_t format, last_type = BT_UUID_UNSPEC;
-	uint16_t length, num;
-	int i;
+	uint8_t format = 0, last_type = BT_UUID_UNSPEC, *ptr = &pdu[2];
+	uint16_t elen = 0;
+	int i, num = 0, max = 0;
 
 	if (start > end || start == 0x0000)
 		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	for (l = database, info = NULL, num = 0; l; l = l->next) {
-		a = l->data;
-
-		if (a->handle < start)
-			continue;
-
+	for (i = index_lower_bound(database, start);
+					(a = index_get(database, i)); i++) {
 		if (a->handle > end)
 			break;
 
-		if (last_type == BT_UUID_UNSPEC)
+		if (last_type == BT_UUID_UNSPEC) {
 			last_type = a->uuid.type;
 
+			if (last_type == BT_UUID16) {
+				elen = 2 + 2;
+				format = 0x01;
+			} else if (last_type == BT_UUID128) {
+				elen = 2 + 16;
+				format = 0x02;
+			} else
+				return 0;
+
+			max = response_capacity(len, elen);
+		}
+
 		if (a->uuid.type != last_type)
 			break;
 
-		info = g_slist_append(info, a);
-		num++;
+		att_put_u16(a->handle, ptr);
+		att_put_uuid(a->uuid, &ptr[2]);
+		ptr += elen;
 
-		last_type = a->uuid.type;
+		if (++num == max)
+			break;
 	}
 
-	if (info == NULL)
+	if (num == 0)
 		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
 					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
 
-	if (last_type == BT_UUID16) {
-		length = 2;
-		format = 0x01;
-	} else if (last_type == BT_UUID128) {
-		length = 16;
-		format = 0x02;
-	} else {
-		g_slist_free(info);
-		return 0;
-	}
-
-	adl = att_data_list_alloc(num, length + 2);
-
-	for (i = 0, l = info; l; i++, l = l->next) {
-		uint8_t *value;
-
-		a = l->data;
-
-		value = (void *) adl->data[i];
+	pdu[0] = ATT_OP_FIND_INFO_RESP;
+	pdu[1] = format;
 
-		att_put_u16(a->handle, value);
-
-		/* Attribute Value */
-		att_put_uuid(a->uuid, &value[2]);
-	}
-
-	length = enc_find_info_resp(format, adl, pdu, len);
-
-	att_data_list_free(adl);
-	g_slist_free(info);
-
-	return length;
+	return ptr - pdu;
 }
 
 static int find_by_type(uint16_t start, uint16_t end, bt_uuid_t *uuid,
@@ -568,20 +654,41 @@ static int find_by_type(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 {
 	struct attribute *a;
 	struct att_range *range;
-	GSList *l, *matches;
+	GSList *matches;
+	guint i;
 	int len;
 
 	if (start > end || start == 0x0000)
 		return enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
 					ATT_ECODE_INVALID_HANDLE, opdu, mtu);
 
-	/* Searching first requested handle number */
-	for (l = database, matches = NULL, range = NULL; l; l = l->next) {
-		a = l->data;
+	matches = NULL;
 
-		if (a->handle < start)
-			continue;
+	/* Discover Primary Service by UUID only visits the services */
+	if (type_index(uuid) == services) {
+		for (i = index_lower_bound(services, start);
+					(a = index_get(services, i)); i++) {
+			if (a->handle > end)
+				break;
+
+			if (bt_uuid_cmp(&a->uuid, uuid) != 0 ||
+					a->len != vlen ||
+					memcmp(a->data, value, vlen) != 0)
+				continue;
+
+			range = g_new0(struct att_range, 1);
+			range->start = a->handle;
+			range->end = service_end(i, end + 1);
+
+			matches = g_slist_append(matches, range);
+		}
+
+		goto done;
+	}
 
+	/* Searching first requested handle number */
+	for (i = index_lower_bound(database, start), range = NULL;
+				(a = index_get(database, i)); i++) {
 		if (a->handle > end)
 			break;
 
@@ -608,6 +715,7 @@ static int find_by_type(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 		}
 	}
 
+done:
 	if (matches == NULL)
 		return enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
 				ATT_ECODE_ATTR_NOT_FOUND, opdu, mtu);
@@ -623,32 +731,18 @@ static int find_by_type(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 static struct attribute *find_primary_range(uint16_t start, uint16_t *end)
 {
 	struct attribute *attrib;
-	guint h = start;
-	GSList *l;
 
 	if (end == NULL)
 		return NULL;
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	attrib = db_lookup(start);
+	if (!attrib)
 		return NULL;
 
-	attrib = l->data;
-
 	if (bt_uuid_cmp(&attrib->uuid, &prim_uuid) != 0)
 		return NULL;
 
-	*end = start;
-
-	for (l = l->next; l; l = l->next) {
-		struct attribute *a = l->data;
-
-		if (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)
-			break;
-
-		*end = a->handle;
-	}
+	*end = service_end(index_lower_bound(services, start), 0x10000);
 
 	return attrib;
 }
@@ -658,16 +752,12 @@ static uint16_t read_value(struct gatt_channel *channel, uint16_t handle,
 {
 	struct attribute *a, *client_attr;
 	uint8_t status;
-	GSList *l;
-	guint h = handle;
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (!a)
 		return enc_error_resp(ATT_OP_READ_REQ, handle,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	status = att_check_reqs(channel, ATT_OP_READ_REQ, a->read_reqs);
 
 	client_attr = client_cfg_attribute(channel, a, a->data, a->len);
@@ -689,16 +779,12 @@ static uint16_t read_blob(struct gatt_channel *channel, uint16_t handle,
 {
 	struct attribute *a, *client_attr;
 	uint8_t status;
-	GSList *l;
-	guint h = handle;
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (!a)
 		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
 					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	if (a->len <= offset)
 		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
 					ATT_ECODE_INVALID_OFFSET, pdu, len);
@@ -719,22 +805,59 @@ static uint16_t read_blob(struct gatt_channel *channel, uint16_t handle,
 	return enc_read_blob_resp(a->data, a->len, offset, pdu, len);
 }
 
+static uint16_t read_multiple(struct gatt_channel *channel,
+					const uint16_t *handles, int num,
+					uint8_t *pdu, int len)
+{
+	struct attribute *a, *client_attr;
+	uint16_t length = 1;
+	uint8_t status;
+	int i, vlen;
+
+	for (i = 0; i < num; i++) {
+		a = db_lookup(handles[i]);
+		if (!a)
+			return enc_error_resp(ATT_OP_READ_MULTI_REQ, handles[i],
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+		status = att_check_reqs(channel, ATT_OP_READ_MULTI_REQ,
+								a->read_reqs);
+
+		client_attr = client_cfg_attribute(channel, a, a->data,
+								a->len);
+		if (client_attr)
+			a = client_attr;
+
+		if (status == 0x00 && a->read_cb)
+			status = a->read_cb(a, a->cb_user_data);
+
+		if (status)
+			return enc_error_resp(ATT_OP_READ_MULTI_REQ, handles[i],
+							status, pdu, len);
+
+		/* The response is truncated to the MTU */
+		vlen = MIN(a->len, len - length);
+		memcpy(&pdu[length], a->data, vlen);
+		length += vlen;
+	}
+
+	pdu[0] = ATT_OP_READ_MULTI_RESP;
+
+	return length;
+}
+
 static uint16_t write_value(struct gatt_channel *channel, uint16_t handle,
 						const uint8_t *value, int vlen,
 						uint8_t *pdu, int len)
 {
 	struct attribute *a, *client_attr;
 	uint8_t status;
-	GSList *l;
-	guint h = handle;
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	a = db_lookup(handle);
+	if (!a)
 		return enc_error_resp(ATT_OP_WRITE_REQ, handle,
 				ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	a = l->data;
-
 	status = att_check_reqs(channel, ATT_OP_WRITE_REQ, a->write_reqs);
 	if (status)
 		return enc_error_resp(ATT_OP_WRITE_REQ, handle, status, pdu,
@@ -763,18 +886,15 @@ static uint16_t write_value(struct gatt_channel *channel, uint16_t handle,
 static uint16_t mtu_exchange(struct gatt_channel *channel, uint16_t mtu,
 		uint8_t *pdu, int len)
 {
-	guint old_mtu = channel->mtu;
-
 	if (mtu < ATT_DEFAULT_LE_MTU)
 		channel->mtu = ATT_DEFAULT_LE_MTU;
 	else
-		channel->mtu = MIN(mtu, channel->mtu);
+		channel->mtu = MIN(mtu, channel->max_mtu);
 
-	bt_io_set(le_io, BT_IO_L2CAP, NULL,
-			BT_IO_OPT_OMTU, channel->mtu,
-			BT_IO_OPT_INVALID);
+	/* Applies to this bearer only, later PDUs use the new size */
+	g_attrib_set_mtu(channel->attrib, channel->mtu);
 
-	return enc_mtu_resp(old_mtu, pdu, len);
+	return enc_mtu_resp(channel->max_mtu, pdu, len);
 }
 
 static void channel_disconnect(void *user_data)
@@ -784,8 +904,7 @@ static void channel_disconnect(void *user_data)
 	g_attrib_unref(channel->attrib);
 	clients = g_slist_remove(clients, channel);
 
-	g_slist_free(channel->notify);
-	g_slist_free(channel->indicate);
+	channel_unsubscribe(channel);
 	g_slist_foreach(channel->configs, (GFunc) g_free, NULL);
 	g_slist_free(channel->configs);
 
@@ -797,10 +916,11 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 {
 	struct gatt_channel *channel = user_data;
 	uint8_t opdu[ATT_MAX_MTU], value[ATT_MAX_MTU];
+	uint16_t handles[ATT_MAX_MTU / 2];
 	uint16_t length, start, end, mtu, offset;
 	bt_uuid_t uuid;
 	uint8_t status = 0;
-	int vlen;
+	int vlen, num;
 
 	DBG("op 0x%02x", ipdu[0]);
 
@@ -843,6 +963,17 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 
 		length = read_blob(channel, start, offset, opdu, channel->mtu);
 		break;
+	case ATT_OP_READ_MULTI_REQ:
+		num = G_N_ELEMENTS(handles);
+		length = dec_read_multi_req(ipdu, len, handles, &num);
+		if (length == 0) {
+			status = ATT_ECODE_INVALID_PDU;
+			goto done;
+		}
+
+		length = read_multiple(channel, handles, num, opdu,
+								channel->mtu);
+		break;
 	case ATT_OP_MTU_REQ:
 		if (!channel->le) {
 			status = ATT_ECODE_REQ_NOT_SUPP;
@@ -895,7 +1026,6 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 		break;
 	case ATT_OP_HANDLE_CNF:
 		return;
-	case ATT_OP_READ_MULTI_REQ:
 	case ATT_OP_PREP_WRITE_REQ:
 	case ATT_OP_EXEC_WRITE_REQ:
 	default:
@@ -943,13 +1073,19 @@ static void connect_event(GIOChannel *io, GError *err, void *user_data)
 		return;
 	}
 
-	if (channel->mtu > ATT_MAX_MTU)
+	if (channel->mtu == 0 || channel->mtu > ATT_MAX_MTU)
 		channel->mtu = ATT_MAX_MTU;
 
-	if (cid != ATT_CID)
+	/* LE starts at the default ATT MTU, and may grow up to what the
+	 * PDU buffers take once the client exchanges MTUs */
+	if (cid != ATT_CID) {
 		channel->le = FALSE;
-	else
+		channel->max_mtu = channel->mtu;
+	} else {
 		channel->le = TRUE;
+		channel->max_mtu = ATT_MAX_MTU;
+		channel->mtu = ATT_DEFAULT_LE_MTU;
+	}
 
 	channel->attrib = g_attrib_new(io);
 	g_io_channel_unref(io);
@@ -976,42 +1112,90 @@ static void confirm_event(GIOChannel *io, void *user_data)
 	return;
 }
 
-static void attrib_notify_clients(struct attribute *attr)
+static void send_to_subscribers(GSList *channels, struct attribute *attr,
+						gboolean indication)
 {
-	guint handle = attr->handle;
+	uint8_t pdu[ATT_MAX_MTU];
+	uint16_t len = 0;
+	guint mtu = 0;
 	GSList *l;
 
-	for (l = clients; l; l = l->next) {
+	/* Channels with the same MTU share the encoded PDU */
+	for (l = channels; l; l = l->next) {
 		struct gatt_channel *channel = l->data;
 
-		/* Notification */
-		if (g_slist_find_custom(channel->notify,
-					GUINT_TO_POINTER(handle), handle_cmp)) {
-			uint8_t pdu[ATT_MAX_MTU];
-			uint16_t len;
+		if (channel->mtu != mtu) {
+			mtu = channel->mtu;
 
-			len = enc_notification(attr, pdu, channel->mtu);
-			if (len == 0)
-				continue;
+			if (indication)
+				len = enc_indication(attr, pdu, mtu);
+			else
+				len = enc_notification(attr, pdu, mtu);
+		}
+
+		if (len == 0)
+			continue;
 
-			g_attrib_send(channel->attrib, 0, pdu[0], pdu, len,
+		g_attrib_send(channel->attrib, 0, pdu[0], pdu, len,
 							NULL, NULL, NULL);
-		}
+	}
+}
 
-		/* Indication */
-		if (g_slist_find_custom(channel->indicate,
-					GUINT_TO_POINTER(handle), handle_cmp)) {
-			uint8_t pdu[ATT_MAX_MTU];
-			uint16_t len;
+static void notify_subscribers(struct attribute *attr)
+{
+	struct subscribers *subs;
 
-			len = enc_indication(attr, pdu, channel->mtu);
-			if (len == 0)
-				return;
+	subs = g_hash_table_lookup(subscribers,
+					GUINT_TO_POINTER(attr->handle));
+	if (subs == NULL)
+		return;
 
-			g_attrib_send(channel->attrib, 0, pdu[0], pdu, len,
-							NULL, NULL, NULL);
-		}
+	send_to_subscribers(subs->notify, attr, FALSE);
+	send_to_subscribers(subs->indicate, attr, TRUE);
+}
+
+static gboolean pending_notify_cb(gpointer user_data)
+{
+	GSList *l;
+
+	for (l = pending_notify; l; l = l->next) {
+		struct attribute *a = db_lookup(GPOINTER_TO_UINT(l->data));
+
+		/* Only the latest value is sent */
+		if (a)
+			notify_subscribers(a);
+	}
+
+	g_slist_free(pending_notify);
+	pending_notify = NULL;
+	pending_notify_id = 0;
+
+	return FALSE;
+}
+
+static void attrib_notify_clients(struct attribute *attr)
+{
+	gpointer key = GUINT_TO_POINTER(attr->handle);
+
+	/* Database updates may happen without the server running */
+	if (subscribers == NULL)
+		return;
+
+	if (main_opts.attrib_notify_interval == 0) {
+		notify_subscribers(attr);
+		return;
 	}
+
+	if (!g_hash_table_lookup(subscribers, key))
+		return;
+
+	if (!g_slist_find(pending_notify, key))
+		pending_notify = g_slist_append(pending_notify, key);
+
+	if (pending_notify_id == 0)
+		pending_notify_id = g_timeout_add(
+					main_opts.attrib_notify_interval,
+					pending_notify_cb, NULL);
 }
 
 static gboolean register_core_services(void)
@@ -1082,6 +1266,9 @@ int attrib_server_init(void)
 {
 	GError *gerr = NULL;
 
+	subscribers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, subscribers_free);
+
 	/* BR/EDR socket */
 	l2cap_io = bt_io_listen(BT_IO_L2CAP, NULL, confirm_event,
 					NULL, NULL, &gerr,
@@ -1128,12 +1315,24 @@ failed:
 	return -1;
 }
 
+static void attribute_free(struct attribute *a)
+{
+	btd_memstat_sub(MEMSTAT_GATT_DATABASE, sizeof(*a) + a->len);
+
+	g_free(a);
+}
+
 void attrib_server_exit(void)
 {
 	GSList *l;
 
-	g_slist_foreach(database, (GFunc) g_free, NULL);
-	g_slist_free(database);
+	if (database) {
+		g_ptr_array_foreach(database, (GFunc) attribute_free, NULL);
+		g_ptr_array_free(database, TRUE);
+		g_ptr_array_free(services, TRUE);
+		g_ptr_array_free(characteristics, TRUE);
+		database = services = characteristics = NULL;
+	}
 
 	if (l2cap_io) {
 		g_io_channel_unref(l2cap_io);
@@ -1145,6 +1344,14 @@ void attrib_server_exit(void)
 		g_io_channel_shutdown(le_io, FALSE, NULL);
 	}
 
+	if (pending_notify_id) {
+		g_source_remove(pending_notify_id);
+		pending_notify_id = 0;
+	}
+
+	g_slist_free(pending_notify);
+	pending_notify = NULL;
+
 	for (l = clients; l; l = l->next) {
 		struct gatt_channel *channel = l->data;
 
@@ -1159,6 +1366,11 @@ void attrib_server_exit(void)
 
 	g_slist_free(clients);
 
+	if (subscribers) {
+		g_hash_table_destroy(subscribers);
+		subscribers = NULL;
+	}
+
 	if (gatt_sdp_handle)
 		remove_record_from_server(gatt_sdp_handle);
 
@@ -1214,26 +1426,34 @@ void attrib_free_sdp(uint32_t sdp_handle)
 
 uint16_t attrib_db_find_avail(uint16_t nitems)
 {
+	struct attribute *a, *last;
 	uint16_t handle;
-	GSList *l;
+	guint i, pos;
 
 	g_assert(nitems > 0);
 
-	for (l = database, handle = 0; l; l = l->next) {
-		struct attribute *a = l->data;
+	/* Only the gaps in front of a service can be used */
+	for (i = 0; (a = index_get(services, i)); i++) {
+		pos = index_lower_bound(database, a->handle);
+		if (pos == 0)
+			continue;
+
+		last = index_get(database, pos - 1);
+		handle = last->handle + 1;
 
-		if (handle && (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0) &&
-				a->handle - handle >= nitems)
+		if (a->handle - handle >= nitems)
 			/* Note: the range above excludes the current handle */
 			return handle;
-
-		if (a->handle == 0xffff)
-			return 0;
-
-		handle = a->handle + 1;
 	}
 
+	last = database ? index_get(database, database->len - 1) : NULL;
+	if (last == NULL)
+		handle = 0;
+	else if (last->handle == 0xffff)
+		return 0;
+	else
+		handle = last->handle + 1;
+
 	if (0xffff - handle + 1 >= nitems)
 		return handle;
 
@@ -1244,14 +1464,16 @@ struct attribute *attrib_db_add(uint16_t handle, bt_uuid_t *uuid, int read_reqs,
 				int write_reqs, const uint8_t *value, int len)
 {
 	struct attribute *a;
-	guint h = handle;
+	GPtrArray *attrs;
 
 	DBG("handle=0x%04x", handle);
 
-	if (g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp))
+	if (db_lookup(handle))
 		return NULL;
 
 	a = g_malloc0(sizeof(struct attribute) + len);
+	btd_memstat_add(MEMSTAT_GATT_DATABASE, sizeof(struct attribute) + len);
+
 	a->handle = handle;
 	memcpy(&a->uuid, uuid, sizeof(bt_uuid_t));
 	a->read_reqs = read_reqs;
@@ -1259,7 +1481,17 @@ struct attribute *attrib_db_add(uint16_t handle, bt_uuid_t *uuid, int read_reqs,
 	a->len = len;
 	memcpy(a->data, value, len);
 
-	database = g_slist_insert_sorted(database, a, attribute_cmp);
+	if (database == NULL) {
+		database = g_ptr_array_new();
+		services = g_ptr_array_new();
+		characteristics = g_ptr_array_new();
+	}
+
+	index_insert(database, a);
+
+	attrs = type_index(&a->uuid);
+	if (attrs)
+		index_insert(attrs, a);
 
 	return a;
 }
@@ -1267,26 +1499,45 @@ struct attribute *attrib_db_add(uint16_t handle, bt_uuid_t *uuid, int read_reqs,
 int attrib_db_update(uint16_t handle, bt_uuid_t *uuid, const uint8_t *value,
 					int len, struct attribute **attr)
 {
-	struct attribute *a;
-	GSList *l;
-	guint h = handle;
+	struct attribute *a, *old;
+	GPtrArray *attrs;
+	guint i;
 
 	DBG("handle=0x%04x", handle);
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	i = index_lower_bound(database, handle);
+	old = index_get(database, i);
+	if (old == NULL || old->handle != handle)
 		return -ENOENT;
 
-	a = g_try_realloc(l->data, sizeof(struct attribute) + len);
-	if (a == NULL)
+	/* The block may move, drop it from the declaration index first */
+	attrs = type_index(&old->uuid);
+	if (attrs)
+		index_remove(attrs, handle);
+
+	btd_memstat_sub(MEMSTAT_GATT_DATABASE, sizeof(*old) + old->len);
+
+	a = g_try_realloc(old, sizeof(struct attribute) + len);
+	if (a == NULL) {
+		btd_memstat_add(MEMSTAT_GATT_DATABASE,
+					sizeof(*old) + old->len);
+		if (attrs)
+			index_insert(attrs, old);
 		return -ENOMEM;
+	}
+
+	btd_memstat_add(MEMSTAT_GATT_DATABASE, sizeof(struct attribute) + len);
 
-	l->data = a;
+	database->pdata[i] = a;
 	if (uuid != NULL)
 		memcpy(&a->uuid, uuid, sizeof(bt_uuid_t));
 	a->len = len;
 	memcpy(a->data, value, len);
 
+	attrs = type_index(&a->uuid);
+	if (attrs)
+		index_insert(attrs, a);
+
 	attrib_notify_clients(a);
 
 	if (attr)
@@ -1298,18 +1549,22 @@ int attrib_db_update(uint16_t handle, bt_uuid_t *uuid, const uint8_t *value,
 int attrib_db_del(uint16_t handle)
 {
 	struct attribute *a;
-	GSList *l;
-	guint h = handle;
+	GPtrArray *attrs;
+	guint i;
 
 	DBG("handle=0x%04x", handle);
 
-	l = g_slist_find_custom(database, GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
+	i = index_lower_bound(database, handle);
+	a = index_get(database, i);
+	if (a == NULL || a->handle != handle)
 		return -ENOENT;
 
-	a = l->data;
-	database = g_slist_remove(database, a);
-	g_free(a);
+	attrs = type_index(&a->uuid);
+	if (attrs)
+		index_remove(attrs, handle);
+
+	g_ptr_array_remove_index(database, i);
+	attribute_free(a);
 
 	return 0;
 }
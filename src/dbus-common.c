@@ -42,6 +42,7 @@
 
 #include "log.h"
 
+#include "hcid.h"
 #include "adapter.h"
 #include "manager.h"
 #include "event.h"
@@ -49,6 +50,21 @@
 
 static DBusConnection *connection = NULL;
 
+struct pending_prop {
+	char *name;
+	DBusMessage *value;		/* Carries the value as a variant */
+};
+
+struct pending_object {
+	DBusConnection *conn;
+	char *path;
+	char *interface;
+	GSList *props;			/* In the order of the first change */
+};
+
+static GSList *pending_objects = NULL;
+static guint pending_id = 0;
+
 static void append_variant(DBusMessageIter *iter, int type, void *val)
 {
 	DBusMessageIter value;
@@ -179,6 +195,258 @@ dbus_bool_t emit_array_property_changed(DBusConnection *conn,
 	return g_dbus_send_message(conn, signal);
 }
 
+static void append_iter(DBusMessageIter *dst, DBusMessageIter *src)
+{
+	int type;
+
+	while ((type = dbus_message_iter_get_arg_type(src)) !=
+							DBUS_TYPE_INVALID) {
+		DBusMessageIter sub_src, sub_dst;
+		char *sig, *full = NULL;
+
+		if (dbus_type_is_basic(type)) {
+			union {
+				dbus_uint64_t u64;
+				double dbl;
+				const char *str;
+			} value;
+
+			dbus_message_iter_get_basic(src, &value);
+			dbus_message_iter_append_basic(dst, type, &value);
+			dbus_message_iter_next(src);
+			continue;
+		}
+
+		dbus_message_iter_recurse(src, &sub_src);
+
+		switch (type) {
+		case DBUS_TYPE_ARRAY:
+			full = dbus_message_iter_get_signature(src);
+			sig = full + 1;
+			break;
+		case DBUS_TYPE_VARIANT:
+			full = dbus_message_iter_get_signature(&sub_src);
+			sig = full;
+			break;
+		default:
+			sig = NULL;
+			break;
+		}
+
+		dbus_message_iter_open_container(dst, type, sig, &sub_dst);
+		append_iter(&sub_dst, &sub_src);
+		dbus_message_iter_close_container(dst, &sub_dst);
+
+		dbus_free(full);
+
+		dbus_message_iter_next(src);
+	}
+}
+
+static void append_pending_value(DBusMessageIter *iter,
+						struct pending_prop *prop)
+{
+	DBusMessageIter value;
+
+	dbus_message_iter_init(prop->value, &value);
+	append_iter(iter, &value);
+}
+
+static void pending_prop_free(gpointer data, gpointer user_data)
+{
+	struct pending_prop *prop = data;
+
+	dbus_message_unref(prop->value);
+	g_free(prop->name);
+	g_free(prop);
+}
+
+static void send_pending_object(struct pending_object *obj)
+{
+	DBusMessage *signal;
+	DBusMessageIter iter, dict;
+	GSList *l;
+
+	if (main_opts.property_compat) {
+		for (l = obj->props; l; l = l->next) {
+			struct pending_prop *prop = l->data;
+
+			signal = dbus_message_new_signal(obj->path,
+						obj->interface,
+						"PropertyChanged");
+			if (!signal)
+				break;
+
+			dbus_message_iter_init_append(signal, &iter);
+			dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING,
+								&prop->name);
+			append_pending_value(&iter, prop);
+
+			g_dbus_send_message(obj->conn, signal);
+		}
+
+		return;
+	}
+
+	signal = dbus_message_new_signal(obj->path, obj->interface,
+						"PropertiesChanged");
+	if (!signal) {
+		error("Unable to allocate new %s.PropertiesChanged signal",
+				obj->interface);
+		return;
+	}
+
+	dbus_message_iter_init_append(signal, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	for (l = obj->props; l; l = l->next) {
+		struct pending_prop *prop = l->data;
+		DBusMessageIter entry;
+
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+								NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+								&prop->name);
+		append_pending_value(&entry, prop);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	g_dbus_send_message(obj->conn, signal);
+}
+
+static void pending_object_free(struct pending_object *obj)
+{
+	g_slist_foreach(obj->props, pending_prop_free, NULL);
+	g_slist_free(obj->props);
+	dbus_connection_unref(obj->conn);
+	g_free(obj->path);
+	g_free(obj->interface);
+	g_free(obj);
+}
+
+static gboolean send_pending_properties(gpointer user_data)
+{
+	GSList *objects = g_slist_reverse(pending_objects);
+
+	pending_objects = NULL;
+	pending_id = 0;
+
+	while (objects) {
+		struct pending_object *obj = objects->data;
+
+		send_pending_object(obj);
+		pending_object_free(obj);
+
+		objects = g_slist_delete_link(objects, objects);
+	}
+
+	return FALSE;
+}
+
+static struct pending_prop *pending_prop_get(DBusConnection *conn,
+						const char *path,
+						const char *interface,
+						const char *name)
+{
+	struct pending_object *obj = NULL;
+	struct pending_prop *prop;
+	GSList *l;
+
+	for (l = pending_objects; l; l = l->next) {
+		obj = l->data;
+
+		if (obj->conn == conn && g_str_equal(obj->path, path) &&
+				g_str_equal(obj->interface, interface))
+			break;
+	}
+
+	if (l == NULL) {
+		obj = g_new0(struct pending_object, 1);
+		obj->conn = dbus_connection_ref(conn);
+		obj->path = g_strdup(path);
+		obj->interface = g_strdup(interface);
+		pending_objects = g_slist_prepend(pending_objects, obj);
+	}
+
+	for (l = obj->props; l; l = l->next) {
+		prop = l->data;
+
+		if (g_str_equal(prop->name, name)) {
+			dbus_message_unref(prop->value);
+			return prop;
+		}
+	}
+
+	prop = g_new0(struct pending_prop, 1);
+	prop->name = g_strdup(name);
+	obj->props = g_slist_append(obj->props, prop);
+
+	if (pending_id == 0)
+		pending_id = g_idle_add(send_pending_properties, NULL);
+
+	return prop;
+}
+
+void queue_property_changed(DBusConnection *conn, const char *path,
+					const char *interface,
+					const char *name,
+					int type, void *value)
+{
+	struct pending_prop *prop;
+	DBusMessageIter iter;
+
+	prop = pending_prop_get(conn, path, interface, name);
+
+	prop->value = dbus_message_new(DBUS_MESSAGE_TYPE_SIGNAL);
+	dbus_message_iter_init_append(prop->value, &iter);
+	append_variant(&iter, type, value);
+}
+
+void queue_array_property_changed(DBusConnection *conn, const char *path,
+					const char *interface,
+					const char *name,
+					int type, void *value, int num)
+{
+	struct pending_prop *prop;
+	DBusMessageIter iter;
+
+	prop = pending_prop_get(conn, path, interface, name);
+
+	prop->value = dbus_message_new(DBUS_MESSAGE_TYPE_SIGNAL);
+	dbus_message_iter_init_append(prop->value, &iter);
+	append_array_variant(&iter, type, value, num);
+}
+
+void flush_property_changed(const char *path)
+{
+	GSList *l, *next;
+
+	for (l = pending_objects; l; l = next) {
+		struct pending_object *obj = l->data;
+
+		next = l->next;
+
+		if (!g_str_equal(obj->path, path))
+			continue;
+
+		pending_objects = g_slist_delete_link(pending_objects, l);
+
+		send_pending_object(obj);
+		pending_object_free(obj);
+	}
+
+	if (pending_objects == NULL && pending_id > 0) {
+		g_source_remove(pending_id);
+		pending_id = 0;
+	}
+}
+
 void set_dbus_connection(DBusConnection *conn)
 {
 	connection = conn;
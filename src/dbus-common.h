@@ -41,6 +41,21 @@ dbus_bool_t emit_array_property_changed(DBusConnection *conn,
 					const char *name,
 					int type, void *value, int num);
 
+/* Queued until the main loop is idle, then the changes of each object go
+ * out together and only the last value of a property is sent */
+void queue_property_changed(DBusConnection *conn, const char *path,
+					const char *interface,
+					const char *name,
+					int type, void *value);
+
+void queue_array_property_changed(DBusConnection *conn, const char *path,
+					const char *interface,
+					const char *name,
+					int type, void *value, int num);
+
+/* Sends what is queued for the object right away */
+void flush_property_changed(const char *path);
+
 void set_dbus_connection(DBusConnection *conn);
 DBusConnection *get_dbus_connection(void);
 
@@ -58,6 +58,7 @@
 #include "gatt.h"
 #include "agent.h"
 #include "sdp-xml.h"
+#include "eir.h"
 #include "storage.h"
 #include "btio.h"
 #include "../attrib/client.h"
@@ -101,6 +102,7 @@ struct browse_req {
 	sdp_list_t *records;
 	int search_uuid;
 	int reconnect_attempt;
+	gboolean found_pnp;
 	guint listener_id;
 };
 
@@ -128,6 +130,7 @@ struct btd_device {
 	gboolean	connected;
 
 	sdp_list_t	*tmp_records;
+	GHashTable	*xml_records;		/* handle -> struct xml_record */
 
 	gboolean	trusted;
 	gboolean	paired;
@@ -135,6 +138,7 @@ struct btd_device {
 	gboolean	bonded;
 
 	gboolean	authorizing;
+	struct btd_device_driver *reconnect_driver;	/* Paging driver */
 	gint		ref;
 };
 
@@ -147,6 +151,14 @@ static uint16_t uuid_list[] = {
 
 static GSList *device_drivers = NULL;
 
+/* 128 bit UUID -> struct driver_uuid list, in driver registration order */
+static GHashTable *driver_index = NULL;
+
+struct driver_uuid {
+	struct btd_device_driver *driver;
+	uint128_t uuid;
+};
+
 static void browse_request_free(struct browse_req *req)
 {
 	if (req->listener_id)
@@ -212,6 +224,9 @@ static void device_free(gpointer user_data)
 		sdp_list_free(device->tmp_records,
 					(sdp_free_func_t) sdp_record_free);
 
+	if (device->xml_records)
+		g_hash_table_destroy(device->xml_records);
+
 	if (device->disconn_timer)
 		g_source_remove(device->disconn_timer);
 
@@ -374,7 +389,7 @@ static DBusMessage *set_alias(DBusConnection *conn, DBusMessage *msg,
 	g_free(device->alias);
 	device->alias = g_str_equal(alias, "") ? NULL : g_strdup(alias);
 
-	emit_property_changed(conn, dbus_message_get_path(msg),
+	queue_property_changed(conn, dbus_message_get_path(msg),
 				DEVICE_INTERFACE, "Alias",
 				DBUS_TYPE_STRING, &alias);
 
@@ -403,7 +418,7 @@ static DBusMessage *set_trust(DBusConnection *conn, DBusMessage *msg,
 
 	device->trusted = value;
 
-	emit_property_changed(conn, dbus_message_get_path(msg),
+	queue_property_changed(conn, dbus_message_get_path(msg),
 				DEVICE_INTERFACE, "Trusted",
 				DBUS_TYPE_BOOLEAN, &value);
 
@@ -456,7 +471,7 @@ static int device_block(DBusConnection *conn, struct btd_device *device)
 
 	device_set_temporary(device, FALSE);
 
-	emit_property_changed(conn, device->path, DEVICE_INTERFACE, "Blocked",
+	queue_property_changed(conn, device->path, DEVICE_INTERFACE, "Blocked",
 					DBUS_TYPE_BOOLEAN, &device->blocked);
 
 	return 0;
@@ -484,7 +499,7 @@ static int device_unblock(DBusConnection *conn, struct btd_device *device,
 		error("write_blocked(): %s (%d)", strerror(-err), -err);
 
 	if (!silent) {
-		emit_property_changed(conn, device->path,
+		queue_property_changed(conn, device->path,
 					DEVICE_INTERFACE, "Blocked",
 					DBUS_TYPE_BOOLEAN, &device->blocked);
 		device_probe_drivers(device, device->uuids);
@@ -632,6 +647,94 @@ static void iter_append_record(DBusMessageIter *dict, uint32_t handle,
 	dbus_message_iter_close_container(dict, &entry);
 }
 
+/* XML rendering of a record as last sent by DiscoverServices, reused as
+ * long as a new browse brings back the same record bytes */
+struct xml_record {
+	uint8_t *pdu;
+	uint32_t len;
+	char *xml;
+};
+
+static void xml_record_free(gpointer data)
+{
+	struct xml_record *xr = data;
+
+	g_free(xr->pdu);
+	g_free(xr->xml);
+	g_free(xr);
+}
+
+static gboolean xml_record_stale(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	uint32_t handle = GPOINTER_TO_UINT(key);
+	sdp_list_t *seq;
+
+	for (seq = user_data; seq; seq = seq->next) {
+		sdp_record_t *rec = seq->data;
+
+		if (rec->handle == handle)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Drops the renderings of records the device no longer has */
+static void xml_records_prune(struct btd_device *device)
+{
+	if (device->xml_records == NULL)
+		return;
+
+	g_hash_table_foreach_remove(device->xml_records, xml_record_stale,
+							device->tmp_records);
+}
+
+static const char *record_to_xml(struct btd_device *device,
+							sdp_record_t *rec)
+{
+	/* Rendering happens in one pass into a buffer that is kept around,
+	 * so only the final string gets allocated */
+	static GString *buf = NULL;
+	struct xml_record *xr = NULL;
+	const uint8_t *pdu;
+	uint32_t len;
+
+	if (sdp_get_record_pdu(rec, &pdu, &len) < 0)
+		len = 0;
+
+	if (len > 0 && device->xml_records)
+		xr = g_hash_table_lookup(device->xml_records,
+					GUINT_TO_POINTER(rec->handle));
+
+	if (xr && xr->len == len && memcmp(xr->pdu, pdu, len) == 0)
+		return xr->xml;
+
+	if (buf == NULL)
+		buf = g_string_sized_new(4096);
+	else
+		g_string_truncate(buf, 0);
+
+	convert_sdp_record_to_xml(rec, buf, (void *) g_string_append);
+
+	if (len == 0 || buf->len == 0)
+		return buf->str;
+
+	if (device->xml_records == NULL)
+		device->xml_records = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, xml_record_free);
+
+	xr = g_new0(struct xml_record, 1);
+	xr->pdu = g_memdup(pdu, len);
+	xr->len = len;
+	xr->xml = g_strndup(buf->str, buf->len);
+
+	g_hash_table_replace(device->xml_records,
+				GUINT_TO_POINTER(rec->handle), xr);
+
+	return xr->xml;
+}
+
 static void discover_services_reply(struct browse_req *req, int err,
 							sdp_list_t *recs)
 {
@@ -666,20 +769,14 @@ static void discover_services_reply(struct browse_req *req, int err,
 
 	for (seq = recs; seq; seq = seq->next) {
 		sdp_record_t *rec = (sdp_record_t *) seq->data;
-		GString *result;
+		const char *xml;
 
 		if (!rec)
 			break;
 
-		result = g_string_new(NULL);
-
-		convert_sdp_record_to_xml(rec, result,
-				(void *) g_string_append);
-
-		if (result->len)
-			iter_append_record(&dict, rec->handle, result->str);
-
-		g_string_free(result, TRUE);
+		xml = record_to_xml(req->device, rec);
+		if (*xml != '\0')
+			iter_append_record(&dict, rec->handle, xml);
 	}
 
 	dbus_message_iter_close_container(&iter, &dict);
@@ -857,6 +954,7 @@ static GDBusMethodTable device_methods[] = {
 
 static GDBusSignalTable device_signals[] = {
 	{ "PropertyChanged",		"sv"	},
+	{ "PropertiesChanged",		"a{sv}"	},
 	{ "DisconnectRequested",	""	},
 	{ }
 };
@@ -877,7 +975,7 @@ void device_add_connection(struct btd_device *device, DBusConnection *conn)
 
 	device->connected = TRUE;
 
-	emit_property_changed(conn, device->path,
+	queue_property_changed(conn, device->path,
 					DEVICE_INTERFACE, "Connected",
 					DBUS_TYPE_BOOLEAN, &device->connected);
 }
@@ -908,7 +1006,7 @@ void device_remove_connection(struct btd_device *device, DBusConnection *conn)
 	if (device_is_paired(device) && !device->bonded)
 		device_set_paired(device, FALSE);
 
-	emit_property_changed(conn, device->path,
+	queue_property_changed(conn, device->path,
 					DEVICE_INTERFACE, "Connected",
 					DBUS_TYPE_BOOLEAN, &device->connected);
 }
@@ -1007,14 +1105,14 @@ void device_set_name(struct btd_device *device, const char *name)
 
 	strncpy(device->name, name, MAX_NAME_LENGTH);
 
-	emit_property_changed(conn, device->path,
+	queue_property_changed(conn, device->path,
 				DEVICE_INTERFACE, "Name",
 				DBUS_TYPE_STRING, &name);
 
 	if (device->alias != NULL)
 		return;
 
-	emit_property_changed(conn, device->path,
+	queue_property_changed(conn, device->path,
 				DEVICE_INTERFACE, "Alias",
 				DBUS_TYPE_STRING, &name);
 }
@@ -1031,19 +1129,12 @@ device_type_t device_get_type(struct btd_device *device)
 
 void device_remove_bonding(struct btd_device *device)
 {
-	char filename[PATH_MAX + 1];
-	char srcaddr[18], dstaddr[18];
 	bdaddr_t bdaddr;
 
 	adapter_get_address(device->adapter, &bdaddr);
-	ba2str(&bdaddr, srcaddr);
-	ba2str(&device->bdaddr, dstaddr);
-
-	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr,
-			"linkkeys");
 
 	/* Delete the link key from storage */
-	textfile_casedel(filename, dstaddr);
+	delete_link_key(&bdaddr, &device->bdaddr);
 	device_set_bonded(device, FALSE);
 
 	btd_adapter_remove_bonding(device->adapter, &device->bdaddr);
@@ -1066,6 +1157,7 @@ static void device_remove_stored(struct btd_device *device)
 	delete_entry(&src, "primary", addr);
 	delete_all_records(&src, &device->bdaddr);
 	delete_device_service(&src, &device->bdaddr);
+	delete_device_gatt_cache(&src, &device->bdaddr);
 
 	if (device->blocked)
 		device_unblock(conn, device, TRUE);
@@ -1112,90 +1204,140 @@ void device_remove(struct btd_device *device, gboolean remove_stored)
 
 gint device_address_cmp(struct btd_device *device, const gchar *address)
 {
-	char addr[18];
+	bdaddr_t bdaddr;
 
-	ba2str(&device->bdaddr, addr);
-	return strcasecmp(addr, address);
+	if (str2ba(address, &bdaddr) < 0)
+		return -1;
+
+	return bacmp(&device->bdaddr, &bdaddr);
 }
 
-static gboolean record_has_uuid(const sdp_record_t *rec,
-				const char *profile_uuid)
+/* The record pattern holds 128-bit UUIDs, so uuid must be extended */
+static gboolean record_has_uuid(const sdp_record_t *rec, const uuid_t *uuid)
 {
 	sdp_list_t *pat;
 
 	for (pat = rec->pattern; pat != NULL; pat = pat->next) {
-		char *uuid;
-		int ret;
+		if (sdp_uuid128_cmp(pat->data, uuid) == 0)
+			return TRUE;
+	}
 
-		uuid = bt_uuid2string(pat->data);
-		if (!uuid)
-			continue;
+	return FALSE;
+}
 
-		ret = strcasecmp(uuid, profile_uuid);
+static guint uuid128_hash(gconstpointer key)
+{
+	const uint8_t *ptr = key;
+	guint h = 2166136261u;
+	int i;
 
-		g_free(uuid);
+	for (i = 0; i < 16; i++)
+		h = (h ^ ptr[i]) * 16777619u;
 
-		if (ret == 0)
-			return TRUE;
-	}
+	return h;
+}
 
-	return FALSE;
+static gboolean uuid128_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, sizeof(uint128_t)) == 0;
 }
 
-static GSList *device_match_pattern(struct btd_device *device,
-					const char *match_uuid,
-					GSList *profiles)
+static int string2uuid128(const char *str, uint128_t *uuid128)
 {
-	GSList *l, *uuids = NULL;
+	uuid_t uuid;
 
-	for (l = profiles; l; l = l->next) {
-		char *profile_uuid = l->data;
-		const sdp_record_t *rec;
+	if (bt_string2uuid(&uuid, str) < 0)
+		return -EINVAL;
 
-		rec = btd_device_get_record(device, profile_uuid);
-		if (!rec)
-			continue;
+	sdp_uuid_extend(&uuid);
+	memcpy(uuid128, &uuid.value.uuid128, sizeof(*uuid128));
 
-		if (record_has_uuid(rec, match_uuid))
-			uuids = g_slist_append(uuids, profile_uuid);
-	}
+	return 0;
+}
+
+static void match_add(GHashTable *matches, struct btd_device_driver *driver,
+								char *profile)
+{
+	GSList *uuids = g_hash_table_lookup(matches, driver);
+
+	if (g_slist_find(uuids, profile))
+		return;
 
-	return uuids;
+	g_hash_table_insert(matches, driver, g_slist_append(uuids, profile));
 }
 
-static GSList *device_match_driver(struct btd_device *device,
-					struct btd_device_driver *driver,
-					GSList *profiles)
+/*
+ * Returns the profiles to probe each driver with. Drivers match the
+ * profiles they list, and through the service records the profiles whose
+ * records mention one of their other UUIDs (pattern drivers).
+ */
+static GHashTable *device_match_drivers(struct btd_device *device,
+							GSList *profiles)
 {
-	const char **uuid;
-	GSList *uuids = NULL;
+	GHashTable *matches;
+	GSList *l, *e, *exact = NULL;
+	uint128_t uuid;
 
-	for (uuid = driver->uuids; *uuid; uuid++) {
-		GSList *match;
+	matches = g_hash_table_new(NULL, NULL);
 
-		/* skip duplicated uuids */
-		if (g_slist_find_custom(uuids, *uuid,
-				(GCompareFunc) strcasecmp))
-			continue;
+	if (driver_index == NULL)
+		return matches;
 
-		/* match profile driver */
-		match = g_slist_find_custom(profiles, *uuid,
-					(GCompareFunc) strcasecmp);
-		if (match) {
-			uuids = g_slist_append(uuids, match->data);
+	for (l = profiles; l; l = l->next) {
+		if (string2uuid128(l->data, &uuid) < 0)
 			continue;
+
+		e = g_hash_table_lookup(driver_index, &uuid);
+		for (; e; e = e->next) {
+			struct driver_uuid *entry = e->data;
+
+			match_add(matches, entry->driver, l->data);
+			exact = g_slist_prepend(exact, entry);
 		}
+	}
+
+	for (l = profiles; l; l = l->next) {
+		const sdp_record_t *rec;
+		sdp_list_t *pat;
 
-		/* match pattern driver */
-		match = device_match_pattern(device, *uuid, profiles);
-		uuids = g_slist_concat(uuids, match);
+		rec = btd_device_get_record(device, l->data);
+		if (!rec)
+			continue;
+
+		/* The record pattern holds 128-bit UUIDs */
+		for (pat = rec->pattern; pat != NULL; pat = pat->next) {
+			uuid_t *pat_uuid = pat->data;
+
+			if (pat_uuid->type != SDP_UUID128)
+				continue;
+
+			e = g_hash_table_lookup(driver_index,
+						&pat_uuid->value.uuid128);
+			for (; e; e = e->next) {
+				struct driver_uuid *entry = e->data;
+
+				/* Matched as a profile already */
+				if (g_slist_find(exact, entry))
+					continue;
+
+				match_add(matches, entry->driver, l->data);
+			}
+		}
 	}
 
-	return uuids;
+	g_slist_free(exact);
+
+	return matches;
+}
+
+static void free_match(gpointer key, gpointer value, gpointer user_data)
+{
+	g_slist_free(value);
 }
 
 void device_probe_drivers(struct btd_device *device, GSList *profiles)
 {
+	GHashTable *matches;
 	GSList *list;
 	char addr[18];
 	int err;
@@ -1209,12 +1351,13 @@ void device_probe_drivers(struct btd_device *device, GSList *profiles)
 
 	DBG("Probing drivers for %s", addr);
 
+	matches = device_match_drivers(device, profiles);
+
 	for (list = device_drivers; list; list = list->next) {
 		struct btd_device_driver *driver = list->data;
 		GSList *probe_uuids;
 
-		probe_uuids = device_match_driver(device, driver, profiles);
-
+		probe_uuids = g_hash_table_lookup(matches, driver);
 		if (!probe_uuids)
 			continue;
 
@@ -1222,14 +1365,15 @@ void device_probe_drivers(struct btd_device *device, GSList *profiles)
 		if (err < 0) {
 			error("%s driver probe failed for device %s",
 							driver->name, addr);
-			g_slist_free(probe_uuids);
 			continue;
 		}
 
 		device->drivers = g_slist_append(device->drivers, driver);
-		g_slist_free(probe_uuids);
 	}
 
+	g_hash_table_foreach(matches, free_match, NULL);
+	g_hash_table_destroy(matches);
+
 add_uuids:
 	for (list = profiles; list; list = list->next) {
 		GSList *l = g_slist_find_custom(device->uuids, list->data,
@@ -1243,6 +1387,59 @@ add_uuids:
 	}
 }
 
+/* Starts the first profile able to reconnect, which pages the device; the
+ * others follow from device_reconnect_profiles once the link is up */
+int device_reconnect(struct btd_device *device)
+{
+	GSList *l;
+	char addr[18];
+	int err = -ENOENT;
+
+	ba2str(&device->bdaddr, addr);
+
+	for (l = device->drivers; l; l = l->next) {
+		struct btd_device_driver *driver = l->data;
+
+		if (driver->reconnect == NULL)
+			continue;
+
+		err = driver->reconnect(device);
+		if (err < 0) {
+			DBG("%s driver reconnect to %s failed: %s (%d)",
+				driver->name, addr, strerror(-err), -err);
+			continue;
+		}
+
+		DBG("%s driver reconnecting %s", driver->name, addr);
+		device->reconnect_driver = driver;
+
+		return 0;
+	}
+
+	return err;
+}
+
+void device_reconnect_profiles(struct btd_device *device)
+{
+	GSList *l;
+	int err;
+
+	for (l = device->drivers; l; l = l->next) {
+		struct btd_device_driver *driver = l->data;
+
+		if (driver->reconnect == NULL ||
+					driver == device->reconnect_driver)
+			continue;
+
+		err = driver->reconnect(device);
+		if (err < 0)
+			DBG("%s driver reconnect failed: %s (%d)",
+					driver->name, strerror(-err), -err);
+	}
+
+	device->reconnect_driver = NULL;
+}
+
 static void device_remove_drivers(struct btd_device *device, GSList *uuids)
 {
 	struct btd_adapter *adapter = device_get_adapter(device);
@@ -1311,7 +1508,7 @@ static void services_changed(struct btd_device *device)
 	for (i = 0, l = device->uuids; l; l = l->next, i++)
 		uuids[i] = l->data;
 
-	emit_array_property_changed(conn, device->path, DEVICE_INTERFACE,
+	queue_array_property_changed(conn, device->path, DEVICE_INTERFACE,
 					"UUIDs", DBUS_TYPE_STRING, &uuids, i);
 
 	g_free(uuids);
@@ -1381,6 +1578,8 @@ static void update_services(struct browse_req *req, sdp_list_t *recs)
 			if (source || vendor || product || version)
 				store_device_id(srcaddr, dstaddr, source,
 						vendor, product, version);
+
+			req->found_pnp = TRUE;
 		}
 
 		/* Check for duplicates */
@@ -1448,11 +1647,10 @@ static void create_device_reply(struct btd_device *device, struct browse_req *re
 GSList *device_services_from_record(struct btd_device *device, GSList *profiles)
 {
 	GSList *l, *prim_list = NULL;
-	char *att_uuid;
 	uuid_t proto_uuid;
 
 	sdp_uuid16_create(&proto_uuid, ATT_UUID);
-	att_uuid = bt_uuid2string(&proto_uuid);
+	sdp_uuid_extend(&proto_uuid);
 
 	for (l = profiles; l; l = l->next) {
 		const char *profile_uuid = l->data;
@@ -1465,7 +1663,7 @@ GSList *device_services_from_record(struct btd_device *device, GSList *profiles)
 		if (!rec)
 			continue;
 
-		if (!record_has_uuid(rec, att_uuid))
+		if (!record_has_uuid(rec, &proto_uuid))
 			continue;
 
 		if (!gatt_parse_record(rec, &prim_uuid, &psm, &start, &end))
@@ -1479,11 +1677,156 @@ GSList *device_services_from_record(struct btd_device *device, GSList *profiles)
 		prim_list = g_slist_append(prim_list, prim);
 	}
 
-	g_free(att_uuid);
-
 	return prim_list;
 }
 
+/* The SDP server record is not part of the public browse group, so it is
+ * fetched and stored on its own. Its ServiceDatabaseState changes
+ * whenever any of the remote records does, which lets a new bonding
+ * with a known device skip the full browse when nothing changed */
+static uint32_t record_db_state(const sdp_record_t *rec)
+{
+	sdp_data_t *d;
+
+	if (!rec)
+		return 0;
+
+	d = sdp_data_get(rec, SDP_ATTR_SVCDB_STATE);
+	if (!d || d->dtd != SDP_UINT32)
+		return 0;
+
+	return d->val.uint32;
+}
+
+static uint32_t stored_db_state(struct btd_device *device)
+{
+	sdp_list_t *recs;
+	bdaddr_t src;
+	uint32_t state;
+
+	adapter_get_address(device->adapter, &src);
+
+	recs = read_records(&src, &device->bdaddr);
+	if (!recs)
+		return 0;
+
+	state = record_db_state(find_record_in_list(recs, SDP_SERVER_UUID));
+
+	sdp_list_free(recs, (sdp_free_func_t) sdp_record_free);
+
+	return state;
+}
+
+static void store_server_record(struct btd_device *device, sdp_list_t *recs)
+{
+	char srcaddr[18], dstaddr[18];
+	bdaddr_t src;
+
+	if (!recs || record_db_state(recs->data) == 0)
+		return;
+
+	adapter_get_address(device->adapter, &src);
+	ba2str(&src, srcaddr);
+	ba2str(&device->bdaddr, dstaddr);
+
+	store_record(srcaddr, dstaddr, recs->data);
+}
+
+static void server_record_cb(sdp_list_t *recs, int err, gpointer user_data)
+{
+	struct btd_device *device = user_data;
+
+	if (err == 0)
+		store_server_record(device, recs);
+
+	btd_device_unref(device);
+}
+
+static void validate_cb(sdp_list_t *recs, int err, gpointer user_data)
+{
+	struct btd_device *device = user_data;
+	uint32_t state = 0;
+
+	if (err == 0 && recs)
+		state = record_db_state(recs->data);
+
+	if (state != 0 && state == stored_db_state(device)) {
+		DBG("%s: service database unchanged", device->path);
+		goto done;
+	}
+
+	DBG("%s: service database changed, refreshing", device->path);
+
+	if (err == 0)
+		store_server_record(device, recs);
+
+	if (!device->browse)
+		device_browse_sdp(device, NULL, NULL, NULL, FALSE);
+
+done:
+	btd_device_unref(device);
+}
+
+static int search_server_record(struct btd_device *device, bt_callback_t cb)
+{
+	bdaddr_t src;
+	uuid_t uuid;
+	int err;
+
+	adapter_get_address(device->adapter, &src);
+	sdp_uuid16_create(&uuid, SDP_SERVER_SVCLASS_ID);
+
+	err = bt_search_service(&src, &device->bdaddr, &uuid, cb,
+					btd_device_ref(device), NULL);
+	if (err < 0)
+		btd_device_unref(device);
+
+	return err;
+}
+
+static gboolean eir_uuids_known(struct btd_device *device)
+{
+	struct remote_dev_info match, *dev;
+	gboolean known = TRUE;
+	char **uuids;
+	int i;
+
+	memset(&match, 0, sizeof(struct remote_dev_info));
+	bacpy(&match.bdaddr, &device->bdaddr);
+	match.name_status = NAME_ANY;
+
+	dev = adapter_search_found_devices(device->adapter, &match);
+	if (!dev || !dev->services)
+		return TRUE;
+
+	uuids = eir_uuids_to_strv(dev->services);
+	for (i = 0; uuids[i]; i++) {
+		if (!g_slist_find_custom(device->uuids, uuids[i],
+						(GCompareFunc) strcasecmp)) {
+			known = FALSE;
+			break;
+		}
+	}
+
+	g_strfreev(uuids);
+
+	return known;
+}
+
+static gboolean device_reuse_services(struct btd_device *device)
+{
+	if (!device->uuids || device->browse)
+		return FALSE;
+
+	if (stored_db_state(device) == 0)
+		return FALSE;
+
+	if (!eir_uuids_known(device))
+		return FALSE;
+
+	return search_server_record(device, validate_cb) == 0;
+}
+
 static void search_cb(sdp_list_t *recs, int err, gpointer user_data)
 {
 	struct browse_req *req = user_data;
@@ -1507,6 +1850,8 @@ static void search_cb(sdp_list_t *recs, int err, gpointer user_data)
 	device->tmp_records = req->records;
 	req->records = NULL;
 
+	xml_records_prune(device);
+
 	if (!req->profiles_added && !req->profiles_removed) {
 		DBG("%s: No service update", addr);
 		goto send_reply;
@@ -1565,6 +1910,10 @@ cleanup:
 		write_device_type(&sba, &dba, device->type);
 	}
 
+	/* Remember the service database state for the next bonding */
+	if (err == 0 && !device->temporary && device->uuids)
+		search_server_record(device, server_record_cb);
+
 	device->browse = NULL;
 	browse_request_free(req);
 }
@@ -1589,6 +1938,15 @@ static void browse_cb(sdp_list_t *recs, int err, gpointer user_data)
 
 	update_services(req, recs);
 
+	/* The Device ID record usually lists L2CAP too, in which case it
+	 * came with the previous search and the PNP search would only cost
+	 * another transaction */
+	if (uuid_list[req->search_uuid] == PNP_INFO_SVCLASS_ID &&
+							req->found_pnp) {
+		search_cb(NULL, 0, user_data);
+		return;
+	}
+
 	adapter_get_address(adapter, &src);
 
 	/* Search for mandatory uuids */
@@ -1714,6 +2072,7 @@ static void gatt_connect_cb(GIOChannel *io, GError *gerr, gpointer user_data)
 	req->attrib = g_attrib_new(io);
 	g_io_channel_unref(io);
 
+	gatt_exchange_max_mtu(req->attrib);
 	gatt_discover_primary(req->attrib, NULL, primary_cb, req);
 }
 
@@ -2004,7 +2363,7 @@ void device_set_paired(struct btd_device *device, gboolean value)
 
 	device->paired = value;
 
-	emit_property_changed(conn, device->path, DEVICE_INTERFACE, "Paired",
+	queue_property_changed(conn, device->path, DEVICE_INTERFACE, "Paired",
 				DBUS_TYPE_BOOLEAN, &value);
 }
 
@@ -2083,29 +2442,19 @@ DBusMessage *device_create_bonding(struct btd_device *device,
 					const char *agent_path,
 					uint8_t capability)
 {
-	char filename[PATH_MAX + 1];
-	char *str, srcaddr[18], dstaddr[18];
 	struct btd_adapter *adapter = device->adapter;
 	struct bonding_req *bonding;
 	bdaddr_t src;
 	int err;
 
 	adapter_get_address(adapter, &src);
-	ba2str(&src, srcaddr);
-	ba2str(&device->bdaddr, dstaddr);
 
 	if (device->bonding)
 		return btd_error_in_progress(msg);
 
 	/* check if a link key already exists */
-	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr,
-			"linkkeys");
-
-	str = textfile_caseget(filename, dstaddr);
-	if (str) {
-		free(str);
+	if (read_link_key(&src, &device->bdaddr, NULL, NULL) == 0)
 		return btd_error_already_exists(msg);
-	}
 
 	err = adapter_create_bonding(adapter, &device->bdaddr, capability);
 	if (err < 0)
@@ -2187,8 +2536,24 @@ void device_bonding_complete(struct btd_device *device, uint8_t status)
 			device->discov_timer = 0;
 		}
 
-		device_browse_sdp(device, bonding->conn, bonding->msg,
-				NULL, FALSE);
+		/* Known devices whose service database did not change keep
+		 * their stored services, so reply right away and validate
+		 * them in the background */
+		if (device_reuse_services(device)) {
+			DBusMessage *reply;
+
+			DBG("Reusing stored services");
+
+			reply = dbus_message_new_method_return(bonding->msg);
+			if (reply) {
+				dbus_message_append_args(reply,
+					DBUS_TYPE_OBJECT_PATH, &device->path,
+					DBUS_TYPE_INVALID);
+				g_dbus_send_message(bonding->conn, reply);
+			}
+		} else
+			device_browse_sdp(device, bonding->conn, bonding->msg,
+								NULL, FALSE);
 
 		bonding_request_free(bonding);
 	} else {
@@ -2519,6 +2884,47 @@ const sdp_record_t *btd_device_get_record(struct btd_device *device,
 
 int btd_register_device_driver(struct btd_device_driver *driver)
 {
+	const char **str;
+
+	if (driver_index == NULL)
+		driver_index = g_hash_table_new_full(uuid128_hash,
+						uuid128_equal, g_free, NULL);
+
+	for (str = driver->uuids; *str; str++) {
+		struct driver_uuid *entry;
+		uint128_t uuid;
+		GSList *l, *entries;
+
+		if (string2uuid128(*str, &uuid) < 0) {
+			error("%s driver has an invalid UUID %s",
+							driver->name, *str);
+			continue;
+		}
+
+		entries = g_hash_table_lookup(driver_index, &uuid);
+
+		/* skip duplicated uuids */
+		for (l = entries; l; l = l->next) {
+			entry = l->data;
+			if (entry->driver == driver)
+				break;
+		}
+
+		if (l)
+			continue;
+
+		entry = g_new0(struct driver_uuid, 1);
+		entry->driver = driver;
+		entry->uuid = uuid;
+
+		if (entries)
+			g_slist_append(entries, entry);
+		else
+			g_hash_table_insert(driver_index,
+					g_memdup(&uuid, sizeof(uuid)),
+					g_slist_append(NULL, entry));
+	}
+
 	device_drivers = g_slist_append(device_drivers, driver);
 
 	return 0;
@@ -2526,7 +2932,39 @@ int btd_register_device_driver(struct btd_device_driver *driver)
 
 void btd_unregister_device_driver(struct btd_device_driver *driver)
 {
+	const char **str;
+
 	device_drivers = g_slist_remove(device_drivers, driver);
+
+	if (driver_index == NULL)
+		return;
+
+	for (str = driver->uuids; *str; str++) {
+		GSList *l, *entries;
+		uint128_t uuid;
+
+		if (string2uuid128(*str, &uuid) < 0)
+			continue;
+
+		entries = g_hash_table_lookup(driver_index, &uuid);
+
+		for (l = entries; l; l = l->next) {
+			struct driver_uuid *entry = l->data;
+
+			if (entry->driver != driver)
+				continue;
+
+			entries = g_slist_delete_link(entries, l);
+			g_free(entry);
+			break;
+		}
+
+		if (entries)
+			g_hash_table_insert(driver_index,
+					g_memdup(&uuid, sizeof(uuid)), entries);
+		else
+			g_hash_table_remove(driver_index, &uuid);
+	}
 }
 
 struct btd_device *btd_device_ref(struct btd_device *device)
@@ -2561,6 +2999,6 @@ void device_set_class(struct btd_device *device, uint32_t value)
 {
 	DBusConnection *conn = get_dbus_connection();
 
-	emit_property_changed(conn, device->path, DEVICE_INTERFACE, "Class",
+	queue_property_changed(conn, device->path, DEVICE_INTERFACE, "Class",
 				DBUS_TYPE_UINT32, &value);
 }
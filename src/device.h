@@ -94,6 +94,8 @@ void device_set_authorizing(struct btd_device *device, gboolean auth);
 void device_add_connection(struct btd_device *device, DBusConnection *conn);
 void device_remove_connection(struct btd_device *device, DBusConnection *conn);
 void device_request_disconnect(struct btd_device *device, DBusMessage *msg);
+int device_reconnect(struct btd_device *device);
+void device_reconnect_profiles(struct btd_device *device);
 
 typedef void (*disconnect_watch) (struct btd_device *device, gboolean removal,
 					void *user_data);
@@ -111,6 +113,7 @@ struct btd_device_driver {
 	const char **uuids;
 	int (*probe) (struct btd_device *device, GSList *uuids);
 	void (*remove) (struct btd_device *device);
+	int (*reconnect) (struct btd_device *device);
 };
 
 int btd_register_device_driver(struct btd_device_driver *driver);
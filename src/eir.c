@@ -24,11 +24,13 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <glib.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
 
 #include "glib-helper.h"
 #include "eir.h"
@@ -45,28 +47,84 @@
 #define EIR_TX_POWER                0x0A  /* transmit power level */
 #define EIR_DEVICE_ID               0x10  /* device ID */
 
-void eir_data_free(struct eir_data *eir)
+/* Bytes 4 to 15 of the Bluetooth base UUID, big endian */
+static const uint8_t base_uuid[12] = {
+	0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0x80,
+	0x5f, 0x9b, 0x34, 0xfb
+};
+
+static inline uint64_t short_bit(uint32_t val)
+{
+	return (uint64_t) 1 << ((val * 0x9e3779b1u) >> 26);
+}
+
+static inline uint64_t long_bit(const uint8_t *val)
+{
+	uint32_t h = 0;
+	int k;
+
+	for (k = 0; k < 16; k++)
+		h = h * 31 + val[k];
+
+	return short_bit(h);
+}
+
+static void add_short(struct eir_uuids *uuids, uint32_t val)
+{
+	uint64_t bit = short_bit(val);
+	int i;
+
+	if (uuids->filter & bit) {
+		for (i = 0; i < uuids->short_count; i++)
+			if (uuids->short_uuids[i] == val)
+				return;
+	}
+
+	if (uuids->short_count == EIR_MAX_SHORT_UUIDS)
+		return;
+
+	uuids->short_uuids[uuids->short_count++] = val;
+	uuids->filter |= bit;
+}
+
+static void add_long(struct eir_uuids *uuids, const uint8_t *val)
 {
-	g_slist_foreach(eir->services, (GFunc) g_free, NULL);
-	g_slist_free(eir->services);
-	g_free(eir->name);
+	uint64_t bit;
+	int i;
+
+	if (memcmp(val + 4, base_uuid, sizeof(base_uuid)) == 0) {
+		add_short(uuids, (uint32_t) val[0] << 24 | val[1] << 16 |
+							val[2] << 8 | val[3]);
+		return;
+	}
+
+	bit = long_bit(val);
+
+	if (uuids->filter & bit) {
+		for (i = 0; i < uuids->long_count; i++)
+			if (memcmp(uuids->long_uuids[i], val, 16) == 0)
+				return;
+	}
+
+	if (uuids->long_count == EIR_MAX_LONG_UUIDS)
+		return;
+
+	memcpy(uuids->long_uuids[uuids->long_count++], val, 16);
+	uuids->filter |= bit;
 }
 
 int eir_parse(struct eir_data *eir, uint8_t *eir_data)
 {
 	uint16_t len = 0;
-	size_t total;
-	size_t uuid16_count = 0;
-	size_t uuid32_count = 0;
-	size_t uuid128_count = 0;
-	uint8_t *uuid16 = NULL;
-	uint8_t *uuid32 = NULL;
-	uint8_t *uuid128 = NULL;
-	uuid_t service;
-	char *uuid_str;
-	unsigned int i;
+	uint8_t val[16];
+	int i, k;
 
 	eir->flags = -1;
+	eir->name[0] = '\0';
+	eir->name_complete = FALSE;
+	eir->services.filter = 0;
+	eir->services.short_count = 0;
+	eir->services.long_count = 0;
 
 	/* No EIR data to parse */
 	if (eir_data == NULL)
@@ -74,38 +132,52 @@ int eir_parse(struct eir_data *eir, uint8_t *eir_data)
 
 	while (len < HCI_MAX_EIR_LENGTH - 1) {
 		uint8_t field_len = eir_data[0];
+		uint8_t *field = &eir_data[2];
 
 		/* Check for the end of EIR */
 		if (field_len == 0)
 			break;
 
+		/* Bail out if got incorrect length */
+		if (len + field_len + 1 > HCI_MAX_EIR_LENGTH)
+			return -EINVAL;
+
+		/* EIR data is Little Endian */
 		switch (eir_data[1]) {
 		case EIR_UUID16_SOME:
 		case EIR_UUID16_ALL:
-			uuid16_count = field_len / 2;
-			uuid16 = &eir_data[2];
+			for (i = 0; i + 2 < field_len; i += 2)
+				add_short(&eir->services,
+						field[i] | field[i + 1] << 8);
 			break;
 		case EIR_UUID32_SOME:
 		case EIR_UUID32_ALL:
-			uuid32_count = field_len / 4;
-			uuid32 = &eir_data[2];
+			for (i = 0; i + 4 < field_len; i += 4)
+				add_short(&eir->services, field[i] |
+						field[i + 1] << 8 |
+						field[i + 2] << 16 |
+						(uint32_t) field[i + 3] << 24);
 			break;
 		case EIR_UUID128_SOME:
 		case EIR_UUID128_ALL:
-			uuid128_count = field_len / 16;
-			uuid128 = &eir_data[2];
+			for (i = 0; i + 16 < field_len; i += 16) {
+				for (k = 0; k < 16; k++)
+					val[k] = field[i + 16 - k - 1];
+
+				add_long(&eir->services, val);
+			}
 			break;
 		case EIR_FLAGS:
-			eir->flags = eir_data[2];
+			eir->flags = field[0];
 			break;
 		case EIR_NAME_SHORT:
 		case EIR_NAME_COMPLETE:
-			if (g_utf8_validate((char *) &eir_data[2],
-							field_len - 1, NULL))
-				eir->name = g_strndup((char *) &eir_data[2],
-								field_len - 1);
-			else
-				eir->name = g_strdup("");
+			if (g_utf8_validate((char *) field, field_len - 1,
+									NULL)) {
+				memcpy(eir->name, field, field_len - 1);
+				eir->name[field_len - 1] = '\0';
+			} else
+				eir->name[0] = '\0';
 			eir->name_complete = eir_data[1] == EIR_NAME_COMPLETE;
 			break;
 		}
@@ -114,55 +186,93 @@ int eir_parse(struct eir_data *eir, uint8_t *eir_data)
 		eir_data += field_len + 1;
 	}
 
-	/* Bail out if got incorrect length */
-	if (len > HCI_MAX_EIR_LENGTH)
-		return -EINVAL;
+	return 0;
+}
 
-	total = uuid16_count + uuid32_count + uuid128_count;
+unsigned int eir_uuids_merge(struct eir_uuids *dst,
+					const struct eir_uuids *src)
+{
+	unsigned int count = eir_uuids_count(dst);
+	int i;
 
-	/* No UUIDs were parsed, so skip code below */
-	if (!total)
-		return 0;
+	for (i = 0; i < src->short_count; i++)
+		add_short(dst, src->short_uuids[i]);
+
+	for (i = 0; i < src->long_count; i++)
+		add_long(dst, src->long_uuids[i]);
 
-	/* Generate uuids in SDP format (EIR data is Little Endian) */
-	service.type = SDP_UUID16;
-	for (i = 0; i < uuid16_count; i++) {
-		uint16_t val16 = uuid16[1];
+	return eir_uuids_count(dst) - count;
+}
 
-		val16 = (val16 << 8) + uuid16[0];
-		service.value.uuid16 = val16;
-		uuid_str = bt_uuid2string(&service);
-		eir->services = g_slist_append(eir->services, uuid_str);
-		uuid16 += 2;
+unsigned int eir_uuids_count(const struct eir_uuids *uuids)
+{
+	return uuids->short_count + uuids->long_count;
+}
+
+void eir_uuids_add(struct eir_uuids *uuids, const uuid_t *uuid)
+{
+	switch (uuid->type) {
+	case SDP_UUID16:
+		add_short(uuids, uuid->value.uuid16);
+		break;
+	case SDP_UUID32:
+		add_short(uuids, uuid->value.uuid32);
+		break;
+	case SDP_UUID128:
+		add_long(uuids, (const uint8_t *) &uuid->value.uuid128);
+		break;
 	}
+}
 
-	service.type = SDP_UUID32;
-	for (i = uuid16_count; i < uuid32_count + uuid16_count; i++) {
-		uint32_t val32 = uuid32[3];
-		int k;
+gboolean eir_uuids_match(const struct eir_uuids *uuids,
+					const struct eir_uuids *wanted)
+{
+	int i, j;
 
-		for (k = 2; k >= 0; k--)
-			val32 = (val32 << 8) + uuid32[k];
+	if ((uuids->filter & wanted->filter) == 0)
+		return FALSE;
 
-		service.value.uuid32 = val32;
-		uuid_str = bt_uuid2string(&service);
-		eir->services = g_slist_append(eir->services, uuid_str);
-		uuid32 += 4;
+	for (i = 0; i < wanted->short_count; i++) {
+		if (!(uuids->filter & short_bit(wanted->short_uuids[i])))
+			continue;
+
+		for (j = 0; j < uuids->short_count; j++)
+			if (uuids->short_uuids[j] == wanted->short_uuids[i])
+				return TRUE;
+	}
+
+	for (i = 0; i < wanted->long_count; i++) {
+		if (!(uuids->filter & long_bit(wanted->long_uuids[i])))
+			continue;
+
+		for (j = 0; j < uuids->long_count; j++)
+			if (memcmp(uuids->long_uuids[j],
+					wanted->long_uuids[i], 16) == 0)
+				return TRUE;
 	}
 
-	service.type = SDP_UUID128;
-	for (i = uuid32_count + uuid16_count; i < total; i++) {
-		int k;
+	return FALSE;
+}
+
+char **eir_uuids_to_strv(const struct eir_uuids *uuids)
+{
+	char **strv;
+	uuid_t uuid;
+	int i, n = 0;
 
-		for (k = 0; k < 16; k++)
-			service.value.uuid128.data[k] = uuid128[16 - k - 1];
+	strv = g_new0(char *, eir_uuids_count(uuids) + 1);
 
-		uuid_str = bt_uuid2string(&service);
-		eir->services = g_slist_append(eir->services, uuid_str);
-		uuid128 += 16;
+	for (i = 0; i < uuids->short_count; i++) {
+		sdp_uuid32_create(&uuid, uuids->short_uuids[i]);
+		strv[n++] = bt_uuid2string(&uuid);
 	}
 
-	return 0;
+	for (i = 0; i < uuids->long_count; i++) {
+		sdp_uuid128_create(&uuid, uuids->long_uuids[i]);
+		strv[n++] = bt_uuid2string(&uuid);
+	}
+
+	return strv;
 }
 
 #define SIZEOF_UUID128 16
@@ -27,15 +27,43 @@ struct uuid_info {
 	uint8_t svc_hint;
 };
 
+/* As many UUIDs as a single EIR block can carry */
+#define EIR_MAX_SHORT_UUIDS	(HCI_MAX_EIR_LENGTH / 2)
+#define EIR_MAX_LONG_UUIDS	(HCI_MAX_EIR_LENGTH / 16)
+
+/* Service UUIDs in binary form. 16 and 32 bit UUIDs, and 128 bit ones on
+ * top of the Bluetooth base UUID, are kept as 32 bit values; the others
+ * in big endian byte order. The filter has a bit set for the hash of
+ * every UUID present and saves most of the comparisons on lookups. */
+struct eir_uuids {
+	uint64_t filter;
+	uint8_t short_count;
+	uint8_t long_count;
+	uint32_t short_uuids[EIR_MAX_SHORT_UUIDS];
+	uint8_t long_uuids[EIR_MAX_LONG_UUIDS][16];
+};
+
 struct eir_data {
-	GSList *services;
+	struct eir_uuids services;
 	int flags;
-	char *name;
+	char name[HCI_MAX_EIR_LENGTH];	/* empty if not present */
 	gboolean name_complete;
 };
 
-void eir_data_free(struct eir_data *eir);
 int eir_parse(struct eir_data *eir, uint8_t *eir_data);
+
+/* Adds the UUIDs of src missing from dst, returns how many were added */
+unsigned int eir_uuids_merge(struct eir_uuids *dst,
+					const struct eir_uuids *src);
+unsigned int eir_uuids_count(const struct eir_uuids *uuids);
+void eir_uuids_add(struct eir_uuids *uuids, const uuid_t *uuid);
+
+/* TRUE if the sets have at least one UUID in common */
+gboolean eir_uuids_match(const struct eir_uuids *uuids,
+					const struct eir_uuids *wanted);
+
+/* Returns a newly allocated string vector of the UUIDs as 128 bit strings */
+char **eir_uuids_to_strv(const struct eir_uuids *uuids);
 void eir_create(const char *name, int8_t tx_power, uint16_t did_vendor,
 			uint16_t did_product, uint16_t did_version,
 			GSList *uuids, uint8_t *data);
@@ -293,17 +293,6 @@ void btd_event_simple_pairing_complete(bdaddr_t *local, bdaddr_t *peer,
 	device_simple_pairing_complete(device, status);
 }
 
-static void update_lastseen(bdaddr_t *sba, bdaddr_t *dba)
-{
-	time_t t;
-	struct tm *tm;
-
-	t = time(NULL);
-	tm = gmtime(&t);
-
-	write_lastseen_info(sba, dba, tm);
-}
-
 static void update_lastused(bdaddr_t *sba, bdaddr_t *dba)
 {
 	time_t t;
@@ -315,10 +304,18 @@ static void update_lastused(bdaddr_t *sba, bdaddr_t *dba)
 	write_lastused_info(sba, dba, tm);
 }
 
-void btd_event_device_found(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
-				int8_t rssi, uint8_t *data)
+/* The adapter lookup and the timestamp are done once for all the
+ * responses of an event */
+void btd_event_devices_found(bdaddr_t *local, struct btd_found_info *found,
+								int count)
 {
 	struct btd_adapter *adapter;
+	struct tm *tm;
+	time_t t;
+	int i;
+
+	if (count == 0)
+		return;
 
 	adapter = manager_find_adapter(local);
 	if (!adapter) {
@@ -326,13 +323,34 @@ void btd_event_device_found(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
 		return;
 	}
 
-	update_lastseen(local, peer);
-	write_remote_class(local, peer, class);
+	t = time(NULL);
+	tm = gmtime(&t);
+
+	for (i = 0; i < count; i++) {
+		write_lastseen_info(local, found[i].bdaddr, tm);
+		write_remote_class(local, found[i].bdaddr, found[i].class);
+
+		if (found[i].data)
+			write_remote_eir(local, found[i].bdaddr,
+							found[i].data);
+
+		adapter_update_found_devices(adapter, found[i].bdaddr,
+					found[i].class, found[i].rssi,
+					found[i].data);
+	}
+}
+
+void btd_event_device_found(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
+				int8_t rssi, uint8_t *data)
+{
+	struct btd_found_info found;
 
-	if (data)
-		write_remote_eir(local, peer, data);
+	found.bdaddr = peer;
+	found.class = class;
+	found.rssi = rssi;
+	found.data = data;
 
-	adapter_update_found_devices(adapter, peer, class, rssi, data);
+	btd_event_devices_found(local, &found, 1);
 }
 
 void btd_event_set_legacy_pairing(bdaddr_t *local, bdaddr_t *peer,
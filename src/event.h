@@ -25,6 +25,18 @@
 int btd_event_request_pin(bdaddr_t *sba, bdaddr_t *dba);
 void btd_event_device_found(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
 						int8_t rssi, uint8_t *data);
+
+/* One of the responses of a multi-response inquiry result or advertising
+ * report, pointing into the event buffer */
+struct btd_found_info {
+	bdaddr_t *bdaddr;
+	uint32_t class;
+	int8_t rssi;
+	uint8_t *data;
+};
+
+void btd_event_devices_found(bdaddr_t *local, struct btd_found_info *found,
+								int count);
 void btd_event_set_legacy_pairing(bdaddr_t *local, bdaddr_t *peer, gboolean legacy);
 void btd_event_remote_class(bdaddr_t *local, bdaddr_t *peer, uint32_t class);
 void btd_event_remote_name(bdaddr_t *local, bdaddr_t *peer, uint8_t status, char *name);
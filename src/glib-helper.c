@@ -87,7 +87,11 @@ static sdp_session_t *get_sdp_session(const bdaddr_t *src, const bdaddr_t *dst)
 		return session;
 	}
 
-	return sdp_connect(src, dst, SDP_NON_BLOCKING);
+	/* Search results are only borrowed by the callbacks, so the records
+	 * can live in one arena each, and most users look at a handful of
+	 * attributes only */
+	return sdp_connect(src, dst, SDP_NON_BLOCKING | SDP_ARENA_RECORDS |
+							SDP_LAZY_RECORDS);
 }
 
 static void cache_sdp_session(bdaddr_t *src, bdaddr_t *dst,
@@ -118,24 +122,72 @@ struct search_context {
 	gpointer		user_data;
 	uuid_t			uuid;
 	guint			io_id;
+	gboolean		queued;
+	sdp_list_t		*recs;
 };
 
+/* Pending and ongoing searches, the ones queued behind another search to
+ * the same device take over its session once it completes */
 static GSList *context_list = NULL;
 
+static struct search_context *find_active_search(const bdaddr_t *src,
+							const bdaddr_t *dst)
+{
+	GSList *l;
+
+	for (l = context_list; l != NULL; l = l->next) {
+		struct search_context *ctxt = l->data;
+
+		if (ctxt->session == NULL)
+			continue;
+
+		if (!bacmp(&ctxt->src, src) && !bacmp(&ctxt->dst, dst))
+			return ctxt;
+	}
+
+	return NULL;
+}
+
+static struct search_context *next_queued_search(const bdaddr_t *src,
+							const bdaddr_t *dst)
+{
+	GSList *l;
+
+	for (l = context_list; l != NULL; l = l->next) {
+		struct search_context *ctxt = l->data;
+
+		if (!ctxt->queued)
+			continue;
+
+		if (!bacmp(&ctxt->src, src) && !bacmp(&ctxt->dst, dst))
+			return ctxt;
+	}
+
+	return NULL;
+}
+
 static void search_context_cleanup(struct search_context *ctxt)
 {
 	context_list = g_slist_remove(context_list, ctxt);
 
+	if (ctxt->recs)
+		sdp_list_free(ctxt->recs, (sdp_free_func_t) sdp_record_free);
+
 	if (ctxt->destroy)
 		ctxt->destroy(ctxt->user_data);
 
 	g_free(ctxt);
 }
 
+static void resume_queued_search(const bdaddr_t *src, const bdaddr_t *dst,
+						sdp_session_t *session);
+
 static void search_completed_cb(uint8_t type, uint16_t status,
 			uint8_t *rsp, size_t size, void *user_data)
 {
 	struct search_context *ctxt = user_data;
+	sdp_session_t *session;
+	bdaddr_t src, dst;
 	sdp_list_t *recs = NULL;
 	int scanned, seqlen = 0, bytesleft = size;
 	uint8_t dataType;
@@ -146,6 +198,11 @@ static void search_completed_cb(uint8_t type, uint16_t status,
 		goto done;
 	}
 
+	/* Records that were complete before the last fragment, the rest
+	 * of the response normally is empty */
+	recs = ctxt->recs;
+	ctxt->recs = NULL;
+
 	scanned = sdp_extract_seqtype(rsp, bytesleft, &dataType, &seqlen);
 	if (!scanned || !seqlen)
 		goto done;
@@ -157,7 +214,8 @@ static void search_completed_cb(uint8_t type, uint16_t status,
 		int recsize;
 
 		recsize = 0;
-		rec = sdp_extract_pdu(rsp, bytesleft, &recsize);
+		rec = sdp_session_extract_pdu(ctxt->session, rsp, bytesleft,
+								&recsize);
 		if (!rec)
 			break;
 
@@ -174,21 +232,36 @@ static void search_completed_cb(uint8_t type, uint16_t status,
 	} while (scanned < (ssize_t) size && bytesleft > 0);
 
 done:
-	cache_sdp_session(&ctxt->src, &ctxt->dst, ctxt->session);
-
+	/* Searches started from the callback queue up behind this one and
+	 * get its session afterwards */
 	if (ctxt->cb)
 		ctxt->cb(recs, err, ctxt->user_data);
 
 	if (recs)
 		sdp_list_free(recs, (sdp_free_func_t) sdp_record_free);
 
+	bacpy(&src, &ctxt->src);
+	bacpy(&dst, &ctxt->dst);
+	session = ctxt->session;
+	ctxt->session = NULL;
+
 	search_context_cleanup(ctxt);
+
+	resume_queued_search(&src, &dst, session);
+}
+
+static void search_record_cb(sdp_record_t *rec, void *user_data)
+{
+	struct search_context *ctxt = user_data;
+
+	ctxt->recs = sdp_list_append(ctxt->recs, rec);
 }
 
 static gboolean search_process_cb(GIOChannel *chan, GIOCondition cond,
 							gpointer user_data)
 {
 	struct search_context *ctxt = user_data;
+	bdaddr_t src, dst;
 	int err = 0;
 
 	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
@@ -206,21 +279,58 @@ failed:
 		sdp_close(ctxt->session);
 		ctxt->session = NULL;
 
+		bacpy(&src, &ctxt->src);
+		bacpy(&dst, &ctxt->dst);
+
 		if (ctxt->cb)
 			ctxt->cb(NULL, err, ctxt->user_data);
 
 		search_context_cleanup(ctxt);
+
+		resume_queued_search(&src, &dst, NULL);
 	}
 
 	return FALSE;
 }
 
+static int start_search(struct search_context *ctxt)
+{
+	sdp_list_t *search, *attrids;
+	uint32_t range = 0x0000ffff;
+	GIOChannel *chan;
+	int err;
+
+	if (sdp_set_notify(ctxt->session, search_completed_cb, ctxt) < 0)
+		return -EIO;
+
+	if (sdp_set_record_notify(ctxt->session, search_record_cb, ctxt) < 0)
+		return -EIO;
+
+	search = sdp_list_append(NULL, &ctxt->uuid);
+	attrids = sdp_list_append(NULL, &range);
+	err = sdp_service_search_attr_async(ctxt->session,
+				search, SDP_ATTR_REQ_RANGE, attrids);
+	sdp_list_free(attrids, NULL);
+	sdp_list_free(search, NULL);
+
+	if (err < 0)
+		return -EIO;
+
+	/* Set callback responsible for update the internal SDP transaction */
+	chan = g_io_channel_unix_new(sdp_get_socket(ctxt->session));
+	ctxt->io_id = g_io_add_watch(chan,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				search_process_cb, ctxt);
+	g_io_channel_unref(chan);
+
+	return 0;
+}
+
 static gboolean connect_watch(GIOChannel *chan, GIOCondition cond,
 							gpointer user_data)
 {
 	struct search_context *ctxt = user_data;
-	sdp_list_t *search, *attrids;
-	uint32_t range = 0x0000ffff;
+	bdaddr_t src, dst;
 	socklen_t len;
 	int sk, err = 0;
 
@@ -236,73 +346,113 @@ static gboolean connect_watch(GIOChannel *chan, GIOCondition cond,
 	if (err != 0)
 		goto failed;
 
-	if (sdp_set_notify(ctxt->session, search_completed_cb, ctxt) < 0) {
-		err = EIO;
-		goto failed;
-	}
-
-	search = sdp_list_append(NULL, &ctxt->uuid);
-	attrids = sdp_list_append(NULL, &range);
-	if (sdp_service_search_attr_async(ctxt->session,
-				search, SDP_ATTR_REQ_RANGE, attrids) < 0) {
-		sdp_list_free(attrids, NULL);
-		sdp_list_free(search, NULL);
-		err = EIO;
-		goto failed;
-	}
-
-	sdp_list_free(attrids, NULL);
-	sdp_list_free(search, NULL);
-
-	/* Set callback responsible for update the internal SDP transaction */
-	ctxt->io_id = g_io_add_watch(chan,
-				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				search_process_cb, ctxt);
-	return FALSE;
+	err = -start_search(ctxt);
+	if (err == 0)
+		return FALSE;
 
 failed:
 	sdp_close(ctxt->session);
 	ctxt->session = NULL;
 
+	bacpy(&src, &ctxt->src);
+	bacpy(&dst, &ctxt->dst);
+
 	if (ctxt->cb)
 		ctxt->cb(NULL, -err, ctxt->user_data);
 
 	search_context_cleanup(ctxt);
 
+	resume_queued_search(&src, &dst, NULL);
+
 	return FALSE;
 }
 
+static int connect_search(struct search_context *ctxt)
+{
+	GIOChannel *chan;
+
+	ctxt->session = get_sdp_session(&ctxt->src, &ctxt->dst);
+	if (!ctxt->session)
+		return -errno;
+
+	chan = g_io_channel_unix_new(sdp_get_socket(ctxt->session));
+	ctxt->io_id = g_io_add_watch(chan,
+				G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				connect_watch, ctxt);
+	g_io_channel_unref(chan);
+
+	return 0;
+}
+
+/*
+ * Hands the session of a finished search to the next one queued for the
+ * same device, or puts it into the cache if there is none. Without a
+ * session, as after errors, the next search connects on its own.
+ */
+static void resume_queued_search(const bdaddr_t *src, const bdaddr_t *dst,
+						sdp_session_t *session)
+{
+	struct search_context *ctxt;
+	int err;
+
+	while ((ctxt = next_queued_search(src, dst)) != NULL) {
+		ctxt->queued = FALSE;
+
+		if (session) {
+			ctxt->session = session;
+			err = start_search(ctxt);
+		} else
+			err = connect_search(ctxt);
+
+		if (err == 0)
+			return;
+
+		if (ctxt->session)
+			sdp_close(ctxt->session);
+		ctxt->session = NULL;
+		session = NULL;
+
+		if (ctxt->cb)
+			ctxt->cb(NULL, err, ctxt->user_data);
+
+		search_context_cleanup(ctxt);
+	}
+
+	if (session)
+		cache_sdp_session((bdaddr_t *) src, (bdaddr_t *) dst, session);
+}
+
 static int create_search_context(struct search_context **ctxt,
 					const bdaddr_t *src,
 					const bdaddr_t *dst,
 					uuid_t *uuid)
 {
-	sdp_session_t *s;
-	GIOChannel *chan;
+	int err;
 
 	if (!ctxt)
 		return -EINVAL;
 
-	s = get_sdp_session(src, dst);
-	if (!s)
-		return -errno;
-
 	*ctxt = g_try_malloc0(sizeof(struct search_context));
-	if (!*ctxt) {
-		sdp_close(s);
+	if (!*ctxt)
 		return -ENOMEM;
-	}
 
 	bacpy(&(*ctxt)->src, src);
 	bacpy(&(*ctxt)->dst, dst);
-	(*ctxt)->session = s;
 	(*ctxt)->uuid = *uuid;
 
-	chan = g_io_channel_unix_new(sdp_get_socket(s));
-	(*ctxt)->io_id = g_io_add_watch(chan,
-				G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				connect_watch, *ctxt);
-	g_io_channel_unref(chan);
+	/* Wait for the ongoing search instead of opening another L2CAP
+	 * channel to the same device */
+	if (find_active_search(src, dst)) {
+		(*ctxt)->queued = TRUE;
+		return 0;
+	}
+
+	err = connect_search(*ctxt);
+	if (err < 0) {
+		g_free(*ctxt);
+		*ctxt = NULL;
+		return err;
+	}
 
 	return 0;
 }
@@ -354,6 +504,11 @@ int bt_cancel_discovery(const bdaddr_t *src, const bdaddr_t *dst)
 
 	ctxt = l->data;
 
+	if (ctxt->queued) {
+		search_context_cleanup(ctxt);
+		return 0;
+	}
+
 	if (!ctxt->session)
 		return -ENOTCONN;
 
@@ -365,6 +520,8 @@ int bt_cancel_discovery(const bdaddr_t *src, const bdaddr_t *dst)
 
 	search_context_cleanup(ctxt);
 
+	resume_queued_search(src, dst, NULL);
+
 	return 0;
 }
 
@@ -585,3 +742,16 @@ GSList *bt_string2list(const gchar *str)
 
 	return l;
 }
+
+/* Hash and equality functions for GHashTables keyed by bdaddr_t */
+guint bt_bdaddr_hash(gconstpointer key)
+{
+	uint64_t k = bt_bdaddr_key(key);
+
+	return (guint) (k ^ (k >> 32));
+}
+
+gboolean bt_bdaddr_equal(gconstpointer a, gconstpointer b)
+{
+	return bt_bdaddr_key(a) == bt_bdaddr_key(b);
+}
@@ -34,3 +34,6 @@ char *bt_name2string(const char *string);
 int bt_string2uuid(uuid_t *uuid, const char *string);
 gchar *bt_list2string(GSList *list);
 GSList *bt_string2list(const gchar *str);
+
+guint bt_bdaddr_hash(gconstpointer key);
+gboolean bt_bdaddr_equal(gconstpointer a, gconstpointer b);
@@ -36,9 +36,24 @@ struct main_opts {
 	gboolean	remember_powered;
 	gboolean	reverse_sdp;
 	gboolean	name_resolv;
+	uint8_t		name_resolv_parallel;	/* requests at the same time */
+	uint32_t	name_resolv_max_age;	/* seconds, 0 for no limit */
 	gboolean	debug_keys;
 	gboolean	attrib_server;
+	uint32_t	attrib_notify_interval;	/* msec, 0 sends at once */
 	gboolean	le;
+	gboolean	sdp_low_priority;
+	uint8_t		found_hysteresis;	/* RSSI change worth a signal */
+	uint32_t	found_interval;		/* msec between signals */
+	gboolean	found_changes_only;
+
+	gboolean	property_compat;	/* PropertyChanged per property */
+
+	uint32_t	max_pending_conn;	/* per peer, 0 for no limit */
+
+	uint8_t		reconnect_parallel;	/* devices paged at once, 0 off */
+
+	uint32_t	dispatch_warning;	/* msec, 0 for no warnings */
 
 	uint8_t		mode;
 	uint8_t		discov_interval;
@@ -59,6 +74,7 @@ void btd_stop_exit_timer(void);
 
 gboolean plugin_init(GKeyFile *config, const char *enable,
 							const char *disable);
+void plugin_trigger(int trigger);
 void plugin_cleanup(void);
 
 void rfkill_init(void);
@@ -26,20 +26,216 @@
 #endif
 
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <glib.h>
 
 #include "log.h"
 
+/*
+ * Messages are formatted into a ring of fixed size records, each with
+ * its timestamp, so logging costs no system call. With the syslog and
+ * file targets a writer thread drains the ring, it only gets woken up
+ * through a pipe by the first message after it ran out of work. When
+ * the ring is full new messages are dropped and counted. The memory
+ * target keeps the latest messages only, overwriting the oldest, until
+ * __btd_log_dump() sends them to syslog.
+ *
+ * Slots are reserved with a compare and swap on the head and published
+ * through their ready flag, so any thread may log.
+ */
+#define LOG_RING_SIZE		1024	/* power of two */
+#define LOG_MESSAGE_LEN		232
+
+enum {
+	LOG_TARGET_SYSLOG,
+	LOG_TARGET_FILE,
+	LOG_TARGET_MEMORY,
+};
+
+struct log_record {
+	struct timeval time;
+	volatile int ready;
+	int priority;
+	char message[LOG_MESSAGE_LEN];
+};
+
+static struct log_record ring[LOG_RING_SIZE];
+static volatile unsigned int ring_head = 0;
+static volatile unsigned int ring_tail = 0;
+static volatile unsigned int ring_dropped = 0;
+
+static int ring_active = 0;
+static int log_target = LOG_TARGET_SYSLOG;
+static int log_fd = -1;
+
+static pthread_t writer;
+static int writer_pipe[2] = { -1, -1 };
+static volatile int writer_sleeping = 0;
+static volatile int writer_stopping = 0;
+
+static void wake_writer(void)
+{
+	char c = 0;
+
+	if (writer_sleeping &&
+			__sync_bool_compare_and_swap(&writer_sleeping, 1, 0))
+		if (write(writer_pipe[1], &c, 1) < 0)
+			return;
+}
+
+static void log_queue(int priority, const char *format, va_list ap)
+{
+	struct log_record *rec;
+	unsigned int head;
+
+	if (!ring_active) {
+		vsyslog(priority, format, ap);
+		return;
+	}
+
+	do {
+		head = ring_head;
+
+		if (head - ring_tail >= LOG_RING_SIZE) {
+			if (log_target != LOG_TARGET_MEMORY) {
+				__sync_fetch_and_add(&ring_dropped, 1);
+				return;
+			}
+
+			/* The flight recorder forgets the oldest message */
+			__sync_bool_compare_and_swap(&ring_tail, head -
+						LOG_RING_SIZE, head -
+						LOG_RING_SIZE + 1);
+			continue;
+		}
+	} while (!__sync_bool_compare_and_swap(&ring_head, head, head + 1));
+
+	rec = &ring[head & (LOG_RING_SIZE - 1)];
+	rec->ready = 0;
+
+	gettimeofday(&rec->time, NULL);
+	rec->priority = priority;
+	vsnprintf(rec->message, sizeof(rec->message), format, ap);
+
+	__sync_synchronize();
+	rec->ready = 1;
+	__sync_synchronize();
+
+	if (log_target != LOG_TARGET_MEMORY)
+		wake_writer();
+}
+
+static void write_record(const struct log_record *rec)
+{
+	char buf[LOG_MESSAGE_LEN + 64];
+	struct tm tm;
+	time_t sec;
+	int len;
+
+	if (log_target != LOG_TARGET_FILE) {
+		syslog(rec->priority, "%s", rec->message);
+		return;
+	}
+
+	sec = rec->time.tv_sec;
+	localtime_r(&sec, &tm);
+
+	len = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	len += snprintf(buf + len, sizeof(buf) - len, ".%06ld %s\n",
+				(long) rec->time.tv_usec, rec->message);
+
+	if (write(log_fd, buf, MIN(len, (int) sizeof(buf) - 1)) < 0)
+		return;
+}
+
+/* Returns the number of records written, stops at unfinished ones */
+static unsigned int drain_ring(void)
+{
+	unsigned int count = 0, dropped;
+
+	while (ring_tail != ring_head) {
+		struct log_record *rec;
+
+		rec = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+		if (!rec->ready)
+			break;
+
+		__sync_synchronize();
+
+		write_record(rec);
+
+		rec->ready = 0;
+		__sync_synchronize();
+		ring_tail++;
+		count++;
+	}
+
+	dropped = __sync_fetch_and_and(&ring_dropped, 0);
+	if (dropped > 0) {
+		struct log_record rec;
+
+		gettimeofday(&rec.time, NULL);
+		rec.priority = LOG_WARNING;
+		snprintf(rec.message, sizeof(rec.message),
+				"%u log messages dropped", dropped);
+		write_record(&rec);
+	}
+
+	return count;
+}
+
+static void *writer_thread(void *data)
+{
+	struct pollfd pfd;
+	char buf[32];
+
+	pfd.fd = writer_pipe[0];
+	pfd.events = POLLIN;
+
+	while (1) {
+		if (drain_ring() > 0)
+			continue;
+
+		if (writer_stopping)
+			break;
+
+		writer_sleeping = 1;
+		__sync_synchronize();
+
+		/* A message may have come in before going to sleep */
+		if (ring_tail != ring_head &&
+			__sync_bool_compare_and_swap(&writer_sleeping, 1, 0))
+			continue;
+
+		if (poll(&pfd, 1, -1) > 0)
+			while (read(writer_pipe[0], buf, sizeof(buf)) ==
+								sizeof(buf));
+
+		writer_sleeping = 0;
+	}
+
+	return NULL;
+}
+
 void info(const char *format, ...)
 {
 	va_list ap;
 
 	va_start(ap, format);
 
-	vsyslog(LOG_INFO, format, ap);
+	log_queue(LOG_INFO, format, ap);
 
 	va_end(ap);
 }
@@ -50,7 +246,7 @@ void error(const char *format, ...)
 
 	va_start(ap, format);
 
-	vsyslog(LOG_ERR, format, ap);
+	log_queue(LOG_ERR, format, ap);
 
 	va_end(ap);
 }
@@ -61,7 +257,7 @@ void btd_debug(const char *format, ...)
 
 	va_start(ap, format);
 
-	vsyslog(LOG_DEBUG, format, ap);
+	log_queue(LOG_DEBUG, format, ap);
 
 	va_end(ap);
 }
@@ -71,17 +267,139 @@ extern struct btd_debug_desc __stop___debug[];
 
 static gchar **enabled = NULL;
 
-static gboolean is_enabled(struct btd_debug_desc *desc)
+/*
+ * The descriptors are grouped by source file once, so changing the
+ * debug output of a file or a pattern only goes through the files.
+ */
+struct debug_file {
+	const char *file;
+	GSList *descs;
+};
+
+static GHashTable *debug_table = NULL;
+static GSList *debug_files = NULL;
+
+typedef void (*debug_func_t) (struct btd_debug_desc *desc,
+							unsigned int value);
+
+static void group_descriptors(void)
 {
-	int i;
+	struct btd_debug_desc *desc;
 
-	if (enabled == NULL)
+	debug_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (desc = __start___debug; desc < __stop___debug; desc++) {
+		struct debug_file *file;
+
+		if (desc->file == NULL)
+			continue;
+
+		file = g_hash_table_lookup(debug_table, desc->file);
+		if (file == NULL) {
+			file = g_new0(struct debug_file, 1);
+			file->file = desc->file;
+			g_hash_table_insert(debug_table, (gpointer) file->file,
+									file);
+			debug_files = g_slist_prepend(debug_files, file);
+		}
+
+		file->descs = g_slist_prepend(file->descs, desc);
+	}
+}
+
+static void debug_file_apply(struct debug_file *file, debug_func_t func,
+							unsigned int value)
+{
+	GSList *l;
+
+	for (l = file->descs; l; l = l->next)
+		func(l->data, value);
+}
+
+/* Returns the number of files matching pattern */
+static int debug_foreach(const char *pattern, debug_func_t func,
+							unsigned int value)
+{
+	struct debug_file *file;
+	GSList *l;
+	int count = 0;
+
+	if (debug_table == NULL)
 		return 0;
 
-	for (i = 0; enabled[i] != NULL; i++)
-		if (desc->file != NULL && g_pattern_match_simple(enabled[i],
-							desc->file) == TRUE)
-			return 1;
+	if (strpbrk(pattern, "*?") == NULL) {
+		file = g_hash_table_lookup(debug_table, pattern);
+		if (file == NULL)
+			return 0;
+
+		debug_file_apply(file, func, value);
+
+		return 1;
+	}
+
+	for (l = debug_files; l; l = l->next) {
+		file = l->data;
+
+		if (g_pattern_match_simple(pattern, file->file) == FALSE)
+			continue;
+
+		debug_file_apply(file, func, value);
+		count++;
+	}
+
+	return count;
+}
+
+static void set_print(struct btd_debug_desc *desc, unsigned int enable)
+{
+	if (enable)
+		desc->flags |= BTD_DEBUG_FLAG_PRINT;
+	else
+		desc->flags &= ~BTD_DEBUG_FLAG_PRINT;
+}
+
+static void set_limit(struct btd_debug_desc *desc, unsigned int limit)
+{
+	desc->limit = limit;
+	desc->count = 0;
+	desc->suppressed = 0;
+
+	if (limit > 0)
+		desc->flags |= BTD_DEBUG_FLAG_RATELIMIT;
+	else
+		desc->flags &= ~BTD_DEBUG_FLAG_RATELIMIT;
+}
+
+int __btd_debug_set(const char *pattern, int enable)
+{
+	return debug_foreach(pattern, set_print, enable);
+}
+
+int __btd_debug_set_limit(const char *pattern, unsigned int limit)
+{
+	return debug_foreach(pattern, set_limit, limit);
+}
+
+int __btd_debug_ratelimit(struct btd_debug_desc *desc)
+{
+	time_t now = time(NULL);
+
+	if (now != desc->window) {
+		if (desc->suppressed > 0)
+			btd_debug("%s: %u debug messages suppressed",
+						desc->file, desc->suppressed);
+
+		desc->window = now;
+		desc->count = 0;
+		desc->suppressed = 0;
+	}
+
+	if (desc->count < desc->limit) {
+		desc->count++;
+		return 1;
+	}
+
+	desc->suppressed++;
 
 	return 0;
 }
@@ -94,17 +412,92 @@ void __btd_toggle_debug(void)
 		desc->flags |= BTD_DEBUG_FLAG_PRINT;
 }
 
-void __btd_log_init(const char *debug, int detach)
+static int start_writer(void)
+{
+	sigset_t mask, old;
+	int i, err;
+
+	if (pipe(writer_pipe) < 0)
+		return -errno;
+
+	for (i = 0; i < 2; i++)
+		fcntl(writer_pipe[i], F_SETFL, O_NONBLOCK);
+
+	/* Signals are left to the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+	err = pthread_create(&writer, NULL, writer_thread, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0) {
+		close(writer_pipe[0]);
+		close(writer_pipe[1]);
+		writer_pipe[0] = writer_pipe[1] = -1;
+		return -err;
+	}
+
+	return 0;
+}
+
+static void stop_writer(void)
+{
+	char c = 0;
+
+	if (writer_pipe[1] < 0)
+		return;
+
+	writer_stopping = 1;
+	__sync_synchronize();
+
+	if (write(writer_pipe[1], &c, 1) < 0)
+		syslog(LOG_ERR, "Can't wake up the log writer");
+
+	pthread_join(writer, NULL);
+
+	close(writer_pipe[0]);
+	close(writer_pipe[1]);
+	writer_pipe[0] = writer_pipe[1] = -1;
+}
+
+void __btd_log_dump(void)
+{
+	unsigned int i;
+
+	if (!ring_active || log_target != LOG_TARGET_MEMORY)
+		return;
+
+	for (i = ring_tail; i != ring_head; i++) {
+		struct log_record *rec = &ring[i & (LOG_RING_SIZE - 1)];
+		char buf[32];
+		struct tm tm;
+		time_t sec;
+
+		if (!rec->ready)
+			continue;
+
+		sec = rec->time.tv_sec;
+		localtime_r(&sec, &tm);
+		strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+
+		syslog(rec->priority, "[%s.%06ld] %s", buf,
+					(long) rec->time.tv_usec, rec->message);
+	}
+}
+
+void __btd_log_init(const char *debug, int detach, const char *target)
 {
 	int option = LOG_NDELAY | LOG_PID;
-	struct btd_debug_desc *desc;
+	int i;
+
+	group_descriptors();
 
 	if (debug != NULL)
 		enabled = g_strsplit_set(debug, ":, ", 0);
 
-	for (desc = __start___debug; desc < __stop___debug; desc++)
-		if (is_enabled(desc))
-			desc->flags |= BTD_DEBUG_FLAG_PRINT;
+	for (i = 0; enabled != NULL && enabled[i] != NULL; i++)
+		__btd_debug_set(enabled[i], TRUE);
 
 	if (!detach)
 		option |= LOG_PERROR;
@@ -112,11 +505,56 @@ void __btd_log_init(const char *debug, int detach)
 	openlog("bluetoothd", option, LOG_DAEMON);
 
 	syslog(LOG_INFO, "Bluetooth deamon %s", VERSION);
+
+	if (target == NULL || g_str_equal(target, "syslog"))
+		log_target = LOG_TARGET_SYSLOG;
+	else if (g_str_equal(target, "memory"))
+		log_target = LOG_TARGET_MEMORY;
+	else {
+		log_fd = open(target, O_WRONLY | O_CREAT | O_APPEND,
+							S_IRUSR | S_IWUSR);
+		if (log_fd < 0) {
+			syslog(LOG_ERR, "Can't open log file %s: %s (%d)",
+					target, strerror(errno), errno);
+			log_target = LOG_TARGET_SYSLOG;
+		} else
+			log_target = LOG_TARGET_FILE;
+	}
+
+	/* Logging stays synchronous without a writer */
+	if (log_target != LOG_TARGET_MEMORY && start_writer() < 0) {
+		syslog(LOG_ERR, "Can't start the log writer");
+		return;
+	}
+
+	ring_active = 1;
 }
 
 void __btd_log_cleanup(void)
 {
+	ring_active = 0;
+
+	stop_writer();
+
+	if (log_fd >= 0) {
+		close(log_fd);
+		log_fd = -1;
+	}
+
 	closelog();
 
 	g_strfreev(enabled);
+
+	while (debug_files) {
+		struct debug_file *file = debug_files->data;
+
+		debug_files = g_slist_remove(debug_files, file);
+		g_slist_free(file->descs);
+		g_free(file);
+	}
+
+	if (debug_table != NULL) {
+		g_hash_table_destroy(debug_table);
+		debug_table = NULL;
+	}
 }
@@ -26,17 +26,30 @@ void error(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
 void btd_debug(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
-void __btd_log_init(const char *debug, int detach);
+void __btd_log_init(const char *debug, int detach, const char *target);
 void __btd_log_cleanup(void);
+void __btd_log_dump(void);
 void __btd_toggle_debug(void);
 
 struct btd_debug_desc {
 	const char *file;
-#define BTD_DEBUG_FLAG_DEFAULT (0)
-#define BTD_DEBUG_FLAG_PRINT   (1 << 0)
+#define BTD_DEBUG_FLAG_DEFAULT   (0)
+#define BTD_DEBUG_FLAG_PRINT     (1 << 0)
+#define BTD_DEBUG_FLAG_RATELIMIT (1 << 1)
 	unsigned int flags;
+	unsigned int limit;	/* messages per second when rate limited */
+	unsigned int count;
+	unsigned int suppressed;
+	long window;
 } __attribute__((aligned(8)));
 
+/* Enable, disable or rate limit the debug output of the source files
+ * matching pattern, returns the number of files matched */
+int __btd_debug_set(const char *pattern, int enable);
+int __btd_debug_set_limit(const char *pattern, unsigned int limit);
+
+int __btd_debug_ratelimit(struct btd_debug_desc *desc);
+
 /**
  * DBG:
  * @fmt: format string
@@ -50,7 +63,9 @@ struct btd_debug_desc {
 	__attribute__((used, section("__debug"), aligned(8))) = { \
 		.file = __FILE__, .flags = BTD_DEBUG_FLAG_DEFAULT, \
 	}; \
-	if (__btd_debug_desc.flags & BTD_DEBUG_FLAG_PRINT) \
+	if ((__btd_debug_desc.flags & BTD_DEBUG_FLAG_PRINT) && \
+		(!(__btd_debug_desc.flags & BTD_DEBUG_FLAG_RATELIMIT) || \
+			__btd_debug_ratelimit(&__btd_debug_desc))) \
 		btd_debug("%s:%s() " fmt,  __FILE__, __FUNCTION__ , ## arg); \
 } while (0)
 
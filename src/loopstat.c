@@ -0,0 +1,309 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "loopstat.h"
+
+/* The real ones are needed here */
+#undef g_io_add_watch
+#undef g_io_add_watch_full
+#undef g_timeout_add
+#undef g_timeout_add_full
+#undef g_timeout_add_seconds
+#undef g_timeout_add_seconds_full
+
+/* Dispatch time histogram in powers of two milliseconds, the first
+ * bucket is under 1 ms and the last 512 ms or more */
+#define LOOPSTAT_BUCKETS	11
+
+struct site {
+	const char *file;
+	int line;
+	unsigned long sources;
+	unsigned long dispatches;
+	unsigned long slow;
+	guint64 total;			/* usec */
+	unsigned int max;		/* usec */
+	unsigned long hist[LOOPSTAT_BUCKETS];
+};
+
+struct wrapped {
+	struct site *site;
+	GIOFunc io_func;
+	GSourceFunc timeout_func;
+	gpointer user_data;
+	GDestroyNotify notify;
+};
+
+static GHashTable *sites = NULL;
+static unsigned int threshold = 0;	/* msec, 0 for no warnings */
+
+static guint site_hash(gconstpointer key)
+{
+	const struct site *site = key;
+
+	return g_str_hash(site->file) ^ site->line;
+}
+
+static gboolean site_equal(gconstpointer a, gconstpointer b)
+{
+	const struct site *sa = a, *sb = b;
+
+	return sa->line == sb->line && strcmp(sa->file, sb->file) == 0;
+}
+
+static struct site *site_get(const char *file, int line)
+{
+	struct site match, *site;
+
+	match.file = file;
+	match.line = line;
+
+	site = g_hash_table_lookup(sites, &match);
+	if (site == NULL) {
+		site = g_new0(struct site, 1);
+		site->file = file;
+		site->line = line;
+		g_hash_table_insert(sites, site, site);
+	}
+
+	site->sources++;
+
+	return site;
+}
+
+static guint64 monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void account(struct site *site, guint64 start)
+{
+	unsigned int usec, msec;
+	int bucket;
+
+	usec = monotonic_usec() - start;
+
+	site->dispatches++;
+	site->total += usec;
+	if (usec > site->max)
+		site->max = usec;
+
+	msec = usec / 1000;
+	for (bucket = 0; msec > 0 && bucket < LOOPSTAT_BUCKETS - 1; bucket++)
+		msec >>= 1;
+
+	site->hist[bucket]++;
+
+	if (threshold > 0 && usec >= threshold * 1000) {
+		site->slow++;
+		error("%s:%d blocked the main loop for %u ms", site->file,
+						site->line, usec / 1000);
+	}
+}
+
+static gboolean io_cb(GIOChannel *io, GIOCondition cond, gpointer data)
+{
+	struct wrapped *w = data;
+	guint64 start = monotonic_usec();
+	gboolean ret;
+
+	ret = w->io_func(io, cond, w->user_data);
+
+	account(w->site, start);
+
+	return ret;
+}
+
+static gboolean timeout_cb(gpointer data)
+{
+	struct wrapped *w = data;
+	guint64 start = monotonic_usec();
+	gboolean ret;
+
+	ret = w->timeout_func(w->user_data);
+
+	account(w->site, start);
+
+	return ret;
+}
+
+static void wrapped_free(gpointer data)
+{
+	struct wrapped *w = data;
+
+	if (w->notify)
+		w->notify(w->user_data);
+
+	g_free(w);
+}
+
+static struct wrapped *wrap(gpointer user_data, GDestroyNotify notify,
+						const char *file, int line)
+{
+	struct wrapped *w;
+
+	w = g_new0(struct wrapped, 1);
+	w->site = site_get(file, line);
+	w->user_data = user_data;
+	w->notify = notify;
+
+	return w;
+}
+
+guint btd_io_add_watch(GIOChannel *io, gint priority, GIOCondition cond,
+				GIOFunc func, gpointer user_data,
+				GDestroyNotify notify,
+				const char *file, int line)
+{
+	struct wrapped *w;
+
+	if (sites == NULL)
+		return g_io_add_watch_full(io, priority, cond, func,
+							user_data, notify);
+
+	w = wrap(user_data, notify, file, line);
+	w->io_func = func;
+
+	return g_io_add_watch_full(io, priority, cond, io_cb, w,
+								wrapped_free);
+}
+
+guint btd_timeout_add(gint priority, guint interval, gboolean seconds,
+				GSourceFunc func, gpointer user_data,
+				GDestroyNotify notify,
+				const char *file, int line)
+{
+	struct wrapped *w;
+
+	if (sites == NULL) {
+		if (seconds)
+			return g_timeout_add_seconds_full(priority, interval,
+						func, user_data, notify);
+
+		return g_timeout_add_full(priority, interval, func,
+							user_data, notify);
+	}
+
+	w = wrap(user_data, notify, file, line);
+	w->timeout_func = func;
+
+	if (seconds)
+		return g_timeout_add_seconds_full(priority, interval,
+						timeout_cb, w, wrapped_free);
+
+	return g_timeout_add_full(priority, interval, timeout_cb, w,
+								wrapped_free);
+}
+
+/* Sources created before this are not followed */
+void loopstat_init(unsigned int msec)
+{
+	threshold = msec;
+
+	if (sites != NULL)
+		return;
+
+	/* Sites are never removed, wrapped sources point to them */
+	sites = g_hash_table_new_full(site_hash, site_equal, g_free, NULL);
+}
+
+void loopstat_cleanup(void)
+{
+	if (sites == NULL)
+		return;
+
+	/* Only called once the main loop is gone, so no wrapped source
+	 * can be dispatched anymore */
+	g_hash_table_destroy(sites);
+	sites = NULL;
+}
+
+static gint site_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct site *sa = a, *sb = b;
+
+	if (sa->total == sb->total)
+		return 0;
+
+	return sa->total < sb->total ? 1 : -1;
+}
+
+void loopstat_dump(void)
+{
+	GList *list, *l;
+	GString *hist;
+
+	if (sites == NULL || g_hash_table_size(sites) == 0)
+		return;
+
+	info("Main loop statistics, most busy sources first");
+
+	list = g_list_sort(g_hash_table_get_values(sites), site_cmp);
+	hist = g_string_sized_new(128);
+
+	for (l = list; l != NULL; l = l->next) {
+		struct site *site = l->data;
+		int i;
+
+		if (site->dispatches == 0)
+			continue;
+
+		info("%s:%d: %lu sources, %lu dispatches, %lu slow, "
+				"busy %llu ms, max %u us", site->file,
+				site->line, site->sources, site->dispatches,
+				site->slow, site->total / 1000, site->max);
+
+		g_string_truncate(hist, 0);
+
+		for (i = 0; i < LOOPSTAT_BUCKETS; i++) {
+			if (site->hist[i] == 0)
+				continue;
+
+			if (i == 0)
+				g_string_append_printf(hist, " <1:%lu",
+								site->hist[i]);
+			else
+				g_string_append_printf(hist, " %u:%lu",
+						1 << (i - 1), site->hist[i]);
+		}
+
+		info("%s:%d: ms%s", site->file, site->line, hist->str);
+	}
+
+	g_string_free(hist, TRUE);
+	g_list_free(list);
+}
@@ -0,0 +1,72 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Main loop dispatch statistics. With --enable-loopstat this header is
+ * included with LOOPSTAT defined ahead of every source file of the
+ * daemon, before config.h, so that the watches and timeouts they add
+ * are timed per creating file:line. */
+
+#ifndef __LOOPSTAT_H
+#define __LOOPSTAT_H
+
+#if defined(LOOPSTAT) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <glib.h>
+
+void loopstat_init(unsigned int threshold);
+void loopstat_cleanup(void);
+void loopstat_dump(void);
+
+guint btd_io_add_watch(GIOChannel *io, gint priority, GIOCondition cond,
+				GIOFunc func, gpointer user_data,
+				GDestroyNotify notify,
+				const char *file, int line);
+guint btd_timeout_add(gint priority, guint interval, gboolean seconds,
+				GSourceFunc func, gpointer user_data,
+				GDestroyNotify notify,
+				const char *file, int line);
+
+#ifdef LOOPSTAT
+#define g_io_add_watch(io, cond, func, data) \
+	btd_io_add_watch(io, G_PRIORITY_DEFAULT, cond, func, data, NULL, \
+							__FILE__, __LINE__)
+#define g_io_add_watch_full(io, prio, cond, func, data, notify) \
+	btd_io_add_watch(io, prio, cond, func, data, notify, \
+							__FILE__, __LINE__)
+#define g_timeout_add(interval, func, data) \
+	btd_timeout_add(G_PRIORITY_DEFAULT, interval, FALSE, func, data, \
+						NULL, __FILE__, __LINE__)
+#define g_timeout_add_full(prio, interval, func, data, notify) \
+	btd_timeout_add(prio, interval, FALSE, func, data, notify, \
+							__FILE__, __LINE__)
+#define g_timeout_add_seconds(interval, func, data) \
+	btd_timeout_add(G_PRIORITY_DEFAULT, interval, TRUE, func, data, \
+						NULL, __FILE__, __LINE__)
+#define g_timeout_add_seconds_full(prio, interval, func, data, notify) \
+	btd_timeout_add(prio, interval, TRUE, func, data, notify, \
+							__FILE__, __LINE__)
+#endif
+
+#endif /* __LOOPSTAT_H */
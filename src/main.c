@@ -37,6 +37,8 @@
 #include <sys/stat.h>
 
 #include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
 #include <bluetooth/uuid.h>
 
 #include <glib.h>
@@ -54,6 +56,11 @@
 #include "dbus-common.h"
 #include "agent.h"
 #include "manager.h"
+#include "device.h"
+#include "storage.h"
+#include "loopstat.h"
+#include "memstat.h"
+#include "btio.h"
 
 #ifdef HAVE_CAPNG
 #include <cap-ng.h>
@@ -204,6 +211,24 @@ static void parse_config(GKeyFile *config)
 	else
 		main_opts.name_resolv = boolean;
 
+	val = g_key_file_get_integer(config, "General",
+					"NameResolvingParallel", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (val > 0 && val <= 255) {
+		DBG("name_resolv_parallel=%d", val);
+		main_opts.name_resolv_parallel = val;
+	}
+
+	val = g_key_file_get_integer(config, "General",
+					"NameResolvingMaxAge", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (val >= 0) {
+		DBG("name_resolv_max_age=%d", val);
+		main_opts.name_resolv_max_age = val;
+	}
+
 	boolean = g_key_file_get_boolean(config, "General",
 						"DebugKeys", &err);
 	if (err)
@@ -218,6 +243,15 @@ static void parse_config(GKeyFile *config)
 	else
 		main_opts.attrib_server = boolean;
 
+	val = g_key_file_get_integer(config, "General",
+					"AttributeNotifyInterval", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (val >= 0) {
+		DBG("attrib_notify_interval=%d", val);
+		main_opts.attrib_notify_interval = val;
+	}
+
 	boolean = g_key_file_get_boolean(config, "General",
 						"EnableLE", &err);
 	if (err)
@@ -225,6 +259,73 @@ static void parse_config(GKeyFile *config)
 	else
 		main_opts.le = boolean;
 
+	boolean = g_key_file_get_boolean(config, "General",
+						"SDPLowPriority", &err);
+	if (err)
+		g_clear_error(&err);
+	else
+		main_opts.sdp_low_priority = boolean;
+
+	val = g_key_file_get_integer(config, "General",
+					"DeviceFoundRSSIHysteresis", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (val >= 0 && val <= 255) {
+		DBG("found_hysteresis=%d", val);
+		main_opts.found_hysteresis = val;
+	}
+
+	val = g_key_file_get_integer(config, "General",
+					"DeviceFoundInterval", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (val >= 0) {
+		DBG("found_interval=%d", val);
+		main_opts.found_interval = val;
+	}
+
+	boolean = g_key_file_get_boolean(config, "General",
+						"DeviceFoundChangesOnly", &err);
+	if (err)
+		g_clear_error(&err);
+	else
+		main_opts.found_changes_only = boolean;
+
+	boolean = g_key_file_get_boolean(config, "General",
+						"PropertyChangedCompat", &err);
+	if (err)
+		g_clear_error(&err);
+	else
+		main_opts.property_compat = boolean;
+
+	val = g_key_file_get_integer(config, "General",
+					"MaxPendingConnections", &err);
+	if (err) {
+		DBG("%s", err->message);
+		g_clear_error(&err);
+	} else {
+		DBG("max_pending_conn=%d", val);
+		main_opts.max_pending_conn = val;
+	}
+
+	val = g_key_file_get_integer(config, "General",
+					"ReconnectParallel", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (val >= 0 && val <= 255) {
+		DBG("reconnect_parallel=%d", val);
+		main_opts.reconnect_parallel = val;
+	}
+
+	val = g_key_file_get_integer(config, "General",
+					"DispatchWarning", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (val >= 0) {
+		DBG("dispatch_warning=%d", val);
+		main_opts.dispatch_warning = val;
+	}
+
 	main_opts.link_mode = HCI_LM_ACCEPT;
 
 	main_opts.link_policy = HCI_LP_RSWITCH | HCI_LP_SNIFF |
@@ -250,6 +351,8 @@ static void init_defaults(void)
 	main_opts.remember_powered = TRUE;
 	main_opts.reverse_sdp = TRUE;
 	main_opts.name_resolv = TRUE;
+	main_opts.name_resolv_parallel = 1;
+	main_opts.property_compat = TRUE;
 	main_opts.link_mode = HCI_LM_ACCEPT;
 	main_opts.link_policy = HCI_LP_RSWITCH | HCI_LP_SNIFF |
 						HCI_LP_HOLD | HCI_LP_PARK;
@@ -270,7 +373,27 @@ static void sig_debug(int sig)
 	__btd_toggle_debug();
 }
 
+static gboolean dump_state(gpointer user_data)
+{
+	storage_dump_stats();
+
+	loopstat_dump();
+
+	memstat_dump();
+
+	/* Last so the flight recorder includes the statistics */
+	__btd_log_dump();
+
+	return FALSE;
+}
+
+static void sig_dump(int sig)
+{
+	g_idle_add(dump_state, NULL);
+}
+
 static gchar *option_debug = NULL;
+static gchar *option_log = NULL;
 static gchar *option_plugin = NULL;
 static gchar *option_noplugin = NULL;
 static gboolean option_detach = TRUE;
@@ -279,6 +402,36 @@ static gboolean option_udev = FALSE;
 
 static guint last_adapter_timeout = 0;
 
+/* Startup profiler, logs how long each phase took until the main loop
+ * first goes idle */
+static GTimer *startup_timer = NULL;
+static gdouble startup_last = 0;
+
+static void startup_phase(const char *phase)
+{
+	gdouble now;
+
+	if (startup_timer == NULL)
+		return;
+
+	now = g_timer_elapsed(startup_timer, NULL);
+
+	info("Startup: %s took %.1f ms (%.1f ms total)", phase,
+				(now - startup_last) * 1000, now * 1000);
+
+	startup_last = now;
+}
+
+static gboolean startup_complete(gpointer user_data)
+{
+	startup_phase("first main loop iteration");
+
+	g_timer_destroy(startup_timer);
+	startup_timer = NULL;
+
+	return FALSE;
+}
+
 static gboolean exit_timeout(gpointer data)
 {
 	g_main_loop_quit(event_loop);
@@ -360,6 +513,9 @@ static GOptionEntry options[] = {
 	{ "debug", 'd', G_OPTION_FLAG_OPTIONAL_ARG,
 				G_OPTION_ARG_CALLBACK, parse_debug,
 				"Specify debug options to enable", "DEBUG" },
+	{ "log", 'l', 0, G_OPTION_ARG_STRING, &option_log,
+				"Log to syslog, a file or only to memory",
+				"syslog|memory|FILE" },
 	{ "plugin", 'p', 0, G_OPTION_ARG_STRING, &option_plugin,
 				"Specify plugins to load", "NAME,..," },
 	{ "noplugin", 'P', 0, G_OPTION_ARG_STRING, &option_noplugin,
@@ -380,6 +536,7 @@ int main(int argc, char *argv[])
 	GError *err = NULL;
 	struct sigaction sa;
 	uint16_t mtu = 0;
+	uint32_t sdp_flags;
 	GKeyFile *config;
 
 #ifdef ANDROID_SET_AID_AND_CAP
@@ -389,6 +546,8 @@ int main(int argc, char *argv[])
 	android_set_aid_and_cap();
 #endif
 
+	startup_timer = g_timer_new();
+
 	init_defaults();
 
 #ifdef HAVE_CAPNG
@@ -440,7 +599,7 @@ int main(int argc, char *argv[])
 
 	umask(0077);
 
-	__btd_log_init(option_debug, option_detach);
+	__btd_log_init(option_debug, option_detach, option_log);
 
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_flags = SA_NOCLDSTOP;
@@ -451,6 +610,9 @@ int main(int argc, char *argv[])
 	sa.sa_handler = sig_debug;
 	sigaction(SIGUSR2, &sa, NULL);
 
+	sa.sa_handler = sig_dump;
+	sigaction(SIGUSR1, &sa, NULL);
+
 	sa.sa_handler = SIG_IGN;
 	sigaction(SIGPIPE, &sa, NULL);
 
@@ -458,8 +620,12 @@ int main(int argc, char *argv[])
 
 	parse_config(config);
 
-	agent_init();
+	loopstat_init(main_opts.dispatch_warning);
+
+	startup_phase("configuration");
 
+	/* Own the bus name before anything slow so that clients waiting
+	 * for it get going as early as possible */
 	if (option_udev == FALSE) {
 		if (connect_dbus() < 0) {
 			error("Unable to get on D-Bus");
@@ -472,21 +638,45 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	start_sdp_server(mtu, main_opts.deviceid, SDP_SERVER_COMPAT);
+	startup_phase("D-Bus");
+
+	storage_init();
+
+	agent_init();
+
+	startup_phase("storage");
+
+	sdp_flags = SDP_SERVER_COMPAT;
+	if (main_opts.sdp_low_priority)
+		sdp_flags |= SDP_SERVER_LOW_PRIORITY;
+
+	start_sdp_server(mtu, main_opts.deviceid, sdp_flags);
 
 	if (main_opts.attrib_server) {
 		if (attrib_server_init() < 0)
 			error("Can't initialize attribute server");
 	}
 
+	startup_phase("SDP and attribute servers");
+
 	/* Loading plugins has to be done after D-Bus has been setup since
 	 * the plugins might wanna expose some paths on the bus. However the
 	 * best order of how to init various subsystems of the Bluetooth
 	 * daemon needs to be re-worked. */
+	bt_io_set_admission(NULL, main_opts.max_pending_conn, NULL);
+
 	plugin_init(config, option_plugin, option_noplugin);
 
+	startup_phase("plugins");
+
 	event_loop = g_main_loop_new(NULL, FALSE);
 
+	/* Default adapter and hciX source lookups are served from a table
+	 * kept current by the device events instead of ioctls */
+	if (hci_dev_cache_enable() < 0)
+		error("Can't enable the HCI device cache: %s (%d)",
+						strerror(errno), errno);
+
 	if (adapter_ops_setup() < 0) {
 		error("adapter_ops_setup failed");
 		exit(1);
@@ -494,6 +684,12 @@ int main(int argc, char *argv[])
 
 	rfkill_init();
 
+	startup_phase("adapters");
+
+	/* Runs ahead of the idle callbacks loading the stored devices of
+	 * the adapters, so this is when requests start being served */
+	g_idle_add_full(G_PRIORITY_HIGH_IDLE, startup_complete, NULL, NULL);
+
 	DBG("Entering main loop");
 
 	g_main_loop_run(event_loop);
@@ -504,6 +700,8 @@ int main(int argc, char *argv[])
 
 	plugin_cleanup();
 
+	hci_dev_cache_disable();
+
 	if (main_opts.attrib_server)
 		attrib_server_exit();
 
@@ -511,6 +709,10 @@ int main(int argc, char *argv[])
 
 	agent_exit();
 
+	storage_cleanup();
+
+	loopstat_cleanup();
+
 	g_main_loop_unref(event_loop);
 
 	if (config)
@@ -42,11 +42,13 @@
 #include <gdbus.h>
 
 #include "hcid.h"
+#include "plugin.h"
 #include "dbus-common.h"
 #include "log.h"
 #include "adapter.h"
 #include "error.h"
 #include "manager.h"
+#include "memstat.h"
 
 static char base_path[50] = "/org/bluez";
 
@@ -193,12 +195,130 @@ static DBusMessage *get_properties(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *get_objects(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	g_dbus_append_objects(conn, "/", &iter);
+
+	return reply;
+}
+
+static DBusMessage *set_debug(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *pattern;
+	dbus_bool_t enable;
+
+	if (!dbus_message_get_args(msg, NULL,
+					DBUS_TYPE_STRING, &pattern,
+					DBUS_TYPE_BOOLEAN, &enable,
+					DBUS_TYPE_INVALID))
+		return btd_error_invalid_args(msg);
+
+	if (__btd_debug_set(pattern, enable) == 0)
+		return btd_error_does_not_exist(msg);
+
+	info("Debug output of %s %s", pattern,
+					enable ? "enabled" : "disabled");
+
+	return dbus_message_new_method_return(msg);
+}
+
+static DBusMessage *set_debug_limit(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *pattern;
+	dbus_uint32_t limit;
+
+	if (!dbus_message_get_args(msg, NULL,
+					DBUS_TYPE_STRING, &pattern,
+					DBUS_TYPE_UINT32, &limit,
+					DBUS_TYPE_INVALID))
+		return btd_error_invalid_args(msg);
+
+	if (__btd_debug_set_limit(pattern, limit) == 0)
+		return btd_error_does_not_exist(msg);
+
+	return dbus_message_new_method_return(msg);
+}
+
+static void append_memstat(const char *name,
+				const struct memstat_counters *counters,
+				unsigned int rate, void *user_data)
+{
+	DBusMessageIter *iter = user_data;
+	DBusMessageIter entry, dict;
+	dbus_uint64_t bytes = counters->bytes, peak = counters->peak;
+	dbus_uint32_t objects = counters->objects, allocs = counters->allocs;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name);
+
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	dict_append_entry(&dict, "Bytes", DBUS_TYPE_UINT64, &bytes);
+	dict_append_entry(&dict, "PeakBytes", DBUS_TYPE_UINT64, &peak);
+	dict_append_entry(&dict, "Objects", DBUS_TYPE_UINT32, &objects);
+	dict_append_entry(&dict, "Allocations", DBUS_TYPE_UINT32, &allocs);
+	dict_append_entry(&dict, "AllocationRate", DBUS_TYPE_UINT32, &rate);
+
+	dbus_message_iter_close_container(&entry, &dict);
+
+	dbus_message_iter_close_container(iter, &entry);
+}
+
+static DBusMessage *get_memory_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	memstat_foreach(append_memstat, &array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
 static GDBusMethodTable manager_methods[] = {
 	{ "GetProperties",	"",	"a{sv}",get_properties	},
+	{ "GetObjects",		"",	"a{oa{sa{sv}}}", get_objects },
 	{ "DefaultAdapter",	"",	"o",	default_adapter	},
 	{ "FindAdapter",	"s",	"o",	find_adapter	},
 	{ "ListAdapters",	"",	"ao",	list_adapters,
 						G_DBUS_METHOD_FLAG_DEPRECATED},
+	{ "SetDebug",		"sb",	"",	set_debug	},
+	{ "SetDebugLimit",	"su",	"",	set_debug_limit	},
+	{ "GetMemoryStatistics", "",	"a{sa{sv}}", get_memory_statistics },
 	{ }
 };
 
@@ -372,6 +492,10 @@ struct btd_adapter *btd_manager_register_adapter(int id)
 		return NULL;
 	}
 
+	/* Profile drivers get registered before the adapter shows up */
+	if (adapters == NULL)
+		plugin_trigger(BLUETOOTH_PLUGIN_TRIGGER_ADAPTER);
+
 	adapter = adapter_create(connection, id);
 	if (!adapter)
 		return NULL;
@@ -0,0 +1,132 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "memstat.h"
+
+static const char *tag_names[MEMSTAT_TAGS] = {
+	"SDPRecords",
+	"SDPContinuationStates",
+	"FoundDevices",
+	"GATTDatabase",
+	"AVDTPCapabilities",
+	"AVRCPMetaData",
+};
+
+static struct memstat_counters counters[MEMSTAT_TAGS];
+static unsigned long last_allocs[MEMSTAT_TAGS];
+static guint64 last_query = 0;		/* msec, monotonic */
+
+#ifdef MEMSTAT
+void btd_memstat_add(enum memstat_tag tag, size_t size)
+{
+	struct memstat_counters *c = &counters[tag];
+
+	c->bytes += size;
+	c->objects++;
+	c->allocs++;
+
+	if (c->bytes > c->peak)
+		c->peak = c->bytes;
+}
+
+void btd_memstat_sub(enum memstat_tag tag, size_t size)
+{
+	struct memstat_counters *c = &counters[tag];
+
+	if (c->bytes < size || c->objects == 0) {
+		error("%s accounting underflow", tag_names[tag]);
+		return;
+	}
+
+	c->bytes -= size;
+	c->objects--;
+}
+#endif
+
+static guint64 monotonic_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (guint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void memstat_foreach(memstat_func_t func, void *user_data)
+{
+	guint64 now, elapsed;
+	int i;
+
+	now = monotonic_msec();
+	elapsed = now - last_query;
+	last_query = now;
+
+	for (i = 0; i < MEMSTAT_TAGS; i++) {
+		unsigned long allocs = counters[i].allocs - last_allocs[i];
+		unsigned int rate;
+
+		last_allocs[i] = counters[i].allocs;
+
+		if (counters[i].allocs == 0)
+			continue;
+
+		rate = elapsed > 0 ? (guint64) allocs * 1000 / elapsed : 0;
+
+		func(tag_names[i], &counters[i], rate, user_data);
+	}
+}
+
+static void dump_counters(const char *name,
+				const struct memstat_counters *c,
+				unsigned int rate, void *user_data)
+{
+	info("%s: %llu bytes in %lu objects, peak %llu bytes, "
+			"%lu allocations, %u/s", name, c->bytes, c->objects,
+			c->peak, c->allocs, rate);
+}
+
+void memstat_dump(void)
+{
+	int i;
+
+	for (i = 0; i < MEMSTAT_TAGS; i++)
+		if (counters[i].allocs > 0)
+			break;
+
+	if (i == MEMSTAT_TAGS)
+		return;
+
+	info("Memory statistics");
+
+	memstat_foreach(dump_counters, NULL);
+}
@@ -0,0 +1,64 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __MEMSTAT_H
+#define __MEMSTAT_H
+
+/* Memory held by the daemon per subsystem. Counted only when built with
+ * --enable-memstat, otherwise the hooks compile to nothing. */
+
+enum memstat_tag {
+	MEMSTAT_SDP_RECORDS,
+	MEMSTAT_SDP_CSTATES,
+	MEMSTAT_FOUND_DEVICES,
+	MEMSTAT_GATT_DATABASE,
+	MEMSTAT_AVDTP_CAPS,
+	MEMSTAT_AVRCP_METADATA,
+	MEMSTAT_TAGS
+};
+
+#ifdef MEMSTAT
+void btd_memstat_add(enum memstat_tag tag, size_t size);
+void btd_memstat_sub(enum memstat_tag tag, size_t size);
+#else
+#define btd_memstat_add(tag, size) do { } while (0)
+#define btd_memstat_sub(tag, size) do { } while (0)
+#endif
+
+struct memstat_counters {
+	unsigned long long bytes;	/* live */
+	unsigned long long peak;
+	unsigned long objects;		/* live */
+	unsigned long allocs;		/* since startup */
+};
+
+/* Rate is the allocations per second since the previous call, only the
+ * subsystems that allocated anything are reported */
+typedef void (*memstat_func_t) (const char *name,
+				const struct memstat_counters *counters,
+				unsigned int rate, void *user_data);
+
+void memstat_foreach(memstat_func_t func, void *user_data);
+void memstat_dump(void);
+
+#endif /* __MEMSTAT_H */
@@ -209,22 +209,44 @@ gboolean plugin_init(GKeyFile *config, const char *enable, const char *disable)
 	g_dir_close(dir);
 
 start:
+	plugin_trigger(BLUETOOTH_PLUGIN_TRIGGER_STARTUP);
+
+	g_strfreev(conf_disabled);
+	g_strfreev(cli_enabled);
+	g_strfreev(cli_disabled);
+
+	return TRUE;
+}
+
+/* Plugins only needed once something happens, like the profiles needing
+ * an adapter, are left out of startup so D-Bus gets served sooner */
+void plugin_trigger(int trigger)
+{
+	GSList *list;
+	GTimer *timer;
+
+	timer = g_timer_new();
+
 	for (list = plugins; list; list = list->next) {
 		struct bluetooth_plugin *plugin = list->data;
 
+		if (plugin->active || plugin->desc->trigger != trigger)
+			continue;
+
+		g_timer_start(timer);
+
 		if (plugin->desc->init() < 0) {
 			error("Failed to init %s plugin", plugin->desc->name);
 			continue;
 		}
 
+		DBG("%s plugin initialized in %.3f ms", plugin->desc->name,
+					g_timer_elapsed(timer, NULL) * 1000);
+
 		plugin->active = TRUE;
 	}
 
-	g_strfreev(conf_disabled);
-	g_strfreev(cli_enabled);
-	g_strfreev(cli_disabled);
-
-	return TRUE;
+	g_timer_destroy(timer);
 }
 
 void plugin_cleanup(void)
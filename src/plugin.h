@@ -24,24 +24,36 @@
 #define BLUETOOTH_PLUGIN_PRIORITY_DEFAULT     0
 #define BLUETOOTH_PLUGIN_PRIORITY_HIGH      100
 
+/* When a plugin gets initialized */
+#define BLUETOOTH_PLUGIN_TRIGGER_STARTUP	0
+#define BLUETOOTH_PLUGIN_TRIGGER_ADAPTER	1	/* first adapter */
+
 struct bluetooth_plugin_desc {
 	const char *name;
 	const char *version;
 	int priority;
 	int (*init) (void);
 	void (*exit) (void);
+	int trigger;
 };
 
 #ifdef BLUETOOTH_PLUGIN_BUILTIN
-#define BLUETOOTH_PLUGIN_DEFINE(name, version, priority, init, exit) \
+#define BLUETOOTH_PLUGIN_DEFINE_TRIGGER(name, version, priority, trigger, \
+								init, exit) \
 		struct bluetooth_plugin_desc __bluetooth_builtin_ ## name = { \
-			#name, version, priority, init, exit \
+			#name, version, priority, init, exit, trigger \
 		};
 #else
-#define BLUETOOTH_PLUGIN_DEFINE(name, version, priority, init, exit) \
+#define BLUETOOTH_PLUGIN_DEFINE_TRIGGER(name, version, priority, trigger, \
+								init, exit) \
 		extern struct bluetooth_plugin_desc bluetooth_plugin_desc \
 				__attribute__ ((visibility("default"))); \
 		struct bluetooth_plugin_desc bluetooth_plugin_desc = { \
-			#name, version, priority, init, exit \
+			#name, version, priority, init, exit, trigger \
 		};
 #endif
+
+#define BLUETOOTH_PLUGIN_DEFINE(name, version, priority, init, exit) \
+		BLUETOOTH_PLUGIN_DEFINE_TRIGGER(name, version, priority, \
+				BLUETOOTH_PLUGIN_TRIGGER_STARTUP, init, exit)
+
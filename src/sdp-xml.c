@@ -399,6 +399,9 @@ void convert_sdp_record_to_xml(sdp_record_t *rec,
 	cd.data = data;
 	cd.appender = appender;
 
+	if (rec)
+		sdp_record_decode(rec);
+
 	if (rec && rec->attrlist) {
 		appender(data, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n\n");
 		appender(data, "<record>\n");
@@ -781,3 +784,417 @@ sdp_data_t *sdp_xml_parse_datatype(const char *el, struct sdp_xml_data *elem,
 
 	return NULL;
 }
+
+#define PDU_KIND_SEQ	0
+#define PDU_KIND_LEAF	1
+#define PDU_KIND_SKIP	2
+
+static int pdu_open_seq(struct sdp_xml_pdu *pdu, uint8_t dtd);
+static int pdu_close_seq(struct sdp_xml_pdu *pdu, uint32_t offset);
+
+/* The record sequence is opened right away, <record> is optional */
+int sdp_xml_pdu_init(struct sdp_xml_pdu *pdu)
+{
+	memset(pdu, 0, sizeof(*pdu));
+
+	return pdu_open_seq(pdu, SDP_SEQ8);
+}
+
+/* Returns the PDU length, the PDU itself is in pdu->buf */
+int sdp_xml_pdu_finish(struct sdp_xml_pdu *pdu)
+{
+	int err;
+
+	if (pdu->depth > 0)
+		return -EINVAL;
+
+	err = pdu_close_seq(pdu, 0);
+	if (err < 0)
+		return err;
+
+	return pdu->buf.data_size;
+}
+
+void sdp_xml_pdu_free(struct sdp_xml_pdu *pdu)
+{
+	free(pdu->buf.data);
+	memset(pdu, 0, sizeof(*pdu));
+}
+
+static uint8_t *pdu_reserve(struct sdp_xml_pdu *pdu, uint32_t len)
+{
+	sdp_buf_t *buf = &pdu->buf;
+
+	if (buf->data_size + len > buf->buf_size) {
+		uint32_t size = buf->buf_size ? buf->buf_size : 512;
+		uint8_t *data;
+
+		while (size < buf->data_size + len)
+			size *= 2;
+
+		data = realloc(buf->data, size);
+		if (!data)
+			return NULL;
+
+		buf->data = data;
+		buf->buf_size = size;
+	}
+
+	return buf->data + buf->data_size;
+}
+
+static int pdu_put(struct sdp_xml_pdu *pdu, uint8_t dtd, const void *val,
+								uint32_t len)
+{
+	uint8_t *p = pdu_reserve(pdu, len + 1);
+
+	if (!p)
+		return -ENOMEM;
+
+	*p = dtd;
+	memcpy(p + 1, val, len);
+	pdu->buf.data_size += len + 1;
+
+	return 0;
+}
+
+/* Same lenient checks as sdp_xml_parse_int */
+static int parse_number(const char *data, uint64_t *val)
+{
+	char *endptr;
+
+	*val = strtoull(data, &endptr, 0);
+
+	if (endptr != data && *endptr != '\0')
+		return -EINVAL;
+
+	return 0;
+}
+
+static int parse_hex128(const char *data, uint128_t *val)
+{
+	unsigned int i, j;
+	char buf[3];
+
+	buf[2] = '\0';
+
+	for (i = 0, j = 0; data[i] && j < 16;) {
+		if (data[i] == '-') {
+			i++;
+			continue;
+		}
+
+		if (!isxdigit(data[i]) || !isxdigit(data[i + 1]))
+			return -EINVAL;
+
+		buf[0] = data[i];
+		buf[1] = data[i + 1];
+
+		val->data[j++] = strtoul(buf, 0, 16);
+		i += 2;
+	}
+
+	return j == 16 ? 0 : -EINVAL;
+}
+
+static int pdu_put_int(struct sdp_xml_pdu *pdu, uint8_t dtd, const char *data)
+{
+	uint128_t u128, n128;
+	uint64_t val, n64;
+	uint32_t n32;
+	uint16_t n16;
+	uint8_t n8;
+
+	switch (dtd) {
+	case SDP_BOOL:
+		if (!strcmp(data, "true"))
+			n8 = 1;
+		else if (!strcmp(data, "false"))
+			n8 = 0;
+		else
+			return -EINVAL;
+		return pdu_put(pdu, dtd, &n8, sizeof(n8));
+	case SDP_INT128:
+	case SDP_UINT128:
+		if (parse_hex128(data, &u128) < 0)
+			return -EINVAL;
+		/* Same byte order sdp_gen_pdu gives the parsed value */
+		hton128(&u128, &n128);
+		return pdu_put(pdu, dtd, &n128, sizeof(n128));
+	}
+
+	if (parse_number(data, &val) < 0)
+		return -EINVAL;
+
+	switch (dtd) {
+	case SDP_INT8:
+	case SDP_UINT8:
+		n8 = val;
+		return pdu_put(pdu, dtd, &n8, sizeof(n8));
+	case SDP_INT16:
+	case SDP_UINT16:
+		n16 = htons(val);
+		return pdu_put(pdu, dtd, &n16, sizeof(n16));
+	case SDP_INT32:
+	case SDP_UINT32:
+		n32 = htonl(val);
+		return pdu_put(pdu, dtd, &n32, sizeof(n32));
+	case SDP_INT64:
+	case SDP_UINT64:
+		n64 = hton64(val);
+		return pdu_put(pdu, dtd, &n64, sizeof(n64));
+	}
+
+	return -EINVAL;
+}
+
+static int pdu_put_uuid(struct sdp_xml_pdu *pdu, const char *data)
+{
+	uint128_t u128;
+	uint32_t val;
+	uint16_t n16;
+	char *endptr;
+
+	if (strlen(data) == 36) {
+		if (parse_hex128(data, &u128) < 0)
+			return -EINVAL;
+		return pdu_put(pdu, SDP_UUID128, &u128, sizeof(u128));
+	}
+
+	val = strtoll(data, &endptr, 16);
+	if (*endptr != '\0')
+		return -EINVAL;
+
+	if (val > USHRT_MAX) {
+		val = htonl(val);
+		return pdu_put(pdu, SDP_UUID32, &val, sizeof(val));
+	}
+
+	n16 = htons(val);
+	return pdu_put(pdu, SDP_UUID16, &n16, sizeof(n16));
+}
+
+static int pdu_put_str(struct sdp_xml_pdu *pdu, uint8_t dtd8,
+					const char *data, char encoding)
+{
+	uint32_t len = strlen(data), hdr, i;
+	uint8_t *p;
+
+	if (encoding == SDP_XML_ENCODING_HEX)
+		len >>= 1;
+
+	if (len > USHRT_MAX)
+		hdr = 1 + sizeof(uint32_t);
+	else if (len > UCHAR_MAX)
+		hdr = 1 + sizeof(uint16_t);
+	else
+		hdr = 1 + sizeof(uint8_t);
+
+	p = pdu_reserve(pdu, hdr + len);
+	if (!p)
+		return -ENOMEM;
+
+	/* The 16 and 32 bit length forms follow the 8 bit one */
+	*p = dtd8 + (hdr == 2 ? 0 : hdr == 3 ? 1 : 2);
+	sdp_set_seq_len(p, len);
+
+	if (encoding == SDP_XML_ENCODING_HEX) {
+		char buf[3];
+
+		buf[2] = '\0';
+
+		for (i = 0; i < len; i++) {
+			buf[0] = data[i * 2];
+			buf[1] = data[i * 2 + 1];
+			p[hdr + i] = strtoul(buf, 0, 16);
+		}
+	} else
+		memcpy(p + hdr, data, len);
+
+	pdu->buf.data_size += hdr + len;
+
+	return 0;
+}
+
+static int pdu_put_datatype(struct sdp_xml_pdu *pdu, const char *el,
+					const char *data, char encoding)
+{
+	static const struct {
+		const char *name;
+		uint8_t dtd;
+	} ints[] = {
+		{ "boolean",	SDP_BOOL	},
+		{ "uint8",	SDP_UINT8	},
+		{ "uint16",	SDP_UINT16	},
+		{ "uint32",	SDP_UINT32	},
+		{ "uint64",	SDP_UINT64	},
+		{ "uint128",	SDP_UINT128	},
+		{ "int8",	SDP_INT8	},
+		{ "int16",	SDP_INT16	},
+		{ "int32",	SDP_INT32	},
+		{ "int64",	SDP_INT64	},
+		{ "int128",	SDP_INT128	},
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(ints) / sizeof(ints[0]); i++)
+		if (!strcmp(el, ints[i].name))
+			return pdu_put_int(pdu, ints[i].dtd, data);
+
+	if (!strcmp(el, "uuid"))
+		return pdu_put_uuid(pdu, data);
+	else if (!strcmp(el, "url"))
+		return pdu_put_str(pdu, SDP_URL_STR8, data,
+						SDP_XML_ENCODING_NORMAL);
+	else if (!strcmp(el, "text"))
+		return pdu_put_str(pdu, SDP_TEXT_STR8, data, encoding);
+	else if (!strcmp(el, "nil")) {
+		uint8_t *p = pdu_reserve(pdu, 1);
+		if (!p)
+			return -ENOMEM;
+		*p = SDP_DATA_NIL;
+		pdu->buf.data_size++;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int pdu_open_seq(struct sdp_xml_pdu *pdu, uint8_t dtd)
+{
+	uint8_t *p = pdu_reserve(pdu, 2);
+
+	if (!p)
+		return -ENOMEM;
+
+	p[0] = dtd;
+	p[1] = 0;
+	pdu->buf.data_size += 2;
+
+	return 0;
+}
+
+/* Sequences start out with an 8 bit length and grow when needed */
+static int pdu_close_seq(struct sdp_xml_pdu *pdu, uint32_t offset)
+{
+	uint32_t len = pdu->buf.data_size - offset - 2, extra = 0;
+	uint8_t *p;
+
+	if (len > USHRT_MAX)
+		extra = sizeof(uint32_t) - sizeof(uint8_t);
+	else if (len > UCHAR_MAX)
+		extra = sizeof(uint16_t) - sizeof(uint8_t);
+
+	if (extra) {
+		if (!pdu_reserve(pdu, extra))
+			return -ENOMEM;
+
+		p = pdu->buf.data + offset;
+		memmove(p + 2 + extra, p + 2, len);
+		*p += extra == 1 ? 1 : 2;
+		pdu->buf.data_size += extra;
+	}
+
+	sdp_set_seq_len(pdu->buf.data + offset, len);
+
+	return 0;
+}
+
+/*
+ * Element callbacks of the streaming conversion. Like the tree based
+ * parsers, elements that can't be parsed are left out and only the
+ * first value of an attribute is kept.
+ */
+int sdp_xml_pdu_start(struct sdp_xml_pdu *pdu, const char *el,
+				const char **names, const char **values)
+{
+	const char *value = "";
+	char encoding = SDP_XML_ENCODING_NORMAL;
+	uint32_t start = pdu->buf.data_size;
+	uint8_t kind;
+	int i, err;
+
+	if (!strcmp(el, "record"))
+		return 0;
+
+	if (!strcmp(el, "attribute")) {
+		pdu->attr_id = 0;
+		for (i = 0; names[i]; i++) {
+			if (!strcmp(names[i], "id")) {
+				pdu->attr_id = strtol(values[i], 0, 0);
+				break;
+			}
+		}
+		pdu->attr_pending = 1;
+		pdu->depth = 0;
+		return 0;
+	}
+
+	if (pdu->depth == SDP_XML_MAX_DEPTH)
+		return -E2BIG;
+
+	if (pdu->depth == 0 ? !pdu->attr_pending :
+			pdu->stack[pdu->depth - 1].kind != PDU_KIND_SEQ) {
+		kind = PDU_KIND_SKIP;
+		goto push;
+	}
+
+	if (pdu->depth == 0) {
+		uint16_t id = htons(pdu->attr_id);
+
+		err = pdu_put(pdu, SDP_UINT16, &id, sizeof(id));
+		if (err < 0)
+			return err;
+	}
+
+	if (!strcmp(el, "sequence") || !strcmp(el, "alternate")) {
+		kind = PDU_KIND_SEQ;
+		/* a sequence stays, even if all of its elements fail */
+		pdu->stack[pdu->depth].offset = pdu->buf.data_size;
+		err = pdu_open_seq(pdu, el[0] == 's' ? SDP_SEQ8 : SDP_ALT8);
+		if (err < 0)
+			return err;
+	} else {
+		for (i = 0; names[i]; i++) {
+			if (!strcmp(names[i], "value"))
+				value = values[i];
+			else if (!strcmp(names[i], "encoding") &&
+						!strcmp(values[i], "hex"))
+				encoding = SDP_XML_ENCODING_HEX;
+		}
+
+		kind = PDU_KIND_LEAF;
+		err = pdu_put_datatype(pdu, el, value, encoding);
+		if (err == -ENOMEM)
+			return err;
+		if (err < 0) {
+			pdu->buf.data_size = start;
+			kind = PDU_KIND_SKIP;
+			goto push;
+		}
+	}
+
+	if (pdu->depth == 0)
+		pdu->attr_pending = 0;
+
+push:
+	pdu->stack[pdu->depth++].kind = kind;
+
+	return 0;
+}
+
+int sdp_xml_pdu_end(struct sdp_xml_pdu *pdu, const char *el)
+{
+	if (!strcmp(el, "record") || !strcmp(el, "attribute"))
+		return 0;
+
+	if (pdu->depth == 0)
+		return -EINVAL;
+
+	pdu->depth--;
+
+	if (pdu->stack[pdu->depth].kind == PDU_KIND_SEQ)
+		return pdu_close_seq(pdu, pdu->stack[pdu->depth].offset);
+
+	return 0;
+}
@@ -56,4 +56,25 @@ struct sdp_xml_data *sdp_xml_data_expand(struct sdp_xml_data *elem);
 sdp_data_t *sdp_xml_parse_datatype(const char *el, struct sdp_xml_data *elem,
 							sdp_record_t *record);
 
+#define SDP_XML_MAX_DEPTH	32
+
+/* State of the direct conversion of a record from XML to its PDU */
+struct sdp_xml_pdu {
+	sdp_buf_t buf;			/* The PDU converted so far */
+	uint16_t attr_id;
+	int attr_pending;		/* No value for attr_id yet */
+	int depth;
+	struct {
+		uint8_t kind;
+		uint32_t offset;	/* Of the sequence header */
+	} stack[SDP_XML_MAX_DEPTH];
+};
+
+int sdp_xml_pdu_init(struct sdp_xml_pdu *pdu);
+int sdp_xml_pdu_finish(struct sdp_xml_pdu *pdu);
+void sdp_xml_pdu_free(struct sdp_xml_pdu *pdu);
+int sdp_xml_pdu_start(struct sdp_xml_pdu *pdu, const char *el,
+				const char **names, const char **values);
+int sdp_xml_pdu_end(struct sdp_xml_pdu *pdu, const char *el);
+
 #endif /* __SDP_XML_H */
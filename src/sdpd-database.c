@@ -33,6 +33,8 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 
+#include <glib.h>
+
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include <bluetooth/sdp.h>
@@ -42,15 +44,41 @@
 #include "log.h"
 #include "adapter.h"
 #include "manager.h"
+#include "memstat.h"
 
 static sdp_list_t *service_db;
 static sdp_list_t *access_db;
 
+/* handle -> record and handle -> access data */
+static GHashTable *record_hash;
+static GHashTable *access_hash;
+
 typedef struct {
 	uint32_t handle;
 	bdaddr_t device;
+	uint32_t size;		/* record bytes in the memory statistics */
 } sdp_access_t;
 
+struct uuid_entry {
+	sdp_list_t *head;
+	sdp_list_t *tail;
+	unsigned int count;
+};
+
+/*
+ * 128-bit UUID -> records having it in their pattern, restricted to the
+ * records visible through one local adapter. Patterns are filled in
+ * after a record got added, so these indexes are built on the first
+ * search through an adapter and dropped whenever the repository changes.
+ */
+struct uuid_index {
+	bdaddr_t device;
+	struct uuid_entry visible;
+	GHashTable *uuids;
+};
+
+static GSList *uuid_indexes;
+
 /*
  * Ordering function called when inserting a service record.
  * The service repository is a linked list in sorted order
@@ -84,7 +112,149 @@ static int access_sort(const void *r1, const void *r2)
 
 static void access_free(void *p)
 {
-	free(p);
+	sdp_access_t *a = p;
+
+	btd_memstat_sub(MEMSTAT_SDP_RECORDS, a->size);
+
+	free(a);
+}
+
+static int access_allowed(const sdp_access_t *a, const bdaddr_t *device)
+{
+	if (!a)
+		return 1;
+
+	if (bacmp(&a->device, device) &&
+			bacmp(&a->device, BDADDR_ANY) &&
+			bacmp(device, BDADDR_ANY))
+		return 0;
+
+	return 1;
+}
+
+static guint uuid128_hash(gconstpointer key)
+{
+	const uuid_t *uuid = key;
+	guint h = 0;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		h = h * 31 + uuid->value.uuid128.data[i];
+
+	return h;
+}
+
+static gboolean uuid128_equal(gconstpointer a, gconstpointer b)
+{
+	return sdp_uuid128_cmp(a, b) == 0;
+}
+
+static void uuid_entry_free(gpointer data)
+{
+	struct uuid_entry *entry = data;
+
+	sdp_list_free(entry->head, NULL);
+	g_free(entry);
+}
+
+static void uuid_entry_append(struct uuid_entry *entry, sdp_record_t *rec)
+{
+	sdp_list_t *node;
+
+	node = malloc(sizeof(sdp_list_t));
+	if (!node)
+		return;
+
+	node->data = rec;
+	node->next = NULL;
+
+	if (entry->tail)
+		entry->tail->next = node;
+	else
+		entry->head = node;
+	entry->tail = node;
+	entry->count++;
+}
+
+static void uuid_index_free(gpointer data, gpointer user_data)
+{
+	struct uuid_index *index = data;
+
+	g_hash_table_destroy(index->uuids);
+	sdp_list_free(index->visible.head, NULL);
+	g_free(index);
+}
+
+static struct uuid_index *uuid_index_build(const bdaddr_t *device)
+{
+	struct uuid_index *index;
+	sdp_list_t *p, *q;
+
+	index = g_new0(struct uuid_index, 1);
+	bacpy(&index->device, device);
+	index->uuids = g_hash_table_new_full(uuid128_hash, uuid128_equal,
+							NULL, uuid_entry_free);
+
+	/* service_db is sorted, so every entry ends up in handle order */
+	for (p = service_db; p; p = p->next) {
+		sdp_record_t *rec = p->data;
+		sdp_access_t *a = NULL;
+
+		if (access_hash)
+			a = g_hash_table_lookup(access_hash,
+						GUINT_TO_POINTER(rec->handle));
+
+		if (!access_allowed(a, device))
+			continue;
+
+		uuid_entry_append(&index->visible, rec);
+
+		for (q = rec->pattern; q; q = q->next) {
+			struct uuid_entry *entry;
+
+			entry = g_hash_table_lookup(index->uuids, q->data);
+			if (entry == NULL) {
+				entry = g_new0(struct uuid_entry, 1);
+				g_hash_table_insert(index->uuids, q->data,
+									entry);
+			}
+
+			uuid_entry_append(entry, rec);
+		}
+	}
+
+	uuid_indexes = g_slist_prepend(uuid_indexes, index);
+
+	return index;
+}
+
+static struct uuid_index *uuid_index_find(const bdaddr_t *device)
+{
+	GSList *l;
+
+	/* there is one index per adapter at most, plus the local one */
+	for (l = uuid_indexes; l; l = l->next) {
+		struct uuid_index *index = l->data;
+
+		if (bacmp(&index->device, device) == 0)
+			return index;
+	}
+
+	return uuid_index_build(device);
+}
+
+/*
+ * Must be called when the UUID pattern of a record in the repository
+ * changed after it got added
+ */
+void sdp_svcdb_changed(void)
+{
+	if (uuid_indexes == NULL)
+		return;
+
+	g_slist_foreach(uuid_indexes, uuid_index_free, NULL);
+	g_slist_free(uuid_indexes);
+	uuid_indexes = NULL;
 }
 
 /*
@@ -92,6 +262,18 @@ static void access_free(void *p)
  */
 void sdp_svcdb_reset(void)
 {
+	sdp_svcdb_changed();
+
+	if (record_hash) {
+		g_hash_table_destroy(record_hash);
+		record_hash = NULL;
+	}
+
+	if (access_hash) {
+		g_hash_table_destroy(access_hash);
+		access_hash = NULL;
+	}
+
 	sdp_list_free(service_db, (sdp_free_func_t) sdp_record_free);
 	sdp_list_free(access_db, access_free);
 }
@@ -165,6 +347,17 @@ void sdp_svcdb_set_collectable(sdp_record_t *record, int sock)
 	socket_index = sdp_list_insert_sorted(socket_index, item, compare_indices);
 }
 
+static inline uint32_t record_size(const sdp_record_t *rec)
+{
+	const uint8_t *pdu;
+	uint32_t len;
+
+	if (sdp_get_record_pdu(rec, &pdu, &len) < 0)
+		len = 0;
+
+	return sizeof(*rec) + len;
+}
+
 /*
  * Add a service record to the repository
  */
@@ -178,15 +371,31 @@ void sdp_record_add(const bdaddr_t *device, sdp_record_t *rec)
 
 	service_db = sdp_list_insert_sorted(service_db, rec, record_sort);
 
+	if (record_hash == NULL)
+		record_hash = g_hash_table_new(NULL, NULL);
+	g_hash_table_insert(record_hash, GUINT_TO_POINTER(rec->handle), rec);
+
+	sdp_svcdb_changed();
+
 	dev = malloc(sizeof(*dev));
 	if (!dev)
 		return;
 
 	bacpy(&dev->device, device);
 	dev->handle = rec->handle;
+	dev->size = 0;
+
+#ifdef MEMSTAT
+	dev->size = record_size(rec);
+	btd_memstat_add(MEMSTAT_SDP_RECORDS, dev->size);
+#endif
 
 	access_db = sdp_list_insert_sorted(access_db, dev, access_sort);
 
+	if (access_hash == NULL)
+		access_hash = g_hash_table_new(NULL, NULL);
+	g_hash_table_insert(access_hash, GUINT_TO_POINTER(dev->handle), dev);
+
 	if (bacmp(device, BDADDR_ANY) == 0) {
 		manager_foreach_adapter(adapter_service_insert, rec);
 		return;
@@ -197,31 +406,21 @@ void sdp_record_add(const bdaddr_t *device, sdp_record_t *rec)
 		adapter_service_insert(adapter, rec);
 }
 
-static sdp_list_t *record_locate(uint32_t handle)
+static sdp_record_t *record_locate(uint32_t handle)
 {
-	if (service_db) {
-		sdp_list_t *p;
-		sdp_record_t r;
-
-		r.handle = handle;
-		p = sdp_list_find(service_db, &r, record_sort);
-		return p;
-	}
+	if (record_hash)
+		return g_hash_table_lookup(record_hash,
+						GUINT_TO_POINTER(handle));
 
 	SDPDBG("Could not find svcRec for : 0x%x", handle);
 	return NULL;
 }
 
-static sdp_list_t *access_locate(uint32_t handle)
+static sdp_access_t *access_locate(uint32_t handle)
 {
-	if (access_db) {
-		sdp_list_t *p;
-		sdp_access_t a;
-
-		a.handle = handle;
-		p = sdp_list_find(access_db, &a, access_sort);
-		return p;
-	}
+	if (access_hash)
+		return g_hash_table_lookup(access_hash,
+						GUINT_TO_POINTER(handle));
 
 	SDPDBG("Could not find access data for : 0x%x", handle);
 	return NULL;
@@ -232,14 +431,14 @@ static sdp_list_t *access_locate(uint32_t handle)
  */
 sdp_record_t *sdp_record_find(uint32_t handle)
 {
-	sdp_list_t *p = record_locate(handle);
+	sdp_record_t *r = record_locate(handle);
 
-	if (!p) {
+	if (!r) {
 		SDPDBG("Couldn't find record for : 0x%x", handle);
 		return 0;
 	}
 
-	return p->data;
+	return r;
 }
 
 /*
@@ -247,24 +446,22 @@ sdp_record_t *sdp_record_find(uint32_t handle)
  */
 int sdp_record_remove(uint32_t handle)
 {
-	sdp_list_t *p = record_locate(handle);
-	sdp_record_t *r;
+	sdp_record_t *r = record_locate(handle);
 	sdp_access_t *a;
 
-	if (!p) {
+	if (!r) {
 		error("Remove : Couldn't find record for : 0x%x", handle);
 		return -1;
 	}
 
-	r = p->data;
-	if (r)
-		service_db = sdp_list_remove(service_db, r);
+	service_db = sdp_list_remove(service_db, r);
+	g_hash_table_remove(record_hash, GUINT_TO_POINTER(handle));
 
-	p = access_locate(handle);
-	if (p == NULL || p->data == NULL)
-		return 0;
+	sdp_svcdb_changed();
 
-	a = p->data;
+	a = access_locate(handle);
+	if (a == NULL)
+		return 0;
 
 	if (bacmp(&a->device, BDADDR_ANY) != 0) {
 		struct btd_adapter *adapter = manager_find_adapter(&a->device);
@@ -274,6 +471,7 @@ int sdp_record_remove(uint32_t handle)
 		manager_foreach_adapter(adapter_service_remove, r);
 
 	access_db = sdp_list_remove(access_db, a);
+	g_hash_table_remove(access_hash, GUINT_TO_POINTER(handle));
 	access_free(a);
 
 	return 0;
@@ -287,6 +485,36 @@ sdp_list_t *sdp_get_record_list(void)
 	return service_db;
 }
 
+/*
+ * Return the records visible through the given local adapter, in sorted
+ * order, which can match the search pattern: those having its least
+ * common UUID. The list belongs to the repository and is only valid
+ * until the repository changes.
+ */
+sdp_list_t *sdp_get_record_candidates(sdp_list_t *search,
+						const bdaddr_t *device)
+{
+	struct uuid_index *index = uuid_index_find(device);
+	struct uuid_entry *best = NULL;
+
+	if (search == NULL)
+		return index->visible.head;
+
+	for (; search; search = search->next) {
+		struct uuid_entry *entry;
+
+		/* the search UUIDs got their 128-bit form in extract_des */
+		entry = g_hash_table_lookup(index->uuids, search->data);
+		if (entry == NULL)
+			return NULL;
+
+		if (best == NULL || entry->count < best->count)
+			best = entry;
+	}
+
+	return best->head;
+}
+
 sdp_list_t *sdp_get_access_list(void)
 {
 	return access_db;
@@ -294,22 +522,7 @@ sdp_list_t *sdp_get_access_list(void)
 
 int sdp_check_access(uint32_t handle, bdaddr_t *device)
 {
-	sdp_list_t *p = access_locate(handle);
-	sdp_access_t *a;
-
-	if (!p)
-		return 1;
-
-	a = p->data;
-	if (!a)
-		return 1;
-
-	if (bacmp(&a->device, device) &&
-			bacmp(&a->device, BDADDR_ANY) &&
-			bacmp(device, BDADDR_ANY))
-		return 0;
-
-	return 1;
+	return access_allowed(access_locate(handle), device);
 }
 
 uint32_t sdp_next_handle(void)
@@ -44,6 +44,7 @@
 
 #include "sdpd.h"
 #include "log.h"
+#include "memstat.h"
 
 typedef struct {
 	uint32_t timestamp;
@@ -57,43 +58,187 @@ typedef struct {
 
 #define MIN(x, y) ((x) < (y)) ? (x): (y)
 
+/*
+ * Responses waiting for continuation requests. Clients may abandon them
+ * at any point, so the least recently used ones are evicted once either
+ * limit is reached. Such a client just gets SDP_INVALID_CSTATE.
+ */
+#define CSTATE_MAX_ENTRIES	64
+#define CSTATE_MAX_BYTES	(256 * 1024)
+#define CSTATE_BUCKETS		64
+
 typedef struct _sdp_cstate_list sdp_cstate_list_t;
 
 struct _sdp_cstate_list {
-	sdp_cstate_list_t *next;
+	sdp_cstate_list_t *next;	/* hash chain */
+	sdp_cstate_list_t *newer;
+	sdp_cstate_list_t *older;
+	int sock;
 	uint32_t timestamp;
 	sdp_buf_t buf;
 };
 
-static sdp_cstate_list_t *cstates;
+static sdp_cstate_list_t *cstates[CSTATE_BUCKETS];
+static sdp_cstate_list_t *cstate_newest;
+static sdp_cstate_list_t *cstate_oldest;
+static struct sdp_cstate_stats cstate_stats;
+
+static sdp_cstate_list_t **cstate_bucket(int sock, uint32_t timestamp)
+{
+	return &cstates[(timestamp * 31 + sock) % CSTATE_BUCKETS];
+}
 
-/* FIXME: should probably remove it when it's found */
-static sdp_buf_t *sdp_get_cached_rsp(sdp_cont_state_t *cstate)
+static sdp_cstate_list_t *cstate_lookup(int sock, uint32_t timestamp)
 {
 	sdp_cstate_list_t *p;
 
-	for (p = cstates; p; p = p->next)
-		if (p->timestamp == cstate->timestamp)
-			return &p->buf;
-	return 0;
+	for (p = *cstate_bucket(sock, timestamp); p; p = p->next)
+		if (p->sock == sock && p->timestamp == timestamp)
+			return p;
+
+	return NULL;
+}
+
+static void cstate_unlink(sdp_cstate_list_t *cstate)
+{
+	if (cstate->newer)
+		cstate->newer->older = cstate->older;
+	else
+		cstate_newest = cstate->older;
+
+	if (cstate->older)
+		cstate->older->newer = cstate->newer;
+	else
+		cstate_oldest = cstate->newer;
+}
+
+static void cstate_push(sdp_cstate_list_t *cstate)
+{
+	cstate->newer = NULL;
+	cstate->older = cstate_newest;
+
+	if (cstate_newest)
+		cstate_newest->newer = cstate;
+	else
+		cstate_oldest = cstate;
+
+	cstate_newest = cstate;
+}
+
+static void cstate_free(sdp_cstate_list_t *cstate)
+{
+	sdp_cstate_list_t **p;
+
+	for (p = cstate_bucket(cstate->sock, cstate->timestamp); *p;
+							p = &(*p)->next)
+		if (*p == cstate) {
+			*p = cstate->next;
+			break;
+		}
+
+	cstate_unlink(cstate);
+
+	cstate_stats.entries--;
+	cstate_stats.bytes -= cstate->buf.data_size;
+
+	btd_memstat_sub(MEMSTAT_SDP_CSTATES,
+				sizeof(*cstate) + cstate->buf.data_size);
+
+	free(cstate->buf.data);
+	free(cstate);
+}
+
+static sdp_buf_t *sdp_get_cached_rsp(int sock, sdp_cont_state_t *cstate)
+{
+	sdp_cstate_list_t *p = cstate_lookup(sock, cstate->timestamp);
+
+	if (p == NULL)
+		return NULL;
+
+	cstate_unlink(p);
+	cstate_push(p);
+
+	return &p->buf;
 }
 
-static uint32_t sdp_cstate_alloc_buf(sdp_buf_t *buf)
+/* The last part of the response got sent */
+static void sdp_release_cached_rsp(int sock, sdp_cont_state_t *cstate)
 {
-	sdp_cstate_list_t *cstate = malloc(sizeof(sdp_cstate_list_t));
-	uint8_t *data = malloc(buf->data_size);
+	sdp_cstate_list_t *p = cstate_lookup(sock, cstate->timestamp);
 
-	memcpy(data, buf->data, buf->data_size);
-	memset((char *)cstate, 0, sizeof(sdp_cstate_list_t));
-	cstate->buf.data = data;
+	if (p)
+		cstate_free(p);
+}
+
+static uint32_t sdp_cstate_alloc_buf(int sock, sdp_buf_t *buf)
+{
+	sdp_cstate_list_t *cstate, **bucket;
+	uint32_t timestamp;
+
+	while (cstate_oldest &&
+			(cstate_stats.entries >= CSTATE_MAX_ENTRIES ||
+			cstate_stats.bytes + buf->data_size > CSTATE_MAX_BYTES)) {
+		cstate_free(cstate_oldest);
+		cstate_stats.evictions++;
+	}
+
+	cstate = malloc(sizeof(sdp_cstate_list_t));
+	if (!cstate)
+		return 0;
+
+	cstate->buf.data = malloc(buf->data_size);
+	if (!cstate->buf.data) {
+		free(cstate);
+		return 0;
+	}
+
+	memcpy(cstate->buf.data, buf->data, buf->data_size);
 	cstate->buf.data_size = buf->data_size;
 	cstate->buf.buf_size = buf->data_size;
-	cstate->timestamp = sdp_get_time();
-	cstate->next = cstates;
-	cstates = cstate;
+
+	/* 0 means no continuation, and requests within a second must
+	 * still get their own state */
+	timestamp = sdp_get_time();
+	while (timestamp == 0 || cstate_lookup(sock, timestamp))
+		timestamp++;
+
+	cstate->sock = sock;
+	cstate->timestamp = timestamp;
+
+	bucket = cstate_bucket(sock, timestamp);
+	cstate->next = *bucket;
+	*bucket = cstate;
+	cstate_push(cstate);
+
+	cstate_stats.entries++;
+	cstate_stats.bytes += cstate->buf.data_size;
+
+	btd_memstat_add(MEMSTAT_SDP_CSTATES,
+				sizeof(*cstate) + cstate->buf.data_size);
+
 	return cstate->timestamp;
 }
 
+/*
+ * Drop the continuation states of a client going away
+ */
+void sdp_cstate_cleanup(int sock)
+{
+	sdp_cstate_list_t *p, *older;
+
+	for (p = cstate_newest; p; p = older) {
+		older = p->older;
+
+		if (p->sock == sock)
+			cstate_free(p);
+	}
+}
+
+void sdp_cstate_get_stats(struct sdp_cstate_stats *stats)
+{
+	*stats = cstate_stats;
+}
+
 /* Additional values for checking datatype (not in spec) */
 #define SDP_TYPE_UUID	0xfe
 #define SDP_TYPE_ATTRID	0xff
@@ -220,6 +365,8 @@ static int extract_des(uint8_t *buf, int len, sdp_list_t **svcReqSeq, uint8_t *p
 				free(pElem);
 				goto failed;
 			}
+			/* record patterns hold 128-bit UUIDs only */
+			sdp_uuid_extend((uuid_t *) pElem);
 			seqlen += localSeqLength;
 			p += localSeqLength;
 			bufsize -= localSeqLength;
@@ -328,16 +475,13 @@ static int sdp_match_uuid(sdp_list_t *search, sdp_list_t *pattern)
 	if (patlen < sdp_list_len(search))
 		return -1;
 	for (; search; search = search->next) {
-		uuid_t *uuid128;
 		void *data = search->data;
 		sdp_list_t *list;
 		if (data == NULL)
 			return -1;
 
-		/* create 128-bit form of the search UUID */
-		uuid128 = sdp_uuid_to_uuid128((uuid_t *)data);
-		list = sdp_list_find(pattern, uuid128, sdp_uuid128_cmp);
-		bt_free(uuid128);
+		/* the search UUIDs got their 128-bit form in extract_des */
+		list = sdp_list_find(pattern, data, sdp_uuid128_cmp);
 		if (!list)
 			return 0;
 	}
@@ -422,7 +566,8 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 	if (cstate == NULL) {
 		/* for every record in the DB, do a pattern search */
-		sdp_list_t *list = sdp_get_record_list();
+		sdp_list_t *list = sdp_get_record_candidates(pattern,
+								&req->device);
 
 		handleSize = 0;
 		for (; list && rsp_count < expected; list = list->next) {
@@ -430,8 +575,7 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 			SDPDBG("Checking svcRec : 0x%x", rec->handle);
 
-			if (sdp_match_uuid(pattern, rec->pattern) > 0 &&
-					sdp_check_access(rec->handle, &req->device)) {
+			if (sdp_match_uuid(pattern, rec->pattern) > 0) {
 				rsp_count++;
 				bt_put_unaligned(htonl(rec->handle), (uint32_t *)pdata);
 				pdata += sizeof(uint32_t);
@@ -447,7 +591,7 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 
 		if (rsp_count > actual) {
 			/* cache the rsp and generate a continuation state */
-			cStateId = sdp_cstate_alloc_buf(buf);
+			cStateId = sdp_cstate_alloc_buf(req->sock, buf);
 			/*
 			 * subtract handleSize since we now send only
 			 * a subset of handles
@@ -468,7 +612,7 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 			 * Get the previous sdp_cont_state_t and obtain
 			 * the cached rsp
 			 */
-			sdp_buf_t *pCache = sdp_get_cached_rsp(cstate);
+			sdp_buf_t *pCache = sdp_get_cached_rsp(req->sock, cstate);
 			if (pCache) {
 				pCacheBuffer = pCache->data;
 				/* get the rsp_count from the cached buffer */
@@ -514,6 +658,8 @@ static int service_search_req(sdp_req_t *req, sdp_buf_t *buf)
 		if (i == rsp_count) {
 			/* set "null" continuationState */
 			sdp_set_cstate_pdu(buf, NULL);
+			if (cstate)
+				sdp_release_cached_rsp(req->sock, cstate);
 		} else {
 			/*
 			 * there's more: set lastIndexSent to
@@ -549,21 +695,45 @@ done:
  * requested identifiers are present in the PDU form of
  * the request
  */
-static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
+#define ATTR_KEY_MAX 32
+
+/*
+ * Build the key the serialized attributes are cached under in the
+ * record: the requested ranges, single attributes being a range of one.
+ * Returns the key length or 0 if the request can't be cached.
+ */
+static uint32_t attr_cache_key(sdp_list_t *seq, uint32_t *key)
 {
-	sdp_buf_t pdu;
+	int n = 0;
 
-	if (!rec)
-		return SDP_INVALID_RECORD_HANDLE;
+	for (; seq; seq = seq->next) {
+		struct attrid *aid = seq->data;
+		uint32_t range;
 
-	if (seq == NULL) {
-		SDPDBG("Attribute sequence is NULL");
-		return 0;
+		if (n == ATTR_KEY_MAX)
+			return 0;
+
+		if (aid->dtd == SDP_UINT16) {
+			uint16_t attr = bt_get_unaligned(&aid->uint16);
+			range = (attr << 16) | attr;
+		} else if (aid->dtd == SDP_UINT32) {
+			range = bt_get_unaligned(&aid->uint32);
+			/* the full record has its own cache */
+			if (range == 0x0000ffff)
+				return 0;
+		} else
+			return 0;
+
+		key[n++] = range;
 	}
 
-	SDPDBG("Entries in attr seq : %d", sdp_list_len(seq));
+	return n * sizeof(uint32_t);
+}
 
-	sdp_gen_record_pdu(rec, &pdu);
+static int gen_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
+{
+	sdp_list_t *l = rec->attrlist;
+	int last = -1;
 
 	for (; seq; seq = seq->next) {
 		struct attrid *aid = seq->data;
@@ -577,43 +747,91 @@ static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
 				sdp_append_to_pdu(buf, a);
 		} else if (aid->dtd == SDP_UINT32) {
 			uint32_t range = bt_get_unaligned((uint32_t *)&aid->uint32);
-			uint16_t attr;
 			uint16_t low = (0xffff0000 & range) >> 16;
 			uint16_t high = 0x0000ffff & range;
+			const uint8_t *pdu;
+			uint32_t len;
 			sdp_data_t *data;
 
 			SDPDBG("attr range : 0x%x", range);
 			SDPDBG("Low id : 0x%x", low);
 			SDPDBG("High id : 0x%x", high);
 
-			if (low == 0x0000 && high == 0xffff && pdu.data_size <= buf->buf_size) {
-				/* copy it */
-				memcpy(buf->data, pdu.data, pdu.data_size);
-				buf->data_size = pdu.data_size;
+			/* the serialized record is cached, copy it */
+			if (low == 0x0000 && high == 0xffff &&
+					sdp_get_record_pdu(rec, &pdu, &len) == 0 &&
+					len <= buf->buf_size) {
+				memcpy(buf->data, pdu, len);
+				buf->data_size = len;
 				break;
 			}
-			/* (else) sub-range of attributes */
-			for (attr = low; attr < high; attr++) {
-				data = sdp_data_get(rec, attr);
-				if (data)
+			/*
+			 * (else) sub-range of attributes, attrlist is sorted.
+			 * Ranges come in ascending order, so the walk goes on
+			 * from where the previous range stopped.
+			 */
+			if (low <= last)
+				l = rec->attrlist;
+
+			for (; l; l = l->next) {
+				data = l->data;
+				if (data->attrId > high)
+					break;
+				if (data->attrId >= low)
 					sdp_append_to_pdu(buf, data);
 			}
-			data = sdp_data_get(rec, high);
-			if (data)
-				sdp_append_to_pdu(buf, data);
+
+			last = high;
 		} else {
 			error("Unexpected data type : 0x%x", aid->dtd);
 			error("Expect uint16_t or uint32_t");
-			free(pdu.data);
 			return SDP_INVALID_SYNTAX;
 		}
 	}
 
-	free(pdu.data);
-
 	return 0;
 }
 
+/*
+ * Generate the attribute list for the requested ranges. Repeated
+ * requests into an empty buffer are answered from the record's cache.
+ */
+static int extract_attrs(sdp_record_t *rec, sdp_list_t *seq, sdp_buf_t *buf)
+{
+	uint32_t key[ATTR_KEY_MAX], key_len = 0;
+	const uint8_t *data;
+	uint32_t len;
+	int status;
+
+	if (!rec)
+		return SDP_INVALID_RECORD_HANDLE;
+
+	if (seq == NULL) {
+		SDPDBG("Attribute sequence is NULL");
+		return 0;
+	}
+
+	SDPDBG("Entries in attr seq : %d", sdp_list_len(seq));
+
+	if (buf->data_size == 0)
+		key_len = attr_cache_key(seq, key);
+
+	if (key_len > 0 &&
+			sdp_record_cache_get(rec, key, key_len, &data, &len) == 0 &&
+			len <= buf->buf_size) {
+		memcpy(buf->data, data, len);
+		buf->data_size = len;
+		return 0;
+	}
+
+	status = gen_attrs(rec, seq, buf);
+	if (status == 0 && key_len > 0)
+		sdp_record_cache_set(rec, key, key_len, buf->data,
+							buf->data_size);
+
+	return status;
+}
+
 /*
  * A request for the attributes of a service record.
  * First check if the service record (specified by
@@ -709,7 +927,7 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 	buf->buf_size -= sizeof(uint16_t);
 
 	if (cstate) {
-		sdp_buf_t *pCache = sdp_get_cached_rsp(cstate);
+		sdp_buf_t *pCache = sdp_get_cached_rsp(req->sock, cstate);
 
 		SDPDBG("Obtained cached rsp : %p", pCache);
 
@@ -722,9 +940,10 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 
 			SDPDBG("Response size : %d sending now : %d bytes sent so far : %d",
 				pCache->data_size, sent, cstate->cStateValue.maxBytesSent);
-			if (cstate->cStateValue.maxBytesSent == pCache->data_size)
+			if (cstate->cStateValue.maxBytesSent == pCache->data_size) {
 				cstate_size = sdp_set_cstate_pdu(buf, NULL);
-			else
+				sdp_release_cached_rsp(req->sock, cstate);
+			} else
 				cstate_size = sdp_set_cstate_pdu(buf, cstate);
 		} else {
 			status = SDP_INVALID_CSTATE;
@@ -737,7 +956,7 @@ static int service_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 			sdp_cont_state_t newState;
 
 			memset((char *)&newState, 0, sizeof(sdp_cont_state_t));
-			newState.timestamp = sdp_cstate_alloc_buf(buf);
+			newState.timestamp = sdp_cstate_alloc_buf(req->sock, buf);
 			/*
 			 * Reset the buffer size to the maximum expected and
 			 * set the sdp_cont_state_t
@@ -845,7 +1064,7 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 		goto done;
 	}
 
-	svcList = sdp_get_record_list();
+	svcList = sdp_get_record_candidates(pattern, &req->device);
 
 	tmpbuf.data = malloc(USHRT_MAX);
 	tmpbuf.data_size = 0;
@@ -867,8 +1086,7 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 		sdp_list_t *p;
 		for (p = svcList; p; p = p->next) {
 			sdp_record_t *rec = p->data;
-			if (sdp_match_uuid(pattern, rec->pattern) > 0 &&
-					sdp_check_access(rec->handle, &req->device)) {
+			if (sdp_match_uuid(pattern, rec->pattern) > 0) {
 				rsp_count++;
 				status = extract_attrs(rec, seq, &tmpbuf);
 
@@ -894,7 +1112,7 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 			sdp_cont_state_t newState;
 
 			memset((char *)&newState, 0, sizeof(sdp_cont_state_t));
-			newState.timestamp = sdp_cstate_alloc_buf(buf);
+			newState.timestamp = sdp_cstate_alloc_buf(req->sock, buf);
 			/*
 			 * Reset the buffer size to the maximum expected and
 			 * set the sdp_cont_state_t
@@ -906,16 +1124,17 @@ static int service_search_attr_req(sdp_req_t *req, sdp_buf_t *buf)
 			cstate_size = sdp_set_cstate_pdu(buf, NULL);
 	} else {
 		/* continuation State exists -> get from cache */
-		sdp_buf_t *pCache = sdp_get_cached_rsp(cstate);
+		sdp_buf_t *pCache = sdp_get_cached_rsp(req->sock, cstate);
 		if (pCache) {
 			uint16_t sent = MIN(max, pCache->data_size - cstate->cStateValue.maxBytesSent);
 			pResponse = pCache->data;
 			memcpy(buf->data, pResponse + cstate->cStateValue.maxBytesSent, sent);
 			buf->data_size += sent;
 			cstate->cStateValue.maxBytesSent += sent;
-			if (cstate->cStateValue.maxBytesSent == pCache->data_size)
+			if (cstate->cStateValue.maxBytesSent == pCache->data_size) {
 				cstate_size = sdp_set_cstate_pdu(buf, NULL);
-			else
+				sdp_release_cached_rsp(req->sock, cstate);
+			} else
 				cstate_size = sdp_set_cstate_pdu(buf, cstate);
 		} else {
 			status = SDP_INVALID_CSTATE;
@@ -955,18 +1174,22 @@ done:
  * function based on request type. Handles service registration
  * client requests also.
  */
-static void process_request(sdp_req_t *req)
+static void process_request(sdp_req_t *req, uint8_t *buf)
 {
 	sdp_pdu_hdr_t *reqhdr = (sdp_pdu_hdr_t *)req->buf;
 	sdp_pdu_hdr_t *rsphdr;
 	sdp_buf_t rsp;
-	uint8_t *buf = malloc(USHRT_MAX);
 	int status = SDP_INVALID_SYNTAX;
 
-	memset(buf, 0, USHRT_MAX);
+	/*
+	 * The buffer is reused, but only its start is ever read before
+	 * being written: sdp_append_to_buf() needs a zero type byte to
+	 * open the attribute list sequence.
+	 */
+	memset(buf, 0, sizeof(sdp_pdu_hdr_t) + 16);
 	rsp.data = buf + sizeof(sdp_pdu_hdr_t);
 	rsp.data_size = 0;
-	rsp.buf_size = USHRT_MAX - sizeof(sdp_pdu_hdr_t);
+	rsp.buf_size = SDP_RSP_BUF_SIZE - sizeof(sdp_pdu_hdr_t);
 	rsphdr = (sdp_pdu_hdr_t *)buf;
 
 	if (ntohs(reqhdr->plen) != req->len - sizeof(sdp_pdu_hdr_t)) {
@@ -1038,12 +1261,9 @@ send_rsp:
 		error("send: %s (%d)", strerror(errno), errno);
 
 	SDPDBG("Bytes Sent : %d", sent);
-
-	free(rsp.data);
-	free(req->buf);
 }
 
-void handle_request(int sk, uint8_t *data, int len)
+void handle_request(int sk, uint8_t *data, int len, uint8_t *rsp)
 {
 	struct sockaddr_l2 sa;
 	socklen_t size;
@@ -1089,5 +1309,5 @@ void handle_request(int sk, uint8_t *data, int len)
 	req.buf  = data;
 	req.len  = len;
 
-	process_request(&req);
+	process_request(&req, rsp);
 }
@@ -51,8 +51,20 @@
 
 static guint l2cap_id = 0, unix_id = 0;
 
+/* Main loop priority of the client sessions */
+static gint session_priority = G_PRIORITY_DEFAULT;
+
 static int l2cap_sock, unix_sock;
 
+/* Responses are built in place, one request is handled at a time */
+static uint8_t *rsp_buf;
+
+struct sdp_client {
+	int stream;		/* no packet boundaries on the unix socket */
+	uint8_t *buf;
+	int size;
+};
+
 /*
  * SDP server initialization on startup includes creating the
  * l2cap and unix sockets over which discovery and registration clients
@@ -162,10 +174,18 @@ static int init_server(uint16_t mtu, int master, int compat)
         return 0;
 }
 
+static void client_free(gpointer data)
+{
+	struct sdp_client *client = data;
+
+	g_free(client->buf);
+	g_free(client);
+}
+
 static gboolean io_session_event(GIOChannel *chan, GIOCondition cond, gpointer data)
 {
+	struct sdp_client *client = data;
 	sdp_pdu_hdr_t hdr;
-	uint8_t *buf;
 	int sk, len, size;
 
 	if (cond & G_IO_NVAL)
@@ -173,36 +193,44 @@ static gboolean io_session_event(GIOChannel *chan, GIOCondition cond, gpointer d
 
 	sk = g_io_channel_unix_get_fd(chan);
 
-	if (cond & (G_IO_HUP | G_IO_ERR)) {
-		sdp_svcdb_collect_all(sk);
-		return FALSE;
-	}
+	if (cond & (G_IO_HUP | G_IO_ERR))
+		goto failed;
 
-	len = recv(sk, &hdr, sizeof(sdp_pdu_hdr_t), MSG_PEEK);
-	if (len <= 0) {
-		sdp_svcdb_collect_all(sk);
-		return FALSE;
-	}
+	if (client->stream) {
+		len = recv(sk, &hdr, sizeof(sdp_pdu_hdr_t), MSG_PEEK);
+		if (len <= 0)
+			goto failed;
 
-	size = sizeof(sdp_pdu_hdr_t) + ntohs(hdr.plen);
-	buf = malloc(size);
-	if (!buf)
-		return TRUE;
+		size = sizeof(sdp_pdu_hdr_t) + ntohs(hdr.plen);
+		if (size > client->size) {
+			g_free(client->buf);
+			client->buf = g_malloc(size);
+			client->size = size;
+		}
+	} else
+		size = client->size;
 
-	len = recv(sk, buf, size, 0);
-	if (len <= 0) {
-		sdp_svcdb_collect_all(sk);
-		free(buf);
-		return FALSE;
-	}
+	/* L2CAP keeps the PDU boundaries, a single read is a request */
+	len = recv(sk, client->buf, size, 0);
+	if (len <= 0)
+		goto failed;
 
-	handle_request(sk, buf, len);
+	if (rsp_buf == NULL)
+		rsp_buf = g_malloc(SDP_RSP_BUF_SIZE);
+
+	handle_request(sk, client->buf, len, rsp_buf);
 
 	return TRUE;
+
+failed:
+	sdp_svcdb_collect_all(sk);
+	sdp_cstate_cleanup(sk);
+	return FALSE;
 }
 
 static gboolean io_accept_event(GIOChannel *chan, GIOCondition cond, gpointer data)
 {
+	struct sdp_client *client;
 	GIOChannel *io;
 	int nsk;
 
@@ -227,11 +255,33 @@ static gboolean io_accept_event(GIOChannel *chan, GIOCondition cond, gpointer da
 		return TRUE;
 	}
 
+	client = g_new0(struct sdp_client, 1);
+
+	if (data == &l2cap_sock) {
+		struct l2cap_options opts;
+		socklen_t optlen = sizeof(opts);
+
+		/* Requests can't be larger than the negotiated MTU */
+		memset(&opts, 0, sizeof(opts));
+		if (getsockopt(nsk, SOL_L2CAP, L2CAP_OPTIONS, &opts,
+							&optlen) < 0 ||
+						opts.imtu < L2CAP_DEFAULT_MTU)
+			opts.imtu = L2CAP_DEFAULT_MTU;
+
+		client->size = opts.imtu;
+	} else {
+		client->stream = 1;
+		client->size = L2CAP_DEFAULT_MTU;
+	}
+
+	client->buf = g_malloc(client->size);
+
 	io = g_io_channel_unix_new(nsk);
 	g_io_channel_set_close_on_unref(io, TRUE);
 
-	g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-					io_session_event, data);
+	g_io_add_watch_full(io, session_priority,
+					G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+					io_session_event, client, client_free);
 
 	g_io_channel_unref(io);
 
@@ -246,6 +296,13 @@ int start_sdp_server(uint16_t mtu, const char *did, uint32_t flags)
 
 	info("Starting SDP server");
 
+	/* Requests pending on any adapter are only served once no HCI
+	 * or D-Bus event is waiting, one request per dispatch */
+	if (flags & SDP_SERVER_LOW_PRIORITY)
+		session_priority = G_PRIORITY_DEFAULT_IDLE;
+	else
+		session_priority = G_PRIORITY_DEFAULT;
+
 	if (init_server(mtu, master, compat) < 0) {
 		error("Server initialization failed");
 		return -1;
@@ -288,8 +345,14 @@ int start_sdp_server(uint16_t mtu, const char *did, uint32_t flags)
 
 void stop_sdp_server(void)
 {
+	struct sdp_cstate_stats stats;
+
 	info("Stopping SDP server");
 
+	sdp_cstate_get_stats(&stats);
+	DBG("%u continuation states (%zu bytes) left, %lu evicted",
+				stats.entries, stats.bytes, stats.evictions);
+
 	sdp_svcdb_reset();
 
 	if (unix_id > 0)
@@ -300,4 +363,7 @@ void stop_sdp_server(void)
 
 	l2cap_id = unix_id = 0;
 	l2cap_sock = unix_sock = -1;
+
+	g_free(rsp_buf);
+	rsp_buf = NULL;
 }
@@ -91,6 +91,8 @@ static void update_db_timestamp(void)
 	uint32_t dbts = sdp_get_time();
 	sdp_data_t *d = sdp_data_alloc(SDP_UINT32, &dbts);
 	sdp_attr_replace(server, SDP_ATTR_SVCDB_STATE, d);
+
+	sdp_svcdb_changed();
 }
 
 void register_public_browse_group(void)
@@ -114,6 +116,8 @@ void register_public_browse_group(void)
 	sdp_uuid16_create(&pbgid, PUBLIC_BROWSE_GROUP);
 	sdp_attr_add_new(browse, SDP_ATTR_GROUP_ID,
 				SDP_UUID16, &pbgid.value.uuid16);
+
+	sdp_svcdb_changed();
 }
 
 /*
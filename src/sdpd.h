@@ -45,7 +45,19 @@ typedef struct request {
 	int      len;
 } sdp_req_t;
 
-void handle_request(int sk, uint8_t *data, int len);
+/* Size of the response buffer handed to handle_request() */
+#define SDP_RSP_BUF_SIZE	0xffff
+
+void handle_request(int sk, uint8_t *data, int len, uint8_t *rsp);
+
+struct sdp_cstate_stats {
+	unsigned int entries;
+	size_t bytes;
+	unsigned long evictions;
+};
+
+void sdp_cstate_cleanup(int sock);
+void sdp_cstate_get_stats(struct sdp_cstate_stats *stats);
 
 int service_register_req(sdp_req_t *req, sdp_buf_t *rsp);
 int service_update_req(sdp_req_t *req, sdp_buf_t *rsp);
@@ -65,6 +77,9 @@ sdp_record_t *sdp_record_find(uint32_t handle);
 void sdp_record_add(const bdaddr_t *device, sdp_record_t *rec);
 int sdp_record_remove(uint32_t handle);
 sdp_list_t *sdp_get_record_list(void);
+sdp_list_t *sdp_get_record_candidates(sdp_list_t *search,
+						const bdaddr_t *device);
+void sdp_svcdb_changed(void);
 sdp_list_t *sdp_get_access_list(void);
 int sdp_check_access(uint32_t handle, bdaddr_t *device);
 uint32_t sdp_next_handle(void);
@@ -73,6 +88,7 @@ uint32_t sdp_get_time(void);
 
 #define SDP_SERVER_COMPAT (1 << 0)
 #define SDP_SERVER_MASTER (1 << 1)
+#define SDP_SERVER_LOW_PRIORITY (1 << 2)
 
 int start_sdp_server(uint16_t mtu, const char *did, uint32_t flags);
 void stop_sdp_server(void);
@@ -26,14 +26,18 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
+#include <dlfcn.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <sys/socket.h>
@@ -48,13 +52,126 @@
 #include "adapter.h"
 #include "device.h"
 #include "glib-helper.h"
+#include "log.h"
 #include "storage.h"
 
+#ifndef HAVE_FDATASYNC
+#define fdatasync fsync
+#endif
+
+/* Seconds deferred writes may stay in memory */
+#define STORAGE_FLUSH_TIMEOUT	10
+
+/* Storage operations taking longer are logged, in usec */
+#define STORAGE_SLOW_OPERATION	(100 * 1000)
+
 struct match {
 	GSList *keys;
 	char *pattern;
 };
 
+static guint flush_id = 0;
+
+static GSList *key_stores = NULL;
+
+static GSList *device_caches = NULL;
+
+static void key_store_free(gpointer data);
+static void device_cache_free(gpointer data);
+
+static gboolean flush_timeout(gpointer user_data)
+{
+	/* Retried on the next timeout if anything could not be written */
+	if (textfile_cache_flush() < 0)
+		return TRUE;
+
+	flush_id = 0;
+
+	return FALSE;
+}
+
+static void schedule_flush(void)
+{
+	if (flush_id > 0)
+		return;
+
+	flush_id = g_timeout_add_seconds(STORAGE_FLUSH_TIMEOUT,
+						flush_timeout, NULL);
+}
+
+static void slow_operation(const char *pathname, const char *op,
+					unsigned int usec, const void *caller)
+{
+	Dl_info dli;
+
+	if (caller && dladdr(caller, &dli) && dli.dli_sname)
+		info("Storage %s of %s took %u ms, from %s()", op, pathname,
+						usec / 1000, dli.dli_sname);
+	else if (caller)
+		info("Storage %s of %s took %u ms, from %p", op, pathname,
+							usec / 1000, caller);
+	else
+		info("Storage %s of %s took %u ms", op, pathname,
+							usec / 1000);
+}
+
+void storage_init(void)
+{
+	textfile_cache_enable();
+	textfile_cache_defer(schedule_flush);
+	textfile_stats_enable(STORAGE_SLOW_OPERATION, slow_operation);
+}
+
+static void dump_file_stats(const char *pathname,
+			const struct textfile_stats *stats, void *user_data)
+{
+	info("%s: %lu reads, %lu writes, %lu deferred, %lu foreach, "
+			"%lu flushes", pathname, stats->reads, stats->writes,
+			stats->deferred, stats->iterations, stats->flushes);
+
+	info("%s: %llu bytes written, busy %llu ms, lock wait %llu ms, "
+			"p99 %u us, max %u us", pathname, stats->written,
+			stats->busy / 1000, stats->lock_wait / 1000,
+			textfile_stats_percentile(stats, 99), stats->max);
+}
+
+void storage_dump_stats(void)
+{
+	info("Storage statistics, most recently used files first");
+
+	textfile_stats_foreach(dump_file_stats, NULL);
+}
+
+void storage_flush(void)
+{
+	if (flush_id > 0) {
+		g_source_remove(flush_id);
+		flush_id = 0;
+	}
+
+	if (textfile_cache_flush() < 0)
+		schedule_flush();
+}
+
+void storage_cleanup(void)
+{
+	if (flush_id > 0) {
+		g_source_remove(flush_id);
+		flush_id = 0;
+	}
+
+	g_slist_foreach(key_stores, (GFunc) key_store_free, NULL);
+	g_slist_free(key_stores);
+	key_stores = NULL;
+
+	g_slist_foreach(device_caches, (GFunc) device_cache_free, NULL);
+	g_slist_free(device_caches);
+	device_caches = NULL;
+
+	textfile_cache_disable();
+	textfile_stats_disable();
+}
+
 static inline int create_filename(char *buf, size_t size,
 				const bdaddr_t *bdaddr, const char *name)
 {
@@ -65,6 +182,191 @@ static inline int create_filename(char *buf, size_t size,
 	return create_name(buf, size, STORAGEDIR, addr, name);
 }
 
+/*
+ * Information refreshed for every device found during discovery is
+ * written behind, coalescing the updates of each file into one rewrite.
+ */
+static int write_found_info(const char *filename, const char *key,
+							const char *value)
+{
+	if (textfile_put_deferred(filename, key, value) == 0)
+		return 0;
+
+	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	return textfile_put(filename, key, value);
+}
+
+/*
+ * What gets looked up for every device found is kept in memory per
+ * adapter: loaded from the names, namestamps, aliases and features files
+ * on first use and updated by the writers below, so that discovery does
+ * not go to the filesystem.
+ */
+struct device_cache {
+	bdaddr_t local;
+	GHashTable *devices;
+};
+
+static void cached_device_free(gpointer data)
+{
+	struct cached_device *dev = data;
+
+	g_free(dev->name);
+	g_free(dev->alias);
+	g_free(dev);
+}
+
+static void device_cache_free(gpointer data)
+{
+	struct device_cache *cache = data;
+
+	g_hash_table_destroy(cache->devices);
+	g_free(cache);
+}
+
+static struct cached_device *cached_device_get(struct device_cache *cache,
+							const bdaddr_t *peer)
+{
+	struct cached_device *dev;
+
+	dev = g_hash_table_lookup(cache->devices, peer);
+	if (dev)
+		return dev;
+
+	dev = g_new0(struct cached_device, 1);
+	bacpy(&dev->bdaddr, peer);
+	g_hash_table_insert(cache->devices, &dev->bdaddr, dev);
+
+	return dev;
+}
+
+static struct cached_device *cached_device_raw(struct device_cache *cache,
+						const char *key, size_t keylen)
+{
+	char addr[18];
+	bdaddr_t peer;
+
+	if (keylen != 17)
+		return NULL;
+
+	memcpy(addr, key, keylen);
+	addr[keylen] = '\0';
+	str2ba(addr, &peer);
+
+	return cached_device_get(cache, &peer);
+}
+
+static void load_cached_name(const char *key, size_t keylen,
+				const char *value, size_t valuelen, void *data)
+{
+	struct cached_device *dev = cached_device_raw(data, key, keylen);
+
+	if (dev == NULL)
+		return;
+
+	g_free(dev->name);
+	dev->name = g_strndup(value, MIN(valuelen, 248));
+}
+
+static void load_cached_stamp(const char *key, size_t keylen,
+				const char *value, size_t valuelen, void *data)
+{
+	struct cached_device *dev = cached_device_raw(data, key, keylen);
+	char str[21];
+
+	if (dev == NULL)
+		return;
+
+	memcpy(str, value, MIN(valuelen, sizeof(str) - 1));
+	str[MIN(valuelen, sizeof(str) - 1)] = '\0';
+
+	dev->name_time = strtoul(str, NULL, 10);
+}
+
+static void load_cached_alias(const char *key, size_t keylen,
+				const char *value, size_t valuelen, void *data)
+{
+	struct cached_device *dev = cached_device_raw(data, key, keylen);
+
+	if (dev == NULL)
+		return;
+
+	g_free(dev->alias);
+	dev->alias = g_strndup(value, valuelen);
+}
+
+static int decode_bytes(const char *str, unsigned char *bytes, size_t len);
+
+static void load_cached_features(const char *key, size_t keylen,
+				const char *value, size_t valuelen, void *data)
+{
+	struct cached_device *dev;
+	char str[17];
+
+	/* Only the first page, the second one is not needed for lookups */
+	if (valuelen < 16)
+		return;
+
+	dev = cached_device_raw(data, key, keylen);
+	if (dev == NULL)
+		return;
+
+	memcpy(str, value, 16);
+	str[16] = '\0';
+
+	if (decode_bytes(str, dev->features, 8) == 0)
+		dev->features_known = TRUE;
+}
+
+static struct device_cache *device_cache_get(const bdaddr_t *local)
+{
+	char filename[PATH_MAX + 1];
+	struct device_cache *cache;
+	GSList *l;
+
+	for (l = device_caches; l; l = l->next) {
+		cache = l->data;
+
+		if (bacmp(&cache->local, local) == 0)
+			return cache;
+	}
+
+	cache = g_new0(struct device_cache, 1);
+	bacpy(&cache->local, local);
+	cache->devices = g_hash_table_new_full(bt_bdaddr_hash, bt_bdaddr_equal,
+						NULL, cached_device_free);
+
+	create_filename(filename, PATH_MAX, local, "names");
+	textfile_foreach_raw(filename, load_cached_name, cache);
+
+	create_filename(filename, PATH_MAX, local, "namestamps");
+	textfile_foreach_raw(filename, load_cached_stamp, cache);
+
+	create_filename(filename, PATH_MAX, local, "aliases");
+	textfile_foreach_raw(filename, load_cached_alias, cache);
+
+	create_filename(filename, PATH_MAX, local, "features");
+	textfile_foreach_raw(filename, load_cached_features, cache);
+
+	device_caches = g_slist_prepend(device_caches, cache);
+
+	return cache;
+}
+
+void storage_load_devices(bdaddr_t *local)
+{
+	device_cache_get(local);
+}
+
+const struct cached_device *read_cached_device(bdaddr_t *local,
+							bdaddr_t *peer)
+{
+	struct device_cache *cache = device_cache_get(local);
+
+	return g_hash_table_lookup(cache->devices, peer);
+}
+
 int read_device_alias(const char *src, const char *dst, char *alias, size_t size)
 {
 	char filename[PATH_MAX + 1], *tmp;
@@ -86,12 +388,26 @@ int read_device_alias(const char *src, const char *dst, char *alias, size_t size
 int write_device_alias(const char *src, const char *dst, const char *alias)
 {
 	char filename[PATH_MAX + 1];
+	struct cached_device *dev;
+	bdaddr_t local, peer;
+	int err;
 
 	create_name(filename, PATH_MAX, STORAGEDIR, src, "aliases");
 
 	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
-	return textfile_put(filename, dst, alias);
+	err = textfile_put(filename, dst, alias);
+	if (err < 0)
+		return err;
+
+	str2ba(src, &local);
+	str2ba(dst, &peer);
+
+	dev = cached_device_get(device_cache_get(&local), &peer);
+	g_free(dev->alias);
+	dev->alias = g_strdup(alias);
+
+	return 0;
 }
 
 int write_discoverable_timeout(bdaddr_t *bdaddr, int timeout)
@@ -291,12 +607,10 @@ int write_remote_class(bdaddr_t *local, bdaddr_t *peer, uint32_t class)
 
 	create_filename(filename, PATH_MAX, local, "classes");
 
-	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
 	ba2str(peer, addr);
 	sprintf(str, "0x%6.6x", class);
 
-	return textfile_put(filename, addr, str);
+	return write_found_info(filename, addr, str);
 }
 
 int read_remote_class(bdaddr_t *local, bdaddr_t *peer, uint32_t *class)
@@ -324,7 +638,9 @@ int read_remote_class(bdaddr_t *local, bdaddr_t *peer, uint32_t *class)
 int write_device_name(bdaddr_t *local, bdaddr_t *peer, char *name)
 {
 	char filename[PATH_MAX + 1], addr[18], str[249];
-	int i;
+	struct cached_device *dev;
+	time_t now;
+	int i, err;
 
 	memset(str, 0, sizeof(str));
 	for (i = 0; i < 248 && name[i]; i++)
@@ -335,10 +651,26 @@ int write_device_name(bdaddr_t *local, bdaddr_t *peer, char *name)
 
 	create_filename(filename, PATH_MAX, local, "names");
 
-	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
 	ba2str(peer, addr);
-	return textfile_put(filename, addr, str);
+	err = write_found_info(filename, addr, str);
+	if (err < 0)
+		return err;
+
+	now = time(NULL);
+
+	dev = cached_device_get(device_cache_get(local), peer);
+	if (g_strcmp0(dev->name, str) != 0) {
+		g_free(dev->name);
+		dev->name = g_strdup(str);
+	}
+	dev->name_time = now;
+
+	/* When the name was last learned, to tell when it needs refreshing */
+	create_filename(filename, PATH_MAX, local, "namestamps");
+
+	snprintf(str, sizeof(str), "%lu", (unsigned long) now);
+
+	return write_found_info(filename, addr, str);
 }
 
 int read_device_name(const char *src, const char *dst, char *name)
@@ -373,10 +705,8 @@ int write_remote_eir(bdaddr_t *local, bdaddr_t *peer, uint8_t *data)
 
 	create_filename(filename, PATH_MAX, local, "eir");
 
-	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-
 	ba2str(peer, addr);
-	return textfile_put(filename, addr, str);
+	return write_found_info(filename, addr, str);
 }
 
 int read_remote_eir(bdaddr_t *local, bdaddr_t *peer, uint8_t *data)
@@ -455,6 +785,14 @@ int write_features_info(bdaddr_t *local, bdaddr_t *peer,
 
 	free(old_value);
 
+	if (page1) {
+		struct cached_device *dev;
+
+		dev = cached_device_get(device_cache_get(local), peer);
+		memcpy(dev->features, page1, 8);
+		dev->features_known = TRUE;
+	}
+
 	return textfile_put(filename, addr, str);
 }
 
@@ -480,63 +818,465 @@ int read_remote_features(bdaddr_t *local, bdaddr_t *peer,
 	if (page1 == NULL && page2 == NULL)
 		return -EINVAL;
 
-	create_filename(filename, PATH_MAX, local, "features");
+	create_filename(filename, PATH_MAX, local, "features");
+
+	ba2str(peer, addr);
+
+	str = textfile_get(filename, addr);
+	if (!str)
+		return -ENOENT;
+
+	len = strlen(str);
+
+	err = -ENOENT;
+
+	if (page1 && len >= 16)
+		err = decode_bytes(str, page1, 8);
+
+	if (page2 && len >= 33)
+		err = decode_bytes(str + 17, page2, 8);
+
+	free(str);
+
+	return err;
+}
+
+int write_lastseen_info(bdaddr_t *local, bdaddr_t *peer, struct tm *tm)
+{
+	char filename[PATH_MAX + 1], addr[18], str[24];
+
+	memset(str, 0, sizeof(str));
+	strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S %Z", tm);
+
+	create_filename(filename, PATH_MAX, local, "lastseen");
+
+	ba2str(peer, addr);
+	return write_found_info(filename, addr, str);
+}
+
+int write_lastused_info(bdaddr_t *local, bdaddr_t *peer, struct tm *tm)
+{
+	char filename[PATH_MAX + 1], addr[18], str[24];
+
+	memset(str, 0, sizeof(str));
+	strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S %Z", tm);
+
+	create_filename(filename, PATH_MAX, local, "lastused");
+
+	ba2str(peer, addr);
+	return write_found_info(filename, addr, str);
+}
+
+/* The stored "%Y-%m-%d %H:%M:%S" UTC times sort as strings, str gets an
+ * empty string for devices never used */
+int read_lastused_info(const bdaddr_t *local, const bdaddr_t *peer,
+						char *str, size_t size)
+{
+	char filename[PATH_MAX + 1], addr[18], *tmp;
+	int err;
+
+	create_filename(filename, PATH_MAX, local, "lastused");
+
+	ba2str(peer, addr);
+
+	*str = '\0';
+
+	tmp = textfile_get(filename, addr);
+	if (!tmp)
+		return -ENOENT;
+
+	err = snprintf(str, size, "%s", tmp);
+
+	free(tmp);
+
+	return err < 0 ? -EIO : 0;
+}
+
+/*
+ * Link keys are also kept in a binary log per adapter, "keydb": a magic
+ * followed by fixed size records, each one setting or deleting the key of
+ * a device. The log is mapped once into a hash table so looking up a key
+ * needs no parsing, changes are appended to it and it gets compacted once
+ * most of its records are stale.
+ *
+ * The "linkkeys" file is still written and stays the reference. Every
+ * change is appended before updating the file and followed by a sync
+ * record holding the modification time and size of the file afterwards.
+ * The log is imported again from the file unless it ends with a sync
+ * record matching it, so neither a crash in the middle of a change nor
+ * an edit of the file can leave stale keys behind.
+ */
+#define KEYDB_MAGIC		"BZKEY001"
+#define KEYDB_MAGIC_LEN		8
+#define KEYDB_COMPACT_SLACK	64
+
+#define KEYDB_RECORD_SET	0x01
+#define KEYDB_RECORD_DEL	0x02
+#define KEYDB_RECORD_SYNC	0x03
+
+struct keydb_record {
+	bdaddr_t bdaddr;
+	uint8_t op;
+	uint8_t type;
+	union {
+		struct {
+			uint8_t key[16];
+			uint8_t pin_len;
+		} link;
+		struct {
+			uint64_t mtime;
+			uint64_t size;
+		} __attribute__ ((packed)) sync;
+	} __attribute__ ((packed)) data;
+	uint8_t reserved[3];
+	uint32_t checksum;
+} __attribute__ ((packed));
+
+struct key_store {
+	bdaddr_t local;
+	GHashTable *keys;
+	int fd;
+	unsigned int records;
+};
+
+static uint32_t keydb_checksum(const struct keydb_record *rec)
+{
+	const uint8_t *ptr = (const uint8_t *) rec;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < offsetof(struct keydb_record, checksum); i++)
+		h = (h ^ ptr[i]) * 16777619u;
+
+	return h;
+}
+
+static void keydb_sync_record(const bdaddr_t *local,
+						struct keydb_record *rec)
+{
+	char filename[PATH_MAX + 1];
+	struct stat st;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->op = KEYDB_RECORD_SYNC;
+
+	create_filename(filename, PATH_MAX, local, "linkkeys");
+	if (stat(filename, &st) < 0)
+		return;
+
+	rec->data.sync.mtime = st.st_mtime;
+	rec->data.sync.size = st.st_size;
+}
+
+/* Parses "<key> <type> <pin length>" as found in the linkkeys file */
+static int parse_link_key(const char *str, size_t len,
+					struct link_key_info *info)
+{
+	char tmp[3];
+	long int l;
+	int i;
+
+	if (len < 36)
+		return -EILSEQ;
+
+	memset(tmp, 0, sizeof(tmp));
+
+	for (i = 0; i < 16; i++) {
+		memcpy(tmp, str + (i * 2), 2);
+		info->key[i] = (uint8_t) strtol(tmp, NULL, 16);
+	}
+
+	memcpy(tmp, str + 33, 2);
+	info->type = (uint8_t) strtol(tmp, NULL, 10);
+
+	/* The value is not terminated, the pin length may be one digit */
+	memset(tmp, 0, sizeof(tmp));
+	memcpy(tmp, str + 35, MIN(len - 35, 2));
+	l = strtol(tmp, NULL, 10);
+	if (l < 0)
+		l = 0;
+	info->pin_len = l;
+
+	return 0;
+}
+
+static void key_store_set(struct key_store *store,
+					const struct keydb_record *rec)
+{
+	struct link_key_info *info;
+
+	if (rec->op == KEYDB_RECORD_DEL) {
+		g_hash_table_remove(store->keys, &rec->bdaddr);
+		return;
+	}
+
+	info = g_new0(struct link_key_info, 1);
+	bacpy(&info->bdaddr, &rec->bdaddr);
+	memcpy(info->key, rec->data.link.key, sizeof(info->key));
+	info->type = rec->type;
+	info->pin_len = rec->data.link.pin_len;
+
+	g_hash_table_replace(store->keys, &info->bdaddr, info);
+}
+
+static int key_store_read(struct key_store *store, int fd, off_t size)
+{
+	struct keydb_record rec, sync;
+	uint8_t *map;
+	off_t off;
+	int err = 0;
+
+	if (size < KEYDB_MAGIC_LEN)
+		return -EILSEQ;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!map || map == MAP_FAILED)
+		return -errno;
+
+	if (memcmp(map, KEYDB_MAGIC, KEYDB_MAGIC_LEN)) {
+		munmap(map, size);
+		return -EILSEQ;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+
+	for (off = KEYDB_MAGIC_LEN; off + (off_t) sizeof(rec) <= size;
+						off += sizeof(rec)) {
+		memcpy(&rec, map + off, sizeof(rec));
+
+		if (rec.checksum != keydb_checksum(&rec))
+			break;
+
+		if (rec.op != KEYDB_RECORD_SYNC)
+			key_store_set(store, &rec);
+
+		store->records++;
+	}
+
+	munmap(map, size);
+
+	if (off != size)
+		return -EILSEQ;
+
+	keydb_sync_record(&store->local, &sync);
+
+	if (rec.op != KEYDB_RECORD_SYNC ||
+				rec.data.sync.mtime != sync.data.sync.mtime ||
+				rec.data.sync.size != sync.data.sync.size)
+		err = -ESTALE;
+
+	return err;
+}
+
+static void import_link_key(const char *key, size_t keylen,
+				const char *value, size_t valuelen, void *data)
+{
+	struct key_store *store = data;
+	struct link_key_info *info;
+	char addr[18];
+
+	if (keylen != 17)
+		return;
+
+	memcpy(addr, key, keylen);
+	addr[keylen] = '\0';
+
+	info = g_new0(struct link_key_info, 1);
+	str2ba(addr, &info->bdaddr);
+
+	if (parse_link_key(value, valuelen, info) < 0) {
+		g_free(info);
+		return;
+	}
+
+	g_hash_table_replace(store->keys, &info->bdaddr, info);
+}
+
+static void compact_link_key(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct link_key_info *info = value;
+	GByteArray *buf = user_data;
+	struct keydb_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	bacpy(&rec.bdaddr, &info->bdaddr);
+	rec.op = KEYDB_RECORD_SET;
+	rec.type = info->type;
+	memcpy(rec.data.link.key, info->key, sizeof(rec.data.link.key));
+	rec.data.link.pin_len = info->pin_len;
+	rec.checksum = keydb_checksum(&rec);
+
+	g_byte_array_append(buf, (guint8 *) &rec, sizeof(rec));
+}
+
+static int key_store_compact(struct key_store *store)
+{
+	char filename[PATH_MAX + 1], tmp[PATH_MAX + 5];
+	struct keydb_record rec;
+	GByteArray *buf;
+	int fd, err = 0;
+
+	create_filename(filename, PATH_MAX, &store->local, "keydb");
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+	if (create_file(tmp, S_IRUSR | S_IWUSR) < 0)
+		return -errno;
+
+	fd = open(tmp, O_WRONLY | O_TRUNC);
+	if (fd < 0) {
+		err = -errno;
+		unlink(tmp);
+		return err;
+	}
+
+	buf = g_byte_array_sized_new(KEYDB_MAGIC_LEN + sizeof(rec) *
+					(g_hash_table_size(store->keys) + 1));
+	g_byte_array_append(buf, (guint8 *) KEYDB_MAGIC, KEYDB_MAGIC_LEN);
+	g_hash_table_foreach(store->keys, compact_link_key, buf);
+
+	keydb_sync_record(&store->local, &rec);
+	rec.checksum = keydb_checksum(&rec);
+	g_byte_array_append(buf, (guint8 *) &rec, sizeof(rec));
+
+	if (write(fd, buf->data, buf->len) != (ssize_t) buf->len ||
+							fdatasync(fd) < 0)
+		err = -EIO;
+
+	g_byte_array_free(buf, TRUE);
+	close(fd);
+
+	if (err == 0 && rename(tmp, filename) < 0)
+		err = -errno;
+
+	if (err < 0) {
+		unlink(tmp);
+		return err;
+	}
+
+	if (store->fd >= 0)
+		close(store->fd);
+
+	store->fd = open(filename, O_WRONLY | O_APPEND);
+	store->records = g_hash_table_size(store->keys) + 1;
+
+	return 0;
+}
+
+static GHashTable *key_table_new(void)
+{
+	return g_hash_table_new_full(bt_bdaddr_hash, bt_bdaddr_equal,
+								NULL, g_free);
+}
+
+static struct key_store *key_store_get(const bdaddr_t *local)
+{
+	char filename[PATH_MAX + 1];
+	struct key_store *store;
+	struct stat st;
+	GSList *l;
+	int fd;
+
+	for (l = key_stores; l; l = l->next) {
+		store = l->data;
+
+		if (bacmp(&store->local, local) == 0)
+			return store;
+	}
+
+	store = g_new0(struct key_store, 1);
+	bacpy(&store->local, local);
+	store->keys = key_table_new();
+	store->fd = -1;
+
+	create_filename(filename, PATH_MAX, local, "keydb");
+	fd = open(filename, O_RDWR | O_APPEND);
+
+	if (fd >= 0 && fstat(fd, &st) == 0 &&
+				key_store_read(store, fd, st.st_size) == 0)
+		store->fd = fd;
+	else {
+		if (fd >= 0)
+			close(fd);
+
+		g_hash_table_destroy(store->keys);
+		store->keys = key_table_new();
+		store->records = 0;
 
-	ba2str(peer, addr);
+		create_filename(filename, PATH_MAX, local, "linkkeys");
+		textfile_foreach_raw(filename, import_link_key, store);
 
-	str = textfile_get(filename, addr);
-	if (!str)
-		return -ENOENT;
+		/* Without a log changes still reach the linkkeys file */
+		key_store_compact(store);
+	}
 
-	len = strlen(str);
+	key_stores = g_slist_prepend(key_stores, store);
 
-	err = -ENOENT;
+	return store;
+}
 
-	if (page1 && len >= 16)
-		err = decode_bytes(str, page1, 8);
+static void key_store_drop(struct key_store *store)
+{
+	char filename[PATH_MAX + 1];
 
-	if (page2 && len >= 33)
-		err = decode_bytes(str + 17, page2, 8);
+	if (store->fd < 0)
+		return;
 
-	free(str);
+	/* Imported again from the linkkeys file on the next start */
+	close(store->fd);
+	store->fd = -1;
 
-	return err;
+	create_filename(filename, PATH_MAX, &store->local, "keydb");
+	unlink(filename);
 }
 
-int write_lastseen_info(bdaddr_t *local, bdaddr_t *peer, struct tm *tm)
+static void key_store_append(struct key_store *store,
+						struct keydb_record *rec)
 {
-	char filename[PATH_MAX + 1], addr[18], str[24];
-
-	memset(str, 0, sizeof(str));
-	strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S %Z", tm);
+	if (store->fd < 0)
+		return;
 
-	create_filename(filename, PATH_MAX, local, "lastseen");
+	rec->checksum = keydb_checksum(rec);
 
-	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (write(store->fd, rec, sizeof(*rec)) != sizeof(*rec) ||
+						fdatasync(store->fd) < 0) {
+		key_store_drop(store);
+		return;
+	}
 
-	ba2str(peer, addr);
-	return textfile_put(filename, addr, str);
+	store->records++;
 }
 
-int write_lastused_info(bdaddr_t *local, bdaddr_t *peer, struct tm *tm)
+static void key_store_sync(struct key_store *store)
 {
-	char filename[PATH_MAX + 1], addr[18], str[24];
+	struct keydb_record rec;
 
-	memset(str, 0, sizeof(str));
-	strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S %Z", tm);
+	keydb_sync_record(&store->local, &rec);
+	key_store_append(store, &rec);
 
-	create_filename(filename, PATH_MAX, local, "lastused");
+	if (store->fd >= 0 && store->records >
+			g_hash_table_size(store->keys) * 3 + KEYDB_COMPACT_SLACK)
+		key_store_compact(store);
+}
 
-	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+static void key_store_free(gpointer data)
+{
+	struct key_store *store = data;
 
-	ba2str(peer, addr);
-	return textfile_put(filename, addr, str);
+	if (store->fd >= 0)
+		close(store->fd);
+
+	g_hash_table_destroy(store->keys);
+	g_free(store);
 }
 
 int write_link_key(bdaddr_t *local, bdaddr_t *peer, unsigned char *key, uint8_t type, int length)
 {
 	char filename[PATH_MAX + 1], addr[18], str[38];
-	int i;
+	struct key_store *store;
+	struct link_key_info *info;
+	struct keydb_record rec;
+	int i, err;
 
 	memset(str, 0, sizeof(str));
 	for (i = 0; i < 16; i++)
@@ -558,40 +1298,80 @@ int write_link_key(bdaddr_t *local, bdaddr_t *peer, unsigned char *key, uint8_t
 		}
 	}
 
-	return textfile_put(filename, addr, str);
+	store = key_store_get(local);
+
+	memset(&rec, 0, sizeof(rec));
+	bacpy(&rec.bdaddr, peer);
+	rec.op = KEYDB_RECORD_SET;
+	rec.type = type;
+	memcpy(rec.data.link.key, key, sizeof(rec.data.link.key));
+
+	if (length >= 0)
+		rec.data.link.pin_len = length;
+	else {
+		info = g_hash_table_lookup(store->keys, peer);
+		if (info)
+			rec.data.link.pin_len = info->pin_len;
+	}
+
+	key_store_append(store, &rec);
+
+	err = textfile_put(filename, addr, str);
+	if (err < 0) {
+		key_store_drop(store);
+		return err;
+	}
+
+	key_store_set(store, &rec);
+	key_store_sync(store);
+
+	return 0;
 }
 
 int read_link_key(bdaddr_t *local, bdaddr_t *peer, unsigned char *key, uint8_t *type)
 {
-	char filename[PATH_MAX + 1], addr[18], tmp[3], *str;
-	int i;
+	struct key_store *store;
+	struct link_key_info *info;
 
-	create_filename(filename, PATH_MAX, local, "linkkeys");
+	store = key_store_get(local);
 
-	ba2str(peer, addr);
-	str = textfile_get(filename, addr);
-	if (!str)
+	info = g_hash_table_lookup(store->keys, peer);
+	if (!info)
 		return -ENOENT;
 
-	if (!key) {
-		free(str);
-		return 0;
-	}
+	if (key)
+		memcpy(key, info->key, sizeof(info->key));
 
-	memset(tmp, 0, sizeof(tmp));
-	for (i = 0; i < 16; i++) {
-		memcpy(tmp, str + (i * 2), 2);
-		key[i] = (uint8_t) strtol(tmp, NULL, 16);
-	}
+	if (type)
+		*type = info->type;
 
-	if (type) {
-		memcpy(tmp, str + 33, 2);
-		*type = (uint8_t) strtol(tmp, NULL, 10);
-	}
+	return 0;
+}
 
-	free(str);
+int delete_link_key(bdaddr_t *local, bdaddr_t *peer)
+{
+	char filename[PATH_MAX + 1], addr[18];
+	struct key_store *store;
+	struct keydb_record rec;
+	int err;
 
-	return 0;
+	store = key_store_get(local);
+
+	memset(&rec, 0, sizeof(rec));
+	bacpy(&rec.bdaddr, peer);
+	rec.op = KEYDB_RECORD_DEL;
+
+	key_store_append(store, &rec);
+
+	create_filename(filename, PATH_MAX, local, "linkkeys");
+
+	ba2str(peer, addr);
+	err = textfile_casedel(filename, addr);
+
+	key_store_set(store, &rec);
+	key_store_sync(store);
+
+	return err;
 }
 
 int read_pin_code(bdaddr_t *local, bdaddr_t *peer, char *pin)
@@ -737,12 +1517,14 @@ struct trust_list {
 	const char *service;
 };
 
-static void append_trust(char *key, char *value, void *data)
+static void append_trust(const char *key, size_t keylen, const char *value,
+						size_t valuelen, void *data)
 {
 	struct trust_list *list = data;
 
-	if (strstr(value, list->service))
-		list->trusts = g_slist_append(list->trusts, g_strdup(key));
+	if (g_strstr_len(value, valuelen, list->service))
+		list->trusts = g_slist_append(list->trusts,
+						g_strndup(key, keylen));
 }
 
 GSList *list_trusts(bdaddr_t *local, const char *service)
@@ -755,7 +1537,7 @@ GSList *list_trusts(bdaddr_t *local, const char *service)
 	list.trusts = NULL;
 	list.service = service;
 
-	if (textfile_foreach(filename, append_trust, &list) < 0)
+	if (textfile_foreach_raw(filename, append_trust, &list) < 0)
 		return NULL;
 
 	return list.trusts;
@@ -785,6 +1567,124 @@ int delete_entry(bdaddr_t *src, const char *storage, const char *key)
 	return textfile_del(filename, key);
 }
 
+/*
+ * The records of each device are also kept as a binary snapshot, the raw
+ * record PDUs one after the other, so loading them needs neither a scan
+ * of the whole "sdp" file nor hex decoding. The "sdp" file stays the
+ * reference: the snapshot is dropped before a record of the device gets
+ * changed there and written again by the next read_records().
+ */
+#define RECORDS_CACHE_MAGIC	"BZSDP001"
+#define RECORDS_CACHE_MAGIC_LEN	8
+
+static void create_records_cache_name(char *buf, size_t size,
+					const char *src, const char *dst)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "sdpcache/%s", dst);
+
+	create_name(buf, size, STORAGEDIR, src, name);
+}
+
+static void drop_records_cache(const char *src, const char *dst)
+{
+	char filename[PATH_MAX + 1];
+
+	create_records_cache_name(filename, PATH_MAX, src, dst);
+
+	unlink(filename);
+}
+
+static int read_records_cache(const char *src, const char *dst,
+							sdp_list_t **recs)
+{
+	char filename[PATH_MAX + 1];
+	struct stat st;
+	uint8_t *map;
+	off_t off;
+	int fd, err = 0;
+
+	create_records_cache_name(filename, PATH_MAX, src, dst);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || st.st_size < RECORDS_CACHE_MAGIC_LEN) {
+		close(fd);
+		return -EILSEQ;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!map || map == MAP_FAILED) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if (memcmp(map, RECORDS_CACHE_MAGIC, RECORDS_CACHE_MAGIC_LEN)) {
+		err = -EILSEQ;
+		goto done;
+	}
+
+	*recs = NULL;
+
+	for (off = RECORDS_CACHE_MAGIC_LEN; off < st.st_size; ) {
+		sdp_record_t *rec;
+		int len = 0;
+
+		rec = sdp_extract_pdu_lazy(map + off, st.st_size - off, &len);
+		if (!rec || len <= 0) {
+			if (rec)
+				sdp_record_free(rec);
+			sdp_list_free(*recs, (sdp_free_func_t) sdp_record_free);
+			*recs = NULL;
+			err = -EILSEQ;
+			break;
+		}
+
+		*recs = sdp_list_append(*recs, rec);
+		off += len;
+	}
+
+done:
+	munmap(map, st.st_size);
+	close(fd);
+
+	return err;
+}
+
+static void write_records_cache(const char *src, const char *dst,
+					const uint8_t *data, size_t len)
+{
+	char filename[PATH_MAX + 1], tmp[PATH_MAX + 5];
+	int fd;
+
+	create_records_cache_name(filename, PATH_MAX, src, dst);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+	if (create_file(tmp, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0)
+		return;
+
+	fd = open(tmp, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return;
+
+	if (write(fd, RECORDS_CACHE_MAGIC, RECORDS_CACHE_MAGIC_LEN) !=
+						RECORDS_CACHE_MAGIC_LEN ||
+			(len > 0 && write(fd, data, len) != (ssize_t) len)) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	close(fd);
+
+	if (rename(tmp, filename) < 0)
+		unlink(tmp);
+}
+
 int store_record(const gchar *src, const gchar *dst, sdp_record_t *rec)
 {
 	char filename[PATH_MAX + 1], key[28];
@@ -792,6 +1692,8 @@ int store_record(const gchar *src, const gchar *dst, sdp_record_t *rec)
 	int err, size, i;
 	char *str;
 
+	drop_records_cache(src, dst);
+
 	create_name(filename, PATH_MAX, STORAGEDIR, src, "sdp");
 
 	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -816,24 +1718,42 @@ int store_record(const gchar *src, const gchar *dst, sdp_record_t *rec)
 	return err;
 }
 
+static inline uint8_t hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return 0;
+}
+
+static uint8_t *string_to_pdu(const gchar *str, int *size)
+{
+	uint8_t *pdata;
+	int i;
+
+	*size = strlen(str) / 2;
+	pdata = g_malloc0(*size);
+
+	for (i = 0; i < *size; i++)
+		pdata[i] = hex_value(str[i * 2]) << 4 | hex_value(str[i * 2 + 1]);
+
+	return pdata;
+}
+
 sdp_record_t *record_from_string(const gchar *str)
 {
 	sdp_record_t *rec;
-	int size, i, len;
+	int size, len;
 	uint8_t *pdata;
-	char tmp[3];
-
-	size = strlen(str)/2;
-	pdata = g_malloc0(size);
 
-	tmp[2] = 0;
-	for (i = 0; i < size; i++) {
-		memcpy(tmp, str + (i * 2), 2);
-		pdata[i] = (uint8_t) strtol(tmp, NULL, 16);
-	}
+	pdata = string_to_pdu(str, &size);
 
 	rec = sdp_extract_pdu(pdata, size, &len);
-	free(pdata);
+	g_free(pdata);
 
 	return rec;
 }
@@ -863,6 +1783,8 @@ int delete_record(const gchar *src, const gchar *dst, const uint32_t handle)
 {
 	char filename[PATH_MAX + 1], key[28];
 
+	drop_records_cache(src, dst);
+
 	create_name(filename, PATH_MAX, STORAGEDIR, src, "sdp");
 
 	snprintf(key, sizeof(key), "%17s#%08X", dst, handle);
@@ -873,21 +1795,39 @@ int delete_record(const gchar *src, const gchar *dst, const uint32_t handle)
 struct record_list {
 	sdp_list_t *recs;
 	const gchar *addr;
+	GByteArray *cache;
 };
 
-static void create_stored_records_from_keys(char *key, char *value,
-							void *user_data)
+/* The PDU is decoded from the mapped file straight into the snapshot */
+static void create_stored_records_from_keys(const char *key, size_t keylen,
+					const char *value, size_t valuelen,
+					void *user_data)
 {
 	struct record_list *rec_list = user_data;
+	GByteArray *cache = rec_list->cache;
 	const gchar *addr = rec_list->addr;
 	sdp_record_t *rec;
+	guint base = cache->len;
+	size_t i, size = valuelen / 2;
+	int len;
 
-	if (strncmp(key, addr, 17))
+	if (keylen < 17 || strncmp(key, addr, 17))
 		return;
 
-	rec = record_from_string(value);
+	g_byte_array_set_size(cache, base + size);
 
-	rec_list->recs = sdp_list_append(rec_list->recs, rec);
+	for (i = 0; i < size; i++)
+		cache->data[base + i] = hex_value(value[i * 2]) << 4 |
+						hex_value(value[i * 2 + 1]);
+
+	rec = sdp_extract_pdu(cache->data + base, size, &len);
+	if (rec && len > 0)
+		g_byte_array_set_size(cache, base + len);
+	else
+		g_byte_array_set_size(cache, base);
+
+	if (rec)
+		rec_list->recs = sdp_list_append(rec_list->recs, rec);
 }
 
 void delete_all_records(const bdaddr_t *src, const bdaddr_t *dst)
@@ -918,11 +1858,20 @@ sdp_list_t *read_records(const bdaddr_t *src, const bdaddr_t *dst)
 	ba2str(src, srcaddr);
 	ba2str(dst, dstaddr);
 
+	if (read_records_cache(srcaddr, dstaddr, &rec_list.recs) == 0)
+		return rec_list.recs;
+
 	rec_list.addr = dstaddr;
 	rec_list.recs = NULL;
+	rec_list.cache = g_byte_array_new();
 
 	create_name(filename, PATH_MAX, STORAGEDIR, srcaddr, "sdp");
-	textfile_foreach(filename, create_stored_records_from_keys, &rec_list);
+	if (textfile_foreach_raw(filename, create_stored_records_from_keys,
+							&rec_list) == 0)
+		write_records_cache(srcaddr, dstaddr, rec_list.cache->data,
+							rec_list.cache->len);
+
+	g_byte_array_free(rec_list.cache, TRUE);
 
 	return rec_list.recs;
 }
@@ -1171,14 +2120,16 @@ int write_device_services(const bdaddr_t *sba, const bdaddr_t *dba,
 	return textfile_put(filename, addr, services);
 }
 
-static void filter_keys(char *key, char *value, void *data)
+static void filter_keys(const char *key, size_t keylen, const char *value,
+						size_t valuelen, void *data)
 {
 	struct match *match = data;
 	const char *address = match->pattern;
 
 	/* Each key contains: MAC#handle*/
-	if (strncasecmp(key, address, 17) == 0)
-		match->keys = g_slist_append(match->keys, g_strdup(key));
+	if (keylen >= 17 && strncasecmp(key, address, 17) == 0)
+		match->keys = g_slist_append(match->keys,
+						g_strndup(key, keylen));
 }
 
 int delete_device_service(const bdaddr_t *sba, const bdaddr_t *dba)
@@ -1202,7 +2153,7 @@ int delete_device_service(const bdaddr_t *sba, const bdaddr_t *dba)
 	match.pattern = address;
 
 	create_filename(filename, PATH_MAX, sba, "characteristic");
-	err = textfile_foreach(filename, filter_keys, &match);
+	err = textfile_foreach_raw(filename, filter_keys, &match);
 	if (err < 0)
 		return err;
 
@@ -1219,7 +2170,7 @@ int delete_device_service(const bdaddr_t *sba, const bdaddr_t *dba)
 	match.pattern = address;
 
 	create_filename(filename, PATH_MAX, sba, "attributes");
-	err = textfile_foreach(filename, filter_keys, &match);
+	err = textfile_foreach_raw(filename, filter_keys, &match);
 	if (err < 0)
 		return err;
 
@@ -1247,6 +2198,81 @@ char *read_device_services(const bdaddr_t *sba, const bdaddr_t *dba)
 	return textfile_caseget(filename, addr);
 }
 
+int write_remote_seps(const bdaddr_t *sba, const bdaddr_t *dba,
+							const char *seps)
+{
+	char filename[PATH_MAX + 1], addr[18];
+
+	create_filename(filename, PATH_MAX, sba, "avdtp");
+
+	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	ba2str(dba, addr);
+
+	return textfile_put(filename, addr, seps);
+}
+
+char *read_remote_seps(const bdaddr_t *sba, const bdaddr_t *dba)
+{
+	char filename[PATH_MAX + 1], addr[18];
+
+	create_filename(filename, PATH_MAX, sba, "avdtp");
+
+	ba2str(dba, addr);
+
+	return textfile_caseget(filename, addr);
+}
+
+int delete_remote_seps(const bdaddr_t *sba, const bdaddr_t *dba)
+{
+	char filename[PATH_MAX + 1], addr[18];
+
+	create_filename(filename, PATH_MAX, sba, "avdtp");
+
+	ba2str(dba, addr);
+
+	return textfile_casedel(filename, addr);
+}
+
+/* SCO connection setup time in milliseconds, as a running average and
+ * the last measured value */
+int write_sco_setup_time(const bdaddr_t *sba, const bdaddr_t *dba,
+					unsigned int avg, unsigned int last)
+{
+	char filename[PATH_MAX + 1], addr[18], str[24];
+
+	create_filename(filename, PATH_MAX, sba, "scotime");
+
+	create_file(filename, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	ba2str(dba, addr);
+
+	snprintf(str, sizeof(str), "%u %u", avg, last);
+
+	return textfile_put(filename, addr, str);
+}
+
+int read_sco_setup_time(const bdaddr_t *sba, const bdaddr_t *dba,
+					unsigned int *avg, unsigned int *last)
+{
+	char filename[PATH_MAX + 1], addr[18], *str;
+	int ret;
+
+	create_filename(filename, PATH_MAX, sba, "scotime");
+
+	ba2str(dba, addr);
+
+	str = textfile_caseget(filename, addr);
+	if (!str)
+		return -ENOENT;
+
+	ret = sscanf(str, "%u %u", avg, last);
+
+	free(str);
+
+	return ret == 2 ? 0 : -EINVAL;
+}
+
 int write_device_characteristics(const bdaddr_t *sba, const bdaddr_t *dba,
 					uint16_t handle, const char *chars)
 {
@@ -1306,6 +2332,100 @@ int read_device_attributes(const bdaddr_t *sba, textfile_cb func, void *data)
 	return textfile_foreach(filename, func, data);
 }
 
+/*
+ * GATT client cache of a device: its characteristics and descriptors as
+ * laid out by attrib/client.c, so reconnecting needs no discovery. It is
+ * kept until the device sends Service Changed for the cached handles.
+ */
+#define GATT_CACHE_MAGIC	"BZGATT01"
+#define GATT_CACHE_MAGIC_LEN	8
+
+static void create_gatt_cache_name(char *buf, size_t size,
+				const bdaddr_t *sba, const bdaddr_t *dba)
+{
+	char src[18], dst[18], name[32];
+
+	ba2str(sba, src);
+	ba2str(dba, dst);
+
+	snprintf(name, sizeof(name), "gattcache/%s", dst);
+
+	create_name(buf, size, STORAGEDIR, src, name);
+}
+
+int write_device_gatt_cache(const bdaddr_t *sba, const bdaddr_t *dba,
+					const uint8_t *data, size_t len)
+{
+	char filename[PATH_MAX + 1], tmp[PATH_MAX + 5];
+	int fd, err = 0;
+
+	create_gatt_cache_name(filename, PATH_MAX, sba, dba);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+	if (create_file(tmp, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0)
+		return -errno;
+
+	fd = open(tmp, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, GATT_CACHE_MAGIC, GATT_CACHE_MAGIC_LEN) !=
+						GATT_CACHE_MAGIC_LEN ||
+			(len > 0 && write(fd, data, len) != (ssize_t) len)) {
+		err = -EIO;
+		close(fd);
+		unlink(tmp);
+		return err;
+	}
+
+	close(fd);
+
+	if (rename(tmp, filename) < 0) {
+		err = -errno;
+		unlink(tmp);
+	}
+
+	return err;
+}
+
+int read_device_gatt_cache(const bdaddr_t *sba, const bdaddr_t *dba,
+						uint8_t **data, size_t *len)
+{
+	char filename[PATH_MAX + 1];
+	gchar *contents;
+	gsize size;
+
+	create_gatt_cache_name(filename, PATH_MAX, sba, dba);
+
+	if (!g_file_get_contents(filename, &contents, &size, NULL))
+		return -ENOENT;
+
+	if (size < GATT_CACHE_MAGIC_LEN ||
+			memcmp(contents, GATT_CACHE_MAGIC,
+						GATT_CACHE_MAGIC_LEN) != 0) {
+		g_free(contents);
+		return -EILSEQ;
+	}
+
+	*len = size - GATT_CACHE_MAGIC_LEN;
+	memmove(contents, contents + GATT_CACHE_MAGIC_LEN, *len);
+	*data = (uint8_t *) contents;
+
+	return 0;
+}
+
+int delete_device_gatt_cache(const bdaddr_t *sba, const bdaddr_t *dba)
+{
+	char filename[PATH_MAX + 1];
+
+	create_gatt_cache_name(filename, PATH_MAX, sba, dba);
+
+	if (unlink(filename) < 0 && errno != ENOENT)
+		return -errno;
+
+	return 0;
+}
+
 int write_device_type(const bdaddr_t *sba, const bdaddr_t *dba,
 						device_type_t type)
 {
@@ -23,6 +23,26 @@
 
 #include "textfile.h"
 
+void storage_init(void);
+void storage_flush(void);
+void storage_dump_stats(void);
+void storage_cleanup(void);
+
+/* What is stored about a remote device, as far as found devices need it */
+struct cached_device {
+	bdaddr_t bdaddr;
+	char *name;
+	char *alias;
+	time_t name_time;
+	gboolean features_known;
+	unsigned char features[8];
+};
+
+/* Loaded on first use, this is only to get it out of the way early */
+void storage_load_devices(bdaddr_t *local);
+const struct cached_device *read_cached_device(bdaddr_t *local,
+							bdaddr_t *peer);
+
 int read_device_alias(const char *src, const char *dst, char *alias, size_t size);
 int write_device_alias(const char *src, const char *dst, const char *alias);
 int write_discoverable_timeout(bdaddr_t *bdaddr, int timeout);
@@ -47,8 +67,11 @@ int write_features_info(bdaddr_t *local, bdaddr_t *peer, unsigned char *page1, u
 int read_remote_features(bdaddr_t *local, bdaddr_t *peer, unsigned char *page1, unsigned char *page2);
 int write_lastseen_info(bdaddr_t *local, bdaddr_t *peer, struct tm *tm);
 int write_lastused_info(bdaddr_t *local, bdaddr_t *peer, struct tm *tm);
+int read_lastused_info(const bdaddr_t *local, const bdaddr_t *peer,
+						char *str, size_t size);
 int write_link_key(bdaddr_t *local, bdaddr_t *peer, unsigned char *key, uint8_t type, int length);
 int read_link_key(bdaddr_t *local, bdaddr_t *peer, unsigned char *key, uint8_t *type);
+int delete_link_key(bdaddr_t *local, bdaddr_t *peer);
 int read_pin_code(bdaddr_t *local, bdaddr_t *peer, char *pin);
 gboolean read_trust(const bdaddr_t *local, const char *addr, const char *service);
 int write_trust(const char *src, const char *addr, const char *service, gboolean trust);
@@ -77,6 +100,14 @@ int write_device_services(const bdaddr_t *sba, const bdaddr_t *dba,
 							const char *services);
 int delete_device_service(const bdaddr_t *sba, const bdaddr_t *dba);
 char *read_device_services(const bdaddr_t *sba, const bdaddr_t *dba);
+int write_remote_seps(const bdaddr_t *sba, const bdaddr_t *dba,
+							const char *seps);
+char *read_remote_seps(const bdaddr_t *sba, const bdaddr_t *dba);
+int delete_remote_seps(const bdaddr_t *sba, const bdaddr_t *dba);
+int write_sco_setup_time(const bdaddr_t *sba, const bdaddr_t *dba,
+					unsigned int avg, unsigned int last);
+int read_sco_setup_time(const bdaddr_t *sba, const bdaddr_t *dba,
+					unsigned int *avg, unsigned int *last);
 int write_device_characteristics(const bdaddr_t *sba, const bdaddr_t *dba,
 					uint16_t handle, const char *chars);
 char *read_device_characteristics(const bdaddr_t *sba, const bdaddr_t *dba,
@@ -84,9 +115,15 @@ char *read_device_characteristics(const bdaddr_t *sba, const bdaddr_t *dba,
 int write_device_attribute(const bdaddr_t *sba, const bdaddr_t *dba,
                                         uint16_t handle, const char *chars);
 int read_device_attributes(const bdaddr_t *sba, textfile_cb func, void *data);
+int write_device_gatt_cache(const bdaddr_t *sba, const bdaddr_t *dba,
+					const uint8_t *data, size_t len);
+int read_device_gatt_cache(const bdaddr_t *sba, const bdaddr_t *dba,
+						uint8_t **data, size_t *len);
+int delete_device_gatt_cache(const bdaddr_t *sba, const bdaddr_t *dba);
 int write_device_type(const bdaddr_t *sba, const bdaddr_t *dba,
 						device_type_t type);
 device_type_t read_device_type(const bdaddr_t *sba, const bdaddr_t *dba);
 
 #define PNP_UUID		"00001200-0000-1000-8000-00805f9b34fb"
+#define SDP_SERVER_UUID		"00001000-0000-1000-8000-00805f9b34fb"
 
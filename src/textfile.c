@@ -35,6 +35,7 @@
 #include <string.h>
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/param.h>
 
@@ -44,6 +45,220 @@
 #define fdatasync fsync
 #endif
 
+/*
+ * When enabled, the contents of the files read are kept in memory: one
+ * hash table of their lines per file, in file order, so lookups neither
+ * touch the file system nor scan it. Writes still go to the file first
+ * and are then applied to the copy, which is dropped if the write fails.
+ *
+ * Keys are hashed ignoring their case, so case insensitive lookups use
+ * the same bucket chains. A copy is loaded again once the modification
+ * time or the size of its file changed behind the cache's back.
+ *
+ * Deferred writes only change the copy and mark the file dirty; the
+ * owner of the cache is notified of the first one and has to call
+ * textfile_cache_flush() later, which replaces each dirty file as a
+ * whole through a rename. A file is flushed as well before any
+ * synchronous write to it, before it is iterated and before eviction.
+ */
+#define CACHE_MAX_FILES		64
+#define CACHE_MIN_BUCKETS	16
+
+struct cache_entry {
+	struct cache_entry *prev;	/* file order */
+	struct cache_entry *next;
+	struct cache_entry *chain;	/* same bucket, in file order */
+	unsigned int hash;
+	char *value;
+	char key[0];
+};
+
+struct cache_file {
+	struct cache_file *next;	/* most recently used first */
+	struct cache_entry *head;
+	struct cache_entry *tail;
+	struct cache_entry **buckets;
+	unsigned int size;
+	unsigned int count;
+	time_t mtime;
+	off_t length;
+	int missing;
+	int dirty;
+	char path[0];
+};
+
+static int cache_enabled = 0;
+static struct cache_file *cache_files = NULL;
+static unsigned int cache_nfiles = 0;
+static unsigned int cache_ndirty = 0;
+static textfile_notify_cb cache_notify = NULL;
+
+/*
+ * Once enabled, every lookup, write, iteration and flush is timed and
+ * accounted to its file, together with the time spent waiting for the
+ * file lock and the bytes written. Operations taking longer than the
+ * threshold are reported along with the address they were called from.
+ */
+#define STATS_MAX_FILES		128
+
+enum {
+	STATS_READ,
+	STATS_WRITE,
+	STATS_DEFERRED,
+	STATS_FOREACH,
+	STATS_FLUSH,
+};
+
+static const char *stats_ops[] = { "read", "write", "deferred write",
+						"foreach", "flush" };
+
+struct stats_file {
+	struct stats_file *next;	/* most recently used first */
+	struct textfile_stats stats;
+	char path[0];
+};
+
+static int stats_enabled = 0;
+static unsigned int stats_slow = 0;
+static textfile_slow_cb stats_slow_cb = NULL;
+static struct stats_file *stats_files = NULL;
+static unsigned int stats_nfiles = 0;
+
+static struct textfile_stats *stats_get(const char *pathname)
+{
+	struct stats_file *file, **ptr;
+
+	if (!stats_enabled)
+		return NULL;
+
+	for (ptr = &stats_files; *ptr; ptr = &(*ptr)->next) {
+		file = *ptr;
+
+		if (strcmp(file->path, pathname))
+			continue;
+
+		*ptr = file->next;
+		file->next = stats_files;
+		stats_files = file;
+
+		return &file->stats;
+	}
+
+	/* Files beyond the limit are simply not accounted */
+	if (stats_nfiles >= STATS_MAX_FILES)
+		return NULL;
+
+	file = calloc(1, sizeof(*file) + strlen(pathname) + 1);
+	if (!file)
+		return NULL;
+
+	strcpy(file->path, pathname);
+
+	file->next = stats_files;
+	stats_files = file;
+	stats_nfiles++;
+
+	return &file->stats;
+}
+
+static inline void stats_start(struct timeval *start)
+{
+	if (stats_enabled)
+		gettimeofday(start, NULL);
+}
+
+static unsigned int stats_elapsed(const struct timeval *start)
+{
+	struct timeval now;
+	long long usec;
+
+	gettimeofday(&now, NULL);
+
+	usec = (now.tv_sec - start->tv_sec) * 1000000LL +
+					(now.tv_usec - start->tv_usec);
+
+	/* The clock may have been set back in the meantime */
+	if (usec < 0)
+		return 0;
+
+	return usec > UINT_MAX ? UINT_MAX : usec;
+}
+
+static void stats_end(const char *pathname, int op,
+			const struct timeval *start, const void *caller)
+{
+	struct textfile_stats *stats;
+	unsigned int usec, bucket;
+	int err = errno;
+
+	if (!stats_enabled)
+		return;
+
+	usec = stats_elapsed(start);
+
+	stats = stats_get(pathname);
+	if (stats) {
+		switch (op) {
+		case STATS_READ:
+			stats->reads++;
+			break;
+		case STATS_WRITE:
+			stats->writes++;
+			break;
+		case STATS_DEFERRED:
+			stats->deferred++;
+			break;
+		case STATS_FOREACH:
+			stats->iterations++;
+			break;
+		case STATS_FLUSH:
+			stats->flushes++;
+			break;
+		}
+
+		for (bucket = 0; bucket < TEXTFILE_STATS_BUCKETS - 1 &&
+					usec >= (2U << bucket); bucket++);
+
+		stats->latency[bucket]++;
+		stats->busy += usec;
+		if (usec > stats->max)
+			stats->max = usec;
+	}
+
+	if (stats_slow_cb && usec >= stats_slow)
+		stats_slow_cb(pathname, stats_ops[op], usec, caller);
+
+	errno = err;
+}
+
+static void stats_written(const char *pathname, size_t bytes)
+{
+	struct textfile_stats *stats = stats_get(pathname);
+
+	if (stats)
+		stats->written += bytes;
+}
+
+static int stats_flock(const char *pathname, int fd, int operation)
+{
+	struct textfile_stats *stats;
+	struct timeval start;
+	int err;
+
+	if (!stats_enabled)
+		return flock(fd, operation);
+
+	stats_start(&start);
+
+	err = flock(fd, operation);
+
+	stats = stats_get(pathname);
+	if (stats)
+		stats->lock_wait += stats_elapsed(&start);
+
+	return err;
+}
+
 int create_dirs(const char *filename, const mode_t mode)
 {
 	struct stat st;
@@ -117,15 +332,17 @@ static inline char *find_key(char *map, size_t size, const char *key, size_t len
 		}
 
 		if (icase) {
-			char *p1 = memchr(ptr + 1, tolower(*key), ptrlen - 1);
-			char *p2 = memchr(ptr + 1, toupper(*key), ptrlen - 1);
-
-			if (!p1)
-				ptr = p2;
-			else if (!p2)
-				ptr = p1;
-			else
-				ptr = (p1 < p2) ? p1 : p2;
+			char *end = map + size;
+
+			/* Rather than looking for both cases of the first
+			 * character, go straight to the next line */
+			while (ptr < end && *ptr != '\r' && *ptr != '\n')
+				ptr++;
+
+			if (ptr == end)
+				return NULL;
+
+			ptr++;
 		} else
 			ptr = memchr(ptr + 1, *key, ptrlen - 1);
 
@@ -138,7 +355,608 @@ static inline char *find_key(char *map, size_t size, const char *key, size_t len
 	return NULL;
 }
 
-static inline int write_key_value(int fd, const char *key, const char *value)
+static unsigned int cache_hash(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key)
+		h = h * 33 + tolower((unsigned char) *key++);
+
+	return h;
+}
+
+static void cache_chain_insert(struct cache_file *file,
+						struct cache_entry *entry)
+{
+	struct cache_entry **ptr = &file->buckets[entry->hash &
+							(file->size - 1)];
+
+	while (*ptr)
+		ptr = &(*ptr)->chain;
+
+	entry->chain = NULL;
+	*ptr = entry;
+}
+
+static void cache_chain_remove(struct cache_file *file,
+						struct cache_entry *entry)
+{
+	struct cache_entry **ptr = &file->buckets[entry->hash &
+							(file->size - 1)];
+
+	while (*ptr != entry)
+		ptr = &(*ptr)->chain;
+
+	*ptr = entry->chain;
+}
+
+static int cache_resize(struct cache_file *file, unsigned int size)
+{
+	struct cache_entry **buckets, *entry;
+
+	buckets = calloc(size, sizeof(*buckets));
+	if (!buckets)
+		return -ENOMEM;
+
+	free(file->buckets);
+	file->buckets = buckets;
+	file->size = size;
+
+	/* Going through the file order keeps every chain in file order */
+	for (entry = file->head; entry; entry = entry->next)
+		cache_chain_insert(file, entry);
+
+	return 0;
+}
+
+static struct cache_entry *cache_entry_new(const char *key, size_t keylen,
+					const char *value, size_t valuelen)
+{
+	struct cache_entry *entry;
+
+	entry = malloc(sizeof(*entry) + keylen + 1);
+	if (!entry)
+		return NULL;
+
+	entry->value = malloc(valuelen + 1);
+	if (!entry->value) {
+		free(entry);
+		return NULL;
+	}
+
+	memcpy(entry->key, key, keylen);
+	entry->key[keylen] = '\0';
+	memcpy(entry->value, value, valuelen);
+	entry->value[valuelen] = '\0';
+	entry->hash = cache_hash(entry->key);
+
+	return entry;
+}
+
+static void cache_entry_free(struct cache_entry *entry)
+{
+	free(entry->value);
+	free(entry);
+}
+
+/* Links a new entry in the file order after prev, or first if NULL */
+static int cache_link(struct cache_file *file, struct cache_entry *prev,
+						struct cache_entry *entry)
+{
+	if (file->count >= file->size * 2 &&
+				cache_resize(file, file->size * 2) < 0) {
+		cache_entry_free(entry);
+		return -ENOMEM;
+	}
+
+	entry->prev = prev;
+	entry->next = prev ? prev->next : file->head;
+
+	if (entry->next)
+		entry->next->prev = entry;
+	else
+		file->tail = entry;
+
+	if (prev)
+		prev->next = entry;
+	else
+		file->head = entry;
+
+	file->count++;
+
+	/* A duplicate key further down has to stay behind in its chain */
+	if (entry->next) {
+		struct cache_entry *e;
+
+		for (e = file->buckets[entry->hash & (file->size - 1)]; e;
+								e = e->chain) {
+			if (e->hash == entry->hash &&
+					!strcasecmp(e->key, entry->key))
+				return cache_resize(file, file->size);
+		}
+	}
+
+	cache_chain_insert(file, entry);
+
+	return 0;
+}
+
+static void cache_unlink(struct cache_file *file, struct cache_entry *entry)
+{
+	cache_chain_remove(file, entry);
+
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		file->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		file->tail = entry->prev;
+
+	file->count--;
+
+	cache_entry_free(entry);
+}
+
+static void cache_file_free(struct cache_file *file)
+{
+	struct cache_entry *entry, *next;
+
+	for (entry = file->head; entry; entry = next) {
+		next = entry->next;
+		cache_entry_free(entry);
+	}
+
+	free(file->buckets);
+	free(file);
+}
+
+/* Remembers the state of the file the copy matches */
+static void cache_stamp(struct cache_file *file)
+{
+	struct stat st;
+
+	if (stat(file->path, &st) < 0) {
+		file->mtime = 0;
+		file->length = 0;
+		return;
+	}
+
+	file->mtime = st.st_mtime;
+	file->length = st.st_size;
+}
+
+static int cache_stale(struct cache_file *file)
+{
+	struct stat st;
+
+	/* Pending changes replace the file anyway */
+	if (file->dirty)
+		return 0;
+
+	if (stat(file->path, &st) < 0)
+		return !file->missing;
+
+	return file->missing || st.st_mtime != file->mtime ||
+						st.st_size != file->length;
+}
+
+static void cache_parse(struct cache_file *file, const char *map, size_t size)
+{
+	const char *off = map, *end = map + size;
+
+	while (off < end) {
+		const char *eol, *sep;
+		struct cache_entry *entry;
+
+		eol = memchr(off, '\n', end - off);
+		if (!eol)
+			eol = end;
+
+		sep = memchr(off, ' ', eol - off);
+
+		/* Empty lines and lines without a value can't be looked up */
+		if (sep && sep > off) {
+			const char *value = sep + 1, *vend = eol;
+
+			if (vend > value && vend[-1] == '\r')
+				vend--;
+
+			entry = cache_entry_new(off, sep - off, value,
+								vend - value);
+			if (entry)
+				cache_link(file, file->tail, entry);
+		}
+
+		off = eol + 1;
+	}
+}
+
+static struct cache_file *cache_load(const char *pathname)
+{
+	struct cache_file *file;
+	struct stat st;
+	char *map;
+	int fd;
+
+	file = calloc(1, sizeof(*file) + strlen(pathname) + 1);
+	if (!file)
+		return NULL;
+
+	strcpy(file->path, pathname);
+
+	if (cache_resize(file, CACHE_MIN_BUCKETS) < 0) {
+		free(file);
+		return NULL;
+	}
+
+	fd = open(pathname, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			file->missing = 1;
+			return file;
+		}
+
+		goto failed;
+	}
+
+	if (stats_flock(pathname, fd, LOCK_SH) < 0 || fstat(fd, &st) < 0)
+		goto failed;
+
+	file->mtime = st.st_mtime;
+	file->length = st.st_size;
+
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (!map || map == MAP_FAILED)
+			goto failed;
+
+		cache_parse(file, map, st.st_size);
+
+		munmap(map, st.st_size);
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	return file;
+
+failed:
+	if (fd >= 0)
+		close(fd);
+
+	cache_file_free(file);
+
+	return NULL;
+}
+
+/* Replaces the file by the contents of the copy */
+static int cache_write(struct cache_file *file)
+{
+	char tmp[PATH_MAX + 5], *buf, *ptr;
+	struct cache_entry *entry;
+	struct timeval start;
+	struct stat st;
+	mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	size_t size = 0;
+	int fd, err = 0;
+
+	if (!file->dirty)
+		return 0;
+
+	stats_start(&start);
+
+	for (entry = file->head; entry; entry = entry->next)
+		size += strlen(entry->key) + strlen(entry->value) + 2;
+
+	buf = malloc(size + 1);
+	if (!buf)
+		return -ENOMEM;
+
+	for (ptr = buf, entry = file->head; entry; entry = entry->next)
+		ptr += sprintf(ptr, "%s %s\n", entry->key, entry->value);
+
+	if (stat(file->path, &st) == 0)
+		mode = st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+	else
+		create_dirs(file->path, S_IRUSR | S_IWUSR | S_IXUSR |
+					S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file->path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	if (write(fd, buf, size) != (ssize_t) size)
+		err = -EIO;
+	else if (fdatasync(fd) < 0)
+		err = -errno;
+
+	stats_written(file->path, size);
+
+	close(fd);
+
+	if (err == 0 && rename(tmp, file->path) < 0)
+		err = -errno;
+
+	if (err < 0)
+		unlink(tmp);
+
+done:
+	free(buf);
+
+	if (err == 0) {
+		file->dirty = 0;
+		file->missing = 0;
+		cache_ndirty--;
+		cache_stamp(file);
+	}
+
+	stats_end(file->path, STATS_FLUSH, &start, NULL);
+
+	return err;
+}
+
+static void cache_file_release(struct cache_file *file)
+{
+	cache_write(file);
+
+	/* Whatever could not be written is lost at this point */
+	if (file->dirty)
+		cache_ndirty--;
+
+	cache_file_free(file);
+}
+
+static struct cache_file *cache_lookup(const char *pathname, int load)
+{
+	struct cache_file *file, **ptr;
+
+	for (ptr = &cache_files; *ptr; ptr = &(*ptr)->next) {
+		file = *ptr;
+
+		if (strcmp(file->path, pathname))
+			continue;
+
+		*ptr = file->next;
+
+		if (cache_stale(file)) {
+			cache_file_free(file);
+			cache_nfiles--;
+			break;
+		}
+
+		file->next = cache_files;
+		cache_files = file;
+
+		return file;
+	}
+
+	if (!load)
+		return NULL;
+
+	file = cache_load(pathname);
+	if (!file)
+		return NULL;
+
+	if (cache_nfiles >= CACHE_MAX_FILES) {
+		for (ptr = &cache_files; (*ptr)->next; ptr = &(*ptr)->next);
+
+		cache_file_release(*ptr);
+		*ptr = NULL;
+		cache_nfiles--;
+	}
+
+	file->next = cache_files;
+	cache_files = file;
+	cache_nfiles++;
+
+	return file;
+}
+
+static void cache_drop(const char *pathname)
+{
+	struct cache_file *file = cache_lookup(pathname, 0);
+
+	if (!file)
+		return;
+
+	cache_files = file->next;
+	cache_nfiles--;
+
+	cache_file_release(file);
+}
+
+static struct cache_entry *cache_find(struct cache_file *file,
+						const char *key, int icase)
+{
+	struct cache_entry *entry;
+	unsigned int hash;
+
+	hash = cache_hash(key);
+
+	for (entry = file->buckets[hash & (file->size - 1)]; entry;
+							entry = entry->chain) {
+		if (entry->hash != hash)
+			continue;
+
+		if (icase ? !strcasecmp(entry->key, key) :
+						!strcmp(entry->key, key))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Applies a write to the copy the way write_key() does to the file,
+ * returns 1 if anything changed, 0 if not and a negative error if the
+ * copy could not be updated.
+ */
+static int cache_apply(struct cache_file *file, const char *key,
+						const char *value, int icase)
+{
+	struct cache_entry *entry, *prev = NULL, *new;
+
+	entry = cache_find(file, key, icase);
+
+	/* An unchanged value leaves the line alone, the key case included */
+	if (entry && value && !strcmp(entry->value, value))
+		return 0;
+
+	if (entry && value && !strcmp(entry->key, key)) {
+		char *str;
+
+		str = strdup(value);
+		if (!str)
+			return -ENOMEM;
+
+		free(entry->value);
+		entry->value = str;
+
+		return 1;
+	}
+
+	if (entry) {
+		prev = entry->prev;
+		cache_unlink(file, entry);
+	} else if (value)
+		prev = file->tail;
+	else
+		return 0;
+
+	if (!value)
+		return 1;
+
+	new = cache_entry_new(key, strlen(key), value, strlen(value));
+	if (!new || cache_link(file, prev, new) < 0)
+		return -ENOMEM;
+
+	return 1;
+}
+
+static void cache_set_dirty(struct cache_file *file)
+{
+	if (file->dirty)
+		return;
+
+	file->dirty = 1;
+
+	if (cache_ndirty++ == 0 && cache_notify)
+		cache_notify();
+}
+
+/* Mirrors a successful write_key() to the file looked up before it */
+static void cache_update(struct cache_file *file, const char *pathname,
+				const char *key, const char *value, int icase)
+{
+	if (!file)
+		return;
+
+	file->missing = 0;
+
+	if (cache_apply(file, key, value, icase) < 0)
+		cache_drop(pathname);
+	else
+		cache_stamp(file);
+}
+
+void textfile_cache_enable(void)
+{
+	cache_enabled = 1;
+}
+
+void textfile_cache_defer(textfile_notify_cb notify)
+{
+	cache_notify = notify;
+}
+
+int textfile_cache_flush(void)
+{
+	struct cache_file *file;
+	int err = 0;
+
+	for (file = cache_files; file && cache_ndirty > 0; file = file->next) {
+		int ret = cache_write(file);
+		if (ret < 0 && err == 0)
+			err = ret;
+	}
+
+	return err;
+}
+
+void textfile_cache_disable(void)
+{
+	while (cache_files) {
+		struct cache_file *file = cache_files;
+
+		cache_files = file->next;
+		cache_file_release(file);
+	}
+
+	cache_nfiles = 0;
+	cache_enabled = 0;
+	cache_notify = NULL;
+}
+
+void textfile_stats_enable(unsigned int slow, textfile_slow_cb func)
+{
+	stats_enabled = 1;
+	stats_slow = slow;
+	stats_slow_cb = func;
+}
+
+void textfile_stats_disable(void)
+{
+	while (stats_files) {
+		struct stats_file *file = stats_files;
+
+		stats_files = file->next;
+		free(file);
+	}
+
+	stats_nfiles = 0;
+	stats_enabled = 0;
+	stats_slow_cb = NULL;
+}
+
+void textfile_stats_foreach(textfile_stats_cb func, void *data)
+{
+	struct stats_file *file;
+
+	for (file = stats_files; file; file = file->next)
+		func(file->path, &file->stats, data);
+}
+
+unsigned int textfile_stats_percentile(const struct textfile_stats *stats,
+							unsigned int percent)
+{
+	unsigned long total = 0, count = 0;
+	unsigned int bucket;
+
+	for (bucket = 0; bucket < TEXTFILE_STATS_BUCKETS; bucket++)
+		total += stats->latency[bucket];
+
+	if (total == 0)
+		return 0;
+
+	for (bucket = 0; bucket < TEXTFILE_STATS_BUCKETS - 1; bucket++) {
+		count += stats->latency[bucket];
+		if (count * 100 >= total * percent)
+			break;
+	}
+
+	/* The upper bound of the bucket, never more than the maximum */
+	return MIN(2U << bucket, stats->max);
+}
+
+static inline int write_key_value(const char *pathname, int fd,
+					const char *key, const char *value)
 {
 	char *str;
 	size_t size;
@@ -154,6 +972,8 @@ static inline int write_key_value(int fd, const char *key, const char *value)
 
 	if (write(fd, str, size) < 0)
 		err = errno;
+	else
+		stats_written(pathname, size);
 
 	free(str);
 
@@ -194,7 +1014,7 @@ static int write_key(const char *pathname, const char *key, const char *value, i
 	if (fd < 0)
 		return -errno;
 
-	if (flock(fd, LOCK_EX) < 0) {
+	if (stats_flock(pathname, fd, LOCK_EX) < 0) {
 		err = errno;
 		goto close;
 	}
@@ -209,7 +1029,7 @@ static int write_key(const char *pathname, const char *key, const char *value, i
 	if (!size) {
 		if (value) {
 			lseek(fd, size, SEEK_SET);
-			err = write_key_value(fd, key, value);
+			err = write_key_value(pathname, fd, key, value);
 		}
 		goto unlock;
 	}
@@ -227,7 +1047,7 @@ static int write_key(const char *pathname, const char *key, const char *value, i
 		if (value) {
 			munmap(map, size);
 			lseek(fd, size, SEEK_SET);
-			err = write_key_value(fd, key, value);
+			err = write_key_value(pathname, fd, key, value);
 		}
 		goto unlock;
 	}
@@ -255,8 +1075,9 @@ static int write_key(const char *pathname, const char *key, const char *value, i
 			goto unlock;
 		}
 		lseek(fd, base, SEEK_SET);
-		if (value)
-			err = write_key_value(fd, key, value);
+		if (value) {
+			err = write_key_value(pathname, fd, key, value);
+		}
 
 		goto unlock;
 	}
@@ -282,10 +1103,13 @@ static int write_key(const char *pathname, const char *key, const char *value, i
 	}
 	lseek(fd, base, SEEK_SET);
 	if (value)
-		err = write_key_value(fd, key, value);
+		err = write_key_value(pathname, fd, key, value);
 
+	/* Everything behind the key is written again */
 	if (write(fd, str, len) < 0)
 		err = errno;
+	else
+		stats_written(pathname, len);
 
 	free(str);
 
@@ -317,7 +1141,7 @@ static char *read_key(const char *pathname, const char *key, int icase)
 	if (fd < 0)
 		return NULL;
 
-	if (flock(fd, LOCK_SH) < 0) {
+	if (stats_flock(pathname, fd, LOCK_SH) < 0) {
 		err = errno;
 		goto close;
 	}
@@ -370,48 +1194,203 @@ close:
 	return str;
 }
 
+static int cached_write_key(const char *pathname, const char *key,
+						const char *value, int icase)
+{
+	struct cache_file *file;
+	int err;
+
+	file = cache_enabled ? cache_lookup(pathname, 0) : NULL;
+
+	/* Pending changes go out together with this one */
+	if (file && file->dirty) {
+		err = cache_apply(file, key, value, icase);
+		if (err < 0) {
+			cache_drop(pathname);
+			return write_key(pathname, key, value, icase);
+		}
+
+		err = cache_write(file);
+		errno = -err;
+
+		return err;
+	}
+
+	err = write_key(pathname, key, value, icase);
+
+	if (cache_enabled) {
+		if (err < 0)
+			cache_drop(pathname);
+		else
+			cache_update(file, pathname, key, value, icase);
+	}
+
+	errno = -err;
+
+	return err;
+}
+
+static char *cached_read_key(const char *pathname, const char *key,
+								int icase)
+{
+	struct cache_file *file;
+	struct cache_entry *entry;
+	char *str;
+
+	if (!cache_enabled)
+		return read_key(pathname, key, icase);
+
+	file = cache_lookup(pathname, 1);
+	if (!file)
+		return read_key(pathname, key, icase);
+
+	if (file->missing) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	entry = cache_find(file, key, icase);
+	if (!entry) {
+		errno = EILSEQ;
+		return NULL;
+	}
+
+	str = strdup(entry->value);
+	if (!str)
+		errno = ENOMEM;
+
+	return str;
+}
+
+static int cached_put_deferred(const char *pathname, const char *key,
+							const char *value)
+{
+	struct cache_file *file;
+	int err;
+
+	if (!cache_enabled || !cache_notify)
+		return -ENOTSUP;
+
+	file = cache_lookup(pathname, 1);
+	if (!file)
+		return -EIO;
+
+	err = cache_apply(file, key, value, 0);
+	if (err < 0) {
+		cache_drop(pathname);
+		return err;
+	}
+
+	if (err > 0) {
+		file->missing = 0;
+		cache_set_dirty(file);
+	}
+
+	return 0;
+}
+
+static int timed_write_key(const char *pathname, const char *key,
+			const char *value, int icase, const void *caller)
+{
+	struct timeval start;
+	int err;
+
+	stats_start(&start);
+
+	err = cached_write_key(pathname, key, value, icase);
+
+	stats_end(pathname, STATS_WRITE, &start, caller);
+
+	return err;
+}
+
+static char *timed_read_key(const char *pathname, const char *key,
+					int icase, const void *caller)
+{
+	struct timeval start;
+	char *str;
+
+	stats_start(&start);
+
+	str = cached_read_key(pathname, key, icase);
+
+	stats_end(pathname, STATS_READ, &start, caller);
+
+	return str;
+}
+
+int textfile_put_deferred(const char *pathname, const char *key,
+							const char *value)
+{
+	struct timeval start;
+	int err;
+
+	stats_start(&start);
+
+	err = cached_put_deferred(pathname, key, value);
+	if (err == -ENOTSUP)
+		return err;
+
+	stats_end(pathname, STATS_DEFERRED, &start,
+					__builtin_return_address(0));
+
+	return err;
+}
+
 int textfile_put(const char *pathname, const char *key, const char *value)
 {
-	return write_key(pathname, key, value, 0);
+	return timed_write_key(pathname, key, value, 0,
+					__builtin_return_address(0));
 }
 
 int textfile_caseput(const char *pathname, const char *key, const char *value)
 {
-	return write_key(pathname, key, value, 1);
+	return timed_write_key(pathname, key, value, 1,
+					__builtin_return_address(0));
 }
 
 int textfile_del(const char *pathname, const char *key)
 {
-	return write_key(pathname, key, NULL, 0);
+	return timed_write_key(pathname, key, NULL, 0,
+					__builtin_return_address(0));
 }
 
 int textfile_casedel(const char *pathname, const char *key)
 {
-	return write_key(pathname, key, NULL, 1);
+	return timed_write_key(pathname, key, NULL, 1,
+					__builtin_return_address(0));
 }
 
 char *textfile_get(const char *pathname, const char *key)
 {
-	return read_key(pathname, key, 0);
+	return timed_read_key(pathname, key, 0, __builtin_return_address(0));
 }
 
 char *textfile_caseget(const char *pathname, const char *key)
 {
-	return read_key(pathname, key, 1);
+	return timed_read_key(pathname, key, 1, __builtin_return_address(0));
 }
 
-int textfile_foreach(const char *pathname, textfile_cb func, void *data)
+static int foreach_key(const char *pathname, textfile_raw_cb func,
+								void *data)
 {
 	struct stat st;
-	char *map, *off, *end, *key, *value;
-	off_t size; size_t len;
+	char *map, *off, *end, *key;
+	off_t size; size_t keylen;
 	int fd, err = 0;
 
+	if (cache_enabled) {
+		struct cache_file *file = cache_lookup(pathname, 0);
+
+		if (file && file->dirty)
+			cache_write(file);
+	}
+
 	fd = open(pathname, O_RDONLY);
 	if (fd < 0)
 		return -errno;
 
-	if (flock(fd, LOCK_SH) < 0) {
+	if (stats_flock(pathname, fd, LOCK_SH) < 0) {
 		err = errno;
 		goto close;
 	}
@@ -438,48 +1417,23 @@ int textfile_foreach(const char *pathname, textfile_cb func, void *data)
 			break;
 		}
 
-		len = end - off;
-
-		key = malloc(len + 1);
-		if (!key) {
-			err = errno;
-			break;
-		}
-
-		memset(key, 0, len + 1);
-		memcpy(key, off, len);
+		key = off;
+		keylen = end - off;
 
 		off = end + 1;
 
 		if (size - (off - map) < 0) {
 			err = EILSEQ;
-			free(key);
 			break;
 		}
 
 		end = strnpbrk(off, size - (off - map), "\r\n");
 		if (!end) {
 			err = EILSEQ;
-			free(key);
-			break;
-		}
-
-		len = end - off;
-
-		value = malloc(len + 1);
-		if (!value) {
-			err = errno;
-			free(key);
 			break;
 		}
 
-		memset(value, 0, len + 1);
-		memcpy(value, off, len);
-
-		func(key, value, data);
-
-		free(key);
-		free(value);
+		func(key, keylen, off, end - off, data);
 
 		off = end + 1;
 	}
@@ -495,3 +1449,71 @@ close:
 
 	return 0;
 }
+
+static int timed_foreach(const char *pathname, textfile_raw_cb func,
+					void *data, const void *caller)
+{
+	struct timeval start;
+	int err;
+
+	stats_start(&start);
+
+	err = foreach_key(pathname, func, data);
+
+	stats_end(pathname, STATS_FOREACH, &start, caller);
+
+	return err;
+}
+
+int textfile_foreach_raw(const char *pathname, textfile_raw_cb func,
+								void *data)
+{
+	return timed_foreach(pathname, func, data,
+					__builtin_return_address(0));
+}
+
+struct foreach_data {
+	textfile_cb func;
+	void *data;
+	char *buf;
+	size_t size;
+};
+
+/* Hands out NUL terminated copies, all made in the same buffer */
+static void foreach_copy(const char *key, size_t keylen, const char *value,
+					size_t valuelen, void *user_data)
+{
+	struct foreach_data *fe = user_data;
+	size_t size = keylen + valuelen + 2;
+
+	if (size > fe->size) {
+		char *buf = realloc(fe->buf, size);
+		if (!buf)
+			return;
+
+		fe->buf = buf;
+		fe->size = size;
+	}
+
+	memcpy(fe->buf, key, keylen);
+	fe->buf[keylen] = '\0';
+	memcpy(fe->buf + keylen + 1, value, valuelen);
+	fe->buf[keylen + 1 + valuelen] = '\0';
+
+	fe->func(fe->buf, fe->buf + keylen + 1, fe->data);
+}
+
+int textfile_foreach(const char *pathname, textfile_cb func, void *data)
+{
+	struct foreach_data fe = { func, data, NULL, 0 };
+	int err, saved_errno;
+
+	err = timed_foreach(pathname, foreach_copy, &fe,
+					__builtin_return_address(0));
+
+	saved_errno = errno;
+	free(fe.buf);
+	errno = saved_errno;
+
+	return err;
+}
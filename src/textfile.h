@@ -36,8 +36,63 @@ int textfile_casedel(const char *pathname, const char *key);
 char *textfile_get(const char *pathname, const char *key);
 char *textfile_caseget(const char *pathname, const char *key);
 
+/* Keeps the files read in memory, only for the daemon owning them */
+void textfile_cache_enable(void);
+void textfile_cache_disable(void);
+
+/* Allows deferred writes, notify is called when the first one is made
+ * after textfile_cache_flush() wrote out all the previous ones */
+typedef void (*textfile_notify_cb) (void);
+
+void textfile_cache_defer(textfile_notify_cb notify);
+int textfile_cache_flush(void);
+
+int textfile_put_deferred(const char *pathname, const char *key,
+							const char *value);
+
+/* Access statistics of each file, kept once enabled */
+#define TEXTFILE_STATS_BUCKETS	24
+
+struct textfile_stats {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long deferred;
+	unsigned long iterations;
+	unsigned long flushes;
+	unsigned long long written;	/* bytes */
+	unsigned long long lock_wait;	/* usec */
+	unsigned long long busy;	/* usec */
+	unsigned int max;		/* usec */
+	unsigned int latency[TEXTFILE_STATS_BUCKETS]; /* below 2^(n+1) usec */
+};
+
+/* Called for operations taking at least slow usec, caller is the return
+ * address of the textfile function or NULL for flushes */
+typedef void (*textfile_slow_cb) (const char *pathname, const char *op,
+					unsigned int usec, const void *caller);
+
+typedef void (*textfile_stats_cb) (const char *pathname,
+			const struct textfile_stats *stats, void *data);
+
+void textfile_stats_enable(unsigned int slow, textfile_slow_cb func);
+void textfile_stats_disable(void);
+void textfile_stats_foreach(textfile_stats_cb func, void *data);
+
+/* Upper bound of the latency below which percent of the operations are */
+unsigned int textfile_stats_percentile(const struct textfile_stats *stats,
+							unsigned int percent);
+
 typedef void (*textfile_cb) (char *key, char *value, void *data);
 
 int textfile_foreach(const char *pathname, textfile_cb func, void *data);
 
+/* Same as textfile_foreach() without copying anything: key and value
+ * point into the file mapping, are not NUL terminated and only valid
+ * during the callback */
+typedef void (*textfile_raw_cb) (const char *key, size_t keylen,
+				const char *value, size_t valuelen, void *data);
+
+int textfile_foreach_raw(const char *pathname, textfile_raw_cb func,
+								void *data);
+
 #endif /* __TEXTFILE_H */
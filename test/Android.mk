@@ -179,6 +179,137 @@ LOCAL_MODULE:=avtest
 
 include $(BUILD_EXECUTABLE)
 
+#
+# avbench
+#
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS:= \
+	-DVERSION=\"4.93\"
+
+LOCAL_SRC_FILES:= \
+	avbench.c
+
+LOCAL_C_INCLUDES:= \
+	$(LOCAL_PATH)/../lib \
+	$(LOCAL_PATH)/../src
+
+LOCAL_SHARED_LIBRARIES := \
+	libbluetoothd libbluetooth
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE:=avbench
+
+include $(BUILD_EXECUTABLE)
+
+#
+# sdpbench
+#
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS:= \
+	-DVERSION=\"4.93\"
+
+LOCAL_SRC_FILES:= \
+	sdpbench.c
+
+LOCAL_C_INCLUDES:= \
+	$(LOCAL_PATH)/../lib \
+	$(LOCAL_PATH)/../src
+
+LOCAL_SHARED_LIBRARIES := \
+	libbluetoothd libbluetooth
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE:=sdpbench
+
+include $(BUILD_EXECUTABLE)
+
+#
+# l2bench
+#
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS:= \
+	-DVERSION=\"4.93\"
+
+LOCAL_SRC_FILES:= \
+	l2bench.c
+
+LOCAL_C_INCLUDES:= \
+	$(LOCAL_PATH)/../lib \
+	$(LOCAL_PATH)/../src
+
+LOCAL_SHARED_LIBRARIES := \
+	libbluetoothd libbluetooth
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE:=l2bench
+
+include $(BUILD_EXECUTABLE)
+
+#
+# parsebench
+#
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS:= \
+	-DVERSION=\"4.93\"
+
+LOCAL_SRC_FILES:= \
+	parsebench.c
+
+LOCAL_C_INCLUDES:= \
+	$(LOCAL_PATH)/../lib \
+	$(LOCAL_PATH)/../src \
+	$(LOCAL_PATH)/../attrib \
+	$(call include-path-for, glib) \
+	$(call include-path-for, glib)/glib
+
+LOCAL_SHARED_LIBRARIES := \
+	libbluetoothd libbluetooth libglib
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE:=parsebench
+
+include $(BUILD_EXECUTABLE)
+
+#
+# hfbench
+#
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS:= \
+	-DVERSION=\"4.93\"
+
+LOCAL_SRC_FILES:= \
+	hfbench.c \
+	../audio/ipc.c
+
+LOCAL_C_INCLUDES:= \
+	$(LOCAL_PATH)/../lib \
+	$(LOCAL_PATH)/../src \
+	$(LOCAL_PATH)/../audio \
+	$(call include-path-for, dbus)
+
+LOCAL_SHARED_LIBRARIES := \
+	libbluetoothd libbluetooth libdbus
+
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := eng
+LOCAL_MODULE:=hfbench
+
+include $(BUILD_EXECUTABLE)
+
 #
 # bdaddr
 #
@@ -0,0 +1,649 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+
+#define AVDTP_PSM			25
+
+#define AVDTP_PKT_TYPE_SINGLE		0x00
+#define AVDTP_PKT_TYPE_START		0x01
+#define AVDTP_PKT_TYPE_CONTINUE		0x02
+#define AVDTP_PKT_TYPE_END		0x03
+
+#define AVDTP_MSG_TYPE_COMMAND		0x00
+#define AVDTP_MSG_TYPE_GEN_REJECT	0x01
+#define AVDTP_MSG_TYPE_ACCEPT		0x02
+#define AVDTP_MSG_TYPE_REJECT		0x03
+
+#define AVDTP_DISCOVER			0x01
+#define AVDTP_GET_CAPABILITIES		0x02
+#define AVDTP_SET_CONFIGURATION		0x03
+#define AVDTP_OPEN			0x06
+#define AVDTP_START			0x07
+#define AVDTP_CLOSE			0x08
+#define AVDTP_SUSPEND			0x09
+
+#define AVDTP_MEDIA_TYPE_AUDIO		0x00
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+
+struct avdtp_header {
+	uint8_t message_type:2;
+	uint8_t packet_type:2;
+	uint8_t transaction:4;
+	uint8_t signal_id:6;
+	uint8_t rfa0:2;
+} __attribute__ ((packed));
+
+struct seid_info {
+	uint8_t rfa0:1;
+	uint8_t inuse:1;
+	uint8_t seid:6;
+	uint8_t rfa2:3;
+	uint8_t type:1;
+	uint8_t media_type:4;
+} __attribute__ ((packed));
+
+struct avdtp_start_header {
+	uint8_t message_type:2;
+	uint8_t packet_type:2;
+	uint8_t transaction:4;
+	uint8_t no_of_packets;
+	uint8_t signal_id:6;
+	uint8_t rfa0:2;
+} __attribute__ ((packed));
+
+struct avdtp_continue_header {
+	uint8_t message_type:2;
+	uint8_t packet_type:2;
+	uint8_t transaction:4;
+} __attribute__ ((packed));
+
+#elif __BYTE_ORDER == __BIG_ENDIAN
+
+struct avdtp_header {
+	uint8_t transaction:4;
+	uint8_t packet_type:2;
+	uint8_t message_type:2;
+	uint8_t rfa0:2;
+	uint8_t signal_id:6;
+} __attribute__ ((packed));
+
+struct seid_info {
+	uint8_t seid:6;
+	uint8_t inuse:1;
+	uint8_t rfa0:1;
+	uint8_t media_type:4;
+	uint8_t type:1;
+	uint8_t rfa2:3;
+} __attribute__ ((packed));
+
+struct avdtp_start_header {
+	uint8_t transaction:4;
+	uint8_t packet_type:2;
+	uint8_t message_type:2;
+	uint8_t no_of_packets;
+	uint8_t rfa0:2;
+	uint8_t signal_id:6;
+} __attribute__ ((packed));
+
+struct avdtp_continue_header {
+	uint8_t transaction:4;
+	uint8_t packet_type:2;
+	uint8_t message_type:2;
+} __attribute__ ((packed));
+
+#else
+#error "Unknown byte order"
+#endif
+
+static const unsigned char media_transport[] = {
+		0x01,	/* Media transport category */
+		0x00,
+		0x07,	/* Media codec category */
+		0x06,
+		0x00,	/* Media type audio */
+		0x00,	/* Codec SBC */
+		0x21,	/* 44.1 kHz, joint stereo */
+		0x15,	/* 16 blocks, 8 subbands, loudness */
+		0x02,
+		0x35,
+};
+
+/* Commands timed by the benchmark, in the order they are sent */
+static const struct {
+	uint8_t signal_id;
+	const char *name;
+} commands[] = {
+	{ AVDTP_DISCOVER,		"discover"	},
+	{ AVDTP_GET_CAPABILITIES,	"getcap"	},
+	{ AVDTP_SET_CONFIGURATION,	"setconf"	},
+	{ AVDTP_OPEN,			"open"		},
+	{ AVDTP_START,			"start"		},
+	{ AVDTP_SUSPEND,		"suspend"	},
+	{ AVDTP_CLOSE,			"close"		},
+};
+
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+struct stats {
+	unsigned int count;
+	unsigned int rejected;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+/* Usage of the daemon answering, sampled from /proc */
+struct usage {
+	uint64_t cpu;			/* usec of user and system time */
+	unsigned long minflt;
+};
+
+static struct stats cmd_stats[NUM_COMMANDS];
+static struct stats setup_stats;
+
+static bdaddr_t src, dst;
+static int fragment = 0;
+static int fragment_size = 4;
+static pid_t daemon_pid = 0;
+static uint8_t transaction = 0;
+
+static uint64_t get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int get_usage(pid_t pid, struct usage *usage)
+{
+	unsigned long utime, stime;
+	char path[64], buf[1024], *ptr;
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	ptr = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!ptr)
+		return -EIO;
+
+	/* The command name may contain spaces, skip past it */
+	ptr = strrchr(buf, ')');
+	if (!ptr)
+		return -EIO;
+
+	n = sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %*u %*u "
+					"%lu %lu", &usage->minflt,
+					&utime, &stime);
+	if (n != 3)
+		return -EIO;
+
+	usage->cpu = (uint64_t) (utime + stime) * 1000000 /
+						sysconf(_SC_CLK_TCK);
+
+	return 0;
+}
+
+static void stats_add(struct stats *s, uint64_t usec)
+{
+	if (s->count == 0 || usec < s->min)
+		s->min = usec;
+	if (usec > s->max)
+		s->max = usec;
+
+	s->total += usec;
+	s->count++;
+}
+
+static int l2cap_connect(int min_mtu)
+{
+	struct sockaddr_l2 addr;
+	struct l2cap_options l2o;
+	socklen_t optlen;
+	int sk;
+
+	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+	if (sk < 0) {
+		perror("Can't create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	bacpy(&addr.l2_bdaddr, &src);
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Can't bind socket");
+		goto error;
+	}
+
+	if (min_mtu) {
+		/* Forces the responses to be fragmented as well */
+		memset(&l2o, 0, sizeof(l2o));
+		optlen = sizeof(l2o);
+
+		if (getsockopt(sk, SOL_L2CAP, L2CAP_OPTIONS, &l2o,
+							&optlen) == 0) {
+			l2o.imtu = 48;
+			l2o.omtu = 48;
+			setsockopt(sk, SOL_L2CAP, L2CAP_OPTIONS, &l2o,
+								sizeof(l2o));
+		}
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	bacpy(&addr.l2_bdaddr, &dst);
+	addr.l2_psm = htobs(AVDTP_PSM);
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Unable to connect");
+		goto error;
+	}
+
+	return sk;
+
+error:
+	close(sk);
+	return -1;
+}
+
+/* Sends a command, split into start, continue and end packets carrying
+ * fragment_size bytes each when fragmenting */
+static int send_command(int sk, uint8_t signal_id, const void *params,
+								size_t len)
+{
+	unsigned char buf[672];
+	struct avdtp_header *hdr = (void *) buf;
+	struct avdtp_start_header *start = (void *) buf;
+	struct avdtp_continue_header *cont = (void *) buf;
+	const unsigned char *ptr = params;
+	size_t chunk, packets;
+
+	transaction = (transaction + 1) % 16;
+
+	if (!fragment || len <= (size_t) fragment_size) {
+		memset(buf, 0, sizeof(*hdr));
+		hdr->transaction = transaction;
+		hdr->packet_type = AVDTP_PKT_TYPE_SINGLE;
+		hdr->message_type = AVDTP_MSG_TYPE_COMMAND;
+		hdr->signal_id = signal_id;
+		memcpy(buf + sizeof(*hdr), params, len);
+
+		return write(sk, buf, sizeof(*hdr) + len) < 0 ? -errno : 0;
+	}
+
+	packets = (len + fragment_size - 1) / fragment_size;
+
+	memset(buf, 0, sizeof(*start));
+	start->transaction = transaction;
+	start->packet_type = AVDTP_PKT_TYPE_START;
+	start->message_type = AVDTP_MSG_TYPE_COMMAND;
+	start->no_of_packets = packets;
+	start->signal_id = signal_id;
+	memcpy(buf + sizeof(*start), ptr, fragment_size);
+
+	if (write(sk, buf, sizeof(*start) + fragment_size) < 0)
+		return -errno;
+
+	for (ptr += fragment_size, len -= fragment_size; len > 0;
+					ptr += chunk, len -= chunk) {
+		chunk = len > (size_t) fragment_size ?
+					(size_t) fragment_size : len;
+
+		memset(buf, 0, sizeof(*cont));
+		cont->transaction = transaction;
+		cont->packet_type = chunk == len ? AVDTP_PKT_TYPE_END :
+						AVDTP_PKT_TYPE_CONTINUE;
+		cont->message_type = AVDTP_MSG_TYPE_COMMAND;
+		memcpy(buf + sizeof(*cont), ptr, chunk);
+
+		if (write(sk, buf, sizeof(*cont) + chunk) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/* Waits for the response to the last command, reassembling fragments, and
+ * returns the length of its parameters or a negative error */
+static int recv_response(int sk, uint8_t signal_id, unsigned char *params,
+								size_t size)
+{
+	unsigned char buf[672];
+	struct avdtp_header *hdr = (void *) buf;
+	struct avdtp_start_header *start = (void *) buf;
+	size_t len = 0, skip;
+	uint8_t message_type = 0;
+	ssize_t ret;
+
+	while (1) {
+		ret = read(sk, buf, sizeof(buf));
+		if (ret < 0)
+			return -errno;
+		if (ret < 1)
+			return -EIO;
+
+		if (hdr->transaction != transaction)
+			continue;
+
+		switch (hdr->packet_type) {
+		case AVDTP_PKT_TYPE_SINGLE:
+			if (ret < (ssize_t) sizeof(*hdr))
+				return -EIO;
+			message_type = hdr->message_type;
+			if (hdr->signal_id != signal_id)
+				continue;
+			skip = sizeof(*hdr);
+			break;
+		case AVDTP_PKT_TYPE_START:
+			if (ret < (ssize_t) sizeof(*start))
+				return -EIO;
+			message_type = start->message_type;
+			if (start->signal_id != signal_id)
+				continue;
+			skip = sizeof(*start);
+			len = 0;
+			break;
+		default:
+			skip = sizeof(struct avdtp_continue_header);
+			break;
+		}
+
+		/* Commands from the daemon would carry our label by chance */
+		if (message_type == AVDTP_MSG_TYPE_COMMAND)
+			continue;
+
+		if (len + ret - skip > size)
+			return -ENOBUFS;
+
+		memcpy(params + len, buf + skip, ret - skip);
+		len += ret - skip;
+
+		if (hdr->packet_type == AVDTP_PKT_TYPE_SINGLE ||
+				hdr->packet_type == AVDTP_PKT_TYPE_END)
+			break;
+	}
+
+	if (message_type != AVDTP_MSG_TYPE_ACCEPT)
+		return -EBADMSG;
+
+	return len;
+}
+
+static int run_command(int sk, int index, const void *params, size_t len,
+					unsigned char *rsp, size_t size)
+{
+	uint64_t begin;
+	int ret;
+
+	begin = get_usec();
+
+	ret = send_command(sk, commands[index].signal_id, params, len);
+	if (ret == 0)
+		ret = recv_response(sk, commands[index].signal_id, rsp, size);
+
+	if (ret == -EBADMSG)
+		cmd_stats[index].rejected++;
+	else if (ret >= 0)
+		stats_add(&cmd_stats[index], get_usec() - begin);
+
+	return ret;
+}
+
+/* One full stream setup and teardown, returns 0 on success */
+static int run_cycle(int sk)
+{
+	unsigned char rsp[672], params[2 + sizeof(media_transport)];
+	struct seid_info *sei = (void *) rsp;
+	uint8_t acp_seid = 0;
+	uint64_t begin;
+	int i, ret, media_sk = -1;
+
+	begin = get_usec();
+
+	ret = run_command(sk, 0, NULL, 0, rsp, sizeof(rsp));
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < ret / (int) sizeof(*sei); i++) {
+		if (!sei[i].inuse &&
+				sei[i].media_type == AVDTP_MEDIA_TYPE_AUDIO) {
+			acp_seid = sei[i].seid;
+			break;
+		}
+	}
+
+	if (acp_seid == 0) {
+		fprintf(stderr, "No free audio endpoint\n");
+		return -ENOENT;
+	}
+
+	params[0] = acp_seid << 2;
+	ret = run_command(sk, 1, params, 1, rsp, sizeof(rsp));
+	if (ret < 0)
+		return ret;
+
+	params[1] = 1 << 2; /* INT SEID */
+	memcpy(&params[2], media_transport, sizeof(media_transport));
+	ret = run_command(sk, 2, params, sizeof(params), rsp, sizeof(rsp));
+	if (ret < 0)
+		return ret;
+
+	ret = run_command(sk, 3, params, 1, rsp, sizeof(rsp));
+	if (ret < 0)
+		goto close;
+
+	media_sk = l2cap_connect(0);
+	if (media_sk < 0) {
+		ret = -EIO;
+		goto close;
+	}
+
+	ret = run_command(sk, 4, params, 1, rsp, sizeof(rsp));
+	if (ret < 0)
+		goto close;
+
+	stats_add(&setup_stats, get_usec() - begin);
+
+	ret = run_command(sk, 5, params, 1, rsp, sizeof(rsp));
+
+close:
+	i = run_command(sk, 6, params, 1, rsp, sizeof(rsp));
+	if (ret >= 0)
+		ret = i;
+
+	if (media_sk >= 0)
+		close(media_sk);
+
+	return ret < 0 ? ret : 0;
+}
+
+static void print_stats(const char *name, const struct stats *s)
+{
+	if (s->count == 0) {
+		printf("%-10s %8s\n", name, "-");
+		return;
+	}
+
+	printf("%-10s %8u %8u %10llu %10llu %10llu\n", name, s->count,
+				s->rejected, (unsigned long long) s->min,
+				(unsigned long long) (s->total / s->count),
+				(unsigned long long) s->max);
+}
+
+static void usage(void)
+{
+	printf("avbench - AVDTP signaling benchmark ver %s\n", VERSION);
+	printf("Usage:\n"
+		"\tavbench [options] <remote address>\n");
+	printf("Options:\n"
+		"\t--device <hcidev>    HCI device\n"
+		"\t--count <N>          Number of stream setups, default 100\n"
+		"\t--fragment <bytes>   Send fragmented commands of this size\n"
+		"\t                     and use the minimum MTU\n"
+		"\t--pid <pid>          Sample CPU time and page faults of the\n"
+		"\t                     responding daemon\n");
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "device",	1, 0, 'i' },
+	{ "count",	1, 0, 'n' },
+	{ "fragment",	1, 0, 'F' },
+	{ "pid",	1, 0, 'p' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	struct usage before, after;
+	unsigned int i, count = 100, failed = 0, cmds = 0;
+	uint64_t begin, elapsed;
+	int opt, sk, ret;
+
+	bacpy(&src, BDADDR_ANY);
+	bacpy(&dst, BDADDR_ANY);
+
+	while ((opt = getopt_long(argc, argv, "+i:n:F:p:h",
+						main_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'i':
+			if (!strncmp(optarg, "hci", 3))
+				hci_devba(atoi(optarg + 3), &src);
+			else
+				str2ba(optarg, &src);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		case 'F':
+			fragment = 1;
+			fragment_size = atoi(optarg);
+			if (fragment_size < 1 || fragment_size > 40) {
+				fprintf(stderr, "Invalid fragment size\n");
+				exit(1);
+			}
+			break;
+
+		case 'p':
+			daemon_pid = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (!argv[optind]) {
+		usage();
+		exit(1);
+	}
+
+	str2ba(argv[optind], &dst);
+
+	sk = l2cap_connect(fragment);
+	if (sk < 0)
+		exit(1);
+
+	if (daemon_pid && get_usage(daemon_pid, &before) < 0) {
+		fprintf(stderr, "Unable to read usage of pid %d\n",
+							daemon_pid);
+		daemon_pid = 0;
+	}
+
+	begin = get_usec();
+
+	for (i = 0; i < count; i++) {
+		ret = run_cycle(sk);
+		if (ret < 0) {
+			fprintf(stderr, "Cycle %u failed: %s (%d)\n", i,
+							strerror(-ret), -ret);
+			failed++;
+		}
+	}
+
+	elapsed = get_usec() - begin;
+
+	printf("%-10s %8s %8s %10s %10s %10s\n", "command", "count",
+				"rejected", "min (us)", "avg (us)", "max (us)");
+
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		print_stats(commands[i].name, &cmd_stats[i]);
+		cmds += cmd_stats[i].count + cmd_stats[i].rejected;
+	}
+
+	print_stats("setup", &setup_stats);
+
+	printf("\n%u cycles, %u failed, %u commands in %llu ms",
+			count, failed, cmds,
+			(unsigned long long) elapsed / 1000);
+	if (elapsed)
+		printf(", %llu commands/s",
+			(unsigned long long) cmds * 1000000 / elapsed);
+	printf("\n");
+
+	if (daemon_pid && cmds && get_usage(daemon_pid, &after) == 0) {
+		printf("daemon: %llu us of CPU per command, "
+				"%lu minor faults per cycle\n",
+				(unsigned long long) (after.cpu - before.cpu) /
+									cmds,
+				count ? (after.minflt - before.minflt) /
+								count : 0);
+	}
+
+	close(sk);
+
+	return failed ? 1 : 0;
+}
@@ -53,6 +53,8 @@
 
 #include <glib.h>
 
+#include <dbus/dbus.h>
+
 #define GHCI_DEV		"/dev/ghci"
 
 #define VHCI_DEV		"/dev/vhci"
@@ -133,6 +135,7 @@ static void sig_term(int sig)
 }
 
 static gboolean io_acl_data(GIOChannel *chan, GIOCondition cond, gpointer data);
+static void bench_start(void);
 static gboolean io_conn_ind(GIOChannel *chan, GIOCondition cond, gpointer data);
 static gboolean io_hci_data(GIOChannel *chan, GIOCondition cond, gpointer data);
 
@@ -678,6 +681,7 @@ static void hci_host_control(uint16_t ocf, int plen, uint8_t *data)
 	case OCF_WRITE_SCAN_ENABLE:
 		status = scan_enable(data);
 		command_complete(ogf, ocf, 1, &status);
+		bench_start();
 		break;
 
 	case OCF_WRITE_AUTH_ENABLE:
@@ -998,6 +1002,534 @@ static gboolean io_hci_data(GIOChannel *chan, GIOCondition cond, gpointer data)
 	return TRUE;
 }
 
+/* Benchmark mode: floods a running bluetoothd with events and measures
+ * how fast and how expensively it turns them into D-Bus signals */
+
+#define BENCH_TICK		10	/* ms */
+#define BENCH_REPORT		1000	/* ms */
+#define BENCH_MAX_PEERS		65536
+#define BENCH_DEFAULT_RATE	100
+#define BENCH_DEFAULT_PEERS	256
+#define BENCH_LE_REPORTS	6	/* longest names still fit one event */
+#define BENCH_MAX_CHURN		0x0e00	/* connection handles are 12 bits */
+
+enum {
+	BENCH_NONE,
+	BENCH_INQUIRY,
+	BENCH_LE,
+	BENCH_CHURN,
+};
+
+static struct {
+	int		mode;
+	unsigned int	rate;		/* events per second */
+	unsigned int	peers;
+	unsigned int	duration;	/* seconds, 0 runs until killed */
+	gboolean	running;
+	struct timeval	start;
+	struct timeval	*pending;	/* per peer, oldest unsignalled send */
+	guint8		*connected;
+	unsigned int	round;
+	unsigned int	next;
+	uint64_t	sent;
+	uint64_t	signals;
+	uint64_t	latency_sum;	/* us */
+	uint64_t	latency_max;	/* us */
+	uint64_t	last_sent;
+	uint64_t	last_signals;
+	unsigned long	start_cpu;
+	unsigned long	last_cpu;
+	DBusConnection	*conn;
+	pid_t		daemon_pid;
+} bench;
+
+static const char *bench_modes[] = { NULL, "inquiry", "le", "churn" };
+
+static int bench_mode_from_str(const char *str)
+{
+	unsigned int i;
+
+	for (i = BENCH_INQUIRY; i < G_N_ELEMENTS(bench_modes); i++)
+		if (!strcasecmp(str, bench_modes[i]))
+			return i;
+
+	return BENCH_NONE;
+}
+
+static void bench_peer(unsigned int idx, bdaddr_t *ba)
+{
+	ba->b[5] = 0x00;
+	ba->b[4] = 0xbe;
+	ba->b[3] = 0x4c;
+	ba->b[2] = bench.mode;
+	ba->b[1] = idx >> 8;
+	ba->b[0] = idx & 0xff;
+}
+
+static int bench_peer_index(bdaddr_t *ba)
+{
+	unsigned int idx;
+
+	if (ba->b[5] != 0x00 || ba->b[4] != 0xbe || ba->b[3] != 0x4c ||
+						ba->b[2] != bench.mode)
+		return -1;
+
+	idx = (ba->b[1] << 8) | ba->b[0];
+	if (idx >= bench.peers)
+		return -1;
+
+	return idx;
+}
+
+static void bench_mark_sent(unsigned int idx)
+{
+	struct timeval *tv = &bench.pending[idx];
+
+	bench.sent++;
+
+	if (timerisset(tv))
+		return;
+
+	gettimeofday(tv, NULL);
+}
+
+static void bench_mark_signal(bdaddr_t *ba)
+{
+	struct timeval now, diff;
+	uint64_t us;
+	int idx;
+
+	idx = bench_peer_index(ba);
+	if (idx < 0)
+		return;
+
+	bench.signals++;
+
+	if (!timerisset(&bench.pending[idx]))
+		return;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &bench.pending[idx], &diff);
+	timerclear(&bench.pending[idx]);
+
+	us = diff.tv_sec * 1000000ull + diff.tv_usec;
+	bench.latency_sum += us;
+	if (us > bench.latency_max)
+		bench.latency_max = us;
+}
+
+/* Name changes every round so the daemon can not drop the result as a
+ * duplicate and every send is expected to produce a signal */
+static uint8_t bench_eir(uint8_t *eir, unsigned int idx)
+{
+	char name[HCI_MAX_NAME_LENGTH];
+	size_t len;
+
+	snprintf(name, sizeof(name), "hciemu %u.%u", idx, bench.round);
+	len = strlen(name);
+
+	eir[0] = len + 1;
+	eir[1] = 0x09;	/* Complete Local Name */
+	memcpy(eir + 2, name, len);
+
+	return len + 2;
+}
+
+static void bench_send_event(uint8_t *buf, uint8_t *ptr)
+{
+	write_snoop(vdev.dd, HCI_EVENT_PKT, 1, buf, ptr - buf);
+
+	if (write(vdev.fd, buf, ptr - buf) < 0)
+		syslog(LOG_ERR, "Can't send event: %s (%d)",
+						strerror(errno), errno);
+}
+
+static void bench_inquiry_result(unsigned int idx)
+{
+	uint8_t buf[HCI_MAX_FRAME_SIZE], *ptr = buf;
+	extended_inquiry_info *info;
+	hci_event_hdr *he;
+
+	*ptr++ = HCI_EVENT_PKT;
+
+	he = (void *) ptr; ptr += HCI_EVENT_HDR_SIZE;
+
+	he->evt  = EVT_EXTENDED_INQUIRY_RESULT;
+	he->plen = 1 + EXTENDED_INQUIRY_INFO_SIZE;
+
+	*ptr++ = 1;	/* Num_Responses */
+
+	info = (void *) ptr; ptr += EXTENDED_INQUIRY_INFO_SIZE;
+
+	memset(info, 0, EXTENDED_INQUIRY_INFO_SIZE);
+	bench_peer(idx, &info->bdaddr);
+	info->pscan_rep_mode = 0x01;
+	info->dev_class[1] = 0x01;	/* Computer */
+	info->rssi = -40 - (idx % 40);
+	bench_eir(info->data, idx);
+
+	bench_send_event(buf, ptr);
+	bench_mark_sent(idx);
+}
+
+static unsigned int bench_le_reports(unsigned int idx, unsigned int count)
+{
+	uint8_t buf[HCI_MAX_FRAME_SIZE], *ptr = buf;
+	evt_le_meta_event *me;
+	le_advertising_info *info;
+	hci_event_hdr *he;
+	unsigned int i;
+
+	*ptr++ = HCI_EVENT_PKT;
+
+	he = (void *) ptr; ptr += HCI_EVENT_HDR_SIZE;
+	he->evt = EVT_LE_META_EVENT;
+
+	me = (void *) ptr; ptr += EVT_LE_META_EVENT_SIZE;
+	me->subevent = EVT_LE_ADVERTISING_REPORT;
+
+	*ptr++ = count;	/* Num_Reports */
+
+	for (i = 0; i < count; i++) {
+		info = (void *) ptr; ptr += LE_ADVERTISING_INFO_SIZE;
+
+		info->evt_type = 0x00;	/* ADV_IND */
+		info->bdaddr_type = LE_PUBLIC_ADDRESS;
+		bench_peer((idx + i) % bench.peers, &info->bdaddr);
+		info->length = bench_eir(info->data, (idx + i) % bench.peers);
+		ptr += info->length;
+
+		*ptr++ = -40 - (idx % 40);	/* RSSI */
+	}
+
+	he->plen = ptr - buf - 1 - HCI_EVENT_HDR_SIZE;
+
+	bench_send_event(buf, ptr);
+
+	for (i = 0; i < count; i++)
+		bench_mark_sent((idx + i) % bench.peers);
+
+	return count;
+}
+
+static void bench_churn(unsigned int idx)
+{
+	struct vhci_conn conn;
+
+	bench_peer(idx, &conn.dest);
+	/* Stay clear of the handles used by real emulated links */
+	conn.handle = VHCI_MAX_CONN + 1 + idx;
+	conn.chan = NULL;
+
+	if (bench.connected[idx]) {
+		disconn_complete(&conn);
+		bench.connected[idx] = 0;
+	} else {
+		connect_complete(&conn);
+		bench.connected[idx] = 1;
+	}
+
+	bench_mark_sent(idx);
+}
+
+static unsigned long bench_daemon_cpu(void)
+{
+	unsigned long utime, stime;
+	char path[32], buf[512], *ptr;
+	ssize_t len;
+	int fd;
+
+	if (bench.daemon_pid <= 0)
+		return 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", bench.daemon_pid);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+
+	buf[len] = '\0';
+
+	/* Skip pid and comm, the latter may contain spaces */
+	ptr = strrchr(buf, ')');
+	if (!ptr)
+		return 0;
+
+	if (sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+					"%lu %lu", &utime, &stime) != 2)
+		return 0;
+
+	return utime + stime;
+}
+
+static void bench_message(DBusMessage *msg)
+{
+	const char *path, *address, *dev;
+	char str[18];
+	bdaddr_t ba;
+	int i;
+
+	if (dbus_message_is_signal(msg, "org.bluez.Adapter", "DeviceFound")) {
+		if (!dbus_message_get_args(msg, NULL,
+					DBUS_TYPE_STRING, &address,
+					DBUS_TYPE_INVALID))
+			return;
+
+		str2ba(address, &ba);
+		bench_mark_signal(&ba);
+		return;
+	}
+
+	/* Churn is observed through the Connected property of the device
+	 * object, whose path ends in dev_XX_XX_XX_XX_XX_XX */
+	if (!dbus_message_is_signal(msg, "org.bluez.Device", "PropertyChanged"))
+		return;
+
+	path = dbus_message_get_path(msg);
+	if (!path)
+		return;
+
+	dev = strstr(path, "/dev_");
+	if (!dev || strlen(dev + 5) != 17)
+		return;
+
+	for (i = 0; i < 17; i++)
+		str[i] = dev[5 + i] == '_' ? ':' : dev[5 + i];
+	str[17] = '\0';
+
+	str2ba(str, &ba);
+	bench_mark_signal(&ba);
+}
+
+static gboolean bench_dbus_dispatch(void)
+{
+	DBusMessage *msg;
+
+	if (!dbus_connection_read_write(bench.conn, 0))
+		return FALSE;
+
+	while ((msg = dbus_connection_pop_message(bench.conn))) {
+		if (bench.running)
+			bench_message(msg);
+		dbus_message_unref(msg);
+	}
+
+	return TRUE;
+}
+
+static gboolean bench_dbus_data(GIOChannel *chan, GIOCondition cond,
+								gpointer data)
+{
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR)) {
+		syslog(LOG_ERR, "Lost connection to the system bus");
+		return FALSE;
+	}
+
+	return bench_dbus_dispatch();
+}
+
+static void bench_report(const char *what, uint64_t sent, uint64_t signals,
+					unsigned long ticks, double secs)
+{
+	uint64_t avg;
+
+	avg = bench.signals ? bench.latency_sum / bench.signals : 0;
+
+	syslog(LOG_INFO, "%s: %.0f events/s, %.0f signals/s, "
+			"latency avg %llu us max %llu us, daemon cpu %.1f%%",
+			what, sent / secs, signals / secs,
+			(unsigned long long) avg,
+			(unsigned long long) bench.latency_max,
+			100.0 * ticks / sysconf(_SC_CLK_TCK) / secs);
+}
+
+static void bench_stop(void)
+{
+	struct timeval now, diff;
+	double secs;
+
+	if (!bench.running)
+		return;
+
+	bench.running = FALSE;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &bench.start, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+
+	if (secs > 0)
+		bench_report("Total", bench.sent, bench.signals,
+					bench_daemon_cpu() - bench.start_cpu,
+					secs);
+}
+
+static gboolean bench_tick(gpointer data)
+{
+	struct timeval now, diff;
+	uint64_t due;
+	unsigned int n;
+
+	if (!bench.running)
+		return FALSE;
+
+	/* Signals read while blocking on a method reply never wake up
+	 * the bus watch */
+	bench_dbus_dispatch();
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &bench.start, &diff);
+
+	if (bench.duration && (unsigned int) diff.tv_sec >= bench.duration) {
+		bench_stop();
+		g_main_loop_quit(event_loop);
+		return FALSE;
+	}
+
+	due = (diff.tv_sec * 1000ull + diff.tv_usec / 1000) *
+							bench.rate / 1000;
+
+	while (bench.sent < due) {
+		switch (bench.mode) {
+		case BENCH_INQUIRY:
+			bench_inquiry_result(bench.next);
+			n = 1;
+			break;
+		case BENCH_LE:
+			n = MIN(due - bench.sent, BENCH_LE_REPORTS);
+			n = MIN(n, bench.peers - bench.next);
+			bench_le_reports(bench.next, n);
+			break;
+		case BENCH_CHURN:
+			bench_churn(bench.next);
+			n = 1;
+			break;
+		default:
+			return FALSE;
+		}
+
+		bench.next += n;
+		if (bench.next >= bench.peers) {
+			bench.next = 0;
+			bench.round++;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean bench_interval(gpointer data)
+{
+	unsigned long cpu;
+
+	if (!bench.running)
+		return FALSE;
+
+	cpu = bench_daemon_cpu();
+
+	bench_report("Interval", bench.sent - bench.last_sent,
+				bench.signals - bench.last_signals,
+				cpu - bench.last_cpu, BENCH_REPORT / 1000.0);
+
+	bench.last_sent = bench.sent;
+	bench.last_signals = bench.signals;
+	bench.last_cpu = cpu;
+
+	return TRUE;
+}
+
+static pid_t bench_get_daemon_pid(void)
+{
+	DBusMessage *msg, *reply;
+	const char *name = "org.bluez";
+	dbus_uint32_t pid;
+
+	msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+			DBUS_INTERFACE_DBUS, "GetConnectionUnixProcessID");
+	if (!msg)
+		return -1;
+
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &name,
+							DBUS_TYPE_INVALID);
+
+	reply = dbus_connection_send_with_reply_and_block(bench.conn, msg,
+								-1, NULL);
+	dbus_message_unref(msg);
+
+	if (!reply)
+		return -1;
+
+	if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_UINT32, &pid,
+							DBUS_TYPE_INVALID))
+		pid = 0;
+
+	dbus_message_unref(reply);
+
+	return pid ? (pid_t) pid : -1;
+}
+
+static int bench_init(void)
+{
+	GIOChannel *io;
+	int fd;
+
+	bench.conn = dbus_bus_get(DBUS_BUS_SYSTEM, NULL);
+	if (!bench.conn) {
+		syslog(LOG_ERR, "Can't connect to the system bus");
+		return -1;
+	}
+
+	dbus_bus_add_match(bench.conn, "type='signal',"
+				"interface='org.bluez.Adapter',"
+				"member='DeviceFound'", NULL);
+	dbus_bus_add_match(bench.conn, "type='signal',"
+				"interface='org.bluez.Device',"
+				"member='PropertyChanged'", NULL);
+
+	if (!dbus_connection_get_unix_fd(bench.conn, &fd)) {
+		syslog(LOG_ERR, "Can't get the system bus socket");
+		return -1;
+	}
+
+	io = g_io_channel_unix_new(fd);
+	g_io_add_watch(io, G_IO_IN | G_IO_NVAL | G_IO_HUP | G_IO_ERR,
+						bench_dbus_data, NULL);
+	g_io_channel_unref(io);
+
+	bench.pending = g_new0(struct timeval, bench.peers);
+	bench.connected = g_new0(guint8, bench.peers);
+
+	return 0;
+}
+
+/* Called once the daemon has brought the emulated controller up */
+static void bench_start(void)
+{
+	if (bench.mode == BENCH_NONE || bench.running)
+		return;
+
+	bench.daemon_pid = bench_get_daemon_pid();
+	if (bench.daemon_pid < 0)
+		syslog(LOG_WARNING, "bluetoothd not on the bus, "
+						"daemon cpu not measured");
+
+	syslog(LOG_INFO, "Starting %s benchmark: %u events/s over %u peers",
+			bench_modes[bench.mode], bench.rate, bench.peers);
+
+	bench.start_cpu = bench_daemon_cpu();
+	bench.last_cpu = bench.start_cpu;
+	gettimeofday(&bench.start, NULL);
+	bench.running = TRUE;
+
+	g_timeout_add(BENCH_TICK, bench_tick, NULL);
+	g_timeout_add(BENCH_REPORT, bench_interval, NULL);
+}
+
 static int getbdaddrbyname(char *str, bdaddr_t *ba)
 {
 	int i, n, len;
@@ -1172,7 +1704,12 @@ static void usage(void)
 		"\t[-b bdaddr] emulate specified address\n"
 		"\t[-s file] create snoop file\n"
 		"\t[-n] do not detach\n"
-		"\t[-h] help, you are looking at it\n");
+		"\t[-B inquiry|le|churn] benchmark a running bluetoothd\n"
+		"\t[-r rate] benchmark events per second (default %u)\n"
+		"\t[-c count] benchmark peer devices (default %u)\n"
+		"\t[-t seconds] benchmark duration\n"
+		"\t[-h] help, you are looking at it\n",
+		BENCH_DEFAULT_RATE, BENCH_DEFAULT_PEERS);
 }
 
 static struct option main_options[] = {
@@ -1180,6 +1717,10 @@ static struct option main_options[] = {
 	{ "bdaddr",	1, 0, 'b' },
 	{ "snoop",	1, 0, 's' },
 	{ "nodetach",	0, 0, 'n' },
+	{ "bench",	1, 0, 'B' },
+	{ "rate",	1, 0, 'r' },
+	{ "count",	1, 0, 'c' },
+	{ "time",	1, 0, 't' },
 	{ "help",	0, 0, 'h' },
 	{ 0 }
 };
@@ -1194,7 +1735,10 @@ int main(int argc, char *argv[])
 
 	bacpy(&bdaddr, BDADDR_ANY);
 
-	while ((opt=getopt_long(argc, argv, "d:b:s:nh", main_options, NULL)) != EOF) {
+	bench.rate = BENCH_DEFAULT_RATE;
+	bench.peers = BENCH_DEFAULT_PEERS;
+
+	while ((opt=getopt_long(argc, argv, "d:b:s:nB:r:c:t:h", main_options, NULL)) != EOF) {
 		switch(opt) {
 		case 'd':
 			device = strdup(optarg);
@@ -1212,6 +1756,26 @@ int main(int argc, char *argv[])
 			detach = 0;
 			break;
 
+		case 'B':
+			bench.mode = bench_mode_from_str(optarg);
+			if (bench.mode == BENCH_NONE) {
+				usage();
+				exit(1);
+			}
+			break;
+
+		case 'r':
+			bench.rate = atoi(optarg);
+			break;
+
+		case 'c':
+			bench.peers = atoi(optarg);
+			break;
+
+		case 't':
+			bench.duration = atoi(optarg);
+			break;
+
 		case 'h':
 		default:
 			usage();
@@ -1228,6 +1792,14 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (bench.rate == 0 || bench.peers == 0 ||
+					bench.peers > BENCH_MAX_PEERS ||
+					(bench.mode == BENCH_CHURN &&
+					bench.peers > BENCH_MAX_CHURN)) {
+		fprintf(stderr, "Invalid benchmark parameters\n");
+		exit(1);
+	}
+
 	if (strlen(argv[0]) > 3 && !strncasecmp(argv[0], "hci", 3)) {
 		dev = hci_devid(argv[0]);
 		if (dev < 0) {
@@ -1303,6 +1875,9 @@ int main(int argc, char *argv[])
 	if (dev >= 0)
 		return run_proxy(fd, dev, &bdaddr);
 
+	if (bench.mode != BENCH_NONE && bench_init() < 0)
+		exit(1);
+
 	/* Device settings */
 	vdev.features[0] = 0xff;
 	vdev.features[1] = 0xff;
@@ -1336,6 +1911,8 @@ int main(int argc, char *argv[])
 	/* Start event processor */
 	g_main_loop_run(event_loop);
 
+	bench_stop();
+
 	close(fd);
 
 	if (dd >= 0)
@@ -0,0 +1,944 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Benchmark of the Handsfree (HF role) path of the audio plugin. A second
+ * local adapter plays a synthetic Audio Gateway: it connects RFCOMM to the
+ * adapter bluetoothd runs on, answers a scripted AT sequence issued through
+ * the fd handed to the HandsfreeAgent registered here, and then accepts the
+ * SCO link the daemon sets up when a unix IPC client starts a stream.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/rfcomm.h>
+#include <bluetooth/sco.h>
+
+#include <dbus/dbus.h>
+
+#include "ipc.h"
+
+#ifndef DBUS_TYPE_UNIX_FD
+#define DBUS_TYPE_UNIX_FD -1
+#endif
+
+#define AGENT_INTERFACE		"org.bluez.HandsfreeAgent"
+#define AGENT_PATH		"/test/hfbench"
+
+#define DEFAULT_CHANNEL		7
+#define TIMEOUT			5000
+
+/* 8 kHz, 16 bit mono CVSD input */
+#define SCO_BYTES_PER_SEC	16000
+
+struct stats {
+	unsigned int count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct sco_dir {
+	const char *name;
+	unsigned int sent;
+	unsigned int received;
+	uint64_t bytes;
+	uint64_t last;
+	uint64_t jitter;
+	struct stats gaps;
+};
+
+static const char *default_script[] = {
+	"AT+BRSF=118",
+	"AT+CIND=?",
+	"AT+CIND?",
+	"AT+CMER=3,0,0,1",
+	"AT+CHLD=?",
+	"AT+CLCC",
+	"AT+COPS?",
+	NULL
+};
+
+/* Answers of the synthetic AG, matched against the start of the command */
+static const struct {
+	const char *cmd;
+	const char *rsp;
+} answers[] = {
+	{ "AT+BRSF=",	"+BRSF: 871" },
+	{ "AT+CIND=?",	"+CIND: (\"service\",(0,1)),(\"call\",(0,1)),"
+			"(\"callsetup\",(0-3)),(\"callheld\",(0-2)),"
+			"(\"signal\",(0-5)),(\"roam\",(0,1)),"
+			"(\"battchg\",(0-5))" },
+	{ "AT+CIND?",	"+CIND: 1,0,0,0,5,0,5" },
+	{ "AT+CHLD=?",	"+CHLD: (0,1,1x,2,2x,3,4)" },
+	{ "AT+COPS?",	"+COPS: 0,0,\"hfbench\"" },
+	{ "AT+CNUM",	"+CNUM: ,\"5551234\",129,,4" },
+	{ NULL, NULL }
+};
+
+static bdaddr_t ag_addr, hf_addr;
+static int hf_fd = -1;
+static uint64_t hf_fd_time = 0;
+static int released = 0;
+
+static uint64_t get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stats_add(struct stats *s, uint64_t usec)
+{
+	if (s->count == 0 || usec < s->min)
+		s->min = usec;
+	if (usec > s->max)
+		s->max = usec;
+
+	s->total += usec;
+	s->count++;
+}
+
+static void print_stats(const char *name, const struct stats *s)
+{
+	if (s->count == 0) {
+		printf("%-20s %8s\n", name, "-");
+		return;
+	}
+
+	printf("%-20s %8u %10llu %10llu %10llu\n", name, s->count,
+				(unsigned long long) s->min,
+				(unsigned long long) (s->total / s->count),
+				(unsigned long long) s->max);
+}
+
+static DBusHandlerResult agent_message(DBusConnection *conn,
+						DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	int fd;
+
+	if (dbus_message_is_method_call(msg, AGENT_INTERFACE, "Release"))
+		released = 1;
+	else if (dbus_message_is_method_call(msg, AGENT_INTERFACE,
+							"NewConnection")) {
+		if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UNIX_FD, &fd,
+							DBUS_TYPE_INVALID)) {
+			fprintf(stderr, "Invalid arguments for NewConnection\n");
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		}
+
+		if (hf_fd >= 0)
+			close(hf_fd);
+
+		hf_fd = fd;
+		hf_fd_time = get_usec();
+	} else
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply) {
+		fprintf(stderr, "Can't create reply message\n");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_connection_send(conn, reply, NULL);
+	dbus_connection_flush(conn);
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable agent_table = {
+	.message_function = agent_message,
+};
+
+/* Calls a method taking one string argument and returning an object path */
+static char *find_path(DBusConnection *conn, const char *path,
+				const char *interface, const char *method,
+				const char *arg)
+{
+	DBusMessage *msg, *reply;
+	DBusError err;
+	const char *reply_path;
+	char *result;
+
+	msg = dbus_message_new_method_call("org.bluez", path, interface,
+								method);
+	if (!msg) {
+		fprintf(stderr, "Can't allocate new method call\n");
+		return NULL;
+	}
+
+	dbus_message_append_args(msg, DBUS_TYPE_STRING, &arg,
+							DBUS_TYPE_INVALID);
+
+	dbus_error_init(&err);
+
+	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+
+	dbus_message_unref(msg);
+
+	if (!reply) {
+		fprintf(stderr, "%s(%s) failed: %s\n", method, arg,
+							err.message);
+		dbus_error_free(&err);
+		return NULL;
+	}
+
+	if (!dbus_message_get_args(reply, &err, DBUS_TYPE_OBJECT_PATH,
+					&reply_path, DBUS_TYPE_INVALID)) {
+		fprintf(stderr, "%s(%s) failed: %s\n", method, arg,
+							err.message);
+		dbus_error_free(&err);
+		dbus_message_unref(reply);
+		return NULL;
+	}
+
+	result = strdup(reply_path);
+
+	dbus_message_unref(reply);
+
+	return result;
+}
+
+static int register_agent(DBusConnection *conn, const char *device_path)
+{
+	DBusMessage *msg, *reply;
+	DBusError err;
+	const char *path = AGENT_PATH;
+
+	if (!dbus_connection_register_object_path(conn, AGENT_PATH,
+							&agent_table, NULL)) {
+		fprintf(stderr, "Can't register object path for agent\n");
+		return -1;
+	}
+
+	msg = dbus_message_new_method_call("org.bluez", device_path,
+				"org.bluez.HandsfreeGateway", "RegisterAgent");
+	if (!msg) {
+		fprintf(stderr, "Can't allocate new method call\n");
+		return -1;
+	}
+
+	dbus_message_append_args(msg, DBUS_TYPE_OBJECT_PATH, &path,
+							DBUS_TYPE_INVALID);
+
+	dbus_error_init(&err);
+
+	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+
+	dbus_message_unref(msg);
+
+	if (!reply) {
+		fprintf(stderr, "Can't register agent: %s\n", err.message);
+		dbus_error_free(&err);
+		return -1;
+	}
+
+	dbus_message_unref(reply);
+
+	return 0;
+}
+
+static int rfcomm_connect(uint8_t channel)
+{
+	struct sockaddr_rc addr;
+	int sk;
+
+	sk = socket(PF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+	if (sk < 0) {
+		perror("Can't create RFCOMM socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.rc_family = AF_BLUETOOTH;
+	bacpy(&addr.rc_bdaddr, &ag_addr);
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Can't bind RFCOMM socket");
+		close(sk);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.rc_family = AF_BLUETOOTH;
+	bacpy(&addr.rc_bdaddr, &hf_addr);
+	addr.rc_channel = channel;
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Can't connect RFCOMM socket");
+		close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+static int sco_listen(void)
+{
+	struct sockaddr_sco addr;
+	int sk;
+
+	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_SCO);
+	if (sk < 0) {
+		perror("Can't create SCO socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sco_family = AF_BLUETOOTH;
+	bacpy(&addr.sco_bdaddr, &ag_addr);
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Can't bind SCO socket");
+		close(sk);
+		return -1;
+	}
+
+	if (listen(sk, 1) < 0) {
+		perror("Can't listen on SCO socket");
+		close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+/* Reads until the buffer ends with one of the given terminators */
+static int read_until(int sk, char *buf, size_t size, const char *term1,
+							const char *term2)
+{
+	struct pollfd p;
+	size_t len = 0;
+	ssize_t ret;
+
+	while (len < size - 1) {
+		p.fd = sk;
+		p.events = POLLIN;
+
+		ret = poll(&p, 1, TIMEOUT);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ETIMEDOUT;
+
+		ret = read(sk, buf + len, size - 1 - len);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ECONNRESET;
+
+		len += ret;
+		buf[len] = '\0';
+
+		if (strstr(buf, term1) || (term2 && strstr(buf, term2)))
+			return len;
+	}
+
+	return -ENOBUFS;
+}
+
+static int ag_answer(int sk, const char *cmd)
+{
+	char buf[512];
+	int i, len;
+
+	len = 0;
+
+	for (i = 0; answers[i].cmd; i++) {
+		if (strncmp(cmd, answers[i].cmd, strlen(answers[i].cmd)))
+			continue;
+
+		len = snprintf(buf, sizeof(buf), "\r\n%s\r\n",
+							answers[i].rsp);
+		break;
+	}
+
+	len += snprintf(buf + len, sizeof(buf) - len, "\r\nOK\r\n");
+
+	if (write(sk, buf, len) != len)
+		return -errno;
+
+	return 0;
+}
+
+static int run_command(int ag_sk, int hf_sk, const char *cmd,
+							struct stats *s)
+{
+	char buf[512];
+	uint64_t start;
+	int len, ret;
+
+	len = snprintf(buf, sizeof(buf), "%s\r", cmd);
+
+	start = get_usec();
+
+	if (write(hf_sk, buf, len) != len)
+		return -errno;
+
+	ret = read_until(ag_sk, buf, sizeof(buf), "\r", NULL);
+	if (ret < 0)
+		return ret;
+
+	ret = ag_answer(ag_sk, buf);
+	if (ret < 0)
+		return ret;
+
+	ret = read_until(hf_sk, buf, sizeof(buf), "OK\r\n", "ERROR\r\n");
+	if (ret < 0)
+		return ret;
+
+	stats_add(s, get_usec() - start);
+
+	return 0;
+}
+
+static char **load_script(const char *file, unsigned int *count)
+{
+	char line[256], **cmds = NULL;
+	unsigned int n = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		perror("Can't open script");
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		cmds = realloc(cmds, sizeof(char *) * (n + 2));
+		cmds[n++] = strdup(line);
+	}
+
+	fclose(f);
+
+	if (!cmds) {
+		fprintf(stderr, "Script %s is empty\n", file);
+		return NULL;
+	}
+
+	cmds[n] = NULL;
+	*count = n;
+
+	return cmds;
+}
+
+static int ipc_request(int sk, bt_audio_msg_header_t *req,
+						bt_audio_msg_header_t *rsp)
+{
+	ssize_t ret;
+
+	if (send(sk, req, req->length, 0) < 0)
+		return -errno;
+
+	ret = recv(sk, rsp, BT_SUGGESTED_BUFFER_SIZE, 0);
+	if (ret < 0)
+		return -errno;
+
+	if (rsp->type == BT_ERROR)
+		return -((bt_audio_error_t *) rsp)->posix_errno;
+
+	if (rsp->type != BT_RESPONSE || rsp->name != req->name)
+		return -EPROTO;
+
+	return 0;
+}
+
+/* Goes through GET_CAPABILITIES, OPEN and SET_CONFIGURATION for the SCO
+ * transport so that the next START_STREAM asks the gateway for audio */
+static int ipc_configure(int sk)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE], rsp_buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_get_capabilities_req *caps_req = (void *) buf;
+	struct bt_get_capabilities_rsp *caps_rsp = (void *) rsp_buf;
+	struct bt_open_req *open_req = (void *) buf;
+	struct bt_set_configuration_req *conf_req = (void *) buf;
+	bt_audio_msg_header_t *rsp = (void *) rsp_buf;
+	codec_capabilities_t *codec;
+	pcm_capabilities_t pcm;
+	char ag[18], hf[18];
+	uint16_t bytes_left;
+	int err;
+
+	ba2str(&ag_addr, ag);
+	ba2str(&hf_addr, hf);
+
+	memset(buf, 0, sizeof(buf));
+	caps_req->h.type = BT_REQUEST;
+	caps_req->h.name = BT_GET_CAPABILITIES;
+	caps_req->h.length = sizeof(*caps_req);
+	strncpy(caps_req->source, hf, 18);
+	strncpy(caps_req->destination, ag, 18);
+	caps_req->transport = BT_CAPABILITIES_TRANSPORT_SCO;
+	caps_req->flags = BT_FLAG_AUTOCONNECT;
+
+	err = ipc_request(sk, &caps_req->h, rsp);
+	if (err < 0)
+		return err;
+
+	codec = (void *) caps_rsp->data;
+	bytes_left = caps_rsp->h.length - sizeof(*caps_rsp);
+
+	while (bytes_left >= sizeof(*codec)) {
+		if (codec->length == 0 || codec->length > bytes_left)
+			return -EPROTO;
+
+		if (codec->transport == BT_CAPABILITIES_TRANSPORT_SCO)
+			break;
+
+		bytes_left -= codec->length;
+		codec = (void *) codec + codec->length;
+	}
+
+	if (bytes_left < sizeof(pcm) ||
+			codec->transport != BT_CAPABILITIES_TRANSPORT_SCO)
+		return -ENOTSUP;
+
+	memcpy(&pcm, codec, sizeof(pcm));
+
+	memset(buf, 0, sizeof(buf));
+	open_req->h.type = BT_REQUEST;
+	open_req->h.name = BT_OPEN;
+	open_req->h.length = sizeof(*open_req);
+	strncpy(open_req->source, hf, 18);
+	strncpy(open_req->destination, ag, 18);
+	open_req->seid = pcm.capability.seid;
+	open_req->lock = BT_READ_LOCK | BT_WRITE_LOCK;
+
+	err = ipc_request(sk, &open_req->h, rsp);
+	if (err < 0)
+		return err;
+
+	memset(buf, 0, sizeof(buf));
+	conf_req->h.type = BT_REQUEST;
+	conf_req->h.name = BT_SET_CONFIGURATION;
+	memcpy(&conf_req->codec, &pcm, sizeof(pcm));
+	conf_req->h.length = sizeof(*conf_req) + sizeof(pcm) -
+						sizeof(conf_req->codec);
+
+	return ipc_request(sk, &conf_req->h, rsp);
+}
+
+static int ipc_start(int sk)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE], rsp_buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_start_stream_req *req = (void *) buf;
+	bt_audio_msg_header_t *rsp = (void *) rsp_buf;
+	int err;
+
+	memset(buf, 0, sizeof(buf));
+	req->h.type = BT_REQUEST;
+	req->h.name = BT_START_STREAM;
+	req->h.length = sizeof(*req);
+
+	err = ipc_request(sk, &req->h, rsp);
+	if (err < 0)
+		return err;
+
+	if (recv(sk, rsp_buf, sizeof(rsp_buf), 0) < 0)
+		return -errno;
+
+	if (rsp->type != BT_INDICATION || rsp->name != BT_NEW_STREAM)
+		return -EPROTO;
+
+	err = bt_audio_service_get_data_fd(sk);
+	if (err < 0)
+		return -errno;
+
+	return err;
+}
+
+static void sco_receive(int sk, struct sco_dir *dir, uint64_t interval)
+{
+	char buf[1024];
+	uint64_t now, gap;
+	ssize_t len;
+
+	len = read(sk, buf, sizeof(buf));
+	if (len <= 0)
+		return;
+
+	now = get_usec();
+
+	if (dir->received > 0) {
+		gap = now - dir->last;
+		stats_add(&dir->gaps, gap);
+		dir->jitter += gap > interval ? gap - interval :
+							interval - gap;
+	}
+
+	dir->last = now;
+	dir->received++;
+	dir->bytes += len;
+}
+
+static void print_sco(const struct sco_dir *dir, uint64_t elapsed)
+{
+	printf("%-20s %8u %8u %10llu", dir->name, dir->sent, dir->received,
+		elapsed ? (unsigned long long) dir->bytes * 8000 / elapsed :
+									0);
+
+	if (dir->gaps.count)
+		printf(" %10llu %10llu %10llu",
+			(unsigned long long) (dir->gaps.total / dir->gaps.count),
+			(unsigned long long) dir->gaps.max,
+			(unsigned long long) (dir->jitter / dir->gaps.count));
+
+	printf("\n");
+}
+
+static void run_sco(int ag_sk, int hf_sk, uint16_t mtu, unsigned int seconds)
+{
+	struct sco_dir down = { .name = "AG -> HF" };
+	struct sco_dir up = { .name = "HF -> AG" };
+	struct pollfd p[2];
+	uint64_t interval, start, end, next, now;
+	char buf[1024];
+	int timeout;
+
+	if (mtu > sizeof(buf))
+		mtu = sizeof(buf);
+
+	memset(buf, 0, sizeof(buf));
+
+	interval = (uint64_t) mtu * 1000000 / SCO_BYTES_PER_SEC;
+
+	start = get_usec();
+	end = start + (uint64_t) seconds * 1000000;
+	next = start;
+
+	p[0].fd = ag_sk;
+	p[0].events = POLLIN;
+	p[1].fd = hf_sk;
+	p[1].events = POLLIN;
+
+	while ((now = get_usec()) < end) {
+		if (now >= next) {
+			if (write(ag_sk, buf, mtu) == mtu)
+				down.sent++;
+			if (write(hf_sk, buf, mtu) == mtu)
+				up.sent++;
+			next += interval;
+			continue;
+		}
+
+		timeout = (next - now + 999) / 1000;
+
+		if (poll(p, 2, timeout) < 0) {
+			perror("poll");
+			break;
+		}
+
+		if (p[0].revents & (POLLERR | POLLHUP) ||
+				p[1].revents & (POLLERR | POLLHUP)) {
+			fprintf(stderr, "SCO link lost\n");
+			break;
+		}
+
+		if (p[0].revents & POLLIN)
+			sco_receive(ag_sk, &up, interval);
+
+		if (p[1].revents & POLLIN)
+			sco_receive(hf_sk, &down, interval);
+	}
+
+	printf("\nSCO mtu %u, packet every %llu us\n", mtu,
+					(unsigned long long) interval);
+	printf("%-20s %8s %8s %10s %10s %10s %10s\n", "direction", "sent",
+				"received", "kbit/s", "gap (us)",
+				"max (us)", "jitter (us)");
+	print_sco(&down, get_usec() - start);
+	print_sco(&up, get_usec() - start);
+}
+
+static void usage(void)
+{
+	printf("hfbench - Handsfree gateway benchmark ver %s\n", VERSION);
+	printf("Usage:\n"
+		"\thfbench [options] <hf address>\n");
+	printf("Options:\n"
+		"\t--device <hcidev>    HCI device playing the AG\n"
+		"\t--channel <N>        HFP RFCOMM channel, default %d\n"
+		"\t--script <file>      AT commands to send, one per line\n"
+		"\t--count <N>          Number of script runs, default 1\n"
+		"\t--time <seconds>     SCO streaming time, default 5,\n"
+		"\t                     0 skips the audio part\n",
+		DEFAULT_CHANNEL);
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "device",	1, 0, 'i' },
+	{ "channel",	1, 0, 'c' },
+	{ "script",	1, 0, 's' },
+	{ "count",	1, 0, 'n' },
+	{ "time",	1, 0, 't' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	struct stats connect_stats, slc_stats, start_stats, *cmd_stats;
+	const char **script = default_script;
+	char **loaded = NULL, ag[18], hf[18], *adapter_path, *device_path;
+	unsigned int i, j, ncmds, count = 1, seconds = 5;
+	uint8_t channel = DEFAULT_CHANNEL;
+	struct sco_options so;
+	socklen_t optlen;
+	DBusConnection *conn;
+	uint64_t start;
+	int opt, ag_sk, sco_sk, ag_sco, hf_sco, ipc_sk, ret, failed = 0;
+
+	bacpy(&ag_addr, BDADDR_ANY);
+	bacpy(&hf_addr, BDADDR_ANY);
+
+	while ((opt = getopt_long(argc, argv, "+i:c:s:n:t:h",
+						main_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'i':
+			if (!strncmp(optarg, "hci", 3))
+				hci_devba(atoi(optarg + 3), &ag_addr);
+			else
+				str2ba(optarg, &ag_addr);
+			break;
+
+		case 'c':
+			channel = atoi(optarg);
+			break;
+
+		case 's':
+			loaded = load_script(optarg, &ncmds);
+			if (!loaded)
+				exit(1);
+			script = (const char **) loaded;
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		case 't':
+			seconds = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (!argv[optind]) {
+		usage();
+		exit(1);
+	}
+
+	str2ba(argv[optind], &hf_addr);
+
+	if (!bacmp(&ag_addr, BDADDR_ANY)) {
+		fprintf(stderr, "An AG adapter other than the one bluetoothd "
+					"uses for the HF role is needed\n");
+		exit(1);
+	}
+
+	if (DBUS_TYPE_UNIX_FD < 0) {
+		fprintf(stderr, "D-Bus has no fd passing support\n");
+		exit(1);
+	}
+
+	for (ncmds = 0; script[ncmds]; ncmds++);
+
+	cmd_stats = calloc(ncmds, sizeof(struct stats));
+	memset(&connect_stats, 0, sizeof(connect_stats));
+	memset(&slc_stats, 0, sizeof(slc_stats));
+	memset(&start_stats, 0, sizeof(start_stats));
+
+	ba2str(&ag_addr, ag);
+	ba2str(&hf_addr, hf);
+
+	conn = dbus_bus_get(DBUS_BUS_SYSTEM, NULL);
+	if (!conn) {
+		fprintf(stderr, "Can't get on system bus");
+		exit(1);
+	}
+
+	adapter_path = find_path(conn, "/", "org.bluez.Manager",
+							"FindAdapter", hf);
+	if (!adapter_path)
+		exit(1);
+
+	device_path = find_path(conn, adapter_path, "org.bluez.Adapter",
+							"FindDevice", ag);
+	if (!device_path) {
+		fprintf(stderr, "%s has to be paired with %s first\n", ag, hf);
+		exit(1);
+	}
+
+	if (register_agent(conn, device_path) < 0)
+		exit(1);
+
+	for (i = 0; i < count && !released; i++) {
+		start = get_usec();
+
+		ag_sk = rfcomm_connect(channel);
+		if (ag_sk < 0) {
+			failed++;
+			break;
+		}
+
+		hf_fd_time = 0;
+		while (!hf_fd_time && !released &&
+				get_usec() - start < TIMEOUT * 1000)
+			dbus_connection_read_write_dispatch(conn, 100);
+
+		if (!hf_fd_time) {
+			fprintf(stderr, "No NewConnection from the daemon\n");
+			close(ag_sk);
+			failed++;
+			break;
+		}
+
+		stats_add(&connect_stats, hf_fd_time - start);
+
+		for (j = 0; j < ncmds; j++) {
+			ret = run_command(ag_sk, hf_fd, script[j],
+								&cmd_stats[j]);
+			if (ret < 0) {
+				fprintf(stderr, "%s failed: %s (%d)\n",
+					script[j], strerror(-ret), -ret);
+				break;
+			}
+		}
+
+		if (j < ncmds)
+			failed++;
+		else
+			stats_add(&slc_stats, get_usec() - start);
+
+		if (i + 1 < count || seconds == 0 || j < ncmds) {
+			close(hf_fd);
+			hf_fd = -1;
+			close(ag_sk);
+		}
+	}
+
+	printf("%-20s %8s %10s %10s %10s\n", "step", "count",
+				"min (us)", "avg (us)", "max (us)");
+
+	print_stats("rfcomm + agent", &connect_stats);
+
+	for (j = 0; j < ncmds; j++)
+		print_stats(script[j], &cmd_stats[j]);
+
+	print_stats("slc", &slc_stats);
+
+	if (failed || seconds == 0 || hf_fd < 0)
+		goto done;
+
+	sco_sk = sco_listen();
+	if (sco_sk < 0) {
+		failed++;
+		goto done;
+	}
+
+	ipc_sk = bt_audio_service_open();
+	if (ipc_sk < 0) {
+		failed++;
+		goto done;
+	}
+
+	ret = ipc_configure(ipc_sk);
+	if (ret < 0) {
+		fprintf(stderr, "IPC configuration failed: %s (%d)\n",
+						strerror(-ret), -ret);
+		failed++;
+		goto done;
+	}
+
+	start = get_usec();
+
+	hf_sco = ipc_start(ipc_sk);
+	if (hf_sco < 0) {
+		fprintf(stderr, "IPC start failed: %s (%d)\n",
+						strerror(-hf_sco), -hf_sco);
+		failed++;
+		goto done;
+	}
+
+	stats_add(&start_stats, get_usec() - start);
+
+	/* The kernel has completed the link by the time the daemon hands
+	 * out the fd, so this does not block */
+	ag_sco = accept(sco_sk, NULL, NULL);
+	if (ag_sco < 0) {
+		perror("Can't accept SCO connection");
+		failed++;
+		goto done;
+	}
+
+	print_stats("start stream", &start_stats);
+
+	memset(&so, 0, sizeof(so));
+	optlen = sizeof(so);
+	if (getsockopt(ag_sco, SOL_SCO, SCO_OPTIONS, &so, &optlen) < 0 ||
+								!so.mtu)
+		so.mtu = 48;
+
+	run_sco(ag_sco, hf_sco, so.mtu, seconds);
+
+	close(ag_sco);
+	close(hf_sco);
+	close(sco_sk);
+	bt_audio_service_close(ipc_sk);
+
+done:
+	printf("\n%u connections, %u failed\n", i, failed);
+
+	return failed ? 1 : 0;
+}
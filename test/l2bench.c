@@ -0,0 +1,990 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2000-2001  Qualcomm Incorporated
+ *  Copyright (C) 2002-2003  Maxim Krasnyansky <maxk@qualcomm.com>
+ *  Copyright (C) 2002-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/rfcomm.h>
+
+#define MAX_CHANNELS		64
+#define MAX_CONFIGS		8
+#define BUF_SIZE		(2 * 65536)
+
+#define FLAG_ECHO		0x01	/* Receiver returns the header */
+#define FLAG_REPLY		0x02
+
+/* Every frame starts with this header, the payload is filler. The stamp
+ * is only ever read back by the host that wrote it, so it stays in host
+ * byte order. */
+struct frame_hdr {
+	uint32_t seq;
+	uint16_t len;		/* Whole frame, header included */
+	uint8_t flags;
+	uint8_t reserved;
+	uint64_t stamp;		/* Sender clock in usec */
+	uint32_t received;	/* Replies only: frames the receiver got */
+	uint32_t lost;		/* Replies only: sequence gaps it saw */
+} __attribute__ ((packed));
+
+struct stats {
+	unsigned int count;
+	unsigned int size;
+	uint32_t *samples;		/* round trip in usec */
+};
+
+struct channel {
+	int sk;
+	int mtu;			/* Incoming MTU asked for */
+	int sec;
+	int frame_len;
+	uint8_t *out;
+	int out_off;			/* Partial write on stream sockets */
+	uint8_t *buf;
+	int len;
+	uint32_t seq;
+	uint64_t bytes;
+	uint32_t frames;
+	uint32_t received;		/* Last counters reported by the peer */
+	uint32_t lost;
+	uint64_t begin;
+	uint64_t end;
+	struct stats rtt;
+};
+
+enum {
+	OUTPUT_TABLE,
+	OUTPUT_CSV,
+	OUTPUT_JSON,
+};
+
+static const char *sec_names[] = { "sdp", "low", "medium", "high" };
+
+static bdaddr_t src, dst;
+static int use_rfcomm = 0;
+static uint16_t psm = 0x1011;
+static uint8_t rfcomm_channel = 10;
+static int mode = L2CAP_MODE_BASIC;
+static int mtus[MAX_CONFIGS] = { 672 };
+static int num_mtus = 1;
+static int secs[MAX_CONFIGS] = { BT_SECURITY_LOW };
+static int num_secs = 1;
+static int frame_size = 0;
+static unsigned int echo_every = 16;
+static unsigned int duration = 10;
+static int output = OUTPUT_TABLE;
+static volatile int terminate = 0;
+
+static uint64_t get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t cpu_usec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+				ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int stats_add(struct stats *s, uint64_t usec)
+{
+	if (s->count == s->size) {
+		unsigned int size = s->size ? s->size * 2 : 1024;
+		uint32_t *samples;
+
+		samples = realloc(s->samples, size * sizeof(*samples));
+		if (!samples)
+			return -ENOMEM;
+
+		s->samples = samples;
+		s->size = size;
+	}
+
+	s->samples[s->count++] = usec > UINT32_MAX ? UINT32_MAX : usec;
+
+	return 0;
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct stats *s, unsigned int pct)
+{
+	unsigned int i = (uint64_t) s->count * pct / 100;
+
+	if (s->count == 0)
+		return 0;
+
+	return s->samples[i < s->count ? i : s->count - 1];
+}
+
+/* Parses "a,b,c" into at most MAX_CONFIGS values */
+static int parse_list(const char *str, int *values,
+				int (*parse)(const char *str))
+{
+	char *dup, *tok, *save = NULL;
+	int n = 0;
+
+	dup = strdup(str);
+	if (!dup)
+		return -ENOMEM;
+
+	for (tok = strtok_r(dup, ",", &save); tok && n < MAX_CONFIGS;
+					tok = strtok_r(NULL, ",", &save)) {
+		values[n] = parse(tok);
+		if (values[n] < 0) {
+			free(dup);
+			return -EINVAL;
+		}
+		n++;
+	}
+
+	free(dup);
+
+	return n > 0 ? n : -EINVAL;
+}
+
+static int parse_mtu(const char *str)
+{
+	int mtu = atoi(str);
+
+	return mtu >= 48 && mtu <= 65535 ? mtu : -1;
+}
+
+static int parse_sec(const char *str)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sec_names) / sizeof(sec_names[0]); i++)
+		if (!strcasecmp(str, sec_names[i]))
+			return i;
+
+	return -1;
+}
+
+static int set_options(int sk, int imtu, int sec)
+{
+	struct bt_security bt_sec;
+
+	memset(&bt_sec, 0, sizeof(bt_sec));
+	bt_sec.level = sec;
+
+	if (setsockopt(sk, SOL_BLUETOOTH, BT_SECURITY, &bt_sec,
+							sizeof(bt_sec)) < 0)
+		return -errno;
+
+	if (!use_rfcomm) {
+		struct l2cap_options opts;
+		socklen_t optlen = sizeof(opts);
+
+		memset(&opts, 0, sizeof(opts));
+		if (getsockopt(sk, SOL_L2CAP, L2CAP_OPTIONS, &opts,
+								&optlen) < 0)
+			return -errno;
+
+		opts.imtu = imtu;
+		opts.mode = mode;
+
+		if (setsockopt(sk, SOL_L2CAP, L2CAP_OPTIONS, &opts,
+							sizeof(opts)) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static int create_socket(int imtu, int sec, int server)
+{
+	int sk, err;
+
+	if (use_rfcomm) {
+		struct sockaddr_rc addr;
+
+		sk = socket(PF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+		if (sk < 0)
+			return -errno;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.rc_family = AF_BLUETOOTH;
+		bacpy(&addr.rc_bdaddr, &src);
+		addr.rc_channel = server ? rfcomm_channel : 0;
+
+		if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+			goto failed;
+	} else {
+		struct sockaddr_l2 addr;
+
+		sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+		if (sk < 0)
+			return -errno;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.l2_family = AF_BLUETOOTH;
+		bacpy(&addr.l2_bdaddr, &src);
+		addr.l2_psm = server ? htobs(psm) : 0;
+
+		if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+			goto failed;
+	}
+
+	err = set_options(sk, imtu, sec);
+	if (err < 0) {
+		close(sk);
+		return err;
+	}
+
+	return sk;
+
+failed:
+	err = -errno;
+	close(sk);
+	return err;
+}
+
+static int connect_socket(int sk)
+{
+	if (use_rfcomm) {
+		struct sockaddr_rc addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.rc_family = AF_BLUETOOTH;
+		bacpy(&addr.rc_bdaddr, &dst);
+		addr.rc_channel = rfcomm_channel;
+
+		if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+			return -errno;
+	} else {
+		struct sockaddr_l2 addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.l2_family = AF_BLUETOOTH;
+		bacpy(&addr.l2_bdaddr, &dst);
+		addr.l2_psm = htobs(psm);
+
+		if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/* Frames have to fit the outgoing MTU, RFCOMM is a stream so anything
+ * up to the buffer size goes */
+static int get_frame_len(int sk)
+{
+	struct l2cap_options opts;
+	socklen_t optlen = sizeof(opts);
+	int len;
+
+	if (use_rfcomm)
+		len = frame_size ? frame_size : 1024;
+	else {
+		memset(&opts, 0, sizeof(opts));
+		if (getsockopt(sk, SOL_L2CAP, L2CAP_OPTIONS, &opts,
+								&optlen) < 0)
+			return -errno;
+
+		len = frame_size && frame_size < opts.omtu ? frame_size :
+								opts.omtu;
+	}
+
+	if (len < (int) sizeof(struct frame_hdr))
+		len = sizeof(struct frame_hdr);
+
+	return len > 65535 ? 65535 : len;
+}
+
+static int channel_init(struct channel *ch, int sk)
+{
+	memset(ch, 0, sizeof(*ch));
+
+	ch->sk = sk;
+	ch->buf = malloc(BUF_SIZE);
+	if (!ch->buf)
+		return -ENOMEM;
+
+	fcntl(sk, F_SETFL, fcntl(sk, F_GETFL) | O_NONBLOCK);
+
+	ch->begin = get_usec();
+
+	return 0;
+}
+
+static void channel_close(struct channel *ch)
+{
+	if (ch->sk < 0)
+		return;
+
+	close(ch->sk);
+	ch->sk = -1;
+	ch->end = get_usec();
+}
+
+static void channel_free(struct channel *ch)
+{
+	channel_close(ch);
+	free(ch->buf);
+	free(ch->out);
+	free(ch->rtt.samples);
+}
+
+/* Sends the rest of the current frame, starting a new one when the
+ * previous went out. Returns 0 when the socket is full. */
+static int send_frame(struct channel *ch)
+{
+	struct frame_hdr *hdr = (void *) ch->out;
+	ssize_t ret;
+
+	if (ch->out_off == 0) {
+		hdr->seq = htobl(ch->seq);
+		hdr->len = htobs(ch->frame_len);
+		hdr->flags = 0;
+		if (echo_every && ch->seq % echo_every == 0)
+			hdr->flags |= FLAG_ECHO;
+		hdr->stamp = get_usec();
+	}
+
+	ret = send(ch->sk, ch->out + ch->out_off,
+					ch->frame_len - ch->out_off, 0);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+
+	ch->out_off += ret;
+	if (ch->out_off < ch->frame_len)
+		return 0;
+
+	ch->out_off = 0;
+	ch->seq++;
+	ch->frames++;
+	ch->bytes += ch->frame_len;
+
+	return 1;
+}
+
+static void reply_frame(struct channel *ch, struct frame_hdr *hdr)
+{
+	struct frame_hdr rsp;
+
+	memcpy(&rsp, hdr, sizeof(rsp));
+	rsp.len = htobs(sizeof(rsp));
+	rsp.flags = FLAG_REPLY;
+	rsp.received = htobl(ch->frames);
+	rsp.lost = htobl(ch->lost);
+
+	/* A reply that does not fit is counted as a lost echo by the
+	 * sender, which is what a saturated link should show */
+	if (send(ch->sk, &rsp, sizeof(rsp), MSG_DONTWAIT) < 0 &&
+							errno != EAGAIN)
+		perror("Can't send reply");
+}
+
+static void process_frame(struct channel *ch, struct frame_hdr *hdr, int len)
+{
+	uint32_t seq = btohl(hdr->seq);
+
+	if (hdr->flags & FLAG_REPLY) {
+		stats_add(&ch->rtt, get_usec() - hdr->stamp);
+		ch->received = btohl(hdr->received);
+		ch->lost = btohl(hdr->lost);
+		return;
+	}
+
+	/* Receiver side, count gaps in the sequence */
+	if (ch->frames > 0 && seq != ch->seq)
+		ch->lost += seq > ch->seq ? seq - ch->seq : 0;
+
+	ch->seq = seq + 1;
+	ch->frames++;
+	ch->bytes += len;
+
+	if (hdr->flags & FLAG_ECHO)
+		reply_frame(ch, hdr);
+}
+
+/* Returns -ECONNRESET when the peer closed the channel */
+static int read_frames(struct channel *ch)
+{
+	struct frame_hdr *hdr;
+	ssize_t ret;
+	int off = 0, len;
+
+	ret = recv(ch->sk, ch->buf + ch->len, BUF_SIZE - ch->len, 0);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+	if (ret == 0)
+		return -ECONNRESET;
+
+	ch->len += ret;
+
+	while (ch->len - off >= (int) sizeof(*hdr)) {
+		hdr = (void *) (ch->buf + off);
+		len = btohs(hdr->len);
+
+		if (len < (int) sizeof(*hdr))
+			return -EBADMSG;
+
+		if (ch->len - off < len)
+			break;
+
+		process_frame(ch, hdr, len);
+		off += len;
+	}
+
+	ch->len -= off;
+	memmove(ch->buf, ch->buf + off, ch->len);
+
+	return 0;
+}
+
+static void print_header(void)
+{
+	switch (output) {
+	case OUTPUT_CSV:
+		printf("channel,mtu,security,frame,bytes,seconds,kbps,frames,"
+			"received,lost,echoes,rtt_p50,rtt_p90,rtt_p99,"
+			"rtt_max\n");
+		break;
+	case OUTPUT_JSON:
+		printf("{\n  \"channels\": [\n");
+		break;
+	default:
+		printf("%-4s %5s %-6s %5s %10s %9s %8s %8s %6s %8s %8s %8s\n",
+			"chan", "mtu", "sec", "frame", "bytes", "kB/s",
+			"frames", "lost", "echoes", "p50 (us)", "p99 (us)",
+			"max (us)");
+		break;
+	}
+}
+
+static void print_channel(int index, struct channel *ch, int last)
+{
+	uint64_t usec = ch->end > ch->begin ? ch->end - ch->begin : 1;
+	double kbps = (double) ch->bytes * 1000000 / usec / 1024;
+	struct stats *s = &ch->rtt;
+	uint32_t max;
+
+	if (s->count)
+		qsort(s->samples, s->count, sizeof(*s->samples), cmp_sample);
+
+	max = s->count ? s->samples[s->count - 1] : 0;
+
+	switch (output) {
+	case OUTPUT_CSV:
+		printf("%d,%d,%s,%d,%llu,%.3f,%.2f,%u,%u,%u,%u,%u,%u,%u,%u\n",
+			index, ch->mtu, sec_names[ch->sec], ch->frame_len,
+			(unsigned long long) ch->bytes, usec / 1000000.0,
+			kbps, ch->frames, ch->received, ch->lost, s->count,
+			percentile(s, 50), percentile(s, 90),
+			percentile(s, 99), max);
+		break;
+	case OUTPUT_JSON:
+		printf("    { \"channel\": %d, \"mtu\": %d, "
+			"\"security\": \"%s\", \"frame\": %d, "
+			"\"bytes\": %llu, \"seconds\": %.3f, "
+			"\"kbps\": %.2f, \"frames\": %u, \"received\": %u, "
+			"\"lost\": %u, \"echoes\": %u, \"rtt_p50\": %u, "
+			"\"rtt_p90\": %u, \"rtt_p99\": %u, \"rtt_max\": %u }%s\n",
+			index, ch->mtu, sec_names[ch->sec], ch->frame_len,
+			(unsigned long long) ch->bytes, usec / 1000000.0,
+			kbps, ch->frames, ch->received, ch->lost, s->count,
+			percentile(s, 50), percentile(s, 90),
+			percentile(s, 99), max, last ? "" : ",");
+		break;
+	default:
+		printf("%-4d %5d %-6s %5d %10llu %9.2f %8u %8u %6u %8u %8u "
+			"%8u\n", index, ch->mtu, sec_names[ch->sec],
+			ch->frame_len, (unsigned long long) ch->bytes, kbps,
+			ch->frames, ch->lost, s->count, percentile(s, 50),
+			percentile(s, 99), max);
+		break;
+	}
+}
+
+static void print_summary(int channels, uint64_t bytes, uint64_t usec,
+							uint64_t cpu)
+{
+	double mb = (double) bytes / (1024 * 1024);
+	double kbps = usec ? (double) bytes * 1000000 / usec / 1024 : 0;
+	double cpu_per_mb = mb > 0 ? cpu / 1000.0 / mb : 0;
+
+	switch (output) {
+	case OUTPUT_CSV:
+		printf("total,,,,%llu,%.3f,%.2f,,,,,,,,\n",
+				(unsigned long long) bytes, usec / 1000000.0,
+				kbps);
+		printf("# cpu ms per MB,%.2f\n", cpu_per_mb);
+		break;
+	case OUTPUT_JSON:
+		printf("  ],\n  \"total\": { \"channels\": %d, \"bytes\": %llu, "
+			"\"seconds\": %.3f, \"kbps\": %.2f, "
+			"\"cpu_ms_per_mb\": %.2f }\n}\n", channels,
+			(unsigned long long) bytes, usec / 1000000.0, kbps,
+			cpu_per_mb);
+		break;
+	default:
+		printf("\n%d channels, %llu bytes in %.2f sec, %.2f kB/s, "
+			"%.2f ms CPU per MB\n", channels,
+			(unsigned long long) bytes, usec / 1000000.0, kbps,
+			cpu_per_mb);
+		break;
+	}
+}
+
+static void sig_term(int sig)
+{
+	terminate = 1;
+}
+
+static int run_client(int num_channels)
+{
+	struct channel *chans;
+	struct pollfd *fds;
+	uint64_t begin, stop, drain, cpu, bytes = 0;
+	int i, n, ret, active;
+
+	chans = calloc(num_channels, sizeof(*chans));
+	fds = calloc(num_channels, sizeof(*fds));
+	if (!chans || !fds) {
+		perror("Can't allocate channels");
+		return 1;
+	}
+
+	/* Connections are set up one by one, the page and the L2CAP
+	 * configuration are not what is being measured */
+	for (i = 0; i < num_channels; i++) {
+		struct channel *ch = &chans[i];
+		int mtu = mtus[i % num_mtus], sec = secs[i % num_secs];
+		int sk;
+
+		sk = create_socket(mtu, sec, 0);
+		if (sk < 0) {
+			fprintf(stderr, "Can't create socket: %s (%d)\n",
+							strerror(-sk), -sk);
+			return 1;
+		}
+
+		ret = connect_socket(sk);
+		if (ret < 0) {
+			fprintf(stderr, "Can't connect channel %d: %s (%d)\n",
+						i, strerror(-ret), -ret);
+			close(sk);
+			return 1;
+		}
+
+		ret = get_frame_len(sk);
+		if (ret < 0 || channel_init(ch, sk) < 0) {
+			fprintf(stderr, "Can't set up channel %d\n", i);
+			close(sk);
+			return 1;
+		}
+
+		ch->mtu = mtu;
+		ch->sec = sec;
+		ch->frame_len = ret;
+		ch->out = malloc(ch->frame_len);
+		if (!ch->out) {
+			perror("Can't allocate frame");
+			return 1;
+		}
+
+		memset(ch->out, 0x7f, ch->frame_len);
+	}
+
+	cpu = cpu_usec();
+	begin = get_usec();
+	stop = begin + (uint64_t) duration * 1000000;
+	drain = 0;
+
+	for (i = 0; i < num_channels; i++)
+		chans[i].begin = begin;
+
+	while (!terminate) {
+		uint64_t now = get_usec();
+
+		/* Stop sending, then give the last echoes a moment */
+		if (!drain && now >= stop) {
+			drain = now + 500000;
+			for (i = 0; i < num_channels; i++)
+				chans[i].end = now;
+		}
+
+		if (drain && now >= drain)
+			break;
+
+		for (i = 0, active = 0; i < num_channels; i++) {
+			fds[i].fd = chans[i].sk;
+			fds[i].events = POLLIN;
+			if (!drain)
+				fds[i].events |= POLLOUT;
+			fds[i].revents = 0;
+			if (chans[i].sk >= 0)
+				active++;
+		}
+
+		if (active == 0)
+			break;
+
+		n = poll(fds, num_channels, 100);
+		if (n < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		for (i = 0; i < num_channels && n > 0; i++) {
+			struct channel *ch = &chans[i];
+
+			if (ch->sk < 0 || !fds[i].revents)
+				continue;
+
+			ret = 0;
+
+			if (fds[i].revents & POLLIN)
+				ret = read_frames(ch);
+
+			if (ret == 0 && (fds[i].revents & POLLOUT))
+				ret = send_frame(ch);
+
+			if (ret == 0 && (fds[i].revents & (POLLERR | POLLHUP)))
+				ret = -ECONNRESET;
+
+			if (ret < 0) {
+				fprintf(stderr, "Channel %d failed: %s (%d)\n",
+						i, strerror(-ret), -ret);
+				channel_close(ch);
+			}
+		}
+	}
+
+	cpu = cpu_usec() - cpu;
+
+	print_header();
+
+	for (i = 0; i < num_channels; i++) {
+		if (!chans[i].end)
+			chans[i].end = get_usec();
+		print_channel(i, &chans[i], i == num_channels - 1);
+		bytes += chans[i].bytes;
+	}
+
+	print_summary(num_channels, bytes, (drain ? drain - 500000 :
+						get_usec()) - begin, cpu);
+
+	for (i = 0; i < num_channels; i++)
+		channel_free(&chans[i]);
+
+	free(chans);
+	free(fds);
+
+	return 0;
+}
+
+static int run_server(void)
+{
+	struct channel chans[MAX_CHANNELS];
+	struct pollfd fds[MAX_CHANNELS + 1];
+	int lsk, i, n, ret, index = 0;
+
+	lsk = create_socket(mtus[0], secs[0], 1);
+	if (lsk < 0) {
+		fprintf(stderr, "Can't create socket: %s (%d)\n",
+						strerror(-lsk), -lsk);
+		return 1;
+	}
+
+	if (listen(lsk, 10) < 0) {
+		perror("Can't listen");
+		close(lsk);
+		return 1;
+	}
+
+	for (i = 0; i < MAX_CHANNELS; i++)
+		chans[i].sk = -1;
+
+	print_header();
+
+	while (!terminate) {
+		fds[0].fd = lsk;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		for (i = 0; i < MAX_CHANNELS; i++) {
+			fds[i + 1].fd = chans[i].sk;
+			fds[i + 1].events = POLLIN;
+			fds[i + 1].revents = 0;
+		}
+
+		n = poll(fds, MAX_CHANNELS + 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int sk = accept(lsk, NULL, NULL);
+
+			for (i = 0; i < MAX_CHANNELS; i++)
+				if (chans[i].sk < 0)
+					break;
+
+			if (sk >= 0 && i < MAX_CHANNELS &&
+					channel_init(&chans[i], sk) == 0) {
+				chans[i].mtu = mtus[0];
+				chans[i].sec = secs[0];
+			} else if (sk >= 0)
+				close(sk);
+		}
+
+		for (i = 0; i < MAX_CHANNELS; i++) {
+			struct channel *ch = &chans[i];
+
+			if (ch->sk < 0 || !fds[i + 1].revents)
+				continue;
+
+			ret = read_frames(ch);
+			if (ret == 0 && (fds[i + 1].revents &
+							(POLLERR | POLLHUP)))
+				ret = -ECONNRESET;
+
+			if (ret == 0)
+				continue;
+
+			/* One line per channel as they finish */
+			channel_close(ch);
+			print_channel(index++, ch, 1);
+			fflush(stdout);
+			free(ch->buf);
+			free(ch->rtt.samples);
+			ch->buf = NULL;
+		}
+	}
+
+	for (i = 0; i < MAX_CHANNELS; i++)
+		if (chans[i].sk >= 0)
+			channel_free(&chans[i]);
+
+	close(lsk);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("l2bench - L2CAP and RFCOMM throughput benchmark ver %s\n",
+								VERSION);
+	printf("Usage:\n"
+		"\tl2bench [options] <remote address>\n"
+		"\tl2bench [options] --listen\n");
+	printf("Options:\n"
+		"\t--device <hcidev>    HCI device\n"
+		"\t--listen             Receive and answer echo requests\n"
+		"\t--rfcomm             Use RFCOMM instead of L2CAP\n"
+		"\t--psm <psm>          L2CAP PSM, default 0x1011\n"
+		"\t--channel <channel>  RFCOMM channel, default 10\n"
+		"\t--mode <mode>        basic, ertm or streaming\n"
+		"\t--channels <N>       Parallel channels, default 1\n"
+		"\t--mtu <mtu,...>      Incoming MTUs, channels take turns\n"
+		"\t--security <sec,...> low, medium or high, taking turns\n"
+		"\t--size <bytes>       Frame size, default the outgoing MTU\n"
+		"\t--echo <N>           Echo every Nth frame for round trip\n"
+		"\t                     times, 0 disables, default 16\n"
+		"\t--time <seconds>     Test duration, default 10\n"
+		"\t--csv                Comma separated output\n"
+		"\t--json               JSON output\n");
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "device",	1, 0, 'i' },
+	{ "listen",	0, 0, 'l' },
+	{ "rfcomm",	0, 0, 'r' },
+	{ "psm",	1, 0, 'P' },
+	{ "channel",	1, 0, 'C' },
+	{ "mode",	1, 0, 'X' },
+	{ "channels",	1, 0, 'n' },
+	{ "mtu",	1, 0, 'm' },
+	{ "security",	1, 0, 'S' },
+	{ "size",	1, 0, 'b' },
+	{ "echo",	1, 0, 'e' },
+	{ "time",	1, 0, 't' },
+	{ "csv",	0, 0, 'c' },
+	{ "json",	0, 0, 'j' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	int opt, listen_mode = 0, num_channels = 1;
+
+	bacpy(&src, BDADDR_ANY);
+	bacpy(&dst, BDADDR_ANY);
+
+	while ((opt = getopt_long(argc, argv, "+i:lrP:C:X:n:m:S:b:e:t:cjh",
+						main_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'i':
+			if (!strncmp(optarg, "hci", 3))
+				hci_devba(atoi(optarg + 3), &src);
+			else
+				str2ba(optarg, &src);
+			break;
+
+		case 'l':
+			listen_mode = 1;
+			break;
+
+		case 'r':
+			use_rfcomm = 1;
+			break;
+
+		case 'P':
+			psm = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'C':
+			rfcomm_channel = atoi(optarg);
+			break;
+
+		case 'X':
+			if (!strcasecmp(optarg, "ertm"))
+				mode = L2CAP_MODE_ERTM;
+			else if (!strcasecmp(optarg, "streaming"))
+				mode = L2CAP_MODE_STREAMING;
+			else if (!strcasecmp(optarg, "basic"))
+				mode = L2CAP_MODE_BASIC;
+			else {
+				fprintf(stderr, "Invalid mode %s\n", optarg);
+				exit(1);
+			}
+			break;
+
+		case 'n':
+			num_channels = atoi(optarg);
+			break;
+
+		case 'm':
+			num_mtus = parse_list(optarg, mtus, parse_mtu);
+			if (num_mtus < 0) {
+				fprintf(stderr, "Invalid MTU list %s\n",
+								optarg);
+				exit(1);
+			}
+			break;
+
+		case 'S':
+			num_secs = parse_list(optarg, secs, parse_sec);
+			if (num_secs < 0) {
+				fprintf(stderr, "Invalid security list %s\n",
+								optarg);
+				exit(1);
+			}
+			break;
+
+		case 'b':
+			frame_size = atoi(optarg);
+			break;
+
+		case 'e':
+			echo_every = atoi(optarg);
+			break;
+
+		case 't':
+			duration = atoi(optarg);
+			break;
+
+		case 'c':
+			output = OUTPUT_CSV;
+			break;
+
+		case 'j':
+			output = OUTPUT_JSON;
+			break;
+
+		case 'h':
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (!listen_mode) {
+		if (!argv[optind]) {
+			usage();
+			exit(1);
+		}
+
+		str2ba(argv[optind], &dst);
+	}
+
+	if (num_channels < 1 || num_channels > MAX_CHANNELS) {
+		fprintf(stderr, "Between 1 and %d channels\n", MAX_CHANNELS);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_term;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	if (listen_mode)
+		return run_server();
+
+	return run_client(num_channels);
+}
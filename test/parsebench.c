@@ -0,0 +1,650 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2005-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+#include <bluetooth/uuid.h>
+
+#include <glib.h>
+
+#include "att.h"
+#include "eir.h"
+#include "textfile.h"
+
+#define DEFAULT_ITERATIONS	100000
+#define TEXTFILE_ENTRIES	200
+
+enum {
+	SAMPLE_SDP,
+	SAMPLE_EIR,
+	SAMPLE_ATT,
+};
+
+struct sample {
+	int kind;
+	char name[32];
+	uint8_t *data;
+	size_t len;
+};
+
+static GSList *samples = NULL;
+static int iterations = DEFAULT_ITERATIONS;
+static const char *only = NULL;
+
+/* Every allocation made by the parsers and by glib goes through these,
+ * which is what allocs/op counts */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs = 0;
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+#define ALLOCS() allocs
+#else
+#define ALLOCS() 0UL
+#endif
+
+static uint64_t get_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sample_add(int kind, const char *name, const uint8_t *data,
+								size_t len)
+{
+	struct sample *s;
+
+	s = g_new0(struct sample, 1);
+	s->kind = kind;
+	g_strlcpy(s->name, name, sizeof(s->name));
+
+	/* EIR is always parsed from a full size block */
+	s->len = len;
+	if (kind == SAMPLE_EIR && len < HCI_MAX_EIR_LENGTH)
+		len = HCI_MAX_EIR_LENGTH;
+
+	s->data = g_malloc0(len);
+	memcpy(s->data, data, s->len);
+
+	samples = g_slist_append(samples, s);
+}
+
+/* Services of a typical phone, as found by browsing it */
+static const struct {
+	const char *name;
+	uint16_t svclass[2];
+	uint16_t profile;
+	uint16_t version;
+	uint16_t psm;		/* 0 over RFCOMM */
+	uint8_t channel;
+	uint16_t proto;		/* on top of L2CAP or RFCOMM, 0 for none */
+	int features;		/* -1 for none */
+} phone_services[] = {
+	{ "Voice Gateway", { HANDSFREE_AGW_SVCLASS_ID,
+			GENERIC_AUDIO_SVCLASS_ID }, HANDSFREE_PROFILE_ID,
+			0x0105, 0, 3, 0, 0x0021 },
+	{ "Headset Gateway", { HEADSET_AGW_SVCLASS_ID,
+			GENERIC_AUDIO_SVCLASS_ID }, HEADSET_PROFILE_ID,
+			0x0102, 0, 2, 0, -1 },
+	{ "Audio Source", { AUDIO_SOURCE_SVCLASS_ID, 0 },
+			ADVANCED_AUDIO_PROFILE_ID, 0x0102, AVDTP_UUID, 0,
+			AVDTP_UUID, 0x0001 },
+	{ "AVRCP TG", { AV_REMOTE_TARGET_SVCLASS_ID, 0 },
+			AV_REMOTE_PROFILE_ID, 0x0103, AVCTP_UUID, 0,
+			AVCTP_UUID, 0x0002 },
+	{ "OBEX Phonebook Access Server", { PBAP_PSE_SVCLASS_ID, 0 },
+			PBAP_PROFILE_ID, 0x0101, 0, 19, OBEX_UUID, -1 },
+	{ "OBEX Object Push", { OBEX_OBJPUSH_SVCLASS_ID, 0 },
+			OBEX_OBJPUSH_PROFILE_ID, 0x0100, 0, 12, OBEX_UUID, -1 },
+	{ "Network Access Point", { NAP_SVCLASS_ID, 0 }, NAP_PROFILE_ID,
+			0x0100, 15, 0, BNEP_UUID, -1 },
+	{ "SIM Access", { SAP_SVCLASS_ID, GENERIC_TELEPHONY_SVCLASS_ID },
+			SAP_PROFILE_ID, 0x0101, 0, 8, 0, -1 },
+	{ "OBEX Message Access Server", { OBEX_MAS_SVCLASS_ID, 0 },
+			OBEX_MAP_PROFILE_ID, 0x0100, 0, 16, OBEX_UUID, -1 },
+};
+
+static sdp_record_t *phone_record(int i, uint32_t handle)
+{
+	sdp_list_t *svclass_id = NULL, *pfseq, *apseq, *aproto, *root;
+	sdp_list_t *proto[3] = { NULL, NULL, NULL };
+	uuid_t root_uuid, svclass_uuid[2], l2cap_uuid, rfcomm_uuid, top_uuid;
+	sdp_profile_desc_t profile;
+	sdp_data_t *psm = NULL, *channel = NULL;
+	sdp_record_t *record;
+	uint16_t feat;
+	int j, n = 0;
+
+	record = sdp_record_alloc();
+	if (!record)
+		return NULL;
+
+	record->handle = handle;
+	sdp_attr_add_new(record, SDP_ATTR_RECORD_HANDLE, SDP_UINT32,
+							&record->handle);
+
+	sdp_uuid16_create(&root_uuid, PUBLIC_BROWSE_GROUP);
+	root = sdp_list_append(NULL, &root_uuid);
+	sdp_set_browse_groups(record, root);
+
+	for (j = 0; j < 2 && phone_services[i].svclass[j]; j++) {
+		sdp_uuid16_create(&svclass_uuid[j],
+					phone_services[i].svclass[j]);
+		svclass_id = sdp_list_append(svclass_id, &svclass_uuid[j]);
+	}
+	sdp_set_service_classes(record, svclass_id);
+
+	sdp_uuid16_create(&profile.uuid, phone_services[i].profile);
+	profile.version = phone_services[i].version;
+	pfseq = sdp_list_append(NULL, &profile);
+	sdp_set_profile_descs(record, pfseq);
+
+	sdp_uuid16_create(&l2cap_uuid, L2CAP_UUID);
+	proto[n] = sdp_list_append(NULL, &l2cap_uuid);
+	if (phone_services[i].psm) {
+		psm = sdp_data_alloc(SDP_UINT16, &phone_services[i].psm);
+		proto[n] = sdp_list_append(proto[n], psm);
+	}
+	apseq = sdp_list_append(NULL, proto[n++]);
+
+	if (phone_services[i].channel) {
+		sdp_uuid16_create(&rfcomm_uuid, RFCOMM_UUID);
+		proto[n] = sdp_list_append(NULL, &rfcomm_uuid);
+		channel = sdp_data_alloc(SDP_UINT8,
+					&phone_services[i].channel);
+		proto[n] = sdp_list_append(proto[n], channel);
+		apseq = sdp_list_append(apseq, proto[n++]);
+	}
+
+	if (phone_services[i].proto) {
+		sdp_uuid16_create(&top_uuid, phone_services[i].proto);
+		proto[n] = sdp_list_append(NULL, &top_uuid);
+		apseq = sdp_list_append(apseq, proto[n++]);
+	}
+
+	aproto = sdp_list_append(NULL, apseq);
+	sdp_set_access_protos(record, aproto);
+
+	if (phone_services[i].features >= 0) {
+		feat = phone_services[i].features;
+		sdp_attr_add_new(record, SDP_ATTR_SUPPORTED_FEATURES,
+							SDP_UINT16, &feat);
+	}
+
+	sdp_set_info_attr(record, phone_services[i].name, NULL, NULL);
+
+	free(psm);
+	free(channel);
+	for (j = 0; j < n; j++)
+		sdp_list_free(proto[j], NULL);
+	sdp_list_free(apseq, NULL);
+	sdp_list_free(aproto, NULL);
+	sdp_list_free(pfseq, NULL);
+	sdp_list_free(svclass_id, NULL);
+	sdp_list_free(root, NULL);
+
+	return record;
+}
+
+static void add_sdp_samples(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(phone_services) /
+					sizeof(phone_services[0]); i++) {
+		sdp_record_t *rec = phone_record(i, 0x10000 + i);
+		sdp_buf_t buf;
+
+		if (rec == NULL || sdp_gen_record_pdu(rec, &buf) < 0) {
+			fprintf(stderr, "Can't build %s record\n",
+						phone_services[i].name);
+			exit(1);
+		}
+
+		sample_add(SAMPLE_SDP, phone_services[i].name, buf.data,
+								buf.data_size);
+
+		free(buf.data);
+		sdp_record_free(rec);
+	}
+}
+
+/* Inquiry results as sent by a phone and a headset, and LE adverts */
+static const uint8_t eir_phone[] = {
+	0x0d, 0x09, 'G', 'a', 'l', 'a', 'x', 'y', ' ', 'N', 'e', 'x', 'u',
+	's',
+	0x02, 0x0a, 0x04,
+	0x09, 0x10, 0x01, 0x00, 0x0f, 0x00, 0x34, 0x12, 0x00, 0x04,
+	0x17, 0x03, 0x00, 0x12, 0x1f, 0x11, 0x12, 0x11, 0x0a, 0x11,
+	0x0c, 0x11, 0x0e, 0x11, 0x2f, 0x11, 0x05, 0x11, 0x16, 0x11,
+	0x32, 0x11, 0x2d, 0x11,
+	0x11, 0x07, 0x66, 0x9a, 0x0c, 0x20, 0x00, 0x08, 0xc1, 0xa1,
+	0xe2, 0x11, 0x39, 0xac, 0x5f, 0x8e, 0x0a, 0x00,
+};
+
+static const uint8_t eir_headset[] = {
+	0x0b, 0x09, 'B', 'T', ' ', 'H', 'e', 'a', 'd', 's', 'e', 't',
+	0x09, 0x03, 0x08, 0x11, 0x1e, 0x11, 0x0b, 0x11, 0x0e, 0x11,
+};
+
+static const uint8_t eir_le_tag[] = {
+	0x02, 0x01, 0x06,
+	0x11, 0x07, 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0,
+	0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e,
+	0x05, 0x08, 'T', 'a', 'g', '1',
+	0x03, 0xff, 0x4c, 0x00,
+};
+
+/* Length running past the end of the block */
+static const uint8_t eir_broken[] = {
+	0x0b, 0x09, 'B', 'T', ' ', 'H', 'e', 'a', 'd', 's', 'e', 't',
+	0xf0, 0x03, 0x08, 0x11,
+};
+
+static void add_eir_samples(void)
+{
+	sample_add(SAMPLE_EIR, "phone", eir_phone, sizeof(eir_phone));
+	sample_add(SAMPLE_EIR, "headset", eir_headset, sizeof(eir_headset));
+	sample_add(SAMPLE_EIR, "le tag", eir_le_tag, sizeof(eir_le_tag));
+	sample_add(SAMPLE_EIR, "broken", eir_broken, sizeof(eir_broken));
+}
+
+/* Characteristic declarations and descriptors of a crowded server, as
+ * many as fit in the MTU */
+static void add_att_samples(void)
+{
+	uint8_t pdu[ATT_MAX_MTU];
+	uint16_t mtus[] = { ATT_DEFAULT_LE_MTU, 185 };
+	unsigned int i;
+	int n, len;
+
+	for (i = 0; i < sizeof(mtus) / sizeof(mtus[0]); i++) {
+		char name[32];
+
+		pdu[0] = ATT_OP_READ_BY_TYPE_RESP;
+		pdu[1] = 7;
+		for (n = 0, len = 2; len + 7 <= mtus[i]; n++, len += 7) {
+			att_put_u16(0x0010 + n * 2, &pdu[len]);
+			pdu[len + 2] = ATT_CHAR_PROPER_READ |
+						ATT_CHAR_PROPER_NOTIFY;
+			att_put_u16(0x0011 + n * 2, &pdu[len + 3]);
+			att_put_u16(0x2a00 + n, &pdu[len + 5]);
+		}
+
+		snprintf(name, sizeof(name), "%d chars, mtu %u", n, mtus[i]);
+		sample_add(SAMPLE_ATT, name, pdu, len);
+
+		pdu[0] = ATT_OP_FIND_INFO_RESP;
+		pdu[1] = 0x01;		/* 16-bit UUIDs */
+		for (n = 0, len = 2; len + 4 <= mtus[i]; n++, len += 4) {
+			att_put_u16(0x0020 + n, &pdu[len]);
+			att_put_u16(n % 2 ? GATT_CLIENT_CHARAC_CFG_UUID :
+					GATT_CHARAC_USER_DESC_UUID,
+					&pdu[len + 2]);
+		}
+
+		snprintf(name, sizeof(name), "%d descs, mtu %u", n, mtus[i]);
+		sample_add(SAMPLE_ATT, name, pdu, len);
+
+		pdu[0] = ATT_OP_FIND_INFO_RESP;
+		pdu[1] = 0x02;		/* 128-bit UUIDs */
+		for (n = 0, len = 2; len + 18 <= mtus[i]; n++, len += 18) {
+			att_put_u16(0x0040 + n, &pdu[len]);
+			memcpy(&pdu[len + 2], &eir_le_tag[5], 16);
+			pdu[len + 2] = n;
+		}
+
+		snprintf(name, sizeof(name), "%d uuid128, mtu %u", n,
+								mtus[i]);
+		sample_add(SAMPLE_ATT, name, pdu, len);
+	}
+}
+
+/* Lines of "sdp|eir|att <hex bytes>", as captured with hcidump */
+static int load_samples(const char *filename)
+{
+	char line[4096], name[32];
+	uint8_t data[2048];
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *kind, *hex;
+		size_t len = 0;
+		int type;
+
+		lineno++;
+
+		kind = strtok(line, " \t\n");
+		if (kind == NULL || kind[0] == '#')
+			continue;
+
+		if (strcmp(kind, "sdp") == 0)
+			type = SAMPLE_SDP;
+		else if (strcmp(kind, "eir") == 0)
+			type = SAMPLE_EIR;
+		else if (strcmp(kind, "att") == 0)
+			type = SAMPLE_ATT;
+		else {
+			fprintf(stderr, "%s:%d: unknown parser %s\n",
+						filename, lineno, kind);
+			continue;
+		}
+
+		while ((hex = strtok(NULL, " \t\n")) != NULL) {
+			for (; isxdigit(hex[0]) && isxdigit(hex[1]) &&
+					len < sizeof(data); hex += 2) {
+				unsigned int byte;
+
+				sscanf(hex, "%2x", &byte);
+				data[len++] = byte;
+			}
+		}
+
+		if (len == 0 || (type == SAMPLE_EIR &&
+						len > HCI_MAX_EIR_LENGTH))
+			continue;
+
+		snprintf(name, sizeof(name), "line %d", lineno);
+		sample_add(type, name, data, len);
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+static void print_result(const char *parser, const char *name,
+				uint64_t nsec, unsigned long count)
+{
+	printf("%-26s %-24s %10.1f", parser, name,
+					(double) nsec / iterations);
+
+#ifdef __GLIBC__
+	printf(" %10.2f\n", (double) count / iterations);
+#else
+	printf(" %10s\n", "-");
+#endif
+}
+
+static int wanted(const char *parser)
+{
+	return only == NULL || strstr(parser, only) != NULL;
+}
+
+#define BENCH(parser, name, expr) do {					\
+	if (wanted(parser)) {						\
+		unsigned long count = ALLOCS();				\
+		uint64_t nsec = get_nsec();				\
+		int i;							\
+									\
+		for (i = 0; i < iterations; i++) {			\
+			expr;						\
+		}							\
+									\
+		nsec = get_nsec() - nsec;				\
+		print_result(parser, name, nsec, ALLOCS() - count);	\
+	}								\
+} while (0)
+
+static void bench_sdp(struct sample *s)
+{
+	sdp_session_t session;
+	sdp_record_t *rec;
+	int scanned;
+
+	memset(&session, 0, sizeof(session));
+	session.flags = SDP_ARENA_RECORDS;
+
+	BENCH("sdp_extract_pdu", s->name,
+		rec = sdp_extract_pdu(s->data, s->len, &scanned);
+		sdp_record_free(rec));
+
+	BENCH("sdp_extract_pdu (arena)", s->name,
+		rec = sdp_session_extract_pdu(&session, s->data, s->len,
+								&scanned);
+		sdp_record_free(rec));
+
+	BENCH("sdp_extract_pdu_lazy", s->name,
+		rec = sdp_extract_pdu_lazy(s->data, s->len, &scanned);
+		sdp_record_free(rec));
+}
+
+static void bench_eir(struct sample *s)
+{
+	struct eir_data eir;
+
+	BENCH("eir_parse", s->name, eir_parse(&eir, s->data));
+}
+
+static void bench_att(struct sample *s)
+{
+	struct att_data_list *list;
+	struct att_data_iter iter;
+	uint8_t format;
+
+	switch (s->data[0]) {
+	case ATT_OP_READ_BY_TYPE_RESP:
+		BENCH("dec_read_by_type_resp", s->name,
+			list = dec_read_by_type_resp(s->data, s->len);
+			att_data_list_free(list));
+		break;
+	case ATT_OP_FIND_INFO_RESP:
+		BENCH("dec_find_info_resp", s->name,
+			list = dec_find_info_resp(s->data, s->len, &format);
+			att_data_list_free(list));
+		break;
+	default:
+		return;
+	}
+
+	BENCH("att_data_iter", s->name,
+		att_data_iter_init(&iter, s->data, s->len);
+		while (att_data_iter_next(&iter) != NULL));
+}
+
+static void bench_textfile(void)
+{
+	char filename[] = "/tmp/parsebenchXXXXXX";
+	char key[18], value[40], first[18], last[18];
+	char *str;
+	int fd, i;
+
+	fd = mkstemp(filename);
+	if (fd < 0) {
+		perror("Can't create textfile");
+		return;
+	}
+
+	close(fd);
+
+	/* Link keys of a device paired with many others */
+	for (i = 0; i < TEXTFILE_ENTRIES; i++) {
+		snprintf(key, sizeof(key), "00:1A:7D:%2.2X:%2.2X:%2.2X",
+						i >> 16, (i >> 8) & 0xff,
+						i & 0xff);
+		snprintf(value, sizeof(value),
+				"%8.8X%8.8X%8.8X%8.8X 0 4", i, i * 7,
+				i * 13, i * 31);
+		textfile_put(filename, key, value);
+
+		if (i == 0)
+			strcpy(first, key);
+		strcpy(last, key);
+	}
+
+	BENCH("textfile_get", "first entry",
+		str = textfile_get(filename, first);
+		free(str));
+
+	BENCH("textfile_get", "last entry",
+		str = textfile_get(filename, last);
+		free(str));
+
+	BENCH("textfile_caseget", "last entry",
+		str = textfile_caseget(filename, last);
+		free(str));
+
+	textfile_cache_enable();
+
+	BENCH("textfile_get (cache)", "last entry",
+		str = textfile_get(filename, last);
+		free(str));
+
+	textfile_cache_disable();
+
+	unlink(filename);
+}
+
+static void usage(void)
+{
+	printf("parsebench - Parser benchmark ver %s\n", VERSION);
+	printf("Usage:\n"
+		"\tparsebench [options]\n");
+	printf("Options:\n"
+		"\t-h, --help           Display help\n"
+		"\t-n, --iterations     Number of iterations (default %d)\n"
+		"\t-f, --file <file>    Add captured samples, one per line\n"
+		"\t                     as \"sdp|eir|att <hex bytes>\"\n"
+		"\t-o, --only <parser>  Only run parsers matching the name\n",
+		DEFAULT_ITERATIONS);
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "iterations",	1, 0, 'n' },
+	{ "file",	1, 0, 'f' },
+	{ "only",	1, 0, 'o' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	GSList *l;
+	int opt, err;
+
+	add_sdp_samples();
+	add_eir_samples();
+	add_att_samples();
+
+	while ((opt = getopt_long(argc, argv, "+hn:f:o:",
+						main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage();
+			exit(0);
+
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) {
+				fprintf(stderr, "Invalid iterations\n");
+				exit(1);
+			}
+			break;
+
+		case 'f':
+			err = load_samples(optarg);
+			if (err < 0) {
+				fprintf(stderr, "Can't load %s: %s\n", optarg,
+							strerror(-err));
+				exit(1);
+			}
+			break;
+
+		case 'o':
+			only = optarg;
+			break;
+
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	printf("%-26s %-24s %10s %10s\n", "parser", "input", "ns/op",
+								"allocs/op");
+
+	for (l = samples; l != NULL; l = l->next) {
+		struct sample *s = l->data;
+
+		switch (s->kind) {
+		case SAMPLE_SDP:
+			bench_sdp(s);
+			break;
+		case SAMPLE_EIR:
+			bench_eir(s);
+			break;
+		case SAMPLE_ATT:
+			bench_att(s);
+			break;
+		}
+	}
+
+	bench_textfile();
+
+	return 0;
+}
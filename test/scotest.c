@@ -31,6 +31,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <syslog.h>
 #include <signal.h>
@@ -47,9 +48,14 @@ enum {
 	RECONNECT,
 	MULTY,
 	DUMP,
-	CONNECT
+	CONNECT,
+	JITTER
 };
 
+/* Frames sent by send mode start with a sequence number, the frame
+ * length and the sender clock in usec, all little endian */
+#define FRAME_HDR_SIZE	10
+
 static unsigned char *buf;
 
 /* Default data size */
@@ -247,11 +253,88 @@ static void recv_mode(int sk)
 	}
 }
 
+/* Measures loss from sequence gaps and the one way jitter as defined
+ * for RTP, the mean deviation of the transit time between consecutive
+ * frames. The clocks of both sides do not need to be in sync for that.
+ * SCO does not keep the frame boundaries of the sender, so frames are
+ * reassembled from the byte stream using the length in the header. */
+static void jitter_mode(int sk)
+{
+	struct timeval tv;
+	uint32_t seq, stamp, now, expect = 0, frames = 0, lost = 0;
+	uint32_t resync = 0, last_report = 0;
+	int32_t transit, last_transit = 0, d;
+	double jitter = 0;
+	uint16_t flen;
+	long len = 0, off;
+	int r;
+
+	syslog(LOG_INFO, "Measuring jitter ...");
+
+	while ((r = recv(sk, buf + len, data_size - len, 0)) > 0) {
+		gettimeofday(&tv, NULL);
+		now = tv.tv_sec * 1000000 + tv.tv_usec;
+
+		len += r;
+
+		for (off = 0; len - off >= FRAME_HDR_SIZE; off += flen) {
+			memcpy(&flen, buf + off + 4, sizeof(flen));
+			flen = btohs(flen);
+
+			if (flen < FRAME_HDR_SIZE || flen > data_size) {
+				/* Lost track of the frames, start over */
+				resync++;
+				off = len;
+				break;
+			}
+
+			if (len - off < flen)
+				break;
+
+			memcpy(&seq, buf + off, sizeof(seq));
+			memcpy(&stamp, buf + off + 6, sizeof(stamp));
+			seq = btohl(seq);
+			transit = now - btohl(stamp);
+
+			if (frames > 0) {
+				if ((int32_t) (seq - expect) > 0)
+					lost += seq - expect;
+
+				d = transit - last_transit;
+				jitter += ((d < 0 ? -d : d) - jitter) / 16;
+			}
+
+			expect = seq + 1;
+			last_transit = transit;
+			frames++;
+		}
+
+		len -= off;
+		memmove(buf, buf + off, len);
+
+		if (now - last_report < 1000000)
+			continue;
+
+		last_report = now;
+
+		syslog(LOG_INFO, "%u frames, %u lost (%.2f%%), "
+				"jitter %.0f us, %u resyncs", frames, lost,
+				lost ? lost * 100.0 / (frames + lost) : 0.0,
+				jitter, resync);
+	}
+
+	if (r < 0)
+		syslog(LOG_ERR, "Read failed: %s (%d)",
+						strerror(errno), errno);
+}
+
 static void send_mode(char *svr)
 {
 	struct sco_options so;
+	struct timeval tv;
 	socklen_t len;
-	uint32_t seq;
+	uint32_t seq, stamp;
+	uint16_t size;
 	int i, sk;
 
 	if ((sk = do_connect(svr)) < 0) {
@@ -269,16 +352,26 @@ static void send_mode(char *svr)
 
 	syslog(LOG_INFO,"Sending ...");
 
-	for (i = 6; i < so.mtu; i++)
+	size = so.mtu < data_size ? so.mtu : data_size;
+	if (size < FRAME_HDR_SIZE) {
+		syslog(LOG_ERR, "SCO MTU %d too small", so.mtu);
+		exit(1);
+	}
+
+	for (i = FRAME_HDR_SIZE; i < size; i++)
 		buf[i] = 0x7f;
 
 	seq = 0;
 	while (1) {
+		gettimeofday(&tv, NULL);
+		stamp = htobl(tv.tv_sec * 1000000 + tv.tv_usec);
+
 		*(uint32_t *) buf = htobl(seq);
-		*(uint16_t *) (buf + 4) = htobs(data_size);
+		*(uint16_t *) (buf + 4) = htobs(size);
+		memcpy(buf + 6, &stamp, sizeof(stamp));
 		seq++;
 
-		if (send(sk, buf, so.mtu, 0) <= 0) {
+		if (send(sk, buf, size, 0) <= 0) {
 			syslog(LOG_ERR, "Send failed: %s (%d)",
 							strerror(errno), errno);
 			exit(1);
@@ -335,6 +428,7 @@ static void usage(void)
 	printf("\tscotest <mode> [-b bytes] [-p pkt_type] [bd_addr]\n");
 	printf("Modes:\n"
 		"\t-d dump (server)\n"
+		"\t-j measure loss and jitter of -s frames (server)\n"
 		"\t-c reconnect (client)\n"
 		"\t-m multiple connects (client)\n"
 		"\t-r receive (server)\n"
@@ -347,7 +441,7 @@ int main(int argc ,char *argv[])
 	struct sigaction sa;
 	int opt, sk, mode = RECV;
 
-	while ((opt=getopt(argc,argv,"rdscmnb:p:")) != EOF) {
+	while ((opt=getopt(argc,argv,"rdjscmnb:p:")) != EOF) {
 		switch(opt) {
 		case 'r':
 			mode = RECV;
@@ -361,6 +455,10 @@ int main(int argc ,char *argv[])
 			mode = DUMP;
 			break;
 
+		case 'j':
+			mode = JITTER;
+			break;
+
 		case 'c':
 			mode = RECONNECT;
 			break;
@@ -390,7 +488,8 @@ int main(int argc ,char *argv[])
 		}
 	}
 
-	if (!(argc - optind) && (mode != RECV && mode != DUMP)) {
+	if (!(argc - optind) && (mode != RECV && mode != DUMP &&
+							mode != JITTER)) {
 		usage();
 		exit(1);
 	}
@@ -416,6 +515,10 @@ int main(int argc ,char *argv[])
 			do_listen(dump_mode);
 			break;
 
+		case JITTER:
+			do_listen(jitter_mode);
+			break;
+
 		case SEND:
 			send_mode(argv[optind]);
 			break;
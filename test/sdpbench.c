@@ -0,0 +1,698 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2005-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/sdp.h>
+
+#define MAX_CSTATE_LEN		16
+#define MAX_HANDLES		256
+#define RSP_BUF_SIZE		(sizeof(sdp_pdu_hdr_t) + 0xffff)
+
+enum {
+	REQ_SEARCH,
+	REQ_ATTR,
+	REQ_SEARCH_ATTR,
+};
+
+/* Requests issued by each session, in the order they are sent */
+static const struct {
+	uint8_t pdu_id;
+	uint8_t rsp_id;
+	const char *name;
+} requests[] = {
+	{ SDP_SVC_SEARCH_REQ,		SDP_SVC_SEARCH_RSP,	"search"	},
+	{ SDP_SVC_ATTR_REQ,		SDP_SVC_ATTR_RSP,	"attr"		},
+	{ SDP_SVC_SEARCH_ATTR_REQ,	SDP_SVC_SEARCH_ATTR_RSP, "ssa"		},
+};
+
+#define NUM_REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+struct stats {
+	unsigned int count;
+	unsigned int errors;
+	unsigned int pdus;
+	unsigned int size;
+	uint32_t *samples;		/* latency in usec, one per request */
+};
+
+struct session {
+	int sk;
+	int type;
+	uint16_t tid;
+	unsigned int remaining;
+	uint64_t begin;
+	uint8_t cstate[1 + MAX_CSTATE_LEN];
+	uint8_t *buf;
+	size_t len;
+	uint32_t handles[MAX_HANDLES];
+	unsigned int num_handles;
+	unsigned int next_handle;
+};
+
+static struct stats req_stats[NUM_REQUESTS];
+
+static bdaddr_t src, dst;
+static int use_unix = 0;
+static int imtu = 0;
+static uint16_t max_bytes = 128;
+static uint16_t search_uuid = PUBLIC_BROWSE_GROUP;
+static pid_t daemon_pid = 0;
+
+static uint64_t get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Reads a "Name:  value kB" line of /proc/<pid>/status */
+static long get_status_kb(pid_t pid, const char *name)
+{
+	char path[64], buf[256];
+	size_t len = strlen(name);
+	long kb = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (!strncmp(buf, name, len) && buf[len] == ':') {
+			kb = atol(buf + len + 1);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return kb;
+}
+
+static int stats_add(struct stats *s, uint64_t usec)
+{
+	if (s->count == s->size) {
+		unsigned int size = s->size ? s->size * 2 : 1024;
+		uint32_t *samples;
+
+		samples = realloc(s->samples, size * sizeof(*samples));
+		if (!samples)
+			return -ENOMEM;
+
+		s->samples = samples;
+		s->size = size;
+	}
+
+	s->samples[s->count++] = usec > UINT32_MAX ? UINT32_MAX : usec;
+
+	return 0;
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct stats *s, unsigned int pct)
+{
+	unsigned int i = (uint64_t) s->count * pct / 100;
+
+	return s->samples[i < s->count ? i : s->count - 1];
+}
+
+static int l2cap_connect(void)
+{
+	struct sockaddr_l2 addr;
+	struct l2cap_options l2o;
+	socklen_t optlen;
+	int sk;
+
+	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+	if (sk < 0) {
+		perror("Can't create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	bacpy(&addr.l2_bdaddr, &src);
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Can't bind socket");
+		goto error;
+	}
+
+	if (imtu) {
+		/* A small MTU makes the server split its responses */
+		memset(&l2o, 0, sizeof(l2o));
+		optlen = sizeof(l2o);
+
+		if (getsockopt(sk, SOL_L2CAP, L2CAP_OPTIONS, &l2o,
+							&optlen) == 0) {
+			l2o.imtu = imtu;
+			setsockopt(sk, SOL_L2CAP, L2CAP_OPTIONS, &l2o,
+								sizeof(l2o));
+		}
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	bacpy(&addr.l2_bdaddr, &dst);
+	addr.l2_psm = htobs(SDP_PSM);
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Unable to connect");
+		goto error;
+	}
+
+	return sk;
+
+error:
+	close(sk);
+	return -1;
+}
+
+static int unix_connect(void)
+{
+	struct sockaddr_un addr;
+	int sk;
+
+	sk = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (sk < 0) {
+		perror("Can't create socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SDP_UNIX_PATH, sizeof(addr.sun_path) - 1);
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("Unable to connect");
+		close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t val)
+{
+	bt_put_unaligned(htons(val), (uint16_t *) p);
+	return p + sizeof(uint16_t);
+}
+
+static uint8_t *put_uuid_seq(uint8_t *p)
+{
+	*p++ = SDP_SEQ8;
+	*p++ = 3;
+	*p++ = SDP_UUID16;
+	return put_u16(p, search_uuid);
+}
+
+static uint8_t *put_range_seq(uint8_t *p)
+{
+	*p++ = SDP_SEQ8;
+	*p++ = 5;
+	*p++ = SDP_UINT32;
+	bt_put_unaligned(htonl(0x0000ffff), (uint32_t *) p);
+	return p + sizeof(uint32_t);
+}
+
+/* Sends the current request of the session, carrying the continuation
+ * state of the previous response if any */
+static int send_request(struct session *s)
+{
+	uint8_t buf[64], *p;
+	sdp_pdu_hdr_t *hdr = (void *) buf;
+	uint32_t handle;
+
+	p = buf + sizeof(*hdr);
+
+	switch (s->type) {
+	case REQ_SEARCH:
+		p = put_uuid_seq(p);
+		p = put_u16(p, MAX_HANDLES);
+		break;
+	case REQ_ATTR:
+		handle = s->handles[s->next_handle % s->num_handles];
+		bt_put_unaligned(htonl(handle), (uint32_t *) p);
+		p += sizeof(uint32_t);
+		p = put_u16(p, max_bytes);
+		p = put_range_seq(p);
+		break;
+	case REQ_SEARCH_ATTR:
+		p = put_uuid_seq(p);
+		p = put_u16(p, max_bytes);
+		p = put_range_seq(p);
+		break;
+	}
+
+	memcpy(p, s->cstate, 1 + s->cstate[0]);
+	p += 1 + s->cstate[0];
+
+	hdr->pdu_id = requests[s->type].pdu_id;
+	hdr->tid = htons(++s->tid);
+	hdr->plen = htons(p - buf - sizeof(*hdr));
+
+	req_stats[s->type].pdus++;
+
+	if (send(s->sk, buf, p - buf, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int start_request(struct session *s)
+{
+	s->cstate[0] = 0;
+	s->begin = get_usec();
+
+	if (s->type == REQ_SEARCH)
+		s->num_handles = 0;
+
+	return send_request(s);
+}
+
+static void next_request(struct session *s)
+{
+	if (s->type == REQ_ATTR)
+		s->next_handle++;
+
+	s->type = (s->type + 1) % NUM_REQUESTS;
+
+	/* Nothing to fetch attributes of when the search found nothing */
+	if (s->type == REQ_ATTR && s->num_handles == 0)
+		s->type = REQ_SEARCH_ATTR;
+}
+
+/* Handles one complete response, returns 1 when the request is done, 0
+ * when it was continued and a negative error otherwise */
+static int process_response(struct session *s, const uint8_t *pdu, size_t len)
+{
+	const sdp_pdu_hdr_t *hdr = (const void *) pdu;
+	const uint8_t *p = pdu + sizeof(*hdr), *end = p + ntohs(hdr->plen);
+	unsigned int i, count;
+
+	if (ntohs(hdr->tid) != s->tid)
+		return -EBADMSG;
+
+	if (hdr->pdu_id == SDP_ERROR_RSP)
+		return -EPROTO;
+
+	if (hdr->pdu_id != requests[s->type].rsp_id)
+		return -EBADMSG;
+
+	switch (s->type) {
+	case REQ_SEARCH:
+		if (end - p < 4)
+			return -EBADMSG;
+		count = ntohs(bt_get_unaligned((uint16_t *) (p + 2)));
+		p += 4;
+		if ((size_t) (end - p) < count * sizeof(uint32_t))
+			return -EBADMSG;
+		for (i = 0; i < count; i++, p += sizeof(uint32_t))
+			if (s->num_handles < MAX_HANDLES)
+				s->handles[s->num_handles++] =
+					ntohl(bt_get_unaligned((uint32_t *) p));
+		break;
+	default:
+		if (end - p < 2)
+			return -EBADMSG;
+		count = ntohs(bt_get_unaligned((uint16_t *) p));
+		p += 2;
+		if ((size_t) (end - p) < count)
+			return -EBADMSG;
+		p += count;
+		break;
+	}
+
+	if (p >= end || *p > MAX_CSTATE_LEN || end - p < 1 + *p)
+		return -EBADMSG;
+
+	memcpy(s->cstate, p, 1 + *p);
+
+	return s->cstate[0] == 0 ? 1 : 0;
+}
+
+/* Reads whatever is available, responses on the unix socket may arrive
+ * in pieces while L2CAP always delivers whole packets */
+static int session_read(struct session *s)
+{
+	sdp_pdu_hdr_t *hdr = (void *) s->buf;
+	size_t total;
+	ssize_t ret;
+
+	ret = recv(s->sk, s->buf + s->len, RSP_BUF_SIZE - s->len, 0);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+	if (ret == 0)
+		return -ECONNRESET;
+
+	s->len += ret;
+
+	if (s->len < sizeof(*hdr))
+		return 0;
+
+	total = sizeof(*hdr) + ntohs(hdr->plen);
+	if (s->len < total)
+		return 0;
+
+	ret = process_response(s, s->buf, total);
+
+	/* Anything past the response would be unsolicited, drop it */
+	s->len = 0;
+
+	if (ret == 0)
+		return send_request(s);
+
+	if (ret > 0)
+		stats_add(&req_stats[s->type], get_usec() - s->begin);
+	else
+		req_stats[s->type].errors++;
+
+	if (ret == -EBADMSG)
+		return ret;
+
+	next_request(s);
+
+	if (--s->remaining == 0) {
+		close(s->sk);
+		s->sk = -1;
+		return 0;
+	}
+
+	return start_request(s);
+}
+
+static void print_stats(const char *name, struct stats *s)
+{
+	uint64_t total = 0;
+	unsigned int i;
+
+	if (s->count == 0) {
+		printf("%-8s %8s %8u\n", name, "-", s->errors);
+		return;
+	}
+
+	qsort(s->samples, s->count, sizeof(*s->samples), cmp_sample);
+
+	for (i = 0; i < s->count; i++)
+		total += s->samples[i];
+
+	printf("%-8s %8u %8u %8u %10llu %10u %10u %10u\n", name, s->count,
+				s->errors, s->pdus,
+				(unsigned long long) (total / s->count),
+				percentile(s, 50), percentile(s, 99),
+				s->samples[s->count - 1]);
+}
+
+static void usage(void)
+{
+	printf("sdpbench - SDP server load generator ver %s\n", VERSION);
+	printf("Usage:\n"
+		"\tsdpbench [options] <remote address>\n"
+		"\tsdpbench [options] --unix\n");
+	printf("Options:\n"
+		"\t--device <hcidev>    HCI device\n"
+		"\t--unix               Use the local SDP server socket\n"
+		"\t--sessions <N>       Concurrent sessions, default 8\n"
+		"\t--count <N>          Requests per session, default 300\n"
+		"\t--uuid <uuid16>      UUID to search for, default 0x1002\n"
+		"\t--max-bytes <N>      Maximum attribute bytes per response,\n"
+		"\t                     default 128 to force continuations\n"
+		"\t--mtu <bytes>        L2CAP incoming MTU\n"
+		"\t--pid <pid>          Sample the memory use of the server\n");
+}
+
+static struct option main_options[] = {
+	{ "help",	0, 0, 'h' },
+	{ "device",	1, 0, 'i' },
+	{ "unix",	0, 0, 'U' },
+	{ "sessions",	1, 0, 's' },
+	{ "count",	1, 0, 'n' },
+	{ "uuid",	1, 0, 'u' },
+	{ "max-bytes",	1, 0, 'b' },
+	{ "mtu",	1, 0, 'm' },
+	{ "pid",	1, 0, 'p' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	struct session *sessions;
+	struct pollfd *fds;
+	unsigned int i, num_sessions = 8, count = 300, active, total = 0;
+	unsigned int pdus = 0, failed = 0;
+	long rss_before = -1, rss_after = -1, rss_peak = -1;
+	uint64_t begin, elapsed;
+	int opt, ret;
+
+	bacpy(&src, BDADDR_ANY);
+	bacpy(&dst, BDADDR_ANY);
+
+	while ((opt = getopt_long(argc, argv, "+i:Us:n:u:b:m:p:h",
+						main_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'i':
+			if (!strncmp(optarg, "hci", 3))
+				hci_devba(atoi(optarg + 3), &src);
+			else
+				str2ba(optarg, &src);
+			break;
+
+		case 'U':
+			use_unix = 1;
+			break;
+
+		case 's':
+			num_sessions = atoi(optarg);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		case 'u':
+			search_uuid = strtoul(optarg, NULL, 16);
+			break;
+
+		case 'b':
+			max_bytes = atoi(optarg);
+			if (max_bytes < 7) {
+				fprintf(stderr, "Invalid maximum byte count\n");
+				exit(1);
+			}
+			break;
+
+		case 'm':
+			imtu = atoi(optarg);
+			break;
+
+		case 'p':
+			daemon_pid = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (!use_unix) {
+		if (!argv[optind]) {
+			usage();
+			exit(1);
+		}
+
+		str2ba(argv[optind], &dst);
+	}
+
+	if (num_sessions == 0 || count == 0) {
+		usage();
+		exit(1);
+	}
+
+	sessions = calloc(num_sessions, sizeof(*sessions));
+	fds = calloc(num_sessions, sizeof(*fds));
+	if (!sessions || !fds) {
+		perror("Can't allocate sessions");
+		exit(1);
+	}
+
+	for (i = 0; i < num_sessions; i++) {
+		struct session *s = &sessions[i];
+
+		s->sk = use_unix ? unix_connect() : l2cap_connect();
+		if (s->sk < 0)
+			exit(1);
+
+		s->buf = malloc(RSP_BUF_SIZE);
+		if (!s->buf) {
+			perror("Can't allocate buffer");
+			exit(1);
+		}
+
+		s->remaining = count;
+		fcntl(s->sk, F_SETFL, fcntl(s->sk, F_GETFL) | O_NONBLOCK);
+	}
+
+	if (daemon_pid) {
+		rss_before = get_status_kb(daemon_pid, "VmRSS");
+		if (rss_before < 0) {
+			fprintf(stderr, "Unable to read memory use of pid %d\n",
+								daemon_pid);
+			daemon_pid = 0;
+		}
+	}
+
+	begin = get_usec();
+
+	for (i = 0; i < num_sessions; i++) {
+		ret = start_request(&sessions[i]);
+		if (ret < 0) {
+			fprintf(stderr, "Session %u failed: %s (%d)\n", i,
+							strerror(-ret), -ret);
+			close(sessions[i].sk);
+			sessions[i].sk = -1;
+			failed++;
+		}
+	}
+
+	while (1) {
+		for (i = 0, active = 0; i < num_sessions; i++) {
+			fds[i].fd = sessions[i].sk;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			if (sessions[i].sk >= 0)
+				active++;
+		}
+
+		if (active == 0)
+			break;
+
+		ret = poll(fds, num_sessions, 5000);
+		if (ret < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		if (ret == 0) {
+			fprintf(stderr, "Server stopped responding\n");
+			failed += active;
+			break;
+		}
+
+		for (i = 0; i < num_sessions; i++) {
+			struct session *s = &sessions[i];
+
+			if (s->sk < 0 || !fds[i].revents)
+				continue;
+
+			ret = session_read(s);
+			if (ret < 0) {
+				fprintf(stderr, "Session %u failed: %s (%d)\n",
+						i, strerror(-ret), -ret);
+				close(s->sk);
+				s->sk = -1;
+				failed++;
+			}
+		}
+
+		if (daemon_pid) {
+			long rss = get_status_kb(daemon_pid, "VmRSS");
+			if (rss > rss_peak)
+				rss_peak = rss;
+		}
+	}
+
+	elapsed = get_usec() - begin;
+
+	if (daemon_pid)
+		rss_after = get_status_kb(daemon_pid, "VmRSS");
+
+	printf("%-8s %8s %8s %8s %10s %10s %10s %10s\n", "request", "count",
+				"errors", "pdus", "avg (us)", "p50 (us)",
+				"p99 (us)", "max (us)");
+
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		print_stats(requests[i].name, &req_stats[i]);
+		total += req_stats[i].count;
+		pdus += req_stats[i].pdus;
+	}
+
+	printf("\n%u sessions, %u failed, %u requests (%u PDUs) in %llu ms",
+			num_sessions, failed, total, pdus,
+			(unsigned long long) elapsed / 1000);
+	if (elapsed)
+		printf(", %llu requests/s, %llu PDUs/s",
+			(unsigned long long) total * 1000000 / elapsed,
+			(unsigned long long) pdus * 1000000 / elapsed);
+	printf("\n");
+
+	if (daemon_pid)
+		printf("daemon: RSS %ld kB before, %ld kB peak, %ld kB after\n",
+					rss_before, rss_peak, rss_after);
+
+	for (i = 0; i < num_sessions; i++) {
+		if (sessions[i].sk >= 0)
+			close(sessions[i].sk);
+		free(sessions[i].buf);
+	}
+
+	for (i = 0; i < NUM_REQUESTS; i++)
+		free(req_stats[i].samples);
+
+	free(sessions);
+	free(fds);
+
+	return failed ? 1 : 0;
+}
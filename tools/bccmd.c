@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
@@ -122,6 +123,24 @@ static inline int transport_write(int transport, uint16_t varid, uint8_t *value,
 	}
 }
 
+static inline const char *transport_name(int transport)
+{
+	switch (transport) {
+	case CSR_TRANSPORT_HCI:
+		return "hci";
+	case CSR_TRANSPORT_USB:
+		return "usb";
+	case CSR_TRANSPORT_BCSP:
+		return "bcsp";
+	case CSR_TRANSPORT_H4:
+		return "h4";
+	case CSR_TRANSPORT_3WIRE:
+		return "3wire";
+	default:
+		return "unknown";
+	}
+}
+
 static inline void transport_close(int transport)
 {
 	switch (transport) {
@@ -608,15 +627,16 @@ static int cmd_memtypes(int transport, int argc, char *argv[])
 static struct option pskey_options[] = {
 	{ "stores",	1, 0, 's' },
 	{ "reset",	0, 0, 'r' },
+	{ "compare",	0, 0, 'c' },
 	{ "help",	0, 0, 'h' },
 	{ 0, 0, 0, 0 }
 };
 
-static int opt_pskey(int argc, char *argv[], uint16_t *stores, int *reset, int *help)
+static int opt_pskey(int argc, char *argv[], uint16_t *stores, int *reset, int *compare, int *help)
 {
 	int opt;
 
-	while ((opt=getopt_long(argc, argv, "+s:rh", pskey_options, NULL)) != EOF) {
+	while ((opt=getopt_long(argc, argv, "+s:rch", pskey_options, NULL)) != EOF) {
 		switch (opt) {
 		case 's':
 			if (!stores)
@@ -650,6 +670,11 @@ static int opt_pskey(int argc, char *argv[], uint16_t *stores, int *reset, int *
 				*reset = 1;
 			break;
 
+		case 'c':
+			if (compare)
+				*compare = 1;
+			break;
+
 		case 'h':
 			if (help)
 				*help = 1;
@@ -660,8 +685,8 @@ static int opt_pskey(int argc, char *argv[], uint16_t *stores, int *reset, int *
 	return optind;
 }
 
-#define OPT_PSKEY(min, max, stores, reset, help) \
-		opt_pskey(argc, argv, (stores), (reset), (help)); \
+#define OPT_PSKEY(min, max, stores, reset, compare, help) \
+		opt_pskey(argc, argv, (stores), (reset), (compare), (help)); \
 		argc -= optind; argv += optind; optind = 0; \
 		OPT_RANGE((min), (max))
 
@@ -674,7 +699,7 @@ static int cmd_psget(int transport, int argc, char *argv[])
 
 	memset(array, 0, sizeof(array));
 
-	OPT_PSKEY(1, 1, &stores, &reset, NULL);
+	OPT_PSKEY(1, 1, &stores, &reset, NULL, NULL);
 
 	if (strncasecmp(argv[0], "0x", 2)) {
 		pskey = atoi(argv[0]);
@@ -749,7 +774,7 @@ static int cmd_psset(int transport, int argc, char *argv[])
 
 	memset(array, 0, sizeof(array));
 
-	OPT_PSKEY(2, 81, &stores, &reset, NULL);
+	OPT_PSKEY(2, 81, &stores, &reset, NULL, NULL);
 
 	if (strncasecmp(argv[0], "0x", 2)) {
 		pskey = atoi(argv[0]);
@@ -852,7 +877,7 @@ static int cmd_psclr(int transport, int argc, char *argv[])
 	uint16_t pskey, stores = CSR_STORES_PSRAM;
 	int i, err, reset = 0;
 
-	OPT_PSKEY(1, 1, &stores, &reset, NULL);
+	OPT_PSKEY(1, 1, &stores, &reset, NULL, NULL);
 
 	if (strncasecmp(argv[0], "0x", 2)) {
 		pskey = atoi(argv[0]);
@@ -889,7 +914,7 @@ static int cmd_pslist(int transport, int argc, char *argv[])
 	uint16_t pskey = 0x0000, length, stores = CSR_STORES_DEFAULT;
 	int err, reset = 0;
 
-	OPT_PSKEY(0, 0, &stores, &reset, NULL);
+	OPT_PSKEY(0, 0, &stores, &reset, NULL, NULL);
 
 	while (1) {
 		memset(array, 0, sizeof(array));
@@ -935,7 +960,7 @@ static int cmd_psread(int transport, int argc, char *argv[])
 	char *str, val[7];
 	int i, err, reset = 0;
 
-	OPT_PSKEY(0, 0, &stores, &reset, NULL);
+	OPT_PSKEY(0, 0, &stores, &reset, NULL, NULL);
 
 	while (1) {
 		memset(array, 0, sizeof(array));
@@ -997,20 +1022,59 @@ static int cmd_psread(int transport, int argc, char *argv[])
 	return 0;
 }
 
+/* Two reads are cheaper than rewriting a key in a persistent store that
+ * already holds the value */
+static int psload_unchanged(int transport, uint16_t pskey, uint16_t stores,
+					uint8_t *value, uint16_t size)
+{
+	uint8_t array[256];
+	uint16_t length;
+
+	memset(array, 0, sizeof(array));
+	array[0] = pskey & 0xff;
+	array[1] = pskey >> 8;
+	array[2] = stores & 0xff;
+	array[3] = stores >> 8;
+
+	if (transport_read(transport, CSR_VARID_PS_SIZE, array, 8) < 0)
+		return 0;
+
+	length = array[2] + (array[3] << 8);
+	if (length * 2 != size)
+		return 0;
+
+	memset(array, 0, sizeof(array));
+	array[0] = pskey & 0xff;
+	array[1] = pskey >> 8;
+	array[2] = length & 0xff;
+	array[3] = length >> 8;
+	array[4] = stores & 0xff;
+	array[5] = stores >> 8;
+
+	if (transport_read(transport, CSR_VARID_PS, array, size + 6) < 0)
+		return 0;
+
+	return !memcmp(array + 6, value, size);
+}
+
 static int cmd_psload(int transport, int argc, char *argv[])
 {
 	uint8_t array[256];
 	uint16_t pskey, length, size, stores = CSR_STORES_PSRAM;
+	struct timeval start, now, diff;
+	int loaded = 0, unchanged = 0, failed = 0;
 	char *str, val[7];
-	int err, reset = 0;
+	int err, reset = 0, compare = 0;
 
-	OPT_PSKEY(1, 1, &stores, &reset, NULL);
+	OPT_PSKEY(1, 1, &stores, &reset, &compare, NULL);
 
 	psr_read(argv[0]);
 
 	memset(array, 0, sizeof(array));
 	size = sizeof(array) - 6;
 
+	gettimeofday(&start, NULL);
+
 	while (psr_get(&pskey, array + 6, &size) == 0) {
 		str = csr_pskeytoval(pskey);
 		if (!strcasecmp(str, "UNKNOWN")) {
@@ -1022,6 +1086,13 @@ static int cmd_psload(int transport, int argc, char *argv[])
 							str ? str : val);
 		fflush(stdout);
 
+		if (compare && psload_unchanged(transport, pskey, stores,
+							array + 6, size)) {
+			printf("unchanged\n");
+			unchanged++;
+			goto next;
+		}
+
 		length = size / 2;
 
 		array[0] = pskey & 0xff;
@@ -1035,10 +1106,24 @@ static int cmd_psload(int transport, int argc, char *argv[])
 
 		printf("%s\n", err < 0 ? "failed" : "done");
 
+		if (err < 0)
+			failed++;
+		else
+			loaded++;
+
+next:
 		memset(array, 0, sizeof(array));
 		size = sizeof(array) - 6;
 	}
 
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &diff);
+
+	printf("%d keys loaded, %d unchanged, %d failed in %ld.%03ld s "
+			"over %s\n", loaded, unchanged, failed,
+			(long) diff.tv_sec, (long) diff.tv_usec / 1000,
+			transport_name(transport));
+
 	if (reset)
 		transport_write(transport, CSR_VARID_WARM_RESET, NULL, 0);
 
@@ -32,6 +32,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <termios.h>
+#include <sys/poll.h>
 
 #include "csr.h"
 #include "ubcsp.h"
@@ -46,6 +47,45 @@ static uint8_t send_buffer[512];
 static struct ubcsp_packet receive_packet;
 static uint8_t receive_buffer[512];
 
+/* The ubcsp engine works an octet at a time, the UART does not have to */
+static uint8_t uart_tx[1024];
+static int uart_tx_len = 0;
+
+static uint8_t uart_rx[256];
+static int uart_rx_len = 0;
+static int uart_rx_pos = 0;
+
+static void flush_uart(void)
+{
+	int off = 0;
+
+	while (off < uart_tx_len) {
+		struct pollfd p;
+		ssize_t len;
+
+		len = write(fd, uart_tx + off, uart_tx_len - off);
+		if (len > 0) {
+			off += len;
+			continue;
+		}
+
+		if (len < 0 && errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "UART write error\n");
+			break;
+		}
+
+		p.fd = fd;
+		p.events = POLLOUT;
+
+		if (poll(&p, 1, 1000) <= 0) {
+			fprintf(stderr, "UART write timeout\n");
+			break;
+		}
+	}
+
+	uart_tx_len = 0;
+}
+
 int csr_open_bcsp(char *device, speed_t bcsp_rate)
 {
 	struct termios ti;
@@ -105,6 +145,9 @@ int csr_open_bcsp(char *device, speed_t bcsp_rate)
 	memset(&send_packet, 0, sizeof(send_packet));
 	memset(&receive_packet, 0, sizeof(receive_packet));
 
+	uart_tx_len = 0;
+	uart_rx_len = uart_rx_pos = 0;
+
 	ubcsp_initialize();
 
 	send_packet.length = 512;
@@ -117,6 +160,7 @@ int csr_open_bcsp(char *device, speed_t bcsp_rate)
 
 	while (1) {
 		delay = ubcsp_poll(&activity);
+		flush_uart();
 
 		if (activity & UBCSP_PACKET_RECEIVED)
 			break;
@@ -136,14 +180,26 @@ int csr_open_bcsp(char *device, speed_t bcsp_rate)
 
 void put_uart(uint8_t ch)
 {
-	if (write(fd, &ch, 1) < 0)
-		fprintf(stderr, "UART write error\n");
+	if (uart_tx_len == sizeof(uart_tx))
+		flush_uart();
+
+	uart_tx[uart_tx_len++] = ch;
 }
 
 uint8_t get_uart(uint8_t *ch)
 {
-	int res = read(fd, ch, 1);
-	return res > 0 ? res : 0;
+	if (uart_rx_pos == uart_rx_len) {
+		int res = read(fd, uart_rx, sizeof(uart_rx));
+		if (res <= 0)
+			return 0;
+
+		uart_rx_len = res;
+		uart_rx_pos = 0;
+	}
+
+	*ch = uart_rx[uart_rx_pos++];
+
+	return 1;
 }
 
 static int do_command(uint16_t command, uint16_t seqnum, uint16_t varid, uint8_t *value, uint16_t length)
@@ -187,6 +243,7 @@ static int do_command(uint16_t command, uint16_t seqnum, uint16_t varid, uint8_t
 
 	while (1) {
 		delay = ubcsp_poll(&activity);
+		flush_uart();
 
 		if (activity & UBCSP_PACKET_SENT) {
 			switch (varid) {
@@ -104,6 +104,14 @@ uint32_t crc32_byte(uint32_t accum, uint8_t delta)
 	return dfu_crc32_table[(accum ^ delta) & 0xff] ^ (accum >> 8);
 }
 
+uint32_t crc32_block(uint32_t accum, const uint8_t *buf, size_t len)
+{
+	while (len--)
+		accum = dfu_crc32_table[(accum ^ *buf++) & 0xff] ^ (accum >> 8);
+
+	return accum;
+}
+
 int dfu_detach(struct usb_dev_handle *udev, int intf)
 {
 	if (!udev)
@@ -166,3 +174,42 @@ int dfu_abort(struct usb_dev_handle *udev, int intf)
 	return usb_control_msg(udev, USB_TYPE_CLASS | USB_DIR_OUT | USB_RECIP_INTERFACE,
 		DFU_ABORT, 0, intf, NULL, 0, DFU_TIMEOUT);
 }
+
+/* Look up wTransferSize in the DFU functional descriptor of the interface,
+ * falling back to the CSR default if the device doesn't provide one */
+int dfu_get_transfer_size(struct usb_device *dev, int intf)
+{
+	int c, i, a, size;
+
+	if (!dev)
+		return DFU_PACKETSIZE;
+
+	for (c = 0; c < dev->descriptor.bNumConfigurations; c++) {
+		struct usb_config_descriptor *config = &dev->config[c];
+
+		for (i = 0; i < config->bNumInterfaces; i++) {
+			struct usb_interface *interface = &config->interface[i];
+
+			for (a = 0; a < interface->num_altsetting; a++) {
+				struct usb_interface_descriptor *desc = &interface->altsetting[a];
+				unsigned char *ptr = desc->extra;
+				int len = desc->extralen;
+
+				if (desc->bInterfaceNumber != intf)
+					continue;
+
+				while (ptr && len >= 7 && ptr[0] >= 2 && ptr[0] <= len) {
+					if (ptr[1] == USB_DT_DFU && ptr[0] >= 7) {
+						size = ptr[5] | (ptr[6] << 8);
+						if (size > 0)
+							return size;
+					}
+					len -= ptr[0];
+					ptr += ptr[0];
+				}
+			}
+		}
+	}
+
+	return DFU_PACKETSIZE;
+}
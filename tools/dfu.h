@@ -22,10 +22,12 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 /* CRC interface */
 uint32_t crc32_init(void);
 uint32_t crc32_byte(uint32_t accum, uint8_t delta);
+uint32_t crc32_block(uint32_t accum, const uint8_t *buf, size_t len);
 
 /* DFU descriptor */
 struct usb_dfu_descriptor {
@@ -105,3 +107,4 @@ int dfu_get_status(struct usb_dev_handle *udev, int intf, struct dfu_status *sta
 int dfu_clear_status(struct usb_dev_handle *udev, int intf);
 int dfu_get_state(struct usb_dev_handle *udev, int intf, uint8_t *state);
 int dfu_abort(struct usb_dev_handle *udev, int intf);
+int dfu_get_transfer_size(struct usb_device *dev, int intf);
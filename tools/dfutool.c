@@ -37,6 +37,8 @@
 #include <libgen.h>
 #include <endian.h>
 #include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -313,18 +315,109 @@ error:
 
 static void usage(void);
 
-static void cmd_verify(char *device, int argc, char **argv)
+static unsigned char *map_firmware(const char *filename, size_t *size)
 {
 	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		perror("Can't open firmware");
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("Can't access firmware");
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size < DFU_SUFFIX_SIZE) {
+		fprintf(stderr, "Firmware file is too small\n");
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror("Can't load firmware");
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*size = st.st_size;
+
+	return map;
+}
+
+static unsigned long poll_timeout(struct dfu_status *status)
+{
+	return (status->bwPollTimeout[2] << 16) |
+			(status->bwPollTimeout[1] << 8) |
+				status->bwPollTimeout[0];
+}
+
+static long elapsed_usec(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+					(now.tv_usec - start->tv_usec);
+}
+
+static void set_deadline(struct timeval *deadline, unsigned long msec)
+{
+	gettimeofday(deadline, NULL);
+
+	deadline->tv_sec += msec / 1000;
+	deadline->tv_usec += (msec % 1000) * 1000;
+	if (deadline->tv_usec >= 1000000) {
+		deadline->tv_sec++;
+		deadline->tv_usec -= 1000000;
+	}
+}
+
+/* Sleep for whatever is left of the poll timeout the device asked for */
+static void wait_until(const struct timeval *deadline)
+{
+	long left = -elapsed_usec(deadline);
+
+	if (left > 0)
+		usleep(left);
+}
+
+static void print_progress(const struct timeval *start, size_t sent, size_t total)
+{
+	long usec = elapsed_usec(start);
+	double rate = usec > 0 ? (double) sent * 1000000 / usec : 0;
+
+	printf("\rFirmware download ... %zd/%zd bytes (%zd%%) %.1f KB/s",
+				sent, total, total ? sent * 100 / total : 0,
+								rate / 1024);
+
+	if (rate > 0 && sent < total)
+		printf(" ETA %lds  ", (long) ((total - sent) / rate + 0.5));
+	else
+		printf("        ");
+
+	fflush(stdout);
+}
+
+static void cmd_verify(char *device, int argc, char **argv)
+{
 	struct dfu_suffix *suffix;
-	uint32_t crc;
+	uint32_t crc, image_crc;
 	uint16_t bcd;
 	char str[16];
 	unsigned char *buf;
 	size_t size;
 	char *filename;
 	unsigned int i, len;
-	int fd;
 
 	if (argc < 2) {
 		usage();
@@ -333,37 +426,17 @@ static void cmd_verify(char *device, int argc, char **argv)
 
 	filename = argv[1];
 
-	if (stat(filename, &st) < 0) {
-		perror("Can't access firmware");
+	buf = map_firmware(filename, &size);
+	if (!buf)
 		exit(1);
-	}
-
-	size = st.st_size;
-
-	if (!(buf = malloc(size))) {
-		perror("Unable to allocate file buffer");
-		exit(1);
-	}
-
-	if ((fd = open(filename, O_RDONLY)) < 0) {
-		perror("Can't open firmware");
-		free(buf);
-		exit(1);
-	}
-
-	if (read(fd, buf, size) < (ssize_t) size) {
-		perror("Can't load firmware");
-		free(buf);
-		close(fd);
-		exit(1);
-	}
 
 	printf("Filename\t%s\n", basename(filename));
 	printf("Filesize\t%zd\n", size);
 
-	crc = crc32_init();
-	for (i = 0; i < size - 4; i++)
-		crc = crc32_byte(crc, buf[i]);
+	/* One pass gives both the image and the file checksum */
+	image_crc = crc32_block(crc32_init(), buf, size - DFU_SUFFIX_SIZE);
+	crc = crc32_block(image_crc, buf + size - DFU_SUFFIX_SIZE,
+							DFU_SUFFIX_SIZE - 4);
 	printf("Checksum\t%08x\n", crc);
 
 	printf("\n");
@@ -395,18 +468,12 @@ static void cmd_verify(char *device, int argc, char **argv)
 	memcpy(str, buf, 8);
 
 	if (!strcmp(str, "CSR-dfu1") || !strcmp(str, "CSR-dfu2")) {
-		crc = crc32_init();
-		for (i = 0; i < size - DFU_SUFFIX_SIZE; i++)
-			crc = crc32_byte(crc, buf[i]);
-
 		printf("Firmware type\t%s\n", str);
-		printf("Firmware check\t%s checksum\n", crc == 0 ? "valid" : "corrupt");
+		printf("Firmware check\t%s checksum\n", image_crc == 0 ? "valid" : "corrupt");
 		printf("\n");
 	}
 
-	free(buf);
-
-	close(fd);
+	munmap(buf, size);
 }
 
 static void cmd_modify(char *device, int argc, char **argv)
@@ -418,14 +485,14 @@ static void cmd_upgrade(char *device, int argc, char **argv)
 	struct usb_dev_handle *udev;
 	struct dfu_status status;
 	struct dfu_suffix suffix;
-	struct stat st;
-	char *buf;
-	size_t filesize;
+	struct timeval start, deadline;
+	unsigned char *buf;
+	size_t filesize, total;
 	unsigned long count, timeout = 0;
 	char *filename;
 	uint32_t crc, dwCRC;
-	unsigned int i;
-	int fd, block, len, size, sent = 0, try = 10;
+	long usec;
+	int block, len, size, xfer, sent = 0, try = 10;
 
 	if (argc < 2) {
 		usage();
@@ -434,30 +501,9 @@ static void cmd_upgrade(char *device, int argc, char **argv)
 
 	filename = argv[1];
 
-	if (stat(filename, &st) < 0) {
-		perror("Can't access firmware");
-		exit(1);
-	}
-
-	filesize = st.st_size;
-
-	if (!(buf = malloc(filesize))) {
-		perror("Unable to allocate file buffer");
+	buf = map_firmware(filename, &filesize);
+	if (!buf)
 		exit(1);
-	}
-
-	if ((fd = open(filename, O_RDONLY)) < 0) {
-		perror("Can't open firmware");
-		free(buf);
-		exit(1);
-	}
-
-	if (read(fd, buf, filesize) < (ssize_t) filesize) {
-		perror("Can't load firmware");
-		free(buf);
-		close(fd);
-		exit(1);
-	}
 
 	memcpy(&suffix, buf + filesize - DFU_SUFFIX_SIZE, sizeof(suffix));
 	dwCRC = le32_to_cpu(suffix.dwCRC);
@@ -465,34 +511,40 @@ static void cmd_upgrade(char *device, int argc, char **argv)
 	printf("Filename\t%s\n", basename(filename));
 	printf("Filesize\t%zd\n", filesize);
 
-	crc = crc32_init();
-	for (i = 0; i < filesize - 4; i++)
-		crc = crc32_byte(crc, buf[i]);
+	crc = crc32_block(crc32_init(), buf, filesize - 4);
 
 	printf("Checksum\t%08x (%s)\n", crc,
 			crc == dwCRC ? "valid" : "corrupt");
 
 	if (crc != dwCRC) {
-		free(buf);
-		close(fd);
+		munmap(buf, filesize);
 		exit(1);
 	}
 
 	printf("\n");
 
 	udev = open_device(device, &suffix);
-	if (!udev)
+	if (!udev) {
+		munmap(buf, filesize);
 		exit(1);
+	}
+
+	xfer = dfu_get_transfer_size(usb_device(udev), 0);
 
 	printf("\r" "          " "          " "          " "          " "          ");
 	printf("\rFirmware download ... ");
 	fflush(stdout);
 
-	count = filesize - DFU_SUFFIX_SIZE;
+	total = count = filesize - DFU_SUFFIX_SIZE;
 	block = 0;
 
+	gettimeofday(&start, NULL);
+	deadline = start;
+
 	while (count) {
-		size = (count > 1023) ? 1023 : count;
+		size = (count > (unsigned long) xfer) ? xfer : count;
+
+		wait_until(&deadline);
 
 		if (dfu_get_status(udev, 0, &status) < 0) {
 			if (try-- > 0) {
@@ -514,19 +566,23 @@ static void cmd_upgrade(char *device, int argc, char **argv)
 			goto done;
 		}
 
+		timeout = poll_timeout(&status);
+
+		/* The device is still writing the previous block, come
+		 * back when its poll timeout has passed */
+		if (status.bState == DFU_STATE_DFU_DNLOAD_SYNC ||
+				status.bState == DFU_STATE_DFU_DNLOAD_BUSY) {
+			set_deadline(&deadline, timeout);
+			continue;
+		}
+
 		if (status.bState != DFU_STATE_DFU_IDLE &&
 				status.bState != DFU_STATE_DFU_DNLOAD_IDLE) {
 			sleep(1);
 			continue;
 		}
 
-		timeout = (status.bwPollTimeout[2] << 16) |
-				(status.bwPollTimeout[1] << 8) |
-					status.bwPollTimeout[0];
-
-		usleep(timeout * 1000);
-
-		len = dfu_download(udev, 0, block, buf + sent, size);
+		len = dfu_download(udev, 0, block, (char *) buf + sent, size);
 		if (len < 0) {
 			if (try-- > 0) {
 				sleep(1);
@@ -536,14 +592,20 @@ static void cmd_upgrade(char *device, int argc, char **argv)
 			goto done;
 		}
 
-		printf("\rFirmware download ... %d bytes ", block * 1023 + len);
-		fflush(stdout);
+		/* Let the poll timeout run while updating the progress */
+		set_deadline(&deadline, timeout);
 
 		sent  += len;
 		count -= len;
 		block++;
+
+		print_progress(&start, sent, total);
 	}
 
+	usec = elapsed_usec(&start);
+	printf("\nTransferred %zd bytes in %ld.%03lds (block size %d)\n",
+			total, usec / 1000000, (usec / 1000) % 1000, xfer);
+
 	printf("\r" "          " "          " "          " "          " "          ");
 	printf("\rFinishing firmware download ... ");
 	fflush(stdout);
@@ -555,9 +617,7 @@ static void cmd_upgrade(char *device, int argc, char **argv)
 		goto done;
 	}
 
-	timeout = (status.bwPollTimeout[2] << 16) |
-			(status.bwPollTimeout[1] << 8) |
-				status.bwPollTimeout[0];
+	timeout = poll_timeout(&status);
 
 	usleep(timeout * 1000);
 
@@ -578,8 +638,7 @@ static void cmd_upgrade(char *device, int argc, char **argv)
 	printf("\n");
 
 done:
-	free(buf);
-	close(fd);
+	munmap(buf, filesize);
 
 	usb_release_interface(udev, 0);
 	usb_reset(udev);
@@ -647,9 +706,7 @@ static void cmd_archive(char *device, int argc, char **argv)
 			continue;
 		}
 
-		timeout = (status.bwPollTimeout[2] << 16) |
-				(status.bwPollTimeout[1] << 8) |
-					status.bwPollTimeout[0];
+		timeout = poll_timeout(&status);
 
 		usleep(timeout * 1000);
 
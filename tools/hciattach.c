@@ -41,6 +41,8 @@
 #include <sys/poll.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
@@ -199,6 +201,51 @@ int read_hci_event(int fd, unsigned char* buf, int size)
 	return count;
 }
 
+/* Firmware and script files are mapped once so the vendor initializers
+ * can walk them in place instead of reading them piece by piece. The
+ * mapping is released with munmap(). */
+void *map_firmware(const char *file, size_t *size)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		errno = ENODATA;
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+
+	return data;
+}
+
+long elapsed_msec(const struct timeval *start)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &diff);
+
+	return diff.tv_sec * 1000 + diff.tv_usec / 1000;
+}
+
 /*
  * Ericsson specific initialization
  */
@@ -22,6 +22,7 @@
  */
 
 #include <termios.h>
+#include <sys/time.h>
 
 #ifndef N_HCI
 #define N_HCI	15
@@ -45,6 +46,8 @@
 
 int read_hci_event(int fd, unsigned char* buf, int size);
 int set_speed(int fd, struct termios *ti, int speed);
+void *map_firmware(const char *file, size_t *size);
+long elapsed_msec(const struct timeval *start);
 
 int texas_init(int fd, struct termios *ti);
 int texas_post(int fd, struct termios *ti);
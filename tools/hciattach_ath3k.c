@@ -32,6 +32,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -88,13 +89,19 @@ static int send_hci_cmd_sync(int dev, uint8_t *cmd, int len, uint8_t **event)
 	int err;
 	uint8_t *hci_event;
 	uint8_t pkt_type = HCI_COMMAND_PKT;
+	struct iovec iov[2];
 
 	if (len == 0)
 		return len;
 
-	if (write(dev, &pkt_type, 1) != 1)
-		return -EILSEQ;
-	if (write(dev, (unsigned char *)cmd, len) != len)
+	/* Packet type and command go out in one write so the controller
+	 * does not see a gap after the indicator byte */
+	iov[0].iov_base = &pkt_type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = cmd;
+	iov[1].iov_len = len;
+
+	if (writev(dev, iov, 2) != len + 1)
 		return -EILSEQ;
 
 	hci_event = (uint8_t *)malloc(PS_EVENT_LEN);
@@ -960,6 +967,7 @@ int ath3k_init(int fd, int speed, int init_speed, char *bdaddr,
 {
 	int r;
 	int err = 0;
+	struct timeval start;
 	struct timespec tm = { 0, 500000 };
 	unsigned char cmd[MAX_CMD_LEN], rsp[HCI_MAX_EVENT_SIZE];
 	unsigned char *ptr = cmd + 1;
@@ -979,6 +987,8 @@ int ath3k_init(int fd, int speed, int init_speed, char *bdaddr,
 	}
 
 	/* Download PS and patch */
+	gettimeofday(&start, NULL);
+
 	r = ath_ps_download(fd);
 	if (r < 0) {
 		perror("Failed to Download configuration");
@@ -986,6 +996,9 @@ int ath3k_init(int fd, int speed, int init_speed, char *bdaddr,
 		goto failed;
 	}
 
+	fprintf(stderr, "ath3k: configuration downloaded in %ld ms\n",
+							elapsed_msec(&start));
+
 	/* Write BDADDR */
 	if (bdaddr) {
 		ch->opcode = htobs(cmd_opcode_pack(HCI_VENDOR_CMD_OGF,
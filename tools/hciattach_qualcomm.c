@@ -40,6 +40,7 @@
 #include <sys/poll.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
@@ -100,68 +101,85 @@ static int read_command_complete(int fd,
 
 static int qualcomm_load_firmware(int fd, const char *firmware, const char *bdaddr_s)
 {
-
-	int fw = open(firmware, O_RDONLY);
+	struct timeval start;
+	unsigned char *fw;
+	size_t size, off;
+	int count = 0, err = -1;
 
 	fprintf(stdout, "Opening firmware file: %s\n", firmware);
 
-	FAILIF(fw < 0,
+	fw = map_firmware(firmware, &size);
+	FAILIF(fw == NULL,
 		"Could not open firmware file %s: %s (%d).\n",
 		firmware, strerror(errno), errno);
 
+	gettimeofday(&start, NULL);
+
 	fprintf(stdout, "Uploading firmware...\n");
-	do {
-		/* Read each command and wait for a response. */
-		unsigned char data[1024];
-		unsigned char cmdp[1 + sizeof(hci_command_hdr)];
+	for (off = 0; off < size; count++) {
+		/* Commands are sent straight out of the mapping, only the
+		 * one carrying the BD address is patched in a copy */
+		unsigned char *cmdp = fw + off;
 		hci_command_hdr *cmd = (hci_command_hdr *) (cmdp + 1);
-		int nr;
+		unsigned char bdaddr_data[256];
+		unsigned char *data;
+		struct iovec iov_cmd[2];
+		int nw;
+
+		if (size - off < 1 + HCI_COMMAND_HDR_SIZE) {
+			fprintf(stderr, "Could not read H4 + HCI header!\n");
+			goto done;
+		}
 
-		nr = read(fw, cmdp, sizeof(cmdp));
-		if (!nr)
-			break;
+		if (*cmdp != HCI_COMMAND_PKT) {
+			fprintf(stderr, "Command is not an H4 command packet!\n");
+			goto done;
+		}
 
-		FAILIF(nr != sizeof(cmdp),
-			"Could not read H4 + HCI header!\n");
-		FAILIF(*cmdp != HCI_COMMAND_PKT,
-			"Command is not an H4 command packet!\n");
+		data = cmdp + 1 + HCI_COMMAND_HDR_SIZE;
+		off += 1 + HCI_COMMAND_HDR_SIZE + cmd->plen;
 
-		FAILIF(read(fw, data, cmd->plen) != cmd->plen,
-				"Could not read %d bytes of data \
-				for command with opcode %04x!\n",
-				cmd->plen, cmd->opcode);
+		if (off > size) {
+			fprintf(stderr, "Could not read %d bytes of data "
+					"for command with opcode %04x!\n",
+					cmd->plen, cmd->opcode);
+			goto done;
+		}
 
-		if ((data[0] == 1) && (data[1] == 2) && (data[2] == 6)) {
+		if (bdaddr_s != NULL && cmd->plen >= 3 + sizeof(bdaddr_t) &&
+				data[0] == 1 && data[1] == 2 && data[2] == 6) {
 			bdaddr_t bdaddr;
-			if (bdaddr_s != NULL) {
-				str2ba(bdaddr_s, &bdaddr);
-				memcpy(&data[3], &bdaddr, sizeof(bdaddr_t));
-			}
+
+			str2ba(bdaddr_s, &bdaddr);
+			memcpy(bdaddr_data, data, cmd->plen);
+			memcpy(&bdaddr_data[3], &bdaddr, sizeof(bdaddr_t));
+			data = bdaddr_data;
 		}
 
-		{
-			int nw;
-			struct iovec iov_cmd[2];
-			iov_cmd[0].iov_base = cmdp;
-			iov_cmd[0].iov_len = sizeof(cmdp);
-			iov_cmd[1].iov_base = data;
-			iov_cmd[1].iov_len = cmd->plen;
-			nw = writev(fd, iov_cmd, 2);
-			FAILIF(nw != (int) sizeof(cmdp) + cmd->plen,
-				"Could not send entire command \
-				(sent only %d bytes)!\n",
-				nw);
+		iov_cmd[0].iov_base = cmdp;
+		iov_cmd[0].iov_len = 1 + HCI_COMMAND_HDR_SIZE;
+		iov_cmd[1].iov_base = data;
+		iov_cmd[1].iov_len = cmd->plen;
+		nw = writev(fd, iov_cmd, 2);
+		if (nw != 1 + HCI_COMMAND_HDR_SIZE + cmd->plen) {
+			fprintf(stderr, "Could not send entire command "
+					"(sent only %d bytes)!\n", nw);
+			goto done;
 		}
 
 		/* Wait for response */
 		if (read_command_complete(fd, cmd->opcode, cmd->plen) < 0)
-			return -1;
-	} while (1);
-	fprintf(stdout, "Firmware upload successful.\n");
+			goto done;
+	}
 
-	close(fw);
+	fprintf(stdout, "Firmware upload successful, %d commands in %ld ms.\n",
+						count, elapsed_msec(&start));
+	err = 0;
 
-	return 0;
+done:
+	munmap(fw, size);
+
+	return err;
 }
 
 int qualcomm_init(int fd, int speed, struct termios *ti, const char *bdaddr)
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <termios.h>
@@ -36,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
@@ -111,71 +113,77 @@ struct bts_action_serial {
 	uint32_t flow_control;
 }__attribute__ ((packed));
 
-static FILE *bts_load_script(const char* file_name, uint32_t* version)
+/*
+ * BRF script mapped in memory, actions are handed out in place
+ */
+struct bts_script {
+	uint8_t		*data;
+	size_t		size;
+	size_t		offset;
+};
+
+static void bts_unload_script(struct bts_script *script)
+{
+	if (script->data)
+		munmap(script->data, script->size);
+
+	memset(script, 0, sizeof(*script));
+}
+
+static int bts_load_script(struct bts_script *script, const char* file_name,
+							uint32_t* version)
 {
-	struct bts_header header;
-	FILE* fp;
+	struct bts_header *header;
 
-	fp = fopen(file_name, "rb");
-	if (!fp) {
+	script->data = map_firmware(file_name, &script->size);
+	if (!script->data) {
 		perror("can't open firmware file");
-		goto out;
+		return -1;
 	}
 
-	if (1 != fread(&header, sizeof(struct bts_header), 1, fp)) {
-		perror("can't read firmware file");
-		goto errclose;
-	}
+	header = (struct bts_header *) script->data;
 
-	if (header.magic != FILE_HEADER_MAGIC) {
+	if (script->size < sizeof(struct bts_header) ||
+					header->magic != FILE_HEADER_MAGIC) {
 		fprintf(stderr, "%s not a legal TI firmware file\n", file_name);
-		goto errclose;
+		bts_unload_script(script);
+		return -1;
 	}
 
 	if (NULL != version)
-		*version = header.version;
+		*version = header->version;
 
-	goto out;
+	script->offset = sizeof(struct bts_header);
 
-errclose:
-	fclose(fp);
-	fp = NULL;
-out:
-	return fp;
+	return 0;
 }
 
-static unsigned long bts_fetch_action(FILE* fp, unsigned char* action_buf,
-				unsigned long buf_size, uint16_t* action_type)
+static unsigned long bts_fetch_action(struct bts_script *script,
+				uint8_t **action, uint16_t* action_type)
 {
-	struct bts_action action_hdr;
-	unsigned long nread;
+	struct bts_action *action_hdr;
+	size_t remain;
 
-	if (!fp)
+	if (!script->data)
 		return 0;
 
-	if (1 != fread(&action_hdr, sizeof(struct bts_action), 1, fp))
+	remain = script->size - script->offset;
+	if (remain < sizeof(struct bts_action))
 		return 0;
 
-	if (action_hdr.size > buf_size) {
-		fprintf(stderr, "bts_next_action: not enough space to read next action\n");
-		return 0;
-	}
+	action_hdr = (struct bts_action *) (script->data + script->offset);
 
-	nread = fread(action_buf, sizeof(uint8_t), action_hdr.size, fp);
-	if (nread != (action_hdr.size)) {
-		fprintf(stderr, "bts_next_action: fread failed to read next action\n");
+	if (action_hdr->size > remain - sizeof(struct bts_action)) {
+		fprintf(stderr, "bts_next_action: action exceeds the file\n");
 		return 0;
 	}
 
-	*action_type = action_hdr.type;
+	script->offset += sizeof(struct bts_action) + action_hdr->size;
 
-	return nread * sizeof(uint8_t);
-}
+	*action = action_hdr->data;
+	*action_type = action_hdr->type;
 
-static void bts_unload_script(FILE* fp)
-{
-	if (fp)
-		fclose(fp);
+	return action_hdr->size;
 }
 
 static int is_it_texas(const uint8_t *respond)
@@ -267,24 +275,26 @@ static int brf_send_command_socket(int fd, struct bts_action_send* send_action)
 	return 0;
 }
 
-static int brf_send_command_file(int fd, struct bts_action_send* send_action, long size)
+/*
+ * Commands written to the UART whose response has not been read yet, and
+ * the number of commands the controller announced it can still take
+ */
+static int brf_outstanding = 0;
+static int brf_credits = 1;
+
+static int brf_read_response(int fd)
 {
 	unsigned char response[1024] = {0};
 	long ret = 0;
 
-	/* send command */
-	if (size != write(fd, send_action, size)) {
-		perror("Texas: Failed to write action command");
-		return -1;
-	}
-
-	/* read response */
 	ret = read_hci_event(fd, response, sizeof(response));
 	if (ret < 0) {
 		perror("texas: failed to read command response");
 		return -1;
 	}
 
+	brf_outstanding--;
+
 	/* verify success */
 	if (ret < 7 || 0 != response[6]) {
 		fprintf( stderr, "TI init command failed.\n" );
@@ -292,6 +302,41 @@ static int brf_send_command_file(int fd, struct bts_action_send* send_action, lo
 		return -1;
 	}
 
+	if (response[1] == EVT_CMD_COMPLETE)
+		brf_credits = response[3];
+	else
+		brf_credits = 1;
+
+	return 0;
+}
+
+static int brf_flush_responses(int fd)
+{
+	while (brf_outstanding > 0)
+		if (brf_read_response(fd) < 0)
+			return -1;
+
+	return 0;
+}
+
+static int brf_send_command_file(int fd, struct bts_action_send* send_action, long size)
+{
+	/* Only wait when the controller has no room for another command,
+	 * the remaining responses are collected by brf_flush_responses()
+	 * before anything that depends on them */
+	while (brf_credits <= 0 && brf_outstanding > 0)
+		if (brf_read_response(fd) < 0)
+			return -1;
+
+	/* send command */
+	if (size != write(fd, send_action, size)) {
+		perror("Texas: Failed to write action command");
+		return -1;
+	}
+
+	brf_outstanding++;
+	brf_credits--;
+
 	return 0;
 }
 
@@ -324,13 +369,17 @@ static int brf_do_action(uint16_t brf_type, uint8_t *brf_action, long brf_size,
 		break;
 	case ACTION_WAIT_EVENT:
 		DPRINTF("R");
+		ret = brf_flush_responses(fd);
 		break;
 	case ACTION_SERIAL:
 		DPRINTF("S");
-		ret = brf_set_serial_params((struct bts_action_serial *) brf_action, fd, ti);
+		ret = brf_flush_responses(fd);
+		if (ret == 0)
+			ret = brf_set_serial_params((struct bts_action_serial *) brf_action, fd, ti);
 		break;
 	case ACTION_DELAY:
 		DPRINTF("D");
+		ret = brf_flush_responses(fd);
 		brf_delay((struct bts_action_delay *) brf_action);
 		break;
 	case ACTION_REMARKS:
@@ -382,16 +431,19 @@ static int brf_do_script(int fd, struct termios *ti, const char *bts_file)
 {
 	int ret = 0,  hcill_installed = bts_file ? 0 : 1;
 	uint32_t vers;
-	static FILE *brf_script_file = NULL;
-	static uint8_t brf_action[512];
+	struct timeval start;
+	int commands = 0;
+	static struct bts_script brf_script;
+	static uint8_t *brf_action;
 	static long brf_size;
 	static uint16_t brf_type;
 
+	gettimeofday(&start, NULL);
+
 	/* is it the first time we are called ? */
 	if (0 == hcill_installed) {
 		DPRINTF("Sending script to serial device\n");
-		brf_script_file = bts_load_script(bts_file, &vers );
-		if (!brf_script_file) {
+		if (bts_load_script(&brf_script, bts_file, &vers) < 0) {
 			fprintf(stderr, "Warning: cannot find BTS file: %s\n",
 					bts_file);
 			return 0;
@@ -399,10 +451,11 @@ static int brf_do_script(int fd, struct termios *ti, const char *bts_file)
 
 		fprintf( stderr, "Loaded BTS script version %u\n", vers );
 
-		brf_size = bts_fetch_action(brf_script_file, brf_action,
-						sizeof(brf_action), &brf_type);
+		brf_size = bts_fetch_action(&brf_script, &brf_action,
+								&brf_type);
 		if (brf_size == 0) {
 			fprintf(stderr, "Warning: BTS file is empty !");
+			bts_unload_script(&brf_script);
 			return 0;
 		}
 	}
@@ -412,25 +465,38 @@ static int brf_do_script(int fd, struct termios *ti, const char *bts_file)
 
 	/* execute current action and continue to parse brf script file */
 	while (brf_size != 0) {
+		if (brf_type == ACTION_SEND_COMMAND)
+			commands++;
+
 		ret = brf_do_action(brf_type, brf_action, brf_size,
 						fd, ti, hcill_installed);
 		if (ret == -1)
 			break;
 
-		brf_size = bts_fetch_action(brf_script_file, brf_action,
-						sizeof(brf_action), &brf_type);
+		brf_size = bts_fetch_action(&brf_script, &brf_action,
+								&brf_type);
 
 		/* if this is the first time we run (no HCILL yet) */
 		/* and a deep sleep command is encountered */
 		/* we exit */
 		if (!hcill_installed &&
 				brf_action_is_deep_sleep(brf_action,
-							brf_size, brf_type))
-			return 0;
+							brf_size, brf_type)) {
+			ret = brf_flush_responses(fd);
+			fprintf(stderr, "texas: %d commands over UART in "
+					"%ld ms\n", commands,
+					elapsed_msec(&start));
+			return ret;
+		}
 	}
 
-	bts_unload_script(brf_script_file);
-	brf_script_file = NULL;
+	if (ret == 0)
+		ret = brf_flush_responses(fd);
+
+	fprintf(stderr, "texas: %d commands in %ld ms\n", commands,
+							elapsed_msec(&start));
+
+	bts_unload_script(&brf_script);
 	DPRINTF("\n");
 
 	return ret;
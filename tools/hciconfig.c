@@ -47,6 +47,8 @@
 
 static struct hci_dev_info di;
 static int all;
+static int batch;
+static int json;
 
 static void print_dev_hdr(struct hci_dev_info *di);
 static void print_dev_info(int ctl, struct hci_dev_info *di);
@@ -591,6 +593,24 @@ static void cmd_features(int ctl, int hdev, char *opt)
 	hci_close_dev(dd);
 }
 
+static void sanitize_name(char *name)
+{
+	int i;
+
+	for (i = 0; i < 248 && name[i]; i++) {
+		if ((unsigned char) name[i] < 32 || name[i] == 127)
+			name[i] = '.';
+	}
+
+	name[248] = '\0';
+}
+
+static void print_dev_name(char *name)
+{
+	sanitize_name(name);
+	printf("\tName: '%s'\n", name);
+}
+
 static void cmd_name(int ctl, int hdev, char *opt)
 {
 	int dd;
@@ -610,7 +630,6 @@ static void cmd_name(int ctl, int hdev, char *opt)
 		}
 	} else {
 		char name[249];
-		int i;
 
 		if (hci_read_local_name(dd, sizeof(name), name, 1000) < 0) {
 			fprintf(stderr, "Can't read local name on hci%d: %s (%d)\n",
@@ -618,15 +637,8 @@ static void cmd_name(int ctl, int hdev, char *opt)
 			exit(1);
 		}
 
-		for (i = 0; i < 248 && name[i]; i++) {
-			if ((unsigned char) name[i] < 32 || name[i] == 127)
-				name[i] = '.';
-		}
-
-		name[248] = '\0';
-
 		print_dev_hdr(&di);
-		printf("\tName: '%s'\n", name);
+		print_dev_name(name);
 	}
 
 	hci_close_dev(dd);
@@ -830,7 +842,7 @@ static char *get_minor_device_name(int major, int minor)
 	return "Unknown (reserved) minor device class";
 }
 
-static void cmd_class(int ctl, int hdev, char *opt)
+static void print_dev_class(uint8_t *cls)
 {
 	static const char *services[] = { "Positioning",
 					"Networking",
@@ -848,6 +860,31 @@ static void cmd_class(int ctl, int hdev, char *opt)
 					"Peripheral",
 					"Imaging",
 					"Uncategorized" };
+
+	printf("\tClass: 0x%02x%02x%02x\n", cls[2], cls[1], cls[0]);
+	printf("\tService Classes: ");
+	if (cls[2]) {
+		unsigned int i;
+		int first = 1;
+		for (i = 0; i < (sizeof(services) / sizeof(*services)); i++)
+			if (cls[2] & (1 << i)) {
+				if (!first)
+					printf(", ");
+				printf("%s", services[i]);
+				first = 0;
+			}
+	} else
+		printf("Unspecified");
+	printf("\n\tDevice Class: ");
+	if ((cls[1] & 0x1f) >= sizeof(major_devices) / sizeof(*major_devices))
+		printf("Invalid Device Class!\n");
+	else
+		printf("%s, %s\n", major_devices[cls[1] & 0x1f],
+			get_minor_device_name(cls[1] & 0x1f, cls[0] >> 2));
+}
+
+static void cmd_class(int ctl, int hdev, char *opt)
+{
 	int s = hci_open_dev(hdev);
 
 	if (s < 0) {
@@ -870,26 +907,7 @@ static void cmd_class(int ctl, int hdev, char *opt)
 			exit(1);
 		}
 		print_dev_hdr(&di);
-		printf("\tClass: 0x%02x%02x%02x\n", cls[2], cls[1], cls[0]);
-		printf("\tService Classes: ");
-		if (cls[2]) {
-			unsigned int i;
-			int first = 1;
-			for (i = 0; i < (sizeof(services) / sizeof(*services)); i++)
-				if (cls[2] & (1 << i)) {
-					if (!first)
-						printf(", ");
-					printf("%s", services[i]);
-					first = 0;
-				}
-		} else
-			printf("Unspecified");
-		printf("\n\tDevice Class: ");
-		if ((cls[1] & 0x1f) >= sizeof(major_devices) / sizeof(*major_devices))
-			printf("Invalid Device Class!\n");
-		else
-			printf("%s, %s\n", major_devices[cls[1] & 0x1f],
-				get_minor_device_name(cls[1] & 0x1f, cls[0] >> 2));
+		print_dev_class(cls);
 	}
 }
 
@@ -1118,10 +1136,29 @@ static void cmd_commands(int ctl, int hdev, char *opt)
 	hci_close_dev(dd);
 }
 
+static void print_dev_version(struct hci_version *ver)
+{
+	char *hciver, *lmpver;
+
+	hciver = hci_vertostr(ver->hci_ver);
+	lmpver = lmp_vertostr(ver->lmp_ver);
+
+	printf("\tHCI Version: %s (0x%x)  Revision: 0x%x\n"
+		"\tLMP Version: %s (0x%x)  Subversion: 0x%x\n"
+		"\tManufacturer: %s (%d)\n",
+		hciver ? hciver : "n/a", ver->hci_ver, ver->hci_rev,
+		lmpver ? lmpver : "n/a", ver->lmp_ver, ver->lmp_subver,
+		bt_compidtostr(ver->manufacturer), ver->manufacturer);
+
+	if (hciver)
+		bt_free(hciver);
+	if (lmpver)
+		bt_free(lmpver);
+}
+
 static void cmd_version(int ctl, int hdev, char *opt)
 {
 	struct hci_version ver;
-	char *hciver, *lmpver;
 	int dd;
 
 	dd = hci_open_dev(hdev);
@@ -1137,21 +1174,8 @@ static void cmd_version(int ctl, int hdev, char *opt)
 		exit(1);
 	}
 
-	hciver = hci_vertostr(ver.hci_ver);
-	lmpver = lmp_vertostr(ver.lmp_ver);
-
 	print_dev_hdr(&di);
-	printf("\tHCI Version: %s (0x%x)  Revision: 0x%x\n"
-		"\tLMP Version: %s (0x%x)  Subversion: 0x%x\n"
-		"\tManufacturer: %s (%d)\n",
-		hciver ? hciver : "n/a", ver.hci_ver, ver.hci_rev,
-		lmpver ? lmpver : "n/a", ver.lmp_ver, ver.lmp_subver,
-		bt_compidtostr(ver.manufacturer), ver.manufacturer);
-
-	if (hciver)
-		bt_free(hciver);
-	if (lmpver)
-		bt_free(lmpver);
+	print_dev_version(&ver);
 
 	hci_close_dev(dd);
 }
@@ -1833,6 +1857,225 @@ static void cmd_unblock(int ctl, int hdev, char *opt)
 	hci_close_dev(dd);
 }
 
+/*
+ * The reads behind "hciconfig -a" don't depend on each other, so with
+ * --batch (and --json) they are all sent at once on a single socket and
+ * the answers collected together, instead of one blocking request each.
+ */
+struct dev_query {
+	read_local_name_rp	name;
+	read_class_of_dev_rp	cls;
+	read_local_version_rp	ver;
+	read_voice_setting_rp	voice;
+	int			name_err;
+	int			cls_err;
+	int			ver_err;
+	int			voice_err;
+};
+
+static void query_req_cb(struct hci_request *rq, int err, void *user_data)
+{
+	*((int *) user_data) = err;
+}
+
+static void query_submit(struct hci_req_queue *q, struct hci_request *rq,
+				uint16_t ogf, uint16_t ocf, void *rp, int rlen,
+								int *err)
+{
+	memset(rq, 0, sizeof(*rq));
+	rq->ogf    = ogf;
+	rq->ocf    = ocf;
+	rq->event  = EVT_CMD_COMPLETE;
+	rq->rparam = rp;
+	rq->rlen   = rlen;
+
+	*err = ETIMEDOUT;
+	if (hci_req_submit(q, rq, query_req_cb, err) < 0)
+		*err = errno;
+}
+
+static int query_dev(int hdev, struct dev_query *dq)
+{
+	struct hci_req_queue *q;
+	struct hci_request name_rq, cls_rq, ver_rq, voice_rq;
+	int dd;
+
+	memset(dq, 0, sizeof(*dq));
+
+	dd = hci_open_dev(hdev);
+	if (dd < 0) {
+		fprintf(stderr, "Can't open device hci%d: %s (%d)\n",
+						hdev, strerror(errno), errno);
+		return -1;
+	}
+
+	q = hci_req_queue_new(dd);
+	if (!q) {
+		fprintf(stderr, "Can't set up requests on hci%d: %s (%d)\n",
+						hdev, strerror(errno), errno);
+		hci_close_dev(dd);
+		return -1;
+	}
+
+	query_submit(q, &name_rq, OGF_HOST_CTL, OCF_READ_LOCAL_NAME,
+			&dq->name, READ_LOCAL_NAME_RP_SIZE, &dq->name_err);
+	query_submit(q, &cls_rq, OGF_HOST_CTL, OCF_READ_CLASS_OF_DEV,
+			&dq->cls, READ_CLASS_OF_DEV_RP_SIZE, &dq->cls_err);
+	query_submit(q, &ver_rq, OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION,
+			&dq->ver, READ_LOCAL_VERSION_RP_SIZE, &dq->ver_err);
+	query_submit(q, &voice_rq, OGF_HOST_CTL, OCF_READ_VOICE_SETTING,
+			&dq->voice, READ_VOICE_SETTING_RP_SIZE, &dq->voice_err);
+
+	hci_req_wait(q, 1000);
+	hci_req_queue_free(q);
+
+	hci_close_dev(dd);
+
+	if (!dq->name_err && dq->name.status)
+		dq->name_err = EIO;
+	if (!dq->cls_err && dq->cls.status)
+		dq->cls_err = EIO;
+	if (!dq->ver_err && dq->ver.status)
+		dq->ver_err = EIO;
+	if (!dq->voice_err && dq->voice.status)
+		dq->voice_err = EIO;
+
+	if (!dq->name_err)
+		sanitize_name((char *) dq->name.name);
+
+	return 0;
+}
+
+static void query_version(struct dev_query *dq, struct hci_version *ver)
+{
+	ver->manufacturer = btohs(dq->ver.manufacturer);
+	ver->hci_ver      = dq->ver.hci_ver;
+	ver->hci_rev      = btohs(dq->ver.hci_rev);
+	ver->lmp_ver      = dq->ver.lmp_ver;
+	ver->lmp_subver   = btohs(dq->ver.lmp_subver);
+}
+
+static void print_dev_query(struct hci_dev_info *di)
+{
+	struct dev_query dq;
+	struct hci_version ver;
+
+	if (query_dev(di->dev_id, &dq) < 0)
+		return;
+
+	if (dq.name_err)
+		fprintf(stderr, "Can't read local name on hci%d: %s (%d)\n",
+				di->dev_id, strerror(dq.name_err), dq.name_err);
+	else
+		print_dev_name((char *) dq.name.name);
+
+	if (dq.cls_err)
+		fprintf(stderr, "Can't read class of device on hci%d: %s (%d)\n",
+				di->dev_id, strerror(dq.cls_err), dq.cls_err);
+	else
+		print_dev_class(dq.cls.dev_class);
+
+	if (dq.ver_err)
+		fprintf(stderr, "Can't read version info hci%d: %s (%d)\n",
+				di->dev_id, strerror(dq.ver_err), dq.ver_err);
+	else {
+		query_version(&dq, &ver);
+		print_dev_version(&ver);
+	}
+}
+
+static void json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void print_dev_json(struct hci_dev_info *di)
+{
+	struct hci_dev_stats *st = &di->stat;
+	char addr[18], *str;
+	int len;
+
+	ba2str(&di->bdaddr, addr);
+
+	printf("{\"dev\":\"%s\",\"type\":\"%s\",\"bus\":\"%s\","
+			"\"bdaddr\":\"%s\"", di->name,
+					hci_typetostr(di->type >> 4),
+					hci_bustostr(di->type & 0x0f), addr);
+
+	str = hci_dflagstostr(di->flags);
+	if (str) {
+		len = strlen(str);
+		while (len > 0 && str[len - 1] == ' ')
+			str[--len] = '\0';
+		printf(",\"flags\":\"%s\"", str);
+		bt_free(str);
+	}
+
+	printf(",\"acl_mtu\":%d,\"acl_pkts\":%d,\"sco_mtu\":%d,\"sco_pkts\":%d",
+				di->acl_mtu, di->acl_pkts,
+				di->sco_mtu, di->sco_pkts);
+
+	printf(",\"rx\":{\"bytes\":%u,\"acl\":%u,\"sco\":%u,\"events\":%u,"
+			"\"errors\":%u}", st->byte_rx, st->acl_rx,
+				st->sco_rx, st->evt_rx, st->err_rx);
+
+	printf(",\"tx\":{\"bytes\":%u,\"acl\":%u,\"sco\":%u,\"commands\":%u,"
+			"\"errors\":%u}", st->byte_tx, st->acl_tx,
+				st->sco_tx, st->cmd_tx, st->err_tx);
+
+	if (all && !hci_test_bit(HCI_RAW, &di->flags) &&
+			bacmp(&di->bdaddr, BDADDR_ANY)) {
+		struct dev_query dq;
+		struct hci_version ver;
+
+		printf(",\"features\":\"%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x%2.2x\"",
+			di->features[0], di->features[1], di->features[2],
+			di->features[3], di->features[4], di->features[5],
+			di->features[6], di->features[7]);
+
+		if (hci_test_bit(HCI_UP, &di->flags) &&
+					query_dev(di->dev_id, &dq) == 0) {
+			if (!dq.name_err) {
+				printf(",\"name\":");
+				json_string((char *) dq.name.name);
+			}
+
+			if (!dq.cls_err)
+				printf(",\"class\":\"0x%02x%02x%02x\"",
+						dq.cls.dev_class[2],
+						dq.cls.dev_class[1],
+						dq.cls.dev_class[0]);
+
+			if (!dq.ver_err) {
+				query_version(&dq, &ver);
+				printf(",\"hci_ver\":%d,\"hci_rev\":%d,"
+					"\"lmp_ver\":%d,\"lmp_subver\":%d,"
+					"\"manufacturer\":%d",
+					ver.hci_ver, ver.hci_rev,
+					ver.lmp_ver, ver.lmp_subver,
+					ver.manufacturer);
+			}
+
+			if (!dq.voice_err)
+				printf(",\"voice\":\"0x%04x\"",
+					btohs(dq.voice.voice_setting));
+		}
+	}
+
+	printf("}\n");
+}
+
 static void print_dev_hdr(struct hci_dev_info *di)
 {
 	static int hdr = -1;
@@ -1857,6 +2100,11 @@ static void print_dev_info(int ctl, struct hci_dev_info *di)
 	struct hci_dev_stats *st = &di->stat;
 	char *str;
 
+	if (json) {
+		print_dev_json(di);
+		return;
+	}
+
 	print_dev_hdr(di);
 
 	str = hci_dflagstostr(di->flags);
@@ -1877,9 +2125,13 @@ static void print_dev_info(int ctl, struct hci_dev_info *di)
 		print_link_mode(di);
 
 		if (hci_test_bit(HCI_UP, &di->flags)) {
-			cmd_name(ctl, di->dev_id, NULL);
-			cmd_class(ctl, di->dev_id, NULL);
-			cmd_version(ctl, di->dev_id, NULL);
+			if (batch)
+				print_dev_query(di);
+			else {
+				cmd_name(ctl, di->dev_id, NULL);
+				cmd_class(ctl, di->dev_id, NULL);
+				cmd_version(ctl, di->dev_id, NULL);
+			}
 		}
 	}
 
@@ -1945,7 +2197,7 @@ static void usage(void)
 	printf("hciconfig - HCI device configuration utility\n");
 	printf("Usage:\n"
 		"\thciconfig\n"
-		"\thciconfig [-a] hciX [command ...]\n");
+		"\thciconfig [-a] [-b] [-j] hciX [command ...]\n");
 	printf("Commands:\n");
 	for (i = 0; command[i].cmd; i++)
 		printf("\t%-10s %-8s\t%s\n", command[i].cmd,
@@ -1956,6 +2208,8 @@ static void usage(void)
 static struct option main_options[] = {
 	{ "help",	0, 0, 'h' },
 	{ "all",	0, 0, 'a' },
+	{ "batch",	0, 0, 'b' },
+	{ "json",	0, 0, 'j' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -1963,12 +2217,20 @@ int main(int argc, char *argv[])
 {
 	int opt, ctl, i, cmd = 0;
 
-	while ((opt = getopt_long(argc, argv, "ah", main_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "abjh", main_options, NULL)) != -1) {
 		switch (opt) {
 		case 'a':
 			all = 1;
 			break;
 
+		case 'b':
+			batch = 1;
+			break;
+
+		case 'j':
+			json = 1;
+			break;
+
 		case 'h':
 		default:
 			usage();
@@ -35,7 +35,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <signal.h>
+#include <sys/poll.h>
 #include <sys/param.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 
@@ -857,13 +860,26 @@ static const char *info_help =
 	"Usage:\n"
 	"\tinfo <bdaddr>\n";
 
+static void info_req_cb(struct hci_request *rq, int err, void *user_data)
+{
+	*((int *) user_data) = err;
+}
+
 static void cmd_info(int dev_id, int argc, char **argv)
 {
 	bdaddr_t bdaddr;
 	uint16_t handle;
 	uint8_t features[8], max_page = 0;
-	char name[249], oui[9], *comp, *tmp;
-	struct hci_version version;
+	char oui[9], *comp, *tmp;
+	struct hci_req_queue *q;
+	struct hci_request name_rq, ver_rq, feat_rq;
+	remote_name_req_cp name_cp;
+	evt_remote_name_req_complete name_rp;
+	read_remote_version_cp ver_cp;
+	evt_read_remote_version_complete ver_rp;
+	read_remote_features_cp feat_cp;
+	evt_read_remote_features_complete feat_rp;
+	int name_err, ver_err, feat_err;
 	struct hci_dev_info di;
 	struct hci_conn_info_req *cr;
 	int i, opt, dd, cc = 0;
@@ -934,24 +950,86 @@ static void cmd_info(int dev_id, int argc, char **argv)
 		free(comp);
 	}
 
-	if (hci_read_remote_name(dd, &bdaddr, sizeof(name), name, 25000) == 0)
-		printf("\tDevice Name: %s\n", name);
+	/* Name, version and features don't depend on each other, so ask
+	 * for all of them at once */
+	q = hci_req_queue_new(dd);
+	if (!q) {
+		perror("Can't set up requests");
+		close(dd);
+		exit(1);
+	}
 
-	if (hci_read_remote_version(dd, handle, &version, 20000) == 0) {
-		char *ver = lmp_vertostr(version.lmp_ver);
+	memset(&name_cp, 0, sizeof(name_cp));
+	bacpy(&name_cp.bdaddr, &bdaddr);
+	name_cp.pscan_rep_mode = 0x02;
+
+	memset(&name_rq, 0, sizeof(name_rq));
+	name_rq.ogf    = OGF_LINK_CTL;
+	name_rq.ocf    = OCF_REMOTE_NAME_REQ;
+	name_rq.event  = EVT_REMOTE_NAME_REQ_COMPLETE;
+	name_rq.cparam = &name_cp;
+	name_rq.clen   = REMOTE_NAME_REQ_CP_SIZE;
+	name_rq.rparam = &name_rp;
+	name_rq.rlen   = EVT_REMOTE_NAME_REQ_COMPLETE_SIZE;
+	name_err = ETIMEDOUT;
+	if (hci_req_submit(q, &name_rq, info_req_cb, &name_err) < 0)
+		name_err = errno;
+
+	memset(&ver_cp, 0, sizeof(ver_cp));
+	ver_cp.handle = handle;
+
+	memset(&ver_rq, 0, sizeof(ver_rq));
+	ver_rq.ogf    = OGF_LINK_CTL;
+	ver_rq.ocf    = OCF_READ_REMOTE_VERSION;
+	ver_rq.event  = EVT_READ_REMOTE_VERSION_COMPLETE;
+	ver_rq.cparam = &ver_cp;
+	ver_rq.clen   = READ_REMOTE_VERSION_CP_SIZE;
+	ver_rq.rparam = &ver_rp;
+	ver_rq.rlen   = EVT_READ_REMOTE_VERSION_COMPLETE_SIZE;
+	ver_err = ETIMEDOUT;
+	if (hci_req_submit(q, &ver_rq, info_req_cb, &ver_err) < 0)
+		ver_err = errno;
+
+	memset(&feat_cp, 0, sizeof(feat_cp));
+	feat_cp.handle = handle;
+
+	memset(&feat_rq, 0, sizeof(feat_rq));
+	feat_rq.ogf    = OGF_LINK_CTL;
+	feat_rq.ocf    = OCF_READ_REMOTE_FEATURES;
+	feat_rq.event  = EVT_READ_REMOTE_FEATURES_COMPLETE;
+	feat_rq.cparam = &feat_cp;
+	feat_rq.clen   = READ_REMOTE_FEATURES_CP_SIZE;
+	feat_rq.rparam = &feat_rp;
+	feat_rq.rlen   = EVT_READ_REMOTE_FEATURES_COMPLETE_SIZE;
+	feat_err = ETIMEDOUT;
+	if (hci_req_submit(q, &feat_rq, info_req_cb, &feat_err) < 0)
+		feat_err = errno;
+
+	hci_req_wait(q, 25000);
+	hci_req_queue_free(q);
+
+	if (!name_err && !name_rp.status) {
+		name_rp.name[247] = '\0';
+		printf("\tDevice Name: %s\n", name_rp.name);
+	}
+
+	if (!ver_err && !ver_rp.status) {
+		uint16_t manufacturer = btohs(ver_rp.manufacturer);
+		char *ver = lmp_vertostr(ver_rp.lmp_ver);
 		printf("\tLMP Version: %s (0x%x) LMP Subversion: 0x%x\n"
 			"\tManufacturer: %s (%d)\n",
 			ver ? ver : "n/a",
-			version.lmp_ver,
-			version.lmp_subver,
-			bt_compidtostr(version.manufacturer),
-			version.manufacturer);
+			ver_rp.lmp_ver,
+			btohs(ver_rp.lmp_subver),
+			bt_compidtostr(manufacturer),
+			manufacturer);
 		if (ver)
 			bt_free(ver);
 	}
 
 	memset(features, 0, sizeof(features));
-	hci_read_remote_features(dd, handle, features, 20000);
+	if (!feat_err && !feat_rp.status)
+		memcpy(features, feat_rp.features, 8);
 
 	if ((di.features[7] & LMP_EXT_FEAT) && (features[7] & LMP_EXT_FEAT))
 		hci_read_remote_ext_features(dd, handle, 0, &max_page,
@@ -2406,11 +2484,302 @@ done:
 	return 0;
 }
 
+/* Survey mode keeps one entry per address in an open addressing table
+ * instead of printing every report */
+struct survey_entry {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint8_t used;
+	int8_t rssi_min;
+	int8_t rssi_max;
+	int32_t rssi_sum;
+	uint32_t rssi_count;
+	uint32_t count;
+};
+
+struct survey {
+	struct survey_entry *table;
+	unsigned int size;
+	unsigned int used;
+	uint32_t reports;
+	uint32_t period_reports;
+	uint32_t period_new;
+};
+
+static volatile sig_atomic_t survey_stop = 0;
+
+static void survey_sigint(int sig)
+{
+	survey_stop = 1;
+}
+
+static struct survey_entry *survey_lookup(struct survey *s,
+					const bdaddr_t *ba, uint8_t type)
+{
+	unsigned int i, hash = type;
+
+	for (i = 0; i < 6; i++)
+		hash = hash * 31 + ba->b[i];
+
+	for (i = hash & (s->size - 1); s->table[i].used;
+					i = (i + 1) & (s->size - 1)) {
+		struct survey_entry *e = &s->table[i];
+
+		if (e->bdaddr_type == type && !bacmp(&e->bdaddr, ba))
+			break;
+	}
+
+	return &s->table[i];
+}
+
+static int survey_grow(struct survey *s)
+{
+	struct survey_entry *old = s->table;
+	unsigned int i, old_size = s->size;
+
+	s->size = old_size ? old_size * 2 : 256;
+	s->table = calloc(s->size, sizeof(*s->table));
+	if (!s->table) {
+		s->table = old;
+		s->size = old_size;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < old_size; i++)
+		if (old[i].used)
+			*survey_lookup(s, &old[i].bdaddr,
+						old[i].bdaddr_type) = old[i];
+
+	free(old);
+
+	return 0;
+}
+
+static void survey_add(struct survey *s, le_advertising_info *info,
+								int8_t rssi)
+{
+	struct survey_entry *e;
+
+	/* Keep the table at most half full so probing stays short */
+	if (s->used * 2 >= s->size && survey_grow(s) < 0)
+		return;
+
+	e = survey_lookup(s, &info->bdaddr, info->bdaddr_type);
+	if (!e->used) {
+		e->used = 1;
+		bacpy(&e->bdaddr, &info->bdaddr);
+		e->bdaddr_type = info->bdaddr_type;
+		e->rssi_min = 127;
+		e->rssi_max = -127;
+		s->used++;
+		s->period_new++;
+	}
+
+	e->count++;
+	s->reports++;
+	s->period_reports++;
+
+	/* 127 means the controller did not measure it */
+	if (rssi == 127)
+		return;
+
+	if (rssi < e->rssi_min)
+		e->rssi_min = rssi;
+	if (rssi > e->rssi_max)
+		e->rssi_max = rssi;
+
+	e->rssi_sum += rssi;
+	e->rssi_count++;
+}
+
+static void survey_event(struct survey *s, uint8_t filter_type,
+					unsigned char *buf, int len)
+{
+	evt_le_meta_event *meta = (void *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+	uint8_t num, *ptr;
+
+	len -= 1 + HCI_EVENT_HDR_SIZE;
+	if (len < 2 || meta->subevent != EVT_LE_ADVERTISING_REPORT)
+		return;
+
+	num = meta->data[0];
+	ptr = meta->data + 1;
+	len -= 2;
+
+	/* Unlike the plain mode every report of the event is counted */
+	while (num-- && len >= LE_ADVERTISING_INFO_SIZE) {
+		le_advertising_info *info = (void *) ptr;
+		int size = LE_ADVERTISING_INFO_SIZE + info->length + 1;
+
+		if (len < size)
+			break;
+
+		if (check_report_filter(filter_type, info))
+			survey_add(s, info, (int8_t) ptr[size - 1]);
+
+		ptr += size;
+		len -= size;
+	}
+}
+
+static int cmp_survey_entry(const void *a, const void *b)
+{
+	const struct survey_entry *x = a, *y = b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static void survey_print(struct survey *s, double seconds)
+{
+	struct survey_entry *list;
+	unsigned int i, n;
+	char addr[18];
+
+	printf("\n%u reports from %u addresses in %.1f s\n", s->reports,
+							s->used, seconds);
+
+	list = malloc((s->used + 1) * sizeof(*list));
+	if (!list)
+		return;
+
+	for (i = 0, n = 0; i < s->size; i++)
+		if (s->table[i].used)
+			list[n++] = s->table[i];
+
+	qsort(list, n, sizeof(*list), cmp_survey_entry);
+
+	printf("%-17s %-6s %8s %8s %14s\n", "Address", "Type", "Reports",
+					"Rate/s", "RSSI min/avg/max");
+
+	for (i = 0; i < n; i++) {
+		struct survey_entry *e = &list[i];
+
+		ba2str(&e->bdaddr, addr);
+		printf("%-17s %-6s %8u %8.1f ", addr,
+				e->bdaddr_type ? "random" : "public",
+				e->count, seconds > 0 ? e->count / seconds : 0);
+
+		if (e->rssi_count)
+			printf("%4d/%4d/%4d\n", e->rssi_min,
+				e->rssi_sum / (int32_t) e->rssi_count,
+				e->rssi_max);
+		else
+			printf("%14s\n", "-");
+	}
+
+	free(list);
+}
+
+static double tv_elapsed(struct timeval *from, struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+				(to->tv_usec - from->tv_usec) / 1000000.0;
+}
+
+/* Reads every queued event before looking at the clock again and only
+ * prints a summary line per period, so a busy site does not end up
+ * being limited by the terminal. A large socket buffer absorbs bursts
+ * while the summary is printed. */
+static int survey_advertising_devices(int dd, uint8_t filter_type,
+				unsigned int period, unsigned int duration)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct hci_filter nf, of;
+	struct sigaction sa, osa;
+	struct timeval start, last, now;
+	struct survey s;
+	socklen_t olen;
+	int len, rcvbuf = 1024 * 1024, err = 0;
+
+	olen = sizeof(of);
+	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
+		printf("Could not get socket options\n");
+		return -1;
+	}
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+		printf("Could not set socket options\n");
+		return -1;
+	}
+
+	setsockopt(dd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&s, 0, sizeof(s));
+	if (survey_grow(&s) < 0) {
+		err = -1;
+		goto done;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = survey_sigint;
+	sigaction(SIGINT, &sa, &osa);
+
+	gettimeofday(&start, NULL);
+	last = start;
+
+	while (!survey_stop) {
+		struct pollfd p;
+		double elapsed;
+
+		p.fd = dd;
+		p.events = POLLIN;
+
+		if (poll(&p, 1, 100) < 0 && errno != EINTR) {
+			err = -1;
+			break;
+		}
+
+		while ((len = recv(dd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+			survey_event(&s, filter_type, buf, len);
+
+		if (len < 0 && errno != EAGAIN && errno != EINTR) {
+			err = -1;
+			break;
+		}
+
+		gettimeofday(&now, NULL);
+
+		elapsed = tv_elapsed(&last, &now);
+		if (elapsed >= period) {
+			printf("%6.1f s: %7.1f reports/s, %u addresses "
+				"(%u new)\n", tv_elapsed(&start, &now),
+				s.period_reports / elapsed, s.used,
+				s.period_new);
+			fflush(stdout);
+
+			s.period_reports = 0;
+			s.period_new = 0;
+			last = now;
+		}
+
+		if (duration && tv_elapsed(&start, &now) >= duration)
+			break;
+	}
+
+	sigaction(SIGINT, &osa, NULL);
+
+	gettimeofday(&now, NULL);
+	survey_print(&s, tv_elapsed(&start, &now));
+
+	free(s.table);
+
+done:
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+
+	return err;
+}
+
 static struct option lescan_options[] = {
 	{ "help",	0, 0, 'h' },
 	{ "privacy",	0, 0, 'p' },
 	{ "passive",	0, 0, 'P' },
 	{ "discovery",	1, 0, 'd' },
+	{ "survey",	2, 0, 's' },
+	{ "duration",	1, 0, 't' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -2419,7 +2788,10 @@ static const char *lescan_help =
 	"\tlescan [--privacy] enable privacy\n"
 	"\tlescan [--passive] set scan type passive (default active)\n"
 	"\tlescan [--discovery=g|l] enable general or limited discovery"
-		"procedure\n";
+		"procedure\n"
+	"\tlescan [--survey[=seconds]] count reports per address and print\n"
+	"\t       a summary every period (default 1) instead of each report\n"
+	"\tlescan [--duration=seconds] stop the survey after the given time\n";
 
 static void cmd_lescan(int dev_id, int argc, char **argv)
 {
@@ -2429,6 +2801,7 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
 	uint8_t filter_type = 0;
 	uint16_t interval = htobs(0x0010);
 	uint16_t window = htobs(0x0010);
+	unsigned int survey = 0, duration = 0;
 
 	for_each_opt(opt, lescan_options, NULL) {
 		switch (opt) {
@@ -2448,6 +2821,14 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
 			interval = htobs(0x0012);
 			window = htobs(0x0012);
 			break;
+		case 's':
+			survey = optarg ? atoi(optarg) : 1;
+			if (survey == 0)
+				survey = 1;
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
 		default:
 			printf("%s", lescan_help);
 			return;
@@ -2479,7 +2860,11 @@ static void cmd_lescan(int dev_id, int argc, char **argv)
 
 	printf("LE Scan ...\n");
 
-	err = print_advertising_devices(dd, filter_type);
+	if (survey)
+		err = survey_advertising_devices(dd, filter_type, survey,
+								duration);
+	else
+		err = print_advertising_devices(dd, filter_type);
 	if (err < 0) {
 		perror("Could not receive advertising events");
 		exit(1);
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <signal.h>
 #include <sys/time.h>
@@ -47,25 +48,106 @@
 static bdaddr_t bdaddr;
 static int size    = 44;
 static int ident   = 200;
-static int delay   = 1;
+static long delay  = 1000000;	/* usec */
 static int count   = -1;
 static int timeout = 10;
 static int reverse = 0;
 static int verify = 0;
+static int quiet = 0;
 
 /* Stats */
 static int sent_pkt = 0;
 static int recv_pkt = 0;
 
+/* Round trip times go into a log-linear histogram, every power of two
+ * is split into 16 buckets so percentiles are within 1/16 of the real
+ * value whatever the rate and the run length */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(32 * HIST_SUB)
+
+static unsigned int hist[HIST_BUCKETS];
+static uint32_t rtt_min = UINT32_MAX;
+static uint32_t rtt_max = 0;
+static uint64_t rtt_sum = 0;
+static uint64_t jitter_sum = 0;
+static uint32_t rtt_last = 0;
+
 static float tv2fl(struct timeval tv)
 {
 	return (float)(tv.tv_sec*1000.0) + (float)(tv.tv_usec/1000.0);
 }
 
+static int hist_index(uint32_t usec)
+{
+	int msb;
+
+	if (usec < HIST_SUB)
+		return usec;
+
+	msb = 31 - __builtin_clz(usec);
+
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+			((usec >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint32_t hist_value(int index)
+{
+	if (index < HIST_SUB)
+		return index;
+
+	return (HIST_SUB + index % HIST_SUB) << (index / HIST_SUB - 1);
+}
+
+static void rtt_add(struct timeval *tv)
+{
+	uint32_t usec = tv->tv_sec * 1000000 + tv->tv_usec;
+
+	hist[hist_index(usec)]++;
+
+	if (usec < rtt_min)
+		rtt_min = usec;
+	if (usec > rtt_max)
+		rtt_max = usec;
+
+	/* Jitter is the mean difference between consecutive replies */
+	if (recv_pkt > 1)
+		jitter_sum += usec > rtt_last ? usec - rtt_last :
+							rtt_last - usec;
+
+	rtt_sum += usec;
+	rtt_last = usec;
+}
+
+static float rtt_percentile(float pct)
+{
+	unsigned int target = recv_pkt * pct / 100, total = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		total += hist[i];
+		if (total > target)
+			return hist_value(i) / 1000.0;
+	}
+
+	return rtt_max / 1000.0;
+}
+
 static void stat(int sig)
 {
 	int loss = sent_pkt ? (float)((sent_pkt-recv_pkt)/(sent_pkt/100.0)) : 0;
 	printf("%d sent, %d received, %d%% loss\n", sent_pkt, recv_pkt, loss);
+
+	if (recv_pkt > 0) {
+		printf("rtt min/avg/max/jitter = %.2f/%.2f/%.2f/%.2f ms\n",
+			rtt_min / 1000.0, rtt_sum / 1000.0 / recv_pkt,
+			rtt_max / 1000.0, recv_pkt > 1 ?
+			jitter_sum / 1000.0 / (recv_pkt - 1) : 0.0);
+		printf("rtt p50/p90/p99/p99.9 = %.2f/%.2f/%.2f/%.2f ms\n",
+			rtt_percentile(50), rtt_percentile(90),
+			rtt_percentile(99), rtt_percentile(99.9));
+	}
+
 	exit(0);
 }
 
@@ -210,6 +292,7 @@ static void ping(char *svr)
 
 			gettimeofday(&tv_recv, NULL);
 			timersub(&tv_recv, &tv_send, &tv_diff);
+			rtt_add(&tv_diff);
 
 			if (verify) {
 				/* Check payload length */
@@ -227,11 +310,13 @@ static void ping(char *svr)
 				}
 			}
 
-			printf("%d bytes from %s id %d time %.2fms\n", recv_cmd->len, svr,
-				   id - ident, tv2fl(tv_diff));
+			if (!quiet)
+				printf("%d bytes from %s id %d time %.2fms\n",
+					recv_cmd->len, svr, id - ident,
+					tv2fl(tv_diff));
 
 			if (delay)
-				sleep(delay);
+				usleep(delay);
 		} else {
 			printf("no response from %s: id %d\n", svr, id - ident);
 		}
@@ -255,10 +340,12 @@ static void usage(void)
 {
 	printf("l2ping - L2CAP ping\n");
 	printf("Usage:\n");
-	printf("\tl2ping [-i device] [-s size] [-c count] [-t timeout] [-d delay] [-f] [-r] [-v] <bdaddr>\n");
+	printf("\tl2ping [-i device] [-s size] [-c count] [-t timeout] [-d delay] [-f] [-r] [-v] [-q] <bdaddr>\n");
+	printf("\t-d  Delay between pings in seconds, fractions allowed\n");
 	printf("\t-f  Flood ping (delay = 0)\n");
 	printf("\t-r  Reverse ping\n");
 	printf("\t-v  Verify request and response payload\n");
+	printf("\t-q  Only print the summary and the percentiles\n");
 }
 
 int main(int argc, char *argv[])
@@ -268,7 +355,7 @@ int main(int argc, char *argv[])
 	/* Default options */
 	bacpy(&bdaddr, BDADDR_ANY);
 
-	while ((opt=getopt(argc,argv,"i:d:s:c:t:frv")) != EOF) {
+	while ((opt=getopt(argc,argv,"i:d:s:c:t:frvq")) != EOF) {
 		switch(opt) {
 		case 'i':
 			if (!strncasecmp(optarg, "hci", 3))
@@ -278,7 +365,7 @@ int main(int argc, char *argv[])
 			break;
 
 		case 'd':
-			delay = atoi(optarg);
+			delay = atof(optarg) * 1000000;
 			break;
 
 		case 'f':
@@ -295,6 +382,10 @@ int main(int argc, char *argv[])
 			verify = 1;
 			break;
 
+		case 'q':
+			quiet = 1;
+			break;
+
 		case 'c':
 			count = atoi(optarg);
 			break;
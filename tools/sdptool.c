@@ -35,6 +35,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
+#include <sys/poll.h>
 #include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
@@ -3913,6 +3915,357 @@ static int do_search(bdaddr_t *bdaddr, struct search_context *context)
 	return 0;
 }
 
+/*
+ * Browse several devices at once.  Each target gets its own non-blocking
+ * SDP session and up to BROWSE_PARALLEL of them are kept in flight, so the
+ * page and the SDP exchange of one device overlap with the others.  The
+ * results are printed as one JSON object per device, and devices that
+ * return a byte-identical response (e.g. many units of the same product)
+ * are only decoded once.
+ */
+#define BROWSE_PARALLEL	4
+#define BROWSE_TIMEOUT	30
+
+enum {
+	TARGET_IDLE,
+	TARGET_CONNECTING,
+	TARGET_SEARCHING,
+	TARGET_DONE,
+};
+
+struct browse_target {
+	bdaddr_t	bdaddr;
+	sdp_session_t	*session;
+	int		state;
+	time_t		started;
+};
+
+struct browse_cache {
+	uint64_t	hash;
+	char		addr[18];
+	struct browse_cache *next;
+};
+
+static struct browse_cache *browse_cache = NULL;
+
+static void json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void json_record(sdp_record_t *rec)
+{
+	sdp_list_t *list = 0, *proto = 0;
+	char str[MAX_LEN_SERVICECLASS_UUID_STR];
+	int port;
+
+	printf("{\"handle\":%u", rec->handle);
+
+	if (sdp_get_service_name(rec, str, sizeof(str)) == 0) {
+		printf(",\"name\":");
+		json_string(str);
+	}
+
+	if (sdp_get_service_classes(rec, &list) == 0) {
+		sdp_list_t *l;
+
+		printf(",\"classes\":[");
+		for (l = list; l; l = l->next) {
+			sdp_uuid2strn(l->data, str, sizeof(str));
+			json_string(str);
+			if (l->next)
+				putchar(',');
+		}
+		putchar(']');
+		sdp_list_free(list, free);
+	}
+
+	if (sdp_get_access_protos(rec, &proto) == 0) {
+		port = sdp_get_proto_port(proto, L2CAP_UUID);
+		if (port > 0)
+			printf(",\"psm\":%d", port);
+		port = sdp_get_proto_port(proto, RFCOMM_UUID);
+		if (port > 0)
+			printf(",\"channel\":%d", port);
+		sdp_list_foreach(proto, (sdp_list_func_t)sdp_list_free, 0);
+		sdp_list_free(proto, 0);
+	}
+
+	putchar('}');
+}
+
+static void browse_search_cb(uint8_t type, uint16_t status,
+				uint8_t *rsp, size_t size, void *udata)
+{
+	struct browse_target *t = udata;
+	struct browse_cache *c;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int scanned, seqlen = 0, bytesleft = size, first = 1;
+	uint8_t dtd;
+	char addr[18];
+	size_t i;
+
+	t->state = TARGET_DONE;
+	ba2str(&t->bdaddr, addr);
+
+	if (status || type != SDP_SVC_SEARCH_ATTR_RSP) {
+		printf("{\"bdaddr\":\"%s\",\"error\":\"%s\"}\n", addr,
+				status ? "Search failed" : "Invalid response");
+		return;
+	}
+
+	/* FNV-1a over the raw attribute lists */
+	for (i = 0; i < size; i++) {
+		hash ^= rsp[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	for (c = browse_cache; c; c = c->next) {
+		if (c->hash == hash) {
+			printf("{\"bdaddr\":\"%s\",\"same_as\":\"%s\"}\n",
+								addr, c->addr);
+			return;
+		}
+	}
+
+	c = malloc(sizeof(*c));
+	if (c) {
+		c->hash = hash;
+		strcpy(c->addr, addr);
+		c->next = browse_cache;
+		browse_cache = c;
+	}
+
+	printf("{\"bdaddr\":\"%s\",\"records\":[", addr);
+
+	scanned = sdp_extract_seqtype(rsp, bytesleft, &dtd, &seqlen);
+	if (scanned && seqlen) {
+		rsp += scanned;
+		bytesleft -= scanned;
+
+		while (bytesleft > 0) {
+			sdp_record_t *rec;
+			int recsize = 0;
+
+			rec = sdp_extract_pdu(rsp, bytesleft, &recsize);
+			if (!rec)
+				break;
+
+			if (!recsize) {
+				sdp_record_free(rec);
+				break;
+			}
+
+			if (!first)
+				putchar(',');
+			first = 0;
+
+			json_record(rec);
+			sdp_record_free(rec);
+
+			rsp += recsize;
+			bytesleft -= recsize;
+		}
+	}
+
+	printf("]}\n");
+}
+
+static void browse_target_fail(struct browse_target *t, const char *err)
+{
+	char addr[18];
+
+	ba2str(&t->bdaddr, addr);
+	printf("{\"bdaddr\":\"%s\",\"error\":", addr);
+	json_string(err);
+	printf("}\n");
+
+	t->state = TARGET_DONE;
+}
+
+static int browse_target_start(struct browse_target *t)
+{
+	t->session = sdp_connect(&interface, &t->bdaddr, SDP_NON_BLOCKING);
+	if (!t->session) {
+		browse_target_fail(t, strerror(errno));
+		return -1;
+	}
+
+	t->state = TARGET_CONNECTING;
+	t->started = time(NULL);
+
+	return 0;
+}
+
+static int browse_target_search(struct browse_target *t,
+					struct search_context *context)
+{
+	sdp_list_t *attrid, *search;
+	uint32_t range = 0x0000ffff;
+	socklen_t len;
+	int err, sk = sdp_get_socket(t->session);
+
+	len = sizeof(err);
+	if (getsockopt(sk, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if (err) {
+		browse_target_fail(t, strerror(err));
+		return -1;
+	}
+
+	if (sdp_set_notify(t->session, browse_search_cb, t) < 0) {
+		browse_target_fail(t, strerror(errno));
+		return -1;
+	}
+
+	attrid = sdp_list_append(0, &range);
+	search = sdp_list_append(0, &context->group);
+	err = sdp_service_search_attr_async(t->session, search,
+						SDP_ATTR_REQ_RANGE, attrid);
+	sdp_list_free(attrid, 0);
+	sdp_list_free(search, 0);
+
+	if (err < 0) {
+		browse_target_fail(t, strerror(errno));
+		return -1;
+	}
+
+	t->state = TARGET_SEARCHING;
+
+	return 0;
+}
+
+static int do_parallel_search(char **addrs, int count,
+				struct search_context *context, int parallel)
+{
+	struct browse_target *targets, **active;
+	struct pollfd *fds;
+	int i, next = 0, running = 0, failed = 0;
+
+	targets = calloc(count, sizeof(*targets));
+	active = calloc(parallel, sizeof(*active));
+	fds = calloc(parallel, sizeof(*fds));
+	if (!targets || !active || !fds) {
+		printf("Can't allocate browse targets\n");
+		free(targets);
+		free(active);
+		free(fds);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+		estr2ba(addrs[i], &targets[i].bdaddr);
+
+	while (next < count || running > 0) {
+		time_t now;
+		int n;
+
+		/* Refill the free slots */
+		for (i = 0; i < parallel && next < count; i++) {
+			if (active[i])
+				continue;
+
+			if (browse_target_start(&targets[next]) < 0) {
+				failed++;
+				next++;
+				i--;
+				continue;
+			}
+
+			active[i] = &targets[next++];
+			running++;
+		}
+
+		if (running == 0)
+			continue;
+
+		for (i = 0; i < parallel; i++) {
+			if (!active[i]) {
+				fds[i].fd = -1;
+				continue;
+			}
+
+			fds[i].fd = sdp_get_socket(active[i]->session);
+			fds[i].events = active[i]->state == TARGET_CONNECTING ?
+								POLLOUT : POLLIN;
+			fds[i].revents = 0;
+		}
+
+		n = poll(fds, parallel, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		now = time(NULL);
+
+		for (i = 0; i < parallel; i++) {
+			struct browse_target *t = active[i];
+
+			if (!t)
+				continue;
+
+			if (t->state == TARGET_CONNECTING &&
+						fds[i].revents & (POLLOUT |
+							POLLERR | POLLHUP)) {
+				if (browse_target_search(t, context) < 0)
+					failed++;
+			} else if (t->state == TARGET_SEARCHING &&
+						fds[i].revents & (POLLIN |
+							POLLERR | POLLHUP)) {
+				errno = 0;
+				if (sdp_process(t->session) < 0 &&
+						t->state != TARGET_DONE) {
+					browse_target_fail(t, errno ?
+						strerror(errno) :
+						"Connection closed");
+					failed++;
+				}
+			} else if (now - t->started > BROWSE_TIMEOUT) {
+				browse_target_fail(t, "Timeout");
+				failed++;
+			}
+
+			if (t->state != TARGET_DONE)
+				continue;
+
+			sdp_close(t->session);
+			t->session = NULL;
+			active[i] = NULL;
+			running--;
+		}
+
+		fflush(stdout);
+	}
+
+	while (browse_cache) {
+		struct browse_cache *c = browse_cache;
+
+		browse_cache = c->next;
+		free(c);
+	}
+
+	free(targets);
+	free(active);
+	free(fds);
+
+	return failed ? -1 : 0;
+}
+
 static struct option browse_options[] = {
 	{ "help",	0, 0, 'h' },
 	{ "tree",	0, 0, 't' },
@@ -3920,12 +4273,15 @@ static struct option browse_options[] = {
 	{ "xml",	0, 0, 'x' },
 	{ "uuid",	1, 0, 'u' },
 	{ "l2cap",	0, 0, 'l' },
+	{ "json",	0, 0, 'j' },
+	{ "parallel",	1, 0, 'p' },
 	{ 0, 0, 0, 0 }
 };
 
 static const char *browse_help =
 	"Usage:\n"
-	"\tbrowse [--tree] [--raw] [--xml] [--uuid uuid] [--l2cap] [bdaddr]\n";
+	"\tbrowse [--tree] [--raw] [--xml] [--uuid uuid] [--l2cap]\n"
+	"\t       [--json] [--parallel N] [bdaddr ...]\n";
 
 /*
  * Browse the full SDP database (i.e. list all services starting from the
@@ -3934,7 +4290,7 @@ static const char *browse_help =
 static int cmd_browse(int argc, char **argv)
 {
 	struct search_context context;
-	int opt, num;
+	int opt, num, json = 0, parallel = BROWSE_PARALLEL;
 
 	/* Initialise context */
 	memset(&context, '\0', sizeof(struct search_context));
@@ -3962,6 +4318,16 @@ static int cmd_browse(int argc, char **argv)
 		case 'l':
 			sdp_uuid16_create(&context.group, L2CAP_UUID);
 			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'p':
+			parallel = atoi(optarg);
+			if (parallel < 1) {
+				printf("Invalid parallel count %s\n", optarg);
+				return -1;
+			}
+			break;
 		default:
 			printf("%s", browse_help);
 			return -1;
@@ -3971,10 +4337,20 @@ static int cmd_browse(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (json && argc >= 1)
+		return do_parallel_search(argv, argc, &context, parallel);
+
 	if (argc >= 1) {
-		bdaddr_t bdaddr;
-		estr2ba(argv[0], &bdaddr);
-		return do_search(&bdaddr, &context);
+		int i, err = 0;
+
+		for (i = 0; i < argc; i++) {
+			bdaddr_t bdaddr;
+			estr2ba(argv[i], &bdaddr);
+			if (do_search(&bdaddr, &context) < 0)
+				err = -1;
+		}
+
+		return err;
 	}
 
 	return do_search(NULL, &context);
@@ -220,24 +220,50 @@ void ubcsp_receive_packet (struct ubcsp_packet *receive_packet)
 
 #ifdef UBCSP_CRC
 
-static uint16 ubcsp_calc_crc (uint8 ch, uint16 crc)
-{
-	/* Calculate the CRC using the above 16 entry lookup table */
+/* CRC-CCITT (reflected polynomial 0x8408) for every possible octet */
 
-	static const uint16 crc_table[] =
+static const uint16 ubcsp_crc_table[256] =
 		{
-			0x0000, 0x1081, 0x2102, 0x3183,
-			0x4204, 0x5285, 0x6306, 0x7387,
-			0x8408, 0x9489, 0xa50a, 0xb58b,
-			0xc60c, 0xd68d, 0xe70e, 0xf78f
+			0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+			0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+			0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+			0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+			0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+			0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+			0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+			0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+			0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+			0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+			0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+			0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+			0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+			0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+			0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+			0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+			0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+			0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+			0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+			0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+			0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+			0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+			0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+			0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+			0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+			0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+			0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+			0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+			0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+			0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+			0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+			0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78,
 		};
 
-	/* Do this four bits at a time - more code, less space */
-
-    crc = (crc >> 4) ^ crc_table[(crc ^ ch) & 0x000f];
-    crc = (crc >> 4) ^ crc_table[(crc ^ (ch >> 4)) & 0x000f];
+static uint16 ubcsp_calc_crc (uint8 ch, uint16 crc)
+{
+	/* Calculate the CRC using the above 256 entry lookup table,
+	   a whole octet at a time */
 
-	return crc;
+	return (crc >> 8) ^ ubcsp_crc_table[(crc ^ ch) & 0x00ff];
 }
 
 /*****************************************************************************/
@@ -270,39 +296,47 @@ static uint16 ubcsp_crc_reverse (uint16 crc)
 
 /*****************************************************************************/
 /**                                                                         **/
-/** ubcsp_put_slip_uart                                                     **/
+/** ubcsp_put_slip_block                                                    **/
 /**                                                                         **/
-/** Outputs a single octet to the uart                                      **/
-/** If the octet needs to be escaped, then output the escape value          **/
-/** and then store the second octet to be output later                      **/
+/** Outputs a whole block of octets to the uart, escaping them as required  **/
+/** and updating the CRC on the way. Returns the new CRC value              **/
 /**                                                                         **/
 /*****************************************************************************/
 
-static void ubcsp_put_slip_uart (uint8 ch)
+static uint16 ubcsp_put_slip_block (const uint8 *ptr, uint16 len, uint16 crc)
 {
-	/* output a single UART octet */
-
-	/* If it needs to be escaped, then output the escape octet
-	   and set the send_slip_escape so that the next time we
-	   output the second octet for the escape correctly.
-	   This is done right at the top of ubcsp_poll */
+	uint8
+		ch;
 
-	if (ch == SLIP_FRAME)
-	{
-		put_uart (SLIP_ESCAPE);
-		ubcsp_config.send_slip_escape = SLIP_ESCAPE_FRAME;
-	}
-	else if (ch == SLIP_ESCAPE)
+	while (len --)
 	{
-		put_uart (SLIP_ESCAPE);
-		ubcsp_config.send_slip_escape = SLIP_ESCAPE_ESCAPE;
-	}
-	else
-	{
-		/* Not escaped, so just output octet */
+		ch = *ptr ++;
 
-		put_uart (ch);
+#if UBCSP_CRC
+		crc = ubcsp_calc_crc (ch, crc);
+#endif
+
+		/* Escaped octets go out as two octets straight away */
+
+		if (ch == SLIP_FRAME)
+		{
+			put_uart (SLIP_ESCAPE);
+			put_uart (SLIP_ESCAPE_FRAME);
+		}
+		else if (ch == SLIP_ESCAPE)
+		{
+			put_uart (SLIP_ESCAPE);
+			put_uart (SLIP_ESCAPE_ESCAPE);
+		}
+		else
+		{
+			/* Not escaped, so just output octet */
+
+			put_uart (ch);
+		}
 	}
+
+	return crc;
 }
 
 /*****************************************************************************/
@@ -809,7 +843,7 @@ static uint8 ubcsp_sent_packet (void)
 /** This is the main function for ubcsp                                     **/
 /** It performs a number of tasks                                           **/
 /**                                                                         **/
-/** 1) Send another octet to the UART - escaping as required                **/
+/** 1) Send the next block to the UART - escaping as required               **/
 /** 2) Setup the payload to be sent after the header has been sent          **/
 /** 3) Send the CRC for the packet if required                              **/
 /**                                                                         **/
@@ -846,97 +880,53 @@ uint8 ubcsp_poll (uint8 *activity)
 
 		if (ubcsp_config.send_size)
 		{
-			/* We have something to send so send it */
+			/* We have something to send so send the whole block,
+			   calculating the CRC as we go */
 
-			if (ubcsp_config.send_slip_escape)
-			{
-				/* Last time we send a SLIP_ESCAPE octet
-				   this time send the second escape code */
-
-				put_uart (ubcsp_config.send_slip_escape);
-
-				ubcsp_config.send_slip_escape = 0;
-			}
-			else
-			{
 #if UBCSP_CRC
-				/* get the value to send, and calculate CRC as we go */
-
-				value = *ubcsp_config.send_ptr ++;
-
-				ubcsp_config.send_crc = ubcsp_calc_crc (value, ubcsp_config.send_crc);
-
-				/* Output the octet */
-
-				ubcsp_put_slip_uart (value);
+			ubcsp_config.send_crc = ubcsp_put_slip_block (ubcsp_config.send_ptr, ubcsp_config.send_size, ubcsp_config.send_crc);
 #else
-				/* Just output the octet*/
-
-				ubcsp_put_slip_uart (*ubcsp_config.send_ptr ++);
+			ubcsp_put_slip_block (ubcsp_config.send_ptr, ubcsp_config.send_size, 0);
 #endif
-			}
 
-			/* If we did output a SLIP_ESCAPE, then don't process the end of a block */
+			/*** We are at the end of a block - either header or payload ***/
 
-			if ((!ubcsp_config.send_slip_escape) && ((ubcsp_config.send_size = ubcsp_config.send_size - 1) == 0))
-			{
-				/*** We are at the end of a block - either header or payload ***/
+			/* setup the next block */
 
-				/* setup the next block */
-
-				ubcsp_config.send_ptr = ubcsp_config.next_send_ptr;
-				ubcsp_config.send_size = ubcsp_config.next_send_size;
-				ubcsp_config.next_send_ptr = 0;
-				ubcsp_config.next_send_size = 0;
+			ubcsp_config.send_ptr = ubcsp_config.next_send_ptr;
+			ubcsp_config.send_size = ubcsp_config.next_send_size;
+			ubcsp_config.next_send_ptr = 0;
+			ubcsp_config.next_send_size = 0;
 
 #if UBCSP_CRC
-				/* If we have no successor block
-				   then we might need to send the CRC */
+			/* If we have no successor block
+			   then we might need to send the CRC */
 
-				if (!ubcsp_config.send_ptr)
+			if (!ubcsp_config.send_ptr)
+			{
+				if (ubcsp_config.need_send_crc)
 				{
-					if (ubcsp_config.need_send_crc)
-					{
-						/* reverse the CRC from what we computed along the way */
+					/* reverse the CRC from what we computed along the way */
 
-						ubcsp_config.need_send_crc = 0;
+					ubcsp_config.need_send_crc = 0;
 
-						ubcsp_config.send_crc = ubcsp_crc_reverse (ubcsp_config.send_crc);
+					ubcsp_config.send_crc = ubcsp_crc_reverse (ubcsp_config.send_crc);
 
-						/* Save in the send_crc buffer */
+					/* Save in the send_crc buffer */
 
-						ubcsp_send_crc[0] = (uint8) (ubcsp_config.send_crc >> 8);
-						ubcsp_send_crc[1] = (uint8) ubcsp_config.send_crc;
+					ubcsp_send_crc[0] = (uint8) (ubcsp_config.send_crc >> 8);
+					ubcsp_send_crc[1] = (uint8) ubcsp_config.send_crc;
 
-						/* Setup to send this buffer */
+					/* Setup to send this buffer */
 
-						ubcsp_config.send_ptr = ubcsp_send_crc;
-						ubcsp_config.send_size = 2;
-					}
-					else
-					{
-						/* We don't need to send the crc
-						   either we just have, or this packet doesn't include it */
-
-						/* Output the end of FRAME marker */
-
-						put_uart (SLIP_FRAME);
-
-						/* Check if this is an unreliable packet */
-
-						*activity |= ubcsp_sent_packet ();
-
-						/* We've sent the packet, so don't need to have be called quickly soon */
-
-						delay = UBCSP_POLL_TIME_DELAY;
-					}
+					ubcsp_config.send_ptr = ubcsp_send_crc;
+					ubcsp_config.send_size = 2;
 				}
-#else
-				/* If we have no successor block
-				   then we might need to send the CRC */
-
-				if (!ubcsp_config.send_ptr)
+				else
 				{
+					/* We don't need to send the crc
+					   either we just have, or this packet doesn't include it */
+
 					/* Output the end of FRAME marker */
 
 					put_uart (SLIP_FRAME);
@@ -949,8 +939,26 @@ uint8 ubcsp_poll (uint8 *activity)
 
 					delay = UBCSP_POLL_TIME_DELAY;
 				}
-#endif
 			}
+#else
+			/* If we have no successor block
+			   then we might need to send the CRC */
+
+			if (!ubcsp_config.send_ptr)
+			{
+				/* Output the end of FRAME marker */
+
+				put_uart (SLIP_FRAME);
+
+				/* Check if this is an unreliable packet */
+
+				*activity |= ubcsp_sent_packet ();
+
+				/* We've sent the packet, so don't need to have be called quickly soon */
+
+				delay = UBCSP_POLL_TIME_DELAY;
+			}
+#endif
 		}
 		else if (ubcsp_config.link_establishment_packet == ubcsp_le_none)
 		{
@@ -30,16 +30,47 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <syslog.h>
 
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
 #include <glib.h>
 
 #ifdef HAVE_CAPNG
 #include <cap-ng.h>
 #endif
 
+#include "ring.h"
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL	40
+#endif
+
+/* Packets read per wakeup before returning to the main loop */
+#define TRACE_BATCH		64
+
+/* Seconds after a freeze during which further triggers are ignored */
+#define TRACE_HOLDOFF		10
+
+struct trace_dev {
+	int id;
+	GIOChannel *io;
+	guint watch;
+	struct trace_ring *ring;
+	uint32_t drops;
+	guint freeze;
+	time_t holdoff;
+};
+
+static struct trace_dev *devices[HCI_MAX_DEV];
+
 static GMainLoop *event_loop;
 
 static void sig_term(int sig)
@@ -49,6 +80,12 @@ static void sig_term(int sig)
 
 static gboolean option_detach = TRUE;
 static gboolean option_debug = FALSE;
+static gboolean option_sco = FALSE;
+static gchar *option_directory = NULL;
+static gchar *option_triggers = NULL;
+static gint option_size = 1024;
+static gint option_snaplen = 64;
+static gint option_delay = 1000;
 
 static GOptionEntry options[] = {
 	{ "nodaemon", 'n', G_OPTION_FLAG_REVERSE,
@@ -56,9 +93,30 @@ static GOptionEntry options[] = {
 				"Don't run as daemon in background" },
 	{ "debug", 'd', 0, G_OPTION_ARG_NONE, &option_debug,
 				"Enable debug information output" },
+	{ "directory", 'D', 0, G_OPTION_ARG_STRING, &option_directory,
+				"Directory for the ring and snapshot files",
+				"DIR" },
+	{ "size", 's', 0, G_OPTION_ARG_INT, &option_size,
+				"Size of each ring in KiB", "SIZE" },
+	{ "snaplen", 'S', 0, G_OPTION_ARG_INT, &option_snaplen,
+				"Bytes of each data packet to keep", "LEN" },
+	{ "sco", 0, 0, G_OPTION_ARG_NONE, &option_sco,
+				"Capture SCO data packets as well" },
+	{ "triggers", 't', 0, G_OPTION_ARG_STRING, &option_triggers,
+				"Disconnect reasons freezing the ring",
+				"0x08,0x22,..." },
+	{ "delay", 0, 0, G_OPTION_ARG_INT, &option_delay,
+				"Milliseconds of capture kept after a trigger",
+				"MSEC" },
 	{ NULL },
 };
 
+/* Disconnect reasons worth a snapshot: connection and LMP response
+ * timeouts, unacceptable connection interval, MIC failure and failures
+ * to establish. Normal terminations by either side are left out. */
+static uint8_t trigger_reasons[32];
+static const uint8_t default_reasons[] = { 0x08, 0x22, 0x3b, 0x3d, 0x3e };
+
 static void debug(const char *format, ...)
 {
 	va_list ap;
@@ -78,11 +136,390 @@ static void sig_debug(int sig)
 	option_debug = !option_debug;
 }
 
+static gboolean freeze_ring(gpointer user_data)
+{
+	struct trace_dev *dev = user_data;
+	char path[PATH_MAX], stamp[32];
+	time_t now = time(NULL);
+	int err;
+
+	dev->freeze = 0;
+	dev->holdoff = now + TRACE_HOLDOFF;
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+	snprintf(path, sizeof(path), "%s/hci%d-%s.btsnoop",
+					option_directory, dev->id, stamp);
+
+	err = trace_ring_export(dev->ring, path);
+	if (err < 0)
+		syslog(LOG_ERR, "Can't write %s: %s (%d)", path,
+						strerror(-err), -err);
+	else
+		syslog(LOG_INFO, "Saved %u packets of hci%d to %s",
+				trace_ring_count(dev->ring), dev->id, path);
+
+	return FALSE;
+}
+
+static void trigger(struct trace_dev *dev, const char *reason)
+{
+	if (dev->freeze > 0 || time(NULL) < dev->holdoff)
+		return;
+
+	debug("hci%d: %s, freezing ring", dev->id, reason);
+
+	/* Keep recording for a moment to have the aftermath as well */
+	dev->freeze = g_timeout_add(option_delay, freeze_ring, dev);
+}
+
+static gboolean trigger_all(gpointer user_data)
+{
+	int i;
+
+	for (i = 0; i < HCI_MAX_DEV; i++) {
+		if (devices[i] == NULL)
+			continue;
+
+		/* Requested by hand, ignore the holdoff */
+		devices[i]->holdoff = 0;
+		trigger(devices[i], "external trigger");
+	}
+
+	return FALSE;
+}
+
+static void sig_trigger(int sig)
+{
+	g_idle_add(trigger_all, NULL);
+}
+
+static void check_event(struct trace_dev *dev, const uint8_t *buf, int len)
+{
+	const hci_event_hdr *hdr = (const void *) buf;
+	const evt_disconn_complete *evt;
+	char reason[32];
+
+	if (len < HCI_EVENT_HDR_SIZE)
+		return;
+
+	buf += HCI_EVENT_HDR_SIZE;
+	len -= HCI_EVENT_HDR_SIZE;
+
+	switch (hdr->evt) {
+	case EVT_DISCONN_COMPLETE:
+		if (len < EVT_DISCONN_COMPLETE_SIZE)
+			return;
+
+		evt = (const void *) buf;
+		if (evt->status != 0x00 || !(trigger_reasons[evt->reason / 8] &
+						(1 << (evt->reason % 8))))
+			return;
+
+		snprintf(reason, sizeof(reason), "disconnect reason 0x%02x",
+								evt->reason);
+		trigger(dev, reason);
+		break;
+	case EVT_HARDWARE_ERROR:
+		trigger(dev, "hardware error");
+		break;
+	case EVT_DATA_BUFFER_OVERFLOW:
+		trigger(dev, "data buffer overflow");
+		break;
+	}
+}
+
+static void close_device(int id);
+
+static gboolean io_data(GIOChannel *io, GIOCondition cond, gpointer user_data)
+{
+	struct trace_dev *dev = user_data;
+	unsigned char buf[HCI_MAX_FRAME_SIZE], control[64];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct timeval tv;
+	uint32_t snaplen;
+	int sk, dir, n;
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		syslog(LOG_INFO, "Stopped capture on hci%d", dev->id);
+		dev->watch = 0;
+		close_device(dev->id);
+		return FALSE;
+	}
+
+	sk = g_io_channel_unix_get_fd(io);
+
+	for (n = 0; n < TRACE_BATCH; n++) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		len = recvmsg(sk, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (len < 1)
+			continue;
+
+		dir = 0;
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+					cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SO_RXQ_OVFL) {
+				memcpy(&dev->drops, CMSG_DATA(cmsg),
+							sizeof(dev->drops));
+				continue;
+			}
+
+			if (cmsg->cmsg_level != SOL_HCI)
+				continue;
+
+			switch (cmsg->cmsg_type) {
+			case HCI_CMSG_DIR:
+				memcpy(&dir, CMSG_DATA(cmsg), sizeof(dir));
+				break;
+			case HCI_CMSG_TSTAMP:
+				memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+				break;
+			}
+		}
+
+		if (buf[0] == HCI_ACLDATA_PKT || buf[0] == HCI_SCODATA_PKT)
+			snaplen = option_snaplen;
+		else
+			snaplen = sizeof(buf);
+
+		trace_ring_append(dev->ring, buf[0], dir, &tv, buf + 1,
+					len - 1, snaplen, dev->drops);
+
+		if (buf[0] == HCI_EVENT_PKT)
+			check_event(dev, buf + 1, len - 1);
+	}
+
+	return TRUE;
+}
+
+static int open_device(int id)
+{
+	struct trace_dev *dev;
+	struct sockaddr_hci addr;
+	struct hci_filter flt;
+	char path[PATH_MAX];
+	int sk, opt = 1, size = 256 * 1024;
+
+	if (id < 0 || id >= HCI_MAX_DEV || devices[id] != NULL)
+		return -EALREADY;
+
+	sk = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (sk < 0)
+		return -errno;
+
+	if (setsockopt(sk, SOL_HCI, HCI_DATA_DIR, &opt, sizeof(opt)) < 0 ||
+			setsockopt(sk, SOL_HCI, HCI_TIME_STAMP,
+						&opt, sizeof(opt)) < 0)
+		goto failed;
+
+	/* Everything else is dropped by the kernel and never copied */
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_COMMAND_PKT, &flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_set_ptype(HCI_ACLDATA_PKT, &flt);
+	if (option_sco)
+		hci_filter_set_ptype(HCI_SCODATA_PKT, &flt);
+	hci_filter_all_events(&flt);
+
+	if (setsockopt(sk, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0)
+		goto failed;
+
+	/* Not fatal, older kernels don't report socket drops */
+	setsockopt(sk, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt));
+	setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = id;
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto failed;
+
+	dev = g_new0(struct trace_dev, 1);
+	dev->id = id;
+
+	snprintf(path, sizeof(path), "%s/hci%d.ring", option_directory, id);
+
+	dev->ring = trace_ring_open(path, option_size * 1024);
+	if (dev->ring == NULL) {
+		syslog(LOG_ERR, "Can't map %s: %s (%d)", path,
+						strerror(errno), errno);
+		g_free(dev);
+		close(sk);
+		return -EIO;
+	}
+
+	dev->io = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(dev->io, TRUE);
+	dev->watch = g_io_add_watch(dev->io, G_IO_IN | G_IO_NVAL |
+						G_IO_ERR | G_IO_HUP,
+						io_data, dev);
+
+	devices[id] = dev;
+
+	syslog(LOG_INFO, "Capturing hci%d into %s", id, path);
+
+	return 0;
+
+failed:
+	opt = -errno;
+	close(sk);
+	return opt;
+}
+
+static void close_device(int id)
+{
+	struct trace_dev *dev = devices[id];
+
+	if (dev == NULL)
+		return;
+
+	devices[id] = NULL;
+
+	if (dev->freeze > 0) {
+		g_source_remove(dev->freeze);
+		freeze_ring(dev);
+	}
+
+	if (dev->watch > 0)
+		g_source_remove(dev->watch);
+
+	g_io_channel_unref(dev->io);
+	trace_ring_close(dev->ring);
+	g_free(dev);
+}
+
+static gboolean io_stack_event(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	unsigned char buf[HCI_MAX_FRAME_SIZE];
+	evt_stack_internal *si;
+	evt_si_device *sd;
+	hci_event_hdr *hdr;
+	ssize_t len;
+	int err;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		g_main_loop_quit(event_loop);
+		return FALSE;
+	}
+
+	len = read(g_io_channel_unix_get_fd(io), buf, sizeof(buf));
+	if (len < (ssize_t) (HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE +
+				EVT_STACK_INTERNAL_SIZE + EVT_SI_DEVICE_SIZE))
+		return TRUE;
+
+	hdr = (void *) (buf + HCI_TYPE_LEN);
+	si = (void *) (buf + HCI_TYPE_LEN + HCI_EVENT_HDR_SIZE);
+	if (hdr->evt != EVT_STACK_INTERNAL || si->type != EVT_SI_DEVICE)
+		return TRUE;
+
+	sd = (void *) si->data;
+
+	switch (sd->event) {
+	case HCI_DEV_REG:
+		err = open_device(sd->dev_id);
+		if (err < 0 && err != -EALREADY)
+			syslog(LOG_ERR, "Can't capture hci%d: %s (%d)",
+					sd->dev_id, strerror(-err), -err);
+		break;
+	case HCI_DEV_UNREG:
+		close_device(sd->dev_id);
+		break;
+	}
+
+	return TRUE;
+}
+
+static GIOChannel *open_stack(void)
+{
+	struct sockaddr_hci addr;
+	struct hci_filter flt;
+	GIOChannel *io;
+	int sk;
+
+	sk = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (sk < 0)
+		return NULL;
+
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_set_event(EVT_STACK_INTERNAL, &flt);
+	if (setsockopt(sk, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0)
+		goto failed;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = HCI_DEV_NONE;
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto failed;
+
+	io = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(io, TRUE);
+	g_io_add_watch(io, G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
+						io_stack_event, NULL);
+
+	return io;
+
+failed:
+	close(sk);
+	return NULL;
+}
+
+static void parse_triggers(const char *list)
+{
+	char **reasons;
+	int i;
+
+	memset(trigger_reasons, 0, sizeof(trigger_reasons));
+
+	if (list == NULL) {
+		for (i = 0; i < (int) sizeof(default_reasons); i++)
+			trigger_reasons[default_reasons[i] / 8] |=
+					1 << (default_reasons[i] % 8);
+		return;
+	}
+
+	reasons = g_strsplit(list, ",", 0);
+
+	for (i = 0; reasons[i] != NULL; i++) {
+		unsigned long reason = strtoul(reasons[i], NULL, 0);
+
+		if (reason > 0xff)
+			continue;
+
+		trigger_reasons[reason / 8] |= 1 << (reason % 8);
+	}
+
+	g_strfreev(reasons);
+}
+
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
 	GError *err = NULL;
+	GIOChannel *stack;
 	struct sigaction sa;
+	int i;
 
 #ifdef HAVE_CAPNG
 	/* Drop capabilities */
@@ -107,6 +544,17 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
+	if (option_directory == NULL)
+		option_directory = g_strdup("/var/log/bluetooth");
+
+	if (option_size < 4)
+		option_size = 4;
+
+	if (option_snaplen < 1)
+		option_snaplen = 1;
+
+	parse_triggers(option_triggers);
+
 	if (option_detach == TRUE) {
 		if (daemon(0, 0)) {
 			perror("Can't start daemon");
@@ -126,6 +574,9 @@ int main(int argc, char *argv[])
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGINT,  &sa, NULL);
 
+	sa.sa_handler = sig_trigger;
+	sigaction(SIGUSR1, &sa, NULL);
+
 	sa.sa_handler = sig_debug;
 	sigaction(SIGUSR2, &sa, NULL);
 
@@ -136,14 +587,48 @@ int main(int argc, char *argv[])
 		syslog(LOG_INFO, "Enabling debug information");
 	}
 
+	if (mkdir(option_directory, 0700) < 0 && errno != EEXIST) {
+		syslog(LOG_ERR, "Can't create %s: %s (%d)", option_directory,
+						strerror(errno), errno);
+		exit(1);
+	}
+
 	event_loop = g_main_loop_new(NULL, FALSE);
 
+	stack = open_stack();
+	if (stack == NULL) {
+		syslog(LOG_ERR, "Can't open HCI socket: %s (%d)",
+						strerror(errno), errno);
+		exit(1);
+	}
+
+	for (i = 0; i < HCI_MAX_DEV; i++) {
+		struct hci_dev_info di;
+		int err;
+
+		if (hci_devinfo(i, &di) < 0)
+			continue;
+
+		err = open_device(i);
+		if (err < 0)
+			syslog(LOG_ERR, "Can't capture hci%d: %s (%d)",
+						i, strerror(-err), -err);
+	}
+
 	debug("Entering main loop");
 
 	g_main_loop_run(event_loop);
 
+	for (i = 0; i < HCI_MAX_DEV; i++)
+		close_device(i);
+
+	g_io_channel_unref(stack);
+
 	g_main_loop_unref(event_loop);
 
+	g_free(option_directory);
+	g_free(option_triggers);
+
 	syslog(LOG_INFO, "Exit");
 
 	closelog();
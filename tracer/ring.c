@@ -0,0 +1,287 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "ring.h"
+
+/* The ring file is a small header followed by btsnoop packet records laid
+ * out back to back. A record never straddles the end of the data area, the
+ * writer wraps early and remembers where the records before head stop. */
+#define RING_MAGIC	"BZRING01"
+
+struct ring_hdr {
+	uint8_t		magic[8];
+	uint32_t	size;		/* Data area size */
+	uint32_t	head;		/* Oldest record */
+	uint32_t	tail;		/* Next record */
+	uint32_t	wrap;		/* End of the records before head */
+	uint32_t	count;
+	uint32_t	reserved[9];
+} __attribute__ ((packed));
+#define RING_HDR_SIZE (sizeof(struct ring_hdr))
+
+struct trace_ring {
+	struct ring_hdr *hdr;
+	uint8_t *data;
+	size_t length;
+};
+
+static uint8_t btsnoop_id[] = { 0x62, 0x74, 0x73, 0x6e, 0x6f, 0x6f, 0x70, 0x00 };
+
+static void ring_reset(struct trace_ring *ring)
+{
+	struct ring_hdr *hdr = ring->hdr;
+
+	hdr->head = 0;
+	hdr->tail = 0;
+	hdr->wrap = hdr->size;
+	hdr->count = 0;
+}
+
+static int ring_valid(struct ring_hdr *hdr, uint32_t size)
+{
+	if (memcmp(hdr->magic, RING_MAGIC, sizeof(hdr->magic)) != 0)
+		return 0;
+
+	if (hdr->size != size || hdr->wrap > size)
+		return 0;
+
+	if (hdr->head >= hdr->wrap && hdr->count > 0)
+		return 0;
+
+	return hdr->tail <= size;
+}
+
+static uint32_t record_length(struct trace_ring *ring, uint32_t offset)
+{
+	struct btsnoop_pkt *pkt = (void *) (ring->data + offset);
+
+	return BTSNOOP_PKT_SIZE + ntohl(pkt->len);
+}
+
+static void ring_evict(struct trace_ring *ring)
+{
+	struct ring_hdr *hdr = ring->hdr;
+	uint32_t len = record_length(ring, hdr->head);
+
+	if (len > hdr->wrap - hdr->head) {
+		/* Something tore the file, start over */
+		ring_reset(ring);
+		return;
+	}
+
+	hdr->head += len;
+	hdr->count--;
+
+	if (hdr->count == 0)
+		hdr->head = hdr->tail;
+	else if (hdr->head == hdr->wrap) {
+		hdr->head = 0;
+		hdr->wrap = hdr->size;
+	}
+}
+
+void trace_ring_append(struct trace_ring *ring, uint8_t type, int incoming,
+				const struct timeval *tv, const void *data,
+				uint32_t len, uint32_t snaplen, uint32_t drops)
+{
+	struct ring_hdr *hdr = ring->hdr;
+	struct btsnoop_pkt *pkt;
+	uint32_t size = len + 1, incl, need, flags;
+	uint64_t ts;
+
+	incl = size < snaplen ? size : snaplen;
+	if (incl == 0)
+		incl = 1;
+	if (incl > hdr->size - BTSNOOP_PKT_SIZE)
+		incl = hdr->size - BTSNOOP_PKT_SIZE;
+
+	need = BTSNOOP_PKT_SIZE + incl;
+
+	if (need > hdr->size - hdr->tail) {
+		/* Drop whatever is left past the tail and wrap */
+		while (hdr->count > 0 && hdr->head >= hdr->tail)
+			ring_evict(ring);
+
+		hdr->wrap = hdr->tail;
+		hdr->tail = 0;
+
+		if (hdr->count == 0)
+			hdr->head = 0;
+	}
+
+	while (hdr->count > 0 && hdr->head >= hdr->tail &&
+					hdr->head < hdr->tail + need)
+		ring_evict(ring);
+
+	if (hdr->count == 0) {
+		hdr->head = hdr->tail;
+		hdr->wrap = hdr->size;
+	}
+
+	ts = (tv->tv_sec - 946684800ll) * 1000000ll + tv->tv_usec;
+
+	flags = incoming ? 0x01 : 0x00;
+	if (type == 0x01 || type == 0x04)
+		flags |= 0x02;
+
+	pkt = (void *) (ring->data + hdr->tail);
+	pkt->size = htonl(size);
+	pkt->len = htonl(incl);
+	pkt->flags = htonl(flags);
+	pkt->drops = htonl(drops);
+	pkt->ts = hton64(ts + 0x00E03AB44A676000ll);
+	pkt->data[0] = type;
+	memcpy(pkt->data + 1, data, incl - 1);
+
+	hdr->tail += need;
+	hdr->count++;
+}
+
+uint32_t trace_ring_count(struct trace_ring *ring)
+{
+	return ring->hdr->count;
+}
+
+int trace_ring_export(struct trace_ring *ring, const char *path)
+{
+	struct ring_hdr *hdr = ring->hdr;
+	struct btsnoop_hdr snoop;
+	struct iovec iov[3];
+	int fd, cnt = 1;
+	ssize_t len, total = 0;
+
+	memcpy(snoop.id, btsnoop_id, sizeof(btsnoop_id));
+	snoop.version = htonl(1);
+	snoop.type = htonl(1002);
+
+	iov[0].iov_base = &snoop;
+	iov[0].iov_len = BTSNOOP_HDR_SIZE;
+
+	if (hdr->count > 0 && hdr->head >= hdr->tail) {
+		iov[cnt].iov_base = ring->data + hdr->head;
+		iov[cnt++].iov_len = hdr->wrap - hdr->head;
+		iov[cnt].iov_base = ring->data;
+		iov[cnt++].iov_len = hdr->tail;
+	} else if (hdr->count > 0) {
+		iov[cnt].iov_base = ring->data + hdr->head;
+		iov[cnt++].iov_len = hdr->tail - hdr->head;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return -errno;
+
+	len = writev(fd, iov, cnt);
+	if (len < 0) {
+		int err = -errno;
+		close(fd);
+		unlink(path);
+		return err;
+	}
+
+	close(fd);
+
+	while (cnt-- > 0)
+		total += iov[cnt].iov_len;
+
+	if (len != total) {
+		unlink(path);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+struct trace_ring *trace_ring_open(const char *path, uint32_t size)
+{
+	struct trace_ring *ring;
+	struct stat st;
+	void *map;
+	size_t length;
+	int fd;
+
+	size &= ~3;
+	if (size < 4096)
+		size = 4096;
+
+	length = RING_HDR_SIZE + size;
+
+	fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (st.st_size != (off_t) length &&
+					ftruncate(fd, length) < 0)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	ring = malloc(sizeof(*ring));
+	if (ring == NULL) {
+		munmap(map, length);
+		return NULL;
+	}
+
+	ring->hdr = map;
+	ring->data = (uint8_t *) map + RING_HDR_SIZE;
+	ring->length = length;
+
+	if (!ring_valid(ring->hdr, size)) {
+		memset(ring->hdr, 0, RING_HDR_SIZE);
+		memcpy(ring->hdr->magic, RING_MAGIC, sizeof(ring->hdr->magic));
+		ring->hdr->size = size;
+		ring_reset(ring);
+	}
+
+	return ring;
+}
+
+void trace_ring_close(struct trace_ring *ring)
+{
+	msync(ring->hdr, ring->length, MS_ASYNC);
+	munmap(ring->hdr, ring->length);
+	free(ring);
+}
@@ -0,0 +1,61 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/time.h>
+
+struct btsnoop_hdr {
+	uint8_t		id[8];		/* Identification Pattern */
+	uint32_t	version;	/* Version Number = 1 */
+	uint32_t	type;		/* Datalink Type */
+} __attribute__ ((packed));
+#define BTSNOOP_HDR_SIZE (sizeof(struct btsnoop_hdr))
+
+struct btsnoop_pkt {
+	uint32_t	size;		/* Original Length */
+	uint32_t	len;		/* Included Length */
+	uint32_t	flags;		/* Packet Flags */
+	uint32_t	drops;		/* Cumulative Drops */
+	uint64_t	ts;		/* Timestamp microseconds */
+	uint8_t		data[0];	/* Packet Data */
+} __attribute__ ((packed));
+#define BTSNOOP_PKT_SIZE (sizeof(struct btsnoop_pkt))
+
+struct trace_ring;
+
+/* Maps the ring file at path, the records of a previous run are kept when
+ * the file is intact and has the same size */
+struct trace_ring *trace_ring_open(const char *path, uint32_t size);
+void trace_ring_close(struct trace_ring *ring);
+
+/* Appends one H4 packet, type is the HCI packet indicator and only snaplen
+ * bytes of the packet are stored. Never blocks and never fails, the oldest
+ * records are overwritten to make room. */
+void trace_ring_append(struct trace_ring *ring, uint8_t type, int incoming,
+				const struct timeval *tv, const void *data,
+				uint32_t len, uint32_t snaplen, uint32_t drops);
+
+/* Writes the current contents as a btsnoop file */
+int trace_ring_export(struct trace_ring *ring, const char *path);
+
+uint32_t trace_ring_count(struct trace_ring *ring);